@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <app.h>
 #include <kernel/thread.h>
+#include <lk/bootprof.h>
 
 extern const struct app_descriptor __apps_start;
 extern const struct app_descriptor __apps_end;
@@ -36,8 +37,11 @@ void apps_init(void)
 
     /* call all the init routines */
     for (app = &__apps_start; app != &__apps_end; app++) {
-        if (app->init)
+        if (app->init) {
+            uint32_t start = bootprof_start();
             app->init(app);
+            bootprof_record(BOOTPROF_APP, app->name, 0, start);
+        }
     }
 
     /* start any that want to start on boot */
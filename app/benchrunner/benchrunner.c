@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Runs the benchmark suite once at boot and powers the machine off, for the
+ * -bench projects. The comma separated results are framed by marker lines
+ * so scripts/do-bench can pick them out of the rest of the console output.
+ */
+#include <app.h>
+#include <debug.h>
+#include <stdio.h>
+#include <platform.h>
+#include <app/tests.h>
+#include <kernel/thread.h>
+#include <lib/console.h>
+#include <lib/version.h>
+
+#ifndef BENCHRUNNER_ITERATIONS
+#define BENCHRUNNER_ITERATIONS 1000
+#endif
+
+/* time for the boot chatter of other threads to settle before starting */
+#ifndef BENCHRUNNER_START_DELAY
+#define BENCHRUNNER_START_DELAY 500
+#endif
+
+static void benchrunner_entry(const struct app_descriptor *app, void *args)
+{
+    const cmd_args argv[] = {
+        { .str = "bench" },
+        { .str = "run" },
+        { .str = "-m" },
+        { .str = "-n" },
+        { .str = "", .u = BENCHRUNNER_ITERATIONS },
+    };
+
+    thread_sleep(BENCHRUNNER_START_DELAY);
+
+    printf("\n=== bench begin %s %s %s\n", version.project, version.buildid, version.arch);
+    int err = benchmarks(countof(argv), argv);
+    printf("=== bench end %d\n", err);
+
+    platform_halt(HALT_ACTION_SHUTDOWN, HALT_REASON_SW_RESET);
+}
+
+APP_START(benchrunner)
+.entry = benchrunner_entry,
+ .flags = 0,
+  APP_END
@@ -0,0 +1,13 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_DEPS += \
+	app/tests \
+	lib/console \
+	lib/version
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/benchrunner.c
+
+include make/module.mk
@@ -26,6 +26,7 @@
 #include <trace.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <compiler.h>
 #include <kernel/thread.h>
 #include <lib/minip.h>
@@ -33,186 +34,350 @@
 #include <lib/cksum.h>
 #include <platform.h>
 
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+#endif
+
 #include "inetsrv.h"
 
-static int chargen_worker(void *socket)
-{
-    uint64_t count = 0;
-    tcp_socket_t *s = socket;
+/*
+ * The services run as state machines on a fixed pool of worker threads. Every worker owns a
+ * wait set and the connections on it, so a connection is only ever touched by one thread and
+ * never blocks it: reads happen once the socket is readable, writes copy only what fits. An
+ * acceptor thread takes new connections off the listening sockets and hands them to the
+ * least loaded worker, turning them away past INETSRV_MAX_CONNECTIONS.
+ */
+
+#ifndef INETSRV_WORKERS
+#define INETSRV_WORKERS 2
+#endif
+
+/* connections served at once, across all the services */
+#ifndef INETSRV_MAX_CONNECTIONS
+#define INETSRV_MAX_CONNECTIONS 32
+#endif
+
+/* connections a listening socket queues up, past that syn cookies take over */
+#ifndef INETSRV_BACKLOG
+#define INETSRV_BACKLOG 16
+#endif
 
-    /* enough buffer to hold an entire defacto chargen sequences */
+/* the threads only ever block waiting on their wait set and keep connection state on the
+ * heap, so they get by with a fraction of the default stack */
+#ifndef INETSRV_WORKER_STACK_SIZE
+#define INETSRV_WORKER_STACK_SIZE 4096
+#endif
+
+/* sockets handled per wakeup of a worker */
+#define POLL_BATCH 8
+
+/* enough buffer to hold an entire defacto chargen sequences */
 #define CHARGEN_BUFSIZE (0x5f * 0x5f) // 9025 bytes
 
-    uint8_t *buf = malloc(CHARGEN_BUFSIZE);
-    if (!buf)
-        return ERR_NO_MEMORY;
+#define ECHO_BUFSIZE 1024
 
-    /* generate the sequence */
-    uint8_t c = '!';
-    for (size_t i = 0; i < CHARGEN_BUFSIZE; i++) {
-        buf[i] = c++;
-        if (c == 0x7f)
-            c = ' ';
-    }
+struct conn;
 
-    lk_time_t t = current_time();
-    for (;;) {
-        ssize_t ret = tcp_write(s, buf, CHARGEN_BUFSIZE);
-        //TRACEF("tcp_write returns %d\n", ret);
-        if (ret < 0)
-            break;
+typedef struct service {
+    const char *name;
+    uint16_t port;
+    uint events;        // what a new connection is waited on for
+    size_t buf_size;    // per connection buffer
+    status_t (*handle)(struct conn *c, uint events);
+    void (*done)(struct conn *c);
 
-        count += ret;
-    }
-    t = current_time() - t;
+    tcp_socket_t *listen_socket;
+    volatile int accepted;
+} service_t;
+
+typedef struct worker {
+    tcp_waitset_t *ws;
+    volatile int conns;
+} worker_t;
+
+typedef struct conn {
+    const service_t *service;
+    worker_t *worker;
+    tcp_socket_t *s;
+    uint events;        // what it is waited on for right now
+    lk_time_t start;
+    uint64_t count;     // bytes through it
+    union {
+        size_t chargen_offset;
+        uint32_t discard_crc;
+        struct {
+            size_t len;
+            size_t sent;
+        } echo;
+    };
+    uint8_t buf[];
+} conn_t;
+
+static worker_t workers[INETSRV_WORKERS];
+
+static volatile int active_conns;
+static int peak_conns;
+static volatile int refused_conns;
+
+/* every chargen connection sends out of the same sequence */
+static uint8_t *chargen_buf;
+
+static status_t chargen_handle(conn_t *c, uint events)
+{
+    size_t offset = c->chargen_offset;
+    ssize_t ret = tcp_write_nowait(c->s, chargen_buf + offset, CHARGEN_BUFSIZE - offset);
+    if (ret < 0)
+        return ret;
+
+    c->chargen_offset = (offset + ret) % CHARGEN_BUFSIZE;
+    c->count += ret;
+    return NO_ERROR;
+}
 
-    TRACEF("chargen worker exiting, wrote %llu bytes in %u msecs (%llu bytes/sec)\n",
-           count, (uint32_t)t, count * 1000 / t);
-    free(buf);
-    tcp_close(s);
+static void chargen_done(conn_t *c)
+{
+    lk_time_t t = current_time() - c->start;
+    TRACEF("chargen connection closed, wrote %llu bytes in %u msecs (%llu bytes/sec)\n",
+           c->count, (uint32_t)t, c->count * 1000 / MAX(t, 1));
+}
 
-    return 0;
+static status_t discard_handle(conn_t *c, uint events)
+{
+    /* checksum the data where it landed and hand it back, nothing to copy it into */
+    iovec_t regions[2];
+    ssize_t ret = tcp_read_peek(c->s, regions);
+    if (ret <= 0)
+        return (ret < 0) ? ret : ERR_CHANNEL_CLOSED;
+
+    c->discard_crc = crc32(c->discard_crc, regions[0].iov_base, regions[0].iov_len);
+    if (regions[1].iov_len > 0)
+        c->discard_crc = crc32(c->discard_crc, regions[1].iov_base, regions[1].iov_len);
+
+    status_t err = tcp_read_release(c->s, ret);
+    if (err < 0)
+        return err;
+
+    c->count += ret;
+    return NO_ERROR;
 }
 
-static int chargen_server(void *arg)
+static void discard_done(conn_t *c)
 {
-    status_t err;
-    tcp_socket_t *listen_socket;
+    lk_time_t t = current_time() - c->start;
+    TRACEF("discard connection closed, read %llu bytes in %u msecs (%llu bytes/sec), crc32 0x%x\n",
+           c->count, (uint32_t)t, c->count * 1000 / MAX(t, 1), c->discard_crc);
+}
 
-    err = tcp_open_listen(&listen_socket, 19);
-    if (err < 0) {
-        TRACEF("error opening chargen listen socket\n");
-        return -1;
+static status_t echo_handle(conn_t *c, uint events)
+{
+    /* read only once what was read before has gone back out */
+    if (c->echo.sent == c->echo.len) {
+        ssize_t ret = tcp_read(c->s, c->buf, ECHO_BUFSIZE);
+        if (ret <= 0)
+            return (ret < 0) ? ret : ERR_CHANNEL_CLOSED;
+
+        c->echo.len = ret;
+        c->echo.sent = 0;
+        c->count += ret;
     }
 
-    for (;;) {
-        tcp_socket_t *accept_socket;
+    ssize_t ret = tcp_write_nowait(c->s, c->buf + c->echo.sent, c->echo.len - c->echo.sent);
+    if (ret < 0)
+        return ret;
+    c->echo.sent += ret;
 
-        err = tcp_accept(listen_socket, &accept_socket);
-        TRACEF("tcp_accept returns returns %d, handle %p\n", err, accept_socket);
-        if (err < 0) {
-            TRACEF("error accepting socket, retrying\n");
-            continue;
-        }
+    /* wait for room to send the rest, or for more to read */
+    c->events = (c->echo.sent < c->echo.len) ? TCP_POLL_OUT : TCP_POLL_IN;
+    return NO_ERROR;
+}
 
-        TRACEF("starting chargen worker\n");
-        thread_detach_and_resume(thread_create("chargen_worker", &chargen_worker, accept_socket, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
-    }
+static void echo_done(conn_t *c)
+{
+    TRACEF("echo connection closed, echoed %llu bytes\n", c->count);
 }
 
-static int discard_worker(void *socket)
+static service_t services[] = {
+    {
+        .name = "chargen", .port = 19, .events = TCP_POLL_OUT,
+        .handle = chargen_handle, .done = chargen_done,
+    },
+    {
+        .name = "discard", .port = 9, .events = TCP_POLL_IN,
+        .handle = discard_handle, .done = discard_done,
+    },
+    {
+        .name = "echo", .port = 7, .events = TCP_POLL_IN, .buf_size = ECHO_BUFSIZE,
+        .handle = echo_handle, .done = echo_done,
+    },
+};
+
+static void conn_close(conn_t *c)
 {
-    uint64_t count = 0;
-    uint32_t crc = 0;
-    tcp_socket_t *s = socket;
+    tcp_waitset_remove(c->worker->ws, c->s);
+    tcp_close(c->s);
+    c->service->done(c);
 
-#define DISCARD_BUFSIZE 1024
+    atomic_add(&c->worker->conns, -1);
+    atomic_add(&active_conns, -1);
+    free(c);
+}
 
-    uint8_t *buf = malloc(DISCARD_BUFSIZE);
-    if (!buf) {
-        TRACEF("error allocating buffer\n");
-    }
+static int worker_thread(void *arg)
+{
+    worker_t *w = arg;
+    tcp_poll_result_t results[POLL_BATCH];
 
-    lk_time_t t = current_time();
     for (;;) {
-        ssize_t ret = tcp_read(s, buf, DISCARD_BUFSIZE);
-        if (ret <= 0)
-            break;
-
-        crc = crc32(crc, buf, ret);
+        int count = tcp_waitset_wait(w->ws, results, countof(results), INFINITE_TIME);
+        if (count < 0)
+            continue;
 
-        count += ret;
+        for (int i = 0; i < count; i++) {
+            conn_t *c = results[i].cookie;
+
+            if (results[i].events & TCP_POLL_HUP) {
+                conn_close(c);
+                continue;
+            }
+
+            uint events = c->events;
+            if (c->service->handle(c, results[i].events) < 0) {
+                conn_close(c);
+                continue;
+            }
+            if (c->events != events)
+                tcp_waitset_modify(w->ws, c->s, c->events);
+        }
     }
-    t = current_time() - t;
-
-    TRACEF("discard worker exiting, read %llu bytes in %u msecs (%llu bytes/sec), crc32 0x%x\n",
-           count, (uint32_t)t, count * 1000 / t, crc);
-    tcp_close(s);
-
-    free(buf);
 
     return 0;
 }
 
-static int discard_server(void *arg)
+static worker_t *least_loaded_worker(void)
 {
-    status_t err;
-    tcp_socket_t *listen_socket;
+    worker_t *best = &workers[0];
 
-    err = tcp_open_listen(&listen_socket, 9);
-    if (err < 0) {
-        TRACEF("error opening discard listen socket\n");
-        return -1;
+    for (uint i = 1; i < countof(workers); i++) {
+        if (workers[i].conns < best->conns)
+            best = &workers[i];
     }
+    return best;
+}
 
-    for (;;) {
-        tcp_socket_t *accept_socket;
+static void accept_conn(service_t *svc, tcp_socket_t *s)
+{
+    int active = atomic_add(&active_conns, 1) + 1;
+    if (active > INETSRV_MAX_CONNECTIONS) {
+        atomic_add(&active_conns, -1);
+        atomic_add(&refused_conns, 1);
+        tcp_close(s);
+        return;
+    }
+    if (active > peak_conns)
+        peak_conns = active;
+
+    conn_t *c = calloc(1, sizeof(conn_t) + svc->buf_size);
+    if (!c) {
+        TRACEF("out of memory, dropping %s connection\n", svc->name);
+        atomic_add(&active_conns, -1);
+        tcp_close(s);
+        return;
+    }
 
-        err = tcp_accept(listen_socket, &accept_socket);
-        TRACEF("tcp_accept returns returns %d, handle %p\n", err, accept_socket);
-        if (err < 0) {
-            TRACEF("error accepting socket, retrying\n");
-            continue;
-        }
+    c->service = svc;
+    c->s = s;
+    c->events = svc->events;
+    c->start = current_time();
+    c->worker = least_loaded_worker();
+
+    atomic_add(&svc->accepted, 1);
+    atomic_add(&c->worker->conns, 1);
 
-        TRACEF("starting discard worker\n");
-        thread_detach_and_resume(thread_create("discard_worker", &discard_worker, accept_socket, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+    status_t err = tcp_waitset_add(c->worker->ws, s, c->events, c);
+    if (err < 0) {
+        TRACEF("error %d adding %s connection\n", err, svc->name);
+        atomic_add(&c->worker->conns, -1);
+        atomic_add(&active_conns, -1);
+        tcp_close(s);
+        free(c);
     }
 }
 
-static int echo_worker(void *socket)
+static int acceptor_thread(void *arg)
 {
-    tcp_socket_t *s = socket;
-
-#define ECHO_BUFSIZE 1024
-
-    uint8_t *buf = malloc(ECHO_BUFSIZE);
-    if (!buf) {
-        TRACEF("error allocating buffer\n");
-        return ERR_NO_MEMORY;
-    }
+    tcp_waitset_t *ws = arg;
+    tcp_poll_result_t results[countof(services)];
 
     for (;;) {
-        ssize_t ret = tcp_read(s, buf, sizeof(buf));
-        if (ret <= 0)
-            break;
+        int count = tcp_waitset_wait(ws, results, countof(results), INFINITE_TIME);
+        if (count < 0)
+            continue;
 
-        tcp_write(s, buf, ret);
-        if (ret <= 0)
-            break;
-    }
+        for (int i = 0; i < count; i++) {
+            service_t *svc = results[i].cookie;
+            tcp_socket_t *accept_socket;
 
-    TRACEF("echo worker exiting\n");
-    tcp_close(s);
-    free(buf);
+            /* take everything queued, the listener stays readable until then */
+            while (tcp_accept_timeout(svc->listen_socket, &accept_socket, 0) >= 0)
+                accept_conn(svc, accept_socket);
+        }
+    }
 
     return 0;
 }
 
-static int echo_server(void *arg)
+static status_t start_servers(void)
 {
     status_t err;
-    tcp_socket_t *listen_socket;
+    tcp_waitset_t *accept_ws;
 
-    err = tcp_open_listen(&listen_socket, 7);
-    if (err < 0) {
-        TRACEF("error opening echo listen socket\n");
-        return -1;
+    chargen_buf = malloc(CHARGEN_BUFSIZE);
+    if (!chargen_buf)
+        return ERR_NO_MEMORY;
+
+    /* generate the sequence */
+    uint8_t c = '!';
+    for (size_t i = 0; i < CHARGEN_BUFSIZE; i++) {
+        chargen_buf[i] = c++;
+        if (c == 0x7f)
+            c = ' ';
     }
 
-    for (;;) {
-        tcp_socket_t *accept_socket;
+    for (uint i = 0; i < countof(workers); i++) {
+        err = tcp_waitset_create(&workers[i].ws);
+        if (err < 0)
+            return err;
+
+        thread_t *t = thread_create("inetsrv worker", &worker_thread, &workers[i],
+                                    DEFAULT_PRIORITY, INETSRV_WORKER_STACK_SIZE);
+        if (!t)
+            return ERR_NO_MEMORY;
+        thread_detach_and_resume(t);
+    }
 
-        err = tcp_accept(listen_socket, &accept_socket);
-        TRACEF("tcp_accept returns returns %d, handle %p\n", err, accept_socket);
+    err = tcp_waitset_create(&accept_ws);
+    if (err < 0)
+        return err;
+
+    for (uint i = 0; i < countof(services); i++) {
+        service_t *svc = &services[i];
+
+        err = tcp_open_listen(&svc->listen_socket, svc->port);
         if (err < 0) {
-            TRACEF("error accepting socket, retrying\n");
+            TRACEF("error opening %s listen socket\n", svc->name);
             continue;
         }
-
-        TRACEF("starting echo worker\n");
-        thread_detach_and_resume(thread_create("echo_worker", &echo_worker, accept_socket, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+        tcp_set_backlog(svc->listen_socket, INETSRV_BACKLOG, true);
+        tcp_waitset_add(accept_ws, svc->listen_socket, TCP_POLL_IN, svc);
     }
+
+    thread_t *t = thread_create("inetsrv accept", &acceptor_thread, accept_ws,
+                                DEFAULT_PRIORITY, INETSRV_WORKER_STACK_SIZE);
+    if (!t)
+        return ERR_NO_MEMORY;
+    thread_detach_and_resume(t);
+
+    return NO_ERROR;
 }
 
 static void inetsrv_init(const struct app_descriptor *app)
@@ -225,12 +390,30 @@ static void inetsrv_entry(const struct app_descriptor *app, void *args)
 
     printf("starting internet servers\n");
 
-    thread_detach_and_resume(thread_create("chargen", &chargen_server, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
-    thread_detach_and_resume(thread_create("discard", &discard_server, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
-    thread_detach_and_resume(thread_create("echo", &echo_server, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+    status_t err = start_servers();
+    if (err < 0)
+        printf("error %d starting internet servers\n", err);
+
     tftp_server_init(NULL);
 }
 
+#if WITH_LIB_CONSOLE
+static int cmd_inetsrv(int argc, const cmd_args *argv)
+{
+    printf("%d connections, %d at most, %d refused, limit %d\n",
+           active_conns, peak_conns, refused_conns, INETSRV_MAX_CONNECTIONS);
+    for (uint i = 0; i < countof(services); i++)
+        printf("\t%-8s port %u: %d accepted\n", services[i].name, services[i].port, services[i].accepted);
+    for (uint i = 0; i < countof(workers); i++)
+        printf("\tworker %u: %d connections\n", i, workers[i].conns);
+    return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("inetsrv", "internet server connection stats", &cmd_inetsrv)
+STATIC_COMMAND_END(inetsrv);
+#endif
+
 APP_START(inetsrv)
 .init = inetsrv_init,
  .entry = inetsrv_entry,
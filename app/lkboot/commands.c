@@ -20,7 +20,7 @@
  * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
-
+#include "lkboot.h"
 
 #include <platform.h>
 #include <stdio.h>
@@ -54,6 +54,11 @@
 
 #define LOCAL_TRACE 0
 
+/* how much of a boot image to receive between bootimage hash updates */
+#ifndef LKBOOT_BOOT_CHUNK_SIZE
+#define LKBOOT_BOOT_CHUNK_SIZE (64*1024)
+#endif
+
 struct lkb_command {
     struct lkb_command *next;
     const char *name;
@@ -102,23 +107,41 @@ static int do_boot(lkb_t *lkb, size_t len, const char **result)
 {
     LTRACEF("lkb %p, len %zu, result %p\n", lkb, len, result);
 
-    void *buf;
+    uint8_t *buf;
     paddr_t buf_phys;
 
+    /* the buffer is cached so that receiving and hashing the image run at
+     * full speed, it is cleaned out to memory before chain loading */
     if (vmm_alloc_contiguous(vmm_get_kernel_aspace(), "lkboot_iobuf",
-        len, &buf, log2_uint(1024*1024), 0, ARCH_MMU_FLAG_UNCACHED) < 0) {
+        len, (void **)&buf, log2_uint(1024*1024), 0, 0) < 0) {
         *result = "not enough memory";
         return -1;
     }
     buf_phys = vaddr_to_paddr(buf);
     LTRACEF("iobuffer %p (phys 0x%lx)\n", buf, buf_phys);
 
-    if (lkb_read(lkb, buf, len)) {
-        *result = "io error";
+    /* check the bootimage hashes while the image is coming in */
+    bootimage_stream_t *bs;
+    if (bootimage_stream_begin(buf, len, &bs) < 0) {
+        *result = "not enough memory";
         // XXX free buffer here
         return -1;
     }
 
+    bootimage_t *bi;
+    for (size_t pos = 0; pos < len; ) {
+        size_t xfer = MIN(len - pos, LKBOOT_BOOT_CHUNK_SIZE);
+        if (lkb_read(lkb, buf + pos, xfer)) {
+            *result = "io error";
+            if (bootimage_stream_finish(bs, &bi) >= 0)
+                bootimage_close(bi);
+            // XXX free buffer here
+            return -1;
+        }
+        pos += xfer;
+        bootimage_stream_update(bs, pos);
+    }
+
     /* construct a boot argument list */
     const size_t bootargs_size = PAGE_SIZE;
 #if 0
@@ -143,9 +166,8 @@ static int do_boot(lkb_t *lkb, size_t len, const char **result)
 
     const void *ptr;
 
-    /* sniff it to see if it's a bootimage or a raw image */
-    bootimage_t *bi;
-    if (bootimage_open(buf, len, &bi) >= 0) {
+    /* see if it was a bootimage or a raw image */
+    if (bootimage_stream_finish(bs, &bi) >= 0) {
         size_t len;
 
         /* it's a bootimage */
@@ -168,6 +190,9 @@ static int do_boot(lkb_t *lkb, size_t len, const char **result)
         ptr = buf;
     }
 
+    /* the new image may come up with the caches off */
+    arch_clean_cache_range((vaddr_t)buf, len);
+
     /* start a boot thread to complete the startup */
     static struct chainload_args cl_args;
 
@@ -234,8 +259,8 @@ status_t do_flash_boot(void)
         return ERR_NOT_FOUND;
     }
 
-    /* convert the bdev to a memory pointer */
-    err = bio_ioctl(bdev, BIO_IOCTL_GET_MEM_MAP, (void *)&ptr);
+    /* reference the partition in place */
+    err = bio_direct_map(bdev, entry.offset, entry.length, &ptr);
     TRACEF("err %d, ptr %p\n", err, ptr);
     if (err < 0) {
         TRACEF("error getting direct pointer to block device\n");
@@ -244,7 +269,7 @@ status_t do_flash_boot(void)
 
     /* sniff it to see if it's a bootimage or a raw image */
     bootimage_t *bi;
-    if (bootimage_open((char *)ptr + entry.offset, entry.length, &bi) >= 0) {
+    if (bootimage_open(ptr, entry.length, &bi) >= 0) {
         size_t len;
 
         /* it's a bootimage */
@@ -262,7 +287,7 @@ status_t do_flash_boot(void)
         }
     } else {
         /* did not find a bootimage, abort */
-        bio_ioctl(bdev, BIO_IOCTL_PUT_MEM_MAP, NULL);
+        bio_direct_unmap(bdev);
         return ERR_NOT_FOUND;
     }
 
@@ -270,7 +295,7 @@ status_t do_flash_boot(void)
     arch_chain_load((void *)ptr, lk_args[0], lk_args[1], lk_args[2], lk_args[3]);
 
     /* put the block device back into block mode (though we never get here) */
-    bio_ioctl(bdev, BIO_IOCTL_PUT_MEM_MAP, NULL);
+    bio_direct_unmap(bdev);
 
     return NO_ERROR;
 }
@@ -315,43 +340,17 @@ int lkb_handle_command(lkb_t *lkb, const char *cmd, const char *arg, size_t len,
             return -1;
         }
 
-        printf("lkboot: erasing partition of size %llu\n", entry.length);
-        if (bio_erase(bdev, entry.offset, entry.length) != (ssize_t)entry.length) {
-            *result = "bio_erase failed";
-            return -1;
-        }
-
         if (!strcmp(cmd, "flash")) {
-            printf("lkboot: writing to partition\n");
-
-            void *buf = malloc(bdev->block_size);
-            if (!buf) {
-                *result = "memory allocation failed";
+            /* erase as it goes, chunk by chunk, while the rest is still coming in */
+            printf("lkboot: erasing and writing partition of size %llu\n", entry.length);
+            if (lkb_stream_to_bdev(lkb, bdev, entry.offset, len, entry.length, result) < 0)
+                return -1;
+        } else {
+            printf("lkboot: erasing partition of size %llu\n", entry.length);
+            if (bio_erase(bdev, entry.offset, entry.length) != (ssize_t)entry.length) {
+                *result = "bio_erase failed";
                 return -1;
             }
-
-            size_t pos = 0;
-            while (pos < len) {
-                size_t toread = MIN(len - pos, bdev->block_size);
-
-                LTRACEF("offset %zu, toread %zu\n", pos, toread);
-
-                if (lkb_read(lkb, buf, toread)) {
-                    *result = "io error";
-                    free(buf);
-                    return -1;
-                }
-
-                if (bio_write(bdev, buf, entry.offset + pos, toread) != (ssize_t)toread) {
-                    *result = "bio_write failed";
-                    free(buf);
-                    return -1;
-                }
-
-                pos += toread;
-            }
-
-            free(buf);
         }
     } else if (!strcmp(cmd, "remove")) {
         if (ptable_remove(arg) < 0) {
@@ -23,6 +23,8 @@
 
 #pragma once
 
+#include <sys/types.h>
+
 typedef struct LKB lkb_t;
 
 // lkb_read/write may *only* be called from within a lkb_handler()
@@ -41,3 +43,7 @@ typedef const char* (*lkb_handler_t)(lkb_t *lkb,
 // cmd must be a string constant
 void lkb_register(const char *cmd, lkb_handler_t handler, void *cookie);
 
+// add a vendor class interface carrying lkboot over a pair of bulk endpoints.
+// target usb setup code calls this between usb_setup() and usb_start()
+status_t lkboot_usb_init(uint interface_num, uint epin, uint epout);
+
@@ -35,6 +35,7 @@
 #include <trace.h>
 
 #include <lib/sysparam.h>
+#include <lib/miniz.h>
 
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
@@ -55,6 +56,18 @@
 #ifndef LKBOOT_AUTOBOOT_TIMEOUT
 #define LKBOOT_AUTOBOOT_TIMEOUT 5000
 #endif
+#ifndef LKBOOT_TCP_RX_BUFFER_SIZE
+#define LKBOOT_TCP_RX_BUFFER_SIZE (128*1024)
+#endif
+#ifndef LKBOOT_TCP_TX_BUFFER_SIZE
+#define LKBOOT_TCP_TX_BUFFER_SIZE (8*1024)
+#endif
+#ifndef LKBOOT_WITH_DEFLATE
+#define LKBOOT_WITH_DEFLATE 1
+#endif
+#ifndef LKBOOT_INFLATE_BUFFER_SIZE
+#define LKBOOT_INFLATE_BUFFER_SIZE (4*1024)
+#endif
 
 #define LOCAL_TRACE 0
 
@@ -72,8 +85,32 @@ typedef struct LKB {
 
     int state;
     size_t avail;
+
+    /* extra of the first MSG_SEND_DATA, once one has been seen */
+    bool data_started;
+    u8 data_flags;
+    struct lkb_inflate *inflate;
 } lkb_t;
 
+/* state for undoing LKB_DATA_DEFLATE, only allocated for compressed transfers.
+ * tinfl writes into the dictionary ring, which is handed out to the reader
+ * before the next round of decompression overwrites it. */
+struct lkb_inflate {
+    tinfl_decompressor inflator;
+    bool need_input;
+    bool eof;
+    bool done;
+
+    size_t in_pos;
+    size_t in_len;
+    size_t dict_ofs;
+    size_t out_pos;
+    size_t out_avail;
+
+    u8 dict[TINFL_LZ_DICT_SIZE];
+    u8 in[LKBOOT_INFLATE_BUFFER_SIZE];
+};
+
 lkb_t *lkboot_create_lkb(void *cookie, lkb_read_hook *read, lkb_write_hook *write) {
     lkb_t *lkb = malloc(sizeof(lkb_t));
     if (!lkb)
@@ -84,10 +121,18 @@ lkb_t *lkboot_create_lkb(void *cookie, lkb_read_hook *read, lkb_write_hook *writ
     lkb->avail = 0;
     lkb->read = read;
     lkb->write = write;
+    lkb->data_started = false;
+    lkb->data_flags = 0;
+    lkb->inflate = NULL;
 
     return lkb;
 }
 
+void lkboot_free_lkb(lkb_t *lkb) {
+    free(lkb->inflate);
+    free(lkb);
+}
+
 static int lkb_send(lkb_t *lkb, u8 opcode, const void *data, size_t len) {
     msg_hdr_t hdr;
 
@@ -122,7 +167,7 @@ static int lkb_send(lkb_t *lkb, u8 opcode, const void *data, size_t len) {
     }
 
     hdr.opcode = opcode;
-    hdr.extra = 0;
+    hdr.extra = (opcode == MSG_GO_AHEAD && LKBOOT_WITH_DEFLATE) ? LKB_GO_AHEAD_DEFLATE : 0;
     hdr.length = (opcode == MSG_SEND_DATA) ? (len - 1) : len;
     if (lkb->write(lkb->cookie, &hdr, sizeof(hdr)) != sizeof(&hdr)) {
         printf("xmit hdr fail\n");
@@ -151,9 +196,130 @@ int lkb_write(lkb_t *lkb, const void *_data, size_t len) {
     return 0;
 }
 
+/* read the next data message header. returns -1 at the end of the data,
+ * with the state moved to STATE_RESP, or on error. */
+static int lkb_next_msg(lkb_t *lkb) {
+    msg_hdr_t hdr;
+    if (lkb->read(lkb->cookie, &hdr, sizeof(hdr))) goto fail;
+    if (hdr.opcode == MSG_END_DATA) {
+        lkb->state = STATE_RESP;
+        return -1;
+    }
+    if (hdr.opcode != MSG_SEND_DATA) goto fail;
+
+    if (!lkb->data_started) {
+        /* the first message decides for the whole transfer */
+        if (hdr.extra & ~LKB_DATA_DEFLATE) goto fail;
+        if (hdr.extra & LKB_DATA_DEFLATE) {
+#if LKBOOT_WITH_DEFLATE
+            struct lkb_inflate *z = malloc(sizeof(*z));
+            if (!z) {
+                printf("lkboot: no memory to inflate transfer\n");
+                goto fail;
+            }
+            tinfl_init(&z->inflator);
+            z->need_input = true;
+            z->eof = z->done = false;
+            z->in_pos = z->in_len = 0;
+            z->dict_ofs = z->out_pos = z->out_avail = 0;
+            lkb->inflate = z;
+#else
+            goto fail;
+#endif
+        }
+        lkb->data_started = true;
+        lkb->data_flags = hdr.extra;
+    } else if (hdr.extra != lkb->data_flags) {
+        goto fail;
+    }
+
+    lkb->avail = ((size_t) hdr.length) + 1;
+    return 0;
+
+fail:
+    lkb->state = STATE_ERROR;
+    return -1;
+}
+
+#if LKBOOT_WITH_DEFLATE
+/* fill the input buffer with whatever is left of the current message,
+ * or the next one. sets eof when the client has ended the data. */
+static int lkb_inflate_refill(lkb_t *lkb, struct lkb_inflate *z) {
+    if (lkb->avail == 0) {
+        if (lkb_next_msg(lkb)) {
+            if (lkb->state != STATE_RESP)
+                return -1;
+            z->eof = true;
+            z->in_pos = z->in_len = 0;
+            return 0;
+        }
+    }
+
+    size_t xfer = MIN(lkb->avail, sizeof(z->in));
+    if (lkb->read(lkb->cookie, z->in, xfer)) {
+        lkb->state = STATE_ERROR;
+        return -1;
+    }
+    lkb->avail -= xfer;
+    z->in_pos = 0;
+    z->in_len = xfer;
+    return 0;
+}
+
+static int lkb_inflate_read(lkb_t *lkb, u8 *data, size_t len) {
+    struct lkb_inflate *z = lkb->inflate;
+
+    while (len > 0) {
+        if (z->out_avail > 0) {
+            size_t xfer = MIN(len, z->out_avail);
+            memcpy(data, z->dict + z->out_pos, xfer);
+            z->out_pos += xfer;
+            z->out_avail -= xfer;
+            data += xfer;
+            len -= xfer;
+            continue;
+        }
+
+        /* the stream ended short of what the reader asked for */
+        if (z->done) goto fail;
+
+        if (z->need_input && !z->eof) {
+            if (lkb_inflate_refill(lkb, z)) return -1;
+        }
+
+        size_t in_bytes = z->in_len - z->in_pos;
+        size_t out_bytes = TINFL_LZ_DICT_SIZE - z->dict_ofs;
+        int flags = TINFL_FLAG_PARSE_ZLIB_HEADER | (z->eof ? 0 : TINFL_FLAG_HAS_MORE_INPUT);
+        tinfl_status status = tinfl_decompress(&z->inflator, z->in + z->in_pos, &in_bytes,
+                                               z->dict, z->dict + z->dict_ofs, &out_bytes, flags);
+        z->in_pos += in_bytes;
+        z->out_pos = z->dict_ofs;
+        z->out_avail = out_bytes;
+        z->dict_ofs = (z->dict_ofs + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+
+        if (status < TINFL_STATUS_DONE) {
+            printf("lkboot: corrupt compressed data (%d)\n", status);
+            goto fail;
+        }
+        z->done = (status == TINFL_STATUS_DONE);
+        z->need_input = (status == TINFL_STATUS_NEEDS_MORE_INPUT);
+        if (z->need_input && z->eof && out_bytes == 0) goto fail;
+    }
+    return 0;
+
+fail:
+    lkb->state = STATE_ERROR;
+    return -1;
+}
+#endif
+
 int lkb_read(lkb_t *lkb, void *_data, size_t len) {
     char *data = _data;
 
+#if LKBOOT_WITH_DEFLATE
+    /* the end of the data may have been read while output is still pending */
+    if (lkb->inflate) return lkb_inflate_read(lkb, (u8 *)data, len);
+#endif
     if (lkb->state == STATE_RESP) {
         return 0;
     }
@@ -161,15 +327,12 @@ int lkb_read(lkb_t *lkb, void *_data, size_t len) {
         if (lkb_send(lkb, MSG_GO_AHEAD, NULL, 0)) return -1;
     }
     while (len > 0) {
+#if LKBOOT_WITH_DEFLATE
+        if (lkb->inflate) return lkb_inflate_read(lkb, (u8 *)data, len);
+#endif
         if (lkb->avail == 0) {
-            msg_hdr_t hdr;
-            if (lkb->read(lkb->cookie, &hdr, sizeof(hdr))) goto fail;
-            if (hdr.opcode == MSG_END_DATA) {
-                lkb->state = STATE_RESP;
-                return -1;
-            }
-            if (hdr.opcode != MSG_SEND_DATA) goto fail;
-            lkb->avail = ((size_t) hdr.length) + 1;
+            if (lkb_next_msg(lkb)) return -1;
+            continue;
         }
         if (lkb->avail >= len) {
             if (lkb->read(lkb->cookie, data, len)) goto fail;
@@ -240,6 +403,9 @@ static status_t lkboot_server(lk_time_t timeout)
         printf("lkboot: error opening listen socket\n");
         return ERR_NO_MEMORY;
     }
+
+    /* big enough a window to keep a fast link busy while downloading images */
+    tcp_set_buffer_sizes(listen_socket, LKBOOT_TCP_RX_BUFFER_SIZE, LKBOOT_TCP_TX_BUFFER_SIZE);
 #endif
 
     /* run the main lkserver loop */
@@ -260,7 +426,7 @@ static status_t lkboot_server(lk_time_t timeout)
             /* handle the command and close it */
             lkb = lkboot_tcp_opened(s);
             lkboot_process_command(lkb);
-            free(lkb);
+            lkboot_free_lkb(lkb);
             tcp_close(s);
             handled_command = true;
         }
@@ -270,7 +436,15 @@ static status_t lkboot_server(lk_time_t timeout)
         lkb = lkboot_check_dcc_open();
         if (lkb) {
             lkboot_process_command(lkb);
-            free(lkb);
+            lkboot_free_lkb(lkb);
+            handled_command = true;
+        }
+
+        /* and on usb */
+        lkb = lkboot_check_usb_open();
+        if (lkb) {
+            lkboot_process_command(lkb);
+            lkboot_free_lkb(lkb);
             handled_command = true;
         }
 
@@ -24,6 +24,7 @@
 
 #include <sys/types.h>
 #include <app/lkboot.h>
+#include <lib/bio.h>
 #include "lkboot_protocol.h"
 
 /* private to lkboot app */
@@ -32,10 +33,17 @@ int lkb_handle_command(lkb_t *lkb, const char *cmd, const char *arg, size_t len,
 
 status_t do_flash_boot(void);
 
+/* receive len bytes and write them to bdev at offset, erasing the erase_len
+ * bytes from offset along the way if erase_len isn't 0. the transfer runs
+ * alongside erasing and programming. on failure *result says what went wrong. */
+status_t lkb_stream_to_bdev(lkb_t *lkb, bdev_t *bdev, off_t offset, size_t len,
+                            size_t erase_len, const char **result);
+
 typedef ssize_t lkb_read_hook(void *s, void *data, size_t len);
 typedef ssize_t lkb_write_hook(void *s, const void *data, size_t len);
 
 lkb_t *lkboot_create_lkb(void *cookie, lkb_read_hook *read, lkb_write_hook *write);
+void lkboot_free_lkb(lkb_t *);
 status_t lkboot_process_command(lkb_t *);
 
 /* inet server */
@@ -45,3 +53,6 @@ lkb_t *lkboot_tcp_opened(void *s);
 void lkboot_dcc_init(void);
 lkb_t *lkboot_check_dcc_open(void);
 
+/* usb bulk based server, set up by lkboot_usb_init() */
+lkb_t *lkboot_check_usb_open(void);
+
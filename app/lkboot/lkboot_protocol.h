@@ -46,6 +46,10 @@ typedef struct {
 // length must be zero
 // server indicates that command was valid and it is ready for data
 // client should send MSG_SEND_DATA messages to transfer data
+// extra may have LKB_GO_AHEAD_DEFLATE set, see below
+
+#define LKB_GO_AHEAD_DEFLATE    0x01
+// server accepts the data as a compressed stream
 
 #define MSG_CMD     0x40
 // length must be greater than zero
@@ -55,6 +59,13 @@ typedef struct {
 #define MSG_SEND_DATA   0x41
 // client sends data to server
 // length is datalen -1 (to allow for full 64k chunks)
+// extra may be LKB_DATA_DEFLATE if the server offered it in MSG_GO_AHEAD
+
+#define LKB_DATA_DEFLATE    0x01
+// the data of all MSG_SEND_DATA messages of the transfer, taken together,
+// is a single zlib (rfc 1950) stream. the decimal-datalen of the command
+// is still the uncompressed length. every MSG_SEND_DATA of a transfer
+// must use the same extra.
 
 #define MSG_END_DATA    0x42
 // client ends data stream
@@ -73,6 +84,13 @@ typedef struct {
 // S: MSG_LOG "writing sectors"
 // S: MSG_OKAY
 //
+// C: MSG_CMD "flash:1048576:system"
+// S: MSG_GO_AHEAD LKB_GO_AHEAD_DEFLATE
+// C: MSG_SEND_DATA LKB_DATA_DEFLATE 65536 ...
+// C: MSG_SEND_DATA LKB_DATA_DEFLATE 3112 ...
+// C: MSG_END_DATA
+// S: MSG_OKAY
+//
 // C: MSG_CMD "eraese:0:bootloader"
 // S: MSG_FAIL "unknown command 'eraese'"
 //
@@ -7,6 +7,7 @@ MODULE_DEPS += \
 	lib/bootargs \
 	lib/bootimage \
 	lib/cbuf \
+	lib/miniz \
 	lib/ptable \
 	lib/sysparam
 
@@ -15,5 +16,7 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/dcc.c \
 	$(LOCAL_DIR)/inet.c \
 	$(LOCAL_DIR)/lkboot.c \
+	$(LOCAL_DIR)/stream.c \
+	$(LOCAL_DIR)/usb.c \
 
 include make/module.mk
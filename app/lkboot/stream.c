@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Streaming receive for the flash command. Rather than receiving a block,
+ * writing it and only then receiving the next one, a writer thread erases and
+ * programs one chunk while the connection fills the next, so the transfer
+ * and the flash programming overlap instead of adding up.
+ */
+#include "lkboot.h"
+
+#include <debug.h>
+#include <err.h>
+#include <stdlib.h>
+#include <trace.h>
+#include <kernel/semaphore.h>
+#include <kernel/thread.h>
+#include <lib/bio.h>
+
+#define LOCAL_TRACE 0
+
+/* how much is received and written at a time, rounded up to whole erase blocks */
+#ifndef LKBOOT_STREAM_CHUNK_SIZE
+#define LKBOOT_STREAM_CHUNK_SIZE (64*1024)
+#endif
+/* chunks in flight between the receiver and the writer thread */
+#ifndef LKBOOT_STREAM_BUFFERS
+#define LKBOOT_STREAM_BUFFERS 2
+#endif
+
+struct stream_buf {
+    void *data;
+    size_t len; /* 0 tells the writer there is nothing more */
+    off_t pos;
+};
+
+struct stream {
+    bdev_t *bdev;
+    off_t offset;
+    size_t erase_len; /* of the area to erase, 0 to not erase at all */
+    size_t chunk_size;
+
+    struct stream_buf bufs[LKBOOT_STREAM_BUFFERS];
+    semaphore_t free_bufs;
+    semaphore_t full_bufs;
+
+    /* first failure seen by the writer, the receiver stops when it is set */
+    volatile const char *error;
+};
+
+static size_t roundup_to(size_t val, size_t align)
+{
+    return ((val + align - 1) / align) * align;
+}
+
+/* smallest unit the chunks must be made of, so every chunk erases whole blocks */
+static size_t stream_granule(const bdev_t *bdev)
+{
+    size_t granule = bdev->block_size;
+
+    for (size_t i = 0; i < bdev->geometry_count; i++)
+        granule = MAX(granule, bdev->geometry[i].erase_size);
+
+    return granule;
+}
+
+static int stream_writer(void *arg)
+{
+    struct stream *s = arg;
+
+    for (uint i = 0;; i = (i + 1) % LKBOOT_STREAM_BUFFERS) {
+        sem_wait(&s->full_bufs);
+
+        struct stream_buf *b = &s->bufs[i];
+        if (b->len == 0)
+            break;
+
+        if (!s->error) {
+            LTRACEF("pos %lld, len %zu\n", b->pos, b->len);
+
+            off_t offset = s->offset + b->pos;
+            if (s->erase_len) {
+                /* whole chunks, so every erase block is only erased once */
+                size_t erase_len = MIN(s->chunk_size, s->erase_len - b->pos);
+                if (bio_erase(s->bdev, offset, erase_len) != (ssize_t)erase_len)
+                    s->error = "bio_erase failed";
+            }
+            if (!s->error && bio_write(s->bdev, b->data, offset, b->len) != (ssize_t)b->len)
+                s->error = "bio_write failed";
+        }
+
+        sem_post(&s->free_bufs, false);
+    }
+
+    return 0;
+}
+
+/* hand a chunk to the writer once it has given one back */
+static void stream_queue(struct stream *s, uint i, size_t len, off_t pos)
+{
+    s->bufs[i].len = len;
+    s->bufs[i].pos = pos;
+    sem_post(&s->full_bufs, false);
+}
+
+status_t lkb_stream_to_bdev(lkb_t *lkb, bdev_t *bdev, off_t offset, size_t len,
+                            size_t erase_len, const char **result)
+{
+    struct stream s = {
+        .bdev = bdev,
+        .offset = offset,
+        .erase_len = erase_len,
+    };
+    status_t err = NO_ERROR;
+
+    /* fall back to smaller chunks if memory is tight, down to a single erase block */
+    size_t granule = stream_granule(bdev);
+    s.chunk_size = roundup_to(LKBOOT_STREAM_CHUNK_SIZE, granule);
+    for (;;) {
+        uint i;
+        for (i = 0; i < LKBOOT_STREAM_BUFFERS; i++) {
+            s.bufs[i].data = malloc(s.chunk_size);
+            if (!s.bufs[i].data)
+                break;
+        }
+        if (i == LKBOOT_STREAM_BUFFERS)
+            break;
+
+        while (i > 0)
+            free(s.bufs[--i].data);
+        if (s.chunk_size == granule) {
+            *result = "memory allocation failed";
+            return ERR_NO_MEMORY;
+        }
+        s.chunk_size = MAX(granule, roundup_to(s.chunk_size / 2, granule));
+    }
+
+    sem_init(&s.free_bufs, LKBOOT_STREAM_BUFFERS);
+    sem_init(&s.full_bufs, 0);
+
+    thread_t *writer = thread_create("lkboot writer", &stream_writer, &s,
+                                     DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!writer) {
+        *result = "thread create failed";
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+    thread_resume(writer);
+
+    LTRACEF("len %zu, chunk size %zu\n", len, s.chunk_size);
+
+    uint i = 0;
+    size_t pos;
+    for (pos = 0; pos < len && !s.error; pos += s.chunk_size) {
+        size_t toread = MIN(len - pos, s.chunk_size);
+
+        sem_wait(&s.free_bufs);
+        if (lkb_read(lkb, s.bufs[i].data, toread)) {
+            *result = "io error";
+            err = ERR_IO;
+            sem_post(&s.free_bufs, false);
+            break;
+        }
+        stream_queue(&s, i, toread, pos);
+        i = (i + 1) % LKBOOT_STREAM_BUFFERS;
+    }
+
+    /* tell the writer to stop once it is done with what it has */
+    sem_wait(&s.free_bufs);
+    stream_queue(&s, i, 0, 0);
+    thread_join(writer, NULL, INFINITE_TIME);
+
+    if (err == NO_ERROR && s.error) {
+        *result = (const char *)s.error;
+        err = ERR_IO;
+    }
+
+    /* erase whatever is left of the area past the image */
+    if (err == NO_ERROR && pos < erase_len) {
+        if (bio_erase(bdev, offset + pos, erase_len - pos) != (ssize_t)(erase_len - pos)) {
+            *result = "bio_erase failed";
+            err = ERR_IO;
+        }
+    }
+
+out:
+    sem_destroy(&s.full_bufs);
+    sem_destroy(&s.free_bufs);
+    for (uint j = 0; j < LKBOOT_STREAM_BUFFERS; j++)
+        free(s.bufs[j].data);
+
+    return err;
+}
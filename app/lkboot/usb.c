@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "lkboot.h"
+
+#include <debug.h>
+#include <trace.h>
+#include <err.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <app/lkboot.h>
+
+#if WITH_DEV_USB
+
+#include <dev/usb.h>
+#include <dev/usbc.h>
+#include <hw/usb.h>
+#include <kernel/event.h>
+
+/* lkboot over a pair of vendor class bulk endpoints. the byte stream is the
+ * same one the tcp and dcc servers carry. each direction keeps a few large
+ * transfers going back to back, so the controller fills (or drains) one
+ * buffer while the command handler works on the other.
+ */
+
+#define LOCAL_TRACE 0
+
+#define W(w) (w & 0xff), (w >> 8)
+
+#ifndef LKBOOT_USB_BUFLEN
+#define LKBOOT_USB_BUFLEN 4096
+#endif
+#ifndef LKBOOT_USB_BUFFERS
+#define LKBOOT_USB_BUFFERS 2
+#endif
+#ifndef LKBOOT_USB_TIMEOUT
+#define LKBOOT_USB_TIMEOUT 5000
+#endif
+
+enum usb_buf_state {
+    BUF_IDLE,
+    BUF_QUEUED,
+    BUF_FILLED,
+};
+
+struct usb_buf {
+    usbc_transfer_t transfer;
+    volatile enum usb_buf_state state;
+    uint8_t data[LKBOOT_USB_BUFLEN] __ALIGNED(CACHE_LINE);
+};
+
+static struct usb_buf rx_bufs[LKBOOT_USB_BUFFERS];
+static struct usb_buf tx_bufs[LKBOOT_USB_BUFFERS];
+
+/* rx buffers complete in the order they were queued, so the reader only
+ * ever looks at the one at rx_head */
+static uint rx_head;
+static uint rx_pos;
+static uint tx_head;
+
+static ep_t usb_epin;
+static ep_t usb_epout;
+static volatile bool usb_online;
+static bool usb_inited;
+
+static event_t rx_event = EVENT_INITIAL_VALUE(rx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+static event_t tx_event = EVENT_INITIAL_VALUE(tx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+static status_t usb_rx_cb(ep_t endpoint, usbc_transfer_t *t)
+{
+    struct usb_buf *buf = t->extra;
+
+    LTRACEF("ep %u, result %d, bufpos %u\n", endpoint, t->result, t->bufpos);
+
+    buf->state = (t->result >= 0) ? BUF_FILLED : BUF_IDLE;
+    event_signal(&rx_event, false);
+
+    return NO_ERROR;
+}
+
+static status_t usb_tx_cb(ep_t endpoint, usbc_transfer_t *t)
+{
+    struct usb_buf *buf = t->extra;
+
+    LTRACEF("ep %u, result %d, bufpos %u\n", endpoint, t->result, t->bufpos);
+
+    buf->state = BUF_IDLE;
+    event_signal(&tx_event, false);
+
+    return NO_ERROR;
+}
+
+static void queue_rx(struct usb_buf *buf)
+{
+    buf->transfer.callback = &usb_rx_cb;
+    buf->transfer.result = 0;
+    buf->transfer.buf = buf->data;
+    buf->transfer.buflen = LKBOOT_USB_BUFLEN;
+    buf->transfer.bufpos = 0;
+    buf->transfer.extra = buf;
+    buf->state = BUF_QUEUED;
+
+    usbc_queue_rx(usb_epout, &buf->transfer);
+}
+
+static void queue_tx(struct usb_buf *buf, size_t len)
+{
+    buf->transfer.callback = &usb_tx_cb;
+    buf->transfer.result = 0;
+    buf->transfer.buf = buf->data;
+    buf->transfer.buflen = len;
+    buf->transfer.bufpos = 0;
+    buf->transfer.extra = buf;
+    buf->state = BUF_QUEUED;
+
+    usbc_queue_tx(usb_epin, &buf->transfer);
+}
+
+static ssize_t usb_read(void *unused, void *_data, size_t len)
+{
+    unsigned char *data = _data;
+    size_t pos = 0;
+
+    LTRACEF("buf %p, len %zu, rx_head %u, rx_pos %u\n", _data, len, rx_head, rx_pos);
+
+    while (pos < len) {
+        struct usb_buf *buf = &rx_bufs[rx_head];
+
+        if (buf->state != BUF_FILLED) {
+            if (!usb_online)
+                return ERR_IO;
+            if (event_wait_timeout(&rx_event, LKBOOT_USB_TIMEOUT) == ERR_TIMED_OUT)
+                return ERR_TIMED_OUT;
+            continue;
+        }
+
+        size_t tocopy = MIN(buf->transfer.bufpos - rx_pos, len - pos);
+        memcpy(&data[pos], &buf->data[rx_pos], tocopy);
+        pos += tocopy;
+        rx_pos += tocopy;
+
+        /* hand the drained buffer back to the controller behind the others */
+        if (rx_pos == buf->transfer.bufpos) {
+            rx_pos = 0;
+            rx_head = (rx_head + 1) % LKBOOT_USB_BUFFERS;
+            queue_rx(buf);
+        }
+    }
+
+    return 0;
+}
+
+static ssize_t usb_write(void *unused, const void *_data, size_t len)
+{
+    const unsigned char *data = _data;
+    size_t pos = 0;
+
+    LTRACEF("buf %p, len %zu\n", _data, len);
+
+    while (pos < len) {
+        struct usb_buf *buf = &tx_bufs[tx_head];
+
+        if (!usb_online)
+            return ERR_IO;
+        if (buf->state == BUF_QUEUED) {
+            if (event_wait_timeout(&tx_event, LKBOOT_USB_TIMEOUT) == ERR_TIMED_OUT)
+                return ERR_TIMED_OUT;
+            continue;
+        }
+
+        /* the data is copied, so the caller's buffer is free again as soon
+         * as the last transfer is queued */
+        size_t tocopy = MIN(len - pos, LKBOOT_USB_BUFLEN);
+        memcpy(buf->data, &data[pos], tocopy);
+        queue_tx(buf, tocopy);
+        tx_head = (tx_head + 1) % LKBOOT_USB_BUFFERS;
+
+        pos += tocopy;
+    }
+
+    return pos;
+}
+
+static status_t lkboot_usb_cb(void *cookie, usb_callback_op_t op, const union usb_callback_args *args)
+{
+    LTRACEF("cookie %p, op %u, args %p\n", cookie, op, args);
+
+    switch (op) {
+        case USB_CB_ONLINE:
+            usbc_setup_endpoint(usb_epin, USB_IN, 0x40, USB_BULK);
+            usbc_setup_endpoint(usb_epout, USB_OUT, 0x40, USB_BULK);
+
+            rx_head = 0;
+            rx_pos = 0;
+            tx_head = 0;
+            for (uint i = 0; i < LKBOOT_USB_BUFFERS; i++) {
+                tx_bufs[i].state = BUF_IDLE;
+                queue_rx(&rx_bufs[i]);
+            }
+            usb_online = true;
+            break;
+        case USB_CB_RESET:
+        case USB_CB_DISCONNECT:
+        case USB_CB_OFFLINE:
+            /* the controller cancels whatever was queued, wake up anyone waiting on it */
+            usb_online = false;
+            event_signal(&rx_event, false);
+            event_signal(&tx_event, false);
+            break;
+        default:
+            break;
+    }
+
+    return NO_ERROR;
+}
+
+lkb_t *lkboot_check_usb_open(void)
+{
+    if (!usb_inited || !usb_online)
+        return NULL;
+
+    if (rx_bufs[rx_head].state != BUF_FILLED)
+        return NULL;
+
+    LTRACEF("we have data on usb, starting command handler\n");
+    return lkboot_create_lkb(NULL, usb_read, usb_write);
+}
+
+status_t lkboot_usb_init(uint interface_num, uint epin, uint epout)
+{
+    LTRACEF("interface %u, epin %u, epout %u\n", interface_num, epin, epout);
+
+    usb_epin = epin;
+    usb_epout = epout;
+
+    uint8_t if_descriptor[] = {
+        0x09,           /* length */
+        INTERFACE,      /* type */
+        interface_num,  /* interface num */
+        0x00,           /* alternates */
+        0x02,           /* endpoint count */
+        0xff,           /* interface class */
+        0x4c,           /* interface subclass: 'L' */
+        0x4b,           /* interface protocol: 'K' */
+        0x00,           /* string index */
+
+        /* endpoint IN */
+        0x07,           /* length */
+        ENDPOINT,       /* type */
+        epin | 0x80,    /* address */
+        0x02,           /* type: bulk */
+        W(64),          /* max packet size: 64 */
+        00,             /* interval */
+
+        /* endpoint OUT */
+        0x07,           /* length */
+        ENDPOINT,       /* type */
+        epout,          /* address */
+        0x02,           /* type: bulk */
+        W(64),          /* max packet size: 64 */
+        00,             /* interval */
+    };
+
+    usb_append_interface_lowspeed(if_descriptor, sizeof(if_descriptor));
+    usb_append_interface_highspeed(if_descriptor, sizeof(if_descriptor));
+
+    usb_register_callback(&lkboot_usb_cb, NULL);
+    usb_inited = true;
+
+    return NO_ERROR;
+}
+
+#else
+
+lkb_t *lkboot_check_usb_open(void)
+{
+    return NULL;
+}
+
+#endif
@@ -30,6 +30,7 @@
 #include <lib/tftp.h>
 #include <lib/cksum.h>
 #include <lib/elf.h>
+#include <lib/fsloader.h>
 
 #include <kernel/thread.h>
 
@@ -107,6 +108,9 @@ static void process_elf_blob(const void *start, size_t len)
         return;
     }
 
+    /* the blob is in memory, so reading it from several threads is fine */
+    elf.parallel_load = true;
+
     st = elf_load(&elf);
     if (st < 0) {
         printf("elf processing failed, status : %d\n", st);
@@ -126,30 +130,23 @@ exit:
     elf_close_handle(&elf);
 }
 
-int tftp_callback(void *data, size_t len, void *arg)
+static void tftp_done(status_t status, size_t len, void *arg)
 {
     download_t *download = arg;
     size_t final_len;
 
-    if (!data) {
-        final_len = output_result(download);
-        if (download->type == DOWNLOAD_ELF) {
-            process_elf_blob(download->start, final_len);
-        }
-
-        download->end = download->start;
-        return 0;
+    if (status < 0) {
+        printf("[%s] transfer failed: %d\n", download->name, status);
+        return;
     }
 
-    if ((download->end + len) > download->max) {
-        printf("transfer too big, aborting\n");
-        return -1;
-    }
-    if (len) {
-        memcpy(download->end, data, len);
-        download->end += len;
+    download->end = download->start + len;
+    final_len = output_result(download);
+    if (download->type == DOWNLOAD_ELF) {
+        process_elf_blob(download->start, final_len);
     }
-    return 0;
+
+    download->end = download->start;
 }
 
 static int loader(int argc, const cmd_args *argv)
@@ -160,16 +157,25 @@ static int loader(int argc, const cmd_args *argv)
     download_t *download;
     int slot;
 
-    if (!DOWNLOAD_BASE) {
-        printf("loader not available. it needs sdram\n");
-        return 0;
-    }
-
     if (argc < 3) {
 usage:
         printf("load any [filename] <slot>\n"
                "load elf [filename] <slot>\n"
-               "protocol is tftp and <slot> is optional\n");
+               "protocol is tftp and <slot> is optional\n"
+               "load manifest [path]\n"
+               "loads the files listed in a manifest from the file system at once\n");
+        return 0;
+    }
+
+    if (strcmp(argv[1].str, "manifest") == 0) {
+        status_t err = fsloader_load_manifest(argv[2].str);
+        if (err < 0)
+            printf("error %d loading %s\n", err, argv[2].str);
+        return err;
+    }
+
+    if (!DOWNLOAD_BASE) {
+        printf("loader not available. it needs sdram\n");
         return 0;
     }
 
@@ -192,7 +198,8 @@ usage:
     }
 
     set_ram_zone(download, slot);
-    tftp_set_write_client(download->name, &tftp_callback, download);
+    tftp_set_write_buffer(download->name, download->start, download->max - download->start,
+                          &tftp_done, download);
     printf("ready for %s over tftp (at %p)\n", argv[2].str, download->start);
     return 0;
 }
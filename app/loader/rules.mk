@@ -9,6 +9,7 @@ MODULE_SRCS += \
 MODULE_DEPS := \
     lib/cksum \
     lib/tftp  \
-    lib/elf
+    lib/elf \
+    lib/fsloader
 
 include make/module.mk
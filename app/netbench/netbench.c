@@ -0,0 +1,559 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Network benchmarks against a host running iperf 2.
+ *
+ * tcp sink    accepts connections (iperf -c <target>) and throws the data away
+ * tcp source  accepts connections and sends to them until they close (nc <target> <port> > /dev/null)
+ * udp sink    receives an iperf udp stream (iperf -u -c <target>) and answers its final
+ *             datagram with the server report, so the host prints loss and jitter
+ * udp send    sends an iperf udp stream to a host running iperf -u -s
+ *
+ * Every run ends with a report of the bytes moved, the rate, the tcp retransmits on our side
+ * and, with THREAD_STATS, how busy each cpu was over the run. The stack has no active open,
+ * so there is no tcp client; point the host's client at the sink instead.
+ */
+#include <app.h>
+#include <err.h>
+#include <debug.h>
+#include <trace.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <compiler.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/thread.h>
+#include <lib/console.h>
+#include <lib/minip.h>
+#include <platform.h>
+
+#define NETBENCH_TCP_SINK_PORT      5001
+#define NETBENCH_TCP_SOURCE_PORT    5002
+#define NETBENCH_UDP_PORT           5001
+
+/* local port the udp sender sends from and hears the server report on */
+#ifndef NETBENCH_UDP_CLIENT_PORT
+#define NETBENCH_UDP_CLIENT_PORT    50001
+#endif
+
+#ifndef NETBENCH_BUFSIZE
+#define NETBENCH_BUFSIZE            16384
+#endif
+
+#define NETBENCH_UDP_QUEUE_LEN      256
+#define NETBENCH_UDP_DEFAULT_LEN    1470
+#define NETBENCH_UDP_FIN_TRIES      10
+
+/* iperf 2 wire formats, all fields big endian */
+struct iperf_udp_datagram {
+    int32_t id;         // negative on the last datagram
+    uint32_t tv_sec;
+    uint32_t tv_usec;
+} __PACKED;
+
+/* follows the datagram header in the sink's reply to the last datagram */
+struct iperf_server_hdr {
+    int32_t flags;
+    int32_t total_len1;
+    int32_t total_len2;
+    int32_t stop_sec;
+    int32_t stop_usec;
+    int32_t error_cnt;
+    int32_t outorder_cnt;
+    int32_t datagrams;
+    int32_t jitter1;
+    int32_t jitter2;
+} __PACKED;
+
+#define IPERF_HEADER_VERSION1       0x80000000
+
+/* cpu load over a run, from the idle time the scheduler accounts */
+struct cpu_sample {
+    lk_bigtime_t time;
+#if THREAD_STATS
+    lk_bigtime_t idle[SMP_MAX_CPUS];
+#endif
+};
+
+static void cpu_sample(struct cpu_sample *s)
+{
+    s->time = current_time_hires();
+#if THREAD_STATS
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        s->idle[i] = percpu_ptr(thread_stats, i)->idle_time;
+        if (mp_is_cpu_idle(i))
+            s->idle[i] += s->time - percpu_ptr(thread_stats, i)->last_idle_timestamp;
+    }
+#endif
+}
+
+static void print_cpu_load(const struct cpu_sample *start)
+{
+#if THREAD_STATS
+    struct cpu_sample now;
+    cpu_sample(&now);
+
+    lk_bigtime_t window = MAX(now.time - start->time, 1);
+
+    printf("\tcpu busy:");
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!mp_is_cpu_active(i))
+            continue;
+        lk_bigtime_t idle = MIN(now.idle[i] - start->idle[i], window);
+        uint busy = (window - idle) * 10000 / window;
+        printf(" %u: %u.%02u%%", i, busy / 100, busy % 100);
+    }
+    printf("\n");
+#endif
+}
+
+static void print_rate(const char *what, uint64_t bytes, lk_bigtime_t usecs)
+{
+    usecs = MAX(usecs, 1);
+    uint64_t kbits = bytes * 8 * 1000 / usecs;
+
+    printf("%s %llu bytes in %llu.%03llu sec, %llu.%03llu Mbits/sec\n", what, bytes,
+           usecs / 1000000, (usecs / 1000) % 1000, kbits / 1000, kbits % 1000);
+}
+
+static void print_tcp_stats(tcp_socket_t *s)
+{
+    tcp_stats_t stats;
+    if (tcp_get_stats(s, &stats) < 0)
+        return;
+
+    printf("\tsegs out %llu, retransmits %llu (fast %u, timeouts %u), srtt %u.%03u ms, cwnd %u, mss %u\n",
+           stats.segs_out, stats.segs_retransmitted, stats.fast_retransmits, stats.timeouts,
+           stats.srtt / 1000, stats.srtt % 1000, stats.cwnd, stats.mss);
+}
+
+/* tcp */
+
+static int tcp_sink_worker(void *arg)
+{
+    tcp_socket_t *s = arg;
+    uint64_t total = 0;
+    uint64_t interval = 0;
+
+    uint8_t *buf = malloc(NETBENCH_BUFSIZE);
+    if (!buf) {
+        tcp_close(s);
+        return ERR_NO_MEMORY;
+    }
+
+    struct cpu_sample start;
+    cpu_sample(&start);
+    lk_bigtime_t last = start.time;
+
+    for (;;) {
+        ssize_t ret = tcp_read(s, buf, NETBENCH_BUFSIZE);
+        if (ret <= 0)
+            break;
+        total += ret;
+        interval += ret;
+
+        lk_bigtime_t now = current_time_hires();
+        if (now - last >= 1000000) {
+            print_rate("tcp sink:", interval, now - last);
+            interval = 0;
+            last = now;
+        }
+    }
+
+    print_rate("tcp sink done:", total, current_time_hires() - start.time);
+    print_tcp_stats(s);
+    print_cpu_load(&start);
+
+    free(buf);
+    tcp_close(s);
+
+    return 0;
+}
+
+static int tcp_source_worker(void *arg)
+{
+    tcp_socket_t *s = arg;
+    uint64_t total = 0;
+    uint64_t interval = 0;
+
+    uint8_t *buf = malloc(NETBENCH_BUFSIZE);
+    if (!buf) {
+        tcp_close(s);
+        return ERR_NO_MEMORY;
+    }
+    memset(buf, 0, NETBENCH_BUFSIZE);
+
+    struct cpu_sample start;
+    cpu_sample(&start);
+    lk_bigtime_t last = start.time;
+
+    for (;;) {
+        ssize_t ret = tcp_write(s, buf, NETBENCH_BUFSIZE);
+        if (ret <= 0)
+            break;
+        total += ret;
+        interval += ret;
+
+        lk_bigtime_t now = current_time_hires();
+        if (now - last >= 1000000) {
+            print_rate("tcp source:", interval, now - last);
+            interval = 0;
+            last = now;
+        }
+    }
+
+    print_rate("tcp source done:", total, current_time_hires() - start.time);
+    print_tcp_stats(s);
+    print_cpu_load(&start);
+
+    free(buf);
+    tcp_close(s);
+
+    return 0;
+}
+
+struct tcp_server_args {
+    uint16_t port;
+    thread_start_routine worker;
+};
+
+static int tcp_server(void *_args)
+{
+    struct tcp_server_args *args = _args;
+    tcp_socket_t *listen_socket;
+
+    status_t err = tcp_open_listen(&listen_socket, args->port);
+    if (err < 0) {
+        printf("error %d listening on tcp port %u\n", err, args->port);
+        free(args);
+        return err;
+    }
+
+    for (;;) {
+        tcp_socket_t *accept_socket;
+
+        err = tcp_accept(listen_socket, &accept_socket);
+        if (err < 0)
+            continue;
+
+        thread_t *t = thread_create("netbench worker", args->worker, accept_socket,
+                                    DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!t) {
+            tcp_close(accept_socket);
+            continue;
+        }
+        thread_detach_and_resume(t);
+    }
+}
+
+static status_t start_tcp_server(uint16_t port, thread_start_routine worker)
+{
+    struct tcp_server_args *args = malloc(sizeof(*args));
+    if (!args)
+        return ERR_NO_MEMORY;
+    args->port = port;
+    args->worker = worker;
+
+    thread_t *t = thread_create("netbench tcp", &tcp_server, args, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!t) {
+        free(args);
+        return ERR_NO_MEMORY;
+    }
+    thread_detach_and_resume(t);
+
+    printf("tcp %s listening on port %u\n", (worker == &tcp_sink_worker) ? "sink" : "source", port);
+    return NO_ERROR;
+}
+
+/* udp sink, one stream at a time. runs on the udp worker thread */
+
+static struct {
+    bool active;
+    uint32_t addr;
+    uint16_t port;
+    int32_t last_id;
+    uint64_t bytes;
+    uint32_t datagrams;
+    uint32_t lost;
+    uint32_t out_of_order;
+    int64_t last_transit;   // usecs
+    int64_t jitter;         // usecs << 4
+    struct cpu_sample start;
+    lk_bigtime_t stop;
+} udp_sink;
+
+static void udp_sink_report(uint32_t srcaddr, uint16_t srcport, int32_t id)
+{
+    uint8_t reply[sizeof(struct iperf_udp_datagram) + sizeof(struct iperf_server_hdr)];
+    struct iperf_udp_datagram *dgram = (void *)reply;
+    struct iperf_server_hdr *hdr = (void *)(dgram + 1);
+
+    lk_bigtime_t duration = udp_sink.stop - udp_sink.start.time;
+    uint64_t jitter = udp_sink.jitter >> 4;
+
+    memset(reply, 0, sizeof(reply));
+    dgram->id = htonl(id);
+    hdr->flags = htonl(IPERF_HEADER_VERSION1);
+    hdr->total_len1 = htonl(udp_sink.bytes >> 32);
+    hdr->total_len2 = htonl(udp_sink.bytes & 0xffffffff);
+    hdr->stop_sec = htonl(duration / 1000000);
+    hdr->stop_usec = htonl(duration % 1000000);
+    hdr->error_cnt = htonl(udp_sink.lost);
+    hdr->outorder_cnt = htonl(udp_sink.out_of_order);
+    hdr->datagrams = htonl(udp_sink.last_id + 1);
+    hdr->jitter1 = htonl(jitter / 1000000);
+    hdr->jitter2 = htonl(jitter % 1000000);
+
+    udp_socket_t *handle;
+    if (udp_open(srcaddr, NETBENCH_UDP_PORT, srcport, &handle) < 0)
+        return;
+    udp_send(reply, sizeof(reply), handle);
+    udp_close(handle);
+}
+
+static void udp_sink_callback(void *data, size_t len, uint32_t srcaddr, uint16_t srcport, void *arg)
+{
+    if (len < sizeof(struct iperf_udp_datagram))
+        return;
+
+    const struct iperf_udp_datagram *dgram = data;
+    int32_t id = ntohl(dgram->id);
+    lk_bigtime_t now = current_time_hires();
+
+    /* the sender repeats its last datagram until it hears the report */
+    if (id < 0) {
+        if (udp_sink.active && udp_sink.addr == srcaddr && udp_sink.port == srcport) {
+            udp_sink.active = false;
+            udp_sink.stop = now;
+
+            printf("udp sink from %u.%u.%u.%u:%u done, %u datagrams, %u lost, %u out of order, jitter %llu us\n",
+                   IPV4_SPLIT(srcaddr), srcport, udp_sink.datagrams, udp_sink.lost,
+                   udp_sink.out_of_order, (uint64_t)udp_sink.jitter >> 4);
+            print_rate("\t", udp_sink.bytes, udp_sink.stop - udp_sink.start.time);
+            print_cpu_load(&udp_sink.start);
+        }
+        udp_sink_report(srcaddr, srcport, id);
+        return;
+    }
+
+    /* a new stream */
+    if (!udp_sink.active || udp_sink.addr != srcaddr || udp_sink.port != srcport) {
+        memset(&udp_sink, 0, sizeof(udp_sink));
+        udp_sink.active = true;
+        udp_sink.addr = srcaddr;
+        udp_sink.port = srcport;
+        udp_sink.last_id = -1;
+        cpu_sample(&udp_sink.start);
+    }
+
+    udp_sink.bytes += len;
+    udp_sink.datagrams++;
+
+    if (id > udp_sink.last_id + 1) {
+        udp_sink.lost += id - udp_sink.last_id - 1;
+    } else if (id <= udp_sink.last_id) {
+        /* counted as lost when it was skipped */
+        udp_sink.out_of_order++;
+        if (udp_sink.lost > 0)
+            udp_sink.lost--;
+    }
+    if (id > udp_sink.last_id)
+        udp_sink.last_id = id;
+
+    /* RFC 1889 interarrival jitter, the clocks needn't agree for the difference to hold */
+    int64_t sent = (int64_t)ntohl(dgram->tv_sec) * 1000000 + ntohl(dgram->tv_usec);
+    int64_t transit = (int64_t)now - sent;
+    if (udp_sink.datagrams > 1) {
+        int64_t d = transit - udp_sink.last_transit;
+        if (d < 0)
+            d = -d;
+        udp_sink.jitter += d - ((udp_sink.jitter + 8) >> 4);
+    }
+    udp_sink.last_transit = transit;
+}
+
+/* udp sender */
+
+static event_t udp_report_event;
+static struct iperf_server_hdr udp_report;
+
+static void udp_report_callback(void *data, size_t len, uint32_t srcaddr, uint16_t srcport, void *arg)
+{
+    if (len < sizeof(struct iperf_udp_datagram) + sizeof(struct iperf_server_hdr))
+        return;
+
+    const struct iperf_udp_datagram *dgram = data;
+    if ((int32_t)ntohl(dgram->id) >= 0)
+        return;
+
+    memcpy(&udp_report, dgram + 1, sizeof(udp_report));
+    event_signal(&udp_report_event, false);
+}
+
+static status_t udp_send_stream(uint32_t host, uint16_t port, uint32_t secs, uint32_t mbits, size_t len)
+{
+    if (len < sizeof(struct iperf_udp_datagram) + sizeof(struct iperf_server_hdr))
+        return ERR_INVALID_ARGS;
+
+    uint8_t *buf = malloc(len);
+    if (!buf)
+        return ERR_NO_MEMORY;
+    memset(buf, 0, len);
+    struct iperf_udp_datagram *dgram = (void *)buf;
+
+    udp_socket_t *handle;
+    status_t err = udp_open(host, NETBENCH_UDP_CLIENT_PORT, port, &handle);
+    if (err < 0) {
+        free(buf);
+        return err;
+    }
+
+    event_init(&udp_report_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    udp_listen(NETBENCH_UDP_CLIENT_PORT, &udp_report_callback, NULL);
+
+    printf("sending %zu byte datagrams to %u.%u.%u.%u:%u for %u sec at %u Mbits/sec\n",
+           len, IPV4_SPLIT(host), port, secs, mbits);
+
+    /* 0 Mbits/sec is as fast as it goes */
+    lk_bigtime_t gap = mbits ? (lk_bigtime_t)len * 8 / mbits : 0;
+
+    struct cpu_sample start;
+    cpu_sample(&start);
+    lk_bigtime_t end = start.time + (lk_bigtime_t)secs * 1000000;
+    lk_bigtime_t next = start.time;
+    uint64_t bytes = 0;
+    uint32_t failures = 0;
+    int32_t id = 0;
+
+    for (;;) {
+        lk_bigtime_t now = current_time_hires();
+        if (now >= end)
+            break;
+
+        if (now < next) {
+            if (next - now > 1000)
+                thread_sleep(1);
+            else
+                thread_yield();
+            continue;
+        }
+        next += gap;
+
+        dgram->id = htonl(id);
+        id++;
+        dgram->tv_sec = htonl(now / 1000000);
+        dgram->tv_usec = htonl(now % 1000000);
+        if (udp_send(buf, len, handle) < 0)
+            failures++;
+        else
+            bytes += len;
+    }
+    lk_bigtime_t stop = current_time_hires();
+
+    print_rate("udp send done:", bytes, stop - start.time);
+    printf("\t%d datagrams, %u failed to send\n", id, failures);
+    print_cpu_load(&start);
+
+    /* tell them we're done until they report back */
+    bool reported = false;
+    for (uint i = 0; i < NETBENCH_UDP_FIN_TRIES && !reported; i++) {
+        dgram->id = htonl(-id);
+        dgram->tv_sec = htonl(stop / 1000000);
+        dgram->tv_usec = htonl(stop % 1000000);
+        udp_send(buf, len, handle);
+
+        reported = event_wait_timeout(&udp_report_event, 250) == NO_ERROR;
+    }
+
+    if (reported) {
+        uint64_t rx_bytes = ((uint64_t)ntohl(udp_report.total_len1) << 32) | ntohl(udp_report.total_len2);
+        lk_bigtime_t rx_time = (lk_bigtime_t)ntohl(udp_report.stop_sec) * 1000000 + ntohl(udp_report.stop_usec);
+
+        print_rate("server received", rx_bytes, rx_time);
+        printf("\t%d/%d datagrams lost, %d out of order, jitter %d.%03d ms\n",
+               (int32_t)ntohl(udp_report.error_cnt), (int32_t)ntohl(udp_report.datagrams),
+               (int32_t)ntohl(udp_report.outorder_cnt), (int32_t)ntohl(udp_report.jitter1) * 1000 +
+               (int32_t)ntohl(udp_report.jitter2) / 1000, (int32_t)ntohl(udp_report.jitter2) % 1000);
+    } else {
+        printf("no server report\n");
+    }
+
+    udp_listen(NETBENCH_UDP_CLIENT_PORT, NULL, NULL);
+    event_destroy(&udp_report_event);
+    udp_close(handle);
+    free(buf);
+
+    return NO_ERROR;
+}
+
+static int cmd_netbench(int argc, const cmd_args *argv)
+{
+    if (argc < 3) {
+usage:
+        printf("usage:\n");
+        printf("\t%s tcp sink [port]                         : discard what connections send, for iperf -c\n", argv[0].str);
+        printf("\t%s tcp source [port]                       : send to connections until they close\n", argv[0].str);
+        printf("\t%s udp sink [port]                         : receive iperf -u -c streams\n", argv[0].str);
+        printf("\t%s udp send <ip> [port] [secs] [mbit/s] [len] : stream to iperf -u -s\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    status_t err;
+    if (!strcmp(argv[1].str, "tcp") && !strcmp(argv[2].str, "sink")) {
+        err = start_tcp_server((argc >= 4) ? argv[3].u : NETBENCH_TCP_SINK_PORT, &tcp_sink_worker);
+    } else if (!strcmp(argv[1].str, "tcp") && !strcmp(argv[2].str, "source")) {
+        err = start_tcp_server((argc >= 4) ? argv[3].u : NETBENCH_TCP_SOURCE_PORT, &tcp_source_worker);
+    } else if (!strcmp(argv[1].str, "udp") && !strcmp(argv[2].str, "sink")) {
+        uint16_t port = (argc >= 4) ? argv[3].u : NETBENCH_UDP_PORT;
+        err = udp_listen_queued(port, &udp_sink_callback, NULL, NETBENCH_UDP_QUEUE_LEN);
+        if (err >= 0)
+            printf("udp sink listening on port %u\n", port);
+    } else if (!strcmp(argv[1].str, "udp") && !strcmp(argv[2].str, "send")) {
+        if (argc < 4)
+            goto usage;
+        uint32_t host = minip_parse_ipaddr(argv[3].str, strlen(argv[3].str));
+        err = udp_send_stream(host,
+                              (argc >= 5) ? argv[4].u : NETBENCH_UDP_PORT,
+                              (argc >= 6) ? argv[5].u : 10,
+                              (argc >= 7) ? argv[6].u : 1,
+                              (argc >= 8) ? argv[7].u : NETBENCH_UDP_DEFAULT_LEN);
+    } else {
+        goto usage;
+    }
+
+    if (err < 0)
+        printf("error %d\n", err);
+
+    return err;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("netbench", "network throughput tests against iperf", &cmd_netbench)
+STATIC_COMMAND_END(netbench);
+
+APP_START(netbench)
+.flags = 0,
+APP_END
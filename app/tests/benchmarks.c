@@ -31,7 +31,16 @@
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
 #include <platform.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+#if WITH_LIB_MINIP
+#include <lib/pktbuf.h>
+#endif
 
 const size_t BUFSIZE = (1024*1024);
 const uint ITER = 1024;
@@ -247,8 +256,447 @@ __NO_INLINE static void bench_sincos(void)
 
 #endif // WITH_LIB_LIBM
 
+/*
+ * Microbenchmark suite, 'bench run'. Every benchmark times one operation per
+ * iteration and the samples are reduced to min/median/p99/max, in cycles
+ * unless the unit says otherwise.
+ */
+#define MICRO_DEFAULT_ITERATIONS 1000
+#define MICRO_MAX_ITERATIONS 4096
+#define MICRO_TIMER_PERIOD 1
+
+struct micro_bench {
+    const char *name;
+    const char *unit;
+    const char *desc;
+    /* fills up to iterations samples and returns how many, or a negative error */
+    int (*fn)(uint32_t *samples, uint iterations, uintptr_t arg);
+    uintptr_t arg;
+};
+
+static int micro_overhead(uint32_t *samples, uint iterations, uintptr_t arg)
+{
+    for (uint i = 0; i < iterations; i++) {
+        uint32_t t = arch_cycle_count();
+        __asm__ volatile("");
+        samples[i] = arch_cycle_count() - t;
+    }
+    return iterations;
+}
+
+static int micro_time(uint32_t *samples, uint iterations, uintptr_t arg)
+{
+    for (uint i = 0; i < iterations; i++) {
+        uint32_t t = arch_cycle_count();
+        __UNUSED volatile lk_bigtime_t now = current_time_hires();
+        samples[i] = arch_cycle_count() - t;
+    }
+    return iterations;
+}
+
+static int micro_spinlock(uint32_t *samples, uint iterations, uintptr_t arg)
+{
+    spin_lock_t lock = SPIN_LOCK_INITIAL_VALUE;
+    spin_lock_saved_state_t state;
+
+    for (uint i = 0; i < iterations; i++) {
+        uint32_t t = arch_cycle_count();
+        spin_lock_irqsave(&lock, state);
+        spin_unlock_irqrestore(&lock, state);
+        samples[i] = arch_cycle_count() - t;
+    }
+    return iterations;
+}
+
+static int micro_mutex(uint32_t *samples, uint iterations, uintptr_t arg)
+{
+    mutex_t m;
+    mutex_init(&m);
+
+    for (uint i = 0; i < iterations; i++) {
+        uint32_t t = arch_cycle_count();
+        mutex_acquire(&m);
+        mutex_release(&m);
+        samples[i] = arch_cycle_count() - t;
+    }
+
+    mutex_destroy(&m);
+    return iterations;
+}
+
+static int micro_event(uint32_t *samples, uint iterations, uintptr_t arg)
+{
+    event_t e;
+    event_init(&e, false, 0);
+
+    for (uint i = 0; i < iterations; i++) {
+        uint32_t t = arch_cycle_count();
+        event_signal(&e, false);
+        event_unsignal(&e);
+        samples[i] = arch_cycle_count() - t;
+    }
+
+    event_destroy(&e);
+    return iterations;
+}
+
+static int micro_yield(uint32_t *samples, uint iterations, uintptr_t arg)
+{
+    for (uint i = 0; i < iterations; i++) {
+        uint32_t t = arch_cycle_count();
+        thread_yield();
+        samples[i] = arch_cycle_count() - t;
+    }
+    return iterations;
+}
+
+/* two threads handing control back and forth through a pair of events */
+struct micro_pingpong {
+    event_t ping;
+    event_t pong;
+    mutex_t lock;
+    volatile uint turn;
+    uint iterations;
+};
+
+static int micro_event_partner(void *arg)
+{
+    struct micro_pingpong *pp = arg;
+
+    for (uint i = 0; i < pp->iterations; i++) {
+        event_wait(&pp->ping);
+        event_signal(&pp->pong, true);
+    }
+    return 0;
+}
+
+static int micro_mutex_partner(void *arg)
+{
+    struct micro_pingpong *pp = arg;
+
+    for (uint i = 0; i < pp->iterations; ) {
+        mutex_acquire(&pp->lock);
+        if (pp->turn == 1) {
+            pp->turn = 0;
+            i++;
+        }
+        mutex_release(&pp->lock);
+    }
+    return 0;
+}
+
+/* a cpu other than the current one, or -1 */
+static int micro_other_cpu(void)
+{
+    uint curr = arch_curr_cpu_num();
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (i != curr && mp_is_cpu_active(i))
+            return i;
+    }
+    return -1;
+}
+
+/* ping-pong with a partner thread on this cpu or on another one, through the events or the mutex */
+static int micro_pingpong_run(uint32_t *samples, uint iterations, bool cross_cpu, bool use_mutex)
+{
+    thread_t *self = get_current_thread();
+    __UNUSED int old_pin = thread_pinned_cpu(self);
+    int cpu = arch_curr_cpu_num();
+    int partner_cpu = cpu;
+
+    if (cross_cpu) {
+        partner_cpu = micro_other_cpu();
+        if (partner_cpu < 0)
+            return ERR_NOT_SUPPORTED;
+    }
+
+    struct micro_pingpong pp = { .iterations = iterations };
+    event_init(&pp.ping, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&pp.pong, false, EVENT_FLAG_AUTOUNSIGNAL);
+    mutex_init(&pp.lock);
+
+    thread_t *t = thread_create("bench partner", use_mutex ? micro_mutex_partner : micro_event_partner,
+                                &pp, self->base_priority, DEFAULT_STACK_SIZE);
+    if (!t) {
+        event_destroy(&pp.ping);
+        event_destroy(&pp.pong);
+        mutex_destroy(&pp.lock);
+        return ERR_NO_MEMORY;
+    }
+
+    thread_set_pinned_cpu(self, cpu);
+    thread_set_pinned_cpu(t, partner_cpu);
+    thread_resume(t);
+
+    for (uint i = 0; i < iterations; ) {
+        uint32_t start = arch_cycle_count();
+        if (use_mutex) {
+            mutex_acquire(&pp.lock);
+            pp.turn = 1;
+            mutex_release(&pp.lock);
+            for (;;) {
+                mutex_acquire(&pp.lock);
+                bool back = (pp.turn == 0);
+                mutex_release(&pp.lock);
+                if (back)
+                    break;
+            }
+            samples[i++] = arch_cycle_count() - start;
+        } else {
+            event_signal(&pp.ping, true);
+            event_wait(&pp.pong);
+            /* a round trip is two switches on one cpu, one wakeup each way across cpus */
+            samples[i++] = (arch_cycle_count() - start) / (cross_cpu ? 1 : 2);
+        }
+    }
+
+    thread_join(t, NULL, INFINITE_TIME);
+    thread_set_pinned_cpu(self, old_pin);
+
+    event_destroy(&pp.ping);
+    event_destroy(&pp.pong);
+    mutex_destroy(&pp.lock);
+    return iterations;
+}
+
+static int micro_ctxswitch(uint32_t *samples, uint iterations, uintptr_t arg)
+{
+    return micro_pingpong_run(samples, iterations, false, false);
+}
+
+static int micro_wake_xcpu(uint32_t *samples, uint iterations, uintptr_t arg)
+{
+    return micro_pingpong_run(samples, iterations, true, false);
+}
+
+static int micro_mutex_xcpu(uint32_t *samples, uint iterations, uintptr_t arg)
+{
+    return micro_pingpong_run(samples, iterations, true, true);
+}
+
+struct micro_timer_state {
+    uint32_t *samples;
+    uint iterations;
+    uint count;
+    lk_bigtime_t last;
+    event_t done;
+};
+
+static enum handler_return micro_timer_cb(timer_t *timer, lk_time_t now, void *arg)
+{
+    struct micro_timer_state *ts = arg;
+    lk_bigtime_t t = current_time_hires();
+
+    if (ts->count < ts->iterations) {
+        /* deviation of this period from the nominal one */
+        int64_t delta = (int64_t)(t - ts->last) - MICRO_TIMER_PERIOD * 1000;
+        ts->samples[ts->count++] = MIN((uint64_t)(delta < 0 ? -delta : delta), UINT32_MAX);
+        if (ts->count == ts->iterations)
+            event_signal(&ts->done, false);
+    }
+    ts->last = t;
+
+    return INT_NO_RESCHEDULE;
+}
+
+static int micro_timer(uint32_t *samples, uint iterations, uintptr_t arg)
+{
+    struct micro_timer_state ts = { .samples = samples, .iterations = iterations };
+    timer_t timer;
+
+    event_init(&ts.done, false, 0);
+    timer_initialize(&timer);
+
+    ts.last = current_time_hires();
+    timer_set_periodic(&timer, MICRO_TIMER_PERIOD, micro_timer_cb, &ts);
+    event_wait(&ts.done);
+    timer_cancel(&timer);
+
+    event_destroy(&ts.done);
+    return ts.count;
+}
+
+static int micro_malloc(uint32_t *samples, uint iterations, uintptr_t size)
+{
+    for (uint i = 0; i < iterations; i++) {
+        uint32_t t = arch_cycle_count();
+        void *p = malloc(size);
+        free(p);
+        samples[i] = arch_cycle_count() - t;
+        if (!p)
+            return ERR_NO_MEMORY;
+    }
+    return iterations;
+}
+
+#if WITH_KERNEL_VM
+static int micro_page_alloc(uint32_t *samples, uint iterations, uintptr_t arg)
+{
+    for (uint i = 0; i < iterations; i++) {
+        uint32_t t = arch_cycle_count();
+        vm_page_t *p = pmm_alloc_page();
+        if (p)
+            pmm_free_page(p);
+        samples[i] = arch_cycle_count() - t;
+        if (!p)
+            return ERR_NO_MEMORY;
+    }
+    return iterations;
+}
+#endif
+
+#if WITH_LIB_MINIP
+static int micro_pktbuf(uint32_t *samples, uint iterations, uintptr_t arg)
+{
+    for (uint i = 0; i < iterations; i++) {
+        uint32_t t = arch_cycle_count();
+        pktbuf_t *p = pktbuf_alloc();
+        if (p)
+            pktbuf_free(p, false);
+        samples[i] = arch_cycle_count() - t;
+        if (!p)
+            return ERR_NO_MEMORY;
+    }
+    return iterations;
+}
+#endif
+
+static const struct micro_bench micro_benches[] = {
+    { "overhead", "cycles", "back to back cycle counter reads", micro_overhead, 0 },
+    { "time", "cycles", "current_time_hires()", micro_time, 0 },
+    { "spinlock", "cycles", "uncontended spin lock and unlock with irqsave", micro_spinlock, 0 },
+    { "mutex", "cycles", "uncontended mutex acquire and release", micro_mutex, 0 },
+    { "event", "cycles", "signal and unsignal of an event with no waiters", micro_event, 0 },
+    { "yield", "cycles", "thread_yield() with nothing else to run", micro_yield, 0 },
+    { "ctxswitch", "cycles", "one switch of an event ping-pong on one cpu", micro_ctxswitch, 0 },
+    { "wake_xcpu", "cycles", "event ping-pong round trip across cpus, one ipi each way", micro_wake_xcpu, 0 },
+    { "mutex_xcpu", "cycles", "mutex protected hand off round trip across cpus", micro_mutex_xcpu, 0 },
+    { "timer", "usecs", "deviation of a periodic timer from its period", micro_timer, 0 },
+    { "malloc16", "cycles", "malloc and free of 16 bytes", micro_malloc, 16 },
+    { "malloc64", "cycles", "malloc and free of 64 bytes", micro_malloc, 64 },
+    { "malloc256", "cycles", "malloc and free of 256 bytes", micro_malloc, 256 },
+    { "malloc1k", "cycles", "malloc and free of 1KB", micro_malloc, 1024 },
+    { "malloc4k", "cycles", "malloc and free of 4KB", micro_malloc, 4096 },
+    { "malloc64k", "cycles", "malloc and free of 64KB", micro_malloc, 65536 },
+#if WITH_KERNEL_VM
+    { "page_alloc", "cycles", "pmm_alloc_page() and pmm_free_page()", micro_page_alloc, 0 },
+#endif
+#if WITH_LIB_MINIP
+    { "pktbuf", "cycles", "pktbuf_alloc() and pktbuf_free()", micro_pktbuf, 0 },
+#endif
+};
+
+static int micro_cmp(const void *a, const void *b)
+{
+    uint32_t sa = *(const uint32_t *)a;
+    uint32_t sb = *(const uint32_t *)b;
+
+    return (sa > sb) - (sa < sb);
+}
+
+static void micro_run_one(const struct micro_bench *b, uint32_t *samples, uint iterations,
+                          bool machine)
+{
+    int count = b->fn(samples, iterations, b->arg);
+
+    if (count <= 0) {
+        if (machine)
+            printf("%s,%s,skipped,%d\n", b->name, b->unit, count);
+        else
+            printf("%-12s skipped (%d)\n", b->name, count);
+        return;
+    }
+
+    qsort(samples, count, sizeof(uint32_t), micro_cmp);
+
+    uint64_t sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += samples[i];
+
+    uint32_t min = samples[0];
+    uint32_t median = samples[count / 2];
+    uint32_t p99 = samples[count * 99 / 100];
+    uint32_t max = samples[count - 1];
+    uint32_t mean = sum / count;
+
+    if (machine) {
+        printf("%s,%s,%d,%u,%u,%u,%u,%u\n", b->name, b->unit, count, min, median, p99, max, mean);
+    } else {
+        printf("%-12s %6d runs min %8u median %8u p99 %8u max %8u mean %8u %s\n",
+               b->name, count, min, median, p99, max, mean, b->unit);
+    }
+}
+
+static int micro_benchmarks(int argc, const cmd_args *argv)
+{
+    uint iterations = MICRO_DEFAULT_ITERATIONS;
+    bool machine = false;
+    int first = argc;
+
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i].str, "-m")) {
+            machine = true;
+        } else if (!strcmp(argv[i].str, "-n") && i + 1 < argc) {
+            iterations = argv[++i].u;
+        } else {
+            first = i;
+            break;
+        }
+    }
+
+    if (iterations == 0 || iterations > MICRO_MAX_ITERATIONS) {
+        printf("iterations must be between 1 and %u\n", MICRO_MAX_ITERATIONS);
+        return ERR_INVALID_ARGS;
+    }
+
+    uint32_t *samples = malloc(iterations * sizeof(uint32_t));
+    if (!samples) {
+        printf("failed to allocate sample buffer\n");
+        return ERR_NO_MEMORY;
+    }
+
+    if (machine)
+        printf("name,unit,runs,min,median,p99,max,mean\n");
+
+    for (uint i = 0; i < countof(micro_benches); i++) {
+        const struct micro_bench *b = &micro_benches[i];
+
+        /* with names given, only run those */
+        bool selected = (first == argc);
+        for (int j = first; j < argc; j++) {
+            if (!strcmp(argv[j].str, b->name))
+                selected = true;
+        }
+        if (selected)
+            micro_run_one(b, samples, iterations, machine);
+    }
+
+    free(samples);
+    return NO_ERROR;
+}
+
 int benchmarks(int argc, const cmd_args *argv)
 {
+    if (argc >= 2) {
+        if (!strcmp(argv[1].str, "run"))
+            return micro_benchmarks(argc, argv);
+
+        if (!strcmp(argv[1].str, "list")) {
+            for (uint i = 0; i < countof(micro_benches); i++)
+                printf("%-12s %-6s %s\n", micro_benches[i].name, micro_benches[i].unit,
+                       micro_benches[i].desc);
+            return NO_ERROR;
+        }
+
+        printf("usage:\n");
+        printf("\t%s                             : memory bandwidth loops\n", argv[0].str);
+        printf("\t%s list                        : list the microbenchmarks\n", argv[0].str);
+        printf("\t%s run [-m] [-n iters] [name]* : run all or the named microbenchmarks,\n", argv[0].str);
+        printf("\t%s                               -m prints comma separated values\n", "");
+        return ERR_INVALID_ARGS;
+    }
+
     bench_set_overhead();
     bench_memset();
     bench_memcpy();
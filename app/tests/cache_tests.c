@@ -20,7 +20,7 @@
  * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
-#if ARM_WITH_CACHE
+#if ARM_WITH_CACHE || ARCH_ARM64
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -52,7 +52,7 @@ static void bench_cache(size_t bufsize, uint8_t *buf)
     arch_clean_cache_range((addr_t)buf, bufsize);
     t = current_time_hires() - t;
 
-    printf("took %llu usecs to clean %d bytes (cold)\n", t, bufsize);
+    printf("took %llu usecs to clean %zu bytes (cold)\n", t, bufsize);
 
     memset(buf, 0x99, bufsize);
 
@@ -63,12 +63,90 @@ static void bench_cache(size_t bufsize, uint8_t *buf)
     if (do_free)
         free(buf);
 
-    printf("took %llu usecs to clean %d bytes (hot)\n", t, bufsize);
+    printf("took %llu usecs to clean %zu bytes (hot)\n", t, bufsize);
 }
 
+#ifdef ARCH_CACHE_WHOLE_THRESHOLD
+
+#if ARCH_ARM64
+#define clean_range_lines arm64_clean_cache_range_lines
+#define clean_inv_range_lines arm64_clean_invalidate_cache_range_lines
+#define clean_all arm64_clean_dcache_all
+#define clean_inv_all arm64_clean_invalidate_dcache_all
+#else
+#define clean_range_lines arm_clean_cache_range_lines
+#define clean_inv_range_lines arm_clean_invalidate_cache_range_lines
+#define clean_all arm_clean_dcache_all
+#define clean_inv_all arm_clean_invalidate_dcache_all
+#endif
+
+/* time one way of cleaning a freshly dirtied buffer, in usecs */
+static lk_bigtime_t time_clean(uint8_t *buf, size_t len, bool whole, bool invalidate)
+{
+    memset(buf, 0x99, len);
+
+    lk_bigtime_t t = current_time_hires();
+    if (whole) {
+        if (invalidate)
+            clean_inv_all();
+        else
+            clean_all();
+    } else {
+        if (invalidate)
+            clean_inv_range_lines((addr_t)buf, len);
+        else
+            clean_range_lines((addr_t)buf, len);
+    }
+    return current_time_hires() - t;
+}
+
+/* compare cleaning by line against cleaning the whole cache over growing sizes, to pick
+ * ARCH_CACHE_WHOLE_THRESHOLD for a platform */
+static void bench_crossover(size_t max)
+{
+    uint8_t *buf = memalign(PAGE_SIZE, max);
+    if (!buf) {
+        printf("error allocating %zu bytes\n", max);
+        return;
+    }
+
+    printf("current threshold %zu bytes%s\n", (size_t)ARCH_CACHE_WHOLE_THRESHOLD,
+           ARCH_CACHE_WHOLE_THRESHOLD ? "" : " (off)");
+    printf("%10s %12s %12s %12s %12s\n", "bytes", "clean line", "clean whole",
+           "c+inv line", "c+inv whole");
+
+    size_t crossover = 0;
+    for (size_t len = 4096; len <= max; len *= 2) {
+        lk_bigtime_t cl = time_clean(buf, len, false, false);
+        lk_bigtime_t cw = time_clean(buf, len, true, false);
+        lk_bigtime_t il = time_clean(buf, len, false, true);
+        lk_bigtime_t iw = time_clean(buf, len, true, true);
+
+        printf("%10zu %12llu %12llu %12llu %12llu\n", len, cl, cw, il, iw);
+        if (!crossover && cw <= cl && iw <= il)
+            crossover = len;
+    }
+
+    if (crossover)
+        printf("whole cache wins from %zu bytes on\n", crossover);
+    else
+        printf("line by line wins up to %zu bytes\n", max);
+
+    free(buf);
+}
+#endif
+
 static int cache_tests(int argc, const cmd_args *argv)
 {
     uint8_t *buf;
+
+#ifdef ARCH_CACHE_WHOLE_THRESHOLD
+    if (argc > 1 && !strcmp(argv[1].str, "crossover")) {
+        bench_crossover((argc > 2) ? argv[2].u : 16*1024*1024);
+        return 0;
+    }
+#endif
+
     buf = (uint8_t *)((argc > 1) ? argv[1].u : 0UL);
 
     printf("testing cache\n");
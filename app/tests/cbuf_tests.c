@@ -25,13 +25,13 @@
         }                                                              \
     } while (0);
 
-int cbuf_tests(int argc, const cmd_args *argv)
+static void cbuf_mode_tests(uint flags)
 {
     cbuf_t cbuf;
 
-    printf("running basic tests...\n");
+    printf("running basic tests, flags %#x...\n", flags);
 
-    cbuf_initialize(&cbuf, 16);
+    cbuf_initialize_flags(&cbuf, 16, NULL, flags);
 
     ASSERT_EQ(15, cbuf_space_avail(&cbuf));
 
@@ -108,7 +108,46 @@ int cbuf_tests(int argc, const cmd_args *argv)
         ASSERT_LEQ(pos_in, pos_out);
     }
 
+    // Zero copy writes, wrapping around the end of the buffer.
+    printf("running reserve/commit tests...\n");
+    cbuf_reset(&cbuf);
+    {
+        iovec_t regions[2];
+        char buf[16];
+
+        ASSERT_EQ(10, cbuf_write(&cbuf, "0123456789", 10, false));
+        ASSERT_EQ(10, cbuf_read(&cbuf, buf, 10, false));
+
+        // head is somewhere in the middle now, so free space wraps
+        int avail = cbuf_write_reserve(&cbuf, regions);
+        ASSERT_EQ(15, avail);
+        ASSERT_EQ(15, regions[0].iov_len + regions[1].iov_len);
+        ASSERT_EQ(1, regions[1].iov_len > 0);
+
+        for (int i = 0; i < 12; ++i) {
+            size_t r = (i < (int)regions[0].iov_len) ? 0 : 1;
+            size_t off = r ? i - regions[0].iov_len : (size_t)i;
+            ((char *)regions[r].iov_base)[off] = 'A' + i;
+        }
+
+        // nothing shows up before the commit
+        ASSERT_EQ(0, cbuf_space_used(&cbuf));
+        cbuf_write_commit(&cbuf, 12, false);
+        ASSERT_EQ(12, cbuf_space_used(&cbuf));
+
+        ASSERT_EQ(12, cbuf_read(&cbuf, buf, 16, false));
+        for (int i = 0; i < 12; ++i) {
+            ASSERT_EQ('A' + i, buf[i]);
+        }
+    }
+
     free(cbuf.buf);
+}
+
+int cbuf_tests(int argc, const cmd_args *argv)
+{
+    cbuf_mode_tests(0);
+    cbuf_mode_tests(CBUF_FLAG_SPSC);
 
     printf("cbuf tests passed\n");
 
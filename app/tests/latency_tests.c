@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#if ARM_ISA_ARMV7M
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arch.h>
+#include <arch/ops.h>
+#include <arch/arm/cm.h>
+#include <kernel/thread.h>
+#include <kernel/event.h>
+#include <lib/console.h>
+
+#define SWITCH_ITER 10000
+#define IRQ_ITER 1000
+
+struct latency {
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint count;
+};
+
+static void latency_init(struct latency *l)
+{
+    memset(l, 0, sizeof(*l));
+    l->min = UINT32_MAX;
+}
+
+static void latency_add(struct latency *l, uint32_t cycles)
+{
+    if (cycles < l->min)
+        l->min = cycles;
+    if (cycles > l->max)
+        l->max = cycles;
+    l->total += cycles;
+    l->count++;
+}
+
+static void latency_print(const char *name, const struct latency *l)
+{
+    if (l->count == 0) {
+        printf("%-16s no samples\n", name);
+        return;
+    }
+    printf("%-16s min %6u avg %6u max %6u cycles (%u samples)\n", name,
+           l->min, (uint32_t)(l->total / l->count), l->max, l->count);
+}
+
+struct yield_args {
+    uint iter;
+    bool fp;
+};
+
+static int yield_thread(void *arg)
+{
+    const struct yield_args *args = arg;
+    volatile float f = 0;
+
+    for (uint i = 0; i < args->iter; i++) {
+        /* dirty the fpu so every switch has to carry its state */
+        if (args->fp)
+            f = f + 1.0f;
+        thread_yield();
+    }
+    return 0;
+}
+
+/* two threads at the same priority yielding to each other, the plain thread to thread switch */
+static void bench_yield(uint iter, bool fp)
+{
+    struct yield_args args = { .iter = iter, .fp = fp };
+    thread_t *t[2];
+
+    t[0] = thread_create("yield 0", &yield_thread, &args, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    t[1] = thread_create("yield 1", &yield_thread, &args, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!t[0] || !t[1]) {
+        printf("error creating threads\n");
+        return;
+    }
+
+    /* stay above them until both are ready, so they take turns from the first yield on */
+    int oldpri = get_current_thread()->priority;
+    thread_set_priority(HIGH_PRIORITY + 1);
+
+    uint32_t c = arch_cycle_count();
+    thread_resume(t[0]);
+    thread_resume(t[1]);
+    thread_set_priority(oldpri);
+    thread_join(t[0], NULL, INFINITE_TIME);
+    thread_join(t[1], NULL, INFINITE_TIME);
+    c = arch_cycle_count() - c;
+
+    printf("%-16s %u switches, %u cycles each\n", fp ? "yield fpu" : "yield",
+           iter * 2, c / (iter * 2));
+}
+
+#if ARM_CM_DIRECT_IRQS
+static volatile uint32_t irq_stamp;
+static volatile uint irq_hits;
+static volatile uint32_t trigger_stamp;
+static event_t irq_event;
+
+static void direct_handler(void)
+{
+    irq_stamp = arch_cycle_count();
+    irq_hits++;
+}
+
+static void wrapped_handler(void)
+{
+    arm_cm_irq_entry();
+    irq_stamp = arch_cycle_count();
+    irq_hits++;
+    arm_cm_irq_exit(false);
+}
+
+static void wake_handler(void)
+{
+    arm_cm_irq_entry();
+    irq_hits++;
+    event_signal(&irq_event, false);
+    arm_cm_irq_exit(true);
+}
+
+/* software triggered irq, taken before the isb completes */
+static void trigger(unsigned int irq)
+{
+    arm_cm_trigger_interrupt(irq);
+    __DSB();
+    __ISB();
+}
+
+static status_t irq_start(unsigned int irq, void (*handler)(void), uint32_t priority)
+{
+    status_t err = arm_cm_register_direct_irq(irq, handler, priority);
+    if (err < 0) {
+        printf("error %d registering irq %u\n", err, irq);
+        return err;
+    }
+
+    irq_hits = 0;
+    NVIC_ClearPendingIRQ((IRQn_Type)irq);
+    NVIC_EnableIRQ((IRQn_Type)irq);
+    return NO_ERROR;
+}
+
+static void irq_stop(unsigned int irq)
+{
+    NVIC_DisableIRQ((IRQn_Type)irq);
+    arm_cm_register_direct_irq(irq, NULL, 0);
+}
+
+/* cycles from the trigger to the first line of the handler */
+static void bench_irq_entry(unsigned int irq, const char *name, void (*handler)(void),
+                            uint32_t priority)
+{
+    struct latency l;
+
+    if (irq_start(irq, handler, priority) < 0)
+        return;
+
+    latency_init(&l);
+    for (uint i = 0; i < IRQ_ITER; i++) {
+        uint hits = irq_hits;
+        uint32_t t = arch_cycle_count();
+        trigger(irq);
+        if (irq_hits != hits)
+            latency_add(&l, irq_stamp - t);
+    }
+
+    irq_stop(irq);
+    latency_print(name, &l);
+}
+
+static int wake_thread(void *arg)
+{
+    struct latency *l = arg;
+
+    for (uint i = 0; i < IRQ_ITER; i++) {
+        event_wait(&irq_event);
+        latency_add(l, arch_cycle_count() - trigger_stamp);
+    }
+    return 0;
+}
+
+/* cycles from the trigger to a higher priority thread woken by the irq, through pendsv */
+static void bench_irq_wake(unsigned int irq, uint32_t priority)
+{
+    struct latency l;
+
+    event_init(&irq_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    latency_init(&l);
+
+    if (irq_start(irq, &wake_handler, priority) < 0)
+        return;
+
+    thread_t *t = thread_create("irq wake", &wake_thread, &l, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!t) {
+        printf("error creating thread\n");
+        irq_stop(irq);
+        return;
+    }
+
+    thread_resume(t);
+    for (uint i = 0; i < IRQ_ITER; i++) {
+        trigger_stamp = arch_cycle_count();
+        trigger(irq);
+    }
+    thread_join(t, NULL, INFINITE_TIME);
+
+    irq_stop(irq);
+    latency_print("irq to thread", &l);
+}
+#endif
+
+static int latency_tests(int argc, const cmd_args *argv)
+{
+#if ARM_CM_DIRECT_IRQS
+    if (argc < 2) {
+        printf("usage: %s <irq>\n", argv[0].str);
+        printf("irq is an external irq nothing else has enabled, it is triggered from software\n");
+        return ERR_INVALID_ARGS;
+    }
+#endif
+
+    printf("fpu context %s, direct irqs %s\n",
+           (ARM_CM_FPU_CONTEXT == ARM_CM_FPU_CONTEXT_LAZY) ? "lazy" : "none",
+           ARM_CM_DIRECT_IRQS ? "on" : "off");
+
+    bench_yield(SWITCH_ITER, false);
+#if ARM_CM_FPU_CONTEXT == ARM_CM_FPU_CONTEXT_LAZY
+    bench_yield(SWITCH_ITER, true);
+#endif
+
+#if ARM_CM_DIRECT_IRQS
+    unsigned int irq = argv[1].u;
+
+    /* the wrapped handlers sit just above the platform's irqs, the direct one above all */
+    bench_irq_entry(irq, "irq direct", &direct_handler, arm_cm_highest_priority());
+    bench_irq_entry(irq, "irq wrapped", &wrapped_handler, arm_cm_medium_priority() - 1);
+    bench_irq_wake(irq, arm_cm_medium_priority() - 1);
+#else
+    printf("build with ARM_CM_DIRECT_IRQS=1 for the irq latencies\n");
+#endif
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("latency_tests", "bench context switch and irq latency", &latency_tests)
+STATIC_COMMAND_END(latency_tests);
+
+#endif
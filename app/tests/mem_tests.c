@@ -27,107 +27,205 @@
 #include <arch.h>
 #include <arch/ops.h>
 #include <lib/console.h>
+#include <kernel/mp.h>
+#include <kernel/thread.h>
 #include <platform.h>
 #include <debug.h>
 
 #if WITH_KERNEL_VM
 #include <kernel/vm.h>
+#include <arch/mmu.h>
 #endif
 
-static void mem_test_fail(void *ptr, uint32_t should, uint32_t is)
+/*
+ * The region under test is split into a slice per active cpu, each tested by a thread pinned
+ * to that cpu, so the whole machine's memory bandwidth goes into it. Memory is accessed a
+ * native word at a time, with the 32 bit patterns repeated across wider words, and the loops
+ * check a block of words at once, only looking for the exact word once a block mismatches.
+ */
+
+typedef unsigned long memword_t;
+
+#define WORD_SIZE sizeof(memword_t)
+
+/* words handled per step of the fill and verify loops */
+#define BLOCK 8
+
+/* slices start on a boundary of this many bytes */
+#define SLICE_ALIGN 4096
+
+struct mem_test_slice {
+    volatile memword_t *buf;
+    size_t count;       // words
+    uint cpu;
+    bool verbose;       // prints progress for everyone
+    uint64_t bytes;     // read and written, for the bandwidth figure
+    status_t result;
+};
+
+static memword_t pattern_word(uint32_t pat)
+{
+    memword_t val = pat;
+    for (uint shift = 32; shift < sizeof(memword_t) * 8; shift += 32)
+        val |= (memword_t)pat << shift;
+    return val;
+}
+
+static void mem_test_fail(struct mem_test_slice *slice, volatile memword_t *ptr,
+                          memword_t should, memword_t is)
 {
-    printf("ERROR at %p: should be 0x%x, is 0x%x\n", ptr, should, is);
+    printf("ERROR on cpu %u at %p: should be 0x%lx, is 0x%lx\n",
+           slice->cpu, (void *)ptr, should, is);
 
-    ptr = (void *)ROUNDDOWN((uintptr_t)ptr, 64);
-    hexdump(ptr, 128);
+    void *line = (void *)ROUNDDOWN((uintptr_t)ptr, 64);
+    hexdump(line, 128);
 }
 
-static status_t do_pattern_test(void *ptr, size_t len, uint32_t pat)
+static void fill_words(volatile memword_t *buf, size_t count, memword_t val)
 {
-    volatile uint32_t *vbuf32 = ptr;
-    size_t i;
+    size_t i = 0;
+    for (; i + BLOCK <= count; i += BLOCK) {
+        for (uint k = 0; k < BLOCK; k++)
+            buf[i + k] = val;
+    }
+    for (; i < count; i++)
+        buf[i] = val;
+}
 
-    printf("\tpattern 0x%08x\n", pat);
-    for (i = 0; i < len / 4; i++) {
-        vbuf32[i] = pat;
+/* returns the index of the first word that isn't val, or count */
+static size_t verify_words(volatile memword_t *buf, size_t count, memword_t val)
+{
+    size_t i = 0;
+    for (; i + BLOCK <= count; i += BLOCK) {
+        memword_t diff = 0;
+        for (uint k = 0; k < BLOCK; k++)
+            diff |= buf[i + k] ^ val;
+        if (unlikely(diff))
+            break;
     }
+    for (; i < count; i++) {
+        if (buf[i] != val)
+            return i;
+    }
+    return count;
+}
 
-    for (i = 0; i < len / 4; i++) {
-        if (vbuf32[i] != pat) {
-            mem_test_fail((void *)&vbuf32[i], pat, vbuf32[i]);
-            return ERR_GENERIC;
-        }
+/* check for expect and replace it with val, from the bottom up. returns like verify_words */
+static size_t invert_up(volatile memword_t *buf, size_t count, memword_t expect, memword_t val)
+{
+    size_t i = 0;
+    for (; i + BLOCK <= count; i += BLOCK) {
+        memword_t diff = 0;
+        for (uint k = 0; k < BLOCK; k++)
+            diff |= buf[i + k] ^ expect;
+        if (unlikely(diff))
+            break;
+        for (uint k = 0; k < BLOCK; k++)
+            buf[i + k] = val;
     }
+    /* the rest, and the block with the bad word, a word at a time */
+    for (; i < count; i++) {
+        if (buf[i] != expect)
+            return i;
+        buf[i] = val;
+    }
+    return count;
+}
 
-    return NO_ERROR;
+/* the same, from the top down */
+static size_t invert_down(volatile memword_t *buf, size_t count, memword_t expect, memword_t val)
+{
+    size_t i = count;
+    for (; i >= BLOCK; i -= BLOCK) {
+        memword_t diff = 0;
+        for (uint k = 1; k <= BLOCK; k++)
+            diff |= buf[i - k] ^ expect;
+        if (unlikely(diff))
+            break;
+        for (uint k = 1; k <= BLOCK; k++)
+            buf[i - k] = val;
+    }
+    for (; i > 0; i--) {
+        if (buf[i - 1] != expect)
+            return i - 1;
+        buf[i - 1] = val;
+    }
+    return count;
 }
 
-static status_t do_moving_inversion_test(void *ptr, size_t len, uint32_t pat)
+static status_t check(struct mem_test_slice *slice, size_t bad, memword_t should)
 {
-    volatile uint32_t *vbuf32 = ptr;
-    size_t i;
+    if (bad == slice->count)
+        return NO_ERROR;
 
-    printf("\tpattern 0x%08x\n", pat);
+    mem_test_fail(slice, &slice->buf[bad], should, slice->buf[bad]);
+    return ERR_GENERIC;
+}
+
+static status_t do_pattern_test(struct mem_test_slice *slice, uint32_t pat)
+{
+    memword_t val = pattern_word(pat);
+
+    if (slice->verbose)
+        printf("\tpattern 0x%08x\n", pat);
+
+    fill_words(slice->buf, slice->count, val);
+    slice->bytes += slice->count * WORD_SIZE * 2;
+    return check(slice, verify_words(slice->buf, slice->count, val), val);
+}
+
+static status_t do_moving_inversion_test(struct mem_test_slice *slice, uint32_t pat)
+{
+    memword_t val = pattern_word(pat);
+    status_t err;
+
+    if (slice->verbose)
+        printf("\tpattern 0x%08x\n", pat);
 
     /* fill memory */
-    for (i = 0; i < len / 4; i++) {
-        vbuf32[i] = pat;
-    }
+    fill_words(slice->buf, slice->count, val);
+    slice->bytes += slice->count * WORD_SIZE;
 
     /* from the bottom, walk through each cell, inverting the value */
-    //printf("\t\tbottom up invert\n");
-    for (i = 0; i < len / 4; i++) {
-        if (vbuf32[i] != pat) {
-            mem_test_fail((void *)&vbuf32[i], pat, vbuf32[i]);
-            return ERR_GENERIC;
-        }
-
-        vbuf32[i] = ~pat;
-    }
+    err = check(slice, invert_up(slice->buf, slice->count, val, ~val), val);
+    slice->bytes += slice->count * WORD_SIZE * 2;
+    if (err < 0)
+        return err;
 
     /* repeat, walking from top down */
-    //printf("\t\ttop down invert\n");
-    for (i = len / 4; i > 0; i--) {
-        if (vbuf32[i-1] != ~pat) {
-            mem_test_fail((void *)&vbuf32[i-1], ~pat, vbuf32[i-1]);
-            return ERR_GENERIC;
-        }
-
-        vbuf32[i-1] = pat;
-    }
+    err = check(slice, invert_down(slice->buf, slice->count, ~val, val), ~val);
+    slice->bytes += slice->count * WORD_SIZE * 2;
+    if (err < 0)
+        return err;
 
     /* verify that we have the original pattern */
-    //printf("\t\tfinal test\n");
-    for (i = 0; i < len / 4; i++) {
-        if (vbuf32[i] != pat) {
-            mem_test_fail((void *)&vbuf32[i], pat, vbuf32[i]);
-            return ERR_GENERIC;
-        }
-    }
-
-    return NO_ERROR;
+    slice->bytes += slice->count * WORD_SIZE;
+    return check(slice, verify_words(slice->buf, slice->count, val), val);
 }
 
-static void do_mem_tests(void *ptr, size_t len)
+static status_t do_mem_tests(struct mem_test_slice *slice)
 {
+    volatile memword_t *buf = slice->buf;
     size_t i;
 
     /* test 1: simple write address to memory, read back */
-    printf("test 1: simple address write, read back\n");
-    volatile uint32_t *vbuf32 = ptr;
-    for (i = 0; i < len / 4; i++) {
-        vbuf32[i] = i;
+    if (slice->verbose)
+        printf("test 1: simple address write, read back\n");
+    for (i = 0; i < slice->count; i++) {
+        buf[i] = (memword_t)&buf[i];
     }
 
-    for (i = 0; i < len / 4; i++) {
-        if (vbuf32[i] != i) {
-            mem_test_fail((void *)&vbuf32[i], i, vbuf32[i]);
-            goto out;
+    for (i = 0; i < slice->count; i++) {
+        if (buf[i] != (memword_t)&buf[i]) {
+            mem_test_fail(slice, &buf[i], (memword_t)&buf[i], buf[i]);
+            return ERR_GENERIC;
         }
     }
+    slice->bytes += slice->count * WORD_SIZE * 2;
 
     /* test 2: write various patterns, read back */
-    printf("test 2: write patterns, read back\n");
+    if (slice->verbose)
+        printf("test 2: write patterns, read back\n");
 
     static const uint32_t pat[] = {
         0x0, 0xffffffff,
@@ -135,55 +233,141 @@ static void do_mem_tests(void *ptr, size_t len)
     };
 
     for (size_t p = 0; p < countof(pat); p++) {
-        if (do_pattern_test(ptr, len, pat[p]) < 0)
-            goto out;
+        if (do_pattern_test(slice, pat[p]) < 0)
+            return ERR_GENERIC;
     }
     // shift bits through 32bit word
     for (uint32_t p = 1; p != 0; p <<= 1) {
-        if (do_pattern_test(ptr, len, p) < 0)
-            goto out;
+        if (do_pattern_test(slice, p) < 0)
+            return ERR_GENERIC;
     }
     // shift bits through 16bit word, invert top of 32bit
     for (uint16_t p = 1; p != 0; p <<= 1) {
-        if (do_pattern_test(ptr, len, ((~p) << 16) | p) < 0)
-            goto out;
+        if (do_pattern_test(slice, ((~p) << 16) | p) < 0)
+            return ERR_GENERIC;
     }
 
     /* test 3: moving inversion, patterns */
-    printf("test 3: moving inversions with patterns\n");
+    if (slice->verbose)
+        printf("test 3: moving inversions with patterns\n");
     for (size_t p = 0; p < countof(pat); p++) {
-        if (do_moving_inversion_test(ptr, len, pat[p]) < 0)
-            goto out;
+        if (do_moving_inversion_test(slice, pat[p]) < 0)
+            return ERR_GENERIC;
 
     }
     // shift bits through 32bit word
     for (uint32_t p = 1; p != 0; p <<= 1) {
-        if (do_moving_inversion_test(ptr, len, p) < 0)
-            goto out;
+        if (do_moving_inversion_test(slice, p) < 0)
+            return ERR_GENERIC;
     }
     // shift bits through 16bit word, invert top of 32bit
     for (uint16_t p = 1; p != 0; p <<= 1) {
-        if (do_moving_inversion_test(ptr, len, ((~p) << 16) | p) < 0)
-            goto out;
+        if (do_moving_inversion_test(slice, ((~p) << 16) | p) < 0)
+            return ERR_GENERIC;
     }
 
-out:
-    printf("done with tests\n");
+    return NO_ERROR;
+}
+
+static int mem_test_thread(void *arg)
+{
+    struct mem_test_slice *slice = arg;
+
+    slice->result = do_mem_tests(slice);
+    return 0;
+}
+
+static void run_mem_tests(void *ptr, size_t len)
+{
+    struct mem_test_slice slices[SMP_MAX_CPUS];
+    thread_t *threads[SMP_MAX_CPUS];
+    uint cpus[SMP_MAX_CPUS];
+    uint count = 0;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (mp_is_cpu_active(i))
+            cpus[count++] = i;
+    }
+
+    /* small regions aren't worth splitting */
+    uintptr_t start = ROUNDUP((uintptr_t)ptr, WORD_SIZE);
+    uintptr_t end = ROUNDDOWN((uintptr_t)ptr + len, WORD_SIZE);
+    if (end <= start) {
+        printf("nothing to test\n");
+        return;
+    }
+    count = MAX(1u, MIN(count, (end - start) / SLICE_ALIGN));
+
+    size_t slice_len = ROUNDUP((end - start) / count, SLICE_ALIGN);
+    uint started = 0;
+    for (uint i = 0; i < count; i++) {
+        uintptr_t base = start + i * slice_len;
+        if (base >= end)
+            break;
+
+        struct mem_test_slice *slice = &slices[started];
+        memset(slice, 0, sizeof(*slice));
+        slice->buf = (volatile memword_t *)base;
+        slice->count = (MIN(base + slice_len, end) - base) / WORD_SIZE;
+        slice->cpu = cpus[i];
+        slice->verbose = (started == 0);
+
+        threads[started] = thread_create("mem_test", &mem_test_thread, slice,
+                                         DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!threads[started]) {
+            printf("error creating thread for cpu %u\n", cpus[i]);
+            break;
+        }
+        thread_set_pinned_cpu(threads[started], cpus[i]);
+        started++;
+    }
+
+    printf("testing %zu bytes on %u cpus\n", (size_t)(end - start), started);
+
+    lk_bigtime_t t = current_time_hires();
+    for (uint i = 0; i < started; i++)
+        thread_resume(threads[i]);
+
+    uint64_t bytes = 0;
+    uint failed = 0;
+    for (uint i = 0; i < started; i++) {
+        thread_join(threads[i], NULL, INFINITE_TIME);
+        bytes += slices[i].bytes;
+        if (slices[i].result < 0) {
+            printf("cpu %u: FAILED in %p-%p\n", slices[i].cpu, (void *)slices[i].buf,
+                   (void *)(slices[i].buf + slices[i].count));
+            failed++;
+        }
+    }
+    t = current_time_hires() - t;
+
+    printf("done with tests: %u of %u slices failed, %llu MB in %llu msecs (%llu MB/sec)\n",
+           failed, started, bytes / (1024 * 1024), t / 1000,
+           bytes * 1000000 / MAX(t, 1) / (1024 * 1024));
 }
 
 static int mem_test(int argc, const cmd_args *argv)
 {
-    if (argc < 2) {
+    bool cached = false;
+    int arg = 1;
+
+    if (argc >= 2 && !strcmp(argv[1].str, "-c")) {
+        cached = true;
+        arg++;
+    }
+
+    if (argc < arg + 1) {
         printf("not enough arguments\n");
 usage:
-        printf("usage: %s <length>\n", argv[0].str);
+        printf("usage: %s [-c] <length>\n", argv[0].str);
         printf("usage: %s <base> <length>\n", argv[0].str);
+        printf("-c maps the region cached, much faster once length is well past the caches\n");
         return -1;
     }
 
-    if (argc == 2) {
+    if (argc == arg + 1) {
         void *ptr;
-        size_t len = argv[1].u;
+        size_t len = argv[arg].u;
 
 #if WITH_KERNEL_VM
         /* rounding up len to the next page */
@@ -193,8 +377,13 @@ usage:
             return -1;
         }
 
-        /* allocate a region to test in */
-        status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "memtest", len, &ptr, 0, 0, ARCH_MMU_FLAG_UNCACHED);
+        /* allocate a region to test in, aligned so it can be mapped with large pages */
+        vmm_aspace_t *aspace = vmm_get_kernel_aspace();
+        uint align = arch_mmu_block_shift(&aspace->arch_aspace, 0, len);
+        uint flags = cached ? ARCH_MMU_FLAG_CACHED : ARCH_MMU_FLAG_UNCACHED;
+        status_t err = vmm_alloc_contiguous(aspace, "memtest", len, &ptr, align, 0, flags);
+        if (err < 0 && align > PAGE_SIZE_SHIFT)
+            err = vmm_alloc_contiguous(aspace, "memtest", len, &ptr, 0, 0, flags);
         if (err < 0) {
             printf("error %d allocating test region\n", err);
             return -1;
@@ -216,20 +405,19 @@ usage:
         printf("got buffer at %p of length 0x%lx\n", ptr, len);
 
         /* run the tests */
-        do_mem_tests(ptr, len);
+        run_mem_tests(ptr, len);
 
 #if WITH_KERNEL_VM
-        // XXX free memory region here
-        printf("NOTE: leaked memory\n");
+        vmm_free_region(aspace, (vaddr_t)ptr);
 #else
         free(ptr);
 #endif
-    } else if (argc == 3) {
+    } else if (argc == 3 && !cached) {
         void *ptr = argv[1].p;
         size_t len = argv[2].u;
 
         /* run the tests */
-        do_mem_tests(ptr, len);
+        run_mem_tests(ptr, len);
     } else {
         goto usage;
     }
@@ -653,6 +653,108 @@ int group_dynamic(void)
     return 0;
 }
 
+#define SW_PACKET_COUNT 1000
+
+static int single_writer_thread(void *arg)
+{
+    port_t w_port = (port_t)arg;
+
+    for (uint32_t seq = 0; seq < SW_PACKET_COUNT; ) {
+        port_packet_t pkt = { { 0 } };
+        memcpy(pkt.value, &seq, sizeof(seq));
+
+        status_t st = port_write(w_port, &pkt, 1);
+        if (st == ERR_PARTIAL_WRITE) {
+            // reader is behind, let it catch up.
+            thread_yield();
+            continue;
+        }
+        if (st < 0)
+            return __LINE__;
+        seq++;
+    }
+    return 0;
+}
+
+/* A lockless single writer streaming to a batched reader, checking that
+ * nothing is lost or reordered.
+ */
+int single_writer_batch(void)
+{
+    port_t w_port, r_port;
+    status_t st = port_create("sw_port", PORT_MODE_UNICAST | PORT_MODE_SINGLE_WRITER | PORT_MODE_BIG_BUFFER,
+                              &w_port);
+    if (st < 0)
+        return __LINE__;
+
+    // broadcast ports can't be single writer.
+    port_t bad_port;
+    st = port_create("sw_bad", PORT_MODE_BROADCAST | PORT_MODE_SINGLE_WRITER, &bad_port);
+    if (st != ERR_INVALID_ARGS)
+        return __LINE__;
+
+    st = port_open("sw_port", context1, &r_port);
+    if (st < 0)
+        return __LINE__;
+
+    // nothing there yet.
+    port_result_t res[16];
+    size_t count;
+    st = port_read_batch(r_port, 0, res, countof(res), &count);
+    if (st != ERR_TIMED_OUT || count != 0)
+        return __LINE__;
+
+    thread_t *t = thread_create("single writer", &single_writer_thread, w_port,
+                                DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(t);
+
+    uint32_t expected = 0;
+    while (expected < SW_PACKET_COUNT) {
+        st = port_read_batch(r_port, 1000, res, countof(res), &count);
+        if (st < 0) {
+            printf("batch read failed, status = %d\n", st);
+            return __LINE__;
+        }
+        if (count == 0 || count > countof(res))
+            return __LINE__;
+
+        for (size_t i = 0; i < count; i++) {
+            uint32_t seq;
+            memcpy(&seq, res[i].packet.value, sizeof(seq));
+            if (seq != expected || res[i].ctx != context1) {
+                printf("got packet %u, expected %u\n", seq, expected);
+                return __LINE__;
+            }
+            expected++;
+        }
+    }
+
+    int retcode;
+    thread_join(t, &retcode, INFINITE_TIME);
+    if (retcode)
+        return retcode;
+
+    st = port_close(r_port);
+    if (st < 0)
+        return __LINE__;
+    st = port_close(w_port);
+    if (st < 0)
+        return __LINE__;
+
+    // a closed single writer port refuses writes like any other.
+    port_packet_t pkt = { { 0 } };
+    st = port_write(w_port, &pkt, 1);
+    if (st != ERR_BAD_HANDLE)
+        return __LINE__;
+
+    st = port_destroy(w_port);
+    if (st < 0)
+        return __LINE__;
+
+    printf("single_writer_batch : ok\n");
+    return 0;
+}
+
 event_t group_waiting_sync_evt;
 
 static int receive_thread(void *arg)
@@ -740,6 +842,7 @@ int port_tests(void)
         RUN_TEST(two_threads_basic);
         RUN_TEST(group_basic);
         RUN_TEST(group_dynamic);
+        RUN_TEST(single_writer_batch);
     }
 
     printf("all tests passed\n");
@@ -30,7 +30,9 @@
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
+#include <kernel/rwlock.h>
 #include <kernel/event.h>
+#include <kernel/futex.h>
 #include <platform.h>
 
 static int sleep_thread(void *arg)
@@ -240,6 +242,167 @@ int mutex_test(void)
     return 0;
 }
 
+static mutex_t inherit_mutex;
+static event_t inherit_holding_event;
+static event_t inherit_release_event;
+static int inherit_priority_after_release;
+
+static int mutex_inherit_holder(void *arg)
+{
+    mutex_acquire(&inherit_mutex);
+    event_signal(&inherit_holding_event, true);
+    event_wait(&inherit_release_event);
+    mutex_release(&inherit_mutex);
+
+    inherit_priority_after_release = get_current_thread()->priority;
+
+    return 0;
+}
+
+static int mutex_inherit_waiter(void *arg)
+{
+    mutex_acquire(&inherit_mutex);
+    mutex_release(&inherit_mutex);
+
+    return 0;
+}
+
+static void inherit_trace_hook(const mutex_t *m, const thread_t *holder,
+                               int boost_priority, lk_bigtime_t duration)
+{
+    printf("mutex %p holder %s ran at priority %d for %llu us\n",
+           m, holder->name, boost_priority, duration);
+}
+
+static int mutex_inherit_test(void)
+{
+    printf("testing mutex priority inheritance\n");
+
+    mutex_init(&inherit_mutex);
+    event_init(&inherit_holding_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&inherit_release_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    mutex_set_pi_trace_hook(&inherit_trace_hook);
+
+    thread_t *holder = thread_create("inherit holder", &mutex_inherit_holder, NULL, LOW_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(holder);
+    event_wait(&inherit_holding_event);
+
+    thread_t *waiter = thread_create("inherit waiter", &mutex_inherit_waiter, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(waiter);
+    thread_sleep(50);
+
+    if (holder->priority != HIGH_PRIORITY)
+        printf("holder priority %d, expected it to inherit %d\n", holder->priority, HIGH_PRIORITY);
+
+    event_signal(&inherit_release_event, true);
+    thread_join(waiter, NULL, INFINITE_TIME);
+    thread_join(holder, NULL, INFINITE_TIME);
+
+    if (inherit_priority_after_release != LOW_PRIORITY)
+        printf("holder priority %d after release, expected %d\n", inherit_priority_after_release, LOW_PRIORITY);
+
+    mutex_set_pi_trace_hook(NULL);
+    event_destroy(&inherit_release_event);
+    event_destroy(&inherit_holding_event);
+    mutex_destroy(&inherit_mutex);
+
+    printf("done with mutex priority inheritance tests\n");
+
+    return 0;
+}
+
+static rwlock_t rwlock_test_lock;
+static volatile int rwlock_readers;
+static volatile int rwlock_writers;
+
+static int rwlock_reader_thread(void *arg)
+{
+    const int iterations = 100000;
+
+    for (int i = 0; i < iterations; i++) {
+        rwlock_acquire_read(&rwlock_test_lock);
+
+        atomic_add(&rwlock_readers, 1);
+        if (rwlock_writers != 0)
+            panic("rwlock reader running alongside a writer\n");
+        if ((i % 16) == 0)
+            thread_yield();
+        atomic_add(&rwlock_readers, -1);
+
+        rwlock_release_read(&rwlock_test_lock);
+    }
+
+    return 0;
+}
+
+static int rwlock_writer_thread(void *arg)
+{
+    const int iterations = 10000;
+
+    for (int i = 0; i < iterations; i++) {
+        rwlock_acquire_write(&rwlock_test_lock);
+
+        if (atomic_add(&rwlock_writers, 1) != 0)
+            panic("rwlock has more than one writer\n");
+        if (rwlock_readers != 0)
+            panic("rwlock writer running alongside %d readers\n", rwlock_readers);
+        thread_yield();
+        atomic_add(&rwlock_writers, -1);
+
+        rwlock_release_write(&rwlock_test_lock);
+        thread_yield();
+    }
+
+    return 0;
+}
+
+static int rwlock_timeout_thread(void *arg)
+{
+    status_t err;
+
+    err = rwlock_acquire_read_timeout(&rwlock_test_lock, 100);
+    if (err != ERR_TIMED_OUT)
+        printf("rwlock_acquire_read_timeout returns %d, expected ERR_TIMED_OUT\n", err);
+    err = rwlock_acquire_write_timeout(&rwlock_test_lock, 0);
+    if (err != ERR_TIMED_OUT)
+        printf("rwlock_acquire_write_timeout returns %d, expected ERR_TIMED_OUT\n", err);
+
+    return err;
+}
+
+static int rwlock_test(void)
+{
+    rwlock_init(&rwlock_test_lock);
+
+    thread_t *threads[6];
+
+    for (uint i = 0; i < countof(threads); i++) {
+        if (i < 2)
+            threads[i] = thread_create("rwlock writer", &rwlock_writer_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        else
+            threads[i] = thread_create("rwlock reader", &rwlock_reader_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(threads[i]);
+    }
+
+    for (uint i = 0; i < countof(threads); i++) {
+        thread_join(threads[i], NULL, INFINITE_TIME);
+    }
+
+    printf("testing rwlock timeout\n");
+
+    rwlock_acquire_write(&rwlock_test_lock);
+    threads[0] = thread_create("rwlock timeout tester", &rwlock_timeout_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(threads[0]);
+    thread_join(threads[0], NULL, INFINITE_TIME);
+    rwlock_release_write(&rwlock_test_lock);
+
+    printf("done with rwlock tests\n");
+
+    rwlock_destroy(&rwlock_test_lock);
+
+    return 0;
+}
+
 static event_t e;
 
 static int event_signaler(void *arg)
@@ -450,6 +613,71 @@ static void atomic_test(void)
     printf("atomic count == %d (should be zero)\n", atomic);
 }
 
+/* a lock in the style of the futex.h example: 0 free, 1 held, 2 held with waiters */
+static volatile int futex_lock;
+static volatile int futex_protected;
+
+static void futex_lock_acquire(void)
+{
+    int free = 0;
+    if (__atomic_compare_exchange_n(&futex_lock, &free, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    while (__atomic_exchange_n(&futex_lock, 2, __ATOMIC_ACQUIRE) != 0)
+        wait_on_address(&futex_lock, 2, INFINITE_TIME);
+}
+
+static void futex_lock_release(void)
+{
+    if (__atomic_exchange_n(&futex_lock, 0, __ATOMIC_RELEASE) == 2)
+        wake_address(&futex_lock, 1);
+}
+
+static int futex_tester(void *arg)
+{
+    for (int i = 0; i < 10000; i++) {
+        futex_lock_acquire();
+        int val = futex_protected;
+        if ((i % 100) == 0)
+            thread_yield();
+        futex_protected = val + 1;
+        futex_lock_release();
+    }
+    return 0;
+}
+
+static int futex_test(void)
+{
+    printf("testing futexes\n");
+
+    volatile int word = 5;
+    status_t err = wait_on_address(&word, 4, INFINITE_TIME);
+    if (err != ERR_BAD_STATE)
+        printf("wait_on_address with a stale value returns %d, expected ERR_BAD_STATE\n", err);
+    err = wait_on_address(&word, 5, 20);
+    if (err != ERR_TIMED_OUT)
+        printf("wait_on_address returns %d, expected ERR_TIMED_OUT\n", err);
+    if (wake_address(&word, 1) != 0)
+        printf("wake_address woke someone with nobody waiting\n");
+
+    futex_lock = 0;
+    futex_protected = 0;
+
+    thread_t *threads[4];
+    for (uint i = 0; i < countof(threads); i++) {
+        threads[i] = thread_create("futex tester", &futex_tester, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(threads[i]);
+    }
+    for (uint i = 0; i < countof(threads); i++)
+        thread_join(threads[i], NULL, INFINITE_TIME);
+
+    if (futex_protected != 10000 * (int)countof(threads))
+        printf("futex protected count %d, expected %d\n", futex_protected, 10000 * (int)countof(threads));
+
+    printf("done with futex tests\n");
+
+    return 0;
+}
+
 static volatile int preempt_count;
 
 static int preempt_tester(void *arg)
@@ -616,11 +844,89 @@ static void spinlock_test(void)
 #undef COUNT
 }
 
+#if KERNEL_DEADLINE
+struct deadline_test_args {
+    struct thread_deadline_params params;
+    lk_bigtime_t work;  /* usecs to spin every period */
+    uint periods;
+    struct thread_deadline_stats stats;
+};
+
+static int deadline_tester(void *arg)
+{
+    struct deadline_test_args *args = arg;
+
+    status_t err = thread_set_deadline(get_current_thread(), &args->params);
+    if (err < 0) {
+        printf("thread_set_deadline returns %d\n", err);
+        return err;
+    }
+
+    for (uint i = 0; i < args->periods; i++) {
+        lk_bigtime_t start = current_time_hires();
+        while (current_time_hires() - start < args->work)
+            ;
+        thread_deadline_wait();
+    }
+
+    thread_get_deadline_stats(get_current_thread(), &args->stats);
+    return 0;
+}
+
+static void deadline_run(struct deadline_test_args *args)
+{
+    thread_t *t = thread_create("deadline tester", &deadline_tester, args, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(t);
+    thread_join(t, NULL, INFINITE_TIME);
+}
+
+static void deadline_test(void)
+{
+    printf("testing deadline scheduling\n");
+
+    /* neither of these should change the current thread */
+    struct thread_deadline_params params = { .runtime = 20000, .period = 10000 };
+    status_t err = thread_set_deadline(get_current_thread(), &params);
+    if (err != ERR_INVALID_ARGS)
+        printf("runtime > period returns %d, expected ERR_INVALID_ARGS\n", err);
+    params.runtime = params.period;
+    err = thread_set_deadline(get_current_thread(), &params);
+    if (err != ERR_NO_RESOURCES)
+        printf("a whole cpu returns %d, expected ERR_NO_RESOURCES\n", err);
+
+    /* well within its budget, every period should complete on time */
+    struct deadline_test_args args = {
+        .params = { .runtime = 5000, .period = 20000 },
+        .work = 1000,
+        .periods = 20,
+    };
+    deadline_run(&args);
+    printf("periodic: jobs %u (should be 20), overruns %u misses %u (should be 0)\n",
+           args.stats.jobs, args.stats.overruns, args.stats.misses);
+
+    /* spinning for longer than a period gets it throttled in every one it spans */
+    struct deadline_test_args hog = {
+        .params = { .runtime = 2000, .period = 20000 },
+        .work = 50000,
+        .periods = 1,
+    };
+    deadline_run(&hog);
+    printf("hog: overruns %u (should be 2 or more), max runtime %llu us (should be well under 50000)\n",
+           hog.stats.overruns, hog.stats.max_runtime);
+}
+#endif
+
 int thread_tests(int argc, const cmd_args *argv)
 {
     mutex_test();
+    mutex_inherit_test();
     semaphore_test();
+    rwlock_test();
+    futex_test();
     event_test();
+#if KERNEL_DEADLINE
+    deadline_test();
+#endif
 
     spinlock_test();
     atomic_test();
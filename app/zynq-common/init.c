@@ -116,11 +116,10 @@ static void zynq_common_target_init(uint level)
         } else if (!strcmp(device, BLOCK_DEVICE_NAME)) {
             /* we were loaded from spi flash, go look at it to see if we can find it */
             if (spi) {
-                void *ptr = 0;
-                int err = bio_ioctl(spi, BIO_IOCTL_GET_MEM_MAP, (void *)&ptr);
+                const void *ptr;
+                int err = bio_direct_map(spi, bootimage_phys, bootimage_size, &ptr);
                 if (err >= 0) {
                     put_bio_memmap = true;
-                    ptr = (uint8_t *)ptr + bootimage_phys;
                     bootimage_open(ptr, bootimage_size, &bi);
                 }
             }
@@ -160,7 +159,7 @@ static void zynq_common_target_init(uint level)
              */
             thread_sleep(10);
 
-            bio_ioctl(spi, BIO_IOCTL_PUT_MEM_MAP, NULL);
+            bio_direct_unmap(spi);
         }
     }
 
@@ -197,6 +196,8 @@ static void zynq_common_target_init(uint level)
         /* Configure IP stack and hook to the driver */
         minip_init_dhcp(gem_send_raw_pkt, NULL);
     }
+    minip_set_tx_offloads(MINIP_TX_OFFLOAD_SG);
+    minip_set_tx_batch_handler(gem_send_raw_pkts);
     gem_set_callback(minip_rx_driver_callback);
 #endif
 }
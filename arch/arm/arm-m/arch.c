@@ -45,7 +45,11 @@ void arch_early_init(void)
 #if (__CORTEX_M >= 0x03) || (CORTEX_SC >= 300)
     uint i;
     /* set the vector table base */
+#if ARM_CM_DIRECT_IRQS
+    arm_cm_init_vectab();
+#else
     SCB->VTOR = (uint32_t)&vectab;
+#endif
 
 #if ARM_CM_DYNAMIC_PRIORITY_SIZE
     /* number of priorities */
@@ -90,7 +94,9 @@ void arch_early_init(void)
 #endif
 
     /* FPU settings ------------------------------------------------------------*/
-#if (__FPU_PRESENT == 1) && (__FPU_USED == 1)
+    /* with ARM_CM_FPU_CONTEXT_NONE the fpu stays off, so CONTROL.FPCA never gets set
+     * and exceptions only ever stack the short frame */
+#if ARM_CM_FPU_CONTEXT != ARM_CM_FPU_CONTEXT_NONE
     SCB->CPACR |= ((3UL << 10*2)|(3UL << 11*2));  /* set CP10 and CP11 Full Access */
 #endif
 
@@ -107,7 +113,7 @@ void arch_init(void)
     *REG32(DWT_CTRL) |= 1; // enable cycle counter
 #endif
     printf("CONTROL 0x%x\n", __get_CONTROL());
-#if (__FPU_PRESENT == 1) && (__FPU_USED == 1)
+#if ARM_CM_FPU_CONTEXT != ARM_CM_FPU_CONTEXT_NONE
     printf("FPSCR 0x%x\n", __get_FPSCR());
     printf("FPCCR 0x%x\n", FPU->FPCCR);
 #endif
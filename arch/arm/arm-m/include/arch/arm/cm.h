@@ -120,6 +120,41 @@ static const unsigned int arm_cm_num_irq_pri_bits = __NVIC_PRIO_BITS;
 static const unsigned int arm_cm_irq_pri_mask = ~((1 << __NVIC_PRIO_BITS) - 1) & 0xff;
 #endif
 
+/* how the context switch deals with fpu state on cores that have one.
+ * NONE leaves the fpu disabled and switches integer state only, any floating point
+ * instruction takes a usage fault. LAZY tracks per thread whether the fpu was used and
+ * lets the core's lazy stacking save s0-s15 only when it was.
+ */
+#define ARM_CM_FPU_CONTEXT_NONE 0
+#define ARM_CM_FPU_CONTEXT_LAZY 1
+
+#ifndef ARM_CM_FPU_CONTEXT
+#if (__FPU_PRESENT == 1) && (__FPU_USED == 1)
+#define ARM_CM_FPU_CONTEXT ARM_CM_FPU_CONTEXT_LAZY
+#else
+#define ARM_CM_FPU_CONTEXT ARM_CM_FPU_CONTEXT_NONE
+#endif
+#endif
+
+#if (ARM_CM_FPU_CONTEXT != ARM_CM_FPU_CONTEXT_NONE) && !((__FPU_PRESENT == 1) && (__FPU_USED == 1))
+#error "ARM_CM_FPU_CONTEXT needs a core with an fpu"
+#endif
+
+/* run out of a copy of the vector table in ram, so irqs can be pointed straight at
+ * their handler with arm_cm_register_direct_irq() */
+#ifndef ARM_CM_DIRECT_IRQS
+#define ARM_CM_DIRECT_IRQS 0
+#endif
+
+/* number of external irqs the ram vector table has room for */
+#ifndef ARM_CM_NUM_IRQS
+#define ARM_CM_NUM_IRQS 128
+#endif
+
+#if ARM_CM_DIRECT_IRQS && !((__CORTEX_M >= 0x03) || (CORTEX_SC >= 300))
+#error "ARM_CM_DIRECT_IRQS needs a core with VTOR"
+#endif
+
 #if     (__CORTEX_M >= 0x03) || (CORTEX_SC >= 300)
 
 void _arm_cm_set_irqpri(uint32_t pri);
@@ -173,7 +208,8 @@ static inline void arm_cm_trigger_interrupt(int vector)
 
 static inline void arm_cm_trigger_preempt(void)
 {
-    SCB->ICSR |= SCB_ICSR_PENDSVSET_Msk;
+    /* write only, the other set bits would re-pend whatever reads back as pending */
+    SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
 }
 
 
@@ -190,5 +226,27 @@ void arm_cm_systick_init(uint32_t mhz);
 void arm_cm_irq_entry(void);
 void arm_cm_irq_exit(bool reschedule);
 
+#if ARM_CM_DIRECT_IRQS
+/*
+ * Point the vector of an external irq straight at handler, skipping the platform's
+ * wrapper and the glue above, and set its priority. The priority has to be above
+ * arm_cm_medium_priority(), where the wrapped irqs sit, so the irq is taken ahead of
+ * them and tail-chains into them when both are pending.
+ *
+ * A direct handler runs without PRIMASK set and must not call into the kernel. Hand
+ * work off by pending a wrapped irq with arm_cm_trigger_interrupt(), which runs as
+ * soon as the direct handler returns. Passing a NULL handler puts the platform's
+ * vector back at medium priority.
+ *
+ * Returns ERR_OUT_OF_RANGE if irq is past the end of the vector table,
+ * ERR_INVALID_ARGS if the priority is not above the wrapped irqs and
+ * ERR_NOT_SUPPORTED if the platform's table did not fit in ARM_CM_NUM_IRQS.
+ */
+status_t arm_cm_register_direct_irq(unsigned int irq, void (*handler)(void), uint32_t priority);
+
+/* set up the ram vector table and point VTOR at it, called from arch_early_init */
+void arm_cm_init_vectab(void);
+#endif
+
 #endif
 
@@ -21,7 +21,10 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <compiler.h>
+#include <err.h>
 #include <stdint.h>
+#include <string.h>
+#include <arch/arm/cm.h>
 
 /*
  * Make a nice 8 byte aligned stack to run on before the threading system is up.
@@ -70,5 +73,66 @@ const void *const __SECTION(".text.boot.vectab1") vectab[] = {
     _systick, // systick
 };
 
+#if ARM_CM_DIRECT_IRQS
+/* end of the platform's external irq vectors in vectab2, from the linker script */
+extern const void *const __vectab_end[];
+
+/* VTOR wants the table aligned to its size rounded up to a power of two */
+#define RAM_VECTAB_ENTRIES (16 + ARM_CM_NUM_IRQS)
+#define RAM_VECTAB_ALIGN \
+    ((RAM_VECTAB_ENTRIES <= 32) ? 128 : \
+     (RAM_VECTAB_ENTRIES <= 64) ? 256 : \
+     (RAM_VECTAB_ENTRIES <= 128) ? 512 : \
+     (RAM_VECTAB_ENTRIES <= 256) ? 1024 : 2048)
+
+static const void *ram_vectab[RAM_VECTAB_ENTRIES] __ALIGNED(RAM_VECTAB_ALIGN);
+
+/* external irqs copied into ram_vectab, 0 if we are still running out of flash */
+static unsigned int direct_irq_count;
+
+void arm_cm_init_vectab(void)
+{
+    size_t entries = __vectab_end - vectab;
+
+    if (entries > countof(ram_vectab)) {
+        /* too big for the ram copy, stay on the flash table */
+        SCB->VTOR = (uint32_t)&vectab;
+        return;
+    }
+
+    memcpy(ram_vectab, vectab, entries * sizeof(vectab[0]));
+    direct_irq_count = entries - 16;
+
+    __DSB();
+    SCB->VTOR = (uint32_t)&ram_vectab;
+    __DSB();
+    __ISB();
+}
+
+status_t arm_cm_register_direct_irq(unsigned int irq, void (*handler)(void), uint32_t priority)
+{
+    if (direct_irq_count == 0)
+        return ERR_NOT_SUPPORTED;
+    if (irq >= direct_irq_count)
+        return ERR_OUT_OF_RANGE;
+
+    if (handler) {
+        if (priority >= arm_cm_medium_priority())
+            return ERR_INVALID_ARGS;
+
+        ram_vectab[16 + irq] = handler;
+        __DSB();
+        NVIC_SetPriority((IRQn_Type)irq, priority);
+    } else {
+        /* back to the platform's wrapper */
+        NVIC_SetPriority((IRQn_Type)irq, arm_cm_medium_priority());
+        ram_vectab[16 + irq] = vectab[16 + irq];
+        __DSB();
+    }
+
+    return NO_ERROR;
+}
+#endif
+
 
 
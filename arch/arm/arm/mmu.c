@@ -510,6 +510,15 @@ vaddr_t arch_mmu_pick_spot(vaddr_t base, uint prev_region_flags,
 }
 #endif  /* WITH_ARCH_MMU_PICK_SPOT */
 
+uint arch_mmu_block_shift(arch_aspace_t *aspace, paddr_t paddr, size_t size)
+{
+    /* arch_mmu_map uses 1MB sections wherever it can */
+    if (size >= SECTION_SIZE && IS_SECTION_ALIGNED(paddr))
+        return 20;
+
+    return PAGE_SIZE_SHIFT;
+}
+
 
 int arch_mmu_map(arch_aspace_t *aspace, addr_t vaddr, paddr_t paddr, uint count, uint flags)
 {
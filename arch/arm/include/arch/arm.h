@@ -54,6 +54,15 @@ void arm_context_switch(vaddr_t *old_sp, vaddr_t new_sp);
 
 void arm_chain_load(paddr_t entry, ulong arg0, ulong arg1, ulong arg2, ulong arg3) __NO_RETURN;
 
+#if ARM_ISA_ARMV7A && ARM_WITH_CACHE
+/* the two ways arch_clean_cache_range and arch_clean_invalidate_cache_range pick from. the
+ * whole cache ones only reach the inner caches */
+void arm_clean_cache_range_lines(addr_t start, size_t len);
+void arm_clean_invalidate_cache_range_lines(addr_t start, size_t len);
+void arm_clean_dcache_all(void);
+void arm_clean_invalidate_dcache_all(void);
+#endif
+
 static inline uint32_t read_cpsr(void)
 {
     uint32_t cpsr;
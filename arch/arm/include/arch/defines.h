@@ -52,5 +52,18 @@
 #error unknown cpu
 #endif
 
+#if ARM_ISA_ARMV7A && ARM_WITH_CACHE
+/* clean and clean & invalidate ranges at least this long by set/way over the whole inner cache
+ * instead of line by line, 0 for never. set/way only reaches the caches of the cpu doing it,
+ * so it is off for SMP. app/tests cache_tests finds the crossover for a platform. */
+#ifndef ARCH_CACHE_WHOLE_THRESHOLD
+#if WITH_SMP
+#define ARCH_CACHE_WHOLE_THRESHOLD 0
+#else
+#define ARCH_CACHE_WHOLE_THRESHOLD (1024 * 1024)
+#endif
+#endif
+#endif
+
 #endif
 
@@ -257,11 +257,13 @@ SMP_MAX_CPUS ?= 4
 SMP_CPU_CLUSTER_SHIFT ?= 8
 SMP_CPU_ID_BITS ?= 24
 
+# the mmu code uses the inner shareable tlb maintenance ops on SMP
 GLOBAL_DEFINES += \
     WITH_SMP=1 \
     SMP_MAX_CPUS=$(SMP_MAX_CPUS) \
     SMP_CPU_CLUSTER_SHIFT=$(SMP_CPU_CLUSTER_SHIFT) \
-    SMP_CPU_ID_BITS=$(SMP_CPU_ID_BITS)
+    SMP_CPU_ID_BITS=$(SMP_CPU_ID_BITS) \
+    ARCH_MMU_TLB_BROADCAST=1
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/arm/mp.c
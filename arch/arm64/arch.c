@@ -27,6 +27,7 @@
 #include <arch/arm64.h>
 #include <arch/arm64/mmu.h>
 #include <arch/mp.h>
+#include <kernel/mp.h>
 #include <kernel/thread.h>
 #include <lk/init.h>
 #include <lk/main.h>
@@ -140,6 +141,9 @@ void arm64_secondary_entry(ulong asm_cpu_num)
 
     arm64_cpu_early_init();
 
+    /* help out with early boot work until the boot cpu lets us go */
+    mp_early_park(&arm_boot_cpu_lock);
+
     spin_lock(&arm_boot_cpu_lock);
     spin_unlock(&arm_boot_cpu_lock);
 
@@ -22,9 +22,13 @@
  */
 #include <stdio.h>
 #include <debug.h>
+#include <err.h>
 #include <bits.h>
 #include <arch/arch_ops.h>
 #include <arch/arm64.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 #define SHUTDOWN_ON_FATAL 1
 
@@ -51,6 +55,40 @@ static void dump_iframe(const struct arm64_iframe_long *iframe)
     printf("spsr 0x%16llx\n", iframe->spsr);
 }
 
+#if WITH_KERNEL_VM
+/* give the vmm a chance to fill in a missing page, returns true if the access can be retried */
+static bool arm64_page_fault(struct arm64_iframe_long *iframe, uint32_t ec, uint32_t iss)
+{
+    /* translation faults, at any level, mean the page is not there. permission faults on
+     * writes may be to a page that is shared copy-on-write */
+    bool is_data = (ec == 0b100100 || ec == 0b100101);
+    bool not_present = (BITS(iss, 5, 0) & 0b111100) == 0b000100;
+    bool write_perm = is_data && BIT(iss, 6) && (BITS(iss, 5, 0) & 0b111100) == 0b001100;
+    if (!not_present && !write_perm)
+        return false;
+
+    /* the vmm may block, which is only safe if the faulting code had irqs enabled */
+    if (iframe->spsr & (1 << 7))
+        return false;
+
+    uint64_t far = ARM64_READ_SYSREG(far_el1);
+
+    uint pf_flags = not_present ? VMM_PF_FLAG_NOT_PRESENT : 0;
+    if (!is_data)
+        pf_flags |= VMM_PF_FLAG_INSTRUCTION;
+    else if (BIT(iss, 6)) /* WnR */
+        pf_flags |= VMM_PF_FLAG_WRITE;
+    if (ec == 0b100000 || ec == 0b100100)
+        pf_flags |= VMM_PF_FLAG_USER;
+
+    arch_enable_ints();
+    status_t err = vmm_page_fault_handler(far, pf_flags);
+    arch_disable_ints();
+
+    return err == NO_ERROR;
+}
+#endif
+
 __WEAK void arm64_syscall(struct arm64_iframe_long *iframe, bool is_64bit)
 {
     panic("unhandled syscall vector\n");
@@ -82,10 +120,18 @@ void arm64_sync_exception(struct arm64_iframe_long *iframe)
 #endif
         case 0b100000: /* instruction abort from lower level */
         case 0b100001: /* instruction abort from same level */
+#if WITH_KERNEL_VM
+            if (arm64_page_fault(iframe, ec, iss))
+                return;
+#endif
             printf("instruction abort: PC at 0x%llx\n", iframe->elr);
             break;
         case 0b100100: /* data abort from lower level */
         case 0b100101: { /* data abort from same level */
+#if WITH_KERNEL_VM
+            if (arm64_page_fault(iframe, ec, iss))
+                return;
+#endif
             for (fault_handler = __fault_handler_table_start;
                     fault_handler < __fault_handler_table_end;
                     fault_handler++) {
@@ -85,5 +85,11 @@ static inline void arm64_fpu_pre_context_switch(struct thread *thread)
 /* overridable syscall handler */
 void arm64_syscall(struct arm64_iframe_long *iframe, bool is_64bit);
 
+/* the two ways arch_clean_cache_range and arch_clean_invalidate_cache_range pick from */
+void arm64_clean_cache_range_lines(addr_t start, size_t len);
+void arm64_clean_invalidate_cache_range_lines(addr_t start, size_t len);
+void arm64_clean_dcache_all(void);
+void arm64_clean_invalidate_dcache_all(void);
+
 __END_CDECLS
 
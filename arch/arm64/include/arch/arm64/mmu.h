@@ -334,8 +334,17 @@ __BEGIN_CDECLS
     ISB; \
 })
 
+/* tlbi without the trailing barrier, for callers that batch several */
+#define ARM64_TLBI_NOSYNC(op, val) \
+({ \
+    __asm__ volatile("tlbi " #op ", %0" :: "r" (val)); \
+})
+
 #define MMU_ARM64_GLOBAL_ASID (~0U)
 #define MMU_ARM64_USER_ASID (0U)
+
+/* TCR_EL1.AS is left clear, so only 8 bit asids are used even if the cpu has 16 */
+#define MMU_ARM64_ASID_BITS (8)
 int arm64_mmu_map(vaddr_t vaddr, paddr_t paddr, size_t size, pte_t attrs,
                   vaddr_t vaddr_base, uint top_size_shift,
                   uint top_index_shift, uint page_size_shift,
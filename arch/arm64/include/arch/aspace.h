@@ -35,6 +35,9 @@ struct arch_aspace {
 
     uint flags;
 
+    /* asid in the low MMU_ARM64_ASID_BITS, allocation generation above, 0 if never assigned */
+    uint64_t asid;
+
     /* range of address space */
     vaddr_t base;
     size_t size;
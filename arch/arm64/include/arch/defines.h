@@ -44,3 +44,14 @@
 #else
 #define CACHE_LINE 32
 #endif
+
+/* clean and clean & invalidate ranges at least this long by set/way over the whole data cache
+ * instead of line by line, 0 for never. set/way only reaches the caches of the cpu doing it,
+ * so it is off for SMP. app/tests cache_tests finds the crossover for a platform. */
+#ifndef ARCH_CACHE_WHOLE_THRESHOLD
+#if WITH_SMP
+#define ARCH_CACHE_WHOLE_THRESHOLD 0
+#else
+#define ARCH_CACHE_WHOLE_THRESHOLD (1024 * 1024)
+#endif
+#endif
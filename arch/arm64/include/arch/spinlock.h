@@ -58,10 +58,19 @@ static inline void arch_spin_lock_init(spin_lock_t *lock)
     *lock = SPIN_LOCK_INITIAL_VALUE;
 }
 
+#if WITH_SMP && ARM64_SPINLOCK_TICKET
+/* ticket lock, held while the next ticket differs from the one being served */
+static inline bool arch_spin_lock_held(spin_lock_t *lock)
+{
+    uint32_t val = *(volatile uint32_t *)lock;
+    return (val & 0xffff) != (val >> 16);
+}
+#else
 static inline bool arch_spin_lock_held(spin_lock_t *lock)
 {
     return *lock != 0;
 }
+#endif
 
 enum {
     /* Possible future flags:
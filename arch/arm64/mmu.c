@@ -25,7 +25,9 @@
 #include <assert.h>
 #include <debug.h>
 #include <err.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
+#include <lib/console.h>
 #include <lib/heap.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,6 +47,103 @@ pte_t arm64_kernel_translation_table[MMU_KERNEL_PAGE_TABLE_ENTRIES_TOP]
     __ALIGNED(MMU_KERNEL_PAGE_TABLE_ENTRIES_TOP * 8)
     __SECTION(".bss.prebss.translation_table");
 
+/*
+ * asid allocation
+ *
+ * every user aspace is tagged with an asid so that switching between them does not need
+ * to throw away the tlb. asids are handed out round robin, tagged with a generation count.
+ * when they run out the generation is bumped, the map is cleared and every cpu flushes its
+ * tlb before it next loads an asid. the asid each cpu is running with at the time of the
+ * rollover is carried over into the new generation, so running aspaces keep their asid.
+ * asid 0 is never handed out.
+ */
+#define ASID_MASK ((1ULL << MMU_ARM64_ASID_BITS) - 1)
+#define ASID_GENERATION_STEP (1ULL << MMU_ARM64_ASID_BITS)
+#define ASID_COUNT (1U << MMU_ARM64_ASID_BITS)
+
+static spin_lock_t asid_lock = SPIN_LOCK_INITIAL_VALUE;
+static uint64_t asid_generation = ASID_GENERATION_STEP;
+static uint64_t asid_map[ASID_COUNT / 64];
+static uint asid_next = 1;
+
+/* per cpu, the asid currently loaded in ttbr0 and the one kept over a rollover */
+static uint64_t asid_active[SMP_MAX_CPUS];
+static uint64_t asid_reserved[SMP_MAX_CPUS];
+static bool asid_flush_pending[SMP_MAX_CPUS];
+
+static uint64_t asid_allocations;
+static uint64_t asid_rollovers;
+
+static inline bool asid_test_and_set_locked(uint asid)
+{
+    uint64_t mask = 1ULL << (asid % 64);
+    bool was_set = asid_map[asid / 64] & mask;
+
+    asid_map[asid / 64] |= mask;
+    return was_set;
+}
+
+static void asid_rollover_locked(void)
+{
+    memset(asid_map, 0, sizeof(asid_map));
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        /* a cpu that has not switched since the last rollover is still on its reserved asid */
+        uint64_t asid = asid_active[cpu] ? asid_active[cpu] : asid_reserved[cpu];
+
+        asid_active[cpu] = 0;
+        asid_reserved[cpu] = asid;
+        if (asid)
+            asid_test_and_set_locked(asid & ASID_MASK);
+        asid_flush_pending[cpu] = true;
+    }
+
+    asid_generation += ASID_GENERATION_STEP;
+    asid_next = 1;
+    asid_rollovers++;
+}
+
+/* find an asid of the current generation for an aspace whose asid is stale or unassigned */
+static uint64_t asid_new_locked(uint64_t old)
+{
+    if (old) {
+        uint64_t updated = asid_generation | (old & ASID_MASK);
+        bool reserved = false;
+
+        /* keep an asid carried over a rollover, on every cpu it is reserved for */
+        for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+            if (asid_reserved[cpu] == old) {
+                asid_reserved[cpu] = updated;
+                reserved = true;
+            }
+        }
+        if (reserved)
+            return updated;
+
+        /* or the same number if nobody has taken it in this generation yet */
+        if (!asid_test_and_set_locked(old & ASID_MASK))
+            return updated;
+    }
+
+    for (;;) {
+        for (uint asid = asid_next; asid < ASID_COUNT; asid++) {
+            if (!asid_test_and_set_locked(asid)) {
+                asid_next = asid + 1;
+                asid_allocations++;
+                return asid_generation | asid;
+            }
+        }
+
+        asid_rollover_locked();
+    }
+}
+
+/* the asid to tag tlb maintenance for a user aspace with */
+static inline uint aspace_asid(arch_aspace_t *aspace)
+{
+    return aspace->asid & ASID_MASK;
+}
+
 static inline bool is_valid_vaddr(arch_aspace_t *aspace, vaddr_t vaddr)
 {
     return (vaddr >= aspace->base && vaddr <= aspace->base + aspace->size - 1);
@@ -308,10 +407,69 @@ static bool page_table_is_clear(pte_t *page_table, uint page_size_shift)
     return true;
 }
 
+/*
+ * tlb invalidation for an unmap is collected while walking the page tables and issued in one
+ * go, with a single barrier at the end. past ARM64_TLBI_BATCH_MAX_PAGES pages the whole asid
+ * is invalidated instead of page by page.
+ */
+#ifndef ARM64_TLBI_BATCH_MAX_PAGES
+#define ARM64_TLBI_BATCH_MAX_PAGES 64
+#endif
+
+struct tlb_batch {
+    uint asid;
+    uint page_size_shift;
+    vaddr_t start;
+    vaddr_t end;
+};
+
+static void tlb_batch_init(struct tlb_batch *batch, uint asid, uint page_size_shift)
+{
+    batch->asid = asid;
+    batch->page_size_shift = page_size_shift;
+    batch->start = batch->end = 0;
+}
+
+static void tlb_batch_add(struct tlb_batch *batch, vaddr_t vaddr, size_t size)
+{
+    if (batch->start == batch->end)
+        batch->start = vaddr;
+    batch->end = vaddr + size;
+}
+
+static void tlb_batch_flush(struct tlb_batch *batch)
+{
+    if (batch->start == batch->end)
+        return;
+
+    /* make the cleared entries visible to the table walkers before invalidating */
+    __asm__ volatile("dsb ishst" ::: "memory");
+
+    size_t pages = (batch->end - batch->start) >> batch->page_size_shift;
+    if (pages > ARM64_TLBI_BATCH_MAX_PAGES) {
+        if (batch->asid == MMU_ARM64_GLOBAL_ASID)
+            __asm__ volatile("tlbi vmalle1is" ::: "memory");
+        else
+            ARM64_TLBI_NOSYNC(aside1is, (vaddr_t)batch->asid << 48);
+    } else {
+        for (vaddr_t va = batch->start; va != batch->end; va += 1UL << batch->page_size_shift) {
+            if (batch->asid == MMU_ARM64_GLOBAL_ASID)
+                ARM64_TLBI_NOSYNC(vaae1is, va >> 12);
+            else
+                ARM64_TLBI_NOSYNC(vae1is, va >> 12 | (vaddr_t)batch->asid << 48);
+        }
+    }
+
+    __asm__ volatile("dsb ish" ::: "memory");
+    ISB;
+
+    batch->start = batch->end = 0;
+}
+
 static void arm64_mmu_unmap_pt(vaddr_t vaddr, vaddr_t vaddr_rel,
                                size_t size,
                                uint index_shift, uint page_size_shift,
-                               pte_t *page_table, uint asid)
+                               pte_t *page_table, struct tlb_batch *batch)
 {
     pte_t *next_page_table;
     vaddr_t index;
@@ -341,22 +499,20 @@ static void arm64_mmu_unmap_pt(vaddr_t vaddr, vaddr_t vaddr_rel,
             arm64_mmu_unmap_pt(vaddr, vaddr_rem, chunk_size,
                                index_shift - (page_size_shift - 3),
                                page_size_shift,
-                               next_page_table, asid);
+                               next_page_table, batch);
             if (chunk_size == block_size ||
                     page_table_is_clear(next_page_table, page_size_shift)) {
                 LTRACEF("pte %p[0x%lx] = 0 (was page table)\n", page_table, index);
                 page_table[index] = MMU_PTE_DESCRIPTOR_INVALID;
-                __asm__ volatile("dmb ishst" ::: "memory");
+                /* walkers may still hold the table, it can only go once they've been told */
+                tlb_batch_add(batch, vaddr, chunk_size);
+                tlb_batch_flush(batch);
                 free_page_table(next_page_table, page_table_paddr, page_size_shift);
             }
         } else if (pte) {
             LTRACEF("pte %p[0x%lx] = 0\n", page_table, index);
             page_table[index] = MMU_PTE_DESCRIPTOR_INVALID;
-            CF;
-            if (asid == MMU_ARM64_GLOBAL_ASID)
-                ARM64_TLBI(vaae1is, vaddr >> 12);
-            else
-                ARM64_TLBI(vae1is, vaddr >> 12 | (vaddr_t)asid << 48);
+            tlb_batch_add(batch, vaddr, chunk_size);
         } else {
             LTRACEF("pte %p[0x%lx] already clear\n", page_table, index);
         }
@@ -439,10 +595,13 @@ static int arm64_mmu_map_pt(vaddr_t vaddr_in, vaddr_t vaddr_rel_in,
 
     return 0;
 
-err:
-    arm64_mmu_unmap_pt(vaddr_in, vaddr_rel_in, size_in - size,
-                       index_shift, page_size_shift, page_table, asid);
-    DSB;
+err: {
+        struct tlb_batch batch;
+        tlb_batch_init(&batch, asid, page_size_shift);
+        arm64_mmu_unmap_pt(vaddr_in, vaddr_rel_in, size_in - size,
+                           index_shift, page_size_shift, page_table, &batch);
+        tlb_batch_flush(&batch);
+    }
     return ERR_GENERIC;
 }
 
@@ -496,9 +655,11 @@ int arm64_mmu_unmap(vaddr_t vaddr, size_t size,
         return ERR_INVALID_ARGS;
     }
 
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, asid, page_size_shift);
     arm64_mmu_unmap_pt(vaddr, vaddr_rel, size,
-                       top_index_shift, page_size_shift, top_page_table, asid);
-    DSB;
+                       top_index_shift, page_size_shift, top_page_table, &batch);
+    tlb_batch_flush(&batch);
     return 0;
 }
 
@@ -530,11 +691,12 @@ int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count
                          MMU_KERNEL_TOP_SHIFT, MMU_KERNEL_PAGE_SIZE_SHIFT,
                          aspace->tt_virt, MMU_ARM64_GLOBAL_ASID);
     } else {
+        /* user mappings are tagged with the aspace's asid */
         ret = arm64_mmu_map(vaddr, paddr, count * PAGE_SIZE,
-                         mmu_flags_to_pte_attr(flags),
+                         mmu_flags_to_pte_attr(flags) | MMU_PTE_ATTR_NON_GLOBAL,
                          0, MMU_USER_SIZE_SHIFT,
                          MMU_USER_TOP_SHIFT, MMU_USER_PAGE_SIZE_SHIFT,
-                         aspace->tt_virt, MMU_ARM64_USER_ASID);
+                         aspace->tt_virt, aspace_asid(aspace));
     }
 
     return ret;
@@ -568,12 +730,39 @@ int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
                            0, MMU_USER_SIZE_SHIFT,
                            MMU_USER_TOP_SHIFT, MMU_USER_PAGE_SIZE_SHIFT,
                            aspace->tt_virt,
-                           MMU_ARM64_USER_ASID);
+                           aspace_asid(aspace));
     }
 
     return ret;
 }
 
+uint arch_mmu_block_shift(arch_aspace_t *aspace, paddr_t paddr, size_t size)
+{
+    uint page_size_shift;
+    uint top_shift;
+
+    if (aspace->flags & ARCH_ASPACE_FLAG_KERNEL) {
+        page_size_shift = MMU_KERNEL_PAGE_SIZE_SHIFT;
+        top_shift = MMU_KERNEL_TOP_SHIFT;
+    } else {
+        page_size_shift = MMU_USER_PAGE_SIZE_SHIFT;
+        top_shift = MMU_USER_TOP_SHIFT;
+    }
+
+    /* arm64_mmu_map_pt uses a block descriptor at any level above the last one that
+     * allows it, each level covering (page_size / 8) times the one below */
+    uint best = page_size_shift;
+    for (uint shift = page_size_shift + (page_size_shift - 3);
+            shift <= MIN(top_shift, MMU_PTE_DESCRIPTOR_BLOCK_MAX_SHIFT);
+            shift += page_size_shift - 3) {
+        if (size < (1UL << shift) || !IS_ALIGNED(paddr, 1UL << shift))
+            break;
+        best = shift;
+    }
+
+    return best;
+}
+
 status_t arch_mmu_init_aspace(arch_aspace_t *aspace, vaddr_t base, size_t size, uint flags)
 {
     LTRACEF("aspace %p, base 0x%lx, size 0x%zx, flags 0x%x\n", aspace, base, size, flags);
@@ -600,6 +789,7 @@ status_t arch_mmu_init_aspace(arch_aspace_t *aspace, vaddr_t base, size_t size,
 
         aspace->base = base;
         aspace->size = size;
+        aspace->asid = 0;
 
         pte_t *va = pmm_alloc_kpages(1, NULL);
         if (!va)
@@ -644,13 +834,29 @@ void arch_mmu_context_switch(arch_aspace_t *aspace)
     if (aspace) {
         DEBUG_ASSERT((aspace->flags & ARCH_ASPACE_FLAG_KERNEL) == 0);
 
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&asid_lock, state);
+
+        uint cpu = arch_curr_cpu_num();
+        if ((aspace->asid & ~ASID_MASK) != asid_generation)
+            aspace->asid = asid_new_locked(aspace->asid);
+        asid_active[cpu] = aspace->asid;
+
+        /* entries from before a rollover may belong to asids that have been handed out again */
+        if (asid_flush_pending[cpu]) {
+            asid_flush_pending[cpu] = false;
+            ARM64_TLBI_NOADDR(vmalle1);
+            DSB;
+        }
+
+        spin_unlock_irqrestore(&asid_lock, state);
+
         tcr = MMU_TCR_FLAGS_USER;
-        ttbr = ((uint64_t)MMU_ARM64_USER_ASID << 48) | aspace->tt_phys;
+        ttbr = ((uint64_t)aspace_asid(aspace) << 48) | aspace->tt_phys;
         ARM64_WRITE_SYSREG(ttbr0_el1, ttbr);
 
         if (TRACE_CONTEXT_SWITCH)
             TRACEF("ttbr 0x%llx, tcr 0x%llx\n", ttbr, tcr);
-        ARM64_TLBI(aside1, (uint64_t)MMU_ARM64_USER_ASID << 48);
     } else {
         tcr = MMU_TCR_FLAGS_KERNEL;
 
@@ -661,3 +867,24 @@ void arch_mmu_context_switch(arch_aspace_t *aspace)
     ARM64_WRITE_SYSREG(tcr_el1, tcr);
 }
 
+#if WITH_LIB_CONSOLE
+static int cmd_asid(int argc, const cmd_args *argv)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&asid_lock, state);
+    uint64_t generation = asid_generation >> MMU_ARM64_ASID_BITS;
+    uint64_t allocations = asid_allocations;
+    uint64_t rollovers = asid_rollovers;
+    uint next = asid_next;
+    spin_unlock_irqrestore(&asid_lock, state);
+
+    printf("%u bit asids, generation %llu, next %u\n", MMU_ARM64_ASID_BITS, generation, next);
+    printf("allocations %llu, rollovers %llu\n", allocations, rollovers);
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("asid", "arm64 asid allocator stats", &cmd_asid)
+STATIC_COMMAND_END(arm64_mmu);
+#endif
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Performance counters through the PMUv3 event counters, cycles included.
+ * The dedicated cycle counter is left alone.
+ */
+#include <arch/pmu.h>
+
+#include <arch/arm64.h>
+#include <arch/ops.h>
+#include <assert.h>
+#include <bits.h>
+#include <err.h>
+#include <lk/init.h>
+#include <stdlib.h>
+#include <trace.h>
+#include <kernel/spinlock.h>
+
+#define LOCAL_TRACE 0
+
+#define PMCR_E          (1u << 0)
+#define PMCR_P          (1u << 1)
+#define PMCR_LP         (1u << 7)
+#define PMCR_N(pmcr)    (((pmcr) >> 11) & 0x1f)
+
+#define PMUVER_NONE     0x0
+#define PMUVER_V3P5     0x6
+#define PMUVER_IMPDEF   0xf
+
+/* common architectural and microarchitectural event numbers */
+#define EV_L1I_TLB_REFILL   0x02
+#define EV_L1D_CACHE_REFILL 0x03
+#define EV_L1D_CACHE        0x04
+#define EV_L1D_TLB_REFILL   0x05
+#define EV_INST_RETIRED     0x08
+#define EV_BR_MIS_PRED      0x10
+#define EV_CPU_CYCLES       0x11
+#define EV_BR_PRED          0x12
+#define EV_BR_RETIRED       0x21
+
+static const uint16_t event_number[ARCH_PMU_EVENT_COUNT] = {
+    [ARCH_PMU_EVENT_CYCLES] = EV_CPU_CYCLES,
+    [ARCH_PMU_EVENT_INSTRUCTIONS] = EV_INST_RETIRED,
+    [ARCH_PMU_EVENT_CACHE_REFS] = EV_L1D_CACHE,
+    [ARCH_PMU_EVENT_CACHE_MISSES] = EV_L1D_CACHE_REFILL,
+    [ARCH_PMU_EVENT_BRANCHES] = EV_BR_RETIRED,
+    [ARCH_PMU_EVENT_BRANCH_MISSES] = EV_BR_MIS_PRED,
+    [ARCH_PMU_EVENT_DTLB_MISSES] = EV_L1D_TLB_REFILL,
+    [ARCH_PMU_EVENT_ITLB_MISSES] = EV_L1I_TLB_REFILL,
+};
+
+static struct {
+    uint num_counters;
+    bool long_counters;
+    uint64_t common_events; /* PMCEID1:PMCEID0, one bit per event number below 64 */
+} pmu;
+
+static bool common_event_implemented(uint ev)
+{
+    return ev < 64 && (pmu.common_events & (1ull << ev));
+}
+
+/* the event number this cpu can count for event, 0 if none */
+static uint event_for(enum arch_pmu_event event)
+{
+    if (event >= ARCH_PMU_EVENT_COUNT)
+        return 0;
+
+    uint ev = event_number[event];
+    if (ev == EV_BR_RETIRED && !common_event_implemented(ev))
+        ev = EV_BR_PRED;
+
+    return common_event_implemented(ev) ? ev : 0;
+}
+
+uint arch_pmu_num_counters(void)
+{
+    return pmu.num_counters;
+}
+
+bool arch_pmu_event_supported(enum arch_pmu_event event)
+{
+    return pmu.num_counters > 0 && event_for(event) != 0;
+}
+
+status_t arch_pmu_set_event(uint counter, enum arch_pmu_event event)
+{
+    if (counter >= pmu.num_counters)
+        return ERR_INVALID_ARGS;
+    if (!arch_pmu_event_supported(event))
+        return ERR_NOT_SUPPORTED;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    ARM64_WRITE_SYSREG(pmcntenclr_el0, 1ul << counter);
+    ARM64_WRITE_SYSREG(pmovsclr_el0, 1ul << counter);
+    ARM64_WRITE_SYSREG(pmselr_el0, (uint64_t)counter);
+    /* no filter bits set, count at EL0 and EL1 */
+    ARM64_WRITE_SYSREG(pmxevtyper_el0, (uint64_t)event_for(event));
+    ARM64_WRITE_SYSREG(pmxevcntr_el0, 0ul);
+
+    uint64_t pmcr = ARM64_READ_SYSREG(pmcr_el0);
+    pmcr |= PMCR_E;
+    if (pmu.long_counters)
+        pmcr |= PMCR_LP;
+    ARM64_WRITE_SYSREG(pmcr_el0, pmcr);
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return NO_ERROR;
+}
+
+/* the event counters, leaving the cycle counter in bit 31 alone */
+static uint64_t counter_bits(void)
+{
+    return (1ul << pmu.num_counters) - 1;
+}
+
+void arch_pmu_start(void)
+{
+    if (pmu.num_counters)
+        ARM64_WRITE_SYSREG(pmcntenset_el0, counter_bits());
+}
+
+void arch_pmu_stop(void)
+{
+    if (pmu.num_counters)
+        ARM64_WRITE_SYSREG(pmcntenclr_el0, counter_bits());
+}
+
+uint64_t arch_pmu_read(uint counter)
+{
+    if (counter >= pmu.num_counters)
+        return 0;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    ARM64_WRITE_SYSREG(pmselr_el0, (uint64_t)counter);
+    uint64_t val = ARM64_READ_SYSREG(pmxevcntr_el0);
+
+    /* without PMUv3p5 the counters are 32 bits, account for one wrap */
+    if (!pmu.long_counters) {
+        val &= 0xffffffff;
+        if (ARM64_READ_SYSREG(pmovsclr_el0) & (1ul << counter))
+            val += 1ull << 32;
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return val;
+}
+
+static void arm64_pmu_init(uint level)
+{
+    uint64_t dfr0 = ARM64_READ_SYSREG(id_aa64dfr0_el1);
+    uint ver = BITS_SHIFT(dfr0, 11, 8);
+
+    if (ver == PMUVER_NONE || ver == PMUVER_IMPDEF)
+        return;
+
+    pmu.num_counters = PMCR_N(ARM64_READ_SYSREG(pmcr_el0));
+    pmu.long_counters = (ver >= PMUVER_V3P5);
+    pmu.common_events = (ARM64_READ_SYSREG(pmceid1_el0) << 32) |
+                        (ARM64_READ_SYSREG(pmceid0_el0) & 0xffffffff);
+
+    LTRACEF("pmu version %u, %u counters, events %#llx\n", ver, pmu.num_counters, pmu.common_events);
+}
+
+LK_INIT_HOOK(arm64_pmu, arm64_pmu_init, LK_INIT_LEVEL_ARCH);
@@ -2,10 +2,13 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
+# tlbi ...is reaches every cpu in the inner shareable domain
 GLOBAL_DEFINES += \
 	ARM64_CPU_$(ARM_CPU)=1 \
 	ARM_ISA_ARMV8=1 \
-	IS_64BIT=1
+	IS_64BIT=1 \
+	ARCH_MMU_TLB_BROADCAST=1 \
+	ARCH_HAS_PMU=1
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/arch.c \
@@ -13,6 +16,7 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/exceptions.S \
 	$(LOCAL_DIR)/exceptions_c.c \
 	$(LOCAL_DIR)/fpu.c \
+	$(LOCAL_DIR)/pmu.c \
 	$(LOCAL_DIR)/thread.c \
 	$(LOCAL_DIR)/spinlock.S \
 	$(LOCAL_DIR)/start.S \
@@ -41,6 +45,12 @@ GLOBAL_DEFINES += \
 
 MODULE_SRCS += \
     $(LOCAL_DIR)/mp.c
+
+# spinlock flavor, a fair ticket lock or a plain test-and-set lock
+ARM64_SPINLOCK_IMPLEMENTATION ?= ticket
+ifeq ($(ARM64_SPINLOCK_IMPLEMENTATION),ticket)
+GLOBAL_DEFINES += ARM64_SPINLOCK_TICKET=1
+endif
 else
 GLOBAL_DEFINES += \
     SMP_MAX_CPUS=1
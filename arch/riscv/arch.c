@@ -26,16 +26,32 @@
 #include <stdint.h>
 #include <arch/riscv.h>
 #include <arch/ops.h>
+#include <arch/mp.h>
+#if RISCV_S_MODE
+#include <arch/riscv/sbi.h>
+#endif
 
 #define LOCAL_TRACE 0
 
-void arch_early_init(void) {
+// run by every cpu as it comes up
+void riscv_early_init_percpu(void) {
     // set the top level exception handler
-    riscv_csr_write(mtvec, (uintptr_t)&riscv_exception_entry);
+    riscv_csr_write(RISCV_CSR_XTVEC, (uintptr_t)&riscv_exception_entry);
 
     // mask all exceptions, just in case
-    riscv_csr_clear(mstatus, RISCV_STATUS_MIE);
-    riscv_csr_clear(mie, RISCV_MIE_MTIE | RISCV_MIE_MSIE | RISCV_MIE_SEIE | RISCV_MIE_MEIE);
+    riscv_csr_clear(RISCV_CSR_XSTATUS, RISCV_STATUS_XIE);
+    riscv_csr_clear(RISCV_CSR_XIE, RISCV_IE_XSIE | RISCV_IE_XTIE | RISCV_IE_XEIE);
+#if RISCV_M_MODE
+    riscv_csr_clear(mie, RISCV_MIE_SEIE);
+#endif
+}
+
+void arch_early_init(void) {
+    riscv_early_init_percpu();
+
+#if RISCV_S_MODE
+    sbi_init();
+#endif
 
     // enable cycle counter (disabled for now, unimplemented on sifive-e)
     //riscv_csr_set(mcounteren, 1);
@@ -43,13 +59,22 @@ void arch_early_init(void) {
 
 void arch_init(void) {
     // print some arch info
+#if RISCV_M_MODE
     dprintf(INFO, "RISCV: mvendorid %#lx marchid %#lx mimpid %#lx mhartid %#lx\n",
             riscv_csr_read(mvendorid), riscv_csr_read(marchid),
             riscv_csr_read(mimpid), riscv_csr_read(mhartid));
     dprintf(INFO, "RISCV: misa %#lx\n", riscv_csr_read(misa));
+#else
+    dprintf(INFO, "RISCV: supervisor mode\n");
+#endif
+
+    // enable external interrupts, only the boot cpu takes them
+    riscv_csr_set(RISCV_CSR_XIE, RISCV_IE_XEIE);
 
-    // enable external interrupts
-    riscv_csr_set(mie, RISCV_MIE_MEIE);
+#if WITH_SMP
+    arch_mp_init_percpu();
+    riscv_start_secondary_cpus();
+#endif
 }
 
 void arch_idle(void) {
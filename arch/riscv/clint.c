@@ -26,13 +26,16 @@
 #include <err.h>
 #include <platform.h>
 #include <platform/timer.h>
+#include <arch/ops.h>
 #include <arch/riscv.h>
-#include <trace.h>
+#if RISCV_S_MODE
+#include <arch/riscv/sbi.h>
+#endif
 
 #define LOCAL_TRACE 0
 
 // platform must define these
-#ifndef ARCH_RISCV_CLINT_BASE
+#if RISCV_M_MODE && !defined(ARCH_RISCV_CLINT_BASE)
 #error Platform must define ARCH_RISCV_CLINT_BASE
 #endif
 #ifndef ARCH_RISCV_MTIME_RATE
@@ -40,57 +43,98 @@
 #endif
 
 #define CLINT_MSIP(x) (ARCH_RISCV_CLINT_BASE + 4 * (x))
-#define CLINT_MTIMECMP(x) (ARCH_RISCV_CLINT_BASE + 0x4000 + 4 * (x))
+#define CLINT_MTIMECMP(x) (ARCH_RISCV_CLINT_BASE + 0x4000 + 8 * (x))
 #define CLINT_MTIME (ARCH_RISCV_CLINT_BASE + 0xbff8)
 
+// in supervisor mode the clint belongs to the sbi, time comes from the time csr
+static uint64_t riscv_get_time(void) {
+#if RISCV_M_MODE
+    return *REG64(CLINT_MTIME);
+#else
+    ulong hi, lo;
+    do {
+        hi = riscv_csr_read(timeh);
+        lo = riscv_csr_read(time);
+    } while (hi != riscv_csr_read(timeh));
+    return ((uint64_t)hi << 32) | lo;
+#endif
+}
+
 lk_bigtime_t current_time_hires(void) {
 #if ARCH_RISCV_MTIME_RATE < 10000000
     return current_time() * 1000llu; // hack to deal with slow clocks
 #else
-    return *REG64(CLINT_MTIME) / (ARCH_RISCV_MTIME_RATE / 1000000u);
+    return riscv_get_time() / (ARCH_RISCV_MTIME_RATE / 1000000u);
 #endif
 }
 
 lk_time_t current_time(void) {
-    return *REG64(CLINT_MTIME) / (ARCH_RISCV_MTIME_RATE / 1000u);
+    return riscv_get_time() / (ARCH_RISCV_MTIME_RATE / 1000u);
 }
 
-static platform_timer_callback timer_cb;
-static void *timer_arg;
+// every hart has its own comparator, so every cpu runs its own timer
+static struct {
+    platform_timer_callback cb;
+    void *arg;
+} timers[SMP_MAX_CPUS];
+
+static void riscv_set_timer_compare(uint64_t compare) {
+#if RISCV_M_MODE
+    addr_t cmp = CLINT_MTIMECMP(riscv_current_hart());
+
+    // written a half at a time, don't let the comparator go below the new value in between
+    *REG32(cmp) = 0xffffffff;
+    *REG32(cmp + 4) = compare >> 32;
+    *REG32(cmp) = (uint32_t)compare;
+#else
+    sbi_set_timer(compare);
+#endif
+}
 
 status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg, lk_time_t interval) {
     LTRACEF("cb %p, arg %p, interval %u\n", callback, arg, interval);
 
     // disable timer
-    riscv_csr_clear(mie, RISCV_MIE_MTIE);
+    riscv_csr_clear(RISCV_CSR_XIE, RISCV_IE_XTIE);
 
-    timer_cb = callback;
-    timer_arg = arg;
+    uint cpu = arch_curr_cpu_num();
+    timers[cpu].cb = callback;
+    timers[cpu].arg = arg;
 
     // convert interval to ticks
-    uint64_t ticks = (interval * ARCH_RISCV_MTIME_RATE) / 1000u;
-    *REG64(CLINT_MTIMECMP(0)) = *REG64(CLINT_MTIME) + ticks;
+    uint64_t ticks = ((uint64_t)interval * ARCH_RISCV_MTIME_RATE) / 1000u;
+    riscv_set_timer_compare(riscv_get_time() + ticks);
 
     // enable the timer
-    riscv_csr_set(mie, RISCV_MIE_MTIE);
+    riscv_csr_set(RISCV_CSR_XIE, RISCV_IE_XTIE);
 
     return NO_ERROR;
 }
 
 void platform_stop_timer(void) {
-    riscv_csr_clear(mie, RISCV_MIE_MTIE);
+    riscv_csr_clear(RISCV_CSR_XIE, RISCV_IE_XTIE);
 }
 
 enum handler_return riscv_timer_exception(void) {
     LTRACEF("tick\n");
 
-    riscv_csr_clear(mie, RISCV_MIE_MTIE);
+    riscv_csr_clear(RISCV_CSR_XIE, RISCV_IE_XTIE);
 
+    uint cpu = arch_curr_cpu_num();
     enum handler_return ret = INT_NO_RESCHEDULE;
-    if (timer_cb) {
-        ret = timer_cb(timer_arg, current_time());
+    if (timers[cpu].cb) {
+        ret = timers[cpu].cb(timers[cpu].arg, current_time());
     }
 
     return ret;
 }
 
+#if RISCV_M_MODE
+void clint_send_ipi(uint hart_id) {
+    *REG32(CLINT_MSIP(hart_id)) = 1;
+}
+
+void clint_clear_ipi(uint hart_id) {
+    *REG32(CLINT_MSIP(hart_id)) = 0;
+}
+#endif
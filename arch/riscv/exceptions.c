@@ -30,8 +30,8 @@
 
 // keep in sync with asm.S
 struct riscv_short_iframe {
-    ulong  mepc;
-    ulong  mstatus;
+    ulong  epc;
+    ulong  status;
     ulong  ra;
     ulong  a0;
     ulong  a1;
@@ -56,28 +56,33 @@ void riscv_exception_handler(ulong cause, ulong epc, struct riscv_short_iframe *
     LTRACEF("cause %#lx epc %#lx\n", cause, epc);
 
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(frame->mstatus & RISCV_STATUS_MPIE);
+    DEBUG_ASSERT(frame->status & RISCV_STATUS_XPIE);
 
     enum handler_return ret = INT_NO_RESCHEDULE;
     switch (cause) {
-        case 0x80000007: // machine timer interrupt
+#if WITH_SMP
+        case RISCV_MCAUSE_INT | RISCV_INT_XSWI: // software interrupt, ipis
+            ret = riscv_software_exception();
+            break;
+#endif
+        case RISCV_MCAUSE_INT | RISCV_INT_XTIMER: // timer interrupt
             ret = riscv_timer_exception();
             break;
-        case 0x8000000b: // machine external interrupt
+        case RISCV_MCAUSE_INT | RISCV_INT_XEXT: // external interrupt
             ret = riscv_platform_irq();
             break;
         default:
-            TRACEF("unhandled cause %#lx, epc %#lx, mtval %#lx\n", cause, epc, riscv_csr_read(mtval));
+            TRACEF("unhandled cause %#lx, epc %#lx, tval %#lx\n", cause, epc, riscv_csr_read(RISCV_CSR_XTVAL));
             panic("stopping");
     }
 
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(frame->mstatus & RISCV_STATUS_MPIE);
+    DEBUG_ASSERT(frame->status & RISCV_STATUS_XPIE);
 
     if (ret == INT_RESCHEDULE) {
         thread_preempt();
     }
 
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(frame->mstatus & RISCV_STATUS_MPIE);
+    DEBUG_ASSERT(frame->status & RISCV_STATUS_XPIE);
 }
@@ -27,34 +27,46 @@
 #include <arch/riscv.h>
 
 static inline void arch_enable_ints(void) {
-    riscv_csr_set(mstatus, RISCV_STATUS_MIE);
+    riscv_csr_set(RISCV_CSR_XSTATUS, RISCV_STATUS_XIE);
 }
 
 static inline void arch_disable_ints(void) {
-    riscv_csr_clear(mstatus, RISCV_STATUS_MIE);
+    riscv_csr_clear(RISCV_CSR_XSTATUS, RISCV_STATUS_XIE);
 }
 
 static inline bool arch_ints_disabled(void) {
-    ulong val = riscv_csr_read(mstatus);
-    return !(val & RISCV_STATUS_MIE);
+    ulong val = riscv_csr_read(RISCV_CSR_XSTATUS);
+    return !(val & RISCV_STATUS_XIE);
 }
 
+/* amo instructions with aq and rl set, other harts may be looking */
+
 static inline int atomic_add(volatile int *ptr, int val) {
-    return __atomic_fetch_add(ptr, val, __ATOMIC_RELAXED);
+    return __atomic_fetch_add(ptr, val, __ATOMIC_SEQ_CST);
 }
 
 static inline int atomic_or(volatile int *ptr, int val) {
-    return __atomic_fetch_or(ptr, val, __ATOMIC_RELAXED);
+    return __atomic_fetch_or(ptr, val, __ATOMIC_SEQ_CST);
 }
 
 static inline int atomic_and(volatile int *ptr, int val) {
-    return __atomic_fetch_and(ptr, val, __ATOMIC_RELAXED);
+    return __atomic_fetch_and(ptr, val, __ATOMIC_SEQ_CST);
 }
 
 static inline int atomic_swap(volatile int *ptr, int val) {
-    return __atomic_exchange_n(ptr, val, __ATOMIC_RELAXED);
+    return __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST);
+}
+
+#if WITH_SMP
+/* the current thread lives in the per cpu structure pointed to by tp */
+static inline struct thread *get_current_thread(void) {
+    return riscv_get_percpu()->current_thread;
 }
 
+static inline void set_current_thread(struct thread *t) {
+    riscv_get_percpu()->current_thread = t;
+}
+#else
 /* use a global pointer to store the current_thread */
 extern struct thread *_current_thread;
 
@@ -65,16 +77,24 @@ static inline struct thread *get_current_thread(void) {
 static inline void set_current_thread(struct thread *t) {
     _current_thread = t;
 }
+#endif
 
 static inline uint32_t arch_cycle_count(void) {
     uint32_t count;
 
-    //__asm__("rdcycle %0" : "=r"(count));
+#if RISCV_S_MODE
+    __asm__ volatile("rdcycle %0" : "=r"(count));
+#else
     count = riscv_csr_read(mcycle);
+#endif
     return count;
 }
 
 static inline uint arch_curr_cpu_num(void) {
+#if WITH_SMP
+    return riscv_get_percpu()->cpu_num;
+#else
     return 0;
+#endif
 }
 
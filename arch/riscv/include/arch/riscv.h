@@ -22,27 +22,97 @@
  */
 #pragma once
 
-#define RISCV_STATUS_SIE        (1u << 2)
+#define RISCV_STATUS_SIE        (1u << 1)
 #define RISCV_STATUS_MIE        (1u << 3)
+#define RISCV_STATUS_SPIE       (1u << 5)
 #define RISCV_STATUS_MPIE       (1u << 7)
 #define RISCV_STATUS_MPP_MASK   (3u << 11)
 
+#define RISCV_MIE_SSIE          (1u << 1)
 #define RISCV_MIE_MSIE          (1u << 3)
+#define RISCV_MIE_STIE          (1u << 5)
 #define RISCV_MIE_MTIE          (1u << 7)
 #define RISCV_MIE_SEIE          (1u << 9)
 #define RISCV_MIE_MEIE          (1u << 11)
 
+#define RISCV_MIP_SSIP          (1u << 1)
 #define RISCV_MIP_MSIP          (1u << 3)
+#define RISCV_MIP_STIP          (1u << 5)
 #define RISCV_MIP_MTIP          (1u << 7)
+#define RISCV_MIP_SEIP          (1u << 9)
 #define RISCV_MIP_MEIP          (1u << 11)
 
 #define RISCV_MCAUSE_INT        (1u << 31)
 
+/* interrupt cause numbers */
+#define RISCV_INT_SSWI          1
+#define RISCV_INT_MSWI          3
+#define RISCV_INT_STIMER        5
+#define RISCV_INT_MTIMER        7
+#define RISCV_INT_SEXT          9
+#define RISCV_INT_MEXT          11
+
+/*
+ * The kernel runs either in machine mode on bare hardware, or in supervisor mode
+ * on top of an SBI implementation. The X forms refer to whichever mode is in use.
+ */
+#if RISCV_S_MODE
+#define RISCV_CSR_XSTATUS       sstatus
+#define RISCV_CSR_XIE           sie
+#define RISCV_CSR_XIP           sip
+#define RISCV_CSR_XTVEC         stvec
+#define RISCV_CSR_XEPC          sepc
+#define RISCV_CSR_XCAUSE        scause
+#define RISCV_CSR_XTVAL         stval
+#define RISCV_XRET              sret
+
+#define RISCV_STATUS_XIE        RISCV_STATUS_SIE
+#define RISCV_STATUS_XPIE       RISCV_STATUS_SPIE
+
+#define RISCV_IE_XSIE           RISCV_MIE_SSIE
+#define RISCV_IE_XTIE           RISCV_MIE_STIE
+#define RISCV_IE_XEIE           RISCV_MIE_SEIE
+#define RISCV_IP_XSIP           RISCV_MIP_SSIP
+
+#define RISCV_INT_XSWI          RISCV_INT_SSWI
+#define RISCV_INT_XTIMER        RISCV_INT_STIMER
+#define RISCV_INT_XEXT          RISCV_INT_SEXT
+#else
+#define RISCV_CSR_XSTATUS       mstatus
+#define RISCV_CSR_XIE           mie
+#define RISCV_CSR_XIP           mip
+#define RISCV_CSR_XTVEC         mtvec
+#define RISCV_CSR_XEPC          mepc
+#define RISCV_CSR_XCAUSE        mcause
+#define RISCV_CSR_XTVAL         mtval
+#define RISCV_XRET              mret
+
+#define RISCV_STATUS_XIE        RISCV_STATUS_MIE
+#define RISCV_STATUS_XPIE       RISCV_STATUS_MPIE
+
+#define RISCV_IE_XSIE           RISCV_MIE_MSIE
+#define RISCV_IE_XTIE           RISCV_MIE_MTIE
+#define RISCV_IE_XEIE           RISCV_MIE_MEIE
+#define RISCV_IP_XSIP           RISCV_MIP_MSIP
+
+#define RISCV_INT_XSWI          RISCV_INT_MSWI
+#define RISCV_INT_XTIMER        RISCV_INT_MTIMER
+#define RISCV_INT_XEXT          RISCV_INT_MEXT
+#endif
+
+#ifndef ASSEMBLY
+
+#include <sys/types.h>
+
+/* expand the csr argument first so the X aliases above can be passed in */
+#define __RISCV_CSR_STR(csr) #csr
+#define RISCV_CSR_STR(csr) __RISCV_CSR_STR(csr)
+
 #define riscv_csr_clear(csr, bits) \
 ({ \
     ulong __val = bits; \
     __asm__ volatile( \
-        "csrc   " #csr ", %0" \
+        "csrc   " RISCV_CSR_STR(csr) ", %0" \
         :: "rK" (__val) \
         : "memory"); \
 })
@@ -52,7 +122,7 @@
     ulong __val = bits; \
     ulong __val_out; \
     __asm__ volatile( \
-        "csrrc   %0, " #csr ", %1" \
+        "csrrc   %0, " RISCV_CSR_STR(csr) ", %1" \
         : "=r"(__val_out) \
         : "rK" (__val) \
         : "memory"); \
@@ -63,7 +133,7 @@
 ({ \
     ulong __val = bits; \
     __asm__ volatile( \
-        "csrs   " #csr ", %0" \
+        "csrs   " RISCV_CSR_STR(csr) ", %0" \
         :: "rK" (__val) \
         : "memory"); \
 })
@@ -72,7 +142,7 @@
 ({ \
     ulong __val; \
     __asm__ volatile( \
-        "csrr   %0, " #csr \
+        "csrr   %0, " RISCV_CSR_STR(csr) \
         : "=r" (__val) \
         :: "memory"); \
     __val; \
@@ -82,7 +152,7 @@
 ({ \
     ulong __val = (ulong)val; \
     __asm__ volatile( \
-        "csrw   " #csr ", %0" \
+        "csrw   " RISCV_CSR_STR(csr) ", %0" \
         :: "rK" (__val) \
         : "memory"); \
     __val; \
@@ -90,3 +160,47 @@
 
 void riscv_exception_entry(void);
 enum handler_return riscv_timer_exception(void);
+enum handler_return riscv_software_exception(void);
+void riscv_early_init_percpu(void);
+
+#if RISCV_M_MODE
+void clint_send_ipi(uint hart_id);
+void clint_clear_ipi(uint hart_id);
+#endif
+
+#if WITH_SMP
+struct thread;
+
+/* per cpu state, tp points at the current cpu's entry */
+struct riscv_percpu {
+    struct thread *current_thread;
+    uint cpu_num;
+    uint hart_id;
+};
+
+extern struct riscv_percpu riscv_percpu[SMP_MAX_CPUS];
+
+static inline struct riscv_percpu *riscv_get_percpu(void) {
+    struct riscv_percpu *p;
+    __asm__ volatile("mv %0, tp" : "=r"(p));
+    return p;
+}
+
+void riscv_percpu_init(uint hart_id, uint cpu_num);
+void riscv_secondary_entry(uint hart_id, uint cpu_num);
+void riscv_secondary_start(void);
+void riscv_start_secondary_cpus(void);
+#endif
+
+/* the hart the calling code runs on */
+static inline uint riscv_current_hart(void) {
+#if RISCV_M_MODE
+    return riscv_csr_read(mhartid);
+#elif WITH_SMP
+    return riscv_get_percpu()->hart_id;
+#else
+    return 0;
+#endif
+}
+
+#endif // !ASSEMBLY
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* legacy (v0.1) extensions, one call each */
+#define SBI_EXT_0_1_SET_TIMER       0x0
+#define SBI_EXT_0_1_SEND_IPI        0x4
+
+/* v0.2+ extensions */
+#define SBI_EXT_BASE                0x10
+#define SBI_EXT_TIME                0x54494d45
+#define SBI_EXT_IPI                 0x735049
+#define SBI_EXT_HSM                 0x48534d
+
+#define SBI_BASE_GET_SPEC_VERSION   0
+#define SBI_BASE_PROBE_EXTENSION    3
+
+#define SBI_SUCCESS                 0
+#define SBI_ERR_NOT_SUPPORTED       -2
+#define SBI_ERR_INVALID_PARAM       -3
+#define SBI_ERR_ALREADY_AVAILABLE   -6
+
+__BEGIN_CDECLS
+
+struct sbiret {
+    long error;
+    long value;
+};
+
+/* find out which extensions the sbi implementation has, falls back to the legacy calls */
+void sbi_init(void);
+
+void sbi_set_timer(uint64_t stime_value);
+status_t sbi_send_ipi(ulong hart_mask);
+
+/* start a stopped hart at start_addr with a0 = hart id, a1 = opaque, in supervisor mode */
+status_t sbi_hart_start(ulong hart_id, ulong start_addr, ulong opaque);
+
+__END_CDECLS
@@ -25,10 +25,6 @@
 #include <arch/ops.h>
 #include <stdbool.h>
 
-#if WITH_SMP
-#error microblaze does not support SMP
-#endif
-
 #define SPIN_LOCK_INITIAL_VALUE (0)
 
 typedef unsigned int spin_lock_t;
@@ -36,6 +32,23 @@ typedef unsigned int spin_lock_t;
 typedef unsigned long spin_lock_saved_state_t;
 typedef unsigned int spin_lock_save_flags_t;
 
+#if WITH_SMP
+/* amoswap.w.aq to take the lock, spinning on plain loads while it is held */
+static inline void arch_spin_lock(spin_lock_t *lock) {
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+            ;
+    }
+}
+
+static inline int arch_spin_trylock(spin_lock_t *lock) {
+    return __atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void arch_spin_unlock(spin_lock_t *lock) {
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+#else
 static inline void arch_spin_lock(spin_lock_t *lock) {
     *lock = 1;
 }
@@ -47,6 +60,7 @@ static inline int arch_spin_trylock(spin_lock_t *lock) {
 static inline void arch_spin_unlock(spin_lock_t *lock) {
     *lock = 0;
 }
+#endif
 
 static inline void arch_spin_lock_init(spin_lock_t *lock) {
     *lock = SPIN_LOCK_INITIAL_VALUE;
@@ -61,13 +75,13 @@ static inline bool arch_spin_lock_held(spin_lock_t *lock) {
 
 static inline void
 arch_interrupt_save(spin_lock_saved_state_t *statep, spin_lock_save_flags_t flags) {
-    /* disable interrupts by clearing the MIE bit while atomically saving the old state */
-    *statep = riscv_csr_read_clear(mstatus, RISCV_STATUS_MIE) & RISCV_STATUS_MIE;
+    /* disable interrupts by clearing the xIE bit while atomically saving the old state */
+    *statep = riscv_csr_read_clear(RISCV_CSR_XSTATUS, RISCV_STATUS_XIE) & RISCV_STATUS_XIE;
 }
 
 static inline void
 arch_interrupt_restore(spin_lock_saved_state_t old_state, spin_lock_save_flags_t flags) {
-    /* drop the old MIE flag into the status register */
-    riscv_csr_set(mstatus, old_state);
+    /* drop the old xIE flag into the status register */
+    riscv_csr_set(RISCV_CSR_XSTATUS, old_state);
 }
 
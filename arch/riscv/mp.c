@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/mp.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <arch/riscv.h>
+#include <kernel/mp.h>
+#include <lk/init.h>
+#include <lk/main.h>
+#if RISCV_S_MODE
+#include <arch/riscv/sbi.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+struct riscv_percpu riscv_percpu[SMP_MAX_CPUS];
+
+/* mp_ipi_t bits waiting to be handled, per cpu */
+static volatile int ipi_pending[SMP_MAX_CPUS];
+
+/* cpus that got as far as arch_mp_init_percpu(), ipis are only sent to these */
+static volatile int cpus_up;
+
+void riscv_percpu_init(uint hart_id, uint cpu_num) {
+    struct riscv_percpu *percpu = &riscv_percpu[cpu_num];
+
+    percpu->cpu_num = cpu_num;
+    percpu->hart_id = hart_id;
+    __asm__ volatile("mv tp, %0" :: "r"(percpu));
+}
+
+status_t arch_mp_send_ipi(mp_cpu_mask_t target, mp_ipi_t ipi) {
+    LTRACEF("target 0x%x, ipi %u\n", target, ipi);
+
+    if (ipi > MP_IPI_TLB_SHOOTDOWN)
+        return ERR_INVALID_ARGS;
+
+    if (target == MP_CPU_ALL_BUT_LOCAL)
+        target &= ~(1U << arch_curr_cpu_num());
+    target &= cpus_up;
+
+#if RISCV_S_MODE
+    ulong hart_mask = 0;
+#endif
+    while (target) {
+        uint cpu = __builtin_ctz(target);
+        target &= ~(1U << cpu);
+
+        /* post the ipi before raising the interrupt, the handler clears the interrupt first */
+        atomic_or(&ipi_pending[cpu], 1 << ipi);
+#if RISCV_M_MODE
+        clint_send_ipi(riscv_percpu[cpu].hart_id);
+#else
+        hart_mask |= 1UL << riscv_percpu[cpu].hart_id;
+#endif
+    }
+
+#if RISCV_S_MODE
+    if (hart_mask)
+        return sbi_send_ipi(hart_mask);
+#endif
+    return NO_ERROR;
+}
+
+enum handler_return riscv_software_exception(void) {
+    struct riscv_percpu *percpu = riscv_get_percpu();
+
+#if RISCV_M_MODE
+    clint_clear_ipi(percpu->hart_id);
+#else
+    riscv_csr_clear(sip, RISCV_MIP_SSIP);
+#endif
+
+    int pending = atomic_swap(&ipi_pending[percpu->cpu_num], 0);
+    LTRACEF("cpu %u, pending %#x\n", percpu->cpu_num, pending);
+
+    enum handler_return ret = INT_NO_RESCHEDULE;
+    if (pending & (1 << MP_IPI_RESCHEDULE))
+        ret = mp_mbx_reschedule_irq();
+    if (pending & (1 << MP_IPI_TLB_SHOOTDOWN)) {
+        if (mp_mbx_tlb_shootdown_irq() == INT_RESCHEDULE)
+            ret = INT_RESCHEDULE;
+    }
+
+    return ret;
+}
+
+void arch_mp_init_percpu(void) {
+    atomic_or(&cpus_up, 1 << arch_curr_cpu_num());
+    riscv_csr_set(RISCV_CSR_XIE, RISCV_IE_XSIE);
+}
+
+void riscv_start_secondary_cpus(void) {
+    uint boot_hart = riscv_get_percpu()->hart_id;
+
+    /* there is no discovery of the harts, the build says how many to use. harts are
+     * assumed to be numbered contiguously from RISCV_BOOT_HART */
+    lk_init_secondary_cpus(SMP_MAX_CPUS - 1);
+
+    uint hart = RISCV_BOOT_HART;
+    for (uint cpu = 1; cpu < SMP_MAX_CPUS; cpu++, hart++) {
+        if (hart == boot_hart)
+            hart++;
+
+#if RISCV_M_MODE
+        /* the hart is waiting in start.S for its software interrupt */
+        clint_send_ipi(hart);
+#else
+        status_t err = sbi_hart_start(hart, (ulong)&riscv_secondary_start, cpu);
+        if (err < 0)
+            dprintf(INFO, "RISCV: hart %u did not start, err %d\n", hart, err);
+#endif
+    }
+}
+
+void riscv_secondary_entry(uint hart_id, uint cpu_num) {
+    riscv_percpu_init(hart_id, cpu_num);
+    riscv_early_init_percpu();
+
+    LTRACEF("hart %u, cpu %u\n", hart_id, cpu_num);
+
+    lk_init_level(LK_INIT_FLAG_SECONDARY_CPUS, LK_INIT_LEVEL_EARLIEST, LK_INIT_LEVEL_THREADING - 1);
+
+    arch_mp_init_percpu();
+
+    dprintf(INFO, "RISCV: cpu %u (hart %u) up\n", cpu_num, hart_id);
+
+    lk_secondary_cpu_entry();
+}
@@ -9,8 +9,31 @@ MODULE_SRCS += $(LOCAL_DIR)/clint.c
 MODULE_SRCS += $(LOCAL_DIR)/exceptions.c
 MODULE_SRCS += $(LOCAL_DIR)/thread.c
 
+# machine mode on bare hardware, or supervisor mode on top of an sbi implementation
+RISCV_MODE ?= machine
+ifeq ($(RISCV_MODE),supervisor)
+GLOBAL_DEFINES += RISCV_S_MODE=1
+MODULE_SRCS += $(LOCAL_DIR)/sbi.c
+else ifeq ($(RISCV_MODE),machine)
+GLOBAL_DEFINES += RISCV_M_MODE=1
+else
+$(error unknown RISCV_MODE $(RISCV_MODE))
+endif
+
+# the hart that starts the kernel, harts below it are left parked
+RISCV_BOOT_HART ?= 0
+GLOBAL_DEFINES += RISCV_BOOT_HART=$(RISCV_BOOT_HART)
+
+ifeq ($(WITH_SMP),1)
+SMP_MAX_CPUS ?= 4
+GLOBAL_DEFINES += \
+	WITH_SMP=1 \
+	SMP_MAX_CPUS=$(SMP_MAX_CPUS)
+MODULE_SRCS += $(LOCAL_DIR)/mp.c
+else
 GLOBAL_DEFINES += \
 	SMP_MAX_CPUS=1
+endif
 
 # set the default toolchain to riscv32 elf and set a #define
 ifndef TOOLCHAIN_PREFIX
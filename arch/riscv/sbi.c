@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/riscv/sbi.h>
+
+#include <debug.h>
+#include <err.h>
+#include <stdbool.h>
+#include <trace.h>
+
+#define LOCAL_TRACE 0
+
+static bool sbi_has_time;
+static bool sbi_has_ipi;
+static bool sbi_has_hsm;
+
+static struct sbiret sbi_call(ulong ext, ulong fid, ulong arg0, ulong arg1, ulong arg2) {
+    register ulong a0 __asm__("a0") = arg0;
+    register ulong a1 __asm__("a1") = arg1;
+    register ulong a2 __asm__("a2") = arg2;
+    register ulong a6 __asm__("a6") = fid;
+    register ulong a7 __asm__("a7") = ext;
+
+    __asm__ volatile("ecall"
+                     : "+r"(a0), "+r"(a1)
+                     : "r"(a2), "r"(a6), "r"(a7)
+                     : "memory");
+
+    struct sbiret ret = { .error = (long)a0, .value = (long)a1 };
+    return ret;
+}
+
+static status_t sbi_to_status(long error) {
+    switch (error) {
+        case SBI_SUCCESS:
+            return NO_ERROR;
+        case SBI_ERR_NOT_SUPPORTED:
+            return ERR_NOT_SUPPORTED;
+        case SBI_ERR_INVALID_PARAM:
+            return ERR_INVALID_ARGS;
+        case SBI_ERR_ALREADY_AVAILABLE:
+            return ERR_ALREADY_STARTED;
+        default:
+            return ERR_GENERIC;
+    }
+}
+
+static bool sbi_probe(ulong ext) {
+    struct sbiret ret = sbi_call(SBI_EXT_BASE, SBI_BASE_PROBE_EXTENSION, ext, 0, 0);
+    return ret.error == SBI_SUCCESS && ret.value != 0;
+}
+
+void sbi_init(void) {
+    /* a legacy implementation fails the base extension outright */
+    struct sbiret ret = sbi_call(SBI_EXT_BASE, SBI_BASE_GET_SPEC_VERSION, 0, 0, 0);
+    if (ret.error != SBI_SUCCESS) {
+        dprintf(INFO, "SBI: legacy implementation\n");
+        return;
+    }
+
+    sbi_has_time = sbi_probe(SBI_EXT_TIME);
+    sbi_has_ipi = sbi_probe(SBI_EXT_IPI);
+    sbi_has_hsm = sbi_probe(SBI_EXT_HSM);
+
+    dprintf(INFO, "SBI: spec version %lu.%lu, time %d ipi %d hsm %d\n",
+            ((ulong)ret.value >> 24) & 0x7f, (ulong)ret.value & 0xffffff,
+            sbi_has_time, sbi_has_ipi, sbi_has_hsm);
+}
+
+void sbi_set_timer(uint64_t stime_value) {
+    /* rv32 passes the 64 bit value split over a0 and a1 */
+    if (sbi_has_time)
+        sbi_call(SBI_EXT_TIME, 0, (ulong)stime_value, (ulong)(stime_value >> 32), 0);
+    else
+        sbi_call(SBI_EXT_0_1_SET_TIMER, 0, (ulong)stime_value, (ulong)(stime_value >> 32), 0);
+}
+
+status_t sbi_send_ipi(ulong hart_mask) {
+    LTRACEF("mask %#lx\n", hart_mask);
+
+    if (sbi_has_ipi)
+        return sbi_to_status(sbi_call(SBI_EXT_IPI, 0, hart_mask, 0, 0).error);
+
+    /* the legacy call takes a pointer to the mask */
+    return sbi_to_status(sbi_call(SBI_EXT_0_1_SEND_IPI, 0, (ulong)&hart_mask, 0, 0).error);
+}
+
+status_t sbi_hart_start(ulong hart_id, ulong start_addr, ulong opaque) {
+    LTRACEF("hart %lu, start %#lx, opaque %#lx\n", hart_id, start_addr, opaque);
+
+    if (!sbi_has_hsm)
+        return ERR_NOT_SUPPORTED;
+
+    return sbi_to_status(sbi_call(SBI_EXT_HSM, 0, hart_id, start_addr, opaque).error);
+}
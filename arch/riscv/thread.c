@@ -31,7 +31,9 @@
 
 #define LOCAL_TRACE 0
 
+#if !WITH_SMP
 struct thread *_current_thread;
+#endif
 
 static void initial_thread_func(void) __NO_RETURN;
 static void initial_thread_func(void) {
@@ -368,6 +368,18 @@ static void update_pml4_entry(vaddr_t vaddr, addr_t pml4_addr, map_addr_t m, arc
         pml4_table[pml4_index] |= X86_MMU_PG_G; /* setting global flag for kernel pages */
 }
 
+static void update_pd_large_entry(vaddr_t vaddr, paddr_t paddr, uint64_t pdpe, arch_flags_t flags)
+{
+    uint32_t pd_index;
+
+    uint64_t *pd_table = (uint64_t *)(pdpe & X86_PG_FRAME);
+    pd_index = (((uint64_t)vaddr >> PD_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
+    pd_table[pd_index] = (uint64_t)paddr;
+    pd_table[pd_index] |= flags | X86_MMU_PG_P | X86_MMU_PG_PS;
+    if (!(flags & X86_MMU_PG_U))
+        pd_table[pd_index] |= X86_MMU_PG_G; /* setting global flag for kernel pages */
+}
+
 /**
  * @brief Allocating a new page table
  */
@@ -440,9 +452,16 @@ status_t x86_mmu_add_mapping(map_addr_t pml4, map_addr_t paddr,
         X86_SET_FLAG(pd_new);
     }
 
-    if (!pd_new)
+    if (!pd_new) {
         pde = get_pd_entry_from_pd_table(vaddr, pdpe);
 
+        /* already covered by a 2MB page */
+        if ((pde & X86_MMU_PG_P) && (pde & X86_MMU_PG_PS)) {
+            ret = ERR_ALREADY_EXISTS;
+            goto clean;
+        }
+    }
+
     if (pd_new || (pde & X86_MMU_PG_P) == 0) {
         /* Creating a new pt */
         m  = _map_alloc_page();
@@ -474,6 +493,140 @@ clean:
     return ret;
 }
 
+/**
+ * @brief  Add a new 2MB mapping for the given virtual address & physical address
+ *
+ * Both addresses must be 2MB aligned. The mapping is made with a single page directory
+ * entry, creating the upper level tables as needed. Returns ERR_ALREADY_EXISTS if the
+ * page directory entry is already in use, in which case the caller should fall back
+ * to 4KB pages.
+ *
+ */
+static status_t x86_mmu_add_large_mapping(map_addr_t pml4, map_addr_t paddr,
+                                          vaddr_t vaddr, arch_flags_t mmu_flags)
+{
+    uint64_t pml4e, pdpe = 0, pde;
+    map_addr_t *m;
+
+    LTRACEF("pml4 0x%llx paddr 0x%llx vaddr 0x%lx flags 0x%llx\n", pml4, paddr, vaddr, mmu_flags);
+
+    DEBUG_ASSERT(pml4);
+    DEBUG_ASSERT(IS_ALIGNED(vaddr, 1UL << PD_SHIFT));
+    DEBUG_ASSERT(IS_ALIGNED(paddr, 1UL << PD_SHIFT));
+    if ((!x86_mmu_check_vaddr(vaddr)) || (!x86_mmu_check_paddr(paddr)) )
+        return ERR_INVALID_ARGS;
+
+    pml4e = get_pml4_entry_from_pml4_table(vaddr, pml4);
+    if ((pml4e & X86_MMU_PG_P) == 0) {
+        /* Creating a new pdp table */
+        m = _map_alloc_page();
+        if (m == NULL)
+            return ERR_NO_MEMORY;
+
+        update_pml4_entry(vaddr, pml4, X86_VIRT_TO_PHYS(m), get_x86_arch_flags(mmu_flags));
+        pml4e = (uint64_t)m;
+    } else {
+        pdpe = get_pdp_entry_from_pdp_table(vaddr, pml4e);
+    }
+
+    if ((pdpe & X86_MMU_PG_P) == 0) {
+        /* Creating a new pd table. an empty pdp table left behind on failure is harmless */
+        m = _map_alloc_page();
+        if (m == NULL)
+            return ERR_NO_MEMORY;
+
+        update_pdp_entry(vaddr, pml4e, X86_VIRT_TO_PHYS(m), get_x86_arch_flags(mmu_flags));
+        pdpe = (uint64_t)m;
+    } else if (pdpe & X86_MMU_PG_PS) {
+        /* already covered by a 1GB page */
+        return ERR_ALREADY_EXISTS;
+    }
+
+    pde = get_pd_entry_from_pd_table(vaddr, pdpe);
+    if (pde & X86_MMU_PG_P)
+        return ERR_ALREADY_EXISTS;
+
+    update_pd_large_entry(vaddr, paddr, pdpe, get_x86_arch_flags(mmu_flags));
+    return NO_ERROR;
+}
+
+uint arch_mmu_block_shift(arch_aspace_t *aspace, paddr_t paddr, size_t size)
+{
+    /* 2MB pages at the page directory level */
+    if (size >= (1UL << PD_SHIFT) && IS_ALIGNED(paddr, 1UL << PD_SHIFT))
+        return PD_SHIFT;
+
+    return PAGE_SIZE_SHIFT;
+}
+
+/* past this many pages an unmap flushes the whole tlb instead of page by page */
+#ifndef X86_MMU_UNMAP_FLUSH_THRESHOLD
+#define X86_MMU_UNMAP_FLUSH_THRESHOLD 32
+#endif
+
+#define X86_CR3_PCID_MASK 0xfffULL
+#define X86_KERNEL_PCID 0
+
+static inline void x86_invlpg(vaddr_t vaddr)
+{
+    __asm__ __volatile__ ("invlpg (%0)" :: "r" (vaddr) : "memory");
+}
+
+/* set up by x86_mmu_early_init() from cpuid */
+static bool x86_pcid_enabled;
+static bool x86_invpcid_avail;
+
+/* flush the local tlb, including global kernel pages */
+static void x86_tlb_flush_all(void)
+{
+    uint64_t cr4 = x86_get_cr4();
+
+    if (x86_invpcid_avail) {
+        x86_invpcid(X86_INVPCID_ALL_GLOBAL, 0, 0);
+    } else if (cr4 & X86_CR4_PGE) {
+        x86_set_cr4(cr4 & ~X86_CR4_PGE);
+        x86_set_cr4(cr4);
+    } else {
+        x86_set_cr3(x86_get_cr3());
+    }
+}
+
+static inline uint16_t x86_current_pcid(void)
+{
+    return x86_pcid_enabled ? (x86_get_cr3() & X86_CR3_PCID_MASK) : 0;
+}
+
+/* drop the translations for a range of pages tagged with pcid */
+static void x86_tlb_invalidate_range(uint16_t pcid, vaddr_t vaddr, uint count)
+{
+    bool current = (pcid == x86_current_pcid());
+
+    if (!current && !x86_invpcid_avail) {
+        /* no way to reach another context's entries selectively */
+        x86_tlb_flush_all();
+    } else if (count > X86_MMU_UNMAP_FLUSH_THRESHOLD) {
+        if (current || pcid == X86_KERNEL_PCID)
+            x86_tlb_flush_all();
+        else
+            x86_invpcid(X86_INVPCID_CONTEXT, pcid, 0);
+    } else {
+        for (uint i = 0; i < count; i++) {
+            if (current)
+                x86_invlpg(vaddr + i * PAGE_SIZE);
+            else
+                x86_invpcid(X86_INVPCID_ADDR, pcid, vaddr + i * PAGE_SIZE);
+        }
+    }
+}
+
+void arch_mmu_invalidate_local(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
+{
+    if (count == 0)
+        x86_tlb_flush_all();
+    else
+        x86_tlb_invalidate_range(aspace ? aspace->pcid : X86_KERNEL_PCID, vaddr, count);
+}
+
 /**
  * @brief  x86-64 MMU unmap an entry in the page tables recursively and clear out tables
  *
@@ -513,6 +666,13 @@ static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, vaddr_t table_entry)
             LTRACEF_LEVEL(2, "next_table_addr %p\n", next_table_addr);
             if ((X86_PHYS_TO_VIRT(table[offset]) & X86_MMU_PG_P) == 0)
                 return;
+            if (table[offset] & X86_MMU_PG_PS) {
+                /* a 2MB page, drop the whole thing */
+                arch_disable_ints();
+                table[offset] = table[offset] & X86_PTE_NOT_PRESENT;
+                arch_enable_ints();
+                return;
+            }
             break;
         case PT_L:
             offset = (((uint64_t)vaddr >> PT_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
@@ -555,7 +715,7 @@ static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, vaddr_t table_entry)
     }
 }
 
-status_t x86_mmu_unmap(map_addr_t pml4, vaddr_t vaddr, uint count)
+static status_t x86_mmu_unmap_pcid(map_addr_t pml4, vaddr_t vaddr, uint count, uint16_t pcid)
 {
     vaddr_t next_aligned_v_addr;
 
@@ -566,15 +726,25 @@ status_t x86_mmu_unmap(map_addr_t pml4, vaddr_t vaddr, uint count)
     if (count == 0)
         return NO_ERROR;
 
+    uint pages = count;
     next_aligned_v_addr = vaddr;
     while (count > 0) {
         x86_mmu_unmap_entry(next_aligned_v_addr, X86_PAGING_LEVELS, pml4);
         next_aligned_v_addr += PAGE_SIZE;
         count--;
     }
+
+    /* invalidate once the tables are updated, rather than per entry */
+    x86_tlb_invalidate_range(pcid, vaddr, pages);
+
     return NO_ERROR;
 }
 
+status_t x86_mmu_unmap(map_addr_t pml4, vaddr_t vaddr, uint count)
+{
+    return x86_mmu_unmap_pcid(pml4, vaddr, count, x86_current_pcid());
+}
+
 int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
 {
     addr_t current_cr3_val;
@@ -592,7 +762,7 @@ int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
     DEBUG_ASSERT(x86_get_cr3());
     current_cr3_val = (addr_t)x86_get_cr3();
 
-    return (x86_mmu_unmap(X86_PHYS_TO_VIRT(current_cr3_val), vaddr, count));
+    return (x86_mmu_unmap_pcid(X86_PHYS_TO_VIRT(current_cr3_val), vaddr, count, aspace->pcid));
 }
 
 /**
@@ -623,6 +793,23 @@ status_t x86_mmu_map_range(map_addr_t pml4, struct map_range *range, arch_flags_
     next_aligned_p_addr = range->start_paddr;
 
     for (index = 0; index < no_of_pages; index++) {
+        /* use 2MB pages where both addresses line up and the rest of the range covers one */
+        if (IS_ALIGNED(next_aligned_v_addr | next_aligned_p_addr, 1UL << PD_SHIFT) &&
+                no_of_pages - index >= (1UL << (PD_SHIFT - PAGE_DIV_SHIFT))) {
+            map_status = x86_mmu_add_large_mapping(pml4, next_aligned_p_addr, next_aligned_v_addr, flags);
+            if (map_status == NO_ERROR) {
+                index += (1UL << (PD_SHIFT - PAGE_DIV_SHIFT)) - 1;
+                next_aligned_v_addr += 1UL << PD_SHIFT;
+                next_aligned_p_addr += 1UL << PD_SHIFT;
+                continue;
+            }
+            if (map_status != ERR_ALREADY_EXISTS) {
+                dprintf(SPEW, "Add large mapping failed with err=%d\n", map_status);
+                x86_mmu_unmap(pml4, range->start_vaddr, index);
+                return map_status;
+            }
+        }
+
         map_status = x86_mmu_add_mapping(pml4, next_aligned_p_addr, next_aligned_v_addr, flags);
         if (map_status) {
             dprintf(SPEW, "Add mapping failed with err=%d\n", map_status);
@@ -696,7 +883,7 @@ int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count
     return (x86_mmu_map_range(X86_PHYS_TO_VIRT(current_cr3_val), &range, flags));
 }
 
-void x86_mmu_early_init(void)
+void x86_mmu_percpu_init(void)
 {
     volatile uint64_t efer_msr, cr0, cr4;
 
@@ -711,12 +898,26 @@ void x86_mmu_early_init(void)
         cr4 |= X86_CR4_SMEP;
     if (check_smap_avail())
         cr4 |=X86_CR4_SMAP;
+    if (x86_pcid_enabled)
+        cr4 |= X86_CR4_PCIDE;
     x86_set_cr4(cr4);
 
     /* Set NXE bit in MSR_EFER*/
     efer_msr = read_msr(x86_MSR_EFER);
     efer_msr |= x86_EFER_NXE;
     write_msr(x86_MSR_EFER, efer_msr);
+}
+
+void x86_mmu_early_init(void)
+{
+    /* tag tlb entries with process context ids, the kernel runs as pcid 0, which is what
+     * the low bits of cr3 hold at this point */
+    if (check_pcid_avail() && (x86_get_cr3() & X86_CR3_PCID_MASK) == 0) {
+        x86_pcid_enabled = true;
+        x86_invpcid_avail = check_invpcid_avail();
+    }
+
+    x86_mmu_percpu_init();
 
     /* getting the address width from CPUID instr */
     /* Bits 07-00: Physical Address width info */
@@ -726,6 +927,7 @@ void x86_mmu_early_init(void)
     g_vaddr_width = (uint8_t)((addr_width >> 8) & 0xFF);
 
     LTRACEF("paddr_width %u vaddr_width %u\n", g_paddr_width, g_vaddr_width);
+    LTRACEF("pcid %d invpcid %d\n", x86_pcid_enabled, x86_invpcid_avail);
 
     /* unmap the lower identity mapping */
     pml4[0] = 0;
@@ -734,6 +936,15 @@ void x86_mmu_early_init(void)
     x86_set_cr3(x86_get_cr3());
 }
 
+void x86_mmu_map_low_identity(bool map)
+{
+    /* pdp still holds the boot mapping start.S built, it is a kernel image address */
+    paddr_t pdp_phys = (vaddr_t)pdp - KERNEL_BASE + MEMBASE;
+
+    pml4[0] = map ? (pdp_phys | X86_KERNEL_PD_FLAGS) : 0;
+    x86_tlb_flush_all();
+}
+
 void x86_mmu_init(void)
 {
 }
@@ -750,6 +961,8 @@ status_t arch_mmu_init_aspace(arch_aspace_t *aspace, vaddr_t base, size_t size,
         return ERR_NOT_SUPPORTED;
     }
 
+    aspace->pcid = X86_KERNEL_PCID;
+
     return NO_ERROR;
 }
 
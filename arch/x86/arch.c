@@ -28,8 +28,13 @@
 #include <arch/x86.h>
 #include <arch/x86/mmu.h>
 #include <arch/x86/descriptor.h>
+#include <arch/x86/mp.h>
 #include <arch/fpu.h>
 #include <arch/mmu.h>
+#if WITH_SMP
+#include <arch/mp.h>
+#include <arch/x86/apic.h>
+#endif
 #include <platform.h>
 #include <sys/types.h>
 #include <string.h>
@@ -41,30 +46,43 @@ uint8_t _kstack[PAGE_SIZE] __ALIGNED(8);
 /* make sure it lives in .data to avoid it being wiped out by bss clearing */
 __SECTION(".data") void *_multiboot_info;
 
-/* main tss */
-static tss_t system_tss;
+/* main tss, one per cpu */
+static tss_t system_tss[SMP_MAX_CPUS];
 
-void arch_early_init(void)
+void x86_tss_init_percpu(uint cpu_num)
 {
-    /* enable caches here for now */
-    clear_in_cr0(X86_CR0_NW | X86_CR0_CD);
+    tss_t *tss = &system_tss[cpu_num];
 
-    memset(&system_tss, 0, sizeof(system_tss));
+    memset(tss, 0, sizeof(*tss));
 
 #if ARCH_X86_32
-    system_tss.esp0 = 0;
-    system_tss.ss0 = DATA_SELECTOR;
-    system_tss.ss1 = 0;
-    system_tss.ss2 = 0;
-    system_tss.eflags = 0x00003002;
-    system_tss.bitmap = offsetof(tss_32_t, tss_bitmap);
-    system_tss.trace = 1; // trap on hardware task switch
+    tss->esp0 = 0;
+    tss->ss0 = DATA_SELECTOR;
+    tss->ss1 = 0;
+    tss->ss2 = 0;
+    tss->eflags = 0x00003002;
+    tss->bitmap = offsetof(tss_32_t, tss_bitmap);
+    tss->trace = 1; // trap on hardware task switch
 #endif
 
-    set_global_desc(TSS_SELECTOR, &system_tss, sizeof(system_tss), 1, 0, 0, SEG_TYPE_TSS, 0, 0);
-    x86_ltr(TSS_SELECTOR);
+    set_global_desc(TSS_SELECTOR_CPU(cpu_num), tss, sizeof(*tss), 1, 0, 0, SEG_TYPE_TSS, 0, 0);
+    x86_ltr(TSS_SELECTOR_CPU(cpu_num));
+}
+
+void arch_early_init(void)
+{
+    /* enable caches here for now */
+    clear_in_cr0(X86_CR0_NW | X86_CR0_CD);
+
+    x86_tss_init_percpu(0);
 
     x86_mmu_early_init();
+
+#if WITH_SMP
+    /* the platform timer code calibrates the local apic timer right after this */
+    lapic_init_percpu();
+    x86_percpu[0].apic_id = lapic_id();
+#endif
 }
 
 void arch_init(void)
@@ -74,6 +92,11 @@ void arch_init(void)
 #ifdef X86_WITH_FPU
     fpu_init();
 #endif
+
+#if WITH_SMP
+    arch_mp_init_percpu();
+    x86_mp_init();
+#endif
 }
 
 void arch_chain_load(void *entry, ulong arg0, ulong arg1, ulong arg2, ulong arg3)
@@ -74,7 +74,7 @@ void set_global_desc(seg_sel_t sel, void *base, uint32_t limit,
     _gdt[index].seg_desc_legacy.d_b     = bits != 0;    // 16 / 32 bit
 
 #ifdef ARCH_X86_64
-    if (TSS_SELECTOR == sel) {
+    if (sel >= TSS_SELECTOR) {
         _gdt[index + 1].seg_desc_64.base_63_32  = (uint32_t)((uintptr_t) base >> 32);
         _gdt[index + 1].seg_desc_64.reserved_1  = 0;
     }
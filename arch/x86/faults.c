@@ -23,9 +23,17 @@
  */
 #include <debug.h>
 #include <trace.h>
+#include <err.h>
 #include <arch/x86.h>
 #include <arch/fpu.h>
 #include <kernel/thread.h>
+#include <kernel/debug.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+#if WITH_LIB_PROFILER
+#include <lib/profiler.h>
+#endif
 
 /* exceptions */
 #define INT_DIVIDE_0        0x00
@@ -114,6 +122,31 @@ void x86_pfe_handler(x86_iframe_t *frame)
     thread_t *current_thread;
     error_code = frame->err_code;
 
+#if WITH_KERNEL_VM
+    /* let the vmm fill in missing pages of lazily committed regions and copy shared pages
+     * that are written to. it may block, so only if the faulting code had interrupts enabled */
+    if ((!(error_code & PFEX_P) || (error_code & PFEX_W)) && (frame->flags & X86_FLAGS_IF)) {
+        vaddr_t fault_addr = x86_get_cr2();
+        uint pf_flags = 0;
+
+        if (!(error_code & PFEX_P))
+            pf_flags |= VMM_PF_FLAG_NOT_PRESENT;
+        if (error_code & PFEX_W)
+            pf_flags |= VMM_PF_FLAG_WRITE;
+        if (error_code & PFEX_U)
+            pf_flags |= VMM_PF_FLAG_USER;
+        if (error_code & PFEX_I)
+            pf_flags |= VMM_PF_FLAG_INSTRUCTION;
+
+        arch_enable_ints();
+        status_t err = vmm_page_fault_handler(fault_addr, pf_flags);
+        arch_disable_ints();
+
+        if (err == NO_ERROR)
+            return;
+    }
+#endif
+
 #ifdef PAGE_FAULT_DEBUG_INFO
     addr_t v_addr, ssp, esp, ip, rip;
     v_addr = x86_get_cr2();
@@ -227,7 +260,12 @@ void x86_exception_handler(x86_iframe_t *frame)
 
         /* pass the rest of the irq vectors to the platform */
         case 0x20 ... 255:
+            KEVLOG_IRQ_ENTER(vector);
+#if WITH_LIB_PROFILER
+            profiler_irq_enter(frame->ip, frame->bp);
+#endif
             ret = platform_irq(frame);
+            KEVLOG_IRQ_EXIT(vector);
     }
 
     if (ret != INT_NO_RESCHEDULE)
@@ -54,7 +54,9 @@
 #define FXSAVE_CAP(ecx, edx) ((edx & EDX_FXSR) != 0)
 
 static int fp_supported;
-static thread_t *fp_owner;
+
+/* thread whose state is in each cpu's fpu registers */
+static thread_t *fp_owner[SMP_MAX_CPUS];
 
 /* FXSAVE area comprises 512 bytes starting with 16-byte aligned */
 static uint8_t __ALIGNED(16) fpu_init_states[512]= {0};
@@ -67,9 +69,9 @@ static void get_cpu_cap(uint32_t *ecx, uint32_t *edx)
     ("cpuid" : "=c" (*ecx), "=d" (*edx) : "a" (eax));
 }
 
-void fpu_init(void)
+/* enable the x87 and sse units of the calling cpu */
+static void fpu_enable(void)
 {
-    uint32_t ecx = 0, edx = 0;
     uint16_t fcw;
     uint32_t mxcsr;
 
@@ -79,16 +81,6 @@ void fpu_init(void)
     uint32_t x;
 #endif
 
-    fp_supported = 0;
-    fp_owner = NULL;
-
-    get_cpu_cap(&ecx, &edx);
-
-    if (!FPU_CAP(ecx, edx) || !SSE_CAP(ecx, edx) || !FXSAVE_CAP(ecx, edx))
-        return;
-
-    fp_supported = 1;
-
     /* No x87 emul, monitor co-processor */
 
     x = x86_get_cr0();
@@ -125,6 +117,23 @@ void fpu_init(void)
     mxcsr &= 0x0000003f;
 #endif
     __asm__ __volatile__("ldmxcsr %0" : : "m" (mxcsr));
+}
+
+void fpu_init(void)
+{
+    uint32_t ecx = 0, edx = 0;
+
+    fp_supported = 0;
+    memset(fp_owner, 0, sizeof(fp_owner));
+
+    get_cpu_cap(&ecx, &edx);
+
+    if (!FPU_CAP(ecx, edx) || !SSE_CAP(ecx, edx) || !FXSAVE_CAP(ecx, edx))
+        return;
+
+    fp_supported = 1;
+
+    fpu_enable();
 
     /* save fpu initial states, and used when new thread creates */
     __asm__ __volatile__("fxsave %0" : "=m" (fpu_init_states));
@@ -133,6 +142,15 @@ void fpu_init(void)
     return;
 }
 
+void fpu_init_percpu(void)
+{
+    if (fp_supported == 0)
+        return;
+
+    fpu_enable();
+    x86_set_cr0(x86_get_cr0() | X86_CR0_TS);
+}
+
 void fpu_init_thread_states(thread_t *t)
 {
     t->arch.fpu_states = (vaddr_t *)ROUNDUP(((vaddr_t)t->arch.fpu_buffer), 16);
@@ -144,10 +162,22 @@ void fpu_context_switch(thread_t *old_thread, thread_t *new_thread)
     if (fp_supported == 0)
         return;
 
-    if (new_thread != fp_owner)
+#if WITH_SMP
+    /* the old thread may run on another cpu next, so its state can't stay behind in this
+     * cpu's registers */
+    uint cpu = arch_curr_cpu_num();
+    if (fp_owner[cpu] == old_thread) {
+        x86_set_cr0(x86_get_cr0() & ~X86_CR0_TS);
+        __asm__ __volatile__("fxsave %0" : "=m" (*old_thread->arch.fpu_states));
+        fp_owner[cpu] = NULL;
+    }
+    x86_set_cr0(x86_get_cr0() | X86_CR0_TS);
+#else
+    if (new_thread != fp_owner[0])
         x86_set_cr0(x86_get_cr0() | X86_CR0_TS);
     else
         x86_set_cr0(x86_get_cr0() & ~X86_CR0_TS);
+#endif
 
     return;
 }
@@ -162,14 +192,22 @@ void fpu_dev_na_handler(void)
         return;
 
     self = get_current_thread();
+    uint cpu = arch_curr_cpu_num();
+    thread_t *owner = fp_owner[cpu];
 
-    LTRACEF("owner %p self %p\n", fp_owner, self);
-    if ((fp_owner != NULL) && (fp_owner != self)) {
-        __asm__ __volatile__("fxsave %0" : "=m" (*fp_owner->arch.fpu_states));
+    LTRACEF("owner %p self %p\n", owner, self);
+#if WITH_SMP
+    /* owners give up the registers when switched out, load our own state */
+    if (owner != self)
+        __asm__ __volatile__("fxrstor %0" : : "m" (*self->arch.fpu_states));
+#else
+    if ((owner != NULL) && (owner != self)) {
+        __asm__ __volatile__("fxsave %0" : "=m" (*owner->arch.fpu_states));
         __asm__ __volatile__("fxrstor %0" : : "m" (*self->arch.fpu_states));
     }
+#endif
 
-    fp_owner = self;
+    fp_owner[cpu] = self;
     return;
 }
 #endif
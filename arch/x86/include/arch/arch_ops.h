@@ -105,6 +105,37 @@ static inline uint32_t arch_cycle_count(void)
 #endif
 }
 
+#if WITH_SMP
+#include <arch/x86/mp.h>
+
+/* the current thread and cpu number live in the per cpu state gs points at */
+static inline struct thread *get_current_thread(void)
+{
+    struct thread *t;
+
+    __asm__ volatile("movq %%gs:%c1, %0"
+                     : "=r" (t)
+                     : "i" (__builtin_offsetof(struct x86_percpu, current_thread)));
+    return t;
+}
+
+static inline void set_current_thread(struct thread *t)
+{
+    __asm__ volatile("movq %0, %%gs:%c1"
+                     :: "r" (t), "i" (__builtin_offsetof(struct x86_percpu, current_thread))
+                     : "memory");
+}
+
+static inline uint arch_curr_cpu_num(void)
+{
+    uint cpu;
+
+    __asm__ volatile("movl %%gs:%c1, %0"
+                     : "=r" (cpu)
+                     : "i" (__builtin_offsetof(struct x86_percpu, cpu_num)));
+    return cpu;
+}
+#else
 /* use a global pointer to store the current_thread */
 extern struct thread *_current_thread;
 
@@ -122,5 +153,6 @@ static inline uint arch_curr_cpu_num(void)
 {
     return 0;
 }
+#endif
 
 #endif // !ASSEMBLY
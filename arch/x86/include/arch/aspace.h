@@ -23,11 +23,15 @@
 #pragma once
 
 #include <compiler.h>
+#include <stdint.h>
 
 __BEGIN_CDECLS
 
 struct arch_aspace {
-    // nothing for now, does not support address spaces other than the kernel
+    // only the kernel address space is supported for now
+
+    /* process context id tagging this aspace's tlb entries, 0 for the kernel */
+    uint16_t pcid;
 };
 
 __END_CDECLS
@@ -33,12 +33,51 @@ typedef unsigned long spin_lock_t;
 typedef x86_flags_t spin_lock_saved_state_t;
 typedef uint spin_lock_save_flags_t;
 
-/* simple implementation of spinlocks for no smp support */
 static inline void arch_spin_lock_init(spin_lock_t *lock)
 {
     *lock = SPIN_LOCK_INITIAL_VALUE;
 }
 
+#if WITH_SMP
+/*
+ * Ticket lock. The low 32 bits of the lock word hold two 16 bit counters,
+ * the ticket currently being served in [15:0] and the next ticket to hand
+ * out in [31:16]. Waiters are served in the order they arrived.
+ */
+static inline bool arch_spin_lock_held(spin_lock_t *lock)
+{
+    uint32_t val = *(volatile uint32_t *)lock;
+    return (val & 0xffff) != (val >> 16);
+}
+
+static inline void arch_spin_lock(spin_lock_t *lock)
+{
+    uint16_t ticket = __atomic_fetch_add((uint32_t *)lock, 1u << 16, __ATOMIC_ACQUIRE) >> 16;
+
+    while (__atomic_load_n((uint16_t *)lock, __ATOMIC_ACQUIRE) != ticket)
+        __asm__ volatile("pause");
+}
+
+/* Returns 0 on success, non-0 on failure */
+static inline int arch_spin_trylock(spin_lock_t *lock)
+{
+    uint32_t val = __atomic_load_n((uint32_t *)lock, __ATOMIC_RELAXED);
+
+    if ((val & 0xffff) != (val >> 16))
+        return 1;
+
+    return !__atomic_compare_exchange_n((uint32_t *)lock, &val, val + (1u << 16),
+                                        false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void arch_spin_unlock(spin_lock_t *lock)
+{
+    uint16_t *owner = (uint16_t *)lock;
+
+    __atomic_store_n(owner, (uint16_t)(*owner + 1), __ATOMIC_RELEASE);
+}
+#else
+/* simple implementation of spinlocks for no smp support */
 static inline bool arch_spin_lock_held(spin_lock_t *lock)
 {
     return *lock != 0;
@@ -58,6 +97,7 @@ static inline void arch_spin_unlock(spin_lock_t *lock)
 {
     *lock = 0;
 }
+#endif
 
 /* flags are unused on x86 */
 #define ARCH_DEFAULT_SPIN_LOCK_FLAG_INTERRUPTS  0
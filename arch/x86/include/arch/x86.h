@@ -36,6 +36,7 @@ __BEGIN_CDECLS
 #define PFEX_U 0x04
 #define PFEX_RSV 0x08
 #define PFEX_I 0x10
+#define X86_FLAGS_IF (1 << 9)
 #define X86_8BYTE_MASK 0xFFFFFFFF
 #define X86_CPUID_ADDR_WIDTH 0x80000008
 
@@ -146,13 +147,17 @@ typedef tss_64_t tss_t;
 #define X86_CR0_CD 0x40000000 /* cache disable */
 #define X86_CR0_PG 0x80000000 /* enable paging */
 #define X86_CR4_PAE 0x00000020 /* PAE paging */
+#define X86_CR4_PGE 0x00000080 /* global pages */
 #define X86_CR4_OSFXSR 0x00000200 /* os supports fxsave */
 #define X86_CR4_OSXMMEXPT 0x00000400 /* os supports xmm exception */
+#define X86_CR4_PCIDE 0x00020000 /* process context identifiers */
 #define X86_CR4_OSXSAVE 0x00040000 /* os supports xsave */
 #define X86_CR4_SMEP 0x00100000 /* SMEP protection enabling */
 #define X86_CR4_SMAP 0x00200000 /* SMAP protection enabling */
 #define x86_EFER_NXE 0x00000800 /* to enable execute disable bit */
 #define x86_MSR_EFER 0xc0000080 /* EFER Model Specific Register id */
+#define x86_MSR_APIC_BASE 0x0000001b /* local apic base address and enables */
+#define x86_MSR_GS_BASE 0xc0000101 /* gs segment base */
 #define X86_CR4_PSE 0xffffffef /* Disabling PSE bit in the CR4 */
 
 #if ARCH_X86_32
@@ -843,6 +848,72 @@ static inline uint64_t check_smap_avail(void)
     return ((reg_b>>0x13) & 0x1);
 }
 
+static inline uint64_t check_pcid_avail(void)
+{
+    uint64_t reg_a = 0x01;
+    uint64_t reg_c = 0x0;
+    __asm__ __volatile__ (
+        "cpuid \n\t"
+        :"=c" (reg_c)
+        :"a" (reg_a)
+        :"ebx", "edx");
+    return ((reg_c>>0x11) & 0x1);
+}
+
+static inline uint64_t check_invpcid_avail(void)
+{
+    uint64_t reg_a = 0x07;
+    uint64_t reg_b = 0x0;
+    uint64_t reg_c = 0x0;
+    __asm__ __volatile__ (
+        "cpuid \n\t"
+        :"=b" (reg_b)
+        :"a" (reg_a),"c" (reg_c));
+    return ((reg_b>>0x0a) & 0x1);
+}
+
+static inline void x86_cpuid(uint32_t leaf, uint32_t subleaf,
+                             uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d)
+{
+    __asm__ __volatile__ (
+        "cpuid \n\t"
+        :"=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+        :"a" (leaf), "c" (subleaf));
+}
+
+/* enhanced rep movsb/stosb */
+static inline uint64_t check_erms_avail(void)
+{
+    uint32_t a, b, c, d;
+    x86_cpuid(0x07, 0, &a, &b, &c, &d);
+    return ((b>>0x09) & 0x1);
+}
+
+/* fast short rep movsb */
+static inline uint64_t check_fsrm_avail(void)
+{
+    uint32_t a, b, c, d;
+    x86_cpuid(0x07, 0, &a, &b, &c, &d);
+    return ((d>>0x04) & 0x1);
+}
+
+/* invpcid types */
+#define X86_INVPCID_ADDR        0 /* one address in one pcid */
+#define X86_INVPCID_CONTEXT     1 /* all non global entries of one pcid */
+#define X86_INVPCID_ALL_GLOBAL  2 /* everything, including global entries */
+#define X86_INVPCID_ALL         3 /* everything but global entries */
+
+static inline void x86_invpcid(uint64_t type, uint64_t pcid, uint64_t addr)
+{
+    struct { uint64_t pcid, addr; } desc = { pcid, addr };
+
+    __asm__ __volatile__ (
+        "invpcid %0, %1 \n\t"
+        :
+        :"m" (desc), "r" (type)
+        :"memory");
+}
+
 #endif // ARCH_X86_64
 
 __END_CDECLS
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+/* local apic vectors, above the remapped legacy pic */
+#define X86_INT_LAPIC_BASE          0x3b
+#define X86_INT_IPI_TLB_SHOOTDOWN   0x3b
+#define X86_INT_IPI_GENERIC         0x3c
+#define X86_INT_IPI_RESCHEDULE      0x3d
+#define X86_INT_LAPIC_TIMER         0x3e
+#define X86_INT_LAPIC_SPURIOUS      0x3f
+
+#ifndef ASSEMBLY
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <compiler.h>
+
+__BEGIN_CDECLS
+
+/* enable the local apic of the calling cpu, in x2apic mode if the cpu supports it. the boot
+ * cpu must get here first */
+void lapic_init_percpu(void);
+bool lapic_present(void);
+uint32_t lapic_id(void);
+void lapic_eoi(void);
+
+void lapic_send_ipi(uint32_t apic_id, uint vector);
+
+/* INIT and STARTUP to every cpu but the calling one, the startup vector is a physical page
+ * number below 1MB */
+void lapic_send_init_all_but_self(void);
+void lapic_send_startup_all_but_self(uint page);
+
+/* the timer counts down from count at the bus clock divided by 16 */
+void lapic_timer_start(uint32_t count, bool periodic);
+void lapic_timer_stop(void);
+uint32_t lapic_timer_current_count(void);
+
+__END_CDECLS
+
+#endif // !ASSEMBLY
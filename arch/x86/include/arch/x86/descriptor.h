@@ -41,6 +41,7 @@
 #define USER_DATA_64_SELECTOR   0x40
 
 #define TSS_SELECTOR        0x48
+#define TSS_SELECTOR_CPU(n) (TSS_SELECTOR + (n) * 16)
 
 /*
  * Descriptor Types
@@ -160,6 +160,14 @@ status_t x86_mmu_unmap(map_addr_t init_table, vaddr_t vaddr, uint count);
 void x86_mmu_early_init(void);
 void x86_mmu_init(void);
 
+#if ARCH_X86_64
+/* control register and efer setup done by x86_mmu_early_init(), for secondary cpus */
+void x86_mmu_percpu_init(void);
+
+/* put back or drop the boot identity mapping of the first 1GB */
+void x86_mmu_map_low_identity(bool map);
+#endif
+
 __END_CDECLS
 
 #endif // !ASSEMBLY
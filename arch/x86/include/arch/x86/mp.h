@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+/* physical page the secondary cpus start executing from, must be below 1MB */
+#define X86_AP_TRAMPOLINE_PHYS  0x8000
+
+/* boot stack each secondary cpu runs its idle thread on, the same size as the boot cpu's */
+#define X86_AP_STACK_SIZE       4096
+
+/* layout of struct x86_ap_trampoline_args, for the trampoline */
+#define X86_AP_ARGS_GDTR        0
+#define X86_AP_ARGS_CR3         8
+#define X86_AP_ARGS_NEXT_CPU    12
+#define X86_AP_ARGS_STACK_BASE  16
+#define X86_AP_ARGS_ENTRY       24
+
+#ifndef ASSEMBLY
+
+#include <sys/types.h>
+#include <compiler.h>
+
+__BEGIN_CDECLS
+
+struct thread;
+
+/* per cpu state, each cpu's gs base points at its own */
+struct x86_percpu {
+    struct x86_percpu *self;
+    struct thread *current_thread;
+    uint cpu_num;
+    uint32_t apic_id;
+};
+
+extern struct x86_percpu x86_percpu[SMP_MAX_CPUS];
+
+/* filled in by the boot cpu before the secondary cpus are started */
+struct x86_ap_trampoline_args {
+    uint16_t gdtr_limit;
+    uint32_t gdtr_base;
+    uint16_t pad;
+    uint32_t cr3;
+    volatile uint32_t next_cpu;
+    uint64_t stack_base;
+    uint64_t entry;
+} __PACKED;
+
+/* the real mode entry point in trampoline.S, copied to X86_AP_TRAMPOLINE_PHYS */
+extern uint8_t x86_ap_trampoline[];
+extern uint8_t x86_ap_trampoline_args[];
+extern uint8_t x86_ap_trampoline_end[];
+
+/* point the calling cpu's gs base at its per cpu state */
+void x86_percpu_init_early(uint cpu_num);
+
+/* start the secondary cpus and wait for them to check in, from arch_init() */
+void x86_mp_init(void);
+
+/* called from the trampoline on the cpu's boot stack */
+void x86_secondary_entry(uint cpu_num) __NO_RETURN;
+
+/* load the calling cpu's tss, from arch.c */
+void x86_tss_init_percpu(uint cpu_num);
+
+__END_CDECLS
+
+#endif // !ASSEMBLY
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Local apic driver, used for interrupts between cpus and the per cpu timers.
+ *
+ * In xapic mode the registers are memory mapped and reached through the kernel's linear
+ * map of physical memory, firmware marks that range uncached in the mtrrs. In x2apic mode
+ * the same registers are msrs at 0x800 + (offset >> 4).
+ */
+#include <arch/x86/apic.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <trace.h>
+#include <arch/x86.h>
+#include <arch/x86/mmu.h>
+#include <kernel/spinlock.h>
+
+#define LOCAL_TRACE 0
+
+#define LAPIC_REG_ID            0x020
+#define LAPIC_REG_VERSION       0x030
+#define LAPIC_REG_TPR           0x080
+#define LAPIC_REG_EOI           0x0b0
+#define LAPIC_REG_SVR           0x0f0
+#define LAPIC_REG_ESR           0x280
+#define LAPIC_REG_ICR_LOW       0x300
+#define LAPIC_REG_ICR_HIGH      0x310
+#define LAPIC_REG_LVT_TIMER     0x320
+#define LAPIC_REG_LVT_ERROR     0x370
+#define LAPIC_REG_TIMER_INIT    0x380
+#define LAPIC_REG_TIMER_CURRENT 0x390
+#define LAPIC_REG_TIMER_DIV     0x3e0
+
+#define X2APIC_MSR_BASE         0x800
+
+#define APIC_BASE_X2APIC_EN     (1 << 10)
+#define APIC_BASE_EN            (1 << 11)
+#define APIC_BASE_ADDR_MASK     (~0xfffULL)
+
+#define SVR_ENABLE              (1 << 8)
+#define LVT_MASKED              (1 << 16)
+#define LVT_TIMER_PERIODIC      (1 << 17)
+#define TIMER_DIV_16            0x3
+
+#define ICR_DELIVERY_FIXED      (0 << 8)
+#define ICR_DELIVERY_INIT       (5 << 8)
+#define ICR_DELIVERY_STARTUP    (6 << 8)
+#define ICR_DELIVERY_PENDING    (1 << 12)
+#define ICR_LEVEL_ASSERT        (1 << 14)
+#define ICR_ALL_BUT_SELF        (3 << 18)
+
+/* cpuid leaf 1 */
+#define EDX_APIC                (1 << 9)
+#define ECX_X2APIC              (1 << 21)
+
+static bool lapic_avail;
+static bool x2apic;
+static volatile uint32_t *lapic_mmio;
+
+static inline uint32_t lapic_read(uint reg)
+{
+    if (x2apic)
+        return read_msr(X2APIC_MSR_BASE + (reg >> 4));
+    return lapic_mmio[reg / 4];
+}
+
+static inline void lapic_write(uint reg, uint32_t val)
+{
+    if (x2apic)
+        write_msr(X2APIC_MSR_BASE + (reg >> 4), val);
+    else
+        lapic_mmio[reg / 4] = val;
+}
+
+static void lapic_write_icr(uint32_t dest, uint32_t icr)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (x2apic) {
+        /* msr writes don't wait for earlier stores, which the target may be about to read */
+        __asm__ volatile("mfence" ::: "memory");
+        write_msr(X2APIC_MSR_BASE + (LAPIC_REG_ICR_LOW >> 4), ((uint64_t)dest << 32) | icr);
+    } else {
+        lapic_write(LAPIC_REG_ICR_HIGH, dest << 24);
+        lapic_write(LAPIC_REG_ICR_LOW, icr);
+        while (lapic_read(LAPIC_REG_ICR_LOW) & ICR_DELIVERY_PENDING)
+            __asm__ volatile("pause");
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+void lapic_init_percpu(void)
+{
+    uint32_t eax = 1, ebx, ecx, edx;
+
+    __asm__ volatile("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+    if (!(edx & EDX_APIC))
+        return;
+
+    uint64_t base = read_msr(x86_MSR_APIC_BASE) | APIC_BASE_EN;
+    if (ecx & ECX_X2APIC)
+        base |= APIC_BASE_X2APIC_EN;
+    write_msr(x86_MSR_APIC_BASE, base);
+
+    if (!lapic_avail) {
+        x2apic = (ecx & ECX_X2APIC) != 0;
+        if (!x2apic)
+            lapic_mmio = (volatile uint32_t *)X86_PHYS_TO_VIRT(base & APIC_BASE_ADDR_MASK);
+        lapic_avail = true;
+    }
+
+    /* accept everything, software enable with the spurious vector, and leave lint0/1 the
+     * way firmware set them so the pic keeps reaching the boot cpu */
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_SVR, SVR_ENABLE | X86_INT_LAPIC_SPURIOUS);
+    lapic_write(LAPIC_REG_LVT_ERROR, LVT_MASKED);
+    lapic_write(LAPIC_REG_ESR, 0);
+
+    lapic_write(LAPIC_REG_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LVT_MASKED | X86_INT_LAPIC_TIMER);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+
+    LTRACEF("id %u version 0x%x x2apic %d\n", lapic_id(), lapic_read(LAPIC_REG_VERSION), x2apic);
+}
+
+bool lapic_present(void)
+{
+    return lapic_avail;
+}
+
+uint32_t lapic_id(void)
+{
+    uint32_t id = lapic_read(LAPIC_REG_ID);
+
+    return x2apic ? id : id >> 24;
+}
+
+void lapic_eoi(void)
+{
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint vector)
+{
+    DEBUG_ASSERT(vector >= 0x20 && vector < 0x100);
+
+    lapic_write_icr(apic_id, ICR_DELIVERY_FIXED | ICR_LEVEL_ASSERT | vector);
+}
+
+void lapic_send_init_all_but_self(void)
+{
+    lapic_write_icr(0, ICR_DELIVERY_INIT | ICR_LEVEL_ASSERT | ICR_ALL_BUT_SELF);
+}
+
+void lapic_send_startup_all_but_self(uint page)
+{
+    DEBUG_ASSERT(page < 0x100);
+
+    lapic_write_icr(0, ICR_DELIVERY_STARTUP | ICR_ALL_BUT_SELF | page);
+}
+
+void lapic_timer_start(uint32_t count, bool periodic)
+{
+    lapic_write(LAPIC_REG_LVT_TIMER, X86_INT_LAPIC_TIMER | (periodic ? LVT_TIMER_PERIODIC : 0));
+    lapic_write(LAPIC_REG_TIMER_INIT, count);
+}
+
+void lapic_timer_stop(void)
+{
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+    lapic_write(LAPIC_REG_LVT_TIMER, LVT_MASKED | X86_INT_LAPIC_TIMER);
+}
+
+uint32_t lapic_timer_current_count(void)
+{
+    return lapic_read(LAPIC_REG_TIMER_CURRENT);
+}
@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/mp.h>
+#include <arch/x86/mp.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <arch/fpu.h>
+#include <arch/mmu.h>
+#include <arch/x86.h>
+#include <arch/x86/apic.h>
+#include <arch/x86/mmu.h>
+#include <kernel/mp.h>
+#include <kernel/thread.h>
+#include <lk/init.h>
+#include <lk/main.h>
+#include <platform.h>
+#include <platform/interrupts.h>
+
+#define LOCAL_TRACE 0
+
+/* how long the boot cpu waits for secondary cpus to show up. there is no count of them to
+ * wait for without parsing firmware tables, so any that take longer are left halted */
+#ifndef X86_AP_BOOT_WAIT_MS
+#define X86_AP_BOOT_WAIT_MS 20
+#endif
+
+STATIC_ASSERT(__builtin_offsetof(struct x86_ap_trampoline_args, cr3) == X86_AP_ARGS_CR3);
+STATIC_ASSERT(__builtin_offsetof(struct x86_ap_trampoline_args, next_cpu) == X86_AP_ARGS_NEXT_CPU);
+STATIC_ASSERT(__builtin_offsetof(struct x86_ap_trampoline_args, stack_base) == X86_AP_ARGS_STACK_BASE);
+STATIC_ASSERT(__builtin_offsetof(struct x86_ap_trampoline_args, entry) == X86_AP_ARGS_ENTRY);
+
+struct x86_percpu x86_percpu[SMP_MAX_CPUS];
+
+/* cpus that made it to x86_secondary_entry(), and the boot cpu's go for the rest */
+static volatile int ap_arrived;
+static volatile int ap_release;
+static volatile int secondaries_to_init;
+static uint num_cpus = 1;
+
+static uint8_t ap_stacks[SMP_MAX_CPUS - 1][X86_AP_STACK_SIZE] __ALIGNED(16);
+
+extern uint8_t _gdtr[];
+extern uint8_t _gdtr_phys[];
+extern uint8_t _idtr[];
+
+void x86_percpu_init_early(uint cpu_num)
+{
+    struct x86_percpu *percpu = &x86_percpu[cpu_num];
+
+    percpu->self = percpu;
+    percpu->cpu_num = cpu_num;
+    write_msr(x86_MSR_GS_BASE, (uintptr_t)percpu);
+}
+
+status_t arch_mp_send_ipi(mp_cpu_mask_t target, mp_ipi_t ipi)
+{
+    uint vector;
+
+    LTRACEF("target 0x%x, ipi %u\n", target, ipi);
+
+    switch (ipi) {
+        case MP_IPI_GENERIC:
+            vector = X86_INT_IPI_GENERIC;
+            break;
+        case MP_IPI_RESCHEDULE:
+            vector = X86_INT_IPI_RESCHEDULE;
+            break;
+        case MP_IPI_TLB_SHOOTDOWN:
+            vector = X86_INT_IPI_TLB_SHOOTDOWN;
+            break;
+        default:
+            return ERR_INVALID_ARGS;
+    }
+
+    if (target == MP_CPU_ALL_BUT_LOCAL)
+        target &= ~(1U << arch_curr_cpu_num());
+
+    /* filter out targets outside of the range of cpus that came up */
+    target &= (1UL << num_cpus) - 1;
+    while (target) {
+        uint cpu = __builtin_ctz(target);
+        target &= ~(1U << cpu);
+        lapic_send_ipi(x86_percpu[cpu].apic_id, vector);
+    }
+
+    return NO_ERROR;
+}
+
+static enum handler_return x86_ipi_generic_handler(void *arg)
+{
+    LTRACEF("cpu %u, arg %p\n", arch_curr_cpu_num(), arg);
+
+    return INT_NO_RESCHEDULE;
+}
+
+static enum handler_return x86_ipi_reschedule_handler(void *arg)
+{
+    LTRACEF("cpu %u, arg %p\n", arch_curr_cpu_num(), arg);
+
+    return mp_mbx_reschedule_irq();
+}
+
+static enum handler_return x86_ipi_tlb_shootdown_handler(void *arg)
+{
+    return mp_mbx_tlb_shootdown_irq();
+}
+
+void arch_mp_init_percpu(void)
+{
+    register_int_handler(X86_INT_IPI_GENERIC, &x86_ipi_generic_handler, 0);
+    register_int_handler(X86_INT_IPI_RESCHEDULE, &x86_ipi_reschedule_handler, 0);
+    register_int_handler(X86_INT_IPI_TLB_SHOOTDOWN, &x86_ipi_tlb_shootdown_handler, 0);
+}
+
+static void ap_halt(void) __NO_RETURN;
+static void ap_halt(void)
+{
+    arch_disable_ints();
+    for (;;)
+        x86_hlt();
+}
+
+void x86_mp_init(void)
+{
+    if (!lapic_present()) {
+        dprintf(INFO, "no local apic, secondary cpus not started\n");
+        return;
+    }
+
+    /* copy the trampoline into low memory and tell it where the kernel is */
+    uint8_t *trampoline = (uint8_t *)X86_PHYS_TO_VIRT(X86_AP_TRAMPOLINE_PHYS);
+    memcpy(trampoline, x86_ap_trampoline, x86_ap_trampoline_end - x86_ap_trampoline);
+
+    struct x86_ap_trampoline_args *args =
+        (void *)(trampoline + (x86_ap_trampoline_args - x86_ap_trampoline));
+    memcpy(&args->gdtr_limit, _gdtr_phys, sizeof(args->gdtr_limit) + sizeof(args->gdtr_base));
+    args->cr3 = x86_get_cr3();
+    args->next_cpu = 1;
+    args->stack_base = (uintptr_t)ap_stacks;
+    args->entry = (uintptr_t)&x86_secondary_entry;
+
+    /* the trampoline turns on paging while running at its physical address */
+    x86_mmu_map_low_identity(true);
+
+    lapic_send_init_all_but_self();
+    thread_sleep(10);
+    lapic_send_startup_all_but_self(X86_AP_TRAMPOLINE_PHYS >> PAGE_SIZE_SHIFT);
+    spin(200);
+    lapic_send_startup_all_but_self(X86_AP_TRAMPOLINE_PHYS >> PAGE_SIZE_SHIFT);
+
+    lk_time_t start = current_time();
+    while (ap_arrived < SMP_MAX_CPUS - 1 && current_time() - start < X86_AP_BOOT_WAIT_MS)
+        thread_sleep(1);
+
+    /* every cpu that took a number has to be off the identity mapping before it goes, cpus
+     * past SMP_MAX_CPUS never leave real mode */
+    uint started = MIN(args->next_cpu - 1, SMP_MAX_CPUS - 1);
+    while ((uint)ap_arrived < started && current_time() - start < X86_AP_BOOT_WAIT_MS * 10)
+        thread_sleep(1);
+
+    uint count = ap_arrived;
+    dprintf(INFO, "%u secondary cpus started, %u found\n", count, args->next_cpu - 1);
+
+    if (count == started)
+        x86_mmu_map_low_identity(false);
+    else
+        dprintf(CRITICAL, "%u cpus did not get out of the trampoline\n", started - count);
+
+    secondaries_to_init = count;
+    num_cpus = count + 1;
+    lk_init_secondary_cpus(count);
+
+    /* release the secondary cpus */
+    __atomic_store_n(&ap_release, 1, __ATOMIC_RELEASE);
+}
+
+void x86_secondary_entry(uint cpu_num)
+{
+    x86_percpu_init_early(cpu_num);
+
+    /* repeat what start.S and arch_early_init() did on the boot cpu */
+    __asm__ volatile("lgdt (%0)" :: "r" (_gdtr));
+    __asm__ volatile("lidt (%0)" :: "r" (_idtr));
+    x86_tss_init_percpu(cpu_num);
+    x86_mmu_percpu_init();
+#if X86_WITH_FPU
+    fpu_init_percpu();
+#endif
+    lapic_init_percpu();
+    x86_percpu[cpu_num].apic_id = lapic_id();
+
+    atomic_add(&ap_arrived, 1);
+
+    while (!__atomic_load_n(&ap_release, __ATOMIC_ACQUIRE))
+        __asm__ volatile("pause");
+
+    /* showed up after the boot cpu stopped counting */
+    if (cpu_num >= num_cpus)
+        ap_halt();
+
+    /* drop anything left of the identity mapping */
+    arch_mmu_invalidate_local(NULL, 0, 0);
+
+    /* run early secondary cpu init routines up to the threading level */
+    lk_init_level(LK_INIT_FLAG_SECONDARY_CPUS, LK_INIT_LEVEL_EARLIEST, LK_INIT_LEVEL_THREADING - 1);
+
+    arch_mp_init_percpu();
+
+    LTRACEF("cpu num %u apic id %u\n", cpu_num, x86_percpu[cpu_num].apic_id);
+
+    /* we're done, tell the main cpu we're up */
+    atomic_add(&secondaries_to_init, -1);
+
+    lk_secondary_cpu_entry();
+
+    ap_halt();
+}
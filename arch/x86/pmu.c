@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Performance counters through Intel's architectural performance monitoring
+ * or AMD's core performance counter extensions. Only the general purpose
+ * counters are used, the fixed function ones are left alone.
+ */
+#include <arch/pmu.h>
+
+#include <arch/ops.h>
+#include <arch/x86.h>
+#include <assert.h>
+#include <err.h>
+#include <lk/init.h>
+#include <stdlib.h>
+#include <trace.h>
+#include <kernel/spinlock.h>
+
+#define LOCAL_TRACE 0
+
+#define MAX_COUNTERS 8
+
+#define MSR_IA32_PERFEVTSEL0    0x186
+#define MSR_IA32_PMC0           0xc1
+#define MSR_IA32_PERF_GLOBAL_CTRL 0x38f
+#define MSR_AMD_PERF_CTL0       0xc0010200 /* control and count interleave */
+#define MSR_AMD_PERF_CTR0       0xc0010201
+
+#define EVTSEL_USR  (1u << 16)
+#define EVTSEL_OS   (1u << 17)
+#define EVTSEL_EN   (1u << 22)
+
+#define EVENT(event, umask) ((event) | ((umask) << 8))
+
+/* architectural events, indexed by their bit in cpuid leaf 0xa ebx */
+static const struct {
+    enum arch_pmu_event event;
+    uint bit;
+    uint32_t sel;
+} intel_events[] = {
+    { ARCH_PMU_EVENT_CYCLES, 0, EVENT(0x3c, 0x00) },
+    { ARCH_PMU_EVENT_INSTRUCTIONS, 1, EVENT(0xc0, 0x00) },
+    { ARCH_PMU_EVENT_CACHE_REFS, 3, EVENT(0x2e, 0x4f) },
+    { ARCH_PMU_EVENT_CACHE_MISSES, 4, EVENT(0x2e, 0x41) },
+    { ARCH_PMU_EVENT_BRANCHES, 5, EVENT(0xc4, 0x00) },
+    { ARCH_PMU_EVENT_BRANCH_MISSES, 6, EVENT(0xc5, 0x00) },
+};
+
+/* the few events that have kept their numbers across amd families */
+static const struct {
+    enum arch_pmu_event event;
+    uint32_t sel;
+} amd_events[] = {
+    { ARCH_PMU_EVENT_CYCLES, EVENT(0x76, 0x00) },
+    { ARCH_PMU_EVENT_INSTRUCTIONS, EVENT(0xc0, 0x00) },
+    { ARCH_PMU_EVENT_BRANCHES, EVENT(0xc2, 0x00) },
+    { ARCH_PMU_EVENT_BRANCH_MISSES, EVENT(0xc3, 0x00) },
+};
+
+static struct {
+    bool amd;
+    uint version;
+    uint num_counters;
+    uint64_t counter_mask;
+    uint32_t sel[ARCH_PMU_EVENT_COUNT]; /* 0 for events the cpu can't count */
+} pmu;
+
+/* per cpu state, only touched by the cpu itself */
+static uint64_t evtsel[SMP_MAX_CPUS][MAX_COUNTERS];
+static uint32_t programmed[SMP_MAX_CPUS];
+
+static uint32_t ctl_msr(uint counter)
+{
+    return pmu.amd ? MSR_AMD_PERF_CTL0 + 2 * counter : MSR_IA32_PERFEVTSEL0 + counter;
+}
+
+static uint32_t ctr_msr(uint counter)
+{
+    return pmu.amd ? MSR_AMD_PERF_CTR0 + 2 * counter : MSR_IA32_PMC0 + counter;
+}
+
+uint arch_pmu_num_counters(void)
+{
+    return pmu.num_counters;
+}
+
+bool arch_pmu_event_supported(enum arch_pmu_event event)
+{
+    return event < ARCH_PMU_EVENT_COUNT && pmu.sel[event] != 0;
+}
+
+status_t arch_pmu_set_event(uint counter, enum arch_pmu_event event)
+{
+    if (counter >= pmu.num_counters)
+        return ERR_INVALID_ARGS;
+    if (!arch_pmu_event_supported(event))
+        return ERR_NOT_SUPPORTED;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    uint cpu = arch_curr_cpu_num();
+    evtsel[cpu][counter] = pmu.sel[event] | EVTSEL_USR | EVTSEL_OS;
+    programmed[cpu] |= 1u << counter;
+
+    write_msr(ctl_msr(counter), evtsel[cpu][counter]);
+    write_msr(ctr_msr(counter), 0);
+
+    /* firmware may leave the general purpose counters globally disabled */
+    if (!pmu.amd && pmu.version >= 2) {
+        uint64_t global = read_msr(MSR_IA32_PERF_GLOBAL_CTRL);
+        write_msr(MSR_IA32_PERF_GLOBAL_CTRL, global | ((1ull << pmu.num_counters) - 1));
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return NO_ERROR;
+}
+
+static void pmu_enable(bool enable)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    uint cpu = arch_curr_cpu_num();
+    for (uint i = 0; i < pmu.num_counters; i++) {
+        if (programmed[cpu] & (1u << i))
+            write_msr(ctl_msr(i), evtsel[cpu][i] | (enable ? EVTSEL_EN : 0));
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+void arch_pmu_start(void)
+{
+    pmu_enable(true);
+}
+
+void arch_pmu_stop(void)
+{
+    pmu_enable(false);
+}
+
+uint64_t arch_pmu_read(uint counter)
+{
+    if (counter >= pmu.num_counters)
+        return 0;
+
+    return read_msr(ctr_msr(counter)) & pmu.counter_mask;
+}
+
+static void x86_pmu_init(uint level)
+{
+    uint32_t a, b, c, d;
+
+    x86_cpuid(0, 0, &a, &b, &c, &d);
+    uint32_t max_leaf = a;
+    bool intel = (b == 0x756e6547); /* "Genu" */
+    bool amd = (b == 0x68747541); /* "Auth" */
+
+    if (intel && max_leaf >= 0xa) {
+        x86_cpuid(0xa, 0, &a, &b, &c, &d);
+        pmu.version = a & 0xff;
+        if (pmu.version == 0)
+            return;
+
+        uint width = (a >> 16) & 0xff;
+        uint ebx_len = (a >> 24) & 0xff;
+        pmu.num_counters = MIN((a >> 8) & 0xff, (uint32_t)MAX_COUNTERS);
+        pmu.counter_mask = (width >= 64) ? ~0ull : (1ull << width) - 1;
+
+        /* a set bit in ebx means the event is not available */
+        for (uint i = 0; i < countof(intel_events); i++) {
+            if (intel_events[i].bit < ebx_len && !(b & (1u << intel_events[i].bit)))
+                pmu.sel[intel_events[i].event] = intel_events[i].sel;
+        }
+    } else if (amd) {
+        /* the legacy counters are always there, but emulators tend to not
+         * implement them, so trust only the advertised extension */
+        x86_cpuid(0x80000000, 0, &a, &b, &c, &d);
+        if (a < 0x80000001)
+            return;
+        x86_cpuid(0x80000001, 0, &a, &b, &c, &d);
+        if (!(c & (1u << 23)))
+            return;
+
+        pmu.amd = true;
+        pmu.num_counters = 6;
+        pmu.counter_mask = (1ull << 48) - 1;
+        for (uint i = 0; i < countof(amd_events); i++)
+            pmu.sel[amd_events[i].event] = amd_events[i].sel;
+    }
+
+    LTRACEF("%s version %u, %u counters\n", pmu.amd ? "amd" : "intel", pmu.version, pmu.num_counters);
+}
+
+LK_INIT_HOOK(x86_pmu, x86_pmu_init, LK_INIT_LEVEL_ARCH);
@@ -38,7 +38,8 @@ GLOBAL_DEFINES += \
 	KERNEL_LOAD_OFFSET=$(KERNEL_LOAD_OFFSET) \
 	KERNEL_ASPACE_BASE=$(KERNEL_ASPACE_BASE) \
 	KERNEL_ASPACE_SIZE=$(KERNEL_ASPACE_SIZE) \
-	SMP_MAX_CPUS=1 \
+	ARCH_HAS_PMU=1 \
+	ARCH_DMA_COHERENT=1 \
 
 MODULE_SRCS += \
 	$(SUBARCH_DIR)/start.S \
@@ -53,6 +54,24 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/thread.c \
 	$(LOCAL_DIR)/faults.c \
 	$(LOCAL_DIR)/descriptor.c \
+	$(LOCAL_DIR)/pmu.c \
+
+# smp is only supported on x86-64, where the local apic starts the other cpus
+ifeq ($(SUBARCH)$(WITH_SMP),x86-641)
+SMP_MAX_CPUS ?= 4
+
+GLOBAL_DEFINES += \
+    WITH_SMP=1 \
+    SMP_MAX_CPUS=$(SMP_MAX_CPUS)
+
+MODULE_SRCS += \
+	$(SUBARCH_DIR)/trampoline.S \
+	$(LOCAL_DIR)/lapic.c \
+	$(LOCAL_DIR)/mp.c
+else
+GLOBAL_DEFINES += \
+	SMP_MAX_CPUS=1
+endif
 
 # legacy x86's dont have fpu support
 ifneq ($(CPU),legacy)
@@ -32,8 +32,10 @@
 #include <arch/x86/descriptor.h>
 #include <arch/fpu.h>
 
-/* we're uniprocessor at this point for x86, so store a global pointer to the current thread */
+#if !WITH_SMP
+/* uniprocessor, so store a global pointer to the current thread */
 struct thread *_current_thread;
+#endif
 
 static void initial_thread_func(void) __NO_RETURN;
 static void initial_thread_func(void)
@@ -44,7 +46,8 @@ static void initial_thread_func(void)
     spin_unlock(&thread_lock);
     arch_enable_ints();
 
-    ret = _current_thread->entry(_current_thread->arg);
+    thread_t *t = get_current_thread();
+    ret = t->entry(t->arg);
 
     thread_exit(ret);
 }
@@ -72,3 +72,14 @@ status_t class_fb_update_region(struct device *dev, size_t x, size_t y, size_t w
         return ERR_NOT_SUPPORTED;
 }
 
+status_t class_fb_flip(struct device *dev, void *addr)
+{
+    struct fb_ops *ops = device_get_driver_ops(dev, struct fb_ops, std);
+    if (!ops)
+        return ERR_NOT_CONFIGURED;
+
+    if (ops->flip)
+        return ops->flip(dev, addr);
+    else
+        return ERR_NOT_SUPPORTED;
+}
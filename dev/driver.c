@@ -25,6 +25,7 @@
 #include <assert.h>
 #include <err.h>
 #include <trace.h>
+#include <lk/bootprof.h>
 
 /* static list of devices constructed with DEVICE_INSTANCE macros */
 extern struct device __devices[];
@@ -85,7 +86,9 @@ status_t device_init(struct device *dev)
 
     if (ops && ops->init) {
         dprintf(INFO, "dev: initializing device %s:%s\n", dev->driver->type, dev->name);
+        uint32_t start = bootprof_start();
         status_t err = ops->init(dev);
+        bootprof_record(BOOTPROF_DEVICE, dev->name, 0, start);
         if (err < 0) {
             dev->device_state = DEVICE_INITIALIZED_FAILED;
         } else {
@@ -33,7 +33,11 @@
 #include <platform/interrupts.h>
 #include <arch/ops.h>
 #include <platform/gic.h>
+#include "arm_gic_priv.h"
 #include <trace.h>
+#if WITH_LIB_IRQSTATS
+#include <lib/irqstats.h>
+#endif
 #if WITH_LIB_SM
 #include <lib/sm.h>
 #include <lib/sm/sm_err.h>
@@ -87,11 +91,6 @@ static void suspend_resume_fiq(bool resume_gicc, bool resume_gicd)
 #endif
 
 
-struct int_handler_struct {
-    int_handler handler;
-    void *arg;
-};
-
 static struct int_handler_struct int_handler_table_per_cpu[GIC_MAX_PER_CPU_INT][SMP_MAX_CPUS];
 static struct int_handler_struct int_handler_table_shared[MAX_INT-GIC_MAX_PER_CPU_INT];
 
@@ -124,44 +123,6 @@ void register_int_handler(unsigned int vector, int_handler handler, void *arg)
     spin_unlock_restore(&gicd_lock, state, GICD_LOCK_FLAGS);
 }
 
-#define GICREG(gic, reg) (*REG32(GICBASE(gic) + (reg)))
-
-/* main cpu regs */
-#define GICC_CTLR               (GICC_OFFSET + 0x0000)
-#define GICC_PMR                (GICC_OFFSET + 0x0004)
-#define GICC_BPR                (GICC_OFFSET + 0x0008)
-#define GICC_IAR                (GICC_OFFSET + 0x000c)
-#define GICC_EOIR               (GICC_OFFSET + 0x0010)
-#define GICC_RPR                (GICC_OFFSET + 0x0014)
-#define GICC_HPPIR              (GICC_OFFSET + 0x0018)
-#define GICC_APBR               (GICC_OFFSET + 0x001c)
-#define GICC_AIAR               (GICC_OFFSET + 0x0020)
-#define GICC_AEOIR              (GICC_OFFSET + 0x0024)
-#define GICC_AHPPIR             (GICC_OFFSET + 0x0028)
-#define GICC_APR(n)             (GICC_OFFSET + 0x00d0 + (n) * 4)
-#define GICC_NSAPR(n)           (GICC_OFFSET + 0x00e0 + (n) * 4)
-#define GICC_IIDR               (GICC_OFFSET + 0x00fc)
-#define GICC_DIR                (GICC_OFFSET + 0x1000)
-
-/* distribution regs */
-#define GICD_CTLR               (GICD_OFFSET + 0x000)
-#define GICD_TYPER              (GICD_OFFSET + 0x004)
-#define GICD_IIDR               (GICD_OFFSET + 0x008)
-#define GICD_IGROUPR(n)         (GICD_OFFSET + 0x080 + (n) * 4)
-#define GICD_ISENABLER(n)       (GICD_OFFSET + 0x100 + (n) * 4)
-#define GICD_ICENABLER(n)       (GICD_OFFSET + 0x180 + (n) * 4)
-#define GICD_ISPENDR(n)         (GICD_OFFSET + 0x200 + (n) * 4)
-#define GICD_ICPENDR(n)         (GICD_OFFSET + 0x280 + (n) * 4)
-#define GICD_ISACTIVER(n)       (GICD_OFFSET + 0x300 + (n) * 4)
-#define GICD_ICACTIVER(n)       (GICD_OFFSET + 0x380 + (n) * 4)
-#define GICD_IPRIORITYR(n)      (GICD_OFFSET + 0x400 + (n) * 4)
-#define GICD_ITARGETSR(n)       (GICD_OFFSET + 0x800 + (n) * 4)
-#define GICD_ICFGR(n)           (GICD_OFFSET + 0xc00 + (n) * 4)
-#define GICD_NSACR(n)           (GICD_OFFSET + 0xe00 + (n) * 4)
-#define GICD_SGIR               (GICD_OFFSET + 0xf00)
-#define GICD_CPENDSGIR(n)       (GICD_OFFSET + 0xf10 + (n) * 4)
-#define GICD_SPENDSGIR(n)       (GICD_OFFSET + 0xf20 + (n) * 4)
-
 #define DIV_ROUND_UP(n,d) (((n) + (d) - 1) / (d))
 #define GIC_REG_COUNT(bit_per_reg) DIV_ROUND_UP(MAX_INT, (bit_per_reg))
 #define DEFINE_GIC_SHADOW_REG(name, bit_per_reg, init_val, init_from) \
@@ -173,10 +134,15 @@ void register_int_handler(unsigned int vector, int_handler handler, void *arg)
 #if WITH_LIB_SM
 static DEFINE_GIC_SHADOW_REG(gicd_igroupr, 32, ~0U, 0);
 #endif
+#if GIC_VERSION <= 2
 static DEFINE_GIC_SHADOW_REG(gicd_itargetsr, 4, 0x01010101, 32);
+#endif
 
 static void gic_set_enable(uint vector, bool enable)
 {
+#if GIC_VERSION > 2
+    arm_gicv3_set_enable(vector, enable);
+#else
     int reg = vector / 32;
     uint32_t mask = 1ULL << (vector % 32);
 
@@ -184,10 +150,14 @@ static void gic_set_enable(uint vector, bool enable)
         GICREG(0, GICD_ISENABLER(reg)) = mask;
     else
         GICREG(0, GICD_ICENABLER(reg)) = mask;
+#endif
 }
 
 static void arm_gic_init_percpu(uint level)
 {
+#if GIC_VERSION > 2
+    arm_gicv3_init_percpu();
+#else
 #if WITH_LIB_SM
     GICREG(0, GICC_CTLR) = 0xb; // enable GIC0 and select fiq mode for secure
     GICREG(0, GICD_IGROUPR(0)) = ~0U; /* GICD_IGROUPR0 is banked */
@@ -195,6 +165,7 @@ static void arm_gic_init_percpu(uint level)
     GICREG(0, GICC_CTLR) = 1; // enable GIC0
 #endif
     GICREG(0, GICC_PMR) = 0xFF; // unmask interrupts at all priority levels
+#endif
 }
 
 LK_INIT_HOOK_FLAGS(arm_gic_init_percpu,
@@ -229,10 +200,12 @@ static void arm_gic_resume_cpu(uint level)
 LK_INIT_HOOK_FLAGS(arm_gic_resume_cpu, arm_gic_resume_cpu,
                    LK_INIT_LEVEL_PLATFORM, LK_INIT_FLAG_CPU_RESUME);
 
+#if GIC_VERSION <= 2
 static int arm_gic_max_cpu(void)
 {
     return (GICREG(0, GICD_TYPER) >> 5) & 0x7;
 }
+#endif
 
 static status_t gic_configure_interrupt(unsigned int vector,
                                         enum interrupt_trigger_mode tm,
@@ -273,20 +246,25 @@ void arm_gic_init(void)
         GICREG(0, GICD_ICPENDR(i / 32)) = ~0;
     }
 
+#if GIC_VERSION <= 2
     if (arm_gic_max_cpu() > 0) {
         /* Set external interrupts to target cpu 0 */
         for (i = 32; i < MAX_INT; i += 4) {
             GICREG(0, GICD_ITARGETSR(i / 4)) = gicd_itargetsr[i / 4];
         }
     }
+#endif
 
     // Initialize all the SPIs to edge triggered
     for (i = 32; i < MAX_INT; i++) {
         gic_configure_interrupt(i, IRQ_TRIGGER_MODE_EDGE, IRQ_POLARITY_ACTIVE_HIGH);
     }
 
-
+#if GIC_VERSION > 2
+    arm_gicv3_init(); // routes SPIs to this cpu and enables the distributor
+#else
     GICREG(0, GICD_CTLR) = 1; // enable GIC0
+#endif
 #if WITH_LIB_SM
     GICREG(0, GICD_CTLR) = 3; // enable GIC0 ns interrupts
     /*
@@ -321,6 +299,7 @@ static status_t arm_gic_set_secure_locked(u_int irq, bool secure)
     return NO_ERROR;
 }
 
+#if GIC_VERSION <= 2
 static status_t arm_gic_set_target_locked(u_int irq, u_int cpu_mask, u_int enable_mask)
 {
     u_int reg = irq / 4;
@@ -339,6 +318,7 @@ static status_t arm_gic_set_target_locked(u_int irq, u_int cpu_mask, u_int enabl
 
     return NO_ERROR;
 }
+#endif
 
 static status_t arm_gic_get_priority(u_int irq)
 {
@@ -366,6 +346,9 @@ static status_t arm_gic_set_priority_locked(u_int irq, uint8_t priority)
 
 status_t arm_gic_sgi(u_int irq, u_int flags, u_int cpu_mask)
 {
+#if GIC_VERSION > 2
+    return arm_gicv3_sgi(irq, flags, cpu_mask);
+#else
     u_int val =
         ((flags & ARM_GIC_SGI_FLAG_TARGET_FILTER_MASK) << 24) |
         ((cpu_mask & 0xff) << 16) |
@@ -380,10 +363,15 @@ status_t arm_gic_sgi(u_int irq, u_int flags, u_int cpu_mask)
     GICREG(0, GICD_SGIR) = val;
 
     return NO_ERROR;
+#endif
 }
 
 status_t mask_interrupt(unsigned int vector)
 {
+#if GIC_VERSION > 2
+    if (vector >= GIC_LPI_BASE)
+        return arm_gicv3_lpi_set_enable(vector, false);
+#endif
     if (vector >= MAX_INT)
         return ERR_INVALID_ARGS;
 
@@ -395,6 +383,10 @@ status_t mask_interrupt(unsigned int vector)
 
 status_t unmask_interrupt(unsigned int vector)
 {
+#if GIC_VERSION > 2
+    if (vector >= GIC_LPI_BASE)
+        return arm_gicv3_lpi_set_enable(vector, true);
+#endif
     if (vector >= MAX_INT)
         return ERR_INVALID_ARGS;
 
@@ -404,15 +396,95 @@ status_t unmask_interrupt(unsigned int vector)
     return NO_ERROR;
 }
 
+#if GIC_VERSION > 2
+/* SPIs are routed to one cpu or to all of them, LPIs to one. SGIs and PPIs always go to
+ * the cpu they belong to */
+status_t set_interrupt_affinity(unsigned int vector, uint cpu_mask)
+{
+    if (vector >= GIC_LPI_BASE)
+        return arm_gicv3_lpi_set_route(vector, cpu_mask);
+    if (vector < GIC_BASE_SPI || vector >= MAX_INT)
+        return ERR_INVALID_ARGS;
+
+    status_t err = NO_ERROR;
+    spin_lock_saved_state_t state;
+    spin_lock_save(&gicd_lock, &state, GICD_LOCK_FLAGS);
+
+    if (arm_gic_interrupt_change_allowed(vector))
+        err = arm_gicv3_set_route_locked(vector, cpu_mask);
+
+    spin_unlock_restore(&gicd_lock, state, GICD_LOCK_FLAGS);
+
+    return err;
+}
+
+uint get_interrupt_affinity(unsigned int vector)
+{
+    if (vector >= GIC_LPI_BASE)
+        return arm_gicv3_lpi_get_route(vector);
+    if (vector < GIC_BASE_SPI || vector >= MAX_INT)
+        return 0;
+
+    return arm_gicv3_get_route(vector);
+}
+#else
+/* SPIs can be sent to any of the first eight cpus, SGIs and PPIs always go to the cpu
+ * they belong to */
+status_t set_interrupt_affinity(unsigned int vector, uint cpu_mask)
+{
+    if (vector < GIC_BASE_SPI || vector >= MAX_INT)
+        return ERR_INVALID_ARGS;
+
+    cpu_mask &= (1u << (arm_gic_max_cpu() + 1)) - 1;
+    if (cpu_mask == 0)
+        return ERR_INVALID_ARGS;
+
+    /* with a single cpu the target registers read as zero and ignore writes */
+    if (arm_gic_max_cpu() == 0)
+        return NO_ERROR;
+
+    spin_lock_saved_state_t state;
+    spin_lock_save(&gicd_lock, &state, GICD_LOCK_FLAGS);
+
+    if (arm_gic_interrupt_change_allowed(vector))
+        arm_gic_set_target_locked(vector, ~0, cpu_mask);
+
+    spin_unlock_restore(&gicd_lock, state, GICD_LOCK_FLAGS);
+
+    return NO_ERROR;
+}
+
+uint get_interrupt_affinity(unsigned int vector)
+{
+    if (vector < GIC_BASE_SPI || vector >= MAX_INT)
+        return 0;
+
+    if (arm_gic_max_cpu() == 0)
+        return 1;
+
+    return (gicd_itargetsr[vector / 4] >> (8 * (vector % 4))) & 0xff;
+}
+#endif
+
 static
 enum handler_return __platform_irq(struct iframe *frame)
 {
     // get the current vector
+#if GIC_VERSION > 2
+    uint32_t iar = arm_gicv3_acknowledge();
+    unsigned int vector = iar & 0xffffff;
+
+    if (vector >= 1020 && vector < GIC_LPI_BASE) {
+#else
     uint32_t iar = GICREG(0, GICC_IAR);
     unsigned int vector = iar & 0x3ff;
 
     if (vector >= 0x3fe) {
+#endif
         // spurious
+#if WITH_LIB_IRQSTATS
+        irqstats_spurious();
+#endif
         return INT_NO_RESCHEDULE;
     }
 
@@ -428,11 +500,28 @@ enum handler_return __platform_irq(struct iframe *frame)
     enum handler_return ret;
 
     ret = INT_NO_RESCHEDULE;
+#if WITH_LIB_IRQSTATS
+    uint32_t start = arch_cycle_count();
+#endif
+#if GIC_VERSION > 2
+    struct int_handler_struct *handler = (vector >= GIC_LPI_BASE) ?
+        arm_gicv3_lpi_handler(vector) : get_int_handler(vector, cpu);
+#else
     struct int_handler_struct *handler = get_int_handler(vector, cpu);
-    if (handler->handler)
+#endif
+    thread_wake_batch_begin();
+    if (handler && handler->handler)
         ret = handler->handler(handler->arg);
+    ret |= thread_wake_batch_end();
+#if WITH_LIB_IRQSTATS
+    irqstats_record(vector, arch_cycle_count() - start);
+#endif
 
+#if GIC_VERSION > 2
+    arm_gicv3_end_of_interrupt(iar);
+#else
     GICREG(0, GICC_EOIR) = iar;
+#endif
 
     LTRACEF_LEVEL(2, "cpu %u exit %d\n", cpu, ret);
 
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2012-2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+/* registers and helpers shared between arm_gic.c and the GICv3 support */
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <reg.h>
+#include <platform/gic.h>
+#include <platform/interrupts.h>
+
+#define GICREG(gic, reg) (*REG32(GICBASE(gic) + (reg)))
+
+/* main cpu regs */
+#define GICC_CTLR               (GICC_OFFSET + 0x0000)
+#define GICC_PMR                (GICC_OFFSET + 0x0004)
+#define GICC_BPR                (GICC_OFFSET + 0x0008)
+#define GICC_IAR                (GICC_OFFSET + 0x000c)
+#define GICC_EOIR               (GICC_OFFSET + 0x0010)
+#define GICC_RPR                (GICC_OFFSET + 0x0014)
+#define GICC_HPPIR              (GICC_OFFSET + 0x0018)
+#define GICC_APBR               (GICC_OFFSET + 0x001c)
+#define GICC_AIAR               (GICC_OFFSET + 0x0020)
+#define GICC_AEOIR              (GICC_OFFSET + 0x0024)
+#define GICC_AHPPIR             (GICC_OFFSET + 0x0028)
+#define GICC_APR(n)             (GICC_OFFSET + 0x00d0 + (n) * 4)
+#define GICC_NSAPR(n)           (GICC_OFFSET + 0x00e0 + (n) * 4)
+#define GICC_IIDR               (GICC_OFFSET + 0x00fc)
+#define GICC_DIR                (GICC_OFFSET + 0x1000)
+
+/* distribution regs */
+#define GICD_CTLR               (GICD_OFFSET + 0x000)
+#define GICD_TYPER              (GICD_OFFSET + 0x004)
+#define GICD_IIDR               (GICD_OFFSET + 0x008)
+#define GICD_IGROUPR(n)         (GICD_OFFSET + 0x080 + (n) * 4)
+#define GICD_ISENABLER(n)       (GICD_OFFSET + 0x100 + (n) * 4)
+#define GICD_ICENABLER(n)       (GICD_OFFSET + 0x180 + (n) * 4)
+#define GICD_ISPENDR(n)         (GICD_OFFSET + 0x200 + (n) * 4)
+#define GICD_ICPENDR(n)         (GICD_OFFSET + 0x280 + (n) * 4)
+#define GICD_ISACTIVER(n)       (GICD_OFFSET + 0x300 + (n) * 4)
+#define GICD_ICACTIVER(n)       (GICD_OFFSET + 0x380 + (n) * 4)
+#define GICD_IPRIORITYR(n)      (GICD_OFFSET + 0x400 + (n) * 4)
+#define GICD_ITARGETSR(n)       (GICD_OFFSET + 0x800 + (n) * 4)
+#define GICD_ICFGR(n)           (GICD_OFFSET + 0xc00 + (n) * 4)
+#define GICD_NSACR(n)           (GICD_OFFSET + 0xe00 + (n) * 4)
+#define GICD_SGIR               (GICD_OFFSET + 0xf00)
+#define GICD_CPENDSGIR(n)       (GICD_OFFSET + 0xf10 + (n) * 4)
+#define GICD_SPENDSGIR(n)       (GICD_OFFSET + 0xf20 + (n) * 4)
+
+struct int_handler_struct {
+    int_handler handler;
+    void *arg;
+};
+
+#if GIC_VERSION > 2
+
+#define GICREG64(gic, reg) (*REG64(GICBASE(gic) + (reg)))
+
+/* GICv3 distributor additions */
+#define GICD_CTLR_RWP           (1U << 31)
+#define GICD_CTLR_ARE           (1U << 4)
+#define GICD_CTLR_ENABLE_G1A    (1U << 1)
+#define GICD_CTLR_ENABLE_G1     (1U << 0)
+#define GICD_TYPER_LPIS         (1U << 17)
+#define GICD_IROUTER(n)         (GICD_OFFSET + 0x6000 + (n) * 8)
+#define GICD_IROUTER_IRM        (1ULL << 31)
+
+/* redistributor, one pair of 64k frames per cpu (two more with GICv4) */
+#define GICR_CTLR               (0x0000)
+#define GICR_IIDR               (0x0004)
+#define GICR_TYPER              (0x0008)
+#define GICR_WAKER              (0x0014)
+#define GICR_PROPBASER          (0x0070)
+#define GICR_PENDBASER          (0x0078)
+#define GICR_SGI_OFFSET         (0x10000)
+#define GICR_IGROUPR0           (GICR_SGI_OFFSET + 0x0080)
+#define GICR_ISENABLER0         (GICR_SGI_OFFSET + 0x0100)
+#define GICR_ICENABLER0         (GICR_SGI_OFFSET + 0x0180)
+#define GICR_ICPENDR0           (GICR_SGI_OFFSET + 0x0280)
+#define GICR_IPRIORITYR(n)      (GICR_SGI_OFFSET + 0x0400 + (n) * 4)
+#define GICR_ICFGR1             (GICR_SGI_OFFSET + 0x0c04)
+
+#define GICR_CTLR_ENABLE_LPIS   (1U << 0)
+#define GICR_CTLR_RWP           (1U << 3)
+#define GICR_TYPER_VLPIS        (1ULL << 1)
+#define GICR_TYPER_LAST         (1ULL << 4)
+#define GICR_WAKER_PROCESSOR_SLEEP (1U << 1)
+#define GICR_WAKER_CHILDREN_ASLEEP (1U << 2)
+
+/* first LPI interrupt id, and how many of them the driver handles */
+#define GIC_LPI_BASE            8192
+#ifndef GIC_MAX_LPIS
+#define GIC_MAX_LPIS            256
+#endif
+
+/* gic_v3.c */
+void arm_gicv3_init(void);
+void arm_gicv3_init_percpu(void);
+uint32_t arm_gicv3_acknowledge(void);
+void arm_gicv3_end_of_interrupt(uint32_t iar);
+void arm_gicv3_set_enable(uint vector, bool enable);
+status_t arm_gicv3_sgi(u_int irq, u_int flags, u_int cpu_mask);
+status_t arm_gicv3_set_route_locked(uint vector, uint cpu_mask);
+uint arm_gicv3_get_route(uint vector);
+
+/* cpu interface helpers for the its */
+vaddr_t arm_gicv3_redistributor(uint cpu);
+bool arm_gicv3_cpu_present(uint cpu);
+
+/* gic_v3_its.c, all no-ops where the platform has no ITS */
+struct int_handler_struct *arm_gicv3_lpi_handler(uint vector);
+status_t arm_gicv3_lpi_set_enable(uint vector, bool enable);
+status_t arm_gicv3_lpi_set_route(uint vector, uint cpu_mask);
+uint arm_gicv3_lpi_get_route(uint vector);
+
+#endif // GIC_VERSION > 2
@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * GICv3 support for arm_gic.c: affinity routed distributor, per cpu
+ * redistributors and the system register cpu interface.
+ *
+ * All interrupts are put in non-secure group 1 and taken through
+ * ICC_IAR1_EL1/ICC_EOIR1_EL1. SPIs are routed to a single cpu through
+ * GICD_IROUTER, the boot cpu until set_interrupt_affinity() says otherwise.
+ */
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <dev/interrupt/arm_gic.h>
+#include "arm_gic_priv.h"
+
+#if !ARCH_ARM64
+#error GICv3 support is only implemented for arm64
+#endif
+#if WITH_LIB_SM
+#error GICv3 support does not handle the secure monitor yet
+#endif
+
+#include <arch/arm64.h>
+
+#define LOCAL_TRACE 0
+
+/* the cpu interface registers, by encoding so older assemblers take them */
+#define ICC_PMR_EL1     S3_0_C4_C6_0
+#define ICC_IAR1_EL1    S3_0_C12_C12_0
+#define ICC_EOIR1_EL1   S3_0_C12_C12_1
+#define ICC_BPR1_EL1    S3_0_C12_C12_3
+#define ICC_CTLR_EL1    S3_0_C12_C12_4
+#define ICC_SRE_EL1     S3_0_C12_C12_5
+#define ICC_IGRPEN1_EL1 S3_0_C12_C12_7
+#define ICC_SGI1R_EL1   S3_0_C12_C11_5
+
+#define ICC_SRE_SRE     (1U << 0)
+#define ICC_SRE_DFB     (1U << 1)
+#define ICC_SRE_DIB     (1U << 2)
+
+/* mpidr and redistributor of every cpu that has come up */
+static uint64_t cpu_mpidr[SMP_MAX_CPUS];
+static vaddr_t cpu_gicr[SMP_MAX_CPUS];
+
+/* Aff3.Aff2.Aff1.Aff0 packed the way GICR_TYPER and GICD_IROUTER want them */
+static uint32_t mpidr_to_affinity(uint64_t mpidr)
+{
+    return ((mpidr >> 8) & 0xff000000) | (mpidr & 0xffffff);
+}
+
+static uint64_t mpidr_to_irouter(uint64_t mpidr)
+{
+    return ((mpidr & 0xff00000000ULL)) | (mpidr & 0xffffff);
+}
+
+static void gicd_wait_for_rwp(void)
+{
+    int count = 1000000;
+
+    while (GICREG(0, GICD_CTLR) & GICD_CTLR_RWP) {
+        if (--count == 0) {
+            TRACEF("timed out waiting for the distributor\n");
+            return;
+        }
+    }
+}
+
+static void gicr_wait_for_rwp(vaddr_t gicr)
+{
+    int count = 1000000;
+
+    while (*REG32(gicr + GICR_CTLR) & GICR_CTLR_RWP) {
+        if (--count == 0) {
+            TRACEF("timed out waiting for redistributor %#lx\n", gicr);
+            return;
+        }
+    }
+}
+
+static vaddr_t find_redistributor(uint64_t mpidr)
+{
+    uint32_t aff = mpidr_to_affinity(mpidr);
+    vaddr_t gicr = GICBASE(0) + GICR_OFFSET;
+
+    for (;;) {
+        uint64_t typer = *REG64(gicr + GICR_TYPER);
+
+        if ((typer >> 32) == aff)
+            return gicr;
+        if (typer & GICR_TYPER_LAST)
+            return 0;
+
+        gicr += (typer & GICR_TYPER_VLPIS) ? 0x40000 : 0x20000;
+    }
+}
+
+bool arm_gicv3_cpu_present(uint cpu)
+{
+    return cpu < SMP_MAX_CPUS && cpu_gicr[cpu] != 0;
+}
+
+vaddr_t arm_gicv3_redistributor(uint cpu)
+{
+    return arm_gicv3_cpu_present(cpu) ? cpu_gicr[cpu] : 0;
+}
+
+void arm_gicv3_init(void)
+{
+    uint max_int = MIN(MAX_INT, 32 * ((GICREG(0, GICD_TYPER) & 0x1f) + 1));
+
+    /* affinity routing has to be switched on with the groups off */
+    GICREG(0, GICD_CTLR) = 0;
+    gicd_wait_for_rwp();
+    GICREG(0, GICD_CTLR) = GICD_CTLR_ARE;
+    gicd_wait_for_rwp();
+
+    uint64_t route = mpidr_to_irouter(ARM64_READ_SYSREG(mpidr_el1));
+    for (uint i = GIC_BASE_SPI; i < max_int; i += 32)
+        GICREG(0, GICD_IGROUPR(i / 32)) = ~0U;
+    for (uint i = GIC_BASE_SPI; i < max_int; i++)
+        GICREG64(0, GICD_IROUTER(i)) = route;
+
+    GICREG(0, GICD_CTLR) = GICD_CTLR_ARE | GICD_CTLR_ENABLE_G1A | GICD_CTLR_ENABLE_G1;
+    gicd_wait_for_rwp();
+
+    LTRACEF("typer %#x, %u interrupts\n", GICREG(0, GICD_TYPER), max_int);
+}
+
+void arm_gicv3_init_percpu(void)
+{
+    uint cpu = arch_curr_cpu_num();
+    uint64_t mpidr = ARM64_READ_SYSREG(mpidr_el1);
+
+    vaddr_t gicr = find_redistributor(mpidr);
+    if (!gicr)
+        panic("no GICv3 redistributor for cpu %u, mpidr %#llx\n", cpu, (unsigned long long)mpidr);
+
+    DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
+    cpu_mpidr[cpu] = mpidr;
+    cpu_gicr[cpu] = gicr;
+
+    /* wake the redistributor up */
+    *REG32(gicr + GICR_WAKER) &= ~GICR_WAKER_PROCESSOR_SLEEP;
+    while (*REG32(gicr + GICR_WAKER) & GICR_WAKER_CHILDREN_ASLEEP)
+        ;
+
+    /* SGIs and PPIs are group 1, off and not pending until someone asks */
+    *REG32(gicr + GICR_IGROUPR0) = ~0U;
+    *REG32(gicr + GICR_ICENABLER0) = ~0U;
+    *REG32(gicr + GICR_ICPENDR0) = ~0U;
+    gicr_wait_for_rwp(gicr);
+
+    /* system register access to the cpu interface */
+    uint64_t sre = ARM64_READ_SYSREG(ICC_SRE_EL1);
+    ARM64_WRITE_SYSREG(ICC_SRE_EL1, sre | ICC_SRE_SRE | ICC_SRE_DFB | ICC_SRE_DIB);
+
+    ARM64_WRITE_SYSREG(ICC_PMR_EL1, 0xffULL);   // unmask interrupts at all priority levels
+    ARM64_WRITE_SYSREG(ICC_BPR1_EL1, 0ULL);
+    ARM64_WRITE_SYSREG(ICC_CTLR_EL1, 0ULL);     // EOI drops priority and deactivates
+    ARM64_WRITE_SYSREG(ICC_IGRPEN1_EL1, 1ULL);
+
+    LTRACEF("cpu %u, mpidr %#llx, redistributor %#lx\n", cpu, (unsigned long long)mpidr, gicr);
+}
+
+uint32_t arm_gicv3_acknowledge(void)
+{
+    return ARM64_READ_SYSREG(ICC_IAR1_EL1);
+}
+
+void arm_gicv3_end_of_interrupt(uint32_t iar)
+{
+    ARM64_WRITE_SYSREG(ICC_EOIR1_EL1, (uint64_t)iar);
+}
+
+void arm_gicv3_set_enable(uint vector, bool enable)
+{
+    uint32_t mask = 1U << (vector % 32);
+
+    if (vector < GIC_BASE_SPI) {
+        /* banked per cpu, in this cpu's redistributor */
+        vaddr_t gicr = cpu_gicr[arch_curr_cpu_num()];
+        DEBUG_ASSERT(gicr);
+
+        *REG32(gicr + (enable ? GICR_ISENABLER0 : GICR_ICENABLER0)) = mask;
+        if (!enable)
+            gicr_wait_for_rwp(gicr);
+    } else {
+        GICREG(0, enable ? GICD_ISENABLER(vector / 32) : GICD_ICENABLER(vector / 32)) = mask;
+        if (!enable)
+            gicd_wait_for_rwp();
+    }
+}
+
+status_t arm_gicv3_sgi(u_int irq, u_int flags, u_int cpu_mask)
+{
+    if (irq >= 16)
+        return ERR_INVALID_ARGS;
+
+    switch (flags & ARM_GIC_SGI_FLAG_TARGET_FILTER_MASK) {
+        case ARM_GIC_SGI_FLAG_TARGET_FILTER_NOT_SENDER:
+            /* interrupt routing mode: every cpu but this one */
+            ARM64_WRITE_SYSREG(ICC_SGI1R_EL1, ((uint64_t)irq << 24) | (1ULL << 40));
+            return NO_ERROR;
+        case ARM_GIC_SGI_FLAG_TARGET_FILTER_SENDER:
+            cpu_mask = 1U << arch_curr_cpu_num();
+            break;
+    }
+
+    /* one write per cluster, each holding the Aff0 of the cpus to hit in it */
+    while (cpu_mask) {
+        uint first = __builtin_ctz(cpu_mask);
+        if (first >= SMP_MAX_CPUS)
+            break;
+        if (!cpu_gicr[first]) {
+            /* not up yet, nothing to interrupt */
+            cpu_mask &= ~(1U << first);
+            continue;
+        }
+
+        uint64_t cluster = cpu_mpidr[first] & 0xff00ffff00ULL;
+        uint16_t targets = 0;
+        for (uint cpu = first; cpu < SMP_MAX_CPUS; cpu++) {
+            if ((cpu_mask & (1U << cpu)) && cpu_gicr[cpu] &&
+                    (cpu_mpidr[cpu] & 0xff00ffff00ULL) == cluster) {
+                targets |= 1U << (cpu_mpidr[cpu] & 0xf);
+                cpu_mask &= ~(1U << cpu);
+            }
+        }
+
+        uint64_t val = ((cluster >> 32) & 0xff) << 48 |   // Aff3
+                       ((cluster >> 16) & 0xff) << 32 |   // Aff2
+                       ((cluster >> 8) & 0xff) << 16 |    // Aff1
+                       ((uint64_t)irq << 24) | targets;
+        LTRACEF("ICC_SGI1R_EL1: %#llx\n", (unsigned long long)val);
+        ARM64_WRITE_SYSREG(ICC_SGI1R_EL1, val);
+    }
+
+    return NO_ERROR;
+}
+
+/* SPIs go to exactly one cpu, or with the routing mode bit to any of them. a mask of every
+ * cpu that is up picks the latter, anything else the lowest cpu it names. */
+status_t arm_gicv3_set_route_locked(uint vector, uint cpu_mask)
+{
+    uint present = 0;
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (cpu_gicr[cpu])
+            present |= 1U << cpu;
+    }
+
+    cpu_mask &= present;
+    if (cpu_mask == 0)
+        return ERR_INVALID_ARGS;
+
+    uint64_t route;
+    if (cpu_mask == present && __builtin_popcount(present) > 1)
+        route = GICD_IROUTER_IRM;
+    else
+        route = mpidr_to_irouter(cpu_mpidr[__builtin_ctz(cpu_mask)]);
+
+    LTRACEF("vector %u, mask %#x, irouter %#llx\n", vector, cpu_mask, (unsigned long long)route);
+    GICREG64(0, GICD_IROUTER(vector)) = route;
+
+    return NO_ERROR;
+}
+
+uint arm_gicv3_get_route(uint vector)
+{
+    uint64_t route = GICREG64(0, GICD_IROUTER(vector));
+    uint mask = 0;
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (!cpu_gicr[cpu])
+            continue;
+        if ((route & GICD_IROUTER_IRM) || mpidr_to_irouter(cpu_mpidr[cpu]) == (route & ~GICD_IROUTER_IRM))
+            mask |= 1U << cpu;
+    }
+
+    return mask;
+}
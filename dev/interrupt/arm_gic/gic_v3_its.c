@@ -0,0 +1,586 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * GICv3 interrupt translation service, for MSIs.
+ *
+ * A device raises an MSI by writing its event id to the ITS translation
+ * register. The ITS looks the (device id, event id) pair up in the device's
+ * interrupt translation table and turns it into an LPI delivered to the
+ * redistributor of the collection it maps to. There is one collection per
+ * cpu, numbered like the cpu.
+ *
+ * LPIs have no distributor state: whether one is enabled and its priority
+ * live in a configuration table in memory shared by all redistributors, and
+ * changes to it only take effect once the ITS has been told with INV. The
+ * driver hands out the first GIC_MAX_LPIS of them.
+ *
+ * Tables are allocated from the pmm once the VM is up, the boot cpu's LPIs
+ * and collection are set up then, the other cpus' once they run threads.
+ * LPI state is not restored across cpu suspend.
+ */
+#include <assert.h>
+#include <bits.h>
+#include <pow2.h>
+#include <debug.h>
+#include <err.h>
+#include <list.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <dev/interrupt/arm_gic.h>
+#include <kernel/spinlock.h>
+#include <kernel/vm.h>
+#include <lk/init.h>
+#include "arm_gic_priv.h"
+
+#define LOCAL_TRACE 0
+
+#ifdef GITS_OFFSET
+
+#define GITSREG(reg)            (*REG32(GICBASE(0) + GITS_OFFSET + (reg)))
+#define GITSREG64(reg)          (*REG64(GICBASE(0) + GITS_OFFSET + (reg)))
+
+#define GITS_CTLR               (0x0000)
+#define GITS_IIDR               (0x0004)
+#define GITS_TYPER              (0x0008)
+#define GITS_CBASER             (0x0080)
+#define GITS_CWRITER            (0x0088)
+#define GITS_CREADR             (0x0090)
+#define GITS_BASER(n)           (0x0100 + (n) * 8)
+#define GITS_TRANSLATER         (0x10040)
+
+#define GITS_CTLR_ENABLED       (1U << 0)
+#define GITS_CTLR_QUIESCENT     (1U << 31)
+
+#define GITS_TYPER_PTA          (1ULL << 19)
+
+#define GITS_BASER_VALID        (1ULL << 63)
+#define GITS_BASER_TYPE(v)      (((v) >> 56) & 0x7)
+#define GITS_BASER_TYPE_DEVICE      1
+#define GITS_BASER_TYPE_COLLECTION  4
+#define GITS_BASER_ENTRY_SIZE(v) ((((v) >> 48) & 0x1f) + 1)
+#define GITS_BASER_PAGE_SIZE(v) (((v) >> 8) & 0x3)
+
+/* cacheability and shareability used for everything the ITS and redistributors read */
+#define GIC_BASER_ATTRS         ((7ULL << 59) | (1ULL << 10))
+#define GIC_RDIST_ATTRS         ((7ULL << 7) | (1ULL << 10))
+#define GICR_PENDBASER_PTZ      (1ULL << 62)
+
+/* LPI ids 8192 up to 2^GIC_LPI_ID_BITS - 1, the smallest range that has any */
+#define GIC_LPI_ID_BITS         14
+#define GIC_LPI_CONFIG_SIZE     ((1U << GIC_LPI_ID_BITS) - GIC_LPI_BASE)
+#define GIC_LPI_PENDING_SIZE    ((1U << GIC_LPI_ID_BITS) / 8)
+
+#define LPI_PRIORITY            0xa0
+#define LPI_CONFIG_ENABLE       (1U << 0)
+
+/* events per device, and devices the driver keeps track of */
+#define ITS_EVENT_BITS          5
+#ifndef ITS_MAX_DEVICES
+#define ITS_MAX_DEVICES         32
+#endif
+/* device ids up to what this many 4k pages of device table can hold */
+#define ITS_DEVICE_TABLE_SIZE   (16 * 4096)
+#define ITS_CMD_QUEUE_SIZE      4096
+
+enum {
+    ITS_CMD_MOVI    = 0x01,
+    ITS_CMD_SYNC    = 0x05,
+    ITS_CMD_MAPD    = 0x08,
+    ITS_CMD_MAPC    = 0x09,
+    ITS_CMD_MAPTI   = 0x0a,
+    ITS_CMD_INV     = 0x0c,
+    ITS_CMD_DISCARD = 0x0f,
+};
+
+struct its_cmd {
+    uint64_t dw[4];
+};
+
+struct its_device {
+    uint32_t device_id;
+    bool mapped;
+    paddr_t itt;
+};
+
+struct lpi {
+    struct int_handler_struct h;
+    uint32_t device_id;
+    uint32_t event_id;
+    uint cpu;
+    bool allocated;
+};
+
+static spin_lock_t its_lock = SPIN_LOCK_INITIAL_VALUE;
+static bool its_ready;
+static bool its_pta;
+static uint its_itt_entry_size;
+static uint32_t its_max_device_id;
+
+static struct list_node its_pages = LIST_INITIAL_VALUE(its_pages);
+
+static uint8_t *lpi_config;
+static paddr_t lpi_config_pa;
+
+static struct its_cmd *its_cmds;
+static uint its_cmd_write;
+
+static struct its_device its_devices[ITS_MAX_DEVICES];
+static struct lpi lpis[GIC_MAX_LPIS];
+
+/* physically contiguous zeroed memory the gic may read and write */
+static void *its_alloc(size_t size, uint8_t align_log2, paddr_t *pa)
+{
+    uint count = ROUNDUP(size, PAGE_SIZE) / PAGE_SIZE;
+
+    if (pmm_alloc_contiguous(count, MAX(align_log2, PAGE_SIZE_SHIFT), pa, &its_pages) != count)
+        return NULL;
+
+    void *va = paddr_to_kvaddr(*pa);
+    memset(va, 0, count * PAGE_SIZE);
+    arch_clean_cache_range((addr_t)va, count * PAGE_SIZE);
+
+    return va;
+}
+
+/* the target field of MAPC and SYNC: the redistributor's address or its processor number */
+static uint64_t its_rdbase(uint cpu)
+{
+    vaddr_t gicr = arm_gicv3_redistributor(cpu);
+
+    if (its_pta)
+        return vaddr_to_paddr((void *)gicr) >> 16;
+    return (*REG64(gicr + GICR_TYPER) >> 8) & 0xffff;
+}
+
+static void its_send_locked(const struct its_cmd *cmd)
+{
+    uint next = (its_cmd_write + 1) % (ITS_CMD_QUEUE_SIZE / sizeof(struct its_cmd));
+
+    /* wait for the its to make room */
+    while (GITSREG64(GITS_CREADR) / sizeof(struct its_cmd) == next)
+        ;
+
+    its_cmds[its_cmd_write] = *cmd;
+    arch_clean_cache_range((addr_t)&its_cmds[its_cmd_write], sizeof(*cmd));
+
+    its_cmd_write = next;
+    GITSREG64(GITS_CWRITER) = its_cmd_write * sizeof(struct its_cmd);
+}
+
+/* queue a SYNC for cpu's redistributor and wait for the its to get through the queue */
+static void its_sync_locked(uint cpu)
+{
+    struct its_cmd cmd = { .dw = {
+        ITS_CMD_SYNC, 0, its_rdbase(cpu) << 16, 0,
+    } };
+    its_send_locked(&cmd);
+
+    int count = 1000000;
+    while (GITSREG64(GITS_CREADR) != GITSREG64(GITS_CWRITER)) {
+        if (--count == 0) {
+            TRACEF("timed out waiting for the its, creadr %#llx\n",
+                   (unsigned long long)GITSREG64(GITS_CREADR));
+            return;
+        }
+    }
+}
+
+static void its_inv_locked(const struct lpi *l)
+{
+    struct its_cmd cmd = { .dw = {
+        ITS_CMD_INV | ((uint64_t)l->device_id << 32), l->event_id, 0, 0,
+    } };
+    its_send_locked(&cmd);
+    its_sync_locked(l->cpu);
+}
+
+/* point every BASER at a table of the type it asks for */
+static status_t its_setup_tables(void)
+{
+    for (uint n = 0; n < 8; n++) {
+        uint64_t baser = GITSREG64(GITS_BASER(n));
+        uint type = GITS_BASER_TYPE(baser);
+        size_t size;
+
+        switch (type) {
+            case GITS_BASER_TYPE_DEVICE:
+                size = ITS_DEVICE_TABLE_SIZE;
+                break;
+            case GITS_BASER_TYPE_COLLECTION:
+                size = ROUNDUP(GITS_BASER_ENTRY_SIZE(baser) * SMP_MAX_CPUS, 4096);
+                break;
+            default:
+                continue;
+        }
+
+        /* try 4k, 16k and 64k its pages until one sticks */
+        uint page_code;
+        for (page_code = 0; page_code < 3; page_code++) {
+            size_t page = 4096U << (2 * page_code);
+            size_t table_size = ROUNDUP(size, page);
+            paddr_t pa;
+
+            if (!its_alloc(table_size, log2_uint(page), &pa))
+                return ERR_NO_MEMORY;
+
+            uint64_t val = GITS_BASER_VALID | GIC_BASER_ATTRS |
+                           ((uint64_t)type << 56) | (baser & (0x1fULL << 48)) |
+                           pa | ((uint64_t)page_code << 8) | (table_size / page - 1);
+            GITSREG64(GITS_BASER(n)) = val;
+
+            uint64_t got = GITSREG64(GITS_BASER(n));
+            LTRACEF("baser%u type %u: wrote %#llx, read %#llx\n", n, type,
+                    (unsigned long long)val, (unsigned long long)got);
+            if (GITS_BASER_PAGE_SIZE(got) == page_code) {
+                if (type == GITS_BASER_TYPE_DEVICE) {
+                    its_max_device_id = table_size / GITS_BASER_ENTRY_SIZE(baser) - 1;
+                }
+                break;
+            }
+            /* the pages stay on its_pages, this only happens once at boot */
+        }
+        if (page_code == 3)
+            return ERR_NOT_SUPPORTED;
+    }
+
+    return NO_ERROR;
+}
+
+static status_t its_init(void)
+{
+    if ((GICREG(0, GICD_TYPER) & GICD_TYPER_LPIS) == 0)
+        return ERR_NOT_SUPPORTED;
+
+    /* quiesce it before touching the tables */
+    GITSREG(GITS_CTLR) &= ~GITS_CTLR_ENABLED;
+    while ((GITSREG(GITS_CTLR) & GITS_CTLR_QUIESCENT) == 0)
+        ;
+
+    uint64_t typer = GITSREG64(GITS_TYPER);
+    its_pta = typer & GITS_TYPER_PTA;
+    its_itt_entry_size = ((typer >> 4) & 0xf) + 1;
+    LTRACEF("typer %#llx, itt entry size %u\n", (unsigned long long)typer, its_itt_entry_size);
+
+    status_t err = its_setup_tables();
+    if (err < 0)
+        return err;
+
+    /* the lpi configuration table, shared by every redistributor */
+    lpi_config = its_alloc(GIC_LPI_CONFIG_SIZE, 12, &lpi_config_pa);
+    if (!lpi_config)
+        return ERR_NO_MEMORY;
+    memset(lpi_config, LPI_PRIORITY, GIC_LPI_CONFIG_SIZE);
+    arch_clean_cache_range((addr_t)lpi_config, GIC_LPI_CONFIG_SIZE);
+
+    /* the command queue */
+    paddr_t cmd_pa;
+    its_cmds = its_alloc(ITS_CMD_QUEUE_SIZE, 12, &cmd_pa);
+    if (!its_cmds)
+        return ERR_NO_MEMORY;
+    GITSREG64(GITS_CBASER) = GITS_BASER_VALID | GIC_BASER_ATTRS | cmd_pa | (ITS_CMD_QUEUE_SIZE / 4096 - 1);
+    GITSREG64(GITS_CWRITER) = 0;
+    its_cmd_write = 0;
+
+    GITSREG(GITS_CTLR) |= GITS_CTLR_ENABLED;
+
+    return NO_ERROR;
+}
+
+/* give the current cpu's redistributor the lpi tables and map its collection */
+static void its_init_percpu(void)
+{
+    if (!its_ready)
+        return;
+
+    uint cpu = arch_curr_cpu_num();
+    vaddr_t gicr = arm_gicv3_redistributor(cpu);
+
+    if (*REG32(gicr + GICR_CTLR) & GICR_CTLR_ENABLE_LPIS) {
+        /* whoever booted us left them on and the tables can't be changed any more */
+        TRACEF("cpu %u: lpis already enabled, not using them\n", cpu);
+        return;
+    }
+
+    paddr_t pending_pa;
+    if (!its_alloc(GIC_LPI_PENDING_SIZE, 16, &pending_pa)) {
+        TRACEF("cpu %u: no memory for the lpi pending table\n", cpu);
+        return;
+    }
+
+    *REG64(gicr + GICR_PROPBASER) = lpi_config_pa | GIC_RDIST_ATTRS | (GIC_LPI_ID_BITS - 1);
+    *REG64(gicr + GICR_PENDBASER) = pending_pa | GIC_RDIST_ATTRS | GICR_PENDBASER_PTZ;
+    *REG32(gicr + GICR_CTLR) |= GICR_CTLR_ENABLE_LPIS;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&its_lock, state);
+
+    struct its_cmd cmd = { .dw = {
+        ITS_CMD_MAPC, 0, GITS_BASER_VALID | (its_rdbase(cpu) << 16) | cpu, 0,
+    } };
+    its_send_locked(&cmd);
+    its_sync_locked(cpu);
+
+    spin_unlock_irqrestore(&its_lock, state);
+
+    LTRACEF("cpu %u: collection mapped\n", cpu);
+}
+
+static void its_init_hook(uint level)
+{
+    status_t err = its_init();
+    if (err < 0) {
+        dprintf(INFO, "GICv3: no ITS, msis not available (%d)\n", err);
+        return;
+    }
+
+    its_ready = true;
+    its_init_percpu();
+}
+
+/* after the pmm has memory, before the secondary cpus come up */
+LK_INIT_HOOK(arm_gicv3_its, its_init_hook, LK_INIT_LEVEL_VM);
+
+static void its_init_secondary(uint level)
+{
+    its_init_percpu();
+}
+
+/* the pmm takes a mutex, so secondaries wait until they can block */
+LK_INIT_HOOK_FLAGS(arm_gicv3_its_percpu, its_init_secondary,
+                   LK_INIT_LEVEL_THREADING, LK_INIT_FLAG_SECONDARY_CPUS);
+
+static struct its_device *its_get_device_locked(uint32_t device_id)
+{
+    struct its_device *free = NULL;
+
+    for (uint i = 0; i < ITS_MAX_DEVICES; i++) {
+        if (its_devices[i].mapped && its_devices[i].device_id == device_id)
+            return &its_devices[i];
+        if (!its_devices[i].mapped && !free)
+            free = &its_devices[i];
+    }
+    if (!free)
+        return NULL;
+
+    void *itt = its_alloc(its_itt_entry_size << ITS_EVENT_BITS, 8, &free->itt);
+    if (!itt)
+        return NULL;
+
+    free->device_id = device_id;
+    free->mapped = true;
+
+    struct its_cmd cmd = { .dw = {
+        ITS_CMD_MAPD | ((uint64_t)device_id << 32), ITS_EVENT_BITS - 1,
+        GITS_BASER_VALID | free->itt, 0,
+    } };
+    its_send_locked(&cmd);
+
+    return free;
+}
+
+status_t arm_gic_alloc_msi(uint32_t device_id, uint32_t event_id, int_handler handler, void *arg,
+                           uint *vector, paddr_t *msi_addr, uint32_t *msi_data)
+{
+    if (!its_ready)
+        return ERR_NOT_SUPPORTED;
+    if (device_id > its_max_device_id || event_id >= (1U << ITS_EVENT_BITS))
+        return ERR_OUT_OF_RANGE;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&its_lock, state);
+
+    status_t err = ERR_NO_RESOURCES;
+    uint i;
+    for (i = 0; i < GIC_MAX_LPIS; i++) {
+        if (!lpis[i].allocated)
+            break;
+    }
+    if (i == GIC_MAX_LPIS)
+        goto out;
+
+    if (!its_get_device_locked(device_id)) {
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+
+    struct lpi *l = &lpis[i];
+    l->h.handler = handler;
+    l->h.arg = arg;
+    l->device_id = device_id;
+    l->event_id = event_id;
+    l->cpu = arch_curr_cpu_num();
+    l->allocated = true;
+
+    /* masked until the driver unmasks it */
+    lpi_config[i] = LPI_PRIORITY;
+    arch_clean_cache_range((addr_t)&lpi_config[i], 1);
+
+    struct its_cmd cmd = { .dw = {
+        ITS_CMD_MAPTI | ((uint64_t)device_id << 32),
+        event_id | ((uint64_t)(GIC_LPI_BASE + i) << 32), l->cpu, 0,
+    } };
+    its_send_locked(&cmd);
+    its_inv_locked(l);
+
+    *vector = GIC_LPI_BASE + i;
+    *msi_addr = vaddr_to_paddr((void *)(GICBASE(0) + GITS_OFFSET + GITS_TRANSLATER));
+    *msi_data = event_id;
+    err = NO_ERROR;
+
+    LTRACEF("device %#x event %u: lpi %u, doorbell %#lx\n", device_id, event_id, *vector, *msi_addr);
+
+out:
+    spin_unlock_irqrestore(&its_lock, state);
+    return err;
+}
+
+void arm_gic_free_msi(uint vector)
+{
+    if (vector < GIC_LPI_BASE || vector >= GIC_LPI_BASE + GIC_MAX_LPIS)
+        return;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&its_lock, state);
+
+    struct lpi *l = &lpis[vector - GIC_LPI_BASE];
+    if (l->allocated) {
+        struct its_cmd cmd = { .dw = {
+            ITS_CMD_DISCARD | ((uint64_t)l->device_id << 32), l->event_id, 0, 0,
+        } };
+        its_send_locked(&cmd);
+        its_sync_locked(l->cpu);
+
+        lpi_config[vector - GIC_LPI_BASE] = LPI_PRIORITY;
+        arch_clean_cache_range((addr_t)&lpi_config[vector - GIC_LPI_BASE], 1);
+        memset(l, 0, sizeof(*l));
+    }
+
+    spin_unlock_irqrestore(&its_lock, state);
+}
+
+struct int_handler_struct *arm_gicv3_lpi_handler(uint vector)
+{
+    if (vector < GIC_LPI_BASE || vector >= GIC_LPI_BASE + GIC_MAX_LPIS)
+        return NULL;
+
+    return &lpis[vector - GIC_LPI_BASE].h;
+}
+
+status_t arm_gicv3_lpi_set_enable(uint vector, bool enable)
+{
+    if (vector < GIC_LPI_BASE || vector >= GIC_LPI_BASE + GIC_MAX_LPIS)
+        return ERR_INVALID_ARGS;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&its_lock, state);
+
+    status_t err = ERR_NOT_FOUND;
+    struct lpi *l = &lpis[vector - GIC_LPI_BASE];
+    if (l->allocated) {
+        lpi_config[vector - GIC_LPI_BASE] = LPI_PRIORITY | (enable ? LPI_CONFIG_ENABLE : 0);
+        arch_clean_cache_range((addr_t)&lpi_config[vector - GIC_LPI_BASE], 1);
+        its_inv_locked(l);
+        err = NO_ERROR;
+    }
+
+    spin_unlock_irqrestore(&its_lock, state);
+    return err;
+}
+
+/* lpis go to one collection, so one cpu: the lowest in the mask that is up */
+status_t arm_gicv3_lpi_set_route(uint vector, uint cpu_mask)
+{
+    if (vector < GIC_LPI_BASE || vector >= GIC_LPI_BASE + GIC_MAX_LPIS)
+        return ERR_INVALID_ARGS;
+
+    uint cpu;
+    for (cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if ((cpu_mask & (1U << cpu)) && arm_gicv3_cpu_present(cpu))
+            break;
+    }
+    if (cpu == SMP_MAX_CPUS)
+        return ERR_INVALID_ARGS;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&its_lock, state);
+
+    status_t err = ERR_NOT_FOUND;
+    struct lpi *l = &lpis[vector - GIC_LPI_BASE];
+    if (l->allocated) {
+        struct its_cmd cmd = { .dw = {
+            ITS_CMD_MOVI | ((uint64_t)l->device_id << 32), l->event_id, cpu, 0,
+        } };
+        its_send_locked(&cmd);
+        its_sync_locked(l->cpu);
+        l->cpu = cpu;
+        err = NO_ERROR;
+    }
+
+    spin_unlock_irqrestore(&its_lock, state);
+    return err;
+}
+
+uint arm_gicv3_lpi_get_route(uint vector)
+{
+    if (vector < GIC_LPI_BASE || vector >= GIC_LPI_BASE + GIC_MAX_LPIS)
+        return 0;
+
+    const struct lpi *l = &lpis[vector - GIC_LPI_BASE];
+    return l->allocated ? 1U << l->cpu : 0;
+}
+
+#else // !GITS_OFFSET
+
+status_t arm_gic_alloc_msi(uint32_t device_id, uint32_t event_id, int_handler handler, void *arg,
+                           uint *vector, paddr_t *msi_addr, uint32_t *msi_data)
+{
+    return ERR_NOT_SUPPORTED;
+}
+
+void arm_gic_free_msi(uint vector)
+{
+}
+
+struct int_handler_struct *arm_gicv3_lpi_handler(uint vector)
+{
+    return NULL;
+}
+
+status_t arm_gicv3_lpi_set_enable(uint vector, bool enable)
+{
+    return ERR_INVALID_ARGS;
+}
+
+status_t arm_gicv3_lpi_set_route(uint vector, uint cpu_mask)
+{
+    return ERR_INVALID_ARGS;
+}
+
+uint arm_gicv3_lpi_get_route(uint vector)
+{
+    return 0;
+}
+
+#endif // GITS_OFFSET
@@ -24,6 +24,7 @@
 #define __DEV_INTERRUPT_ARM_GIC_H
 
 #include <sys/types.h>
+#include <platform/interrupts.h>
 
 void arm_gic_init(void);
 
@@ -53,5 +54,17 @@ enum {
 };
 status_t arm_gic_sgi(u_int irq, u_int flags, u_int cpu_mask);
 
+#if GIC_VERSION > 2
+/*
+ * Allocate an LPI for event event_id of the MSI capable device device_id and
+ * route it through the ITS to the current cpu. The device should be programmed
+ * to write msi_data to msi_addr. The LPI starts masked, unmask it with
+ * unmask_interrupt(*vector) once the device is ready.
+ */
+status_t arm_gic_alloc_msi(uint32_t device_id, uint32_t event_id, int_handler handler, void *arg,
+                           uint *vector, paddr_t *msi_addr, uint32_t *msi_data);
+void arm_gic_free_msi(uint vector);
+#endif
+
 #endif
 
@@ -2,7 +2,20 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
+# 2 for GICv2 and older with a memory mapped cpu interface, 3 for GICv3 through system
+# registers, with redistributors and, if the platform's gic.h has GITS_OFFSET, an ITS for MSIs
+GIC_VERSION ?= 2
+
+GLOBAL_DEFINES += \
+	GIC_VERSION=$(GIC_VERSION)
+
 MODULE_SRCS += \
 	$(LOCAL_DIR)/arm_gic.c
 
+ifeq ($(GIC_VERSION),3)
+MODULE_SRCS += \
+	$(LOCAL_DIR)/gic_v3.c \
+	$(LOCAL_DIR)/gic_v3_its.c
+endif
+
 include make/module.mk
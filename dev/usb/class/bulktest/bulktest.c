@@ -32,6 +32,10 @@
 #include <dev/usbc.h>
 #include <dev/usb.h>
 #include <lk/init.h>
+#include <platform.h>
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+#endif
 
 /* a simple demo usb class device that reflects data written to
  * one endpoint to the other.
@@ -47,40 +51,53 @@ static status_t ep_cb_tx(ep_t endpoint, usbc_transfer_t *t);
 
 #define TRANSFER_SIZE 512
 
-static void queue_rx(void)
-{
-    static usbc_transfer_t transfer;
-    static uint8_t buf[TRANSFER_SIZE];
+/* transfers kept queued on each endpoint, so the controller always has the
+ * next one ready when one completes */
+#ifndef BULKTEST_QUEUE_DEPTH
+#define BULKTEST_QUEUE_DEPTH 4
+#endif
 
-    transfer.callback = &ep_cb_rx;
-    transfer.result = 0;
-    transfer.buf = &buf;
-    transfer.buflen = sizeof(buf);
-    transfer.bufpos = 0;
-    transfer.extra = 0;
+struct bulktest_xfer {
+    usbc_transfer_t transfer;
+    uint8_t buf[TRANSFER_SIZE];
+};
 
-    usbc_queue_rx(1, &transfer);
-}
+static struct bulktest_xfer rx_xfers[BULKTEST_QUEUE_DEPTH];
+static struct bulktest_xfer tx_xfers[BULKTEST_QUEUE_DEPTH];
 
-static void queue_tx(void)
-{
-    static usbc_transfer_t transfer;
-    static uint8_t buf[TRANSFER_SIZE];
+static ep_t bulktest_epin;
+static ep_t bulktest_epout;
 
-    for (uint i = 0; i < sizeof(buf); i++) {
-        buf[i] = ~i;
-    }
+/* throughput since the device came online or the stats were last cleared */
+static struct {
+    lk_time_t start;
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    uint rx_transfers;
+    uint tx_transfers;
+} stats;
 
-    transfer.callback = &ep_cb_tx;
-    transfer.result = 0;
-    transfer.buf = &buf;
-    transfer.buflen = sizeof(buf);
-    transfer.bufpos = 0;
-    transfer.extra = 0;
+static void queue_rx(usbc_transfer_t *transfer)
+{
+    transfer->callback = &ep_cb_rx;
+    transfer->result = 0;
+    transfer->buflen = TRANSFER_SIZE;
+    transfer->bufpos = 0;
+    transfer->extra = 0;
 
-    usbc_queue_tx(1, &transfer);
+    usbc_queue_rx(bulktest_epout, transfer);
 }
 
+static void queue_tx(usbc_transfer_t *transfer)
+{
+    transfer->callback = &ep_cb_tx;
+    transfer->result = 0;
+    transfer->buflen = TRANSFER_SIZE;
+    transfer->bufpos = 0;
+    transfer->extra = 0;
+
+    usbc_queue_tx(bulktest_epin, transfer);
+}
 
 static status_t ep_cb_rx(ep_t endpoint, usbc_transfer_t *t)
 {
@@ -93,8 +110,11 @@ static status_t ep_cb_rx(ep_t endpoint, usbc_transfer_t *t)
     }
 #endif
 
-    if (t->result >= 0)
-        queue_rx();
+    if (t->result >= 0) {
+        stats.rx_bytes += t->bufpos;
+        stats.rx_transfers++;
+        queue_rx(t);
+    }
 
     return NO_ERROR;
 }
@@ -106,22 +126,37 @@ static status_t ep_cb_tx(ep_t endpoint, usbc_transfer_t *t)
     usbc_dump_transfer(t);
 #endif
 
-    if (t->result >= 0)
-        queue_tx();
+    if (t->result >= 0) {
+        stats.tx_bytes += t->bufpos;
+        stats.tx_transfers++;
+        queue_tx(t);
+    }
 
     return NO_ERROR;
 }
 
+static void bulktest_clear_stats(void)
+{
+    stats.rx_bytes = 0;
+    stats.tx_bytes = 0;
+    stats.rx_transfers = 0;
+    stats.tx_transfers = 0;
+    stats.start = current_time();
+}
+
 static status_t bulktest_usb_cb(void *cookie, usb_callback_op_t op, const union usb_callback_args *args)
 {
     LTRACEF("cookie %p, op %u, args %p\n", cookie, op, args);
 
     if (op == USB_CB_ONLINE) {
-        usbc_setup_endpoint(1, USB_IN, 0x40, USB_BULK);
-        usbc_setup_endpoint(1, USB_OUT, 0x40, USB_BULK);
-
-        queue_rx();
-        queue_tx();
+        usbc_setup_endpoint(bulktest_epin, USB_IN, 0x40, USB_BULK);
+        usbc_setup_endpoint(bulktest_epout, USB_OUT, 0x40, USB_BULK);
+
+        bulktest_clear_stats();
+        for (uint i = 0; i < BULKTEST_QUEUE_DEPTH; i++) {
+            queue_rx(&rx_xfers[i].transfer);
+            queue_tx(&tx_xfers[i].transfer);
+        }
     }
     return NO_ERROR;
 }
@@ -130,6 +165,16 @@ status_t usb_class_bulktest_init(uint interface_num, ep_t epin, ep_t epout)
 {
     LTRACEF("epin %u, epout %u\n", epin, epout);
 
+    bulktest_epin = epin;
+    bulktest_epout = epout;
+
+    for (uint i = 0; i < BULKTEST_QUEUE_DEPTH; i++) {
+        rx_xfers[i].transfer.buf = rx_xfers[i].buf;
+        tx_xfers[i].transfer.buf = tx_xfers[i].buf;
+        for (uint j = 0; j < TRANSFER_SIZE; j++)
+            tx_xfers[i].buf[j] = ~j;
+    }
+
     /* build a descriptor for it */
     uint8_t if_descriptor[] = {
         0x09,           /* length */
@@ -167,3 +212,30 @@ status_t usb_class_bulktest_init(uint interface_num, ep_t epin, ep_t epout)
     return NO_ERROR;
 }
 
+#if WITH_LIB_CONSOLE
+
+static int cmd_bulktest(int argc, const cmd_args *argv)
+{
+    if (argc >= 2 && !strcmp(argv[1].str, "clear")) {
+        bulktest_clear_stats();
+        return NO_ERROR;
+    }
+
+    lk_time_t elapsed = current_time() - stats.start;
+    if (elapsed == 0)
+        elapsed = 1;
+
+    printf("%u ms, queue depth %u\n", (uint)elapsed, BULKTEST_QUEUE_DEPTH);
+    printf("rx: %llu bytes in %u transfers, %llu bytes/sec\n",
+           stats.rx_bytes, stats.rx_transfers, stats.rx_bytes * 1000 / elapsed);
+    printf("tx: %llu bytes in %u transfers, %llu bytes/sec\n",
+           stats.tx_bytes, stats.tx_transfers, stats.tx_bytes * 1000 / elapsed);
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("bulktest", "usb bulk test throughput, 'clear' to restart the measurement", &cmd_bulktest)
+STATIC_COMMAND_END(bulktest);
+
+#endif
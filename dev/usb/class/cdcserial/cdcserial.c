@@ -312,7 +312,7 @@ ssize_t cdcserial_read_async(cdcserial_channel_t *chan, usbc_transfer_t *transfe
 ssize_t cdcserial_read(cdcserial_channel_t *chan, size_t len, uint8_t *buf)
 {
     usbc_transfer_t transfer;
-    status_t ret = cdcserial_write_async(chan, &transfer, &usb_recv_cplt_cb, len, buf);
+    status_t ret = cdcserial_read_async(chan, &transfer, &usb_recv_cplt_cb, len, buf);
     if (ret != NO_ERROR) {
         return ret;
     }
@@ -49,7 +49,8 @@ typedef struct _cdcserial_channel_t {
 
 void cdcserial_create_channel(cdcserial_channel_t *chan, int data_ep_addr, int ctrl_ep_addr);
 
-// Write len bytes to the CDC Serial Virtual Com Port.
+// Write len bytes to the CDC Serial Virtual Com Port. Any number of async
+// transfers may be outstanding at once, they complete in order.
 status_t cdcserial_write(cdcserial_channel_t *chan, size_t len, uint8_t *buf);
 status_t cdcserial_write_async(cdcserial_channel_t *chan, usbc_transfer_t *transfer, ep_callback cb,
                                size_t len, uint8_t *buf);
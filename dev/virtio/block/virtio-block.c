@@ -28,6 +28,8 @@
 #include <compiler.h>
 #include <list.h>
 #include <err.h>
+#include <stdlib.h>
+#include <kernel/dma.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
 #include <kernel/mutex.h>
@@ -76,23 +78,49 @@ struct virtio_blk_req {
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
 static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count);
 static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count);
+static status_t virtio_bdev_submit(struct bdev *bdev, bio_request_t *req);
+
+/* descriptors in the ring, which bounds the number of requests in flight */
+#define VIRTIO_BLOCK_RING_SIZE 256
+
+/* largest transfer handed to the device as one request, and the most pages
+ * its buffers may touch. worst case every page needs its own descriptor, plus
+ * the header and status ones. */
+#define VIRTIO_BLOCK_MAX_TXN_SIZE ((size_t)(VIRTIO_BLOCK_RING_SIZE / 4) * PAGE_SIZE)
+#define VIRTIO_BLOCK_MAX_TXN_PAGES (VIRTIO_BLOCK_MAX_TXN_SIZE / PAGE_SIZE + 1)
+
+/* most scatter list entries gathered into one transfer */
+#define VIRTIO_BLOCK_MAX_TXN_IOVS 16
+
+/* called with interrupts disabled, from the irq handler or the irq thread, when a
+ * transfer completes */
+typedef void (*virtio_block_done_t)(void *arg, status_t err);
+
+/* state for one in flight transfer. there is one per ring descriptor, indexed
+ * by the head descriptor of the transfer's chain, and they are aligned so that
+ * the header and status byte handed to the device never cross a page. */
+struct virtio_block_txn {
+    struct virtio_blk_req req;
+    uint8_t status;
+
+    virtio_block_done_t done;
+    void *arg;
+} __ALIGNED(64);
 
 struct virtio_block_dev {
     struct virtio_device *dev;
 
-    mutex_t lock;
-    event_t io_event;
+    /* protects descriptor allocation, submission and completion on the ring */
+    spin_lock_t lock;
+
+    /* signaled whenever descriptors are returned to the ring */
+    event_t desc_event;
 
     /* bio block device */
     bdev_t bdev;
 
-    /* one blk_req structure for io, not crossing a page boundary */
-    struct virtio_blk_req *blk_req;
-    paddr_t blk_req_phys;
-
-    /* one uint8_t response word */
-    uint8_t blk_response;
-    paddr_t blk_response_phys;
+    /* per transfer state, indexed by head descriptor */
+    struct virtio_block_txn *txns;
 };
 
 status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
@@ -104,25 +132,18 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     if (!bdev)
         return ERR_NO_MEMORY;
 
-    mutex_init(&bdev->lock);
-    event_init(&bdev->io_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    spin_lock_init(&bdev->lock);
+    event_init(&bdev->desc_event, false, 0);
 
     bdev->dev = dev;
     dev->priv = bdev;
 
-    bdev->blk_req = memalign(sizeof(struct virtio_blk_req), sizeof(struct virtio_blk_req));
-#if WITH_KERNEL_VM
-    bdev->blk_req_phys = vaddr_to_paddr(bdev->blk_req);
-#else
-    bdev->blk_freq_phys = (uint64_t)(uintptr_t)bdev->blk_req;
-#endif
-    LTRACEF("blk_req structure at %p (0x%lx phys)\n", bdev->blk_req, bdev->blk_req_phys);
-
-#if WITH_KERNEL_VM
-    bdev->blk_response_phys = vaddr_to_paddr(&bdev->blk_response);
-#else
-    bdev->blk_response_phys = (uint64_t)(uintptr_t)&bdev->blk_response;
-#endif
+    bdev->txns = memalign(sizeof(struct virtio_block_txn), sizeof(struct virtio_block_txn) * VIRTIO_BLOCK_RING_SIZE);
+    if (!bdev->txns) {
+        free(bdev);
+        return ERR_NO_MEMORY;
+    }
+    LTRACEF("txn structures at %p\n", bdev->txns);
 
     /* make sure the device is reset */
     virtio_reset_device(dev);
@@ -138,9 +159,10 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     virtio_status_acknowledge_driver(dev);
 
     // XXX check features bits and ack/nak them
+    virtio_set_guest_features(dev, 0);
 
     /* allocate a virtio ring */
-    virtio_alloc_ring(dev, 0, 256);
+    virtio_alloc_ring(dev, 0, VIRTIO_BLOCK_RING_SIZE);
 
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_block_irq_driver_callback;
@@ -159,6 +181,7 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     /* override our block device hooks */
     bdev->bdev.read_block = &virtio_bdev_read_block;
     bdev->bdev.write_block = &virtio_bdev_write_block;
+    bdev->bdev.submit = &virtio_bdev_submit;
 
     bio_register_device(&bdev->bdev);
 
@@ -167,17 +190,14 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     return NO_ERROR;
 }
 
-static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e)
+/* return a completed chain to the free list. bdev->lock must be held. */
+static void virtio_block_free_chain(struct virtio_block_dev *bdev, uint16_t i)
 {
-    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
-
-    LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
+    struct virtio_device *dev = bdev->dev;
 
-    /* parse our descriptor chain, add back to the free queue */
-    uint16_t i = e->id;
     for (;;) {
         int next;
-        struct vring_desc *desc = virtio_desc_index_to_desc(dev, ring, i);
+        struct vring_desc *desc = virtio_desc_index_to_desc(dev, 0, i);
 
         //virtio_dump_desc(desc);
 
@@ -188,111 +208,150 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
             next = -1;
         }
 
-        virtio_free_desc(dev, ring, i);
+        virtio_free_desc(dev, 0, i);
 
         if (next < 0)
             break;
         i = next;
     }
 
-    /* signal our event */
-    event_signal(&bdev->io_event, false);
-
-    return INT_RESCHEDULE;
+    event_signal(&bdev->desc_event, false);
 }
 
-ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write)
+static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e)
 {
     struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
 
-    uint16_t i;
-    struct vring_desc *desc;
-    paddr_t pa;
+    LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
+
+    /* the used element carries the head of the chain, which identifies the
+     * transfer. pick up its state before the slot can be reused. */
+    DEBUG_ASSERT(e->id < VIRTIO_BLOCK_RING_SIZE);
+    struct virtio_block_txn *txn = &bdev->txns[e->id];
+    dma_unmap_single(&txn->status, 1, DMA_FROM_DEVICE);
+    uint8_t status = txn->status;
+    virtio_block_done_t done = txn->done;
+    void *arg = txn->arg;
+
+    LTRACEF("status 0x%hhx\n", status);
+
+    spin_lock(&bdev->lock);
+    virtio_block_free_chain(bdev, e->id);
+    spin_unlock(&bdev->lock);
+
+    done(arg, (status == VIRTIO_BLK_S_OK) ? NO_ERROR : ERR_IO);
+
+    /* the interrupt dispatch works out whether any waiter woken should preempt */
+    return INT_NO_RESCHEDULE;
+}
+
+/* number of pages a buffer touches */
+static size_t virtio_block_pages_spanned(const void *buf, size_t len)
+{
     vaddr_t va = (vaddr_t)buf;
 
-    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+    return (ROUNDUP(va + len, PAGE_SIZE) - ROUNDDOWN(va, PAGE_SIZE)) / PAGE_SIZE;
+}
 
-    mutex_acquire(&bdev->lock);
+/* queue a single transfer of at most VIRTIO_BLOCK_MAX_TXN_SIZE, touching at
+ * most VIRTIO_BLOCK_MAX_TXN_PAGES pages, gathered from or scattered to the
+ * iovec list. done is called from the irq handler when it completes. blocks
+ * while the ring is full, so must be called from thread context. */
+static void virtio_block_queue(struct virtio_block_dev *bdev, const iovec_t *iov, uint iov_cnt, off_t offset,
+                               bool write, virtio_block_done_t done, void *arg)
+{
+    struct virtio_device *dev = bdev->dev;
+    uint16_t i;
+    struct vring_desc *desc;
 
-    /* set up the request */
-    bdev->blk_req->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    bdev->blk_req->ioprio = 0;
-    bdev->blk_req->sector = offset / 512;
-    LTRACEF("blk_req type %u ioprio %u sector %llu\n",
-            bdev->blk_req->type, bdev->blk_req->ioprio, bdev->blk_req->sector);
+    /* header, status and one descriptor per page the buffers touch */
+    size_t needed = 2;
+    for (uint n = 0; n < iov_cnt; n++)
+        needed += virtio_block_pages_spanned(iov[n].iov_base, iov[n].iov_len);
+    DEBUG_ASSERT(needed <= 2 + VIRTIO_BLOCK_MAX_TXN_PAGES);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bdev->lock, state);
+
+    /* wait for enough of the ring to free up */
+    while (dev->ring[0].free_count < needed) {
+        event_unsignal(&bdev->desc_event);
+        spin_unlock_irqrestore(&bdev->lock, state);
+        event_wait(&bdev->desc_event);
+        spin_lock_irqsave(&bdev->lock, state);
+    }
 
     /* put together a transfer */
-    desc = virtio_alloc_desc_chain(dev, 0, 3, &i);
+    desc = virtio_alloc_desc_chain(dev, 0, 1, &i);
     LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
+    DEBUG_ASSERT(desc);
 
-    // XXX not cache safe.
-    // At the moment only tested on arm qemu, which doesn't emulate cache.
+    /* set up the request */
+    struct virtio_block_txn *txn = &bdev->txns[i];
+    txn->req.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    txn->req.ioprio = 0;
+    txn->req.sector = offset / 512;
+    txn->status = VIRTIO_BLK_S_IOERR;
+    txn->done = done;
+    txn->arg = arg;
+    LTRACEF("blk_req type %u ioprio %u sector %llu\n",
+            txn->req.type, txn->req.ioprio, txn->req.sector);
 
     /* set up the descriptor pointing to the head */
-    desc->addr = bdev->blk_req_phys;
+    desc->addr = dma_map_single(&txn->req, sizeof(struct virtio_blk_req), DMA_TO_DEVICE);
     desc->len = sizeof(struct virtio_blk_req);
-    desc->flags |= VRING_DESC_F_NEXT;
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
+    /* add descriptors for the buffers, one per physically contiguous run */
+    bool data = false;
+    for (uint n = 0; n < iov_cnt; n++) {
+        vaddr_t va = (vaddr_t)iov[n].iov_base;
+        size_t len = iov[n].iov_len;
+
+        dma_sync_for_device((void *)va, len, write ? DMA_TO_DEVICE : DMA_FROM_DEVICE);
+        while (len > 0) {
 #if WITH_KERNEL_VM
-    /* translate the first buffer */
-    pa = vaddr_to_paddr((void *)va);
-    desc->addr = (uint64_t)pa;
-    /* desc->len is filled in below */
+            /* translate a page at a time */
+            size_t len_tohandle = MIN(len, PAGE_SIZE - (va & (PAGE_SIZE - 1)));
+            paddr_t pa = vaddr_to_paddr((void *)va);
 #else
-    desc->addr = (uint64_t)(uintptr_t)buf;
-    desc->len = len;
+            size_t len_tohandle = len;
+            paddr_t pa = va;
 #endif
-    desc->flags |= write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-    desc->flags |= VRING_DESC_F_NEXT;
-
-#if WITH_KERNEL_VM
-    /* see if we need to add more descriptors due to scatter gather */
-    paddr_t next_pa = PAGE_ALIGN(pa + 1);
-    desc->len = MIN(next_pa - pa, len);
-    LTRACEF("first descriptor va 0x%lx desc->addr 0x%llx desc->len %u\n", va, desc->addr, desc->len);
-    len -= desc->len;
-    while (len > 0) {
-        /* amount of source buffer handled by this iteration of the loop */
-        size_t len_tohandle = MIN(len, PAGE_SIZE);
-
-        /* translate the next page in the buffer */
-        va = PAGE_ALIGN(va + 1);
-        pa = vaddr_to_paddr((void *)va);
-        LTRACEF("va now 0x%lx, pa 0x%lx, next_pa 0x%lx, remaining len %zu\n", va, pa, next_pa, len);
-
-        /* is the new translated physical address contiguous to the last one? */
-        if (next_pa == pa) {
-            LTRACEF("extending last one by %zu bytes\n", len_tohandle);
-            desc->len += len_tohandle;
-        } else {
-            uint16_t next_i = virtio_alloc_desc(dev, 0);
-            struct vring_desc *next_desc = virtio_desc_index_to_desc(dev, 0, next_i);
-            DEBUG_ASSERT(next_desc);
-
-            LTRACEF("doesn't extend, need new desc, allocated desc %i (%p)\n", next_i, next_desc);
-
-            /* fill this descriptor in and put it after the last one but before the response descriptor */
-            next_desc->addr = (uint64_t)pa;
-            next_desc->len = len_tohandle;
-            next_desc->flags = write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-            next_desc->flags |= VRING_DESC_F_NEXT;
-            next_desc->next = desc->next;
-            desc->next = next_i;
-
-            desc = next_desc;
+            LTRACEF("va 0x%lx, pa 0x%lx, len %zu\n", va, pa, len_tohandle);
+
+            /* is the new translated physical address contiguous to the last one? */
+            if (data && desc->addr + desc->len == pa) {
+                LTRACEF("extending last one by %zu bytes\n", len_tohandle);
+                desc->len += len_tohandle;
+            } else {
+                uint16_t next_i = virtio_alloc_desc(dev, 0);
+                struct vring_desc *next_desc = virtio_desc_index_to_desc(dev, 0, next_i);
+                DEBUG_ASSERT(next_desc);
+
+                LTRACEF("doesn't extend, need new desc, allocated desc %i (%p)\n", next_i, next_desc);
+
+                next_desc->addr = (uint64_t)pa;
+                next_desc->len = len_tohandle;
+                next_desc->flags = write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
+                desc->flags |= VRING_DESC_F_NEXT;
+                desc->next = next_i;
+
+                desc = next_desc;
+                data = true;
+            }
+            va += len_tohandle;
+            len -= len_tohandle;
         }
-        len -= len_tohandle;
-        next_pa += PAGE_SIZE;
     }
-#endif
 
     /* set up the descriptor pointing to the response */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-    desc->addr = bdev->blk_response_phys;
-    desc->len = 1;
-    desc->flags = VRING_DESC_F_WRITE;
+    uint16_t status_i = virtio_alloc_desc(dev, 0);
+    struct vring_desc *status_desc = virtio_desc_index_to_desc(dev, 0, status_i);
+    status_desc->addr = dma_map_single(&txn->status, 1, DMA_FROM_DEVICE);
+    status_desc->len = 1;
+    status_desc->flags = VRING_DESC_F_WRITE;
+    desc->flags |= VRING_DESC_F_NEXT;
+    desc->next = status_i;
 
     /* submit the transfer */
     virtio_submit_chain(dev, 0, i);
@@ -300,14 +359,51 @@ ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offs
     /* kick it off */
     virtio_kick(dev, 0);
 
-    /* wait for the transfer to complete */
-    event_wait(&bdev->io_event);
+    spin_unlock_irqrestore(&bdev->lock, state);
+}
 
-    LTRACEF("status 0x%hhx\n", bdev->blk_response);
+/* synchronous transfers wait on one of these */
+struct virtio_block_wait {
+    event_t event;
+    status_t err;
+};
 
-    mutex_release(&bdev->lock);
+static void virtio_block_wait_done(void *arg, status_t err)
+{
+    struct virtio_block_wait *wait = arg;
 
-    return len;
+    wait->err = err;
+    event_signal(&wait->event, false);
+}
+
+ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write)
+{
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+    struct virtio_block_wait wait;
+
+    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+
+    event_init(&wait.event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    wait.err = NO_ERROR;
+
+    /* break up transfers too large to describe in the ring at once */
+    while (len > 0 && wait.err == NO_ERROR) {
+        size_t chunk = MIN(len, VIRTIO_BLOCK_MAX_TXN_SIZE);
+        iovec_t iov = { buf, chunk };
+
+        virtio_block_queue(bdev, &iov, 1, offset, write, virtio_block_wait_done, &wait);
+        event_wait(&wait.event);
+        if (!write)
+            dma_sync_for_cpu(buf, chunk, DMA_FROM_DEVICE);
+
+        buf = (uint8_t *)buf + chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+
+    event_destroy(&wait.event);
+
+    return wait.err;
 }
 
 static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
@@ -338,3 +434,95 @@ static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_
     }
 }
 
+/* drop one of the references a bio request's transfers hold on it */
+static void virtio_bdev_request_put(bio_request_t *req)
+{
+    if (atomic_add(&req->pending, -1) != 1)
+        return;
+
+    /* result still holds the length of the whole request unless a transfer failed */
+    if (!req->write && req->result > 0) {
+        size_t remaining = req->result;
+        for (uint i = 0; i < req->iov_cnt && remaining > 0; i++) {
+            size_t len = MIN(req->iov[i].iov_len, remaining);
+            dma_sync_for_cpu(req->iov[i].iov_base, len, DMA_FROM_DEVICE);
+            remaining -= len;
+        }
+    }
+
+    bio_request_complete(req, req->result);
+}
+
+static void virtio_bdev_request_done(void *arg, status_t err)
+{
+    bio_request_t *req = arg;
+
+    if (err < 0)
+        req->result = err;
+
+    virtio_bdev_request_put(req);
+}
+
+/* queue the scatter list entries gathered so far as one transfer */
+static void virtio_bdev_queue_group(struct virtio_block_dev *dev, bio_request_t *req,
+                                    const iovec_t *group, uint group_cnt, off_t offset)
+{
+    if (group_cnt == 0)
+        return;
+
+    atomic_add(&req->pending, 1);
+    virtio_block_queue(dev, group, group_cnt, offset, req->write, virtio_bdev_request_done, req);
+}
+
+static status_t virtio_bdev_submit(struct bdev *bdev, bio_request_t *req)
+{
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+    size_t remaining = (size_t)req->count * dev->bdev.block_size;
+    off_t offset = (off_t)req->block * dev->bdev.block_size;
+
+    LTRACEF("dev %p, req %p, block 0x%x, count %u\n", bdev, req, req->block, req->count);
+
+    /* gather as many scatter list entries into each transfer as its
+     * descriptor budget allows, splitting entries that are too large.
+     * hold a reference across the loop so the request can't complete early. */
+    iovec_t group[VIRTIO_BLOCK_MAX_TXN_IOVS];
+    uint group_cnt = 0;
+    size_t group_len = 0;
+    size_t group_pages = 0;
+
+    req->result = remaining;
+    req->pending = 1;
+    for (uint i = 0; i < req->iov_cnt && remaining > 0; i++) {
+        uint8_t *buf = req->iov[i].iov_base;
+        size_t len = MIN(req->iov[i].iov_len, remaining);
+
+        remaining -= len;
+        while (len > 0) {
+            size_t chunk = MIN(len, VIRTIO_BLOCK_MAX_TXN_SIZE);
+            size_t pages = virtio_block_pages_spanned(buf, chunk);
+
+            if (group_cnt == countof(group) ||
+                    group_len + chunk > VIRTIO_BLOCK_MAX_TXN_SIZE ||
+                    group_pages + pages > VIRTIO_BLOCK_MAX_TXN_PAGES) {
+                virtio_bdev_queue_group(dev, req, group, group_cnt, offset);
+                offset += group_len;
+                group_cnt = 0;
+                group_len = 0;
+                group_pages = 0;
+            }
+
+            group[group_cnt].iov_base = buf;
+            group[group_cnt].iov_len = chunk;
+            group_cnt++;
+            group_len += chunk;
+            group_pages += pages;
+
+            buf += chunk;
+            len -= chunk;
+        }
+    }
+    virtio_bdev_queue_group(dev, req, group, group_cnt, offset);
+    virtio_bdev_request_put(req);
+
+    return NO_ERROR;
+}
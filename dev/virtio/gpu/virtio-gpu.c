@@ -28,6 +28,7 @@
 #include <compiler.h>
 #include <list.h>
 #include <err.h>
+#include <stdlib.h>
 #include <string.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
@@ -39,9 +40,15 @@
 
 #define LOCAL_TRACE 0
 
+/* allocate a second resource so the display can be page flipped */
+#ifndef VIRTIO_GPU_PAGE_FLIP
+#define VIRTIO_GPU_PAGE_FLIP 1
+#endif
+
 static enum handler_return virtio_gpu_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
 static enum handler_return virtio_gpu_config_change_callback(struct virtio_device *dev);
 static int virtio_gpu_flush_thread(void *arg);
+static void virtio_gpu_gfx_flush_rect(uint x, uint y, uint width, uint height);
 
 struct virtio_gpu_dev {
     struct virtio_device *dev;
@@ -59,13 +66,25 @@ struct virtio_gpu_dev {
     /* resource id that is set as scanout */
     uint32_t display_resource_id;
 
+    /* resource that is not being scanned out, 0 if page flipping is not available */
+    uint32_t back_resource_id;
+
+    /* held across a flip and across each pass of the flush thread */
+    mutex_t flip_lock;
+
     /* next resource id */
     uint32_t next_resource_id;
 
     event_t flush_event;
 
-    /* framebuffer */
+    /* damage accumulated since the flush thread last ran, empty when x0 >= x1.
+     * may be added to from interrupt context, so it is guarded by a spinlock */
+    spin_lock_t dirty_lock;
+    uint32_t dirty_x0, dirty_y0, dirty_x1, dirty_y1;
+
+    /* framebuffers backing the display and back resources */
     void *fb;
+    void *back_fb;
 };
 
 static struct virtio_gpu_dev *the_gdev;
@@ -281,11 +300,11 @@ static status_t set_scanout(struct virtio_gpu_dev *gdev, uint32_t scanout_id, ui
     return err;
 }
 
-static status_t flush_resource(struct virtio_gpu_dev *gdev, uint32_t resource_id, uint32_t width, uint32_t height)
+static status_t flush_resource(struct virtio_gpu_dev *gdev, uint32_t resource_id, const struct virtio_gpu_rect *r)
 {
     status_t err;
 
-    LTRACEF("gdev %p, resource_id %u, width %u, height %u\n", gdev, resource_id, width, height);
+    LTRACEF("gdev %p, resource_id %u, %ux%u at %u,%u\n", gdev, resource_id, r->width, r->height, r->x, r->y);
 
     /* grab a lock to keep this single message at a time */
     mutex_acquire(&gdev->lock);
@@ -295,9 +314,7 @@ static status_t flush_resource(struct virtio_gpu_dev *gdev, uint32_t resource_id
     memset(&req, 0, sizeof(req));
 
     req.hdr.type = VIRTIO_GPU_CMD_RESOURCE_FLUSH;
-    req.r.x = req.r.y = 0;
-    req.r.width = width;
-    req.r.height = height;
+    req.r = *r;
     req.resource_id = resource_id;
 
     /* send the command and get a response */
@@ -315,11 +332,11 @@ static status_t flush_resource(struct virtio_gpu_dev *gdev, uint32_t resource_id
     return err;
 }
 
-static status_t transfer_to_host_2d(struct virtio_gpu_dev *gdev, uint32_t resource_id, uint32_t width, uint32_t height)
+static status_t transfer_to_host_2d(struct virtio_gpu_dev *gdev, uint32_t resource_id, const struct virtio_gpu_rect *r)
 {
     status_t err;
 
-    LTRACEF("gdev %p, resource_id %u, width %u, height %u\n", gdev, resource_id, width, height);
+    LTRACEF("gdev %p, resource_id %u, %ux%u at %u,%u\n", gdev, resource_id, r->width, r->height, r->x, r->y);
 
     /* grab a lock to keep this single message at a time */
     mutex_acquire(&gdev->lock);
@@ -329,10 +346,9 @@ static status_t transfer_to_host_2d(struct virtio_gpu_dev *gdev, uint32_t resour
     memset(&req, 0, sizeof(req));
 
     req.hdr.type = VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D;
-    req.r.x = req.r.y = 0;
-    req.r.width = width;
-    req.r.height = height;
-    req.offset = 0;
+    req.r = *r;
+    /* offset of the rectangle in the backing store, which has the resource's width */
+    req.offset = ((uint64_t)r->y * gdev->pmode.r.width + r->x) * 4;
     req.resource_id = resource_id;
 
     /* send the command and get a response */
@@ -400,13 +416,28 @@ status_t virtio_gpu_start(struct virtio_device *dev)
         return err;
     }
 
+#if VIRTIO_GPU_PAGE_FLIP
+    /* a second resource of the same size for page flipping, not fatal if it can't be had */
+    void *back_fb = pmm_alloc_kpages(ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE, NULL);
+    if (!back_fb) {
+        TRACEF("no memory for a back buffer, page flipping disabled\n");
+    } else if (allocate_2d_resource(gdev, &gdev->back_resource_id, gdev->pmode.r.width, gdev->pmode.r.height) < 0 ||
+               attach_backing(gdev, gdev->back_resource_id, back_fb, len) < 0) {
+        TRACEF("failed to set up back buffer resource, page flipping disabled\n");
+        pmm_free_kpages(back_fb, ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE);
+        gdev->back_resource_id = 0;
+    } else {
+        gdev->back_fb = back_fb;
+    }
+#endif
+
     /* create the flush thread */
     thread_t *t;
     t = thread_create("virtio gpu flusher", &virtio_gpu_flush_thread, (void *)gdev, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
     thread_detach_and_resume(t);
 
     /* kick it once */
-    event_signal(&gdev->flush_event, true);
+    virtio_gpu_gfx_flush_rect(0, 0, gdev->pmode.r.width, gdev->pmode.r.height);
 
     LTRACE_EXIT;
 
@@ -432,14 +463,18 @@ status_t virtio_gpu_init(struct virtio_device *dev, uint32_t host_features)
         return ERR_NO_MEMORY;
 
     mutex_init(&gdev->lock);
+    mutex_init(&gdev->flip_lock);
     event_init(&gdev->io_event, false, EVENT_FLAG_AUTOUNSIGNAL);
     event_init(&gdev->flush_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    spin_lock_init(&gdev->dirty_lock);
 
     gdev->dev = dev;
     dev->priv = gdev;
 
     gdev->pmode_id = -1;
     gdev->next_resource_id = 1;
+    gdev->back_resource_id = 0;
+    gdev->fb = gdev->back_fb = NULL;
 
     /* allocate memory for a gpu request */
 #if WITH_KERNEL_VM
@@ -460,6 +495,7 @@ status_t virtio_gpu_init(struct virtio_device *dev, uint32_t host_features)
     virtio_status_acknowledge_driver(dev);
 
     // XXX check features bits and ack/nak them
+    virtio_set_guest_features(dev, 0);
 
     /* allocate a virtio ring */
     virtio_alloc_ring(dev, 0, 16);
@@ -533,27 +569,123 @@ static int virtio_gpu_flush_thread(void *arg)
     for (;;) {
         event_wait(&gdev->flush_event);
 
+        /* take everything damaged since the last pass, however many flushes that was */
+        struct virtio_gpu_rect r;
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&gdev->dirty_lock, state);
+        r.x = gdev->dirty_x0;
+        r.y = gdev->dirty_y0;
+        r.width = gdev->dirty_x1 - gdev->dirty_x0;
+        r.height = gdev->dirty_y1 - gdev->dirty_y0;
+        gdev->dirty_x0 = gdev->dirty_x1 = 0;
+        spin_unlock_irqrestore(&gdev->dirty_lock, state);
+
+        if (r.width == 0 || r.height == 0)
+            continue;
+
+        mutex_acquire(&gdev->flip_lock);
+
         /* transfer to host 2d */
-        err = transfer_to_host_2d(gdev, gdev->display_resource_id, gdev->pmode.r.width, gdev->pmode.r.height);
+        err = transfer_to_host_2d(gdev, gdev->display_resource_id, &r);
         if (err < 0) {
             LTRACEF("failed to flush resource\n");
-            continue;
+            goto next;
         }
 
         /* resource flush */
-        err = flush_resource(gdev, gdev->display_resource_id, gdev->pmode.r.width, gdev->pmode.r.height);
+        err = flush_resource(gdev, gdev->display_resource_id, &r);
         if (err < 0) {
             LTRACEF("failed to flush resource\n");
-            continue;
+            goto next;
         }
+
+next:
+        mutex_release(&gdev->flip_lock);
     }
 
     return 0;
 }
 
+static void virtio_gpu_gfx_flush_rect(uint x, uint y, uint width, uint height)
+{
+    struct virtio_gpu_dev *gdev = the_gdev;
+
+    /* clip to the scanout */
+    if (x >= gdev->pmode.r.width || y >= gdev->pmode.r.height || width == 0 || height == 0)
+        return;
+    uint32_t x1 = MIN(x + width, gdev->pmode.r.width);
+    uint32_t y1 = MIN(y + height, gdev->pmode.r.height);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&gdev->dirty_lock, state);
+    if (gdev->dirty_x0 >= gdev->dirty_x1) {
+        gdev->dirty_x0 = x;
+        gdev->dirty_y0 = y;
+        gdev->dirty_x1 = x1;
+        gdev->dirty_y1 = y1;
+    } else {
+        gdev->dirty_x0 = MIN(gdev->dirty_x0, x);
+        gdev->dirty_y0 = MIN(gdev->dirty_y0, y);
+        gdev->dirty_x1 = MAX(gdev->dirty_x1, x1);
+        gdev->dirty_y1 = MAX(gdev->dirty_y1, y1);
+    }
+    spin_unlock_irqrestore(&gdev->dirty_lock, state);
+
+    event_signal(&gdev->flush_event, !arch_ints_disabled());
+}
+
 void virtio_gpu_gfx_flush(uint starty, uint endy)
 {
-    event_signal(&the_gdev->flush_event, !arch_ints_disabled());
+    if (starty > endy)
+        return;
+
+    virtio_gpu_gfx_flush_rect(0, starty, the_gdev->pmode.r.width, endy - starty + 1);
+}
+
+/* make the back buffer the scanout. the host's copy of it is refreshed in full
+ * first, the guest buffer may have changed anywhere since it was last shown */
+static status_t virtio_gpu_gfx_flip(void *pixels)
+{
+    struct virtio_gpu_dev *gdev = the_gdev;
+    status_t err;
+
+    DEBUG_ASSERT(!arch_ints_disabled());
+
+    mutex_acquire(&gdev->flip_lock);
+
+    if (pixels == gdev->fb) {
+        /* already scanned out */
+        err = NO_ERROR;
+        goto out;
+    }
+    if (!gdev->back_fb || pixels != gdev->back_fb) {
+        err = ERR_INVALID_ARGS;
+        goto out;
+    }
+
+    struct virtio_gpu_rect r = { 0, 0, gdev->pmode.r.width, gdev->pmode.r.height };
+
+    err = transfer_to_host_2d(gdev, gdev->back_resource_id, &r);
+    if (err < 0)
+        goto out;
+
+    err = set_scanout(gdev, gdev->pmode_id, gdev->back_resource_id, gdev->pmode.r.width, gdev->pmode.r.height);
+    if (err < 0)
+        goto out;
+
+    err = flush_resource(gdev, gdev->back_resource_id, &r);
+
+    uint32_t id = gdev->display_resource_id;
+    gdev->display_resource_id = gdev->back_resource_id;
+    gdev->back_resource_id = id;
+
+    void *tmp = gdev->fb;
+    gdev->fb = gdev->back_fb;
+    gdev->back_fb = tmp;
+
+out:
+    mutex_release(&gdev->flip_lock);
+    return err;
 }
 
 status_t display_get_framebuffer(struct display_framebuffer *fb)
@@ -571,6 +703,11 @@ status_t display_get_framebuffer(struct display_framebuffer *fb)
     fb->image.stride = fb->image.width;
     fb->image.rowbytes = fb->image.width * 4;
     fb->flush = virtio_gpu_gfx_flush;
+    fb->flush_rect = virtio_gpu_gfx_flush_rect;
+    if (the_gdev->back_fb) {
+        fb->back_pixels = the_gdev->back_fb;
+        fb->flip = virtio_gpu_gfx_flip;
+    }
     fb->format = DISPLAY_FORMAT_RGB_x888;
 
     return NO_ERROR;
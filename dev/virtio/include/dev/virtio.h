@@ -26,15 +26,24 @@
 #include <assert.h>
 #include <list.h>
 #include <sys/types.h>
+#include <kernel/spinlock.h>
 #include <dev/virtio/virtio_ring.h>
 
 /* detect a virtio mmio hardware block
  * returns number of devices found */
 int virtio_mmio_detect(void *ptr, uint count, const uint irqs[]);
 
-#define MAX_VIRTIO_RINGS 4
+/* scan pci for legacy virtio devices, pc only
+ * returns number of devices found */
+int virtio_pci_detect(void);
+
+/* enough for a virtio-net device with 8 queue pairs and its control queue */
+#ifndef MAX_VIRTIO_RINGS
+#define MAX_VIRTIO_RINGS 17
+#endif
 
 struct virtio_mmio_config;
+struct virtio_transport;
 
 struct virtio_device {
     bool valid;
@@ -42,23 +51,45 @@ struct virtio_device {
     uint index;
     uint irq;
 
+    const struct virtio_transport *transport;
     volatile struct virtio_mmio_config *mmio_config;
     void *config_ptr;
 
     void *priv; /* a place for the driver to put private data */
 
+    uint32_t host_features; /* the first 32 feature bits the device offers */
+    bool event_idx; /* VIRTIO_RING_F_EVENT_IDX was negotiated */
+
     enum handler_return (*irq_driver_callback)(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
     enum handler_return (*config_change_callback)(struct virtio_device *dev);
 
     /* virtio rings */
     uint32_t active_rings_bitmap;
     struct vring ring[MAX_VIRTIO_RINGS];
+
+    /* serializes used ring processing between the irq handler and virtio_poll_ring */
+    spin_lock_t used_lock[MAX_VIRTIO_RINGS];
+
+    /* interrupt status the hard irq handler has acked but the irq thread not seen yet */
+    volatile int irq_pending;
 };
 
 void virtio_reset_device(struct virtio_device *dev);
 void virtio_status_acknowledge_driver(struct virtio_device *dev);
 void virtio_status_driver_ok(struct virtio_device *dev);
 
+/* tell the device which of the first 32 feature bits the driver is going to use. ring
+ * features the device offers, such as VIRTIO_RING_F_EVENT_IDX, are added on top. */
+void virtio_set_guest_features(struct virtio_device *dev, uint32_t features);
+
+/* ask the device to interrupt, or not, when it adds to a ring's used list. the device
+ * may still interrupt for a while after being asked not to. */
+void virtio_set_ring_interrupts(struct virtio_device *dev, uint ring_index, bool enable);
+
+/* run the driver callback over what the device has added to a ring's used list, from thread
+ * context. for drivers that poll with interrupts off. returns the number of elements seen. */
+uint virtio_poll_ring(struct virtio_device *dev, uint ring_index);
+
 /* api used by devices to interact with the virtio bus */
 status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len) __NONNULL();
 
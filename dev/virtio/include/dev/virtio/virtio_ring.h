@@ -32,6 +32,7 @@
  * SUCH DAMAGE.
  *
  * Copyright Rusty Russell IBM Corporation 2007. */
+#include <stdbool.h>
 #include <stdint.h>
 #include <pow2.h>
 
@@ -99,7 +100,9 @@ struct vring {
     uint16_t free_list; /* head of a free list of descriptors per ring. 0xffff is NULL */
     uint16_t free_count;
 
-    uint16_t last_used;
+    uint16_t last_used; /* free running, the used idx the driver has processed up to */
+    uint16_t kicked_idx; /* avail idx when the device was last notified */
+    bool no_interrupt; /* the driver asked for no interrupts on this ring */
 
     struct vring_desc *desc;
 
@@ -135,7 +138,8 @@ struct vring {
 /* We publish the used event index at the end of the available ring, and vice
  * versa. They are at the end for backwards compatibility. */
 #define vring_used_event(vr) ((vr)->avail->ring[(vr)->num])
-#define vring_avail_event(vr) (*(uint16_t *)&(vr)->used->ring[(vr)->num])
+#define vring_avail_event(vr) (*(uint16_t *)((uintptr_t)(vr)->used + sizeof(struct vring_used) + \
+                                              sizeof(struct vring_used_elem) * (vr)->num))
 
 static inline void vring_init(struct vring *vr, unsigned int num, void *p,
                               unsigned long align)
@@ -145,6 +149,8 @@ static inline void vring_init(struct vring *vr, unsigned int num, void *p,
     vr->free_list = 0xffff;
     vr->free_count = 0;
     vr->last_used = 0;
+    vr->kicked_idx = 0;
+    vr->no_interrupt = false;
     vr->desc = p;
     vr->avail = p + num*sizeof(struct vring_desc);
     vr->used = (void *)(((unsigned long)&vr->avail->ring[num] + sizeof(uint16_t)
@@ -35,5 +35,11 @@ int virtio_net_found(void);
 status_t virtio_net_get_mac_addr(uint8_t mac_addr[6]);
 
 struct pktbuf;
+struct list_node;
 extern status_t virtio_net_send_minip_pkt(struct pktbuf *p);
+/* minip batch tx handler, one kick per tx ring for the whole list */
+extern int virtio_net_send_minip_pkts(struct list_node *list);
+
+/* MINIP_TX_OFFLOAD_* flags for what was negotiated with the device */
+uint virtio_net_get_tx_offloads(void);
 
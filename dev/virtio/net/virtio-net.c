@@ -28,11 +28,14 @@
 #include <compiler.h>
 #include <list.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <err.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
 #include <kernel/spinlock.h>
 #include <kernel/vm.h>
+#include <kernel/mp.h>
 #include <lib/pktbuf.h>
 #include <lib/minip.h>
 
@@ -54,6 +57,12 @@ struct virtio_net_hdr {
     uint16_t num_buffers; // unused in tx
 } __PACKED;
 
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM         (1<<0)
+#define VIRTIO_NET_HDR_F_DATA_VALID         (1<<1)
+
+#define VIRTIO_NET_HDR_GSO_NONE             0
+#define VIRTIO_NET_HDR_GSO_TCPV4            1
+
 #define VIRTIO_NET_F_CSUM                   (1<<0)
 #define VIRTIO_NET_F_GUEST_CSUM             (1<<1)
 #define VIRTIO_NET_F_CTRL_GUEST_OFFLOADS    (1<<2)
@@ -79,19 +88,50 @@ struct virtio_net_hdr {
 #define VIRTIO_NET_S_LINK_UP                (1<<0)
 #define VIRTIO_NET_S_ANNOUNCE               (1<<1)
 
+struct virtio_net_ctrl_hdr {
+    uint8_t class;
+    uint8_t cmd;
+} __PACKED;
+
+#define VIRTIO_NET_CTRL_MQ                  4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET     0
+
+#define VIRTIO_NET_OK                       0
+
 #define TX_RING_SIZE 16
 #define RX_RING_SIZE 16
 
-#define RING_RX 0
-#define RING_TX 1
+/* received packets the rx worker passes up before yielding, while it polls with interrupts off */
+#define RX_POLL_BUDGET 8
+
+/* queue pairs to use at most, the device may offer fewer. each pair's rx worker is pinned to
+ * the cpu of the same number */
+#ifndef VIRTIO_NET_MAX_QUEUE_PAIRS
+#define VIRTIO_NET_MAX_QUEUE_PAIRS 4
+#endif
+
+#define RING_RX(q) ((q) * 2)
+#define RING_TX(q) ((q) * 2 + 1)
+
+#define CTRL_RING_SIZE 4
+#define CTRL_TIMEOUT 1000 // ms
 
 #define VIRTIO_NET_MSS 1514
 
-struct virtio_net_dev {
-    struct virtio_device *dev;
-    bool started;
+/* the features we know how to use */
+#define VIRTIO_NET_DRIVER_FEATURES (VIRTIO_NET_F_MAC | VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | \
+                                    VIRTIO_NET_F_HOST_TSO4)
 
-    struct virtio_net_config *config;
+/* offsets into the outgoing frames, to fill in the offload part of the header */
+#define ETH_HDR_LEN 14
+#define TCP_CSUM_OFFSET 16
+
+struct virtio_net_dev;
+
+/* a pair of rx and tx rings, with its own lock and rx worker */
+struct virtio_net_queue {
+    struct virtio_net_dev *ndev;
+    uint index;
 
     spin_lock_t lock;
     event_t rx_event;
@@ -104,9 +144,24 @@ struct virtio_net_dev {
     struct list_node completed_rx_queue;
 };
 
+struct virtio_net_dev {
+    struct virtio_device *dev;
+    bool started;
+
+    struct virtio_net_config *config;
+    uint32_t features; // negotiated with the device
+
+    uint queue_count;
+    struct virtio_net_queue queue[VIRTIO_NET_MAX_QUEUE_PAIRS];
+
+    /* control queue, only there if VIRTIO_NET_F_CTRL_VQ was negotiated */
+    uint ctrl_ring;
+    volatile bool ctrl_done;
+};
+
 static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
 static int virtio_net_rx_worker(void *arg);
-static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p);
+static status_t virtio_net_queue_rx(struct virtio_net_queue *q, pktbuf_t *p);
 
 // XXX remove need for this
 static struct virtio_net_dev *the_ndev;
@@ -151,55 +206,222 @@ status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features)
     dev->priv = ndev;
     ndev->started = false;
 
-    ndev->lock = SPIN_LOCK_INITIAL_VALUE;
-    event_init(&ndev->rx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
-    list_initialize(&ndev->completed_rx_queue);
+    for (uint i = 0; i < VIRTIO_NET_MAX_QUEUE_PAIRS; i++) {
+        struct virtio_net_queue *q = &ndev->queue[i];
+
+        q->ndev = ndev;
+        q->index = i;
+        q->lock = SPIN_LOCK_INITIAL_VALUE;
+        event_init(&q->rx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+        list_initialize(&q->completed_rx_queue);
+    }
 
     ndev->config = (struct virtio_net_config *)dev->config_ptr;
 
     /* ack and set the driver status bit */
     virtio_status_acknowledge_driver(dev);
 
-    // XXX check features bits and ack/nak them
     dump_feature_bits(host_features);
 
+    /* take what offloads the device offers, segmentation only comes with checksumming */
+    ndev->features = host_features & VIRTIO_NET_DRIVER_FEATURES;
+    if ((ndev->features & VIRTIO_NET_F_CSUM) == 0)
+        ndev->features &= ~VIRTIO_NET_F_HOST_TSO4;
+
+    /* a queue pair per cpu, if the device has them. the control queue that turns them on sits
+     * after the last pair the device supports, not the last one we use, and has to fit */
+    ndev->queue_count = 1;
+    if (SMP_MAX_CPUS > 1 && VIRTIO_NET_MAX_QUEUE_PAIRS > 1 &&
+            (host_features & (VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ)) == (VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ)) {
+        uint max_pairs = ndev->config->max_virtqueue_pairs;
+        if (max_pairs > 1 && RING_RX(max_pairs) < MAX_VIRTIO_RINGS) {
+            ndev->features |= VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ;
+            ndev->queue_count = MIN(MIN(max_pairs, VIRTIO_NET_MAX_QUEUE_PAIRS), SMP_MAX_CPUS);
+            ndev->ctrl_ring = RING_RX(max_pairs);
+        }
+    }
+    virtio_set_guest_features(dev, ndev->features);
+
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_net_irq_driver_callback;
 
     /* set DRIVER_OK */
     virtio_status_driver_ok(dev);
 
-    /* allocate a pair of virtio rings */
-    virtio_alloc_ring(dev, RING_RX, RX_RING_SIZE); // rx
-    virtio_alloc_ring(dev, RING_TX, TX_RING_SIZE); // tx
+    /* allocate a pair of virtio rings per queue */
+    for (uint i = 0; i < ndev->queue_count; i++) {
+        virtio_alloc_ring(dev, RING_RX(i), RX_RING_SIZE); // rx
+        virtio_alloc_ring(dev, RING_TX(i), TX_RING_SIZE); // tx
+    }
+    if (ndev->features & VIRTIO_NET_F_CTRL_VQ)
+        virtio_alloc_ring(dev, ndev->ctrl_ring, CTRL_RING_SIZE);
 
     the_ndev = ndev;
 
     return NO_ERROR;
 }
 
+/* tell the device how many queue pairs to spread rx over, over the control queue */
+static status_t virtio_net_set_queue_pairs(struct virtio_net_dev *ndev, uint pairs)
+{
+    struct virtio_device *vdev = ndev->dev;
+
+    pktbuf_t *p = pktbuf_alloc();
+    if (!p)
+        return ERR_NO_MEMORY;
+
+    /* the command, its argument, then a byte for the device to write the result to, each in
+     * a descriptor of its own */
+    struct virtio_net_ctrl_hdr *hdr = pktbuf_append(p, sizeof(struct virtio_net_ctrl_hdr));
+    hdr->class = VIRTIO_NET_CTRL_MQ;
+    hdr->cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+    uint16_t *arg = pktbuf_append(p, sizeof(uint16_t));
+    *arg = pairs;
+    volatile uint8_t *ack = pktbuf_append(p, sizeof(uint8_t));
+    *ack = 0xff;
+
+    /* nothing else uses the control queue, so the descriptors can't run out */
+    uint16_t i;
+    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, ndev->ctrl_ring, 3, &i);
+    DEBUG_ASSERT(desc);
+
+    u32 pa = pktbuf_data_phys(p);
+    desc->addr = pa;
+    desc->len = sizeof(struct virtio_net_ctrl_hdr);
+    desc->flags = VRING_DESC_F_NEXT;
+
+    desc = virtio_desc_index_to_desc(vdev, ndev->ctrl_ring, desc->next);
+    desc->addr = pa + sizeof(struct virtio_net_ctrl_hdr);
+    desc->len = sizeof(uint16_t);
+    desc->flags = VRING_DESC_F_NEXT;
+
+    desc = virtio_desc_index_to_desc(vdev, ndev->ctrl_ring, desc->next);
+    desc->addr = pa + sizeof(struct virtio_net_ctrl_hdr) + sizeof(uint16_t);
+    desc->len = sizeof(uint8_t);
+    desc->flags = VRING_DESC_F_WRITE;
+
+    ndev->ctrl_done = false;
+    virtio_submit_chain(vdev, ndev->ctrl_ring, i);
+    virtio_kick(vdev, ndev->ctrl_ring);
+
+    /* the irq handler may get to it first, otherwise poll */
+    for (lk_time_t t = 0; !ndev->ctrl_done; t++) {
+        if (t == CTRL_TIMEOUT) {
+            /* the device still owns the buffer, leave it be */
+            return ERR_TIMED_OUT;
+        }
+        thread_sleep(1);
+        virtio_poll_ring(vdev, ndev->ctrl_ring);
+    }
+
+    status_t err = (*ack == VIRTIO_NET_OK) ? NO_ERROR : ERR_NOT_SUPPORTED;
+    pktbuf_free(p, true);
+
+    return err;
+}
+
 status_t virtio_net_start(void)
 {
-    if (the_ndev->started)
+    struct virtio_net_dev *ndev = the_ndev;
+
+    if (ndev->started)
         return ERR_ALREADY_STARTED;
 
-    the_ndev->started = true;
+    ndev->started = true;
 
-    /* start the rx worker thread */
-    thread_resume(thread_create("virtio_net_rx", &virtio_net_rx_worker, (void *)the_ndev, HIGH_PRIORITY, DEFAULT_STACK_SIZE));
+    /* the device only uses the first queue pair until told otherwise */
+    if (ndev->queue_count > 1) {
+        status_t err = virtio_net_set_queue_pairs(ndev, ndev->queue_count);
+        if (err < 0) {
+            TRACEF("failed to enable %u queue pairs, err %d\n", ndev->queue_count, err);
+            ndev->queue_count = 1;
+        }
+    }
 
-    /* queue up a bunch of rxes */
-    for (uint i = 0; i < RX_RING_SIZE - 1; i++) {
-        pktbuf_t *p = pktbuf_alloc();
-        if (p) {
-            virtio_net_queue_rx(the_ndev, p);
+    for (uint i = 0; i < ndev->queue_count; i++) {
+        struct virtio_net_queue *q = &ndev->queue[i];
+
+        /* start the rx worker thread, on the cpu matching the queue if there are several */
+        char name[32];
+        snprintf(name, sizeof(name), "virtio_net_rx%u", i);
+        thread_t *t = thread_create(name, &virtio_net_rx_worker, (void *)q, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!t)
+            return ERR_NO_MEMORY;
+        if (ndev->queue_count > 1)
+            thread_set_pinned_cpu(t, i);
+        thread_resume(t);
+
+        /* queue up a bunch of rxes */
+        for (uint j = 0; j < RX_RING_SIZE - 1; j++) {
+            pktbuf_t *p = pktbuf_alloc();
+            if (p) {
+                virtio_net_queue_rx(q, p);
+            }
         }
+        virtio_kick(ndev->dev, RING_RX(i));
     }
 
     return NO_ERROR;
 }
 
-static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t *p2)
+/* describe the checksum and segmentation the stack left for the device to do */
+static void virtio_net_fill_tx_hdr(struct virtio_net_hdr *hdr, const pktbuf_t *p)
+{
+    if ((p->flags & PKTBUF_FLAG_CKSUM_TCP_PARTIAL) == 0)
+        return;
+
+    /* the headers are all in the first part: ethernet, ipv4 with options, then tcp */
+    DEBUG_ASSERT(p->dlen >= ETH_HDR_LEN + 20 + 20);
+    uint ip_hdr_len = (p->data[ETH_HDR_LEN] & 0xf) * 4;
+    uint tcp_offset = ETH_HDR_LEN + ip_hdr_len;
+
+    hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr->csum_start = tcp_offset;
+    hdr->csum_offset = TCP_CSUM_OFFSET;
+
+    if (p->gso_size) {
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr->gso_size = p->gso_size;
+        hdr->hdr_len = tcp_offset + (p->data[tcp_offset + 12] >> 4) * 4;
+    }
+}
+
+/* pick the tx queue for an outgoing frame. every packet of a flow hashes to the same queue
+ * pair, and the device steers incoming packets of a flow to the rx queue of the pair it was
+ * last sent on, so a connection stays on one queue and its worker's cpu */
+static struct virtio_net_queue *virtio_net_tx_queue(struct virtio_net_dev *ndev, const pktbuf_t *p)
+{
+    if (ndev->queue_count == 1)
+        return &ndev->queue[0];
+
+    /* ipv4 only, everything else goes out the first queue */
+    const uint8_t *frame = p->data;
+    if (p->dlen < ETH_HDR_LEN + 20 || frame[12] != 0x08 || frame[13] != 0x00)
+        return &ndev->queue[0];
+
+    const uint8_t *ip = frame + ETH_HDR_LEN;
+    uint ip_hdr_len = (ip[0] & 0xf) * 4;
+
+    uint32_t src, dst;
+    memcpy(&src, ip + 12, sizeof(src));
+    memcpy(&dst, ip + 16, sizeof(dst));
+    uint32_t hash = src ^ dst;
+
+    /* throw in the ports of tcp and udp, when they're in the first part */
+    if ((ip[9] == 6 || ip[9] == 17) && p->dlen >= ETH_HDR_LEN + ip_hdr_len + 4) {
+        uint32_t ports;
+        memcpy(&ports, ip + ip_hdr_len, sizeof(ports));
+        hash ^= ports;
+    }
+
+    hash *= 0x9e3779b1u;
+    return &ndev->queue[(hash >> 16) % ndev->queue_count];
+}
+
+/* queue a packet on q's tx ring, telling the device about it unless the caller is going to
+ * queue more first */
+static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, struct virtio_net_queue *q,
+                                           pktbuf_t *p2, bool kick)
 {
     struct virtio_device *vdev = ndev->dev;
 
@@ -215,53 +437,72 @@ static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t
     /* point our header to the base of the first pktbuf */
     struct virtio_net_hdr *hdr = pktbuf_append(p, sizeof(struct virtio_net_hdr) - 2);
     memset(hdr, 0, p->dlen);
+    virtio_net_fill_tx_hdr(hdr, p2);
+
+    /* the header gets a descriptor, as does every part of the packet */
+    uint count = 1;
+    for (pktbuf_t *part = p2; part; part = part->next)
+        count++;
 
     spin_lock_saved_state_t state;
-    spin_lock_irqsave(&ndev->lock, state);
+    spin_lock_irqsave(&q->lock, state);
 
     /* only queue if we have enough tx descriptors */
-    if (ndev->tx_pending_count + 2 > TX_RING_SIZE)
+    if (q->tx_pending_count + count > TX_RING_SIZE)
         goto nodesc;
 
     /* allocate a chain of descriptors for our transfer */
-    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_TX, 2, &i);
+    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_TX(q->index), count, &i);
     if (!desc) {
-        spin_unlock_irqrestore(&ndev->lock, state);
+        spin_unlock_irqrestore(&q->lock, state);
 
 nodesc:
-        TRACEF("out of virtio tx descriptors, tx_pending_count %u\n", ndev->tx_pending_count);
+        TRACEF("out of virtio tx descriptors, tx_pending_count %u\n", q->tx_pending_count);
         pktbuf_free(p, true);
 
         return ERR_NO_MEMORY;
     }
 
-    ndev->tx_pending_count += 2;
+    q->tx_pending_count += count;
 
     /* save a pointer to our pktbufs for the irq handler to free */
-    LTRACEF("saving pointer to pkt in index %u and %u\n", i, desc->next);
-    DEBUG_ASSERT(ndev->pending_tx_packet[i] == NULL);
-    DEBUG_ASSERT(ndev->pending_tx_packet[desc->next] == NULL);
-    ndev->pending_tx_packet[i] = p;
-    ndev->pending_tx_packet[desc->next] = p2;
+    LTRACEF("saving pointer to pkt in index %u\n", i);
+    DEBUG_ASSERT(q->pending_tx_packet[i] == NULL);
+    q->pending_tx_packet[i] = p;
 
     /* set up the descriptor pointing to the header */
     desc->addr = pktbuf_data_phys(p);
     desc->len = p->dlen;
     desc->flags |= VRING_DESC_F_NEXT;
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(vdev, RING_TX, desc->next);
-    desc->addr = pktbuf_data_phys(p2);
-    desc->len = p2->dlen;
-    desc->flags = 0;
+    /* set up a descriptor pointing to each part of the packet. the parts are split up, since
+     * the irq handler frees each descriptor's pktbuf on its own */
+    pktbuf_t *part = p2;
+    while (part) {
+        pktbuf_t *next = part->next;
+        part->next = NULL;
+
+        uint16_t index = desc->next;
+        LTRACEF("saving pointer to pkt in index %u\n", index);
+        DEBUG_ASSERT(q->pending_tx_packet[index] == NULL);
+        q->pending_tx_packet[index] = part;
+
+        desc = virtio_desc_index_to_desc(vdev, RING_TX(q->index), index);
+        desc->addr = pktbuf_data_phys(part);
+        desc->len = part->dlen;
+        desc->flags = next ? VRING_DESC_F_NEXT : 0;
+
+        part = next;
+    }
 
     /* submit the transfer */
-    virtio_submit_chain(vdev, RING_TX, i);
+    virtio_submit_chain(vdev, RING_TX(q->index), i);
 
     /* kick it off */
-    virtio_kick(vdev, RING_TX);
+    if (kick)
+        virtio_kick(vdev, RING_TX(q->index));
 
-    spin_unlock_irqrestore(&ndev->lock, state);
+    spin_unlock_irqrestore(&q->lock, state);
 
     return NO_ERROR;
 }
@@ -282,7 +523,7 @@ static status_t virtio_net_queue_tx(struct virtio_net_dev *ndev, const void *buf
     memcpy(p->data, buf, len);
 
     /* call through to the variant of the function that takes a pre-populated pktbuf */
-    status_t err = virtio_net_queue_tx_pktbuf(ndev, p);
+    status_t err = virtio_net_queue_tx_pktbuf(ndev, virtio_net_tx_queue(ndev, p), p, true);
     if (err < 0) {
         pktbuf_free(p, true);
     }
@@ -290,11 +531,11 @@ static status_t virtio_net_queue_tx(struct virtio_net_dev *ndev, const void *buf
     return err;
 }
 
-static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p)
+static status_t virtio_net_queue_rx(struct virtio_net_queue *q, pktbuf_t *p)
 {
-    struct virtio_device *vdev = ndev->dev;
+    struct virtio_device *vdev = q->ndev->dev;
 
-    DEBUG_ASSERT(ndev);
+    DEBUG_ASSERT(q);
     DEBUG_ASSERT(p);
 
     /* point our header to the base of the pktbuf */
@@ -305,29 +546,26 @@ static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p)
     p->dlen = sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS;
 
     spin_lock_saved_state_t state;
-    spin_lock_irqsave(&ndev->lock, state);
+    spin_lock_irqsave(&q->lock, state);
 
     /* allocate a chain of descriptors for our transfer */
     uint16_t i;
-    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_RX, 1, &i);
+    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_RX(q->index), 1, &i);
     DEBUG_ASSERT(desc); /* shouldn't be possible not to have a descriptor ready */
 
     /* save a pointer to our pktbufs for the irq handler to use */
-    DEBUG_ASSERT(ndev->pending_rx_packet[i] == NULL);
-    ndev->pending_rx_packet[i] = p;
+    DEBUG_ASSERT(q->pending_rx_packet[i] == NULL);
+    q->pending_rx_packet[i] = p;
 
     /* set up the descriptor pointing to the header */
     desc->addr = pktbuf_data_phys(p);
     desc->len = p->dlen;
     desc->flags = VRING_DESC_F_WRITE;
 
-    /* submit the transfer */
-    virtio_submit_chain(vdev, RING_RX, i);
-
-    /* kick it off */
-    virtio_kick(vdev, RING_RX);
+    /* submit the transfer, the caller kicks the device once it has queued a batch */
+    virtio_submit_chain(vdev, RING_RX(q->index), i);
 
-    spin_unlock_irqrestore(&ndev->lock, state);
+    spin_unlock_irqrestore(&q->lock, state);
 
     return NO_ERROR;
 }
@@ -338,7 +576,29 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
 
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
-    spin_lock(&ndev->lock);
+    if ((ndev->features & VIRTIO_NET_F_CTRL_VQ) && ring == ndev->ctrl_ring) {
+        /* a control command finished, the waiter picks up the result */
+        uint16_t i = e->id;
+        for (;;) {
+            struct vring_desc *desc = virtio_desc_index_to_desc(dev, ring, i);
+            int next = (desc->flags & VRING_DESC_F_NEXT) ? desc->next : -1;
+
+            virtio_free_desc(dev, ring, i);
+
+            if (next < 0)
+                break;
+            i = next;
+        }
+        ndev->ctrl_done = true;
+
+        return INT_NO_RESCHEDULE;
+    }
+
+    /* even rings receive, odd ones transmit */
+    struct virtio_net_queue *q = &ndev->queue[ring / 2];
+    bool rx = (ring & 1) == 0;
+
+    spin_lock(&q->lock);
 
     /* parse our descriptor chain, add back to the free queue */
     uint16_t i = e->id;
@@ -355,10 +615,10 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
 
         virtio_free_desc(dev, ring, i);
 
-        if (ring == RING_RX) {
+        if (rx) {
             /* put the freed rx buffer in a queue */
-            pktbuf_t *p = ndev->pending_rx_packet[i];
-            ndev->pending_rx_packet[i] = NULL;
+            pktbuf_t *p = q->pending_rx_packet[i];
+            q->pending_rx_packet[i] = NULL;
 
             DEBUG_ASSERT(p);
             LTRACEF("rx pktbuf %p filled\n", p);
@@ -371,12 +631,12 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
                 p->dlen = e->len;
             }
 
-            list_add_tail(&ndev->completed_rx_queue, &p->list);
-        } else { // ring == RING_TX
+            list_add_tail(&q->completed_rx_queue, &p->list);
+        } else {
             /* free the pktbuf associated with the tx packet we just consumed */
-            pktbuf_t *p = ndev->pending_tx_packet[i];
-            ndev->pending_tx_packet[i] = NULL;
-            ndev->tx_pending_count--;
+            pktbuf_t *p = q->pending_tx_packet[i];
+            q->pending_tx_packet[i] = NULL;
+            q->tx_pending_count--;
 
             DEBUG_ASSERT(p);
             LTRACEF("freeing pktbuf %p\n", p);
@@ -389,46 +649,85 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
         i = next;
     }
 
-    spin_unlock(&ndev->lock);
+    spin_unlock(&q->lock);
 
-    /* if rx ring, signal our event */
-    if (ring == 0) {
-        event_signal(&ndev->rx_event, false);
+    /* if rx ring, hand off to the worker, which polls with interrupts off until it catches up */
+    if (rx) {
+        virtio_set_ring_interrupts(dev, ring, false);
+        event_signal(&q->rx_event, false);
     }
 
-    return INT_RESCHEDULE;
+    /* the interrupt dispatch works out whether the woken worker should preempt */
+    return INT_NO_RESCHEDULE;
 }
 
-static int virtio_net_rx_worker(void *arg)
+/* pass up to budget received packets up the stack and give their buffers back to the device */
+static uint virtio_net_rx_process(struct virtio_net_queue *q, uint budget)
 {
-    struct virtio_net_dev *ndev = (struct virtio_net_dev *)arg;
+    /* pick up anything that arrived while interrupts were off */
+    virtio_poll_ring(q->ndev->dev, RING_RX(q->index));
 
-    for (;;) {
-        event_wait(&ndev->rx_event);
+    uint count;
+    for (count = 0; count < budget; count++) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&q->lock, state);
 
-        /* pull some packets from the received queue */
-        for (;;) {
-            spin_lock_saved_state_t state;
-            spin_lock_irqsave(&ndev->lock, state);
+        pktbuf_t *p = list_remove_head_type(&q->completed_rx_queue, pktbuf_t, list);
+
+        spin_unlock_irqrestore(&q->lock, state);
 
-            pktbuf_t *p = list_remove_head_type(&ndev->completed_rx_queue, pktbuf_t, list);
+        if (!p)
+            break; /* nothing left in the queue */
 
-            spin_unlock_irqrestore(&ndev->lock, state);
+        LTRACEF("got packet len %u\n", p->dlen);
 
-            if (!p)
-                break; /* nothing left in the queue, go back to waiting */
+        /* process our packet */
+        struct virtio_net_hdr *hdr = pktbuf_consume(p, sizeof(struct virtio_net_hdr) - 2);
+        if (hdr) {
+            /* with GUEST_CSUM the device either checked the checksum or the packet never
+             * left the host and doesn't have a real one */
+            p->flags &= ~(PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD);
+            if (hdr->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID))
+                p->flags |= PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD;
 
-            LTRACEF("got packet len %u\n", p->dlen);
+            /* call up into the stack */
+            minip_rx_driver_callback(p);
+        }
 
-            /* process our packet */
-            struct virtio_net_hdr *hdr = pktbuf_consume(p, sizeof(struct virtio_net_hdr) - 2);
-            if (hdr) {
-                /* call up into the stack */
-                minip_rx_driver_callback(p);
+        /* requeue the pktbuf in the rx queue */
+        virtio_net_queue_rx(q, p);
+    }
+
+    /* one kick for the whole batch */
+    if (count > 0)
+        virtio_kick(q->ndev->dev, RING_RX(q->index));
+
+    return count;
+}
+
+static int virtio_net_rx_worker(void *arg)
+{
+    struct virtio_net_queue *q = (struct virtio_net_queue *)arg;
+    struct virtio_device *vdev = q->ndev->dev;
+
+    for (;;) {
+        event_wait(&q->rx_event);
+
+        /* the irq handler has turned rx interrupts off, poll until the ring runs dry */
+        for (;;) {
+            if (virtio_net_rx_process(q, RX_POLL_BUDGET) == RX_POLL_BUDGET) {
+                /* there may be more, let anything else at this priority in first */
+                thread_yield();
+                continue;
             }
 
-            /* requeue the pktbuf in the rx queue */
-            virtio_net_queue_rx(ndev, p);
+            /* caught up. turn interrupts back on, then look again, in case something came in
+             * just before they were */
+            virtio_set_ring_interrupts(vdev, RING_RX(q->index), true);
+            if (virtio_poll_ring(vdev, RING_RX(q->index)) == 0)
+                break;
+
+            virtio_set_ring_interrupts(vdev, RING_RX(q->index), false);
         }
     }
     return 0;
@@ -449,21 +748,28 @@ status_t virtio_net_get_mac_addr(uint8_t mac_addr[6])
     return NO_ERROR;
 }
 
+uint virtio_net_get_tx_offloads(void)
+{
+    if (!the_ndev)
+        return 0;
+
+    uint offloads = MINIP_TX_OFFLOAD_SG;
+    if (the_ndev->features & VIRTIO_NET_F_CSUM)
+        offloads |= MINIP_TX_OFFLOAD_TCP_CSUM;
+    if (the_ndev->features & VIRTIO_NET_F_HOST_TSO4)
+        offloads |= MINIP_TX_OFFLOAD_TSO;
+
+    return offloads;
+}
+
 status_t virtio_net_send_minip_pkt(pktbuf_t *p)
 {
     LTRACEF("p %p, dlen %u, flags 0x%x\n", p, p->dlen, p->flags);
 
     DEBUG_ASSERT(p && p->dlen);
 
-    if ((p->flags & PKTBUF_FLAG_EOF) == 0) {
-        /* can't handle multi part packets yet */
-        PANIC_UNIMPLEMENTED;
-
-        return ERR_NOT_IMPLEMENTED;
-    }
-
     /* hand the pktbuf off to the nic, it owns the pktbuf from now on out unless it fails */
-    status_t err = virtio_net_queue_tx_pktbuf(the_ndev, p);
+    status_t err = virtio_net_queue_tx_pktbuf(the_ndev, virtio_net_tx_queue(the_ndev, p), p, true);
     if (err < 0) {
         pktbuf_free(p, true);
     }
@@ -471,3 +777,32 @@ status_t virtio_net_send_minip_pkt(pktbuf_t *p)
     return err;
 }
 
+int virtio_net_send_minip_pkts(struct list_node *list)
+{
+    struct virtio_net_dev *ndev = the_ndev;
+    uint kick_mask = 0;
+    int count = 0;
+
+    /* queue everything, then kick each tx ring that got something once */
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(list, pktbuf_t, list))) {
+        DEBUG_ASSERT(p->dlen);
+
+        struct virtio_net_queue *q = virtio_net_tx_queue(ndev, p);
+        if (virtio_net_queue_tx_pktbuf(ndev, q, p, false) < 0) {
+            pktbuf_free(p, true);
+            continue;
+        }
+
+        kick_mask |= 1u << q->index;
+        count++;
+    }
+
+    for (uint i = 0; i < ndev->queue_count; i++) {
+        if (kick_mask & (1u << i))
+            virtio_kick(ndev->dev, RING_TX(i));
+    }
+
+    return count;
+}
+
@@ -5,4 +5,18 @@ MODULE := $(LOCAL_DIR)
 MODULE_SRCS += \
 	$(LOCAL_DIR)/virtio.c
 
+# legacy virtio-pci, i/o port based so only where there are ports
+ifeq ($(PLATFORM),pc)
+MODULE_SRCS += \
+	$(LOCAL_DIR)/virtio_pci.c
+endif
+
+# process the rings and run the driver callbacks in a thread instead of the
+# irq handler, set to 0 to do everything in interrupt context
+VIRTIO_THREADED_IRQ ?= 1
+ifeq ($(VIRTIO_THREADED_IRQ),1)
+MODULE_DEFINES += VIRTIO_THREADED_IRQ=1
+MODULE_DEPS += lib/irqthread
+endif
+
 include make/module.mk
@@ -33,9 +33,14 @@
 #include <string.h>
 #include <pow2.h>
 #include <lk/init.h>
+#include <arch/ops.h>
+#include <kernel/dma.h>
 #include <kernel/thread.h>
 #include <kernel/vm.h>
 #include <platform/interrupts.h>
+#if VIRTIO_THREADED_IRQ
+#include <lib/irqthread.h>
+#endif
 
 #include "virtio_priv.h"
 
@@ -51,6 +56,21 @@
 
 #define LOCAL_TRACE 0
 
+/* x86 has no barrier of its own in arch headers */
+#ifndef DSB
+#define DSB __sync_synchronize()
+#endif
+
+/* use VIRTIO_RING_F_EVENT_IDX to cut down on kicks and interrupts when the device has it */
+#ifndef VIRTIO_RING_EVENT_IDX
+#define VIRTIO_RING_EVENT_IDX 1
+#endif
+
+/* priority of the irq threads, see VIRTIO_THREADED_IRQ in rules.mk */
+#ifndef VIRTIO_IRQ_PRIORITY
+#define VIRTIO_IRQ_PRIORITY HIGH_PRIORITY
+#endif
+
 static struct virtio_device *devices;
 
 static void dump_mmio_config(const volatile struct virtio_mmio_config *mmio)
@@ -78,45 +98,102 @@ void virtio_dump_desc(const struct vring_desc *desc)
     printf("\tnext  0x%hhx\n", desc->next);
 }
 
-static enum handler_return virtio_mmio_irq(void *arg)
+/* hand every new used element of a ring to the driver */
+static uint virtio_process_used_locked(struct virtio_device *dev, uint r, enum handler_return *ret)
 {
-    struct virtio_device *dev = (struct virtio_device *)arg;
-    LTRACEF("dev %p, index %u\n", dev, dev->index);
+    struct vring *ring = &dev->ring[r];
+    LTRACEF("ring %u: used flags 0x%hhx idx 0x%hhx last_used %u\n", r, ring->used->flags, ring->used->idx, ring->last_used);
 
-    uint32_t irq_status = dev->mmio_config->interrupt_status;
-    LTRACEF("status 0x%x\n", irq_status);
+    uint count = 0;
+    for (;;) {
+        uint16_t cur_idx = ring->used->idx;
+        while (ring->last_used != cur_idx) {
+            uint i = ring->last_used & ring->num_mask;
+            LTRACEF("looking at idx %u\n", i);
+
+            // process chain
+            struct vring_used_elem *used_elem = &ring->used->ring[i];
+            LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
+
+            DEBUG_ASSERT(dev->irq_driver_callback);
+            *ret |= dev->irq_driver_callback(dev, r, used_elem);
+
+            ring->last_used++;
+            count++;
+        }
+
+        if (!dev->event_idx || ring->no_interrupt)
+            break;
+
+        /* ask for an interrupt on the next element, then catch any the device added
+         * before it could have seen the request */
+        vring_used_event(ring) = cur_idx;
+        DSB;
+        if (ring->used->idx == cur_idx)
+            break;
+    }
+
+    return count;
+}
+
+uint virtio_poll_ring(struct virtio_device *dev, uint ring_index)
+{
+    DEBUG_ASSERT(ring_index < MAX_VIRTIO_RINGS);
 
     enum handler_return ret = INT_NO_RESCHEDULE;
-    if (irq_status & 0x1) { /* used ring update */
-        // XXX is this safe?
-        dev->mmio_config->interrupt_ack = 0x1;
 
-        /* cycle through all the active rings */
-        for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
-            if ((dev->active_rings_bitmap & (1<<r)) == 0)
-                continue;
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&dev->used_lock[ring_index], state);
+    uint count = virtio_process_used_locked(dev, ring_index, &ret);
+    spin_unlock_irqrestore(&dev->used_lock[ring_index], state);
 
-            struct vring *ring = &dev->ring[r];
-            LTRACEF("ring %u: used flags 0x%hhx idx 0x%hhx last_used %u\n", r, ring->used->flags, ring->used->idx, ring->last_used);
+    return count;
+}
 
-            uint cur_idx = ring->used->idx;
-            for (uint i = ring->last_used; i != (cur_idx & ring->num_mask); i = (i + 1) & ring->num_mask) {
-                LTRACEF("looking at idx %u\n", i);
+void virtio_set_ring_interrupts(struct virtio_device *dev, uint ring_index, bool enable)
+{
+    DEBUG_ASSERT(ring_index < MAX_VIRTIO_RINGS);
+
+    struct vring *ring = &dev->ring[ring_index];
+    ring->no_interrupt = !enable;
+
+    /* with event indices the flag is ignored and the device interrupts at most once more
+     * past the last used_event, which is left alone until interrupts are back on */
+    if (enable) {
+        ring->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+        if (dev->event_idx)
+            vring_used_event(ring) = ring->last_used;
+    } else {
+        ring->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+    }
 
-                // process chain
-                struct vring_used_elem *used_elem = &ring->used->ring[i];
-                LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
+    /* make sure the device sees the flag before the driver looks at the used ring again */
+    DSB;
+}
 
-                DEBUG_ASSERT(dev->irq_driver_callback);
-                ret |= dev->irq_driver_callback(dev, r, used_elem);
+enum handler_return virtio_handle_irq(struct virtio_device *dev)
+{
+    LTRACEF("dev %p, index %u\n", dev, dev->index);
 
-                ring->last_used = (ring->last_used + 1) & ring->num_mask;
-            }
+    // XXX is acking before processing safe?
+    uint32_t irq_status = dev->transport->ack_irq(dev);
+    LTRACEF("status 0x%x\n", irq_status);
+
+    enum handler_return ret = INT_NO_RESCHEDULE;
+    if (irq_status & VIRTIO_IRQ_USED_RING) {
+        /* cycle through all the active rings */
+        for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
+            if ((dev->active_rings_bitmap & (1u<<r)) == 0)
+                continue;
+
+            spin_lock(&dev->used_lock[r]);
+            virtio_process_used_locked(dev, r, &ret);
+            spin_unlock(&dev->used_lock[r]);
         }
     }
-    if (irq_status & 0x2) { /* config change */
-        dev->mmio_config->interrupt_ack = 0x2;
-
+    if (irq_status & VIRTIO_IRQ_CONFIG_CHANGE) {
+        if (dev->transport->refresh_config)
+            dev->transport->refresh_config(dev);
         if (dev->config_change_callback) {
             ret |= dev->config_change_callback(dev);
         }
@@ -127,6 +204,183 @@ static enum handler_return virtio_mmio_irq(void *arg)
     return ret;
 }
 
+static enum handler_return virtio_mmio_irq(void *arg)
+{
+    return virtio_handle_irq((struct virtio_device *)arg);
+}
+
+#if VIRTIO_THREADED_IRQ
+/* ack the device and leave everything else to the irq thread */
+static enum irq_thread_return virtio_mmio_hard_irq(void *arg)
+{
+    struct virtio_device *dev = (struct virtio_device *)arg;
+
+    uint32_t irq_status = dev->transport->ack_irq(dev);
+    LTRACEF("dev %p, status 0x%x\n", dev, irq_status);
+
+    if (irq_status == 0)
+        return IRQ_HANDLED;
+
+    atomic_or(&dev->irq_pending, irq_status);
+
+    return IRQ_WAKE_THREAD;
+}
+
+static void virtio_mmio_irq_thread(void *arg)
+{
+    struct virtio_device *dev = (struct virtio_device *)arg;
+    uint32_t irq_status = atomic_swap(&dev->irq_pending, 0);
+
+    LTRACEF("dev %p, status 0x%x\n", dev, irq_status);
+
+    /* the driver callbacks still run with interrupts off, but only for as long as a
+     * ring takes, and a higher priority thread can get in between them */
+    enum handler_return ret = INT_NO_RESCHEDULE;
+    if (irq_status & VIRTIO_IRQ_USED_RING) {
+        for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
+            if ((dev->active_rings_bitmap & (1u<<r)) == 0)
+                continue;
+
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&dev->used_lock[r], state);
+            virtio_process_used_locked(dev, r, &ret);
+            spin_unlock_irqrestore(&dev->used_lock[r], state);
+        }
+    }
+    if (irq_status & VIRTIO_IRQ_CONFIG_CHANGE) {
+        if (dev->transport->refresh_config)
+            dev->transport->refresh_config(dev);
+        if (dev->config_change_callback)
+            dev->config_change_callback(dev);
+    }
+
+    /* anything the callbacks woke gets to run once this thread blocks again */
+}
+#endif
+
+/* unmask the interrupt of a device a driver has taken */
+static void virtio_start_irq(struct virtio_device *dev)
+{
+#if VIRTIO_THREADED_IRQ
+    /* a shared line is left to the transport's own dispatcher */
+    if (dev->transport->shared_irq) {
+        unmask_interrupt(dev->irq);
+        return;
+    }
+
+    /* replaces the plain handler installed at detect time, which stays if this fails */
+    status_t err = register_threaded_int_handler(dev->irq, &virtio_mmio_hard_irq,
+                   &virtio_mmio_irq_thread, dev, VIRTIO_IRQ_PRIORITY, 0, "virtio irq");
+    if (err < 0)
+        TRACEF("dev %u: no irq thread (%d), handling the rings in interrupt context\n", dev->index, err);
+#endif
+
+    unmask_interrupt(dev->irq);
+}
+
+/* mmio transport */
+static uint8_t virtio_mmio_get_status(struct virtio_device *dev)
+{
+    return dev->mmio_config->status;
+}
+
+static void virtio_mmio_set_status(struct virtio_device *dev, uint8_t status)
+{
+    dev->mmio_config->status = status;
+}
+
+static void virtio_mmio_set_features(struct virtio_device *dev, uint32_t features)
+{
+    dev->mmio_config->guest_features_sel = 0;
+    dev->mmio_config->guest_features = features;
+}
+
+static uint16_t virtio_mmio_ring_size(struct virtio_device *dev, uint index, uint16_t len)
+{
+    /* the driver picks the size */
+    return len;
+}
+
+static void virtio_mmio_enable_ring(struct virtio_device *dev, uint index, uint16_t num, paddr_t pa)
+{
+    dev->mmio_config->guest_page_size = PAGE_SIZE;
+    dev->mmio_config->queue_sel = index;
+    dev->mmio_config->queue_num = num;
+    dev->mmio_config->queue_align = PAGE_SIZE;
+    dev->mmio_config->queue_pfn = pa / PAGE_SIZE;
+}
+
+static void virtio_mmio_notify(struct virtio_device *dev, uint index)
+{
+    dev->mmio_config->queue_notify = index;
+}
+
+static uint32_t virtio_mmio_ack_irq(struct virtio_device *dev)
+{
+    uint32_t irq_status = dev->mmio_config->interrupt_status & (VIRTIO_IRQ_USED_RING | VIRTIO_IRQ_CONFIG_CHANGE);
+    if (irq_status)
+        dev->mmio_config->interrupt_ack = irq_status;
+
+    return irq_status;
+}
+
+static const struct virtio_transport virtio_mmio_transport = {
+    .get_status = virtio_mmio_get_status,
+    .set_status = virtio_mmio_set_status,
+    .set_features = virtio_mmio_set_features,
+    .ring_size = virtio_mmio_ring_size,
+    .enable_ring = virtio_mmio_enable_ring,
+    .notify = virtio_mmio_notify,
+    .ack_irq = virtio_mmio_ack_irq,
+};
+
+bool virtio_attach_device(struct virtio_device *dev, uint32_t device_id, uint32_t host_features)
+{
+    DEBUG_ASSERT(dev->transport);
+
+    dev->host_features = host_features;
+
+    status_t err = ERR_NOT_SUPPORTED;
+    switch (device_id) {
+#if WITH_DEV_VIRTIO_BLOCK
+        case 2: // block device
+            LTRACEF("found block device\n");
+            err = virtio_block_init(dev, host_features);
+            break;
+#endif
+#if WITH_DEV_VIRTIO_NET
+        case 1: // network device
+            LTRACEF("found net device\n");
+            err = virtio_net_init(dev, host_features);
+            break;
+#endif
+#if WITH_DEV_VIRTIO_GPU
+        case 0x10: // virtio-gpu
+            LTRACEF("found gpu device\n");
+            err = virtio_gpu_init(dev, host_features);
+            break;
+#endif
+        default:
+            break;
+    }
+
+    if (err < 0)
+        return false;
+
+    // good device
+    dev->valid = true;
+
+    if (dev->irq_driver_callback)
+        virtio_start_irq(dev);
+
+#if WITH_DEV_VIRTIO_GPU
+    if (device_id == 0x10)
+        virtio_gpu_start(dev);
+#endif
+
+    return true;
+}
+
 int virtio_mmio_detect(void *ptr, uint count, const uint irqs[])
 {
     LTRACEF("ptr %p, count %u\n", ptr, count);
@@ -147,6 +401,9 @@ int virtio_mmio_detect(void *ptr, uint count, const uint irqs[])
 
         dev->index = i;
         dev->irq = irqs[i];
+        dev->transport = &virtio_mmio_transport;
+        for (uint r = 0; r < MAX_VIRTIO_RINGS; r++)
+            dev->used_lock[r] = SPIN_LOCK_INITIAL_VALUE;
 
         mask_interrupt(irqs[i]);
         register_int_handler(irqs[i], &virtio_mmio_irq, (void *)dev);
@@ -164,76 +421,13 @@ int virtio_mmio_detect(void *ptr, uint count, const uint irqs[])
         }
 #endif
 
-#if WITH_DEV_VIRTIO_BLOCK
-        if (mmio->device_id == 2) { // block device
-            LTRACEF("found block device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-
-            status_t err = virtio_block_init(dev, mmio->host_features);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
-
-                // XXX quick test code, remove
-#if 0
-                uint8_t buf[512];
-                memset(buf, 0x99, sizeof(buf));
-                virtio_block_read_write(dev, buf, 0, sizeof(buf), false);
-                hexdump8_ex(buf, sizeof(buf), 0);
-
-                buf[0]++;
-                virtio_block_read_write(dev, buf, 0, sizeof(buf), true);
-
-                virtio_block_read_write(dev, buf, 0, sizeof(buf), false);
-                hexdump8_ex(buf, sizeof(buf), 0);
-#endif
-            }
-
-        }
-#endif // WITH_DEV_VIRTIO_BLOCK
-#if WITH_DEV_VIRTIO_NET
-        if (mmio->device_id == 1) { // network device
-            LTRACEF("found net device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-
-            status_t err = virtio_net_init(dev, mmio->host_features);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
-            }
-        }
-#endif // WITH_DEV_VIRTIO_NET
-#if WITH_DEV_VIRTIO_GPU
-        if (mmio->device_id == 0x10) { // virtio-gpu
-            LTRACEF("found gpu device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-
-            status_t err = virtio_gpu_init(dev, mmio->host_features);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
+        if (mmio->device_id == 0)
+            continue;
 
-                virtio_gpu_start(dev);
-            }
-        }
-#endif // WITH_DEV_VIRTIO_GPU
+        dev->mmio_config = mmio;
+        dev->config_ptr = (void *)mmio->config;
 
-        if (dev->valid)
+        if (virtio_attach_device(dev, mmio->device_id, mmio->host_features))
             found++;
     }
 
@@ -318,7 +512,25 @@ void virtio_kick(struct virtio_device *dev, uint ring_index)
 {
     LTRACEF("dev %p, ring %u\n", dev, ring_index);
 
-    dev->mmio_config->queue_notify = ring_index;
+    struct vring *ring = &dev->ring[ring_index];
+
+    /* the new avail idx has to be visible before looking at whether the device wants a kick */
+    DSB;
+    uint16_t new_idx = ring->avail->idx;
+    uint16_t old_idx = ring->kicked_idx;
+    ring->kicked_idx = new_idx;
+
+    bool notify;
+    if (dev->event_idx)
+        notify = vring_need_event(vring_avail_event(ring), new_idx, old_idx);
+    else
+        notify = !(ring->used->flags & VRING_USED_F_NO_NOTIFY);
+
+    LTRACEF("avail %u -> %u, notify %u\n", old_idx, new_idx, notify);
+    if (!notify)
+        return;
+
+    dev->transport->notify(dev, ring_index);
     DSB;
 }
 
@@ -335,26 +547,24 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
 
     struct vring *ring = &dev->ring[index];
 
+    /* some transports have the device pick the size, the driver still gets no more
+     * descriptors than it asked for */
+    uint16_t num = dev->transport->ring_size(dev, index, len);
+    if (num == 0 || !ispow2(num))
+        return ERR_NOT_FOUND;
+
     /* allocate a ring */
-    size_t size = vring_size(len, PAGE_SIZE);
+    size_t size = vring_size(num, PAGE_SIZE);
     LTRACEF("need %zu bytes\n", size);
 
 #if WITH_KERNEL_VM
     void *vptr;
-    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "virtio_ring", size, &vptr, 0, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
-    if (err < 0)
-        return ERR_NO_MEMORY;
-
-    LTRACEF("allocated virtio_ring at va %p\n", vptr);
-
-    /* compute the physical address */
     paddr_t pa;
-    pa = vaddr_to_paddr(vptr);
-    if (pa == 0) {
+    status_t err = dma_alloc_coherent(size, &vptr, &pa);
+    if (err < 0)
         return ERR_NO_MEMORY;
-    }
 
-    LTRACEF("virtio_ring at pa 0x%lx\n", pa);
+    LTRACEF("allocated virtio_ring at va %p pa 0x%lx\n", vptr, pa);
 #else
     void *vptr = memalign(PAGE_SIZE, size);
     if (!vptr)
@@ -368,22 +578,17 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
 #endif
 
     /* initialize the ring */
-    vring_init(ring, len, vptr, PAGE_SIZE);
+    vring_init(ring, num, vptr, PAGE_SIZE);
     dev->ring[index].free_list = 0xffff;
     dev->ring[index].free_count = 0;
 
-    /* add all the descriptors to the free list */
-    for (uint i = 0; i < len; i++) {
+    /* add the descriptors to the free list */
+    for (uint i = 0; i < MIN(len, num); i++) {
         virtio_free_desc(dev, index, i);
     }
 
     /* register the ring with the device */
-    DEBUG_ASSERT(dev->mmio_config);
-    dev->mmio_config->guest_page_size = PAGE_SIZE;
-    dev->mmio_config->queue_sel = index;
-    dev->mmio_config->queue_num = len;
-    dev->mmio_config->queue_align = PAGE_SIZE;
-    dev->mmio_config->queue_pfn = pa / PAGE_SIZE;
+    dev->transport->enable_ring(dev, index, num, pa);
 
     /* mark the ring active */
     dev->active_rings_bitmap |= (1 << index);
@@ -393,17 +598,28 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
 
 void virtio_reset_device(struct virtio_device *dev)
 {
-    dev->mmio_config->status = 0;
+    dev->transport->set_status(dev, 0);
 }
 
 void virtio_status_acknowledge_driver(struct virtio_device *dev)
 {
-    dev->mmio_config->status |= VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+    uint8_t status = dev->transport->get_status(dev);
+    dev->transport->set_status(dev, status | VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+}
+
+void virtio_set_guest_features(struct virtio_device *dev, uint32_t features)
+{
+    dev->event_idx = VIRTIO_RING_EVENT_IDX && (dev->host_features & (1u << VIRTIO_RING_F_EVENT_IDX));
+    if (dev->event_idx)
+        features |= (1u << VIRTIO_RING_F_EVENT_IDX);
+
+    dev->transport->set_features(dev, features);
 }
 
 void virtio_status_driver_ok(struct virtio_device *dev)
 {
-    dev->mmio_config->status |= VIRTIO_STATUS_DRIVER_OK;
+    uint8_t status = dev->transport->get_status(dev);
+    dev->transport->set_status(dev, status | VIRTIO_STATUS_DRIVER_OK);
 }
 
 void virtio_init(uint level)
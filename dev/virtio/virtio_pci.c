@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Legacy virtio-pci transport.
+ *
+ * Every device has its registers in an i/o port bar 0, laid out as in the
+ * pre 1.0 spec with the device config following the common header. The
+ * device config is only reachable through port accesses, so a copy of it
+ * is kept in ram for the drivers to read from config_ptr and refreshed on
+ * every config change interrupt. Interrupts are INTx, which several
+ * functions may share, so one handler per line services every virtio
+ * device wired to it.
+ */
+#include <dev/virtio.h>
+#include <dev/virtio/virtio_ring.h>
+
+#include <debug.h>
+#include <assert.h>
+#include <trace.h>
+#include <compiler.h>
+#include <list.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arch/x86.h>
+#include <dev/pci.h>
+#include <kernel/spinlock.h>
+#include <platform/interrupts.h>
+#include <platform/pc.h>
+
+#include "virtio_priv.h"
+
+#define LOCAL_TRACE 0
+
+#define VIRTIO_PCI_VENDOR_ID        0x1af4
+#define VIRTIO_PCI_DEVICE_ID_FIRST  0x1000
+#define VIRTIO_PCI_DEVICE_ID_LAST   0x103f
+
+/* legacy register block */
+#define VIRTIO_PCI_HOST_FEATURES    0x00 // 32 bit
+#define VIRTIO_PCI_GUEST_FEATURES   0x04 // 32 bit
+#define VIRTIO_PCI_QUEUE_PFN        0x08 // 32 bit
+#define VIRTIO_PCI_QUEUE_NUM        0x0c // 16 bit, read only
+#define VIRTIO_PCI_QUEUE_SEL        0x0e // 16 bit
+#define VIRTIO_PCI_QUEUE_NOTIFY     0x10 // 16 bit
+#define VIRTIO_PCI_STATUS           0x12 // 8 bit
+#define VIRTIO_PCI_ISR              0x13 // 8 bit, cleared by reading
+#define VIRTIO_PCI_CONFIG           0x14 // device config, msi-x disabled
+
+/* the rings are always laid out on 4k boundaries */
+#define VIRTIO_PCI_QUEUE_ADDR_SHIFT 12
+
+/* largest device config copied out of the device */
+#ifndef VIRTIO_PCI_MAX_CONFIG
+#define VIRTIO_PCI_MAX_CONFIG 64
+#endif
+
+struct virtio_pci_device {
+    struct virtio_device dev;
+    struct list_node node;
+
+    uint16_t io_base;
+    uint16_t config_len;
+    uint8_t config[VIRTIO_PCI_MAX_CONFIG] __ALIGNED(8);
+};
+
+/* every probed device, walked by the irq handlers */
+static struct list_node pci_devices = LIST_INITIAL_VALUE(pci_devices);
+static spin_lock_t pci_devices_lock = SPIN_LOCK_INITIAL_VALUE;
+static uint32_t irq_lines_registered;
+
+static inline struct virtio_pci_device *to_pci_device(struct virtio_device *dev)
+{
+    return containerof(dev, struct virtio_pci_device, dev);
+}
+
+static uint8_t virtio_pci_get_status(struct virtio_device *dev)
+{
+    return inp(to_pci_device(dev)->io_base + VIRTIO_PCI_STATUS);
+}
+
+static void virtio_pci_set_status(struct virtio_device *dev, uint8_t status)
+{
+    outp(to_pci_device(dev)->io_base + VIRTIO_PCI_STATUS, status);
+}
+
+static void virtio_pci_set_features(struct virtio_device *dev, uint32_t features)
+{
+    outpd(to_pci_device(dev)->io_base + VIRTIO_PCI_GUEST_FEATURES, features);
+}
+
+static uint16_t virtio_pci_ring_size(struct virtio_device *dev, uint index, uint16_t len)
+{
+    struct virtio_pci_device *vdev = to_pci_device(dev);
+
+    /* the device decides on the size, len only limits what the driver uses */
+    outpw(vdev->io_base + VIRTIO_PCI_QUEUE_SEL, index);
+    return inpw(vdev->io_base + VIRTIO_PCI_QUEUE_NUM);
+}
+
+static void virtio_pci_enable_ring(struct virtio_device *dev, uint index, uint16_t num, paddr_t pa)
+{
+    struct virtio_pci_device *vdev = to_pci_device(dev);
+
+    DEBUG_ASSERT(PAGE_SIZE == (1u << VIRTIO_PCI_QUEUE_ADDR_SHIFT));
+    DEBUG_ASSERT((pa >> VIRTIO_PCI_QUEUE_ADDR_SHIFT) <= UINT32_MAX);
+
+    outpw(vdev->io_base + VIRTIO_PCI_QUEUE_SEL, index);
+    outpd(vdev->io_base + VIRTIO_PCI_QUEUE_PFN, pa >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+}
+
+static void virtio_pci_notify(struct virtio_device *dev, uint index)
+{
+    outpw(to_pci_device(dev)->io_base + VIRTIO_PCI_QUEUE_NOTIFY, index);
+}
+
+static uint32_t virtio_pci_ack_irq(struct virtio_device *dev)
+{
+    return inp(to_pci_device(dev)->io_base + VIRTIO_PCI_ISR) &
+           (VIRTIO_IRQ_USED_RING | VIRTIO_IRQ_CONFIG_CHANGE);
+}
+
+static void virtio_pci_refresh_config(struct virtio_device *dev)
+{
+    struct virtio_pci_device *vdev = to_pci_device(dev);
+
+    for (uint i = 0; i < vdev->config_len; i++)
+        vdev->config[i] = inp(vdev->io_base + VIRTIO_PCI_CONFIG + i);
+}
+
+static const struct virtio_transport virtio_pci_transport = {
+    .get_status = virtio_pci_get_status,
+    .set_status = virtio_pci_set_status,
+    .set_features = virtio_pci_set_features,
+    .ring_size = virtio_pci_ring_size,
+    .enable_ring = virtio_pci_enable_ring,
+    .notify = virtio_pci_notify,
+    .ack_irq = virtio_pci_ack_irq,
+    .refresh_config = virtio_pci_refresh_config,
+    .shared_irq = true,
+};
+
+static enum handler_return virtio_pci_irq(void *arg)
+{
+    uint irq = (uintptr_t)arg;
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    spin_lock(&pci_devices_lock);
+    struct virtio_pci_device *vdev;
+    list_for_every_entry(&pci_devices, vdev, struct virtio_pci_device, node) {
+        if (vdev->dev.irq != irq)
+            continue;
+
+        /* a device without a driver still gets its status cleared so it can't hold the line */
+        if (vdev->dev.irq_driver_callback)
+            ret |= virtio_handle_irq(&vdev->dev);
+        else
+            virtio_pci_ack_irq(&vdev->dev);
+    }
+    spin_unlock(&pci_devices_lock);
+
+    return ret;
+}
+
+static status_t virtio_pci_probe(pci_location_t *loc, uint index)
+{
+    pci_config_t config;
+
+    for (uint i = 0; i < sizeof(config) / sizeof(uint32_t); i++) {
+        if (pci_read_config_word(loc, i * sizeof(uint32_t), (uint32_t *)&config + i) != _PCI_SUCCESSFUL)
+            return ERR_NOT_CONFIGURED;
+    }
+
+    /* legacy and transitional devices only, modern ones start at 0x1040 */
+    if (config.device_id < VIRTIO_PCI_DEVICE_ID_FIRST || config.device_id > VIRTIO_PCI_DEVICE_ID_LAST)
+        return ERR_NOT_SUPPORTED;
+
+    // bar 0 is the i/o port register block
+    uint32_t bar = config.base_addresses[0];
+    if (!(bar & 1) || (bar & ~0x3u) == 0 || config.interrupt_line >= 16)
+        return ERR_NOT_CONFIGURED;
+
+    pci_write_config_word(loc, PCI_CONFIG_BASE_ADDRESSES, 0xffffffff);
+    uint32_t mask;
+    pci_read_config_word(loc, PCI_CONFIG_BASE_ADDRESSES, &mask);
+    pci_write_config_word(loc, PCI_CONFIG_BASE_ADDRESSES, bar);
+    uint32_t bar_size = (~(mask & ~0x3u) + 1) & 0xffff;
+
+    struct virtio_pci_device *vdev = calloc(1, sizeof(struct virtio_pci_device));
+    if (!vdev)
+        return ERR_NO_MEMORY;
+
+    vdev->io_base = bar & ~0x3u;
+    if (bar_size > VIRTIO_PCI_CONFIG)
+        vdev->config_len = MIN(bar_size - VIRTIO_PCI_CONFIG, VIRTIO_PCI_MAX_CONFIG);
+
+    struct virtio_device *dev = &vdev->dev;
+    dev->index = index;
+    dev->irq = INT_BASE + config.interrupt_line;
+    dev->transport = &virtio_pci_transport;
+    dev->config_ptr = vdev->config;
+    for (uint r = 0; r < MAX_VIRTIO_RINGS; r++)
+        dev->used_lock[r] = SPIN_LOCK_INITIAL_VALUE;
+
+    pci_write_config_half(loc, PCI_CONFIG_COMMAND,
+                          config.command | PCI_COMMAND_IO_EN | PCI_COMMAND_BUS_MASTER_EN);
+
+    /* quiet the device before its line may get unmasked on behalf of another one */
+    virtio_reset_device(dev);
+    virtio_pci_refresh_config(dev);
+
+    uint32_t host_features = inpd(vdev->io_base + VIRTIO_PCI_HOST_FEATURES);
+
+    LTRACEF("device 0x%x type %u at %02x:%02x io 0x%x size %u irq %u features 0x%x\n",
+            config.device_id, config.subsystem_id, loc->bus, loc->dev_fn,
+            vdev->io_base, bar_size, config.interrupt_line, host_features);
+
+    if (!(irq_lines_registered & (1u << config.interrupt_line))) {
+        mask_interrupt(dev->irq);
+        register_int_handler(dev->irq, &virtio_pci_irq, (void *)(uintptr_t)dev->irq);
+        irq_lines_registered |= (1u << config.interrupt_line);
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&pci_devices_lock, state);
+    list_add_tail(&pci_devices, &vdev->node);
+    spin_unlock_irqrestore(&pci_devices_lock, state);
+
+    /* the legacy device type is the subsystem id */
+    if (!virtio_attach_device(dev, config.subsystem_id, host_features)) {
+        virtio_reset_device(dev);
+
+        spin_lock_irqsave(&pci_devices_lock, state);
+        list_delete(&vdev->node);
+        spin_unlock_irqrestore(&pci_devices_lock, state);
+        free(vdev);
+        return ERR_NOT_FOUND;
+    }
+
+    return NO_ERROR;
+}
+
+int virtio_pci_detect(void)
+{
+    pci_location_t loc;
+    int found = 0;
+    uint index = 0;
+
+    for (uint16_t id = VIRTIO_PCI_DEVICE_ID_FIRST; id <= VIRTIO_PCI_DEVICE_ID_LAST; id++) {
+        for (uint16_t i = 0; pci_find_pci_device(&loc, id, VIRTIO_PCI_VENDOR_ID, i) == _PCI_SUCCESSFUL; i++) {
+            if (virtio_pci_probe(&loc, index++) == NO_ERROR)
+                found++;
+        }
+    }
+
+    return found;
+}
@@ -24,6 +24,8 @@
 
 #include <compiler.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <dev/virtio.h>
 
 struct virtio_mmio_config {
     /* 0x00 */  uint32_t magic;
@@ -63,3 +65,36 @@ STATIC_ASSERT(sizeof(struct virtio_mmio_config) == 0x100);
 #define VIRTIO_STATUS_FEATURES_OK (1<<3)
 #define VIRTIO_STATUS_DEVICE_NEEDS_RESET (1<<6)
 #define VIRTIO_STATUS_FAILED      (1<<7)
+
+/* interrupt status bits, the same for every transport */
+#define VIRTIO_IRQ_USED_RING      (1<<0)
+#define VIRTIO_IRQ_CONFIG_CHANGE  (1<<1)
+
+/* the register level operations of a way of attaching devices, mmio or pci */
+struct virtio_transport {
+    uint8_t (*get_status)(struct virtio_device *dev);
+    void (*set_status)(struct virtio_device *dev, uint8_t status);
+    void (*set_features)(struct virtio_device *dev, uint32_t features);
+
+    /* number of entries ring index will have given the size the driver asked for,
+     * 0 if the device has no such ring */
+    uint16_t (*ring_size)(struct virtio_device *dev, uint index, uint16_t len);
+    void (*enable_ring)(struct virtio_device *dev, uint index, uint16_t num, paddr_t pa);
+    void (*notify)(struct virtio_device *dev, uint index);
+
+    /* read and acknowledge the VIRTIO_IRQ_* bits pending */
+    uint32_t (*ack_irq)(struct virtio_device *dev);
+
+    /* optional, bring config_ptr up to date after a config change */
+    void (*refresh_config)(struct virtio_device *dev);
+
+    /* the transport dispatches interrupts itself, the line is shared */
+    bool shared_irq;
+};
+
+/* hand a device to the driver for its type and start its interrupts.
+ * returns true if a driver took it. */
+bool virtio_attach_device(struct virtio_device *dev, uint32_t device_id, uint32_t host_features);
+
+/* service a device's interrupt */
+enum handler_return virtio_handle_irq(struct virtio_device *dev);
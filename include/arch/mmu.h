@@ -61,6 +61,18 @@ vaddr_t arch_mmu_pick_spot(arch_aspace_t *aspace,
                            vaddr_t end,  uint next_region_arch_mmu_flags,
                            vaddr_t align, size_t size, uint arch_mmu_flags) __NONNULL((1));
 
+/* log2 of the largest block the arch can map with a single translation entry, for a run
+ * of size bytes starting at paddr. The vmm aligns the virtual address to it so that
+ * arch_mmu_map can use large pages. Returns PAGE_SIZE_SHIFT if there is no such block.
+ */
+uint arch_mmu_block_shift(arch_aspace_t *aspace, paddr_t paddr, size_t size) __NONNULL((1));
+
+/* drop this cpu's tlb entries for count pages at vaddr in aspace, without touching the page
+ * tables. count 0 drops everything. Used by the mp tlb shootdown, so only needed on SMP
+ * arches whose tlb maintenance is not broadcast by the hardware.
+ */
+void arch_mmu_invalidate_local(arch_aspace_t *aspace, vaddr_t vaddr, uint count);
+
 /* load a new user address space context.
  * aspace argument NULL should unload user space.
  */
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <err.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Hardware performance counters of the current cpu.
+ *
+ * Counters are programmed, started and read on the cpu the caller is running
+ * on, so pin the thread for the duration of a measurement. They count
+ * everything that runs on that cpu in the kernel and in user space, with no
+ * per thread virtualization.
+ *
+ * The events are the closest the arch has to each generic one: on arm64 the
+ * cache events are the L1 data cache, on x86 the last level cache.
+ */
+enum arch_pmu_event {
+    ARCH_PMU_EVENT_CYCLES,
+    ARCH_PMU_EVENT_INSTRUCTIONS,
+    ARCH_PMU_EVENT_CACHE_REFS,
+    ARCH_PMU_EVENT_CACHE_MISSES,
+    ARCH_PMU_EVENT_BRANCHES,
+    ARCH_PMU_EVENT_BRANCH_MISSES,
+    ARCH_PMU_EVENT_DTLB_MISSES,
+    ARCH_PMU_EVENT_ITLB_MISSES,
+
+    ARCH_PMU_EVENT_COUNT
+};
+
+#if ARCH_HAS_PMU
+
+/* number of events that can be counted at the same time, 0 without a usable pmu */
+uint arch_pmu_num_counters(void);
+
+bool arch_pmu_event_supported(enum arch_pmu_event event);
+
+/*
+ * Program a counter to count event, stopped and reset to zero.
+ * Returns ERR_INVALID_ARGS for a counter past arch_pmu_num_counters() and
+ * ERR_NOT_SUPPORTED for an event the cpu can't count.
+ */
+status_t arch_pmu_set_event(uint counter, enum arch_pmu_event event);
+
+/* start and stop every programmed counter together */
+void arch_pmu_start(void);
+void arch_pmu_stop(void);
+
+uint64_t arch_pmu_read(uint counter);
+
+#else
+
+static inline uint arch_pmu_num_counters(void) { return 0; }
+static inline bool arch_pmu_event_supported(enum arch_pmu_event event) { return false; }
+static inline status_t arch_pmu_set_event(uint counter, enum arch_pmu_event event) { return ERR_NOT_SUPPORTED; }
+static inline void arch_pmu_start(void) {}
+static inline void arch_pmu_stop(void) {}
+static inline uint64_t arch_pmu_read(uint counter) { return 0; }
+
+#endif
+
+__END_CDECLS
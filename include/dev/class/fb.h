@@ -32,6 +32,7 @@ struct fb_info {
     size_t width;
     size_t height;
     size_t bpp;
+    void *back_addr; // second buffer for flip, NULL if not supported
 };
 
 /* fb interface */
@@ -42,6 +43,7 @@ struct fb_ops {
     status_t (*get_info)(struct device *dev, struct fb_info *info);
     status_t (*update)(struct device *dev);
     status_t (*update_region)(struct device *dev, size_t x, size_t y, size_t width, size_t height);
+    status_t (*flip)(struct device *dev, void *addr);
 };
 
 __BEGIN_CDECLS
@@ -50,6 +52,7 @@ status_t class_fb_set_mode(struct device *dev, size_t width, size_t height, size
 status_t class_fb_get_info(struct device *dev, struct fb_info *info);
 status_t class_fb_update(struct device *dev);
 status_t class_fb_update_region(struct device *dev, size_t x, size_t y, size_t width, size_t height);
+status_t class_fb_flip(struct device *dev, void *addr);
 
 __END_CDECLS
 
@@ -81,6 +81,13 @@ struct display_framebuffer {
     struct display_image image;
     // Update function
     void (*flush)(uint starty, uint endy);
+    // Optional, update just a rectangle
+    void (*flush_rect)(uint x, uint y, uint width, uint height);
+    // Optional, a second buffer laid out like image that can be scanned out
+    void *back_pixels;
+    // Optional, switch the scanout to pixels (image.pixels or back_pixels)
+    // without tearing. Once it returns the other buffer is free to draw into.
+    status_t (*flip)(void *pixels);
 };
 
 status_t display_get_framebuffer(struct display_framebuffer *fb)
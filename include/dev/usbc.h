@@ -27,6 +27,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include <list.h>
 #include <hw/usb.h>
 
 __BEGIN_CDECLS
@@ -58,6 +59,8 @@ typedef struct usbc_transfer {
     size_t buflen;
     uint bufpos;
     void *extra; // extra pointer to store whatever you want
+
+    struct list_node node; // owned by the controller while queued
 } usbc_transfer_t;
 
 enum {
@@ -67,8 +70,14 @@ enum {
 };
 
 status_t usbc_setup_endpoint(ep_t ep, ep_dir_t dir, uint width, ep_type_t type);
+
+/* queue a transfer on an endpoint. any number may be queued, they run back to
+ * back in order and complete through their callbacks, from interrupt context.
+ * may be called from the callbacks. */
 status_t usbc_queue_rx(ep_t ep, usbc_transfer_t *transfer);
 status_t usbc_queue_tx(ep_t ep, usbc_transfer_t *transfer);
+
+/* drop everything queued on an endpoint, without calling the callbacks */
 status_t usbc_flush_ep(ep_t ep);
 
 status_t usbc_set_active(bool active);
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <list.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Idle state selection.
+ *
+ * The idle thread asks cpuidle_enter() to put the cpu to sleep. Without any
+ * registered states that is a plain arch_idle(). A platform with deeper states
+ * registers them with their costs, and each time the cpu goes idle the deepest
+ * one is picked that pays off before the next timer and that wakes up fast
+ * enough for every latency request in force.
+ */
+
+struct cpuidle_state {
+    const char *name;
+    uint32_t exit_latency_us;       /* from the wakeup interrupt to running again */
+    uint32_t target_residency_us;   /* shortest sleep that makes entering worth it */
+
+    /* called with interrupts disabled, must return once an interrupt is pending */
+    void (*enter)(const struct cpuidle_state *state);
+};
+
+/*
+ * Register the platform's idle states, ordered shallowest to deepest. They are
+ * all deeper than arch_idle(), which is used when none of them fit. The table
+ * is not copied.
+ */
+status_t cpuidle_register_states(const struct cpuidle_state *states, uint count);
+
+/* sleep once, called by the idle thread with interrupts enabled */
+void cpuidle_enter(void);
+
+/*
+ * A bound on wakeup latency, for real time threads that can't wait for a cpu to
+ * climb out of a deep state. The tightest request in force wins.
+ */
+typedef struct cpuidle_latency_req {
+    struct list_node node;
+    uint32_t latency_us;
+} cpuidle_latency_req_t;
+
+void cpuidle_latency_add(cpuidle_latency_req_t *req, uint32_t latency_us);
+void cpuidle_latency_update(cpuidle_latency_req_t *req, uint32_t latency_us);
+void cpuidle_latency_remove(cpuidle_latency_req_t *req);
+
+__END_CDECLS
@@ -29,26 +29,48 @@ __BEGIN_CDECLS
 
 #include <debug.h>
 
-/* kernel event log */
+/*
+ * kernel event log
+ *
+ * Every cpu logs into its own ring with interrupts disabled, so a ring only ever
+ * has one writer and adding an event takes no lock. Each record is a microsecond
+ * timestamp, the cpu and event id, and two event specific arguments. When
+ * WITH_KERNEL_EVLOG is not set the trace points compile away entirely.
+ *
+ * The 'kevlog json' command prints the rings in the Chrome trace event format,
+ * which chrome://tracing and ui.perfetto.dev can open directly.
+ */
 #if WITH_KERNEL_EVLOG
 
 #include <lib/evlog.h>
 
+/* per cpu ring size in words, 4 words per event */
 #ifndef KERNEL_EVLOG_LEN
-#define KERNEL_EVLOG_LEN 1024
+#define KERNEL_EVLOG_LEN 4096
+#endif
+
+/* the timer tick fires often enough to crowd out everything else */
+#ifndef KERNEL_EVLOG_TICKS
+#define KERNEL_EVLOG_TICKS 0
 #endif
 
 void kernel_evlog_init(void);
 
 void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1);
 void kernel_evlog_dump(void);
+void kernel_evlog_dump_json(void);
+void kernel_evlog_clear(void);
 
 #else // !WITH_KERNEL_EVLOG
 
+#define KERNEL_EVLOG_TICKS 0
+
 /* do nothing versions */
 static inline void kernel_evlog_init(void) {}
 static inline void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1) {}
 static inline void kernel_evlog_dump(void) {}
+static inline void kernel_evlog_dump_json(void) {}
+static inline void kernel_evlog_clear(void) {}
 
 #endif
 
@@ -60,14 +82,37 @@ enum {
     KERNEL_EVLOG_TIMER_CALL,
     KERNEL_EVLOG_IRQ_ENTER,
     KERNEL_EVLOG_IRQ_EXIT,
+    KERNEL_EVLOG_MUTEX_BLOCK,
+    KERNEL_EVLOG_MUTEX_WAKE,
+    KERNEL_EVLOG_BIO_BEGIN,
+    KERNEL_EVLOG_BIO_END,
+    KERNEL_EVLOG_NET_RX,
+    KERNEL_EVLOG_NET_TX,
+};
+
+/* KERNEL_EVLOG_BIO_BEGIN operation */
+enum {
+    KERNEL_EVLOG_BIO_READ = 0,
+    KERNEL_EVLOG_BIO_WRITE,
+    KERNEL_EVLOG_BIO_ERASE,
 };
 
 #define KEVLOG_THREAD_SWITCH(from, to) kernel_evlog_add(KERNEL_EVLOG_CONTEXT_SWITCH, (uintptr_t)from, (uintptr_t)to)
 #define KEVLOG_THREAD_PREEMPT(thread) kernel_evlog_add(KERNEL_EVLOG_PREEMPT, (uintptr_t)thread, 0)
+#if KERNEL_EVLOG_TICKS
 #define KEVLOG_TIMER_TICK() kernel_evlog_add(KERNEL_EVLOG_TIMER_TICK, 0, 0)
+#else
+#define KEVLOG_TIMER_TICK() do { } while (0)
+#endif
 #define KEVLOG_TIMER_CALL(ptr, arg) kernel_evlog_add(KERNEL_EVLOG_TIMER_CALL, (uintptr_t)ptr, (uintptr_t)arg)
 #define KEVLOG_IRQ_ENTER(irqn) kernel_evlog_add(KERNEL_EVLOG_IRQ_ENTER, (uintptr_t)irqn, 0)
 #define KEVLOG_IRQ_EXIT(irqn) kernel_evlog_add(KERNEL_EVLOG_IRQ_EXIT, (uintptr_t)irqn, 0)
+#define KEVLOG_MUTEX_BLOCK(m) kernel_evlog_add(KERNEL_EVLOG_MUTEX_BLOCK, (uintptr_t)(m), 0)
+#define KEVLOG_MUTEX_WAKE(m, err) kernel_evlog_add(KERNEL_EVLOG_MUTEX_WAKE, (uintptr_t)(m), (uintptr_t)(err))
+#define KEVLOG_BIO_BEGIN(dev, op) kernel_evlog_add(KERNEL_EVLOG_BIO_BEGIN, (uintptr_t)(dev), (uintptr_t)(op))
+#define KEVLOG_BIO_END(dev, result) kernel_evlog_add(KERNEL_EVLOG_BIO_END, (uintptr_t)(dev), (uintptr_t)(result))
+#define KEVLOG_NET_RX(netif, len) kernel_evlog_add(KERNEL_EVLOG_NET_RX, (uintptr_t)(netif), (uintptr_t)(len))
+#define KEVLOG_NET_TX(netif, len) kernel_evlog_add(KERNEL_EVLOG_NET_TX, (uintptr_t)(netif), (uintptr_t)(len))
 
 __END_CDECLS
 
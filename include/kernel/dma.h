@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <sys/types.h>
+#include <arch/ops.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Memory shared with bus masters.
+ *
+ * Coherent buffers are seen the same way by the cpu and the device at all
+ * times, by mapping them uncached where the hardware doesn't snoop the cpu
+ * caches. They suit small, long lived structures that both sides poke at,
+ * such as descriptor rings.
+ *
+ * Streaming mappings hand ordinary cached memory to a device for one
+ * transfer: sync it for the device before starting the transfer and for
+ * the cpu after the device is done with it, and leave it alone in between.
+ * Buffers the device writes into should be cache line aligned, or at least
+ * not share a line with anything the cpu touches while the transfer runs,
+ * as syncing for the cpu discards those lines.
+ *
+ * Set ARCH_DMA_COHERENT where devices snoop the caches and all of it costs
+ * nothing.
+ */
+#ifndef ARCH_DMA_COHERENT
+#define ARCH_DMA_COHERENT 0
+#endif
+
+enum dma_direction {
+    DMA_TO_DEVICE,      // the device reads the buffer
+    DMA_FROM_DEVICE,    // the device writes the buffer
+    DMA_BIDIRECTIONAL,
+};
+
+/* Allocate zeroed, physically contiguous, coherent memory and return its kernel
+ * and physical addresses. Returns ERR_NOT_SUPPORTED without a vm on platforms
+ * that aren't coherent. */
+status_t dma_alloc_coherent(size_t size, void **ptr, paddr_t *pa) __NONNULL();
+void dma_free_coherent(void *ptr);
+
+/* hand a buffer over to the device */
+static inline void dma_sync_for_device(const void *ptr, size_t len, enum dma_direction dir)
+{
+#if !ARCH_DMA_COHERENT
+    /* write back anything the device is going to read, and make sure no dirty line
+     * lands on top of what it writes */
+    if (dir == DMA_TO_DEVICE)
+        arch_clean_cache_range((addr_t)ptr, len);
+    else
+        arch_clean_invalidate_cache_range((addr_t)ptr, len);
+#endif
+}
+
+/* take a buffer back from the device */
+static inline void dma_sync_for_cpu(const void *ptr, size_t len, enum dma_direction dir)
+{
+#if !ARCH_DMA_COHERENT
+    /* drop lines speculatively fetched while the device was writing */
+    if (dir != DMA_TO_DEVICE)
+        arch_invalidate_cache_range((addr_t)ptr, len);
+#endif
+}
+
+/* sync a physically contiguous buffer for the device and return the address it
+ * should use */
+paddr_t dma_map_single(const void *ptr, size_t len, enum dma_direction dir);
+
+static inline void dma_unmap_single(const void *ptr, size_t len, enum dma_direction dir)
+{
+    dma_sync_for_cpu(ptr, len, dir);
+}
+
+__END_CDECLS
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KERNEL_FUTEX_H
+#define __KERNEL_FUTEX_H
+
+#include <compiler.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Blocking on arbitrary memory words.
+ *
+ * The kernel keeps no state for a word nobody is blocked on, so a lock or
+ * flag built on top can be pure atomics in the uncontended case and only
+ * call in here once a thread actually has to sleep or to be woken:
+ *
+ *   if (!compare_and_swap(&lock, 0, 1)) {
+ *       while (atomic_swap(&lock, 2) != 0)
+ *           wait_on_address(&lock, 2, INFINITE_TIME);
+ *   }
+ *   ...
+ *   if (atomic_swap(&lock, 0) == 2)
+ *       wake_address(&lock, 1);
+ */
+
+/* Block until woken by wake_address() on |addr| if |*addr| still holds
+ * |expected|, the check being atomic with respect to wakers. Returns
+ * ERR_BAD_STATE right away if the value already changed and
+ * ERR_TIMED_OUT if |timeout| expires first.
+ */
+status_t wait_on_address(volatile int *addr, int expected, lk_time_t timeout);
+
+/* Wake up to |count| threads blocked on |addr|, oldest first, and return how
+ * many were woken. Cheap when nobody waits and callable from interrupt
+ * context, in which case it does not reschedule.
+ */
+int wake_address(volatile int *addr, uint count);
+
+__END_CDECLS
+
+#endif
@@ -30,8 +30,6 @@
 
 __BEGIN_CDECLS
 
-typedef uint32_t mp_cpu_mask_t;
-
 #define MP_CPU_ALL_BUT_LOCAL (UINT32_MAX)
 
 /* by default, mp_mbx_reschedule does not signal to cpus that are running realtime
@@ -42,8 +40,14 @@ typedef uint32_t mp_cpu_mask_t;
 typedef enum {
     MP_IPI_GENERIC,
     MP_IPI_RESCHEDULE,
+    MP_IPI_TLB_SHOOTDOWN,
 } mp_ipi_t;
 
+struct arch_aspace;
+
+/* a share of early boot work, index is in [0, count) */
+typedef void (*mp_early_func)(void *arg, uint index, uint count);
+
 #ifdef WITH_SMP
 void mp_init(void);
 
@@ -53,6 +57,34 @@ void mp_set_curr_cpu_active(bool active);
 /* called from arch code during reschedule irq */
 enum handler_return mp_mbx_reschedule_irq(void);
 
+/* make every other active cpu drop its tlb entries for count pages at vaddr in aspace,
+ * after the local cpu has unmapped and invalidated them. requests from concurrent callers
+ * are batched into one ipi per cpu. blocks until all cpus are done, so must be called from
+ * thread context with interrupts enabled. a no-op where the arch broadcasts tlb maintenance
+ * in hardware (ARCH_MMU_TLB_BROADCAST).
+ */
+void mp_tlb_shootdown(struct arch_aspace *aspace, vaddr_t vaddr, uint count);
+
+/* called from arch code during tlb shootdown irq */
+enum handler_return mp_mbx_tlb_shootdown_irq(void);
+
+/*
+ * Early boot work sharing, for before the scheduler is running. Secondary cpus the arch
+ * has started early wait for their release in mp_early_park() rather than spinning idle,
+ * and the boot cpu can split work with them through mp_early_run(). Parked cpus run the
+ * work on their boot stacks with interrupts off, so it must not block, allocate or use
+ * any thread state.
+ */
+
+/* called by a secondary cpu in early bring-up. returns once release is unlocked */
+void mp_early_park(spin_lock_t *release);
+
+/* wait, for a bounded time, until count secondary cpus are parked. returns how many are */
+uint mp_early_wait_parked(uint count);
+
+/* run func on the boot cpu and every parked cpu, returning when all are done */
+void mp_early_run(mp_early_func func, void *arg);
+
 /* global mp state to track what the cpus are up to */
 struct mp_state {
     volatile mp_cpu_mask_t active_cpus;
@@ -111,6 +143,9 @@ static inline void mp_set_curr_cpu_active(bool active) {}
 
 static inline enum handler_return mp_mbx_reschedule_irq(void) { return 0; }
 
+static inline void mp_tlb_shootdown(struct arch_aspace *aspace, vaddr_t vaddr, uint count) {}
+static inline enum handler_return mp_mbx_tlb_shootdown_irq(void) { return 0; }
+
 // only one cpu exists in UP and if you're calling these functions, it's active...
 static inline int mp_is_cpu_active(uint cpu) { return 1; }
 static inline int mp_is_cpu_idle(uint cpu) { return (get_current_thread()->flags & THREAD_FLAG_IDLE) != 0; }
@@ -124,6 +159,9 @@ static inline void mp_set_cpu_realtime(uint cpu) {}
 static inline void mp_set_cpu_non_realtime(uint cpu) {}
 
 static inline mp_cpu_mask_t mp_get_realtime_mask(void) { return 0; }
+
+static inline uint mp_early_wait_parked(uint count) { return 0; }
+static inline void mp_early_run(mp_early_func func, void *arg) { func(arg, 0, 1); }
 #endif
 
 __END_CDECLS
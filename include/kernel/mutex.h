@@ -36,8 +36,17 @@ __BEGIN_CDECLS
 typedef struct mutex {
     uint32_t magic;
     thread_t *holder;
-    int count;
+    int count;                  /* holder + waiters, cas 0 <-> 1 when uncontended */
     wait_queue_t wait;
+
+    /* priority inheritance */
+    struct list_node held_node; /* in the holder's held_mutexes list while contended */
+    lk_bigtime_t boost_start;   /* when the holder was first boosted, 0 if it isn't */
+    int boost_priority;         /* highest priority the holder was boosted to */
+
+#if MUTEX_STATS
+    lk_bigtime_t stats_acquire_time; /* when the holder got it, for kernel/lockstat.c */
+#endif
 } mutex_t;
 
 #define MUTEX_INITIAL_VALUE(m) \
@@ -46,11 +55,23 @@ typedef struct mutex {
     .holder = NULL, \
     .count = 0, \
     .wait = WAIT_QUEUE_INITIAL_VALUE((m).wait), \
+    .held_node = LIST_INITIAL_CLEARED_VALUE, \
+    .boost_start = 0, \
+    .boost_priority = -1, \
+    MUTEX_STATS_INITIAL_VALUE \
 }
 
+#if MUTEX_STATS
+#define MUTEX_STATS_INITIAL_VALUE .stats_acquire_time = 0,
+#else
+#define MUTEX_STATS_INITIAL_VALUE
+#endif
+
 /* Rules for Mutexes:
  * - Mutexes are only safe to use from thread context.
  * - Mutexes are non-recursive.
+ * - A thread holding a mutex runs at least at the priority of the highest
+ *   priority thread waiting for it (priority inheritance).
 */
 
 void mutex_init(mutex_t *);
@@ -63,6 +84,20 @@ static inline status_t mutex_acquire(mutex_t *m)
     return mutex_acquire_timeout(m, INFINITE_TIME);
 }
 
+/* Priority inversion tracing: if set, called with the thread lock held each
+ * time a holder that had been boosted releases the mutex, with the priority
+ * it was boosted to and how long, in microseconds, it held the mutex boosted.
+ */
+typedef void (*mutex_pi_trace_hook_t)(const mutex_t *m, const thread_t *holder,
+                                      int boost_priority, lk_bigtime_t duration);
+void mutex_set_pi_trace_hook(mutex_pi_trace_hook_t hook);
+
+#if MUTEX_STATS
+/* per mutex wait and hold time accounting, see kernel/lockstat.c */
+void mutex_stats_acquired(mutex_t *m, bool contended, lk_bigtime_t wait, void *site);
+void mutex_stats_released(mutex_t *m);
+#endif
+
 /* does the current thread hold the mutex? */
 static bool is_mutex_held(mutex_t *m)
 {
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <arch/defines.h>
+#include <arch/ops.h>
+
+/*
+ * Per cpu variables.
+ *
+ * A per cpu variable has one copy for each of the SMP_MAX_CPUS cpus. Every copy
+ * starts on a cache line of its own and is padded out to a whole number of
+ * lines, so a cpu updating its copy never bounces a line another cpu is using.
+ * All of them live together in .bss.percpu, away from other hot data, and start
+ * out zeroed.
+ *
+ * A variable used from more than one file is declared in a header and defined
+ * once:
+ *
+ *   DECLARE_PERCPU(struct foo_stats, foo_stats);   // foo.h
+ *   DEFINE_PERCPU(foo_stats);                      // foo.c
+ *
+ * and one private to a file is defined with DEFINE_PERCPU_STATIC(type, name).
+ *
+ * this_cpu_ptr() is only stable while the caller can't migrate, ie with
+ * interrupts disabled, holding a spinlock or pinned to the cpu.
+ */
+
+#define __PERCPU_SLOT(type, name) \
+    struct __percpu_slot_##name { type val; } __CPU_ALIGN
+
+#define __PERCPU_ARRAY(name) \
+    __SECTION(".bss.percpu") struct __percpu_slot_##name __percpu_##name[SMP_MAX_CPUS]
+
+#define DECLARE_PERCPU(type, name) \
+    __PERCPU_SLOT(type, name); \
+    extern struct __percpu_slot_##name __percpu_##name[SMP_MAX_CPUS]
+
+#define DEFINE_PERCPU(name) __PERCPU_ARRAY(name)
+
+#define DEFINE_PERCPU_STATIC(type, name) \
+    __PERCPU_SLOT(type, name); \
+    static __PERCPU_ARRAY(name)
+
+/* a pointer to cpu's copy of name */
+#define percpu_ptr(name, cpu) (&__percpu_##name[(cpu)].val)
+
+/* the current cpu's copy of name */
+#define this_cpu_ptr(name) percpu_ptr(name, arch_curr_cpu_num())
+#define this_cpu(name) (*this_cpu_ptr(name))
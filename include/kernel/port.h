@@ -51,6 +51,9 @@ typedef enum {
     PORT_MODE_BROADCAST   = 0,
     PORT_MODE_UNICAST     = 1,
     PORT_MODE_BIG_BUFFER  = 2,
+    /* unicast only: the caller promises writes never race each other, which
+     * lets them skip the thread lock, e.g. a single irq handler producing. */
+    PORT_MODE_SINGLE_WRITER = 4,
 } port_mode_t;
 
 /* Inits the port subsystem
@@ -92,6 +95,13 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count);
  */
 status_t port_read(port_t port, lk_time_t timeout, port_result_t *result);
 
+/* Read up to |count| packets from the port or port group, blocking until at
+ * least one is available like port_read(). |read_count| returns how many
+ * packets were stored in |results|.
+ */
+status_t port_read_batch(port_t port, lk_time_t timeout, port_result_t *results, size_t count,
+                         size_t *read_count);
+
 /* Destroy the write-side port, flush queued packets and release all resources,
  * all calls will now fail on that port. Only a closed port can be destroyed.
  */
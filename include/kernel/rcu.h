@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <list.h>
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Read-copy-update for read mostly data.
+ *
+ * Readers run between rcu_read_lock() and rcu_read_unlock() without taking any
+ * lock. Read sections run with interrupts disabled, so they must be short and
+ * may not block, but they work from interrupt context too. Updaters serialize
+ * among themselves with a lock of their own. Once an object is unlinked, its
+ * memory is handed to call_rcu(), or reclaimed after synchronize_rcu(). Either
+ * one waits out every read section that might still see the object.
+ *
+ * A cpu passes a quiescent state each time it reschedules, and when it takes a
+ * reschedule ipi, since neither can happen inside a read section. A grace
+ * period ends once every active cpu has passed one. Cpus that don't pass one
+ * on their own soon enough are sent a reschedule ipi.
+ */
+
+typedef spin_lock_saved_state_t rcu_read_state_t;
+
+#define rcu_read_lock(state) arch_interrupt_save(&(state), SPIN_LOCK_FLAG_INTERRUPTS)
+#define rcu_read_unlock(state) arch_interrupt_restore((state), SPIN_LOCK_FLAG_INTERRUPTS)
+
+/* publish and pick up pointers to rcu protected objects */
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+
+struct rcu_head;
+typedef void (*rcu_callback_t)(struct rcu_head *head);
+
+/* embedded in objects freed through call_rcu() */
+struct rcu_head {
+    struct list_node node;
+    rcu_callback_t func;
+};
+
+/*
+ * Call func(head) from the rcu thread once a grace period has passed. May be
+ * called from interrupt context.
+ */
+void call_rcu(struct rcu_head *head, rcu_callback_t func);
+
+/* block until every read section running at the time of the call has ended */
+void synchronize_rcu(void);
+
+/* called by the scheduler and the reschedule ipi, the cpu is not in a read section */
+#if WITH_SMP
+void rcu_note_quiescent(void);
+#else
+static inline void rcu_note_quiescent(void) {}
+#endif
+
+/*
+ * List operations that readers can run concurrently with. Insertion and removal
+ * still need the updater's lock. A removed entry keeps its next pointer, so a
+ * reader standing on it finds its way back to the list. The entry may not be
+ * reused or freed until a grace period has passed.
+ */
+static inline void rcu_list_add_head(struct list_node *list, struct list_node *item)
+{
+    item->next = list->next;
+    item->prev = list;
+    list->next->prev = item;
+    rcu_assign_pointer(list->next, item);
+}
+
+static inline void rcu_list_add_tail(struct list_node *list, struct list_node *item)
+{
+    item->prev = list->prev;
+    item->next = list;
+    rcu_assign_pointer(list->prev->next, item);
+    list->prev = item;
+}
+
+static inline void rcu_list_delete(struct list_node *item)
+{
+    item->next->prev = item->prev;
+    __atomic_store_n(&item->prev->next, item->next, __ATOMIC_RELAXED);
+    item->prev = 0;
+}
+
+#define rcu_list_for_every_entry(list, entry, type, member) \
+    for ((entry) = containerof(rcu_dereference((list)->next), type, member); \
+         &(entry)->member != (list); \
+         (entry) = containerof(rcu_dereference((entry)->member.next), type, member))
+
+__END_CDECLS
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2008-2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KERNEL_RWLOCK_H
+#define __KERNEL_RWLOCK_H
+
+#include <compiler.h>
+#include <debug.h>
+#include <stdint.h>
+#include <kernel/thread.h>
+
+__BEGIN_CDECLS
+
+#define RWLOCK_MAGIC (0x72776C6B)  // 'rwlk'
+
+typedef struct rwlock {
+    uint32_t magic;
+    int count;              /* > 0: number of readers, -1: held by a writer, 0: free */
+    thread_t *writer;
+    int waiting_readers;
+    int waiting_writers;
+    wait_queue_t reader_wait;
+    wait_queue_t writer_wait;
+} rwlock_t;
+
+#define RWLOCK_INITIAL_VALUE(l) \
+{ \
+    .magic = RWLOCK_MAGIC, \
+    .count = 0, \
+    .writer = NULL, \
+    .waiting_readers = 0, \
+    .waiting_writers = 0, \
+    .reader_wait = WAIT_QUEUE_INITIAL_VALUE((l).reader_wait), \
+    .writer_wait = WAIT_QUEUE_INITIAL_VALUE((l).writer_wait), \
+}
+
+/* Rules for reader-writer locks:
+ * - Only safe to use from thread context.
+ * - Non-recursive, in either mode.
+ * - Writer preferring: once a writer is waiting, new readers block behind it.
+ *   When a writer releases, all readers that queued up behind it are let in
+ *   together before the next writer.
+ */
+
+void rwlock_init(rwlock_t *);
+void rwlock_destroy(rwlock_t *);
+status_t rwlock_acquire_read_timeout(rwlock_t *, lk_time_t);
+status_t rwlock_release_read(rwlock_t *);
+status_t rwlock_acquire_write_timeout(rwlock_t *, lk_time_t);
+status_t rwlock_release_write(rwlock_t *);
+
+static inline status_t rwlock_acquire_read(rwlock_t *l)
+{
+    return rwlock_acquire_read_timeout(l, INFINITE_TIME);
+}
+
+static inline status_t rwlock_acquire_write(rwlock_t *l)
+{
+    return rwlock_acquire_write_timeout(l, INFINITE_TIME);
+}
+
+/* does the current thread hold the lock for writing? */
+static inline bool is_rwlock_write_held(rwlock_t *l)
+{
+    return l->writer == get_current_thread();
+}
+
+__END_CDECLS
+#endif
+
@@ -27,6 +27,35 @@
 
 __BEGIN_CDECLS
 
+#if SPINLOCK_STATS
+/* per lock wait and hold time accounting, see kernel/lockstat.c */
+void spinlock_stats_acquired(spin_lock_t *lock, uint32_t wait_cycles);
+void spinlock_stats_released(spin_lock_t *lock);
+
+/* interrupts should already be disabled */
+static inline void spin_lock(spin_lock_t *lock)
+{
+    uint32_t start = arch_cycle_count();
+    arch_spin_lock(lock);
+    spinlock_stats_acquired(lock, arch_cycle_count() - start);
+}
+
+/* Returns 0 on success, non-0 on failure */
+static inline int spin_trylock(spin_lock_t *lock)
+{
+    int ret = arch_spin_trylock(lock);
+    if (ret == 0)
+        spinlock_stats_acquired(lock, 0);
+    return ret;
+}
+
+/* interrupts should already be disabled */
+static inline void spin_unlock(spin_lock_t *lock)
+{
+    spinlock_stats_released(lock);
+    arch_spin_unlock(lock);
+}
+#else
 /* interrupts should already be disabled */
 static inline void spin_lock(spin_lock_t *lock)
 {
@@ -44,6 +73,7 @@ static inline void spin_unlock(spin_lock_t *lock)
 {
     arch_spin_unlock(lock);
 }
+#endif
 
 static inline void spin_lock_init(spin_lock_t *lock)
 {
@@ -29,8 +29,10 @@
 #include <arch/defines.h>
 #include <arch/ops.h>
 #include <arch/thread.h>
+#include <kernel/percpu.h>
 #include <kernel/wait.h>
 #include <kernel/spinlock.h>
+#include <kernel/timer.h>
 #include <debug.h>
 
 #if WITH_KERNEL_VM
@@ -61,6 +63,11 @@ enum thread_state {
 
 typedef int (*thread_start_routine)(void *arg);
 
+/* bitmap of cpus, bit n set for cpu n */
+typedef uint32_t mp_cpu_mask_t;
+
+#define THREAD_CPU_MASK_ALL (UINT32_MAX)
+
 /* thread local storage */
 enum thread_tls_list {
 #ifdef WITH_LIB_UTHREAD
@@ -78,22 +85,61 @@ enum thread_tls_list {
 #define THREAD_FLAG_REAL_TIME                 (1<<3)
 #define THREAD_FLAG_IDLE                      (1<<4)
 #define THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK  (1<<5)
+#define THREAD_FLAG_KSTACK                    (1<<6)
 
 #define THREAD_MAGIC (0x74687264) // 'thrd'
 
+#if KERNEL_DEADLINE
+/* deadline scheduling parameters, in usecs. see thread_set_deadline() */
+struct thread_deadline_params {
+    lk_bigtime_t runtime;   /* cpu time guaranteed every period */
+    lk_bigtime_t period;
+    lk_bigtime_t deadline;  /* how long into each period the runtime is delivered by, 0 for period */
+};
+
+struct thread_deadline_stats {
+    uint jobs;                  /* periods finished with thread_deadline_wait() */
+    uint overruns;              /* periods it used up its runtime and got throttled */
+    uint misses;                /* deadlines that passed with the period's work unfinished */
+    lk_bigtime_t max_runtime;   /* most cpu time used between two thread_deadline_wait() */
+};
+
+/* per thread deadline scheduling state */
+struct thread_deadline {
+    lk_bigtime_t runtime;       /* 0 if not a deadline thread */
+    lk_bigtime_t period;
+    lk_bigtime_t deadline;
+    uint32_t util;              /* runtime / deadline, parts per million */
+    int cpu;                    /* the cpu it was admitted on and runs on */
+
+    lk_bigtime_t release;       /* start of the current period */
+    lk_bigtime_t abs_deadline;  /* when the current period's runtime is due */
+    int64_t budget;             /* runtime left in the current period */
+    lk_bigtime_t slice_start;   /* when it last got the cpu */
+    lk_bigtime_t job_runtime;   /* cpu time since the last thread_deadline_wait() */
+    timer_t timer;              /* makes it ready at the next release */
+
+    struct thread_deadline_stats stats;
+};
+#endif
+
 typedef struct thread {
     int magic;
     struct list_node thread_list_node;
 
     /* active bits */
     struct list_node queue_node;
-    int priority;
+    int priority; /* effective priority, base_priority raised by inheritance */
+    int base_priority;
+    int inherited_priority; /* -1 if not inheriting */
     enum thread_state state;
     int remaining_quantum;
     unsigned int flags;
 #if WITH_SMP
     int curr_cpu;
     int pinned_cpu; /* only run on pinned_cpu if >= 0 */
+    int last_cpu; /* cpu it last ran on, -1 if it has never run */
+    mp_cpu_mask_t cpu_mask; /* cpus it may run on when not pinned */
 #endif
 #if WITH_KERNEL_VM
     vmm_aspace_t *aspace;
@@ -103,6 +149,10 @@ typedef struct thread {
     struct wait_queue *blocking_wait_queue;
     status_t wait_queue_block_ret;
 
+    /* mutexes held, and the one being waited on, for priority inheritance */
+    struct list_node held_mutexes;
+    struct mutex *blocking_mutex;
+
     /* architecture stuff */
     struct arch_thread arch;
 
@@ -121,6 +171,17 @@ typedef struct thread {
     /* thread local storage */
     uintptr_t tls[MAX_TLS_ENTRY];
 
+#if KERNEL_DEADLINE
+    struct thread_deadline dl;
+#endif
+
+#if THREAD_STATS
+    /* scheduler accounting, in current_time_hires() usecs */
+    lk_bigtime_t ready_time; /* when it was last put in a run queue */
+    lk_bigtime_t run_start; /* when it last got a cpu */
+    lk_bigtime_t runtime; /* total time spent running */
+#endif
+
     char name[32];
 } thread_t;
 
@@ -129,11 +190,17 @@ typedef struct thread {
 #define thread_pinned_cpu(t) ((t)->pinned_cpu)
 #define thread_set_curr_cpu(t,c) ((t)->curr_cpu = (c))
 #define thread_set_pinned_cpu(t, c) ((t)->pinned_cpu = (c))
+#define thread_last_cpu(t) ((t)->last_cpu)
+#define thread_set_last_cpu(t, c) ((t)->last_cpu = (c))
+#define thread_cpu_mask(t) ((t)->cpu_mask)
 #else
 #define thread_curr_cpu(t) (0)
 #define thread_pinned_cpu(t) (-1)
 #define thread_set_curr_cpu(t,c) do {} while(0)
 #define thread_set_pinned_cpu(t, c) do {} while(0)
+#define thread_last_cpu(t) (0)
+#define thread_set_last_cpu(t, c) do {} while(0)
+#define thread_cpu_mask(t) (THREAD_CPU_MASK_ALL)
 #endif
 
 /* thread priority */
@@ -161,6 +228,7 @@ void thread_secondary_cpu_init_early(void);
 void thread_secondary_cpu_entry(void) __NO_RETURN;
 void thread_set_name(const char *name);
 void thread_set_priority(int priority);
+void thread_set_inherited_priority(thread_t *t, int priority);
 thread_t *thread_create(const char *name, thread_start_routine entry, void *arg, int priority, size_t stack_size);
 thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine entry, void *arg, int priority, void *stack, size_t stack_size);
 status_t thread_resume(thread_t *);
@@ -170,17 +238,56 @@ status_t thread_detach(thread_t *t);
 status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout);
 status_t thread_detach_and_resume(thread_t *t);
 status_t thread_set_real_time(thread_t *t);
+status_t thread_set_cpu_mask(thread_t *t, mp_cpu_mask_t mask);
+
+#if KERNEL_DEADLINE
+/*
+ * Earliest deadline first scheduling. A deadline thread is guaranteed
+ * params->runtime of cpu time within params->deadline of the start of every
+ * period, and runs ahead of every priority level, earliest deadline first.
+ * Admission control places it on the least loaded cpu it may run on whose
+ * deadline threads, this one included, have a total runtime / deadline of at
+ * most THREAD_DEADLINE_MAX_UTIL, and it stays there. The runtime is enforced:
+ * a thread that uses up its budget before calling thread_deadline_wait() is
+ * throttled until its next period. Budgets are enforced and periods released
+ * at kernel timer granularity.
+ *
+ * Only the current thread or a thread that has not been resumed yet may be
+ * changed. A NULL params or a zero runtime turns it back into a normal thread.
+ * Returns ERR_INVALID_ARGS unless runtime <= deadline <= period, ERR_BAD_STATE
+ * if t can't be changed now and ERR_NO_RESOURCES if no cpu has room for it.
+ */
+status_t thread_set_deadline(thread_t *t, const struct thread_deadline_params *params);
+
+/* done with this period's work, sleep until the next period starts */
+status_t thread_deadline_wait(void);
+
+status_t thread_get_deadline_stats(thread_t *t, struct thread_deadline_stats *stats);
+#endif
 
 void dump_thread(thread_t *t);
 void arch_dump_thread(thread_t *t);
 void dump_all_threads(void);
 
+/* copy out the name of t if it is still a live thread, t may be stale */
+bool thread_lookup_name(const void *t, char *name, size_t len);
+
 /* scheduler routines */
 void thread_yield(void); /* give up the cpu voluntarily */
 void thread_preempt(void); /* get preempted (inserted into head of run queue) */
 void thread_block(void); /* block on something and reschedule */
 void thread_unblock(thread_t *t, bool resched); /* go back in the run queue */
 
+/*
+ * Batch the wakeups made between begin and end on this cpu, typically by one
+ * interrupt handler: every other cpu that needs to look at its run queue gets
+ * at most one reschedule ipi, sent from thread_wake_batch_end(), which also
+ * returns INT_RESCHEDULE if a thread woken in the batch should preempt the
+ * current one. Batches nest. Interrupts must stay disabled throughout.
+ */
+void thread_wake_batch_begin(void);
+enum handler_return thread_wake_batch_end(void);
+
 #ifdef WITH_LIB_UTHREAD
 void uthread_context_switch(thread_t *oldthread, thread_t *newthread);
 #endif
@@ -197,7 +304,13 @@ void set_current_thread(thread_t *);
 extern spin_lock_t thread_lock;
 
 #define THREAD_LOCK(state) spin_lock_saved_state_t state; spin_lock_irqsave(&thread_lock, state)
+#if WITH_SMP
+/* reschedule ipis for threads woken while holding the lock go out as it is dropped */
+void thread_flush_wakeups(void);
+#define THREAD_UNLOCK(state) do { thread_flush_wakeups(); spin_unlock_irqrestore(&thread_lock, state); } while (0)
+#else
 #define THREAD_UNLOCK(state) spin_unlock_irqrestore(&thread_lock, state)
+#endif
 
 static inline bool thread_lock_held(void)
 {
@@ -238,12 +351,40 @@ struct thread_stats {
 
 #if WITH_SMP
     ulong reschedule_ipis;
+    ulong reschedule_ipis_sent; /* counted per target cpu */
+    ulong steals; /* threads pulled from another cpu's run queue */
+    ulong tlb_shootdown_ipis;
 #endif
 };
 
-extern struct thread_stats thread_stats[SMP_MAX_CPUS];
+DECLARE_PERCPU(struct thread_stats, thread_stats);
+
+/* log2 histograms per cpu and priority of how long threads sat in the run queue
+ * before getting the cpu, and of how long they ran once they had it. bucket 0
+ * counts durations under 1 usec, bucket n those of [2^(n-1), 2^n) usecs and the
+ * last one everything longer. */
+#define THREAD_STATS_HIST_BUCKETS 16
+
+struct thread_sched_hist {
+    uint32_t wait[NUM_PRIORITIES][THREAD_STATS_HIST_BUCKETS];
+    uint32_t run[NUM_PRIORITIES][THREAD_STATS_HIST_BUCKETS];
+};
+
+DECLARE_PERCPU(struct thread_sched_hist, thread_sched_hist);
+
+void thread_sched_hist_reset(void);
+
+struct thread_runtime {
+    const thread_t *t; /* for matching up snapshots only, may be gone by the time it is read */
+    lk_bigtime_t runtime;
+    int priority;
+    char name[32];
+};
+
+/* copy out up to count threads' cpu time so far, returns the number of threads */
+size_t thread_get_runtimes(struct thread_runtime *buf, size_t count);
 
-#define THREAD_STATS_INC(name) do { thread_stats[arch_curr_cpu_num()].name++; } while(0)
+#define THREAD_STATS_INC(name) do { this_cpu(thread_stats).name++; } while(0)
 
 #else
 
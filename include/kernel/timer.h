@@ -42,6 +42,7 @@ typedef struct timer {
 
     lk_time_t scheduled_time;
     lk_time_t periodic_time;
+    lk_time_t slack; /* how late it may fire to share an interrupt */
 
     timer_callback callback;
     void *arg;
@@ -53,6 +54,7 @@ typedef struct timer {
     .node = LIST_INITIAL_CLEARED_VALUE, \
     .scheduled_time = 0, \
     .periodic_time = 0, \
+    .slack = 0, \
     .callback = NULL, \
     .arg = NULL, \
 }
@@ -65,9 +67,12 @@ typedef struct timer {
 */
 void timer_initialize(timer_t *);
 void timer_set_oneshot(timer_t *, lk_time_t delay, timer_callback, void *arg);
+void timer_set_oneshot_etc(timer_t *, lk_time_t delay, lk_time_t slack, timer_callback, void *arg);
 void timer_set_periodic(timer_t *, lk_time_t period, timer_callback, void *arg);
 void timer_cancel(timer_t *);
 
+bool timer_get_next_deadline(lk_time_t *deadline);
+
 __END_CDECLS
 
 #endif
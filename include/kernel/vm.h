@@ -83,10 +83,12 @@ typedef struct vm_page {
     struct list_node node;
 
     uint flags : 8;
-    uint ref : 24;
+    uint order : 5; /* size of the free block this page heads, see VM_PAGE_FLAG_BUDDY_HEAD */
+    uint ref : 19;
 } vm_page_t;
 
 #define VM_PAGE_FLAG_NONFREE  (0x1)
+#define VM_PAGE_FLAG_BUDDY_HEAD (0x2) /* first page of a free block of 2^order pages */
 
 /* kernel address space */
 #ifndef KERNEL_ASPACE_BASE
@@ -119,6 +121,13 @@ static inline bool is_user_address(vaddr_t va)
 }
 
 /* physical allocator */
+
+/* free pages in an arena are kept in naturally aligned blocks of 2^order pages,
+ * one free list per order, up to blocks of 2^(PMM_MAX_ORDER - 1) pages */
+#ifndef PMM_MAX_ORDER
+#define PMM_MAX_ORDER 20
+#endif
+
 typedef struct pmm_arena {
     struct list_node node;
     const char *name;
@@ -126,18 +135,26 @@ typedef struct pmm_arena {
     uint flags;
     uint priority;
 
+    /* cpus this memory is close to, allocations made on them try it before any other arena.
+     * 0 if the memory is equally far from every cpu. */
+    uint32_t cpu_mask;
+
     paddr_t base;
     size_t  size;
 
     size_t free_count;
+    size_t init_count;  /* pages at the start of the arena known to the allocator, see pmm_add_arena */
 
     struct vm_page *page_array;
-    struct list_node free_list;
+    struct list_node free_lists[PMM_MAX_ORDER];
 } pmm_arena_t;
 
 #define PMM_ARENA_FLAG_KMAP (0x1) /* this arena is already mapped and useful for kallocs */
 
-/* Add a pre-filled memory arena to the physical allocator. */
+/* Add a pre-filled memory arena to the physical allocator. Arenas are searched by
+ * locality to the allocating cpu (see cpu_mask), then in order of priority.
+ * Only the first PMM_EAGER_INIT_PAGES pages are set up right away, the rest is brought
+ * in on demand and by a background thread once threading is up. */
 status_t pmm_add_arena(pmm_arena_t *arena) __NONNULL((1));
 
 /* Allocate count pages of physical memory, adding to the tail of the passed list.
@@ -146,6 +163,12 @@ status_t pmm_add_arena(pmm_arena_t *arena) __NONNULL((1));
  */
 size_t pmm_alloc_pages(uint count, struct list_node *list) __NONNULL((2));
 
+/* Allocate a single page out of an arena marked as KMAP. Usually served out of a
+ * per cpu cache of pages without taking the pmm lock.
+ * Returns NULL if out of memory.
+ */
+vm_page_t *pmm_alloc_page(void);
+
 /* Allocate a specific range of physical pages, adding to the tail of the passed list.
  * The list must be initialized.
  * Returns the number of pages allocated.
@@ -202,16 +225,42 @@ typedef struct vmm_aspace {
     size_t  size;
 
     struct list_node region_list;
+    struct vmm_region *region_tree;
 
     arch_aspace_t arch_aspace;
 } vmm_aspace_t;
 
 #define VMM_ASPACE_FLAG_KERNEL 0x1
 
+/* supplies the contents of the pages of a region made with vmm_alloc_pager() as they are touched */
+typedef struct vmm_pager {
+    /* fill the page at offset into the region, through a kernel mapping of it.
+     * called without any vmm locks held, may block. */
+    status_t (*fill)(struct vmm_pager *pager, size_t offset, void *page);
+    /* optional. return a page the pager keeps itself holding the contents at offset, to be
+     * mapped read only instead of filling a copy; writing to it gives the region a private
+     * copy. The page must stay valid until release. Any error has the page filled instead.
+     * called without any vmm locks held, may block. */
+    status_t (*lookup)(struct vmm_pager *pager, size_t offset, paddr_t *pa);
+    /* the region is gone and no fills are running anymore */
+    void (*release)(struct vmm_pager *pager);
+
+    // Private:
+    uint refs;
+} vmm_pager_t;
+
 typedef struct vmm_region {
     struct list_node node;
     char name[32];
 
+    /* balanced tree of the aspace's regions by base address */
+    struct vmm_region *tree_parent;
+    struct vmm_region *tree_left;
+    struct vmm_region *tree_right;
+    int tree_height;
+    size_t gap;     /* free space between this region and the previous one */
+    size_t max_gap; /* largest gap in this subtree */
+
     uint flags;
     uint arch_mmu_flags;
 
@@ -219,10 +268,21 @@ typedef struct vmm_region {
     size_t  size;
 
     struct list_node page_list;
+    size_t committed; /* pages allocated to back the region */
+
+    /* pages shared copy-on-write with clones of the region, NULL if never cloned */
+    struct vmm_cow_object *cow;
+
+    /* fills in pages of a VMM_REGION_FLAG_PAGER region */
+    vmm_pager_t *pager;
 } vmm_region_t;
 
 #define VMM_REGION_FLAG_RESERVED 0x1
 #define VMM_REGION_FLAG_PHYSICAL 0x2
+#define VMM_REGION_FLAG_LAZY     0x4 /* pages are allocated on first touch */
+#define VMM_REGION_FLAG_ZERO     0x8 /* pages are zeroed before they are mapped */
+#define VMM_REGION_FLAG_COW      0x10 /* shares pages with another region until written */
+#define VMM_REGION_FLAG_PAGER    0x20 /* lazy pages are filled in by a pager */
 
 /* grab a handle to the kernel address space */
 extern vmm_aspace_t _kernel_aspace;
@@ -251,11 +311,51 @@ __NONNULL((1));
 status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **ptr, uint8_t align_log2, uint vmm_flags, uint arch_mmu_flags)
 __NONNULL((1));
 
+/* allocate a region whose pages are allocated on first touch and filled in by pager. The pages
+ * belong to the region, anything written to them is simply dropped with it. On success the
+ * region owns the pager and calls its release routine once it is freed. */
+status_t vmm_alloc_pager(vmm_aspace_t *aspace, const char *name, size_t size, void **ptr, uint8_t align_log2,
+                         vmm_pager_t *pager, uint vmm_flags, uint arch_mmu_flags)
+__NONNULL((1, 6));
+
+/* create a copy of the region at src_vaddr in src_aspace. the pages are shared between the
+ * two, read only, and copied by the page fault handler when either side writes to one. */
+status_t vmm_clone_region(vmm_aspace_t *aspace, const char *name, vmm_aspace_t *src_aspace,
+                          vaddr_t src_vaddr, void **ptr, uint8_t align_log2, uint vmm_flags)
+__NONNULL((1, 3));
+
+/* Allocate and free kernel thread stacks. Each stack is mapped with a guard page below it,
+ * freed stacks of the default size are kept for reuse. */
+void *vmm_alloc_kstack(size_t size);
+void vmm_free_kstack(void *stack, size_t size);
+
 /* Unmap previously allocated region and free physical memory pages backing it (if any) */
 status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t va);
 
 /* For the above region creation routines. Allocate virtual space at the passed in pointer. */
 #define VMM_FLAG_VALLOC_SPECIFIC 0x1
+/* For vmm_alloc. Do not allocate any pages up front, back the region a page at a time
+ * from the page fault handler as it is touched. Reads of untouched pages of a zero filled
+ * region are served from a shared zero page. */
+#define VMM_FLAG_COMMIT_LAZY     0x2
+/* For vmm_alloc and vmm_alloc_contiguous. Zero the pages before mapping them. */
+#define VMM_FLAG_ZERO_FILL       0x4
+/* For vmm_alloc. Put an unmapped page right below the allocation, so running off the
+ * bottom of it faults. The returned pointer is the first mapped page. */
+#define VMM_FLAG_GUARD_PAGE      0x8
+
+/* Try to resolve a page fault at addr by committing a page to a lazily allocated region,
+ * filling it in from the region's pager if it has one, or by breaking the sharing of a
+ * copy-on-write or zero page that was written to.
+ * Called by the arch fault handlers with interrupts enabled, from thread context.
+ * Returns NO_ERROR if the faulting access can be retried.
+ */
+status_t vmm_page_fault_handler(vaddr_t addr, uint pf_flags);
+
+#define VMM_PF_FLAG_WRITE       0x1
+#define VMM_PF_FLAG_USER        0x2
+#define VMM_PF_FLAG_INSTRUCTION 0x4
+#define VMM_PF_FLAG_NOT_PRESENT 0x8
 
 /* allocate a new address space */
 status_t vmm_create_aspace(vmm_aspace_t **aspace, const char *name, uint flags)
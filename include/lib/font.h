@@ -33,6 +33,13 @@ __BEGIN_CDECLS
 
 void font_draw_char(gfx_surface *surface, unsigned char c, int x, int y, uint32_t color);
 
+// pre-render every glyph in the given colors, as one surface in the given
+// format with the glyphs stacked top to bottom. free with gfx_surface_destroy().
+gfx_surface *font_render_glyphs(gfx_format format, uint32_t color, uint32_t back_color);
+
+// draw a character cell out of font_render_glyphs()' output, without flushing
+void font_draw_char_cached(gfx_surface *surface, gfx_surface *glyphs, unsigned char c, int x, int y);
+
 __END_CDECLS
 
 #endif
@@ -54,6 +54,10 @@ typedef enum {
  * to.  Elements include a pointer to the actual pixel memory, its size, its
  * layout, and pointers to basic drawing functions.
  *
+ * A double buffered surface draws into ptr and presents it with
+ * gfx_swap_buffers(), either by page flipping between ptr and front_ptr or,
+ * when the display can't flip, by copying the dirty area over to front_ptr.
+ *
  * @ingroup graphics
  */
 typedef struct gfx_surface {
@@ -73,6 +77,15 @@ typedef struct gfx_surface {
     void (*fillrect)(struct gfx_surface *, uint x, uint y, uint width, uint height, uint color);
     void (*putpixel)(struct gfx_surface *, uint x, uint y, uint color);
     void (*flush)(uint starty, uint endy);
+    void (*flush_rect)(uint x, uint y, uint width, uint height);
+
+    // area drawn to since the last flush, empty when dirty_x0 >= dirty_x1
+    uint dirty_x0, dirty_y0, dirty_x1, dirty_y1;
+
+    // double buffering: the buffer being displayed, NULL if single buffered,
+    // and the display's flip routine, NULL if ptr is copied to front_ptr instead
+    void *front_ptr;
+    status_t (*flip)(void *pixels);
 } gfx_surface;
 
 // copy a rect from x,y with width x height to x2, y2
@@ -87,22 +100,33 @@ void gfx_putpixel(gfx_surface *surface, uint x, uint y, uint color);
 // draw a single pixel line between x1,y1 and x2,y1
 void gfx_line(gfx_surface *surface, uint x1, uint y1, uint x2, uint y2, uint color);
 
+void gfx_flush(struct gfx_surface *surface);
+
 // clear the entire surface with a color
 static inline void gfx_clear(gfx_surface *surface, uint color)
 {
     surface->fillrect(surface, 0, 0, surface->width, surface->height, color);
 
-    if (surface->flush)
-        surface->flush(0, surface->height-1);
+    gfx_flush(surface);
 }
 
 // blend between two surfaces
 void gfx_surface_blend(struct gfx_surface *target, struct gfx_surface *source, uint destx, uint desty);
 
-void gfx_flush(struct gfx_surface *surface);
+// copy a rect of a surface into another surface of the same format
+void gfx_surface_blit(struct gfx_surface *target, struct gfx_surface *source, uint srcx, uint srcy,
+                      uint width, uint height, uint destx, uint desty);
 
 void gfx_flush_rows(struct gfx_surface *surface, uint start, uint end);
 
+// flush only what the gfx_ drawing routines have touched since the last flush
+void gfx_flush_dirty(struct gfx_surface *surface);
+
+// show what has been drawn to a double buffered surface, the same as
+// gfx_flush_dirty() for a single buffered one. the flush routines above
+// swap as well when used on a double buffered surface.
+void gfx_swap_buffers(struct gfx_surface *surface);
+
 // surface setup
 gfx_surface *gfx_create_surface(void *ptr, uint width, uint height, uint stride, gfx_format format);
 
@@ -110,6 +134,10 @@ gfx_surface *gfx_create_surface(void *ptr, uint width, uint height, uint stride,
 struct display_framebuffer;
 gfx_surface *gfx_create_surface_from_display(struct display_framebuffer *) __NONNULL((1));
 
+// same, but drawing goes to a back buffer in cached memory, or to the
+// display's second buffer if it can page flip
+gfx_surface *gfx_create_buffered_surface_from_display(struct display_framebuffer *) __NONNULL((1));
+
 // free the surface
 // optionally frees the buffer if the free bit is set
 void gfx_surface_destroy(struct gfx_surface *surface);
@@ -25,7 +25,9 @@
 
 #include <sys/types.h>
 
-/* examine and try to publish partitions on a particular device at a particular offset */
+/* examine and try to publish partitions on a particular device at a particular offset.
+ * understands mbr tables, and gpt tables behind a protective mbr at offset 0.
+ * partition n is published as <device>p<n>. returns the number published */
 int partition_publish(const char *device, off_t offset);
 
 /* remove any published subdevices on this device */
@@ -30,6 +30,8 @@
 #define SYSPARAM_ALLOW_WRITE 0
 #endif
 
+/* load the parameters stored at offset in bdev. if the device can be memory
+ * mapped the parameters are used where they sit, otherwise they are copied */
 status_t sysparam_scan(bdev_t *bdev, off_t offset, size_t len);
 status_t sysparam_reload(void);
 
@@ -37,6 +39,10 @@ void sysparam_dump(bool show_all);
 
 ssize_t sysparam_length(const char *name);
 ssize_t sysparam_read(const char *name, void *data, size_t len);
+
+/* get a pointer to the value without copying it. on a memory mapped device this
+ * points into the map. valid until the param is removed or the parameters are
+ * written or reloaded */
 status_t sysparam_get_ptr(const char *name, const void **ptr, size_t *len);
 
 #if SYSPARAM_ALLOW_WRITE
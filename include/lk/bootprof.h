@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <sys/types.h>
+#include <arch/ops.h>
+
+/*
+ * Boot time profiling. Init hooks, device inits, app inits and file system
+ * mounts are timed with the cpu cycle counter and kept in a small static
+ * table, shown with the 'bootprof' command and summarized at the end of
+ * bootstrap. Durations wrap at 2^32 cycles.
+ */
+
+#ifndef LK_BOOTPROF
+#define LK_BOOTPROF 1
+#endif
+
+__BEGIN_CDECLS
+
+enum bootprof_kind {
+    BOOTPROF_INIT_HOOK,
+    BOOTPROF_DEVICE,
+    BOOTPROF_APP,
+    BOOTPROF_MOUNT,
+};
+
+#if LK_BOOTPROF
+
+static inline uint32_t bootprof_start(void)
+{
+    return arch_cycle_count();
+}
+
+/* record an event that began at the bootprof_start() value start. the name
+ * is copied. level is the init level for init hooks and 0 otherwise. */
+void bootprof_record(enum bootprof_kind kind, const char *name, uint level, uint32_t start);
+
+/* print the compact end of boot summary */
+void bootprof_summary(void);
+
+#else
+
+static inline uint32_t bootprof_start(void) { return 0; }
+static inline void bootprof_record(enum bootprof_kind kind, const char *name, uint level, uint32_t start) {}
+static inline void bootprof_summary(void) {}
+
+#endif
+
+__END_CDECLS
@@ -55,10 +55,24 @@ enum lk_init_flags {
     LK_INIT_FLAG_ALL_CPUS        = LK_INIT_FLAG_PRIMARY_CPU | LK_INIT_FLAG_SECONDARY_CPUS,
     LK_INIT_FLAG_CPU_SUSPEND     = 0x4,
     LK_INIT_FLAG_CPU_RESUME      = 0x8,
+
+    /*
+     * Scheduling of primary cpu hooks from LK_INIT_LEVEL_THREADING on; earlier
+     * ones always run inline. An async hook runs in its own thread, in
+     * parallel with the other hooks of its level, and is finished before any
+     * hook of a later level starts, so the level is all a hook depends on.
+     * A deferred hook runs in a low priority thread that boot does not wait
+     * for, for probes nothing else needs right away.
+     */
+    LK_INIT_FLAG_ASYNC           = 0x10,
+    LK_INIT_FLAG_DEFERRED        = 0x20,
 };
 
 void lk_init_level(enum lk_init_flags flags, uint start_level, uint stop_level);
 
+/* wait for every deferred hook started so far to return */
+void lk_init_wait_deferred(void);
+
 static inline void lk_primary_cpu_init_level(uint start_level, uint stop_level)
 {
     lk_init_level(LK_INIT_FLAG_PRIMARY_CPU, start_level, stop_level);
@@ -86,3 +100,9 @@ struct lk_init_struct {
 
 #define LK_INIT_HOOK(_name, _hook, _level) \
     LK_INIT_HOOK_FLAGS(_name, _hook, _level, LK_INIT_FLAG_PRIMARY_CPU)
+
+#define LK_INIT_HOOK_ASYNC(_name, _hook, _level) \
+    LK_INIT_HOOK_FLAGS(_name, _hook, _level, LK_INIT_FLAG_PRIMARY_CPU | LK_INIT_FLAG_ASYNC)
+
+#define LK_INIT_HOOK_DEFERRED(_name, _hook, _level) \
+    LK_INIT_HOOK_FLAGS(_name, _hook, _level, LK_INIT_FLAG_PRIMARY_CPU | LK_INIT_FLAG_DEFERRED)
@@ -32,4 +32,12 @@ typedef enum handler_return (*int_handler)(void *arg);
 
 void register_int_handler(unsigned int vector, int_handler handler, void *arg);
 
+/* route vector to the cpus in cpu_mask, one bit per cpu. the interrupt
+ * controller may narrow the mask to the cpus it can reach. returns
+ * ERR_NOT_SUPPORTED where the platform has no way to steer interrupts. */
+status_t set_interrupt_affinity(unsigned int vector, uint cpu_mask);
+
+/* the cpus vector is routed to, 0 if the platform can't tell */
+uint get_interrupt_affinity(unsigned int vector);
+
 #endif
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/cpuidle.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <kernel/mp.h>
+#include <kernel/percpu.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <platform.h>
+
+#define LOCAL_TRACE 0
+
+#ifndef CPUIDLE_MAX_STATES
+#define CPUIDLE_MAX_STATES 8
+#endif
+
+/* slot 0 is arch_idle(), slot n the platform's state n - 1 */
+struct cpuidle_stats {
+    ulong usage[CPUIDLE_MAX_STATES + 1];
+    lk_bigtime_t time[CPUIDLE_MAX_STATES + 1];  /* usecs asleep, not tracked for arch_idle() */
+    ulong short_sleeps[CPUIDLE_MAX_STATES + 1]; /* woke before the target residency */
+};
+
+DEFINE_PERCPU_STATIC(struct cpuidle_stats, cpuidle_stats);
+
+static const struct cpuidle_state *idle_states;
+static uint idle_state_count;
+
+/* tightest latency request in force */
+static volatile uint32_t latency_limit = UINT32_MAX;
+static spin_lock_t latency_lock = SPIN_LOCK_INITIAL_VALUE;
+static struct list_node latency_reqs = LIST_INITIAL_VALUE(latency_reqs);
+
+status_t cpuidle_register_states(const struct cpuidle_state *states, uint count)
+{
+    if (!states || count == 0 || count > CPUIDLE_MAX_STATES)
+        return ERR_INVALID_ARGS;
+    if (idle_state_count)
+        return ERR_ALREADY_EXISTS;
+
+    for (uint i = 0; i < count; i++) {
+        if (!states[i].enter)
+            return ERR_INVALID_ARGS;
+        if (i > 0 && states[i].exit_latency_us < states[i - 1].exit_latency_us)
+            return ERR_INVALID_ARGS;
+    }
+
+    LTRACEF("%u states, deepest '%s'\n", count, states[count - 1].name);
+
+    idle_states = states;
+    __atomic_store_n(&idle_state_count, count, __ATOMIC_RELEASE);
+
+    return NO_ERROR;
+}
+
+/* deepest state that fits, 0 for arch_idle() */
+static uint cpuidle_select(uint count, uint64_t budget_us, uint32_t limit)
+{
+    for (uint i = count; i > 0; i--) {
+        const struct cpuidle_state *state = &idle_states[i - 1];
+        if (state->exit_latency_us <= limit && state->target_residency_us <= budget_us)
+            return i;
+    }
+
+    return 0;
+}
+
+void cpuidle_enter(void)
+{
+    uint count = __atomic_load_n(&idle_state_count, __ATOMIC_ACQUIRE);
+    if (count == 0) {
+        arch_idle();
+        return;
+    }
+
+    arch_disable_ints();
+
+    /* predict the sleep from the next timer, wakeups from devices can't be known */
+    uint64_t budget_us = UINT64_MAX;
+    lk_time_t deadline;
+    if (timer_get_next_deadline(&deadline)) {
+        lk_time_t now = current_time();
+        budget_us = TIME_GT(deadline, now) ? (uint64_t)(deadline - now) * 1000 : 0;
+    }
+
+    uint i = cpuidle_select(count, budget_us, latency_limit);
+    struct cpuidle_stats *stats = this_cpu_ptr(cpuidle_stats);
+    stats->usage[i]++;
+
+    if (i == 0) {
+        arch_enable_ints();
+        arch_idle();
+        return;
+    }
+
+    /* measure before enabling interrupts, the wakeup may switch threads right away */
+    const struct cpuidle_state *state = &idle_states[i - 1];
+    lk_bigtime_t start = current_time_hires();
+    state->enter(state);
+    lk_bigtime_t slept = current_time_hires() - start;
+
+    stats->time[i] += slept;
+    if (slept < state->target_residency_us)
+        stats->short_sleeps[i]++;
+
+    arch_enable_ints();
+}
+
+static void latency_update_locked(void)
+{
+    uint32_t limit = UINT32_MAX;
+    cpuidle_latency_req_t *req;
+
+    list_for_every_entry(&latency_reqs, req, cpuidle_latency_req_t, node) {
+        limit = MIN(limit, req->latency_us);
+    }
+
+    uint32_t old = latency_limit;
+    latency_limit = limit;
+
+    /* cpus asleep in a state that is now too deep wake up and pick again */
+    if (limit < old)
+        mp_reschedule(mp_get_idle_mask(), 0);
+}
+
+void cpuidle_latency_add(cpuidle_latency_req_t *req, uint32_t latency_us)
+{
+    DEBUG_ASSERT(req);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&latency_lock, state);
+    req->latency_us = latency_us;
+    list_add_tail(&latency_reqs, &req->node);
+    latency_update_locked();
+    spin_unlock_irqrestore(&latency_lock, state);
+}
+
+void cpuidle_latency_update(cpuidle_latency_req_t *req, uint32_t latency_us)
+{
+    DEBUG_ASSERT(req && list_in_list(&req->node));
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&latency_lock, state);
+    req->latency_us = latency_us;
+    latency_update_locked();
+    spin_unlock_irqrestore(&latency_lock, state);
+}
+
+void cpuidle_latency_remove(cpuidle_latency_req_t *req)
+{
+    DEBUG_ASSERT(req && list_in_list(&req->node));
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&latency_lock, state);
+    list_delete(&req->node);
+    latency_update_locked();
+    spin_unlock_irqrestore(&latency_lock, state);
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_cpuidle(int argc, const cmd_args *argv)
+{
+    uint count = idle_state_count;
+
+    if (latency_limit == UINT32_MAX)
+        printf("latency limit: none\n");
+    else
+        printf("latency limit: %u us\n", latency_limit);
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (!mp_is_cpu_active(cpu))
+            continue;
+
+        const struct cpuidle_stats *stats = percpu_ptr(cpuidle_stats, cpu);
+
+        printf("cpu %u:\n", cpu);
+        printf("\t%-12s %8s %8s %10s %12s %8s\n", "state", "exit us", "target", "usage", "time us", "short");
+        printf("\t%-12s %8u %8u %10lu %12s %8s\n", "arch_idle", 0, 0, stats->usage[0], "-", "-");
+        for (uint i = 1; i <= count; i++) {
+            const struct cpuidle_state *state = &idle_states[i - 1];
+            printf("\t%-12s %8u %8u %10lu %12lld %8lu\n", state->name,
+                   state->exit_latency_us, state->target_residency_us,
+                   stats->usage[i], stats->time[i], stats->short_sleeps[i]);
+        }
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("cpuidle", "idle state usage and the latency limit", &cmd_cpuidle)
+STATIC_COMMAND_END(cpuidle);
+#endif
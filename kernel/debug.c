@@ -33,6 +33,8 @@
 
 #include <debug.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
@@ -46,7 +48,12 @@
 static int cmd_threads(int argc, const cmd_args *argv);
 static int cmd_threadstats(int argc, const cmd_args *argv);
 static int cmd_threadload(int argc, const cmd_args *argv);
+static int cmd_schedlat(int argc, const cmd_args *argv);
+static int cmd_threadtop(int argc, const cmd_args *argv);
 static int cmd_kevlog(int argc, const cmd_args *argv);
+#if WITH_SMP
+static int cmd_threadmask(int argc, const cmd_args *argv);
+#endif
 
 STATIC_COMMAND_START
 #if LK_DEBUGLEVEL > 1
@@ -55,9 +62,14 @@ STATIC_COMMAND_MASKED("threads", "list kernel threads", &cmd_threads, CMD_AVAIL_
 #if THREAD_STATS
 STATIC_COMMAND("threadstats", "thread level statistics", &cmd_threadstats)
 STATIC_COMMAND("threadload", "toggle thread load display", &cmd_threadload)
+STATIC_COMMAND("schedlat", "run queue wait and run time histograms", &cmd_schedlat)
+STATIC_COMMAND("threadtop", "per thread cpu usage over an interval", &cmd_threadtop)
+#endif
+#if WITH_SMP
+STATIC_COMMAND("threadmask", "show or set the cpu mask of a thread", &cmd_threadmask)
 #endif
 #if WITH_KERNEL_EVLOG
-STATIC_COMMAND_MASKED("kevlog", "dump kernel event log", &cmd_kevlog, CMD_AVAIL_ALWAYS)
+STATIC_COMMAND_MASKED("kevlog", "dump or control the kernel event log", &cmd_kevlog, CMD_AVAIL_ALWAYS)
 #endif
 STATIC_COMMAND_END(kernel);
 
@@ -71,6 +83,36 @@ static int cmd_threads(int argc, const cmd_args *argv)
 }
 #endif
 
+#if WITH_SMP
+static int cmd_threadmask(int argc, const cmd_args *argv)
+{
+    if (argc < 2) {
+        printf("not enough arguments\n");
+        printf("%s <thread address> [cpu mask]\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    thread_t *t = (thread_t *)argv[1].u;
+    if (!t || t->magic != THREAD_MAGIC) {
+        printf("%p is not a thread\n", t);
+        return ERR_INVALID_ARGS;
+    }
+
+    if (argc >= 3) {
+        status_t err = thread_set_cpu_mask(t, argv[2].u);
+        if (err < 0) {
+            printf("error %d setting cpu mask\n", err);
+            return err;
+        }
+    }
+
+    printf("thread %p (%s): pinned_cpu %d, cpu mask 0x%x\n",
+           t, t->name, thread_pinned_cpu(t), thread_cpu_mask(t));
+
+    return NO_ERROR;
+}
+#endif
+
 #if THREAD_STATS
 static int cmd_threadstats(int argc, const cmd_args *argv)
 {
@@ -78,19 +120,24 @@ static int cmd_threadstats(int argc, const cmd_args *argv)
         if (!mp_is_cpu_active(i))
             continue;
 
+        const struct thread_stats *stats = percpu_ptr(thread_stats, i);
+
         printf("thread stats (cpu %d):\n", i);
-        printf("\ttotal idle time: %lld\n", thread_stats[i].idle_time);
-        printf("\ttotal busy time: %lld\n", current_time_hires() - thread_stats[i].idle_time);
-        printf("\treschedules: %lu\n", thread_stats[i].reschedules);
+        printf("\ttotal idle time: %lld\n", stats->idle_time);
+        printf("\ttotal busy time: %lld\n", current_time_hires() - stats->idle_time);
+        printf("\treschedules: %lu\n", stats->reschedules);
 #if WITH_SMP
-        printf("\treschedule_ipis: %lu\n", thread_stats[i].reschedule_ipis);
+        printf("\treschedule_ipis: %lu\n", stats->reschedule_ipis);
+        printf("\treschedule_ipis_sent: %lu\n", stats->reschedule_ipis_sent);
+        printf("\tsteals: %lu\n", stats->steals);
+        printf("\ttlb_shootdown_ipis: %lu\n", stats->tlb_shootdown_ipis);
 #endif
-        printf("\tcontext_switches: %lu\n", thread_stats[i].context_switches);
-        printf("\tpreempts: %lu\n", thread_stats[i].preempts);
-        printf("\tyields: %lu\n", thread_stats[i].yields);
-        printf("\tinterrupts: %lu\n", thread_stats[i].interrupts);
-        printf("\ttimer interrupts: %lu\n", thread_stats[i].timer_ints);
-        printf("\ttimers: %lu\n", thread_stats[i].timers);
+        printf("\tcontext_switches: %lu\n", stats->context_switches);
+        printf("\tpreempts: %lu\n", stats->preempts);
+        printf("\tyields: %lu\n", stats->yields);
+        printf("\tinterrupts: %lu\n", stats->interrupts);
+        printf("\ttimer interrupts: %lu\n", stats->timer_ints);
+        printf("\ttimers: %lu\n", stats->timers);
     }
 
     return 0;
@@ -106,12 +153,13 @@ static enum handler_return threadload(struct timer *t, lk_time_t now, void *arg)
         if (!mp_is_cpu_active(i))
             continue;
 
-        lk_bigtime_t idle_time = thread_stats[i].idle_time;
+        const struct thread_stats *stats = percpu_ptr(thread_stats, i);
+        lk_bigtime_t idle_time = stats->idle_time;
 
         /* if the cpu is currently idle, add the time since it went idle up until now to the idle counter */
         bool is_idle = !!mp_is_cpu_idle(i);
         if (is_idle) {
-            idle_time += current_time_hires() - thread_stats[i].last_idle_timestamp;
+            idle_time += current_time_hires() - stats->last_idle_timestamp;
         }
 
         lk_bigtime_t delta_time = idle_time - last_idle_time[i];
@@ -124,22 +172,24 @@ static enum handler_return threadload(struct timer *t, lk_time_t now, void *arg)
                "pmpts %lu, "
 #if WITH_SMP
                "rs_ipis %lu, "
+               "rs_ipis_sent %lu, "
 #endif
                "ints %lu, "
                "tmr ints %lu, "
                "tmrs %lu\n",
                i,
                busypercent / 100, busypercent % 100,
-               thread_stats[i].context_switches - old_stats[i].context_switches,
-               thread_stats[i].preempts - old_stats[i].preempts,
+               stats->context_switches - old_stats[i].context_switches,
+               stats->preempts - old_stats[i].preempts,
 #if WITH_SMP
-               thread_stats[i].reschedule_ipis - old_stats[i].reschedule_ipis,
+               stats->reschedule_ipis - old_stats[i].reschedule_ipis,
+               stats->reschedule_ipis_sent - old_stats[i].reschedule_ipis_sent,
 #endif
-               thread_stats[i].interrupts - old_stats[i].interrupts,
-               thread_stats[i].timer_ints - old_stats[i].timer_ints,
-               thread_stats[i].timers - old_stats[i].timers);
+               stats->interrupts - old_stats[i].interrupts,
+               stats->timer_ints - old_stats[i].timer_ints,
+               stats->timers - old_stats[i].timers);
 
-        old_stats[i] = thread_stats[i];
+        old_stats[i] = *stats;
         last_idle_time[i] = idle_time;
     }
 
@@ -164,6 +214,122 @@ static int cmd_threadload(int argc, const cmd_args *argv)
     return 0;
 }
 
+static void dump_sched_hist(uint cpu, const char *what, uint32_t hist[NUM_PRIORITIES][THREAD_STATS_HIST_BUCKETS])
+{
+    printf("cpu %u %s (usecs):\n", cpu, what);
+    printf("pri  ");
+    for (uint b = 0; b < THREAD_STATS_HIST_BUCKETS; b++) {
+        if (b == 0)
+            printf(" %6s", "<1");
+        else if (b == THREAD_STATS_HIST_BUCKETS - 1)
+            printf(" %5u+", 1U << (b - 1));
+        else
+            printf(" %6u", 1U << (b - 1));
+    }
+    printf("\n");
+
+    for (int p = NUM_PRIORITIES - 1; p >= 0; p--) {
+        uint64_t total = 0;
+        for (uint b = 0; b < THREAD_STATS_HIST_BUCKETS; b++)
+            total += hist[p][b];
+        if (total == 0)
+            continue;
+
+        printf("%3d  ", p);
+        for (uint b = 0; b < THREAD_STATS_HIST_BUCKETS; b++)
+            printf(" %6u", hist[p][b]);
+        printf("\n");
+    }
+}
+
+static int cmd_schedlat(int argc, const cmd_args *argv)
+{
+    bool wait = true;
+    bool run = true;
+
+    if (argc >= 2) {
+        if (!strcmp(argv[1].str, "reset")) {
+            thread_sched_hist_reset();
+            return 0;
+        } else if (!strcmp(argv[1].str, "wait")) {
+            run = false;
+        } else if (!strcmp(argv[1].str, "run")) {
+            wait = false;
+        } else {
+            printf("usage: %s [wait|run|reset]\n", argv[0].str);
+            return ERR_INVALID_ARGS;
+        }
+    }
+
+    static struct thread_sched_hist snapshot;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!mp_is_cpu_active(i))
+            continue;
+
+        /* racy against the counters moving, which only costs a count or two */
+        memcpy(&snapshot, percpu_ptr(thread_sched_hist, i), sizeof(snapshot));
+        if (wait)
+            dump_sched_hist(i, "run queue wait", snapshot.wait);
+        if (run)
+            dump_sched_hist(i, "run time", snapshot.run);
+    }
+
+    return 0;
+}
+
+static int compare_runtime_delta(const void *_a, const void *_b)
+{
+    const struct thread_runtime *a = _a, *b = _b;
+
+    /* the second snapshot's runtime has been replaced by the delta */
+    return (a->runtime < b->runtime) - (a->runtime > b->runtime);
+}
+
+static int cmd_threadtop(int argc, const cmd_args *argv)
+{
+    lk_time_t interval = (argc >= 2) ? argv[1].u : 1000;
+    if (interval == 0)
+        interval = 1000;
+
+    /* leave room for threads created while measuring */
+    size_t count = thread_get_runtimes(NULL, 0) + 16;
+    struct thread_runtime *before = calloc(count, sizeof(*before));
+    struct thread_runtime *after = calloc(count, sizeof(*after));
+    if (!before || !after) {
+        free(before);
+        free(after);
+        return ERR_NO_MEMORY;
+    }
+
+    size_t nbefore = MIN(thread_get_runtimes(before, count), count);
+    lk_bigtime_t start = current_time_hires();
+    thread_sleep(interval);
+    size_t nafter = MIN(thread_get_runtimes(after, count), count);
+    lk_bigtime_t elapsed = MAX(current_time_hires() - start, 1U);
+
+    for (size_t i = 0; i < nafter; i++) {
+        for (size_t j = 0; j < nbefore; j++) {
+            if (before[j].t == after[i].t && !strcmp(before[j].name, after[i].name)) {
+                after[i].runtime -= MIN(before[j].runtime, after[i].runtime);
+                break;
+            }
+        }
+    }
+
+    qsort(after, nafter, sizeof(*after), compare_runtime_delta);
+
+    printf("%zu threads over %llu usecs, percent of one cpu:\n", nafter, elapsed);
+    printf("%7s %4s %s\n", "cpu%", "pri", "name");
+    for (size_t i = 0; i < nafter; i++) {
+        uint percent = after[i].runtime * 10000 / elapsed;
+        printf("%4u.%02u %4d %s\n", percent / 100, percent % 100, after[i].priority, after[i].name);
+    }
+
+    free(before);
+    free(after);
+    return 0;
+}
+
 #endif // THREAD_STATS
 
 #endif // WITH_LIB_CONSOLE
@@ -171,34 +337,79 @@ static int cmd_threadload(int argc, const cmd_args *argv)
 #if WITH_KERNEL_EVLOG
 
 #include <lib/evlog.h>
+#include <kernel/spinlock.h>
+
+/* record layout, see kernel/debug.h */
+#define KEV_TIME(i) ((i)[0])
+#define KEV_CPU(i)  ((i)[1] >> 16)
+#define KEV_ID(i)   ((i)[1] & 0xffff)
 
-static evlog_t kernel_evlog;
+static evlog_t kernel_evlog[SMP_MAX_CPUS];
+static bool kernel_evlog_ready;
 volatile bool kernel_evlog_enable;
 
 void kernel_evlog_init(void)
 {
-    evlog_init(&kernel_evlog, KERNEL_EVLOG_LEN, 4);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (evlog_init(&kernel_evlog[i], KERNEL_EVLOG_LEN, 4) < 0)
+            return;
+    }
 
+    kernel_evlog_ready = true;
     kernel_evlog_enable = true;
 }
 
 void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1)
 {
     if (kernel_evlog_enable) {
-        uint index = evlog_bump_head(&kernel_evlog);
+        spin_lock_saved_state_t state;
+        arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
 
-        kernel_evlog.items[index] = (uintptr_t)current_time_hires();
-        kernel_evlog.items[index+1] = (arch_curr_cpu_num() << 16) | id;
-        kernel_evlog.items[index+2] = arg0;
-        kernel_evlog.items[index+3] = arg1;
+        /* the ring is only written by this cpu with interrupts off */
+        uint cpu = arch_curr_cpu_num();
+        evlog_t *e = &kernel_evlog[cpu];
+        uint index = evlog_bump_head(e);
+
+        e->items[index] = (uintptr_t)current_time_hires();
+        e->items[index+1] = (cpu << 16) | id;
+        e->items[index+2] = arg0;
+        e->items[index+3] = arg1;
+
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
     }
 }
 
+void kernel_evlog_clear(void)
+{
+    bool enable = kernel_evlog_enable;
+
+    kernel_evlog_enable = false;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        memset(kernel_evlog[i].items, 0, sizeof(uintptr_t) << kernel_evlog[i].len_pow2);
+        kernel_evlog[i].head = 0;
+    }
+    kernel_evlog_enable = enable;
+}
+
 #if WITH_LIB_CONSOLE
 
+static const char *bio_op_name(uintptr_t op)
+{
+    switch (op) {
+        case KERNEL_EVLOG_BIO_READ:
+            return "read";
+        case KERNEL_EVLOG_BIO_WRITE:
+            return "write";
+        default:
+            return "erase";
+    }
+}
+
 static void kevdump_cb(const uintptr_t *i)
 {
     switch (i[1] & 0xffff) {
+        case KERNEL_EVLOG_NULL:
+            break;
         case KERNEL_EVLOG_CONTEXT_SWITCH:
             printf("%lu.%lu: context switch from %p to %p\n", i[0], i[1] >> 16, (void *)i[2], (void *)i[3]);
             break;
@@ -217,6 +428,24 @@ static void kevdump_cb(const uintptr_t *i)
         case KERNEL_EVLOG_IRQ_EXIT:
             printf("%lu.%lu: irq exit  %lu\n", i[0], i[1] >> 16, i[2]);
             break;
+        case KERNEL_EVLOG_MUTEX_BLOCK:
+            printf("%lu.%lu: mutex %p block\n", i[0], i[1] >> 16, (void *)i[2]);
+            break;
+        case KERNEL_EVLOG_MUTEX_WAKE:
+            printf("%lu.%lu: mutex %p wake, err %ld\n", i[0], i[1] >> 16, (void *)i[2], (long)i[3]);
+            break;
+        case KERNEL_EVLOG_BIO_BEGIN:
+            printf("%lu.%lu: bio %p %s begin\n", i[0], i[1] >> 16, (void *)i[2], bio_op_name(i[3]));
+            break;
+        case KERNEL_EVLOG_BIO_END:
+            printf("%lu.%lu: bio %p end, result %ld\n", i[0], i[1] >> 16, (void *)i[2], (long)i[3]);
+            break;
+        case KERNEL_EVLOG_NET_RX:
+            printf("%lu.%lu: netif %p rx %lu bytes\n", i[0], i[1] >> 16, (void *)i[2], i[3]);
+            break;
+        case KERNEL_EVLOG_NET_TX:
+            printf("%lu.%lu: netif %p tx %lu bytes\n", i[0], i[1] >> 16, (void *)i[2], i[3]);
+            break;
         default:
             printf("%lu: unknown id 0x%lx 0x%lx 0x%lx\n", i[0], i[1], i[2], i[3]);
     }
@@ -224,15 +453,175 @@ static void kevdump_cb(const uintptr_t *i)
 
 void kernel_evlog_dump(void)
 {
+    bool enable = kernel_evlog_enable;
+
     kernel_evlog_enable = false;
-    evlog_dump(&kernel_evlog, &kevdump_cb);
-    kernel_evlog_enable = true;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        evlog_dump(&kernel_evlog[i], &kevdump_cb);
+    kernel_evlog_enable = enable;
+}
+
+/*
+ * Chrome trace event export. Each cpu's ring is replayed in order, tracking
+ * which thread is on the cpu so that mutex and bio waits can be drawn as
+ * async slices keyed by the thread they belong to. Threads are shown as
+ * slices on a track per cpu, interrupts on a second track per cpu.
+ */
+#define KEV_IRQ_TID 100
+
+static struct {
+    bool first;
+    bool in_thread[SMP_MAX_CPUS];
+    uintptr_t thread[SMP_MAX_CPUS];
+} kevjson;
+
+static void kevjson_string(const char *str)
+{
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            putchar('\\');
+        if ((unsigned char)*str >= 0x20)
+            putchar(*str);
+    }
+    putchar('"');
+}
+
+static void kevjson_begin(const char *ph, const uintptr_t *i, uint tid)
+{
+    printf("%s\n{\"ph\":\"%s\",\"pid\":0,\"tid\":%u,\"ts\":%lu",
+           kevjson.first ? "" : ",", ph, tid, KEV_TIME(i));
+    kevjson.first = false;
+}
+
+static void kevjson_thread_name(uintptr_t t)
+{
+    char name[32];
+
+    if (!thread_lookup_name((void *)t, name, sizeof(name)))
+        snprintf(name, sizeof(name), "thread %p", (void *)t);
+    printf(",\"name\":");
+    kevjson_string(name);
+}
+
+static void kevjson_cb(const uintptr_t *i)
+{
+    uint cpu = KEV_CPU(i);
+
+    if (KEV_ID(i) == KERNEL_EVLOG_NULL || cpu >= SMP_MAX_CPUS)
+        return;
+
+    switch (KEV_ID(i)) {
+        case KERNEL_EVLOG_CONTEXT_SWITCH:
+            if (kevjson.in_thread[cpu]) {
+                kevjson_begin("E", i, cpu);
+                printf("}");
+            }
+            kevjson_begin("B", i, cpu);
+            kevjson_thread_name(i[3]);
+            printf(",\"cat\":\"sched\",\"args\":{\"thread\":\"%p\"}}", (void *)i[3]);
+            kevjson.in_thread[cpu] = true;
+            kevjson.thread[cpu] = i[3];
+            break;
+        case KERNEL_EVLOG_PREEMPT:
+            kevjson_begin("i", i, cpu);
+            printf(",\"name\":\"preempt\",\"cat\":\"sched\",\"s\":\"t\"}");
+            break;
+        case KERNEL_EVLOG_TIMER_TICK:
+            kevjson_begin("i", i, KEV_IRQ_TID + cpu);
+            printf(",\"name\":\"tick\",\"cat\":\"timer\",\"s\":\"t\"}");
+            break;
+        case KERNEL_EVLOG_TIMER_CALL:
+            kevjson_begin("i", i, KEV_IRQ_TID + cpu);
+            printf(",\"name\":\"timer call\",\"cat\":\"timer\",\"s\":\"t\","
+                   "\"args\":{\"callback\":\"%p\",\"arg\":\"%p\"}}", (void *)i[2], (void *)i[3]);
+            break;
+        case KERNEL_EVLOG_IRQ_ENTER:
+            kevjson_begin("B", i, KEV_IRQ_TID + cpu);
+            printf(",\"name\":\"irq %lu\",\"cat\":\"irq\"}", i[2]);
+            break;
+        case KERNEL_EVLOG_IRQ_EXIT:
+            kevjson_begin("E", i, KEV_IRQ_TID + cpu);
+            printf("}");
+            break;
+        case KERNEL_EVLOG_MUTEX_BLOCK:
+            kevjson_begin("b", i, cpu);
+            printf(",\"name\":\"mutex wait\",\"cat\":\"mutex\",\"id\":\"%p\",\"args\":{\"mutex\":\"%p\"}}",
+                   (void *)kevjson.thread[cpu], (void *)i[2]);
+            break;
+        case KERNEL_EVLOG_MUTEX_WAKE:
+            kevjson_begin("e", i, cpu);
+            printf(",\"name\":\"mutex wait\",\"cat\":\"mutex\",\"id\":\"%p\",\"args\":{\"err\":%ld}}",
+                   (void *)kevjson.thread[cpu], (long)i[3]);
+            break;
+        case KERNEL_EVLOG_BIO_BEGIN:
+            kevjson_begin("b", i, cpu);
+            printf(",\"name\":\"bio\",\"cat\":\"bio\",\"id\":\"%p\",\"args\":{\"dev\":\"%p\",\"op\":\"%s\"}}",
+                   (void *)kevjson.thread[cpu], (void *)i[2], bio_op_name(i[3]));
+            break;
+        case KERNEL_EVLOG_BIO_END:
+            kevjson_begin("e", i, cpu);
+            printf(",\"name\":\"bio\",\"cat\":\"bio\",\"id\":\"%p\",\"args\":{\"result\":%ld}}",
+                   (void *)kevjson.thread[cpu], (long)i[3]);
+            break;
+        case KERNEL_EVLOG_NET_RX:
+        case KERNEL_EVLOG_NET_TX:
+            kevjson_begin("i", i, cpu);
+            printf(",\"name\":\"%s\",\"cat\":\"net\",\"s\":\"t\",\"args\":{\"netif\":\"%p\",\"len\":%lu}}",
+                   (KEV_ID(i) == KERNEL_EVLOG_NET_RX) ? "rx" : "tx", (void *)i[2], i[3]);
+            break;
+    }
+}
+
+void kernel_evlog_dump_json(void)
+{
+    bool enable = kernel_evlog_enable;
+
+    kernel_evlog_enable = false;
+
+    memset(&kevjson, 0, sizeof(kevjson));
+    kevjson.first = true;
+
+    printf("{\"traceEvents\":[");
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        printf("%s\n{\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":\"cpu %u\"}},"
+               "\n{\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":\"cpu %u irq\"}}",
+               kevjson.first ? "" : ",", cpu, cpu, KEV_IRQ_TID + cpu, cpu);
+        kevjson.first = false;
+    }
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+        evlog_dump(&kernel_evlog[cpu], &kevjson_cb);
+    printf("\n]}\n");
+
+    kernel_evlog_enable = enable;
 }
 
 static int cmd_kevlog(int argc, const cmd_args *argv)
 {
-    printf("kernel event log:\n");
-    kernel_evlog_dump();
+    if (!kernel_evlog_ready) {
+        printf("kernel event log not allocated\n");
+        return ERR_NO_MEMORY;
+    }
+
+    if (argc < 2) {
+        printf("kernel event log:\n");
+        kernel_evlog_dump();
+    } else if (!strcmp(argv[1].str, "json")) {
+        kernel_evlog_dump_json();
+    } else if (!strcmp(argv[1].str, "on")) {
+        kernel_evlog_enable = true;
+    } else if (!strcmp(argv[1].str, "off")) {
+        kernel_evlog_enable = false;
+    } else if (!strcmp(argv[1].str, "clear")) {
+        kernel_evlog_clear();
+    } else {
+        printf("usage:\n");
+        printf("\t%s         : dump the event log\n", argv[0].str);
+        printf("\t%s json    : dump in chrome trace event format\n", argv[0].str);
+        printf("\t%s on|off  : start or stop logging\n", argv[0].str);
+        printf("\t%s clear   : empty the event log\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
 
     return NO_ERROR;
 }
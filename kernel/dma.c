@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/dma.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+status_t dma_alloc_coherent(size_t size, void **ptr, paddr_t *pa)
+{
+    LTRACEF("size %zu\n", size);
+
+#if WITH_KERNEL_VM
+    void *va;
+    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "dma_coherent", ROUNDUP(size, PAGE_SIZE),
+                                        &va, 0, VMM_FLAG_ZERO_FILL,
+                                        ARCH_DMA_COHERENT ? ARCH_MMU_FLAG_CACHED : ARCH_MMU_FLAG_UNCACHED);
+    if (err < 0)
+        return err;
+
+    *ptr = va;
+    *pa = vaddr_to_paddr(va);
+#elif ARCH_DMA_COHERENT
+    void *va = memalign(CACHE_LINE, size);
+    if (!va)
+        return ERR_NO_MEMORY;
+
+    memset(va, 0, size);
+    *ptr = va;
+    *pa = (paddr_t)(uintptr_t)va;
+#else
+    /* nothing to map memory uncached with */
+    return ERR_NOT_SUPPORTED;
+#endif
+
+    LTRACEF("va %p pa 0x%lx\n", *ptr, (ulong)*pa);
+
+    return NO_ERROR;
+}
+
+void dma_free_coherent(void *ptr)
+{
+    if (!ptr)
+        return;
+
+#if WITH_KERNEL_VM
+    vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ptr);
+#else
+    free(ptr);
+#endif
+}
+
+paddr_t dma_map_single(const void *ptr, size_t len, enum dma_direction dir)
+{
+    dma_sync_for_device(ptr, len, dir);
+
+#if WITH_KERNEL_VM
+    paddr_t pa = vaddr_to_paddr((void *)ptr);
+    DEBUG_ASSERT(pa);
+    return pa;
+#else
+    return (paddr_t)(uintptr_t)ptr;
+#endif
+}
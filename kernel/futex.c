@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief  Futex style waiting on memory words
+ *
+ * Waiters sit on the list of one of a fixed number of buckets, picked by
+ * hashing the address, each with a wait queue of its own so a wake only
+ * disturbs threads waiting on that address. Everything happens under the
+ * thread lock like the other wait queue users. The per bucket waiter count
+ * lets wake_address() skip the lock when nobody can be waiting: a waiter
+ * bumps it before looking at the word, a waker looks at it after changing
+ * the word, so one of them always sees the other.
+ */
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <list.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <kernel/futex.h>
+#include <kernel/thread.h>
+
+#define LOCAL_TRACE 0
+
+/* power of two */
+#ifndef FUTEX_HASH_BUCKETS
+#define FUTEX_HASH_BUCKETS 64
+#endif
+
+struct futex_waiter {
+    struct list_node node;
+    volatile int *addr;
+    wait_queue_t wait;
+};
+
+struct futex_bucket {
+    struct list_node waiters;
+    int count;
+};
+
+static struct futex_bucket buckets[FUTEX_HASH_BUCKETS] = {
+    [0 ... FUTEX_HASH_BUCKETS - 1] = { .waiters = LIST_INITIAL_CLEARED_VALUE },
+};
+
+static struct futex_bucket *hash_address(volatile int *addr)
+{
+    uintptr_t val = (uintptr_t)addr >> 2;
+    return &buckets[(val * 0x9e3779b1u) & (FUTEX_HASH_BUCKETS - 1)];
+}
+
+status_t wait_on_address(volatile int *addr, int expected, lk_time_t timeout)
+{
+    DEBUG_ASSERT(addr);
+
+    struct futex_waiter w;
+    w.addr = addr;
+    wait_queue_init(&w.wait);
+
+    status_t ret;
+
+    THREAD_LOCK(state);
+
+    struct futex_bucket *b = hash_address(addr);
+
+    /* the list heads can't be statically initialized to point at themselves,
+     * wakers only look at a list once a waiter has been here */
+    if (unlikely(b->waiters.next == NULL))
+        list_initialize(&b->waiters);
+
+    __atomic_fetch_add(&b->count, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) != expected) {
+        ret = ERR_BAD_STATE;
+    } else if (timeout == 0) {
+        ret = ERR_TIMED_OUT;
+    } else {
+        list_add_tail(&b->waiters, &w.node);
+        ret = wait_queue_block(&w.wait, timeout);
+        /* wakers take us off the list, timeouts don't */
+        if (list_in_list(&w.node))
+            list_delete(&w.node);
+    }
+
+    __atomic_fetch_sub(&b->count, 1, __ATOMIC_RELAXED);
+    wait_queue_destroy(&w.wait, false);
+
+    THREAD_UNLOCK(state);
+
+    LTRACEF("addr %p expected %d: %d\n", addr, expected, ret);
+
+    return ret;
+}
+
+int wake_address(volatile int *addr, uint count)
+{
+    DEBUG_ASSERT(addr);
+
+    struct futex_bucket *b = hash_address(addr);
+
+    /* pairs with the waiter bumping the count before reading the word */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&b->count, __ATOMIC_RELAXED) == 0)
+        return 0;
+
+    int woken = 0;
+
+    THREAD_LOCK(state);
+
+    struct futex_waiter *w, *temp;
+    list_for_every_entry_safe(&b->waiters, w, temp, struct futex_waiter, node) {
+        if ((uint)woken == count)
+            break;
+        if (w->addr != addr)
+            continue;
+
+        list_delete(&w->node);
+        woken += wait_queue_wake_one(&w->wait, false, NO_ERROR);
+    }
+
+    THREAD_UNLOCK(state);
+
+    LTRACEF("addr %p: woke %d\n", addr, woken);
+
+    if (woken && !arch_ints_disabled())
+        thread_preempt();
+
+    return woken;
+}
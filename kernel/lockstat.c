@@ -0,0 +1,440 @@
+/*
+ * Copyright (c) 2008-2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief  Lock contention statistics
+ *
+ * Spinlocks are tracked when SPINLOCK_STATS is set. Every spin_lock()/spin_unlock()
+ * pair is accounted against the address of the lock, tracking how long the caller
+ * spun waiting for it and how long it was held, in arch_cycle_count() ticks.
+ * Each cpu keeps its own table so the accounting never takes a lock itself.
+ *
+ * Mutexes are tracked when MUTEX_STATS is set, in a single table since a
+ * mutex is routinely released on another cpu than it was acquired on. Wait
+ * and hold times are in microseconds and include any time spent blocked.
+ *
+ * Both remember the call site of the first acquisition of each lock, which is
+ * usually enough to tell which lock an address is.
+ */
+
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <arch/ops.h>
+#include <platform.h>
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+#endif
+
+static bool lockstat_enabled = true;
+
+#if SPINLOCK_STATS
+
+#define SPINLOCK_STATS_ENTRIES 64   /* locks tracked per cpu, power of 2 */
+#define SPINLOCK_STATS_DEPTH 8      /* max nested locks held per cpu */
+
+struct spinlock_stats_entry {
+    spin_lock_t *lock;
+    void *site;
+    uint32_t acquires;
+    uint32_t contended;
+    uint64_t wait_cycles;
+    uint32_t max_wait_cycles;
+    uint64_t hold_cycles;
+    uint32_t max_hold_cycles;
+};
+
+struct spinlock_stats_held {
+    spin_lock_t *lock;
+    uint32_t acquire_time;
+};
+
+static struct spinlock_stats_cpu {
+    struct spinlock_stats_entry entries[SPINLOCK_STATS_ENTRIES];
+    struct spinlock_stats_held held[SPINLOCK_STATS_DEPTH];
+    uint held_count;
+    uint32_t dropped;
+} spinlock_stats[SMP_MAX_CPUS] __CPU_ALIGN;
+
+static struct spinlock_stats_entry *find_entry(struct spinlock_stats_cpu *s, spin_lock_t *lock)
+{
+    uint hash = ((uintptr_t)lock / sizeof(spin_lock_t)) % SPINLOCK_STATS_ENTRIES;
+
+    for (uint i = 0; i < SPINLOCK_STATS_ENTRIES; i++) {
+        struct spinlock_stats_entry *e = &s->entries[(hash + i) % SPINLOCK_STATS_ENTRIES];
+        if (e->lock == lock)
+            return e;
+        if (e->lock == NULL) {
+            e->lock = lock;
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+void spinlock_stats_acquired(spin_lock_t *lock, uint32_t wait_cycles)
+{
+    spin_lock_saved_state_t state;
+
+    if (!lockstat_enabled)
+        return;
+
+    arch_interrupt_save(&state, ARCH_DEFAULT_SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct spinlock_stats_cpu *s = &spinlock_stats[arch_curr_cpu_num()];
+    struct spinlock_stats_entry *e = find_entry(s, lock);
+    if (!e || s->held_count == SPINLOCK_STATS_DEPTH) {
+        s->dropped++;
+        goto done;
+    }
+
+    /* spin_lock() is inlined, so this is the function that took the lock */
+    if (!e->site)
+        e->site = __GET_CALLER();
+
+    e->acquires++;
+    /* anything beyond the uncontended cost of the acquire counts as contention */
+    if (wait_cycles > 100)
+        e->contended++;
+    e->wait_cycles += wait_cycles;
+    if (wait_cycles > e->max_wait_cycles)
+        e->max_wait_cycles = wait_cycles;
+
+    s->held[s->held_count].lock = lock;
+    s->held[s->held_count].acquire_time = arch_cycle_count();
+    s->held_count++;
+
+done:
+    arch_interrupt_restore(state, ARCH_DEFAULT_SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+void spinlock_stats_released(spin_lock_t *lock)
+{
+    spin_lock_saved_state_t state;
+
+    arch_interrupt_save(&state, ARCH_DEFAULT_SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct spinlock_stats_cpu *s = &spinlock_stats[arch_curr_cpu_num()];
+
+    /* locks are usually released in reverse order, search from the top */
+    for (uint i = s->held_count; i > 0; i--) {
+        struct spinlock_stats_held *h = &s->held[i - 1];
+        if (h->lock != lock)
+            continue;
+
+        uint32_t hold = arch_cycle_count() - h->acquire_time;
+        struct spinlock_stats_entry *e = find_entry(s, lock);
+        if (e) {
+            e->hold_cycles += hold;
+            if (hold > e->max_hold_cycles)
+                e->max_hold_cycles = hold;
+        }
+
+        memmove(h, h + 1, (s->held_count - i) * sizeof(*h));
+        s->held_count--;
+        break;
+    }
+
+    arch_interrupt_restore(state, ARCH_DEFAULT_SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+#endif // SPINLOCK_STATS
+
+#if MUTEX_STATS
+
+#define MUTEX_STATS_ENTRIES 128     /* power of 2 */
+
+struct mutex_stats_entry {
+    const mutex_t *m;
+    void *site;
+    uint32_t acquires;
+    uint32_t contended;
+    uint64_t wait_time;
+    uint32_t max_wait_time;
+    uint64_t hold_time;
+    uint32_t max_hold_time;
+};
+
+static spin_lock_t mutex_stats_lock = SPIN_LOCK_INITIAL_VALUE;
+static struct mutex_stats_entry mutex_stats[MUTEX_STATS_ENTRIES];
+static uint32_t mutex_stats_dropped;
+
+static struct mutex_stats_entry *find_mutex_entry_locked(const mutex_t *m)
+{
+    uint hash = ((uintptr_t)m / sizeof(mutex_t)) % MUTEX_STATS_ENTRIES;
+
+    for (uint i = 0; i < MUTEX_STATS_ENTRIES; i++) {
+        struct mutex_stats_entry *e = &mutex_stats[(hash + i) % MUTEX_STATS_ENTRIES];
+        if (e->m == m)
+            return e;
+        if (e->m == NULL) {
+            e->m = m;
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+void mutex_stats_acquired(mutex_t *m, bool contended, lk_bigtime_t wait, void *site)
+{
+    lk_bigtime_t now = current_time_hires();
+
+    m->stats_acquire_time = now;
+    if (!lockstat_enabled)
+        return;
+
+    uint32_t wait32 = MIN(wait, UINT32_MAX);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&mutex_stats_lock, state);
+
+    struct mutex_stats_entry *e = find_mutex_entry_locked(m);
+    if (!e) {
+        mutex_stats_dropped++;
+    } else {
+        if (!e->site)
+            e->site = site;
+        e->acquires++;
+        if (contended)
+            e->contended++;
+        e->wait_time += wait32;
+        if (wait32 > e->max_wait_time)
+            e->max_wait_time = wait32;
+    }
+
+    spin_unlock_irqrestore(&mutex_stats_lock, state);
+}
+
+void mutex_stats_released(mutex_t *m)
+{
+    if (!lockstat_enabled || m->stats_acquire_time == 0)
+        return;
+
+    uint32_t hold = MIN(current_time_hires() - m->stats_acquire_time, UINT32_MAX);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&mutex_stats_lock, state);
+
+    struct mutex_stats_entry *e = find_mutex_entry_locked(m);
+    if (e) {
+        e->hold_time += hold;
+        if (hold > e->max_hold_time)
+            e->max_hold_time = hold;
+    }
+
+    spin_unlock_irqrestore(&mutex_stats_lock, state);
+}
+
+#endif // MUTEX_STATS
+
+#if WITH_LIB_CONSOLE
+
+/* one merged line of output, in cycles for spinlocks and usecs for mutexes */
+struct lockstat_line {
+    const void *lock;
+    void *site;
+    uint32_t acquires;
+    uint32_t contended;
+    uint64_t wait;
+    uint32_t max_wait;
+    uint64_t hold;
+    uint32_t max_hold;
+};
+
+static int compare_wait(const void *_a, const void *_b)
+{
+    const struct lockstat_line *a = _a, *b = _b;
+
+    if (a->wait != b->wait)
+        return (a->wait > b->wait) ? -1 : 1;
+    return 0;
+}
+
+static void print_lines(struct lockstat_line *lines, uint count, const char *unit)
+{
+    /* the most time spent waiting first */
+    qsort(lines, count, sizeof(lines[0]), compare_wait);
+
+    printf("%-18s %-18s %10s %10s %12s %12s %10s %12s %10s\n",
+           "lock", "first acquirer", "acquires", "contended", "total wait", "avg wait",
+           "max wait", "avg hold", "max hold");
+    for (uint i = 0; i < count; i++) {
+        const struct lockstat_line *l = &lines[i];
+        uint32_t n = l->acquires ? l->acquires : 1;
+
+        printf("%-18p %-18p %10u %10u %12llu %12llu %10u %12llu %10u\n",
+               l->lock, l->site, l->acquires, l->contended, (unsigned long long)l->wait,
+               (unsigned long long)(l->wait / n), l->max_wait,
+               (unsigned long long)(l->hold / n), l->max_hold);
+    }
+    printf("times in %s\n", unit);
+}
+
+#if SPINLOCK_STATS
+static void dump_spinlock_stats(void)
+{
+    static struct lockstat_line total[SPINLOCK_STATS_ENTRIES * SMP_MAX_CPUS];
+    uint count = 0;
+    uint32_t dropped = 0;
+
+    /* merge the per cpu tables */
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        dropped += spinlock_stats[cpu].dropped;
+        for (uint i = 0; i < SPINLOCK_STATS_ENTRIES; i++) {
+            const struct spinlock_stats_entry *e = &spinlock_stats[cpu].entries[i];
+            if (!e->lock)
+                continue;
+
+            uint j;
+            for (j = 0; j < count; j++) {
+                if (total[j].lock == e->lock)
+                    break;
+            }
+            if (j == count) {
+                memset(&total[j], 0, sizeof(total[j]));
+                total[j].lock = e->lock;
+                total[j].site = e->site;
+                count++;
+            }
+
+            total[j].acquires += e->acquires;
+            total[j].contended += e->contended;
+            total[j].wait += e->wait_cycles;
+            total[j].hold += e->hold_cycles;
+            if (e->max_wait_cycles > total[j].max_wait)
+                total[j].max_wait = e->max_wait_cycles;
+            if (e->max_hold_cycles > total[j].max_hold)
+                total[j].max_hold = e->max_hold_cycles;
+        }
+    }
+
+    printf("spinlocks:\n");
+    print_lines(total, count, "cycles");
+    if (dropped)
+        printf("%u acquisitions not tracked\n", dropped);
+}
+
+static void reset_spinlock_stats(void)
+{
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        memset(spinlock_stats[cpu].entries, 0, sizeof(spinlock_stats[cpu].entries));
+        spinlock_stats[cpu].dropped = 0;
+    }
+}
+#endif
+
+#if MUTEX_STATS
+static void dump_mutex_stats(void)
+{
+    static struct lockstat_line lines[MUTEX_STATS_ENTRIES];
+    uint count = 0;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&mutex_stats_lock, state);
+    for (uint i = 0; i < MUTEX_STATS_ENTRIES; i++) {
+        const struct mutex_stats_entry *e = &mutex_stats[i];
+        if (!e->m)
+            continue;
+
+        struct lockstat_line *l = &lines[count++];
+        l->lock = e->m;
+        l->site = e->site;
+        l->acquires = e->acquires;
+        l->contended = e->contended;
+        l->wait = e->wait_time;
+        l->max_wait = e->max_wait_time;
+        l->hold = e->hold_time;
+        l->max_hold = e->max_hold_time;
+    }
+    uint32_t dropped = mutex_stats_dropped;
+    spin_unlock_irqrestore(&mutex_stats_lock, state);
+
+    printf("mutexes:\n");
+    print_lines(lines, count, "usecs");
+    if (dropped)
+        printf("%u acquisitions not tracked\n", dropped);
+}
+
+static void reset_mutex_stats(void)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&mutex_stats_lock, state);
+    memset(mutex_stats, 0, sizeof(mutex_stats));
+    mutex_stats_dropped = 0;
+    spin_unlock_irqrestore(&mutex_stats_lock, state);
+}
+#endif
+
+static int cmd_lockstat(int argc, const cmd_args *argv)
+{
+    if (argc < 2) {
+usage:
+        printf("usage:\n");
+        printf("%s dump              : dump per lock acquisition counts, wait and hold times\n", argv[0].str);
+        printf("%s reset             : clear the statistics\n", argv[0].str);
+        printf("%s enable|disable    : start or stop collecting\n", argv[0].str);
+        return ERR_GENERIC;
+    }
+
+    if (!strcmp(argv[1].str, "dump")) {
+#if SPINLOCK_STATS
+        dump_spinlock_stats();
+#endif
+#if MUTEX_STATS
+        dump_mutex_stats();
+#endif
+    } else if (!strcmp(argv[1].str, "reset")) {
+#if SPINLOCK_STATS
+        reset_spinlock_stats();
+#endif
+#if MUTEX_STATS
+        reset_mutex_stats();
+#endif
+    } else if (!strcmp(argv[1].str, "enable")) {
+        lockstat_enabled = true;
+    } else if (!strcmp(argv[1].str, "disable")) {
+        lockstat_enabled = false;
+    } else {
+        printf("unknown command\n");
+        goto usage;
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("lockstat", "spinlock and mutex contention statistics", &cmd_lockstat)
+#if SPINLOCK_STATS
+STATIC_COMMAND("spinlocks", "spinlock contention statistics", &cmd_lockstat)
+#endif
+STATIC_COMMAND_END(lockstat);
+
+#endif
@@ -27,7 +27,10 @@
 #include <debug.h>
 #include <assert.h>
 #include <trace.h>
+#include <string.h>
 #include <arch/mp.h>
+#include <arch/mmu.h>
+#include <kernel/rcu.h>
 #include <kernel/spinlock.h>
 
 #define LOCAL_TRACE 0
@@ -57,6 +60,13 @@ void mp_reschedule(mp_cpu_mask_t target, uint flags)
 
     LTRACEF("local %d, post mask target now 0x%x\n", local_cpu, target);
 
+    if (target == 0)
+        return;
+
+#if THREAD_STATS
+    percpu_ptr(thread_stats, local_cpu)->reschedule_ipis_sent += __builtin_popcount(target);
+#endif
+
     arch_mp_send_ipi(target, MP_IPI_RESCHEDULE);
 }
 
@@ -65,6 +75,79 @@ void mp_set_curr_cpu_active(bool active)
     atomic_or((volatile int *)&mp.active_cpus, 1U << arch_curr_cpu_num());
 }
 
+/* early boot work sharing */
+#define MP_EARLY_WAIT_SPINS 10000000
+
+static volatile mp_cpu_mask_t early_parked;
+
+static struct {
+    mp_early_func func;
+    void *arg;
+    mp_cpu_mask_t cpus;         /* the parked cpus taking part */
+    uint count;
+    volatile int remaining;
+    uint generation;
+} early_work;
+
+void mp_early_park(spin_lock_t *release)
+{
+    uint cpu = arch_curr_cpu_num();
+    uint seen = 0;
+
+    atomic_or((volatile int *)&early_parked, 1U << cpu);
+
+    while (spin_lock_held(release)) {
+        uint gen = __atomic_load_n(&early_work.generation, __ATOMIC_ACQUIRE);
+        if (gen == seen)
+            continue;
+        seen = gen;
+
+        if (early_work.cpus & (1U << cpu)) {
+            /* the boot cpu has index 0, parked cpus follow in cpu number order */
+            uint index = __builtin_popcount(early_work.cpus & ((1U << cpu) - 1)) + 1;
+            early_work.func(early_work.arg, index, early_work.count);
+            atomic_add(&early_work.remaining, -1);
+        }
+    }
+
+    atomic_and((volatile int *)&early_parked, ~(1U << cpu));
+}
+
+uint mp_early_wait_parked(uint count)
+{
+    for (uint i = 0; i < MP_EARLY_WAIT_SPINS; i++) {
+        if ((uint)__builtin_popcount(early_parked) >= count)
+            break;
+    }
+
+    return __builtin_popcount(early_parked);
+}
+
+/* only valid until the arch releases the parked cpus, which stop taking work once they
+ * see the release */
+void mp_early_run(mp_early_func func, void *arg)
+{
+    mp_cpu_mask_t cpus = early_parked & ~(1U << arch_curr_cpu_num());
+    uint count = __builtin_popcount(cpus) + 1;
+
+    LTRACEF("func %p, cpus 0x%x\n", func, cpus);
+
+    if (count > 1) {
+        early_work.func = func;
+        early_work.arg = arg;
+        early_work.cpus = cpus;
+        early_work.count = count;
+        early_work.remaining = count - 1;
+        __atomic_add_fetch(&early_work.generation, 1, __ATOMIC_RELEASE);
+    }
+
+    func(arg, 0, count);
+
+    while (early_work.remaining > 0)
+        ;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
 enum handler_return mp_mbx_reschedule_irq(void)
 {
     uint cpu = arch_curr_cpu_num();
@@ -73,6 +156,126 @@ enum handler_return mp_mbx_reschedule_irq(void)
 
     THREAD_STATS_INC(reschedule_ipis);
 
+    /* the ipi waits for any rcu read section to end */
+    rcu_note_quiescent();
+
     return (mp.active_cpus & (1U << cpu)) ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
 }
+
+/* nothing to shoot down if the hardware does it or there is no mmu in use */
+#if ARCH_MMU_TLB_BROADCAST || !WITH_KERNEL_VM
+void mp_tlb_shootdown(struct arch_aspace *aspace, vaddr_t vaddr, uint count)
+{
+}
+
+enum handler_return mp_mbx_tlb_shootdown_irq(void)
+{
+    return INT_NO_RESCHEDULE;
+}
+#else
+/* ranges a cpu can have queued before it falls back to flushing everything */
+#define TLB_SHOOTDOWN_BATCH 8
+
+struct tlb_shootdown_range {
+    struct arch_aspace *aspace;
+    vaddr_t vaddr;
+    uint count;
+};
+
+/* per cpu queue of pending shootdowns. requests are numbered, the cpu publishes the number
+ * of the last one it has completed so that senders can wait for theirs.
+ */
+static struct tlb_shootdown_queue {
+    spin_lock_t lock;
+    uint count;
+    bool flush_all;
+    uint queued;
+    uint done;
+    struct tlb_shootdown_range ranges[TLB_SHOOTDOWN_BATCH];
+} tlb_queues[SMP_MAX_CPUS] __CPU_ALIGN;
+
+void mp_tlb_shootdown(struct arch_aspace *aspace, vaddr_t vaddr, uint count)
+{
+    uint tickets[SMP_MAX_CPUS];
+    mp_cpu_mask_t target;
+    mp_cpu_mask_t ipi_target = 0;
+
+    LTRACEF("aspace %p, vaddr 0x%lx, count %u\n", aspace, vaddr, count);
+
+    /* stay on one cpu while deciding who else needs to be told */
+    arch_disable_ints();
+
+    uint local_cpu = arch_curr_cpu_num();
+    target = mp.active_cpus & ~(1U << local_cpu);
+
+    /* the caller may have migrated since it unmapped, so cover the local cpu here too */
+    arch_mmu_invalidate_local(aspace, vaddr, count);
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if ((target & (1U << cpu)) == 0)
+            continue;
+
+        struct tlb_shootdown_queue *q = &tlb_queues[cpu];
+        spin_lock(&q->lock);
+        /* a cpu that already has work queued has an ipi on the way */
+        if (q->count == 0 && !q->flush_all)
+            ipi_target |= 1U << cpu;
+        if (q->count < TLB_SHOOTDOWN_BATCH) {
+            q->ranges[q->count].aspace = aspace;
+            q->ranges[q->count].vaddr = vaddr;
+            q->ranges[q->count].count = count;
+            q->count++;
+        } else {
+            q->flush_all = true;
+        }
+        tickets[cpu] = ++q->queued;
+        spin_unlock(&q->lock);
+    }
+
+    if (ipi_target)
+        arch_mp_send_ipi(ipi_target, MP_IPI_TLB_SHOOTDOWN);
+
+    arch_enable_ints();
+
+    /* the ranges may be reused as soon as this returns */
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if ((target & (1U << cpu)) == 0)
+            continue;
+
+        while ((int)(__atomic_load_n(&tlb_queues[cpu].done, __ATOMIC_ACQUIRE) - tickets[cpu]) < 0)
+            ;
+    }
+}
+
+enum handler_return mp_mbx_tlb_shootdown_irq(void)
+{
+    uint cpu = arch_curr_cpu_num();
+    struct tlb_shootdown_queue *q = &tlb_queues[cpu];
+    struct tlb_shootdown_range ranges[TLB_SHOOTDOWN_BATCH];
+
+    spin_lock(&q->lock);
+    uint count = q->count;
+    bool flush_all = q->flush_all;
+    uint seq = q->queued;
+    memcpy(ranges, q->ranges, count * sizeof(ranges[0]));
+    q->count = 0;
+    q->flush_all = false;
+    spin_unlock(&q->lock);
+
+    LTRACEF("cpu %u, %u ranges, flush all %d\n", cpu, count, flush_all);
+
+    if (flush_all) {
+        arch_mmu_invalidate_local(NULL, 0, 0);
+    } else {
+        for (uint i = 0; i < count; i++)
+            arch_mmu_invalidate_local(ranges[i].aspace, ranges[i].vaddr, ranges[i].count);
+    }
+
+    __atomic_store_n(&q->done, seq, __ATOMIC_RELEASE);
+
+    THREAD_STATS_INC(tlb_shootdown_ipis);
+
+    return INT_NO_RESCHEDULE;
+}
+#endif // ARCH_MMU_TLB_BROADCAST || !WITH_KERNEL_VM
 #endif
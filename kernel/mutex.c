@@ -35,6 +35,137 @@
 #include <assert.h>
 #include <err.h>
 #include <kernel/thread.h>
+#include <kernel/debug.h>
+#include <platform.h>
+
+/* limit on how far a boost is pushed along a chain of blocked holders */
+#define MUTEX_PI_MAX_DEPTH 8
+
+static mutex_pi_trace_hook_t pi_trace_hook;
+
+/**
+ * @brief  Install a hook to trace priority inversions, NULL to remove it
+ */
+void mutex_set_pi_trace_hook(mutex_pi_trace_hook_t hook)
+{
+    pi_trace_hook = hook;
+}
+
+/* highest priority of any thread waiting on a mutex t holds, or -1 if none.
+ * thread lock must be held. */
+static int mutex_waiter_priority(thread_t *t)
+{
+    int priority = -1;
+    mutex_t *m;
+
+    list_for_every_entry(&t->held_mutexes, m, mutex_t, held_node) {
+        thread_t *waiter;
+        list_for_every_entry(&m->wait.list, waiter, thread_t, queue_node) {
+            priority = MAX(priority, waiter->priority);
+        }
+    }
+
+    return priority;
+}
+
+/* raise the holder of m, and whatever its holder is blocked behind in turn,
+ * to at least priority. thread lock must be held. */
+static void mutex_boost_holders(mutex_t *m, int priority)
+{
+    for (int depth = 0; m && depth < MUTEX_PI_MAX_DEPTH; depth++) {
+        thread_t *holder = m->holder;
+        if (!holder || holder->priority >= priority)
+            break;
+
+        if (m->boost_start == 0)
+            m->boost_start = current_time_hires();
+        m->boost_priority = MAX(m->boost_priority, priority);
+
+        thread_set_inherited_priority(holder, priority);
+        m = holder->blocking_mutex;
+    }
+}
+
+/* the current holder is giving up m, report how long it ran boosted */
+static void mutex_end_boost(mutex_t *m)
+{
+    if (m->boost_start == 0)
+        return;
+
+    mutex_pi_trace_hook_t hook = pi_trace_hook;
+    if (hook)
+        hook(m, m->holder, m->boost_priority, current_time_hires() - m->boost_start);
+
+    m->boost_start = 0;
+    m->boost_priority = -1;
+}
+
+/*
+ * Fast path: an uncontended acquire is a compare and swap of count from 0 to
+ * 1 and an uncontended release the reverse, neither touching the thread lock.
+ * Everything else goes through the lock, which still serializes all changes
+ * to the wait queue and to the held_mutexes lists, with count updated
+ * atomically since the fast paths don't take it.
+ *
+ * A mutex is only on its holder's held_mutexes list, which priority
+ * inheritance walks, while someone waits for it: the first contender links
+ * it, and whoever leaves count at 1 under the lock (a waiter timing out, or a
+ * release handing over to the last waiter) unlinks it again. So a count of
+ * 1 always means the mutex is off the list, and the holder can drop it from
+ * 1 to 0 without the lock.
+ */
+static inline bool mutex_try_fast_acquire(mutex_t *m)
+{
+    int expected = 0;
+    return __atomic_compare_exchange_n(&m->count, &expected, 1, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline bool mutex_try_fast_release(mutex_t *m)
+{
+    int expected = 1;
+    return __atomic_compare_exchange_n(&m->count, &expected, 0, false,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+#if WITH_SMP
+/* number of times to poll a mutex whose holder is running on another cpu
+ * before giving up and blocking on the wait queue */
+#ifndef MUTEX_SPIN_COUNT
+#define MUTEX_SPIN_COUNT 1000
+#endif
+
+/*
+ * Adaptive spin: if the mutex is held by a thread that is currently running on
+ * another cpu, it is likely to be released before a block and context switch
+ * would even complete, so poll it for a little while first. Only spin while
+ * there are no other waiters, otherwise the release hands the mutex to the
+ * head of the wait queue and spinning cannot win.
+ *
+ * Runs without the thread lock; the state checks are only a heuristic and the
+ * real acquisition is always done under the lock by the caller.
+ */
+static void mutex_adaptive_spin(mutex_t *m)
+{
+    volatile mutex_t *vm = m;
+    uint cpu = arch_curr_cpu_num();
+
+    for (uint i = 0; i < MUTEX_SPIN_COUNT; i++) {
+        int count = vm->count;
+        if (count == 0)
+            return;
+        if (count > 1)
+            return;
+
+        thread_t *holder = vm->holder;
+        if (holder) {
+            volatile thread_t *vh = holder;
+            if (vh->state != THREAD_RUNNING || (uint)vh->curr_cpu == cpu)
+                return;
+        }
+    }
+}
+#endif
 
 /**
  * @brief  Initialize a mutex_t
@@ -61,6 +192,10 @@ void mutex_destroy(mutex_t *m)
 #endif
 
     THREAD_LOCK(state);
+    if (m->holder && list_in_list(&m->held_node)) {
+        list_delete(&m->held_node);
+        thread_set_inherited_priority(m->holder, mutex_waiter_priority(m->holder));
+    }
     m->magic = 0;
     m->count = 0;
     wait_queue_destroy(&m->wait, true);
@@ -74,6 +209,9 @@ void mutex_destroy(mutex_t *m)
  * Timeout may be zero, in which case this function returns immediately if
  * the mutex is not free.
  *
+ * On SMP builds, if the mutex is held by a thread running on another cpu the
+ * caller briefly spins waiting for it to be released before blocking.
+ *
  * @return  NO_ERROR on success, ERR_TIMED_OUT on timeout,
  * other values on error
  */
@@ -87,11 +225,50 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout)
               get_current_thread(), get_current_thread()->name, m);
 #endif
 
+    thread_t *current_thread = get_current_thread();
+
+#if MUTEX_STATS
+    lk_bigtime_t stats_start = current_time_hires();
+    bool contended = m->count != 0;
+#endif
+
+    if (likely(mutex_try_fast_acquire(m))) {
+        m->holder = current_thread;
+#if MUTEX_STATS
+        mutex_stats_acquired(m, false, current_time_hires() - stats_start, __GET_CALLER());
+#endif
+        return NO_ERROR;
+    }
+
+    if (timeout == 0)
+        return ERR_TIMED_OUT;
+
+#if WITH_SMP
+    if (m->count != 0)
+        mutex_adaptive_spin(m);
+#endif
+
     THREAD_LOCK(state);
 
     status_t ret = NO_ERROR;
-    if (unlikely(++m->count > 1)) {
+    if (unlikely(__atomic_add_fetch(&m->count, 1, __ATOMIC_ACQUIRE) > 1)) {
+#if MUTEX_STATS
+        contended = true;
+#endif
+        /* a fast path holder isn't on its held_mutexes list yet. it may also
+         * not have stored itself as holder yet, in which case it goes without
+         * our priority until it releases into the slow path. */
+        if (m->holder && !list_in_list(&m->held_node))
+            list_add_head(&m->holder->held_mutexes, &m->held_node);
+
+        /* lend the holder our priority while we wait */
+        current_thread->blocking_mutex = m;
+        mutex_boost_holders(m, current_thread->priority);
+
+        KEVLOG_MUTEX_BLOCK(m);
         ret = wait_queue_block(&m->wait, timeout);
+        KEVLOG_MUTEX_WAKE(m, ret);
+        current_thread->blocking_mutex = NULL;
         if (unlikely(ret < NO_ERROR)) {
             /* if the acquisition timed out, back out the acquire and exit */
             if (likely(ret == ERR_TIMED_OUT)) {
@@ -99,20 +276,43 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout)
                  * race: the mutex may have been destroyed after the timeout,
                  * but before we got scheduled again which makes messing with the
                  * count variable dangerous.
+                 *
+                 * if we were the last waiter take the mutex off the holder's
+                 * list before count goes back to 1 and allows a fast release.
                  */
-                m->count--;
+                thread_t *holder = m->holder;
+                if (m->count == 2) {
+                    mutex_end_boost(m);
+                    if (list_in_list(&m->held_node))
+                        list_delete(&m->held_node);
+                }
+                __atomic_sub_fetch(&m->count, 1, __ATOMIC_RELEASE);
+
+                /* the holder no longer needs to run at our priority */
+                if (holder)
+                    thread_set_inherited_priority(holder, mutex_waiter_priority(holder));
             }
             /* if there was a general error, it may have been destroyed out from
              * underneath us, so just exit (which is really an invalid state anyway)
              */
             goto err;
         }
-    }
 
-    m->holder = get_current_thread();
+        /* mutex_release() already handed ownership to us */
+        DEBUG_ASSERT(m->holder == current_thread);
+    } else {
+        /* freed up while we were getting here, no one to inherit from */
+        m->holder = current_thread;
+    }
 
 err:
     THREAD_UNLOCK(state);
+
+#if MUTEX_STATS
+    if (ret == NO_ERROR)
+        mutex_stats_acquired(m, contended, current_time_hires() - stats_start, __GET_CALLER());
+#endif
+
     return ret;
 }
 
@@ -130,11 +330,45 @@ status_t mutex_release(mutex_t *m)
     }
 #endif
 
+#if MUTEX_STATS
+    mutex_stats_released(m);
+#endif
+
+    thread_t *current_thread = m->holder;
+
+    /* uncontended, nothing to boost or wake */
+    m->holder = NULL;
+    if (likely(mutex_try_fast_release(m)))
+        return NO_ERROR;
+    m->holder = current_thread;
+
     THREAD_LOCK(state);
 
+    mutex_end_boost(m);
+    if (list_in_list(&m->held_node))
+        list_delete(&m->held_node);
     m->holder = 0;
 
-    if (unlikely(--m->count >= 1)) {
+    int count = __atomic_sub_fetch(&m->count, 1, __ATOMIC_RELEASE);
+    if (unlikely(count >= 1)) {
+        /* hand the mutex straight to the thread we are about to wake, so it
+         * can inherit from the remaining waiters right away. with no one else
+         * waiting it stays off the list, see mutex_try_fast_release(). */
+        thread_t *next = list_peek_head_type(&m->wait.list, thread_t, queue_node);
+        if (next) {
+            m->holder = next;
+            if (count > 1) {
+                list_add_head(&next->held_mutexes, &m->held_node);
+                mutex_boost_holders(m, mutex_waiter_priority(next));
+            }
+        }
+    }
+
+    /* drop whatever priority we were lent through this mutex */
+    if (current_thread->inherited_priority >= 0)
+        thread_set_inherited_priority(current_thread, mutex_waiter_priority(current_thread));
+
+    if (count >= 1) {
         /* release a thread */
         wait_queue_wake_one(&m->wait, true, NO_ERROR);
     }
@@ -34,6 +34,7 @@
 #include <string.h>
 #include <pow2.h>
 #include <err.h>
+#include <arch/ops.h>
 #include <kernel/thread.h>
 #include <kernel/port.h>
 
@@ -53,14 +54,18 @@
 
 #define MAX_PORT_GROUP_COUNT 256
 
+// head and tail run freely and are masked on access, the writer only moves
+// tail and the reader only moves head, so a single writer and a single reader
+// can use a buffer concurrently without a lock.
 typedef struct {
     uint log2;
-    uint avail;
     uint head;
     uint tail;
     port_packet_t packet[1];
 } port_buf_t;
 
+struct read_port;
+
 typedef struct {
     int magic;
     struct list_node node;
@@ -68,15 +73,20 @@ typedef struct {
     struct list_node rp_list;
     port_mode_t mode;
     char name[PORT_NAME_LEN];
+    // PORT_MODE_SINGLE_WRITER: the reader lockless writes go to, and whether
+    // one is in progress.
+    struct read_port *fast_rp;
+    int writing;
 } write_port_t;
 
 typedef struct {
     int magic;
     wait_queue_t wait;
     struct list_node rp_list;
+    int sleepers;
 } port_group_t;
 
-typedef struct {
+typedef struct read_port {
     int magic;
     struct list_node w_node;
     struct list_node g_node;
@@ -85,6 +95,9 @@ typedef struct {
     wait_queue_t wait;
     write_port_t *wport;
     port_group_t *gport;
+    // threads blocked on this port or on its group, or about to be. lockless
+    // writers only take the thread lock to wake someone if this is non zero.
+    int sleepers;
 } read_port_t;
 
 
@@ -100,36 +113,81 @@ static port_buf_t *make_buf(bool big)
         return NULL;
     buf->log2 = log2_uint(pk_count);
     buf->head = buf->tail = 0;
-    buf->avail = pk_count;
     return buf;
 }
 
 static inline bool buf_is_empty(port_buf_t *buf)
 {
-    return buf->avail == valpow2(buf->log2);
+    return __atomic_load_n(&buf->tail, __ATOMIC_ACQUIRE) == buf->head;
 }
 
 static status_t buf_write(port_buf_t *buf, const port_packet_t *packets, size_t count)
 {
-    if (buf->avail < count)
+    uint tail = buf->tail;
+    uint used = tail - __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+
+    if (valpow2(buf->log2) - used < count)
         return ERR_NOT_ENOUGH_BUFFER;
 
+    for (size_t ix = 0; ix != count; ix++)
+        buf->packet[modpow2(tail + ix, buf->log2)] = packets[ix];
+
+    __atomic_store_n(&buf->tail, tail + count, __ATOMIC_RELEASE);
+    return NO_ERROR;
+}
+
+// read up to |count| packets, returns how many were read.
+static size_t buf_read(port_buf_t *buf, void *ctx, port_result_t *pr, size_t count)
+{
+    uint head = buf->head;
+    uint used = __atomic_load_n(&buf->tail, __ATOMIC_ACQUIRE) - head;
+
+    count = MIN(count, used);
     for (size_t ix = 0; ix != count; ix++) {
-        buf->packet[buf->tail] = packets[ix];
-        buf->tail = modpow2(++buf->tail, buf->log2);
+        pr[ix].ctx = ctx;
+        pr[ix].packet = buf->packet[modpow2(head + ix, buf->log2)];
     }
-    buf->avail -= count;
-    return NO_ERROR;
+
+    __atomic_store_n(&buf->head, head + count, __ATOMIC_RELEASE);
+    return count;
 }
 
-static status_t buf_read(port_buf_t *buf, port_result_t *pr)
+// keep every member's sleepers count including the group's own sleepers.
+static void group_add_sleepers_locked(port_group_t *pg, int delta)
 {
-    if (buf_is_empty(buf))
-        return ERR_NO_MSG;
-    pr->packet = buf->packet[buf->head];
-    buf->head = modpow2(++buf->head, buf->log2);
-    ++buf->avail;
-    return NO_ERROR;
+    read_port_t *rp;
+    list_for_every_entry(&pg->rp_list, rp, read_port_t, g_node) {
+        rp->sleepers += delta;
+    }
+    pg->sleepers += delta;
+}
+
+static int wake_reader_locked(read_port_t *rp)
+{
+    int awaken = 0;
+    if (rp->gport) {
+        awaken = wait_queue_wake_one(&rp->gport->wait, false, NO_ERROR);
+    }
+    if (!awaken) {
+        awaken = wait_queue_wake_one(&rp->wait, false, NO_ERROR);
+    }
+    return awaken;
+}
+
+static void write_reschedule(int awake_count)
+{
+#if RESCHEDULE_POLICY
+    // from interrupt context leave it to the handler's return value.
+    if (awake_count && !arch_ints_disabled())
+        thread_yield();
+#endif
+}
+
+// wait for a lockless write that may have seen |wp->fast_rp| before it was cleared.
+static void wait_for_fast_writer(write_port_t *wp)
+{
+    while (__atomic_load_n(&wp->writing, __ATOMIC_ACQUIRE))
+        thread_sleep(1);
 }
 
 // must be called before any use of ports.
@@ -149,6 +207,10 @@ status_t port_create(const char *name, port_mode_t mode, port_t *port)
             return ERR_INVALID_ARGS;
     }
 
+    // lockless writes need the writer and the reader to share one buffer.
+    if ((mode & PORT_MODE_SINGLE_WRITER) && !(mode & PORT_MODE_UNICAST))
+        return ERR_INVALID_ARGS;
+
     if (strlen(name) >= PORT_NAME_LEN)
         return ERR_INVALID_ARGS;
 
@@ -234,6 +296,8 @@ status_t port_open(const char *name, void *ctx, port_t *port)
                 list_add_tail(&wp->rp_list, &rp->w_node);
                 rp->buf = wp->buf;
                 wp->buf = NULL;
+                if ((wp->mode & PORT_MODE_SINGLE_WRITER) && wp->magic == WRITEPORT_MAGIC_W)
+                    __atomic_store_n(&wp->fast_rp, rp, __ATOMIC_RELEASE);
                 rc = NO_ERROR;
             } else if (buf) {
                 // not first read port.
@@ -337,8 +401,9 @@ status_t port_group_add(port_t group, port_t port)
         rc = ERR_TOO_BIG;
     } else {
         rp->gport = pg;
+        rp->sleepers += pg->sleepers;
         list_add_tail(&pg->rp_list, &rp->g_node);
-        
+
         // If the new read port being added has messages available, try to wake
         // any readers that might be present.
         if (!buf_is_empty(rp->buf)) {
@@ -379,18 +444,63 @@ status_t port_group_remove(port_t group, port_t port)
         return ERR_BAD_HANDLE;
 
     list_delete(&rp->g_node);
+    rp->sleepers -= pg->sleepers;
 
     THREAD_UNLOCK(state);
 
     return NO_ERROR;
 }
 
+// PORT_MODE_SINGLE_WRITER with its reader attached: write straight into the
+// reader's buffer, only taking the thread lock if someone may be blocked on it.
+// returns false if the caller has to go the locked way instead.
+static bool port_write_fast(write_port_t *wp, const port_packet_t *pk, size_t count,
+                            status_t *status)
+{
+    __atomic_store_n(&wp->writing, 1, __ATOMIC_SEQ_CST);
+
+    read_port_t *rp = __atomic_load_n(&wp->fast_rp, __ATOMIC_SEQ_CST);
+    if (!rp) {
+        __atomic_store_n(&wp->writing, 0, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    int awaken = 0;
+    *status = NO_ERROR;
+    if (buf_write(rp->buf, pk, count) < 0) {
+        // buffer full, same as for the locked write to a read port.
+        *status = ERR_PARTIAL_WRITE;
+    } else {
+        // pairs with the fence in the readers between announcing themselves
+        // and checking the buffer one last time.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&rp->sleepers, __ATOMIC_RELAXED)) {
+            THREAD_LOCK(state);
+            if (wp->fast_rp == rp)
+                awaken = wake_reader_locked(rp);
+            THREAD_UNLOCK(state);
+        }
+    }
+
+    __atomic_store_n(&wp->writing, 0, __ATOMIC_RELEASE);
+
+    write_reschedule(awaken);
+    return true;
+}
+
 status_t port_write(port_t port, const port_packet_t *pk, size_t count)
 {
     if (!port || !pk)
         return ERR_INVALID_ARGS;
 
     write_port_t *wp = (write_port_t *)port;
+
+    if (wp->mode & PORT_MODE_SINGLE_WRITER) {
+        status_t status;
+        if (port_write_fast(wp, pk, count, &status))
+            return status;
+    }
+
     THREAD_LOCK(state);
     if (wp->magic != WRITEPORT_MAGIC_W) {
         // wrong port type.
@@ -415,31 +525,20 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count)
                 continue;
             }
 
-            int awaken = 0;
-            if (rp->gport) {
-                awaken = wait_queue_wake_one(&rp->gport->wait, false, NO_ERROR);
-            }
-            if (!awaken) {
-                awaken = wait_queue_wake_one(&rp->wait, false, NO_ERROR);
-            }
-
-            awake_count += awaken;
+            awake_count += wake_reader_locked(rp);
         }
     }
 
     THREAD_UNLOCK(state);
 
-#if RESCHEDULE_POLICY
-    if (awake_count)
-        thread_yield();
-#endif
+    write_reschedule(awake_count);
 
     return status;
 }
 
 static inline status_t read_no_lock(read_port_t *rp, lk_time_t timeout, port_result_t *result)
 {
-    status_t status = buf_read(rp->buf, result);
+    status_t status = buf_read(rp->buf, rp->ctx, result, 1) ? NO_ERROR : ERR_NO_MSG;
     result->ctx = rp->ctx;
 
     if (status != ERR_NO_MSG)
@@ -449,46 +548,97 @@ static inline status_t read_no_lock(read_port_t *rp, lk_time_t timeout, port_res
     if (!timeout)
         return ERR_TIMED_OUT;
 
-    status_t wr = wait_queue_block(&rp->wait, timeout);
+    // a lockless writer only wakes us if it sees a sleeper, so announce
+    // ourselves before checking the buffer for the last time.
+    rp->sleepers++;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    status_t wr = buf_is_empty(rp->buf) ? wait_queue_block(&rp->wait, timeout) : NO_ERROR;
+    // a closed port may be gone already.
+    if (wr != ERR_OBJECT_DESTROYED)
+        rp->sleepers--;
     if (wr != NO_ERROR)
         return wr;
     // recursive tail call is usually optimized away with a goto.
     return read_no_lock(rp, timeout, result);
 }
 
+static status_t read_group_no_lock(port_group_t *pg, lk_time_t timeout, port_result_t *result)
+{
+    status_t rc = ERR_TIMED_OUT;
+    read_port_t *rp;
+
+    // read each port with no timeout.
+    // todo: this order is fixed, probably a bad thing.
+    list_for_every_entry(&pg->rp_list, rp, read_port_t, g_node) {
+        rc = read_no_lock(rp, 0, result);
+        if (rc != ERR_TIMED_OUT)
+            return rc;
+    }
+    if (!timeout)
+        return rc;
+
+    // as in read_no_lock(), but for every member.
+    group_add_sleepers_locked(pg, 1);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    do {
+        list_for_every_entry(&pg->rp_list, rp, read_port_t, g_node) {
+            rc = read_no_lock(rp, 0, result);
+            if (rc != ERR_TIMED_OUT)
+                goto done;
+        }
+        // no data, block on the group waitqueue.
+        rc = wait_queue_block(&pg->wait, timeout);
+    } while (rc == NO_ERROR);
+
+done:
+    if (rc != ERR_OBJECT_DESTROYED)
+        group_add_sleepers_locked(pg, -1);
+    return rc;
+}
+
 status_t port_read(port_t port, lk_time_t timeout, port_result_t *result)
 {
-    if (!port || !result)
+    size_t count;
+
+    return port_read_batch(port, timeout, result, 1, &count);
+}
+
+status_t port_read_batch(port_t port, lk_time_t timeout, port_result_t *results, size_t count,
+                         size_t *read_count)
+{
+    if (!port || !results || !read_count || !count)
         return ERR_INVALID_ARGS;
 
     status_t rc = ERR_GENERIC;
+    size_t n = 0;
     read_port_t *rp = (read_port_t *)port;
 
     THREAD_LOCK(state);
     if (rp->magic == READPORT_MAGIC) {
         // dealing with a single port.
-        rc = read_no_lock(rp, timeout, result);
+        rc = read_no_lock(rp, timeout, results);
+        if (rc == NO_ERROR)
+            n = 1 + buf_read(rp->buf, rp->ctx, results + 1, count - 1);
     } else if (rp->magic == PORTGROUP_MAGIC) {
-        // dealing with a port group.
+        // dealing with a port group, block for the first packet then take
+        // whatever else the members have.
         port_group_t *pg = (port_group_t *)port;
-        do {
-            // read each port with no timeout.
-            // todo: this order is fixed, probably a bad thing.
+        rc = read_group_no_lock(pg, timeout, results);
+        if (rc == NO_ERROR) {
+            n = 1;
             list_for_every_entry(&pg->rp_list, rp, read_port_t, g_node) {
-                rc = read_no_lock(rp, 0, result);
-                if (rc != ERR_TIMED_OUT)
-                    goto read_exit;
+                if (n == count)
+                    break;
+                n += buf_read(rp->buf, rp->ctx, results + n, count - n);
             }
-            // no data, block on the group waitqueue.
-            rc = wait_queue_block(&pg->wait, timeout);
-        } while (rc == NO_ERROR);
+        }
     } else {
         // wrong port type.
         rc = ERR_BAD_HANDLE;
     }
-
-read_exit:
     THREAD_UNLOCK(state);
+
+    *read_count = n;
     return rc;
 }
 
@@ -542,10 +692,17 @@ status_t port_close(port_t port)
     read_port_t *rp = (read_port_t *) port;
     port_buf_t *buf = NULL;
 
+    write_port_t *fast_wp = NULL;
+
     THREAD_LOCK(state);
     if (rp->magic == READPORT_MAGIC) {
         // dealing with a read port.
         if (rp->wport) {
+            // stop lockless writes before the buffer changes hands.
+            if (rp->wport->fast_rp == rp) {
+                __atomic_store_n(&rp->wport->fast_rp, NULL, __ATOMIC_SEQ_CST);
+                fast_wp = rp->wport;
+            }
             // remove self from write port list and reassign the bufer if last.
             list_delete(&rp->w_node);
             if (list_is_empty(&rp->wport->rp_list)) {
@@ -571,6 +728,7 @@ status_t port_close(port_t port)
         // remove self from reader ports.
         rp = NULL;
         list_for_every_entry(&pg->rp_list, rp, read_port_t, g_node) {
+            rp->sleepers -= pg->sleepers;
             rp->gport = NULL;
         }
         pg->magic = 0;
@@ -580,7 +738,9 @@ status_t port_close(port_t port)
         write_port_t *wp = (write_port_t *) port;
         // mark it as closed. Now it can be read but not written to.
         wp->magic = WRITEPORT_MAGIC_X;
+        __atomic_store_n(&wp->fast_rp, NULL, __ATOMIC_SEQ_CST);
         THREAD_UNLOCK(state);
+        wait_for_fast_writer(wp);
         return NO_ERROR;
 
     } else {
@@ -590,6 +750,9 @@ status_t port_close(port_t port)
 
     THREAD_UNLOCK(state);
 
+    if (fast_wp)
+        wait_for_fast_writer(fast_wp);
+
     free(buf);
     free(port);
     return NO_ERROR;
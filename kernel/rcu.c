@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/rcu.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <trace.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/thread.h>
+#include <lk/init.h>
+#include <platform.h>
+
+#define LOCAL_TRACE 0
+
+/* how long a grace period waits for cpus to pass a quiescent state on their own
+ * before sending them a reschedule ipi */
+#ifndef RCU_FORCE_QS_MS
+#define RCU_FORCE_QS_MS 2
+#endif
+
+static struct {
+    spin_lock_t lock;
+    struct list_node pending; /* callbacks waiting for the next grace period */
+    event_t work_event;
+
+    /* cpus that have yet to pass a quiescent state in the current grace period */
+    volatile int need_qs __CPU_ALIGN;
+} rcu = {
+    .lock = SPIN_LOCK_INITIAL_VALUE,
+    .pending = LIST_INITIAL_VALUE(rcu.pending),
+    .work_event = EVENT_INITIAL_VALUE(rcu.work_event, false, EVENT_FLAG_AUTOUNSIGNAL),
+};
+
+#if WITH_SMP
+void rcu_note_quiescent(void)
+{
+    int bit = 1 << arch_curr_cpu_num();
+
+    /* plain load first, this is on every reschedule */
+    if (likely(!(rcu.need_qs & bit)))
+        return;
+
+    /* orders the read sections this cpu ran before it against the end of the grace period */
+    __atomic_fetch_and(&rcu.need_qs, ~bit, __ATOMIC_SEQ_CST);
+}
+#endif
+
+static void rcu_wait_for_grace_period(void)
+{
+#if WITH_SMP
+    /* the unlinking the callbacks wait on must be visible before any cpu reports */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    /* this cpu is in a quiescent state right here, nothing else is */
+    arch_disable_ints();
+    int mask = mp.active_cpus & ~(1U << arch_curr_cpu_num());
+    __atomic_store_n(&rcu.need_qs, mask, __ATOMIC_SEQ_CST);
+    arch_enable_ints();
+
+    LTRACEF("waiting on cpus 0x%x\n", mask);
+
+    lk_time_t start = current_time();
+    while ((mask = __atomic_load_n(&rcu.need_qs, __ATOMIC_ACQUIRE)) != 0) {
+        thread_sleep(1);
+        if (current_time() - start >= RCU_FORCE_QS_MS)
+            mp_reschedule(mask, MP_RESCHEDULE_FLAG_REALTIME);
+    }
+#endif
+}
+
+static int rcu_thread(void *arg)
+{
+    for (;;) {
+        event_wait(&rcu.work_event);
+
+        /* take everything queued so far, anything queued later waits for the next grace period */
+        struct list_node batch = LIST_INITIAL_VALUE(batch);
+        struct rcu_head *head;
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&rcu.lock, state);
+        while ((head = list_remove_head_type(&rcu.pending, struct rcu_head, node)))
+            list_add_tail(&batch, &head->node);
+        spin_unlock_irqrestore(&rcu.lock, state);
+
+        if (list_is_empty(&batch))
+            continue;
+
+        rcu_wait_for_grace_period();
+
+        while ((head = list_remove_head_type(&batch, struct rcu_head, node)))
+            head->func(head);
+    }
+
+    return 0;
+}
+
+void call_rcu(struct rcu_head *head, rcu_callback_t func)
+{
+    DEBUG_ASSERT(head && func);
+
+    head->func = func;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&rcu.lock, state);
+    list_add_tail(&rcu.pending, &head->node);
+    spin_unlock_irqrestore(&rcu.lock, state);
+
+    event_signal(&rcu.work_event, false);
+}
+
+struct rcu_sync {
+    struct rcu_head head;
+    event_t done;
+};
+
+static void rcu_sync_done(struct rcu_head *head)
+{
+    struct rcu_sync *sync = containerof(head, struct rcu_sync, head);
+
+    event_signal(&sync->done, true);
+}
+
+void synchronize_rcu(void)
+{
+    DEBUG_ASSERT(!arch_ints_disabled());
+
+#if WITH_SMP
+    /* read sections don't get preempted, so with no other cpu running there is none to wait for */
+    if ((mp.active_cpus & ~(1U << arch_curr_cpu_num())) == 0)
+        return;
+
+    struct rcu_sync sync;
+    event_init(&sync.done, false, 0);
+    call_rcu(&sync.head, &rcu_sync_done);
+    event_wait(&sync.done);
+    event_destroy(&sync.done);
+#endif
+}
+
+static void rcu_init(uint level)
+{
+    thread_t *t = thread_create("rcu", &rcu_thread, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!t)
+        panic("failed to create the rcu thread\n");
+    thread_detach_and_resume(t);
+}
+
+LK_INIT_HOOK(rcu, &rcu_init, LK_INIT_LEVEL_THREADING - 1);
@@ -8,15 +8,49 @@ MODULE_DEPS := \
 	lib/heap
 
 MODULE_SRCS := \
+	$(LOCAL_DIR)/cpuidle.c \
 	$(LOCAL_DIR)/debug.c \
+	$(LOCAL_DIR)/dma.c \
 	$(LOCAL_DIR)/event.c \
+	$(LOCAL_DIR)/futex.c \
 	$(LOCAL_DIR)/init.c \
 	$(LOCAL_DIR)/mutex.c \
+	$(LOCAL_DIR)/rwlock.c \
 	$(LOCAL_DIR)/thread.c \
 	$(LOCAL_DIR)/timer.c \
 	$(LOCAL_DIR)/semaphore.c \
 	$(LOCAL_DIR)/mp.c \
-	$(LOCAL_DIR)/port.c
+	$(LOCAL_DIR)/port.c \
+	$(LOCAL_DIR)/rcu.c
+
+# pick a timer queue implementation, a sorted list or a hierarchical timing wheel
+KERNEL_TIMER_IMPLEMENTATION ?= list
+ifeq ($(KERNEL_TIMER_IMPLEMENTATION),wheel)
+GLOBAL_DEFINES += KERNEL_TIMER_WHEEL=1
+endif
+
+# tickless scheduling, arm one timer per quantum instead of a periodic preemption
+# tick. needs a platform with a dynamic timer.
+ifeq ($(KERNEL_TICKLESS),1)
+GLOBAL_DEFINES += KERNEL_TICKLESS=1
+endif
+
+# earliest deadline first scheduling class for periodic real time threads, see
+# thread_set_deadline(). adds a timer and some accounting to every thread.
+ifeq ($(KERNEL_DEADLINE),1)
+GLOBAL_DEFINES += KERNEL_DEADLINE=1
+endif
+
+# per lock wait and hold time statistics, for finding hot locks. KERNEL_LOCKSTAT
+# covers both spinlocks and mutexes, KERNEL_SPINLOCK_STATS only spinlocks.
+ifeq ($(KERNEL_LOCKSTAT),1)
+KERNEL_SPINLOCK_STATS := 1
+GLOBAL_DEFINES += MUTEX_STATS=1
+endif
+ifeq ($(KERNEL_SPINLOCK_STATS),1)
+GLOBAL_DEFINES += SPINLOCK_STATS=1
+MODULE_SRCS += $(LOCAL_DIR)/lockstat.c
+endif
 
 ifeq ($(WITH_KERNEL_VM),1)
 MODULE_DEPS += kernel/vm
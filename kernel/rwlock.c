@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2008-2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief  Reader-writer lock functions
+ *
+ * @defgroup rwlock Reader-writer lock
+ * @{
+ */
+
+#include <kernel/rwlock.h>
+#include <debug.h>
+#include <assert.h>
+#include <err.h>
+#include <kernel/thread.h>
+
+/**
+ * @brief  Initialize a rwlock_t
+ */
+void rwlock_init(rwlock_t *l)
+{
+    *l = (rwlock_t)RWLOCK_INITIAL_VALUE(*l);
+}
+
+/**
+ * @brief  Destroy a rwlock_t
+ *
+ * Any threads still waiting on the lock are woken with ERR_OBJECT_DESTROYED.
+ * The rwlock_t object itself is not freed.
+ */
+void rwlock_destroy(rwlock_t *l)
+{
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+    THREAD_LOCK(state);
+    l->magic = 0;
+    l->count = 0;
+    l->writer = NULL;
+    l->waiting_readers = 0;
+    l->waiting_writers = 0;
+    wait_queue_destroy(&l->reader_wait, false);
+    wait_queue_destroy(&l->writer_wait, true);
+    THREAD_UNLOCK(state);
+}
+
+/* hand the lock to every queued reader at once. thread lock must be held. */
+static void rwlock_admit_readers(rwlock_t *l, bool resched)
+{
+    DEBUG_ASSERT(l->count >= 0);
+
+    l->count += l->waiting_readers;
+    l->waiting_readers = 0;
+    wait_queue_wake_all(&l->reader_wait, resched, NO_ERROR);
+}
+
+/**
+ * @brief  Acquire the lock for reading, with timeout
+ *
+ * Any number of readers may hold the lock at once. Blocks while a writer
+ * holds the lock or is waiting for it. Timeout may be zero, in which case
+ * this function returns immediately if the lock cannot be taken.
+ *
+ * @return  NO_ERROR on success, ERR_TIMED_OUT on timeout,
+ * other values on error
+ */
+status_t rwlock_acquire_read_timeout(rwlock_t *l, lk_time_t timeout)
+{
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+    if (unlikely(get_current_thread() == l->writer))
+        panic("rwlock_acquire_read_timeout: thread %p (%s) tried to read lock %p it holds for writing.\n",
+              get_current_thread(), get_current_thread()->name, l);
+#endif
+
+    THREAD_LOCK(state);
+
+    status_t ret = NO_ERROR;
+    if (likely(l->count >= 0 && l->waiting_writers == 0)) {
+        l->count++;
+    } else {
+        l->waiting_readers++;
+        /* the releasing writer accounts for us in count before waking us */
+        ret = wait_queue_block(&l->reader_wait, timeout);
+        if (unlikely(ret == ERR_TIMED_OUT))
+            l->waiting_readers--;
+    }
+
+    THREAD_UNLOCK(state);
+    return ret;
+}
+
+/**
+ * @brief  Release a read hold on the lock
+ */
+status_t rwlock_release_read(rwlock_t *l)
+{
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+    THREAD_LOCK(state);
+
+#if LK_DEBUGLEVEL > 0
+    if (unlikely(l->count <= 0)) {
+        panic("rwlock_release_read: thread %p (%s) released lock %p which is not read locked (count %d)\n",
+              get_current_thread(), get_current_thread()->name, l, l->count);
+    }
+#endif
+
+    if (--l->count == 0 && l->waiting_writers > 0) {
+        /* last reader out, hand the lock directly to a waiting writer */
+        l->count = -1;
+        l->waiting_writers--;
+        wait_queue_wake_one(&l->writer_wait, true, NO_ERROR);
+    }
+
+    THREAD_UNLOCK(state);
+    return NO_ERROR;
+}
+
+/**
+ * @brief  Acquire the lock for writing, with timeout
+ *
+ * Blocks until there are no readers and no other writer. Timeout may be zero,
+ * in which case this function returns immediately if the lock is not free.
+ *
+ * @return  NO_ERROR on success, ERR_TIMED_OUT on timeout,
+ * other values on error
+ */
+status_t rwlock_acquire_write_timeout(rwlock_t *l, lk_time_t timeout)
+{
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+    if (unlikely(get_current_thread() == l->writer))
+        panic("rwlock_acquire_write_timeout: thread %p (%s) tried to acquire lock %p it already owns.\n",
+              get_current_thread(), get_current_thread()->name, l);
+#endif
+
+    THREAD_LOCK(state);
+
+    status_t ret = NO_ERROR;
+    if (likely(l->count == 0)) {
+        l->count = -1;
+    } else {
+        l->waiting_writers++;
+        /* the releasing thread sets count to -1 on our behalf before waking us */
+        ret = wait_queue_block(&l->writer_wait, timeout);
+        if (unlikely(ret < NO_ERROR)) {
+            if (likely(ret == ERR_TIMED_OUT)) {
+                l->waiting_writers--;
+
+                /* readers may have queued up behind us while the lock was read held */
+                if (l->waiting_writers == 0 && l->count >= 0 && l->waiting_readers > 0)
+                    rwlock_admit_readers(l, false);
+            }
+            goto err;
+        }
+    }
+
+    l->writer = get_current_thread();
+
+err:
+    THREAD_UNLOCK(state);
+    return ret;
+}
+
+/**
+ * @brief  Release a write hold on the lock
+ *
+ * Readers that queued up while the lock was write held are preferred over
+ * the next writer, so neither side can starve the other.
+ */
+status_t rwlock_release_write(rwlock_t *l)
+{
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+    if (unlikely(get_current_thread() != l->writer)) {
+        panic("rwlock_release_write: thread %p (%s) tried to release lock %p it doesn't own. owned by %p (%s)\n",
+              get_current_thread(), get_current_thread()->name, l, l->writer, l->writer ? l->writer->name : "none");
+    }
+#endif
+
+    THREAD_LOCK(state);
+
+    l->writer = NULL;
+
+    if (l->waiting_readers > 0) {
+        l->count = 0;
+        rwlock_admit_readers(l, true);
+    } else if (l->waiting_writers > 0) {
+        /* leave count at -1, ownership passes to the woken writer */
+        l->waiting_writers--;
+        wait_queue_wake_one(&l->writer_wait, true, NO_ERROR);
+    } else {
+        l->count = 0;
+    }
+
+    THREAD_UNLOCK(state);
+    return NO_ERROR;
+}
@@ -41,7 +41,9 @@
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
+#include <kernel/cpuidle.h>
 #include <kernel/mp.h>
+#include <kernel/rcu.h>
 #include <platform.h>
 #include <target.h>
 #include <lib/heap.h>
@@ -50,7 +52,8 @@
 #endif
 
 #if THREAD_STATS
-struct thread_stats thread_stats[SMP_MAX_CPUS];
+DEFINE_PERCPU(thread_stats);
+DEFINE_PERCPU(thread_sched_hist);
 #endif
 
 #define STACK_DEBUG_BYTE (0x99)
@@ -64,12 +67,103 @@ static struct list_node thread_list;
 /* master thread spinlock */
 spin_lock_t thread_lock = SPIN_LOCK_INITIAL_VALUE;
 
-/* the run queue */
-static struct list_node run_queue[NUM_PRIORITIES];
-static uint32_t run_queue_bitmap;
+/* the run queues, one per cpu, each with a bitmap of non empty priority lists */
+struct run_queue {
+    struct list_node list[NUM_PRIORITIES];
+    uint32_t bitmap;
+    int curr_priority; /* priority of the thread running on this cpu */
+#if KERNEL_DEADLINE
+    struct list_node dl_list; /* ready deadline threads, earliest deadline first */
+    lk_bigtime_t curr_deadline; /* of the deadline thread running on this cpu, 0 if none */
+    uint32_t dl_util; /* admitted deadline threads' runtime / deadline, parts per million */
+#endif
+} __CPU_ALIGN;
+
+static struct run_queue run_queue[SMP_MAX_CPUS];
+
+#if WITH_KERNEL_VM
+/* vmm stacks of detached threads that have exited, linked through the bottom of the stack.
+ * a dying thread keeps the thread lock until it has switched away, so anything on the list
+ * is safe to free once the lock has been taken. */
+struct dead_kstack {
+    struct dead_kstack *next;
+    size_t size;
+};
+
+static struct dead_kstack *dead_kstacks;
+
+static void reap_dead_kstacks(void)
+{
+    if (!dead_kstacks)
+        return;
+
+    THREAD_LOCK(state);
+    struct dead_kstack *ds = dead_kstacks;
+    dead_kstacks = NULL;
+    THREAD_UNLOCK(state);
+
+    while (ds) {
+        struct dead_kstack *next = ds->next;
+        vmm_free_kstack(ds, ds->size);
+        ds = next;
+    }
+}
+#endif
+
+/* exited threads kept for reuse by thread_create_etc, together with the stack they owned.
+ * linked through thread_list_node and protected by the thread lock. a detached thread puts
+ * itself here while still running on its stack, but the lock is not dropped until it has
+ * switched away. */
+#ifndef THREAD_CACHE_MAX
+#define THREAD_CACHE_MAX 8
+#endif
+
+#define THREAD_FLAG_OWNED_STACK (THREAD_FLAG_FREE_STACK | THREAD_FLAG_KSTACK)
+
+static struct list_node thread_cache = LIST_INITIAL_VALUE(thread_cache);
+static uint thread_cache_count;
+
+static bool thread_cache_put_locked(thread_t *t)
+{
+    if (!(t->flags & THREAD_FLAG_FREE_STRUCT) || thread_cache_count >= THREAD_CACHE_MAX)
+        return false;
+
+    if (!(t->flags & THREAD_FLAG_OWNED_STACK))
+        t->stack = NULL;
+
+    list_add_head(&thread_cache, &t->thread_list_node);
+    thread_cache_count++;
+
+    return true;
+}
+
+static thread_t *thread_cache_get(void)
+{
+    THREAD_LOCK(state);
+    thread_t *t = list_remove_head_type(&thread_cache, thread_t, thread_list_node);
+    if (t)
+        thread_cache_count--;
+    THREAD_UNLOCK(state);
+
+    return t;
+}
+
+/* free a stack allocated by thread_create_etc, not for the currently running thread */
+static void free_thread_stack(void *stack, size_t stack_size, uint flags)
+{
+    if (!stack)
+        return;
+
+    if (flags & THREAD_FLAG_FREE_STACK)
+        free(stack);
+#if WITH_KERNEL_VM
+    if (flags & THREAD_FLAG_KSTACK)
+        vmm_free_kstack(stack, stack_size);
+#endif
+}
 
 /* make sure the bitmap is large enough to cover our number of priorities */
-STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue_bitmap) * 8);
+STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue[0].bitmap) * 8);
 
 /* the idle thread(s) (statically allocated) */
 #if WITH_SMP
@@ -83,13 +177,271 @@ static thread_t _idle_thread;
 /* local routines */
 static void thread_resched(void);
 static void idle_thread_routine(void) __NO_RETURN;
+#if KERNEL_TICKLESS
+static enum handler_return thread_quantum_expired(struct timer *t, lk_time_t now, void *arg);
+#endif
+
+/* length of a scheduler tick, quantums are counted in ticks */
+#define THREAD_TICK_MS 10
+
+#if KERNEL_TICKLESS && !PLATFORM_HAS_DYNAMIC_TIMER
+#error tickless scheduling requires a platform with a dynamic timer
+#endif
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
 /* preemption timer */
 static timer_t preempt_timer[SMP_MAX_CPUS];
+#if KERNEL_TICKLESS
+/* when the running thread's quantum started being consumed */
+static lk_time_t quantum_start[SMP_MAX_CPUS];
+#endif
+#endif
+
+#if KERNEL_DEADLINE
+/* how much of each cpu deadline threads may be promised, in parts per million */
+#ifndef THREAD_DEADLINE_MAX_UTIL
+#define THREAD_DEADLINE_MAX_UTIL 950000
+#endif
+
+/* runtime enforcement for the deadline thread running on each cpu */
+static timer_t dl_budget_timer[SMP_MAX_CPUS];
+
+static inline bool thread_is_deadline(thread_t *t)
+{
+    return t->dl.runtime != 0;
+}
+
+/* would deadline thread t preempt whatever is running on cpu */
+static bool dl_preempts(thread_t *t, uint cpu)
+{
+    lk_bigtime_t curr = run_queue[cpu].curr_deadline;
+    return curr == 0 || t->dl.abs_deadline < curr;
+}
+#else
+static inline bool thread_is_deadline(thread_t *t)
+{
+    return false;
+}
 #endif
 
 /* run queue manipulation */
+
+#if WITH_SMP
+/* mask of all the cpus that could possibly exist */
+#define VALID_CPU_MASK ((SMP_MAX_CPUS >= 32) ? THREAD_CPU_MASK_ALL : ((1U << SMP_MAX_CPUS) - 1))
+
+/* can the thread be scheduled on the passed in cpu */
+static bool thread_can_run_on(thread_t *t, uint cpu)
+{
+#if KERNEL_DEADLINE
+    if (thread_is_deadline(t))
+        return (uint)t->dl.cpu == cpu;
+#endif
+    if (t->pinned_cpu >= 0)
+        return (uint)t->pinned_cpu == cpu;
+
+    return !!(t->cpu_mask & (1U << cpu));
+}
+#endif
+
+/* the set of cpus that may pick up the thread once it is ready */
+static mp_cpu_mask_t thread_allowed_cpus(thread_t *t)
+{
+#if WITH_SMP
+#if KERNEL_DEADLINE
+    if (thread_is_deadline(t))
+        return 1U << t->dl.cpu;
+#endif
+    if (t->pinned_cpu >= 0)
+        return 1U << t->pinned_cpu;
+
+    return t->cpu_mask;
+#else
+    return MP_CPU_ALL_BUT_LOCAL;
+#endif
+}
+
+/* wakeups on each cpu whose reschedule ipis haven't gone out yet */
+struct wake_batch {
+    uint depth;             /* thread_wake_batch_begin() nesting */
+    mp_cpu_mask_t ipis;     /* cpus to poke once the batch or lock hold ends */
+    bool resched;           /* a thread woken in the batch should preempt this cpu */
+};
+
+static struct wake_batch wake_batch[SMP_MAX_CPUS];
+
+static mp_cpu_mask_t wakeup_target(thread_t *t, mp_cpu_mask_t exclude);
+
+/* should t, just made ready, take this cpu from the running thread */
+static bool thread_preempts_local(thread_t *t, uint cpu)
+{
+#if KERNEL_DEADLINE
+    if (thread_is_deadline(t))
+        return (uint)t->dl.cpu == cpu && dl_preempts(t, cpu);
+    if (run_queue[cpu].curr_deadline)
+        return false;
+#endif
+#if WITH_SMP
+    if (!thread_can_run_on(t, cpu))
+        return false;
+#endif
+    return t->priority > get_current_thread()->priority;
+}
+
+/*
+ * t was just made ready. Rather than sending an ipi right away, add the cpu
+ * picked for it to this cpu's pending set, which goes out when the thread lock
+ * is released or the enclosing batch ends. Cpus already in the set are passed
+ * over for further threads, so each one is poked once and the threads spread
+ * out, as wait_queue_wake_all() always did. Thread lock must be held.
+ */
+static void wake_reschedule(thread_t *t)
+{
+    uint cpu = arch_curr_cpu_num();
+    struct wake_batch *b = &wake_batch[cpu];
+
+    mp_cpu_mask_t target = wakeup_target(t, b->ipis);
+    b->ipis |= target;
+
+    if (b->depth > 0 && target == 0 && thread_preempts_local(t, cpu))
+        b->resched = true;
+}
+
+#if WITH_SMP
+void thread_flush_wakeups(void)
+{
+    struct wake_batch *b = &wake_batch[arch_curr_cpu_num()];
+
+    if (b->depth == 0 && b->ipis) {
+        mp_cpu_mask_t target = b->ipis;
+        b->ipis = 0;
+        mp_reschedule(target, 0);
+    }
+}
+#endif
+
+void thread_wake_batch_begin(void)
+{
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    wake_batch[arch_curr_cpu_num()].depth++;
+}
+
+enum handler_return thread_wake_batch_end(void)
+{
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    struct wake_batch *b = &wake_batch[arch_curr_cpu_num()];
+    DEBUG_ASSERT(b->depth > 0);
+
+    if (--b->depth > 0)
+        return INT_NO_RESCHEDULE;
+
+    if (b->ipis) {
+        mp_cpu_mask_t target = b->ipis;
+        b->ipis = 0;
+        mp_reschedule(target, 0);
+    }
+
+    bool resched = b->resched;
+    b->resched = false;
+    return resched ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
+}
+
+/* select which cpu's run queue a ready thread goes into */
+static uint run_queue_cpu(thread_t *t)
+{
+#if WITH_SMP
+#if KERNEL_DEADLINE
+    if (thread_is_deadline(t))
+        return t->dl.cpu;
+#endif
+    if (t->pinned_cpu >= 0)
+        return t->pinned_cpu;
+
+    /* prefer the cpu it last ran on, its cache is most likely to still be warm */
+    if (t->last_cpu >= 0 && thread_can_run_on(t, t->last_cpu) && mp_is_cpu_active(t->last_cpu))
+        return t->last_cpu;
+
+    uint cpu = arch_curr_cpu_num();
+    if (thread_can_run_on(t, cpu))
+        return cpu;
+
+    /* the first allowed cpu that is up, or failing that any allowed cpu */
+    mp_cpu_mask_t active = t->cpu_mask & mp.active_cpus;
+    return __builtin_ctz(active ? active : t->cpu_mask);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Pick the one cpu best placed to run a thread that just became ready, rather
+ * than poking every cpu and having them all race for the thread lock. In order
+ * of preference: the cpu it was queued on if idle, any other idle cpu it may run
+ * on, or the allowed cpu running the least important thread if that is less
+ * important than this one. Cpus in exclude are not considered.
+ *
+ * Returns the mask to pass to mp_reschedule(), which may be empty.
+ */
+static mp_cpu_mask_t wakeup_target(thread_t *t, mp_cpu_mask_t exclude)
+{
+#if WITH_SMP
+    uint queue_cpu = run_queue_cpu(t);
+    mp_cpu_mask_t allowed = thread_allowed_cpus(t) & mp.active_cpus & ~mp.realtime_cpus;
+    allowed &= ~(exclude | (1U << arch_curr_cpu_num()));
+
+    if (allowed == 0)
+        return 0;
+
+#if KERNEL_DEADLINE
+    /* its cpu is the only choice, and only worth poking if it would preempt */
+    if (thread_is_deadline(t))
+        return dl_preempts(t, queue_cpu) ? allowed : 0;
+#endif
+
+    mp_cpu_mask_t idle = allowed & mp.idle_cpus;
+    if (idle) {
+        if (idle & (1U << queue_cpu))
+            return 1U << queue_cpu;
+        return 1U << __builtin_ctz(idle);
+    }
+
+    if ((allowed & (1U << queue_cpu)) && run_queue[queue_cpu].curr_priority < t->priority)
+        return 1U << queue_cpu;
+
+    int lowest_priority = t->priority;
+    mp_cpu_mask_t target = 0;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if ((allowed & (1U << i)) && run_queue[i].curr_priority < lowest_priority) {
+            lowest_priority = run_queue[i].curr_priority;
+            target = 1U << i;
+        }
+    }
+
+    return target;
+#else
+    return 0;
+#endif
+}
+
+#if KERNEL_DEADLINE
+/* queue a deadline thread by its deadline, ahead of or behind others due at the same time */
+static void dl_insert(struct run_queue *rq, thread_t *t, bool head)
+{
+    thread_t *entry;
+
+    list_for_every_entry(&rq->dl_list, entry, thread_t, queue_node) {
+        if (head ? entry->dl.abs_deadline >= t->dl.abs_deadline
+                 : entry->dl.abs_deadline > t->dl.abs_deadline) {
+            list_add_before(&entry->queue_node, &t->queue_node);
+            return;
+        }
+    }
+    list_add_tail(&rq->dl_list, &t->queue_node);
+}
+#endif
+
 static void insert_in_run_queue_head(thread_t *t)
 {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
@@ -98,8 +450,19 @@ static void insert_in_run_queue_head(thread_t *t)
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    list_add_head(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    struct run_queue *rq = &run_queue[run_queue_cpu(t)];
+
+#if THREAD_STATS
+    t->ready_time = current_time_hires();
+#endif
+#if KERNEL_DEADLINE
+    if (thread_is_deadline(t)) {
+        dl_insert(rq, t, true);
+        return;
+    }
+#endif
+    list_add_head(&rq->list[t->priority], &t->queue_node);
+    rq->bitmap |= (1<<t->priority);
 }
 
 static void insert_in_run_queue_tail(thread_t *t)
@@ -110,15 +473,113 @@ static void insert_in_run_queue_tail(thread_t *t)
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    list_add_tail(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    struct run_queue *rq = &run_queue[run_queue_cpu(t)];
+
+#if THREAD_STATS
+    t->ready_time = current_time_hires();
+#endif
+#if KERNEL_DEADLINE
+    if (thread_is_deadline(t)) {
+        dl_insert(rq, t, false);
+        return;
+    }
+#endif
+    list_add_tail(&rq->list[t->priority], &t->queue_node);
+    rq->bitmap |= (1<<t->priority);
+}
+
+static void remove_from_run_queue(struct run_queue *rq, thread_t *t)
+{
+    list_delete(&t->queue_node);
+    if (thread_is_deadline(t))
+        return;
+
+    if (list_is_empty(&rq->list[t->priority]))
+        rq->bitmap &= ~(1<<t->priority);
 }
 
+/* remove a ready thread from whichever cpu's run queue it was put in */
+static void dequeue_ready_thread(thread_t *t)
+{
+    DEBUG_ASSERT(t->state == THREAD_READY);
+    DEBUG_ASSERT(list_in_list(&t->queue_node));
+
+    list_delete(&t->queue_node);
+    if (thread_is_deadline(t))
+        return;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (list_is_empty(&run_queue[i].list[t->priority]))
+            run_queue[i].bitmap &= ~(1<<t->priority);
+    }
+}
+
+/* highest priority with a thread queued, or -1 if the queue is empty */
+static int run_queue_top_priority(const struct run_queue *rq)
+{
+    if (rq->bitmap == 0)
+        return -1;
+
+    return sizeof(rq->bitmap) * 8 - 1 - __builtin_clz(rq->bitmap);
+}
+
+#if THREAD_STATS
+static inline uint sched_hist_bucket(lk_bigtime_t usecs)
+{
+    if (usecs == 0)
+        return 0;
+
+    uint bucket = 64 - __builtin_clzll(usecs);
+    return MIN(bucket, THREAD_STATS_HIST_BUCKETS - 1);
+}
+
+void thread_sched_hist_reset(void)
+{
+    THREAD_LOCK(state);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        memset(percpu_ptr(thread_sched_hist, i), 0, sizeof(struct thread_sched_hist));
+    THREAD_UNLOCK(state);
+}
+
+size_t thread_get_runtimes(struct thread_runtime *buf, size_t count)
+{
+    size_t total = 0;
+    thread_t *t;
+
+    THREAD_LOCK(state);
+    lk_bigtime_t now = current_time_hires();
+    list_for_every_entry(&thread_list, t, thread_t, thread_list_node) {
+        if (total < count) {
+            struct thread_runtime *r = &buf[total];
+            r->t = t;
+            r->runtime = t->runtime;
+            /* include the slice it is in the middle of */
+            if (t->state == THREAD_RUNNING)
+                r->runtime += now - t->run_start;
+            r->priority = t->priority;
+            strlcpy(r->name, t->name, sizeof(r->name));
+        }
+        total++;
+    }
+    THREAD_UNLOCK(state);
+
+    return total;
+}
+#endif
+
 void init_thread_struct(thread_t *t, const char *name)
 {
     memset(t, 0, sizeof(thread_t));
     t->magic = THREAD_MAGIC;
     thread_set_pinned_cpu(t, -1);
+    thread_set_last_cpu(t, -1);
+#if WITH_SMP
+    t->cpu_mask = VALID_CPU_MASK;
+#endif
+    t->inherited_priority = -1;
+    list_initialize(&t->held_mutexes);
+#if KERNEL_DEADLINE
+    timer_initialize(&t->dl.timer);
+#endif
     strlcpy(t->name, name, sizeof(t->name));
 }
 
@@ -152,11 +613,22 @@ void init_thread_struct(thread_t *t, const char *name)
 thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine entry, void *arg, int priority, void *stack, size_t stack_size)
 {
     unsigned int flags = 0;
+    void *old_stack = NULL;
+    size_t old_stack_size = 0;
+    uint old_stack_flags = 0;
 
     if (!t) {
-        t = malloc(sizeof(thread_t));
-        if (!t)
-            return NULL;
+        /* recycle an exited thread if there is one, hanging on to its stack */
+        t = thread_cache_get();
+        if (t) {
+            old_stack = t->stack;
+            old_stack_size = t->stack_size;
+            old_stack_flags = t->flags & THREAD_FLAG_OWNED_STACK;
+        } else {
+            t = malloc(sizeof(thread_t));
+            if (!t)
+                return NULL;
+        }
         flags |= THREAD_FLAG_FREE_STRUCT;
     }
 
@@ -164,7 +636,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 
     t->entry = entry;
     t->arg = arg;
-    t->priority = priority;
+    t->priority = t->base_priority = priority;
     t->state = THREAD_SUSPENDED;
     t->blocking_wait_queue = NULL;
     t->wait_queue_block_ret = NO_ERROR;
@@ -183,17 +655,33 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
         stack_size += THREAD_STACK_PADDING_SIZE;
         flags |= THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK;
 #endif
-        t->stack = malloc(stack_size);
-        if (!t->stack) {
-            if (flags & THREAD_FLAG_FREE_STRUCT)
-                free(t);
-            return NULL;
+        if (old_stack && old_stack_size == stack_size) {
+            t->stack = old_stack;
+            flags |= old_stack_flags;
+        } else {
+            free_thread_stack(old_stack, old_stack_size, old_stack_flags);
+#if WITH_KERNEL_VM
+            /* guarded stack from the vmm, falling back to the heap before it is up */
+            reap_dead_kstacks();
+            t->stack = vmm_alloc_kstack(stack_size);
+            if (t->stack)
+                flags |= THREAD_FLAG_KSTACK;
+            else
+#endif
+                t->stack = malloc(stack_size);
+            if (!t->stack) {
+                if (flags & THREAD_FLAG_FREE_STRUCT)
+                    free(t);
+                return NULL;
+            }
+            if (!(flags & THREAD_FLAG_KSTACK))
+                flags |= THREAD_FLAG_FREE_STACK;
         }
-        flags |= THREAD_FLAG_FREE_STACK;
 #if THREAD_STACK_BOUNDS_CHECK
         memset(t->stack, STACK_DEBUG_BYTE, THREAD_STACK_PADDING_SIZE);
 #endif
     } else {
+        free_thread_stack(old_stack, old_stack_size, old_stack_flags);
         t->stack = stack;
     }
 #if THREAD_STACK_HIGHWATER
@@ -269,9 +757,364 @@ static bool thread_is_idle(thread_t *t)
     return !!(t->flags & THREAD_FLAG_IDLE);
 }
 
+/* threads that are not subject to the quantum */
 static bool thread_is_real_time_or_idle(thread_t *t)
 {
-    return !!(t->flags & (THREAD_FLAG_REAL_TIME | THREAD_FLAG_IDLE));
+    return !!(t->flags & (THREAD_FLAG_REAL_TIME | THREAD_FLAG_IDLE)) || thread_is_deadline(t);
+}
+
+#if KERNEL_DEADLINE
+/*
+ * Deadline scheduling. Deadline threads are partitioned, each one admitted on
+ * and bound to a single cpu, where they are picked strictly earliest deadline
+ * first ahead of the priority run queues. With the runtime / deadline of every
+ * deadline thread on a cpu adding up to no more than 1, they all get their
+ * runtime by their deadlines as long as none overruns, which is what the
+ * runtime enforcement takes care of.
+ */
+
+/* kernel timers count in ms, round up so periods never start early */
+static lk_time_t dl_delay(int64_t usecs)
+{
+    return (usecs > 0) ? (lk_time_t)((usecs + 999) / 1000) : 0;
+}
+
+/* move t on to its next period, skipping any that went by entirely while it
+ * was still busy with the last. returns true if the period has already begun. */
+static bool dl_next_period(thread_t *t, lk_bigtime_t now)
+{
+    struct thread_deadline *dl = &t->dl;
+
+    dl->release += dl->period;
+    if (dl->release + dl->period <= now) {
+        lk_bigtime_t skipped = (now - dl->release) / dl->period;
+        dl->release += skipped * dl->period;
+        dl->stats.misses += skipped;
+    }
+
+    return dl->release <= now;
+}
+
+static void dl_start_period(thread_t *t)
+{
+    t->dl.abs_deadline = t->dl.release + t->dl.deadline;
+    t->dl.budget = t->dl.runtime;
+}
+
+/* timer callback, the next period of a throttled or waiting thread begins */
+static enum handler_return dl_release_handler(timer_t *timer, lk_time_t now, void *arg)
+{
+    thread_t *t = (thread_t *)arg;
+
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(t->state == THREAD_SLEEPING);
+
+    THREAD_LOCK(state);
+
+    dl_start_period(t);
+    t->state = THREAD_READY;
+    insert_in_run_queue_head(t);
+    wake_reschedule(t);
+
+    THREAD_UNLOCK(state);
+
+    return INT_RESCHEDULE;
+}
+
+/* timer callback, the running deadline thread may have used up its budget,
+ * thread_resched() charges it and decides */
+static enum handler_return dl_budget_expired(timer_t *timer, lk_time_t now, void *arg)
+{
+    return INT_RESCHEDULE;
+}
+
+/* sleep until t's next period, which must be in the future. thread lock held. */
+static void dl_sleep_until_release(thread_t *t, lk_bigtime_t now)
+{
+    t->state = THREAD_SLEEPING;
+    timer_set_oneshot(&t->dl.timer, dl_delay(t->dl.release - now), dl_release_handler, t);
+}
+
+/* t is giving up the cpu it has been running on, charge it for the time and
+ * throttle it if it is still ready to run but out of budget */
+static void dl_charge(uint cpu, thread_t *t, lk_bigtime_t now)
+{
+    struct thread_deadline *dl = &t->dl;
+
+    timer_cancel(&dl_budget_timer[cpu]);
+
+    lk_bigtime_t ran = now - dl->slice_start;
+    dl->budget -= ran;
+    dl->job_runtime += ran;
+    dl->slice_start = now;
+
+    if (dl->budget > 0 || t->state != THREAD_READY)
+        return;
+
+    /* an overrun always costs the deadline, the rest will only run next period */
+    dl->stats.overruns++;
+    dl->stats.misses++;
+    remove_from_run_queue(&run_queue[cpu], t);
+    if (dl_next_period(t, now)) {
+        dl_start_period(t);
+        insert_in_run_queue_tail(t);
+    } else {
+        dl_sleep_until_release(t, now);
+    }
+}
+
+/* t is about to run on cpu, arm the budget timer for what it has left */
+static void dl_start_slice(uint cpu, thread_t *t, lk_bigtime_t now)
+{
+    t->dl.slice_start = now;
+    run_queue[cpu].curr_deadline = t->dl.abs_deadline;
+    timer_set_oneshot(&dl_budget_timer[cpu], dl_delay(t->dl.budget), dl_budget_expired, NULL);
+}
+
+/* give back the bandwidth t was admitted with. thread lock held. */
+static void dl_release_bandwidth(thread_t *t)
+{
+    if (!thread_is_deadline(t))
+        return;
+
+    run_queue[t->dl.cpu].dl_util -= t->dl.util;
+    t->dl.runtime = 0;
+    t->dl.util = 0;
+    if (t == get_current_thread()) {
+        timer_cancel(&dl_budget_timer[arch_curr_cpu_num()]);
+        run_queue[arch_curr_cpu_num()].curr_deadline = 0;
+    }
+}
+
+/* the least loaded cpu t may run on with room for util more, or -1 */
+static int dl_pick_cpu(thread_t *t, uint32_t util)
+{
+#if WITH_SMP
+    mp_cpu_mask_t allowed = (t->pinned_cpu >= 0) ? (1U << t->pinned_cpu) : t->cpu_mask;
+    allowed &= mp.active_cpus;
+#else
+    mp_cpu_mask_t allowed = 1;
+#endif
+    int best = -1;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!(allowed & (1U << i)))
+            continue;
+        if (run_queue[i].dl_util + util > THREAD_DEADLINE_MAX_UTIL)
+            continue;
+        if (best < 0 || run_queue[i].dl_util < run_queue[best].dl_util)
+            best = i;
+    }
+
+    return best;
+}
+
+/**
+ * @brief Make a thread a deadline thread, or a normal one again
+ *
+ * See <kernel/thread.h> for the scheduling model.
+ *
+ * @param t Thread to change, the current thread or one not yet resumed
+ * @param params Runtime, period and deadline, NULL for a normal thread
+ *
+ * @return NO_ERROR on success
+ */
+status_t thread_set_deadline(thread_t *t, const struct thread_deadline_params *params)
+{
+    if (!t)
+        return ERR_INVALID_ARGS;
+
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+
+    uint32_t util = 0;
+    lk_bigtime_t deadline = 0;
+    if (params && params->runtime) {
+        deadline = params->deadline ? params->deadline : params->period;
+        if (params->runtime > deadline || deadline > params->period)
+            return ERR_INVALID_ARGS;
+        /* round up, so rounding never admits more than fits */
+        util = (uint32_t)((params->runtime * 1000000 + deadline - 1) / deadline);
+    }
+
+    if (thread_is_idle(t))
+        return ERR_NOT_ALLOWED;
+
+    status_t err = NO_ERROR;
+    thread_t *current_thread = get_current_thread();
+
+    THREAD_LOCK(state);
+
+    if (t != current_thread && t->state != THREAD_SUSPENDED) {
+        err = ERR_BAD_STATE;
+        goto out;
+    }
+
+    int cpu = -1;
+    if (util) {
+        /* don't count what it already has against itself */
+        if (thread_is_deadline(t))
+            run_queue[t->dl.cpu].dl_util -= t->dl.util;
+        cpu = dl_pick_cpu(t, util);
+        if (thread_is_deadline(t))
+            run_queue[t->dl.cpu].dl_util += t->dl.util;
+        if (cpu < 0) {
+            err = ERR_NO_RESOURCES;
+            goto out;
+        }
+    }
+
+    dl_release_bandwidth(t);
+
+    if (util) {
+        lk_bigtime_t now = current_time_hires();
+        struct thread_deadline *dl = &t->dl;
+
+        dl->runtime = params->runtime;
+        dl->period = params->period;
+        dl->deadline = deadline;
+        dl->util = util;
+        dl->cpu = cpu;
+        dl->release = now;
+        dl->slice_start = now;
+        dl->job_runtime = 0;
+        memset(&dl->stats, 0, sizeof(dl->stats));
+        dl_start_period(t);
+        run_queue[cpu].dl_util += util;
+    }
+
+    if (t == current_thread) {
+        /* requeue in the new class, and on the new cpu if it has to move */
+        current_thread->state = THREAD_READY;
+        insert_in_run_queue_head(current_thread);
+        wake_reschedule(current_thread);
+        thread_resched();
+    }
+
+out:
+    THREAD_UNLOCK(state);
+
+    return err;
+}
+
+/**
+ * @brief Finish the current period's work and wait for the next period
+ *
+ * If the next period has already started the thread carries on right away,
+ * periods that went by entirely are skipped and counted as misses.
+ *
+ * @return NO_ERROR, or ERR_BAD_STATE if the current thread is not a deadline thread
+ */
+status_t thread_deadline_wait(void)
+{
+    thread_t *current_thread = get_current_thread();
+
+    if (!thread_is_deadline(current_thread))
+        return ERR_BAD_STATE;
+
+    THREAD_LOCK(state);
+
+    struct thread_deadline *dl = &current_thread->dl;
+    lk_bigtime_t now = current_time_hires();
+
+    /* charge up to now, so the stats see this period's full runtime */
+    lk_bigtime_t ran = now - dl->slice_start;
+    dl->budget -= ran;
+    dl->job_runtime += ran;
+    dl->slice_start = now;
+
+    dl->stats.jobs++;
+    dl->stats.max_runtime = MAX(dl->stats.max_runtime, dl->job_runtime);
+    dl->job_runtime = 0;
+    if (now > dl->abs_deadline)
+        dl->stats.misses++;
+
+    if (dl_next_period(current_thread, now)) {
+        dl_start_period(current_thread);
+        current_thread->state = THREAD_READY;
+        insert_in_run_queue_tail(current_thread);
+    } else {
+        dl_sleep_until_release(current_thread, now);
+    }
+    thread_resched();
+
+    THREAD_UNLOCK(state);
+
+    return NO_ERROR;
+}
+
+status_t thread_get_deadline_stats(thread_t *t, struct thread_deadline_stats *stats)
+{
+    if (!t || !stats)
+        return ERR_INVALID_ARGS;
+
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+
+    status_t err = NO_ERROR;
+
+    THREAD_LOCK(state);
+    if (thread_is_deadline(t))
+        *stats = t->dl.stats;
+    else
+        err = ERR_BAD_STATE;
+    THREAD_UNLOCK(state);
+
+    return err;
+}
+#endif
+
+/**
+ * @brief Restrict the set of cpus a thread may run on
+ *
+ * Threads pinned to a single cpu ignore their mask until unpinned. If the
+ * thread is currently running or queued on a cpu outside of the new mask it
+ * is moved the next time it is rescheduled.
+ *
+ * @param t Thread to modify
+ * @param mask Bitmap of cpus the thread may run on
+ *
+ * @return NO_ERROR on success, ERR_INVALID_ARGS if no valid cpu is in mask
+ */
+status_t thread_set_cpu_mask(thread_t *t, mp_cpu_mask_t mask)
+{
+    if (!t)
+        return ERR_INVALID_ARGS;
+
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+
+#if WITH_SMP
+    mask &= VALID_CPU_MASK;
+    if (mask == 0)
+        return ERR_INVALID_ARGS;
+
+    if (thread_is_idle(t))
+        return ERR_NOT_ALLOWED;
+
+    THREAD_LOCK(state);
+
+    t->cpu_mask = mask;
+
+    if (t->state == THREAD_READY && list_in_list(&t->queue_node)) {
+        /* pull it out of whichever queue it is in and requeue it on an allowed cpu */
+        dequeue_ready_thread(t);
+        insert_in_run_queue_tail(t);
+        mp_reschedule(wakeup_target(t, 0), 0);
+    } else if (t->state == THREAD_RUNNING && !thread_can_run_on(t, t->curr_cpu)) {
+        if (t == get_current_thread()) {
+            /* move ourselves over to an allowed cpu */
+            t->state = THREAD_READY;
+            insert_in_run_queue_head(t);
+            mp_reschedule(wakeup_target(t, 0), 0);
+            thread_resched();
+        } else {
+            /* kick the cpu it is running on, it will get requeued when preempted */
+            mp_reschedule(1U << t->curr_cpu, MP_RESCHEDULE_FLAG_REALTIME);
+        }
+    }
+
+    THREAD_UNLOCK(state);
+#endif
+
+    return NO_ERROR;
 }
 
 /**
@@ -297,10 +1140,9 @@ status_t thread_resume(thread_t *t)
         insert_in_run_queue_head(t);
         if (!ints_disabled) /* HACK, don't resced into bootstrap thread before idle thread is set up */
             resched = true;
+        wake_reschedule(t);
     }
 
-    mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
-
     THREAD_UNLOCK(state);
 
     if (resched)
@@ -354,14 +1196,17 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout)
     /* clear the structure's magic */
     t->magic = 0;
 
+    /* keep it around for the next thread_create, or free its stack and the structure itself */
+    bool cached = thread_cache_put_locked(t);
+
     THREAD_UNLOCK(state);
 
-    /* free its stack and the thread structure itself */
-    if (t->flags & THREAD_FLAG_FREE_STACK && t->stack)
-        free(t->stack);
+    if (!cached) {
+        free_thread_stack(t->stack, t->stack_size, t->flags);
 
-    if (t->flags & THREAD_FLAG_FREE_STRUCT)
-        free(t);
+        if (t->flags & THREAD_FLAG_FREE_STRUCT)
+            free(t);
+    }
 
     return NO_ERROR;
 }
@@ -411,6 +1256,10 @@ void thread_exit(int retcode)
     current_thread->state = THREAD_DEATH;
     current_thread->retcode = retcode;
 
+#if KERNEL_DEADLINE
+    dl_release_bandwidth(current_thread);
+#endif
+
     /* if we're detached, then do our teardown here */
     if (current_thread->flags & THREAD_FLAG_DETACHED) {
         /* remove it from the master thread list */
@@ -419,16 +1268,29 @@ void thread_exit(int retcode)
         /* clear the structure's magic */
         current_thread->magic = 0;
 
-        /* free its stack and the thread structure itself */
-        if (current_thread->flags & THREAD_FLAG_FREE_STACK && current_thread->stack) {
-            heap_delayed_free(current_thread->stack);
+        /* keep it around for the next thread_create, or free its stack and the structure itself */
+        if (!thread_cache_put_locked(current_thread)) {
+            if (current_thread->flags & THREAD_FLAG_FREE_STACK && current_thread->stack) {
+                heap_delayed_free(current_thread->stack);
 
-            /* make sure its not going to get a bounds check performed on the half-freed stack */
-            current_thread->flags &= ~THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK;
-        }
+                /* make sure its not going to get a bounds check performed on the half-freed stack */
+                current_thread->flags &= ~THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK;
+            }
+#if WITH_KERNEL_VM
+            /* still running on it, leave it for the next thread_create to free */
+            if (current_thread->flags & THREAD_FLAG_KSTACK && current_thread->stack) {
+                struct dead_kstack *ds = current_thread->stack;
+                ds->size = current_thread->stack_size;
+                ds->next = dead_kstacks;
+                dead_kstacks = ds;
+
+                current_thread->flags &= ~THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK;
+            }
+#endif
 
-        if (current_thread->flags & THREAD_FLAG_FREE_STRUCT)
-            heap_delayed_free(current_thread);
+            if (current_thread->flags & THREAD_FLAG_FREE_STRUCT)
+                heap_delayed_free(current_thread);
+        }
     } else {
         /* signal if anyone is waiting */
         wait_queue_wake_all(&current_thread->retcode_wait_queue, false, 0);
@@ -443,34 +1305,82 @@ void thread_exit(int retcode)
 static void idle_thread_routine(void)
 {
     for (;;)
-        arch_idle();
+        cpuidle_enter();
 }
 
+#if WITH_SMP
+/* find the highest priority thread above min_priority sitting in another cpu's
+ * run queue that is allowed to migrate to this cpu */
+static thread_t *find_steal_candidate(uint cpu, int min_priority, struct run_queue **out_rq)
+{
+    thread_t *best = NULL;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (i == cpu)
+            continue;
+
+        struct run_queue *rq = &run_queue[i];
+        uint32_t bitmap = rq->bitmap;
+
+        /* only look at priorities better than what we've found so far */
+        if (min_priority >= 0)
+            bitmap &= ~((2U << min_priority) - 1);
+
+        while (bitmap) {
+            uint next_queue = sizeof(bitmap) * 8 - 1 - __builtin_clz(bitmap);
+            thread_t *t;
+
+            list_for_every_entry(&rq->list[next_queue], t, thread_t, queue_node) {
+                /* threads pinned to or confined away from this cpu stay where they are */
+                if (thread_can_run_on(t, cpu)) {
+                    best = t;
+                    *out_rq = rq;
+                    min_priority = next_queue;
+                    goto next_cpu;
+                }
+            }
+
+            bitmap &= ~(1<<next_queue);
+        }
+next_cpu:
+        ;
+    }
+
+    return best;
+}
+#endif
+
 static thread_t *get_top_thread(int cpu)
 {
+    struct run_queue *rq = &run_queue[cpu];
+    int priority = run_queue_top_priority(rq);
     thread_t *newthread;
-    uint32_t local_run_queue_bitmap = run_queue_bitmap;
 
-    while (local_run_queue_bitmap) {
-        /* find the first (remaining) queue with a thread in it */
-        uint next_queue = sizeof(run_queue_bitmap) * 8 - 1 - __builtin_clz(local_run_queue_bitmap);
+#if KERNEL_DEADLINE
+    /* deadline threads go ahead of every priority level */
+    newthread = list_remove_head_type(&rq->dl_list, thread_t, queue_node);
+    if (newthread)
+        return newthread;
+#endif
 
-        list_for_every_entry(&run_queue[next_queue], newthread, thread_t, queue_node) {
 #if WITH_SMP
-            if (newthread->pinned_cpu < 0 || newthread->pinned_cpu == cpu)
+    /* pull work from another cpu if this one is about to go idle or if something
+     * more important than anything queued locally is waiting elsewhere */
+    struct run_queue *steal_rq;
+    newthread = find_steal_candidate(cpu, priority, &steal_rq);
+    if (newthread) {
+        remove_from_run_queue(steal_rq, newthread);
+        THREAD_STATS_INC(steals);
+        return newthread;
+    }
 #endif
-            {
-                list_delete(&newthread->queue_node);
-
-                if (list_is_empty(&run_queue[next_queue]))
-                    run_queue_bitmap &= ~(1<<next_queue);
-
-                return newthread;
-            }
-        }
 
-        local_run_queue_bitmap &= ~(1<<next_queue);
+    if (priority >= 0) {
+        newthread = list_peek_head_type(&rq->list[priority], thread_t, queue_node);
+        remove_from_run_queue(rq, newthread);
+        return newthread;
     }
+
     /* no threads to run, select the idle thread for this cpu */
     return idle_thread(cpu);
 }
@@ -499,6 +1409,26 @@ void thread_resched(void)
 
     THREAD_STATS_INC(reschedules);
 
+#if WITH_SMP
+    /* the outgoing thread can't be in an rcu read section */
+    rcu_note_quiescent();
+
+    /* whatever was woken on the way here must not wait for us to be switched back in */
+    if (wake_batch[cpu].ipis) {
+        mp_reschedule(wake_batch[cpu].ipis, 0);
+        wake_batch[cpu].ipis = 0;
+    }
+#endif
+
+#if KERNEL_DEADLINE
+    /* charge before picking, an overrunning thread must not be picked again */
+    lk_bigtime_t dl_now = 0;
+    if (thread_is_deadline(current_thread)) {
+        dl_now = current_time_hires();
+        dl_charge(cpu, current_thread, dl_now);
+    }
+#endif
+
     newthread = get_top_thread(cpu);
 
     DEBUG_ASSERT(newthread);
@@ -507,6 +1437,14 @@ void thread_resched(void)
 
     oldthread = current_thread;
 
+#if KERNEL_DEADLINE
+    if (thread_is_deadline(newthread))
+        dl_start_slice(cpu, newthread, dl_now ? dl_now : current_time_hires());
+    else
+        run_queue[cpu].curr_deadline = 0;
+#endif
+    run_queue[cpu].curr_priority = thread_is_deadline(newthread) ? NUM_PRIORITIES : newthread->priority;
+
     if (newthread == oldthread)
         return;
 
@@ -518,6 +1456,7 @@ void thread_resched(void)
     /* mark the cpu ownership of the threads */
     thread_set_curr_cpu(oldthread, -1);
     thread_set_curr_cpu(newthread, cpu);
+    thread_set_last_cpu(newthread, cpu);
 
 #if WITH_SMP
     if (thread_is_idle(newthread)) {
@@ -536,18 +1475,42 @@ void thread_resched(void)
 #if THREAD_STATS
     THREAD_STATS_INC(context_switches);
 
+    lk_bigtime_t now = current_time_hires();
     if (thread_is_idle(oldthread)) {
-        lk_bigtime_t now = current_time_hires();
-        thread_stats[cpu].idle_time += now - thread_stats[cpu].last_idle_timestamp;
+        struct thread_stats *stats = percpu_ptr(thread_stats, cpu);
+        stats->idle_time += now - stats->last_idle_timestamp;
     }
     if (thread_is_idle(newthread)) {
-        thread_stats[cpu].last_idle_timestamp = current_time_hires();
+        percpu_ptr(thread_stats, cpu)->last_idle_timestamp = now;
     }
+
+    /* how long the outgoing thread ran and how long the incoming one waited for the cpu */
+    lk_bigtime_t ran = now - oldthread->run_start;
+    oldthread->runtime += ran;
+    if (!thread_is_idle(oldthread))
+        percpu_ptr(thread_sched_hist, cpu)->run[oldthread->priority][sched_hist_bucket(ran)]++;
+    if (!thread_is_idle(newthread) && newthread->ready_time)
+        percpu_ptr(thread_sched_hist, cpu)->wait[newthread->priority][sched_hist_bucket(now - newthread->ready_time)]++;
+    newthread->run_start = now;
 #endif
 
     KEVLOG_THREAD_SWITCH(oldthread, newthread);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
+#if KERNEL_TICKLESS
+    /* rather than ticking, arm a single timer for the end of the quantum */
+    if (!thread_is_real_time_or_idle(oldthread)) {
+        /* charge the outgoing thread for the part of its quantum it used */
+        lk_time_t used = current_time() - quantum_start[cpu];
+        oldthread->remaining_quantum -= (used + THREAD_TICK_MS / 2) / THREAD_TICK_MS;
+        timer_cancel(&preempt_timer[cpu]);
+    }
+    if (!thread_is_real_time_or_idle(newthread)) {
+        quantum_start[cpu] = current_time();
+        timer_set_oneshot(&preempt_timer[cpu], newthread->remaining_quantum * THREAD_TICK_MS,
+                          thread_quantum_expired, NULL);
+    }
+#else
     if (thread_is_real_time_or_idle(newthread)) {
         if (!thread_is_real_time_or_idle(oldthread)) {
             /* if we're switching from a non real time to a real time, cancel
@@ -565,8 +1528,9 @@ void thread_resched(void)
         dprintf(ALWAYS, "arch_context_switch: start preempt, cpu %d, old %p (%s), new %p (%s)\n",
                 cpu, oldthread, oldthread->name, newthread, newthread->name);
 #endif
-        timer_set_periodic(&preempt_timer[cpu], 10, thread_timer_tick, NULL);
+        timer_set_periodic(&preempt_timer[cpu], THREAD_TICK_MS, thread_timer_tick, NULL);
     }
+#endif // KERNEL_TICKLESS
 #endif
 
     /* set some optional target debug leds */
@@ -721,7 +1685,7 @@ void thread_unblock(thread_t *t, bool resched)
 
     t->state = THREAD_READY;
     insert_in_run_queue_head(t);
-    mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+    wake_reschedule(t);
     if (resched)
         thread_resched();
 }
@@ -741,6 +1705,20 @@ enum handler_return thread_timer_tick(struct timer *t, lk_time_t now, void *arg)
     }
 }
 
+#if KERNEL_TICKLESS
+/* one shot preemption timer callback, the running thread used up its quantum */
+static enum handler_return thread_quantum_expired(struct timer *t, lk_time_t now, void *arg)
+{
+    thread_t *current_thread = get_current_thread();
+
+    if (thread_is_real_time_or_idle(current_thread))
+        return INT_NO_RESCHEDULE;
+
+    current_thread->remaining_quantum = 0;
+    return INT_RESCHEDULE;
+}
+#endif
+
 /* timer callback to wake up a sleeping thread */
 static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, void *arg)
 {
@@ -795,13 +1773,17 @@ void thread_sleep(lk_time_t delay)
  */
 void thread_init_early(void)
 {
-    int i;
-
     DEBUG_ASSERT(arch_curr_cpu_num() == 0);
 
     /* initialize the run queues */
-    for (i=0; i < NUM_PRIORITIES; i++)
-        list_initialize(&run_queue[i]);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        for (int i = 0; i < NUM_PRIORITIES; i++)
+            list_initialize(&run_queue[cpu].list[i]);
+        run_queue[cpu].bitmap = 0;
+#if KERNEL_DEADLINE
+        list_initialize(&run_queue[cpu].dl_list);
+#endif
+    }
 
     /* initialize the thread list */
     list_initialize(&thread_list);
@@ -811,7 +1793,7 @@ void thread_init_early(void)
     init_thread_struct(t, "bootstrap");
 
     /* half construct this thread, since we're already running */
-    t->priority = HIGHEST_PRIORITY;
+    t->priority = t->base_priority = HIGHEST_PRIORITY;
     t->state = THREAD_RUNNING;
     t->flags = THREAD_FLAG_DETACHED;
     thread_set_curr_cpu(t, 0);
@@ -833,6 +1815,11 @@ void thread_init(void)
         timer_initialize(&preempt_timer[i]);
     }
 #endif
+#if KERNEL_DEADLINE
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        timer_initialize(&dl_budget_timer[i]);
+    }
+#endif
 }
 
 /**
@@ -859,7 +1846,8 @@ void thread_set_priority(int priority)
         priority = IDLE_PRIORITY + 1;
     if (priority > HIGHEST_PRIORITY)
         priority = HIGHEST_PRIORITY;
-    current_thread->priority = priority;
+    current_thread->base_priority = priority;
+    current_thread->priority = MAX(priority, current_thread->inherited_priority);
 
     current_thread->state = THREAD_READY;
     insert_in_run_queue_head(current_thread);
@@ -868,6 +1856,49 @@ void thread_set_priority(int priority)
     THREAD_UNLOCK(state);
 }
 
+/**
+ * @brief  Set the priority a thread inherits from the threads it is blocking
+ *
+ * The thread runs at the higher of its own priority and \a priority, or at
+ * its own priority if \a priority is -1. Used by mutex priority inheritance.
+ * The thread lock must be held.
+ */
+void thread_set_inherited_priority(thread_t *t, int priority)
+{
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(priority < NUM_PRIORITIES);
+
+    t->inherited_priority = priority;
+
+    int effective = MAX(t->base_priority, priority);
+    if (effective == t->priority)
+        return;
+
+    switch (t->state) {
+        case THREAD_READY:
+            if (list_in_list(&t->queue_node)) {
+                /* move it to the run queue for its new priority */
+                dequeue_ready_thread(t);
+                t->priority = effective;
+                insert_in_run_queue_tail(t);
+                mp_reschedule(wakeup_target(t, 0), 0);
+            } else {
+                t->priority = effective;
+            }
+            break;
+        case THREAD_RUNNING:
+            t->priority = effective;
+            if (!thread_is_deadline(t))
+                run_queue[thread_curr_cpu(t)].curr_priority = effective;
+            break;
+        default:
+            /* picked up the next time it is queued */
+            t->priority = effective;
+            break;
+    }
+}
+
 /**
  * @brief  Become an idle thread
  *
@@ -890,7 +1921,7 @@ void thread_become_idle(void)
 #endif
 
     /* mark ourself as idle */
-    t->priority = IDLE_PRIORITY;
+    t->priority = t->base_priority = IDLE_PRIORITY;
     t->flags |= THREAD_FLAG_IDLE;
     thread_set_pinned_cpu(t, arch_curr_cpu_num());
 
@@ -920,7 +1951,7 @@ void thread_secondary_cpu_init_early(void)
     thread_set_pinned_cpu(t, cpu);
 
     /* half construct this thread, since we're already running */
-    t->priority = HIGHEST_PRIORITY;
+    t->priority = t->base_priority = HIGHEST_PRIORITY;
     t->state = THREAD_RUNNING;
     t->flags = THREAD_FLAG_DETACHED | THREAD_FLAG_IDLE;
     thread_set_curr_cpu(t, cpu);
@@ -939,7 +1970,7 @@ void thread_secondary_cpu_entry(void)
 {
     uint cpu = arch_curr_cpu_num();
     thread_t *t = get_current_thread();
-    t->priority = IDLE_PRIORITY;
+    t->priority = t->base_priority = IDLE_PRIORITY;
 
     mp_set_curr_cpu_active(true);
     mp_set_cpu_idle(cpu);
@@ -996,11 +2027,11 @@ void dump_thread(thread_t *t)
 {
     dprintf(INFO, "dump_thread: t %p (%s)\n", t, t->name);
 #if WITH_SMP
-    dprintf(INFO, "\tstate %s, curr_cpu %d, pinned_cpu %d, priority %d, remaining quantum %d\n",
-            thread_state_to_str(t->state), t->curr_cpu, t->pinned_cpu, t->priority, t->remaining_quantum);
+    dprintf(INFO, "\tstate %s, curr_cpu %d, last_cpu %d, pinned_cpu %d, cpu_mask 0x%x, priority %d (base %d), remaining quantum %d\n",
+            thread_state_to_str(t->state), t->curr_cpu, t->last_cpu, t->pinned_cpu, t->cpu_mask, t->priority, t->base_priority, t->remaining_quantum);
 #else
-    dprintf(INFO, "\tstate %s, priority %d, remaining quantum %d\n",
-            thread_state_to_str(t->state), t->priority, t->remaining_quantum);
+    dprintf(INFO, "\tstate %s, priority %d (base %d), remaining quantum %d\n",
+            thread_state_to_str(t->state), t->priority, t->base_priority, t->remaining_quantum);
 #endif
 #ifdef THREAD_STACK_HIGHWATER
     dprintf(INFO, "\tstack %p, stack_size %zd, stack_used %zd\n",
@@ -1010,6 +2041,13 @@ void dump_thread(thread_t *t)
 #endif
     dprintf(INFO, "\tentry %p, arg %p, flags 0x%x\n", t->entry, t->arg, t->flags);
     dprintf(INFO, "\twait queue %p, wait queue ret %d\n", t->blocking_wait_queue, t->wait_queue_block_ret);
+#if KERNEL_DEADLINE
+    if (thread_is_deadline(t)) {
+        dprintf(INFO, "\tdeadline runtime %llu period %llu deadline %llu us, cpu %d, jobs %u overruns %u misses %u max runtime %llu us\n",
+                t->dl.runtime, t->dl.period, t->dl.deadline, t->dl.cpu, t->dl.stats.jobs,
+                t->dl.stats.overruns, t->dl.stats.misses, t->dl.stats.max_runtime);
+    }
+#endif
 #if WITH_KERNEL_VM
     dprintf(INFO, "\taspace %p\n", t->aspace);
 #endif
@@ -1043,6 +2081,24 @@ void dump_all_threads(void)
     THREAD_UNLOCK(state);
 }
 
+bool thread_lookup_name(const void *_t, char *name, size_t len)
+{
+    bool found = false;
+    thread_t *t;
+
+    THREAD_LOCK(state);
+    list_for_every_entry(&thread_list, t, thread_t, thread_list_node) {
+        if (t == _t) {
+            strlcpy(name, t->name, len);
+            found = true;
+            break;
+        }
+    }
+    THREAD_UNLOCK(state);
+
+    return found;
+}
+
 /** @} */
 
 
@@ -1068,6 +2124,9 @@ static enum handler_return wait_queue_timeout_handler(timer_t *timer, lk_time_t
         ret = INT_RESCHEDULE;
     }
 
+#if WITH_SMP
+    thread_flush_wakeups();
+#endif
     spin_unlock(&thread_lock);
 
     return ret;
@@ -1169,7 +2228,7 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
             insert_in_run_queue_head(current_thread);
         }
         insert_in_run_queue_head(t);
-        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+        wake_reschedule(t);
         if (reschedule) {
             thread_resched();
         }
@@ -1224,13 +2283,13 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
         t->blocking_wait_queue = NULL;
 
         insert_in_run_queue_head(t);
+        wake_reschedule(t);
         ret++;
     }
 
     DEBUG_ASSERT(wait->count == 0);
 
     if (ret > 0) {
-        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
         if (reschedule) {
             thread_resched();
         }
@@ -1285,7 +2344,7 @@ status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
     t->state = THREAD_READY;
     t->wait_queue_block_ret = wait_queue_error;
     insert_in_run_queue_head(t);
-    mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+    mp_reschedule(wakeup_target(t, 0), 0);
 
     return NO_ERROR;
 }
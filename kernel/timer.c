@@ -41,6 +41,7 @@
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
+#include <kernel/percpu.h>
 #include <kernel/spinlock.h>
 #include <platform/timer.h>
 #include <platform.h>
@@ -49,14 +50,57 @@
 
 spin_lock_t timer_lock;
 
+#if KERNEL_TIMER_WHEEL
+/*
+ * Hierarchical timing wheel, one per cpu. Level 0 has a slot per ms for the
+ * next 256ms, each of the levels above it has 64 slots that each span a full
+ * lap of the level below. Whenever a level wraps, the next slot of the level
+ * above it is cascaded down. Inserting or canceling a timer is O(1).
+ *
+ * The slot bitmaps record slots that may have timers in them. Bits are set on
+ * insert and only cleared once the slot is found to be empty, so canceling
+ * never has to touch them.
+ */
+#define WHEEL_L0_BITS   8
+#define WHEEL_L0_SIZE   (1U << WHEEL_L0_BITS)
+#define WHEEL_L0_MASK   (WHEEL_L0_SIZE - 1)
+#define WHEEL_LN_BITS   6
+#define WHEEL_LN_SIZE   (1U << WHEEL_LN_BITS)
+#define WHEEL_LN_MASK   (WHEEL_LN_SIZE - 1)
+#define WHEEL_LN_LEVELS 4 /* enough to cover all 32 bits of lk_time_t */
+#define WHEEL_LN_SHIFT(level) (WHEEL_L0_BITS + (level) * WHEEL_LN_BITS)
+
+STATIC_ASSERT(WHEEL_LN_SHIFT(WHEEL_LN_LEVELS) == sizeof(lk_time_t) * 8);
+
+struct timer_state {
+    lk_time_t wheel_time; /* next ms to be processed */
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    bool hw_armed;
+    lk_time_t hw_deadline; /* when the hardware timer is set to fire */
+#endif
+    uint32_t l0_bitmap[WHEEL_L0_SIZE / 32];
+    uint64_t ln_bitmap[WHEEL_LN_LEVELS];
+    struct list_node l0[WHEEL_L0_SIZE];
+    struct list_node ln[WHEEL_LN_LEVELS][WHEEL_LN_SIZE];
+};
+#else
 struct timer_state {
     struct list_node timer_queue;
-} __CPU_ALIGN;
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    bool hw_armed;
+    lk_time_t hw_deadline; /* when the hardware timer is set to fire */
+#endif
+};
+#endif
 
-static struct timer_state timers[SMP_MAX_CPUS];
+DEFINE_PERCPU_STATIC(struct timer_state, timers);
 
 static enum handler_return timer_tick(void *arg, lk_time_t now);
 
+#if !PLATFORM_HAS_DYNAMIC_TIMER
+#define TIMER_TICK_MS 10
+#endif
+
 /**
  * @brief  Initialize a timer object
  */
@@ -65,6 +109,231 @@ void timer_initialize(timer_t *timer)
     *timer = (timer_t)TIMER_INITIAL_VALUE(*timer);
 }
 
+#if KERNEL_TIMER_WHEEL
+static void timer_queue_init(uint cpu)
+{
+    struct timer_state *ts = percpu_ptr(timers, cpu);
+
+    ts->wheel_time = 0;
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    ts->hw_armed = false;
+#endif
+    for (uint i = 0; i < WHEEL_L0_SIZE; i++)
+        list_initialize(&ts->l0[i]);
+    for (uint i = 0; i < countof(ts->l0_bitmap); i++)
+        ts->l0_bitmap[i] = 0;
+    for (uint level = 0; level < WHEEL_LN_LEVELS; level++) {
+        for (uint i = 0; i < WHEEL_LN_SIZE; i++)
+            list_initialize(&ts->ln[level][i]);
+        ts->ln_bitmap[level] = 0;
+    }
+}
+
+static bool wheel_maybe_empty(struct timer_state *ts)
+{
+    for (uint i = 0; i < countof(ts->l0_bitmap); i++) {
+        if (ts->l0_bitmap[i])
+            return false;
+    }
+    for (uint level = 0; level < WHEEL_LN_LEVELS; level++) {
+        if (ts->ln_bitmap[level])
+            return false;
+    }
+    return true;
+}
+
+static void wheel_insert(struct timer_state *ts, timer_t *timer)
+{
+    lk_time_t expires = timer->scheduled_time;
+
+    /* anything already due goes in the slot about to be processed */
+    if (TIME_LT(expires, ts->wheel_time))
+        expires = ts->wheel_time;
+
+    lk_time_t delta = expires - ts->wheel_time;
+
+    if (delta < WHEEL_L0_SIZE) {
+        uint slot = expires & WHEEL_L0_MASK;
+        list_add_tail(&ts->l0[slot], &timer->node);
+        ts->l0_bitmap[slot / 32] |= 1U << (slot % 32);
+        return;
+    }
+
+    uint level;
+    for (level = 0; level < WHEEL_LN_LEVELS - 1; level++) {
+        if (delta < (1U << WHEEL_LN_SHIFT(level + 1)))
+            break;
+    }
+
+    uint slot = (expires >> WHEEL_LN_SHIFT(level)) & WHEEL_LN_MASK;
+    list_add_tail(&ts->ln[level][slot], &timer->node);
+    ts->ln_bitmap[level] |= 1ULL << slot;
+}
+
+static void insert_timer_in_queue(uint cpu, timer_t *timer)
+{
+    struct timer_state *ts = percpu_ptr(timers, cpu);
+
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    LTRACEF("timer %p, cpu %u, scheduled %u, periodic %u\n", timer, cpu, timer->scheduled_time, timer->periodic_time);
+
+    /* an empty wheel can be brought up to date for free */
+    if (wheel_maybe_empty(ts))
+        ts->wheel_time = current_time();
+
+    wheel_insert(ts, timer);
+}
+
+/* push a slot of a higher level down into the levels below it */
+static void wheel_cascade(struct timer_state *ts, uint level, uint slot)
+{
+    timer_t *timer;
+
+    while ((timer = list_remove_head_type(&ts->ln[level][slot], timer_t, node)))
+        wheel_insert(ts, timer);
+
+    ts->ln_bitmap[level] &= ~(1ULL << slot);
+}
+
+/* move the wheel to a new time, cascading if level 0 wrapped */
+static void wheel_set_time(struct timer_state *ts, lk_time_t time)
+{
+    ts->wheel_time = time;
+
+    if ((time & WHEEL_L0_MASK) != 0)
+        return;
+
+    for (uint level = 0; level < WHEEL_LN_LEVELS; level++) {
+        uint slot = (time >> WHEEL_LN_SHIFT(level)) & WHEEL_LN_MASK;
+        wheel_cascade(ts, level, slot);
+        if (slot != 0)
+            break;
+    }
+}
+
+/* next level 0 slot at or after start that may hold a timer, or -1 */
+static int wheel_l0_next_slot(struct timer_state *ts, uint start)
+{
+    for (uint i = start; i < WHEEL_L0_SIZE; i++) {
+        if ((ts->l0_bitmap[i / 32] & (1U << (i % 32))) == 0) {
+            /* skip the rest of an empty word quickly */
+            if (ts->l0_bitmap[i / 32] >> (i % 32) == 0)
+                i |= 31;
+            continue;
+        }
+        if (!list_is_empty(&ts->l0[i]))
+            return i;
+        ts->l0_bitmap[i / 32] &= ~(1U << (i % 32));
+    }
+    return -1;
+}
+
+/* pull the next timer due at or before now off the queue */
+static timer_t *timer_queue_pop_expired(uint cpu, lk_time_t now)
+{
+    struct timer_state *ts = percpu_ptr(timers, cpu);
+
+    while (TIME_LTE(ts->wheel_time, now)) {
+        uint slot = ts->wheel_time & WHEEL_L0_MASK;
+
+        timer_t *timer = list_remove_head_type(&ts->l0[slot], timer_t, node);
+        if (timer)
+            return timer;
+
+        ts->l0_bitmap[slot / 32] &= ~(1U << (slot % 32));
+
+        if (wheel_maybe_empty(ts)) {
+            ts->wheel_time = now + 1;
+            break;
+        }
+
+        /* skip straight to the next slot with something in it, stopping at the
+         * end of this lap for the cascade or just past now */
+        lk_time_t next;
+        int next_slot = wheel_l0_next_slot(ts, slot + 1);
+        if (next_slot >= 0)
+            next = ts->wheel_time + (next_slot - slot);
+        else
+            next = (ts->wheel_time | WHEEL_L0_MASK) + 1;
+
+        if (TIME_GT(next, now + 1))
+            next = now + 1;
+
+        wheel_set_time(ts, next);
+    }
+
+    return NULL;
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/* earliest time the wheel needs to be looked at again, false if it is empty */
+static bool timer_queue_next_deadline(uint cpu, lk_time_t *deadline)
+{
+    struct timer_state *ts = percpu_ptr(timers, cpu);
+    uint64_t best = UINT64_MAX;
+
+    /* level 0 slots hold exactly the timers due at that ms. starting from the
+     * first one, gather up every timer whose slack lets it wait for the rest */
+    uint cur = ts->wheel_time & WHEEL_L0_MASK;
+    int slot = wheel_l0_next_slot(ts, cur);
+    if (slot < 0)
+        slot = wheel_l0_next_slot(ts, 0);
+    if (slot >= 0) {
+        for (uint64_t delta = (slot - cur) & WHEEL_L0_MASK; delta < WHEEL_L0_SIZE && delta <= best; delta++) {
+            timer_t *timer;
+            list_for_every_entry(&ts->l0[(cur + delta) & WHEEL_L0_MASK], timer, timer_t, node) {
+                if (delta + timer->slack < best)
+                    best = delta + timer->slack;
+            }
+        }
+    }
+
+    /* higher slots need attention when they get cascaded */
+    for (uint level = 0; level < WHEEL_LN_LEVELS; level++) {
+        uint shift = WHEEL_LN_SHIFT(level);
+        uint64_t bitmap = ts->ln_bitmap[level];
+
+        cur = (ts->wheel_time >> shift) & WHEEL_LN_MASK;
+        while (bitmap) {
+            uint i = __builtin_ctzll(bitmap);
+            bitmap &= ~(1ULL << i);
+
+            if (list_is_empty(&ts->ln[level][i])) {
+                ts->ln_bitmap[level] &= ~(1ULL << i);
+                continue;
+            }
+
+            /* the slot at the current index was already cascaded this lap. timers
+             * are cascaded on time regardless of their slack */
+            uint64_t laps = ((i - cur - 1) & WHEEL_LN_MASK) + 1;
+            uint64_t delta = (laps << shift) - (ts->wheel_time & ((1U << shift) - 1));
+            if (delta < best)
+                best = delta;
+        }
+    }
+
+    if (best == UINT64_MAX)
+        return false;
+
+    if (best > INT32_MAX)
+        best = INT32_MAX;
+
+    *deadline = ts->wheel_time + (lk_time_t)best;
+    return true;
+}
+#endif
+
+#else // !KERNEL_TIMER_WHEEL
+
+static void timer_queue_init(uint cpu)
+{
+    list_initialize(&percpu_ptr(timers, cpu)->timer_queue);
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    percpu_ptr(timers, cpu)->hw_armed = false;
+#endif
+}
+
 static void insert_timer_in_queue(uint cpu, timer_t *timer)
 {
     timer_t *entry;
@@ -73,7 +342,7 @@ static void insert_timer_in_queue(uint cpu, timer_t *timer)
 
     LTRACEF("timer %p, cpu %u, scheduled %u, periodic %u\n", timer, cpu, timer->scheduled_time, timer->periodic_time);
 
-    list_for_every_entry(&timers[cpu].timer_queue, entry, timer_t, node) {
+    list_for_every_entry(&percpu_ptr(timers, cpu)->timer_queue, entry, timer_t, node) {
         if (TIME_GT(entry->scheduled_time, timer->scheduled_time)) {
             list_add_before(&entry->node, &timer->node);
             return;
@@ -81,14 +350,91 @@ static void insert_timer_in_queue(uint cpu, timer_t *timer)
     }
 
     /* walked off the end of the list */
-    list_add_tail(&timers[cpu].timer_queue, &timer->node);
+    list_add_tail(&percpu_ptr(timers, cpu)->timer_queue, &timer->node);
+}
+
+/* pull the next timer due at or before now off the queue */
+static timer_t *timer_queue_pop_expired(uint cpu, lk_time_t now)
+{
+    timer_t *timer = list_peek_head_type(&percpu_ptr(timers, cpu)->timer_queue, timer_t, node);
+    if (likely(timer == 0))
+        return NULL;
+
+    LTRACEF("next item on timer queue %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
+    if (likely(TIME_LT(now, timer->scheduled_time)))
+        return NULL;
+
+    list_delete(&timer->node);
+    return timer;
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/* earliest time the queue needs to be looked at again, false if it is empty.
+ * timers with slack may push this out as far as the first one has to fire,
+ * taking every timer due before then along with it. */
+static bool timer_queue_next_deadline(uint cpu, lk_time_t *deadline)
+{
+    timer_t *timer;
+    bool found = false;
+    lk_time_t best = 0;
+
+    list_for_every_entry(&percpu_ptr(timers, cpu)->timer_queue, timer, timer_t, node) {
+        if (found && TIME_GT(timer->scheduled_time, best))
+            break;
+
+        lk_time_t latest = timer->scheduled_time + timer->slack;
+        if (!found || TIME_LT(latest, best))
+            best = latest;
+        found = true;
+    }
+
+    if (found)
+        *deadline = best;
+    return found;
+}
+#endif
+
+#endif // KERNEL_TIMER_WHEEL
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/* point the hardware timer at the next deadline of this cpu's queue. unless
+ * allow_later is set it is only ever moved earlier. */
+static void update_hw_timer(uint cpu, lk_time_t now, bool allow_later)
+{
+    struct timer_state *ts = percpu_ptr(timers, cpu);
+    lk_time_t deadline;
+
+    if (!timer_queue_next_deadline(cpu, &deadline)) {
+        if (allow_later && ts->hw_armed) {
+            LTRACEF("clearing old hw timer, nothing in the queue\n");
+            platform_stop_timer();
+            ts->hw_armed = false;
+        }
+        return;
+    }
+
+    if (ts->hw_armed) {
+        if (deadline == ts->hw_deadline)
+            return;
+        if (!allow_later && TIME_GT(deadline, ts->hw_deadline))
+            return;
+    }
+
+    lk_time_t delay = TIME_GT(deadline, now) ? deadline - now : 0;
+
+    LTRACEF("setting new timer for %u msecs\n", (uint)delay);
+    ts->hw_armed = true;
+    ts->hw_deadline = deadline;
+    platform_set_oneshot_timer(timer_tick, NULL, delay);
 }
+#endif
 
-static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_callback callback, void *arg)
+static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, lk_time_t slack,
+                      timer_callback callback, void *arg)
 {
     lk_time_t now;
 
-    LTRACEF("timer %p, delay %u, period %u, callback %p, arg %p\n", timer, delay, period, callback, arg);
+    LTRACEF("timer %p, delay %u, period %u, slack %u, callback %p, arg %p\n", timer, delay, period, slack, callback, arg);
 
     DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
 
@@ -99,6 +445,7 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
     now = current_time();
     timer->scheduled_time = now + delay;
     timer->periodic_time = period;
+    timer->slack = slack;
     timer->callback = callback;
     timer->arg = arg;
 
@@ -111,11 +458,7 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
     insert_timer_in_queue(cpu, timer);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    if (list_peek_head_type(&timers[cpu].timer_queue, timer_t, node) == timer) {
-        /* we just modified the head of the timer queue */
-        LTRACEF("setting new timer for %u msecs\n", delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    update_hw_timer(cpu, now, false);
 #endif
 
     spin_unlock_irqrestore(&timer_lock, state);
@@ -139,7 +482,27 @@ void timer_set_oneshot(timer_t *timer, lk_time_t delay, timer_callback callback,
 {
     if (delay == 0)
         delay = 1;
-    timer_set(timer, delay, 0, callback, arg);
+    timer_set(timer, delay, 0, 0, callback, arg);
+}
+
+/**
+ * @brief  Set up a timer that executes once, some time within a window
+ *
+ * Like timer_set_oneshot(), but the callback may be delayed by up to slack ms
+ * past the requested delay. This lets the timer be batched up with other
+ * timers expiring around the same time into a single timer interrupt.
+ *
+ * @param  timer The timer to use
+ * @param  delay The minimum delay, in ms, before the timer is executed
+ * @param  slack How much later, in ms, the timer may be executed
+ * @param  callback  The function to call when the timer expires
+ * @param  arg  The argument to pass to the callback
+ */
+void timer_set_oneshot_etc(timer_t *timer, lk_time_t delay, lk_time_t slack, timer_callback callback, void *arg)
+{
+    if (delay == 0)
+        delay = 1;
+    timer_set(timer, delay, 0, slack, callback, arg);
 }
 
 /**
@@ -160,7 +523,7 @@ void timer_set_periodic(timer_t *timer, lk_time_t period, timer_callback callbac
 {
     if (period == 0)
         period = 1;
-    timer_set(timer, period, period, callback, arg);
+    timer_set(timer, period, period, 0, callback, arg);
 }
 
 /**
@@ -173,12 +536,6 @@ void timer_cancel(timer_t *timer)
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&timer_lock, state);
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-    uint cpu = arch_curr_cpu_num();
-
-    timer_t *oldhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-#endif
-
     if (list_in_list(&timer->node))
         list_delete(&timer->node);
 
@@ -189,25 +546,12 @@ void timer_cancel(timer_t *timer)
     timer->callback = NULL;
     timer->arg = NULL;
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-    /* see if we've just modified the head of the timer queue */
-    timer_t *newhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (newhead == NULL) {
-        LTRACEF("clearing old hw timer, nothing in the queue\n");
-        platform_stop_timer();
-    } else if (newhead != oldhead) {
-        lk_time_t delay;
-        lk_time_t now = current_time();
-
-        if (TIME_LT(newhead->scheduled_time, now))
-            delay = 0;
-        else
-            delay = newhead->scheduled_time - now;
-
-        LTRACEF("setting new timer to %u\n", (uint) delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+#if PLATFORM_HAS_DYNAMIC_TIMER && !KERNEL_TIMER_WHEEL
+    /* see if the hardware timer can be pushed out or stopped */
+    update_hw_timer(arch_curr_cpu_num(), current_time(), true);
 #endif
+    /* with the timer wheel the hardware timer is left armed, at worst it fires
+     * once with nothing to do and gets reprogrammed for the next deadline */
 
     spin_unlock_irqrestore(&timer_lock, state);
 }
@@ -221,7 +565,7 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
     DEBUG_ASSERT(arch_ints_disabled());
 
     THREAD_STATS_INC(timer_ints);
-//  KEVLOG_TIMER_TICK(); // enable only if necessary
+    KEVLOG_TIMER_TICK();
 
     uint cpu = arch_curr_cpu_num();
 
@@ -229,19 +573,10 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 
     spin_lock(&timer_lock);
 
-    for (;;) {
-        /* see if there's an event to process */
-        timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-        if (likely(timer == 0))
-            break;
-        LTRACEF("next item on timer queue %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
-        if (likely(TIME_LT(now, timer->scheduled_time)))
-            break;
-
-        /* process it */
+    /* process any events that are due */
+    while ((timer = timer_queue_pop_expired(cpu, now))) {
         LTRACEF("timer %p\n", timer);
         DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
-        list_delete(&timer->node);
 
         /* we pulled it off the list, release the list lock to handle it */
         spin_unlock(&timer_lock);
@@ -272,16 +607,8 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
     /* reset the timer to the next event */
-    timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (timer) {
-        /* has to be the case or it would have fired already */
-        DEBUG_ASSERT(TIME_GT(timer->scheduled_time, now));
-
-        lk_time_t delay = timer->scheduled_time - now;
-
-        LTRACEF("setting new timer for %u msecs for event %p\n", (uint)delay, timer);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    percpu_ptr(timers, cpu)->hw_armed = false;
+    update_hw_timer(cpu, now, true);
 
     /* we're done manipulating the timer queue */
     spin_unlock(&timer_lock);
@@ -298,14 +625,44 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
     return ret;
 }
 
+/**
+ * @brief  Find when the current cpu next has a timer to run
+ *
+ * The idle loop uses this to judge how long it is going to sleep. Call with
+ * interrupts disabled.
+ *
+ * @return false if nothing is queued on this cpu, so it could sleep until woken
+ */
+bool timer_get_next_deadline(lk_time_t *deadline)
+{
+    DEBUG_ASSERT(arch_ints_disabled());
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* the hardware timer always points at the earliest deadline */
+    struct timer_state *ts = this_cpu_ptr(timers);
+    bool armed;
+
+    spin_lock(&timer_lock);
+    armed = ts->hw_armed;
+    *deadline = ts->hw_deadline;
+    spin_unlock(&timer_lock);
+
+    return armed;
+#else
+    /* nothing sleeps through the periodic tick */
+    *deadline = current_time() + TIMER_TICK_MS;
+    return true;
+#endif
+}
+
 void timer_init(void)
 {
     timer_lock = SPIN_LOCK_INITIAL_VALUE;
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-        list_initialize(&timers[i].timer_queue);
+        timer_queue_init(i);
     }
 #if !PLATFORM_HAS_DYNAMIC_TIMER
     /* register for a periodic timer tick */
-    platform_set_periodic_timer(timer_tick, NULL, 10); /* 10ms */
+    platform_set_periodic_timer(timer_tick, NULL, TIMER_TICK_MS);
 #endif
 }
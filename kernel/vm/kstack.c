@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Kernel thread stacks.
+ *
+ * Stacks are mapped out of the kernel aspace with an unmapped guard page
+ * right below them, so a thread running off the bottom of its stack takes
+ * a page fault instead of silently corrupting whatever is next in memory.
+ * Freed stacks of the default size are kept on a small list and handed
+ * back out as is, which keeps thread creation from going through the
+ * region allocator and the pmm every time.
+ */
+#include <kernel/vm.h>
+
+#include <debug.h>
+#include <assert.h>
+#include <trace.h>
+#include <err.h>
+#include <stdio.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
+#include <lk/init.h>
+#include <lib/console.h>
+
+#define LOCAL_TRACE 0
+
+#ifndef KSTACK_CACHE_MAX
+#define KSTACK_CACHE_MAX 16
+#endif
+
+#if THREAD_STACK_BOUNDS_CHECK
+#define KSTACK_CACHE_SIZE ROUNDUP(DEFAULT_STACK_SIZE + THREAD_STACK_PADDING_SIZE, PAGE_SIZE)
+#else
+#define KSTACK_CACHE_SIZE ROUNDUP(DEFAULT_STACK_SIZE, PAGE_SIZE)
+#endif
+
+/* link kept at the bottom of a cached stack */
+struct kstack_free {
+    struct kstack_free *next;
+};
+
+static mutex_t kstack_lock = MUTEX_INITIAL_VALUE(kstack_lock);
+static struct kstack_free *kstack_cache;
+static uint kstack_cached;
+static bool kstack_ready;
+
+static uint kstack_live;
+static uint kstack_hits;
+static uint kstack_misses;
+
+void *vmm_alloc_kstack(size_t size)
+{
+    /* the vmm is not up yet, callers fall back to the heap */
+    if (!kstack_ready)
+        return NULL;
+
+    size = ROUNDUP(size, PAGE_SIZE);
+
+    if (size == KSTACK_CACHE_SIZE) {
+        mutex_acquire(&kstack_lock);
+        struct kstack_free *s = kstack_cache;
+        if (s) {
+            kstack_cache = s->next;
+            kstack_cached--;
+            kstack_live++;
+            kstack_hits++;
+        }
+        mutex_release(&kstack_lock);
+
+        if (s) {
+            LTRACEF("size %zu, reused %p\n", size, s);
+            return s;
+        }
+    }
+
+    void *stack;
+    status_t err = vmm_alloc(vmm_get_kernel_aspace(), "kstack", size, &stack, PAGE_SIZE_SHIFT,
+                             VMM_FLAG_GUARD_PAGE, ARCH_MMU_FLAG_PERM_NO_EXECUTE);
+    if (err < 0) {
+        LTRACEF("size %zu, vmm_alloc returns %d\n", size, err);
+        return NULL;
+    }
+
+    mutex_acquire(&kstack_lock);
+    kstack_live++;
+    kstack_misses++;
+    mutex_release(&kstack_lock);
+
+    LTRACEF("size %zu, new stack %p\n", size, stack);
+    return stack;
+}
+
+void vmm_free_kstack(void *stack, size_t size)
+{
+    DEBUG_ASSERT(stack);
+
+    size = ROUNDUP(size, PAGE_SIZE);
+
+    LTRACEF("stack %p, size %zu\n", stack, size);
+
+    mutex_acquire(&kstack_lock);
+    kstack_live--;
+    if (size == KSTACK_CACHE_SIZE && kstack_cached < KSTACK_CACHE_MAX) {
+        struct kstack_free *s = stack;
+        s->next = kstack_cache;
+        kstack_cache = s;
+        kstack_cached++;
+        stack = NULL;
+    }
+    mutex_release(&kstack_lock);
+
+    /* the region starts at the guard page */
+    if (stack)
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)stack - PAGE_SIZE);
+}
+
+static void kstack_init(uint level)
+{
+    kstack_ready = true;
+}
+
+LK_INIT_HOOK(kstack, &kstack_init, LK_INIT_LEVEL_VM + 1);
+
+#if LK_DEBUGLEVEL > 0
+static int cmd_kstack(int argc, const cmd_args *argv)
+{
+    mutex_acquire(&kstack_lock);
+    printf("kernel stacks: %u live, %u cached (max %u, %zu bytes each)\n",
+           kstack_live, kstack_cached, KSTACK_CACHE_MAX, (size_t)KSTACK_CACHE_SIZE);
+    printf("\t%u allocated from the cache, %u from the vmm\n", kstack_hits, kstack_misses);
+    mutex_release(&kstack_lock);
+
+    return NO_ERROR;
+}
+
+#endif
+
+STATIC_COMMAND_START
+#if LK_DEBUGLEVEL > 0
+STATIC_COMMAND("kstack", "kernel stack allocator stats", &cmd_kstack)
+#endif
+STATIC_COMMAND_END(kstack);
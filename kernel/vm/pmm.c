@@ -31,7 +31,12 @@
 #include <string.h>
 #include <pow2.h>
 #include <lib/console.h>
+#include <arch/ops.h>
+#include <kernel/mp.h>
+#include <kernel/thread.h>
+#include <lk/init.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 
 #define LOCAL_TRACE 0
 
@@ -48,11 +53,349 @@ static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
 #define ADDRESS_IN_ARENA(address, arena) \
     ((address) >= (arena)->base && (address) <= (arena)->base + (arena)->size - 1)
 
+STATIC_ASSERT(PMM_MAX_ORDER <= 32);
+
+/* set once any arena has been added with a cpu_mask */
+static bool arena_affinity;
+
+static inline bool arena_is_local(const pmm_arena_t *a, uint cpu)
+{
+    return a->cpu_mask & (1U << cpu);
+}
+
+/* step through the arenas, those local to cpu first and then the rest, each group in
+ * priority order. *pass tracks which of the two groups is being walked. */
+static pmm_arena_t *arena_next(pmm_arena_t *a, uint cpu, uint *pass)
+{
+    for (;;) {
+        if (a)
+            a = list_next_type(&arena_list, &a->node, pmm_arena_t, node);
+        else
+            a = list_peek_head_type(&arena_list, pmm_arena_t, node);
+
+        if (!a) {
+            if (++*pass > 1)
+                return NULL;
+            continue;
+        }
+
+        if (arena_is_local(a, cpu) == (*pass == 0))
+            return a;
+    }
+}
+
+#define for_every_arena_by_locality(a, pass) \
+    for (pass = arena_affinity ? 0 : 1, a = arena_next(NULL, arch_curr_cpu_num(), &pass); \
+         a; a = arena_next(a, arch_curr_cpu_num(), &pass))
+
 static inline bool page_is_free(const vm_page_t *page)
 {
     return !(page->flags & VM_PAGE_FLAG_NONFREE);
 }
 
+/*
+ * Buddy allocator.
+ *
+ * The free pages of every arena are kept as blocks of 2^order pages, aligned to
+ * their size in physical address space, on one free list per order. Only the
+ * first page of a free block is on a list; it is marked with
+ * VM_PAGE_FLAG_BUDDY_HEAD and records the order of the block. The other pages
+ * of the block are simply free.
+ *
+ * Allocating splits the smallest sufficient block, handing the unused halves
+ * back to the lower orders. Freeing merges a block with its buddy, the other
+ * half of the next larger block, as long as the buddy is also entirely free.
+ * All of this happens under the pmm lock.
+ */
+static inline size_t arena_page_count(const pmm_arena_t *a)
+{
+    return a->size / PAGE_SIZE;
+}
+
+static inline paddr_t page_pfn(const pmm_arena_t *a, size_t index)
+{
+    return (a->base / PAGE_SIZE) + index;
+}
+
+static inline bool block_is_free_head(const vm_page_t *page, uint order)
+{
+    return (page->flags & VM_PAGE_FLAG_BUDDY_HEAD) && page->order == order;
+}
+
+static void buddy_add_block(pmm_arena_t *a, size_t index, uint order)
+{
+    vm_page_t *page = &a->page_array[index];
+
+    DEBUG_ASSERT(order < PMM_MAX_ORDER);
+    DEBUG_ASSERT((page_pfn(a, index) & ((1UL << order) - 1)) == 0);
+    DEBUG_ASSERT(index + (1UL << order) <= a->init_count);
+
+    page->flags |= VM_PAGE_FLAG_BUDDY_HEAD;
+    page->order = order;
+    list_add_head(&a->free_lists[order], &page->node);
+}
+
+static void buddy_remove_block(vm_page_t *page)
+{
+    DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_BUDDY_HEAD);
+
+    list_delete(&page->node);
+    page->flags &= ~VM_PAGE_FLAG_BUDDY_HEAD;
+}
+
+/* return an already free block to the free lists, merging it with its buddies */
+static void buddy_free_block(pmm_arena_t *a, size_t index, uint order)
+{
+    while (order < PMM_MAX_ORDER - 1) {
+        paddr_t buddy_pfn = page_pfn(a, index) ^ (1UL << order);
+        if (buddy_pfn < page_pfn(a, 0))
+            break;
+
+        size_t buddy = buddy_pfn - page_pfn(a, 0);
+        if (buddy >= a->init_count || !block_is_free_head(&a->page_array[buddy], order))
+            break;
+
+        buddy_remove_block(&a->page_array[buddy]);
+        index = MIN(index, buddy);
+        order++;
+    }
+
+    buddy_add_block(a, index, order);
+}
+
+/* return a run of already free pages to the free lists as the largest aligned blocks that fit */
+static void buddy_free_run(pmm_arena_t *a, size_t index, size_t count)
+{
+    while (count > 0) {
+        uint order = 0;
+        while (order < PMM_MAX_ORDER - 1 &&
+                (page_pfn(a, index) & ((2UL << order) - 1)) == 0 &&
+                (2UL << order) <= count) {
+            order++;
+        }
+
+        buddy_free_block(a, index, order);
+        index += 1UL << order;
+        count -= 1UL << order;
+    }
+}
+
+/* take a block of 2^order pages off the free lists, splitting a larger one if needed.
+ * returns the index of the first page or -1. the pages are left marked free. */
+static ssize_t buddy_alloc_block(pmm_arena_t *a, uint order)
+{
+    for (uint o = order; o < PMM_MAX_ORDER; o++) {
+        vm_page_t *page = list_peek_head_type(&a->free_lists[o], vm_page_t, node);
+        if (!page)
+            continue;
+
+        buddy_remove_block(page);
+        size_t index = page - a->page_array;
+
+        /* hand the upper halves back until the block is the right size */
+        while (o > order) {
+            o--;
+            buddy_add_block(a, index + (1UL << o), o);
+        }
+
+        return index;
+    }
+
+    return -1;
+}
+
+/* take a specific free page off the free lists, splitting the block that contains it */
+static void buddy_alloc_page(pmm_arena_t *a, size_t index)
+{
+    DEBUG_ASSERT(page_is_free(&a->page_array[index]));
+
+    /* find the head of the free block this page is in */
+    vm_page_t *head_page = NULL;
+    size_t head = index;
+    uint order;
+    for (order = 0; order < PMM_MAX_ORDER; order++) {
+        size_t offset = page_pfn(a, index) & ((1UL << order) - 1);
+        if (offset > index)
+            break;
+
+        head = index - offset;
+        vm_page_t *page = &a->page_array[head];
+        if ((page->flags & VM_PAGE_FLAG_BUDDY_HEAD) && page->order >= order) {
+            head_page = page;
+            order = page->order;
+            break;
+        }
+    }
+
+    DEBUG_ASSERT(head_page);
+    if (!head_page)
+        return;
+
+    buddy_remove_block(head_page);
+
+    /* split it down, keeping the half with the page in it */
+    while (order > 0) {
+        order--;
+        size_t half = 1UL << order;
+        if (index < head + half) {
+            buddy_add_block(a, head + half, order);
+        } else {
+            buddy_add_block(a, head, order);
+            head += half;
+        }
+    }
+
+    DEBUG_ASSERT(head == index);
+}
+
+static void mark_allocated(pmm_arena_t *a, size_t index, struct list_node *list)
+{
+    vm_page_t *page = &a->page_array[index];
+
+    DEBUG_ASSERT(page_is_free(page));
+    DEBUG_ASSERT(!(page->flags & VM_PAGE_FLAG_BUDDY_HEAD));
+    DEBUG_ASSERT(!list_in_list(&page->node));
+
+    page->flags |= VM_PAGE_FLAG_NONFREE;
+    a->free_count--;
+
+    if (list)
+        list_add_tail(list, &page->node);
+}
+
+/*
+ * Per cpu page caches.
+ *
+ * Single page allocations and frees from KMAP arenas go through a short list of
+ * pages kept by every cpu, so most of them only take a per cpu spinlock instead
+ * of the pmm mutex. An empty cache is refilled PMM_PCP_BATCH pages at a time and
+ * a cache holding more than PMM_PCP_HIGH pages hands its coldest PMM_PCP_BATCH
+ * back. As far as the arenas are concerned, cached pages are allocated.
+ */
+#ifndef PMM_PCP_HIGH
+#define PMM_PCP_HIGH 32
+#endif
+#ifndef PMM_PCP_BATCH
+#define PMM_PCP_BATCH 8
+#endif
+
+struct pmm_page_cache {
+    spin_lock_t lock;
+    uint count;
+    struct list_node pages;
+
+    uint64_t alloc_hits;
+    uint64_t free_hits;
+    uint64_t refills;
+    uint64_t flushes;
+} __ALIGNED(CACHE_LINE);
+
+static struct pmm_page_cache page_caches[SMP_MAX_CPUS];
+
+static void page_caches_init(void)
+{
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        spin_lock_init(&page_caches[cpu].lock);
+        list_initialize(&page_caches[cpu].pages);
+    }
+}
+
+/* return the pages held by every cpu to the arenas, returns the number of pages freed */
+static size_t page_caches_drain(void)
+{
+    struct list_node pages = LIST_INITIAL_VALUE(pages);
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct pmm_page_cache *pcp = &page_caches[cpu];
+        struct list_node *node;
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&pcp->lock, state);
+        while ((node = list_remove_head(&pcp->pages)))
+            list_add_tail(&pages, node);
+        pcp->count = 0;
+        spin_unlock_irqrestore(&pcp->lock, state);
+    }
+
+    if (list_is_empty(&pages))
+        return 0;
+
+    return pmm_free(&pages);
+}
+
+static size_t page_cache_refill(struct list_node *list);
+
+vm_page_t *pmm_alloc_page(void)
+{
+    spin_lock_saved_state_t state;
+    struct pmm_page_cache *pcp;
+    vm_page_t *page;
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    pcp = &page_caches[arch_curr_cpu_num()];
+    spin_lock(&pcp->lock);
+    page = list_remove_head_type(&pcp->pages, vm_page_t, node);
+    if (page) {
+        pcp->count--;
+        pcp->alloc_hits++;
+    }
+    spin_unlock_restore(&pcp->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (page)
+        return page;
+
+    /* the cache is empty, pull a batch out of the arenas */
+    struct list_node batch = LIST_INITIAL_VALUE(batch);
+    size_t count = page_cache_refill(&batch);
+    if (count == 0 && page_caches_drain() > 0) {
+        /* other cpus were sitting on the last free pages */
+        count = page_cache_refill(&batch);
+    }
+
+    page = list_remove_head_type(&batch, vm_page_t, node);
+    if (!page)
+        return NULL;
+
+    /* stash the rest. we may be on another cpu by now, which is fine */
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    pcp = &page_caches[arch_curr_cpu_num()];
+    spin_lock(&pcp->lock);
+    struct list_node *node;
+    while ((node = list_remove_head(&batch))) {
+        list_add_tail(&pcp->pages, node);
+        pcp->count++;
+    }
+    pcp->refills++;
+    spin_unlock_restore(&pcp->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return page;
+}
+
+static void page_cache_free(vm_page_t *page)
+{
+    struct list_node flush = LIST_INITIAL_VALUE(flush);
+    spin_lock_saved_state_t state;
+    struct pmm_page_cache *pcp;
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    pcp = &page_caches[arch_curr_cpu_num()];
+    spin_lock(&pcp->lock);
+    list_add_head(&pcp->pages, &page->node);
+    pcp->count++;
+    pcp->free_hits++;
+    if (pcp->count > PMM_PCP_HIGH) {
+        /* hand back the pages that have been sitting here longest */
+        for (uint i = 0; i < PMM_PCP_BATCH; i++)
+            list_add_tail(&flush, list_remove_tail(&pcp->pages));
+        pcp->count -= PMM_PCP_BATCH;
+        pcp->flushes++;
+    }
+    spin_unlock_restore(&pcp->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (!list_is_empty(&flush))
+        pmm_free(&flush);
+}
+
 paddr_t vm_page_to_paddr(const vm_page_t *page)
 {
     pmm_arena_t *a;
@@ -70,12 +413,98 @@ vm_page_t *paddr_to_vm_page(paddr_t addr)
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
         if (addr >= a->base && addr <= a->base + a->size - 1) {
             size_t index = (addr - a->base) / PAGE_SIZE;
-            return &a->page_array[index];
+            /* pages past init_count have never been handed out */
+            return (index < a->init_count) ? &a->page_array[index] : NULL;
         }
     }
     return NULL;
 }
 
+/*
+ * Lazy arena initialization.
+ *
+ * Setting up the vm_page_t of every page of a big arena takes a while, so only
+ * the first PMM_EAGER_INIT_PAGES are done when it is added. Pages below
+ * init_count are part of the buddy allocator and everything above is untouched
+ * memory the allocator knows nothing about. An arena that runs out of free pages
+ * or is asked for a specific page above init_count grows by PMM_LAZY_INIT_CHUNK
+ * pages at a time, and a background thread grows the arenas to their full size.
+ */
+#ifndef PMM_EAGER_INIT_PAGES
+#define PMM_EAGER_INIT_PAGES 16384
+#endif
+#ifndef PMM_LAZY_INIT_CHUNK
+#define PMM_LAZY_INIT_CHUNK 4096
+#endif
+
+/* bring up to count more pages of the arena into the allocator, returns false if it
+ * was fully initialized already. must be called with the lock held. */
+static bool arena_grow(pmm_arena_t *a, size_t count)
+{
+    size_t start = a->init_count;
+
+    count = MIN(count, arena_page_count(a) - start);
+    if (count == 0)
+        return false;
+
+    LTRACEF("arena %p: pages %zu - %zu\n", a, start, start + count);
+
+    memset(&a->page_array[start], 0, count * sizeof(vm_page_t));
+    a->init_count = start + count;
+    buddy_free_run(a, start, count);
+    a->free_count += count;
+
+    return true;
+}
+
+/* buddy_alloc_block() that grows the arena if it has nothing left */
+static ssize_t arena_alloc_block(pmm_arena_t *a, uint order)
+{
+    for (;;) {
+        ssize_t index = buddy_alloc_block(a, order);
+        if (index >= 0 || !arena_grow(a, MAX(PMM_LAZY_INIT_CHUNK, 1UL << order)))
+            return index;
+    }
+}
+
+static void pmm_lazy_init(uint level)
+{
+    for (;;) {
+        bool grew = false;
+
+        mutex_acquire(&lock);
+        pmm_arena_t *a;
+        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+            if (arena_grow(a, PMM_LAZY_INIT_CHUNK)) {
+                grew = true;
+                break;
+            }
+        }
+        mutex_release(&lock);
+
+        if (!grew)
+            break;
+        thread_yield();
+    }
+}
+
+LK_INIT_HOOK_DEFERRED(pmm_lazy, &pmm_lazy_init, LK_INIT_LEVEL_THREADING);
+
+struct page_array_init {
+    vm_page_t *pages;
+    size_t count;
+};
+
+/* clear one cpu's share of a new page array */
+static void page_array_init(void *_arg, uint index, uint count)
+{
+    const struct page_array_init *arg = _arg;
+
+    size_t start = arg->count * index / count;
+    size_t end = arg->count * (index + 1) / count;
+    memset(&arg->pages[start], 0, (end - start) * sizeof(vm_page_t));
+}
+
 status_t pmm_add_arena(pmm_arena_t *arena)
 {
     LTRACEF("arena %p name '%s' base 0x%lx size 0x%zx\n", arena, arena->name, arena->base, arena->size);
@@ -98,25 +527,30 @@ status_t pmm_add_arena(pmm_arena_t *arena)
 
 done_add:
 
+    if (arena->cpu_mask)
+        arena_affinity = true;
+
+    if (list_length(&arena_list) == 1)
+        page_caches_init();
+
     /* zero out some of the structure */
     arena->free_count = 0;
-    list_initialize(&arena->free_list);
+    for (uint i = 0; i < PMM_MAX_ORDER; i++)
+        list_initialize(&arena->free_lists[i]);
 
     /* allocate an array of pages to back this one */
     size_t page_count = arena->size / PAGE_SIZE;
     arena->page_array = boot_alloc_mem(page_count * sizeof(vm_page_t));
 
-    /* initialize all of the pages */
-    memset(arena->page_array, 0, page_count * sizeof(vm_page_t));
+    /* initialize the first pages, with the help of any secondary cpus already up */
+    size_t eager = MIN(page_count, (size_t)PMM_EAGER_INIT_PAGES);
+    struct page_array_init init = { arena->page_array, eager };
+    mp_early_run(page_array_init, &init);
 
-    /* add them to the free list */
-    for (size_t i = 0; i < page_count; i++) {
-        vm_page_t *p = &arena->page_array[i];
-
-        list_add_tail(&arena->free_list, &p->node);
-
-        arena->free_count++;
-    }
+    /* add them to the free lists */
+    arena->init_count = eager;
+    buddy_free_run(arena, 0, eager);
+    arena->free_count = eager;
 
     return NO_ERROR;
 }
@@ -132,30 +566,67 @@ size_t pmm_alloc_pages(uint count, struct list_node *list)
     if (count == 0)
         return 0;
 
+    bool drained = false;
+retry_drained:
     mutex_acquire(&lock);
 
-    /* walk the arenas in order, allocating as many pages as we can from each */
+    /* walk the arenas nearest first, allocating as many pages as we can from each */
     pmm_arena_t *a;
-    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+    uint pass;
+    for_every_arena_by_locality(a, pass) {
         while (allocated < count) {
-            vm_page_t *page = list_remove_head_type(&a->free_list, vm_page_t, node);
-            if (!page)
-                goto done;
-
-            a->free_count--;
-
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+            ssize_t index = arena_alloc_block(a, 0);
+            if (index < 0)
+                break;
 
+            mark_allocated(a, index, list);
             allocated++;
         }
+
+        if (allocated == count)
+            break;
     }
 
-done:
     mutex_release(&lock);
+
+    if (allocated < count && !drained && page_caches_drain() > 0) {
+        drained = true;
+        goto retry_drained;
+    }
+
     return allocated;
 }
 
+/* allocate up to PMM_PCP_BATCH pages out of the KMAP arenas for a per cpu cache */
+static size_t page_cache_refill(struct list_node *list)
+{
+    size_t count = 0;
+
+    mutex_acquire(&lock);
+
+    pmm_arena_t *a;
+    uint pass;
+    for_every_arena_by_locality(a, pass) {
+        if (!(a->flags & PMM_ARENA_FLAG_KMAP))
+            continue;
+
+        while (count < PMM_PCP_BATCH) {
+            ssize_t index = arena_alloc_block(a, 0);
+            if (index < 0)
+                break;
+
+            mark_allocated(a, index, list);
+            count++;
+        }
+
+        if (count == PMM_PCP_BATCH)
+            break;
+    }
+
+    mutex_release(&lock);
+    return count;
+}
+
 size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
 {
     LTRACEF("address 0x%lx, count %u\n", address, count);
@@ -178,19 +649,18 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
 
             DEBUG_ASSERT(index < a->size / PAGE_SIZE);
 
+            while (index >= a->init_count)
+                arena_grow(a, PMM_LAZY_INIT_CHUNK);
+
             vm_page_t *page = &a->page_array[index];
             if (page->flags & VM_PAGE_FLAG_NONFREE) {
                 /* we hit an allocated page */
                 break;
             }
 
-            DEBUG_ASSERT(list_in_list(&page->node));
-
-            list_delete(&page->node);
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+            buddy_alloc_page(a, index);
+            mark_allocated(a, index, list);
 
-            a->free_count--;
             allocated++;
             address += PAGE_SIZE;
         }
@@ -224,7 +694,7 @@ size_t pmm_free(struct list_node *list)
             if (PAGE_BELONGS_TO_ARENA(page, a)) {
                 page->flags &= ~VM_PAGE_FLAG_NONFREE;
 
-                list_add_head(&a->free_list, &page->node);
+                buddy_free_block(a, page - a->page_array, 0);
                 a->free_count++;
                 count++;
                 break;
@@ -238,6 +708,20 @@ size_t pmm_free(struct list_node *list)
 
 size_t pmm_free_page(vm_page_t *page)
 {
+    DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
+
+    /* pages from KMAP arenas go back to this cpu's cache */
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        if (PAGE_BELONGS_TO_ARENA(page, a)) {
+            if (a->flags & PMM_ARENA_FLAG_KMAP) {
+                page_cache_free(page);
+                return 1;
+            }
+            break;
+        }
+    }
+
     struct list_node list;
     list_initialize(&list);
 
@@ -251,9 +735,6 @@ void *pmm_alloc_kpages(uint count, struct list_node *list)
 {
     LTRACEF("count %u\n", count);
 
-    // XXX do fast path for single page
-
-
     paddr_t pa;
     size_t alloc_count = pmm_alloc_contiguous(count, PAGE_SIZE_SHIFT, &pa, list);
     if (alloc_count == 0)
@@ -268,6 +749,11 @@ size_t pmm_free_kpages(void *_ptr, uint count)
 
     uint8_t *ptr = (uint8_t *)_ptr;
 
+    if (count == 1) {
+        vm_page_t *p = paddr_to_vm_page(vaddr_to_paddr(ptr));
+        return p ? pmm_free_page(p) : 0;
+    }
+
     struct list_node list;
     list_initialize(&list);
 
@@ -293,10 +779,61 @@ size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, str
     if (alignment_log2 < PAGE_SIZE_SHIFT)
         alignment_log2 = PAGE_SIZE_SHIFT;
 
+    /* single pages come out of the per cpu caches */
+    if (count == 1 && alignment_log2 == PAGE_SIZE_SHIFT) {
+        vm_page_t *page = pmm_alloc_page();
+        if (!page)
+            return 0;
+
+        if (pa)
+            *pa = vm_page_to_paddr(page);
+        if (list)
+            list_add_tail(list, &page->node);
+
+        return 1;
+    }
+
+    bool drained = false;
+retry_drained:
     mutex_acquire(&lock);
 
+    /* the smallest buddy block that holds the run is naturally aligned enough */
+    uint order = log2_uint(count);
+    if (!ispow2(count))
+        order++;
+    order = MAX(order, (uint)(alignment_log2 - PAGE_SIZE_SHIFT));
+
     pmm_arena_t *a;
-    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+    uint pass;
+    if (order < PMM_MAX_ORDER) {
+        for_every_arena_by_locality(a, pass) {
+            if (!(a->flags & PMM_ARENA_FLAG_KMAP))
+                continue;
+
+            ssize_t index = arena_alloc_block(a, order);
+            if (index < 0)
+                continue;
+
+            LTRACEF("found order %u block at pn %zd\n", order, index);
+
+            /* give back the tail past the end of the run */
+            buddy_free_run(a, index + count, (1UL << order) - count);
+
+            for (uint i = 0; i < count; i++)
+                mark_allocated(a, index + i, list);
+
+            if (pa)
+                *pa = a->base + index * PAGE_SIZE;
+
+            mutex_release(&lock);
+
+            return count;
+        }
+    }
+
+    /* no single block is big enough, fall back to looking for a run of free pages that
+     * spans several blocks */
+    for_every_arena_by_locality(a, pass) {
         // XXX make this a flag to only search kmap?
         if (a->flags & PMM_ARENA_FLAG_KMAP) {
             /* walk the list starting at alignment boundaries.
@@ -308,6 +845,10 @@ size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, str
             if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
                 continue;
 
+            /* the run may lie anywhere, so set up the whole arena first */
+            while (arena_grow(a, PMM_LAZY_INIT_CHUNK))
+                ;
+
             uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
             uint start = aligned_offset;
             LTRACEF("starting search at aligned offset %u\n", start);
@@ -316,8 +857,8 @@ size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, str
 retry:
             /* search while we're still within the arena and have a chance of finding a slot
                (start + count < end of arena) */
-            while ((start < a->size / PAGE_SIZE) &&
-                    ((start + count) <= a->size / PAGE_SIZE)) {
+            while ((start < a->init_count) &&
+                    ((start + count) <= a->init_count)) {
                 vm_page_t *p = &a->page_array[start];
                 for (uint i = 0; i < count; i++) {
                     if (p->flags & VM_PAGE_FLAG_NONFREE) {
@@ -333,18 +874,10 @@ retry:
                 /* we found a run */
                 LTRACEF("found run from pn %u to %u\n", start, start + count);
 
-                /* remove the pages from the run out of the free list */
+                /* remove the pages from the run out of the free lists */
                 for (uint i = start; i < start + count; i++) {
-                    p = &a->page_array[i];
-                    DEBUG_ASSERT(!(p->flags & VM_PAGE_FLAG_NONFREE));
-                    DEBUG_ASSERT(list_in_list(&p->node));
-
-                    list_delete(&p->node);
-                    p->flags |= VM_PAGE_FLAG_NONFREE;
-                    a->free_count--;
-
-                    if (list)
-                        list_add_tail(list, &p->node);
+                    buddy_alloc_page(a, i);
+                    mark_allocated(a, i, list);
                 }
 
                 if (pa)
@@ -359,6 +892,12 @@ retry:
 
     mutex_release(&lock);
 
+    /* pages sitting in the per cpu caches may complete a run */
+    if (!drained && page_caches_drain() > 0) {
+        drained = true;
+        goto retry_drained;
+    }
+
     LTRACEF("couldn't find run\n");
     return 0;
 }
@@ -368,16 +907,49 @@ static void dump_page(const vm_page_t *page)
     printf("page %p: address 0x%lx flags 0x%x\n", page, vm_page_to_paddr(page), page->flags);
 }
 
-static void dump_arena(const pmm_arena_t *arena, bool dump_pages)
+static void dump_buddy_stats(pmm_arena_t *arena)
+{
+    size_t blocks[PMM_MAX_ORDER];
+    size_t free_count;
+
+    mutex_acquire(&lock);
+    for (uint i = 0; i < PMM_MAX_ORDER; i++)
+        blocks[i] = list_length(&arena->free_lists[i]);
+    free_count = arena->free_count;
+    mutex_release(&lock);
+
+    printf("\tfree blocks by order (order: blocks):");
+    int largest = -1;
+    for (uint i = 0; i < PMM_MAX_ORDER; i++) {
+        if (blocks[i]) {
+            printf(" %u: %zu", i, blocks[i]);
+            largest = i;
+        }
+    }
+    printf("\n");
+
+    if (largest < 0)
+        return;
+
+    /* how much of the free memory is not in a block of the largest free order */
+    size_t largest_pages = blocks[largest] << largest;
+    printf("\tlargest free block %zu pages, fragmentation %zu%%\n",
+           (size_t)1 << largest, (free_count - largest_pages) * 100 / free_count);
+}
+
+static void dump_arena(pmm_arena_t *arena, bool dump_pages)
 {
-    printf("arena %p: name '%s' base 0x%lx size 0x%zx priority %u flags 0x%x\n",
-           arena, arena->name, arena->base, arena->size, arena->priority, arena->flags);
-    printf("\tpage_array %p, free_count %zu\n",
-           arena->page_array, arena->free_count);
+    printf("arena %p: name '%s' base 0x%lx size 0x%zx priority %u flags 0x%x cpu_mask 0x%x\n",
+           arena, arena->name, arena->base, arena->size, arena->priority, arena->flags,
+           arena->cpu_mask);
+    printf("\tpage_array %p, free_count %zu, initialized %zu of %zu pages\n",
+           arena->page_array, arena->free_count, arena->init_count, arena_page_count(arena));
+
+    dump_buddy_stats(arena);
 
     /* dump all of the pages */
     if (dump_pages) {
-        for (size_t i = 0; i < arena->size / PAGE_SIZE; i++) {
+        for (size_t i = 0; i < arena->init_count; i++) {
             dump_page(&arena->page_array[i]);
         }
     }
@@ -385,7 +957,7 @@ static void dump_arena(const pmm_arena_t *arena, bool dump_pages)
     /* dump the free pages */
     printf("\tfree ranges:\n");
     ssize_t last = -1;
-    for (size_t i = 0; i < arena->size / PAGE_SIZE; i++) {
+    for (size_t i = 0; i < arena->init_count; i++) {
         if (page_is_free(&arena->page_array[i])) {
             if (last == -1) {
                 last = i;
@@ -399,7 +971,25 @@ static void dump_arena(const pmm_arena_t *arena, bool dump_pages)
     }
 
     if (last != -1) {
-        printf("\t\t0x%lx - 0x%lx\n",  arena->base + last * PAGE_SIZE, arena->base + arena->size);
+        printf("\t\t0x%lx - 0x%lx\n",  arena->base + last * PAGE_SIZE,
+               arena->base + arena->init_count * PAGE_SIZE);
+    }
+}
+
+static void dump_page_caches(void)
+{
+    printf("cpu page caches: high %u batch %u\n", PMM_PCP_HIGH, PMM_PCP_BATCH);
+    printf("%-4s %6s %12s %12s %10s %10s\n", "cpu", "pages", "alloc hits", "free hits", "refills", "flushes");
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct pmm_page_cache *pcp = &page_caches[cpu];
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&pcp->lock, state);
+        struct pmm_page_cache snap = *pcp;
+        spin_unlock_irqrestore(&pcp->lock, state);
+
+        printf("%-4u %6u %12llu %12llu %10llu %10llu\n", cpu, snap.count,
+               snap.alloc_hits, snap.free_hits, snap.refills, snap.flushes);
     }
 }
 
@@ -411,6 +1001,8 @@ notenoughargs:
 usage:
         printf("usage:\n");
         printf("%s arenas\n", argv[0].str);
+        printf("%s caches\n", argv[0].str);
+        printf("%s drain\n", argv[0].str);
         printf("%s alloc <count>\n", argv[0].str);
         printf("%s alloc_range <address> <count>\n", argv[0].str);
         printf("%s alloc_kpages <count>\n", argv[0].str);
@@ -427,6 +1019,10 @@ usage:
         list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
             dump_arena(a, false);
         }
+    } else if (!strcmp(argv[1].str, "caches")) {
+        dump_page_caches();
+    } else if (!strcmp(argv[1].str, "drain")) {
+        printf("drained %zu pages\n", page_caches_drain());
     } else if (!strcmp(argv[1].str, "alloc")) {
         if (argc < 3) goto notenoughargs;
 
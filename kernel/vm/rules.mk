@@ -2,10 +2,15 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
+MODULE_DEPS += \
+	lib/pool
+
 MODULE_SRCS += \
 	$(LOCAL_DIR)/bootalloc.c \
+	$(LOCAL_DIR)/kstack.c \
 	$(LOCAL_DIR)/pmm.c \
 	$(LOCAL_DIR)/vm.c \
 	$(LOCAL_DIR)/vmm.c \
+	$(LOCAL_DIR)/vmm_tree.c \
 
 include make/module.mk
@@ -34,3 +34,14 @@ extern uintptr_t boot_alloc_end;
 void vmm_init_preheap(void);
 void vmm_init(void);
 
+/* region tree, kept alongside the sorted region list of every aspace */
+void vmm_region_tree_insert(vmm_aspace_t *aspace, vmm_region_t *r);
+void vmm_region_tree_remove(vmm_aspace_t *aspace, vmm_region_t *r);
+
+/* the region with the highest base at or below vaddr, or NULL */
+vmm_region_t *vmm_region_tree_floor(const vmm_aspace_t *aspace, vaddr_t vaddr);
+
+/* the first region after r (or the first region at all if r is NULL) in address order
+ * with at least min_gap bytes of free space in front of it, or NULL */
+vmm_region_t *vmm_region_tree_next_gap(const vmm_aspace_t *aspace, const vmm_region_t *r, size_t min_gap);
+
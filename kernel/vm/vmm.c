@@ -25,7 +25,9 @@
 #include <err.h>
 #include <string.h>
 #include <lib/console.h>
+#include <lib/slab.h>
 #include <kernel/vm.h>
+#include <kernel/mp.h>
 #include <kernel/mutex.h>
 #include "vm_priv.h"
 
@@ -33,11 +35,25 @@
 
 static struct list_node aspace_list = LIST_INITIAL_VALUE(aspace_list);
 static mutex_t vmm_lock = MUTEX_INITIAL_VALUE(vmm_lock);
+static slab_cache_t region_cache;
 
 vmm_aspace_t _kernel_aspace;
 
-static void dump_aspace(const vmm_aspace_t *a);
-static void dump_region(const vmm_region_t *r);
+static void dump_aspace(vmm_aspace_t *a);
+static void dump_region(vmm_aspace_t *a, const vmm_region_t *r);
+static size_t region_map_granule(vmm_aspace_t *a, const vmm_region_t *r);
+
+/* pages shared copy-on-write between a region and its clones. the object owns them until the
+ * last region referencing it goes away, pages copied on write belong to the region that made
+ * the copy. protected by vmm_lock. */
+struct vmm_cow_object {
+    uint refs;
+    size_t page_count;
+    struct list_node pages;
+};
+
+/* zeroed page mapped read only into untouched pages of lazy zero fill regions, never freed */
+static vm_page_t *shared_zero_page;
 
 void vmm_init_preheap(void)
 {
@@ -55,6 +71,7 @@ void vmm_init_preheap(void)
 
 void vmm_init(void)
 {
+    TYPED_SLAB_CACHE_INIT(vmm_region_t, &region_cache, "vmm_region", NULL, NULL);
 }
 
 static inline bool is_inside_aspace(const vmm_aspace_t *aspace, vaddr_t vaddr)
@@ -112,10 +129,12 @@ static vmm_region_t *alloc_region_struct(const char *name, vaddr_t base, size_t
 {
     DEBUG_ASSERT(name);
 
-    vmm_region_t *r = calloc(1, sizeof(vmm_region_t));
+    vmm_region_t *r = TYPED_SLAB_ALLOC(vmm_region_t, &region_cache);
     if (!r)
         return NULL;
 
+    memset(r, 0, sizeof(*r));
+
     strlcpy(r->name, name, sizeof(r->name));
     r->base = base;
     r->size = size;
@@ -144,31 +163,24 @@ static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
 
     vaddr_t r_end = r->base + r->size - 1;
 
-    /* does it fit in front */
-    vmm_region_t *last;
-    last = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
-    if (!last || r_end < last->base) {
-        /* empty list or not empty and fits before the first element */
-        list_add_head(&aspace->region_list, &r->node);
-        return NO_ERROR;
-    }
+    /* find the regions it would go between */
+    vmm_region_t *prev = vmm_region_tree_floor(aspace, r->base);
+    vmm_region_t *next;
+    if (prev)
+        next = list_next_type(&aspace->region_list, &prev->node, vmm_region_t, node);
+    else
+        next = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
 
-    /* walk the list, finding the right spot to put it */
-    list_for_every_entry(&aspace->region_list, last, vmm_region_t, node) {
-        /* does it go after last? */
-        if (r->base > last->base + last->size - 1) {
-            /* get the next element in the list */
-            vmm_region_t *next = list_next_type(&aspace->region_list, &last->node, vmm_region_t, node);
-            if (!next || (r_end < next->base)) {
-                /* end of the list or next exists and it goes between them */
-                list_add_after(&last->node, &r->node);
-                return NO_ERROR;
-            }
-        }
+    /* does it fit between them */
+    if ((prev && r->base <= prev->base + prev->size - 1) || (next && r_end >= next->base)) {
+        LTRACEF("couldn't find spot\n");
+        return ERR_NO_MEMORY;
     }
 
-    LTRACEF("couldn't find spot\n");
-    return ERR_NO_MEMORY;
+    list_add_after(prev ? &prev->node : &aspace->region_list, &r->node);
+    vmm_region_tree_insert(aspace, r);
+
+    return NO_ERROR;
 }
 
 /*
@@ -184,6 +196,16 @@ __WEAK vaddr_t arch_mmu_pick_spot(arch_aspace_t *aspace, vaddr_t base, uint prev
     return ALIGN(base, align);
 }
 
+/*
+ *  Largest block the arch can map in one entry.
+ *
+ *  Arches that can map large pages override this.
+ */
+__WEAK uint arch_mmu_block_shift(arch_aspace_t *aspace, paddr_t paddr, size_t size)
+{
+    return PAGE_SIZE_SHIFT;
+}
+
 /*
  *  Returns true if the caller has to stop search
  */
@@ -246,20 +268,22 @@ static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2,
     vaddr_t spot;
     vmm_region_t *r = NULL;
 
-    /* try to pick spot at the beginning of address space */
-    if (check_gap(aspace, NULL,
-                  list_peek_head_type(&aspace->region_list, vmm_region_t, node),
-                  &spot, align, size, arch_mmu_flags))
-        goto done;
-
-    /* search the middle of the list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if (check_gap(aspace, r,
-                      list_next_type(&aspace->region_list, &r->node, vmm_region_t, node),
-                      &spot, align, size, arch_mmu_flags))
+    /* look at the gaps in front of every region in address order, skipping the ones
+     * that are too small to hold it at all */
+    vmm_region_t *next = vmm_region_tree_next_gap(aspace, NULL, size);
+    while (next) {
+        r = list_prev_type(&aspace->region_list, &next->node, vmm_region_t, node);
+        if (check_gap(aspace, r, next, &spot, align, size, arch_mmu_flags))
             goto done;
+
+        next = vmm_region_tree_next_gap(aspace, next, size);
     }
 
+    /* then the space past the last region */
+    r = list_peek_tail_type(&aspace->region_list, vmm_region_t, node);
+    if (check_gap(aspace, r, NULL, &spot, align, size, arch_mmu_flags))
+        goto done;
+
     /* couldn't find anything */
     return -1;
 
@@ -284,7 +308,7 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
         /* stick it in the list, checking to see if it fits */
         if (add_region_to_aspace(aspace, r) < 0) {
             /* didn't fit */
-            free(r);
+            slab_free(&region_cache, r);
             return NULL;
         }
     } else {
@@ -296,7 +320,7 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
 
         if (vaddr == (vaddr_t)-1) {
             LTRACEF("failed to find spot\n");
-            free(r);
+            slab_free(&region_cache, r);
             return NULL;
         }
 
@@ -306,11 +330,88 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
 
         /* add it to the region list */
         list_add_after(before, &r->node);
+        vmm_region_tree_insert(aspace, r);
     }
 
     return r;
 }
 
+/* clear physical pages through the kernel's mapping of them */
+static void zero_page(paddr_t pa, size_t count)
+{
+    void *va = paddr_to_kvaddr(pa);
+    DEBUG_ASSERT(va);
+    if (va)
+        memset(va, 0, count * PAGE_SIZE);
+}
+
+static inline bool is_shared_zero_page(paddr_t pa)
+{
+    return shared_zero_page && pa == vm_page_to_paddr(shared_zero_page);
+}
+
+static status_t get_shared_zero_page_locked(paddr_t *pa)
+{
+    if (!shared_zero_page) {
+        vm_page_t *page = pmm_alloc_page();
+        if (!page)
+            return ERR_NO_MEMORY;
+
+        zero_page(vm_page_to_paddr(page), 1);
+        shared_zero_page = page;
+    }
+
+    *pa = vm_page_to_paddr(shared_zero_page);
+    return NO_ERROR;
+}
+
+static status_t remap_page_locked(vmm_aspace_t *aspace, vaddr_t va, paddr_t pa, uint arch_mmu_flags)
+{
+    arch_mmu_unmap(&aspace->arch_aspace, va, 1);
+
+    int err = arch_mmu_map(&aspace->arch_aspace, va, pa, 1, arch_mmu_flags);
+    return (err < 0) ? err : NO_ERROR;
+}
+
+/* drop a region's reference to its shared pages, moving them to free_list if it was the last */
+static void release_cow_locked(vmm_region_t *r, struct list_node *free_list)
+{
+    struct vmm_cow_object *cow = r->cow;
+    if (!cow)
+        return;
+
+    r->cow = NULL;
+    if (--cow->refs > 0)
+        return;
+
+    vm_page_t *p;
+    while ((p = list_remove_head_type(&cow->pages, vm_page_t, node)))
+        list_add_tail(free_list, &p->node);
+    free(cow);
+}
+
+/* allocate a region for a physically contiguous run, preferring a virtual address aligned
+ * such that the arch can map it with large blocks */
+static vmm_region_t *alloc_physical_region(vmm_aspace_t *aspace, const char *name, size_t size,
+        vaddr_t vaddr, uint8_t align_pow2, paddr_t paddr,
+        uint vmm_flags, uint arch_mmu_flags)
+{
+    if (!(vmm_flags & VMM_FLAG_VALLOC_SPECIFIC)) {
+        uint block_shift = arch_mmu_block_shift(&aspace->arch_aspace, paddr, size);
+        if (block_shift > MAX(align_pow2, PAGE_SIZE_SHIFT)) {
+            vmm_region_t *r = alloc_region(aspace, name, size, vaddr, block_shift, vmm_flags,
+                                           VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+            if (r)
+                return r;
+
+            LTRACEF("no spot aligned to 0x%lx, falling back to small pages\n", 1UL << block_shift);
+        }
+    }
+
+    return alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
+                        VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+}
+
 status_t vmm_reserve_space(vmm_aspace_t *aspace, const char *name, size_t size, vaddr_t vaddr)
 {
     LTRACEF("aspace %p name '%s' size 0x%zx vaddr 0x%lx\n", aspace, name, size, vaddr);
@@ -385,8 +486,8 @@ status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size,
     mutex_acquire(&vmm_lock);
 
     /* allocate a region and put it in the aspace list */
-    vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_log2, vmm_flags,
-                                   VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    vmm_region_t *r = alloc_physical_region(aspace, name, size, vaddr, align_log2, paddr,
+                                            vmm_flags, arch_mmu_flags);
     if (!r) {
         ret = ERR_NO_MEMORY;
         goto err_alloc_region;
@@ -452,8 +553,8 @@ status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t siz
     mutex_acquire(&vmm_lock);
 
     /* allocate a region and put it in the aspace list */
-    vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
-                                   VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    vmm_region_t *r = alloc_physical_region(aspace, name, size, vaddr, align_pow2, pa,
+                                            vmm_flags, arch_mmu_flags);
     if (!r) {
         err = ERR_NO_MEMORY;
         goto err1;
@@ -463,9 +564,13 @@ status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t siz
     if (ptr)
         *ptr = (void *)r->base;
 
+    if (vmm_flags & VMM_FLAG_ZERO_FILL)
+        zero_page(pa, size / PAGE_SIZE);
+
     /* map all of the pages */
     arch_mmu_map(&aspace->arch_aspace, r->base, pa, size / PAGE_SIZE, arch_mmu_flags);
     // XXX deal with error mapping here
+    r->committed = size / PAGE_SIZE;
 
     vm_page_t *p;
     while ((p = list_remove_head_type(&page_list, vm_page_t, node))) {
@@ -511,6 +616,24 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
         vaddr = (vaddr_t)*ptr;
     }
 
+    uint zero_flag = (vmm_flags & VMM_FLAG_ZERO_FILL) ? VMM_REGION_FLAG_ZERO : 0;
+
+    /* the guard page is part of the region, but never mapped */
+    size_t guard = (vmm_flags & VMM_FLAG_GUARD_PAGE) ? PAGE_SIZE : 0;
+    vaddr -= (vmm_flags & VMM_FLAG_VALLOC_SPECIFIC) ? guard : 0;
+
+    /* lazy regions get their pages from the page fault handler */
+    if (vmm_flags & VMM_FLAG_COMMIT_LAZY) {
+        mutex_acquire(&vmm_lock);
+        vmm_region_t *r = alloc_region(aspace, name, size + guard, vaddr, align_pow2, vmm_flags,
+                                       VMM_REGION_FLAG_LAZY | zero_flag, arch_mmu_flags);
+        if (r && ptr)
+            *ptr = (void *)(r->base + guard);
+        mutex_release(&vmm_lock);
+
+        return r ? NO_ERROR : ERR_NO_MEMORY;
+    }
+
     /* allocate physical memory up front, in case it cant be satisfied */
 
     /* allocate a random pile of pages */
@@ -529,8 +652,8 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
     mutex_acquire(&vmm_lock);
 
     /* allocate a region and put it in the aspace list */
-    vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
-                                   VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    vmm_region_t *r = alloc_region(aspace, name, size + guard, vaddr, align_pow2, vmm_flags,
+                                   VMM_REGION_FLAG_PHYSICAL | zero_flag, arch_mmu_flags);
     if (!r) {
         err = ERR_NO_MEMORY;
         goto err1;
@@ -538,12 +661,12 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
 
     /* return the vaddr if requested */
     if (ptr)
-        *ptr = (void *)r->base;
+        *ptr = (void *)(r->base + guard);
 
     /* map all of the pages */
     /* XXX use smarter algorithm that tries to build runs */
     vm_page_t *p;
-    vaddr_t va = r->base;
+    vaddr_t va = r->base + guard;
     DEBUG_ASSERT(IS_PAGE_ALIGNED(va));
     while ((p = list_remove_head_type(&page_list, vm_page_t, node))) {
         DEBUG_ASSERT(va <= r->base + r->size - 1);
@@ -551,10 +674,14 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
         paddr_t pa = vm_page_to_paddr(p);
         DEBUG_ASSERT(IS_PAGE_ALIGNED(pa));
 
+        if (zero_flag)
+            zero_page(pa, 1);
+
         arch_mmu_map(&aspace->arch_aspace, va, pa, 1, arch_mmu_flags);
         // XXX deal with error mapping here
 
         list_add_tail(&r->page_list, &p->node);
+        r->committed++;
 
         va += PAGE_SIZE;
     }
@@ -569,24 +696,74 @@ err:
     return err;
 }
 
-static vmm_region_t *vmm_find_region(const vmm_aspace_t *aspace, vaddr_t vaddr)
+status_t vmm_alloc_pager(vmm_aspace_t *aspace, const char *name, size_t size, void **ptr,
+                         uint8_t align_pow2, vmm_pager_t *pager, uint vmm_flags, uint arch_mmu_flags)
 {
-    vmm_region_t *r;
+    LTRACEF("aspace %p name '%s' size 0x%zx ptr %p align %hhu pager %p vmm_flags 0x%x arch_mmu_flags 0x%x\n",
+            aspace, name, size, ptr ? *ptr : 0, align_pow2, pager, vmm_flags, arch_mmu_flags);
+
+    DEBUG_ASSERT(aspace);
+    DEBUG_ASSERT(pager && pager->fill && pager->release);
+
+    size = ROUNDUP(size, PAGE_SIZE);
+    if (size == 0)
+        return ERR_INVALID_ARGS;
+
+    if (!name)
+        name = "";
+
+    vaddr_t vaddr = 0;
+
+    /* if they're asking for a specific spot, copy the address */
+    if (vmm_flags & VMM_FLAG_VALLOC_SPECIFIC) {
+        /* can't ask for a specific spot and then not provide one */
+        if (!ptr)
+            return ERR_INVALID_ARGS;
+        vaddr = (vaddr_t)*ptr;
+    }
+
+    mutex_acquire(&vmm_lock);
+
+    vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
+                                   VMM_REGION_FLAG_LAZY | VMM_REGION_FLAG_PAGER, arch_mmu_flags);
+    if (r) {
+        pager->refs = 1;
+        r->pager = pager;
+        if (ptr)
+            *ptr = (void *)r->base;
+    }
+
+    mutex_release(&vmm_lock);
+
+    return r ? NO_ERROR : ERR_NO_MEMORY;
+}
 
+static vmm_region_t *vmm_find_region(const vmm_aspace_t *aspace, vaddr_t vaddr)
+{
     DEBUG_ASSERT(aspace);
 
     if (!aspace)
         return NULL;
 
-    /* search the region list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if ((vaddr >= r->base) && (vaddr <= r->base + r->size - 1))
-            return r;
-    }
+    /* search the region tree */
+    vmm_region_t *r = vmm_region_tree_floor(aspace, vaddr);
+    if (r && vaddr <= r->base + r->size - 1)
+        return r;
 
     return NULL;
 }
 
+/* drop a reference to a pager, releasing it with the last one. called without vmm_lock held */
+static void put_pager(vmm_pager_t *pager)
+{
+    mutex_acquire(&vmm_lock);
+    bool last = (--pager->refs == 0);
+    mutex_release(&vmm_lock);
+
+    if (last)
+        pager->release(pager);
+}
+
 status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr)
 {
     mutex_acquire(&vmm_lock);
@@ -598,22 +775,315 @@ status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr)
     }
 
     /* remove it from aspace */
+    vmm_region_tree_remove(aspace, r);
     list_delete(&r->node);
 
     /* unmap it */
     arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
 
+    struct list_node shared_pages = LIST_INITIAL_VALUE(shared_pages);
+    release_cow_locked(r, &shared_pages);
+
     mutex_release(&vmm_lock);
 
+    /* other cpus may still be holding translations into the pages */
+    mp_tlb_shootdown(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
+
     /* return physical pages if any */
     pmm_free(&r->page_list);
+    pmm_free(&shared_pages);
+
+    if (r->pager)
+        put_pager(r->pager);
 
     /* free it */
-    free(r);
+    slab_free(&region_cache, r);
 
     return NO_ERROR;
 }
 
+/* a write to a page mapped read only because it is shared, give the region its own copy */
+static status_t break_sharing_locked(vmm_aspace_t *aspace, vmm_region_t *r, vaddr_t va, paddr_t pa)
+{
+    bool zero = is_shared_zero_page(pa);
+
+    /* the last region holding on to a shared page can simply have it back writable */
+    if (!zero && r->cow && r->cow->refs == 1)
+        return remap_page_locked(aspace, va, pa, r->arch_mmu_flags);
+
+    vm_page_t *page = pmm_alloc_page();
+    if (!page)
+        return ERR_NO_MEMORY;
+
+    paddr_t new_pa = vm_page_to_paddr(page);
+    if (zero)
+        zero_page(new_pa, 1);
+    else
+        memcpy(paddr_to_kvaddr(new_pa), paddr_to_kvaddr(pa), PAGE_SIZE);
+
+    status_t err = remap_page_locked(aspace, va, new_pa, r->arch_mmu_flags);
+    if (err < 0) {
+        pmm_free_page(page);
+        return err;
+    }
+
+    /* nobody may keep reading the old page through a stale translation */
+    mp_tlb_shootdown(&aspace->arch_aspace, va, 1);
+
+    list_add_tail(&r->page_list, &page->node);
+    r->committed++;
+
+    return NO_ERROR;
+}
+
+status_t vmm_clone_region(vmm_aspace_t *aspace, const char *name, vmm_aspace_t *src_aspace,
+                          vaddr_t src_vaddr, void **ptr, uint8_t align_pow2, uint vmm_flags)
+{
+    status_t err = NO_ERROR;
+
+    LTRACEF("aspace %p name '%s' src_aspace %p src_vaddr 0x%lx ptr %p align %hhu vmm_flags 0x%x\n",
+            aspace, name, src_aspace, src_vaddr, ptr ? *ptr : 0, align_pow2, vmm_flags);
+
+    DEBUG_ASSERT(aspace);
+    DEBUG_ASSERT(src_aspace);
+
+    if (!name)
+        name = "";
+
+    vaddr_t vaddr = 0;
+
+    /* if they're asking for a specific spot, copy the address */
+    if (vmm_flags & VMM_FLAG_VALLOC_SPECIFIC) {
+        /* can't ask for a specific spot and then not provide one */
+        if (!ptr)
+            return ERR_INVALID_ARGS;
+        vaddr = (vaddr_t)*ptr;
+    }
+
+    mutex_acquire(&vmm_lock);
+
+    vmm_region_t *src = vmm_find_region(src_aspace, src_vaddr);
+    if (!src) {
+        err = ERR_NOT_FOUND;
+        goto out;
+    }
+
+    /* only regions backed by pages from the pmm, mapped a page at a time, can be shared */
+    if ((src->flags & (VMM_REGION_FLAG_RESERVED | VMM_REGION_FLAG_PAGER)) ||
+            (list_is_empty(&src->page_list) && !src->cow && !(src->flags & VMM_REGION_FLAG_LAZY)) ||
+            region_map_granule(src_aspace, src) > PAGE_SIZE) {
+        err = ERR_NOT_SUPPORTED;
+        goto out;
+    }
+
+    struct vmm_cow_object *cow = src->cow;
+    if (!cow) {
+        cow = calloc(1, sizeof(*cow));
+        if (!cow) {
+            err = ERR_NO_MEMORY;
+            goto out;
+        }
+        list_initialize(&cow->pages);
+    }
+
+    vmm_region_t *r = alloc_region(aspace, name, src->size, vaddr, align_pow2, vmm_flags,
+                                   src->flags | VMM_REGION_FLAG_COW, src->arch_mmu_flags);
+    if (!r) {
+        if (!src->cow)
+            free(cow);
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+
+    if (!src->cow) {
+        cow->refs = 1;
+        src->cow = cow;
+        src->flags |= VMM_REGION_FLAG_COW;
+    }
+    cow->refs++;
+    r->cow = cow;
+
+    /* everything the source owns so far is shared from now on */
+    vm_page_t *p;
+    while ((p = list_remove_head_type(&src->page_list, vm_page_t, node))) {
+        list_add_tail(&cow->pages, &p->node);
+        cow->page_count++;
+    }
+    src->committed = 0;
+
+    /* map whatever is present read only on both sides */
+    uint ro_flags = src->arch_mmu_flags | ARCH_MMU_FLAG_PERM_RO;
+    for (size_t offset = 0; offset < src->size; offset += PAGE_SIZE) {
+        paddr_t pa;
+        if (arch_mmu_query(&src_aspace->arch_aspace, src->base + offset, &pa, NULL) < 0)
+            continue;
+
+        remap_page_locked(src_aspace, src->base + offset, pa, ro_flags);
+        arch_mmu_map(&aspace->arch_aspace, r->base + offset, pa, 1, ro_flags);
+    }
+
+    /* the source may be in use on other cpus with writable translations */
+    mp_tlb_shootdown(&src_aspace->arch_aspace, src->base, src->size / PAGE_SIZE);
+
+    if (ptr)
+        *ptr = (void *)r->base;
+
+out:
+    mutex_release(&vmm_lock);
+    return err;
+}
+
+/* fill in a page of a pager region. vmm_lock is dropped while the pager runs, so the region
+ * may be gone or the page mapped by someone else by the time it is done. */
+static status_t pager_fault_locked(vmm_aspace_t *aspace, vmm_region_t *r, vaddr_t va)
+{
+    vmm_pager_t *pager = r->pager;
+    size_t offset = va - r->base;
+    status_t err;
+
+    pager->refs++;
+    mutex_release(&vmm_lock);
+
+    /* map the pager's own page if it has one, the region never owns it */
+    paddr_t lent_pa;
+    bool lent = pager->lookup && pager->lookup(pager, offset, &lent_pa) == NO_ERROR;
+
+    vm_page_t *page = NULL;
+    if (lent) {
+        err = NO_ERROR;
+    } else if ((page = pmm_alloc_page())) {
+        err = pager->fill(pager, offset, paddr_to_kvaddr(vm_page_to_paddr(page)));
+    } else {
+        err = ERR_NO_MEMORY;
+    }
+
+    mutex_acquire(&vmm_lock);
+    if (err < 0)
+        goto out;
+
+    paddr_t pa;
+    if (vmm_find_region(aspace, va) != r || r->pager != pager ||
+            arch_mmu_query(&aspace->arch_aspace, va, &pa, NULL) == NO_ERROR) {
+        /* nothing left to do, retrying the access sorts it out */
+        err = NO_ERROR;
+        goto out;
+    }
+
+    if (lent) {
+        err = arch_mmu_map(&aspace->arch_aspace, va, lent_pa, 1, r->arch_mmu_flags | ARCH_MMU_FLAG_PERM_RO);
+        if (err > 0)
+            err = NO_ERROR;
+        goto out;
+    }
+
+    err = arch_mmu_map(&aspace->arch_aspace, va, vm_page_to_paddr(page), 1, r->arch_mmu_flags);
+    if (err < 0)
+        goto out;
+
+    list_add_tail(&r->page_list, &page->node);
+    r->committed++;
+    page = NULL;
+    err = NO_ERROR;
+
+out:
+    if (page)
+        pmm_free_page(page);
+
+    if (--pager->refs == 0) {
+        /* the region went away while the pager was running */
+        mutex_release(&vmm_lock);
+        pager->release(pager);
+        mutex_acquire(&vmm_lock);
+    }
+
+    return err;
+}
+
+status_t vmm_page_fault_handler(vaddr_t addr, uint pf_flags)
+{
+    LTRACEF("addr 0x%lx pf_flags 0x%x\n", addr, pf_flags);
+
+    /* only missing pages can be filled in, and shared ones written to */
+    if (!(pf_flags & (VMM_PF_FLAG_NOT_PRESENT | VMM_PF_FLAG_WRITE)))
+        return ERR_ACCESS_DENIED;
+
+    vmm_aspace_t *aspace = vaddr_to_aspace((void *)addr);
+    if (!aspace)
+        return ERR_NOT_FOUND;
+
+    vaddr_t va = ROUNDDOWN(addr, PAGE_SIZE);
+    status_t err;
+
+    mutex_acquire(&vmm_lock);
+
+    vmm_region_t *r = vmm_find_region(aspace, va);
+    if (!r || !(r->flags & (VMM_REGION_FLAG_LAZY | VMM_REGION_FLAG_COW))) {
+        err = ERR_NOT_FOUND;
+        goto out;
+    }
+
+    /* check the access against the permissions of the region */
+    if (((pf_flags & VMM_PF_FLAG_WRITE) && (r->arch_mmu_flags & ARCH_MMU_FLAG_PERM_RO)) ||
+            ((pf_flags & VMM_PF_FLAG_USER) && !(r->arch_mmu_flags & ARCH_MMU_FLAG_PERM_USER)) ||
+            ((pf_flags & VMM_PF_FLAG_INSTRUCTION) && (r->arch_mmu_flags & ARCH_MMU_FLAG_PERM_NO_EXECUTE))) {
+        err = ERR_ACCESS_DENIED;
+        goto out;
+    }
+
+    paddr_t pa;
+    uint arch_mmu_flags;
+    if (arch_mmu_query(&aspace->arch_aspace, va, &pa, &arch_mmu_flags) == NO_ERROR) {
+        if ((pf_flags & VMM_PF_FLAG_WRITE) && (arch_mmu_flags & ARCH_MMU_FLAG_PERM_RO))
+            err = break_sharing_locked(aspace, r, va, pa);
+        else
+            err = NO_ERROR; /* another thread got here first */
+        goto out;
+    }
+
+    if (!(r->flags & VMM_REGION_FLAG_LAZY)) {
+        err = ERR_NOT_FOUND;
+        goto out;
+    }
+
+    if (r->flags & VMM_REGION_FLAG_PAGER) {
+        err = pager_fault_locked(aspace, r, va);
+        goto out;
+    }
+
+    /* reading an untouched page of a zero fill region does not need a page of its own */
+    if ((r->flags & VMM_REGION_FLAG_ZERO) && !(pf_flags & VMM_PF_FLAG_WRITE) &&
+            get_shared_zero_page_locked(&pa) == NO_ERROR) {
+        err = arch_mmu_map(&aspace->arch_aspace, va, pa, 1, r->arch_mmu_flags | ARCH_MMU_FLAG_PERM_RO);
+        if (err > 0)
+            err = NO_ERROR;
+        goto out;
+    }
+
+    vm_page_t *page = pmm_alloc_page();
+    if (!page) {
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+
+    pa = vm_page_to_paddr(page);
+    if (r->flags & VMM_REGION_FLAG_ZERO)
+        zero_page(pa, 1);
+
+    err = arch_mmu_map(&aspace->arch_aspace, va, pa, 1, r->arch_mmu_flags);
+    if (err < 0) {
+        pmm_free_page(page);
+        goto out;
+    }
+
+    list_add_tail(&r->page_list, &page->node);
+    r->committed++;
+    err = NO_ERROR;
+
+out:
+    mutex_release(&vmm_lock);
+    return err;
+}
+
 status_t vmm_create_aspace(vmm_aspace_t **_aspace, const char *name, uint flags)
 {
     status_t err;
@@ -669,6 +1139,7 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
 
     /* free all of the regions */
     struct list_node region_list = LIST_INITIAL_VALUE(region_list);
+    struct list_node shared_pages = LIST_INITIAL_VALUE(shared_pages);
 
     vmm_region_t *r;
     while ((r = list_remove_head_type(&aspace->region_list, vmm_region_t, node))) {
@@ -677,16 +1148,24 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
 
         /* unmap it */
         arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
+
+        release_cow_locked(r, &shared_pages);
     }
+    aspace->region_tree = NULL;
     mutex_release(&vmm_lock);
 
+    pmm_free(&shared_pages);
+
     /* without the vmm lock held, free all of the pmm pages and the structure */
     while ((r = list_remove_head_type(&region_list, vmm_region_t, node))) {
         /* return physical pages if any */
         pmm_free(&r->page_list);
 
+        if (r->pager)
+            put_pager(r->pager);
+
         /* free it */
-        free(r);
+        slab_free(&region_cache, r);
     }
 
     /* make sure the current thread does not map the aspace */
@@ -732,13 +1211,38 @@ void vmm_set_active_aspace(vmm_aspace_t *aspace)
     THREAD_UNLOCK(state);
 }
 
-static void dump_region(const vmm_region_t *r)
+/* largest translation granule the mapping of a physically contiguous region can use */
+static size_t region_map_granule(vmm_aspace_t *a, const vmm_region_t *r)
+{
+    paddr_t pa;
+    if (!(r->flags & VMM_REGION_FLAG_PHYSICAL) ||
+            arch_mmu_query(&a->arch_aspace, r->base, &pa, NULL) < 0)
+        return PAGE_SIZE;
+
+    uint shift = arch_mmu_block_shift(&a->arch_aspace, pa, r->size);
+    while (shift > PAGE_SIZE_SHIFT && !IS_ALIGNED(r->base, 1UL << shift))
+        shift--;
+
+    /* regions from vmm_alloc are made of scattered pages */
+    paddr_t last_pa;
+    if (arch_mmu_query(&a->arch_aspace, r->base + (1UL << shift) - PAGE_SIZE, &last_pa, NULL) < 0 ||
+            last_pa != pa + (1UL << shift) - PAGE_SIZE)
+        return PAGE_SIZE;
+
+    return 1UL << shift;
+}
+
+static void dump_region(vmm_aspace_t *a, const vmm_region_t *r)
 {
-    printf("\tregion %p: name '%s' range 0x%lx - 0x%lx size 0x%zx flags 0x%x mmu_flags 0x%x\n",
-           r, r->name, r->base, r->base + r->size - 1, r->size, r->flags, r->arch_mmu_flags);
+    printf("\tregion %p: name '%s' range 0x%lx - 0x%lx size 0x%zx flags 0x%x mmu_flags 0x%x granule 0x%zx committed %zu/%zu",
+           r, r->name, r->base, r->base + r->size - 1, r->size, r->flags, r->arch_mmu_flags,
+           region_map_granule(a, r), r->committed, r->size / PAGE_SIZE);
+    if (r->cow)
+        printf(" shared %zu pages with %u regions", r->cow->page_count, r->cow->refs);
+    printf("\n");
 }
 
-static void dump_aspace(const vmm_aspace_t *a)
+static void dump_aspace(vmm_aspace_t *a)
 {
     printf("aspace %p: name '%s' range 0x%lx - 0x%lx size 0x%zx flags 0x%x\n",
            a, a->name, a->base, a->base + a->size - 1, a->size, a->flags);
@@ -746,7 +1250,7 @@ static void dump_aspace(const vmm_aspace_t *a)
     printf("regions:\n");
     vmm_region_t *r;
     list_for_every_entry(&a->region_list, r, vmm_region_t, node) {
-        dump_region(r);
+        dump_region(a, r);
     }
 }
 
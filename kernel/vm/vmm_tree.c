@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Balanced tree of the regions in an address space.
+ *
+ * The sorted region list of every aspace stays the primary record of its regions, the
+ * tree sits alongside it to find regions and free space in O(log n). It is an AVL tree
+ * keyed by region base, augmented with the free space in front of every region (its
+ * gap) and the largest gap in every subtree, so searches for a hole of a given size
+ * can skip whole subtrees that are too fragmented.
+ *
+ * Callers hold the vmm lock.
+ */
+#include <kernel/vm.h>
+#include "vm_priv.h"
+
+#include <assert.h>
+#include <list.h>
+#include <sys/types.h>
+
+static inline int height(const vmm_region_t *r)
+{
+    return r ? r->tree_height : 0;
+}
+
+static inline size_t max_gap(const vmm_region_t *r)
+{
+    return r ? r->max_gap : 0;
+}
+
+static void update(vmm_region_t *r)
+{
+    r->tree_height = 1 + MAX(height(r->tree_left), height(r->tree_right));
+    r->max_gap = MAX(r->gap, MAX(max_gap(r->tree_left), max_gap(r->tree_right)));
+}
+
+/* recompute the augmented data from r to the root, for when only a gap changed */
+static void update_path(vmm_region_t *r)
+{
+    for (; r; r = r->tree_parent)
+        update(r);
+}
+
+static void replace_child(vmm_aspace_t *aspace, vmm_region_t *parent,
+                          vmm_region_t *old, vmm_region_t *new)
+{
+    if (!parent)
+        aspace->region_tree = new;
+    else if (parent->tree_left == old)
+        parent->tree_left = new;
+    else
+        parent->tree_right = new;
+
+    if (new)
+        new->tree_parent = parent;
+}
+
+static vmm_region_t *rotate_left(vmm_aspace_t *aspace, vmm_region_t *x)
+{
+    vmm_region_t *y = x->tree_right;
+
+    x->tree_right = y->tree_left;
+    if (y->tree_left)
+        y->tree_left->tree_parent = x;
+
+    replace_child(aspace, x->tree_parent, x, y);
+    y->tree_left = x;
+    x->tree_parent = y;
+
+    update(x);
+    update(y);
+    return y;
+}
+
+static vmm_region_t *rotate_right(vmm_aspace_t *aspace, vmm_region_t *x)
+{
+    vmm_region_t *y = x->tree_left;
+
+    x->tree_left = y->tree_right;
+    if (y->tree_right)
+        y->tree_right->tree_parent = x;
+
+    replace_child(aspace, x->tree_parent, x, y);
+    y->tree_right = x;
+    x->tree_parent = y;
+
+    update(x);
+    update(y);
+    return y;
+}
+
+/* restore the balance at r, returns the root of the subtree that took its place */
+static vmm_region_t *rebalance(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    int balance = height(r->tree_left) - height(r->tree_right);
+
+    if (balance > 1) {
+        if (height(r->tree_left->tree_left) < height(r->tree_left->tree_right))
+            rotate_left(aspace, r->tree_left);
+        return rotate_right(aspace, r);
+    }
+    if (balance < -1) {
+        if (height(r->tree_right->tree_right) < height(r->tree_right->tree_left))
+            rotate_right(aspace, r->tree_right);
+        return rotate_left(aspace, r);
+    }
+
+    update(r);
+    return r;
+}
+
+static void retrace(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    while (r) {
+        r = rebalance(aspace, r);
+        r = r->tree_parent;
+    }
+}
+
+/* recompute the gap in front of r from its neighbor in the region list */
+static void set_gap(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *prev = list_prev_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    vaddr_t gap_beg = prev ? prev->base + prev->size : aspace->base;
+
+    r->gap = r->base - gap_beg;
+}
+
+void vmm_region_tree_insert(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    DEBUG_ASSERT(list_in_list(&r->node));
+
+    r->tree_left = r->tree_right = NULL;
+    set_gap(aspace, r);
+
+    vmm_region_t *parent = NULL;
+    vmm_region_t **link = &aspace->region_tree;
+    while (*link) {
+        parent = *link;
+        link = (r->base < parent->base) ? &parent->tree_left : &parent->tree_right;
+    }
+    *link = r;
+    r->tree_parent = parent;
+
+    retrace(aspace, r);
+
+    /* the region after this one lost some of its gap */
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    if (next) {
+        set_gap(aspace, next);
+        update_path(next);
+    }
+}
+
+void vmm_region_tree_remove(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    DEBUG_ASSERT(list_in_list(&r->node));
+
+    vmm_region_t *retrace_from;
+
+    if (r->tree_left && r->tree_right) {
+        /* swap in the successor, which has no left child */
+        vmm_region_t *s = r->tree_right;
+        while (s->tree_left)
+            s = s->tree_left;
+
+        if (s->tree_parent == r) {
+            retrace_from = s;
+        } else {
+            retrace_from = s->tree_parent;
+            s->tree_parent->tree_left = s->tree_right;
+            if (s->tree_right)
+                s->tree_right->tree_parent = s->tree_parent;
+            s->tree_right = r->tree_right;
+            s->tree_right->tree_parent = s;
+        }
+
+        s->tree_left = r->tree_left;
+        s->tree_left->tree_parent = s;
+        replace_child(aspace, r->tree_parent, r, s);
+    } else {
+        retrace_from = r->tree_parent;
+        replace_child(aspace, r->tree_parent, r, r->tree_left ? r->tree_left : r->tree_right);
+    }
+
+    retrace(aspace, retrace_from);
+
+    /* the region after this one inherits its space */
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    if (next) {
+        vmm_region_t *prev = list_prev_type(&aspace->region_list, &r->node, vmm_region_t, node);
+        next->gap = next->base - (prev ? prev->base + prev->size : aspace->base);
+        update_path(next);
+    }
+
+    r->tree_parent = r->tree_left = r->tree_right = NULL;
+}
+
+vmm_region_t *vmm_region_tree_floor(const vmm_aspace_t *aspace, vaddr_t vaddr)
+{
+    vmm_region_t *r = aspace->region_tree;
+    vmm_region_t *best = NULL;
+
+    while (r) {
+        if (vaddr < r->base) {
+            r = r->tree_left;
+        } else {
+            best = r;
+            r = r->tree_right;
+        }
+    }
+
+    return best;
+}
+
+/* the lowest region in the subtree with at least min_gap in front of it */
+static vmm_region_t *first_gap_in_subtree(vmm_region_t *r, size_t min_gap)
+{
+    if (!r || max_gap(r) < min_gap)
+        return NULL;
+
+    for (;;) {
+        if (max_gap(r->tree_left) >= min_gap) {
+            r = r->tree_left;
+        } else if (r->gap >= min_gap) {
+            return r;
+        } else {
+            r = r->tree_right;
+            DEBUG_ASSERT(max_gap(r) >= min_gap);
+        }
+    }
+}
+
+vmm_region_t *vmm_region_tree_next_gap(const vmm_aspace_t *aspace, const vmm_region_t *r, size_t min_gap)
+{
+    if (!r)
+        return first_gap_in_subtree(aspace->region_tree, min_gap);
+
+    /* anything later in r's own right subtree comes first */
+    vmm_region_t *found = first_gap_in_subtree(r->tree_right, min_gap);
+    if (found)
+        return found;
+
+    /* then walk up, looking at every ancestor we reach from its left side and whatever
+     * is to the right of it */
+    const vmm_region_t *child = r;
+    vmm_region_t *parent = r->tree_parent;
+    while (parent) {
+        if (parent->tree_left == child) {
+            if (parent->gap >= min_gap)
+                return parent;
+            found = first_gap_in_subtree(parent->tree_right, min_gap);
+            if (found)
+                return found;
+        }
+        child = parent;
+        parent = parent->tree_parent;
+    }
+
+    return NULL;
+}
@@ -26,26 +26,74 @@
 #include <string.h>
 #include <sys/types.h>
 #include <debug.h>
+#include <err.h>
 #include <trace.h>
+#include <pow2.h>
+#include <arch/ops.h>
+#include <kernel/mutex.h>
+#include <kernel/event.h>
 #include <lib/bcache.h>
 #include <lib/bio.h>
 
 #define LOCAL_TRACE 0
 
+/* largest number of blocks moved in a single device request */
+#define BCACHE_MAX_CLUSTER 16
+
+/* blocks read ahead of a miss once an access pattern looks sequential */
+#define BCACHE_DEFAULT_READAHEAD 8
+
+/* how many times alloc_block() will write back a dirty block to make room */
+#define BCACHE_ALLOC_RETRIES 4
+
+/*
+ * Locking:
+ *
+ * Each hash bucket has a mutex protecting its chain along with the
+ * ref_count, is_dirty, valid and busy fields of the blocks in it. Lookups of
+ * different blocks only ever contend on a bucket lock if they hash together.
+ *
+ * lru_lock protects the free list and the lru list. A block is in a hash
+ * bucket exactly when it is on the lru list, and both only change with
+ * lru_lock and the bucket lock held, in that order. Because of that a block's
+ * blocknum is stable while either lru_lock is held or the block is pinned by
+ * a ref. Hits only try for lru_lock to bump the block, and skip it if the lock
+ * is contended, so the lru order is approximate.
+ *
+ * A block being filled from the device is marked busy. Anyone else looking
+ * it up takes a ref and waits on that block's ready event.
+ *
+ * io_lock serializes use of the shared cluster_buf for read-ahead and
+ * clustered write-back.
+ */
+
 struct bcache_block {
     struct list_node node;
+    struct list_node hash_node;
     bnum_t blocknum;
     int ref_count;
     bool is_dirty;
+    bool valid;         /* contents match the device, or are newer */
+    bool busy;          /* being filled, wait on ready */
+    event_t ready;
     void *ptr;
 };
 
 struct bcache_stats {
-    uint32_t hits;
-    uint32_t depth;
-    uint32_t misses;
-    uint32_t reads;
-    uint32_t writes;
+    int hits;
+    int depth;
+    int misses;
+    int reads;
+    int writes;
+    int readahead;          /* blocks brought in by read-ahead */
+    int clustered_writes;   /* multi block write requests issued by bcache_flush */
+};
+
+#define STAT_ADD(cache, name, val) atomic_add(&(cache)->stats.name, (val))
+
+struct bcache_bucket {
+    mutex_t lock;
+    struct list_node list;
 };
 
 struct bcache {
@@ -54,12 +102,32 @@ struct bcache {
     int count;
     struct bcache_stats stats;
 
+    mutex_t lru_lock;
     struct list_node free_list;
     struct list_node lru_list;
 
+    /* blocks in the lru list, hashed by blocknum */
+    struct bcache_bucket *hash;
+    uint hash_shift;
+
+    /* sequential access detection and read-ahead. last_blocknum is only a
+     * hint and is updated without a lock */
+    uint readahead;
+    volatile bnum_t last_blocknum;
+
+    /* staging buffer for multi block reads and writes, NULL if unavailable */
+    mutex_t io_lock;
+    void *cluster_buf;
+
     struct bcache_block *blocks;
 };
 
+static struct bcache_bucket *hash_bucket(struct bcache *cache, bnum_t blocknum)
+{
+    /* multiplicative hash, top bits of the product select the bucket */
+    return &cache->hash[(uint32_t)(blocknum * 2654435761U) >> cache->hash_shift];
+}
+
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count)
 {
     struct bcache *cache;
@@ -71,37 +139,52 @@ bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count)
     cache->count = block_count;
     memset(&cache->stats, 0, sizeof(cache->stats));
 
+    mutex_init(&cache->lru_lock);
     list_initialize(&cache->free_list);
     list_initialize(&cache->lru_list);
 
+    /* roughly one hash bucket per block */
+    uint hash_size = round_up_pow2_u32(MAX(block_count, 2));
+    cache->hash_shift = 32 - log2_uint(hash_size);
+    cache->hash = malloc(sizeof(struct bcache_bucket) * hash_size);
+    for (uint i = 0; i < hash_size; i++) {
+        mutex_init(&cache->hash[i].lock);
+        list_initialize(&cache->hash[i].list);
+    }
+
+    cache->readahead = BCACHE_DEFAULT_READAHEAD;
+    cache->last_blocknum = 0;
+    mutex_init(&cache->io_lock);
+    cache->cluster_buf = malloc(block_size * BCACHE_MAX_CLUSTER);
+
     cache->blocks = malloc(sizeof(struct bcache_block) * block_count);
+
+    /* grab all of the block buffers in one trip to the heap */
+    void **bufs = malloc(sizeof(void *) * block_count);
+    size_t bufs_allocated = malloc_batch(block_size, block_count, bufs);
+
     int i;
     for (i=0; i < block_count; i++) {
+        list_clear_node(&cache->blocks[i].hash_node);
         cache->blocks[i].ref_count = 0;
         cache->blocks[i].is_dirty = false;
-        cache->blocks[i].ptr = malloc(block_size);
+        cache->blocks[i].valid = false;
+        cache->blocks[i].busy = false;
+        event_init(&cache->blocks[i].ready, true, 0);
+        cache->blocks[i].ptr = ((size_t)i < bufs_allocated) ? bufs[i] : NULL;
         // add to the free list
         list_add_head(&cache->free_list, &cache->blocks[i].node);
     }
+    free(bufs);
 
     return (bcache_t)cache;
 }
 
-static int flush_block(struct bcache *cache, struct bcache_block *block)
+void bcache_set_readahead(bcache_t _cache, uint blocks)
 {
-    int rc;
-
-    rc = bio_write(cache->dev, block->ptr,
-                   (off_t)block->blocknum * cache->block_size,
-                   cache->block_size);
-    if (rc < 0)
-        goto exit;
+    struct bcache *cache = _cache;
 
-    block->is_dirty = false;
-    cache->stats.writes++;
-    rc = 0;
-exit:
-    return (rc);
+    cache->readahead = MIN(blocks, BCACHE_MAX_CLUSTER - 1);
 }
 
 void bcache_destroy(bcache_t _cache)
@@ -116,104 +199,407 @@ void bcache_destroy(bcache_t _cache)
             printf("warning: freeing dirty block %u\n",
                    cache->blocks[i].blocknum);
 
+        event_destroy(&cache->blocks[i].ready);
         free(cache->blocks[i].ptr);
     }
 
+    for (i = 0; i < (1 << (32 - cache->hash_shift)); i++)
+        mutex_destroy(&cache->hash[i].lock);
+    mutex_destroy(&cache->lru_lock);
+    mutex_destroy(&cache->io_lock);
+
+    free(cache->blocks);
+    free(cache->hash);
+    free(cache->cluster_buf);
     free(cache);
 }
 
-/* find a block if it's already present */
-static struct bcache_block *find_block(struct bcache *cache, uint blocknum)
+/* look up a block in its bucket, bucket lock must be held */
+static struct bcache_block *lookup_block(struct bcache_bucket *bucket, uint blocknum, uint32_t *depth)
 {
-    uint32_t depth = 0;
     struct bcache_block *block;
 
-    LTRACEF("num %u\n", blocknum);
-
-    block = NULL;
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
+    list_for_every_entry(&bucket->list, block, struct bcache_block, hash_node) {
         LTRACEF("looking at entry %p, num %u\n", block, block->blocknum);
-        depth++;
+        if (depth)
+            (*depth)++;
 
-        if (block->blocknum == blocknum) {
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
-            cache->stats.hits++;
-            cache->stats.depth += depth;
+        if (block->blocknum == blocknum)
             return block;
-        }
     }
 
-    cache->stats.misses++;
     return NULL;
 }
 
-/* allocate a new block */
-static struct bcache_block *alloc_block(struct bcache *cache)
+/* is blocknum cached, in any state? */
+static bool block_present(struct bcache *cache, uint blocknum)
 {
-    int err;
-    struct bcache_block *block;
+    struct bcache_bucket *bucket = hash_bucket(cache, blocknum);
 
-    /* pop one off the free list if it's present */
-    block = list_remove_head_type(&cache->free_list, struct bcache_block, node);
-    if (block) {
-        block->ref_count = 0;
+    mutex_acquire(&bucket->lock);
+    bool present = lookup_block(bucket, blocknum, NULL) != NULL;
+    mutex_release(&bucket->lock);
+
+    return present;
+}
+
+/* drop a ref taken by get_block() */
+static void unpin_block(struct bcache *cache, struct bcache_block *block)
+{
+    struct bcache_bucket *bucket = hash_bucket(cache, block->blocknum);
+
+    mutex_acquire(&bucket->lock);
+    DEBUG_ASSERT(block->ref_count > 0);
+    block->ref_count--;
+    mutex_release(&bucket->lock);
+}
+
+/* move a block to the tail of the lru, unless someone else has the lru locked */
+static void touch_block(struct bcache *cache, struct bcache_block *block)
+{
+    if (mutex_acquire_timeout(&cache->lru_lock, 0) < 0)
+        return;
+
+    if (list_in_list(&block->node)) {
+        list_delete(&block->node);
         list_add_tail(&cache->lru_list, &block->node);
-        LTRACEF("found block %p on free list\n", block);
-        return block;
     }
 
-    /* walk the lru, looking for a free block */
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        LTRACEF("looking at %p, num %u\n", block, block->blocknum);
-        if (block->ref_count == 0) {
-            if (block->is_dirty) {
-                err = flush_block(cache, block);
-                if (err)
-                    return NULL;
+    mutex_release(&cache->lru_lock);
+}
+
+/* write out the run of contiguous dirty blocks starting at blocknum, up to
+ * BCACHE_MAX_CLUSTER blocks per device request. io_lock must be held. */
+static int flush_run(struct bcache *cache, uint blocknum)
+{
+    struct bcache_block *run[BCACHE_MAX_CLUSTER];
+    int err = 0;
+
+    DEBUG_ASSERT(is_mutex_held(&cache->io_lock));
+
+    while (err == 0) {
+        /* pin and snapshot the blocks, marking them clean. anyone dirtying
+         * them again while the write is in flight marks them dirty again. */
+        uint n = 0;
+        while (n < BCACHE_MAX_CLUSTER) {
+            struct bcache_bucket *bucket = hash_bucket(cache, blocknum + n);
+
+            mutex_acquire(&bucket->lock);
+            struct bcache_block *block = lookup_block(bucket, blocknum + n, NULL);
+            if (!block || !block->is_dirty || block->busy) {
+                mutex_release(&bucket->lock);
+                break;
             }
 
-            // add it to the tail of the lru
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
+            block->ref_count++;
+            block->is_dirty = false;
+            if (cache->cluster_buf)
+                memcpy((uint8_t *)cache->cluster_buf + n * cache->block_size, block->ptr, cache->block_size);
+            mutex_release(&bucket->lock);
+
+            run[n++] = block;
+            if (!cache->cluster_buf)
+                break;
+        }
+
+        if (n == 0)
+            break;
+
+        ssize_t len = cache->block_size * n;
+        ssize_t rc = bio_write(cache->dev, cache->cluster_buf ? cache->cluster_buf : run[0]->ptr,
+                               (off_t)blocknum * cache->block_size, len);
+        if (rc < len) {
+            err = rc < 0 ? rc : ERR_IO;
+        } else {
+            STAT_ADD(cache, writes, n);
+            if (n > 1)
+                STAT_ADD(cache, clustered_writes, 1);
+        }
+
+        for (uint i = 0; i < n; i++) {
+            struct bcache_bucket *bucket = hash_bucket(cache, run[i]->blocknum);
+
+            mutex_acquire(&bucket->lock);
+            if (err)
+                run[i]->is_dirty = true;
+            run[i]->ref_count--;
+            mutex_release(&bucket->lock);
+        }
+
+        blocknum += n;
+    }
+
+    return err;
+}
+
+/*
+ * Take a block out of the free list, or evict the least recently used
+ * unreferenced one. The block is returned unhashed and off both lists, owned
+ * by the caller. If can_flush is set, dirty blocks are written back to make
+ * room when there are no clean ones.
+ */
+static struct bcache_block *alloc_block(struct bcache *cache, bool can_flush)
+{
+    struct bcache_block *block;
+
+    for (int tries = 0; tries < BCACHE_ALLOC_RETRIES; tries++) {
+        mutex_acquire(&cache->lru_lock);
+
+        /* pop one off the free list if it's present */
+        block = list_remove_head_type(&cache->free_list, struct bcache_block, node);
+        if (block) {
+            mutex_release(&cache->lru_lock);
+            LTRACEF("found block %p on free list\n", block);
             return block;
         }
+
+        /* walk the lru, looking for an unreferenced clean block */
+        struct bcache_block *dirty = NULL;
+        list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
+            LTRACEF("looking at %p, num %u\n", block, block->blocknum);
+
+            struct bcache_bucket *bucket = hash_bucket(cache, block->blocknum);
+            mutex_acquire(&bucket->lock);
+            if (block->ref_count == 0 && !block->busy) {
+                if (!block->is_dirty) {
+                    list_delete(&block->hash_node);
+                    list_delete(&block->node);
+                    mutex_release(&bucket->lock);
+                    mutex_release(&cache->lru_lock);
+                    return block;
+                }
+                if (!dirty)
+                    dirty = block;
+            }
+            mutex_release(&bucket->lock);
+        }
+
+        if (!dirty || !can_flush) {
+            mutex_release(&cache->lru_lock);
+            return NULL;
+        }
+
+        /* write back the oldest dirty block and try again */
+        uint blocknum = dirty->blocknum;
+        mutex_release(&cache->lru_lock);
+
+        mutex_acquire(&cache->io_lock);
+        status_t err = flush_run(cache, blocknum);
+        mutex_release(&cache->io_lock);
+        if (err < 0)
+            return NULL;
     }
 
     return NULL;
 }
 
-static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blocknum)
+/* put a block returned by alloc_block() back on the free list */
+static void free_block(struct bcache *cache, struct bcache_block *block)
 {
-    int err;
+    mutex_acquire(&cache->lru_lock);
+    list_add_tail(&cache->free_list, &block->node);
+    mutex_release(&cache->lru_lock);
+}
+
+/*
+ * Hash a block from alloc_block() as blocknum, busy and pinned by the caller.
+ * Returns false without touching the block if someone else got blocknum into
+ * the cache first.
+ */
+static bool insert_block(struct bcache *cache, struct bcache_block *block, uint blocknum)
+{
+    struct bcache_bucket *bucket = hash_bucket(cache, blocknum);
+
+    mutex_acquire(&cache->lru_lock);
+    mutex_acquire(&bucket->lock);
 
+    bool inserted = false;
+    if (!lookup_block(bucket, blocknum, NULL)) {
+        block->blocknum = blocknum;
+        block->ref_count = 1;
+        block->is_dirty = false;
+        block->valid = false;
+        block->busy = true;
+        event_unsignal(&block->ready);
+        list_add_head(&bucket->list, &block->hash_node);
+        list_add_tail(&cache->lru_list, &block->node);
+        inserted = true;
+    }
+
+    mutex_release(&bucket->lock);
+    mutex_release(&cache->lru_lock);
+
+    return inserted;
+}
+
+/* mark a busy block as done, waking anyone waiting on it */
+static void finish_block(struct bcache *cache, struct bcache_block *block, bool valid)
+{
+    struct bcache_bucket *bucket = hash_bucket(cache, block->blocknum);
+
+    mutex_acquire(&bucket->lock);
+    block->valid = valid;
+    block->busy = false;
+    /* signal under the bucket lock so it can't land after someone has
+     * marked the block busy again for a retried fill */
+    event_signal(&block->ready, false);
+    mutex_release(&bucket->lock);
+}
+
+/* how many uncached blocks following blocknum to read in along with it */
+static uint readahead_count(struct bcache *cache, uint blocknum, bool sequential)
+{
+    if (!sequential || !cache->cluster_buf)
+        return 0;
+
+    /* never let read-ahead take over more than half the cache */
+    uint max = MIN(cache->readahead, (uint)cache->count / 2);
+    off_t dev_blocks = cache->dev->total_size / cache->block_size;
+
+    uint n;
+    for (n = 0; n < max; n++) {
+        uint next = blocknum + 1 + n;
+        if ((off_t)next >= dev_blocks || block_present(cache, next))
+            break;
+    }
+
+    return n;
+}
+
+/* fill a busy block from the device, along with up to readahead blocks
+ * after it in a single device request if possible */
+static int fill_block(struct bcache *cache, struct bcache_block *block, uint readahead)
+{
+    ssize_t err;
+    off_t offset = (off_t)block->blocknum * cache->block_size;
+
+    if (readahead > 0) {
+        /* don't wait behind a flush for the staging buffer, just skip read-ahead */
+        if (mutex_acquire_timeout(&cache->io_lock, 0) < 0)
+            readahead = 0;
+    }
+
+    if (readahead > 0) {
+        ssize_t len = cache->block_size * (readahead + 1);
+
+        err = bio_read(cache->dev, cache->cluster_buf, offset, len);
+        if (err >= len) {
+            memcpy(block->ptr, cache->cluster_buf, cache->block_size);
+            STAT_ADD(cache, reads, 1);
+
+            /* hand the rest to new blocks, without evicting dirty ones for it */
+            for (uint i = 1; i <= readahead; i++) {
+                struct bcache_block *ra = alloc_block(cache, false);
+                if (!ra)
+                    break;
+
+                if (!insert_block(cache, ra, block->blocknum + i)) {
+                    free_block(cache, ra);
+                    continue;
+                }
+
+                memcpy(ra->ptr, (uint8_t *)cache->cluster_buf + i * cache->block_size, cache->block_size);
+                finish_block(cache, ra, true);
+                unpin_block(cache, ra);
+                STAT_ADD(cache, readahead, 1);
+            }
+
+            mutex_release(&cache->io_lock);
+            return 0;
+        }
+
+        /* fall back to reading just the block asked for */
+        mutex_release(&cache->io_lock);
+    }
+
+    err = bio_read(cache->dev, block->ptr, offset, cache->block_size);
+    if (err < 0)
+        return err;
+
+    STAT_ADD(cache, reads, 1);
+    return 0;
+}
+
+/*
+ * Find a block in the cache, bringing it in if it's not there, and return it
+ * pinned by a ref. With fill false a missing block is zeroed instead of read.
+ */
+static struct bcache_block *get_block(struct bcache *cache, uint blocknum, bool fill)
+{
     LTRACEF("block %u\n", blocknum);
 
-    /* see if it's already in the cache */
-    struct bcache_block *block = find_block(cache, blocknum);
-    if (block == NULL) {
-        LTRACEF("wasn't allocated\n");
+    bool sequential = (blocknum == cache->last_blocknum + 1);
+    cache->last_blocknum = blocknum;
 
-        /* allocate a new block and fill it */
-        block = alloc_block(cache);
-        DEBUG_ASSERT(block);
+    for (;;) {
+        struct bcache_bucket *bucket = hash_bucket(cache, blocknum);
+        uint32_t depth = 0;
 
-        LTRACEF("wasn't allocated, new block %p\n", block);
+        mutex_acquire(&bucket->lock);
+        struct bcache_block *block = lookup_block(bucket, blocknum, &depth);
+        if (block) {
+            block->ref_count++;
 
-        block->blocknum = blocknum;
-        err = bio_read(cache->dev, block->ptr, (off_t)blocknum * cache->block_size, cache->block_size);
+            /* someone else is filling it, wait for them */
+            while (block->busy) {
+                mutex_release(&bucket->lock);
+                event_wait(&block->ready);
+                mutex_acquire(&bucket->lock);
+            }
+
+            if (block->valid || !fill) {
+                if (!block->valid) {
+                    memset(block->ptr, 0, cache->block_size);
+                    block->valid = true;
+                }
+                mutex_release(&bucket->lock);
+
+                STAT_ADD(cache, hits, 1);
+                STAT_ADD(cache, depth, depth);
+                touch_block(cache, block);
+                return block;
+            }
+
+            /* an earlier fill failed, try it ourselves */
+            block->busy = true;
+            event_unsignal(&block->ready);
+            mutex_release(&bucket->lock);
+        } else {
+            mutex_release(&bucket->lock);
+
+            LTRACEF("wasn't allocated\n");
+
+            block = alloc_block(cache, true);
+            if (!block)
+                return NULL;
+
+            LTRACEF("wasn't allocated, new block %p\n", block);
+
+            if (!insert_block(cache, block, blocknum)) {
+                /* lost a race with someone else bringing it in */
+                free_block(cache, block);
+                continue;
+            }
+
+            STAT_ADD(cache, misses, 1);
+        }
+
+        /* we own the busy block now, fill it */
+        int err = 0;
+        if (fill)
+            err = fill_block(cache, block, readahead_count(cache, blocknum, sequential));
+        else
+            memset(block->ptr, 0, cache->block_size);
+
+        finish_block(cache, block, err >= 0);
         if (err < 0) {
-            /* free the block, return an error */
-            list_add_tail(&cache->free_list, &block->node);
+            unpin_block(cache, block);
             return NULL;
         }
 
-        cache->stats.reads++;
+        DEBUG_ASSERT(block->blocknum == blocknum);
+        return block;
     }
-
-    DEBUG_ASSERT(block->blocknum == blocknum);
-
-    return block;
 }
 
 int bcache_read_block(bcache_t _cache, void *buf, uint blocknum)
@@ -222,13 +608,65 @@ int bcache_read_block(bcache_t _cache, void *buf, uint blocknum)
 
     LTRACEF("buf %p, blocknum %u\n", buf, blocknum);
 
-    struct bcache_block *block = find_or_fill_block(cache, blocknum);
+    struct bcache_block *block = get_block(cache, blocknum, true);
     if (block == NULL) {
         /* error */
         return -1;
     }
 
     memcpy(buf, block->ptr, cache->block_size);
+    unpin_block(cache, block);
+    return 0;
+}
+
+int bcache_prefetch(bcache_t _cache, uint blocknum, uint count)
+{
+    struct bcache *cache = _cache;
+    off_t dev_blocks = cache->dev->total_size / cache->block_size;
+
+    LTRACEF("blocknum %u, count %u\n", blocknum, count);
+
+    if ((off_t)blocknum >= dev_blocks)
+        return 0;
+
+    /* like read-ahead, never let a prefetch take over more than half the cache */
+    count = MIN(count, (uint)cache->count / 2);
+    count = MIN((off_t)count, dev_blocks - blocknum);
+
+    uint end = blocknum + count;
+    while (blocknum < end) {
+        if (block_present(cache, blocknum)) {
+            blocknum++;
+            continue;
+        }
+
+        /* the rest of the uncached run comes in along with it */
+        uint run = 0;
+        while (run < BCACHE_MAX_CLUSTER - 1 && blocknum + 1 + run < end &&
+                !block_present(cache, blocknum + 1 + run))
+            run++;
+
+        /* only a hint, so don't write anything back to make room */
+        struct bcache_block *block = alloc_block(cache, false);
+        if (!block)
+            break;
+
+        if (!insert_block(cache, block, blocknum)) {
+            free_block(cache, block);
+            blocknum++;
+            continue;
+        }
+
+        int err = fill_block(cache, block, cache->cluster_buf ? run : 0);
+        finish_block(cache, block, err >= 0);
+        unpin_block(cache, block);
+        if (err < 0)
+            return err;
+
+        /* anything read-ahead had to skip gets picked up block by block */
+        blocknum++;
+    }
+
     return 0;
 }
 
@@ -240,14 +678,13 @@ int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum)
 
     DEBUG_ASSERT(ptr);
 
-    struct bcache_block *block = find_or_fill_block(cache, blocknum);
+    /* the ref taken by get_block keeps it from being freed until put */
+    struct bcache_block *block = get_block(cache, blocknum, true);
     if (block == NULL) {
         /* error */
         return -1;
     }
 
-    /* increment the ref count to keep it from being freed */
-    block->ref_count++;
     *ptr = block->ptr;
 
     return 0;
@@ -256,16 +693,19 @@ int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum)
 int bcache_put_block(bcache_t _cache, uint blocknum)
 {
     struct bcache *cache = _cache;
+    struct bcache_bucket *bucket = hash_bucket(cache, blocknum);
 
     LTRACEF("blocknum %u\n", blocknum);
 
-    struct bcache_block *block = find_block(cache, blocknum);
+    mutex_acquire(&bucket->lock);
+    struct bcache_block *block = lookup_block(bucket, blocknum, NULL);
 
     /* be pretty hard on the caller for now */
     DEBUG_ASSERT(block);
     DEBUG_ASSERT(block->ref_count > 0);
 
     block->ref_count--;
+    mutex_release(&bucket->lock);
 
     return 0;
 }
@@ -274,10 +714,12 @@ int bcache_mark_block_dirty(bcache_t priv, uint blocknum)
 {
     int err;
     struct bcache *cache = priv;
+    struct bcache_bucket *bucket = hash_bucket(cache, blocknum);
     struct bcache_block *block;
 
-    block = find_block(cache, blocknum);
-    if (!block) {
+    mutex_acquire(&bucket->lock);
+    block = lookup_block(bucket, blocknum, NULL);
+    if (!block || !block->valid) {
         err = -1;
         goto exit;
     }
@@ -285,49 +727,71 @@ int bcache_mark_block_dirty(bcache_t priv, uint blocknum)
     block->is_dirty = true;
     err = 0;
 exit:
+    mutex_release(&bucket->lock);
     return (err);
 }
 
 int bcache_zero_block(bcache_t priv, uint blocknum)
 {
-    int err;
     struct bcache *cache = priv;
-    struct bcache_block *block;
+    struct bcache_bucket *bucket = hash_bucket(cache, blocknum);
 
-    block = find_block(cache, blocknum);
-    if (!block) {
-        block = alloc_block(cache);
-        if (!block) {
-            err = -1;
-            goto exit;
-        }
-
-        block->blocknum = blocknum;
-    }
+    struct bcache_block *block = get_block(cache, blocknum, false);
+    if (!block)
+        return -1;
 
+    mutex_acquire(&bucket->lock);
     memset(block->ptr, 0, cache->block_size);
     block->is_dirty = true;
-    err = 0;
-exit:
-    return (err);
+    block->ref_count--;
+    mutex_release(&bucket->lock);
+
+    return 0;
 }
 
 int bcache_flush(bcache_t priv)
 {
-    int err;
+    int err = 0;
     struct bcache *cache = priv;
-    struct bcache_block *block;
 
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        if (block->is_dirty) {
-            err = flush_block(cache, block);
-            if (err)
-                goto exit;
+    mutex_acquire(&cache->io_lock);
+
+    for (int i = 0; i < cache->count && err == 0; i++) {
+        struct bcache_block *block = &cache->blocks[i];
+
+        /* blocknum only changes with lru_lock held */
+        mutex_acquire(&cache->lru_lock);
+        bool cached = list_in_list(&block->hash_node);
+        uint blocknum = block->blocknum;
+        mutex_release(&cache->lru_lock);
+
+        if (!cached)
+            continue;
+
+        /* runs are written starting from their lowest block, skip the rest */
+        struct bcache_bucket *bucket = hash_bucket(cache, blocknum);
+        mutex_acquire(&bucket->lock);
+        block = lookup_block(bucket, blocknum, NULL);
+        bool dirty = block && block->is_dirty;
+        mutex_release(&bucket->lock);
+        if (!dirty)
+            continue;
+
+        if (blocknum > 0) {
+            bucket = hash_bucket(cache, blocknum - 1);
+            mutex_acquire(&bucket->lock);
+            struct bcache_block *prev = lookup_block(bucket, blocknum - 1, NULL);
+            bool prev_dirty = prev && prev->is_dirty;
+            mutex_release(&bucket->lock);
+            if (prev_dirty)
+                continue;
         }
+
+        err = flush_run(cache, blocknum);
     }
 
-    err = 0;
-exit:
+    mutex_release(&cache->io_lock);
+
     return (err);
 }
 
@@ -338,7 +802,7 @@ void bcache_dump(bcache_t priv, const char *name)
 
     finds = cache->stats.hits + cache->stats.misses;
 
-    printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u writes=%u\n",
+    printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u readahead=%u writes=%u clustered_writes=%u\n",
            name,
            cache->stats.hits,
            finds ? (cache->stats.hits * 100) / finds : 0,
@@ -346,5 +810,7 @@ void bcache_dump(bcache_t priv, const char *name)
            cache->stats.misses,
            finds ? (cache->stats.misses * 100) / finds : 0,
            cache->stats.reads,
-           cache->stats.writes);
+           cache->stats.readahead,
+           cache->stats.writes,
+           cache->stats.clustered_writes);
 }
@@ -29,9 +29,24 @@ typedef void *bcache_t;
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count);
 void bcache_destroy(bcache_t);
 
+// set how many blocks to read ahead of a miss when access looks sequential, 0 to disable
+void bcache_set_readahead(bcache_t, uint blocks);
+
 int bcache_read_block(bcache_t, void *, uint block);
 
+// bring a range of blocks into the cache ahead of use, in as few device reads as possible.
+// a hint: stops early rather than evicting dirty blocks, and never fills more than half the cache
+int bcache_prefetch(bcache_t, uint block, uint count);
+
 // get and put a pointer directly to the block
 int bcache_get_block(bcache_t, void **, uint block);
 int bcache_put_block(bcache_t, uint block);
 
+
+// write back: mark a block gotten with bcache_get_block as modified, or zero one without
+// reading it in. dirty blocks are written out when evicted or on bcache_flush
+int bcache_mark_block_dirty(bcache_t, uint block);
+int bcache_zero_block(bcache_t, uint block);
+int bcache_flush(bcache_t);
+
+void bcache_dump(bcache_t, const char *name);
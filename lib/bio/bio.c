@@ -29,11 +29,19 @@
 #include <list.h>
 #include <pow2.h>
 #include <lib/bio.h>
+#include <kernel/debug.h>
 #include <kernel/mutex.h>
+#include <kernel/rcu.h>
+#include <kernel/semaphore.h>
+#include <kernel/spinlock.h>
 #include <lk/init.h>
+#include <platform.h>
+
+#include "bio_priv.h"
 
 #define LOCAL_TRACE 0
 
+/* readers walk the list under rcu, the lock serializes updaters */
 static struct {
     struct list_node list;
     mutex_t lock;
@@ -42,6 +50,95 @@ static struct {
     .lock = MUTEX_INITIAL_VALUE(bdevs.lock),
 };
 
+/* bounce buffers for the partial block transfers of the default hooks. devices
+ * using those hooks get a few preallocated when they are registered, rather
+ * than a block sized buffer going on the stack for every call */
+#ifndef BIO_BOUNCE_BUFFERS
+#define BIO_BOUNCE_BUFFERS 2
+#endif
+
+struct bio_bounce {
+    semaphore_t avail;
+    spin_lock_t lock;
+    uint32_t free_mask;
+    size_t stride;
+    uint8_t *bufs;
+};
+
+static void bio_bounce_create(bdev_t *dev)
+{
+    struct bio_bounce *bounce = malloc(sizeof(*bounce));
+    if (!bounce)
+        return;
+
+    bounce->stride = ROUNDUP(dev->block_size, CACHE_LINE);
+    bounce->bufs = memalign(CACHE_LINE, bounce->stride * BIO_BOUNCE_BUFFERS);
+    if (!bounce->bufs) {
+        free(bounce);
+        return;
+    }
+
+    sem_init(&bounce->avail, BIO_BOUNCE_BUFFERS);
+    spin_lock_init(&bounce->lock);
+    bounce->free_mask = (1u << BIO_BOUNCE_BUFFERS) - 1;
+
+    dev->bounce = bounce;
+}
+
+static void bio_bounce_destroy(bdev_t *dev)
+{
+    struct bio_bounce *bounce = dev->bounce;
+    if (!bounce)
+        return;
+
+    sem_destroy(&bounce->avail);
+    free(bounce->bufs);
+    free(bounce);
+    dev->bounce = NULL;
+}
+
+/* grab a cache aligned block sized buffer, waiting for one if they are all
+ * in use. devices without a pool fall back to the heap */
+static uint8_t *bio_bounce_get(bdev_t *dev)
+{
+    struct bio_bounce *bounce = dev->bounce;
+    if (!bounce)
+        return memalign(CACHE_LINE, ROUNDUP(dev->block_size, CACHE_LINE));
+
+    sem_wait(&bounce->avail);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bounce->lock, state);
+    uint index = __builtin_ctz(bounce->free_mask);
+    bounce->free_mask &= ~(1u << index);
+    spin_unlock_irqrestore(&bounce->lock, state);
+
+    return bounce->bufs + index * bounce->stride;
+}
+
+static void bio_bounce_put(bdev_t *dev, uint8_t *buf)
+{
+    struct bio_bounce *bounce = dev->bounce;
+    if (!bounce) {
+        free(buf);
+        return;
+    }
+
+    uint index = (buf - bounce->bufs) / bounce->stride;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bounce->lock, state);
+    bounce->free_mask |= 1u << index;
+    spin_unlock_irqrestore(&bounce->lock, state);
+
+    sem_post(&bounce->avail, false);
+}
+
+static inline bool bio_is_block_aligned(const bdev_t *dev, off_t offset, size_t len)
+{
+    return ((offset | len) & (dev->block_size - 1)) == 0;
+}
+
 /* default implementation is to use the read_block hook to 'deblock' the device */
 static ssize_t bio_default_read(struct bdev *dev, void *_buf, off_t offset, size_t len)
 {
@@ -49,7 +146,19 @@ static ssize_t bio_default_read(struct bdev *dev, void *_buf, off_t offset, size
     ssize_t bytes_read = 0;
     bnum_t block;
     ssize_t err = 0;
-    STACKBUF_DMA_ALIGN(temp, dev->block_size); // temporary buffer for partial block transfers
+
+    /* whole blocks into a buffer the device can take go straight through */
+    if (bio_is_block_aligned(dev, offset, len) &&
+            (!(dev->flags & BIO_FLAG_CACHE_ALIGNED_READS) || IS_ALIGNED((size_t)buf, CACHE_LINE))) {
+        err = bio_read_block(dev, buf, offset >> dev->block_shift, len >> dev->block_shift);
+        if (err >= 0 && (size_t)err != len)
+            err = ERR_IO;
+        return err;
+    }
+
+    uint8_t *temp = bio_bounce_get(dev); // temporary buffer for partial block transfers
+    if (!temp)
+        return ERR_NO_MEMORY;
 
     /* find the starting block */
     block = offset / dev->block_size;
@@ -136,6 +245,8 @@ static ssize_t bio_default_read(struct bdev *dev, void *_buf, off_t offset, size
     }
 
 err:
+    bio_bounce_put(dev, temp);
+
     /* return error or bytes read */
     return (err >= 0) ? bytes_read : err;
 }
@@ -146,7 +257,19 @@ static ssize_t bio_default_write(struct bdev *dev, const void *_buf, off_t offse
     ssize_t bytes_written = 0;
     bnum_t block;
     ssize_t err = 0;
-    STACKBUF_DMA_ALIGN(temp, dev->block_size); // temporary buffer for partial block transfers
+
+    /* whole blocks from a buffer the device can take go straight through */
+    if (bio_is_block_aligned(dev, offset, len) &&
+            (!(dev->flags & BIO_FLAG_CACHE_ALIGNED_WRITES) || IS_ALIGNED((size_t)buf, CACHE_LINE))) {
+        err = bio_write_block(dev, buf, offset >> dev->block_shift, len >> dev->block_shift);
+        if (err >= 0 && (size_t)err != len)
+            err = ERR_IO;
+        return err;
+    }
+
+    uint8_t *temp = bio_bounce_get(dev); // temporary buffer for partial block transfers
+    if (!temp)
+        return ERR_NO_MEMORY;
 
     /* find the starting block */
     block = offset / dev->block_size;
@@ -255,14 +378,19 @@ static ssize_t bio_default_write(struct bdev *dev, const void *_buf, off_t offse
     }
 
 err:
+    bio_bounce_put(dev, temp);
+
     /* return error or bytes written */
     return (err >= 0) ? bytes_written : err;
 }
 
 static ssize_t bio_default_erase(struct bdev *dev, off_t offset, size_t len)
 {
-    /* default erase operation is to just write zeros over the device */
-    STACKBUF_DMA_ALIGN(erase_buf, dev->block_size);
+    /* default erase operation is to just write zeros over the device. the
+     * write hook may need a bounce buffer itself, so don't hold one here */
+    uint8_t *erase_buf = memalign(CACHE_LINE, ROUNDUP(dev->block_size, CACHE_LINE));
+    if (!erase_buf)
+        return ERR_NO_MEMORY;
 
     memset(erase_buf, dev->erase_byte, dev->block_size);
 
@@ -272,9 +400,11 @@ static ssize_t bio_default_erase(struct bdev *dev, off_t offset, size_t len)
     while (remaining > 0) {
         size_t towrite = MIN(remaining, dev->block_size);
 
-        ssize_t written = bio_write(dev, erase_buf, pos, towrite);
-        if (written < 0)
-            return written;
+        ssize_t written = dev->write(dev, erase_buf, pos, towrite);
+        if (written < 0) {
+            erased = written;
+            break;
+        }
 
         erased += written;
         pos += written;
@@ -284,6 +414,8 @@ static ssize_t bio_default_erase(struct bdev *dev, off_t offset, size_t len)
             break;
     }
 
+    free(erase_buf);
+
     return erased;
 }
 
@@ -297,6 +429,25 @@ static ssize_t bio_default_write_block(struct bdev *dev, const void *buf, bnum_t
     return ERR_NOT_SUPPORTED;
 }
 
+/* send a synchronous block transfer through the device's scheduler */
+static ssize_t bio_sched_block_io(bdev_t *dev, void *buf, bnum_t block, uint count, bool write)
+{
+    iovec_t iov = { buf, (size_t)count << dev->block_shift };
+    bio_request_t req = {
+        .write = write,
+        .block = block,
+        .count = count,
+        .iov = &iov,
+        .iov_cnt = 1,
+    };
+
+    status_t err = bio_submit(dev, &req);
+    if (err < 0)
+        return err;
+
+    return bio_request_wait(&req);
+}
+
 static void bdev_inc_ref(bdev_t *dev)
 {
     LTRACEF("Add ref \"%s\" %d -> %d\n", dev->name, dev->ref, dev->ref + 1);
@@ -315,6 +466,9 @@ static void bdev_dec_ref(bdev_t *dev)
 
         TRACEF("last ref, removing (%s)\n", dev->name);
 
+        bio_sched_detach(dev);
+        bio_bounce_destroy(dev);
+
         // call the close hook if it exists
         if (dev->close)
             dev->close(dev);
@@ -323,6 +477,91 @@ static void bdev_dec_ref(bdev_t *dev)
     }
 }
 
+static lk_bigtime_t bio_stats_begin(bdev_t *dev, bio_op_stats_t *op)
+{
+    KEVLOG_BIO_BEGIN(dev, (op == &dev->stats.read) ? KERNEL_EVLOG_BIO_READ :
+                     (op == &dev->stats.write) ? KERNEL_EVLOG_BIO_WRITE : KERNEL_EVLOG_BIO_ERASE);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&dev->stats_lock, state);
+    dev->stats.inflight++;
+    if (dev->stats.inflight > dev->stats.max_inflight)
+        dev->stats.max_inflight = dev->stats.inflight;
+    spin_unlock_irqrestore(&dev->stats_lock, state);
+
+    return current_time_hires();
+}
+
+static ssize_t bio_stats_end(bdev_t *dev, bio_op_stats_t *op, lk_bigtime_t start, ssize_t result)
+{
+    lk_bigtime_t elapsed = current_time_hires() - start;
+    uint bucket = log2_uint(MIN(elapsed, UINT32_MAX));
+    bucket = MIN(bucket, BIO_LATENCY_BUCKETS - 1);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&dev->stats_lock, state);
+    dev->stats.inflight--;
+    op->count++;
+    if (result < 0)
+        op->errors++;
+    else
+        op->bytes += result;
+    op->latency[bucket]++;
+    spin_unlock_irqrestore(&dev->stats_lock, state);
+
+    KEVLOG_BIO_END(dev, result);
+
+    return result;
+}
+
+void bio_get_stats(bdev_t *dev, bio_stats_t *stats)
+{
+    DEBUG_ASSERT(dev && stats);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&dev->stats_lock, state);
+    *stats = dev->stats;
+    spin_unlock_irqrestore(&dev->stats_lock, state);
+}
+
+void bio_reset_stats(bdev_t *dev)
+{
+    DEBUG_ASSERT(dev);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&dev->stats_lock, state);
+    uint32_t inflight = dev->stats.inflight;
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    dev->stats.inflight = inflight;
+    dev->stats.max_inflight = inflight;
+    spin_unlock_irqrestore(&dev->stats_lock, state);
+}
+
+static void bio_dump_op_stats(const char *name, const bio_op_stats_t *op)
+{
+    printf("\t%-5s count %u errors %u bytes %llu\n", name, op->count, op->errors, op->bytes);
+    if (op->count == 0)
+        return;
+
+    for (uint i = 0; i < BIO_LATENCY_BUCKETS; i++) {
+        if (op->latency[i] == 0)
+            continue;
+        printf("\t\t%8u%s usecs: %u\n", 1U << i,
+               (i == BIO_LATENCY_BUCKETS - 1) ? "+" : " ", op->latency[i]);
+    }
+}
+
+void bio_dump_stats(bdev_t *dev)
+{
+    bio_stats_t stats;
+    bio_get_stats(dev, &stats);
+
+    printf("%s: inflight %u max %u\n", dev->name, stats.inflight, stats.max_inflight);
+    bio_dump_op_stats("read", &stats.read);
+    bio_dump_op_stats("write", &stats.write);
+    bio_dump_op_stats("erase", &stats.erase);
+}
+
 size_t bio_trim_range(const bdev_t *dev, off_t offset, size_t len)
 {
     /* range check */
@@ -358,8 +597,10 @@ bdev_t *bio_open(const char *name)
 
     /* see if it's in our list */
     bdev_t *entry;
-    mutex_acquire(&bdevs.lock);
-    list_for_every_entry(&bdevs.list, entry, bdev_t, node) {
+    rcu_read_state_t state;
+    rcu_read_lock(state);
+    rcu_list_for_every_entry(&bdevs.list, entry, bdev_t, node) {
+        /* the list's reference is dropped only after a grace period */
         DEBUG_ASSERT(entry->ref > 0);
         if (!strcmp(entry->name, name)) {
             bdev = entry;
@@ -367,7 +608,7 @@ bdev_t *bio_open(const char *name)
             break;
         }
     }
-    mutex_release(&bdevs.lock);
+    rcu_read_unlock(state);
 
     return bdev;
 }
@@ -391,7 +632,8 @@ ssize_t bio_read(bdev_t *dev, void *buf, off_t offset, size_t len)
     if (len == 0)
         return 0;
 
-    return dev->read(dev, buf, offset, len);
+    lk_bigtime_t start = bio_stats_begin(dev, &dev->stats.read);
+    return bio_stats_end(dev, &dev->stats.read, start, dev->read(dev, buf, offset, len));
 }
 
 ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count)
@@ -406,6 +648,9 @@ ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count)
     if (count == 0)
         return 0;
 
+    if (dev->sched)
+        return bio_sched_block_io(dev, buf, block, count, false);
+
     return dev->read_block(dev, buf, block, count);
 }
 
@@ -421,7 +666,8 @@ ssize_t bio_write(bdev_t *dev, const void *buf, off_t offset, size_t len)
     if (len == 0)
         return 0;
 
-    return dev->write(dev, buf, offset, len);
+    lk_bigtime_t start = bio_stats_begin(dev, &dev->stats.write);
+    return bio_stats_end(dev, &dev->stats.write, start, dev->write(dev, buf, offset, len));
 }
 
 ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count)
@@ -436,9 +682,86 @@ ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count)
     if (count == 0)
         return 0;
 
+    if (dev->sched)
+        return bio_sched_block_io(dev, (void *)buf, block, count, true);
+
     return dev->write_block(dev, buf, block, count);
 }
 
+/* vectored transfers that are block aligned go to the device as a single
+ * request if it has a submit hook or scheduler, everything else is done an entry at a time */
+static ssize_t bio_vectored(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset, bool write)
+{
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(iov || iov_cnt == 0);
+
+    /* range check */
+    size_t total = 0;
+    bool aligned = (offset & (dev->block_size - 1)) == 0;
+    for (uint i = 0; i < iov_cnt; i++) {
+        total += iov[i].iov_len;
+        if (iov[i].iov_len & (dev->block_size - 1))
+            aligned = false;
+    }
+    size_t len = bio_trim_range(dev, offset, total);
+    if (len == 0)
+        return 0;
+
+    if ((dev->submit || dev->sched) && aligned) {
+        bio_request_t req = {
+            .write = write,
+            .block = offset >> dev->block_shift,
+            .count = len >> dev->block_shift,
+            .iov = iov,
+            .iov_cnt = iov_cnt,
+        };
+
+        status_t err = bio_submit(dev, &req);
+        if (err < 0)
+            return err;
+
+        return bio_request_wait(&req);
+    }
+
+    ssize_t bytes = 0;
+    for (uint i = 0; i < iov_cnt && len > 0; i++) {
+        size_t tohandle = MIN(iov[i].iov_len, len);
+        ssize_t err;
+
+        if (write)
+            err = dev->write(dev, iov[i].iov_base, offset, tohandle);
+        else
+            err = dev->read(dev, iov[i].iov_base, offset, tohandle);
+        if (err < 0)
+            return err;
+
+        bytes += err;
+        if ((size_t)err != tohandle)
+            break;
+
+        offset += tohandle;
+        len -= tohandle;
+    }
+
+    return bytes;
+}
+
+ssize_t bio_readv(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset)
+{
+    LTRACEF("dev '%s', iov %p, iov_cnt %u, offset %lld\n", dev->name, iov, iov_cnt, offset);
+
+    lk_bigtime_t start = bio_stats_begin(dev, &dev->stats.read);
+    return bio_stats_end(dev, &dev->stats.read, start, bio_vectored(dev, iov, iov_cnt, offset, false));
+}
+
+ssize_t bio_writev(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset)
+{
+    LTRACEF("dev '%s', iov %p, iov_cnt %u, offset %lld\n", dev->name, iov, iov_cnt, offset);
+
+    lk_bigtime_t start = bio_stats_begin(dev, &dev->stats.write);
+    return bio_stats_end(dev, &dev->stats.write, start, bio_vectored(dev, iov, iov_cnt, offset, true));
+}
+
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len)
 {
     LTRACEF("dev '%s', offset %lld, len %zd\n", dev->name, offset, len);
@@ -450,7 +773,108 @@ ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len)
     if (len == 0)
         return 0;
 
-    return dev->erase(dev, offset, len);
+    lk_bigtime_t start = bio_stats_begin(dev, &dev->stats.erase);
+    return bio_stats_end(dev, &dev->stats.erase, start, dev->erase(dev, offset, len));
+}
+
+/* carry out a request with the synchronous block hooks, for devices with no submit hook */
+static ssize_t bio_sync_request(bdev_t *dev, bio_request_t *req)
+{
+    bnum_t block = req->block;
+    uint count = req->count;
+    ssize_t bytes = 0;
+
+    for (uint i = 0; i < req->iov_cnt && count > 0; i++) {
+        uint blocks = MIN(req->iov[i].iov_len >> dev->block_shift, count);
+        ssize_t err;
+
+        if (req->write)
+            err = dev->write_block(dev, req->iov[i].iov_base, block, blocks);
+        else
+            err = dev->read_block(dev, req->iov[i].iov_base, block, blocks);
+        if (err < 0)
+            return err;
+
+        bytes += err;
+        if ((size_t)err != ((size_t)blocks << dev->block_shift))
+            break;
+
+        block += blocks;
+        count -= blocks;
+    }
+
+    return bytes;
+}
+
+status_t bio_submit(bdev_t *dev, bio_request_t *req)
+{
+    LTRACEF("dev '%s', req %p, %s block %u, count %u, iov_cnt %u\n", dev->name, req,
+            req->write ? "write" : "read", req->block, req->count, req->iov_cnt);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(req);
+
+    if (!req->iov && req->iov_cnt)
+        return ERR_INVALID_ARGS;
+
+    /* the scatter list must be made of whole blocks and cover the request */
+    size_t len = 0;
+    for (uint i = 0; i < req->iov_cnt; i++) {
+        if (req->iov[i].iov_len & (dev->block_size - 1))
+            return ERR_INVALID_ARGS;
+        len += req->iov[i].iov_len;
+    }
+    if (len < ((size_t)req->count << dev->block_shift))
+        return ERR_INVALID_ARGS;
+
+    event_init(&req->done, false, 0);
+    req->pending = 0;
+    req->result = 0;
+
+    /* range check */
+    req->count = bio_trim_block_range(dev, req->block, req->count);
+    if (req->count == 0) {
+        bio_request_complete(req, 0);
+        return NO_ERROR;
+    }
+
+    if (dev->sched)
+        return bio_sched_queue(dev->sched, req);
+
+    return bio_dispatch(dev, req);
+}
+
+status_t bio_dispatch(bdev_t *dev, bio_request_t *req)
+{
+    if (dev->submit)
+        return dev->submit(dev, req);
+
+    bio_request_complete(req, bio_sync_request(dev, req));
+    return NO_ERROR;
+}
+
+ssize_t bio_request_wait(bio_request_t *req)
+{
+    DEBUG_ASSERT(req && !req->callback);
+
+    event_wait(&req->done);
+    event_destroy(&req->done);
+
+    return req->result;
+}
+
+void bio_request_complete(bio_request_t *req, ssize_t result)
+{
+    LTRACEF("req %p, result %ld\n", req, result);
+
+    req->result = result;
+
+    if (req->callback) {
+        event_destroy(&req->done);
+        req->callback(req);
+    } else {
+        event_signal(&req->done, false);
+    }
 }
 
 int bio_ioctl(bdev_t *dev, int request, void *argp)
@@ -464,6 +888,34 @@ int bio_ioctl(bdev_t *dev, int request, void *argp)
     }
 }
 
+status_t bio_direct_map(bdev_t *dev, off_t offset, size_t len, const void **ptr)
+{
+    LTRACEF("dev '%s', offset %lld, len %zd\n", dev->name, offset, len);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(ptr);
+
+    /* the whole range must be on the device */
+    if (len == 0 || bio_trim_range(dev, offset, len) != len)
+        return ERR_OUT_OF_RANGE;
+
+    void *base;
+    int err = bio_ioctl(dev, BIO_IOCTL_GET_MEM_MAP, &base);
+    if (err < 0)
+        return err;
+
+    *ptr = (const uint8_t *)base + offset;
+
+    return NO_ERROR;
+}
+
+void bio_direct_unmap(bdev_t *dev)
+{
+    DEBUG_ASSERT(dev && dev->ref > 0);
+
+    bio_ioctl(dev, BIO_IOCTL_PUT_MEM_MAP, NULL);
+}
+
 void bio_initialize_bdev(bdev_t *dev,
                          const char *name,
                          size_t block_size,
@@ -486,9 +938,15 @@ void bio_initialize_bdev(bdev_t *dev,
     dev->total_size = (off_t)block_count << dev->block_shift;
     dev->geometry_count = geometry_count;
     dev->geometry = geometry;
+    dev->io_align = block_size;
+    dev->io_align_offset = 0;
     dev->erase_byte = 0;
     dev->ref = 0;
     dev->flags = flags;
+    dev->sched = NULL;
+    dev->bounce = NULL;
+    spin_lock_init(&dev->stats_lock);
+    memset(&dev->stats, 0, sizeof(dev->stats));
 
 #if DEBUG
     // If we have been supplied information about our erase geometry, sanity
@@ -531,12 +989,20 @@ void bio_initialize_bdev(bdev_t *dev,
     }
 #endif
 
+    /* erasable devices want i/o lined up with their largest erase block */
+    for (size_t i = 0; geometry && i < geometry_count; ++i) {
+        if (geometry[i].erase_size > dev->io_align)
+            dev->io_align = geometry[i].erase_size;
+    }
+
     /* set up the default hooks, the sub driver should override the block operations at least */
     dev->read = bio_default_read;
     dev->read_block = bio_default_read_block;
     dev->write = bio_default_write;
     dev->write_block = bio_default_write_block;
     dev->erase = bio_default_erase;
+    dev->submit = NULL;
+    dev->ioctl = NULL;
     dev->close = NULL;
 }
 
@@ -548,8 +1014,12 @@ void bio_register_device(bdev_t *dev)
 
     bdev_inc_ref(dev);
 
+    /* only the default byte hooks bounce through a block buffer */
+    if (!dev->bounce && (dev->read == bio_default_read || dev->write == bio_default_write))
+        bio_bounce_create(dev);
+
     mutex_acquire(&bdevs.lock);
-    list_add_tail(&bdevs.list, &dev->node);
+    rcu_list_add_tail(&bdevs.list, &dev->node);
     mutex_release(&bdevs.lock);
 }
 
@@ -561,9 +1031,12 @@ void bio_unregister_device(bdev_t *dev)
 
     // remove it from the list
     mutex_acquire(&bdevs.lock);
-    list_delete(&dev->node);
+    rcu_list_delete(&dev->node);
     mutex_release(&bdevs.lock);
 
+    // let bio_open() calls that may have seen it take their ref first
+    synchronize_rcu();
+
     bdev_dec_ref(dev); // remove the ref the list used to have
 }
 
@@ -571,12 +1044,23 @@ void bio_dump_devices(void)
 {
     printf("block devices:\n");
     bdev_t *entry;
+    /* printing may block, so hold off updaters rather than use rcu */
     mutex_acquire(&bdevs.lock);
     list_for_every_entry(&bdevs.list, entry, bdev_t, node) {
 
         printf("\t%s, size %lld, bsize %zd, ref %d",
                entry->name, entry->total_size, entry->block_size, entry->ref);
 
+        if (entry->io_align != entry->block_size || entry->io_align_offset)
+            printf(", io align %zu offset %zu", entry->io_align, entry->io_align_offset);
+
+        bio_sched_stats_t stats;
+        if (bio_sched_get_stats(entry, &stats) == NO_ERROR) {
+            printf(", sched requests %u batches %u merged %u expired %u depth %u/%u blocks %llu",
+                   stats.requests, stats.batches, stats.merged, stats.expired,
+                   stats.depth, stats.max_depth, stats.blocks);
+        }
+
         if (!entry->geometry_count || !entry->geometry) {
             printf(" (no erase geometry)\n");
         } else {
@@ -0,0 +1,580 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Write back cache for erasable block devices.
+ *
+ * Flash has to be erased a whole erase block at a time before it can be
+ * programmed, so small writes through the device's own hooks cost a full
+ * erase and program cycle each. The cache sits on top of such a device as a
+ * new bdev and keeps a few erase blocks in memory. Writes land in the cached
+ * copy and the erase block goes back to the medium when it is evicted, when
+ * it has been completely rewritten, or when the device is flushed or closed.
+ *
+ * Each cached line is one erase block of whatever region of the parent's
+ * erase geometry it falls in, so devices with mixed erase sizes are handled.
+ * Everything in a line has been read from the medium, and the blocks that
+ * read back fully erased are remembered, so a write back that only touched
+ * those is programmed without erasing first.
+ */
+#include <debug.h>
+#include <err.h>
+#include <trace.h>
+#include <stdlib.h>
+#include <string.h>
+#include <list.h>
+#include <lib/bio.h>
+#include <kernel/mutex.h>
+
+#define LOCAL_TRACE 0
+
+#ifndef BIO_CACHE_DEFAULT_LINES
+#define BIO_CACHE_DEFAULT_LINES 4
+#endif
+
+struct cache_line {
+    struct list_node node;  // most recently used first
+
+    off_t base;             // parent offset of the erase block, -1 if unused
+    size_t size;            // erase block size
+    uint8_t *buf;
+
+    // one bit per parent block
+    uint32_t *dirty;        // written since the last write back
+    uint32_t *erased;       // still erased on the medium
+};
+
+typedef struct {
+    // inheirit the usual bits
+    bdev_t dev;
+
+    // we're caching this
+    bdev_t *parent;
+
+    mutex_t lock;
+    struct list_node lru;
+
+    uint line_count;
+    size_t mask_words;
+    struct cache_line *lines;
+    uint8_t *bufs;
+    uint32_t *masks;
+
+    bio_cache_stats_t stats;
+} cache_t;
+
+static inline bool mask_test(const uint32_t *mask, uint bit)
+{
+    return mask[bit / 32] & (1u << (bit % 32));
+}
+
+static void mask_set(uint32_t *mask, uint first, uint count)
+{
+    for (uint bit = first; bit < first + count; bit++)
+        mask[bit / 32] |= 1u << (bit % 32);
+}
+
+static bool mask_full(const uint32_t *mask, uint count)
+{
+    for (uint bit = 0; bit < count; bit++) {
+        if (!mask_test(mask, bit))
+            return false;
+    }
+    return true;
+}
+
+static bool mask_any(const uint32_t *mask, size_t words)
+{
+    for (size_t i = 0; i < words; i++) {
+        if (mask[i])
+            return true;
+    }
+    return false;
+}
+
+/* is every bit set in a also set in b */
+static bool mask_subset(const uint32_t *a, const uint32_t *b, size_t words)
+{
+    for (size_t i = 0; i < words; i++) {
+        if (a[i] & ~b[i])
+            return false;
+    }
+    return true;
+}
+
+/* find the erase block of the parent holding offset */
+static void cache_extent(const cache_t *cache, off_t offset, off_t *base, size_t *size)
+{
+    const bdev_t *parent = cache->parent;
+
+    for (size_t i = 0; i < parent->geometry_count; i++) {
+        const bio_erase_geometry_info_t *geo = &parent->geometry[i];
+
+        if (offset >= geo->start && offset < geo->start + geo->size) {
+            size_t erase_size = MAX((size_t)1 << geo->erase_shift, parent->block_size);
+
+            *base = geo->start + ROUNDDOWN(offset - geo->start, (off_t)erase_size);
+            *size = erase_size;
+            return;
+        }
+    }
+
+    /* outside of the erasable regions, cache single blocks */
+    *base = ROUNDDOWN(offset, (off_t)parent->block_size);
+    *size = parent->block_size;
+}
+
+static struct cache_line *cache_find(cache_t *cache, off_t base)
+{
+    struct cache_line *line;
+    list_for_every_entry(&cache->lru, line, struct cache_line, node) {
+        if (line->base == base)
+            return line;
+    }
+
+    return NULL;
+}
+
+static void cache_touch(cache_t *cache, struct cache_line *line)
+{
+    list_delete(&line->node);
+    list_add_head(&cache->lru, &line->node);
+}
+
+static void cache_invalidate(cache_t *cache, struct cache_line *line)
+{
+    line->base = -1;
+    memset(line->dirty, 0, cache->mask_words * sizeof(uint32_t));
+
+    list_delete(&line->node);
+    list_add_tail(&cache->lru, &line->node);
+}
+
+static void cache_scan_erased(cache_t *cache, struct cache_line *line)
+{
+    const bdev_t *parent = cache->parent;
+    uint blocks = line->size >> parent->block_shift;
+
+    memset(line->erased, 0, cache->mask_words * sizeof(uint32_t));
+
+    for (uint i = 0; i < blocks; i++) {
+        const uint8_t *ptr = line->buf + ((size_t)i << parent->block_shift);
+        size_t j;
+
+        for (j = 0; j < parent->block_size; j++) {
+            if (ptr[j] != parent->erase_byte)
+                break;
+        }
+        if (j == parent->block_size)
+            mask_set(line->erased, i, 1);
+    }
+}
+
+static status_t cache_check(ssize_t err, size_t len)
+{
+    if (err < 0)
+        return err;
+    return ((size_t)err == len) ? NO_ERROR : ERR_IO;
+}
+
+/* write a line back to the medium if anything in it changed */
+static status_t cache_flush_line(cache_t *cache, struct cache_line *line)
+{
+    bdev_t *parent = cache->parent;
+    status_t err;
+
+    if (line->base < 0 || !mask_any(line->dirty, cache->mask_words))
+        return NO_ERROR;
+
+    LTRACEF("base 0x%llx size 0x%zx\n", line->base, line->size);
+
+    if (mask_subset(line->dirty, line->erased, cache->mask_words)) {
+        /* only erased blocks were written, program the dirty runs as they are */
+        uint blocks = line->size >> parent->block_shift;
+
+        for (uint i = 0; i < blocks; ) {
+            if (!mask_test(line->dirty, i)) {
+                i++;
+                continue;
+            }
+
+            uint end = i;
+            while (end < blocks && mask_test(line->dirty, end))
+                end++;
+
+            off_t pos = (off_t)i << parent->block_shift;
+            size_t len = (size_t)(end - i) << parent->block_shift;
+
+            err = cache_check(bio_write(parent, line->buf + pos, line->base + pos, len), len);
+            if (err < 0)
+                return err;
+
+            i = end;
+        }
+
+        cache->stats.programs++;
+    } else {
+        err = cache_check(bio_erase(parent, line->base, line->size), line->size);
+        if (err < 0)
+            return err;
+
+        cache->stats.erases++;
+
+        err = cache_check(bio_write(parent, line->buf, line->base, line->size), line->size);
+        if (err < 0) {
+            /* the medium no longer holds the old contents, keep the line dirty
+             * but don't try to program without erasing again */
+            memset(line->erased, 0, cache->mask_words * sizeof(uint32_t));
+            return err;
+        }
+    }
+
+    cache->stats.flushes++;
+
+    memset(line->dirty, 0, cache->mask_words * sizeof(uint32_t));
+    cache_scan_erased(cache, line);
+
+    return NO_ERROR;
+}
+
+static status_t cache_flush_all(cache_t *cache)
+{
+    status_t result = NO_ERROR;
+
+    for (uint i = 0; i < cache->line_count; i++) {
+        status_t err = cache_flush_line(cache, &cache->lines[i]);
+        if (err < 0)
+            result = err;
+    }
+
+    return result;
+}
+
+/* recycle the least recently used line to hold the erase block at base */
+static status_t cache_load(cache_t *cache, off_t base, size_t size, struct cache_line **out)
+{
+    struct cache_line *line = list_peek_tail_type(&cache->lru, struct cache_line, node);
+    status_t err;
+
+    err = cache_flush_line(cache, line);
+    if (err < 0)
+        return err;
+
+    cache_invalidate(cache, line);
+
+    err = cache_check(bio_read(cache->parent, line->buf, base, size), size);
+    if (err < 0)
+        return err;
+
+    line->base = base;
+    line->size = size;
+    cache_scan_erased(cache, line);
+    cache_touch(cache, line);
+
+    cache->stats.misses++;
+
+    *out = line;
+    return NO_ERROR;
+}
+
+static ssize_t cache_read(struct bdev *_dev, void *_buf, off_t offset, size_t len)
+{
+    cache_t *cache = (cache_t *)_dev;
+    uint8_t *buf = (uint8_t *)_buf;
+    ssize_t bytes = 0;
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&cache->lock);
+
+    while (len > 0) {
+        off_t base;
+        size_t size;
+        cache_extent(cache, offset, &base, &size);
+
+        size_t chunk = MIN(len, (size_t)(base + size - offset));
+        struct cache_line *line = cache_find(cache, base);
+
+        if (line) {
+            memcpy(buf, line->buf + (offset - base), chunk);
+            cache_touch(cache, line);
+            cache->stats.hits++;
+        } else {
+            /* reads don't fill the cache, but take the whole uncached run at once */
+            while (chunk < len) {
+                cache_extent(cache, offset + chunk, &base, &size);
+                if (cache_find(cache, base))
+                    break;
+                chunk += MIN(len - chunk, size);
+            }
+
+            err = cache_check(bio_read(cache->parent, buf, offset, chunk), chunk);
+            if (err < 0)
+                break;
+        }
+
+        buf += chunk;
+        offset += chunk;
+        len -= chunk;
+        bytes += chunk;
+    }
+
+    mutex_release(&cache->lock);
+
+    return (err < 0) ? err : bytes;
+}
+
+static ssize_t cache_read_block(struct bdev *_dev, void *buf, bnum_t block, uint count)
+{
+    return cache_read(_dev, buf, (off_t)block << _dev->block_shift, (size_t)count << _dev->block_shift);
+}
+
+static ssize_t cache_write(struct bdev *_dev, const void *_buf, off_t offset, size_t len)
+{
+    cache_t *cache = (cache_t *)_dev;
+    bdev_t *parent = cache->parent;
+    const uint8_t *buf = (const uint8_t *)_buf;
+    ssize_t bytes = 0;
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&cache->lock);
+
+    while (len > 0) {
+        off_t base;
+        size_t size;
+        cache_extent(cache, offset, &base, &size);
+
+        size_t line_offset = offset - base;
+        size_t chunk = MIN(len, size - line_offset);
+        struct cache_line *line = cache_find(cache, base);
+
+        if (!line && chunk == size) {
+            /* a whole erase block that isn't cached goes straight to the medium */
+            err = cache_check(bio_erase(parent, base, size), size);
+            if (err < 0)
+                break;
+            err = cache_check(bio_write(parent, buf, base, size), size);
+            if (err < 0)
+                break;
+
+            cache->stats.erases++;
+            cache->stats.direct++;
+        } else {
+            if (line) {
+                cache_touch(cache, line);
+                cache->stats.hits++;
+            } else {
+                err = cache_load(cache, base, size, &line);
+                if (err < 0)
+                    break;
+            }
+
+            memcpy(line->buf + line_offset, buf, chunk);
+
+            uint first = line_offset >> parent->block_shift;
+            uint last = (line_offset + chunk - 1) >> parent->block_shift;
+            mask_set(line->dirty, first, last - first + 1);
+
+            /* nothing left to gather once the whole erase block is rewritten */
+            if (mask_full(line->dirty, size >> parent->block_shift)) {
+                err = cache_flush_line(cache, line);
+                if (err < 0)
+                    break;
+            }
+        }
+
+        buf += chunk;
+        offset += chunk;
+        len -= chunk;
+        bytes += chunk;
+    }
+
+    mutex_release(&cache->lock);
+
+    return (err < 0) ? err : bytes;
+}
+
+static ssize_t cache_write_block(struct bdev *_dev, const void *buf, bnum_t block, uint count)
+{
+    return cache_write(_dev, buf, (off_t)block << _dev->block_shift, (size_t)count << _dev->block_shift);
+}
+
+static ssize_t cache_erase(struct bdev *_dev, off_t offset, size_t len)
+{
+    cache_t *cache = (cache_t *)_dev;
+    ssize_t err = NO_ERROR;
+
+    mutex_acquire(&cache->lock);
+
+    /* lines the erase covers completely are simply dropped, anything else
+     * cached in range has to reach the medium before being erased around */
+    for (uint i = 0; i < cache->line_count; i++) {
+        struct cache_line *line = &cache->lines[i];
+
+        if (line->base < 0 || !bio_does_overlap(line->base, line->size, offset, len))
+            continue;
+
+        if (!bio_contains_range(offset, len, line->base, line->size)) {
+            err = cache_flush_line(cache, line);
+            if (err < 0)
+                goto out;
+        }
+
+        cache_invalidate(cache, line);
+    }
+
+    err = bio_erase(cache->parent, offset, len);
+
+out:
+    mutex_release(&cache->lock);
+
+    return err;
+}
+
+static int cache_ioctl(struct bdev *_dev, int request, void *argp)
+{
+    cache_t *cache = (cache_t *)_dev;
+
+    mutex_acquire(&cache->lock);
+    status_t err = cache_flush_all(cache);
+    mutex_release(&cache->lock);
+
+    if (err < 0 || request == BIO_IOCTL_FLUSH)
+        return err;
+
+    /* anything else sees the medium directly, which is now up to date */
+    return bio_ioctl(cache->parent, request, argp);
+}
+
+static void cache_close(struct bdev *_dev)
+{
+    cache_t *cache = (cache_t *)_dev;
+
+    status_t err = cache_flush_all(cache);
+    if (err < 0)
+        TRACEF("error %d writing back cache of \"%s\"\n", err, cache->parent->name);
+
+    mutex_destroy(&cache->lock);
+    free(cache->bufs);
+    free(cache->masks);
+
+    bio_close(cache->parent);
+    cache->parent = NULL;
+}
+
+status_t bio_cache_get_stats(bdev_t *dev, bio_cache_stats_t *stats)
+{
+    if (dev->read != &cache_read)
+        return ERR_NOT_SUPPORTED;
+
+    cache_t *cache = (cache_t *)dev;
+
+    mutex_acquire(&cache->lock);
+    *stats = cache->stats;
+    mutex_release(&cache->lock);
+
+    return NO_ERROR;
+}
+
+#define BAIL(__err) do { err = __err; goto bailout; } while (0)
+status_t bio_publish_cache(const char *parent_dev, const char *name, uint lines)
+{
+    status_t err = NO_ERROR;
+    bdev_t *parent = NULL;
+    cache_t *cache = NULL;
+
+    LTRACEF("parent \"%s\", name \"%s\", lines %u\n", parent_dev, name, lines);
+
+    parent = bio_open(parent_dev);
+    if (!parent)
+        BAIL(ERR_NOT_FOUND);
+
+    /* only worth it for devices that need erasing before being written */
+    if (!parent->geometry_count || !parent->geometry)
+        BAIL(ERR_NOT_SUPPORTED);
+
+    if (lines == 0)
+        lines = BIO_CACHE_DEFAULT_LINES;
+
+    /* every line is sized for the largest erase block on the device */
+    size_t line_size = parent->block_size;
+    for (size_t i = 0; i < parent->geometry_count; i++)
+        line_size = MAX(line_size, (size_t)1 << parent->geometry[i].erase_shift);
+
+    cache = calloc(1, sizeof(cache_t) + lines * sizeof(struct cache_line));
+    if (!cache)
+        BAIL(ERR_NO_MEMORY);
+
+    cache->parent = parent;
+    cache->line_count = lines;
+    cache->mask_words = ((line_size >> parent->block_shift) + 31) / 32;
+    cache->lines = (struct cache_line *)(cache + 1);
+    cache->bufs = memalign(CACHE_LINE, lines * line_size);
+    cache->masks = calloc(lines * 2 * cache->mask_words, sizeof(uint32_t));
+    if (!cache->bufs || !cache->masks)
+        BAIL(ERR_NO_MEMORY);
+
+    mutex_init(&cache->lock);
+    list_initialize(&cache->lru);
+
+    for (uint i = 0; i < lines; i++) {
+        struct cache_line *line = &cache->lines[i];
+
+        line->base = -1;
+        line->buf = cache->bufs + i * line_size;
+        line->dirty = cache->masks + i * 2 * cache->mask_words;
+        line->erased = line->dirty + cache->mask_words;
+        list_add_tail(&cache->lru, &line->node);
+    }
+
+    bio_initialize_bdev(&cache->dev, name,
+                        parent->block_size, parent->block_count,
+                        parent->geometry_count, parent->geometry, BIO_FLAGS_NONE);
+
+    cache->dev.erase_byte = parent->erase_byte;
+    cache->dev.io_align = parent->io_align;
+    cache->dev.io_align_offset = parent->io_align_offset;
+
+    cache->dev.read = &cache_read;
+    cache->dev.read_block = &cache_read_block;
+    cache->dev.write = &cache_write;
+    cache->dev.write_block = &cache_write_block;
+    cache->dev.erase = &cache_erase;
+    cache->dev.ioctl = &cache_ioctl;
+    cache->dev.close = &cache_close;
+
+    bio_register_device(&cache->dev);
+
+bailout:
+    if (err < 0) {
+        if (NULL != parent)
+            bio_close(parent);
+        if (cache) {
+            free(cache->bufs);
+            free(cache->masks);
+            free(cache);
+        }
+    }
+
+    return err;
+}
+#undef BAIL
@@ -40,11 +40,18 @@
 #define THREE_BYTE_ADDR_BOUNDARY (16777216)
 #define SUB_ERASE_TEST_SAMPLES (32)
 
+#define BENCH_DEFAULT_BLOCK_SIZE (4096)
+#define BENCH_DEFAULT_SECS (5)
+#define BENCH_MAX_QUEUE_DEPTH (32)
+#define BENCH_LATENCY_SAMPLES (4096)
+
 #if defined(WITH_LIB_CONSOLE)
 
 #if LK_DEBUGLEVEL > 0
 static int cmd_bio(int argc, const cmd_args *argv);
 static int bio_test_device(bdev_t *device);
+static int bio_bench_device(bdev_t *device, bool write, bool random, size_t block_size,
+                            uint queue_depth, lk_time_t duration);
 
 STATIC_COMMAND_START
 STATIC_COMMAND("bio", "block io debug commands", &cmd_bio)
@@ -65,7 +72,12 @@ usage:
         printf("%s erase <device> <offset> <len>\n", argv[0].str);
         printf("%s ioctl <device> <request> <arg>\n", argv[0].str);
         printf("%s remove <device>\n", argv[0].str);
+        printf("%s sched <device> [deadline msecs|off|reset]\n", argv[0].str);
+        printf("%s cache <device> [<cache name> [lines]]\n", argv[0].str);
+        printf("%s ramcache <device> [<cache name> <size> [wt]]\n", argv[0].str);
+        printf("%s stats <device> [reset]\n", argv[0].str);
         printf("%s test <device>\n", argv[0].str);
+        printf("%s bench <device> <read|write|randread|randwrite> [block size] [queue depth] [secs]\n", argv[0].str);
 #if WITH_LIB_PARTITION
         printf("%s partscan <device> [offset]\n", argv[0].str);
 #endif
@@ -209,6 +221,105 @@ usage:
         }
 
         bio_unregister_device(dev);
+        bio_close(dev);
+    } else if (!strcmp(argv[1].str, "sched")) {
+        if (argc < 3) goto notenoughargs;
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        if (argc < 4) {
+            bio_sched_stats_t stats;
+            if (bio_sched_get_stats(dev, &stats) == NO_ERROR) {
+                printf("requests %u batches %u merged %u expired %u depth %u max depth %u blocks %llu\n",
+                       stats.requests, stats.batches, stats.merged, stats.expired,
+                       stats.depth, stats.max_depth, stats.blocks);
+            } else {
+                printf("no scheduler attached\n");
+            }
+        } else if (!strcmp(argv[3].str, "off")) {
+            bio_sched_detach(dev);
+        } else if (!strcmp(argv[3].str, "reset")) {
+            bio_sched_reset_stats(dev);
+        } else {
+            rc = bio_sched_attach(dev, argv[3].u ? argv[3].u : BIO_SCHED_DEFAULT_DEADLINE);
+            if (rc < 0)
+                printf("error %d attaching scheduler\n", rc);
+        }
+
+        bio_close(dev);
+    } else if (!strcmp(argv[1].str, "cache")) {
+        if (argc < 3) goto notenoughargs;
+
+        if (argc >= 4) {
+            rc = bio_publish_cache(argv[2].str, argv[3].str, (argc >= 5) ? argv[4].u : 0);
+            if (rc < 0)
+                printf("error %d publishing cache\n", rc);
+            return rc;
+        }
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        bio_cache_stats_t stats;
+        if (bio_cache_get_stats(dev, &stats) == NO_ERROR) {
+            printf("hits %u misses %u flushes %u erases %u programs %u direct %u\n",
+                   stats.hits, stats.misses, stats.flushes, stats.erases,
+                   stats.programs, stats.direct);
+        } else {
+            printf("not a cache device\n");
+        }
+
+        bio_close(dev);
+    } else if (!strcmp(argv[1].str, "ramcache")) {
+        if (argc < 3) goto notenoughargs;
+
+        if (argc >= 4) {
+            if (argc < 5) goto notenoughargs;
+
+            uint flags = (argc >= 6 && !strcmp(argv[5].str, "wt")) ? BIO_RAMCACHE_WRITE_THROUGH : 0;
+            rc = bio_publish_ramcache(argv[2].str, argv[3].str, argv[4].u, flags);
+            if (rc < 0)
+                printf("error %d publishing ram cache\n", rc);
+            return rc;
+        }
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        bio_ramcache_stats_t stats;
+        if (bio_ramcache_get_stats(dev, &stats) == NO_ERROR) {
+            printf("hits %u misses %u readahead %u evictions %u writebacks %u\n",
+                   stats.hits, stats.misses, stats.readahead, stats.evictions, stats.writebacks);
+        } else {
+            printf("not a ram cache device\n");
+        }
+
+        bio_close(dev);
+    } else if (!strcmp(argv[1].str, "stats")) {
+        if (argc < 3) goto notenoughargs;
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        if (argc >= 4 && !strcmp(argv[3].str, "reset")) {
+            bio_reset_stats(dev);
+        } else {
+            bio_dump_stats(dev);
+        }
+
         bio_close(dev);
     } else if (!strcmp(argv[1].str, "test")) {
         if (argc < 3) goto notenoughargs;
@@ -223,6 +334,39 @@ usage:
         bio_close(dev);
 
         rc = err;
+    } else if (!strcmp(argv[1].str, "bench")) {
+        if (argc < 4) goto notenoughargs;
+
+        bool write, random;
+        if (!strcmp(argv[3].str, "read")) {
+            write = false;
+            random = false;
+        } else if (!strcmp(argv[3].str, "write")) {
+            write = true;
+            random = false;
+        } else if (!strcmp(argv[3].str, "randread")) {
+            write = false;
+            random = true;
+        } else if (!strcmp(argv[3].str, "randwrite")) {
+            write = true;
+            random = true;
+        } else {
+            printf("unknown pattern '%s'\n", argv[3].str);
+            goto usage;
+        }
+
+        size_t block_size = (argc > 4) ? argv[4].u : BENCH_DEFAULT_BLOCK_SIZE;
+        uint queue_depth = (argc > 5) ? argv[5].u : 1;
+        lk_time_t duration = ((argc > 6) ? argv[6].u : BENCH_DEFAULT_SECS) * 1000;
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        rc = bio_bench_device(dev, write, random, block_size, queue_depth, duration);
+        bio_close(dev);
 #if WITH_LIB_PARTITION
     } else if (!strcmp(argv[1].str, "partscan")) {
         if (argc < 3) goto notenoughargs;
@@ -562,3 +706,210 @@ static int bio_test_device(bdev_t *device)
 
     return 0;
 }
+
+struct bench_state {
+    bdev_t *device;
+    bool write;
+    bool random;
+    uint blocks;            /* device blocks per request */
+    bnum_t positions;       /* request sized slots on the device */
+    bnum_t next_pos;
+
+    spin_lock_t lock;
+    struct list_node done;  /* completed requests waiting to be reaped */
+    event_t event;
+};
+
+struct bench_slot {
+    bio_request_t req;
+    iovec_t iov;
+    lk_bigtime_t start;
+    lk_bigtime_t end;
+    struct list_node node;
+    struct bench_state *state;
+};
+
+/* may run in interrupt context */
+static void bench_request_done(bio_request_t *req)
+{
+    struct bench_slot *slot = req->cookie;
+    struct bench_state *state = slot->state;
+
+    slot->end = current_time_hires();
+
+    spin_lock_saved_state_t sstate;
+    spin_lock_irqsave(&state->lock, sstate);
+    list_add_tail(&state->done, &slot->node);
+    spin_unlock_irqrestore(&state->lock, sstate);
+
+    event_signal(&state->event, false);
+}
+
+static uint64_t bench_rand(void)
+{
+    return ((uint64_t)rand() << 31) ^ rand();
+}
+
+/* issue the next request of the pattern on a free slot */
+static bool bench_submit(struct bench_state *state, struct bench_slot *slot)
+{
+    bnum_t pos = state->random ? (bnum_t)(bench_rand() % state->positions)
+                 : state->next_pos++ % state->positions;
+
+    slot->state = state;
+    slot->req = (bio_request_t) {
+        .write = state->write,
+        .block = pos * state->blocks,
+        .count = state->blocks,
+        .iov = &slot->iov,
+        .iov_cnt = 1,
+        .callback = bench_request_done,
+        .cookie = slot,
+    };
+    slot->start = current_time_hires();
+
+    return bio_submit(state->device, &slot->req) == NO_ERROR;
+}
+
+static int bench_cmp_latency(const void *a, const void *b)
+{
+    uint32_t la = *(const uint32_t *)a;
+    uint32_t lb = *(const uint32_t *)b;
+
+    return (la > lb) - (la < lb);
+}
+
+// Runs a read or write pattern against the device for the given duration,
+// keeping queue_depth requests outstanding, and reports throughput and latency.
+static int bio_bench_device(bdev_t *device, bool write, bool random, size_t block_size,
+                            uint queue_depth, lk_time_t duration)
+{
+    block_size = ROUNDUP(MAX(block_size, device->block_size), device->block_size);
+    struct bench_state state = {
+        .device = device,
+        .write = write,
+        .random = random,
+        .blocks = block_size >> device->block_shift,
+    };
+    state.positions = device->block_count / state.blocks;
+
+    if (state.positions == 0 || queue_depth == 0 || queue_depth > BENCH_MAX_QUEUE_DEPTH) {
+        printf("invalid block size or queue depth (max %u)\n", BENCH_MAX_QUEUE_DEPTH);
+        return ERR_INVALID_ARGS;
+    }
+
+    if (write)
+        printf("WARNING: overwriting contents of %s\n", device->name);
+
+    int err = NO_ERROR;
+    struct bench_slot *slots = calloc(queue_depth, sizeof(struct bench_slot));
+    uint32_t *samples = malloc(BENCH_LATENCY_SAMPLES * sizeof(uint32_t));
+    if (!slots || !samples) {
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+    for (uint i = 0; i < queue_depth; i++) {
+        slots[i].iov.iov_base = memalign(DMA_ALIGNMENT, block_size);
+        slots[i].iov.iov_len = block_size;
+        if (!slots[i].iov.iov_base) {
+            err = ERR_NO_MEMORY;
+            goto out;
+        }
+        memset(slots[i].iov.iov_base, i, block_size);
+    }
+
+    spin_lock_init(&state.lock);
+    list_initialize(&state.done);
+    event_init(&state.event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    printf("%s %s %s, block size %zu, queue depth %u, %u secs\n", device->name,
+           random ? "random" : "sequential", write ? "write" : "read",
+           block_size, queue_depth, duration / 1000);
+
+    uint64_t ops = 0;
+    uint64_t errors = 0;
+    uint64_t samples_seen = 0;
+    uint32_t min_latency = UINT32_MAX;
+    uint32_t max_latency = 0;
+    uint outstanding = 0;
+    lk_time_t start = current_time();
+    lk_time_t end = start + duration;
+
+    /* fill the queue */
+    for (uint i = 0; i < queue_depth; i++) {
+        if (bench_submit(&state, &slots[i]))
+            outstanding++;
+        else
+            errors++;
+    }
+
+    /* reap completions and keep the queue full until time runs out */
+    while (outstanding > 0) {
+        event_wait(&state.event);
+
+        for (;;) {
+            spin_lock_saved_state_t sstate;
+            spin_lock_irqsave(&state.lock, sstate);
+            struct bench_slot *slot = list_remove_head_type(&state.done, struct bench_slot, node);
+            spin_unlock_irqrestore(&state.lock, sstate);
+            if (!slot)
+                break;
+
+            outstanding--;
+
+            if (slot->req.result == (ssize_t)block_size)
+                ops++;
+            else
+                errors++;
+
+            uint32_t latency = MIN(slot->end - slot->start, UINT32_MAX);
+            min_latency = MIN(min_latency, latency);
+            max_latency = MAX(max_latency, latency);
+
+            /* keep a uniform sample of the latencies for the percentiles */
+            samples_seen++;
+            if (samples_seen <= BENCH_LATENCY_SAMPLES) {
+                samples[samples_seen - 1] = latency;
+            } else {
+                uint64_t r = bench_rand() % samples_seen;
+                if (r < BENCH_LATENCY_SAMPLES)
+                    samples[r] = latency;
+            }
+
+            if (errors == 0 && TIME_LT(current_time(), end)) {
+                if (bench_submit(&state, slot))
+                    outstanding++;
+                else
+                    errors++;
+            }
+        }
+    }
+
+    lk_time_t elapsed = MAX(current_time() - start, 1U);
+    event_destroy(&state.event);
+
+    uint64_t bytes_per_sec = ops * block_size * 1000 / elapsed;
+    printf("%llu ops, %llu errors in %u msecs\n", ops, errors, elapsed);
+    printf("%llu.%02llu MB/s, %llu IOPS\n", bytes_per_sec / 1000000, (bytes_per_sec % 1000000) / 10000,
+           ops * 1000 / elapsed);
+
+    uint sample_count = MIN(samples_seen, BENCH_LATENCY_SAMPLES);
+    if (sample_count > 0) {
+        qsort(samples, sample_count, sizeof(uint32_t), bench_cmp_latency);
+        printf("latency usecs: min %u p50 %u p90 %u p99 %u p99.9 %u max %u\n", min_latency,
+               samples[sample_count * 50 / 100], samples[sample_count * 90 / 100],
+               samples[sample_count * 99 / 100], samples[sample_count * 999 / 1000], max_latency);
+    }
+
+    if (errors > 0)
+        err = ERR_IO;
+
+out:
+    if (slots) {
+        for (uint i = 0; i < queue_depth; i++)
+            free(slots[i].iov.iov_base);
+    }
+    free(slots);
+    free(samples);
+    return err;
+}
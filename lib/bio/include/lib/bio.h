@@ -25,6 +25,9 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <list.h>
+#include <iovec.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
 
 __BEGIN_CDECLS
 
@@ -41,6 +44,62 @@ typedef struct bio_erase_geometry_info {
     size_t erase_shift;
 } bio_erase_geometry_info_t;
 
+/* per device statistics for each kind of operation */
+#define BIO_LATENCY_BUCKETS 24
+
+typedef struct bio_op_stats {
+    uint32_t count;
+    uint32_t errors;
+    uint64_t bytes;
+    /* bucket n counts operations that took [2^n, 2^(n+1)) usecs, the first
+     * also holds anything faster and the last anything slower */
+    uint32_t latency[BIO_LATENCY_BUCKETS];
+} bio_op_stats_t;
+
+typedef struct bio_stats {
+    bio_op_stats_t read;
+    bio_op_stats_t write;
+    bio_op_stats_t erase;
+    uint32_t inflight;      /* operations currently in progress */
+    uint32_t max_inflight;
+} bio_stats_t;
+
+struct bdev;
+
+/* asynchronous block request */
+typedef struct bio_request bio_request_t;
+typedef void (*bio_request_callback_t)(bio_request_t *req);
+
+struct bio_request {
+    /* filled in by the caller. block may be translated into a parent
+     * device's block space while a request passes through a subdevice */
+    bool write;
+    bnum_t block;
+    uint count;
+
+    /* scatter list covering count blocks. each entry must be a whole number of blocks */
+    const iovec_t *iov;
+    uint iov_cnt;
+
+    /* if set, called exactly once when the request completes, possibly from
+     * interrupt context. the request belongs to the callback from then on.
+     * if not set, wait for completion with bio_request_wait(). */
+    bio_request_callback_t callback;
+    void *cookie;
+
+    /* bytes transferred or error, valid once the request completes */
+    ssize_t result;
+
+    /* private to bio and the driver while the request is in flight */
+    event_t done;
+    volatile int pending;
+    struct list_node node;
+    lk_time_t queued;
+};
+
+struct bio_sched;
+struct bio_bounce;
+
 typedef struct bdev {
     struct list_node node;
     volatile int ref;
@@ -56,10 +115,27 @@ typedef struct bdev {
     size_t geometry_count;
     const bio_erase_geometry_info_t *geometry;
 
+    /* preferred i/o granule of the underlying medium (erase block, stripe,
+     * physical sector) and how far into one block 0 of this device sits.
+     * i/o at offsets where (offset + io_align_offset) % io_align == 0 lines up
+     * with the medium */
+    size_t io_align;
+    size_t io_align_offset;
+
     uint8_t erase_byte;
 
     uint32_t flags;
 
+    /* statistics for bio_read/bio_write/bio_erase and the vectored calls */
+    spin_lock_t stats_lock;
+    bio_stats_t stats;
+
+    /* request scheduler, if one is attached */
+    struct bio_sched *sched;
+
+    /* block buffers for partial transfers through the default read/write hooks */
+    struct bio_bounce *bounce;
+
     /* function pointers */
     ssize_t (*read)(struct bdev *, void *buf, off_t offset, size_t len);
     ssize_t (*read_block)(struct bdev *, void *buf, bnum_t block, uint count);
@@ -67,6 +143,8 @@ typedef struct bdev {
     ssize_t (*write_block)(struct bdev *, const void *buf, bnum_t block, uint count);
     ssize_t (*erase)(struct bdev *, off_t offset, size_t len);
     int (*ioctl)(struct bdev *, int request, void *argp);
+    /* optional, queue a request and return without waiting for it */
+    status_t (*submit)(struct bdev *, bio_request_t *req);
     void (*close)(struct bdev *);
 } bdev_t;
 
@@ -77,9 +155,53 @@ ssize_t bio_read(bdev_t *dev, void *buf, off_t offset, size_t len);
 ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count);
 ssize_t bio_write(bdev_t *dev, const void *buf, off_t offset, size_t len);
 ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count);
+ssize_t bio_readv(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset);
+ssize_t bio_writev(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset);
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len);
 int bio_ioctl(bdev_t *dev, int request, void *argp);
 
+/* direct access to devices whose contents can be memory mapped, such as
+ * memory backed and memory mapped flash devices. returns a pointer to the
+ * range in place, which stays valid until bio_direct_unmap(). the underlying
+ * map is not reference counted, so nested maps of one device must be avoided. */
+status_t bio_direct_map(bdev_t *dev, off_t offset, size_t len, const void **ptr);
+void bio_direct_unmap(bdev_t *dev);
+
+/* statistics */
+void bio_get_stats(bdev_t *dev, bio_stats_t *stats);
+void bio_reset_stats(bdev_t *dev);
+void bio_dump_stats(bdev_t *dev);
+
+/* asynchronous api. requests are handed to the driver's submit hook if it has
+ * one, otherwise they are carried out synchronously before bio_submit returns.
+ * on success the request completes later through its callback or
+ * bio_request_wait(), on failure it is never completed. */
+status_t bio_submit(bdev_t *dev, bio_request_t *req);
+ssize_t bio_request_wait(bio_request_t *req);
+
+/* called by drivers to finish off a submitted request */
+void bio_request_complete(bio_request_t *req, ssize_t result);
+
+/* request scheduler. once attached, requests to the device are sorted and
+ * adjacent ones merged before being handed to the driver one batch at a time,
+ * and no request waits longer than the deadline before being picked. */
+#define BIO_SCHED_DEFAULT_DEADLINE 100 /* msecs */
+
+typedef struct bio_sched_stats {
+    uint32_t requests;  /* requests queued */
+    uint32_t batches;   /* batches handed to the driver */
+    uint32_t merged;    /* requests merged into another request's batch */
+    uint32_t expired;   /* batches started early because of the deadline */
+    uint32_t depth;     /* requests currently queued */
+    uint32_t max_depth;
+    uint64_t blocks;    /* blocks transferred */
+} bio_sched_stats_t;
+
+status_t bio_sched_attach(bdev_t *dev, lk_time_t deadline);
+void bio_sched_detach(bdev_t *dev);
+status_t bio_sched_get_stats(bdev_t *dev, bio_sched_stats_t *stats);
+void bio_sched_reset_stats(bdev_t *dev);
+
 /* register a block device */
 void bio_register_device(bdev_t *dev);
 void bio_unregister_device(bdev_t *dev);
@@ -96,12 +218,54 @@ void bio_initialize_bdev(bdev_t *dev,
 /* debug stuff */
 void bio_dump_devices(void);
 
-/* subdevice support */
+/* round a device offset up to the next io_align boundary of the medium */
+static inline off_t bio_align_io(const bdev_t *dev, off_t offset)
+{
+    off_t rem = (offset + dev->io_align_offset) % dev->io_align;
+
+    return rem ? offset + (dev->io_align - rem) : offset;
+}
+
+/* subdevice support, the subdevice inherits the parent's io alignment */
 status_t bio_publish_subdevice(const char *parent_dev,
                                const char *subdev,
                                bnum_t startblock,
                                bnum_t block_count);
 
+/* write back cache for erasable devices. publishes a new device on top of
+ * parent_dev that keeps up to lines erase blocks (0 for the default) in memory,
+ * gathering small writes into one erase and program per erase block. data
+ * reaches the medium on eviction, once an erase block has been completely
+ * rewritten, on BIO_IOCTL_FLUSH and when the cache device is closed. */
+typedef struct bio_cache_stats {
+    uint32_t hits;      /* reads and writes served by a cached erase block */
+    uint32_t misses;    /* erase blocks read in to take a write */
+    uint32_t flushes;   /* cached erase blocks written back */
+    uint32_t erases;    /* erase cycles issued to the device */
+    uint32_t programs;  /* write backs that only programmed still erased blocks */
+    uint32_t direct;    /* whole erase block writes that bypassed the cache */
+} bio_cache_stats_t;
+
+status_t bio_publish_cache(const char *parent_dev, const char *name, uint lines);
+status_t bio_cache_get_stats(bdev_t *dev, bio_cache_stats_t *stats);
+
+/* ram cache for slow devices. publishes a new device on top of parent_dev
+ * caching up to size bytes of it in memory, with read ahead of sequential
+ * reads. writes are held back until evicted, BIO_IOCTL_FLUSH or close unless
+ * BIO_RAMCACHE_WRITE_THROUGH is passed. */
+#define BIO_RAMCACHE_WRITE_THROUGH (1 << 0)
+
+typedef struct bio_ramcache_stats {
+    uint32_t hits;          /* chunks found in the cache */
+    uint32_t misses;        /* reads issued to the device to fill the cache */
+    uint32_t readahead;     /* chunks read in ahead of being asked for */
+    uint32_t evictions;     /* cached chunks recycled */
+    uint32_t writebacks;    /* writes of dirty blocks to the device */
+} bio_ramcache_stats_t;
+
+status_t bio_publish_ramcache(const char *parent_dev, const char *name, size_t size, uint flags);
+status_t bio_ramcache_get_stats(bdev_t *dev, bio_ramcache_stats_t *stats);
+
 /* memory based block device */
 int create_membdev(const char *name, void *ptr, size_t len);
 
@@ -145,6 +309,7 @@ enum bio_ioctl_num {
     BIO_IOCTL_PUT_MEM_MAP,  /* if needed, return the pointer (to 'close' the map) */
     BIO_IOCTL_GET_MAP_ADDR, /* if supported, request a pointer to the memory map without putting the device into linear mode */
     BIO_IOCTL_IS_MAPPED,    /* if supported, returns whether or not the device is memory mapped. */
+    BIO_IOCTL_FLUSH,        /* if supported, write back anything the device is holding on to */
 };
 
 __END_CDECLS
\ No newline at end of file
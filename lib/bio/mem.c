@@ -24,6 +24,7 @@
 #include <trace.h>
 #include <string.h>
 #include <stdlib.h>
+#include <err.h>
 #include <lib/bio.h>
 
 #define LOCAL_TRACE 0
@@ -80,6 +81,30 @@ static ssize_t mem_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t b
     return count * BLOCKSIZE;
 }
 
+static int mem_bdev_ioctl(struct bdev *bdev, int request, void *argp)
+{
+    mem_bdev_t *mem = (mem_bdev_t *)bdev;
+
+    LTRACEF("bdev %s, request %d, argp %p\n", bdev->name, request, argp);
+
+    switch (request) {
+        case BIO_IOCTL_GET_MEM_MAP:
+        case BIO_IOCTL_GET_MAP_ADDR:
+            /* the contents are always in memory */
+            if (argp)
+                *(void **)argp = mem->ptr;
+            return NO_ERROR;
+        case BIO_IOCTL_PUT_MEM_MAP:
+            return NO_ERROR;
+        case BIO_IOCTL_IS_MAPPED:
+            if (argp)
+                *(void **)argp = (void *)true;
+            return NO_ERROR;
+        default:
+            return ERR_NOT_SUPPORTED;
+    }
+}
+
 int create_membdev(const char *name, void *ptr, size_t len)
 {
     mem_bdev_t *mem = malloc(sizeof(mem_bdev_t));
@@ -94,6 +119,7 @@ int create_membdev(const char *name, void *ptr, size_t len)
     mem->dev.read_block = mem_bdev_read_block;
     mem->dev.write = mem_bdev_write;
     mem->dev.write_block = mem_bdev_write_block;
+    mem->dev.ioctl = mem_bdev_ioctl;
 
     /* register it */
     bio_register_device(&mem->dev);
@@ -0,0 +1,522 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * RAM cache for slow block devices.
+ *
+ * Publishes a new bdev on top of an existing one, backed by a large chunk of
+ * memory split into fixed size chunks of a few blocks each. Chunks are found
+ * through a hash on their position and recycled least recently used first.
+ * Misses are read in with a single vectored read covering every uncached
+ * chunk the request spans, and once reads look sequential a few more chunks
+ * are read ahead with it.
+ *
+ * Writes either go to the device straight away and update whatever is cached
+ * (write through), or only mark the cached blocks dirty, which are then
+ * written out when their chunk is recycled, on BIO_IOCTL_FLUSH and on close.
+ *
+ * The byte level hooks are the default ones, so partial block requests are
+ * deblocked by the bio layer on top of the cached block hooks.
+ */
+#include <debug.h>
+#include <err.h>
+#include <trace.h>
+#include <stdlib.h>
+#include <string.h>
+#include <list.h>
+#include <pow2.h>
+#include <lib/bio.h>
+#include <kernel/mutex.h>
+
+#define LOCAL_TRACE 0
+
+#ifndef BIO_RAMCACHE_CHUNK_SIZE
+#define BIO_RAMCACHE_CHUNK_SIZE 4096
+#endif
+
+/* chunks read ahead of a sequential miss */
+#ifndef BIO_RAMCACHE_READAHEAD
+#define BIO_RAMCACHE_READAHEAD 8
+#endif
+
+/* most chunks filled by one read */
+#define MAX_FILL 16
+
+#define INVALID_CHUNK ((bnum_t)-1)
+
+struct rc_chunk {
+    struct list_node lru;   // most recently used first
+    struct list_node hash;
+    bnum_t index;           // position on the device in chunks
+    uint32_t dirty;         // blocks not written back yet
+    uint8_t *buf;
+};
+
+typedef struct {
+    // inheirit the usual bits
+    bdev_t dev;
+
+    // we're caching this
+    bdev_t *parent;
+
+    mutex_t lock;
+    uint flags;
+
+    uint chunk_blocks;      // power of two, at most 32
+    uint chunk_shift;       // log2 of chunk_blocks
+    uint chunk_count;
+    struct rc_chunk *chunks;
+    uint8_t *bufs;
+
+    struct list_node lru;
+    struct list_node *hash;
+    uint hash_mask;
+
+    // where a read continuing the last miss would start
+    bnum_t next_seq;
+
+    bio_ramcache_stats_t stats;
+} ramcache_t;
+
+static inline uint rc_hash(const ramcache_t *cache, bnum_t index)
+{
+    return (index * 0x9e3779b1u) & cache->hash_mask;
+}
+
+/* blocks held by a chunk, less than chunk_blocks only for the last one */
+static inline uint rc_chunk_blocks(const ramcache_t *cache, bnum_t index)
+{
+    bnum_t first = index << cache->chunk_shift;
+
+    return MIN(cache->chunk_blocks, cache->dev.block_count - first);
+}
+
+static inline uint32_t rc_block_mask(uint first, uint count)
+{
+    uint32_t mask = (count >= 32) ? ~0u : (1u << count) - 1;
+
+    return mask << first;
+}
+
+static struct rc_chunk *rc_find(ramcache_t *cache, bnum_t index)
+{
+    struct rc_chunk *chunk;
+    list_for_every_entry(&cache->hash[rc_hash(cache, index)], chunk, struct rc_chunk, hash) {
+        if (chunk->index == index)
+            return chunk;
+    }
+
+    return NULL;
+}
+
+static void rc_touch(ramcache_t *cache, struct rc_chunk *chunk)
+{
+    list_delete(&chunk->lru);
+    list_add_head(&cache->lru, &chunk->lru);
+}
+
+static void rc_invalidate(ramcache_t *cache, struct rc_chunk *chunk)
+{
+    if (chunk->index != INVALID_CHUNK)
+        list_delete(&chunk->hash);
+
+    chunk->index = INVALID_CHUNK;
+    chunk->dirty = 0;
+
+    list_delete(&chunk->lru);
+    list_add_tail(&cache->lru, &chunk->lru);
+}
+
+/* write the dirty runs of a chunk back to the device */
+static status_t rc_flush_chunk(ramcache_t *cache, struct rc_chunk *chunk)
+{
+    bdev_t *parent = cache->parent;
+
+    while (chunk->dirty) {
+        uint first = __builtin_ctz(chunk->dirty);
+        uint count = 0;
+        while (first + count < 32 && (chunk->dirty & (1u << (first + count))))
+            count++;
+
+        size_t len = (size_t)count << parent->block_shift;
+        ssize_t err = bio_write_block(parent, chunk->buf + ((size_t)first << parent->block_shift),
+                                      (chunk->index << cache->chunk_shift) + first, count);
+        if (err < 0)
+            return err;
+        if ((size_t)err != len)
+            return ERR_IO;
+
+        chunk->dirty &= ~rc_block_mask(first, count);
+        cache->stats.writebacks++;
+    }
+
+    return NO_ERROR;
+}
+
+static status_t rc_flush_all(ramcache_t *cache)
+{
+    status_t result = NO_ERROR;
+
+    for (uint i = 0; i < cache->chunk_count; i++) {
+        status_t err = rc_flush_chunk(cache, &cache->chunks[i]);
+        if (err < 0)
+            result = err;
+    }
+
+    return result;
+}
+
+/* recycle the least recently used chunk to hold index, without reading it in */
+static status_t rc_alloc(ramcache_t *cache, bnum_t index, struct rc_chunk **out)
+{
+    struct rc_chunk *chunk = list_peek_tail_type(&cache->lru, struct rc_chunk, lru);
+
+    status_t err = rc_flush_chunk(cache, chunk);
+    if (err < 0)
+        return err;
+
+    if (chunk->index != INVALID_CHUNK) {
+        list_delete(&chunk->hash);
+        cache->stats.evictions++;
+    }
+
+    chunk->index = index;
+    list_add_head(&cache->hash[rc_hash(cache, index)], &chunk->hash);
+    rc_touch(cache, chunk);
+
+    *out = chunk;
+    return NO_ERROR;
+}
+
+/* read in up to count chunks starting at index, stopping at the end of the
+ * device or the next chunk already cached. returns the number of chunks read */
+static ssize_t rc_fill(ramcache_t *cache, bnum_t index, uint count)
+{
+    bdev_t *parent = cache->parent;
+    bnum_t chunk_total = ((cache->dev.block_count - 1) >> cache->chunk_shift) + 1;
+    struct rc_chunk *chunks[MAX_FILL];
+    iovec_t iov[MAX_FILL];
+    size_t expected = 0;
+    ssize_t err;
+    uint n;
+
+    count = MIN(count, MAX_FILL);
+    count = MIN(count, MAX(cache->chunk_count / 2, 1u));
+    count = MIN(count, chunk_total - index);
+
+    for (n = 0; n < count; n++) {
+        if (n > 0 && rc_find(cache, index + n))
+            break;
+
+        err = rc_alloc(cache, index + n, &chunks[n]);
+        if (err < 0) {
+            count = n;
+            goto fail;
+        }
+
+        iov[n].iov_base = chunks[n]->buf;
+        iov[n].iov_len = (size_t)rc_chunk_blocks(cache, index + n) << parent->block_shift;
+        expected += iov[n].iov_len;
+    }
+    count = n;
+
+    LTRACEF("index %u count %u\n", index, count);
+
+    err = bio_readv(parent, iov, count, (off_t)(index << cache->chunk_shift) << parent->block_shift);
+    if (err >= 0 && (size_t)err != expected)
+        err = ERR_IO;
+    if (err < 0)
+        goto fail;
+
+    cache->stats.misses++;
+    cache->next_seq = index + count;
+
+    return count;
+
+fail:
+    for (uint i = 0; i < count; i++)
+        rc_invalidate(cache, chunks[i]);
+    return err;
+}
+
+static ssize_t rc_read_block(struct bdev *_dev, void *_buf, bnum_t block, uint count)
+{
+    ramcache_t *cache = (ramcache_t *)_dev;
+    uint8_t *buf = (uint8_t *)_buf;
+    size_t bytes = (size_t)count << _dev->block_shift;
+    ssize_t err = NO_ERROR;
+
+    mutex_acquire(&cache->lock);
+
+    while (count > 0) {
+        bnum_t index = block >> cache->chunk_shift;
+        uint first = block & (cache->chunk_blocks - 1);
+        uint n = MIN(count, rc_chunk_blocks(cache, index) - first);
+
+        struct rc_chunk *chunk = rc_find(cache, index);
+        if (chunk) {
+            cache->stats.hits++;
+        } else {
+            /* everything left of the request, plus some more if this carries on from the last miss */
+            uint want = ((block + count - 1) >> cache->chunk_shift) - index + 1;
+            uint ahead = (index == cache->next_seq) ? BIO_RAMCACHE_READAHEAD : 0;
+
+            err = rc_fill(cache, index, want + ahead);
+            if (err < 0)
+                break;
+            if ((uint)err > want)
+                cache->stats.readahead += err - want;
+
+            chunk = rc_find(cache, index);
+            DEBUG_ASSERT(chunk);
+        }
+
+        memcpy(buf, chunk->buf + ((size_t)first << _dev->block_shift), (size_t)n << _dev->block_shift);
+        rc_touch(cache, chunk);
+
+        buf += (size_t)n << _dev->block_shift;
+        block += n;
+        count -= n;
+    }
+
+    mutex_release(&cache->lock);
+
+    return (err < 0) ? err : (ssize_t)bytes;
+}
+
+static ssize_t rc_write_block(struct bdev *_dev, const void *_buf, bnum_t block, uint count)
+{
+    ramcache_t *cache = (ramcache_t *)_dev;
+    const uint8_t *buf = (const uint8_t *)_buf;
+    size_t bytes = (size_t)count << _dev->block_shift;
+    bool write_through = cache->flags & BIO_RAMCACHE_WRITE_THROUGH;
+    ssize_t err = NO_ERROR;
+
+    mutex_acquire(&cache->lock);
+
+    if (write_through) {
+        err = bio_write_block(cache->parent, buf, block, count);
+        if (err >= 0 && (size_t)err != bytes)
+            err = ERR_IO;
+        if (err < 0)
+            goto out;
+    }
+
+    while (count > 0) {
+        bnum_t index = block >> cache->chunk_shift;
+        uint first = block & (cache->chunk_blocks - 1);
+        uint n = MIN(count, rc_chunk_blocks(cache, index) - first);
+        bool whole = (first == 0 && n == rc_chunk_blocks(cache, index));
+
+        struct rc_chunk *chunk = rc_find(cache, index);
+        if (chunk) {
+            cache->stats.hits++;
+        } else if (whole) {
+            /* nothing of the old contents survives, don't read it in */
+            err = rc_alloc(cache, index, &chunk);
+        } else if (!write_through) {
+            err = rc_fill(cache, index, 1);
+            if (err >= 0)
+                chunk = rc_find(cache, index);
+        }
+        if (err < 0)
+            break;
+
+        /* partial chunks that aren't cached need nothing more when writing through */
+        if (chunk) {
+            memcpy(chunk->buf + ((size_t)first << _dev->block_shift), buf, (size_t)n << _dev->block_shift);
+            if (!write_through)
+                chunk->dirty |= rc_block_mask(first, n);
+            rc_touch(cache, chunk);
+        }
+
+        buf += (size_t)n << _dev->block_shift;
+        block += n;
+        count -= n;
+    }
+
+out:
+    mutex_release(&cache->lock);
+
+    return (err < 0) ? err : (ssize_t)bytes;
+}
+
+static ssize_t rc_erase(struct bdev *_dev, off_t offset, size_t len)
+{
+    ramcache_t *cache = (ramcache_t *)_dev;
+    size_t chunk_size = (size_t)cache->chunk_blocks << _dev->block_shift;
+    ssize_t err = NO_ERROR;
+
+    mutex_acquire(&cache->lock);
+
+    /* whatever the erase touches is dropped, written back first so the parts
+     * of a chunk outside of the range aren't lost */
+    for (uint i = 0; i < cache->chunk_count; i++) {
+        struct rc_chunk *chunk = &cache->chunks[i];
+
+        if (chunk->index == INVALID_CHUNK ||
+                !bio_does_overlap((uint64_t)chunk->index * chunk_size, chunk_size, offset, len))
+            continue;
+
+        err = rc_flush_chunk(cache, chunk);
+        if (err < 0)
+            goto out;
+
+        rc_invalidate(cache, chunk);
+    }
+
+    err = bio_erase(cache->parent, offset, len);
+
+out:
+    mutex_release(&cache->lock);
+
+    return err;
+}
+
+static int rc_ioctl(struct bdev *_dev, int request, void *argp)
+{
+    ramcache_t *cache = (ramcache_t *)_dev;
+
+    mutex_acquire(&cache->lock);
+    status_t err = rc_flush_all(cache);
+    mutex_release(&cache->lock);
+
+    if (err < 0 || request == BIO_IOCTL_FLUSH)
+        return err;
+
+    /* anything else sees the device directly, which is now up to date */
+    return bio_ioctl(cache->parent, request, argp);
+}
+
+static void rc_close(struct bdev *_dev)
+{
+    ramcache_t *cache = (ramcache_t *)_dev;
+
+    status_t err = rc_flush_all(cache);
+    if (err < 0)
+        TRACEF("error %d writing back cache of \"%s\"\n", err, cache->parent->name);
+
+    mutex_destroy(&cache->lock);
+    free(cache->bufs);
+    free(cache->hash);
+
+    bio_close(cache->parent);
+    cache->parent = NULL;
+}
+
+status_t bio_ramcache_get_stats(bdev_t *dev, bio_ramcache_stats_t *stats)
+{
+    if (dev->read_block != &rc_read_block)
+        return ERR_NOT_SUPPORTED;
+
+    ramcache_t *cache = (ramcache_t *)dev;
+
+    mutex_acquire(&cache->lock);
+    *stats = cache->stats;
+    mutex_release(&cache->lock);
+
+    return NO_ERROR;
+}
+
+#define BAIL(__err) do { err = __err; goto bailout; } while (0)
+status_t bio_publish_ramcache(const char *parent_dev, const char *name, size_t size, uint flags)
+{
+    status_t err = NO_ERROR;
+    bdev_t *parent = NULL;
+    ramcache_t *cache = NULL;
+
+    LTRACEF("parent \"%s\", name \"%s\", size %zu, flags 0x%x\n", parent_dev, name, size, flags);
+
+    parent = bio_open(parent_dev);
+    if (!parent)
+        BAIL(ERR_NOT_FOUND);
+
+    /* chunks are at least a block but hold no more than 32 of them */
+    uint chunk_blocks = MAX(BIO_RAMCACHE_CHUNK_SIZE >> parent->block_shift, 1u);
+    chunk_blocks = MIN(round_up_pow2_u32(chunk_blocks), 32u);
+    size_t chunk_size = (size_t)chunk_blocks << parent->block_shift;
+
+    uint chunk_count = size / chunk_size;
+    if (chunk_count < 2)
+        BAIL(ERR_INVALID_ARGS);
+
+    cache = calloc(1, sizeof(ramcache_t) + chunk_count * sizeof(struct rc_chunk));
+    if (!cache)
+        BAIL(ERR_NO_MEMORY);
+
+    cache->parent = parent;
+    cache->flags = flags;
+    cache->chunk_blocks = chunk_blocks;
+    cache->chunk_shift = log2_uint(chunk_blocks);
+    cache->chunk_count = chunk_count;
+    cache->chunks = (struct rc_chunk *)(cache + 1);
+    cache->hash_mask = round_up_pow2_u32(chunk_count) - 1;
+    cache->bufs = memalign(CACHE_LINE, chunk_count * chunk_size);
+    cache->hash = malloc((cache->hash_mask + 1) * sizeof(struct list_node));
+    if (!cache->bufs || !cache->hash)
+        BAIL(ERR_NO_MEMORY);
+
+    mutex_init(&cache->lock);
+    list_initialize(&cache->lru);
+    for (uint i = 0; i <= cache->hash_mask; i++)
+        list_initialize(&cache->hash[i]);
+
+    for (uint i = 0; i < chunk_count; i++) {
+        struct rc_chunk *chunk = &cache->chunks[i];
+
+        chunk->index = INVALID_CHUNK;
+        chunk->buf = cache->bufs + i * chunk_size;
+        list_add_tail(&cache->lru, &chunk->lru);
+    }
+
+    bio_initialize_bdev(&cache->dev, name,
+                        parent->block_size, parent->block_count,
+                        parent->geometry_count, parent->geometry, BIO_FLAGS_NONE);
+
+    cache->dev.erase_byte = parent->erase_byte;
+    cache->dev.io_align = parent->io_align;
+    cache->dev.io_align_offset = parent->io_align_offset;
+
+    /* the default byte hooks deblock on top of ours */
+    cache->dev.read_block = &rc_read_block;
+    cache->dev.write_block = &rc_write_block;
+    cache->dev.erase = &rc_erase;
+    cache->dev.ioctl = &rc_ioctl;
+    cache->dev.close = &rc_close;
+
+    bio_register_device(&cache->dev);
+
+bailout:
+    if (err < 0) {
+        if (NULL != parent)
+            bio_close(parent);
+        if (cache) {
+            free(cache->bufs);
+            free(cache->hash);
+            free(cache);
+        }
+    }
+
+    return err;
+}
+#undef BAIL
@@ -4,8 +4,11 @@ MODULE := $(LOCAL_DIR)
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/bio.c \
+	$(LOCAL_DIR)/cache.c \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/mem.c \
+	$(LOCAL_DIR)/ramcache.c \
+	$(LOCAL_DIR)/sched.c \
 	$(LOCAL_DIR)/subdev.c 
 
 include make/module.mk
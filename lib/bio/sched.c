@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Elevator style request scheduler for slow block devices.
+ *
+ * Queued requests are kept sorted by starting block. A worker thread picks
+ * the next request in ascending block order from where the last batch ended,
+ * wrapping around at the end (C-LOOK), unless the oldest queued request has
+ * waited longer than the deadline, in which case it goes next. Requests in
+ * the same direction that continue the picked one's block range are merged
+ * with it and handed to the driver as a single request, and the driver is
+ * given one batch at a time.
+ */
+#include <debug.h>
+#include <trace.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <list.h>
+#include <kernel/thread.h>
+#include <kernel/mutex.h>
+#include <kernel/event.h>
+#include <platform.h>
+#include <lib/bio.h>
+
+#include "bio_priv.h"
+
+#define LOCAL_TRACE 0
+
+/* limits on the size of a merged batch */
+#define BIO_SCHED_MAX_MERGE 16
+#define BIO_SCHED_MAX_IOVS  32
+
+struct bio_sched {
+    bdev_t *dev;
+    lk_time_t deadline;
+
+    mutex_t lock;
+    struct list_node queue; /* queued requests, sorted by starting block */
+    event_t event;          /* signaled while the queue is not empty or on shutdown */
+    bool stop;
+
+    /* block after the end of the last batch handed to the driver */
+    bnum_t head;
+
+    thread_t *thread;
+
+    bio_sched_stats_t stats;
+};
+
+status_t bio_sched_queue(struct bio_sched *sched, bio_request_t *req)
+{
+    LTRACEF("sched %p, req %p, block %u, count %u\n", sched, req, req->block, req->count);
+
+    req->queued = current_time();
+
+    mutex_acquire(&sched->lock);
+
+    /* keep requests that start on the same block in submission order. if the
+     * walk runs off the end, entry->node is the list head and this appends. */
+    bio_request_t *entry;
+    list_for_every_entry(&sched->queue, entry, bio_request_t, node) {
+        if (entry->block > req->block)
+            break;
+    }
+    list_add_before(&entry->node, &req->node);
+
+    sched->stats.requests++;
+    sched->stats.depth++;
+    if (sched->stats.depth > sched->stats.max_depth)
+        sched->stats.max_depth = sched->stats.depth;
+
+    event_signal(&sched->event, false);
+
+    mutex_release(&sched->lock);
+
+    return NO_ERROR;
+}
+
+/* can another request going the same direction join a batch of this size */
+static bool bio_sched_can_merge(const bio_request_t *req, bool write, uint merged, uint iov_cnt)
+{
+    return req->write == write &&
+           merged < BIO_SCHED_MAX_MERGE &&
+           iov_cnt + req->iov_cnt <= BIO_SCHED_MAX_IOVS;
+}
+
+/* move the next batch of requests off the queue and onto batch. sched->lock must be held. */
+static void bio_sched_pick_batch(struct bio_sched *sched, struct list_node *batch)
+{
+    bio_request_t *req = NULL;
+    bio_request_t *entry;
+
+    /* a request that has waited past the deadline goes first */
+    bio_request_t *oldest = NULL;
+    list_for_every_entry(&sched->queue, entry, bio_request_t, node) {
+        if (!oldest || TIME_LT(entry->queued, oldest->queued))
+            oldest = entry;
+    }
+    if (TIME_GTE(current_time(), oldest->queued + sched->deadline)) {
+        req = oldest;
+        sched->stats.expired++;
+    } else {
+        /* otherwise the next one up from the end of the last batch, wrapping around */
+        list_for_every_entry(&sched->queue, entry, bio_request_t, node) {
+            if (entry->block >= sched->head) {
+                req = entry;
+                break;
+            }
+        }
+        if (!req)
+            req = list_peek_head_type(&sched->queue, bio_request_t, node);
+    }
+
+    /* extend the batch backwards over requests that end where it starts */
+    bool write = req->write;
+    uint merged = 1;
+    uint iov_cnt = req->iov_cnt;
+    bio_request_t *start = req;
+    for (;;) {
+        bio_request_t *prev = list_prev_type(&sched->queue, &start->node, bio_request_t, node);
+        if (!prev || prev->block + prev->count != start->block ||
+                !bio_sched_can_merge(prev, write, merged, iov_cnt))
+            break;
+        start = prev;
+        merged++;
+        iov_cnt += prev->iov_cnt;
+    }
+
+    /* and forwards over requests that start where it ends */
+    bnum_t end = req->block + req->count;
+    for (;;) {
+        bio_request_t *next = list_next_type(&sched->queue, &req->node, bio_request_t, node);
+        if (!next || next->block != end ||
+                !bio_sched_can_merge(next, write, merged, iov_cnt))
+            break;
+        req = next;
+        end += next->count;
+        merged++;
+        iov_cnt += next->iov_cnt;
+    }
+
+    /* move them over in block order */
+    for (;;) {
+        bio_request_t *next = list_next_type(&sched->queue, &start->node, bio_request_t, node);
+        list_delete(&start->node);
+        list_add_tail(batch, &start->node);
+        if (start == req)
+            break;
+        start = next;
+    }
+
+    sched->head = end;
+    sched->stats.depth -= merged;
+    sched->stats.batches++;
+    sched->stats.merged += merged - 1;
+}
+
+/* hand a batch to the driver as one request, wait for it and complete its members */
+static void bio_sched_run_batch(struct bio_sched *sched, struct list_node *batch)
+{
+    bdev_t *dev = sched->dev;
+    iovec_t iov[BIO_SCHED_MAX_IOVS];
+    uint iov_cnt = 0;
+
+    bio_request_t *first = list_peek_head_type(batch, bio_request_t, node);
+    bio_request_t parent = {
+        .write = first->write,
+        .block = first->block,
+        .iov = iov,
+    };
+
+    /* gather the members' buffers, trimmed to their block counts, merging
+     * pieces that happen to be contiguous in memory */
+    bio_request_t *req;
+    list_for_every_entry(batch, req, bio_request_t, node) {
+        size_t remaining = (size_t)req->count << dev->block_shift;
+
+        for (uint i = 0; i < req->iov_cnt && remaining > 0; i++) {
+            size_t len = MIN(req->iov[i].iov_len, remaining);
+
+            if (iov_cnt > 0 &&
+                    (uint8_t *)iov[iov_cnt - 1].iov_base + iov[iov_cnt - 1].iov_len == req->iov[i].iov_base) {
+                iov[iov_cnt - 1].iov_len += len;
+            } else {
+                DEBUG_ASSERT(iov_cnt < BIO_SCHED_MAX_IOVS);
+                iov[iov_cnt].iov_base = req->iov[i].iov_base;
+                iov[iov_cnt].iov_len = len;
+                iov_cnt++;
+            }
+            remaining -= len;
+        }
+        parent.count += req->count;
+    }
+    parent.iov_cnt = iov_cnt;
+
+    LTRACEF("batch %s block %u, count %u, iov_cnt %u\n",
+            parent.write ? "write" : "read", parent.block, parent.count, parent.iov_cnt);
+
+    event_init(&parent.done, false, 0);
+    ssize_t result = bio_dispatch(dev, &parent);
+    if (result >= 0)
+        result = bio_request_wait(&parent);
+    else
+        event_destroy(&parent.done);
+
+    sched->stats.blocks += parent.count;
+
+    /* hand each member its share of the result */
+    while ((req = list_remove_head_type(batch, bio_request_t, node))) {
+        ssize_t bytes = (ssize_t)req->count << dev->block_shift;
+
+        if (result < 0) {
+            bio_request_complete(req, result);
+        } else {
+            bytes = MIN(bytes, result);
+            result -= bytes;
+            bio_request_complete(req, bytes);
+        }
+    }
+}
+
+static int bio_sched_thread(void *arg)
+{
+    struct bio_sched *sched = arg;
+
+    for (;;) {
+        event_wait(&sched->event);
+
+        mutex_acquire(&sched->lock);
+        if (list_is_empty(&sched->queue)) {
+            if (sched->stop) {
+                mutex_release(&sched->lock);
+                break;
+            }
+            event_unsignal(&sched->event);
+            mutex_release(&sched->lock);
+            continue;
+        }
+
+        struct list_node batch = LIST_INITIAL_VALUE(batch);
+        bio_sched_pick_batch(sched, &batch);
+        mutex_release(&sched->lock);
+
+        bio_sched_run_batch(sched, &batch);
+    }
+
+    return 0;
+}
+
+status_t bio_sched_attach(bdev_t *dev, lk_time_t deadline)
+{
+    DEBUG_ASSERT(dev);
+
+    LTRACEF("dev '%s', deadline %u\n", dev->name, deadline);
+
+    if (dev->sched)
+        return ERR_ALREADY_EXISTS;
+
+    struct bio_sched *sched = calloc(1, sizeof(struct bio_sched));
+    if (!sched)
+        return ERR_NO_MEMORY;
+
+    sched->dev = dev;
+    sched->deadline = deadline;
+    mutex_init(&sched->lock);
+    list_initialize(&sched->queue);
+    event_init(&sched->event, false, 0);
+
+    char name[32];
+    snprintf(name, sizeof(name), "bio sched %s", dev->name);
+    sched->thread = thread_create(name, &bio_sched_thread, sched, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!sched->thread) {
+        event_destroy(&sched->event);
+        mutex_destroy(&sched->lock);
+        free(sched);
+        return ERR_NO_MEMORY;
+    }
+
+    dev->sched = sched;
+    thread_resume(sched->thread);
+
+    return NO_ERROR;
+}
+
+/* must not race with new requests being submitted to the device */
+void bio_sched_detach(bdev_t *dev)
+{
+    DEBUG_ASSERT(dev);
+
+    struct bio_sched *sched = dev->sched;
+    if (!sched)
+        return;
+
+    LTRACEF("dev '%s'\n", dev->name);
+
+    /* new requests go straight to the driver, the worker drains what is left */
+    dev->sched = NULL;
+
+    mutex_acquire(&sched->lock);
+    sched->stop = true;
+    event_signal(&sched->event, false);
+    mutex_release(&sched->lock);
+
+    thread_join(sched->thread, NULL, INFINITE_TIME);
+
+    event_destroy(&sched->event);
+    mutex_destroy(&sched->lock);
+    free(sched);
+}
+
+status_t bio_sched_get_stats(bdev_t *dev, bio_sched_stats_t *stats)
+{
+    DEBUG_ASSERT(dev);
+    DEBUG_ASSERT(stats);
+
+    struct bio_sched *sched = dev->sched;
+    if (!sched)
+        return ERR_NOT_FOUND;
+
+    mutex_acquire(&sched->lock);
+    *stats = sched->stats;
+    mutex_release(&sched->lock);
+
+    return NO_ERROR;
+}
+
+void bio_sched_reset_stats(bdev_t *dev)
+{
+    DEBUG_ASSERT(dev);
+
+    struct bio_sched *sched = dev->sched;
+    if (!sched)
+        return;
+
+    mutex_acquire(&sched->lock);
+    uint32_t depth = sched->stats.depth;
+    memset(&sched->stats, 0, sizeof(sched->stats));
+    sched->stats.depth = depth;
+    sched->stats.max_depth = depth;
+    mutex_release(&sched->lock);
+}
@@ -26,6 +26,8 @@
 #include <stdlib.h>
 #include <lib/bio.h>
 
+#include "bio_priv.h"
+
 #define LOCAL_TRACE 0
 
 typedef struct {
@@ -43,39 +45,112 @@ typedef struct {
     bnum_t offset;
 } subdev_t;
 
+/*
+ * Everything coming in here has already been range checked against the
+ * subdevice by the bio layer, and the subdevice lies entirely within its
+ * parent, so requests are translated once and handed straight to the
+ * parent's hooks instead of going back through bio_read() and friends.
+ * Only a parent with a scheduler attached is entered through the scheduler,
+ * so requests from all of its subdevices get sorted and merged together.
+ */
+
+static inline off_t subdev_byte_offset(const subdev_t *subdev, off_t offset)
+{
+    return offset + ((off_t)subdev->offset << subdev->dev.block_shift);
+}
+
+static inline bool subdev_is_aligned(const subdev_t *subdev, off_t offset, size_t len)
+{
+    return ((offset | len) & (subdev->dev.block_size - 1)) == 0;
+}
+
+static ssize_t subdev_block_io(subdev_t *subdev, void *buf, bnum_t block, uint count, bool write)
+{
+    bdev_t *parent = subdev->parent;
+
+    block += subdev->offset;
+
+    if (parent->sched)
+        return write ? bio_write_block(parent, buf, block, count) : bio_read_block(parent, buf, block, count);
+
+    return write ? parent->write_block(parent, buf, block, count) : parent->read_block(parent, buf, block, count);
+}
+
 static ssize_t subdev_read(struct bdev *_dev, void *buf, off_t offset, size_t len)
 {
     subdev_t *subdev = (subdev_t *)_dev;
 
-    return bio_read(subdev->parent, buf, offset + subdev->offset * subdev->dev.block_size, len);
+    /* whole blocks skip the parent's splitting and bounce buffering */
+    if (subdev_is_aligned(subdev, offset, len))
+        return subdev_block_io(subdev, buf, offset >> subdev->dev.block_shift, len >> subdev->dev.block_shift, false);
+
+    return subdev->parent->read(subdev->parent, buf, subdev_byte_offset(subdev, offset), len);
 }
 
 static ssize_t subdev_read_block(struct bdev *_dev, void *buf, bnum_t block, uint count)
 {
     subdev_t *subdev = (subdev_t *)_dev;
 
-    return bio_read_block(subdev->parent, buf, block + subdev->offset, count);
+    return subdev_block_io(subdev, buf, block, count, false);
 }
 
 static ssize_t subdev_write(struct bdev *_dev, const void *buf, off_t offset, size_t len)
 {
     subdev_t *subdev = (subdev_t *)_dev;
 
-    return bio_write(subdev->parent, buf, offset + subdev->offset * subdev->dev.block_size, len);
+    if (subdev_is_aligned(subdev, offset, len))
+        return subdev_block_io(subdev, (void *)buf, offset >> subdev->dev.block_shift, len >> subdev->dev.block_shift, true);
+
+    return subdev->parent->write(subdev->parent, buf, subdev_byte_offset(subdev, offset), len);
 }
 
 static ssize_t subdev_write_block(struct bdev *_dev, const void *buf, bnum_t block, uint count)
 {
     subdev_t *subdev = (subdev_t *)_dev;
 
-    return bio_write_block(subdev->parent, buf, block + subdev->offset, count);
+    return subdev_block_io(subdev, (void *)buf, block, count, true);
 }
 
 static ssize_t subdev_erase(struct bdev *_dev, off_t offset, size_t len)
 {
     subdev_t *subdev = (subdev_t *)_dev;
 
-    return bio_erase(subdev->parent, offset + subdev->offset * subdev->dev.block_size, len);
+    return subdev->parent->erase(subdev->parent, subdev_byte_offset(subdev, offset), len);
+}
+
+/* requests are already validated and trimmed by bio_submit() on the subdevice,
+ * move them into the parent's block space and pass them on as they are */
+static status_t subdev_submit(struct bdev *_dev, bio_request_t *req)
+{
+    subdev_t *subdev = (subdev_t *)_dev;
+    bdev_t *parent = subdev->parent;
+
+    req->block += subdev->offset;
+
+    if (parent->sched)
+        return bio_sched_queue(parent->sched, req);
+
+    return bio_dispatch(parent, req);
+}
+
+static int subdev_ioctl(struct bdev *_dev, int request, void *argp)
+{
+    subdev_t *subdev = (subdev_t *)_dev;
+
+    int err = bio_ioctl(subdev->parent, request, argp);
+    if (err < 0)
+        return err;
+
+    /* memory maps of the parent need to be moved up to where we start */
+    switch (request) {
+        case BIO_IOCTL_GET_MEM_MAP:
+        case BIO_IOCTL_GET_MAP_ADDR:
+            if (argp)
+                *(uint8_t **)argp += (off_t)subdev->offset * subdev->dev.block_size;
+            break;
+    }
+
+    return err;
 }
 
 static void subdev_close(struct bdev *_dev)
@@ -177,11 +252,19 @@ status_t bio_publish_subdevice(const char *parent_dev,
     sub->parent = parent;
     sub->offset = startblock;
 
+    /* carry the parent's alignment down, a partition that doesn't start on a
+     * boundary of the medium ends up with a nonzero offset into the granule */
+    sub->dev.io_align = parent->io_align;
+    sub->dev.io_align_offset = (parent->io_align_offset +
+                                ((uint64_t)startblock << parent->block_shift)) % parent->io_align;
+
     sub->dev.read = &subdev_read;
     sub->dev.read_block = &subdev_read_block;
     sub->dev.write = &subdev_write;
     sub->dev.write_block = &subdev_write_block;
     sub->dev.erase = &subdev_erase;
+    sub->dev.submit = &subdev_submit;
+    sub->dev.ioctl = &subdev_ioctl;
     sub->dev.close = &subdev_close;
 
     bio_register_device(&sub->dev);
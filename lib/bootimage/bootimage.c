@@ -23,22 +23,29 @@
 
 #include <lib/bootimage.h>
 #include <trace.h>
+#include <stdbool.h>
 #include <err.h>
 #include <debug.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <lib/bootimage_struct.h>
-#include <lib/mincrypt/sha256.h>
+#include <lib/checksum.h>
 
 #define LOCAL_TRACE 1
 
+/* entries that fit in the first page, and so in the verified mask */
+#define MAX_ENTRIES (4096 / sizeof(bootentry))
+
 struct bootimage {
     const uint8_t *ptr;
     size_t len;
+    uint64_t verified;  /* entries whose section hash has been checked */
 };
 
-static status_t validate_bootimage(bootimage_t *bi)
+/* check everything in the first page: the boot image entry and its hash, the
+ * boot info and the bounds of every section. trims bi->len to the image size. */
+static status_t validate_header(bootimage_t *bi)
 {
     if (!bi)
         return ERR_INVALID_ARGS;
@@ -62,11 +69,8 @@ static status_t validate_bootimage(bootimage_t *bi)
     }
 
     /* check the sha256 of the rest of the first page */
-    SHA256_CTX ctx;
-    SHA256_init(&ctx);
-
-    SHA256_update(&ctx, be + 1, 4096 - sizeof(bootentry));
-    const uint8_t *hash = SHA256_final(&ctx);
+    uint8_t hash[CHECKSUM_SHA256_SIZE];
+    checksum_sha256(be + 1, 4096 - sizeof(bootentry), hash);
 
     if (memcmp(hash, be->file.sha256, sizeof(be->file.sha256)) != 0) {
         LTRACEF("bad hash of first section\n");
@@ -124,19 +128,6 @@ static status_t validate_bootimage(bootimage_t *bi)
                     return ERR_INVALID_ARGS;
                 }
 
-                /* check the sha256 hash */
-                SHA256_init(&ctx);
-
-                LTRACEF("\tvalidating SHA256 hash\n");
-                SHA256_update(&ctx, (const uint8_t *)bi->ptr + be[i].file.offset, be[i].file.length);
-                const uint8_t *hash = SHA256_final(&ctx);
-
-                if (memcmp(hash, be[i].file.sha256, sizeof(be[i].file.sha256)) != 0) {
-                    LTRACEF("bad hash of file section\n");
-
-                    return ERR_CHECKSUM_FAIL;
-                }
-
                 break;
             }
             default:
@@ -145,6 +136,57 @@ static status_t validate_bootimage(bootimage_t *bi)
         }
     }
 
+    return NO_ERROR;
+}
+
+static status_t check_file_hash(const bootentry *be, const uint8_t *hash)
+{
+    if (memcmp(hash, be->file.sha256, sizeof(be->file.sha256)) != 0) {
+        LTRACEF("bad hash of file section\n");
+
+        return ERR_CHECKSUM_FAIL;
+    }
+
+    return NO_ERROR;
+}
+
+/* check the hash of file entry i, unless that has been done already */
+static status_t verify_section(bootimage_t *bi, size_t i)
+{
+    if (i < MAX_ENTRIES && (bi->verified & (1ULL << i)))
+        return NO_ERROR;
+
+    const bootentry *be = (const bootentry *)bi->ptr;
+
+    uint8_t hash[CHECKSUM_SHA256_SIZE];
+
+    LTRACEF("\tvalidating SHA256 hash of entry %zu\n", i);
+    checksum_sha256(bi->ptr + be[i].file.offset, be[i].file.length, hash);
+
+    status_t err = check_file_hash(&be[i], hash);
+    if (err >= 0 && i < MAX_ENTRIES)
+        bi->verified |= 1ULL << i;
+
+    return err;
+}
+
+status_t bootimage_verify(bootimage_t *bi)
+{
+    bootentry *be = (bootentry *)bi->ptr;
+    bootentry_info *info = &be[1].info;
+
+    /* check the sha256 hash of every file section */
+    for (size_t i = 2; i < info->entry_count; i++) {
+        if (be[i].kind == 0)
+            break;
+        if (be[i].kind != KIND_FILE)
+            continue;
+
+        status_t err = verify_section(bi, i);
+        if (err < 0)
+            return err;
+    }
+
     LTRACEF("image good\n");
     return NO_ERROR;
 }
@@ -163,8 +205,8 @@ status_t bootimage_open(const void *ptr, size_t len, bootimage_t **bi)
     (*bi)->ptr = ptr;
     (*bi)->len = len;
 
-    /* try to validate it */
-    status_t err = validate_bootimage(*bi);
+    /* validate the first page, sections are checked as they are asked for */
+    status_t err = validate_header(*bi);
     if (err < 0) {
         bootimage_close(*bi);
         return err;
@@ -210,6 +252,10 @@ status_t bootimage_get_file_section(bootimage_t *bi, uint32_t type, const void *
             continue;
 
         if (type == be[i].file.type) {
+            status_t err = verify_section(bi, i);
+            if (err < 0)
+                return err;
+
             if (ptr)
                 *ptr = bi->ptr + be[i].file.offset;
             if (len)
@@ -221,3 +267,118 @@ status_t bootimage_get_file_section(bootimage_t *bi, uint32_t type, const void *
     return ERR_NOT_FOUND;
 }
 
+
+struct bootimage_stream {
+    bootimage_t bi;
+    status_t err;
+    bool header_ok;
+    size_t hashed;          /* bytes of the image fed to the section hashes */
+    size_t entry_count;
+    checksum_sha256_ctx_t *ctx; /* one per entry, only used for file sections */
+};
+
+status_t bootimage_stream_begin(const void *ptr, size_t len, bootimage_stream_t **bs)
+{
+    LTRACEF("ptr %p, len %zu\n", ptr, len);
+
+    *bs = calloc(1, sizeof(bootimage_stream_t));
+    if (!*bs)
+        return ERR_NO_MEMORY;
+
+    (*bs)->bi.ptr = ptr;
+    (*bs)->bi.len = len;
+    (*bs)->err = len < 4096 ? ERR_BAD_LEN : NO_ERROR;
+
+    return NO_ERROR;
+}
+
+void bootimage_stream_update(bootimage_stream_t *bs, size_t received)
+{
+    if (bs->err < 0)
+        return;
+
+    if (!bs->header_ok) {
+        if (received < 4096)
+            return;
+
+        status_t err = validate_header(&bs->bi);
+        if (err < 0) {
+            bs->err = err;
+            return;
+        }
+
+        bootentry *be = (bootentry *)bs->bi.ptr;
+        bs->entry_count = MIN(be[1].info.entry_count, 4096 / sizeof(bootentry));
+        bs->ctx = malloc(bs->entry_count * sizeof(checksum_sha256_ctx_t));
+        if (!bs->ctx) {
+            bs->err = ERR_NO_MEMORY;
+            return;
+        }
+        for (size_t i = 2; i < bs->entry_count; i++)
+            checksum_sha256_init(&bs->ctx[i]);
+
+        bs->header_ok = true;
+    }
+
+    received = MIN(received, bs->bi.len);
+    if (received <= bs->hashed)
+        return;
+
+    /* feed each section the part of [hashed, received) that falls inside it */
+    const bootentry *be = (const bootentry *)bs->bi.ptr;
+    for (size_t i = 2; i < bs->entry_count; i++) {
+        if (be[i].kind == 0)
+            break;
+        if (be[i].kind != KIND_FILE)
+            continue;
+
+        size_t start = MAX(bs->hashed, (size_t)be[i].file.offset);
+        size_t end = MIN(received, (size_t)be[i].file.offset + be[i].file.length);
+        if (start < end)
+            checksum_sha256_update(&bs->ctx[i], bs->bi.ptr + start, end - start);
+    }
+    bs->hashed = received;
+}
+
+status_t bootimage_stream_finish(bootimage_stream_t *bs, bootimage_t **bi)
+{
+    status_t err = bs->err;
+
+    if (err >= 0 && (!bs->header_ok || bs->hashed < bs->bi.len)) {
+        LTRACEF("image incomplete\n");
+        err = ERR_BAD_LEN;
+    }
+
+    if (err >= 0) {
+        const bootentry *be = (const bootentry *)bs->bi.ptr;
+        for (size_t i = 2; i < bs->entry_count; i++) {
+            if (be[i].kind == 0)
+                break;
+            if (be[i].kind != KIND_FILE)
+                continue;
+
+            uint8_t hash[CHECKSUM_SHA256_SIZE];
+            checksum_sha256_final(&bs->ctx[i], hash);
+            err = check_file_hash(&be[i], hash);
+            if (err < 0)
+                break;
+            if (i < MAX_ENTRIES)
+                bs->bi.verified |= 1ULL << i;
+        }
+    }
+
+    if (err >= 0) {
+        *bi = calloc(1, sizeof(bootimage_t));
+        if (*bi) {
+            **bi = bs->bi;
+            LTRACEF("image good\n");
+        } else {
+            err = ERR_NO_MEMORY;
+        }
+    }
+
+    free(bs->ctx);
+    free(bs);
+
+    return err;
+}
@@ -28,10 +28,30 @@
 
 typedef struct bootimage bootimage_t;
 
+/* open a bootimage at ptr. only the first page is validated here, the hash of
+ * each file section is checked the first time it is asked for with
+ * bootimage_get_file_section(), so sections that are never used cost nothing. */
 status_t bootimage_open(const void *ptr, size_t len, bootimage_t **bi) __NONNULL();
 status_t bootimage_close(bootimage_t *bi) __NONNULL();
 status_t bootimage_get_range(bootimage_t *bi, const void **ptr, size_t *len) __NONNULL((1));
 
-/* ask for a file section of the bootimage, by type */
+/* check the hashes of all file sections now */
+status_t bootimage_verify(bootimage_t *bi) __NONNULL();
+
+/* ask for a file section of the bootimage, by type. returns ERR_CHECKSUM_FAIL
+ * if the section doesn't match its hash. */
 status_t bootimage_get_file_section(bootimage_t *bi, uint32_t type, const void **ptr, size_t *len) __NONNULL((1));
 
+/* validate a bootimage while it is being received into the len bytes at ptr,
+ * so the section hashes are computed as the data arrives instead of in a
+ * separate pass at the end. call bootimage_stream_update() with the number of
+ * bytes received so far, in order, and bootimage_stream_finish() at the end.
+ * finish fails where bootimage_open() followed by bootimage_verify() would,
+ * the bootimage it returns has every section verified already. it always
+ * frees bs. */
+typedef struct bootimage_stream bootimage_stream_t;
+
+status_t bootimage_stream_begin(const void *ptr, size_t len, bootimage_stream_t **bs) __NONNULL();
+void bootimage_stream_update(bootimage_stream_t *bs, size_t received) __NONNULL();
+status_t bootimage_stream_finish(bootimage_stream_t *bs, bootimage_t **bi) __NONNULL();
+
@@ -3,7 +3,7 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_DEPS := \
-    lib/mincrypt
+    lib/checksum
 
 MODULE_SRCS := \
 	$(LOCAL_DIR)/bootimage.c
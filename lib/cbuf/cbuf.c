@@ -35,12 +35,19 @@
 #define INC_POINTER(cbuf, ptr, inc) \
     modpow2(((ptr) + (inc)), (cbuf)->len_pow2)
 
+#define IS_SPSC(cbuf) ((cbuf)->flags & CBUF_FLAG_SPSC)
+
 void cbuf_initialize(cbuf_t *cbuf, size_t len)
 {
-    cbuf_initialize_etc(cbuf, len, malloc(len));
+    cbuf_initialize_flags(cbuf, len, NULL, 0);
 }
 
 void cbuf_initialize_etc(cbuf_t *cbuf, size_t len, void *buf)
+{
+    cbuf_initialize_flags(cbuf, len, buf, 0);
+}
+
+void cbuf_initialize_flags(cbuf_t *cbuf, size_t len, void *buf, uint flags)
 {
     DEBUG_ASSERT(cbuf);
     DEBUG_ASSERT(len > 0);
@@ -49,11 +56,117 @@ void cbuf_initialize_etc(cbuf_t *cbuf, size_t len, void *buf)
     cbuf->head = 0;
     cbuf->tail = 0;
     cbuf->len_pow2 = log2_uint(len);
-    cbuf->buf = buf;
+    cbuf->flags = flags;
+    cbuf->buf = buf ? buf : malloc(len);
     event_init(&cbuf->event, false, 0);
     spin_lock_init(&cbuf->lock);
 
-    LTRACEF("len %zd, len_pow2 %u\n", len, cbuf->len_pow2);
+    LTRACEF("len %zd, len_pow2 %u, flags %#x\n", len, cbuf->len_pow2, flags);
+}
+
+/* the two (possibly empty) contiguous regions of len bytes starting at pos */
+static void cbuf_regions(cbuf_t *cbuf, uint pos, size_t len, iovec_t *regions)
+{
+    size_t sz = cbuf_size(cbuf);
+
+    regions[0].iov_base = len ? (cbuf->buf + pos) : NULL;
+    if (pos + len > sz) {
+        regions[0].iov_len  = sz - pos;
+        regions[1].iov_base = cbuf->buf;
+        regions[1].iov_len  = len - regions[0].iov_len;
+    } else {
+        regions[0].iov_len  = len;
+        regions[1].iov_base = NULL;
+        regions[1].iov_len  = 0;
+    }
+}
+
+/*
+ * Lockless single producer, single consumer paths.
+ *
+ * The producer owns head, the consumer owns tail; each reads the other's index
+ * with acquire and publishes its own with release, so the bytes between them
+ * are always visible to whoever owns them. The event tracks "not empty" as
+ * best it can: the producer skips signaling if it already looks signaled and
+ * the consumer re-checks head after unsignaling, with a full fence between the
+ * index and the event on both sides so that at least one of them sees the
+ * other's update and a waiting reader cannot miss data.
+ */
+static void cbuf_spsc_publish(cbuf_t *cbuf, uint head)
+{
+    __atomic_store_n(&cbuf->head, head, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!cbuf->event.signaled)
+        event_signal(&cbuf->event, false);
+}
+
+static size_t cbuf_spsc_reserve(cbuf_t *cbuf, iovec_t *regions)
+{
+    uint head = cbuf->head;
+    uint tail = __atomic_load_n(&cbuf->tail, __ATOMIC_ACQUIRE);
+    size_t avail = valpow2(cbuf->len_pow2) - modpow2(head - tail, cbuf->len_pow2) - 1;
+
+    cbuf_regions(cbuf, head, avail, regions);
+    return avail;
+}
+
+static size_t cbuf_spsc_write(cbuf_t *cbuf, const char *buf, size_t len)
+{
+    iovec_t regions[2];
+    size_t avail = cbuf_spsc_reserve(cbuf, regions);
+
+    len = MIN(len, avail);
+    if (len == 0)
+        return 0;
+
+    size_t first = MIN(len, regions[0].iov_len);
+    if (buf) {
+        memcpy(regions[0].iov_base, buf, first);
+        if (len > first)
+            memcpy(regions[1].iov_base, buf + first, len - first);
+    } else {
+        memset(regions[0].iov_base, 0, first);
+        if (len > first)
+            memset(regions[1].iov_base, 0, len - first);
+    }
+
+    cbuf_spsc_publish(cbuf, INC_POINTER(cbuf, cbuf->head, len));
+    return len;
+}
+
+/* called by the consumer after emptying the buffer as far as it could see */
+static void cbuf_spsc_drained(cbuf_t *cbuf, uint tail)
+{
+    event_unsignal(&cbuf->event);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cbuf->head, __ATOMIC_ACQUIRE) != tail)
+        event_signal(&cbuf->event, false);
+}
+
+static size_t cbuf_spsc_read(cbuf_t *cbuf, char *buf, size_t buflen)
+{
+    uint tail = cbuf->tail;
+    uint head = __atomic_load_n(&cbuf->head, __ATOMIC_ACQUIRE);
+    size_t len = MIN(buflen, modpow2(head - tail, cbuf->len_pow2));
+
+    if (len > 0) {
+        iovec_t regions[2];
+        cbuf_regions(cbuf, tail, len, regions);
+
+        if (buf) {
+            memcpy(buf, regions[0].iov_base, regions[0].iov_len);
+            if (regions[1].iov_len)
+                memcpy(buf + regions[0].iov_len, regions[1].iov_base, regions[1].iov_len);
+        }
+
+        tail = INC_POINTER(cbuf, tail, len);
+        __atomic_store_n(&cbuf->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    if (tail == head)
+        cbuf_spsc_drained(cbuf, tail);
+
+    return len;
 }
 
 size_t cbuf_space_avail(cbuf_t *cbuf)
@@ -76,6 +189,13 @@ size_t cbuf_write(cbuf_t *cbuf, const void *_buf, size_t len, bool canreschedule
     DEBUG_ASSERT(cbuf);
     DEBUG_ASSERT(len < valpow2(cbuf->len_pow2));
 
+    if (IS_SPSC(cbuf)) {
+        size_t written = cbuf_spsc_write(cbuf, buf, len);
+        if (canreschedule)
+            thread_preempt();
+        return written;
+    }
+
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&cbuf->lock, state);
 
@@ -139,6 +259,13 @@ retry:
     if (block)
         event_wait(&cbuf->event);
 
+    if (IS_SPSC(cbuf)) {
+        size_t ret = cbuf_spsc_read(cbuf, buf, buflen);
+        if (block && ret == 0)
+            goto retry;
+        return ret;
+    }
+
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&cbuf->lock, state);
 
@@ -190,6 +317,15 @@ size_t cbuf_peek(cbuf_t *cbuf, iovec_t *regions)
 {
     DEBUG_ASSERT(cbuf && regions);
 
+    if (IS_SPSC(cbuf)) {
+        uint tail = cbuf->tail;
+        uint head = __atomic_load_n(&cbuf->head, __ATOMIC_ACQUIRE);
+        size_t ret = modpow2(head - tail, cbuf->len_pow2);
+
+        cbuf_regions(cbuf, tail, ret, regions);
+        return ret;
+    }
+
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&cbuf->lock, state);
 
@@ -199,25 +335,72 @@ size_t cbuf_peek(cbuf_t *cbuf, iovec_t *regions)
     DEBUG_ASSERT(cbuf->tail < sz);
     DEBUG_ASSERT(ret <= sz);
 
-    regions[0].iov_base = ret ? (cbuf->buf + cbuf->tail) : NULL;
-    if (ret + cbuf->tail > sz) {
-        regions[0].iov_len  = sz - cbuf->tail;
-        regions[1].iov_base = cbuf->buf;
-        regions[1].iov_len  = ret - regions[0].iov_len;
-    } else {
-        regions[0].iov_len  = ret;
-        regions[1].iov_base = NULL;
-        regions[1].iov_len  = 0;
-    }
+    cbuf_regions(cbuf, cbuf->tail, ret, regions);
 
     spin_unlock_irqrestore(&cbuf->lock, state);
     return ret;
 }
 
+size_t cbuf_write_reserve(cbuf_t *cbuf, iovec_t *regions)
+{
+    DEBUG_ASSERT(cbuf && regions);
+
+    if (IS_SPSC(cbuf))
+        return cbuf_spsc_reserve(cbuf, regions);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cbuf->lock, state);
+
+    size_t ret = cbuf_space_avail(cbuf);
+    cbuf_regions(cbuf, cbuf->head, ret, regions);
+
+    spin_unlock_irqrestore(&cbuf->lock, state);
+    return ret;
+}
+
+void cbuf_write_commit(cbuf_t *cbuf, size_t len, bool canreschedule)
+{
+    DEBUG_ASSERT(cbuf);
+
+    if (len == 0)
+        return;
+
+    if (IS_SPSC(cbuf)) {
+        DEBUG_ASSERT(len < cbuf_size(cbuf));
+        cbuf_spsc_publish(cbuf, INC_POINTER(cbuf, cbuf->head, len));
+    } else {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&cbuf->lock, state);
+
+        DEBUG_ASSERT(len <= cbuf_space_avail(cbuf));
+        cbuf->head = INC_POINTER(cbuf, cbuf->head, len);
+        event_signal(&cbuf->event, false);
+
+        spin_unlock_irqrestore(&cbuf->lock, state);
+    }
+
+    if (canreschedule)
+        thread_preempt();
+}
+
 size_t cbuf_write_char(cbuf_t *cbuf, char c, bool canreschedule)
 {
     DEBUG_ASSERT(cbuf);
 
+    if (IS_SPSC(cbuf)) {
+        uint head = cbuf->head;
+        uint tail = __atomic_load_n(&cbuf->tail, __ATOMIC_ACQUIRE);
+
+        if (INC_POINTER(cbuf, head, 1) == tail)
+            return 0;
+
+        cbuf->buf[head] = c;
+        cbuf_spsc_publish(cbuf, INC_POINTER(cbuf, head, 1));
+        if (canreschedule)
+            thread_preempt();
+        return 1;
+    }
+
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&cbuf->lock, state);
 
@@ -246,6 +429,13 @@ retry:
     if (block)
         event_wait(&cbuf->event);
 
+    if (IS_SPSC(cbuf)) {
+        size_t ret = cbuf_spsc_read(cbuf, c, 1);
+        if (block && ret == 0)
+            goto retry;
+        return ret;
+    }
+
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&cbuf->lock, state);
 
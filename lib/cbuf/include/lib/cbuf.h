@@ -34,11 +34,22 @@ typedef struct cbuf {
     uint head;
     uint tail;
     uint len_pow2;
+    uint flags;
     char *buf;
     event_t event;
     spin_lock_t lock;
 } cbuf_t;
 
+/*
+ * Single producer, single consumer mode. Writes and reads never take the lock
+ * or disable interrupts. The producer only moves head and the consumer only
+ * moves tail, passing data through acquire/release ordering on them. The
+ * caller guarantees at most one context writes and one context reads at a
+ * time, a typical case being a driver's irq handler filling the buffer for a
+ * single reader thread.
+ */
+#define CBUF_FLAG_SPSC 0x1
+
 /**
  * cbuf_initialize
  *
@@ -63,6 +74,19 @@ void cbuf_initialize(cbuf_t *cbuf, size_t len);
  */
 void cbuf_initialize_etc(cbuf_t *cbuf, size_t len, void *buf);
 
+/**
+ * cbuf_initialize_flags
+ *
+ * Initialize a cbuf structure with mode flags.
+ *
+ * @param[in] cbuf A pointer to the cbuf structure to allocate.
+ * @param[in] len The size of the buffer, in bytes.  Must be a power of two.
+ * @param[in] buf A pointer to the memory to be used for internal storage, or
+ * NULL to malloc it.
+ * @param[in] flags 0 or CBUF_FLAG_SPSC.
+ */
+void cbuf_initialize_flags(cbuf_t *cbuf, size_t len, void *buf, uint flags);
+
 /**
  * cbuf_read
  *
@@ -113,6 +137,35 @@ size_t cbuf_peek(cbuf_t *cbuf, iovec_t *regions);
  */
 size_t cbuf_write(cbuf_t *cbuf, const void *buf, size_t len, bool canreschedule);
 
+/**
+ * cbuf_write_reserve
+ *
+ * Zero copy write, for producers that fill the buffer directly, e.g. by DMA.
+ * Fills out a pair of iovec structures describing the (up to) two contiguous
+ * free regions at the write position. The producer stores into them and then
+ * makes the data visible with cbuf_write_commit(). Nothing else may write to
+ * the cbuf between the two calls.
+ *
+ * @param[in] cbuf The cbuf instance to write to.
+ * @param[out] regions A pointer to two iovec structures to hold the free
+ * regions, in the order they are to be filled.
+ *
+ * @return The total number of bytes that may be written.
+ */
+size_t cbuf_write_reserve(cbuf_t *cbuf, iovec_t *regions);
+
+/**
+ * cbuf_write_commit
+ *
+ * Publish len bytes stored into the regions returned by the last
+ * cbuf_write_reserve(), signaling readers.
+ *
+ * @param[in] cbuf The cbuf instance to write to.
+ * @param[in] len The number of bytes written, no more than was reserved.
+ * @param[in] canreschedule Rescheduling policy, as for cbuf_write().
+ */
+void cbuf_write_commit(cbuf_t *cbuf, size_t len, bool canreschedule);
+
 /**
  * cbuf_space_avail
  *
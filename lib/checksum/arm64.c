@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * armv8 crc32 and sha2 extension implementations, used when
+ * ID_AA64ISAR0_EL1 says the cpu has them.
+ */
+#include <lib/checksum.h>
+
+#include <arch/arm64.h>
+#include <trace.h>
+#include <arm_acle.h>
+#include <arm_neon.h>
+
+#define LOCAL_TRACE 0
+
+#define ISAR0_SHA2(r)   (((r) >> 12) & 0xf)
+#define ISAR0_CRC32(r)  (((r) >> 16) & 0xf)
+
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    crc = ~crc;
+
+    /* align to 8 bytes, then eat words */
+    while (len > 0 && ((uintptr_t)buf & 7)) {
+        crc = __crc32b(crc, *buf++);
+        len--;
+    }
+    for (; len >= 8; len -= 8, buf += 8)
+        crc = __crc32d(crc, *(const uint64_t *)buf);
+    for (; len > 0; len--)
+        crc = __crc32b(crc, *buf++);
+
+    return ~crc;
+}
+
+__attribute__((target("+crypto")))
+static void sha256_blocks_armv8(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    uint32x4_t state0 = vld1q_u32(&state[0]);
+    uint32x4_t state1 = vld1q_u32(&state[4]);
+
+    for (; blocks > 0; blocks--, data += 64) {
+        uint32x4_t abcd_save = state0;
+        uint32x4_t efgh_save = state1;
+        uint32x4_t msg[4];
+
+        for (uint i = 0; i < 16; i++) {
+            uint32x4_t m;
+            if (i < 4) {
+                m = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+            } else {
+                m = vsha256su0q_u32(msg[i & 3], msg[(i + 1) & 3]);
+                m = vsha256su1q_u32(m, msg[(i + 2) & 3], msg[(i + 3) & 3]);
+            }
+            msg[i & 3] = m;
+
+            uint32x4_t wk = vaddq_u32(m, vld1q_u32(&checksum_sha256_k[i * 4]));
+            uint32x4_t abcd = state0;
+            state0 = vsha256hq_u32(state0, state1, wk);
+            state1 = vsha256h2q_u32(state1, abcd, wk);
+        }
+
+        state0 = vaddq_u32(state0, abcd_save);
+        state1 = vaddq_u32(state1, efgh_save);
+    }
+
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+}
+
+void checksum_arch_init(struct checksum_ops *ops)
+{
+    uint64_t isar0 = ARM64_READ_SYSREG(id_aa64isar0_el1);
+
+    LTRACEF("id_aa64isar0_el1 0x%llx\n", isar0);
+
+    if (ISAR0_CRC32(isar0)) {
+        ops->crc32_name = "armv8 crc32";
+        ops->crc32 = crc32_armv8;
+        ops->crc32_uses_simd = false;
+    }
+    if (ISAR0_SHA2(isar0)) {
+        ops->sha256_name = "armv8 sha2";
+        ops->sha256_blocks = sha256_blocks_armv8;
+        ops->sha256_uses_simd = true;
+    }
+}
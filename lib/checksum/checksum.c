@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/checksum.h>
+
+#include <arch/ops.h>
+#include <debug.h>
+#include <err.h>
+#include <lk/init.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <platform.h>
+#include <lib/cksum.h>
+#include <lib/console.h>
+
+#define LOCAL_TRACE 0
+
+static struct checksum_ops ops = {
+    .crc32_name = "software",
+    .crc32 = checksum_crc32_soft,
+    .sha256_name = "software",
+    .sha256_blocks = checksum_sha256_blocks_soft,
+};
+
+uint32_t checksum_crc32_soft(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    /* lib/cksum takes an unsigned int length */
+    while (len > 0) {
+        unsigned int chunk = MIN(len, 0x40000000u);
+        crc = crc32(crc, buf, chunk);
+        buf += chunk;
+        len -= chunk;
+    }
+    return crc;
+}
+
+uint32_t checksum_crc32(uint32_t crc, const void *buf, size_t len)
+{
+    if (ops.crc32_uses_simd && arch_ints_disabled())
+        return checksum_crc32_soft(crc, buf, len);
+
+    return ops.crc32(crc, buf, len);
+}
+
+const uint32_t checksum_sha256_k[64] __ALIGNED(16) = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t ror32(uint32_t x, uint n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+void checksum_sha256_blocks_soft(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    for (; blocks > 0; blocks--, data += 64) {
+        uint32_t w[64];
+
+        for (uint i = 0; i < 16; i++) {
+            w[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[i * 4 + 1] << 16) |
+                   ((uint32_t)data[i * 4 + 2] << 8) | data[i * 4 + 3];
+        }
+        for (uint i = 16; i < 64; i++) {
+            uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (uint i = 0; i < 64; i++) {
+            uint32_t s1 = ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + checksum_sha256_k[i] + w[i];
+            uint32_t s0 = ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+static void sha256_blocks(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    if (ops.sha256_uses_simd && arch_ints_disabled())
+        checksum_sha256_blocks_soft(state, data, blocks);
+    else
+        ops.sha256_blocks(state, data, blocks);
+}
+
+void checksum_sha256_init(checksum_sha256_ctx_t *ctx)
+{
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->count = 0;
+}
+
+typedef void (*sha256_blocks_t)(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+static void sha256_update(checksum_sha256_ctx_t *ctx, const void *_data, size_t len,
+                          sha256_blocks_t blocks_func)
+{
+    const uint8_t *data = _data;
+    size_t used = ctx->count % 64;
+
+    ctx->count += len;
+
+    /* top up a partial block first */
+    if (used > 0) {
+        size_t fill = MIN(len, 64 - used);
+        memcpy(ctx->buf + used, data, fill);
+        data += fill;
+        len -= fill;
+        if (used + fill < 64)
+            return;
+        blocks_func(ctx->state, ctx->buf, 1);
+    }
+
+    /* whole blocks straight from the caller's buffer */
+    if (len >= 64) {
+        blocks_func(ctx->state, data, len / 64);
+        data += len & ~(size_t)63;
+        len %= 64;
+    }
+
+    memcpy(ctx->buf, data, len);
+}
+
+static void sha256_final(checksum_sha256_ctx_t *ctx, uint8_t digest[CHECKSUM_SHA256_SIZE],
+                         sha256_blocks_t blocks_func)
+{
+    uint64_t bits = ctx->count * 8;
+    size_t used = ctx->count % 64;
+
+    /* pad with a one bit, zeros and the big endian bit count */
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->buf + used, 0, 64 - used);
+        blocks_func(ctx->state, ctx->buf, 1);
+        used = 0;
+    }
+    memset(ctx->buf + used, 0, 56 - used);
+    for (uint i = 0; i < 8; i++)
+        ctx->buf[56 + i] = bits >> (56 - i * 8);
+    blocks_func(ctx->state, ctx->buf, 1);
+
+    for (uint i = 0; i < 8; i++) {
+        digest[i * 4] = ctx->state[i] >> 24;
+        digest[i * 4 + 1] = ctx->state[i] >> 16;
+        digest[i * 4 + 2] = ctx->state[i] >> 8;
+        digest[i * 4 + 3] = ctx->state[i];
+    }
+}
+
+void checksum_sha256_update(checksum_sha256_ctx_t *ctx, const void *data, size_t len)
+{
+    sha256_update(ctx, data, len, sha256_blocks);
+}
+
+void checksum_sha256_final(checksum_sha256_ctx_t *ctx, uint8_t digest[CHECKSUM_SHA256_SIZE])
+{
+    sha256_final(ctx, digest, sha256_blocks);
+}
+
+void checksum_sha256(const void *data, size_t len, uint8_t digest[CHECKSUM_SHA256_SIZE])
+{
+    checksum_sha256_ctx_t ctx;
+
+    checksum_sha256_init(&ctx);
+    checksum_sha256_update(&ctx, data, len);
+    checksum_sha256_final(&ctx, digest);
+}
+
+__WEAK void checksum_arch_init(struct checksum_ops *o)
+{
+}
+
+__WEAK void checksum_platform_init(struct checksum_ops *o)
+{
+}
+
+static void checksum_init(uint level)
+{
+    struct checksum_ops o = ops;
+
+    checksum_arch_init(&o);
+    checksum_platform_init(&o);
+
+    LTRACEF("crc32 %s, sha256 %s\n", o.crc32_name, o.sha256_name);
+
+    /* each function pointer stays valid on its own, callers racing this
+     * see either the old or the new implementation */
+    ops.crc32_uses_simd = o.crc32_uses_simd;
+    ops.crc32 = o.crc32;
+    ops.crc32_name = o.crc32_name;
+    ops.sha256_uses_simd = o.sha256_uses_simd;
+    ops.sha256_blocks = o.sha256_blocks;
+    ops.sha256_name = o.sha256_name;
+}
+
+LK_INIT_HOOK(checksum, checksum_init, LK_INIT_LEVEL_TARGET);
+
+#if WITH_LIB_CONSOLE
+
+/* compare the accelerated versions against software over assorted lengths
+ * and alignments */
+static int checksum_selftest(void)
+{
+    const size_t size = 64 * 1024;
+    uint8_t *buf = malloc(size + 64);
+    if (!buf)
+        return ERR_NO_MEMORY;
+
+    for (size_t i = 0; i < size + 64; i++)
+        buf[i] = rand();
+
+    int errors = 0;
+
+    /* known answers */
+    static const uint8_t abc_sha256[CHECKSUM_SHA256_SIZE] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+    };
+    uint8_t digest[CHECKSUM_SHA256_SIZE];
+    checksum_sha256("abc", 3, digest);
+    if (memcmp(digest, abc_sha256, sizeof(digest))) {
+        printf("sha256 of \"abc\" wrong\n");
+        errors++;
+    }
+    if (checksum_crc32(0, "123456789", 9) != 0xcbf43926) {
+        printf("crc32 of \"123456789\" wrong\n");
+        errors++;
+    }
+
+    for (uint i = 0; i < 200 && errors < 10; i++) {
+        size_t ofs = rand() % 64;
+        size_t len = (i < 100) ? i : (size_t)rand() % size;
+
+        uint32_t crc = checksum_crc32(0x12345678, buf + ofs, len);
+        uint32_t soft_crc = checksum_crc32_soft(0x12345678, buf + ofs, len);
+        if (crc != soft_crc) {
+            printf("crc32 mismatch len %zu ofs %zu: 0x%x vs 0x%x\n", len, ofs, crc, soft_crc);
+            errors++;
+        }
+
+        /* hash in two uneven pieces against one software pass */
+        checksum_sha256_ctx_t ctx;
+        size_t split = len ? (size_t)rand() % len : 0;
+        checksum_sha256_init(&ctx);
+        checksum_sha256_update(&ctx, buf + ofs, split);
+        checksum_sha256_update(&ctx, buf + ofs + split, len - split);
+        checksum_sha256_final(&ctx, digest);
+
+        uint8_t soft_digest[CHECKSUM_SHA256_SIZE];
+        checksum_sha256_init(&ctx);
+        sha256_update(&ctx, buf + ofs, len, checksum_sha256_blocks_soft);
+        sha256_final(&ctx, soft_digest, checksum_sha256_blocks_soft);
+
+        if (memcmp(digest, soft_digest, sizeof(digest))) {
+            printf("sha256 mismatch len %zu ofs %zu split %zu\n", len, ofs, split);
+            errors++;
+        }
+    }
+
+    free(buf);
+
+    printf("checksum self test %s\n", errors ? "FAILED" : "passed");
+    return errors ? ERR_GENERIC : NO_ERROR;
+}
+
+static void checksum_bench(void)
+{
+    const size_t size = 1024 * 1024;
+    uint8_t *buf = malloc(size);
+    if (!buf)
+        return;
+    memset(buf, 0x5a, size);
+
+    uint8_t digest[CHECKSUM_SHA256_SIZE];
+    lk_bigtime_t t;
+
+    t = current_time_hires();
+    volatile uint32_t crc = checksum_crc32(0, buf, size);
+    t = current_time_hires() - t;
+    printf("crc32 (%s): %llu usecs for %zu bytes\n", ops.crc32_name, t, size);
+
+    t = current_time_hires();
+    crc = checksum_crc32_soft(0, buf, size);
+    t = current_time_hires() - t;
+    printf("crc32 (software): %llu usecs for %zu bytes\n", t, size);
+    (void)crc;
+
+    t = current_time_hires();
+    checksum_sha256(buf, size, digest);
+    t = current_time_hires() - t;
+    printf("sha256 (%s): %llu usecs for %zu bytes\n", ops.sha256_name, t, size);
+
+    uint32_t state[8] = { 0 };
+    t = current_time_hires();
+    checksum_sha256_blocks_soft(state, buf, size / 64);
+    t = current_time_hires() - t;
+    printf("sha256 (software): %llu usecs for %zu bytes\n", t, size);
+
+    free(buf);
+}
+
+static int cmd_checksum(int argc, const cmd_args *argv)
+{
+    if (argc < 2) {
+usage:
+        printf("usage:\n");
+        printf("\t%s info  : implementations in use\n", argv[0].str);
+        printf("\t%s test  : check against the software versions\n", argv[0].str);
+        printf("\t%s bench : time 1MB of each\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    if (!strcmp(argv[1].str, "info")) {
+        printf("crc32: %s\n", ops.crc32_name);
+        printf("sha256: %s\n", ops.sha256_name);
+    } else if (!strcmp(argv[1].str, "test")) {
+        return checksum_selftest();
+    } else if (!strcmp(argv[1].str, "bench")) {
+        checksum_bench();
+    } else {
+        goto usage;
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("checksum", "checksum acceleration", &cmd_checksum)
+STATIC_COMMAND_END(checksum);
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Checksums and hashes with hardware acceleration where the cpu or platform
+ * has it, and portable software versions everywhere else. Results never
+ * depend on which implementation ran.
+ *
+ * Everything here may be called from any context. Implementations that use
+ * simd registers fall back to software while interrupts are disabled.
+ */
+
+__BEGIN_CDECLS
+
+#define CHECKSUM_SHA256_SIZE 32
+
+/* crc-32 as used by ethernet, zlib and lib/cksum's crc32(). pass 0 to start
+ * a new checksum or the previous result to continue one. */
+uint32_t checksum_crc32(uint32_t crc, const void *buf, size_t len);
+
+typedef struct checksum_sha256_ctx {
+    uint32_t state[8];
+    uint64_t count;         /* bytes hashed so far */
+    uint8_t buf[64];
+} checksum_sha256_ctx_t;
+
+void checksum_sha256_init(checksum_sha256_ctx_t *ctx);
+void checksum_sha256_update(checksum_sha256_ctx_t *ctx, const void *data, size_t len);
+void checksum_sha256_final(checksum_sha256_ctx_t *ctx, uint8_t digest[CHECKSUM_SHA256_SIZE]);
+
+/* one shot version of the above */
+void checksum_sha256(const void *data, size_t len, uint8_t digest[CHECKSUM_SHA256_SIZE]);
+
+/*
+ * Backends. At LK_INIT_LEVEL_TARGET the arch gets to fill in what the cpu can
+ * accelerate and then the platform what its peripherals can, each replacing
+ * only the members it implements. Until then the software versions are used.
+ */
+struct checksum_ops {
+    const char *crc32_name;
+    uint32_t (*crc32)(uint32_t crc, const uint8_t *buf, size_t len);
+    bool crc32_uses_simd;
+
+    const char *sha256_name;
+    /* run the compression function over that many consecutive 64 byte blocks */
+    void (*sha256_blocks)(uint32_t state[8], const uint8_t *data, size_t blocks);
+    bool sha256_uses_simd;
+};
+
+void checksum_arch_init(struct checksum_ops *ops);
+void checksum_platform_init(struct checksum_ops *ops);
+
+/* the sha-256 round constants */
+extern const uint32_t checksum_sha256_k[64];
+
+/* the software versions, for backends that only take part of the work */
+uint32_t checksum_crc32_soft(uint32_t crc, const uint8_t *buf, size_t len);
+void checksum_sha256_blocks_soft(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+__END_CDECLS
@@ -0,0 +1,21 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_DEPS += \
+	lib/cksum
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/checksum.c
+
+# cpu specific implementations
+ifeq ($(ARCH),arm64)
+MODULE_SRCS += $(LOCAL_DIR)/arm64.c
+endif
+ifeq ($(ARCH),x86)
+ifneq ($(CPU),legacy)
+MODULE_SRCS += $(LOCAL_DIR)/x86.c
+endif
+endif
+
+include make/module.mk
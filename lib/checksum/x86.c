@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * SHA-NI and PCLMULQDQ implementations. These are written against the
+ * compiler builtins rather than immintrin.h, which doesn't build against the
+ * kernel's libc headers.
+ */
+#include <lib/checksum.h>
+
+#include <arch/x86.h>
+#include <string.h>
+#include <trace.h>
+
+#define LOCAL_TRACE 0
+
+typedef int v4si __attribute__((vector_size(16)));
+typedef long long v2di __attribute__((vector_size(16)));
+typedef char v16qi __attribute__((vector_size(16)));
+typedef short v8hi __attribute__((vector_size(16)));
+
+static inline v2di load128(const void *p)
+{
+    v2di v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store128(void *p, v2di v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+/*
+ * crc-32 by folding 64 bytes at a time with carry-less multiplies and a
+ * final barrett reduction, as described in Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction". The constants are the
+ * bit reflected x^n mod P(x) values for the ieee polynomial.
+ */
+static const uint64_t crc_k1k2[2] = { 0x0154442bd4, 0x01c6e41596 };
+static const uint64_t crc_k3k4[2] = { 0x01751997d0, 0x00ccaa009e };
+static const uint64_t crc_k5[2] = { 0x0163cd6124, 0 };
+static const uint64_t crc_poly[2] = { 0x01db710641, 0x01f7011641 };
+static const uint64_t crc_mask32[2] = { 0xffffffff, 0 };
+
+#define CLMUL(a, b, imm) __builtin_ia32_pclmulqdq128((a), (b), (imm))
+
+__attribute__((target("pclmul,sse4.1")))
+static inline v2di fold128(v2di x, v2di k)
+{
+    return CLMUL(x, k, 0x00) ^ CLMUL(x, k, 0x11);
+}
+
+/* len must be at least 64 and a multiple of 16. works on the raw,
+ * uninverted crc register. */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_fold(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    v2di x1 = load128(buf);
+    v2di x2 = load128(buf + 16);
+    v2di x3 = load128(buf + 32);
+    v2di x4 = load128(buf + 48);
+    x1 ^= (v2di){ crc, 0 };
+    buf += 64;
+    len -= 64;
+
+    v2di k = load128(crc_k1k2);
+    while (len >= 64) {
+        x1 = fold128(x1, k) ^ load128(buf);
+        x2 = fold128(x2, k) ^ load128(buf + 16);
+        x3 = fold128(x3, k) ^ load128(buf + 32);
+        x4 = fold128(x4, k) ^ load128(buf + 48);
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the four lanes into one, then the remaining 16 byte pieces */
+    k = load128(crc_k3k4);
+    x1 = fold128(x1, k) ^ x2;
+    x1 = fold128(x1, k) ^ x3;
+    x1 = fold128(x1, k) ^ x4;
+    while (len >= 16) {
+        x1 = fold128(x1, k) ^ load128(buf);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 to 64 bits, appending 32 zero bits */
+    x1 = CLMUL(k, x1, 0x01) ^ (v2di)__builtin_ia32_psrldqi128(x1, 8 * 8);
+
+    /* 64 to 32 bits */
+    v2di mask = load128(crc_mask32);
+    v2di x2r = (v2di)__builtin_ia32_psrldqi128(x1, 4 * 8);
+    x1 = CLMUL(x1 & mask, load128(crc_k5), 0x00) ^ x2r;
+
+    /* barrett reduction */
+    v2di poly = load128(crc_poly);
+    v2di t = CLMUL(x1 & mask, poly, 0x10);
+    t = CLMUL(t & mask, poly, 0x00);
+    x1 ^= t;
+
+    return ((v4si)x1)[1];
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    if (len < 64)
+        return checksum_crc32_soft(crc, buf, len);
+
+    size_t bulk = len & ~(size_t)15;
+    crc = ~crc32_fold(~crc, buf, bulk);
+
+    return checksum_crc32_soft(crc, buf + bulk, len - bulk);
+}
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    const v16qi bswap = { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 };
+
+    /* the sha instructions want the state as abef and cdgh */
+    v4si tmp = __builtin_ia32_pshufd((v4si)load128(&state[0]), 0xb1);      /* cdab */
+    v4si state1 = __builtin_ia32_pshufd((v4si)load128(&state[4]), 0x1b);   /* efgh */
+    v4si state0 = (v4si)__builtin_ia32_palignr128((v2di)tmp, (v2di)state1, 8 * 8);
+    state1 = (v4si)__builtin_ia32_pblendw128((v8hi)state1, (v8hi)tmp, 0xf0);
+
+    for (; blocks > 0; blocks--, data += 64) {
+        v4si abef_save = state0;
+        v4si cdgh_save = state1;
+        v4si msg[4];
+
+        for (uint i = 0; i < 16; i++) {
+            v4si m;
+            if (i < 4) {
+                m = (v4si)__builtin_ia32_pshufb128((v16qi)load128(data + i * 16), bswap);
+            } else {
+                m = __builtin_ia32_sha256msg1(msg[i & 3], msg[(i + 1) & 3]);
+                m += (v4si)__builtin_ia32_palignr128((v2di)msg[(i + 3) & 3],
+                                                     (v2di)msg[(i + 2) & 3], 4 * 8);
+                m = __builtin_ia32_sha256msg2(m, msg[(i + 3) & 3]);
+            }
+            msg[i & 3] = m;
+
+            v4si wk = m + (v4si)load128(&checksum_sha256_k[i * 4]);
+            state1 = __builtin_ia32_sha256rnds2(state1, state0, wk);
+            wk = __builtin_ia32_pshufd(wk, 0x0e);
+            state0 = __builtin_ia32_sha256rnds2(state0, state1, wk);
+        }
+
+        state0 += abef_save;
+        state1 += cdgh_save;
+    }
+
+    tmp = __builtin_ia32_pshufd(state0, 0x1b);                                  /* feba */
+    state1 = __builtin_ia32_pshufd(state1, 0xb1);                               /* dchg */
+    state0 = (v4si)__builtin_ia32_pblendw128((v8hi)tmp, (v8hi)state1, 0xf0);    /* dcba */
+    state1 = (v4si)__builtin_ia32_palignr128((v2di)state1, (v2di)tmp, 8 * 8);   /* hgfe */
+
+    store128(&state[0], (v2di)state0);
+    store128(&state[4], (v2di)state1);
+}
+
+void checksum_arch_init(struct checksum_ops *ops)
+{
+#if X86_WITH_FPU
+    uint32_t a, b, c, d;
+
+    x86_cpuid(0, 0, &a, &b, &c, &d);
+    uint32_t max_leaf = a;
+
+    x86_cpuid(1, 0, &a, &b, &c, &d);
+    bool sse41 = c & (1u << 19);
+    bool pclmul = c & (1u << 1);
+    bool ssse3 = c & (1u << 9);
+
+    bool sha = false;
+    if (max_leaf >= 7) {
+        x86_cpuid(7, 0, &a, &b, &c, &d);
+        sha = b & (1u << 29);
+    }
+
+    LTRACEF("sse4.1 %d ssse3 %d pclmul %d sha %d\n", sse41, ssse3, pclmul, sha);
+
+    if (sse41 && pclmul) {
+        ops->crc32_name = "pclmulqdq";
+        ops->crc32 = crc32_pclmul;
+        ops->crc32_uses_simd = true;
+    }
+    if (sse41 && ssse3 && sha) {
+        ops->sha256_name = "sha-ni";
+        ops->sha256_blocks = sha256_blocks_shani;
+        ops->sha256_uses_simd = true;
+    }
+#endif
+}
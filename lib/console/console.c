@@ -83,6 +83,23 @@ static void dump_history(void);
 /* list of installed commands */
 static cmd_block *command_list = NULL;
 
+/* hash index over command_list, rebuilt a block at a time as blocks are registered.
+ * chains are ordered the way a walk of command_list would find the commands */
+#ifndef CONSOLE_CMD_HASH_BUCKETS
+#define CONSOLE_CMD_HASH_BUCKETS 64 // power of two
+#endif
+
+struct cmd_hash_node {
+    struct cmd_hash_node *next;
+    const cmd *command;
+    uint32_t hash;
+};
+
+static struct cmd_hash_node *command_hash[CONSOLE_CMD_HASH_BUCKETS];
+
+/* blocks registered while out of memory are only found by walking command_list */
+static bool command_hash_incomplete;
+
 /* a linear array of statically defined command blocks,
    defined in the linker script.
  */
@@ -228,6 +245,8 @@ static const char *prev_history(uint *cursor)
 }
 #endif  // CONSOLE_ENABLE_HISTORY
 
+static const cmd *match_command(const char *command, const uint8_t availability_mask);
+
 #if CONSOLE_ENABLE_REPEAT
 static int cmd_repeat(int argc, const cmd_args* argv)
 {
@@ -237,32 +256,26 @@ static int cmd_repeat(int argc, const cmd_args* argv)
     if (times <= 0) goto usage;
     if (delay < 0) goto usage;
 
-    // Worst case line length with quoting.
-    char line[LINE_LEN + MAX_NUM_ARGS * 3];
-
-    // Paste together all arguments, and quote them.
-    int idx = 0;
-    for (int i = 3; i < argc; ++i) {
-        if (i != 3) {
-            // Add a space before all args but the first.
-            line[idx++] = ' ';
-        }
-        line[idx++] = '"';
-        for (const char* src = argv[i].str; *src != '\0'; src++) {
-            line[idx++] = *src;
-        }
-        line[idx++] = '"';
+    // The arguments were tokenized and converted once already, so look the
+    // command up once and hand it the same arguments every time around.
+    const cmd *command = match_command(argv[3].str, CMD_AVAIL_NORMAL);
+    if (!command) {
+        printf("command not found\n");
+        return ERR_NOT_FOUND;
     }
-    line[idx] = '\0';
 
     for (int i = 0; i < times; ++i) {
         printf("[%d/%d]\n", i + 1, times);
-        int result = console_run_script_locked(line);
+        abort_script = false;
+        int result = command->cmd_callback(argc - 3, argv + 3);
+        lastresult = result;
         if (result != 0) {
             printf("terminating repeat loop, command exited with status %d\n",
                     result);
             return result;
         }
+        if (abort_script)
+            break;
         thread_sleep(delay);
     }
     return NO_ERROR;
@@ -273,11 +286,38 @@ usage:
 }
 #endif  // CONSOLE_ENABLE_REPEAT
 
+static uint32_t hash_command(const char *str)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+
+    while (*str) {
+        hash ^= (uint8_t)*str++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
 static const cmd *match_command(const char *command, const uint8_t availability_mask)
 {
     cmd_block *block;
     size_t i;
 
+    if (!command_hash_incomplete) {
+        uint32_t hash = hash_command(command);
+        struct cmd_hash_node *node = command_hash[hash & (CONSOLE_CMD_HASH_BUCKETS - 1)];
+
+        for (; node; node = node->next) {
+            if (node->hash != hash || (availability_mask & node->command->availability_mask) == 0)
+                continue;
+            if (strcmp(command, node->command->cmd_str) == 0)
+                return node->command;
+        }
+
+        return NULL;
+    }
+
     for (block = command_list; block != NULL; block = block->next) {
         const cmd *curr_cmd = block->list;
         for (i = 0; i < block->count; i++) {
@@ -814,6 +854,29 @@ void console_register_commands(cmd_block *block)
 
     block->next = command_list;
     command_list = block;
+
+    if (block->count == 0)
+        return;
+
+    struct cmd_hash_node *nodes = malloc(block->count * sizeof(struct cmd_hash_node));
+    if (!nodes) {
+        dprintf(INFO, "console: no memory to index commands, falling back to a linear search\n");
+        command_hash_incomplete = true;
+        return;
+    }
+
+    /* the newest block goes first and within a block the first entry wins, so push
+     * the entries onto the chains back to front */
+    for (size_t i = block->count; i-- > 0; ) {
+        const cmd *command = &block->list[i];
+        struct cmd_hash_node *node = &nodes[i];
+        uint32_t hash = hash_command(command->cmd_str);
+
+        node->command = command;
+        node->hash = hash;
+        node->next = command_hash[hash & (CONSOLE_CMD_HASH_BUCKETS - 1)];
+        command_hash[hash & (CONSOLE_CMD_HASH_BUCKETS - 1)] = node;
+    }
 }
 
 
@@ -42,6 +42,8 @@ void spin(uint32_t usecs)
 
 void _panic(void *caller, const char *fmt, ...)
 {
+    console_output_panic();
+
     printf("panic (caller %p): ", caller);
 
     va_list ap;
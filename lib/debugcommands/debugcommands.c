@@ -28,9 +28,11 @@
 #include <list.h>
 #include <string.h>
 #include <arch/ops.h>
+#include <arch/pmu.h>
 #include <platform.h>
 #include <platform/debug.h>
 #include <kernel/thread.h>
+#include <kernel/spinlock.h>
 #include <arch.h>
 
 #include <lib/console.h>
@@ -49,6 +51,7 @@ static int cmd_chain(int argc, const cmd_args *argv);
 static int cmd_sleep(int argc, const cmd_args *argv);
 static int cmd_crash(int argc, const cmd_args *argv);
 static int cmd_stackstomp(int argc, const cmd_args *argv);
+static int cmd_pmu(int argc, const cmd_args *argv);
 
 STATIC_COMMAND_START
 #if LK_DEBUGLEVEL > 0
@@ -71,6 +74,7 @@ STATIC_COMMAND("mtest", "simple memory test", &cmd_memtest)
 STATIC_COMMAND("chain", "chain load another binary", &cmd_chain)
 STATIC_COMMAND("sleep", "sleep number of seconds", &cmd_sleep)
 STATIC_COMMAND("sleepm", "sleep number of milliseconds", &cmd_sleep)
+STATIC_COMMAND("pmu", "count hardware events while running a command", &cmd_pmu)
 STATIC_COMMAND_END(mem);
 
 static int cmd_display_mem(int argc, const cmd_args *argv)
@@ -354,3 +358,162 @@ static int cmd_stackstomp(int argc, const cmd_args *argv)
 }
 
 
+
+static const char *pmu_event_names[ARCH_PMU_EVENT_COUNT] = {
+    [ARCH_PMU_EVENT_CYCLES] = "cycles",
+    [ARCH_PMU_EVENT_INSTRUCTIONS] = "instructions",
+    [ARCH_PMU_EVENT_CACHE_REFS] = "cache-refs",
+    [ARCH_PMU_EVENT_CACHE_MISSES] = "cache-misses",
+    [ARCH_PMU_EVENT_BRANCHES] = "branches",
+    [ARCH_PMU_EVENT_BRANCH_MISSES] = "branch-misses",
+    [ARCH_PMU_EVENT_DTLB_MISSES] = "dtlb-misses",
+    [ARCH_PMU_EVENT_ITLB_MISSES] = "itlb-misses",
+};
+
+/* what gets counted without -e, as far as there are counters for it */
+static const enum arch_pmu_event pmu_default_events[] = {
+    ARCH_PMU_EVENT_CYCLES,
+    ARCH_PMU_EVENT_INSTRUCTIONS,
+    ARCH_PMU_EVENT_CACHE_MISSES,
+    ARCH_PMU_EVENT_BRANCH_MISSES,
+    ARCH_PMU_EVENT_CACHE_REFS,
+    ARCH_PMU_EVENT_BRANCHES,
+    ARCH_PMU_EVENT_DTLB_MISSES,
+    ARCH_PMU_EVENT_ITLB_MISSES,
+};
+
+/* parse a comma separated list of event names, returns the count or an error */
+static int pmu_parse_events(const char *list, enum arch_pmu_event *events, uint max)
+{
+    uint count = 0;
+
+    while (*list) {
+        const char *comma = strchr(list, ',');
+        size_t len = comma ? (size_t)(comma - list) : strlen(list);
+        uint i;
+        for (i = 0; i < ARCH_PMU_EVENT_COUNT; i++) {
+            if (strlen(pmu_event_names[i]) == len && !strncmp(list, pmu_event_names[i], len))
+                break;
+        }
+        if (i == ARCH_PMU_EVENT_COUNT) {
+            printf("unknown event '%.*s'\n", (int)len, list);
+            return ERR_INVALID_ARGS;
+        }
+        if (!arch_pmu_event_supported(i)) {
+            printf("%s can't be counted on this cpu\n", pmu_event_names[i]);
+            return ERR_NOT_SUPPORTED;
+        }
+        if (count == max) {
+            printf("only %u events can be counted at once\n", max);
+            return ERR_TOO_BIG;
+        }
+        events[count++] = i;
+
+        list += len;
+        if (*list == ',')
+            list++;
+    }
+
+    return count;
+}
+
+static int cmd_pmu(int argc, const cmd_args *argv)
+{
+    uint num_counters = MIN(arch_pmu_num_counters(), (uint)ARCH_PMU_EVENT_COUNT);
+    enum arch_pmu_event events[ARCH_PMU_EVENT_COUNT];
+    int count = 0;
+    int first = 1;
+
+    if (argc < 2) {
+usage:
+        printf("usage:\n");
+        printf("\t%s list                      : events this cpu can count\n", argv[0].str);
+        printf("\t%s [-e event,...] <command> : count events while command runs\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    if (!strcmp(argv[1].str, "list")) {
+        printf("%u counters\n", arch_pmu_num_counters());
+        for (uint i = 0; i < ARCH_PMU_EVENT_COUNT; i++)
+            printf("\t%-14s%s\n", pmu_event_names[i], arch_pmu_event_supported(i) ? "" : " (not supported)");
+        return NO_ERROR;
+    }
+
+    if (num_counters == 0) {
+        printf("no performance counters on this cpu\n");
+        return ERR_NOT_SUPPORTED;
+    }
+
+    if (!strcmp(argv[1].str, "-e")) {
+        if (argc < 4)
+            goto usage;
+        count = pmu_parse_events(argv[2].str, events, num_counters);
+        if (count < 0)
+            return count;
+        first = 3;
+    } else {
+        for (uint i = 0; i < countof(pmu_default_events) && (uint)count < num_counters; i++) {
+            if (arch_pmu_event_supported(pmu_default_events[i]))
+                events[count++] = pmu_default_events[i];
+        }
+    }
+
+    /* paste the command back together, quoting every argument */
+    char line[256];
+    size_t len = 0;
+    for (int i = first; i < argc; i++) {
+        int n = snprintf(line + len, sizeof(line) - len, "%s\"%s\"", (i > first) ? " " : "", argv[i].str);
+        if (n < 0 || (size_t)n >= sizeof(line) - len) {
+            printf("command too long\n");
+            return ERR_TOO_BIG;
+        }
+        len += n;
+    }
+
+    /* the counters belong to the cpu, stay on it for the whole run */
+    __UNUSED thread_t *self = get_current_thread();
+    __UNUSED int old_pin = thread_pinned_cpu(self);
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    uint cpu = arch_curr_cpu_num();
+    thread_set_pinned_cpu(self, cpu);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    for (int i = 0; i < count; i++)
+        arch_pmu_set_event(i, events[i]);
+
+    lk_bigtime_t start = current_time_hires();
+    arch_pmu_start();
+    int result = console_run_script_locked(line);
+    arch_pmu_stop();
+    lk_bigtime_t elapsed = current_time_hires() - start;
+
+    uint64_t values[ARCH_PMU_EVENT_COUNT] = { 0 };
+    bool counted[ARCH_PMU_EVENT_COUNT] = { false };
+    for (int i = 0; i < count; i++) {
+        values[events[i]] = arch_pmu_read(i);
+        counted[events[i]] = true;
+    }
+
+    thread_set_pinned_cpu(self, old_pin);
+
+    printf("\ncpu %u, %llu usecs, command returned %d\n", cpu, elapsed, result);
+    for (int i = 0; i < count; i++)
+        printf("%16llu  %s\n", values[events[i]], pmu_event_names[events[i]]);
+
+    /* rates in tenths of a unit or percent */
+    if (counted[ARCH_PMU_EVENT_CYCLES] && counted[ARCH_PMU_EVENT_INSTRUCTIONS] && values[ARCH_PMU_EVENT_CYCLES]) {
+        uint64_t ipc = values[ARCH_PMU_EVENT_INSTRUCTIONS] * 100 / values[ARCH_PMU_EVENT_CYCLES];
+        printf("%13llu.%02llu  instructions per cycle\n", ipc / 100, ipc % 100);
+    }
+    if (counted[ARCH_PMU_EVENT_BRANCHES] && counted[ARCH_PMU_EVENT_BRANCH_MISSES] && values[ARCH_PMU_EVENT_BRANCHES]) {
+        uint64_t rate = values[ARCH_PMU_EVENT_BRANCH_MISSES] * 1000 / values[ARCH_PMU_EVENT_BRANCHES];
+        printf("%14llu.%llu%% branches mispredicted\n", rate / 10, rate % 10);
+    }
+    if (counted[ARCH_PMU_EVENT_CACHE_REFS] && counted[ARCH_PMU_EVENT_CACHE_MISSES] && values[ARCH_PMU_EVENT_CACHE_REFS]) {
+        uint64_t rate = values[ARCH_PMU_EVENT_CACHE_MISSES] * 1000 / values[ARCH_PMU_EVENT_CACHE_REFS];
+        printf("%14llu.%llu%% cache references missed\n", rate / 10, rate % 10);
+    }
+
+    return result;
+}
@@ -21,7 +21,10 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
-#include "devicetree.h"
+#include <lib/devicetree.h>
+
+#include <stdlib.h>
+#include <string.h>
 
 #define DT_MAGIC	0xD00DFEED
 #define DT_NODE_BEGIN	1
@@ -31,6 +34,14 @@
 
 typedef struct dt_slice slice_t;
 
+#ifndef DT_MAX_DEPTH
+#define DT_MAX_DEPTH	16
+#endif
+
+#define DT_ALIGN(n)	(((n) + 7) & ~(size_t)7)
+
+static int dt_build_index(devicetree_t *dt);
+
 u32 dt_rd32(u8 *data) {
 	return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
 }
@@ -156,7 +167,7 @@ int dt_init(devicetree_t *dt, void *data, u32 len) {
 	if (sslice(&dt->top, &dt->ds, dt->hdr.off_strings, dt->hdr.sz_strings))
 		return oops(dt, "invalid strings off/len");
 
-	return 0;
+	return dt_build_index(dt);
 }
 
 int dt_walk(devicetree_t *dtree, dt_node_cb ncb, dt_prop_cb pcb, void *cookie) {
@@ -207,3 +218,338 @@ int dt_walk(devicetree_t *dtree, dt_node_cb ncb, dt_prop_cb pcb, void *cookie) {
 
 	return 0;
 }
+
+/* fnv-1a, fed the full path one piece at a time */
+#define PATH_HASH_INIT	0x811c9dc5
+
+static u32 path_hash(u32 h, const char *s, size_t len) {
+	while (len-- > 0) {
+		h ^= (u8) *s++;
+		h *= 0x01000193;
+	}
+	return h;
+}
+
+/* the index is built in two walks, the first one only counts */
+struct index_state {
+	devicetree_t *dt;
+	dt_node_t *stack[DT_MAX_DEPTH];
+	dt_node_t *last[DT_MAX_DEPTH + 1];
+	dt_node_t *cur;
+	u32 nnodes;
+	u32 nprops;
+	u32 nphandles;
+	u32 ncompat;
+	int counting;
+	int failed;
+};
+
+static int index_node_cb(int depth, const char *name, void *cookie) {
+	struct index_state *st = cookie;
+
+	if (depth > DT_MAX_DEPTH) {
+		st->failed = oops(st->dt, "tree too deep");
+		return 1;
+	}
+
+	if (st->counting) {
+		st->nnodes++;
+		return 0;
+	}
+
+	dt_node_t *node = &st->dt->nodes[st->nnodes++];
+	dt_node_t *parent = (depth > 1) ? st->stack[depth - 2] : NULL;
+
+	node->name = name;
+	node->parent = parent;
+	node->props = &st->dt->props[st->nprops];
+
+	/* children are linked in the order they appear */
+	if (st->last[depth - 1])
+		st->last[depth - 1]->sibling = node;
+	else if (parent)
+		parent->child = node;
+	st->last[depth - 1] = node;
+	st->last[depth] = NULL;
+	st->stack[depth - 1] = node;
+
+	if (!parent) {
+		node->hash = path_hash(PATH_HASH_INIT, "/", 1);
+	} else {
+		node->hash = parent->hash;
+		if (parent->parent)
+			node->hash = path_hash(node->hash, "/", 1);
+		node->hash = path_hash(node->hash, name, strlen(name));
+	}
+
+	st->cur = node;
+	return 0;
+}
+
+/* number of strings in a stringlist property */
+static u32 count_strings(const u8 *data, u32 size) {
+	u32 n = 0;
+	for (u32 i = 0; i < size; i++) {
+		if (data[i] == 0)
+			n++;
+	}
+	return n;
+}
+
+static int index_prop_cb(const char *name, u8 *data, u32 size, void *cookie) {
+	struct index_state *st = cookie;
+	int is_phandle = (size == 4) && (!strcmp(name, "phandle") || !strcmp(name, "linux,phandle"));
+	int is_compat = !strcmp(name, "compatible");
+
+	if (st->counting) {
+		st->nprops++;
+		if (is_compat)
+			st->ncompat += count_strings(data, size);
+		if (is_phandle)
+			st->nphandles++;
+		return 0;
+	}
+
+	/* properties always come before subnodes, so they belong to the last node seen */
+	dt_node_t *node = st->cur;
+	dt_prop_t *prop = &st->dt->props[st->nprops++];
+
+	prop->name = name;
+	prop->data = data;
+	prop->size = size;
+	node->nprops++;
+
+	if (is_phandle && !node->phandle) {
+		node->phandle = dt_rd32(data);
+		st->dt->phandles[st->nphandles++] = node;
+	}
+
+	if (is_compat) {
+		const char *s = (const char *) data;
+		const char *end = s + size;
+		while (s < end) {
+			size_t len = strnlen(s, end - s);
+			if (s + len == end)
+				break;
+			st->dt->compat[st->ncompat].compat = s;
+			st->dt->compat[st->ncompat].node = node;
+			st->ncompat++;
+			s += len + 1;
+		}
+	}
+
+	return 0;
+}
+
+static int phandle_cmp(const void *a, const void *b) {
+	const dt_node_t *na = *(dt_node_t * const *) a;
+	const dt_node_t *nb = *(dt_node_t * const *) b;
+	if (na->phandle != nb->phandle)
+		return (na->phandle < nb->phandle) ? -1 : 1;
+	return 0;
+}
+
+/* nodes with the same string stay in tree order */
+static int compat_cmp(const void *a, const void *b) {
+	const struct dt_compat *ca = a;
+	const struct dt_compat *cb = b;
+	int r = strcmp(ca->compat, cb->compat);
+	if (r)
+		return r;
+	if (ca->node != cb->node)
+		return (ca->node < cb->node) ? -1 : 1;
+	return 0;
+}
+
+static int dt_build_index(devicetree_t *dt) {
+	struct index_state st;
+
+	memset(&st, 0, sizeof(st));
+	st.dt = dt;
+	st.counting = 1;
+	if (dt_walk(dt, index_node_cb, index_prop_cb, &st) || st.failed)
+		return -1;
+	if (st.nnodes == 0)
+		return oops(dt, "no root node");
+
+	u32 table_size = 1;
+	while (table_size < st.nnodes * 2)
+		table_size <<= 1;
+
+	size_t nodes_off = 0;
+	size_t props_off = nodes_off + DT_ALIGN(st.nnodes * sizeof(dt_node_t));
+	size_t table_off = props_off + DT_ALIGN(st.nprops * sizeof(dt_prop_t));
+	size_t phandles_off = table_off + DT_ALIGN(table_size * sizeof(dt_node_t *));
+	size_t compat_off = phandles_off + DT_ALIGN(st.nphandles * sizeof(dt_node_t *));
+	size_t total = compat_off + DT_ALIGN(st.ncompat * sizeof(struct dt_compat));
+
+	u8 *mem;
+	if (dt->pool) {
+		if (total > dt->pool_size)
+			return oops(dt, "index pool too small");
+		mem = dt->pool;
+	} else {
+		mem = malloc(total);
+		if (!mem)
+			return oops(dt, "out of memory for index");
+		dt->alloc = mem;
+	}
+	memset(mem, 0, total);
+
+	dt->nodes = (dt_node_t *) (mem + nodes_off);
+	dt->props = (dt_prop_t *) (mem + props_off);
+	dt->path_table = (dt_node_t **) (mem + table_off);
+	dt->path_table_size = table_size;
+	dt->phandles = (dt_node_t **) (mem + phandles_off);
+	dt->compat = (struct dt_compat *) (mem + compat_off);
+
+	memset(&st, 0, sizeof(st));
+	st.dt = dt;
+	if (dt_walk(dt, index_node_cb, index_prop_cb, &st) || st.failed) {
+		dt_free(dt);
+		return -1;
+	}
+	dt->nnodes = st.nnodes;
+	dt->nprops = st.nprops;
+	dt->nphandles = st.nphandles;
+	dt->ncompat = st.ncompat;
+
+	for (u32 i = 0; i < dt->nnodes; i++) {
+		u32 slot = dt->nodes[i].hash & (table_size - 1);
+		while (dt->path_table[slot])
+			slot = (slot + 1) & (table_size - 1);
+		dt->path_table[slot] = &dt->nodes[i];
+	}
+
+	qsort(dt->phandles, dt->nphandles, sizeof(dt_node_t *), phandle_cmp);
+	qsort(dt->compat, dt->ncompat, sizeof(struct dt_compat), compat_cmp);
+
+	return 0;
+}
+
+void dt_free(devicetree_t *dt) {
+	free(dt->alloc);
+	dt->alloc = NULL;
+	dt->nodes = NULL;
+	dt->nnodes = 0;
+	dt->props = NULL;
+	dt->nprops = 0;
+	dt->path_table = NULL;
+	dt->path_table_size = 0;
+	dt->phandles = NULL;
+	dt->nphandles = 0;
+	dt->compat = NULL;
+	dt->ncompat = 0;
+}
+
+/* does the full path of node equal the first len bytes of path? */
+static int node_path_eq(const dt_node_t *node, const char *path, size_t len) {
+	if (!node->parent)
+		return len == 1 && path[0] == '/';
+
+	size_t nlen = strlen(node->name);
+	if (len < nlen + 1)
+		return 0;
+	if (memcmp(path + len - nlen, node->name, nlen) || path[len - nlen - 1] != '/')
+		return 0;
+	if (!node->parent->parent)
+		return len == nlen + 1;
+	return node_path_eq(node->parent, path, len - nlen - 1);
+}
+
+/* does a path component name this node, with or without its unit address? */
+static int node_name_eq(const dt_node_t *node, const char *c, size_t len) {
+	if (strncmp(node->name, c, len))
+		return 0;
+	if (node->name[len] == 0)
+		return 1;
+	return node->name[len] == '@' && !memchr(c, '@', len);
+}
+
+dt_node_t *dt_find_node(devicetree_t *dt, const char *path) {
+	if (!dt->nnodes || path[0] != '/')
+		return NULL;
+
+	size_t len = strlen(path);
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+
+	/* exact paths come straight out of the table */
+	u32 h = path_hash(PATH_HASH_INIT, path, len);
+	u32 mask = dt->path_table_size - 1;
+	for (u32 slot = h & mask; dt->path_table[slot]; slot = (slot + 1) & mask) {
+		dt_node_t *node = dt->path_table[slot];
+		if (node->hash == h && node_path_eq(node, path, len))
+			return node;
+	}
+
+	/* otherwise walk down one component at a time, allowing for missing unit addresses */
+	dt_node_t *node = &dt->nodes[0];
+	const char *c = path + 1;
+	const char *end = path + len;
+	while (c < end && node) {
+		const char *next = memchr(c, '/', end - c);
+		size_t clen = next ? (size_t) (next - c) : (size_t) (end - c);
+
+		dt_node_t *child;
+		for (child = node->child; child; child = child->sibling) {
+			if (node_name_eq(child, c, clen))
+				break;
+		}
+		node = child;
+		c += clen + 1;
+	}
+
+	return node;
+}
+
+dt_node_t *dt_find_phandle(devicetree_t *dt, u32 phandle) {
+	u32 lo = 0, hi = dt->nphandles;
+
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		u32 p = dt->phandles[mid]->phandle;
+		if (p == phandle)
+			return dt->phandles[mid];
+		if (p < phandle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+dt_node_t *dt_find_compatible(devicetree_t *dt, dt_node_t *from, const char *compat) {
+	u32 lo = 0, hi = dt->ncompat;
+
+	/* first entry for compat */
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (strcmp(dt->compat[mid].compat, compat) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < dt->ncompat && !strcmp(dt->compat[lo].compat, compat); lo++) {
+		if (!from || dt->compat[lo].node > from)
+			return dt->compat[lo].node;
+	}
+	return NULL;
+}
+
+dt_prop_t *dt_find_prop(dt_node_t *node, const char *name) {
+	for (u32 i = 0; i < node->nprops; i++) {
+		if (!strcmp(node->props[i].name, name))
+			return &node->props[i];
+	}
+	return NULL;
+}
+
+int dt_prop_u32(dt_node_t *node, const char *name, u32 *out) {
+	dt_prop_t *prop = dt_find_prop(node, name);
+	if (!prop || prop->size != 4)
+		return -1;
+	*out = dt_rd32((u8 *) prop->data);
+	return 0;
+}
@@ -87,7 +87,7 @@ int prop_cb(const char *name, u8 *data, u32 size, void *cookie) {
 }
 
 int main(int argc, char **argv) {
-	devicetree_t dt;
+	devicetree_t dt = { 0 };
 	dt_slice_t s;
 
 	dt.error = error;
@@ -44,20 +44,79 @@ struct devicetree_header {
 	u32 sz_struct;		// size of DT 'structure'
 };
 
+typedef struct dt_prop {
+	const char *name;
+	const u8 *data;
+	u32 size;
+} dt_prop_t;
+
+/* unflattened node, pointing back into the blob for names and data */
+typedef struct dt_node {
+	const char *name;	// includes the unit address, "" for the root
+	struct dt_node *parent;
+	struct dt_node *child;
+	struct dt_node *sibling;
+	dt_prop_t *props;
+	u32 nprops;
+	u32 phandle;		// 0 if the node has none
+	u32 hash;		// of the full path, for the path table
+} dt_node_t;
+
+struct dt_compat {
+	const char *compat;
+	dt_node_t *node;
+};
+
 typedef struct devicetree {
 	dt_slice_t top;
 	dt_slice_t dt;
 	dt_slice_t ds;
 	struct devicetree_header hdr;
 	void (*error)(const char *msg);
+
+	/* optional memory for the index, for use before the heap is up.
+	 * if NULL the index is malloc()ed */
+	void *pool;
+	u32 pool_size;
+
+	/* index built by dt_init(), nodes are in tree order */
+	dt_node_t *nodes;
+	u32 nnodes;
+	dt_prop_t *props;
+	u32 nprops;
+	dt_node_t **path_table;	// open addressed by path hash
+	u32 path_table_size;
+	dt_node_t **phandles;	// sorted by phandle
+	u32 nphandles;
+	struct dt_compat *compat;	// sorted by compatible string
+	u32 ncompat;
+	void *alloc;
 } devicetree_t;
 
 typedef int (*dt_node_cb)(int depth, const char *name, void *cookie);
 typedef int (*dt_prop_cb)(const char *name, u8 *data, u32 size, void *cookie);
 
+/* check the header and build the node index. everything but error, pool
+ * and pool_size must be zero on entry. returns 0 if successful */
 int dt_init(devicetree_t *dt, void *data, u32 len);
+void dt_free(devicetree_t *dt);
+
 int dt_walk(devicetree_t *dt, dt_node_cb ncb, dt_prop_cb pcb, void *cookie);
 
+/* lookups on the index. paths are absolute, a component without a unit
+ * address matches a node with one, as in "/memory" for "/memory@40000000" */
+dt_node_t *dt_find_node(devicetree_t *dt, const char *path);
+dt_node_t *dt_find_phandle(devicetree_t *dt, u32 phandle);
+
+/* next node after from (or the first one if NULL) in tree order with
+ * compat in its compatible list */
+dt_node_t *dt_find_compatible(devicetree_t *dt, dt_node_t *from, const char *compat);
+
+dt_prop_t *dt_find_prop(dt_node_t *node, const char *name);
+
+/* read a single cell property, returning 0 if successful */
+int dt_prop_u32(dt_node_t *node, const char *name, u32 *out);
+
 u32 dt_rd32(u8 *data);
 void dt_wr32(u32 n, u8 *data);
 
@@ -22,25 +22,28 @@
  */
 #include <debug.h>
 #include <stddef.h>
-#include <list.h>
 #include <malloc.h>
 #include <err.h>
 #include <lib/dpc.h>
-#include <kernel/thread.h>
-#include <kernel/event.h>
-#include <lk/init.h>
+#include <lib/workqueue.h>
 
+/* dpcs are plain work items on the system work queue, run on the cpu that queued them */
 struct dpc {
-    struct list_node node;
+    work_t work;
 
     dpc_callback cb;
     void *arg;
 };
 
-static struct list_node dpc_list = LIST_INITIAL_VALUE(dpc_list);
-static event_t dpc_event;
+static void dpc_work(void *arg)
+{
+    struct dpc *dpc = arg;
+
+//  dprintf("dpc calling %p, arg %p\n", dpc->cb, dpc->arg);
+    dpc->cb(dpc->arg);
 
-static int dpc_thread_routine(void *arg);
+    free(dpc);
+}
 
 status_t dpc_queue(dpc_callback cb, void *arg, uint flags)
 {
@@ -53,43 +56,8 @@ status_t dpc_queue(dpc_callback cb, void *arg, uint flags)
 
     dpc->cb = cb;
     dpc->arg = arg;
-    enter_critical_section();
-    list_add_tail(&dpc_list, &dpc->node);
-    event_signal(&dpc_event, (flags & DPC_FLAG_NORESCHED) ? false : true);
-    exit_critical_section();
+    work_init(&dpc->work, &dpc_work, dpc);
 
-    return NO_ERROR;
+    return workqueue_queue(system_workqueue, &dpc->work,
+                           (flags & DPC_FLAG_NORESCHED) ? WORKQUEUE_QUEUE_NORESCHED : 0);
 }
-
-static int dpc_thread_routine(void *arg)
-{
-    for (;;) {
-        event_wait(&dpc_event);
-
-        enter_critical_section();
-        struct dpc *dpc = list_remove_head_type(&dpc_list, struct dpc, node);
-        if (!dpc)
-            event_unsignal(&dpc_event);
-        exit_critical_section();
-
-        if (dpc) {
-//          dprintf("dpc calling %p, arg %p\n", dpc->cb, dpc->arg);
-            dpc->cb(dpc->arg);
-
-            free(dpc);
-        }
-    }
-
-    return 0;
-}
-
-static void dpc_init(uint level)
-{
-    event_init(&dpc_event, false, 0);
-
-    thread_detach_and_resume(thread_create("dpc", &dpc_thread_routine, NULL, DPC_PRIORITY, DEFAULT_STACK_SIZE));
-}
-
-LK_INIT_HOOK(libdpc, &dpc_init, LK_INIT_LEVEL_THREADING);
-
-
@@ -29,9 +29,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <arch/ops.h>
+#include <kernel/thread.h>
+
+#if ELF_SEGMENT_HASH
+#include <lib/mincrypt/sha256.h>
+#endif
 
 #define LOCAL_TRACE 0
 
+/* most threads that work on a parallel load, including the caller */
+#ifndef ELF_LOAD_THREADS
+#define ELF_LOAD_THREADS SMP_MAX_CPUS
+#endif
+
+/* granularity of reads while hashing, small enough to still be in cache */
+#ifndef ELF_HASH_CHUNK_SIZE
+#define ELF_HASH_CHUNK_SIZE (64*1024)
+#endif
+
 /* conditionally define a 32 or 64 bit version of the data structures
  * we care about, based on our bitness.
  */
@@ -181,6 +196,99 @@ static int verify_eheader(const void *header)
     return NO_ERROR;
 }
 
+struct elf_load_job {
+    uint seg;       // index into pheaders
+    uint8_t *ptr;   // where the segment goes
+    bool zero;      // zero the bss past filesz instead of reading the file part
+};
+
+struct elf_load_state {
+    elf_handle_t *handle;
+    struct elf_load_job jobs[ELF_MAX_PHDRS * 2];
+    uint job_count;
+    int next_job;
+    status_t err;
+};
+
+static status_t elf_read_segment(elf_handle_t *handle, uint seg, uint8_t *ptr)
+{
+    elf_phdr_t *pheader = &handle->pheaders[seg];
+
+    LTRACEF("reading segment at offset " ELF_OFF_PRINT_U " to address %p\n", pheader->p_offset, ptr);
+
+#if ELF_SEGMENT_HASH
+    if (handle->hash_segments) {
+        // hash each piece right after it lands, rather than in a pass of its own
+        SHA256_CTX ctx;
+        SHA256_init(&ctx);
+        for (size_t pos = 0; pos < pheader->p_filesz; ) {
+            size_t len = MIN(pheader->p_filesz - pos, (size_t)ELF_HASH_CHUNK_SIZE);
+            ssize_t readerr = handle->read_hook(handle, ptr + pos, pheader->p_offset + pos, len);
+            if (readerr < (ssize_t)len) {
+                LTRACEF("error %ld reading program header %u\n", readerr, seg);
+                return (readerr < 0) ? readerr : ERR_IO;
+            }
+            SHA256_update(&ctx, ptr + pos, len);
+            pos += len;
+        }
+        memcpy(handle->segment_sha256[seg], SHA256_final(&ctx), sizeof(handle->segment_sha256[seg]));
+        return NO_ERROR;
+    }
+#endif
+
+    ssize_t readerr = handle->read_hook(handle, ptr, pheader->p_offset, pheader->p_filesz);
+    if (readerr < (ssize_t)pheader->p_filesz) {
+        LTRACEF("error %ld reading program header %u\n", readerr, seg);
+        return (readerr < 0) ? readerr : ERR_IO;
+    }
+
+    return NO_ERROR;
+}
+
+/* take jobs off the list until there are none left or one has failed */
+static int elf_load_worker(void *arg)
+{
+    struct elf_load_state *state = arg;
+    elf_handle_t *handle = state->handle;
+
+    for (;;) {
+        if (__atomic_load_n(&state->err, __ATOMIC_RELAXED) < 0)
+            break;
+
+        int job = __atomic_fetch_add(&state->next_job, 1, __ATOMIC_RELAXED);
+        if (job >= (int)state->job_count)
+            break;
+
+        const struct elf_load_job *j = &state->jobs[job];
+        elf_phdr_t *pheader = &handle->pheaders[j->seg];
+
+        uint8_t *start;
+        size_t len;
+        if (j->zero) {
+            // zero out the difference between memsz and filesz
+            start = j->ptr + pheader->p_filesz;
+            len = pheader->p_memsz - pheader->p_filesz;
+            LTRACEF("zeroing memory at %p, size %zu\n", start, len);
+            memset(start, 0, len);
+        } else {
+            start = j->ptr;
+            len = pheader->p_filesz;
+            status_t err = elf_read_segment(handle, j->seg, start);
+            if (err < 0) {
+                status_t expected = NO_ERROR;
+                __atomic_compare_exchange_n(&state->err, &expected, err, false,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+
+        // make sure the i&d cache are coherent, if they exist
+        arch_sync_cache_range((addr_t)start, len);
+    }
+
+    return 0;
+}
+
 status_t elf_load(elf_handle_t *handle)
 {
     if (!handle)
@@ -202,7 +310,7 @@ status_t elf_load(elf_handle_t *handle)
 
     // sanity check number of program headers
     LTRACEF("number of program headers %u, entry size %u\n", handle->eheader.e_phnum, handle->eheader.e_phentsize);
-    if (handle->eheader.e_phnum > 16 ||
+    if (handle->eheader.e_phnum > ELF_MAX_PHDRS ||
             handle->eheader.e_phentsize != sizeof(elf_phdr_t)) {
         LTRACEF("too many program headers or bad size\n");
         return ERR_NO_MEMORY;
@@ -222,6 +330,7 @@ status_t elf_load(elf_handle_t *handle)
     }
 
     LTRACEF("program headers:\n");
+    struct elf_load_state state = { .handle = handle, .next_job = 0, .err = NO_ERROR };
     uint load_count = 0;
     for (uint i = 0; i < handle->eheader.e_phnum; i++) {
         // parse the program headers
@@ -247,30 +356,40 @@ status_t elf_load(elf_handle_t *handle)
                 }
             }
 
-            // read the file portion of the segment into memory at vaddr
-            LTRACEF("reading segment at offset " ELF_OFF_PRINT_U " to address %p\n", pheader->p_offset, ptr);
-            readerr = handle->read_hook(handle, ptr, pheader->p_offset, pheader->p_filesz);
-            if (readerr < (ssize_t)pheader->p_filesz) {
-                LTRACEF("error %ld reading program header %u\n", readerr, i);
-                return (readerr < 0) ? readerr : ERR_IO;
-            }
-
-            // zero out he difference between memsz and filesz
-            size_t tozero = pheader->p_memsz - pheader->p_filesz;
-            if (tozero > 0) {
-                uint8_t *ptr2 = (uint8_t *)ptr + pheader->p_filesz;
-                LTRACEF("zeroing memory at %p, size %zu\n", ptr2, tozero);
-                memset(ptr2, 0, tozero);
-            }
-
-            // make sure the i&d cache are coherent, if they exist
-            arch_sync_cache_range((addr_t)ptr, pheader->p_memsz);
+            // queue up reading the file portion and zeroing the rest as separate jobs
+            state.jobs[state.job_count++] = (struct elf_load_job){ .seg = i, .ptr = ptr, .zero = false };
+            if (pheader->p_memsz > pheader->p_filesz)
+                state.jobs[state.job_count++] = (struct elf_load_job){ .seg = i, .ptr = ptr, .zero = true };
 
             // track the number of load segments we have seen to pass the mem alloc hook
             load_count++;
         }
     }
 
+    // run the jobs, with help from more threads if asked for
+    thread_t *helpers[ELF_LOAD_THREADS];
+    uint helper_count = 0;
+    if (handle->parallel_load) {
+        uint want = MIN(state.job_count, (uint)ELF_LOAD_THREADS);
+        for (uint i = 1; i < want; i++) {
+            thread_t *t = thread_create("elf loader", &elf_load_worker, &state,
+                                        get_current_thread()->base_priority, DEFAULT_STACK_SIZE);
+            if (!t)
+                break;
+            helpers[helper_count++] = t;
+            thread_resume(t);
+        }
+        LTRACEF("%u jobs on %u threads\n", state.job_count, helper_count + 1);
+    }
+
+    elf_load_worker(&state);
+
+    for (uint i = 0; i < helper_count; i++)
+        thread_join(helpers[i], NULL, INFINITE_TIME);
+
+    if (state.err < 0)
+        return state.err;
+
     // save the entry point
     handle->entry = handle->eheader.e_entry;
 
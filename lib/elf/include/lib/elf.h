@@ -33,6 +33,8 @@
 #define WITH_ELF32 1
 #endif
 
+#define ELF_MAX_PHDRS 16
+
 /* api */
 struct elf_handle;
 typedef ssize_t (*elf_read_hook_t)(struct elf_handle *, void *buf, uint64_t offset, size_t len);
@@ -50,6 +52,17 @@ typedef struct elf_handle {
     elf_mem_alloc_t mem_alloc_hook;
     void *mem_alloc_hook_arg;
 
+    // load segments and zero their bss on several threads at once. the read
+    // hook is then called concurrently and must be safe to do so.
+    bool parallel_load;
+
+#if ELF_SEGMENT_HASH
+    // compute the sha256 of the file contents of every PT_LOAD segment as it
+    // is read in, indexed like pheaders
+    bool hash_segments;
+    uint8_t segment_sha256[ELF_MAX_PHDRS][32];
+#endif
+
     // loaded info about the elf file
 #if WITH_ELF32
     struct Elf32_Ehdr eheader;    // a copy of the main elf header
@@ -5,4 +5,10 @@ MODULE := $(LOCAL_DIR)
 MODULE_SRCS += \
 	$(LOCAL_DIR)/elf.c
 
+# optionally hash segments while loading them, see elf_handle.hash_segments
+ifeq ($(ELF_SEGMENT_HASH),1)
+MODULE_DEPS += lib/mincrypt
+GLOBAL_DEFINES += ELF_SEGMENT_HASH=1
+endif
+
 include make/module.mk
@@ -37,6 +37,8 @@
 
 #include "font.h"
 
+#define FONT_GLYPHS (sizeof(FONT) / FONT_Y)
+
 /**
  * @brief Draw one character from the built-in font
  *
@@ -47,6 +49,9 @@ void font_draw_char(gfx_surface *surface, unsigned char c, int x, int y, uint32_
     uint i,j;
     uint line;
 
+    if (c >= FONT_GLYPHS)
+        c = ' ';
+
     // draw this char into a buffer
     for (i = 0; i < FONT_Y; i++) {
         line = FONT[c * FONT_Y + i];
@@ -59,4 +64,43 @@ void font_draw_char(gfx_surface *surface, unsigned char c, int x, int y, uint32_
     gfx_flush_rows(surface, y, y + FONT_Y);
 }
 
+/**
+ * @brief Render the built-in font into a surface of opaque glyph cells
+ *
+ * Drawing from this with font_draw_char_cached() is a row copy per line of
+ * the glyph instead of a bit test and pixel write per pixel.
+ *
+ * @ingroup graphics
+ */
+gfx_surface *font_render_glyphs(gfx_format format, uint32_t color, uint32_t back_color)
+{
+    gfx_surface *glyphs = gfx_create_surface(NULL, FONT_X, FONT_Y * FONT_GLYPHS, FONT_X, format);
+    if (!glyphs)
+        return NULL;
+
+    glyphs->fillrect(glyphs, 0, 0, glyphs->width, glyphs->height, back_color);
 
+    for (uint i = 0; i < FONT_Y * FONT_GLYPHS; i++) {
+        uint line = FONT[i];
+        for (uint j = 0; j < FONT_X; j++) {
+            if (line & 0x1)
+                glyphs->putpixel(glyphs, j, i, color);
+            line = line >> 1;
+        }
+    }
+
+    return glyphs;
+}
+
+/**
+ * @brief Draw one pre-rendered character cell
+ *
+ * @ingroup graphics
+ */
+void font_draw_char_cached(gfx_surface *surface, gfx_surface *glyphs, unsigned char c, int x, int y)
+{
+    if (c >= FONT_GLYPHS)
+        c = ' ';
+
+    gfx_surface_blit(surface, glyphs, 0, c * FONT_Y, FONT_X, FONT_Y, x, y);
+}
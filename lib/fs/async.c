@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Asynchronous file reads.
+ *
+ * The file range is translated into device extents with the fs's map hook, and each extent is
+ * read with one or more bio requests submitted back to back, so a read spanning many extents,
+ * or reads of several files, can all be in flight at once. Parts of an extent that don't start
+ * or end on a device block go through a one block bounce buffer. Holes are zero filled on the
+ * spot.
+ *
+ * Block requests may complete in interrupt context, so the read is finished off, the bounce
+ * buffers freed and the caller's callback run, from the system work queue.
+ */
+#include <debug.h>
+#include <trace.h>
+#include <err.h>
+#include <string.h>
+#include <stdlib.h>
+#include <platform.h>
+#include <lib/fs.h>
+#include <lib/bio.h>
+#include "fs_priv.h"
+
+#define LOCAL_TRACE 0
+
+struct fs_read_piece {
+    struct list_node node;
+    bio_request_t bio;
+    iovec_t iov;
+    fs_read_request_t *req;
+
+    /* for bounced pieces, where the wanted part of the block goes */
+    uint8_t *dst;
+    size_t skip;
+    size_t len;
+    uint8_t bounce[];
+};
+
+static void fs_read_finish(void *arg)
+{
+    fs_read_request_t *req = arg;
+
+    struct fs_read_piece *piece;
+    while ((piece = list_remove_head_type(&req->pieces, struct fs_read_piece, node)))
+        free(piece);
+
+    LTRACEF("req %p result %ld\n", req, req->error < 0 ? (long)req->error : (long)req->result);
+
+    if (req->error < 0)
+        req->result = req->error;
+
+    if (req->handle)
+        fs_stats_account(req->handle->mount, FS_OP_READ_ASYNC, req->handle, NULL, req->offset,
+                         req->len, req->start, req->result);
+
+    if (req->callback)
+        req->callback(req);
+    else
+        event_signal(&req->done, true);
+}
+
+/* drop a reference to the request, finishing it when it was the last */
+static void fs_read_put(fs_read_request_t *req, ssize_t error)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&req->lock, state);
+    if (error < 0 && req->error == 0)
+        req->error = error;
+    bool last = (--req->pending == 0);
+    spin_unlock_irqrestore(&req->lock, state);
+
+    if (last)
+        workqueue_queue(system_workqueue, &req->work, WORKQUEUE_QUEUE_NORESCHED);
+}
+
+static void fs_read_piece_done(bio_request_t *bio)
+{
+    struct fs_read_piece *piece = bio->cookie;
+    ssize_t error = 0;
+
+    if (bio->result < 0)
+        error = bio->result;
+    else if ((size_t)bio->result < piece->iov.iov_len)
+        error = ERR_IO;
+    else if (piece->dst)
+        memcpy(piece->dst, piece->bounce + piece->skip, piece->len);
+
+    fs_read_put(piece->req, error);
+}
+
+/* queue a read of count device blocks starting at block, into buf or a bounce buffer */
+static status_t fs_read_submit(fs_read_request_t *req, bdev_t *dev, bnum_t block, uint count,
+                               uint8_t *buf, bool bounce, size_t skip, size_t len)
+{
+    struct fs_read_piece *piece = calloc(1, sizeof(*piece) + (bounce ? dev->block_size : 0));
+    if (!piece)
+        return ERR_NO_MEMORY;
+
+    piece->req = req;
+    if (bounce) {
+        piece->dst = buf;
+        piece->skip = skip;
+        piece->len = len;
+        piece->iov.iov_base = piece->bounce;
+    } else {
+        piece->iov.iov_base = buf;
+    }
+    piece->iov.iov_len = (size_t)count * dev->block_size;
+
+    piece->bio.write = false;
+    piece->bio.block = block;
+    piece->bio.count = count;
+    piece->bio.iov = &piece->iov;
+    piece->bio.iov_cnt = 1;
+    piece->bio.callback = fs_read_piece_done;
+    piece->bio.cookie = piece;
+
+    /* the list is only looked at again once every piece has completed */
+    list_add_tail(&req->pieces, &piece->node);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&req->lock, state);
+    req->pending++;
+    spin_unlock_irqrestore(&req->lock, state);
+
+    status_t err = bio_submit(dev, &piece->bio);
+    if (err < 0) {
+        /* never going to complete */
+        spin_lock_irqsave(&req->lock, state);
+        list_delete(&piece->node);
+        req->pending--;
+        spin_unlock_irqrestore(&req->lock, state);
+        free(piece);
+    }
+
+    return err;
+}
+
+/* read an extent of the file found at dev_offset on the device */
+static status_t fs_read_extent(fs_read_request_t *req, bdev_t *dev, uint8_t *buf, off_t dev_offset, size_t len)
+{
+    size_t block_size = dev->block_size;
+    status_t err;
+
+    /* leading partial block */
+    size_t skip = dev_offset & (block_size - 1);
+    if (skip) {
+        size_t n = MIN(len, block_size - skip);
+        err = fs_read_submit(req, dev, dev_offset >> dev->block_shift, 1, buf, true, skip, n);
+        if (err < 0)
+            return err;
+
+        buf += n;
+        dev_offset += n;
+        len -= n;
+    }
+
+    /* whole blocks straight into the caller's buffer */
+    if (len >= block_size) {
+        size_t n = len & ~(block_size - 1);
+        err = fs_read_submit(req, dev, dev_offset >> dev->block_shift, n >> dev->block_shift, buf, false, 0, 0);
+        if (err < 0)
+            return err;
+
+        buf += n;
+        dev_offset += n;
+        len -= n;
+    }
+
+    /* trailing partial block */
+    if (len)
+        return fs_read_submit(req, dev, dev_offset >> dev->block_shift, 1, buf, true, 0, len);
+
+    return NO_ERROR;
+}
+
+status_t fs_read_file_async(filehandle *handle, fs_read_request_t *req)
+{
+    LTRACEF("handle %p req %p buf %p offset %lld len %zu\n", handle, req, req->buf, req->offset, req->len);
+
+    if (req->offset < 0)
+        return ERR_INVALID_ARGS;
+
+    struct fs_mount *mount = handle->mount;
+
+    event_init(&req->done, false, 0);
+    spin_lock_init(&req->lock);
+    req->pending = 1; /* held until everything has been submitted */
+    req->error = 0;
+    req->result = 0;
+    list_initialize(&req->pieces);
+    work_init(&req->work, fs_read_finish, req);
+    req->handle = NULL;
+    req->start = current_time_hires();
+
+    if (!mount->api->map || !mount->dev) {
+        /* nothing to go on, read it here and now */
+        ssize_t err = fs_read_file(handle, req->buf, req->offset, req->len);
+        if (err >= 0)
+            req->result = err;
+        fs_read_put(req, err);
+        return NO_ERROR;
+    }
+
+    /* accounted on completion, the synchronous read above counts itself */
+    req->handle = handle;
+
+    uint8_t *buf = req->buf;
+    size_t done = 0;
+    ssize_t err = 0;
+    while (done < req->len) {
+        off_t dev_offset;
+        err = mount->api->map(handle->cookie, req->offset + done, req->len - done, &dev_offset);
+        if (err <= 0)
+            break;
+
+        size_t n = MIN((size_t)err, req->len - done);
+        LTRACEF("extent: file offset %lld, dev offset %lld, len %zu\n", req->offset + done, dev_offset, n);
+
+        if (dev_offset < 0) {
+            memset(buf + done, 0, n);
+        } else {
+            err = fs_read_extent(req, mount->dev, buf + done, dev_offset, n);
+            if (err < 0)
+                break;
+        }
+
+        done += n;
+    }
+
+    /* if nothing went out, it is not going to complete */
+    if (err < 0 && list_is_empty(&req->pieces))
+        return err;
+
+    req->result = done;
+    fs_read_put(req, err < 0 ? err : 0);
+
+    return NO_ERROR;
+}
+
+ssize_t fs_read_request_wait(fs_read_request_t *req)
+{
+    DEBUG_ASSERT(!req->callback);
+
+    event_wait(&req->done);
+    event_destroy(&req->done);
+
+    return req->result;
+}
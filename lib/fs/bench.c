@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * 'fs bench': throughput and latency of a mounted file system, through the public fs api.
+ *
+ * Every workload is timed an operation at a time. Latencies of up to BENCH_LATENCY_SAMPLES
+ * operations are kept, picked uniformly when there are more, for the percentiles.
+ */
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <platform.h>
+#include <lib/console.h>
+#include <lib/fs.h>
+
+#if WITH_LIB_CONSOLE
+
+#define BENCH_DEFAULT_FILE_SIZE (1024 * 1024)
+#define BENCH_DEFAULT_IO_SIZE (4096)
+#define BENCH_DEFAULT_FILES (100)
+#define BENCH_LATENCY_SAMPLES (4096)
+
+struct bench_stats {
+    const char *name;
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t errors;
+    lk_bigtime_t start;
+    lk_bigtime_t elapsed;
+
+    uint32_t min_latency;
+    uint32_t max_latency;
+    uint64_t samples_seen;
+    uint32_t *samples;
+};
+
+static uint64_t bench_rand(void)
+{
+    return ((uint64_t)rand() << 31) ^ rand();
+}
+
+static void bench_begin(struct bench_stats *stats, const char *name, uint32_t *samples)
+{
+    *stats = (struct bench_stats) {
+        .name = name,
+        .min_latency = UINT32_MAX,
+        .samples = samples,
+    };
+    stats->start = current_time_hires();
+}
+
+/* account one operation that started at op_start and moved len bytes, or failed */
+static void bench_record(struct bench_stats *stats, lk_bigtime_t op_start, ssize_t len)
+{
+    uint32_t latency = MIN(current_time_hires() - op_start, UINT32_MAX);
+
+    if (len < 0) {
+        stats->errors++;
+        return;
+    }
+
+    stats->ops++;
+    stats->bytes += len;
+    stats->min_latency = MIN(stats->min_latency, latency);
+    stats->max_latency = MAX(stats->max_latency, latency);
+
+    stats->samples_seen++;
+    if (stats->samples_seen <= BENCH_LATENCY_SAMPLES) {
+        stats->samples[stats->samples_seen - 1] = latency;
+    } else {
+        uint64_t r = bench_rand() % stats->samples_seen;
+        if (r < BENCH_LATENCY_SAMPLES)
+            stats->samples[r] = latency;
+    }
+}
+
+static int bench_cmp_latency(const void *a, const void *b)
+{
+    uint32_t la = *(const uint32_t *)a;
+    uint32_t lb = *(const uint32_t *)b;
+
+    return (la > lb) - (la < lb);
+}
+
+static void bench_end(struct bench_stats *stats)
+{
+    stats->elapsed = MAX(current_time_hires() - stats->start, 1U);
+
+    uint64_t ops_per_sec = stats->ops * 1000000 / stats->elapsed;
+    printf("%-10s %8llu ops %6llu errors %8llu.%03llu ms %8llu ops/s", stats->name,
+           stats->ops, stats->errors, stats->elapsed / 1000, stats->elapsed % 1000, ops_per_sec);
+    if (stats->bytes > 0) {
+        uint64_t bytes_per_sec = stats->bytes * 1000000 / stats->elapsed;
+        printf(" %6llu.%02llu MB/s", bytes_per_sec / 1000000, (bytes_per_sec % 1000000) / 10000);
+    }
+    printf("\n");
+
+    uint sample_count = MIN(stats->samples_seen, BENCH_LATENCY_SAMPLES);
+    if (sample_count > 0) {
+        qsort(stats->samples, sample_count, sizeof(uint32_t), bench_cmp_latency);
+        printf("%-10s latency usecs: min %u p50 %u p90 %u p99 %u max %u\n", "",
+               stats->min_latency, stats->samples[sample_count * 50 / 100],
+               stats->samples[sample_count * 90 / 100], stats->samples[sample_count * 99 / 100],
+               stats->max_latency);
+    }
+}
+
+/* sequential write, sequential read and random read of one file of file_size bytes */
+static status_t bench_data(const char *path, uint32_t *samples, uint8_t *buf,
+                           size_t file_size, size_t io_size)
+{
+    struct bench_stats stats;
+    filehandle *handle;
+    size_t ios = file_size / io_size;
+
+    lk_bigtime_t t = current_time_hires();
+    status_t err = fs_create_file(path, &handle, 0);
+    if (err < 0) {
+        printf("error %d creating '%s'\n", err, path);
+        return err;
+    }
+
+    bench_begin(&stats, "seqwrite", samples);
+    for (size_t i = 0; i < ios; i++) {
+        memset(buf, i, io_size);
+        t = current_time_hires();
+        ssize_t len = fs_write_file(handle, buf, (off_t)i * io_size, io_size);
+        bench_record(&stats, t, len == (ssize_t)io_size ? len : ERR_IO);
+    }
+    bench_end(&stats);
+
+    /* read it back through a fresh handle, as a reader other than the writer would */
+    fs_close_file(handle);
+    err = fs_open_file(path, &handle);
+    if (err < 0) {
+        printf("error %d opening '%s'\n", err, path);
+        return err;
+    }
+
+    bench_begin(&stats, "seqread", samples);
+    for (size_t i = 0; i < ios; i++) {
+        t = current_time_hires();
+        ssize_t len = fs_read_file(handle, buf, (off_t)i * io_size, io_size);
+        bench_record(&stats, t, len == (ssize_t)io_size ? len : ERR_IO);
+    }
+    bench_end(&stats);
+
+    bench_begin(&stats, "randread", samples);
+    for (size_t i = 0; i < ios; i++) {
+        off_t off = (off_t)(bench_rand() % ios) * io_size;
+        t = current_time_hires();
+        ssize_t len = fs_read_file(handle, buf, off, io_size);
+        bench_record(&stats, t, len == (ssize_t)io_size ? len : ERR_IO);
+    }
+    bench_end(&stats);
+
+    fs_close_file(handle);
+
+    return fs_remove_file(path);
+}
+
+/* create, look up and delete count empty files in dir */
+static status_t bench_files(const char *dir, uint32_t *samples, uint count)
+{
+    struct bench_stats stats;
+    char *path = malloc(FS_MAX_PATH_LEN);
+    if (!path)
+        return ERR_NO_MEMORY;
+
+    bench_begin(&stats, "create", samples);
+    for (uint i = 0; i < count; i++) {
+        snprintf(path, FS_MAX_PATH_LEN, "%s/fsbench.%u", dir, i);
+
+        filehandle *handle;
+        lk_bigtime_t t = current_time_hires();
+        status_t err = fs_create_file(path, &handle, 0);
+        if (err >= 0)
+            fs_close_file(handle);
+        bench_record(&stats, t, err < 0 ? err : 0);
+    }
+    bench_end(&stats);
+
+    /* look them up in a different order than they were made */
+    bench_begin(&stats, "lookup", samples);
+    for (uint i = 0; i < count; i++) {
+        snprintf(path, FS_MAX_PATH_LEN, "%s/fsbench.%u", dir, (uint)(bench_rand() % count));
+
+        filehandle *handle;
+        lk_bigtime_t t = current_time_hires();
+        status_t err = fs_open_file(path, &handle);
+        if (err >= 0)
+            fs_close_file(handle);
+        bench_record(&stats, t, err < 0 ? err : 0);
+    }
+    bench_end(&stats);
+
+    bench_begin(&stats, "delete", samples);
+    for (uint i = 0; i < count; i++) {
+        snprintf(path, FS_MAX_PATH_LEN, "%s/fsbench.%u", dir, i);
+
+        lk_bigtime_t t = current_time_hires();
+        status_t err = fs_remove_file(path);
+        bench_record(&stats, t, err < 0 ? err : 0);
+    }
+    bench_end(&stats);
+
+    free(path);
+    return stats.errors ? ERR_IO : NO_ERROR;
+}
+
+int fs_bench(int argc, const cmd_args *argv)
+{
+    if (argc < 3) {
+        printf("not enough arguments\n");
+        printf("usage: %s bench <dir> [file size] [io size] [files]\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    const char *dir = argv[2].str;
+    size_t file_size = (argc >= 4) ? argv[3].u : BENCH_DEFAULT_FILE_SIZE;
+    size_t io_size = (argc >= 5) ? argv[4].u : BENCH_DEFAULT_IO_SIZE;
+    uint files = (argc >= 6) ? argv[5].u : BENCH_DEFAULT_FILES;
+
+    if (io_size == 0 || file_size < io_size) {
+        printf("file size must be at least one io of a non zero size\n");
+        return ERR_INVALID_ARGS;
+    }
+
+    status_t err = ERR_NO_MEMORY;
+    uint32_t *samples = malloc(BENCH_LATENCY_SAMPLES * sizeof(uint32_t));
+    uint8_t *buf = malloc(io_size);
+    char *path = malloc(FS_MAX_PATH_LEN);
+    if (!samples || !buf || !path)
+        goto out;
+
+    printf("benchmarking '%s': file size %zu, io size %zu, %u files\n", dir, file_size,
+           io_size, files);
+
+    snprintf(path, FS_MAX_PATH_LEN, "%s/fsbench.dat", dir);
+    err = bench_data(path, samples, buf, file_size, io_size);
+    if (err >= 0 && files > 0)
+        err = bench_files(dir, samples, files);
+
+out:
+    free(path);
+    free(buf);
+    free(samples);
+    return err;
+}
+
+#endif
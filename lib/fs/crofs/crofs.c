@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * crofs, a read only file system of block compressed files, see crofs_fs.h for the image
+ * format.
+ *
+ * The file table is read in at mount and the block index of a file when it is opened, so
+ * finding the data for any offset costs no device reads. Reads go through the page cache,
+ * whose fills read and inflate just the blocks they cover. The most recently inflated block
+ * is kept, since a block is usually larger than a cache page and its pages tend to be
+ * filled one after another.
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <debug.h>
+#include <endian.h>
+#include <err.h>
+#include <trace.h>
+#include <lib/bio.h>
+#include <lib/fs.h>
+#include <lib/miniz.h>
+#include <kernel/mutex.h>
+#include "crofs_fs.h"
+
+#define LOCAL_TRACE 0
+
+typedef struct {
+    bdev_t *dev;
+    struct crofs_super sb;
+    struct crofs_file_entry *files;
+    size_t block_size;
+
+    /* serializes use of the buffers and the inflator */
+    mutex_t lock;
+    tinfl_decompressor *inflator;
+    uint8_t *zbuf;          // compressed data of one block
+    uint8_t *block;         // the last block inflated
+    int block_file;         // and where it came from, -1 if nothing
+    uint32_t block_num;
+
+    struct {
+        uint blocks_inflated;
+        uint blocks_stored;
+        uint block_hits;
+        uint64_t bytes_read;
+    } stats;
+} crofs_t;
+
+typedef struct {
+    crofs_t *fs;
+    uint num;               // index into the file table, names the contents for the page cache
+    uint32_t block_count;
+    uint32_t *index;        // block_count + 1 offsets
+} crofs_file_t;
+
+struct dircookie {
+    crofs_t *fs;
+    char prefix[CROFS_NAME_LEN + 1];
+    size_t prefix_len;
+    uint next;
+
+    // subdirectory returned last, later names in it are skipped
+    char last_dir[CROFS_NAME_LEN + 1];
+};
+
+static inline uint64_t file_size(const struct crofs_file_entry *e)
+{
+    return e->size;
+}
+
+static size_t entry_name_len(const struct crofs_file_entry *e)
+{
+    return strnlen(e->name, CROFS_NAME_LEN);
+}
+
+static int compare_name(const char *name, size_t namelen, const struct crofs_file_entry *e)
+{
+    size_t elen = entry_name_len(e);
+    int c = memcmp(name, e->name, MIN(namelen, elen));
+    if (c)
+        return c;
+    return (namelen > elen) - (namelen < elen);
+}
+
+/* binary search the sorted file table */
+static int find_file(crofs_t *fs, const char *name)
+{
+    size_t namelen = strlen(name);
+    if (namelen > CROFS_NAME_LEN)
+        return ERR_NOT_FOUND;
+
+    uint lo = 0, hi = fs->sb.file_count;
+    while (lo < hi) {
+        uint mid = lo + (hi - lo) / 2;
+        int c = compare_name(name, namelen, &fs->files[mid]);
+        if (c == 0)
+            return mid;
+        if (c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return ERR_NOT_FOUND;
+}
+
+static status_t read_exact(crofs_t *fs, void *buf, off_t offset, size_t len)
+{
+    ssize_t err = bio_read(fs->dev, buf, offset, len);
+    if (err < 0)
+        return err;
+    if ((size_t)err != len)
+        return ERR_IO;
+
+    fs->stats.bytes_read += len;
+    return NO_ERROR;
+}
+
+static void crofs_free(crofs_t *fs)
+{
+    free(fs->files);
+    free(fs->inflator);
+    free(fs->zbuf);
+    free(fs->block);
+    free(fs);
+}
+
+static status_t crofs_mount(bdev_t *dev, fscookie **cookie)
+{
+    LTRACEF("dev %p\n", dev);
+
+    if (!dev)
+        return ERR_NOT_FOUND;
+
+    crofs_t *fs = calloc(1, sizeof(crofs_t));
+    if (!fs)
+        return ERR_NO_MEMORY;
+
+    fs->dev = dev;
+    fs->block_file = -1;
+    mutex_init(&fs->lock);
+
+    status_t err = read_exact(fs, &fs->sb, 0, sizeof(fs->sb));
+    if (err < 0)
+        goto err;
+
+    LE32SWAP(fs->sb.magic);
+    LE32SWAP(fs->sb.version);
+    LE32SWAP(fs->sb.block_shift);
+    LE32SWAP(fs->sb.file_count);
+    LE32SWAP(fs->sb.files_offset);
+    LE32SWAP(fs->sb.image_size);
+
+    if (fs->sb.magic != CROFS_MAGIC || fs->sb.version != CROFS_VERSION ||
+            fs->sb.block_shift < CROFS_MIN_BLOCK_SHIFT || fs->sb.block_shift > CROFS_MAX_BLOCK_SHIFT ||
+            fs->sb.image_size > dev->total_size) {
+        LTRACEF("bad superblock, magic 0x%x version %u\n", fs->sb.magic, fs->sb.version);
+        err = ERR_NOT_VALID;
+        goto err;
+    }
+    fs->block_size = 1U << fs->sb.block_shift;
+
+    size_t table_len = (size_t)fs->sb.file_count * sizeof(struct crofs_file_entry);
+    if (table_len / sizeof(struct crofs_file_entry) != fs->sb.file_count ||
+            (uint64_t)fs->sb.files_offset + table_len > fs->sb.image_size) {
+        err = ERR_NOT_VALID;
+        goto err;
+    }
+
+    fs->files = malloc(MAX(table_len, 1U));
+    fs->inflator = malloc(sizeof(tinfl_decompressor));
+    fs->zbuf = malloc(fs->block_size);
+    fs->block = malloc(fs->block_size);
+    if (!fs->files || !fs->inflator || !fs->zbuf || !fs->block) {
+        err = ERR_NO_MEMORY;
+        goto err;
+    }
+
+    err = read_exact(fs, fs->files, fs->sb.files_offset, table_len);
+    if (err < 0)
+        goto err;
+
+    for (uint i = 0; i < fs->sb.file_count; i++) {
+        fs->files[i].size = LE64(fs->files[i].size);
+        LE32SWAP(fs->files[i].index_offset);
+    }
+
+    LTRACEF("%u files, block size %zu\n", fs->sb.file_count, fs->block_size);
+
+    *cookie = (fscookie *)fs;
+    return NO_ERROR;
+
+err:
+    crofs_free(fs);
+    return err;
+}
+
+static status_t crofs_unmount(fscookie *cookie)
+{
+    crofs_t *fs = (crofs_t *)cookie;
+
+    LTRACEF("cookie %p: %u blocks inflated, %u stored, %u hits, %llu bytes read\n", fs,
+            fs->stats.blocks_inflated, fs->stats.blocks_stored, fs->stats.block_hits,
+            fs->stats.bytes_read);
+
+    mutex_destroy(&fs->lock);
+    crofs_free(fs);
+
+    return NO_ERROR;
+}
+
+static status_t crofs_open(fscookie *cookie, const char *name, filecookie **fcookie)
+{
+    crofs_t *fs = (crofs_t *)cookie;
+
+    LTRACEF("cookie %p name '%s'\n", cookie, name);
+
+    int num = find_file(fs, trim_name(name));
+    if (num < 0)
+        return num;
+
+    const struct crofs_file_entry *e = &fs->files[num];
+    uint64_t block_count = (file_size(e) + fs->block_size - 1) >> fs->sb.block_shift;
+    size_t index_len = (block_count + 1) * sizeof(uint32_t);
+    if (block_count >= UINT32_MAX / sizeof(uint32_t) ||
+            (uint64_t)e->index_offset + index_len > fs->sb.image_size)
+        return ERR_NOT_VALID;
+
+    crofs_file_t *file = malloc(sizeof(crofs_file_t));
+    uint32_t *index = malloc(index_len);
+    if (!file || !index) {
+        free(file);
+        free(index);
+        return ERR_NO_MEMORY;
+    }
+
+    mutex_acquire(&fs->lock);
+    status_t err = read_exact(fs, index, e->index_offset, index_len);
+    mutex_release(&fs->lock);
+
+    /* the blocks must follow each other inside the image, none bigger than it was raw */
+    for (uint32_t i = 0; err >= 0 && i <= block_count; i++) {
+        index[i] = LE32(index[i]);
+        if (index[i] > fs->sb.image_size ||
+                (i > 0 && (index[i] <= index[i - 1] || index[i] - index[i - 1] > fs->block_size)))
+            err = ERR_NOT_VALID;
+    }
+    if (err < 0) {
+        free(file);
+        free(index);
+        return err;
+    }
+
+    file->fs = fs;
+    file->num = num;
+    file->block_count = block_count;
+    file->index = index;
+    *fcookie = (filecookie *)file;
+
+    return NO_ERROR;
+}
+
+static status_t crofs_close(filecookie *fcookie)
+{
+    crofs_file_t *file = (crofs_file_t *)fcookie;
+
+    free(file->index);
+    free(file);
+
+    return NO_ERROR;
+}
+
+static size_t block_len(crofs_file_t *file, uint32_t block)
+{
+    uint64_t start = (uint64_t)block << file->fs->sb.block_shift;
+    return MIN(file->fs->block_size, file_size(&file->fs->files[file->num]) - start);
+}
+
+/* read block of file into dst, inflating it if it was stored compressed */
+static status_t load_block_locked(crofs_file_t *file, uint32_t block, uint8_t *dst)
+{
+    crofs_t *fs = file->fs;
+    size_t len = block_len(file, block);
+    size_t zlen = file->index[block + 1] - file->index[block];
+
+    LTRACEF("file %u block %u, %zu bytes stored for %zu\n", file->num, block, zlen, len);
+
+    /* didn't compress, read it in place */
+    if (zlen == len) {
+        fs->stats.blocks_stored++;
+        return read_exact(fs, dst, file->index[block], len);
+    }
+
+    status_t err = read_exact(fs, fs->zbuf, file->index[block], zlen);
+    if (err < 0)
+        return err;
+
+    tinfl_init(fs->inflator);
+    size_t in_len = zlen;
+    size_t out_len = len;
+    tinfl_status status = tinfl_decompress(fs->inflator, fs->zbuf, &in_len, dst, dst, &out_len,
+                                           TINFL_FLAG_PARSE_ZLIB_HEADER |
+                                           TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    if (status == TINFL_STATUS_ADLER32_MISMATCH)
+        return ERR_CHECKSUM_FAIL;
+    if (status != TINFL_STATUS_DONE || out_len != len)
+        return ERR_NOT_VALID;
+
+    fs->stats.blocks_inflated++;
+    return NO_ERROR;
+}
+
+/* page cache fill routine, also used directly for reads too big for the cache */
+static ssize_t crofs_fill(void *arg, void *_buf, off_t offset, size_t len)
+{
+    crofs_file_t *file = (crofs_file_t *)arg;
+    crofs_t *fs = file->fs;
+    uint8_t *buf = _buf;
+    uint64_t size = file_size(&fs->files[file->num]);
+
+    if ((uint64_t)offset >= size)
+        return 0;
+    len = MIN(len, size - offset);
+
+    mutex_acquire(&fs->lock);
+
+    status_t err = NO_ERROR;
+    size_t done = 0;
+    while (done < len) {
+        uint32_t block = (offset + done) >> fs->sb.block_shift;
+        size_t block_off = (offset + done) & (fs->block_size - 1);
+        size_t blen = block_len(file, block);
+        size_t n = MIN(len - done, blen - block_off);
+        bool cached = (fs->block_file == (int)file->num && fs->block_num == block);
+
+        if (cached) {
+            fs->stats.block_hits++;
+        } else if (block_off == 0 && n == blen) {
+            /* whole block wanted, straight into the caller's buffer */
+            err = load_block_locked(file, block, buf + done);
+            if (err < 0)
+                break;
+            done += n;
+            continue;
+        } else {
+            fs->block_file = -1;
+            err = load_block_locked(file, block, fs->block);
+            if (err < 0)
+                break;
+            fs->block_file = file->num;
+            fs->block_num = block;
+        }
+
+        memcpy(buf + done, fs->block + block_off, n);
+        done += n;
+    }
+
+    mutex_release(&fs->lock);
+
+    return done ? (ssize_t)done : err;
+}
+
+static ssize_t crofs_read(filecookie *fcookie, void *buf, off_t offset, size_t len)
+{
+    crofs_file_t *file = (crofs_file_t *)fcookie;
+
+    LTRACEF("file %u offset %lld len %zu\n", file->num, offset, len);
+
+    /* the image never changes, the table index names the contents for good */
+    return fs_pcache_read((fscookie *)file->fs, file->num, file_size(&file->fs->files[file->num]),
+                          buf, offset, len, crofs_fill, file);
+}
+
+static status_t crofs_stat(filecookie *fcookie, struct file_stat *stat)
+{
+    crofs_file_t *file = (crofs_file_t *)fcookie;
+    crofs_t *fs = file->fs;
+
+    stat->is_dir = false;
+    stat->size = file_size(&fs->files[file->num]);
+    stat->capacity = file->index[file->block_count] - file->index[0];
+
+    return NO_ERROR;
+}
+
+static status_t crofs_fs_stat(fscookie *cookie, struct fs_stat *stat)
+{
+    crofs_t *fs = (crofs_t *)cookie;
+
+    stat->total_space = fs->sb.image_size;
+    stat->free_space = 0;
+    stat->total_inodes = fs->sb.file_count;
+    stat->free_inodes = 0;
+
+    return NO_ERROR;
+}
+
+static status_t crofs_opendir(fscookie *cookie, const char *name, dircookie **dcookie)
+{
+    crofs_t *fs = (crofs_t *)cookie;
+
+    LTRACEF("cookie %p name '%s'\n", cookie, name);
+
+    name = trim_name(name);
+    size_t len = strlen(name);
+    while (len > 0 && name[len - 1] == '/')
+        len--;
+    if (len + 1 > CROFS_NAME_LEN)
+        return ERR_NOT_FOUND;
+
+    dircookie *dir = calloc(1, sizeof(*dir));
+    if (!dir)
+        return ERR_NO_MEMORY;
+
+    dir->fs = fs;
+    memcpy(dir->prefix, name, len);
+    if (len > 0)
+        dir->prefix[len++] = '/';
+    dir->prefix_len = len;
+
+    /* names under the directory sort together, start at the first of them */
+    uint lo = 0, hi = fs->sb.file_count;
+    while (lo < hi) {
+        uint mid = lo + (hi - lo) / 2;
+        if (compare_name(dir->prefix, len, &fs->files[mid]) > 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    dir->next = lo;
+
+    /* a directory only exists if something is in it, the root always does */
+    if (len > 0 && (lo == fs->sb.file_count || strncmp(fs->files[lo].name, dir->prefix, len))) {
+        free(dir);
+        return ERR_NOT_FOUND;
+    }
+
+    *dcookie = dir;
+
+    return NO_ERROR;
+}
+
+static status_t crofs_readdir(dircookie *dir, struct dirent *ent)
+{
+    crofs_t *fs = dir->fs;
+
+    while (dir->next < fs->sb.file_count) {
+        const struct crofs_file_entry *e = &fs->files[dir->next];
+        size_t elen = entry_name_len(e);
+        if (elen <= dir->prefix_len || strncmp(e->name, dir->prefix, dir->prefix_len))
+            break;
+        dir->next++;
+
+        /* report the first level below the directory, subdirectories once */
+        const char *rest = e->name + dir->prefix_len;
+        size_t rest_len = elen - dir->prefix_len;
+        const char *slash = memchr(rest, '/', rest_len);
+        if (slash) {
+            rest_len = slash - rest;
+            if (strlen(dir->last_dir) == rest_len && !memcmp(dir->last_dir, rest, rest_len))
+                continue;
+            memcpy(dir->last_dir, rest, rest_len);
+            dir->last_dir[rest_len] = '\0';
+        }
+
+        rest_len = MIN(rest_len, sizeof(ent->name) - 1);
+        memcpy(ent->name, rest, rest_len);
+        ent->name[rest_len] = '\0';
+        return NO_ERROR;
+    }
+
+    return ERR_NOT_FOUND;
+}
+
+static status_t crofs_closedir(dircookie *dir)
+{
+    free(dir);
+
+    return NO_ERROR;
+}
+
+static const struct fs_api crofs_api = {
+    .mount = crofs_mount,
+    .unmount = crofs_unmount,
+    .open = crofs_open,
+    .close = crofs_close,
+    .read = crofs_read,
+    .stat = crofs_stat,
+    .fs_stat = crofs_fs_stat,
+
+    .opendir = crofs_opendir,
+    .readdir = crofs_readdir,
+    .closedir = crofs_closedir,
+};
+
+STATIC_FS_IMPL(crofs, &crofs_api);
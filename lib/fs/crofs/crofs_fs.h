@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * On disk format of crofs, a read only file system of block compressed files.
+ *
+ * All fields are little endian and all offsets are from the start of the image.
+ *
+ * The image starts with the superblock, which points at a table of file entries sorted by
+ * name. Names are full paths below the root without a leading '/'; directories are not
+ * stored and exist as the prefixes of the names.
+ *
+ * Every file is cut into blocks of (1 << block_shift) bytes, the last one possibly shorter,
+ * and each block is compressed as a zlib stream on its own. The file's block index holds
+ * block count + 1 offsets, block i taking up the bytes from index[i] up to index[i + 1].
+ * A block that didn't get any smaller is stored as is and is recognized by its stored
+ * length being its full length.
+ *
+ * tools/mkcrofs.py builds images.
+ */
+
+#define CROFS_MAGIC         0x73666f72 // "rofs"
+#define CROFS_VERSION       1
+#define CROFS_NAME_LEN      64
+
+#define CROFS_MIN_BLOCK_SHIFT 12
+#define CROFS_MAX_BLOCK_SHIFT 17
+
+struct crofs_super {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_shift;
+    uint32_t file_count;
+    uint32_t files_offset;
+    uint32_t image_size;
+};
+
+struct crofs_file_entry {
+    char name[CROFS_NAME_LEN]; // nul padded
+    uint64_t size;
+    uint32_t index_offset;
+    uint32_t reserved;
+};
@@ -0,0 +1,13 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_DEPS += \
+	lib/fs \
+	lib/bio \
+	lib/miniz
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/crofs.c
+
+include make/module.mk
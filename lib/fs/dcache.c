@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Name lookup cache shared by the filesystems.
+ *
+ * A filesystem looks up each component of a path in the directory found for the one before it.
+ * The cache remembers those steps by (filesystem, parent, name), where parent and the node it
+ * maps to are whatever the filesystem uses to find a directory or file again, such as an inode
+ * number. Misses are remembered as well, so opening a file that isn't there doesn't rescan the
+ * directory every time either.
+ *
+ * The entries live in a fixed table, recycled least recently used first. Names too long for an
+ * entry simply aren't cached. The fs layer drops a filesystem's entries when it is unmounted
+ * and whenever something is created or removed on it.
+ */
+#include <debug.h>
+#include <trace.h>
+#include <list.h>
+#include <err.h>
+#include <string.h>
+#include <lib/fs.h>
+#include <kernel/mutex.h>
+#include "fs_priv.h"
+
+#define LOCAL_TRACE 0
+
+#ifndef FS_DCACHE_ENTRIES
+#define FS_DCACHE_ENTRIES   128
+#endif
+#define FS_DCACHE_BUCKETS   32      // power of two
+#define FS_DCACHE_NAME_LEN  32
+
+struct dcache_entry {
+    struct list_node hash_node;
+    struct list_node lru_node;
+    fscookie *fs;               // NULL if unused
+    uint64_t parent;
+    uint64_t node;
+    bool exists;
+    uint8_t namelen;
+    char name[FS_DCACHE_NAME_LEN];
+};
+
+static mutex_t dcache_lock = MUTEX_INITIAL_VALUE(dcache_lock);
+static struct dcache_entry dcache_entries[FS_DCACHE_ENTRIES];
+static struct list_node dcache_buckets[FS_DCACHE_BUCKETS];
+static struct list_node dcache_lru = LIST_INITIAL_VALUE(dcache_lru); // most recently used first
+static bool dcache_inited;
+
+static struct {
+    uint hits;
+    uint negative_hits;
+    uint misses;
+} dcache_stats;
+
+static void dcache_init_locked(void)
+{
+    if (dcache_inited)
+        return;
+
+    for (uint i = 0; i < FS_DCACHE_BUCKETS; i++)
+        list_initialize(&dcache_buckets[i]);
+
+    /* unused entries sit at the tail of the lru, off any hash chain */
+    for (uint i = 0; i < FS_DCACHE_ENTRIES; i++) {
+        list_clear_node(&dcache_entries[i].hash_node);
+        list_add_tail(&dcache_lru, &dcache_entries[i].lru_node);
+    }
+
+    dcache_inited = true;
+}
+
+static uint dcache_hash(fscookie *fs, uint64_t parent, const char *name, size_t namelen)
+{
+    /* FNV-1a over the name, then the rest mixed in */
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < namelen; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+
+    h ^= (uint32_t)parent ^ (uint32_t)(parent >> 32) ^ (uint32_t)(uintptr_t)fs;
+    h *= 0x9e3779b1u;
+
+    return h >> (32 - __builtin_ctz(FS_DCACHE_BUCKETS));
+}
+
+static struct dcache_entry *dcache_find_locked(fscookie *fs, uint64_t parent, const char *name, size_t namelen)
+{
+    struct dcache_entry *e;
+    struct list_node *bucket = &dcache_buckets[dcache_hash(fs, parent, name, namelen)];
+
+    list_for_every_entry(bucket, e, struct dcache_entry, hash_node) {
+        if (e->fs == fs && e->parent == parent && e->namelen == namelen &&
+                memcmp(e->name, name, namelen) == 0)
+            return e;
+    }
+
+    return NULL;
+}
+
+static void dcache_drop_locked(struct dcache_entry *e)
+{
+    if (list_in_list(&e->hash_node))
+        list_delete(&e->hash_node);
+    e->fs = NULL;
+
+    /* reused first */
+    list_delete(&e->lru_node);
+    list_add_tail(&dcache_lru, &e->lru_node);
+}
+
+status_t fs_dcache_lookup(fscookie *fs, uint64_t parent, const char *name, size_t namelen, uint64_t *node)
+{
+    status_t err = ERR_NO_MSG;
+
+    if (namelen > FS_DCACHE_NAME_LEN)
+        return err;
+
+    mutex_acquire(&dcache_lock);
+    dcache_init_locked();
+
+    struct dcache_entry *e = dcache_find_locked(fs, parent, name, namelen);
+    if (e) {
+        list_delete(&e->lru_node);
+        list_add_head(&dcache_lru, &e->lru_node);
+
+        if (e->exists) {
+            *node = e->node;
+            dcache_stats.hits++;
+            err = NO_ERROR;
+        } else {
+            dcache_stats.negative_hits++;
+            err = ERR_NOT_FOUND;
+        }
+    } else {
+        dcache_stats.misses++;
+    }
+
+    mutex_release(&dcache_lock);
+
+    fs_stats_count_cache(fs, false, err != ERR_NO_MSG);
+
+    LTRACEF("fs %p, parent %llu, name '%.*s': %d\n", fs, parent, (int)namelen, name, err);
+
+    return err;
+}
+
+void fs_dcache_insert(fscookie *fs, uint64_t parent, const char *name, size_t namelen, uint64_t node, bool exists)
+{
+    if (namelen > FS_DCACHE_NAME_LEN)
+        return;
+
+    mutex_acquire(&dcache_lock);
+    dcache_init_locked();
+
+    struct dcache_entry *e = dcache_find_locked(fs, parent, name, namelen);
+    if (!e) {
+        /* recycle the least recently used one */
+        e = list_peek_tail_type(&dcache_lru, struct dcache_entry, lru_node);
+        if (e->fs)
+            list_delete(&e->hash_node);
+
+        e->fs = fs;
+        e->parent = parent;
+        e->namelen = namelen;
+        memcpy(e->name, name, namelen);
+        list_add_head(&dcache_buckets[dcache_hash(fs, parent, name, namelen)], &e->hash_node);
+    }
+
+    e->node = node;
+    e->exists = exists;
+
+    list_delete(&e->lru_node);
+    list_add_head(&dcache_lru, &e->lru_node);
+
+    mutex_release(&dcache_lock);
+}
+
+void fs_dcache_remove(fscookie *fs, uint64_t parent, const char *name, size_t namelen)
+{
+    if (namelen > FS_DCACHE_NAME_LEN)
+        return;
+
+    mutex_acquire(&dcache_lock);
+    dcache_init_locked();
+
+    struct dcache_entry *e = dcache_find_locked(fs, parent, name, namelen);
+    if (e)
+        dcache_drop_locked(e);
+
+    mutex_release(&dcache_lock);
+}
+
+void fs_dcache_purge(fscookie *fs)
+{
+    mutex_acquire(&dcache_lock);
+    dcache_init_locked();
+
+    for (uint i = 0; i < FS_DCACHE_ENTRIES; i++) {
+        if (dcache_entries[i].fs == fs)
+            dcache_drop_locked(&dcache_entries[i]);
+    }
+
+    mutex_release(&dcache_lock);
+}
+
+void fs_dcache_dump(void)
+{
+    uint used = 0, negative = 0;
+
+    mutex_acquire(&dcache_lock);
+    for (uint i = 0; i < FS_DCACHE_ENTRIES; i++) {
+        if (dcache_entries[i].fs) {
+            used++;
+            if (!dcache_entries[i].exists)
+                negative++;
+        }
+    }
+    printf("dcache: %u/%u entries (%u negative), %u hits, %u negative hits, %u misses\n",
+           used, FS_DCACHE_ENTRIES, negative, dcache_stats.hits, dcache_stats.negative_hits,
+           dcache_stats.misses);
+    mutex_release(&dcache_lock);
+}
@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <platform.h>
 #include <err.h>
+#include "fs_priv.h"
 
 static void test_normalize(const char *in)
 {
@@ -77,6 +78,7 @@ STATIC_COMMAND("fs", "fs debug commands", &cmd_fs)
 STATIC_COMMAND_END(fs);
 
 extern int fs_mount_type(const char *path, const char *device, const char *name);
+extern int fs_bench(int argc, const cmd_args *argv);
 
 static int cmd_fs_ioctl(int argc, const cmd_args *argv)
 {
@@ -168,6 +170,11 @@ usage:
         printf("%s format <type> [device]\n", argv[0].str);
         printf("%s stat <path>\n", argv[0].str);
         printf("%s ioctl <request> [args...]\n", argv[0].str);
+        printf("%s dcache\n", argv[0].str);
+        printf("%s pcache\n", argv[0].str);
+        printf("%s stats\n", argv[0].str);
+        printf("%s trace [dump|on [count]|off]\n", argv[0].str);
+        printf("%s bench <dir> [file size] [io size] [files]\n", argv[0].str);
         return -1;
     }
 
@@ -184,6 +191,14 @@ usage:
             printf("error %d mounting device\n", err);
             return err;
         }
+    } else if (!strcmp(argv[1].str, "dcache")) {
+        fs_dcache_dump();
+    } else if (!strcmp(argv[1].str, "pcache")) {
+        fs_pcache_dump();
+    } else if (!strcmp(argv[1].str, "stats")) {
+        fs_stats_dump();
+    } else if (!strcmp(argv[1].str, "trace")) {
+        return fs_trace_cmd(argc, argv);
     } else if (!strcmp(argv[1].str, "unmount")) {
         int err;
 
@@ -234,6 +249,8 @@ usage:
         printf("\ttotal inodes: %d\n", stat.total_inodes);
         printf("\tfree inodes: %d\n", stat.free_inodes);
 
+    } else if (!strcmp(argv[1].str, "bench")) {
+        return fs_bench(argc, argv);
     } else if (!strcmp(argv[1].str, "ioctl")) {
         return cmd_fs_ioctl(argc, argv);
     } else if (!strcmp(argv[1].str, "write")) {
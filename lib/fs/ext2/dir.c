@@ -30,7 +30,7 @@
 #define LOCAL_TRACE 0
 
 /* read in the dir, look for the entry */
-static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const char *name, inodenum_t *inum)
+static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, inodenum_t dir_inum, const char *name, inodenum_t *inum)
 {
     uint file_blocknum;
     int err;
@@ -40,13 +40,26 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
     if (!S_ISDIR(dir_inode->i_mode))
         return ERR_NOT_DIR;
 
+    uint64_t cached;
+    err = fs_dcache_lookup((fscookie *)ext2, dir_inum, name, namelen, &cached);
+    if (err == NO_ERROR) {
+        *inum = cached;
+        LTRACEF("cached: inode %d\n", *inum);
+        return 1;
+    } else if (err == ERR_NOT_FOUND) {
+        return -1;
+    }
+
     buf = malloc(EXT2_BLOCK_SIZE(ext2->sb));
 
     file_blocknum = 0;
     for (;;) {
         /* read in the offset */
-        err = ext2_read_inode(ext2, dir_inode, buf, file_blocknum * EXT2_BLOCK_SIZE(ext2->sb), EXT2_BLOCK_SIZE(ext2->sb));
+        err = ext2_read_inode(ext2, dir_inode, NULL, buf, file_blocknum * EXT2_BLOCK_SIZE(ext2->sb), EXT2_BLOCK_SIZE(ext2->sb));
         if (err <= 0) {
+            /* only remember that it isn't there if the whole directory was read */
+            if (err == 0)
+                fs_dcache_insert((fscookie *)ext2, dir_inum, name, namelen, 0, false);
             free(buf);
             return -1;
         }
@@ -68,6 +81,7 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
                 // match
                 *inum = LE32(ent->inode);
                 LTRACEF("match: inode %d\n", *inum);
+                fs_dcache_insert((fscookie *)ext2, dir_inum, name, namelen, *inum, true);
                 free(buf);
                 return 1;
             }
@@ -86,7 +100,8 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
 }
 
 /* note, trashes path */
-static int ext2_walk(ext2_t *ext2, char *path, struct ext2_inode *start_inode, inodenum_t *inum, int recurse)
+static int ext2_walk(ext2_t *ext2, char *path, struct ext2_inode *start_inode, inodenum_t start_inum,
+                     inodenum_t *inum, int recurse)
 {
     char *ptr;
     struct ext2_inode inode;
@@ -106,6 +121,7 @@ static int ext2_walk(ext2_t *ext2, char *path, struct ext2_inode *start_inode, i
 
     done = false;
     memcpy(&dir_inode, start_inode, sizeof(struct ext2_inode));
+    inodenum_t dir_inum = start_inum;
     while (!done) {
         /* process the first component */
         char *next_sep = strchr(ptr, '/');
@@ -120,7 +136,7 @@ static int ext2_walk(ext2_t *ext2, char *path, struct ext2_inode *start_inode, i
         LTRACEF("component '%s', done %d\n", ptr, done);
 
         /* do the lookup on this component */
-        err = ext2_dir_lookup(ext2, &dir_inode, ptr, inum);
+        err = ext2_dir_lookup(ext2, &dir_inode, dir_inum, ptr, inum);
         if (err < 0)
             return err;
 
@@ -147,9 +163,9 @@ nextcomponent:
             /* recurse, parsing the link */
             if (link[0] == '/') {
                 /* link starts with '/', so start over again at the rootfs */
-                err = ext2_walk(ext2, link, &ext2->root_inode, inum, recurse + 1);
+                err = ext2_walk(ext2, link, &ext2->root_inode, EXT2_ROOT_INO, inum, recurse + 1);
             } else {
-                err = ext2_walk(ext2, link, &dir_inode, inum, recurse + 1);
+                err = ext2_walk(ext2, link, &dir_inode, dir_inum, inum, recurse + 1);
             }
 
             LTRACEF("recursive walk returns %d\n", err);
@@ -164,6 +180,7 @@ nextcomponent:
         } else if (S_ISDIR(inode.i_mode)) {
             /* for the next cycle, point the dir inode at our new directory */
             memcpy(&dir_inode, &inode, sizeof(struct ext2_inode));
+            dir_inum = *inum;
         } else {
             if (!done) {
                 /* we aren't done and this walked over a nondir, abort */
@@ -193,6 +210,6 @@ int ext2_lookup(ext2_t *ext2, const char *_path, inodenum_t *inum)
     char path[512];
     strlcpy(path, _path, sizeof(path));
 
-    return ext2_walk(ext2, path, &ext2->root_inode, inum, 1);
+    return ext2_walk(ext2, path, &ext2->root_inode, EXT2_ROOT_INO, inum, 1);
 }
 
@@ -32,6 +32,22 @@
 
 #define LOCAL_TRACE 0
 
+#ifndef EXT2_CACHE_BLOCKS
+#define EXT2_CACHE_BLOCKS 16
+#endif
+
+/* blocks at the start of the first inode table read in at mount. the root
+ * directory and everything created along with it lives there, so the first
+ * lookups find their inodes already cached */
+#ifndef EXT2_MOUNT_PREFETCH_BLOCKS
+#define EXT2_MOUNT_PREFETCH_BLOCKS 8
+#endif
+
+/* incompatible features we know how to read. read-only compatible ones don't matter, we never write */
+#define EXT2_INCOMPAT_READ_SUPP (EXT2_FEATURE_INCOMPAT_FILETYPE | EXT3_FEATURE_INCOMPAT_RECOVER | \
+                                 EXT2_FEATURE_INCOMPAT_META_BG | EXT4_FEATURE_INCOMPAT_EXTENTS | \
+                                 EXT4_FEATURE_INCOMPAT_64BIT | EXT4_FEATURE_INCOMPAT_FLEX_BG)
+
 static void endian_swap_superblock(struct ext2_super_block *sb)
 {
     LE32SWAP(sb->s_inodes_count);
@@ -71,6 +87,7 @@ static void endian_swap_superblock(struct ext2_super_block *sb)
     LE32SWAP(sb->s_journal_inum);
     LE32SWAP(sb->s_journal_dev);
     LE32SWAP(sb->s_last_orphan);
+    LE16SWAP(sb->s_desc_size);
     LE32SWAP(sb->s_default_mount_opts);
     LE32SWAP(sb->s_first_meta_bg);
 }
@@ -155,22 +172,33 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie)
         return err;
     }
 
-    /* make sure it doesn't have any ro features we don't support */
-    if (ext2->sb.s_feature_ro_compat & ~(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER|EXT2_FEATURE_RO_COMPAT_LARGE_FILE)) {
+    /* make sure it doesn't have any features that change the layout in ways we don't understand */
+    if (ext2->sb.s_feature_incompat & ~EXT2_INCOMPAT_READ_SUPP) {
         err = -3;
         return err;
     }
 
+    /* with the 64bit feature the descriptors may be bigger, with the high halves at the end */
+    size_t desc_size = sizeof(struct ext2_group_desc);
+    if ((ext2->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) && ext2->sb.s_desc_size > desc_size)
+        desc_size = ext2->sb.s_desc_size;
+
     /* read in all the group descriptors */
-    ext2->gd = malloc(sizeof(struct ext2_group_desc) * ext2->s_group_count);
+    ext2->gd = malloc(desc_size * ext2->s_group_count);
     err = bio_read(ext2->dev, (void *)ext2->gd,
                    (EXT2_BLOCK_SIZE(ext2->sb) == 4096) ? 4096 : 2048,
-                   sizeof(struct ext2_group_desc) * ext2->s_group_count);
+                   desc_size * ext2->s_group_count);
     if (err < 0) {
         err = -4;
         return err;
     }
 
+    /* and pack the low halves, blocks past 2^32 aren't supported */
+    if (desc_size != sizeof(struct ext2_group_desc)) {
+        for (int i = 1; i < ext2->s_group_count; i++)
+            memmove(&ext2->gd[i], (uint8_t *)ext2->gd + i * desc_size, sizeof(struct ext2_group_desc));
+    }
+
     int i;
     for (i=0; i < ext2->s_group_count; i++) {
         endian_swap_group_desc(&ext2->gd[i]);
@@ -184,7 +212,13 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie)
     }
 
     /* initialize the block cache */
-    ext2->cache = bcache_create(ext2->dev, EXT2_BLOCK_SIZE(ext2->sb), 4);
+    ext2->cache = bcache_create(ext2->dev, EXT2_BLOCK_SIZE(ext2->sb), EXT2_CACHE_BLOCKS);
+
+    /* and warm it up with one clustered read instead of a read per inode block */
+    uint inode_table_blocks = (EXT2_INODES_PER_GROUP(ext2->sb) * EXT2_INODE_SIZE(ext2->sb) +
+                               EXT2_BLOCK_SIZE(ext2->sb) - 1) / EXT2_BLOCK_SIZE(ext2->sb);
+    bcache_prefetch(ext2->cache, ext2->gd[0].bg_inode_table,
+                    MIN(inode_table_blocks, EXT2_MOUNT_PREFETCH_BLOCKS));
 
     /* load the first inode */
     err = ext2_load_inode(ext2, EXT2_ROOT_INO, &ext2->root_inode);
@@ -270,6 +304,7 @@ static const struct fs_api ext2_api = {
     .stat = ext2_stat_file,
     .read = ext2_read_file,
     .close = ext2_close_file,
+    .map = ext2_map_file,
 };
 
 STATIC_FS_IMPL(ext2, &ext2_api);
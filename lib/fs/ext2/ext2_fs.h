@@ -282,7 +282,7 @@ struct ext2_super_block {
     uint32_t    s_hash_seed[4];     /* HTREE hash seed */
     uint8_t s_def_hash_version; /* Default hash version to use */
     uint8_t s_reserved_char_pad;
-    uint16_t    s_reserved_word_pad;
+    uint16_t    s_desc_size;        /* Group descriptor size, with the 64bit feature */
     uint32_t    s_default_mount_opts;
     uint32_t    s_first_meta_bg;    /* First metablock block group */
     uint32_t    s_reserved[190];    /* Padding to the end of the block */
@@ -349,6 +349,9 @@ struct ext2_super_block {
 #define EXT3_FEATURE_INCOMPAT_RECOVER       0x0004
 #define EXT3_FEATURE_INCOMPAT_JOURNAL_DEV   0x0008
 #define EXT2_FEATURE_INCOMPAT_META_BG       0x0010
+#define EXT4_FEATURE_INCOMPAT_EXTENTS       0x0040
+#define EXT4_FEATURE_INCOMPAT_64BIT         0x0080
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG       0x0200
 #define EXT2_FEATURE_INCOMPAT_ANY       0xffffffff
 
 #define EXT2_FEATURE_COMPAT_SUPP    EXT2_FEATURE_COMPAT_EXT_ATTR
@@ -360,6 +363,38 @@ struct ext2_super_block {
 #define EXT2_FEATURE_RO_COMPAT_UNSUPPORTED  ~EXT2_FEATURE_RO_COMPAT_SUPP
 #define EXT2_FEATURE_INCOMPAT_UNSUPPORTED   ~EXT2_FEATURE_INCOMPAT_SUPP
 
+/*
+ * ext4 extent trees. An inode with EXT4_EXTENTS_FL set holds the root of the tree in i_block
+ * instead of block pointers: a header followed by up to four entries. Interior nodes, one block
+ * each, hold index entries pointing at the next level down, leaves hold the extents.
+ */
+#define EXT4_EXTENTS_FL         0x00080000
+
+#define EXT4_EXT_MAGIC          0xf30a
+#define EXT4_EXT_INIT_MAX_LEN   32768   /* longer ee_len are unwritten, reading as zeros */
+
+struct ext4_extent_header {
+    uint16_t    eh_magic;
+    uint16_t    eh_entries;     /* valid entries following */
+    uint16_t    eh_max;         /* capacity of the node */
+    uint16_t    eh_depth;       /* 0 for leaves */
+    uint32_t    eh_generation;
+};
+
+struct ext4_extent_idx {
+    uint32_t    ei_block;       /* first file block covered */
+    uint32_t    ei_leaf_lo;     /* block of the next level node */
+    uint16_t    ei_leaf_hi;
+    uint16_t    ei_unused;
+};
+
+struct ext4_extent {
+    uint32_t    ee_block;       /* first file block */
+    uint16_t    ee_len;
+    uint16_t    ee_start_hi;
+    uint32_t    ee_start_lo;    /* first physical block */
+};
+
 /*
  * Default values for user and/or group using reserved blocks
  */
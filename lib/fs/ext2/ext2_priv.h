@@ -27,6 +27,7 @@
 #include <lib/bio.h>
 #include <lib/bcache.h>
 #include <lib/fs.h>
+#include <kernel/mutex.h>
 #include "ext2_fs.h"
 
 typedef uint32_t blocknum_t;
@@ -48,11 +49,19 @@ struct cache_block {
     void *ptr;
 };
 
+/* copies of the indirect blocks a file was last read through, one per level down, so
+ * sequential reads translate blocks without going back to the block cache */
+typedef struct {
+    mutex_t lock;
+    struct cache_block block[3];
+} ext2_ind_cache_t;
+
 /* open file handle */
 typedef struct {
     ext2_t *ext2;
 
-    struct cache_block ind_cache[3]; // cache of indirect blocks as they're scanned
+    ext2_ind_cache_t ind_cache; // cache of indirect blocks as they're scanned
+    inodenum_t inum;
     struct ext2_inode inode;
 } ext2_file_t;
 
@@ -66,7 +75,11 @@ int ext2_get_block(ext2_t *ext2, void **ptr, blocknum_t bnum);
 int ext2_put_block(ext2_t *ext2, blocknum_t bnum);
 
 off_t ext2_file_len(ext2_t *ext2, struct ext2_inode *inode);
-ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *buf, off_t offset, size_t len);
+/* cache may be NULL */
+ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, ext2_ind_cache_t *cache,
+                        void *buf, off_t offset, size_t len);
+ssize_t ext2_map_inode(ext2_t *ext2, struct ext2_inode *inode, ext2_ind_cache_t *cache,
+                       off_t offset, size_t len, off_t *dev_offset);
 int ext2_read_link(ext2_t *ext2, struct ext2_inode *inode, char *str, size_t len);
 
 /* fs api */
@@ -74,6 +87,7 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie);
 status_t ext2_unmount(fscookie *cookie);
 status_t ext2_open_file(fscookie *cookie, const char *path, filecookie **fcookie);
 ssize_t ext2_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len);
+ssize_t ext2_map_file(filecookie *fcookie, off_t offset, size_t len, off_t *dev_offset);
 status_t ext2_close_file(filecookie *fcookie);
 status_t ext2_stat_file(filecookie *fcookie, struct file_stat *);
 
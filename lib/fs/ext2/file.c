@@ -54,11 +54,21 @@ int ext2_open_file(fscookie *cookie, const char *path, filecookie **fcookie)
     }
 
     file->ext2 = ext2;
+    file->inum = inum;
+    mutex_init(&file->ind_cache.lock);
     *fcookie = (filecookie *)file;
 
     return 0;
 }
 
+/* page cache fill routine */
+static ssize_t ext2_fill_file(void *arg, void *buf, off_t offset, size_t len)
+{
+    ext2_file_t *file = (ext2_file_t *)arg;
+
+    return ext2_read_inode(file->ext2, &file->inode, &file->ind_cache, buf, offset, len);
+}
+
 ssize_t ext2_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len)
 {
     ext2_file_t *file = (ext2_file_t *)fcookie;
@@ -70,23 +80,31 @@ ssize_t ext2_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len)
         return -1;
     }
 
-    // read from the inode
-    err = ext2_read_inode(file->ext2, &file->inode, buf, offset, len);
+    // read from the inode, the fs is read only so the inode number names the contents for good
+    err = fs_pcache_read((fscookie *)file->ext2, file->inum, ext2_file_len(file->ext2, &file->inode),
+                         buf, offset, len, ext2_fill_file, file);
 
     return err;
 }
 
+ssize_t ext2_map_file(filecookie *fcookie, off_t offset, size_t len, off_t *dev_offset)
+{
+    ext2_file_t *file = (ext2_file_t *)fcookie;
+
+    if (!S_ISREG(file->inode.i_mode))
+        return ERR_NOT_FILE;
+
+    return ext2_map_inode(file->ext2, &file->inode, &file->ind_cache, offset, len, dev_offset);
+}
+
 int ext2_close_file(filecookie *fcookie)
 {
     ext2_file_t *file = (ext2_file_t *)fcookie;
 
-    // see if we need to free any of the cache blocks
-    int i;
-    for (i=0; i < 3; i++) {
-        if (file->ind_cache[i].num != 0) {
-            free(file->ind_cache[i].ptr);
-        }
-    }
+    // free the copies of the indirect blocks
+    for (int i = 0; i < 3; i++)
+        free(file->ind_cache.block[i].ptr);
+    mutex_destroy(&file->ind_cache.lock);
 
     free(file);
 
@@ -129,7 +147,7 @@ int ext2_read_link(ext2_t *ext2, struct ext2_inode *inode, char *str, size_t len
         return ERR_NO_MEMORY;
 
     if (linklen > 60) {
-        int err = ext2_read_inode(ext2, inode, str, 0, linklen);
+        int err = ext2_read_inode(ext2, inode, NULL, str, 0, linklen);
         if (err < 0)
             return err;
         str[linklen] = 0;
@@ -142,45 +142,249 @@ error:
     return err;
 }
 
-/* translate a file block to a physical block */
-static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode, uint fileblock)
+/* the table a file's copy of an indirect block holds, reading it in if it's of another block */
+static const blocknum_t *ind_cache_get(ext2_t *ext2, struct cache_block *cb, blocknum_t num)
 {
-    int err;
-    blocknum_t block;
+    if (cb->num == num)
+        return cb->ptr;
+
+    if (!cb->ptr) {
+        cb->ptr = malloc(EXT2_BLOCK_SIZE(ext2->sb));
+        if (!cb->ptr)
+            return NULL;
+    }
+
+    if (ext2_read_block(ext2, cb->ptr, num) < 0) {
+        cb->num = 0;
+        return NULL;
+    }
+    cb->num = num;
+
+    return cb->ptr;
+}
+
+/* walk down to the last level table out of the file's copies, with the cache lock held */
+static const blocknum_t *ind_cache_walk(ext2_t *ext2, ext2_ind_cache_t *cache, struct ext2_inode *inode,
+                                        uint32_t level, const uint32_t pos[])
+{
+    DEBUG_ASSERT(level > 0 && level <= 3);
+
+    const blocknum_t *table = NULL;
+    blocknum_t num = LE32(inode->i_block[pos[0]]);
+
+    for (uint32_t i = 0; i < level; i++) {
+        if (num == 0)
+            return NULL;
+
+        table = ind_cache_get(ext2, &cache->block[i], num);
+        if (!table)
+            return NULL;
+
+        if (i + 1 < level)
+            num = LE32(table[pos[i + 1]]);
+    }
+
+    return table;
+}
+
+/*
+ * The extent tree version of file_block_to_fs_run. A run covers the rest of the extent holding
+ * the block, or, in a hole or unwritten extent, everything up to the next extent.
+ */
+static blocknum_t ext4_extent_to_fs_run(ext2_t *ext2, struct ext2_inode *inode, ext2_ind_cache_t *cache,
+                                        uint fileblock, uint max, uint *run)
+{
+    const struct ext4_extent_header *eh = (const void *)inode->i_block;
+    uint32_t limit = UINT32_MAX;    // start of whatever follows the node we're in
+    blocknum_t held = 0;            // block cache block eh points into
+    blocknum_t block = 0;
+    uint depth = 0;
+    uint entries;
+    uint i;
+
+    *run = 1;
+
+    if (cache)
+        mutex_acquire(&cache->lock);
+
+    /* work down to the leaf that would hold the block */
+    for (;;) {
+        if (LE16(eh->eh_magic) != EXT4_EXT_MAGIC)
+            goto out;
+
+        entries = LE16(eh->eh_entries);
+        if (LE16(eh->eh_depth) == 0)
+            break;
+
+        /* the last index starting at or before the block */
+        const struct ext4_extent_idx *idx = (const void *)(eh + 1);
+        for (i = 0; i < entries && LE32(idx[i].ei_block) <= fileblock; i++)
+            ;
+        if (i < entries)
+            limit = LE32(idx[i].ei_block);
+        if (i == 0)
+            goto hole;
+
+        /* only the low half, blocks past 2^32 aren't supported */
+        blocknum_t next = LE32(idx[i - 1].ei_leaf_lo);
+
+        if (held) {
+            ext2_put_block(ext2, held);
+            held = 0;
+        }
+
+        if (cache && depth < countof(cache->block)) {
+            eh = (const void *)ind_cache_get(ext2, &cache->block[depth], next);
+        } else {
+            void *ptr;
+            eh = NULL;
+            if (ext2_get_block(ext2, &ptr, next) >= 0) {
+                held = next;
+                eh = ptr;
+            }
+        }
+        if (!eh)
+            goto out;
+        depth++;
+    }
+
+    /* the last extent starting at or before the block may hold it */
+    const struct ext4_extent *ext = (const void *)(eh + 1);
+    for (i = 0; i < entries && LE32(ext[i].ee_block) <= fileblock; i++)
+        ;
+    if (i > 0) {
+        const struct ext4_extent *e = &ext[i - 1];
+        uint32_t offset = fileblock - LE32(e->ee_block);
+        uint32_t len = LE16(e->ee_len);
+        bool unwritten = len > EXT4_EXT_INIT_MAX_LEN;
+        if (unwritten)
+            len -= EXT4_EXT_INIT_MAX_LEN;
+
+        if (offset < len) {
+            *run = MIN(max, len - offset);
+            if (!unwritten)
+                block = LE32(e->ee_start_lo) + offset;
+            goto out;
+        }
+    }
+    if (i < entries)
+        limit = LE32(ext[i].ee_block);
+
+hole:
+    *run = MIN(max, limit - fileblock);
+
+out:
+    if (held)
+        ext2_put_block(ext2, held);
+    if (cache)
+        mutex_release(&cache->lock);
+
+    LTRACEF("fileblock %u, block %u, run %u\n", fileblock, block, *run);
 
-    LTRACEF("inode %p, fileblock %u\n", inode, fileblock);
+    return block;
+}
 
+/*
+ * Translate a file block to a physical block, and count how many of the up to max file blocks
+ * starting there lie one after the other on disk, or are all holes. Only the block pointer table
+ * holding the first one is looked at, so the run stops at its end. With a cache the indirect
+ * blocks come out of the file's own copies of them rather than the block cache.
+ */
+static blocknum_t file_block_to_fs_run(ext2_t *ext2, struct ext2_inode *inode, ext2_ind_cache_t *cache,
+                                       uint fileblock, uint max, uint *run)
+{
     uint32_t pos[4];
     uint32_t level = 0;
-    ext2_calculate_block_pointer_pos(ext2, fileblock, &level, pos);
+    const uint32_t *table;
+    uint32_t table_len;
+    blocknum_t phys_block = 0;
+
+    DEBUG_ASSERT(max > 0);
 
-    LTRACEF("level %d, pos 0x%x 0x%x 0x%x 0x%x\n", level, pos[0], pos[1], pos[2], pos[3]);
+    if (inode->i_flags & EXT4_EXTENTS_FL)
+        return ext4_extent_to_fs_run(ext2, inode, cache, fileblock, max, run);
+
+    *run = 1;
+    if (ext2_calculate_block_pointer_pos(ext2, fileblock, &level, pos) < 0)
+        return 0;
 
     if (level == 0) {
-        /* direct block, just return it directly */
-        block = LE32(inode->i_block[fileblock]);
+        table = inode->i_block;
+        table_len = EXT2_NDIR_BLOCKS;
+    } else if (cache) {
+        mutex_acquire(&cache->lock);
+        table = ind_cache_walk(ext2, cache, inode, level, pos);
+        if (!table) {
+            mutex_release(&cache->lock);
+            return 0;
+        }
+        table_len = EXT2_ADDR_PER_BLOCK(ext2->sb);
     } else {
-        /* at least one level of indirection, get a pointer to the final indirect block table and dereference it */
         blocknum_t *ind_table;
-        blocknum_t phys_block;
-        err = ext2_get_indirect_block_pointer_cache_block(ext2, inode, &ind_table, level, pos, &phys_block);
-        if (err < 0)
+        if (ext2_get_indirect_block_pointer_cache_block(ext2, inode, &ind_table, level, pos, &phys_block) < 0)
             return 0;
+        table = ind_table;
+        table_len = EXT2_ADDR_PER_BLOCK(ext2->sb);
+    }
 
-        /* dereference the final entry in the final table */
-        block = LE32(ind_table[pos[level]]);
-        LTRACEF("block %u, indirect_block %u\n", block, phys_block);
+    uint32_t i = pos[level];
+    blocknum_t block = LE32(table[i]);
+    uint n = 1;
+    while (n < max && i + n < table_len) {
+        blocknum_t next = LE32(table[i + n]);
+        if (block == 0 ? next != 0 : next != block + n)
+            break;
+        n++;
+    }
+    *run = n;
 
-        /* release the ref on the cache block */
+    if (level > 0 && cache)
+        mutex_release(&cache->lock);
+    else if (level > 0)
         ext2_put_block(ext2, phys_block);
-    }
 
-    LTRACEF("returning %u\n", block);
+    LTRACEF("fileblock %u, block %u, run %u\n", fileblock, block, n);
 
     return block;
 }
 
-ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t offset, size_t len)
+/*
+ * Find where the file data starting at offset is on the device, and how much of it, up to len,
+ * follows on from there or is one hole.
+ */
+ssize_t ext2_map_inode(ext2_t *ext2, struct ext2_inode *inode, ext2_ind_cache_t *cache,
+                       off_t offset, size_t len, off_t *dev_offset)
+{
+    off_t file_size = ext2_file_len(ext2, inode);
+    size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
+
+    if (offset >= file_size)
+        return 0;
+    len = MIN(len, (size_t)(file_size - offset));
+    if (len == 0)
+        return 0;
+
+    uint file_block = offset / block_size;
+    size_t block_offset = offset % block_size;
+    uint max = (block_offset + len + block_size - 1) / block_size;
+
+    uint run;
+    blocknum_t phys_block = file_block_to_fs_run(ext2, inode, cache, file_block, max, &run);
+    while (run < max) {
+        uint more;
+        blocknum_t next = file_block_to_fs_run(ext2, inode, cache, file_block + run, max - run, &more);
+        if (phys_block == 0 ? next != 0 : next != phys_block + run)
+            break;
+        run += more;
+    }
+
+    *dev_offset = phys_block ? (off_t)phys_block * (off_t)block_size + (off_t)block_offset : -1;
+
+    return MIN(len, run * block_size - block_offset);
+}
+
+ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, ext2_ind_cache_t *cache,
+                        void *_buf, off_t offset, size_t len)
 {
     int err = 0;
     size_t bytes_read = 0;
@@ -207,7 +411,8 @@ ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_
         uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
 
         /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
+        uint run;
+        blocknum_t phys_block = file_block_to_fs_run(ext2, inode, cache, file_block, 1, &run);
         if (phys_block == 0) {
             memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
         } else {
@@ -228,27 +433,46 @@ ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_
 
     /* handle middle blocks */
     while (len >= EXT2_BLOCK_SIZE(ext2->sb)) {
-        /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
+        uint max = len / EXT2_BLOCK_SIZE(ext2->sb);
+
+        /* calculate the block and how many after it are contiguous, a block pointer table
+         * at a time, rather than translating every block on its own */
+        uint run;
+        blocknum_t phys_block = file_block_to_fs_run(ext2, inode, cache, file_block, max, &run);
+        while (run < max) {
+            uint more;
+            blocknum_t next = file_block_to_fs_run(ext2, inode, cache, file_block + run, max - run, &more);
+            if (phys_block == 0 ? next != 0 : next != phys_block + run)
+                break;
+            run += more;
+        }
+
         if (phys_block == 0) {
-            memset(buf, 0, EXT2_BLOCK_SIZE(ext2->sb));
+            memset(buf, 0, run * EXT2_BLOCK_SIZE(ext2->sb));
         } else {
-            ext2_read_block(ext2, buf, phys_block);
+            /* read the whole run straight into the caller's buffer, bypassing the cache */
+            ssize_t rc = bio_read(ext2->dev, buf, (off_t)phys_block * EXT2_BLOCK_SIZE(ext2->sb),
+                                  run * EXT2_BLOCK_SIZE(ext2->sb));
+            if (rc < 0) {
+                err = rc;
+                break;
+            }
         }
 
         /* increment our stuff */
-        file_block++;
-        len -= EXT2_BLOCK_SIZE(ext2->sb);
-        bytes_read += EXT2_BLOCK_SIZE(ext2->sb);
-        buf += EXT2_BLOCK_SIZE(ext2->sb);
+        file_block += run;
+        len -= run * EXT2_BLOCK_SIZE(ext2->sb);
+        bytes_read += run * EXT2_BLOCK_SIZE(ext2->sb);
+        buf += run * EXT2_BLOCK_SIZE(ext2->sb);
     }
 
     /* handle partial last block */
-    if (len > 0) {
+    if (len > 0 && err >= 0) {
         uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
 
         /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
+        uint run;
+        blocknum_t phys_block = file_block_to_fs_run(ext2, inode, cache, file_block, 1, &run);
         if (phys_block == 0) {
             memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
         } else {
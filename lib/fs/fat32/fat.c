@@ -33,6 +33,11 @@
 #include "fat32_priv.h"
 #include "fat_fs.h"
 
+/* fat and directory sectors kept in the block cache, dirty ones are written back lazily */
+#ifndef FAT32_CACHE_BLOCKS
+#define FAT32_CACHE_BLOCKS 16
+#endif
+
 void fat32_dump(fat_fs_t *fat)
 {
     printf("bytes_per_sector=%i\n", fat->bytes_per_sector);
@@ -71,7 +76,7 @@ status_t fat32_mount(bdev_t *dev, fscookie **cookie)
         goto end;
     }
 
-    fat_fs_t *fat = malloc(sizeof(fat_fs_t));
+    fat_fs_t *fat = calloc(1, sizeof(fat_fs_t));
     fat->lba_start = 1024;
     fat->dev = dev;
 
@@ -132,6 +137,7 @@ status_t fat32_mount(bdev_t *dev, fscookie **cookie)
             goto end;
         }
         fat->root_entries = 0;
+        fat->fsinfo_sector = fat_read16(bs, 0x30);
     } else {
         if (fat->fat_count != 2) {
             printf("illegal FAT count (%x)\n", fat->fat_count);
@@ -166,7 +172,20 @@ status_t fat32_mount(bdev_t *dev, fscookie **cookie)
     }
 
     fat->bytes_per_cluster = fat->sectors_per_cluster * fat->bytes_per_sector;
-    fat->cache = bcache_create(fat->dev, fat->bytes_per_sector, 4);
+    fat->cache = bcache_create(fat->dev, fat->bytes_per_sector, FAT32_CACHE_BLOCKS);
+    mutex_init(&fat->lock);
+
+    /* start allocating where the fsinfo sector says the free space is */
+    fat->next_free = 2;
+    if (fat->fsinfo_sector != 0 && fat->fsinfo_sector < fat->reserved_sectors &&
+            bio_read(dev, bs, fat->lba_start + fat->fsinfo_sector * fat->bytes_per_sector, 512) == 512 &&
+            fat_read32(bs, 0) == 0x41615252 && fat_read32(bs, 0x1e4) == 0x61417272) {
+        uint32_t hint = fat_read32(bs, 0x1ec);
+        if (hint >= 2 && hint < fat->total_clusters + 2)
+            fat->next_free = hint;
+    } else {
+        fat->fsinfo_sector = 0;
+    }
 
     *cookie = (fscookie *)fat;
 end:
@@ -177,18 +196,31 @@ end:
 status_t fat32_unmount(fscookie *cookie)
 {
     fat_fs_t *fat = (fat_fs_t *)cookie;
+    /* the mount goes away regardless, so all that can be done about a failed flush is say so */
+    status_t err = NO_ERROR;
+    if (bcache_flush(fat->cache) < 0) {
+        printf("fat32: error writing back metadata on unmount\n");
+        err = ERR_IO;
+    }
+
     bcache_destroy(fat->cache);
+    mutex_destroy(&fat->lock);
     free(fat);
-    return NO_ERROR;
+    return err;
 }
 
 static const struct fs_api fat32_api = {
     .mount = fat32_mount,
     .unmount = fat32_unmount,
     .open = fat32_open_file,
+    .create = fat32_create_file,
+    .remove = fat32_remove_file,
+    .truncate = fat32_truncate_file,
     .stat = fat32_stat_file,
     .read = fat32_read_file,
+    .write = fat32_write_file,
     .close = fat32_close_file,
+    .map = fat32_map_file,
 };
 
 STATIC_FS_IMPL(fat32, &fat32_api);
@@ -34,7 +34,12 @@ status_t fat32_unmount(fscookie *cookie);
 
 /* file api */
 status_t fat32_open_file(fscookie *cookie, const char *path, filecookie **fcookie);
+status_t fat32_create_file(fscookie *cookie, const char *path, filecookie **fcookie, uint64_t len);
+status_t fat32_remove_file(fscookie *cookie, const char *path);
 ssize_t fat32_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len);
+ssize_t fat32_write_file(filecookie *fcookie, const void *buf, off_t offset, size_t len);
+status_t fat32_truncate_file(filecookie *fcookie, uint64_t len);
+ssize_t fat32_map_file(filecookie *fcookie, off_t offset, size_t len, off_t *dev_offset);
 status_t fat32_close_file(filecookie *fcookie);
 status_t fat32_stat_file(filecookie *fcookie, struct file_stat *stat);
 
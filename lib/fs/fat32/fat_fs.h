@@ -26,6 +26,7 @@
 
 #include <lib/bio.h>
 #include <lib/bcache.h>
+#include <kernel/mutex.h>
 
 typedef struct {
     bdev_t *dev;
@@ -47,13 +48,44 @@ typedef struct {
     uint32_t root_cluster;
     uint32_t root_entries;
     uint32_t root_start;
+
+    /* held while allocating or freeing clusters and changing directories */
+    mutex_t lock;
+    uint32_t next_free;     // where to start looking for free clusters
+    uint32_t fsinfo_sector;
+    bool fsinfo_stale;      // the free count in fsinfo has been marked unknown
 } fat_fs_t;
 
+/* a stretch of a file stored in consecutive clusters */
+typedef struct {
+    uint32_t file_cluster;  // index of the first cluster within the file
+    uint32_t disk_cluster;
+    uint32_t count;
+} fat_run_t;
+
 typedef struct {
     fat_fs_t *fat_fs;
     uint32_t start_cluster;
     uint32_t length;
     uint8_t attributes;
+
+    /* map of the cluster chain, filled in as far as reads have needed it */
+    mutex_t lock;
+    fat_run_t *runs;
+    uint32_t run_count;
+    uint32_t run_alloc;
+    bool runs_complete;     // the chain has been followed to its end
+    uint32_t last_run;      // run used by the last read, tried first
+
+    /* device offset of the directory entry, rewritten when the size or start cluster change */
+    off_t dirent_offset;
+    bool dirty;
+
+    /* writes collect here and only get clusters allocated when flushed */
+    uint8_t *wbuf;
+    size_t wbuf_size;
+    off_t wbuf_offset;
+    size_t wbuf_len;
 } fat_file_t;
 
 typedef enum {
@@ -73,4 +105,19 @@ typedef enum {
 #define fat_read16(buffer,off) \
 (((uint8_t *)buffer)[(off)] + (((uint8_t *)buffer)[(off)+1] << 8))
 
+#define fat_write32(buffer,off,val) do { \
+    ((uint8_t *)buffer)[(off)] = (val) & 0xff; \
+    ((uint8_t *)buffer)[(off)+1] = ((val) >> 8) & 0xff; \
+    ((uint8_t *)buffer)[(off)+2] = ((val) >> 16) & 0xff; \
+    ((uint8_t *)buffer)[(off)+3] = ((val) >> 24) & 0xff; \
+} while (0)
+
+#define fat_write16(buffer,off,val) do { \
+    ((uint8_t *)buffer)[(off)] = (val) & 0xff; \
+    ((uint8_t *)buffer)[(off)+1] = ((val) >> 8) & 0xff; \
+} while (0)
+
+/* end of chain marker, FAT16 entries keep the low half */
+#define FAT_EOC 0x0fffffff
+
 #endif
\ No newline at end of file
@@ -33,31 +33,57 @@
 #include "fat_fs.h"
 #include "fat32_priv.h"
 
+#define LOCAL_TRACE 0
+
 #define DIR_ENTRY_LENGTH 32
 #define USE_CACHE 1
 
-uint32_t fat32_next_cluster_in_chain(fat_fs_t *fat, uint32_t cluster)
+/* writes are collected per file up to this much, rounded up to whole clusters */
+#ifndef FAT32_WRITE_BUFFER
+#define FAT32_WRITE_BUFFER (64 * 1024)
+#endif
+
+/* there is no clock to stamp new entries with, use 1980-01-01 */
+#define FAT_DEFAULT_DATE 0x0021
+
+/* where a directory entry lives and what it says */
+typedef struct {
+    uint32_t cluster;       // directory cluster holding the short entry
+    uint32_t index;         // byte offset of the short entry in that cluster
+    uint32_t start_cluster;
+    uint32_t length;
+    uint8_t attributes;
+} fat_dirent_t;
+
+/* find the entry for a cluster in one copy of the fat, as a cache block and an offset into it */
+static void fat32_fat_entry(fat_fs_t *fat, uint32_t cluster, uint32_t copy, uint *bnum, uint32_t *index)
 {
-    uint32_t fat_sector = (cluster) >> 7;
-    uint32_t fat_index = (cluster ) & 127;
+    uint32_t byte = cluster * (fat->fat_bits / 8);
 
-    uint32_t bnum = (fat->lba_start / fat->bytes_per_sector) + (fat->reserved_sectors + fat_sector);
+    *bnum = (fat->lba_start / fat->bytes_per_sector) + fat->reserved_sectors +
+            copy * fat->sectors_per_fat + byte / fat->bytes_per_sector;
+    *index = byte % fat->bytes_per_sector;
+}
+
+uint32_t fat32_next_cluster_in_chain(fat_fs_t *fat, uint32_t cluster)
+{
+    uint bnum;
+    uint32_t fat_index;
     uint32_t next_cluster = 0x0fffffff;
 
+    fat32_fat_entry(fat, cluster, 0, &bnum, &fat_index);
+
 #if USE_CACHE
     void *cache_ptr;
     int err = bcache_get_block(fat->cache, &cache_ptr, bnum);
     if (err < 0) {
         printf("bcache_get_block returned: %i\n", err);
     } else {
+        uint8_t *entry = (uint8_t *)cache_ptr + fat_index;
         if (fat->fat_bits == 32) {
-            uint32_t *table = (uint32_t *)cache_ptr;
-            next_cluster = table[fat_index];
-            LE32SWAP(next_cluster);
+            next_cluster = fat_read32(entry, 0) & 0x0fffffff;
         } else if (fat->fat_bits == 16) {
-            uint16_t *table = (uint16_t *)cache_ptr;
-            next_cluster = table[fat_index];
-            LE16SWAP(next_cluster);
+            next_cluster = fat_read16(entry, 0);
             if (next_cluster > 0xfff0) {
                 next_cluster |= 0x0fff0000;
             }
@@ -66,19 +92,132 @@ uint32_t fat32_next_cluster_in_chain(fat_fs_t *fat, uint32_t cluster)
         bcache_put_block(fat->cache, bnum);
     }
 #else
-    uint32_t offset = (bnum * fat->bytes_per_sector) + (fat_index * (fat->fat_bits / 8));
+    uint32_t offset = (bnum * fat->bytes_per_sector) + fat_index;
     bio_read(fat->dev, &next_cluster, offset, 4);
     LE32SWAP(next_cluster);
 #endif
     return next_cluster;
 }
 
+/* point a cluster's entry at value in every copy of the fat, leaving the sectors dirty in the cache */
+static status_t fat32_set_next_cluster(fat_fs_t *fat, uint32_t cluster, uint32_t value)
+{
+    for (uint32_t copy = 0; copy < fat->fat_count; copy++) {
+        uint bnum;
+        uint32_t fat_index;
+        void *cache_ptr;
+
+        fat32_fat_entry(fat, cluster, copy, &bnum, &fat_index);
+        if (bcache_get_block(fat->cache, &cache_ptr, bnum) < 0)
+            return ERR_IO;
+
+        uint8_t *entry = (uint8_t *)cache_ptr + fat_index;
+        if (fat->fat_bits == 32) {
+            /* the top four bits are reserved and have to be left alone */
+            uint32_t v = (value & 0x0fffffff) | (fat_read32(entry, 0) & 0xf0000000);
+            fat_write32(entry, 0, v);
+        } else {
+            fat_write16(entry, 0, value);
+        }
+
+        bcache_mark_block_dirty(fat->cache, bnum);
+        bcache_put_block(fat->cache, bnum);
+    }
+
+    return NO_ERROR;
+}
+
 static inline off_t fat32_offset_for_cluster(fat_fs_t *fat, uint32_t cluster)
 {
     off_t cluster_begin_lba = fat->reserved_sectors + (fat->fat_count * fat->sectors_per_fat);
     return fat->lba_start + (cluster_begin_lba + (cluster - 2) * fat->sectors_per_cluster) * fat->bytes_per_sector;
 }
 
+/* anything past the last data cluster is a bad cluster or end of chain marker */
+static inline bool fat32_cluster_valid(fat_fs_t *fat, uint32_t cluster)
+{
+    return cluster >= 2 && cluster < fat->total_clusters + 2 && cluster < 0x0ffffff7;
+}
+
+/*
+ * The free count in the fsinfo sector is only a hint, mark it unknown before the first change
+ * to the fat rather than keeping it up to date. Caller holds fat->lock.
+ */
+static void fat32_invalidate_fsinfo(fat_fs_t *fat)
+{
+    if (fat->fsinfo_stale || fat->fsinfo_sector == 0)
+        return;
+    fat->fsinfo_stale = true;
+
+    void *cache_ptr;
+    uint bnum = (fat->lba_start / fat->bytes_per_sector) + fat->fsinfo_sector;
+    if (bcache_get_block(fat->cache, &cache_ptr, bnum) < 0)
+        return;
+
+    fat_write32(cache_ptr, 0x1e8, 0xffffffff);
+    bcache_mark_block_dirty(fat->cache, bnum);
+    bcache_put_block(fat->cache, bnum);
+}
+
+/*
+ * Look for count free clusters in a row, trying want first so a file can grow in place and then
+ * scanning from the free hint. Returns the start of the longest run seen, with its length in
+ * *found, or 0 with *found 0 when the volume is full. Caller holds fat->lock.
+ */
+static uint32_t fat32_find_free(fat_fs_t *fat, uint32_t want, uint32_t count, uint32_t *found)
+{
+    uint32_t end = fat->total_clusters + 2;
+    uint32_t best = 0, best_len = 0;
+
+    if (fat32_cluster_valid(fat, want)) {
+        uint32_t len = 0;
+        while (len < count && want + len < end && fat32_next_cluster_in_chain(fat, want + len) == 0)
+            len++;
+        best = want;
+        best_len = len;
+    }
+
+    uint32_t cluster = fat32_cluster_valid(fat, fat->next_free) ? fat->next_free : 2;
+    uint32_t run = 0, run_len = 0;
+    for (uint32_t i = 0; i < fat->total_clusters && best_len < count; i++) {
+        if (fat32_next_cluster_in_chain(fat, cluster) == 0) {
+            if (run_len++ == 0)
+                run = cluster;
+            if (run_len > best_len) {
+                best = run;
+                best_len = run_len;
+            }
+        } else {
+            run_len = 0;
+        }
+
+        /* runs don't wrap around the end of the volume */
+        if (++cluster == end) {
+            cluster = 2;
+            run_len = 0;
+        }
+    }
+
+    *found = best_len;
+    return best_len ? best : 0;
+}
+
+/* give a chain of clusters back to the free space. Caller holds fat->lock */
+static status_t fat32_free_chain(fat_fs_t *fat, uint32_t cluster)
+{
+    while (fat32_cluster_valid(fat, cluster)) {
+        uint32_t next = fat32_next_cluster_in_chain(fat, cluster);
+        status_t err = fat32_set_next_cluster(fat, cluster, 0);
+        if (err < 0)
+            return err;
+        if (cluster < fat->next_free)
+            fat->next_free = cluster;
+        cluster = next;
+    }
+
+    return NO_ERROR;
+}
+
 char *fat32_dir_get_filename(uint8_t *dir, off_t offset, int lfn_sequences)
 {
     int result_len = 1 + (lfn_sequences == 0 ? 12 : (lfn_sequences * 26));
@@ -133,156 +272,969 @@ char *fat32_dir_get_filename(uint8_t *dir, off_t offset, int lfn_sequences)
     return result;
 }
 
-status_t fat32_open_file(fscookie *cookie, const char *path, filecookie **fcookie)
+/* read a directory cluster through the block cache, which may hold entry updates not yet written */
+static status_t fat32_read_dir_cluster(fat_fs_t *fat, uint32_t cluster, uint8_t *dir)
 {
-    fat_fs_t *fat = (fat_fs_t *)cookie;
-    status_t result = ERR_GENERIC;
-
-    uint8_t *dir = malloc(fat->bytes_per_cluster);
-    uint32_t dir_cluster = fat->root_cluster;
-    fat_file_t *file = NULL;
+    uint bnum = fat32_offset_for_cluster(fat, cluster) / fat->bytes_per_sector;
 
-    const char *ptr;
-    /* chew up leading slashes */
-    ptr = &path[0];
-    while (*ptr == '/') {
-        ptr++;
+    for (uint32_t i = 0; i < fat->sectors_per_cluster; i++) {
+        if (bcache_read_block(fat->cache, dir + i * fat->bytes_per_sector, bnum + i) < 0)
+            return ERR_IO;
     }
 
-    bool done = false;
-    do {
-        // XXX: use the cache!
-        bio_read(fat->dev, dir, fat32_offset_for_cluster(fat, dir_cluster), fat->bytes_per_cluster);
+    return NO_ERROR;
+}
 
-        char *next_sep = strchr(ptr, '/');
-        if (next_sep) {
-            /* terminate the next component, giving us a substring */
-            *next_sep = 0;
-        } else {
-            /* this is the last component */
-            done = true;
-        }
+/*
+ * Look a name up in the directory starting at dir_cluster. dir is a cluster sized buffer, left
+ * holding the cluster the entry was found in.
+ */
+static status_t fat32_dir_lookup(fat_fs_t *fat, uint8_t *dir, uint32_t dir_cluster,
+                                 const char *name, size_t namelen, fat_dirent_t *ent)
+{
+    uint32_t cluster = dir_cluster;
+
+    while (fat32_cluster_valid(fat, cluster)) {
+        status_t err = fat32_read_dir_cluster(fat, cluster, dir);
+        if (err < 0)
+            return err;
 
-        uint32_t offset = 0;
         uint32_t lfn_sequences = 0;
-        bool matched = false;
-        while (dir[offset] != 0x00 && offset < fat->bytes_per_cluster) {
-            if ( dir[offset] == 0xE5 /*deleted*/) {
-                offset += DIR_ENTRY_LENGTH;
+        for (uint32_t offset = 0; offset < fat->bytes_per_cluster; offset += DIR_ENTRY_LENGTH) {
+            if (dir[offset] == 0x00) {
+                /* end of the directory */
+                return ERR_NOT_FOUND;
+            } else if (dir[offset] == 0xE5 /*deleted*/) {
                 continue;
             } else if ((dir[offset + 0x0B] & 0x08)) {
                 if (dir[offset + 0x0B] == 0x0f) {
                     lfn_sequences++;
                 }
-
-                offset += DIR_ENTRY_LENGTH;
                 continue;
             }
 
+            /* long names that started in the previous cluster fall back to the short name */
+            if (offset < lfn_sequences * DIR_ENTRY_LENGTH)
+                lfn_sequences = 0;
+
             char *filename = fat32_dir_get_filename(dir, offset, lfn_sequences);
             lfn_sequences = 0;
 
-            matched = (strnicmp(ptr, filename, strlen(filename)) == 0);
+            bool matched = (strlen(filename) == namelen && strnicmp(name, filename, namelen) == 0);
             free(filename);
 
             if (matched) {
-                uint16_t target_cluster = fat_read16(dir, offset + 0x1a);
-                if (done == true) {
-                    file = malloc(sizeof(fat_file_t));
-                    file->fat_fs = fat;
-                    file->start_cluster = target_cluster;
-                    file->length = fat_read32(dir, offset + 0x1c);
-                    file->attributes = dir[0x0B + offset];
-                    result = NO_ERROR;
-                } else {
-                    dir_cluster = target_cluster;
+                ent->cluster = cluster;
+                ent->index = offset;
+                ent->start_cluster = fat_read16(dir, offset + 0x1a);
+                if (fat->fat_bits == 32) {
+                    ent->start_cluster |= fat_read16(dir, offset + 0x14) << 16;
                 }
-                break;
+                ent->length = fat_read32(dir, offset + 0x1c);
+                ent->attributes = dir[offset + 0x0B];
+                return NO_ERROR;
             }
+        }
+
+        cluster = fat32_next_cluster_in_chain(fat, cluster);
+    }
+
+    return ERR_NOT_FOUND;
+}
+
+/*
+ * Walk a path from the root directory. *parent is left at the directory the last component
+ * was looked up in, and *leaf at that component when the walk got as far as it.
+ */
+static status_t fat32_walk(fat_fs_t *fat, uint8_t *dir, const char *path, uint32_t *parent,
+                           const char **leaf, size_t *leaf_len, fat_dirent_t *ent)
+{
+    uint32_t dir_cluster = fat->root_cluster;
 
-            offset += DIR_ENTRY_LENGTH;
+    *leaf = NULL;
+    for (;;) {
+        /* chew up leading slashes */
+        while (*path == '/') {
+            path++;
         }
 
-        if (matched == true) {
-            if (done == true) {
-                break;
-            } else {
-                /* move to the next separator */
-                ptr = next_sep + 1;
+        const char *sep = strchr(path, '/');
+        size_t len = sep ? (size_t)(sep - path) : strlen(path);
+        if (len == 0)
+            return ERR_NOT_FOUND;
 
-                /* consume multiple separators */
-                while (*ptr == '/') {
-                    ptr++;
-                }
+        const char *next = path + len;
+        while (*next == '/') {
+            next++;
+        }
+
+        *parent = dir_cluster;
+        if (*next == 0) {
+            *leaf = path;
+            *leaf_len = len;
+        }
+
+        status_t err = fat32_dir_lookup(fat, dir, dir_cluster, path, len, ent);
+        if (err < 0 || *next == 0)
+            return err;
+
+        if (!(ent->attributes & fat_attribute_directory))
+            return ERR_NOT_FOUND;
+
+        /* entries pointing back at the root hold cluster 0 */
+        dir_cluster = ent->start_cluster ? ent->start_cluster : fat->root_cluster;
+        path = next;
+    }
+}
+
+static fat_file_t *fat32_new_file(fat_fs_t *fat, const fat_dirent_t *ent)
+{
+    fat_file_t *file = calloc(1, sizeof(fat_file_t));
+    if (!file)
+        return NULL;
+
+    file->fat_fs = fat;
+    mutex_init(&file->lock);
+    file->start_cluster = ent->start_cluster;
+    file->length = ent->length;
+    file->attributes = ent->attributes;
+    file->dirent_offset = fat32_offset_for_cluster(fat, ent->cluster) + ent->index;
+    file->wbuf_size = ROUNDUP(FAT32_WRITE_BUFFER, fat->bytes_per_cluster);
+
+    return file;
+}
+
+status_t fat32_open_file(fscookie *cookie, const char *path, filecookie **fcookie)
+{
+    fat_fs_t *fat = (fat_fs_t *)cookie;
+    fat_file_t *file = NULL;
+    uint32_t parent;
+    const char *leaf;
+    size_t leaf_len;
+    fat_dirent_t ent;
+
+    uint8_t *dir = malloc(fat->bytes_per_cluster);
+    if (!dir)
+        return ERR_NO_MEMORY;
+
+    mutex_acquire(&fat->lock);
+    status_t result = fat32_walk(fat, dir, path, &parent, &leaf, &leaf_len, &ent);
+    mutex_release(&fat->lock);
+
+    if (result == NO_ERROR) {
+        file = fat32_new_file(fat, &ent);
+        if (!file)
+            result = ERR_NO_MEMORY;
+    }
+
+    *fcookie = (filecookie *)file;
+    free(dir);
+    return result;
+}
+
+/* characters allowed in short names besides letters and digits */
+static const char fat_short_name_chars[] = "!#$%&'()-@^_`{}~";
+
+/*
+ * Turn a name into the 11 bytes of an 8.3 entry. Names that don't fit are refused rather
+ * than given a long name entry. An all lower case base or extension is recorded in the case
+ * flags so it reads back the way it was written on systems that honour them.
+ */
+static status_t fat32_short_name(const char *name, size_t len, uint8_t *short_name, uint8_t *case_flags)
+{
+    size_t base_len = len;
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] == '.')
+            base_len = i;
+    }
+    size_t ext_len = (base_len < len) ? len - base_len - 1 : 0;
+
+    if (base_len == 0 || (base_len < len && ext_len == 0))
+        return ERR_INVALID_ARGS;
+    if (base_len > 8 || ext_len > 3)
+        return ERR_NOT_SUPPORTED;
+
+    memset(short_name, ' ', 11);
+    *case_flags = 0;
+
+    for (uint part = 0; part < 2; part++) {
+        const char *src = part ? name + base_len + 1 : name;
+        size_t src_len = part ? ext_len : base_len;
+        uint8_t *dst = part ? short_name + 8 : short_name;
+        bool lower = false, upper = false;
+
+        for (size_t i = 0; i < src_len; i++) {
+            char c = src[i];
+            if (c >= 'a' && c <= 'z') {
+                lower = true;
+                c -= 'a' - 'A';
+            } else if (c >= 'A' && c <= 'Z') {
+                upper = true;
+            } else if (!(c >= '0' && c <= '9') && !strchr(fat_short_name_chars, c)) {
+                return ERR_INVALID_ARGS;
             }
-        } else {
-            // XXX: untested!!!
-            dir_cluster = fat32_next_cluster_in_chain(fat, dir_cluster);
-            if (dir_cluster == 0x0fffffff) {
-                // no more clusters in the chain
-                break;
+            dst[i] = c;
+        }
+
+        if (lower && !upper)
+            *case_flags |= part ? 0x10 : 0x08;
+    }
+
+    return NO_ERROR;
+}
+
+/* write an entry for an empty file into the cache block holding a directory slot */
+static status_t fat32_write_new_dirent(fat_fs_t *fat, uint32_t cluster, uint32_t index,
+                                       const uint8_t *short_name, uint8_t case_flags)
+{
+    off_t offset = fat32_offset_for_cluster(fat, cluster) + index;
+    uint bnum = offset / fat->bytes_per_sector;
+    void *cache_ptr;
+
+    if (bcache_get_block(fat->cache, &cache_ptr, bnum) < 0)
+        return ERR_IO;
+
+    uint8_t *entry = (uint8_t *)cache_ptr + offset % fat->bytes_per_sector;
+    memset(entry, 0, DIR_ENTRY_LENGTH);
+    memcpy(entry, short_name, 11);
+    entry[0x0b] = fat_attribute_archive;
+    entry[0x0c] = case_flags;
+    fat_write16(entry, 0x10, FAT_DEFAULT_DATE);
+    fat_write16(entry, 0x12, FAT_DEFAULT_DATE);
+    fat_write16(entry, 0x18, FAT_DEFAULT_DATE);
+
+    bcache_mark_block_dirty(fat->cache, bnum);
+    bcache_put_block(fat->cache, bnum);
+
+    return NO_ERROR;
+}
+
+/*
+ * Find a free slot in a directory for a new short entry, growing the directory by a cluster
+ * when it is full. Caller holds fat->lock.
+ */
+static status_t fat32_dir_add_entry(fat_fs_t *fat, uint8_t *dir, uint32_t dir_cluster,
+                                    uint32_t *slot_cluster, uint32_t *slot_index)
+{
+    uint32_t cluster = dir_cluster;
+    uint32_t last = 0;
+
+    while (fat32_cluster_valid(fat, cluster)) {
+        status_t err = fat32_read_dir_cluster(fat, cluster, dir);
+        if (err < 0)
+            return err;
+
+        for (uint32_t offset = 0; offset < fat->bytes_per_cluster; offset += DIR_ENTRY_LENGTH) {
+            if (dir[offset] == 0x00 || dir[offset] == 0xE5) {
+                *slot_cluster = cluster;
+                *slot_index = offset;
+                return NO_ERROR;
             }
         }
-    } while (true);
+
+        last = cluster;
+        cluster = fat32_next_cluster_in_chain(fat, cluster);
+    }
+
+    if (last == 0)
+        return ERR_NOT_VALID;
+
+    uint32_t found;
+    cluster = fat32_find_free(fat, last + 1, 1, &found);
+    if (found == 0)
+        return ERR_NO_RESOURCES;
+
+    fat32_invalidate_fsinfo(fat);
+    status_t err = fat32_set_next_cluster(fat, cluster, FAT_EOC);
+    if (err == NO_ERROR)
+        err = fat32_set_next_cluster(fat, last, cluster);
+    if (err < 0)
+        return err;
+    fat->next_free = cluster + 1;
+
+    /* a zeroed cluster reads as the end of the directory */
+    uint bnum = fat32_offset_for_cluster(fat, cluster) / fat->bytes_per_sector;
+    for (uint32_t i = 0; i < fat->sectors_per_cluster; i++) {
+        if (bcache_zero_block(fat->cache, bnum + i) < 0)
+            return ERR_IO;
+    }
+
+    *slot_cluster = cluster;
+    *slot_index = 0;
+    return NO_ERROR;
+}
+
+status_t fat32_create_file(fscookie *cookie, const char *path, filecookie **fcookie, uint64_t len)
+{
+    fat_fs_t *fat = (fat_fs_t *)cookie;
+    fat_file_t *file = NULL;
+    uint32_t parent;
+    const char *leaf;
+    size_t leaf_len;
+    fat_dirent_t ent;
+    uint8_t short_name[11];
+    uint8_t case_flags;
+
+    /* space is allocated as the file is written, so that it can be kept in one piece */
+    LTRACEF("path %s, len %llu\n", path, len);
+
+    uint8_t *dir = malloc(fat->bytes_per_cluster);
+    if (!dir)
+        return ERR_NO_MEMORY;
+
+    mutex_acquire(&fat->lock);
+
+    status_t result = fat32_walk(fat, dir, path, &parent, &leaf, &leaf_len, &ent);
+    if (result == NO_ERROR) {
+        result = ERR_ALREADY_EXISTS;
+        goto out;
+    } else if (result != ERR_NOT_FOUND || !leaf) {
+        goto out;
+    }
+
+    result = fat32_short_name(leaf, leaf_len, short_name, &case_flags);
+    if (result < 0)
+        goto out;
+
+    result = fat32_dir_add_entry(fat, dir, parent, &ent.cluster, &ent.index);
+    if (result < 0)
+        goto out;
+
+    result = fat32_write_new_dirent(fat, ent.cluster, ent.index, short_name, case_flags);
+    if (result < 0)
+        goto out;
+
+    result = (bcache_flush(fat->cache) < 0) ? ERR_IO : NO_ERROR;
+    if (result < 0)
+        goto out;
+
+    ent.start_cluster = 0;
+    ent.length = 0;
+    ent.attributes = fat_attribute_archive;
+    file = fat32_new_file(fat, &ent);
+    if (!file)
+        result = ERR_NO_MEMORY;
 
 out:
+    mutex_release(&fat->lock);
     *fcookie = (filecookie *)file;
     free(dir);
     return result;
 }
 
-ssize_t fat32_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len)
+status_t fat32_remove_file(fscookie *cookie, const char *path)
+{
+    fat_fs_t *fat = (fat_fs_t *)cookie;
+    uint32_t parent;
+    const char *leaf;
+    size_t leaf_len;
+    fat_dirent_t ent;
+
+    uint8_t *dir = malloc(fat->bytes_per_cluster);
+    if (!dir)
+        return ERR_NO_MEMORY;
+
+    mutex_acquire(&fat->lock);
+
+    status_t result = fat32_walk(fat, dir, path, &parent, &leaf, &leaf_len, &ent);
+    if (result < 0)
+        goto out;
+    if (ent.attributes & fat_attribute_directory) {
+        result = ERR_NOT_FILE;
+        goto out;
+    }
+
+    fat32_invalidate_fsinfo(fat);
+    result = fat32_free_chain(fat, ent.start_cluster);
+    if (result < 0)
+        goto out;
+
+    /* delete the short entry and the long name entries in front of it, dir still holds them */
+    off_t cluster_offset = fat32_offset_for_cluster(fat, ent.cluster);
+    uint32_t index = ent.index;
+    for (;;) {
+        off_t offset = cluster_offset + index;
+        uint bnum = offset / fat->bytes_per_sector;
+        void *cache_ptr;
+
+        if (bcache_get_block(fat->cache, &cache_ptr, bnum) < 0) {
+            result = ERR_IO;
+            goto out;
+        }
+        ((uint8_t *)cache_ptr)[offset % fat->bytes_per_sector] = 0xE5;
+        bcache_mark_block_dirty(fat->cache, bnum);
+        bcache_put_block(fat->cache, bnum);
+
+        if (index < DIR_ENTRY_LENGTH || dir[index - DIR_ENTRY_LENGTH + 0x0B] != 0x0f ||
+                dir[index - DIR_ENTRY_LENGTH] == 0xE5)
+            break;
+        index -= DIR_ENTRY_LENGTH;
+    }
+
+    result = (bcache_flush(fat->cache) < 0) ? ERR_IO : NO_ERROR;
+
+out:
+    mutex_release(&fat->lock);
+    free(dir);
+    return result;
+}
+
+/* make room for one more run at the end of the map */
+static status_t fat32_grow_run_map(fat_file_t *file)
+{
+    if (file->run_count < file->run_alloc)
+        return NO_ERROR;
+
+    uint32_t alloc = file->run_alloc ? file->run_alloc * 2 : 4;
+    fat_run_t *runs = realloc(file->runs, alloc * sizeof(fat_run_t));
+    if (!runs)
+        return ERR_NO_MEMORY;
+    file->runs = runs;
+    file->run_alloc = alloc;
+
+    return NO_ERROR;
+}
+
+/* follow the chain past the end of the map, adding one run */
+static status_t fat32_extend_run_map(fat_file_t *file)
 {
-    fat_file_t *file = (fat_file_t *)fcookie;
     fat_fs_t *fat = file->fat_fs;
-    bdev_t *dev = fat->dev;
+    uint32_t cluster;
+    uint32_t file_cluster;
 
-    uint32_t cluster = 0;
-    if (offset <= fat->bytes_per_cluster) {
+    if (file->run_count == 0) {
         cluster = file->start_cluster;
+        file_cluster = 0;
     } else {
-        // XXX: support non-0 offsets
-        TRACE;
-        return -1;
+        const fat_run_t *last = &file->runs[file->run_count - 1];
+        cluster = fat32_next_cluster_in_chain(fat, last->disk_cluster + last->count - 1);
+        file_cluster = last->file_cluster + last->count;
     }
 
-    uint32_t length = file->length;
-    uint32_t amount_read = 0;
+    if (!fat32_cluster_valid(fat, cluster)) {
+        file->runs_complete = true;
+        return ERR_NOT_FOUND;
+    }
+
+    status_t err = fat32_grow_run_map(file);
+    if (err < 0)
+        return err;
+
+    fat_run_t *run = &file->runs[file->run_count++];
+    run->file_cluster = file_cluster;
+    run->disk_cluster = cluster;
+    run->count = 1;
+
+    /* soak up every cluster that directly follows */
+    uint32_t next;
+    while ((next = fat32_next_cluster_in_chain(fat, cluster)) == cluster + 1) {
+        cluster = next;
+        run->count++;
+    }
+    if (!fat32_cluster_valid(fat, next))
+        file->runs_complete = true;
+
+    LTRACEF("file %p: run %u: file cluster %u, disk cluster %u, count %u\n", file,
+            file->run_count - 1, run->file_cluster, run->disk_cluster, run->count);
 
-    do {
-        off_t lba_addr = fat32_offset_for_cluster(fat, cluster);
+    return NO_ERROR;
+}
+
+/* map the rest of the chain, returns the number of clusters in it */
+static ssize_t fat32_map_chain(fat_file_t *file)
+{
+    while (!file->runs_complete) {
+        status_t err = fat32_extend_run_map(file);
+        if (err < 0 && err != ERR_NOT_FOUND)
+            return err;
+    }
 
-        uint32_t to_read = fat->bytes_per_cluster;
-        uint32_t next_cluster = 0;
-        while ((next_cluster = fat32_next_cluster_in_chain(fat, cluster)) == cluster + 1) {
-            cluster = next_cluster;
-            to_read += fat->bytes_per_cluster;
+    if (file->run_count == 0)
+        return 0;
+
+    const fat_run_t *last = &file->runs[file->run_count - 1];
+    return last->file_cluster + last->count;
+}
+
+/* find the run holding a cluster of the file, mapping more of the chain if needed */
+static const fat_run_t *fat32_find_run(fat_file_t *file, uint32_t file_cluster)
+{
+    const fat_run_t *run;
+
+    /* sequential reads stay in the same run or move to the next one */
+    for (uint32_t i = file->last_run; i < file->run_count && i <= file->last_run + 1; i++) {
+        run = &file->runs[i];
+        if (file_cluster >= run->file_cluster && file_cluster - run->file_cluster < run->count) {
+            file->last_run = i;
+            return run;
+        }
+    }
+
+    if (file->run_count > 0) {
+        run = &file->runs[file->run_count - 1];
+        if (file_cluster < run->file_cluster + run->count) {
+            /* already mapped, binary search for it */
+            uint32_t lo = 0, hi = file->run_count - 1;
+            while (lo < hi) {
+                uint32_t mid = (lo + hi + 1) / 2;
+                if (file->runs[mid].file_cluster <= file_cluster)
+                    lo = mid;
+                else
+                    hi = mid - 1;
+            }
+            file->last_run = lo;
+            return &file->runs[lo];
+        }
+    }
+
+    while (!file->runs_complete) {
+        if (fat32_extend_run_map(file) < 0)
+            break;
+
+        run = &file->runs[file->run_count - 1];
+        if (file_cluster < run->file_cluster + run->count) {
+            file->last_run = file->run_count - 1;
+            return run;
         }
-        cluster = next_cluster;
+    }
+
+    return NULL;
+}
+
+/*
+ * Add count clusters to the end of the file, in as few runs as the free space allows and
+ * directly behind the current last cluster when that is free. Caller holds file->lock.
+ */
+static status_t fat32_alloc_clusters(fat_file_t *file, uint32_t count)
+{
+    fat_fs_t *fat = file->fat_fs;
 
-        to_read = MIN(length - amount_read, to_read);
-        // XXX: support non-0 offsets
-        int err = bio_read(dev, buf+amount_read, lba_addr, to_read);
+    ssize_t mapped = fat32_map_chain(file);
+    if (mapped < 0)
+        return mapped;
+
+    status_t err = NO_ERROR;
+    mutex_acquire(&fat->lock);
+    fat32_invalidate_fsinfo(fat);
+
+    while (count > 0) {
+        uint32_t tail = 0;
+        if (file->run_count > 0) {
+            const fat_run_t *last = &file->runs[file->run_count - 1];
+            tail = last->disk_cluster + last->count - 1;
+        }
+
+        uint32_t found;
+        uint32_t first = fat32_find_free(fat, tail + 1, count, &found);
+        if (found == 0) {
+            err = ERR_NO_RESOURCES;
+            break;
+        }
+
+        /* room in the map first, so it can't fail once the fat has been changed */
+        bool new_run = (tail == 0 || first != tail + 1);
+        if (new_run && (err = fat32_grow_run_map(file)) < 0)
+            break;
+
+        for (uint32_t i = 0; i < found && err == NO_ERROR; i++)
+            err = fat32_set_next_cluster(fat, first + i, (i == found - 1) ? FAT_EOC : first + i + 1);
+        if (err == NO_ERROR && tail != 0)
+            err = fat32_set_next_cluster(fat, tail, first);
+        if (err < 0)
+            break;
+
+        LTRACEF("file %p: %u clusters at %u, after %u\n", file, found, first, tail);
+
+        if (tail == 0) {
+            file->start_cluster = first;
+            file->dirty = true;
+        }
+        if (new_run) {
+            fat_run_t *run = &file->runs[file->run_count++];
+            run->file_cluster = mapped;
+            run->disk_cluster = first;
+            run->count = found;
+        } else {
+            file->runs[file->run_count - 1].count += found;
+        }
+
+        fat->next_free = first + found;
+        mapped += found;
+        count -= found;
+    }
+
+    mutex_release(&fat->lock);
+    return err;
+}
+
+/* write the buffered data out, allocating the clusters it needs first. Caller holds file->lock */
+static status_t fat32_flush_buffer(fat_file_t *file)
+{
+    fat_fs_t *fat = file->fat_fs;
+
+    if (file->wbuf_len == 0)
+        return NO_ERROR;
+
+    off_t end = file->wbuf_offset + file->wbuf_len;
+    uint32_t needed = (end + fat->bytes_per_cluster - 1) / fat->bytes_per_cluster;
+
+    ssize_t have = fat32_map_chain(file);
+    status_t err = (have < 0) ? (status_t)have : NO_ERROR;
+    if (err == NO_ERROR && needed > (uint32_t)have)
+        err = fat32_alloc_clusters(file, needed - have);
+
+    size_t written = 0;
+    while (err == NO_ERROR && written < file->wbuf_len) {
+        off_t pos = file->wbuf_offset + written;
+        uint32_t file_cluster = pos / fat->bytes_per_cluster;
+
+        const fat_run_t *run = fat32_find_run(file, file_cluster);
+        if (!run) {
+            err = ERR_IO;
+            break;
+        }
+
+        /* write to the end of the run in one go */
+        uint32_t in_run = file_cluster - run->file_cluster;
+        off_t in_cluster = pos % fat->bytes_per_cluster;
+        size_t to_write = (size_t)(run->count - in_run) * fat->bytes_per_cluster - in_cluster;
+        to_write = MIN(file->wbuf_len - written, to_write);
+
+        off_t addr = fat32_offset_for_cluster(fat, run->disk_cluster + in_run) + in_cluster;
+        ssize_t ret = bio_write(fat->dev, file->wbuf + written, addr, to_write);
+        if (ret < 0)
+            err = ret;
+        else if ((size_t)ret != to_write)
+            err = ERR_IO;
+
+        written += to_write;
+    }
+
+    if (err < 0) {
+        /* whatever didn't find a home is lost, don't claim it is in the file */
+        uint64_t allocated = (uint64_t)MAX(fat32_map_chain(file), 0) * fat->bytes_per_cluster;
+        if (file->length > allocated) {
+            file->length = allocated;
+            file->dirty = true;
+        }
+    }
+
+    file->wbuf_len = 0;
+    fs_pcache_invalidate((fscookie *)fat, file->start_cluster);
+
+    return err;
+}
+
+/* get everything about the file onto the disk. Caller holds file->lock */
+static status_t fat32_sync_file(fat_file_t *file)
+{
+    fat_fs_t *fat = file->fat_fs;
+
+    status_t err = fat32_flush_buffer(file);
+
+    if (file->dirty) {
+        uint bnum = file->dirent_offset / fat->bytes_per_sector;
+        void *cache_ptr;
+
+        if (bcache_get_block(fat->cache, &cache_ptr, bnum) < 0)
+            return ERR_IO;
+
+        uint8_t *entry = (uint8_t *)cache_ptr + file->dirent_offset % fat->bytes_per_sector;
+        fat_write16(entry, 0x1a, file->start_cluster & 0xffff);
+        if (fat->fat_bits == 32) {
+            fat_write16(entry, 0x14, file->start_cluster >> 16);
+        }
+        fat_write32(entry, 0x1c, file->length);
+        entry[0x0b] |= fat_attribute_archive;
+
+        bcache_mark_block_dirty(fat->cache, bnum);
+        bcache_put_block(fat->cache, bnum);
+        file->dirty = false;
+    }
+
+    /* data went straight to the device, so the fat and directory follow it */
+    if (bcache_flush(fat->cache) < 0 && err == NO_ERROR)
+        err = ERR_IO;
+
+    return err;
+}
+
+/*
+ * Copy into the write buffer, which holds one contiguous stretch of the file. A write past the
+ * end leaves a gap that is filled with zeros. Caller holds file->lock.
+ */
+static status_t fat32_buffer_write(fat_file_t *file, const uint8_t *buf, off_t offset, size_t len)
+{
+    fat_fs_t *fat = file->fat_fs;
+
+    if (!file->wbuf) {
+        file->wbuf = malloc(file->wbuf_size);
+        if (!file->wbuf)
+            return ERR_NO_MEMORY;
+    }
+
+    size_t written = 0;
+    for (;;) {
+        const uint8_t *src;
+        off_t pos;
+        size_t n;
+
+        if (file->length < offset) {
+            src = NULL;
+            pos = file->length;
+            n = offset - file->length;
+        } else if (written < len) {
+            src = buf + written;
+            pos = offset + written;
+            n = len - written;
+        } else {
+            break;
+        }
+
+        if (file->wbuf_len > 0 && pos != file->wbuf_offset + (off_t)file->wbuf_len) {
+            status_t err = fat32_flush_buffer(file);
+            if (err < 0)
+                return err;
+        }
+        if (file->wbuf_len == 0)
+            file->wbuf_offset = pos;
+
+        /* end the buffer on a cluster boundary so later flushes write whole clusters */
+        size_t limit = file->wbuf_size - file->wbuf_offset % fat->bytes_per_cluster;
+        n = MIN(n, limit - file->wbuf_len);
+        if (src) {
+            memcpy(file->wbuf + file->wbuf_len, src, n);
+            written += n;
+        } else {
+            memset(file->wbuf + file->wbuf_len, 0, n);
+        }
+        file->wbuf_len += n;
+
+        if (pos + n > file->length) {
+            file->length = pos + n;
+            file->dirty = true;
+        }
+
+        if (file->wbuf_len == limit) {
+            status_t err = fat32_flush_buffer(file);
+            if (err < 0)
+                return err;
+        }
+    }
+
+    return NO_ERROR;
+}
+
+/* cut the file down to len bytes. Caller holds file->lock with the write buffer flushed */
+static status_t fat32_shrink_file(fat_file_t *file, uint32_t len)
+{
+    fat_fs_t *fat = file->fat_fs;
+    uint32_t keep = (len + fat->bytes_per_cluster - 1) / fat->bytes_per_cluster;
+    uint32_t old_start = file->start_cluster;
+
+    ssize_t mapped = fat32_map_chain(file);
+    if (mapped < 0)
+        return mapped;
+
+    status_t err = NO_ERROR;
+    mutex_acquire(&fat->lock);
+    fat32_invalidate_fsinfo(fat);
+    if (keep == 0) {
+        err = fat32_free_chain(fat, file->start_cluster);
+        file->start_cluster = 0;
+    } else if (keep < (uint32_t)mapped) {
+        const fat_run_t *run = fat32_find_run(file, keep - 1);
+        if (run) {
+            uint32_t tail = run->disk_cluster + (keep - 1 - run->file_cluster);
+            uint32_t next = fat32_next_cluster_in_chain(fat, tail);
+
+            err = fat32_set_next_cluster(fat, tail, FAT_EOC);
+            if (err == NO_ERROR)
+                err = fat32_free_chain(fat, next);
+        } else {
+            err = ERR_IO;
+        }
+    }
+    mutex_release(&fat->lock);
+
+    /* drop the part of the map past the new end */
+    while (file->run_count > 0 && file->runs[file->run_count - 1].file_cluster >= keep)
+        file->run_count--;
+    if (file->run_count > 0) {
+        fat_run_t *last = &file->runs[file->run_count - 1];
+        last->count = MIN(last->count, keep - last->file_cluster);
+    }
+    file->last_run = 0;
+
+    file->length = len;
+    file->dirty = true;
+    fs_pcache_invalidate((fscookie *)fat, old_start);
+
+    return err;
+}
+
+/* page cache fill routine, offset and len are within the file */
+static ssize_t fat32_fill_file(void *arg, void *buf, off_t offset, size_t len)
+{
+    fat_file_t *file = (fat_file_t *)arg;
+    fat_fs_t *fat = file->fat_fs;
+    bdev_t *dev = fat->dev;
+
+    mutex_acquire(&file->lock);
+
+    size_t amount_read = 0;
+    while (amount_read < len) {
+        off_t pos = offset + amount_read;
+        uint32_t file_cluster = pos / fat->bytes_per_cluster;
+
+        const fat_run_t *run = fat32_find_run(file, file_cluster);
+        if (!run) {
+            printf("no more clusters, file cluster %u, amount_read=%zu\n", file_cluster, amount_read);
+            break;
+        }
+
+        /* read to the end of the run in one go */
+        uint32_t in_run = file_cluster - run->file_cluster;
+        off_t in_cluster = pos % fat->bytes_per_cluster;
+        size_t to_read = (size_t)(run->count - in_run) * fat->bytes_per_cluster - in_cluster;
+        to_read = MIN(len - amount_read, to_read);
+
+        off_t addr = fat32_offset_for_cluster(fat, run->disk_cluster + in_run) + in_cluster;
+        ssize_t err = bio_read(dev, (uint8_t *)buf + amount_read, addr, to_read);
         if (err < 0) {
+            mutex_release(&file->lock);
             return err;
         }
 
         amount_read += to_read;
+    }
 
-        if (amount_read < length) {
-            if (cluster == 0x0fffffff) {
-                printf("no more clusters, amount_read=%i, to_read=%i\n", amount_read, to_read);
-                break;
-            }
-        }
-    } while (amount_read < length);
+    mutex_release(&file->lock);
+
+    if (amount_read == 0)
+        return ERR_IO;
 
     return amount_read;
 }
 
+ssize_t fat32_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len)
+{
+    fat_file_t *file = (fat_file_t *)fcookie;
+
+    /* reads only see what is on the disk */
+    mutex_acquire(&file->lock);
+    status_t err = fat32_flush_buffer(file);
+    mutex_release(&file->lock);
+    if (err < 0)
+        return err;
+
+    /* the start cluster names the contents, writes invalidate the cached pages under it */
+    return fs_pcache_read((fscookie *)file->fat_fs, file->start_cluster, file->length,
+                          buf, offset, len, fat32_fill_file, file);
+}
+
+ssize_t fat32_write_file(filecookie *fcookie, const void *buf, off_t offset, size_t len)
+{
+    fat_file_t *file = (fat_file_t *)fcookie;
+
+    if (offset < 0)
+        return ERR_INVALID_ARGS;
+    if (file->attributes & fat_attribute_directory)
+        return ERR_NOT_FILE;
+    if (file->attributes & fat_attribute_read_only)
+        return ERR_ACCESS_DENIED;
+
+    /* sizes are 32 bits on the disk */
+    if ((uint64_t)offset + len > UINT32_MAX)
+        return ERR_TOO_BIG;
+
+    mutex_acquire(&file->lock);
+    status_t err = fat32_buffer_write(file, buf, offset, len);
+    mutex_release(&file->lock);
+
+    return (err < 0) ? err : (ssize_t)len;
+}
+
+status_t fat32_truncate_file(filecookie *fcookie, uint64_t len)
+{
+    fat_file_t *file = (fat_file_t *)fcookie;
+
+    if (file->attributes & fat_attribute_directory)
+        return ERR_NOT_FILE;
+    if (file->attributes & fat_attribute_read_only)
+        return ERR_ACCESS_DENIED;
+    if (len > UINT32_MAX)
+        return ERR_TOO_BIG;
+
+    mutex_acquire(&file->lock);
+
+    status_t err = fat32_flush_buffer(file);
+    if (err == NO_ERROR && len > file->length) {
+        /* growing writes zeros through the buffer like any other write */
+        err = fat32_buffer_write(file, NULL, len, 0);
+    } else if (err == NO_ERROR && len < file->length) {
+        err = fat32_shrink_file(file, len);
+    }
+    if (err == NO_ERROR)
+        err = fat32_sync_file(file);
+
+    mutex_release(&file->lock);
+
+    return err;
+}
+
+ssize_t fat32_map_file(filecookie *fcookie, off_t offset, size_t len, off_t *dev_offset)
+{
+    fat_file_t *file = (fat_file_t *)fcookie;
+    fat_fs_t *fat = file->fat_fs;
+
+    if (offset < 0)
+        return ERR_INVALID_ARGS;
+
+    mutex_acquire(&file->lock);
+
+    status_t err = fat32_flush_buffer(file);
+    if (err < 0) {
+        mutex_release(&file->lock);
+        return err;
+    }
+    if (offset >= file->length) {
+        mutex_release(&file->lock);
+        return 0;
+    }
+    len = MIN(len, (size_t)(file->length - offset));
+
+    uint32_t file_cluster = offset / fat->bytes_per_cluster;
+    const fat_run_t *run = fat32_find_run(file, file_cluster);
+    if (!run) {
+        mutex_release(&file->lock);
+        return ERR_IO;
+    }
+
+    uint32_t in_run = file_cluster - run->file_cluster;
+    off_t in_cluster = offset % fat->bytes_per_cluster;
+    *dev_offset = fat32_offset_for_cluster(fat, run->disk_cluster + in_run) + in_cluster;
+    len = MIN(len, (size_t)(run->count - in_run) * fat->bytes_per_cluster - in_cluster);
+
+    mutex_release(&file->lock);
+
+    return len;
+}
+
 status_t fat32_close_file(filecookie *fcookie)
 {
     fat_file_t *file = (fat_file_t *)fcookie;
+
+    /* on failure the file stays open so the close can be retried */
+    mutex_acquire(&file->lock);
+    status_t err = fat32_sync_file(file);
+    mutex_release(&file->lock);
+    if (err < 0)
+        return err;
+
+    mutex_destroy(&file->lock);
+    free(file->wbuf);
+    free(file->runs);
     free(file);
     return NO_ERROR;
 }
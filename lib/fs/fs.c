@@ -29,31 +29,18 @@
 #include <lib/fs.h>
 #include <lib/bio.h>
 #include <lk/init.h>
-#include <kernel/mutex.h>
+#include <lk/bootprof.h>
+#include <kernel/rwlock.h>
+#include <kernel/spinlock.h>
+#include <platform.h>
+#include "fs_priv.h"
 
 #define LOCAL_TRACE 0
 
-struct fs_mount {
-    struct list_node node;
-
-    char *path;
-    bdev_t *dev;
-    fscookie *cookie;
-    int ref;
-    const struct fs_api *api;
-};
-
-struct filehandle {
-    filecookie *cookie;
-    struct fs_mount *mount;
-};
-
-struct dirhandle {
-    dircookie *cookie;
-    struct fs_mount *mount;
-};
-
-static mutex_t mount_lock = MUTEX_INITIAL_VALUE(mount_lock);
+/* lookups take mount_lock for reading, changes to the mount list take it for writing.
+ * since lookups run in parallel, the per mount ref count is protected by mount_ref_lock. */
+static rwlock_t mount_lock = RWLOCK_INITIAL_VALUE(mount_lock);
+static spin_lock_t mount_ref_lock = SPIN_LOCK_INITIAL_VALUE;
 static struct list_node mounts = LIST_INITIAL_VALUE(mounts);
 static struct list_node fses = LIST_INITIAL_VALUE(fses);
 
@@ -78,7 +65,7 @@ static struct fs_mount *find_mount(const char *path, const char **trimmed_path)
     struct fs_mount *mount;
     size_t pathlen = strlen(path);
 
-    mutex_acquire(&mount_lock);
+    rwlock_acquire_read(&mount_lock);
     list_for_every_entry(&mounts, mount, struct fs_mount, node) {
         size_t mountpathlen = strlen(mount->path);
         if (pathlen < mountpathlen)
@@ -90,14 +77,17 @@ static struct fs_mount *find_mount(const char *path, const char **trimmed_path)
             if (trimmed_path)
                 *trimmed_path = &path[mountpathlen];
 
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&mount_ref_lock, state);
             mount->ref++;
+            spin_unlock_irqrestore(&mount_ref_lock, state);
 
-            mutex_release(&mount_lock);
+            rwlock_release_read(&mount_lock);
             return mount;
         }
     }
 
-    mutex_release(&mount_lock);
+    rwlock_release_read(&mount_lock);
     return NULL;
 }
 
@@ -105,16 +95,38 @@ static struct fs_mount *find_mount(const char *path, const char **trimmed_path)
 // cause an unmount operation
 static void put_mount(struct fs_mount *mount)
 {
-    mutex_acquire(&mount_lock);
-    if ((--mount->ref) == 0) {
+    spin_lock_saved_state_t state;
+
+    /* fast path, this is not the last ref */
+    spin_lock_irqsave(&mount_ref_lock, state);
+    if (mount->ref > 1) {
+        mount->ref--;
+        spin_unlock_irqrestore(&mount_ref_lock, state);
+        return;
+    }
+    spin_unlock_irqrestore(&mount_ref_lock, state);
+
+    /* possibly the last ref, hold off lookups while dropping it so
+     * nobody can pick up a new ref to a mount being torn down */
+    rwlock_acquire_write(&mount_lock);
+    spin_lock_irqsave(&mount_ref_lock, state);
+    int ref = --mount->ref;
+    spin_unlock_irqrestore(&mount_ref_lock, state);
+
+    if (ref == 0) {
         list_delete(&mount->node);
-        mount->api->unmount(mount->cookie);
+        fs_stats_unregister(mount);
+        fs_dcache_purge(mount->cookie);
+        fs_pcache_purge(mount->cookie);
+        lk_bigtime_t start = current_time_hires();
+        status_t err = mount->api->unmount(mount->cookie);
+        fs_stats_account(mount, FS_OP_UNMOUNT, NULL, mount->path, 0, 0, start, err);
         free(mount->path);
         if (mount->dev)
             bio_close(mount->dev);
         free(mount);
     }
-    mutex_release(&mount_lock);
+    rwlock_release_write(&mount_lock);
 }
 
 static status_t mount(const char *path, const char *device, const struct fs_api *api)
@@ -145,6 +157,7 @@ static status_t mount(const char *path, const char *device, const struct fs_api
 
     /* call into the fs implementation */
     fscookie *cookie;
+    lk_bigtime_t start = current_time_hires();
     status_t err = api->mount(dev, &cookie);
     if (err < 0) {
         if (dev) bio_close(dev);
@@ -158,8 +171,12 @@ static status_t mount(const char *path, const char *device, const struct fs_api
     mount->cookie = cookie;
     mount->ref = 1;
     mount->api = api;
+    fs_stats_register(mount);
+    fs_stats_account(mount, FS_OP_MOUNT, NULL, mount->path, 0, 0, start, err);
 
+    rwlock_acquire_write(&mount_lock);
     list_add_head(&mounts, &mount->node);
+    rwlock_release_write(&mount_lock);
 
     return 0;
 
@@ -192,7 +209,11 @@ status_t fs_mount(const char *path, const char *fsname, const char *device)
     if (!fs)
         return ERR_NOT_FOUND;
 
-    return mount(path, device, fs->api);
+    uint32_t start = bootprof_start();
+    status_t err = mount(path, device, fs->api);
+    bootprof_record(BOOTPROF_MOUNT, path, 0, start);
+
+    return err;
 }
 
 status_t fs_unmount(const char *path)
@@ -231,8 +252,10 @@ status_t fs_open_file(const char *path, filehandle **handle)
     LTRACEF("path %s temppath %s newpath %s\n", path, temppath, newpath);
 
     filecookie *cookie;
+    lk_bigtime_t start = current_time_hires();
     status_t err = mount->api->open(mount->cookie, newpath, &cookie);
     if (err < 0) {
+        fs_stats_account(mount, FS_OP_OPEN, NULL, temppath, 0, 0, start, err);
         put_mount(mount);
         return err;
     }
@@ -242,6 +265,8 @@ status_t fs_open_file(const char *path, filehandle **handle)
     f->mount = mount;
     *handle = f;
 
+    fs_stats_account(mount, FS_OP_OPEN, f, temppath, 0, 0, start, err);
+
     return 0;
 }
 
@@ -275,8 +300,15 @@ status_t fs_create_file(const char *path, filehandle **handle, uint64_t len)
     }
 
     filecookie *cookie;
+    lk_bigtime_t start = current_time_hires();
     status_t err = mount->api->create(mount->cookie, newpath, &cookie, len);
+
+    /* the fs may have cached the name as missing, or as something else */
+    fs_dcache_purge(mount->cookie);
+    fs_pcache_purge(mount->cookie);
+
     if (err < 0) {
+        fs_stats_account(mount, FS_OP_CREATE, NULL, temppath, 0, len, start, err);
         put_mount(mount);
         return err;
     }
@@ -286,6 +318,8 @@ status_t fs_create_file(const char *path, filehandle **handle, uint64_t len)
     f->mount = mount;
     *handle = f;
 
+    fs_stats_account(mount, FS_OP_CREATE, f, temppath, 0, len, start, err);
+
     return 0;
 }
 
@@ -296,7 +330,11 @@ status_t fs_truncate_file(filehandle *handle, uint64_t len)
     if (unlikely(!handle))
         return ERR_INVALID_ARGS;
 
-    return handle->mount->api->truncate(handle->cookie, len);
+    lk_bigtime_t start = current_time_hires();
+    status_t err = handle->mount->api->truncate(handle->cookie, len);
+    fs_stats_account(handle->mount, FS_OP_TRUNCATE, handle, NULL, len, 0, start, err);
+
+    return err;
 }
 
 status_t fs_remove_file(const char *path)
@@ -316,7 +354,11 @@ status_t fs_remove_file(const char *path)
         return ERR_NOT_SUPPORTED;
     }
 
+    lk_bigtime_t start = current_time_hires();
     status_t err = mount->api->remove(mount->cookie, newpath);
+    fs_stats_account(mount, FS_OP_REMOVE, NULL, temppath, 0, 0, start, err);
+    fs_dcache_purge(mount->cookie);
+    fs_pcache_purge(mount->cookie);
 
     put_mount(mount);
 
@@ -325,7 +367,11 @@ status_t fs_remove_file(const char *path)
 
 ssize_t fs_read_file(filehandle *handle, void *buf, off_t offset, size_t len)
 {
-    return handle->mount->api->read(handle->cookie, buf, offset, len);
+    lk_bigtime_t start = current_time_hires();
+    ssize_t err = handle->mount->api->read(handle->cookie, buf, offset, len);
+    fs_stats_account(handle->mount, FS_OP_READ, handle, NULL, offset, len, start, err);
+
+    return err;
 }
 
 ssize_t fs_write_file(filehandle *handle, const void *buf, off_t offset, size_t len)
@@ -333,12 +379,18 @@ ssize_t fs_write_file(filehandle *handle, const void *buf, off_t offset, size_t
     if (!handle->mount->api->write)
         return ERR_NOT_SUPPORTED;
 
-    return handle->mount->api->write(handle->cookie, buf, offset, len);
+    lk_bigtime_t start = current_time_hires();
+    ssize_t err = handle->mount->api->write(handle->cookie, buf, offset, len);
+    fs_stats_account(handle->mount, FS_OP_WRITE, handle, NULL, offset, len, start, err);
+
+    return err;
 }
 
 status_t fs_close_file(filehandle *handle)
 {
+    lk_bigtime_t start = current_time_hires();
     status_t err = handle->mount->api->close(handle->cookie);
+    fs_stats_account(handle->mount, FS_OP_CLOSE, handle, NULL, 0, 0, start, err);
     if (err < 0)
         return err;
 
@@ -369,7 +421,10 @@ status_t fs_make_dir(const char *path)
         return ERR_NOT_SUPPORTED;
     }
 
+    lk_bigtime_t start = current_time_hires();
     status_t err = mount->api->mkdir(mount->cookie, newpath);
+    fs_stats_account(mount, FS_OP_MKDIR, NULL, temppath, 0, 0, start, err);
+    fs_dcache_purge(mount->cookie);
 
     put_mount(mount);
 
@@ -398,8 +453,10 @@ status_t fs_open_dir(const char *path, dirhandle **handle)
     }
 
     dircookie *cookie;
+    lk_bigtime_t start = current_time_hires();
     status_t err = mount->api->opendir(mount->cookie, newpath, &cookie);
     if (err < 0) {
+        fs_stats_account(mount, FS_OP_OPENDIR, NULL, temppath, 0, 0, start, err);
         put_mount(mount);
         return err;
     }
@@ -409,6 +466,8 @@ status_t fs_open_dir(const char *path, dirhandle **handle)
     d->mount = mount;
     *handle = d;
 
+    fs_stats_account(mount, FS_OP_OPENDIR, d, temppath, 0, 0, start, err);
+
     return 0;
 }
 
@@ -461,6 +520,19 @@ status_t fs_stat_fs(const char *mountpoint, struct fs_stat *stat)
 }
 
 
+void fs_for_each_mount(void (*cb)(const char *path, const struct fs_mount_stats *stats))
+{
+    struct fs_mount *mount;
+    struct fs_mount_stats stats;
+
+    rwlock_acquire_read(&mount_lock);
+    list_for_every_entry(&mounts, mount, struct fs_mount, node) {
+        fs_stats_snapshot(mount, &stats);
+        cb(mount->path, &stats);
+    }
+    rwlock_release_read(&mount_lock);
+}
+
 ssize_t fs_load_file(const char *path, void *ptr, size_t maxlen)
 {
     filehandle *handle;
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <list.h>
+#include <lib/bio.h>
+#include <lib/console.h>
+#include <lib/fs.h>
+
+/* per mount counters, see stats.c. times are in usecs spent in the fs implementation,
+ * lookups are the opens, creates, removes and directory operations. */
+struct fs_mount_stats {
+    struct list_node node;
+    fscookie *cookie;
+
+    uint64_t opens;
+    uint64_t creates;
+    uint64_t removes;
+    uint64_t dir_ops;
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t writes;
+    uint64_t write_bytes;
+    uint64_t errors;
+    uint64_t dcache_hits;
+    uint64_t dcache_misses;
+    uint64_t pcache_hits;
+    uint64_t pcache_misses;
+    lk_bigtime_t lookup_time;
+    lk_bigtime_t read_time;
+    lk_bigtime_t write_time;
+};
+
+struct fs_mount {
+    struct list_node node;
+
+    char *path;
+    bdev_t *dev;
+    fscookie *cookie;
+    int ref;
+    const struct fs_api *api;
+
+    struct fs_mount_stats stats;
+};
+
+struct filehandle {
+    filecookie *cookie;
+    struct fs_mount *mount;
+};
+
+struct dirhandle {
+    dircookie *cookie;
+    struct fs_mount *mount;
+};
+
+enum fs_op {
+    FS_OP_MOUNT,
+    FS_OP_UNMOUNT,
+    FS_OP_OPEN,
+    FS_OP_CREATE,
+    FS_OP_REMOVE,
+    FS_OP_CLOSE,
+    FS_OP_READ,
+    FS_OP_READ_ASYNC,
+    FS_OP_WRITE,
+    FS_OP_TRUNCATE,
+    FS_OP_MKDIR,
+    FS_OP_OPENDIR,
+};
+
+void fs_stats_register(struct fs_mount *mount);
+void fs_stats_unregister(struct fs_mount *mount);
+void fs_stats_snapshot(struct fs_mount *mount, struct fs_mount_stats *stats);
+
+/* account an operation on mount that started at start and returned result, and trace it.
+ * name is the path for operations by name, handle the file or dir handle for the others. */
+void fs_stats_account(struct fs_mount *mount, enum fs_op op, const void *handle, const char *name,
+                      off_t offset, size_t len, lk_bigtime_t start, ssize_t result);
+
+/* count a dcache or pcache lookup against the mount of fs */
+void fs_stats_count_cache(fscookie *fs, bool pcache, bool hit);
+
+/* call cb with a snapshot of the counters of every mount, from fs.c */
+void fs_for_each_mount(void (*cb)(const char *path, const struct fs_mount_stats *stats));
+
+void fs_stats_dump(void);
+int fs_trace_cmd(int argc, const cmd_args *argv);
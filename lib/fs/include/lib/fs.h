@@ -25,6 +25,10 @@
 #include <stdbool.h>
 #include <sys/types.h>
 #include <compiler.h>
+#include <list.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <lib/workqueue.h>
 
 #define FS_MAX_PATH_LEN 128
 #define FS_MAX_FILE_LEN 64
@@ -75,6 +79,43 @@ status_t fs_close_file(filehandle *handle) __NONNULL();
 status_t fs_stat_file(filehandle *handle, struct file_stat *) __NONNULL((1));
 status_t fs_truncate_file(filehandle *handle, uint64_t len) __NONNULL((1));
 
+/* asynchronous file read */
+typedef struct fs_read_request fs_read_request_t;
+typedef void (*fs_read_callback_t)(fs_read_request_t *req);
+
+struct fs_read_request {
+    /* filled in by the caller */
+    void *buf;
+    off_t offset;
+    size_t len;
+
+    /* if set, called exactly once when the read completes, from a worker thread. the request
+     * belongs to the callback from then on. if not set, wait with fs_read_request_wait(). */
+    fs_read_callback_t callback;
+    void *cookie;
+
+    /* bytes read or error, valid once the request completes */
+    ssize_t result;
+
+    /* private to the fs layer while the request is in flight */
+    event_t done;
+    spin_lock_t lock;
+    int pending;
+    ssize_t error;
+    struct list_node pieces;
+    work_t work;
+    filehandle *handle;
+    lk_bigtime_t start;
+};
+
+/* start reading a file without waiting for it. If the fs can tell where the file's data lives
+ * on its device the read goes straight to the device, in as many requests as it takes, through
+ * the asynchronous bio api; otherwise it is carried out with fs_read_file() before this returns.
+ * On success the request completes later, on failure it is never completed. The handle must
+ * stay open until it does. */
+status_t fs_read_file_async(filehandle *handle, fs_read_request_t *req) __NONNULL();
+ssize_t fs_read_request_wait(fs_read_request_t *req) __NONNULL();
+
 /* dir api */
 status_t fs_make_dir(const char *path) __NONNULL();
 status_t fs_open_dir(const char *path, dirhandle **handle) __NONNULL();
@@ -86,6 +127,16 @@ status_t fs_stat_fs(const char *mountpoint, struct fs_stat *stat) __NONNULL((1))
 /* convenience routines */
 ssize_t fs_load_file(const char *path, void *ptr, size_t maxlen) __NONNULL();
 
+/* map a file into aspace, reading pages in as they are first touched. The mapping is private,
+ * nothing written to it reaches the file. File systems keeping files in memory may map their
+ * own pages read only rather than copying them, such a page shows later writes to the file
+ * until the mapping writes to it itself. len, if not NULL, returns the file size; the rest of
+ * the last page reads as zeros. Unmap it with vmm_free_region(), which also closes the file.
+ * Only with WITH_KERNEL_VM. */
+struct vmm_aspace;
+status_t fs_map_file(const char *path, struct vmm_aspace *aspace, void **ptr, size_t *len,
+                     uint arch_mmu_flags) __NONNULL((1, 2, 3));
+
 /* walk through a path string, removing duplicate path separators, flattening . and .. references */
 void fs_normalize_path(char *path) __NONNULL();
 
@@ -119,6 +170,16 @@ struct fs_api {
     status_t (*closedir)(dircookie *) __NONNULL();
 
     status_t (*file_ioctl)(filecookie *, int, void *);
+
+    /* optional, for fs_read_file_async. returns how many bytes of the file starting at offset,
+     * up to len, lie one after the other on the device at *dev_offset, or in a hole if that is
+     * set to -1. returns 0 at the end of the file. */
+    ssize_t (*map)(filecookie *, off_t offset, size_t len, off_t *dev_offset);
+
+    /* optional, for fs_map_file. returns the kernel address of a page holding the file's data
+     * at the page aligned offset, to be mapped in place of a copy, or NULL to have it read. The
+     * page must not be freed or reused until the file is closed. */
+    void *(*map_page)(filecookie *, off_t offset);
 };
 
 struct fs_impl {
@@ -130,4 +191,33 @@ struct fs_impl {
 #define STATIC_FS_IMPL(_name, _api) const struct fs_impl __fs_impl_##_name __ALIGNED(sizeof(void *)) __SECTION(".fs_impl") = \
     { .name = #_name, .api = _api }
 
+/*
+ * Name lookup cache for fs implementations, keyed by the mounted fs, a parent directory and a
+ * component name. parent and node are whatever the fs uses to find a directory or file again.
+ * fs_dcache_lookup returns NO_ERROR and fills in node if the name is known to exist,
+ * ERR_NOT_FOUND if it is known not to, and ERR_NO_MSG if the cache has nothing on it.
+ * The fs layer purges a mount's entries on unmount and after creates and removes on it.
+ */
+status_t fs_dcache_lookup(fscookie *fs, uint64_t parent, const char *name, size_t namelen, uint64_t *node) __NONNULL((3)) __NONNULL((5));
+void fs_dcache_insert(fscookie *fs, uint64_t parent, const char *name, size_t namelen, uint64_t node, bool exists) __NONNULL((3));
+void fs_dcache_remove(fscookie *fs, uint64_t parent, const char *name, size_t namelen) __NONNULL((3));
+void fs_dcache_purge(fscookie *fs);
+void fs_dcache_dump(void);
+
+/*
+ * Page cache of file contents for fs implementations, keyed by the mounted fs, a file id that
+ * stays the same for as long as the contents do, and the offset. fs_pcache_read reads up to len
+ * bytes of a file_len long file, calling fill to read from the device whatever isn't cached.
+ * fill is called without any cache locks held. An fs that changes a file's contents or length
+ * must call fs_pcache_invalidate afterwards. The fs layer purges a mount's pages on unmount and
+ * after creates and removes on it.
+ */
+typedef ssize_t (*fs_pcache_fill_t)(void *arg, void *buf, off_t offset, size_t len);
+
+ssize_t fs_pcache_read(fscookie *fs, uint64_t file, uint64_t file_len, void *buf, off_t offset, size_t len,
+                       fs_pcache_fill_t fill, void *arg) __NONNULL((4)) __NONNULL((7));
+void fs_pcache_invalidate(fscookie *fs, uint64_t file);
+void fs_pcache_purge(fscookie *fs);
+void fs_pcache_dump(void);
+
 __END_CDECLS
@@ -31,6 +31,9 @@
 
 typedef struct {
     uint32_t toc_pages;
+    // Pages for the log of ToC changes that saves rewriting a whole ToC on
+    // every create, remove and length change. 0 for none.
+    uint32_t log_pages;
 } spifs_format_args_t;
 
 #endif  // LIB_FS_SPIFS_H_
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Mapping files into an address space.
+ *
+ * The region is backed by a vmm pager that reads a page of the file through the fs layer, and
+ * so through the page cache, the first time it is touched. Pages are private to the region;
+ * for a writable mapping, writes stay in memory and the file never sees them. File systems
+ * that have the page in memory already can hand it out to be mapped read only instead.
+ */
+#include <debug.h>
+#include <trace.h>
+#include <err.h>
+#include <string.h>
+#include <stdlib.h>
+#include <lib/fs.h>
+#include <kernel/vm.h>
+
+#include "fs_priv.h"
+
+#define LOCAL_TRACE 0
+
+struct file_pager {
+    vmm_pager_t pager;
+    filehandle *handle;
+    uint64_t size;
+};
+
+static status_t file_pager_fill(vmm_pager_t *pager, size_t offset, void *page)
+{
+    struct file_pager *fp = containerof(pager, struct file_pager, pager);
+    size_t len = 0;
+
+    LTRACEF("handle %p offset 0x%zx\n", fp->handle, offset);
+
+    if (offset < fp->size) {
+        ssize_t err = fs_read_file(fp->handle, page, offset, MIN(PAGE_SIZE, fp->size - offset));
+        if (err < 0)
+            return err;
+        len = err;
+    }
+
+    /* past the end of the file reads as zeros */
+    memset((uint8_t *)page + len, 0, PAGE_SIZE - len);
+
+    return NO_ERROR;
+}
+
+static status_t file_pager_lookup(vmm_pager_t *pager, size_t offset, paddr_t *pa)
+{
+    struct file_pager *fp = containerof(pager, struct file_pager, pager);
+
+    if (offset >= fp->size)
+        return ERR_OUT_OF_RANGE;
+
+    void *page = fp->handle->mount->api->map_page(fp->handle->cookie, offset);
+    if (!page)
+        return ERR_NOT_FOUND;
+
+    LTRACEF("handle %p offset 0x%zx page %p\n", fp->handle, offset, page);
+
+    *pa = vaddr_to_paddr(page);
+    return *pa ? NO_ERROR : ERR_NOT_FOUND;
+}
+
+static void file_pager_release(vmm_pager_t *pager)
+{
+    struct file_pager *fp = containerof(pager, struct file_pager, pager);
+
+    LTRACEF("handle %p\n", fp->handle);
+
+    fs_close_file(fp->handle);
+    free(fp);
+}
+
+status_t fs_map_file(const char *path, vmm_aspace_t *aspace, void **ptr, size_t *len, uint arch_mmu_flags)
+{
+    LTRACEF("path '%s' aspace %p arch_mmu_flags 0x%x\n", path, aspace, arch_mmu_flags);
+
+    struct file_pager *fp = calloc(1, sizeof(*fp));
+    if (!fp)
+        return ERR_NO_MEMORY;
+
+    status_t err = fs_open_file(path, &fp->handle);
+    if (err < 0) {
+        free(fp);
+        return err;
+    }
+
+    struct file_stat stat;
+    err = fs_stat_file(fp->handle, &stat);
+    if (err < 0)
+        goto err;
+
+    if (stat.is_dir) {
+        err = ERR_NOT_FILE;
+        goto err;
+    }
+    if (stat.size == 0 || stat.size > SIZE_MAX - PAGE_SIZE) {
+        err = (stat.size == 0) ? ERR_NOT_VALID : ERR_TOO_BIG;
+        goto err;
+    }
+
+    fp->size = stat.size;
+    fp->pager.fill = file_pager_fill;
+    if (fp->handle->mount->api->map_page)
+        fp->pager.lookup = file_pager_lookup;
+    fp->pager.release = file_pager_release;
+
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+
+    err = vmm_alloc_pager(aspace, name, stat.size, ptr, 0, &fp->pager, 0, arch_mmu_flags);
+    if (err < 0)
+        goto err;
+
+    if (len)
+        *len = stat.size;
+
+    return NO_ERROR;
+
+err:
+    fs_close_file(fp->handle);
+    free(fp);
+    return err;
+}
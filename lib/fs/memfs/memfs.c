@@ -21,15 +21,31 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+/*
+ * In-memory file system.
+ *
+ * File data lives in whole pages, taken from the pmm when the kernel has one, indexed by an
+ * array of slots per file. Slots that were never written stay NULL and read back as zeros, so
+ * files may be sparse. Bytes past the end of the file in its last page are kept zeroed.
+ *
+ * Pages are lent to fs_map_file() through map_page, so a mapping of a memfs file shares the
+ * file's pages instead of copying them. Once a file has been mapped its pages are not freed
+ * until the last handle to it is closed, even if it is truncated or removed in the meantime.
+ */
+
 #include <string.h>
 #include <stdlib.h>
 #include <debug.h>
+#include <assert.h>
 #include <err.h>
 #include <trace.h>
 #include <list.h>
 #include <lk/init.h>
 #include <lib/fs.h>
 #include <kernel/mutex.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 #define LOCAL_TRACE 0
 
@@ -47,9 +63,17 @@ typedef struct {
     // name
     char *name;
 
-    // main data area
-    uint8_t *ptr;
+    // data pages, NULL slots are holes
+    void **pages;
+    size_t page_slots;
     size_t len;
+
+    // open handles, a removed file is freed on the last close
+    uint opens;
+    bool removed;
+
+    // pages have been lent to a mapping, don't free any before the last close
+    bool mapped;
 } memfs_file_t;
 
 struct dircookie {
@@ -60,6 +84,90 @@ struct dircookie {
     memfs_file_t *next_file;
 };
 
+static void *memfs_alloc_page(void)
+{
+    void *page;
+
+#if WITH_KERNEL_VM
+    vm_page_t *p = pmm_alloc_page();
+    if (!p)
+        return NULL;
+    page = paddr_to_kvaddr(vm_page_to_paddr(p));
+#else
+    page = memalign(PAGE_SIZE, PAGE_SIZE);
+    if (!page)
+        return NULL;
+#endif
+
+    memset(page, 0, PAGE_SIZE);
+    return page;
+}
+
+static void memfs_free_page(void *page)
+{
+#if WITH_KERNEL_VM
+    pmm_free_page(paddr_to_vm_page(vaddr_to_paddr(page)));
+#else
+    free(page);
+#endif
+}
+
+static size_t pages_for_len(uint64_t len)
+{
+    return ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+}
+
+/* free the pages in slot first and up, the slot array itself is left as is */
+static void free_pages_from(memfs_file_t *file, size_t first)
+{
+    for (size_t i = first; i < file->page_slots; i++) {
+        if (file->pages[i]) {
+            memfs_free_page(file->pages[i]);
+            file->pages[i] = NULL;
+        }
+    }
+}
+
+/* zero the pages in slot first and up without giving them back */
+static void zero_pages_from(memfs_file_t *file, size_t first)
+{
+    for (size_t i = first; i < file->page_slots; i++) {
+        if (file->pages[i])
+            memset(file->pages[i], 0, PAGE_SIZE);
+    }
+}
+
+/* return the page in slot index, allocating it and any slots needed to hold it */
+static uint8_t *get_page(memfs_file_t *file, size_t index)
+{
+    if (index >= file->page_slots) {
+        size_t slots = MAX(file->page_slots * 2, index + 1);
+        void **pages = realloc(file->pages, slots * sizeof(void *));
+        if (!pages)
+            return NULL;
+
+        memset(pages + file->page_slots, 0, (slots - file->page_slots) * sizeof(void *));
+        file->pages = pages;
+        file->page_slots = slots;
+    }
+
+    if (!file->pages[index])
+        file->pages[index] = memfs_alloc_page();
+
+    return file->pages[index];
+}
+
+static size_t allocated_pages(memfs_file_t *file)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < file->page_slots; i++) {
+        if (file->pages[i])
+            count++;
+    }
+
+    return count;
+}
+
 static memfs_file_t *find_file(memfs_t *mem, const char *name)
 {
     memfs_file_t *file;
@@ -90,7 +198,8 @@ static status_t memfs_mount(struct bdev *dev, fscookie **cookie)
 
 static void free_file(memfs_file_t *file)
 {
-    free(file->ptr);
+    free_pages_from(file, 0);
+    free(file->pages);
     free(file->name);
     free(file);
 }
@@ -142,25 +251,24 @@ static status_t memfs_create(fscookie *cookie, const char *name, filecookie **fc
         goto out;
     }
 
-    // allocate a new file
-    memfs_file_t *file = malloc(sizeof(*file));
+    // allocate a new file, it starts out as one big hole
+    memfs_file_t *file = calloc(1, sizeof(*file));
     if (!file) {
         err = ERR_NO_MEMORY;
         goto out;
     }
 
-    // allocate the space for it
-    file->ptr = calloc(1, len);
-    if (!file->ptr) {
+    file->name = strdup(name);
+    if (!file->name) {
         free(file);
         err = ERR_NO_MEMORY;
         goto out;
     }
-    file->len = len;
 
     // fill in some metadata and stuff it in the file list
-    file->name = strdup(name);
+    file->len = len;
     file->fs = mem;
+    file->opens = 1;
 
     list_add_tail(&mem->files, &file->node);
 
@@ -185,6 +293,8 @@ static status_t memfs_open(fscookie *cookie, const char *name, filecookie **fcoo
 
     mutex_acquire(&mem->lock);
     memfs_file_t *file = find_file(mem, name);
+    if (file)
+        file->opens++;
     mutex_release(&mem->lock);
 
     if (!file)
@@ -206,15 +316,27 @@ static status_t memfs_remove(fscookie *cookie, const char *name)
 
     mutex_acquire(&mem->lock);
     memfs_file_t *file = find_file(mem, name);
-    if (file)
-        list_delete(&file->node);
-    mutex_release(&mem->lock);
-
-    if (!file)
+    if (!file) {
+        mutex_release(&mem->lock);
         return ERR_NOT_FOUND;
+    }
+
+    // step any directory cursor off of it
+    dircookie *dir;
+    list_for_every_entry(&mem->dcookies, dir, dircookie, node) {
+        if (dir->next_file == file)
+            dir->next_file = list_next_type(&mem->files, &file->node, memfs_file_t, node);
+    }
+
+    list_delete(&file->node);
+    file->removed = true;
 
-    // XXX make sure there are no open file handles
-    free_file(file);
+    // open handles keep it alive, the last close frees it
+    bool unused = (file->opens == 0);
+    mutex_release(&mem->lock);
+
+    if (unused)
+        free_file(file);
 
     return NO_ERROR;
 }
@@ -222,9 +344,26 @@ static status_t memfs_remove(fscookie *cookie, const char *name)
 static status_t memfs_close(filecookie *fcookie)
 {
     memfs_file_t *file = (memfs_file_t *)fcookie;
+    memfs_t *mem = file->fs;
 
     LTRACEF("cookie %p name '%s'\n", fcookie, file->name);
 
+    mutex_acquire(&mem->lock);
+
+    DEBUG_ASSERT(file->opens > 0);
+    bool last = (--file->opens == 0);
+
+    if (last && !file->removed && file->mapped) {
+        // nothing can be mapping the pages anymore, drop the ones a truncate left behind
+        free_pages_from(file, pages_for_len(file->len));
+        file->mapped = false;
+    }
+
+    mutex_release(&mem->lock);
+
+    if (last && file->removed)
+        free_file(file);
+
     return NO_ERROR;
 }
 
@@ -245,8 +384,20 @@ static ssize_t memfs_read(filecookie *fcookie, void *buf, off_t off, size_t len)
         len = file->len - off;
     }
 
-    // copy that floppy
-    memcpy(buf, file->ptr + off, len);
+    // copy that floppy, a page at a time
+    uint8_t *out = buf;
+    for (size_t pos = 0; pos < len; ) {
+        size_t index = (off + pos) / PAGE_SIZE;
+        size_t page_off = (off + pos) % PAGE_SIZE;
+        size_t tocopy = MIN(len - pos, PAGE_SIZE - page_off);
+
+        if (index < file->page_slots && file->pages[index])
+            memcpy(out + pos, (uint8_t *)file->pages[index] + page_off, tocopy);
+        else
+            memset(out + pos, 0, tocopy);
+
+        pos += tocopy;
+    }
 
     mutex_release(&file->fs->lock);
 
@@ -257,33 +408,32 @@ static status_t memfs_truncate(filecookie *fcookie, uint64_t len)
 {
     LTRACEF("filecookie %p, len %llu\n", fcookie, len);
 
-    status_t rc = NO_ERROR;
-
     memfs_file_t *file = (memfs_file_t *)fcookie;
 
-    mutex_acquire(&file->fs->lock);
+    if (len >= ULONG_MAX)
+        return ERR_NO_MEMORY;
 
-    // Can't use truncate to grow a file.
-    if (len > file->len) {
-        rc = ERR_INVALID_ARGS;
-        goto finish;
-    }
+    mutex_acquire(&file->fs->lock);
 
-    // NOTE: Don't allow allocations smaller than 1b. Although realloc(..., 0)
-    // is okay, it may yield an invalid pointer (likely NULL) which might be
-    // dereferenced elsewhere.
-    void *ptr = realloc(file->ptr, len == 0 ? 1 : len);
-    if (unlikely(ptr == NULL)) {
-        rc = ERR_NO_MEMORY;
-        goto finish;
+    if (len < file->len) {
+        // keep the tail of the new last page zeroed
+        size_t index = len / PAGE_SIZE;
+        size_t page_off = len % PAGE_SIZE;
+        if (page_off && index < file->page_slots && file->pages[index])
+            memset((uint8_t *)file->pages[index] + page_off, 0, PAGE_SIZE - page_off);
+
+        // pages lent to a mapping are kept until the last close
+        if (file->mapped)
+            zero_pages_from(file, pages_for_len(len));
+        else
+            free_pages_from(file, pages_for_len(len));
     }
 
+    // growing just makes a hole at the end
     file->len = len;
-    file->ptr = ptr;
 
-finish:
     mutex_release(&file->fs->lock);
-    return rc;
+    return NO_ERROR;
 }
 
 static ssize_t memfs_write(filecookie *fcookie, const void *buf, off_t off, size_t len)
@@ -294,26 +444,37 @@ static ssize_t memfs_write(filecookie *fcookie, const void *buf, off_t off, size
 
     if (off < 0)
         return ERR_INVALID_ARGS;
+    if ((uint64_t)off + len >= ULONG_MAX)
+        return ERR_NO_MEMORY;
 
     mutex_acquire(&file->fs->lock);
 
-    // see if this write will extend the file
-    if (off + len > file->len) {
-        void *ptr = realloc(file->ptr, off + len);
-        if (!ptr) {
-            mutex_release(&file->fs->lock);
-            return ERR_NO_MEMORY;
-        }
+    // fill in the pages the write touches, allocating holes as we go
+    const uint8_t *in = buf;
+    size_t pos = 0;
+    while (pos < len) {
+        size_t index = (off + pos) / PAGE_SIZE;
+        size_t page_off = (off + pos) % PAGE_SIZE;
+        size_t tocopy = MIN(len - pos, PAGE_SIZE - page_off);
 
-        file->ptr = ptr;
-        file->len = off + len;
+        uint8_t *page = get_page(file, index);
+        if (!page)
+            break;
+
+        memcpy(page + page_off, in + pos, tocopy);
+        pos += tocopy;
     }
 
-    memcpy(file->ptr + off, buf, len);
+    // see if this write extended the file
+    if (off + pos > file->len)
+        file->len = off + pos;
 
     mutex_release(&file->fs->lock);
 
-    return len;
+    if (pos == 0 && len > 0)
+        return ERR_NO_MEMORY;
+
+    return pos;
 }
 
 static status_t memfs_stat(filecookie *fcookie, struct file_stat *stat)
@@ -327,6 +488,7 @@ static status_t memfs_stat(filecookie *fcookie, struct file_stat *stat)
     if (stat) {
         stat->is_dir = false;
         stat->size = file->len;
+        stat->capacity = (uint64_t)allocated_pages(file) * PAGE_SIZE;
     }
 
     mutex_release(&file->fs->lock);
@@ -334,6 +496,30 @@ static status_t memfs_stat(filecookie *fcookie, struct file_stat *stat)
     return NO_ERROR;
 }
 
+static void *memfs_map_page(filecookie *fcookie, off_t off)
+{
+    LTRACEF("filecookie %p offset %lld\n", fcookie, off);
+
+    memfs_file_t *file = (memfs_file_t *)fcookie;
+
+    DEBUG_ASSERT(IS_ALIGNED(off, PAGE_SIZE));
+
+    mutex_acquire(&file->fs->lock);
+
+    // holes and pages past the end are read in as zeros instead
+    void *page = NULL;
+    size_t index = off / PAGE_SIZE;
+    if (off >= 0 && off < (off_t)file->len && index < file->page_slots) {
+        page = file->pages[index];
+        if (page)
+            file->mapped = true;
+    }
+
+    mutex_release(&file->fs->lock);
+
+    return page;
+}
+
 static status_t memfs_opendir(fscookie *cookie, const char *name, dircookie **dcookie)
 {
     LTRACEF("cookie %p name '%s' dircookie %p\n", cookie, name, dcookie);
@@ -417,6 +603,7 @@ static const struct fs_api memfs_api = {
     .write = memfs_write,
 
     .stat = memfs_stat,
+    .map_page = memfs_map_page,
 
 #if 0
     status_t (*mkdir)(fscookie *, const char *);
@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Page cache of file contents shared by the filesystems.
+ *
+ * Pages are keyed by (filesystem, file, page index), where file is any id the filesystem can
+ * keep stable for as long as the contents don't change, such as an inode number. An fs routes
+ * its reads through fs_pcache_read() along with a fill routine that reads from the device.
+ * Misses are filled a few pages at a time, starting at the missing page, so a file read front
+ * to back in small pieces goes to the device in larger requests. Reads too large to be worth
+ * keeping go straight to the fill routine.
+ *
+ * Pages are allocated from the heap as they are needed up to FS_PCACHE_PAGES and recycled least
+ * recently used first. If the heap runs dry the cache gives up pages of its own before giving up
+ * on caching altogether.
+ *
+ * Fills run without the cache lock held. Filesystems that write must call fs_pcache_invalidate()
+ * once the new data is visible to their fill routine; a fill that was racing with it is thrown
+ * away instead of being cached.
+ */
+#include <debug.h>
+#include <trace.h>
+#include <list.h>
+#include <err.h>
+#include <string.h>
+#include <stdlib.h>
+#include <lib/fs.h>
+#include <kernel/mutex.h>
+#include "fs_priv.h"
+
+#define LOCAL_TRACE 0
+
+#ifndef FS_PCACHE_PAGES
+#define FS_PCACHE_PAGES     64
+#endif
+#ifndef FS_PCACHE_READAHEAD
+#define FS_PCACHE_READAHEAD 8       // pages filled on a miss
+#endif
+#define FS_PCACHE_PAGE_SIZE 4096
+#define FS_PCACHE_BYPASS    (16 * FS_PCACHE_PAGE_SIZE)
+#define FS_PCACHE_BUCKETS   64      // power of two
+
+struct pcache_page {
+    struct list_node hash_node;
+    struct list_node lru_node;
+    fscookie *fs;
+    uint64_t file;
+    uint64_t index;
+    size_t valid;               // bytes of data, short for the last page of a file
+    uint8_t data[FS_PCACHE_PAGE_SIZE];
+};
+
+static mutex_t pcache_lock = MUTEX_INITIAL_VALUE(pcache_lock);
+static struct list_node pcache_buckets[FS_PCACHE_BUCKETS];
+static struct list_node pcache_lru = LIST_INITIAL_VALUE(pcache_lru); // most recently used first
+static uint pcache_pages;
+static uint pcache_generation;  // bumped by every invalidation
+static bool pcache_inited;
+
+static struct {
+    uint hits;
+    uint misses;
+    uint bypassed;
+    uint fill_pages;
+    uint raced;
+} pcache_stats;
+
+static void pcache_init_locked(void)
+{
+    if (pcache_inited)
+        return;
+
+    for (uint i = 0; i < FS_PCACHE_BUCKETS; i++)
+        list_initialize(&pcache_buckets[i]);
+
+    pcache_inited = true;
+}
+
+static uint pcache_hash(fscookie *fs, uint64_t file, uint64_t index)
+{
+    uint64_t h = ((uintptr_t)fs >> 4) ^ (file * 0x9e3779b97f4a7c15ull) ^ index;
+    h *= 0x9e3779b97f4a7c15ull;
+
+    return (uint)(h >> 32) & (FS_PCACHE_BUCKETS - 1);
+}
+
+static struct pcache_page *pcache_find_locked(fscookie *fs, uint64_t file, uint64_t index)
+{
+    struct pcache_page *p;
+    list_for_every_entry(&pcache_buckets[pcache_hash(fs, file, index)], p, struct pcache_page, hash_node) {
+        if (p->fs == fs && p->file == file && p->index == index)
+            return p;
+    }
+
+    return NULL;
+}
+
+static void pcache_free_locked(struct pcache_page *p)
+{
+    list_delete(&p->hash_node);
+    list_delete(&p->lru_node);
+    pcache_pages--;
+    free(p);
+}
+
+static bool pcache_evict_one_locked(void)
+{
+    struct pcache_page *p = list_peek_tail_type(&pcache_lru, struct pcache_page, lru_node);
+    if (!p)
+        return false;
+
+    pcache_free_locked(p);
+    return true;
+}
+
+/* returns a page off any list, or NULL if nothing could be found for it */
+static struct pcache_page *pcache_alloc_locked(void)
+{
+    if (pcache_pages >= FS_PCACHE_PAGES)
+        pcache_evict_one_locked();
+
+    for (;;) {
+        struct pcache_page *p = malloc(sizeof(struct pcache_page));
+        if (p) {
+            pcache_pages++;
+            return p;
+        }
+
+        /* short on memory, give some back */
+        if (!pcache_evict_one_locked())
+            return NULL;
+    }
+}
+
+/* copy out of cached pages for as long as they are there */
+static size_t pcache_copy_locked(fscookie *fs, uint64_t file, uint8_t *buf, off_t offset, size_t len)
+{
+    size_t copied = 0;
+
+    while (copied < len) {
+        uint64_t index = (offset + copied) / FS_PCACHE_PAGE_SIZE;
+        size_t in_page = (offset + copied) % FS_PCACHE_PAGE_SIZE;
+
+        struct pcache_page *p = pcache_find_locked(fs, file, index);
+        if (!p || p->valid <= in_page)
+            break;
+
+        size_t n = MIN(len - copied, p->valid - in_page);
+        memcpy(buf + copied, p->data + in_page, n);
+        copied += n;
+
+        list_delete(&p->lru_node);
+        list_add_head(&pcache_lru, &p->lru_node);
+    }
+
+    return copied;
+}
+
+/* read pages starting at index from the fs, hand the caller its part and cache the rest */
+static ssize_t pcache_fill(fscookie *fs, uint64_t file, uint64_t file_len, uint64_t index, uint count,
+                           fs_pcache_fill_t fill, void *arg, uint8_t *buf, off_t offset, size_t len)
+{
+    off_t fill_offset = index * FS_PCACHE_PAGE_SIZE;
+    size_t fill_len = MIN((uint64_t)count * FS_PCACHE_PAGE_SIZE, file_len - fill_offset);
+
+    mutex_acquire(&pcache_lock);
+    uint generation = pcache_generation;
+    pcache_stats.misses++;
+    mutex_release(&pcache_lock);
+
+    fs_stats_count_cache(fs, true, false);
+
+    uint8_t *tmp = malloc(fill_len);
+    if (!tmp) {
+        /* no room to cache it anyway */
+        return fill(arg, buf, offset, len);
+    }
+
+    ssize_t err = fill(arg, tmp, fill_offset, fill_len);
+    if (err < 0) {
+        free(tmp);
+        return err;
+    }
+    fill_len = err;
+
+    size_t got = 0;
+    if ((uint64_t)offset < fill_offset + fill_len) {
+        got = MIN(len, fill_offset + fill_len - offset);
+        memcpy(buf, tmp + (offset - fill_offset), got);
+    }
+
+    mutex_acquire(&pcache_lock);
+    if (generation != pcache_generation) {
+        /* the file may have changed while it was being read */
+        pcache_stats.raced++;
+    } else {
+        for (size_t pos = 0; pos < fill_len; pos += FS_PCACHE_PAGE_SIZE, index++) {
+            if (pcache_find_locked(fs, file, index))
+                continue;
+
+            struct pcache_page *p = pcache_alloc_locked();
+            if (!p)
+                break;
+
+            p->fs = fs;
+            p->file = file;
+            p->index = index;
+            p->valid = MIN(fill_len - pos, FS_PCACHE_PAGE_SIZE);
+            memcpy(p->data, tmp + pos, p->valid);
+            list_add_head(&pcache_buckets[pcache_hash(fs, file, index)], &p->hash_node);
+            list_add_head(&pcache_lru, &p->lru_node);
+            pcache_stats.fill_pages++;
+        }
+    }
+    mutex_release(&pcache_lock);
+
+    free(tmp);
+
+    return got;
+}
+
+ssize_t fs_pcache_read(fscookie *fs, uint64_t file, uint64_t file_len, void *_buf, off_t offset, size_t len,
+                       fs_pcache_fill_t fill, void *arg)
+{
+    uint8_t *buf = _buf;
+
+    LTRACEF("fs %p, file %llu, len %llu, offset %lld, len %zu\n", fs, file, file_len, offset, len);
+
+    if (offset < 0)
+        return ERR_INVALID_ARGS;
+    if ((uint64_t)offset >= file_len)
+        return 0;
+    len = MIN(len, file_len - offset);
+
+    if (len >= FS_PCACHE_BYPASS) {
+        mutex_acquire(&pcache_lock);
+        pcache_stats.bypassed++;
+        mutex_release(&pcache_lock);
+        return fill(arg, buf, offset, len);
+    }
+
+    size_t amount = 0;
+    while (amount < len) {
+        mutex_acquire(&pcache_lock);
+        pcache_init_locked();
+        size_t copied = pcache_copy_locked(fs, file, buf + amount, offset + amount, len - amount);
+        if (copied)
+            pcache_stats.hits++;
+        mutex_release(&pcache_lock);
+
+        if (copied)
+            fs_stats_count_cache(fs, true, true);
+
+        amount += copied;
+        if (amount == len)
+            break;
+
+        /* fill at least what is left of the request, and read ahead of it */
+        off_t pos = offset + amount;
+        uint64_t index = pos / FS_PCACHE_PAGE_SIZE;
+        uint64_t last = (offset + len - 1) / FS_PCACHE_PAGE_SIZE;
+        uint count = MAX(last - index + 1, FS_PCACHE_READAHEAD);
+
+        ssize_t err = pcache_fill(fs, file, file_len, index, count, fill, arg, buf + amount, pos, len - amount);
+        if (err < 0)
+            return amount ? (ssize_t)amount : err;
+        if (err == 0)
+            break;
+
+        amount += err;
+    }
+
+    return amount;
+}
+
+void fs_pcache_invalidate(fscookie *fs, uint64_t file)
+{
+    mutex_acquire(&pcache_lock);
+    pcache_init_locked();
+
+    struct pcache_page *p, *temp;
+    list_for_every_entry_safe(&pcache_lru, p, temp, struct pcache_page, lru_node) {
+        if (p->fs == fs && p->file == file)
+            pcache_free_locked(p);
+    }
+    pcache_generation++;
+
+    mutex_release(&pcache_lock);
+}
+
+void fs_pcache_purge(fscookie *fs)
+{
+    mutex_acquire(&pcache_lock);
+    pcache_init_locked();
+
+    struct pcache_page *p, *temp;
+    list_for_every_entry_safe(&pcache_lru, p, temp, struct pcache_page, lru_node) {
+        if (p->fs == fs)
+            pcache_free_locked(p);
+    }
+    pcache_generation++;
+
+    mutex_release(&pcache_lock);
+}
+
+void fs_pcache_dump(void)
+{
+    mutex_acquire(&pcache_lock);
+    printf("pcache: %u/%u pages of %u bytes, %u hits, %u misses, %u bypassed, %u pages filled, %u fills raced\n",
+           pcache_pages, FS_PCACHE_PAGES, FS_PCACHE_PAGE_SIZE, pcache_stats.hits, pcache_stats.misses,
+           pcache_stats.bypassed, pcache_stats.fill_pages, pcache_stats.raced);
+    mutex_release(&pcache_lock);
+}
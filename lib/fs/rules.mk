@@ -2,11 +2,22 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
+MODULE_DEPS += lib/workqueue
+
 MODULE_SRCS += \
 	$(LOCAL_DIR)/fs.c \
+	$(LOCAL_DIR)/async.c \
+	$(LOCAL_DIR)/bench.c \
+	$(LOCAL_DIR)/dcache.c \
+	$(LOCAL_DIR)/pcache.c \
+	$(LOCAL_DIR)/stats.c \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/shell.c
 
+ifeq ($(WITH_KERNEL_VM),1)
+MODULE_SRCS += $(LOCAL_DIR)/map.c
+endif
+
 EXTRA_LINKER_SCRIPTS += $(LOCAL_DIR)/fs.ld
 
 include make/module.mk
@@ -7,7 +7,7 @@ MODULE_SRCS += \
 
 MODULE_DEPS += \
 	lib/fs \
-	lib/cksum \
+	lib/checksum \
 	lib/bio
 
 include make/module.mk
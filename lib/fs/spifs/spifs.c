@@ -24,6 +24,7 @@
 #include <debug.h>
 #include <err.h>
 #include <pow2.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,8 +32,9 @@
 #include <trace.h>
 
 #include <kernel/mutex.h>
+#include <kernel/rwlock.h>
 #include <lib/bio.h>
-#include <lib/cksum.h>
+#include <lib/checksum.h>
 #include <lib/console.h>
 #include <lib/fs.h>
 #include <lib/fs/spifs.h>
@@ -42,7 +44,9 @@
 #define LOCAL_TRACE 0
 
 #define FS_VERSION 1
+#define FS_VERSION_LOG 2     // volume has a ToC change log
 #define FS_MAGIC 0x53504653  // SPFS
+#define LOG_MAGIC 0x53504c47 // SPLG
 
 #define SPIFS_ENTRY_LENGTH 32
 
@@ -59,6 +63,15 @@
 #define FRONT_TOC_LABEL "front-toc"
 #define BACK_TOC_LABEL "back-toc"
 
+#ifndef SPIFS_DEFAULT_LOG_PAGES
+#define SPIFS_DEFAULT_LOG_PAGES 1
+#endif
+
+// ToC change log operations
+#define LOG_OP_CREATE 1
+#define LOG_OP_REMOVE 2
+#define LOG_OP_LENGTH 3
+
 typedef int32_t toc_position_t;
 
 typedef struct {
@@ -71,11 +84,18 @@ typedef struct {
     uint32_t num_entries;
     toc_position_t toc_position;
 
+    // ToC change log, in the pages following the front ToC. Changes are
+    // appended here and only folded into a full ToC commit once it is full.
+    uint32_t log_page;
+    uint32_t log_slots;
+    uint32_t log_next;
+
     struct list_node files;
     struct list_node dcookies;
 
     bdev_t *dev;
 
+    /* protects the file list, the ToC and the shared page buffer, not file data */
     mutex_t lock;
 } spifs_t;
 
@@ -100,9 +120,27 @@ typedef struct {
     uint32_t checksum;
 } toc_footer_t;
 
+// One change to the ToC with the given generation. Records are programmed
+// one after the other into the erased log, the first erased one ends it.
+typedef struct {
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t op;
+    uint32_t sequence;      // slot the record was written to
+    toc_file_t file;
+    uint8_t _reserved[12];
+    uint32_t checksum;
+} toc_log_record_t;
+
+/*
+ * Reads and writes of a file only take its own lock, shared for reads. The length is changed
+ * with both that lock and the fs lock held, so either one is enough to read it. The rest of the
+ * metadata doesn't change while the file exists.
+ */
 typedef struct {
     struct list_node node;
     spifs_t *fs_handle;
+    rwlock_t lock;
     toc_file_t metadata;
 } spifs_file_t;
 
@@ -122,8 +160,8 @@ typedef struct {
     spifs_t *spifs;
 } cursor_t;
 
-static status_t spifs_read_page(spifs_t *spifs, uint32_t page_addr);
-static status_t spifs_write_page(spifs_t *spifs, uint32_t page_addr);
+static status_t spifs_read_page(spifs_t *spifs, uint8_t *page, uint32_t page_addr);
+static status_t spifs_write_page(spifs_t *spifs, const uint8_t *page, uint32_t page_addr);
 
 static status_t get_device_page_info(bdev_t *dev, uint32_t *page_size,
                                      uint32_t *page_count);
@@ -147,7 +185,7 @@ static status_t cursor_init(
     cursor->spifs = spifs;
 
 
-    return spifs_read_page(spifs, page_id);
+    return spifs_read_page(spifs, spifs->page, page_id);
 }
 
 static uint8_t *cursor_get(cursor_t *cursor)
@@ -179,7 +217,7 @@ static status_t cursor_advance(cursor_t *cursor)
         cursor->page_id += cursor->direction;
         cursor->data = spifs->page;
 
-        return spifs_read_page(spifs, cursor->page_id);
+        return spifs_read_page(spifs, spifs->page, cursor->page_id);
     }
 
     return NO_ERROR;
@@ -295,13 +333,13 @@ static status_t spifs_commit_toc(spifs_t *spifs)
     // Setup the ToC Header.
     toc_header_t header = {
         .magic       = FS_MAGIC,
-        .version     = FS_VERSION,
+        .version     = spifs->log_slots ? FS_VERSION_LOG : FS_VERSION,
         .num_entries = spifs->num_entries,
         .generation  = target_generation,
     };
     memset(header._reserved, 0, TOC_HEADER_RESERVED_BYTES);
 
-    crc = crc32(crc, (uint8_t *)&header, SPIFS_ENTRY_LENGTH);
+    crc = checksum_crc32(crc, (uint8_t *)&header, SPIFS_ENTRY_LENGTH);
 
     memcpy(cursor, (uint8_t *)&header, SPIFS_ENTRY_LENGTH);
     cursor += SPIFS_ENTRY_LENGTH;
@@ -315,7 +353,7 @@ static status_t spifs_commit_toc(spifs_t *spifs)
         DEBUG_ASSERT(cursor <= page_end);
 
         if (cursor == page_end) {
-            err = spifs_write_page(spifs, toc_page_addr);
+            err = spifs_write_page(spifs, spifs->page, toc_page_addr);
             if (err != NO_ERROR) {
                 return err;
             }
@@ -325,11 +363,11 @@ static status_t spifs_commit_toc(spifs_t *spifs)
         }
 
         if (file) {
-            crc = crc32(crc, (uint8_t *)&file->metadata, SPIFS_ENTRY_LENGTH);
+            crc = checksum_crc32(crc, (uint8_t *)&file->metadata, SPIFS_ENTRY_LENGTH);
             memcpy(cursor, (uint8_t *)&file->metadata, SPIFS_ENTRY_LENGTH);
             file = list_next_type(&spifs->files, &file->node, spifs_file_t, node);
         } else {
-            crc = crc32(crc, (uint8_t *)&empty, SPIFS_ENTRY_LENGTH);
+            crc = checksum_crc32(crc, (uint8_t *)&empty, SPIFS_ENTRY_LENGTH);
             memcpy(cursor, (uint8_t *)&empty, SPIFS_ENTRY_LENGTH);
         }
 
@@ -348,7 +386,7 @@ static status_t spifs_commit_toc(spifs_t *spifs)
     memset(footer, 0, SPIFS_ENTRY_LENGTH);
     footer->checksum = crc;
 
-    err = spifs_write_page(spifs, toc_page_addr);
+    err = spifs_write_page(spifs, spifs->page, toc_page_addr);
     if (err != NO_ERROR)
         return err;
 
@@ -374,12 +412,181 @@ static void spifs_add_ascending(spifs_t *spifs, spifs_file_t *target)
     list_add_tail(&spifs->files, &target->node);
 }
 
+static status_t spifs_erase_log(spifs_t *spifs)
+{
+    uint32_t log_pages = spifs->log_slots * sizeof(toc_log_record_t) / spifs->page_size;
 
-static status_t spifs_read_page(spifs_t *spifs, uint32_t page_addr)
+    for (uint32_t i = 0; i < log_pages; i++) {
+        uint32_t page_addr = spifs->log_page + i;
+
+        ssize_t bytes;
+        if (spifs->dev->geometry_count != 0) {
+            bytes = bio_erase(spifs->dev, (off_t)page_addr * spifs->page_size,
+                              spifs->page_size);
+        } else {
+            // Nothing to erase, fill it with what erased flash reads as.
+            memset(spifs->page, 0xff, spifs->page_size);
+            bytes = spifs_write_page(spifs, spifs->page, page_addr) == NO_ERROR ?
+                    (ssize_t)spifs->page_size : ERR_IO;
+        }
+
+        if ((uint32_t)bytes != spifs->page_size) {
+            return ERR_IO;
+        }
+    }
+
+    return NO_ERROR;
+}
+
+// Fold everything into a full ToC commit and start the log over.
+static status_t spifs_compact_toc(spifs_t *spifs)
+{
+    status_t err = spifs_commit_toc(spifs);
+    if (err != NO_ERROR)
+        return err;
+
+    if (spifs->log_slots == 0)
+        return NO_ERROR;
+
+    // Records left behind belong to the old generation and are ignored, but
+    // nothing can be appended until the log has been erased.
+    if (spifs_erase_log(spifs) != NO_ERROR) {
+        spifs->log_next = spifs->log_slots;
+        return NO_ERROR;
+    }
+
+    spifs->log_next = 0;
+    return NO_ERROR;
+}
+
+// Record a change to a file's ToC entry that has already been made in
+// memory. Caller holds spifs->lock.
+static status_t spifs_log_change(spifs_t *spifs, uint32_t op, const spifs_file_t *file)
+{
+    if (spifs->log_next >= spifs->log_slots)
+        return spifs_compact_toc(spifs);
+
+    toc_log_record_t record = {
+        .magic      = LOG_MAGIC,
+        .generation = spifs->generation,
+        .op         = op,
+        .sequence   = spifs->log_next,
+        .file       = file->metadata,
+    };
+    memset(record._reserved, 0, sizeof(record._reserved));
+    record.checksum = checksum_crc32(0, (uint8_t *)&record, offsetof(toc_log_record_t, checksum));
+
+    off_t addr = (off_t)spifs->log_page * spifs->page_size +
+                 spifs->log_next * sizeof(record);
+    ssize_t bytes = bio_write(spifs->dev, &record, addr, sizeof(record));
+
+    spifs->log_next++;
+    if (bytes != sizeof(record)) {
+        // The slot may hold half a record, which ends the log on the next
+        // mount. Make sure the change lands in a full commit instead.
+        spifs->log_next = spifs->log_slots;
+        return spifs_compact_toc(spifs);
+    }
+
+    return NO_ERROR;
+}
+
+static spifs_file_t *find_file_by_page(spifs_t *spifs, uint32_t page_idx)
+{
+    spifs_file_t *file;
+
+    list_for_every_entry(&spifs->files, file, spifs_file_t, node) {
+        if (file->metadata.page_idx == page_idx)
+            return file;
+    }
+
+    return NULL;
+}
+
+static status_t spifs_apply_log_record(spifs_t *spifs, const toc_log_record_t *record)
+{
+    spifs_file_t *file = find_file_by_page(spifs, record->file.page_idx);
+
+    switch (record->op) {
+        case LOG_OP_CREATE:
+            if (file || list_length(&spifs->files) >= spifs->num_entries)
+                return ERR_BAD_STATE;
+
+            file = malloc(sizeof(*file));
+            if (!file)
+                return ERR_NO_MEMORY;
+
+            file->fs_handle = spifs;
+            rwlock_init(&file->lock);
+            memcpy(&file->metadata, &record->file, SPIFS_ENTRY_LENGTH);
+            spifs_add_ascending(spifs, file);
+            return NO_ERROR;
+        case LOG_OP_REMOVE:
+            if (!file)
+                return ERR_BAD_STATE;
+
+            list_delete(&file->node);
+            rwlock_destroy(&file->lock);
+            free(file);
+            return NO_ERROR;
+        case LOG_OP_LENGTH:
+            if (!file || record->file.length > file->metadata.capacity)
+                return ERR_BAD_STATE;
+
+            file->metadata.length = record->file.length;
+            return NO_ERROR;
+        default:
+            return ERR_BAD_STATE;
+    }
+}
+
+// Apply the changes logged against the ToC that was just loaded, and find
+// where the next record goes.
+static status_t spifs_replay_log(spifs_t *spifs)
+{
+    uint32_t per_page = spifs->page_size / sizeof(toc_log_record_t);
+
+    for (uint32_t slot = 0; slot < spifs->log_slots; slot++) {
+        if (slot % per_page == 0) {
+            status_t err = spifs_read_page(spifs, spifs->page,
+                                           spifs->log_page + slot / per_page);
+            if (err != NO_ERROR)
+                return err;
+        }
+
+        const toc_log_record_t *record =
+            (const toc_log_record_t *)spifs->page + slot % per_page;
+
+        if (record->magic == 0xffffffff) {
+            // Erased, end of the log.
+            spifs->log_next = slot;
+            return NO_ERROR;
+        }
+
+        // A torn record or one left over from before the last compaction.
+        // Stop here and compact on the next change so the slot gets erased.
+        uint32_t crc = checksum_crc32(0, (const uint8_t *)record, offsetof(toc_log_record_t, checksum));
+        if (record->magic != LOG_MAGIC || record->checksum != crc ||
+                record->generation != spifs->generation || record->sequence != slot) {
+            LTRACEF("log ends at slot %u\n", slot);
+            break;
+        }
+
+        status_t err = spifs_apply_log_record(spifs, record);
+        if (err != NO_ERROR)
+            return err;
+    }
+
+    spifs->log_next = spifs->log_slots;
+    return NO_ERROR;
+}
+
+
+static status_t spifs_read_page(spifs_t *spifs, uint8_t *page, uint32_t page_addr)
 {
     off_t block_addr = page_addr * spifs->blocks_per_page;
 
-    ssize_t bytes = bio_read_block(spifs->dev, spifs->page, block_addr,
+    ssize_t bytes = bio_read_block(spifs->dev, page, block_addr,
                                    spifs->blocks_per_page);
 
     if ((uint32_t)bytes != spifs->page_size) {
@@ -389,7 +596,7 @@ static status_t spifs_read_page(spifs_t *spifs, uint32_t page_addr)
     return NO_ERROR;
 }
 
-static status_t spifs_write_page(spifs_t *spifs, uint32_t page_addr)
+static status_t spifs_write_page(spifs_t *spifs, const uint8_t *page, uint32_t page_addr)
 {
     off_t block_addr = page_addr * spifs->blocks_per_page;
     off_t device_addr = block_addr * spifs->dev->block_size;
@@ -402,7 +609,7 @@ static status_t spifs_write_page(spifs_t *spifs, uint32_t page_addr)
         }
     }
 
-    ssize_t bytes = bio_write_block(spifs->dev, spifs->page, block_addr,
+    ssize_t bytes = bio_write_block(spifs->dev, page, block_addr,
                                     spifs->blocks_per_page);
 
     if ((uint32_t)bytes != spifs->page_size) {
@@ -412,59 +619,99 @@ static status_t spifs_write_page(spifs_t *spifs, uint32_t page_addr)
     return NO_ERROR;
 }
 
-static uint32_t get_toc_generation(spifs_t *spifs, toc_position_t toc_pos)
+static uint32_t toc_page(spifs_t *spifs, toc_position_t toc_pos)
 {
-    LTRACEF("spifs %p\n", spifs);
+    return toc_pos == FRONT_TOC ? 0 : (spifs->page_count - 1);
+}
 
-    uint32_t candidate_generation;
+// Look at just the header of a ToC, to tell which of the two is newer without
+// reading either of them in full.
+static uint32_t peek_toc_generation(spifs_t *spifs, toc_position_t toc_pos)
+{
+    LTRACEF("spifs %p\n", spifs);
 
     DEBUG_ASSERT(spifs);
-
     DEBUG_ASSERT(toc_pos == FRONT_TOC || toc_pos == BACK_TOC);
-    uint32_t toc_page = toc_pos == FRONT_TOC ?
-                        0 : (spifs->page_count - 1);
 
-
-    cursor_t cursor;
-    if (cursor_init(&cursor, spifs, toc_pos, toc_page, SPIFS_ENTRY_LENGTH) !=
-            NO_ERROR) {
+    if (spifs_read_page(spifs, spifs->page, toc_page(spifs, toc_pos)) != NO_ERROR)
         return CORRUPT_TOC;
-    }
 
-    toc_header_t *header = (toc_header_t *)cursor_get(&cursor);
+    const toc_header_t *header = (const toc_header_t *)spifs->page;
 
     if (header->magic != FS_MAGIC) {
         return CORRUPT_TOC;
     }
 
-    if (header->version != FS_VERSION) {
+    if (header->version != FS_VERSION && header->version != FS_VERSION_LOG) {
         return CORRUPT_TOC;
     }
 
-    candidate_generation = header->generation;
-    uint32_t num_toc_entries = header->num_entries;
+    return header->generation;
+}
 
-    uint32_t crc = 0;
-    crc = crc32(crc, (uint8_t *)header, SPIFS_ENTRY_LENGTH);
+// Build the in-memory file list from a ToC, checksumming it in the same pass.
+// On failure the list is left empty.
+static status_t load_toc(spifs_t *spifs, toc_position_t toc_pos)
+{
+    status_t status;
+    spifs_file_t *file;
+
+    cursor_t cursor;
+    status = cursor_init(&cursor, spifs, toc_pos, toc_page(spifs, toc_pos),
+                         SPIFS_ENTRY_LENGTH);
+    if (status != NO_ERROR)
+        return status;
 
+    toc_header_t *header = (toc_header_t *)cursor_get(&cursor);
+    spifs->num_entries = header->num_entries;
+    spifs->generation = header->generation;
+    uint32_t crc = checksum_crc32(0, (uint8_t *)header, SPIFS_ENTRY_LENGTH);
     header = NULL;
 
-    for (size_t i = 0; i < num_toc_entries; i++) {
-        if (cursor_advance(&cursor) != NO_ERROR)
-            return CORRUPT_TOC;
+    for (size_t i = 0; i < spifs->num_entries; i++) {
+        status = cursor_advance(&cursor);
+        if (status != NO_ERROR)
+            goto err;
+
+        toc_file_t *file_entry = (toc_file_t *)cursor_get(&cursor);
+        crc = checksum_crc32(crc, (uint8_t *)file_entry, SPIFS_ENTRY_LENGTH);
+        if (file_entry->capacity == 0) {
+            continue;
+        }
+
+        file = malloc(sizeof(*file));
+        if (!file) {
+            status = ERR_NO_MEMORY;
+            goto err;
+        }
+
+        memcpy(&file->metadata, file_entry, SPIFS_ENTRY_LENGTH);
+
+        file->fs_handle = spifs;
+        rwlock_init(&file->lock);
 
-        crc = crc32(crc, cursor_get(&cursor), SPIFS_ENTRY_LENGTH);
+        list_add_tail(&spifs->files, &file->node);
     }
 
-    if (cursor_advance(&cursor) != NO_ERROR)
-        return CORRUPT_TOC;
+    status = cursor_advance(&cursor);
+    if (status != NO_ERROR)
+        goto err;
 
     toc_footer_t *footer = (toc_footer_t *)cursor_get(&cursor);
     if (footer->checksum != crc) {
-        return CORRUPT_TOC;
+        status = ERR_CRC_FAIL;
+        goto err;
     }
 
-    return candidate_generation;
+    spifs->toc_position = toc_pos;
+    return NO_ERROR;
+
+err:
+    while ((file = list_remove_head_type(&spifs->files, spifs_file_t, node))) {
+        rwlock_destroy(&file->lock);
+        free(file);
+    }
+    return status;
 }
 
 // page_size will be populated with the device's page size if this function
@@ -514,6 +761,7 @@ static status_t spifs_format(bdev_t *dev, const void *args)
     spifs_format_args_t *spifs_args;
     spifs_format_args_t default_args = {
         .toc_pages = 1,
+        .log_pages = SPIFS_DEFAULT_LOG_PAGES,
     };
 
     if (!args) {
@@ -526,6 +774,7 @@ static status_t spifs_format(bdev_t *dev, const void *args)
     STATIC_ASSERT(sizeof(toc_header_t) == SPIFS_ENTRY_LENGTH);
     STATIC_ASSERT(sizeof(toc_file_t) == SPIFS_ENTRY_LENGTH);
     STATIC_ASSERT(sizeof(toc_footer_t) == SPIFS_ENTRY_LENGTH);
+    STATIC_ASSERT(sizeof(toc_log_record_t) == 2 * SPIFS_ENTRY_LENGTH);
 
     uint32_t page_size;
     uint32_t page_count;
@@ -558,6 +807,15 @@ static status_t spifs_format(bdev_t *dev, const void *args)
         return ERR_TOO_BIG;
     }
 
+    // Both ToCs and the log have to fit with room to spare.
+    uint32_t log_pages = spifs_args->log_pages;
+    if (page_size % sizeof(toc_log_record_t) != 0) {
+        log_pages = 0;
+    }
+    if (2 * spifs_args->toc_pages + log_pages >= page_count) {
+        return ERR_TOO_BIG;
+    }
+
     // Create a mock spifs_t for the purposes of formatting the fs.
     spifs_t spifs = {
         .page_size = page_size,
@@ -566,6 +824,8 @@ static status_t spifs_format(bdev_t *dev, const void *args)
         .generation = 1,
         .num_entries = num_toc_entries,
         .toc_position = FRONT_TOC,
+        .log_page = spifs_args->toc_pages,
+        .log_slots = log_pages * (page_size / sizeof(toc_log_record_t)),
         .dev = dev,
     };
     spifs.page = memalign(CACHE_LINE, page_size);
@@ -576,7 +836,8 @@ static status_t spifs_format(bdev_t *dev, const void *args)
     spifs_file_t f_toc;
     f_toc.metadata.page_idx = 0;
     f_toc.metadata.length = spifs_args->toc_pages * page_size;
-    f_toc.metadata.capacity = spifs_args->toc_pages * page_size;
+    // The log lives in the pages the front ToC owns past its end.
+    f_toc.metadata.capacity = (spifs_args->toc_pages + log_pages) * page_size;
     f_toc.fs_handle = &spifs;
     memset(f_toc.metadata.filename, 0, MAX_FILENAME_LENGTH);
     strlcpy(f_toc.metadata.filename, FRONT_TOC_LABEL, MAX_FILENAME_LENGTH);
@@ -597,11 +858,16 @@ static status_t spifs_format(bdev_t *dev, const void *args)
     if (err != NO_ERROR)
         goto err;
 
-    // Commit the other toc.
-    err = spifs_commit_toc(&spifs);
+    // Commit the other toc, leaving the log erased.
+    err = spifs_compact_toc(&spifs);
     if (err != NO_ERROR)
         goto err;
 
+    if (spifs.log_next != 0) {
+        err = ERR_IO;
+        goto err;
+    }
+
 err:
     free(spifs.page);
 
@@ -639,56 +905,50 @@ static status_t spifs_mount(bdev_t *dev, fscookie **cookie)
     list_initialize(&spifs->dcookies);
     mutex_init(&spifs->lock);
 
-    // Determine which of the two Table of Contents we should use.
-    uint32_t f_toc_generation = get_toc_generation(spifs, FRONT_TOC);
-    uint32_t b_toc_generation = get_toc_generation(spifs, BACK_TOC);
+    // The newer of the two Table of Contents is the checkpoint to load, only
+    // read the other one in full if the newer one turns out to be corrupt.
+    uint32_t f_toc_generation = peek_toc_generation(spifs, FRONT_TOC);
+    uint32_t b_toc_generation = peek_toc_generation(spifs, BACK_TOC);
 
-    if (f_toc_generation == CORRUPT_TOC && b_toc_generation == CORRUPT_TOC) {
-        // Both ToCs are corrupt.
-        status = ERR_CRC_FAIL;
-        goto err;
+    toc_position_t order[2] = { BACK_TOC, FRONT_TOC };
+    if (f_toc_generation > b_toc_generation) {
+        order[0] = FRONT_TOC;
+        order[1] = BACK_TOC;
     }
 
-    spifs->toc_position =
-        f_toc_generation > b_toc_generation ? FRONT_TOC : BACK_TOC;
-    spifs->generation = MAX(f_toc_generation, b_toc_generation);
-
-    uint32_t toc_page_addr = spifs->toc_position == FRONT_TOC ?
-                             0 : spifs->page_count - 1;
+    // Both ToCs are corrupt unless one of them loads.
+    status = ERR_CRC_FAIL;
+    for (size_t i = 0; i < countof(order); i++) {
+        uint32_t generation = order[i] == FRONT_TOC ? f_toc_generation : b_toc_generation;
+        if (generation == CORRUPT_TOC)
+            continue;
 
-    cursor_t cursor;
-    status = cursor_init(&cursor, spifs, spifs->toc_position, toc_page_addr,
-                         SPIFS_ENTRY_LENGTH);
+        status = load_toc(spifs, order[i]);
+        if (status == NO_ERROR || status == ERR_NO_MEMORY)
+            break;
+        LTRACEF("%s ToC failed to load: %d\n",
+                order[i] == FRONT_TOC ? FRONT_TOC_LABEL : BACK_TOC_LABEL, status);
+    }
     if (status != NO_ERROR)
         goto err;
 
-    toc_header_t *header = (toc_header_t *)cursor_get(&cursor);
-    spifs->num_entries = header->num_entries;
-    header = NULL;
-
-    // Create in-memory versions of metadata for files.
     spifs_file_t *file;
-    for (size_t i = 0; i < spifs->num_entries; i++) {
-        status = cursor_advance(&cursor);
-        if (status != NO_ERROR)
-            goto err;
-
-        toc_file_t *file_entry = (toc_file_t *)cursor_get(&cursor);
-        if (file_entry->capacity == 0) {
-            continue;
-        }
 
-        file = malloc(sizeof(*file));
-        if (!file) {
-            status = ERR_NO_MEMORY;
-            goto err;
-        }
+    // Bring the ToC up to date with the changes logged since it was written.
+    spifs_file_t *front_toc = list_peek_head_type(&spifs->files, spifs_file_t, node);
+    spifs->log_page = 0;
+    spifs->log_slots = 0;
+    spifs->log_next = 0;
+    if (front_toc && front_toc->metadata.capacity > front_toc->metadata.length &&
+            spifs->page_size % sizeof(toc_log_record_t) == 0) {
+        uint32_t log_bytes = front_toc->metadata.capacity - front_toc->metadata.length;
 
-        memcpy(&file->metadata, file_entry, SPIFS_ENTRY_LENGTH);
+        spifs->log_page = front_toc->metadata.length / spifs->page_size;
+        spifs->log_slots = log_bytes / sizeof(toc_log_record_t);
 
-        file->fs_handle = spifs;
-
-        list_add_tail(&spifs->files, &file->node);
+        status = spifs_replay_log(spifs);
+        if (status != NO_ERROR)
+            goto err;
     }
 
     if (!consistency_check(spifs)) {
@@ -702,6 +962,7 @@ static status_t spifs_mount(bdev_t *dev, fscookie **cookie)
 
 err:
     while ((file = list_remove_head_type(&spifs->files, spifs_file_t, node))) {
+        rwlock_destroy(&file->lock);
         free(file);
     }
 
@@ -720,6 +981,7 @@ static status_t spifs_unmount(fscookie *cookie)
 
     spifs_file_t *file;
     while ((file = list_remove_head_type(&spifs->files, spifs_file_t, node))) {
+        rwlock_destroy(&file->lock);
         free(file);
     }
 
@@ -790,6 +1052,7 @@ static status_t spifs_create(fscookie *cookie, const char *name, filecookie **fc
     }
 
     file->fs_handle = spifs;
+    rwlock_init(&file->lock);
     file->metadata.page_idx = open_run;
     file->metadata.length = len;
     file->metadata.capacity = capacity;
@@ -800,6 +1063,7 @@ static status_t spifs_create(fscookie *cookie, const char *name, filecookie **fc
     if (bio_erase(spifs->dev, open_run * spifs->page_size, capacity) !=
             (ssize_t)capacity) {
 
+        rwlock_destroy(&file->lock);
         free(file);
 
         status = ERR_IO;
@@ -808,10 +1072,11 @@ static status_t spifs_create(fscookie *cookie, const char *name, filecookie **fc
 
     spifs_add_ascending(spifs, file);
 
-    if (spifs_commit_toc(spifs) != NO_ERROR) {
+    if (spifs_log_change(spifs, LOG_OP_CREATE, file) != NO_ERROR) {
         // If the commit fails, make sure we don't leave any residue of the file
         // lying around.
         list_delete(&file->node);
+        rwlock_destroy(&file->lock);
         free(file);
         *fcookie = NULL;
 
@@ -890,9 +1155,19 @@ static status_t spifs_remove(fscookie *cookie, const char *name)
     }
 
     list_delete(&file->node);
+
+    status = spifs_log_change(spifs, LOG_OP_REMOVE, file);
+
+    mutex_release(&spifs->lock);
+
+    // Nobody can find the file any more, wait for reads and writes already
+    // under way on it before letting it go.
+    rwlock_acquire_write(&file->lock);
+    rwlock_release_write(&file->lock);
+    rwlock_destroy(&file->lock);
     free(file);
 
-    status = spifs_commit_toc(spifs);
+    return status;
 
 err:
     mutex_release(&spifs->lock);
@@ -900,17 +1175,10 @@ err:
     return status;
 }
 
-static ssize_t spifs_read(filecookie *fcookie, void *buf, off_t off, size_t len)
+/* page cache fill routine, called from spifs_read with the file lock held */
+static ssize_t spifs_fill_file(void *arg, void *buf, off_t off, size_t len)
 {
-    LTRACEF("filecookie %p buf %p offset %lld len %zu\n", fcookie, buf, off, len);
-
-    spifs_file_t *file = (spifs_file_t *)fcookie;
-    spifs_t *spifs = file->fs_handle;
-
-    if (off < 0)
-        return ERR_INVALID_ARGS;
-
-    mutex_acquire(&spifs->lock);
+    spifs_file_t *file = (spifs_file_t *)arg;
 
     uint32_t file_start = file->fs_handle->page_size * file->metadata.page_idx;
     uint32_t file_end = file_start + file->metadata.length;
@@ -926,13 +1194,50 @@ static ssize_t spifs_read(filecookie *fcookie, void *buf, off_t off, size_t len)
 
     DEBUG_ASSERT(file->fs_handle->dev);
 
-    ssize_t result = bio_read(file->fs_handle->dev, buf, read_start, len);
+    return bio_read(file->fs_handle->dev, buf, read_start, len);
+}
 
-    mutex_release(&spifs->lock);
+static ssize_t spifs_read(filecookie *fcookie, void *buf, off_t off, size_t len)
+{
+    LTRACEF("filecookie %p buf %p offset %lld len %zu\n", fcookie, buf, off, len);
+
+    spifs_file_t *file = (spifs_file_t *)fcookie;
+    spifs_t *spifs = file->fs_handle;
+
+    if (off < 0)
+        return ERR_INVALID_ARGS;
+
+    /* a file's first page doesn't move while it exists, writes drop the cached contents */
+    rwlock_acquire_read(&file->lock);
+    ssize_t result = fs_pcache_read((fscookie *)spifs, file->metadata.page_idx,
+                                    file->metadata.length, buf, off, len,
+                                    spifs_fill_file, file);
+    rwlock_release_read(&file->lock);
 
     return result;
 }
 
+static ssize_t spifs_map(filecookie *fcookie, off_t off, size_t len, off_t *dev_offset)
+{
+    spifs_file_t *file = (spifs_file_t *)fcookie;
+    spifs_t *spifs = file->fs_handle;
+
+    if (off < 0)
+        return ERR_INVALID_ARGS;
+
+    /* files are stored in one piece */
+    rwlock_acquire_read(&file->lock);
+    if ((uint64_t)off >= file->metadata.length) {
+        len = 0;
+    } else {
+        len = MIN(len, (size_t)(file->metadata.length - off));
+        *dev_offset = (off_t)spifs->page_size * file->metadata.page_idx + off;
+    }
+    rwlock_release_read(&file->lock);
+
+    return len;
+}
+
 static ssize_t spifs_write(filecookie *fcookie, const void *buf, off_t off, size_t size)
 {
     status_t err = NO_ERROR;
@@ -946,14 +1251,16 @@ static ssize_t spifs_write(filecookie *fcookie, const void *buf, off_t off, size
     if (off < 0)
         return ERR_INVALID_ARGS;
 
-    mutex_acquire(&spifs->lock);
+    // capacity never changes, no need for a lock to check against it.
+    if (off + len > file->metadata.capacity)
+        return ERR_OUT_OF_RANGE;
 
-    if (off + len > file->metadata.capacity) {
-        err = ERR_OUT_OF_RANGE;
-        goto err;
-    }
+    // Our own page buffer, the one in spifs_t belongs to the ToC.
+    uint8_t *page = memalign(CACHE_LINE, spifs->page_size);
+    if (!page)
+        return ERR_NO_MEMORY;
 
-    bool dirty_toc = false;
+    rwlock_acquire_write(&file->lock);
 
     uint32_t start_addr =
         off + (file->metadata.page_idx * spifs->page_size);
@@ -961,12 +1268,6 @@ static ssize_t spifs_write(filecookie *fcookie, const void *buf, off_t off, size
     uint32_t page_shift = log2_uint(spifs->page_size);
     uint32_t target_page_id = divpow2(start_addr, page_shift);
 
-    // Are we growing the file?
-    if (off + len > file->metadata.length) {
-        file->metadata.length = off + len;
-        dirty_toc = true;
-    }
-
     // Leading Partial Page.
     uint32_t page_offset = start_addr % spifs->page_size;
     if (page_offset) {
@@ -975,16 +1276,16 @@ static ssize_t spifs_write(filecookie *fcookie, const void *buf, off_t off, size
         uint32_t n_bytes = MIN(len, page_end - start_addr);
 
         // read..
-        err = spifs_read_page(spifs, target_page_id);
+        err = spifs_read_page(spifs, page, target_page_id);
         if (err != NO_ERROR) {
             goto err;
         }
 
         // modify..
-        memcpy(spifs->page + page_offset, buf, n_bytes);
+        memcpy(page + page_offset, buf, n_bytes);
 
         // write..
-        err = spifs_write_page(spifs, target_page_id);
+        err = spifs_write_page(spifs, page, target_page_id);
         if (err != NO_ERROR) {
             goto err;
         }
@@ -996,8 +1297,8 @@ static ssize_t spifs_write(filecookie *fcookie, const void *buf, off_t off, size
 
     // Internal Full Pages.
     while (len >= spifs->page_size) {
-        memcpy(spifs->page, buf, spifs->page_size);
-        err = spifs_write_page(spifs, target_page_id);
+        memcpy(page, buf, spifs->page_size);
+        err = spifs_write_page(spifs, page, target_page_id);
         if (err != NO_ERROR) {
             goto err;
         }
@@ -1010,16 +1311,16 @@ static ssize_t spifs_write(filecookie *fcookie, const void *buf, off_t off, size
     // Trailing Partial Page.
     if (len) { // Bytes remaining?
         // read..
-        err = spifs_read_page(spifs, target_page_id);
+        err = spifs_read_page(spifs, page, target_page_id);
         if (err != NO_ERROR) {
             goto err;
         }
 
         // modify..
-        memcpy(spifs->page, buf, len);
+        memcpy(page, buf, len);
 
         // write..
-        err = spifs_write_page(spifs, target_page_id);
+        err = spifs_write_page(spifs, page, target_page_id);
         if (err != NO_ERROR) {
             goto err;
         } else {
@@ -1027,12 +1328,18 @@ static ssize_t spifs_write(filecookie *fcookie, const void *buf, off_t off, size
         }
     }
 
-    if (dirty_toc) {
-        err = spifs_commit_toc(spifs);
+    // Are we growing the file? Only this needs the fs lock, for the ToC commit.
+    if (off + size > file->metadata.length) {
+        mutex_acquire(&spifs->lock);
+        file->metadata.length = off + size;
+        err = spifs_log_change(spifs, LOG_OP_LENGTH, file);
+        mutex_release(&spifs->lock);
     }
 
 err:
-    mutex_release(&spifs->lock);
+    fs_pcache_invalidate((fscookie *)spifs, file->metadata.page_idx);
+    rwlock_release_write(&file->lock);
+    free(page);
     return len == 0 ? (ssize_t)size : err;
 }
 
@@ -1043,23 +1350,25 @@ static status_t spifs_truncate(filecookie *fcookie, uint64_t len)
     status_t rc = NO_ERROR;
 
     spifs_file_t *file = (spifs_file_t *)fcookie;
-
-    mutex_acquire(&file->fs_handle->lock);
-
     spifs_t *spifs = (spifs_t *)(file->fs_handle);
 
+    rwlock_acquire_write(&file->lock);
+
     // Can't use truncate to grow a file.
     if (len > file->metadata.length) {
         rc = ERR_INVALID_ARGS;
         goto finish;
     }
 
+    mutex_acquire(&spifs->lock);
     file->metadata.length = len;
+    rc = spifs_log_change(spifs, LOG_OP_LENGTH, file);
+    mutex_release(&spifs->lock);
 
-    rc = spifs_commit_toc(spifs);
+    fs_pcache_invalidate((fscookie *)spifs, file->metadata.page_idx);
 
 finish:
-    mutex_release(&file->fs_handle->lock);
+    rwlock_release_write(&file->lock);
 
     return rc;
 }
@@ -1070,7 +1379,7 @@ static status_t spifs_stat(filecookie *fcookie, struct file_stat *stat)
 
     spifs_file_t *file = (spifs_file_t *)fcookie;
 
-    mutex_acquire(&file->fs_handle->lock);
+    rwlock_acquire_read(&file->lock);
 
     if (stat) {
         stat->is_dir = false;
@@ -1078,7 +1387,7 @@ static status_t spifs_stat(filecookie *fcookie, struct file_stat *stat)
         stat->capacity = file->metadata.capacity;
     }
 
-    mutex_release(&file->fs_handle->lock);
+    rwlock_release_read(&file->lock);
 
     return NO_ERROR;
 }
@@ -1249,6 +1558,7 @@ static const struct fs_api spifs_api = {
     .close = spifs_close,
 
     .read = spifs_read,
+    .map = spifs_map,
     .write = spifs_write,
     .truncate = spifs_truncate,
 
@@ -44,6 +44,7 @@ typedef struct {
     test_func func;
     const char *name;
     uint32_t toc_pages;
+    uint32_t log_pages;
 } test;
 
 static bool test_empty_after_format(const char *);
@@ -59,27 +60,30 @@ static bool test_write_with_offset(const char *);
 static bool test_read_write_big(const char *);
 static bool test_rm_active_dirent(const char *);
 static bool test_truncate_file(const char *);
+static bool test_toc_log_replay(const char *);
 
 static test tests[] = {
-    {&test_empty_after_format, "Test no files in ToC after format.", 1},
-    {&test_write_read_normal, "Test the normal read/write file paths.", 1},
-    {&test_double_create_file, "Test file cannot be created if it already exists.", 1},
-    {&test_write_past_eof, "Test that file can grow up to capacity.", 1},
-    {&test_full_toc, "Test that files cannot be created once the ToC is full.", 2},
-    {&test_full_fs, "Test that files cannot be created once the device is full.", 1},
-    {&test_rm_reclaim, "Test that files can be deleted and that used space is reclaimed.", 1},
-    {&test_write_past_end_of_capacity, "Test that we cannot write past the capacity of a file.", 1},
-    {&test_corrupt_toc, "Test that FS can be mounted with one corrupt ToC.", 1},
-    {&test_write_with_offset, "Test that files can be written to at an offset.", 1},
-    {&test_read_write_big, "Test that an unaligned ~10kb buffer can be written and read.", 1},
-    {&test_rm_active_dirent, "Test that we can remove a file with an open dirent.", 1},
-    {&test_truncate_file, "Test that we can truncate a file.", 1},
+    {&test_empty_after_format, "Test no files in ToC after format.", 1, 0},
+    {&test_write_read_normal, "Test the normal read/write file paths.", 1, 0},
+    {&test_double_create_file, "Test file cannot be created if it already exists.", 1, 0},
+    {&test_write_past_eof, "Test that file can grow up to capacity.", 1, 0},
+    {&test_full_toc, "Test that files cannot be created once the ToC is full.", 2, 0},
+    {&test_full_fs, "Test that files cannot be created once the device is full.", 1, 0},
+    {&test_rm_reclaim, "Test that files can be deleted and that used space is reclaimed.", 1, 0},
+    {&test_write_past_end_of_capacity, "Test that we cannot write past the capacity of a file.", 1, 0},
+    {&test_corrupt_toc, "Test that FS can be mounted with one corrupt ToC.", 1, 0},
+    {&test_write_with_offset, "Test that files can be written to at an offset.", 1, 0},
+    {&test_read_write_big, "Test that an unaligned ~10kb buffer can be written and read.", 1, 0},
+    {&test_rm_active_dirent, "Test that we can remove a file with an open dirent.", 1, 0},
+    {&test_truncate_file, "Test that we can truncate a file.", 1, 0},
+    {&test_toc_log_replay, "Test that logged ToC changes survive a remount.", 1, 1},
 };
 
-bool test_setup(const char *dev_name, uint32_t toc_pages)
+bool test_setup(const char *dev_name, uint32_t toc_pages, uint32_t log_pages)
 {
     spifs_format_args_t args = {
         .toc_pages = toc_pages,
+        .log_pages = log_pages,
     };
 
     status_t res = fs_format_device(FS_NAME, dev_name, (void *)&args);
@@ -658,6 +662,88 @@ static bool test_truncate_file(const char *dev_name)
     return fs_close_file(handle) == NO_ERROR;
 }
 
+static bool test_toc_log_replay(const char *dev_name)
+{
+    filehandle *handle;
+    status_t status;
+    char buf[3] = { 'a', 'b', 'c' };
+
+    // Every create, remove and length change is a log record. Make enough of
+    // them to fill the log and have it compacted a few times over.
+    for (size_t i = 0; i < 100; i++) {
+        status = fs_create_file(TEST_FILE_PATH, &handle, 1);
+        if (status != NO_ERROR) {
+            return false;
+        }
+
+        status = fs_write_file(handle, buf, 0, 1);
+        fs_close_file(handle);
+        if (status != 1) {
+            return false;
+        }
+
+        status = fs_remove_file(TEST_FILE_PATH);
+        if (status != NO_ERROR) {
+            return false;
+        }
+    }
+
+    // Leave a file behind whose length changed twice since it was created.
+    status = fs_create_file(TEST_FILE_PATH, &handle, sizeof(buf));
+    if (status != NO_ERROR) {
+        return false;
+    }
+
+    status = fs_write_file(handle, buf, 0, sizeof(buf));
+    if (status != sizeof(buf)) {
+        fs_close_file(handle);
+        return false;
+    }
+
+    status = fs_truncate_file(handle, 2);
+    fs_close_file(handle);
+    if (status != NO_ERROR) {
+        return false;
+    }
+
+    status = fs_unmount(MNT_PATH);
+    if (status != NO_ERROR) {
+        return false;
+    }
+
+    status = fs_mount(MNT_PATH, FS_NAME, dev_name);
+    if (status != NO_ERROR) {
+        return false;
+    }
+
+    status = fs_open_file(TEST_FILE_PATH, &handle);
+    if (status != NO_ERROR) {
+        return false;
+    }
+
+    struct file_stat stat;
+    status = fs_stat_file(handle, &stat);
+    fs_close_file(handle);
+    if (status != NO_ERROR || stat.size != 2) {
+        return false;
+    }
+
+    // Only the one file should be left.
+    dirhandle *dhandle;
+    if (fs_open_dir(MNT_PATH, &dhandle) != NO_ERROR) {
+        return false;
+    }
+
+    size_t num_files = 0;
+    struct dirent ent;
+    while (fs_read_dir(dhandle, &ent) >= 0) {
+        num_files++;
+    }
+    fs_close_dir(dhandle);
+
+    return num_files == 1;
+}
+
 // Run the SPIFS test suite.
 static int spifs_test(int argc, const cmd_args *argv)
 {
@@ -678,7 +764,7 @@ static int spifs_test(int argc, const cmd_args *argv)
     size_t attempted = 0;
     for (size_t i = 0; i < countof(tests); i++) {
         ++attempted;
-        if (!test_setup(argv[2].str, tests[i].toc_pages)) {
+        if (!test_setup(argv[2].str, tests[i].toc_pages, tests[i].log_pages)) {
             printf("Test Setup failed before %s. Exiting.\n", tests[i].name);
             break;
         }
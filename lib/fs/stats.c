@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Per mount i/o statistics and the fs operation trace.
+ *
+ * Every call through the fs layer is accounted to the mount it went to, along with its time
+ * in the fs implementation. The dcache and pcache count their hits against the mount owning
+ * the fs cookie they were called with. All of it is updated under one spinlock, so it is
+ * safe from any thread and nests inside any other lock.
+ *
+ * The trace is an optional ring of the most recent operations, with timestamps, durations
+ * and results. It is off until started from the shell, or from boot on if
+ * FS_TRACE_BOOT_ENTRIES is set, and costs a branch per operation while off.
+ */
+#include <debug.h>
+#include <err.h>
+#include <list.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lk/init.h>
+#include <platform.h>
+#include <kernel/spinlock.h>
+#include <lib/console.h>
+#include <lib/fs.h>
+#include "fs_priv.h"
+
+/* number of trace entries to record from boot on, 0 to leave tracing off until asked */
+#ifndef FS_TRACE_BOOT_ENTRIES
+#define FS_TRACE_BOOT_ENTRIES 0
+#endif
+
+#define FS_TRACE_DEFAULT_ENTRIES 256
+#define FS_TRACE_NAME_LEN 32
+
+struct fs_trace_entry {
+    lk_bigtime_t start;
+    uint32_t duration;
+    uint8_t op;
+    int32_t result;
+    const void *handle;
+    off_t offset;
+    size_t len;
+    char name[FS_TRACE_NAME_LEN];
+};
+
+static spin_lock_t stats_lock = SPIN_LOCK_INITIAL_VALUE;
+static struct list_node stats_mounts = LIST_INITIAL_VALUE(stats_mounts);
+
+static struct fs_trace_entry *trace_buf;
+static uint trace_size;
+static uint trace_next;
+static uint64_t trace_total;
+
+static const char *op_names[] = {
+    [FS_OP_MOUNT] = "mount",
+    [FS_OP_UNMOUNT] = "unmount",
+    [FS_OP_OPEN] = "open",
+    [FS_OP_CREATE] = "create",
+    [FS_OP_REMOVE] = "remove",
+    [FS_OP_CLOSE] = "close",
+    [FS_OP_READ] = "read",
+    [FS_OP_READ_ASYNC] = "aread",
+    [FS_OP_WRITE] = "write",
+    [FS_OP_TRUNCATE] = "truncate",
+    [FS_OP_MKDIR] = "mkdir",
+    [FS_OP_OPENDIR] = "opendir",
+};
+
+void fs_stats_register(struct fs_mount *mount)
+{
+    memset(&mount->stats, 0, sizeof(mount->stats));
+    mount->stats.cookie = mount->cookie;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&stats_lock, state);
+    list_add_tail(&stats_mounts, &mount->stats.node);
+    spin_unlock_irqrestore(&stats_lock, state);
+}
+
+void fs_stats_unregister(struct fs_mount *mount)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&stats_lock, state);
+    list_delete(&mount->stats.node);
+    spin_unlock_irqrestore(&stats_lock, state);
+}
+
+void fs_stats_snapshot(struct fs_mount *mount, struct fs_mount_stats *stats)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&stats_lock, state);
+    *stats = mount->stats;
+    spin_unlock_irqrestore(&stats_lock, state);
+}
+
+void fs_stats_count_cache(fscookie *fs, bool pcache, bool hit)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&stats_lock, state);
+
+    struct fs_mount_stats *s;
+    list_for_every_entry(&stats_mounts, s, struct fs_mount_stats, node) {
+        if (s->cookie != fs)
+            continue;
+
+        if (pcache && hit)
+            s->pcache_hits++;
+        else if (pcache)
+            s->pcache_misses++;
+        else if (hit)
+            s->dcache_hits++;
+        else
+            s->dcache_misses++;
+        break;
+    }
+
+    spin_unlock_irqrestore(&stats_lock, state);
+}
+
+static void trace_record_locked(enum fs_op op, const void *handle, const char *name, off_t offset,
+                                size_t len, lk_bigtime_t start, uint32_t duration, ssize_t result)
+{
+    struct fs_trace_entry *e = &trace_buf[trace_next];
+    trace_next = (trace_next + 1) % trace_size;
+    trace_total++;
+
+    e->start = start;
+    e->duration = duration;
+    e->op = op;
+    e->result = result;
+    e->handle = handle;
+    e->offset = offset;
+    e->len = len;
+    e->name[0] = '\0';
+    if (name) {
+        /* the end of a long path says more about it than the start */
+        size_t namelen = strlen(name);
+        if (namelen >= sizeof(e->name))
+            name += namelen - (sizeof(e->name) - 1);
+        strlcpy(e->name, name, sizeof(e->name));
+    }
+}
+
+void fs_stats_account(struct fs_mount *mount, enum fs_op op, const void *handle, const char *name,
+                      off_t offset, size_t len, lk_bigtime_t start, ssize_t result)
+{
+    uint32_t duration = MIN(current_time_hires() - start, UINT32_MAX);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&stats_lock, state);
+
+    struct fs_mount_stats *s = &mount->stats;
+    if (result < 0)
+        s->errors++;
+
+    switch (op) {
+        case FS_OP_OPEN:
+            s->opens++;
+            s->lookup_time += duration;
+            break;
+        case FS_OP_CREATE:
+            s->creates++;
+            s->lookup_time += duration;
+            break;
+        case FS_OP_REMOVE:
+            s->removes++;
+            s->lookup_time += duration;
+            break;
+        case FS_OP_MKDIR:
+        case FS_OP_OPENDIR:
+            s->dir_ops++;
+            s->lookup_time += duration;
+            break;
+        case FS_OP_READ:
+        case FS_OP_READ_ASYNC:
+            s->reads++;
+            s->read_time += duration;
+            if (result > 0)
+                s->read_bytes += result;
+            break;
+        case FS_OP_WRITE:
+            s->writes++;
+            s->write_time += duration;
+            if (result > 0)
+                s->write_bytes += result;
+            break;
+        default:
+            break;
+    }
+
+    if (trace_buf)
+        trace_record_locked(op, handle, name, offset, len, start, duration, result);
+
+    spin_unlock_irqrestore(&stats_lock, state);
+}
+
+/* swap in a trace buffer of entries entries, or none for 0 */
+static status_t trace_start(uint entries)
+{
+    struct fs_trace_entry *buf = NULL;
+    if (entries > 0) {
+        buf = calloc(entries, sizeof(struct fs_trace_entry));
+        if (!buf)
+            return ERR_NO_MEMORY;
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&stats_lock, state);
+    struct fs_trace_entry *old = trace_buf;
+    trace_buf = buf;
+    trace_size = entries;
+    trace_next = 0;
+    trace_total = 0;
+    spin_unlock_irqrestore(&stats_lock, state);
+
+    free(old);
+
+    return NO_ERROR;
+}
+
+#if FS_TRACE_BOOT_ENTRIES > 0
+static void fs_trace_init(uint level)
+{
+    trace_start(FS_TRACE_BOOT_ENTRIES);
+}
+
+LK_INIT_HOOK(fs_trace, fs_trace_init, LK_INIT_LEVEL_HEAP);
+#endif
+
+static void trace_dump(void)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&stats_lock, state);
+    uint size = trace_size;
+    spin_unlock_irqrestore(&stats_lock, state);
+
+    if (size == 0) {
+        printf("tracing is off\n");
+        return;
+    }
+
+    struct fs_trace_entry *copy = malloc(size * sizeof(struct fs_trace_entry));
+    if (!copy) {
+        printf("no memory for a copy of the trace\n");
+        return;
+    }
+
+    /* unroll the ring oldest first, it may have been resized since it was looked at */
+    uint count = 0;
+    uint64_t total;
+    spin_lock_irqsave(&stats_lock, state);
+    total = trace_total;
+    if (trace_buf && trace_size <= size) {
+        uint first = (trace_total < trace_size) ? 0 : trace_next;
+        count = MIN(trace_total, trace_size);
+        for (uint i = 0; i < count; i++)
+            copy[i] = trace_buf[(first + i) % trace_size];
+    }
+    spin_unlock_irqrestore(&stats_lock, state);
+
+    printf("%llu operations traced, last %u:\n", total, count);
+    printf("%14s %10s %-8s %10s %-18s %12s %10s %s\n", "start usecs", "usecs", "op", "result",
+           "handle", "offset", "len", "name");
+    for (uint i = 0; i < count; i++) {
+        const struct fs_trace_entry *e = &copy[i];
+        printf("%14llu %10u %-8s %10d %-18p %12lld %10zu %s\n", e->start, e->duration,
+               op_names[e->op], e->result, e->handle, e->offset, e->len, e->name);
+    }
+
+    free(copy);
+}
+
+static void print_stats(const char *path, const struct fs_mount_stats *s)
+{
+    printf("%s:\n", path);
+    printf("\topens %llu creates %llu removes %llu dir ops %llu, lookup time %llu usecs\n",
+           s->opens, s->creates, s->removes, s->dir_ops, s->lookup_time);
+    printf("\treads %llu, %llu bytes in %llu usecs\n", s->reads, s->read_bytes, s->read_time);
+    printf("\twrites %llu, %llu bytes in %llu usecs\n", s->writes, s->write_bytes, s->write_time);
+    printf("\tdcache %llu hits %llu misses, pcache %llu hits %llu misses, %llu errors\n",
+           s->dcache_hits, s->dcache_misses, s->pcache_hits, s->pcache_misses, s->errors);
+}
+
+void fs_stats_dump(void)
+{
+    fs_for_each_mount(print_stats);
+}
+
+#if WITH_LIB_CONSOLE
+
+int fs_trace_cmd(int argc, const cmd_args *argv)
+{
+    if (argc < 3 || !strcmp(argv[2].str, "dump")) {
+        trace_dump();
+    } else if (!strcmp(argv[2].str, "on")) {
+        status_t err = trace_start((argc >= 4) ? argv[3].u : FS_TRACE_DEFAULT_ENTRIES);
+        if (err < 0) {
+            printf("error %d starting trace\n", err);
+            return err;
+        }
+    } else if (!strcmp(argv[2].str, "off")) {
+        trace_start(0);
+    } else {
+        printf("usage:\n");
+        printf("\t%s trace [dump]     : print the traced operations, oldest first\n", argv[0].str);
+        printf("\t%s trace on [count] : start over tracing the last count operations\n", argv[0].str);
+        printf("\t%s trace off        : stop tracing and drop the trace\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    return NO_ERROR;
+}
+
+#endif
@@ -0,0 +1,467 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/fsloader.h>
+
+#include <debug.h>
+#include <trace.h>
+#include <err.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <kernel/event.h>
+#include <lib/checksum.h>
+#include <lib/fs.h>
+#include <lib/miniz.h>
+#include <platform.h>
+
+#define LOCAL_TRACE 0
+
+#ifndef FSLOADER_CHUNK_SIZE
+#define FSLOADER_CHUNK_SIZE (128 * 1024)
+#endif
+#define FSLOADER_MAX_MANIFEST   16
+#define FSLOADER_MANIFEST_SIZE  4096
+
+struct load_state;
+
+struct load_chunk {
+    fs_read_request_t req;
+    struct load_state *state;
+    uint8_t *buf;
+    bool busy;              // read issued and not processed yet
+    volatile bool done;     // read completed
+};
+
+struct load_state {
+    fsloader_entry_t *entry;
+    event_t *event;
+    filehandle *handle;
+    uint64_t size;
+
+    uint64_t issued;        // file bytes asked for so far
+    uint64_t consumed;      // file bytes processed, always in order
+    uint next;              // chunk to process next
+    struct load_chunk chunk[2];
+
+    /* compressed files are read into staging buffers and inflated from there */
+    uint8_t *staging;
+    tinfl_decompressor *inflator;
+    bool inflate_done;
+
+    uint32_t crc;
+    bool failed;
+    bool finished;
+};
+
+static void chunk_done(fs_read_request_t *req)
+{
+    struct load_chunk *c = req->cookie;
+
+    c->done = true;
+    event_signal(c->state->event, true);
+}
+
+static void load_fail(struct load_state *s, status_t err)
+{
+    LTRACEF("%s: error %d\n", s->entry->path, err);
+
+    if (!s->failed) {
+        s->failed = true;
+        s->entry->status = err;
+    }
+}
+
+static void issue_chunk(struct load_state *s, struct load_chunk *c)
+{
+    if (s->failed || s->issued >= s->size)
+        return;
+
+    size_t len = MIN(FSLOADER_CHUNK_SIZE, s->size - s->issued);
+
+    memset(&c->req, 0, sizeof(c->req));
+    c->req.buf = s->staging ? c->buf : (uint8_t *)s->entry->dest + s->issued;
+    c->req.offset = s->issued;
+    c->req.len = len;
+    c->req.callback = chunk_done;
+    c->req.cookie = c;
+    c->done = false;
+
+    status_t err = fs_read_file_async(s->handle, &c->req);
+    if (err < 0) {
+        load_fail(s, err);
+        return;
+    }
+
+    c->busy = true;
+    s->issued += len;
+}
+
+/* skip the gzip header at the start of the file, returns its length */
+static ssize_t gzip_header_len(const uint8_t *buf, size_t len)
+{
+    if (len < 10 || buf[0] != 0x1f || buf[1] != 0x8b || buf[2] != 8)
+        return ERR_NOT_VALID;
+
+    uint8_t flags = buf[3];
+    size_t pos = 10;
+
+    if (flags & 0x04) { /* FEXTRA */
+        if (pos + 2 > len)
+            return ERR_NOT_SUPPORTED;
+        pos += 2 + (buf[pos] | (buf[pos + 1] << 8));
+    }
+    for (uint8_t f = 0x08; f <= 0x10; f <<= 1) { /* FNAME, FCOMMENT */
+        if (!(flags & f))
+            continue;
+        while (pos < len && buf[pos])
+            pos++;
+        pos++;
+    }
+    if (flags & 0x02) /* FHCRC */
+        pos += 2;
+
+    /* the header has to fit in the first chunk */
+    if (pos > len)
+        return ERR_NOT_SUPPORTED;
+
+    return pos;
+}
+
+static status_t inflate_chunk(struct load_state *s, const uint8_t *buf, size_t len, bool last)
+{
+    fsloader_entry_t *e = s->entry;
+
+    /* anything after the end of the stream, such as the gzip trailer, is ignored */
+    if (s->inflate_done)
+        return NO_ERROR;
+
+    if (s->consumed == 0 && (e->flags & FSLOADER_FLAG_GZIP)) {
+        ssize_t hlen = gzip_header_len(buf, len);
+        if (hlen < 0)
+            return hlen;
+        buf += hlen;
+        len -= hlen;
+    }
+
+    uint flags = TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF;
+    if (e->flags & FSLOADER_FLAG_ZLIB)
+        flags |= TINFL_FLAG_PARSE_ZLIB_HEADER;
+    if (!last)
+        flags |= TINFL_FLAG_HAS_MORE_INPUT;
+
+    uint8_t *out = (uint8_t *)e->dest + e->len;
+    size_t in_len = len;
+    size_t out_len = e->max_len - e->len;
+    tinfl_status status = tinfl_decompress(s->inflator, buf, &in_len, e->dest, out, &out_len, flags);
+
+    if (e->flags & FSLOADER_FLAG_CRC32)
+        s->crc = checksum_crc32(s->crc, out, out_len);
+    e->len += out_len;
+
+    switch (status) {
+        case TINFL_STATUS_DONE:
+            s->inflate_done = true;
+            return NO_ERROR;
+        case TINFL_STATUS_NEEDS_MORE_INPUT:
+            return last ? ERR_NOT_VALID : NO_ERROR;
+        case TINFL_STATUS_HAS_MORE_OUTPUT:
+            return ERR_TOO_BIG;
+        case TINFL_STATUS_ADLER32_MISMATCH:
+            return ERR_CHECKSUM_FAIL;
+        default:
+            return ERR_NOT_VALID;
+    }
+}
+
+static void process_chunk(struct load_state *s, struct load_chunk *c)
+{
+    fsloader_entry_t *e = s->entry;
+
+    c->busy = false;
+    if (s->failed)
+        return;
+
+    if (c->req.result < 0) {
+        load_fail(s, c->req.result);
+        return;
+    }
+    if ((size_t)c->req.result != c->req.len) {
+        load_fail(s, ERR_IO);
+        return;
+    }
+
+    size_t len = c->req.len;
+    bool last = (s->consumed + len == s->size);
+
+    if (s->staging) {
+        status_t err = inflate_chunk(s, c->buf, len, last);
+        if (err < 0) {
+            load_fail(s, err);
+            return;
+        }
+    } else {
+        if (e->flags & FSLOADER_FLAG_CRC32)
+            s->crc = checksum_crc32(s->crc, c->req.buf, len);
+        e->len += len;
+    }
+
+    s->consumed += len;
+    s->next ^= 1;
+
+    if (!last) {
+        /* put the buffer straight back to work */
+        issue_chunk(s, c);
+        return;
+    }
+
+    if ((e->flags & FSLOADER_FLAG_CRC32) && s->crc != e->crc32) {
+        printf("fsloader: %s: crc32 0x%08x, expected 0x%08x\n", e->path, s->crc, e->crc32);
+        load_fail(s, ERR_CHECKSUM_FAIL);
+        return;
+    }
+
+    e->status = NO_ERROR;
+}
+
+static status_t load_start(struct load_state *s, fsloader_entry_t *e, event_t *event)
+{
+    memset(s, 0, sizeof(*s));
+    s->entry = e;
+    s->event = event;
+    e->len = 0;
+    e->status = ERR_BUSY;
+
+    status_t err = fs_open_file(e->path, &s->handle);
+    if (err < 0)
+        return err;
+
+    struct file_stat stat;
+    err = fs_stat_file(s->handle, &stat);
+    if (err < 0)
+        return err;
+    if (stat.is_dir)
+        return ERR_NOT_FILE;
+    s->size = stat.size;
+
+    if (e->flags & (FSLOADER_FLAG_GZIP | FSLOADER_FLAG_ZLIB)) {
+        s->staging = malloc(2 * FSLOADER_CHUNK_SIZE);
+        s->inflator = malloc(sizeof(tinfl_decompressor));
+        if (!s->staging || !s->inflator)
+            return ERR_NO_MEMORY;
+        tinfl_init(s->inflator);
+    } else if (s->size > e->max_len) {
+        return ERR_TOO_BIG;
+    }
+
+    for (uint i = 0; i < 2; i++) {
+        s->chunk[i].state = s;
+        s->chunk[i].buf = s->staging ? s->staging + i * FSLOADER_CHUNK_SIZE : NULL;
+    }
+
+    if (s->size == 0) {
+        e->status = (e->flags & (FSLOADER_FLAG_GZIP | FSLOADER_FLAG_ZLIB)) ? ERR_NOT_VALID : NO_ERROR;
+        return e->status;
+    }
+
+    issue_chunk(s, &s->chunk[0]);
+    issue_chunk(s, &s->chunk[1]);
+
+    return s->failed ? e->status : NO_ERROR;
+}
+
+/* once nothing is in flight anymore */
+static void load_cleanup(struct load_state *s)
+{
+    if (s->handle)
+        fs_close_file(s->handle);
+    free(s->staging);
+    free(s->inflator);
+    s->finished = true;
+
+    LTRACEF("%s: status %d, len %zu\n", s->entry->path, s->entry->status, s->entry->len);
+}
+
+status_t fsloader_load(fsloader_entry_t *entries, uint count)
+{
+    LTRACEF("entries %p count %u\n", entries, count);
+
+    struct load_state *states = calloc(count, sizeof(struct load_state));
+    if (!states)
+        return ERR_NO_MEMORY;
+
+    event_t event;
+    event_init(&event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    lk_bigtime_t start = current_time_hires();
+
+    for (uint i = 0; i < count; i++) {
+        status_t err = load_start(&states[i], &entries[i], &event);
+        if (err < 0)
+            load_fail(&states[i], err);
+    }
+
+    uint remaining = count;
+    while (remaining > 0) {
+        for (uint i = 0; i < count; i++) {
+            struct load_state *s = &states[i];
+            if (s->finished)
+                continue;
+
+            /* chunks are processed in file order */
+            struct load_chunk *c = &s->chunk[s->next];
+            while (c->busy && c->done) {
+                process_chunk(s, c);
+                c = &s->chunk[s->next];
+            }
+
+            /* after a failure the other chunk may still be in flight, and must be waited for */
+            if (s->failed && s->chunk[s->next ^ 1].busy && s->chunk[s->next ^ 1].done)
+                s->chunk[s->next ^ 1].busy = false;
+
+            if (!s->chunk[0].busy && !s->chunk[1].busy) {
+                load_cleanup(s);
+                remaining--;
+            }
+        }
+
+        if (remaining > 0)
+            event_wait(&event);
+    }
+
+    event_destroy(&event);
+    free(states);
+
+    status_t result = NO_ERROR;
+    size_t total = 0;
+    for (uint i = 0; i < count; i++) {
+        if (entries[i].status < 0 && result == NO_ERROR)
+            result = entries[i].status;
+        total += entries[i].len;
+    }
+
+    LTRACEF("loaded %zu bytes in %llu usecs, result %d\n", total, current_time_hires() - start, result);
+
+    return result;
+}
+
+static char *next_token(char **ptr)
+{
+    char *p = *ptr;
+
+    while (*p && isspace((unsigned char)*p))
+        p++;
+    if (!*p) {
+        *ptr = p;
+        return NULL;
+    }
+
+    char *token = p;
+    while (*p && !isspace((unsigned char)*p))
+        p++;
+    if (*p)
+        *p++ = 0;
+    *ptr = p;
+
+    return token;
+}
+
+status_t fsloader_load_manifest(const char *path)
+{
+    status_t err;
+
+    char *manifest = malloc(FSLOADER_MANIFEST_SIZE + 1);
+    fsloader_entry_t *entries = calloc(FSLOADER_MAX_MANIFEST, sizeof(fsloader_entry_t));
+    if (!manifest || !entries) {
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+
+    ssize_t len = fs_load_file(path, manifest, FSLOADER_MANIFEST_SIZE);
+    if (len < 0) {
+        err = len;
+        goto out;
+    }
+    manifest[len] = 0;
+
+    /* the entries point into the manifest, which is cut into tokens as it is parsed */
+    uint count = 0;
+    uint line = 0;
+    for (char *p = manifest; p && *p; ) {
+        char *eol = strchr(p, '\n');
+        if (eol)
+            *eol++ = 0;
+        line++;
+
+        char *token = next_token(&p);
+        if (token && token[0] != '#') {
+            if (count == FSLOADER_MAX_MANIFEST) {
+                printf("fsloader: %s:%u: too many files\n", path, line);
+                err = ERR_TOO_BIG;
+                goto out;
+            }
+
+            fsloader_entry_t *e = &entries[count++];
+            e->path = token;
+
+            char *addr = next_token(&p);
+            char *max = next_token(&p);
+            if (!addr || !max) {
+                printf("fsloader: %s:%u: needs an address and a length\n", path, line);
+                err = ERR_INVALID_ARGS;
+                goto out;
+            }
+            e->dest = (void *)strtoul(addr, NULL, 0);
+            e->max_len = strtoul(max, NULL, 0);
+
+            while ((token = next_token(&p))) {
+                if (!strcmp(token, "gzip")) {
+                    e->flags |= FSLOADER_FLAG_GZIP;
+                } else if (!strcmp(token, "zlib")) {
+                    e->flags |= FSLOADER_FLAG_ZLIB;
+                } else if (!strncmp(token, "crc32=", 6)) {
+                    e->flags |= FSLOADER_FLAG_CRC32;
+                    e->crc32 = strtoul(token + 6, NULL, 0);
+                } else {
+                    printf("fsloader: %s:%u: unknown option '%s'\n", path, line, token);
+                    err = ERR_INVALID_ARGS;
+                    goto out;
+                }
+            }
+        }
+
+        p = eol;
+    }
+
+    err = fsloader_load(entries, count);
+
+    for (uint i = 0; i < count; i++) {
+        printf("%s: %s, %zu bytes at %p\n", entries[i].path,
+               entries[i].status < 0 ? "failed" : "loaded", entries[i].len, entries[i].dest);
+    }
+
+out:
+    free(entries);
+    free(manifest);
+    return err;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Load a set of files, such as a kernel, ramdisk and device tree, into memory all at once.
+ * Every file is read with asynchronous fs reads a chunk at a time, two chunks in flight per
+ * file, and each chunk is decompressed and checksummed while the reads of the others go on.
+ */
+
+#define FSLOADER_FLAG_GZIP  0x1     // the file is gzip compressed
+#define FSLOADER_FLAG_ZLIB  0x2     // the file is a zlib stream
+#define FSLOADER_FLAG_CRC32 0x4     // check the crc32 of what ends up in memory
+
+typedef struct fsloader_entry {
+    /* filled in by the caller */
+    const char *path;
+    void *dest;
+    size_t max_len;     // room at dest
+    uint flags;
+    uint32_t crc32;     // expected, with FSLOADER_FLAG_CRC32
+
+    /* results */
+    size_t len;         // bytes placed at dest
+    status_t status;
+} fsloader_entry_t;
+
+/* load all of the entries. returns the first error found, each entry's own result is in its
+ * status. cleaning the cache over anything that is going to be executed is up to the caller. */
+status_t fsloader_load(fsloader_entry_t *entries, uint count) __NONNULL();
+
+/* load the files listed in a manifest file, one per line:
+ *     <path> <address> <max len> [gzip|zlib] [crc32=<value>]
+ * blank lines and lines starting with # are skipped. */
+status_t fsloader_load_manifest(const char *path) __NONNULL();
+
+__END_CDECLS
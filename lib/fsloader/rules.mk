@@ -0,0 +1,13 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_DEPS += \
+	lib/checksum \
+	lib/fs \
+	lib/miniz
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/fsloader.c
+
+include make/module.mk
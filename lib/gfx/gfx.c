@@ -93,6 +93,27 @@ static uint32_t ARGB8888_to_RGB2220(uint32_t in)
     return out;
 }
 
+// grow the surface's dirty area to cover a rectangle that has been clipped already
+static void mark_dirty(gfx_surface *surface, uint x, uint y, uint width, uint height)
+{
+    if (surface->dirty_x0 >= surface->dirty_x1) {
+        surface->dirty_x0 = x;
+        surface->dirty_y0 = y;
+        surface->dirty_x1 = x + width;
+        surface->dirty_y1 = y + height;
+    } else {
+        surface->dirty_x0 = MIN(surface->dirty_x0, x);
+        surface->dirty_y0 = MIN(surface->dirty_y0, y);
+        surface->dirty_x1 = MAX(surface->dirty_x1, x + width);
+        surface->dirty_y1 = MAX(surface->dirty_y1, y + height);
+    }
+}
+
+static void clear_dirty(gfx_surface *surface)
+{
+    surface->dirty_x0 = surface->dirty_x1 = 0;
+}
+
 /**
  * @brief  Copy a rectangle of pixels from one part of the display to another.
  */
@@ -123,6 +144,7 @@ void gfx_copyrect(gfx_surface *surface, uint x, uint y, uint width, uint height,
         height = surface->height - y2;
 
     surface->copyrect(surface, x, y, width, height, x2, y2);
+    mark_dirty(surface, x2, y2, width, height);
 }
 
 /**
@@ -148,6 +170,7 @@ void gfx_fillrect(gfx_surface *surface, uint x, uint y, uint width, uint height,
         height = surface->height - y;
 
     surface->fillrect(surface, x, y, width, height, color);
+    mark_dirty(surface, x, y, width, height);
 }
 
 /**
@@ -161,6 +184,7 @@ void gfx_putpixel(gfx_surface *surface, uint x, uint y, uint color)
         return;
 
     surface->putpixel(surface, x, y, color);
+    mark_dirty(surface, x, y, 1, 1);
 }
 
 static void putpixel16(gfx_surface *surface, uint x, uint y, uint color)
@@ -186,163 +210,6 @@ static void putpixel8(gfx_surface *surface, uint x, uint y, uint color)
     *dest = (uint8_t)(surface->translate_color(color));
 }
 
-static void copyrect8(gfx_surface *surface, uint x, uint y, uint width, uint height, uint x2, uint y2)
-{
-    // copy
-    const uint8_t *src = &((const uint8_t *)surface->ptr)[x + y * surface->stride];
-    uint8_t *dest = &((uint8_t *)surface->ptr)[x2 + y2 * surface->stride];
-    uint stride_diff = surface->stride - width;
-
-    if (dest < src) {
-        uint i, j;
-        for (i=0; i < height; i++) {
-            for (j=0; j < width; j++) {
-                *dest = *src;
-                dest++;
-                src++;
-            }
-            dest += stride_diff;
-            src += stride_diff;
-        }
-    } else {
-        // copy backwards
-        src += height * surface->stride + width;
-        dest += height * surface->stride + width;
-
-        uint i, j;
-        for (i=0; i < height; i++) {
-            for (j=0; j < width; j++) {
-                *dest = *src;
-                dest--;
-                src--;
-            }
-            dest -= stride_diff;
-            src -= stride_diff;
-        }
-    }
-}
-
-static void fillrect8(gfx_surface *surface, uint x, uint y, uint width, uint height, uint color)
-{
-    uint8_t *dest = &((uint8_t *)surface->ptr)[x + y * surface->stride];
-    uint stride_diff = surface->stride - width;
-
-    uint8_t color8 = (uint8_t)(surface->translate_color(color));
-
-    uint i, j;
-    for (i=0; i < height; i++) {
-        for (j=0; j < width; j++) {
-            *dest = color8;
-            dest++;
-        }
-        dest += stride_diff;
-    }
-}
-
-static void copyrect16(gfx_surface *surface, uint x, uint y, uint width, uint height, uint x2, uint y2)
-{
-    // copy
-    const uint16_t *src = &((const uint16_t *)surface->ptr)[x + y * surface->stride];
-    uint16_t *dest = &((uint16_t *)surface->ptr)[x2 + y2 * surface->stride];
-    uint stride_diff = surface->stride - width;
-
-    if (dest < src) {
-        uint i, j;
-        for (i=0; i < height; i++) {
-            for (j=0; j < width; j++) {
-                *dest = *src;
-                dest++;
-                src++;
-            }
-            dest += stride_diff;
-            src += stride_diff;
-        }
-    } else {
-        // copy backwards
-        src += height * surface->stride + width;
-        dest += height * surface->stride + width;
-
-        uint i, j;
-        for (i=0; i < height; i++) {
-            for (j=0; j < width; j++) {
-                *dest = *src;
-                dest--;
-                src--;
-            }
-            dest -= stride_diff;
-            src -= stride_diff;
-        }
-    }
-}
-
-static void fillrect16(gfx_surface *surface, uint x, uint y, uint width, uint height, uint color)
-{
-    uint16_t *dest = &((uint16_t *)surface->ptr)[x + y * surface->stride];
-    uint stride_diff = surface->stride - width;
-
-    uint16_t color16 = (uint16_t)(surface->translate_color(color));
-
-    uint i, j;
-    for (i=0; i < height; i++) {
-        for (j=0; j < width; j++) {
-            *dest = color16;
-            dest++;
-        }
-        dest += stride_diff;
-    }
-}
-
-static void copyrect32(gfx_surface *surface, uint x, uint y, uint width, uint height, uint x2, uint y2)
-{
-    // copy
-    const uint32_t *src = &((const uint32_t *)surface->ptr)[x + y * surface->stride];
-    uint32_t *dest = &((uint32_t *)surface->ptr)[x2 + y2 * surface->stride];
-    uint stride_diff = surface->stride - width;
-
-    if (dest < src) {
-        uint i, j;
-        for (i=0; i < height; i++) {
-            for (j=0; j < width; j++) {
-                *dest = *src;
-                dest++;
-                src++;
-            }
-            dest += stride_diff;
-            src += stride_diff;
-        }
-    } else {
-        // copy backwards
-        src += height * surface->stride + width;
-        dest += height * surface->stride + width;
-
-        uint i, j;
-        for (i=0; i < height; i++) {
-            for (j=0; j < width; j++) {
-                *dest = *src;
-                dest--;
-                src--;
-            }
-            dest -= stride_diff;
-            src -= stride_diff;
-        }
-    }
-}
-
-static void fillrect32(gfx_surface *surface, uint x, uint y, uint width, uint height, uint color)
-{
-    uint32_t *dest = &((uint32_t *)surface->ptr)[x + y * surface->stride];
-    uint stride_diff = surface->stride - width;
-
-    uint i, j;
-    for (i=0; i < height; i++) {
-        for (j=0; j < width; j++) {
-            *dest = color;
-            dest++;
-        }
-        dest += stride_diff;
-    }
-}
-
 void gfx_line(gfx_surface *surface, uint x1, uint y1, uint x2, uint y2, uint color)
 {
     if (unlikely(x1 >= surface->width))
@@ -355,6 +222,9 @@ void gfx_line(gfx_surface *surface, uint x1, uint y1, uint x2, uint y2, uint col
     if (y2 >= surface->height)
         return;
 
+    mark_dirty(surface, MIN(x1, x2), MIN(y1, y2), (x1 > x2 ? x1 - x2 : x2 - x1) + 1,
+               (y1 > y2 ? y1 - y2 : y2 - y1) + 1);
+
     int dx = x2 - x1;
     int dy = y2 - y1;
 
@@ -432,14 +302,153 @@ uint32_t alpha32_add_ignore_destalpha(uint32_t dest, uint32_t src)
     return (srca << 24) | (cres[0] << 16) | (cres[1] << 8) | (cres[2]);
 }
 
+/*
+ * Row kernels. Where the cpu has 128 bit vectors (sse2 on x86-64, neon on
+ * arm64) the inner loops run four 32 bit pixels at a time using gcc's generic
+ * vector extension, elsewhere they are plain loops.
+ */
+#if __SSE2__ || __ARM_NEON
+#define GFX_VECTOR 1
+typedef uint32_t u32x4 __attribute__((vector_size(16), aligned(4), __may_alias__));
+typedef int32_t i32x4 __attribute__((vector_size(16)));
+typedef uint16_t u16x4 __attribute__((vector_size(8), aligned(2), __may_alias__));
+#endif
+
+static void fill32_row(uint32_t *dest, uint32_t color, uint count)
+{
+    uint i = 0;
+#if GFX_VECTOR
+    const u32x4 v = { color, color, color, color };
+    for (; i + 8 <= count; i += 8) {
+        *(u32x4 *)&dest[i] = v;
+        *(u32x4 *)&dest[i + 4] = v;
+    }
+#endif
+    for (; i < count; i++)
+        dest[i] = color;
+}
+
+static void fill16_row(uint16_t *dest, uint16_t color, uint count)
+{
+    /* get to a 32 bit boundary and fill pairs of pixels */
+    if (count > 0 && ((uintptr_t)dest & 2)) {
+        *dest++ = color;
+        count--;
+    }
+    fill32_row((uint32_t *)dest, color | ((uint32_t)color << 16), count / 2);
+    if (count & 1)
+        dest[count - 1] = color;
+}
+
+static void blend_argb8888_row(uint32_t *dest, const uint32_t *src, uint count)
+{
+    uint i = 0;
+#if GFX_VECTOR
+    const u32x4 ff = { 0xff, 0xff, 0xff, 0xff };
+    const u32x4 zero = { 0, 0, 0, 0 };
+    for (; i + 4 <= count; i += 4) {
+        u32x4 s = *(const u32x4 *)&src[i];
+        u32x4 d = *(const u32x4 *)&dest[i];
+
+        /* same arithmetic as alpha32_add_ignore_destalpha() */
+        u32x4 a = s >> 24;
+        u32x4 sa = a + 1;
+        u32x4 da = ff - sa;
+        u32x4 r = (((s >> 16) & ff) * sa >> 8) + (((d >> 16) & ff) * da >> 8);
+        u32x4 g = (((s >> 8) & ff) * sa >> 8) + (((d >> 8) & ff) * da >> 8);
+        u32x4 b = ((s & ff) * sa >> 8) + ((d & ff) * da >> 8);
+        u32x4 res = (sa << 24) | (r << 16) | (g << 8) | b;
+
+        u32x4 transparent = (u32x4)(a == zero);
+        u32x4 opaque = (u32x4)(a == ff);
+        res = (transparent & d) | (~transparent & res);
+        res = (opaque & s) | (~opaque & res);
+
+        *(u32x4 *)&dest[i] = res;
+    }
+#endif
+    for (; i < count; i++)
+        dest[i] = alpha32_add_ignore_destalpha(dest[i], src[i]);
+}
+
+static void xrgb8888_to_rgb565_row(uint16_t *dest, const uint32_t *src, uint count)
+{
+    uint i = 0;
+#if GFX_VECTOR
+    const u32x4 m5 = { 0x1f, 0x1f, 0x1f, 0x1f };
+    const u32x4 m6 = { 0x3f, 0x3f, 0x3f, 0x3f };
+    for (; i + 4 <= count; i += 4) {
+        u32x4 s = *(const u32x4 *)&src[i];
+        u32x4 out = ((s >> 3) & m5) | (((s >> 10) & m6) << 5) | (((s >> 19) & m5) << 11);
+        *(u16x4 *)&dest[i] = __builtin_convertvector(out, u16x4);
+    }
+#endif
+    for (; i < count; i++)
+        dest[i] = ARGB8888_to_RGB565(src[i]);
+}
+
+static void copyrect(gfx_surface *surface, uint x, uint y, uint width, uint height, uint x2, uint y2)
+{
+    size_t pitch = surface->stride * surface->pixelsize;
+    size_t len = width * surface->pixelsize;
+    const uint8_t *src = (const uint8_t *)surface->ptr + y * pitch + x * surface->pixelsize;
+    uint8_t *dest = (uint8_t *)surface->ptr + y2 * pitch + x2 * surface->pixelsize;
+
+    // rows are moved whole, in the order that keeps an overlapping source intact
+    if (y2 <= y) {
+        for (uint i = 0; i < height; i++)
+            memmove(dest + i * pitch, src + i * pitch, len);
+    } else {
+        for (uint i = height; i > 0; i--)
+            memmove(dest + (i - 1) * pitch, src + (i - 1) * pitch, len);
+    }
+}
+
+static void fillrect8(gfx_surface *surface, uint x, uint y, uint width, uint height, uint color)
+{
+    uint8_t *dest = &((uint8_t *)surface->ptr)[x + y * surface->stride];
+
+    uint8_t color8 = (uint8_t)(surface->translate_color(color));
+
+    for (uint i = 0; i < height; i++) {
+        memset(dest, color8, width);
+        dest += surface->stride;
+    }
+}
+
+static void fillrect16(gfx_surface *surface, uint x, uint y, uint width, uint height, uint color)
+{
+    uint16_t *dest = &((uint16_t *)surface->ptr)[x + y * surface->stride];
+
+    uint16_t color16 = (uint16_t)(surface->translate_color(color));
+
+    for (uint i = 0; i < height; i++) {
+        fill16_row(dest, color16, width);
+        dest += surface->stride;
+    }
+}
+
+static void fillrect32(gfx_surface *surface, uint x, uint y, uint width, uint height, uint color)
+{
+    uint32_t *dest = &((uint32_t *)surface->ptr)[x + y * surface->stride];
+
+    for (uint i = 0; i < height; i++) {
+        fill32_row(dest, color, width);
+        dest += surface->stride;
+    }
+}
+
 /**
  * @brief  Copy pixels from source to dest.
  *
- * Currently does not support alpha channel.
+ * ARGB_8888 sources are alpha blended, ignoring the destination alpha, and
+ * RGB_x888 sources may be converted onto RGB_565 targets. Every other
+ * combination needs matching formats and is copied as is.
  */
 void gfx_surface_blend(struct gfx_surface *target, struct gfx_surface *source, uint destx, uint desty)
 {
-    DEBUG_ASSERT(target->format == source->format);
+    DEBUG_ASSERT(target->format == source->format ||
+                 (source->format == GFX_FORMAT_RGB_x888 && target->format == GFX_FORMAT_RGB_565));
 
     LTRACEF("target %p, source %p, destx %u, desty %u\n", target, source, destx, desty);
 
@@ -456,87 +465,106 @@ void gfx_surface_blend(struct gfx_surface *target, struct gfx_surface *source, u
     if (desty + height > target->height)
         height = target->height - desty;
 
-    // XXX total hack to deal with various blends
-    if (source->format == GFX_FORMAT_RGB_565 && target->format == GFX_FORMAT_RGB_565) {
-        // 16 bit to 16 bit
-        const uint16_t *src = (const uint16_t *)source->ptr;
-        uint16_t *dest = &((uint16_t *)target->ptr)[destx + desty * target->stride];
-        uint dest_stride_diff = target->stride - width;
-        uint source_stride_diff = source->stride - width;
-
-        LTRACEF("w %u h %u dstride %u sstride %u\n", width, height, dest_stride_diff, source_stride_diff);
-
-        uint i, j;
-        for (i=0; i < height; i++) {
-            for (j=0; j < width; j++) {
-                *dest = *src;
-                dest++;
-                src++;
-            }
-            dest += dest_stride_diff;
-            src += source_stride_diff;
+    const uint8_t *src = (const uint8_t *)source->ptr;
+    uint8_t *dest = (uint8_t *)target->ptr + (destx + desty * target->stride) * target->pixelsize;
+    size_t src_pitch = source->stride * source->pixelsize;
+    size_t dest_pitch = target->stride * target->pixelsize;
+
+    LTRACEF("w %u h %u dpitch %zu spitch %zu\n", width, height, dest_pitch, src_pitch);
+
+    if (source->format == GFX_FORMAT_ARGB_8888 && target->format == GFX_FORMAT_ARGB_8888) {
+        for (uint i = 0; i < height; i++) {
+            blend_argb8888_row((uint32_t *)dest, (const uint32_t *)src, width);
+            dest += dest_pitch;
+            src += src_pitch;
         }
-    } else if (source->format == GFX_FORMAT_ARGB_8888 && target->format == GFX_FORMAT_ARGB_8888) {
-        // both are 32 bit modes, both alpha
-        const uint32_t *src = (const uint32_t *)source->ptr;
-        uint32_t *dest = &((uint32_t *)target->ptr)[destx + desty * target->stride];
-        uint dest_stride_diff = target->stride - width;
-        uint source_stride_diff = source->stride - width;
-
-        LTRACEF("w %u h %u dstride %u sstride %u\n", width, height, dest_stride_diff, source_stride_diff);
-
-        uint i, j;
-        for (i=0; i < height; i++) {
-            for (j=0; j < width; j++) {
-                // XXX ignores destination alpha
-                *dest = alpha32_add_ignore_destalpha(*dest, *src);
-                dest++;
-                src++;
-            }
-            dest += dest_stride_diff;
-            src += source_stride_diff;
+    } else if (source->format == GFX_FORMAT_RGB_x888 && target->format == GFX_FORMAT_RGB_565) {
+        for (uint i = 0; i < height; i++) {
+            xrgb8888_to_rgb565_row((uint16_t *)dest, (const uint32_t *)src, width);
+            dest += dest_pitch;
+            src += src_pitch;
         }
-    } else if (source->format == GFX_FORMAT_RGB_x888 && target->format == GFX_FORMAT_RGB_x888) {
-        // both are 32 bit modes, no alpha
-        const uint32_t *src = (const uint32_t *)source->ptr;
-        uint32_t *dest = &((uint32_t *)target->ptr)[destx + desty * target->stride];
-        uint dest_stride_diff = target->stride - width;
-        uint source_stride_diff = source->stride - width;
-
-        LTRACEF("w %u h %u dstride %u sstride %u\n", width, height, dest_stride_diff, source_stride_diff);
-
-        uint i, j;
-        for (i=0; i < height; i++) {
-            for (j=0; j < width; j++) {
-                *dest = *src;
-                dest++;
-                src++;
-            }
-            dest += dest_stride_diff;
-            src += source_stride_diff;
-        }
-    } else if (source->format == GFX_FORMAT_MONO && target->format == GFX_FORMAT_MONO) {
-        // both are 8 bit modes, no alpha
-        const uint8_t *src = (const uint8_t *)source->ptr;
-        uint8_t *dest = &((uint8_t *)target->ptr)[destx + desty * target->stride];
-        uint dest_stride_diff = target->stride - width;
-        uint source_stride_diff = source->stride - width;
-
-        LTRACEF("w %u h %u dstride %u sstride %u\n", width, height, dest_stride_diff, source_stride_diff);
-
-        uint i, j;
-        for (i=0; i < height; i++) {
-            for (j=0; j < width; j++) {
-                *dest = *src;
-                dest++;
-                src++;
-            }
-            dest += dest_stride_diff;
-            src += source_stride_diff;
+    } else if (source->format == target->format &&
+               (source->format == GFX_FORMAT_RGB_565 ||
+                source->format == GFX_FORMAT_RGB_x888 ||
+                source->format == GFX_FORMAT_MONO)) {
+        // no alpha, straight copy
+        size_t len = width * target->pixelsize;
+        for (uint i = 0; i < height; i++) {
+            memcpy(dest, src, len);
+            dest += dest_pitch;
+            src += src_pitch;
         }
     } else {
         panic("gfx_surface_blend: unimplemented colorspace combination (source %d target %d)\n", source->format, target->format);
     }
+
+    mark_dirty(target, destx, desty, width, height);
+}
+
+/**
+ * @brief  Copy a rectangle of pixels from one surface to another of the same format.
+ */
+void gfx_surface_blit(struct gfx_surface *target, struct gfx_surface *source, uint srcx, uint srcy,
+                      uint width, uint height, uint destx, uint desty)
+{
+    DEBUG_ASSERT(target->format == source->format);
+
+    if (srcx >= source->width || srcy >= source->height)
+        return;
+    if (destx >= target->width || desty >= target->height)
+        return;
+
+    width = MIN(width, MIN(source->width - srcx, target->width - destx));
+    height = MIN(height, MIN(source->height - srcy, target->height - desty));
+    if (width == 0 || height == 0)
+        return;
+
+    const uint8_t *src = (const uint8_t *)source->ptr + (srcx + srcy * source->stride) * source->pixelsize;
+    uint8_t *dest = (uint8_t *)target->ptr + (destx + desty * target->stride) * target->pixelsize;
+    size_t src_pitch = source->stride * source->pixelsize;
+    size_t dest_pitch = target->stride * target->pixelsize;
+    size_t len = width * target->pixelsize;
+
+    for (uint i = 0; i < height; i++) {
+        memcpy(dest, src, len);
+        dest += dest_pitch;
+        src += src_pitch;
+    }
+
+    mark_dirty(target, destx, desty, width, height);
+}
+
+static void clean_rect(gfx_surface *surface, void *buf, uint x, uint y, uint width, uint height)
+{
+    size_t pitch = surface->stride * surface->pixelsize;
+    arch_clean_cache_range((addr_t)buf + y * pitch + x * surface->pixelsize,
+                           (height - 1) * pitch + width * surface->pixelsize);
+}
+
+// clean a rectangle of buf out of the cache and tell the display about it
+static void present_rect(gfx_surface *surface, void *buf, uint x, uint y, uint width, uint height)
+{
+    clean_rect(surface, buf, x, y, width, height);
+
+    if (surface->flush_rect)
+        surface->flush_rect(x, y, width, height);
+    else if (surface->flush)
+        surface->flush(y, y + height - 1);
+}
+
+// copy a rectangle between two buffers laid out like the surface
+static void copy_buffer_rect(gfx_surface *surface, void *dest, const void *src,
+                             uint x, uint y, uint width, uint height)
+{
+    size_t pitch = surface->stride * surface->pixelsize;
+    size_t offset = y * pitch + x * surface->pixelsize;
+    size_t len = width * surface->pixelsize;
+
+    for (uint i = 0; i < height; i++) {
+        memcpy((uint8_t *)dest + offset, (const uint8_t *)src + offset, len);
+        offset += pitch;
+    }
 }
 
 /**
@@ -544,10 +572,18 @@ void gfx_surface_blend(struct gfx_surface *target, struct gfx_surface *source, u
  */
 void gfx_flush(gfx_surface *surface)
 {
+    if (surface->front_ptr) {
+        mark_dirty(surface, 0, 0, surface->width, surface->height);
+        gfx_swap_buffers(surface);
+        return;
+    }
+
     arch_clean_cache_range((addr_t)surface->ptr, surface->len);
 
     if (surface->flush)
         surface->flush(0, surface->height-1);
+
+    clear_dirty(surface);
 }
 
 /**
@@ -566,11 +602,87 @@ void gfx_flush_rows(struct gfx_surface *surface, uint start, uint end)
     if (end >= surface->height)
         end = surface->height - 1;
 
+    if (surface->front_ptr) {
+        mark_dirty(surface, 0, start, surface->width, end - start + 1);
+        gfx_swap_buffers(surface);
+        return;
+    }
+
     uint32_t runlen = surface->stride * surface->pixelsize;
     arch_clean_cache_range((addr_t)surface->ptr + start * runlen, (end - start + 1) * runlen);
 
     if (surface->flush)
         surface->flush(start, end);
+
+    if (start <= surface->dirty_y0 && end + 1 >= surface->dirty_y1)
+        clear_dirty(surface);
+}
+
+/**
+ * @brief  Push out just the area drawn to since the last flush.
+ *
+ * Uses the display's rectangle flush if it has one, full width rows otherwise.
+ */
+void gfx_flush_dirty(struct gfx_surface *surface)
+{
+    if (surface->front_ptr) {
+        gfx_swap_buffers(surface);
+        return;
+    }
+
+    if (surface->dirty_x0 >= surface->dirty_x1)
+        return;
+
+    uint x = surface->dirty_x0;
+    uint y = surface->dirty_y0;
+    uint width = surface->dirty_x1 - x;
+    uint height = surface->dirty_y1 - y;
+
+    clear_dirty(surface);
+
+    present_rect(surface, surface->ptr, x, y, width, height);
+}
+
+/**
+ * @brief  Show what has been drawn to a double buffered surface.
+ *
+ * Flips to the back buffer if the display supports it and brings the new back
+ * buffer up to date, otherwise copies the dirty area to the front buffer.
+ */
+void gfx_swap_buffers(struct gfx_surface *surface)
+{
+    if (!surface->front_ptr) {
+        gfx_flush_dirty(surface);
+        return;
+    }
+
+    if (surface->dirty_x0 >= surface->dirty_x1)
+        return;
+
+    uint x = surface->dirty_x0;
+    uint y = surface->dirty_y0;
+    uint width = surface->dirty_x1 - x;
+    uint height = surface->dirty_y1 - y;
+
+    clear_dirty(surface);
+
+    if (surface->flip) {
+        clean_rect(surface, surface->ptr, x, y, width, height);
+        if (surface->flip(surface->ptr) >= 0) {
+            void *temp = surface->front_ptr;
+            surface->front_ptr = surface->ptr;
+            surface->ptr = temp;
+
+            // the old front buffer is missing this frame's changes
+            copy_buffer_rect(surface, surface->ptr, surface->front_ptr, x, y, width, height);
+            clean_rect(surface, surface->ptr, x, y, width, height);
+            return;
+        }
+        // fall back to copying if the flip failed
+    }
+
+    copy_buffer_rect(surface, surface->front_ptr, surface->ptr, x, y, width, height);
+    present_rect(surface, surface->front_ptr, x, y, width, height);
 }
 
 
@@ -592,12 +704,17 @@ gfx_surface *gfx_create_surface(void *ptr, uint width, uint height, uint stride,
     surface->height = height;
     surface->stride = stride;
     surface->alpha = MAX_ALPHA;
+    surface->flush = NULL;
+    surface->flush_rect = NULL;
+    surface->front_ptr = NULL;
+    surface->flip = NULL;
+    clear_dirty(surface);
 
     // set up some function pointers
     switch (format) {
         case GFX_FORMAT_RGB_565:
             surface->translate_color = &ARGB8888_to_RGB565;
-            surface->copyrect = &copyrect16;
+            surface->copyrect = &copyrect;
             surface->fillrect = &fillrect16;
             surface->putpixel = &putpixel16;
             surface->pixelsize = 2;
@@ -606,7 +723,7 @@ gfx_surface *gfx_create_surface(void *ptr, uint width, uint height, uint stride,
         case GFX_FORMAT_RGB_x888:
         case GFX_FORMAT_ARGB_8888:
             surface->translate_color = NULL;
-            surface->copyrect = &copyrect32;
+            surface->copyrect = &copyrect;
             surface->fillrect = &fillrect32;
             surface->putpixel = &putpixel32;
             surface->pixelsize = 4;
@@ -614,7 +731,7 @@ gfx_surface *gfx_create_surface(void *ptr, uint width, uint height, uint stride,
             break;
         case GFX_FORMAT_MONO:
             surface->translate_color = &ARGB8888_to_Luma;
-            surface->copyrect = &copyrect8;
+            surface->copyrect = &copyrect;
             surface->fillrect = &fillrect8;
             surface->putpixel = &putpixel8;
             surface->pixelsize = 1;
@@ -622,7 +739,7 @@ gfx_surface *gfx_create_surface(void *ptr, uint width, uint height, uint stride,
             break;
         case GFX_FORMAT_RGB_332:
             surface->translate_color = &ARGB8888_to_RGB332;
-            surface->copyrect = &copyrect8;
+            surface->copyrect = &copyrect;
             surface->fillrect = &fillrect8;
             surface->putpixel = &putpixel8;
             surface->pixelsize = 1;
@@ -630,7 +747,7 @@ gfx_surface *gfx_create_surface(void *ptr, uint width, uint height, uint stride,
             break;
         case GFX_FORMAT_RGB_2220:
             surface->translate_color = &ARGB8888_to_RGB2220;
-            surface->copyrect = &copyrect8;
+            surface->copyrect = &copyrect;
             surface->fillrect = &fillrect8;
             surface->putpixel = &putpixel8;
             surface->pixelsize = 1;
@@ -690,6 +807,38 @@ gfx_surface *gfx_create_surface_from_display(struct display_framebuffer *fb)
     surface = gfx_create_surface(fb->image.pixels, fb->image.width, fb->image.height, fb->image.stride, format);
 
     surface->flush = fb->flush;
+    surface->flush_rect = fb->flush_rect;
+
+    return surface;
+}
+
+/**
+ * @brief  Create a double buffered graphics surface object from a display
+ */
+gfx_surface *gfx_create_buffered_surface_from_display(struct display_framebuffer *fb)
+{
+    gfx_surface *surface = gfx_create_surface_from_display(fb);
+    if (!surface)
+        return NULL;
+
+    surface->front_ptr = surface->ptr;
+
+    if (fb->flip && fb->back_pixels) {
+        surface->ptr = fb->back_pixels;
+        surface->flip = fb->flip;
+    } else {
+        surface->ptr = malloc(surface->len);
+        if (!surface->ptr) {
+            free(surface);
+            return NULL;
+        }
+        surface->free_on_destroy = true;
+    }
+
+    // start out with what is on screen
+    memcpy(surface->ptr, surface->front_ptr, surface->len);
+    if (surface->flip)
+        arch_clean_cache_range((addr_t)surface->ptr, surface->len);
 
     return surface;
 }
@@ -32,6 +32,8 @@
 
 #include <debug.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 #include <lib/io.h>
 #include <lk/init.h>
 #include <lib/gfx.h>
@@ -45,9 +47,14 @@
 
 /**
  * @brief  Represent state of graphics console
+ *
+ * Output only updates the text grid. The screen is brought up to date once
+ * per print callback, so a burst of lines costs a single scroll of the pixels
+ * and one flush.
  */
 static struct {
     gfx_surface *surface;
+    gfx_surface *glyphs; // font pre-rendered in front_color on back_color
     uint rows, columns;
     uint extray; // extra pixels left over if the rows doesn't fit precisely
 
@@ -55,8 +62,57 @@ static struct {
 
     uint32_t front_color;
     uint32_t back_color;
+
+    // characters on screen, a ring of rows with screen row 0 at ring row top
+    char *text;
+    uint top;
+
+    // per ring row, the columns to redraw. empty when dirty_x0 >= dirty_x1
+    uint16_t *dirty_x0;
+    uint16_t *dirty_x1;
+
+    // rows scrolled off since the last redraw
+    uint scroll;
 } gfxconsole;
 
+static inline uint ring_row(uint y)
+{
+    return (gfxconsole.top + y) % gfxconsole.rows;
+}
+
+static void mark_dirty(uint row, uint x0, uint x1)
+{
+    if (gfxconsole.dirty_x0[row] >= gfxconsole.dirty_x1[row]) {
+        gfxconsole.dirty_x0[row] = x0;
+        gfxconsole.dirty_x1[row] = x1;
+    } else {
+        gfxconsole.dirty_x0[row] = MIN(gfxconsole.dirty_x0[row], x0);
+        gfxconsole.dirty_x1[row] = MAX(gfxconsole.dirty_x1[row], x1);
+    }
+}
+
+static void put_char(char c)
+{
+    uint row = ring_row(gfxconsole.y);
+
+    gfxconsole.text[row * gfxconsole.columns + gfxconsole.x] = c;
+    mark_dirty(row, gfxconsole.x, gfxconsole.x + 1);
+    gfxconsole.x++;
+}
+
+static void scroll_up(void)
+{
+    // the top row becomes the new, blank bottom row
+    uint row = gfxconsole.top;
+    gfxconsole.top = (gfxconsole.top + 1) % gfxconsole.rows;
+
+    memset(&gfxconsole.text[row * gfxconsole.columns], ' ', gfxconsole.columns);
+    gfxconsole.dirty_x0[row] = 0;
+    gfxconsole.dirty_x1[row] = gfxconsole.columns;
+
+    gfxconsole.scroll++;
+}
+
 static void gfxconsole_putc(char c)
 {
     static enum { NORMAL, ESCAPE } state = NORMAL;
@@ -71,8 +127,7 @@ static void gfxconsole_putc(char c)
                 p_num = 0;
                 state = ESCAPE;
             } else {
-                font_draw_char(gfxconsole.surface, c, gfxconsole.x * FONT_X, gfxconsole.y * FONT_Y, gfxconsole.front_color);
-                gfxconsole.x++;
+                put_char(c);
             }
             break;
         }
@@ -87,8 +142,7 @@ static void gfxconsole_putc(char c)
             } else if (c == '[') {
                 // eat this character
             } else {
-                font_draw_char(gfxconsole.surface, c, gfxconsole.x * FONT_X, gfxconsole.y * FONT_Y, gfxconsole.front_color);
-                gfxconsole.x++;
+                put_char(c);
                 state = NORMAL;
             }
             break;
@@ -100,19 +154,51 @@ static void gfxconsole_putc(char c)
         gfxconsole.y++;
     }
     if (gfxconsole.y >= gfxconsole.rows) {
-        // scroll up
-        gfx_copyrect(gfxconsole.surface, 0, FONT_Y, gfxconsole.surface->width, gfxconsole.surface->height - FONT_Y - gfxconsole.extray, 0, 0);
+        scroll_up();
         gfxconsole.y--;
-        gfx_fillrect(gfxconsole.surface, 0, gfxconsole.surface->height - FONT_Y - gfxconsole.extray, gfxconsole.surface->width, FONT_Y, gfxconsole.back_color);
-        gfx_flush(gfxconsole.surface);
     }
 }
 
+/**
+ * @brief  Bring the screen up to date with the text grid.
+ */
+static void gfxconsole_redraw(void)
+{
+    gfx_surface *surface = gfxconsole.surface;
+
+    if (gfxconsole.scroll >= gfxconsole.rows) {
+        // everything on screen scrolled off, the rows were all cleared and are dirty
+    } else if (gfxconsole.scroll > 0) {
+        // move the rows that are still visible up in one go
+        uint dy = gfxconsole.scroll * FONT_Y;
+        gfx_copyrect(surface, 0, dy, surface->width, gfxconsole.rows * FONT_Y - dy, 0, 0);
+    }
+    gfxconsole.scroll = 0;
+
+    for (uint y = 0; y < gfxconsole.rows; y++) {
+        uint row = ring_row(y);
+        uint x0 = gfxconsole.dirty_x0[row];
+        uint x1 = gfxconsole.dirty_x1[row];
+        if (x0 >= x1)
+            continue;
+
+        const char *line = &gfxconsole.text[row * gfxconsole.columns];
+        for (uint x = x0; x < x1; x++)
+            font_draw_char_cached(surface, gfxconsole.glyphs, line[x], x * FONT_X, y * FONT_Y);
+
+        gfxconsole.dirty_x0[row] = gfxconsole.dirty_x1[row] = 0;
+    }
+
+    gfx_flush_dirty(surface);
+}
+
 void gfxconsole_print_callback(print_callback_t *cb, const char *str, size_t len)
 {
     for (size_t i = 0; i < len; i++) {
         gfxconsole_putc(str[i]);
     }
+
+    gfxconsole_redraw();
 }
 
 static print_callback_t cb = {
@@ -149,6 +235,25 @@ void gfxconsole_start(gfx_surface *surface)
     gfxconsole.front_color = 0xffffffff;
     gfxconsole.back_color = 0;
 
+    gfxconsole.glyphs = font_render_glyphs(surface->format, gfxconsole.front_color, gfxconsole.back_color);
+    gfxconsole.text = malloc(gfxconsole.rows * gfxconsole.columns);
+    gfxconsole.dirty_x0 = calloc(gfxconsole.rows, sizeof(uint16_t));
+    gfxconsole.dirty_x1 = calloc(gfxconsole.rows, sizeof(uint16_t));
+    if (!gfxconsole.glyphs || !gfxconsole.text || !gfxconsole.dirty_x0 || !gfxconsole.dirty_x1) {
+        dprintf(INFO, "gfxconsole: out of memory\n");
+        if (gfxconsole.glyphs)
+            gfx_surface_destroy(gfxconsole.glyphs);
+        free(gfxconsole.text);
+        free(gfxconsole.dirty_x0);
+        free(gfxconsole.dirty_x1);
+        gfxconsole.glyphs = NULL;
+        gfxconsole.surface = NULL;
+        return;
+    }
+    memset(gfxconsole.text, ' ', gfxconsole.rows * gfxconsole.columns);
+    gfxconsole.top = 0;
+    gfxconsole.scroll = 0;
+
     // register for debug callbacks
     register_print_callback(&cb);
 }
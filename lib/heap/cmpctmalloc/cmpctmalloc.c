@@ -38,6 +38,11 @@
 // Allocation strategy takes place with a global mutex.  Freelist entries are
 // kept in linked lists with 8 different sizes per binary order of magnitude
 // and the header size is two words with eager coalescing on free.
+//
+// With CMPCT_CPU_CACHE, each cpu also keeps a small cache of free blocks for
+// each of the smallest size classes, so most small allocations and frees
+// never touch the global mutex.  Cached blocks still look allocated to the
+// heap proper, and the caches are refilled from and flushed to it in batches.
 
 #ifdef DEBUG
 #define CMPCT_DEBUG
@@ -57,6 +62,23 @@
 
 STATIC_ASSERT(IS_PAGE_ALIGNED(HEAP_GROW_SIZE));
 
+#if !defined(CMPCT_CPU_CACHE)
+#if WITH_SMP
+#define CMPCT_CPU_CACHE 1
+#else
+#define CMPCT_CPU_CACHE 0
+#endif
+#endif
+
+#if CMPCT_CPU_CACHE
+// Size classes served by the per cpu caches: the smallest 16 buckets, up to 128 bytes.
+#define CMPCT_CACHE_CLASSES 16
+// Blocks moved between a cache and the heap at a time.
+#define CMPCT_CACHE_BATCH 8
+// Most blocks a cache holds per class before it flushes a batch.
+#define CMPCT_CACHE_MAX 32
+#endif
+
 // Individual allocations above 4Mbytes are just fetched directly from the
 // block allocator.
 #define HEAP_ALLOC_VIRTUAL_BITS 22
@@ -100,6 +122,26 @@ struct heap {
 // Heap static vars.
 static struct heap theheap;
 
+#if CMPCT_CPU_CACHE
+// Cached blocks are linked through the first word of their payload.
+typedef struct cached_struct {
+    struct cached_struct *next;
+} cached_t;
+
+struct cpu_cache {
+    spin_lock_t lock;
+    cached_t *lists[CMPCT_CACHE_CLASSES];
+    uint counts[CMPCT_CACHE_CLASSES];
+};
+
+static struct cpu_cache cpu_caches[SMP_MAX_CPUS];
+
+// Set while the self test runs, since it checks exact free space accounting.
+static bool cache_bypass;
+
+static void cpu_caches_drain(void);
+#endif
+
 static ssize_t heap_grow(size_t len, free_t **bucket);
 
 static void lock(void)
@@ -139,6 +181,27 @@ void cmpct_dump(void)
         }
     }
     unlock();
+
+#if CMPCT_CPU_CACHE
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct cpu_cache *cache = &cpu_caches[cpu];
+        uint blocks = 0;
+        size_t bytes = 0;
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&cache->lock, state);
+        for (int i = 0; i < CMPCT_CACHE_CLASSES; i++) {
+            for (cached_t *c = cache->lists[i]; c != NULL; c = c->next) {
+                blocks++;
+                bytes += ((header_t *)c - 1)->size;
+            }
+        }
+        spin_unlock_irqrestore(&cache->lock, state);
+
+        if (blocks > 0)
+            dprintf(INFO, "\tcpu %u cache: %u blocks, %zu bytes\n", cpu, blocks, bytes);
+    }
+#endif
 }
 
 // Operates in sizes that don't include the allocation header.
@@ -572,6 +635,11 @@ static void cmpct_test_return_to_os(void)
 
 void cmpct_test(void)
 {
+#if CMPCT_CPU_CACHE
+    // The tests check exact free space accounting, which the caches would hide.
+    cache_bypass = true;
+    cpu_caches_drain();
+#endif
     cmpct_test_buckets();
     cmpct_test_get_back_newly_freed();
     cmpct_test_return_to_os();
@@ -628,6 +696,9 @@ void cmpct_test(void)
     }
 
     cmpct_dump();
+#if CMPCT_CPU_CACHE
+    cache_bypass = false;
+#endif
 }
 
 static void *large_alloc(size_t size)
@@ -660,6 +731,11 @@ static void *large_alloc(size_t size)
 
 void cmpct_trim(void)
 {
+#if CMPCT_CPU_CACHE
+    // Cached blocks could be pinning pages, give them back first.
+    cpu_caches_drain();
+#endif
+
     // Look at free list entries that are at least as large as one page plus a
     // header. They might be at the start or the end of a block, so we can trim
     // them and free the page(s).
@@ -730,18 +806,9 @@ void cmpct_trim(void)
     unlock();
 }
 
-void *cmpct_alloc(size_t size)
+// Allocates from the free lists.  Called with the lock.
+static void *alloc_locked(size_t size, int start_bucket, size_t rounded_up)
 {
-    if (size == 0u) return NULL;
-
-    if (size + sizeof(header_t) > (1u << HEAP_ALLOC_VIRTUAL_BITS)) return large_alloc(size);
-
-    size_t rounded_up;
-    int start_bucket = size_to_index_allocating(size, &rounded_up);
-
-    rounded_up += sizeof(header_t);
-
-    lock();
     int bucket = find_nonempty_bucket(start_bucket);
     if (bucket == -1) {
         // Grow heap by at least 12% if we can.
@@ -750,7 +817,6 @@ void *cmpct_alloc(size_t size)
                                 MAX(HEAP_GROW_SIZE, rounded_up)));
         while (heap_grow(growby, NULL) < 0) {
             if (growby <= rounded_up) {
-                unlock();
                 return NULL;
             }
             growby = MAX(growby >> 1, rounded_up);
@@ -780,10 +846,122 @@ void *cmpct_alloc(size_t size)
     memset(result, ALLOC_FILL, size);
     memset(((char *)result) + size, PADDING_FILL, rounded_up - size - sizeof(header_t));
 #endif
+    return result;
+}
+
+#if CMPCT_CPU_CACHE
+// Takes a block of the given class from the current cpu's cache, refilling
+// the cache from the heap if it is empty.  Every block in a class's cache has
+// room for any allocation of that class.
+static void *cache_alloc(int bucket, size_t rounded_up)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    struct cpu_cache *cache = &cpu_caches[arch_curr_cpu_num()];
+    spin_lock(&cache->lock);
+    cached_t *block = cache->lists[bucket];
+    if (block != NULL) {
+        cache->lists[bucket] = block->next;
+        cache->counts[bucket]--;
+    }
+    spin_unlock_restore(&cache->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (block != NULL) return block;
+
+    // Refill with a batch in one trip to the heap.
+    size_t payload = rounded_up - sizeof(header_t);
+    cached_t *batch = NULL;
+    uint count = 0;
+    lock();
+    for (; count < CMPCT_CACHE_BATCH; count++) {
+        cached_t *b = alloc_locked(payload, bucket, rounded_up);
+        if (b == NULL) break;
+        b->next = batch;
+        batch = b;
+    }
+    unlock();
+
+    if (batch == NULL) return NULL;
+    block = batch;
+    batch = batch->next;
+
+    // We may have moved cpus, which doesn't matter.
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    cache = &cpu_caches[arch_curr_cpu_num()];
+    spin_lock(&cache->lock);
+    while (batch != NULL) {
+        cached_t *next = batch->next;
+        batch->next = cache->lists[bucket];
+        cache->lists[bucket] = batch;
+        cache->counts[bucket]++;
+        batch = next;
+    }
+    spin_unlock_restore(&cache->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return block;
+}
+#endif
+
+void *cmpct_alloc(size_t size)
+{
+    if (size == 0u) return NULL;
+
+    if (size + sizeof(header_t) > (1u << HEAP_ALLOC_VIRTUAL_BITS)) return large_alloc(size);
+
+    size_t rounded_up;
+    int start_bucket = size_to_index_allocating(size, &rounded_up);
+
+    rounded_up += sizeof(header_t);
+
+#if CMPCT_CPU_CACHE
+    if (start_bucket < CMPCT_CACHE_CLASSES && !cache_bypass) {
+        void *result = cache_alloc(start_bucket, rounded_up);
+#ifdef CMPCT_DEBUG
+        if (result != NULL) {
+            header_t *header = (header_t *)result - 1;
+            memset(result, ALLOC_FILL, size);
+            memset(((char *)result) + size, PADDING_FILL, header->size - size - sizeof(header_t));
+        }
+#endif
+        return result;
+    }
+#endif
+
+    lock();
+    void *result = alloc_locked(size, start_bucket, rounded_up);
     unlock();
     return result;
 }
 
+size_t cmpct_alloc_batch(size_t size, size_t count, void **ptrs)
+{
+    if (size == 0u) return 0;
+
+    size_t i = 0;
+    if (size + sizeof(header_t) > (1u << HEAP_ALLOC_VIRTUAL_BITS)) {
+        for (; i < count; i++) {
+            ptrs[i] = large_alloc(size);
+            if (ptrs[i] == NULL) break;
+        }
+        return i;
+    }
+
+    size_t rounded_up;
+    int start_bucket = size_to_index_allocating(size, &rounded_up);
+
+    rounded_up += sizeof(header_t);
+
+    // Straight from the free lists, the per cpu caches would only add a
+    // second round of locking.
+    lock();
+    for (; i < count; i++) {
+        ptrs[i] = alloc_locked(size, start_bucket, rounded_up);
+        if (ptrs[i] == NULL) break;
+    }
+    unlock();
+    return i;
+}
+
 void *cmpct_memalign(size_t size, size_t alignment)
 {
     if (alignment < 8) return cmpct_alloc(size);
@@ -813,13 +991,11 @@ void *cmpct_memalign(size_t size, size_t alignment)
     return payload;
 }
 
-void cmpct_free(void *payload)
+// Returns an allocation to the free lists.  Called with the lock.
+static void free_locked(void *payload)
 {
-    if (payload == NULL) return;
     header_t *header = (header_t *)payload - 1;
-    DEBUG_ASSERT(!is_tagged_as_free(header));  // Double free!
     size_t size = header->size;
-    lock();
     header_t *left = header->left;
     if (left != NULL && is_tagged_as_free(left)) {
         // Coalesce with left free object.
@@ -848,6 +1024,97 @@ void cmpct_free(void *payload)
             free_memory(header, left, size);
         }
     }
+}
+
+#if CMPCT_CPU_CACHE
+static void free_cached(cached_t *batch)
+{
+    lock();
+    while (batch != NULL) {
+        cached_t *next = batch->next;
+        free_locked(batch);
+        batch = next;
+    }
+    unlock();
+}
+
+// Puts a small block in the current cpu's cache, flushing a batch back to
+// the heap if the cache is full.
+static void cache_free(void *payload, int bucket)
+{
+    cached_t *block = payload;
+    cached_t *batch = NULL;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    struct cpu_cache *cache = &cpu_caches[arch_curr_cpu_num()];
+    spin_lock(&cache->lock);
+    block->next = cache->lists[bucket];
+    cache->lists[bucket] = block;
+    if (++cache->counts[bucket] > CMPCT_CACHE_MAX) {
+        // Flush the oldest blocks, keeping the recently freed ones which are
+        // more likely to still be in the cpu cache.
+        cached_t *keep = cache->lists[bucket];
+        for (uint i = 1; i < CMPCT_CACHE_MAX - CMPCT_CACHE_BATCH; i++)
+            keep = keep->next;
+        batch = keep->next;
+        keep->next = NULL;
+        cache->counts[bucket] = CMPCT_CACHE_MAX - CMPCT_CACHE_BATCH;
+    }
+    spin_unlock_restore(&cache->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (batch != NULL) free_cached(batch);
+}
+
+// Returns every cached block on every cpu to the heap.
+static void cpu_caches_drain(void)
+{
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct cpu_cache *cache = &cpu_caches[cpu];
+
+        for (int i = 0; i < CMPCT_CACHE_CLASSES; i++) {
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&cache->lock, state);
+            cached_t *batch = cache->lists[i];
+            cache->lists[i] = NULL;
+            cache->counts[i] = 0;
+            spin_unlock_irqrestore(&cache->lock, state);
+
+            free_cached(batch);
+        }
+    }
+}
+#endif
+
+void cmpct_free(void *payload)
+{
+    if (payload == NULL) return;
+    header_t *header = (header_t *)payload - 1;
+    DEBUG_ASSERT(!is_tagged_as_free(header));  // Double free!
+#if CMPCT_CPU_CACHE
+    int bucket = size_to_index_freeing(header->size - sizeof(header_t));
+    if (bucket < CMPCT_CACHE_CLASSES && !cache_bypass) {
+#ifdef CMPCT_DEBUG
+        memset(payload, FREE_FILL, header->size - sizeof(header_t));
+#endif
+        cache_free(payload, bucket);
+        return;
+    }
+#endif
+    lock();
+    free_locked(payload);
+    unlock();
+}
+
+void cmpct_free_batch(void **payloads, size_t count)
+{
+    lock();
+    for (size_t i = 0; i < count; i++) {
+        void *payload = payloads[i];
+        if (payload == NULL) continue;
+        DEBUG_ASSERT(!is_tagged_as_free((header_t *)payload - 1));  // Double free!
+        free_locked(payload);
+    }
     unlock();
 }
 
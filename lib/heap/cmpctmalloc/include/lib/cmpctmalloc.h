@@ -31,6 +31,10 @@ void *cmpct_realloc(void *, size_t);
 void cmpct_free(void *);
 void *cmpct_memalign(size_t size, size_t alignment);
 
+/* allocate or free many blocks with one acquisition of the heap lock */
+size_t cmpct_alloc_batch(size_t size, size_t count, void **ptrs);
+void cmpct_free_batch(void **ptrs, size_t count);
+
 void cmpct_init(void);
 void cmpct_dump(void);
 void cmpct_test(void);
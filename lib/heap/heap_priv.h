@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <compiler.h>
+#include <lib/console.h>
+
+__BEGIN_CDECLS
+
+#if HEAP_PROFILE
+
+/* allocation tracking hooks, called by the heap wrapper after every
+ * successful allocation and before every free */
+void heap_profile_alloc(void *ptr, size_t size, void *caller);
+void heap_profile_free(void *ptr);
+
+/* 'heap profile' console subcommand */
+int heap_profile_cmd(int argc, const cmd_args *argv);
+
+#else
+
+static inline void heap_profile_alloc(void *ptr, size_t size, void *caller) {}
+static inline void heap_profile_free(void *ptr) {}
+
+#endif
+
+__END_CDECLS
@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Heap allocation profiler.
+ *
+ * Every live allocation is recorded in a fixed size open addressed table
+ * keyed by pointer, holding its size, the time it was made and the call
+ * site that made it. Call sites are kept in a second table keyed by caller
+ * pc, accumulating live and total counts. Neither table allocates, so the
+ * profiler can sit underneath malloc. When a table fills up new
+ * allocations go untracked and are counted as dropped.
+ */
+#include "heap_priv.h"
+
+#include <debug.h>
+#include <assert.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/spinlock.h>
+#include <platform.h>
+
+#define LOCAL_TRACE 0
+
+/* both must be powers of two */
+#ifndef HEAP_PROFILE_MAX_ALLOCS
+#define HEAP_PROFILE_MAX_ALLOCS 4096
+#endif
+#ifndef HEAP_PROFILE_MAX_SITES
+#define HEAP_PROFILE_MAX_SITES 256
+#endif
+
+#define DEFAULT_TOP_COUNT 10
+#define MAX_OLDEST_COUNT 32
+
+struct live_alloc {
+    void *ptr;
+    size_t size;
+    lk_time_t time;
+    uint16_t site;
+};
+
+struct alloc_site {
+    void *caller;
+    size_t live_bytes;
+    uint live_count;
+    uint allocs;
+    uint64_t total_bytes;
+};
+
+static spin_lock_t profile_lock = SPIN_LOCK_INITIAL_VALUE;
+static bool profile_enabled = true;
+static lk_time_t profile_start;
+static uint profile_dropped;
+static uint profile_live;
+static uint profile_sites;
+
+static struct live_alloc live_table[HEAP_PROFILE_MAX_ALLOCS];
+static struct alloc_site site_table[HEAP_PROFILE_MAX_SITES];
+
+/* copy used for sorting and printing outside of the lock */
+static struct alloc_site site_snapshot[HEAP_PROFILE_MAX_SITES];
+
+static inline uint hash_ptr(const void *ptr, uint size)
+{
+    uintptr_t val = (uintptr_t)ptr >> 3;
+    return (uint)((val * 0x9e3779b1u) & (size - 1));
+}
+
+static uint find_site_locked(void *caller)
+{
+    uint i = hash_ptr(caller, HEAP_PROFILE_MAX_SITES);
+
+    for (uint probe = 0; probe < HEAP_PROFILE_MAX_SITES; probe++) {
+        struct alloc_site *site = &site_table[i];
+        if (site->caller == caller)
+            return i;
+        if (!site->caller) {
+            site->caller = caller;
+            profile_sites++;
+            return i;
+        }
+        i = (i + 1) & (HEAP_PROFILE_MAX_SITES - 1);
+    }
+
+    return HEAP_PROFILE_MAX_SITES;
+}
+
+static struct live_alloc *find_live_locked(const void *ptr)
+{
+    uint i = hash_ptr(ptr, HEAP_PROFILE_MAX_ALLOCS);
+
+    for (uint probe = 0; probe < HEAP_PROFILE_MAX_ALLOCS; probe++) {
+        struct live_alloc *a = &live_table[i];
+        if (a->ptr == ptr)
+            return a;
+        if (!a->ptr)
+            return NULL;
+        i = (i + 1) & (HEAP_PROFILE_MAX_ALLOCS - 1);
+    }
+
+    return NULL;
+}
+
+/* linear probing removal, shifting later members of the run back so that
+ * lookups never need tombstones */
+static void remove_live_locked(struct live_alloc *a)
+{
+    uint hole = a - live_table;
+    uint i = hole;
+
+    for (;;) {
+        i = (i + 1) & (HEAP_PROFILE_MAX_ALLOCS - 1);
+        if (!live_table[i].ptr)
+            break;
+
+        uint home = hash_ptr(live_table[i].ptr, HEAP_PROFILE_MAX_ALLOCS);
+        /* can entry i move back into the hole without passing its home slot? */
+        if (((i - home) & (HEAP_PROFILE_MAX_ALLOCS - 1)) >=
+                ((i - hole) & (HEAP_PROFILE_MAX_ALLOCS - 1))) {
+            live_table[hole] = live_table[i];
+            hole = i;
+        }
+    }
+
+    live_table[hole].ptr = NULL;
+}
+
+void heap_profile_alloc(void *ptr, size_t size, void *caller)
+{
+    if (!ptr || !profile_enabled)
+        return;
+
+    lk_time_t now = current_time();
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&profile_lock, state);
+
+    uint s = find_site_locked(caller);
+    if (s == HEAP_PROFILE_MAX_SITES || profile_live >= HEAP_PROFILE_MAX_ALLOCS * 3 / 4) {
+        profile_dropped++;
+        goto out;
+    }
+
+    uint i = hash_ptr(ptr, HEAP_PROFILE_MAX_ALLOCS);
+    while (live_table[i].ptr)
+        i = (i + 1) & (HEAP_PROFILE_MAX_ALLOCS - 1);
+
+    live_table[i].ptr = ptr;
+    live_table[i].size = size;
+    live_table[i].time = now;
+    live_table[i].site = s;
+    profile_live++;
+
+    struct alloc_site *site = &site_table[s];
+    site->live_bytes += size;
+    site->live_count++;
+    site->allocs++;
+    site->total_bytes += size;
+
+out:
+    spin_unlock_irqrestore(&profile_lock, state);
+}
+
+void heap_profile_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&profile_lock, state);
+
+    /* allocations made while disabled or dropped simply won't be found */
+    struct live_alloc *a = find_live_locked(ptr);
+    if (a) {
+        struct alloc_site *site = &site_table[a->site];
+        site->live_bytes -= a->size;
+        site->live_count--;
+        remove_live_locked(a);
+        profile_live--;
+    }
+
+    spin_unlock_irqrestore(&profile_lock, state);
+}
+
+static void heap_profile_reset(void)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&profile_lock, state);
+    memset(live_table, 0, sizeof(live_table));
+    memset(site_table, 0, sizeof(site_table));
+    profile_live = 0;
+    profile_sites = 0;
+    profile_dropped = 0;
+    profile_start = current_time();
+    spin_unlock_irqrestore(&profile_lock, state);
+}
+
+static int compare_live_bytes(const void *_a, const void *_b)
+{
+    const struct alloc_site *a = _a, *b = _b;
+
+    if (a->live_bytes != b->live_bytes)
+        return (a->live_bytes > b->live_bytes) ? -1 : 1;
+    return 0;
+}
+
+static int compare_allocs(const void *_a, const void *_b)
+{
+    const struct alloc_site *a = _a, *b = _b;
+
+    if (a->allocs != b->allocs)
+        return (a->allocs > b->allocs) ? -1 : 1;
+    return 0;
+}
+
+/* copy out the used part of the site table, returns the number of sites */
+static uint snapshot_sites(uint *dropped, uint *live, lk_time_t *start)
+{
+    uint count = 0;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&profile_lock, state);
+    for (uint i = 0; i < HEAP_PROFILE_MAX_SITES; i++) {
+        if (site_table[i].caller)
+            site_snapshot[count++] = site_table[i];
+    }
+    *dropped = profile_dropped;
+    *live = profile_live;
+    *start = profile_start;
+    spin_unlock_irqrestore(&profile_lock, state);
+
+    return count;
+}
+
+static void dump_sites(bool by_rate, uint top)
+{
+    uint dropped, live;
+    lk_time_t start;
+    uint count = snapshot_sites(&dropped, &live, &start);
+
+    qsort(site_snapshot, count, sizeof(site_snapshot[0]), by_rate ? compare_allocs : compare_live_bytes);
+
+    lk_time_t window = current_time() - start;
+    if (window == 0)
+        window = 1;
+
+    printf("%u call sites, %u live allocations, %u dropped, window %u ms\n",
+           count, live, dropped, (uint)window);
+    printf("%-18s %10s %8s %10s %12s %10s\n",
+           "caller", "live bytes", "live", "allocs", "total bytes", "allocs/s");
+    for (uint i = 0; i < MIN(count, top); i++) {
+        const struct alloc_site *site = &site_snapshot[i];
+        printf("%-18p %10zu %8u %10u %12llu %10llu\n",
+               site->caller, site->live_bytes, site->live_count, site->allocs,
+               site->total_bytes, (uint64_t)site->allocs * 1000 / window);
+    }
+}
+
+static void dump_oldest(uint top)
+{
+    struct live_alloc oldest[MAX_OLDEST_COUNT];
+    void *callers[MAX_OLDEST_COUNT];
+    uint count = 0;
+
+    top = MIN(top, MAX_OLDEST_COUNT);
+    if (top == 0)
+        return;
+
+    /* keep the oldest few sorted by insertion, the table is too big to copy */
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&profile_lock, state);
+    for (uint i = 0; i < HEAP_PROFILE_MAX_ALLOCS; i++) {
+        const struct live_alloc *a = &live_table[i];
+        if (!a->ptr)
+            continue;
+        if (count == top && a->time >= oldest[count - 1].time)
+            continue;
+
+        uint j = (count < top) ? count++ : count - 1;
+        for (; j > 0 && oldest[j - 1].time > a->time; j--)
+            oldest[j] = oldest[j - 1];
+        oldest[j] = *a;
+    }
+    for (uint i = 0; i < count; i++)
+        callers[i] = site_table[oldest[i].site].caller;
+    spin_unlock_irqrestore(&profile_lock, state);
+
+    lk_time_t now = current_time();
+    printf("%-18s %10s %10s %-18s\n", "ptr", "size", "age ms", "caller");
+    for (uint i = 0; i < count; i++) {
+        const struct live_alloc *a = &oldest[i];
+        printf("%-18p %10zu %10u %-18p\n", a->ptr, a->size, (uint)(now - a->time), callers[i]);
+    }
+}
+
+int heap_profile_cmd(int argc, const cmd_args *argv)
+{
+    if (argc < 3) {
+usage:
+        printf("usage:\n");
+        printf("\t%s profile bytes [count]  : top call sites by live bytes\n", argv[0].str);
+        printf("\t%s profile rate [count]   : top call sites by allocation rate\n", argv[0].str);
+        printf("\t%s profile oldest [count] : oldest live allocations\n", argv[0].str);
+        printf("\t%s profile on|off         : pause or resume tracking\n", argv[0].str);
+        printf("\t%s profile reset          : forget everything tracked so far\n", argv[0].str);
+        printf("tracking is %s\n", profile_enabled ? "on" : "off");
+        return ERR_INVALID_ARGS;
+    }
+
+    uint top = (argc >= 4) ? argv[3].u : DEFAULT_TOP_COUNT;
+
+    if (!strcmp(argv[2].str, "bytes")) {
+        dump_sites(false, top);
+    } else if (!strcmp(argv[2].str, "rate")) {
+        dump_sites(true, top);
+    } else if (!strcmp(argv[2].str, "oldest")) {
+        dump_oldest(top);
+    } else if (!strcmp(argv[2].str, "on")) {
+        profile_enabled = true;
+    } else if (!strcmp(argv[2].str, "off")) {
+        profile_enabled = false;
+    } else if (!strcmp(argv[2].str, "reset")) {
+        heap_profile_reset();
+    } else {
+        goto usage;
+    }
+
+    return NO_ERROR;
+}
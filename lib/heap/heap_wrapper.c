@@ -28,11 +28,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <err.h>
-#include <list.h>
+#include <arch/ops.h>
 #include <kernel/spinlock.h>
 #include <lib/console.h>
 #include <lib/page_alloc.h>
 
+#include "heap_priv.h"
+
 #define LOCAL_TRACE 0
 
 /* heap tracing */
@@ -42,9 +44,67 @@ static bool heap_trace = false;
 #define heap_trace (false)
 #endif
 
-/* delayed free list */
-struct list_node delayed_free_list = LIST_INITIAL_VALUE(delayed_free_list);
-spin_lock_t delayed_free_lock = SPIN_LOCK_INITIAL_VALUE;
+/* delayed free stacks, one per cpu so that frees from interrupt handlers
+ * and critical sections never wait on a lock. frees only ever push and a
+ * drain takes a whole stack at once, so the stacks are free of ABA issues.
+ */
+struct delayed_free_node {
+    struct delayed_free_node *next;
+};
+
+struct delayed_free_stack {
+    struct delayed_free_node *head;
+} __ALIGNED(CACHE_LINE);
+
+static struct delayed_free_stack delayed_free_stacks[SMP_MAX_CPUS];
+
+/* a bit per cpu whose stack went from empty to non empty, so the fast path
+ * only has to look at one word */
+static volatile int delayed_free_pending;
+
+STATIC_ASSERT(SMP_MAX_CPUS <= sizeof(delayed_free_pending) * 8);
+
+#if WITH_SMP
+static inline struct delayed_free_node *delayed_free_push(struct delayed_free_stack *stack,
+        struct delayed_free_node *node)
+{
+    struct delayed_free_node *old = __atomic_load_n(&stack->head, __ATOMIC_RELAXED);
+    do {
+        node->next = old;
+    } while (!__atomic_compare_exchange_n(&stack->head, &old, node, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return old;
+}
+
+static inline struct delayed_free_node *delayed_free_take(struct delayed_free_stack *stack)
+{
+    return __atomic_exchange_n(&stack->head, NULL, __ATOMIC_ACQUIRE);
+}
+#else
+/* with one cpu masking interrupts is enough, and works on cores without
+ * atomic pointer exchange */
+static inline struct delayed_free_node *delayed_free_push(struct delayed_free_stack *stack,
+        struct delayed_free_node *node)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    struct delayed_free_node *old = stack->head;
+    node->next = old;
+    stack->head = node;
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+    return old;
+}
+
+static inline struct delayed_free_node *delayed_free_take(struct delayed_free_stack *stack)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    struct delayed_free_node *head = stack->head;
+    stack->head = NULL;
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+    return head;
+}
+#endif
 
 #if WITH_LIB_HEAP_MINIHEAP
 /* miniheap implementation */
@@ -54,6 +114,8 @@ static inline void *HEAP_MALLOC(size_t s) { return miniheap_alloc(s, 0); }
 static inline void *HEAP_REALLOC(void *ptr, size_t s) { return miniheap_realloc(ptr, s); }
 static inline void *HEAP_MEMALIGN(size_t boundary, size_t s) { return miniheap_alloc(s, boundary); }
 #define HEAP_FREE miniheap_free
+#define HEAP_MALLOC_BATCH miniheap_alloc_batch
+#define HEAP_FREE_BATCH miniheap_free_batch
 static inline void *HEAP_CALLOC(size_t n, size_t s)
 {
     size_t realsize = n * s;
@@ -82,6 +144,8 @@ static inline void HEAP_INIT(void)
 #define HEAP_MALLOC cmpct_alloc
 #define HEAP_REALLOC cmpct_realloc
 #define HEAP_FREE cmpct_free
+#define HEAP_MALLOC_BATCH cmpct_alloc_batch
+#define HEAP_FREE_BATCH cmpct_free_batch
 #define HEAP_INIT cmpct_init
 #define HEAP_DUMP cmpct_dump
 #define HEAP_TRIM cmpct_trim
@@ -105,6 +169,21 @@ static inline void *HEAP_CALLOC(size_t n, size_t s)
 #define HEAP_MEMALIGN(b, s) dlmemalign(b, s)
 #define HEAP_REALLOC(p, s) dlrealloc(p, s)
 #define HEAP_FREE(p) dlfree(p)
+static inline size_t HEAP_MALLOC_BATCH(size_t s, size_t n, void **ptrs)
+{
+    /* carved out of one chunk, each piece can be freed on its own */
+    if (n > 0 && dlindependent_calloc(n, s, ptrs))
+        return n;
+
+    size_t i;
+    for (i = 0; i < n; i++) {
+        ptrs[i] = dlmalloc(s);
+        if (!ptrs[i])
+            break;
+    }
+    return i;
+}
+static inline void HEAP_FREE_BATCH(void **ptrs, size_t n) { dlbulk_free(ptrs, n); }
 static inline void HEAP_INIT(void) {}
 
 static inline void HEAP_DUMP(void)
@@ -137,22 +216,19 @@ static inline void HEAP_TRIM(void) { dlmalloc_trim(0); }
 
 static void heap_free_delayed_list(void)
 {
-    struct list_node list;
-
-    list_initialize(&list);
-
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&delayed_free_lock, state);
-
-    struct list_node *node;
-    while ((node = list_remove_head(&delayed_free_list))) {
-        list_add_head(&list, node);
-    }
-    spin_unlock_irqrestore(&delayed_free_lock, state);
-
-    while ((node = list_remove_head(&list))) {
-        LTRACEF("freeing node %p\n", node);
-        HEAP_FREE(node);
+    uint pending = atomic_swap(&delayed_free_pending, 0);
+
+    for (uint cpu = 0; pending != 0; cpu++, pending >>= 1) {
+        if (!(pending & 1))
+            continue;
+
+        struct delayed_free_node *node = delayed_free_take(&delayed_free_stacks[cpu]);
+        while (node) {
+            struct delayed_free_node *next = node->next;
+            LTRACEF("freeing node %p\n", node);
+            HEAP_FREE(node);
+            node = next;
+        }
     }
 }
 
@@ -164,7 +240,7 @@ void heap_init(void)
 void heap_trim(void)
 {
     // deal with the pending free list
-    if (unlikely(!list_is_empty(&delayed_free_list))) {
+    if (unlikely(delayed_free_pending)) {
         heap_free_delayed_list();
     }
 
@@ -176,11 +252,12 @@ void *malloc(size_t size)
     LTRACEF("size %zd\n", size);
 
     // deal with the pending free list
-    if (unlikely(!list_is_empty(&delayed_free_list))) {
+    if (unlikely(delayed_free_pending)) {
         heap_free_delayed_list();
     }
 
     void *ptr = HEAP_MALLOC(size);
+    heap_profile_alloc(ptr, size, __GET_CALLER());
     if (heap_trace)
         printf("caller %p malloc %zu -> %p\n", __GET_CALLER(), size, ptr);
     return ptr;
@@ -191,11 +268,12 @@ void *memalign(size_t boundary, size_t size)
     LTRACEF("boundary %zu, size %zd\n", boundary, size);
 
     // deal with the pending free list
-    if (unlikely(!list_is_empty(&delayed_free_list))) {
+    if (unlikely(delayed_free_pending)) {
         heap_free_delayed_list();
     }
 
     void *ptr = HEAP_MEMALIGN(boundary, size);
+    heap_profile_alloc(ptr, size, __GET_CALLER());
     if (heap_trace)
         printf("caller %p memalign %zu, %zu -> %p\n", __GET_CALLER(), boundary, size, ptr);
     return ptr;
@@ -206,11 +284,12 @@ void *calloc(size_t count, size_t size)
     LTRACEF("count %zu, size %zd\n", count, size);
 
     // deal with the pending free list
-    if (unlikely(!list_is_empty(&delayed_free_list))) {
+    if (unlikely(delayed_free_pending)) {
         heap_free_delayed_list();
     }
 
     void *ptr = HEAP_CALLOC(count, size);
+    heap_profile_alloc(ptr, count * size, __GET_CALLER());
     if (heap_trace)
         printf("caller %p calloc %zu, %zu -> %p\n", __GET_CALLER(), count, size, ptr);
     return ptr;
@@ -221,11 +300,16 @@ void *realloc(void *ptr, size_t size)
     LTRACEF("ptr %p, size %zd\n", ptr, size);
 
     // deal with the pending free list
-    if (unlikely(!list_is_empty(&delayed_free_list))) {
+    if (unlikely(delayed_free_pending)) {
         heap_free_delayed_list();
     }
 
     void *ptr2 = HEAP_REALLOC(ptr, size);
+    if (ptr2 || size == 0) {
+        /* a failed realloc leaves the old block in place */
+        heap_profile_free(ptr);
+        heap_profile_alloc(ptr2, size, __GET_CALLER());
+    }
     if (heap_trace)
         printf("caller %p realloc %p, %zu -> %p\n", __GET_CALLER(), ptr, size, ptr2);
     return ptr2;
@@ -237,36 +321,66 @@ void free(void *ptr)
     if (heap_trace)
         printf("caller %p free %p\n", __GET_CALLER(), ptr);
 
+    heap_profile_free(ptr);
     HEAP_FREE(ptr);
 }
 
+size_t malloc_batch(size_t size, size_t count, void **ptrs)
+{
+    LTRACEF("size %zd, count %zu\n", size, count);
+
+    // deal with the pending free list
+    if (unlikely(delayed_free_pending)) {
+        heap_free_delayed_list();
+    }
+
+    size_t allocated = HEAP_MALLOC_BATCH(size, count, ptrs);
+    for (size_t i = 0; i < allocated; i++)
+        heap_profile_alloc(ptrs[i], size, __GET_CALLER());
+    if (heap_trace)
+        printf("caller %p malloc_batch %zu, %zu -> %zu\n", __GET_CALLER(), size, count, allocated);
+    return allocated;
+}
+
+void free_batch(void **ptrs, size_t count)
+{
+    LTRACEF("ptrs %p, count %zu\n", ptrs, count);
+    if (heap_trace)
+        printf("caller %p free_batch %p, %zu\n", __GET_CALLER(), ptrs, count);
+
+    for (size_t i = 0; i < count; i++)
+        heap_profile_free(ptrs[i]);
+    HEAP_FREE_BATCH(ptrs, count);
+}
+
 /* critical section time delayed free */
 void heap_delayed_free(void *ptr)
 {
     LTRACEF("ptr %p\n", ptr);
 
     /* throw down a structure on the free block */
-    /* XXX assumes the free block is large enough to hold a list node */
-    struct list_node *node = (struct list_node *)ptr;
+    /* XXX assumes the free block is large enough to hold a pointer */
+    struct delayed_free_node *node = (struct delayed_free_node *)ptr;
 
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&delayed_free_lock, state);
-    list_add_head(&delayed_free_list, node);
-    spin_unlock_irqrestore(&delayed_free_lock, state);
+    heap_profile_free(ptr);
+
+    /* any cpu's stack will do if we migrate in between */
+    uint cpu = arch_curr_cpu_num();
+    if (delayed_free_push(&delayed_free_stacks[cpu], node) == NULL)
+        atomic_or(&delayed_free_pending, (int)(1u << cpu));
 }
 
 static void heap_dump(void)
 {
     HEAP_DUMP();
 
-    printf("\tdelayed free list:\n");
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&delayed_free_lock, state);
-    struct list_node *node;
-    list_for_every(&delayed_free_list, node) {
-        printf("\t\tnode %p\n", node);
+    /* the stacks may be drained underneath us, so only peek at the heads */
+    printf("\tdelayed free pending mask 0x%x:\n", delayed_free_pending);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct delayed_free_node *head = delayed_free_stacks[cpu].head;
+        if (head)
+            printf("\t\tcpu %u head %p\n", cpu, head);
     }
-    spin_unlock_irqrestore(&delayed_free_lock, state);
 }
 
 static void heap_test(void)
@@ -350,6 +464,9 @@ usage:
         printf("\t%s alloc <size> [alignment]\n", argv[0].str);
         printf("\t%s realloc <ptr> <size>\n", argv[0].str);
         printf("\t%s free <address>\n", argv[0].str);
+#if HEAP_PROFILE
+        printf("\t%s profile <bytes|rate|oldest|on|off|reset>\n", argv[0].str);
+#endif
         return -1;
     }
 
@@ -376,6 +493,10 @@ usage:
         if (argc < 2) goto notenoughargs;
 
         free(argv[2].p);
+#if HEAP_PROFILE
+    } else if (strcmp(argv[1].str, "profile") == 0) {
+        return heap_profile_cmd(argc, argv);
+#endif
     } else {
         printf("unrecognized command\n");
         goto usage;
@@ -35,6 +35,14 @@ void *calloc(size_t count, size_t size) __MALLOC;
 void *realloc(void *ptr, size_t size) __MALLOC;
 void free(void *ptr);
 
+/* allocate up to count objects of the same size in one trip to the heap,
+ * storing them in ptrs. returns the number allocated, which is only short of
+ * count if the heap runs out. */
+size_t malloc_batch(size_t size, size_t count, void **ptrs);
+
+/* free count objects, skipping NULL entries */
+void free_batch(void **ptrs, size_t count);
+
 void heap_init(void);
 
 /* critical section time delayed free */
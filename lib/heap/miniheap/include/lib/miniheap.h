@@ -40,6 +40,10 @@ void *miniheap_alloc(size_t, unsigned int alignment);
 void *miniheap_realloc(void *, size_t);
 void miniheap_free(void *);
 
+/* allocate or free many blocks with one acquisition of the heap lock */
+size_t miniheap_alloc_batch(size_t size, size_t count, void **ptrs);
+void miniheap_free_batch(void **ptrs, size_t count);
+
 void miniheap_init(void *ptr, size_t len);
 void miniheap_dump(void);
 void miniheap_trim(void);
@@ -105,7 +105,7 @@ void miniheap_dump(void)
 
 // try to insert this free chunk into the free list, consuming the chunk by merging it with
 // nearby ones if possible. Returns base of whatever chunk it became in the list.
-static struct free_heap_chunk *heap_insert_free_chunk(struct free_heap_chunk *chunk)
+static struct free_heap_chunk *heap_insert_free_chunk_locked(struct free_heap_chunk *chunk)
 {
 #if LK_DEBUGLEVEL > INFO
     vaddr_t chunk_end = (vaddr_t)chunk + chunk->len;
@@ -116,8 +116,6 @@ static struct free_heap_chunk *heap_insert_free_chunk(struct free_heap_chunk *ch
     struct free_heap_chunk *next_chunk;
     struct free_heap_chunk *last_chunk;
 
-    mutex_acquire(&theheap.lock);
-
     theheap.remaining += chunk->len;
 
     // walk through the list, finding the node to insert before
@@ -162,6 +160,13 @@ try_merge:
         }
     }
 
+    return chunk;
+}
+
+static struct free_heap_chunk *heap_insert_free_chunk(struct free_heap_chunk *chunk)
+{
+    mutex_acquire(&theheap.lock);
+    chunk = heap_insert_free_chunk_locked(chunk);
     mutex_release(&theheap.lock);
 
     return chunk;
@@ -182,18 +187,12 @@ static struct free_heap_chunk *heap_create_free_chunk(void *ptr, size_t len, boo
     return chunk;
 }
 
-void *miniheap_alloc(size_t size, unsigned int alignment)
+// compute the size of the chunk needed for an allocation, returns 0 for a bad alignment
+static size_t heap_alloc_size(size_t size, unsigned int *alignment)
 {
-    void *ptr;
-#if DEBUG_HEAP
-    size_t original_size = size;
-#endif
-
-    LTRACEF("size %zd, align %d\n", size, alignment);
-
     // alignment must be power of 2
-    if (alignment & (alignment - 1))
-        return NULL;
+    if (*alignment & (*alignment - 1))
+        return 0;
 
     // we always put a size field + base pointer + magic in front of the allocation
     size += sizeof(struct alloc_struct_begin);
@@ -211,20 +210,23 @@ void *miniheap_alloc(size_t size, unsigned int alignment)
     size = ROUNDUP(size, sizeof(void *));
 
     // deal with nonzero alignments
-    if (alignment > 0) {
-        if (alignment < 16)
-            alignment = 16;
+    if (*alignment > 0) {
+        if (*alignment < 16)
+            *alignment = 16;
 
         // add alignment for worst case fit
-        size += alignment;
+        size += *alignment;
     }
 
-    int retry_count = 0;
-retry:
-    mutex_acquire(&theheap.lock);
+    return size;
+}
+
+// carve an allocation out of the first chunk that fits, heap lock must be held
+static void *heap_alloc_locked(size_t size, unsigned int alignment, size_t original_size)
+{
+    void *ptr = NULL;
 
     // walk through the list
-    ptr = NULL;
     struct free_heap_chunk *chunk;
     list_for_every_entry(&theheap.free_list, chunk, struct free_heap_chunk, node) {
         DEBUG_ASSERT((chunk->len % sizeof(void *)) == 0); // len should always be a multiple of pointer size
@@ -290,6 +292,24 @@ retry:
         }
     }
 
+    return ptr;
+}
+
+void *miniheap_alloc(size_t size, unsigned int alignment)
+{
+    void *ptr;
+    size_t original_size = size;
+
+    LTRACEF("size %zd, align %d\n", size, alignment);
+
+    size = heap_alloc_size(size, &alignment);
+    if (size == 0)
+        return NULL;
+
+    int retry_count = 0;
+retry:
+    mutex_acquire(&theheap.lock);
+    ptr = heap_alloc_locked(size, alignment, original_size);
     mutex_release(&theheap.lock);
 
     /* try to grow the heap if we can */
@@ -306,6 +326,38 @@ retry:
     return ptr;
 }
 
+size_t miniheap_alloc_batch(size_t size, size_t count, void **ptrs)
+{
+    size_t original_size = size;
+    unsigned int alignment = 0;
+    size_t i = 0;
+
+    LTRACEF("size %zd, count %zu\n", size, count);
+
+    size = heap_alloc_size(size, &alignment);
+
+    int retry_count = 0;
+retry:
+    mutex_acquire(&theheap.lock);
+    for (; i < count; i++) {
+        ptrs[i] = heap_alloc_locked(size, alignment, original_size);
+        if (!ptrs[i])
+            break;
+    }
+    mutex_release(&theheap.lock);
+
+    /* grow once for whatever is left */
+    if (i < count && retry_count == 0) {
+        ssize_t err = heap_grow(size * (count - i));
+        if (err >= 0) {
+            retry_count++;
+            goto retry;
+        }
+    }
+
+    return i;
+}
+
 void *miniheap_realloc(void *ptr, size_t size)
 {
     /* slow implementation */
@@ -327,11 +379,9 @@ void *miniheap_realloc(void *ptr, size_t size)
     return p;
 }
 
-void miniheap_free(void *ptr)
+// validate an allocation and turn it back into a free chunk, not yet on the list
+static struct free_heap_chunk *heap_free_to_chunk(void *ptr)
 {
-    if (!ptr)
-        return;
-
     LTRACEF("ptr %p\n", ptr);
 
     // check for the old allocation structure
@@ -357,8 +407,30 @@ void miniheap_free(void *ptr)
 
     LTRACEF("allocation was %zd bytes long at ptr %p\n", as->size, as->ptr);
 
+    return heap_create_free_chunk(as->ptr, as->size, true);
+}
+
+void miniheap_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
     // looks good, create a free chunk and add it to the pool
-    heap_insert_free_chunk(heap_create_free_chunk(as->ptr, as->size, true));
+    heap_insert_free_chunk(heap_free_to_chunk(ptr));
+
+#if MINIHEAP_AUTOTRIM
+    miniheap_trim();
+#endif
+}
+
+void miniheap_free_batch(void **ptrs, size_t count)
+{
+    mutex_acquire(&theheap.lock);
+    for (size_t i = 0; i < count; i++) {
+        if (ptrs[i])
+            heap_insert_free_chunk_locked(heap_free_to_chunk(ptrs[i]));
+    }
+    mutex_release(&theheap.lock);
 
 #if MINIHEAP_AUTOTRIM
     miniheap_trim();
@@ -29,4 +29,10 @@ endif
 
 GLOBAL_DEFINES += LK_HEAP_IMPLEMENTATION=$(LK_HEAP_IMPLEMENTATION)
 
+# track every live allocation by call site, see 'heap profile'
+ifeq ($(LK_HEAP_PROFILE),1)
+MODULE_DEFINES += HEAP_PROFILE=1
+MODULE_SRCS += $(LOCAL_DIR)/heap_profile.c
+endif
+
 include make/module.mk
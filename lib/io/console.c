@@ -27,12 +27,14 @@
 #include <debug.h>
 #include <assert.h>
 #include <list.h>
+#include <stdio.h>
 #include <string.h>
 #include <lib/cbuf.h>
 #include <arch/ops.h>
 #include <platform.h>
 #include <platform/debug.h>
 #include <kernel/thread.h>
+#include <kernel/event.h>
 #include <lk/init.h>
 
 /* routines for dealing with main console io */
@@ -56,8 +58,8 @@ cbuf_t console_input_cbuf;
 static uint8_t console_cbuf_buf[CONSOLE_BUF_LEN];
 #endif // CONSOLE_HAS_INPUT_BUFFER
 
-/* print lock must be held when invoking out, outs, outc */
-static void out_count(const char *str, size_t len)
+/* hand output to the print callbacks and the serial port */
+static void out_sinks(const char *str, size_t len)
 {
     print_callback_t *cb;
     size_t i;
@@ -81,6 +83,191 @@ static void out_count(const char *str, size_t len)
     }
 }
 
+#if CONSOLE_OUTPUT_ASYNC
+/*
+ * Asynchronous output. Writers append a record to a ring owned by their cpu,
+ * with interrupts disabled to keep the cpu's own interrupt handlers out, and
+ * never take a lock. A thread drains the rings in record sequence order to
+ * the sinks. Until that thread runs, and once console_output_panic() has been
+ * called, output goes straight to the sinks as before.
+ */
+#ifndef CONSOLE_OUTPUT_BUF_SIZE
+#define CONSOLE_OUTPUT_BUF_SIZE 4096 // per cpu, power of two
+#endif
+#ifndef CONSOLE_OUTPUT_POLL_MS
+#define CONSOLE_OUTPUT_POLL_MS 10
+#endif
+
+/* longest record, longer writes are split */
+#define OUT_MAX_RECORD (CONSOLE_OUTPUT_BUF_SIZE / 4)
+
+struct out_record {
+    uint32_t seq;
+    uint32_t len;
+};
+
+struct out_ring {
+    uint32_t head; /* written by the owning cpu */
+    uint32_t tail; /* written by the drain thread */
+    volatile int dropped;
+    char buf[CONSOLE_OUTPUT_BUF_SIZE];
+};
+
+static struct out_ring out_rings[SMP_MAX_CPUS];
+static volatile int out_seq;
+static bool out_async;
+static volatile bool out_panic;
+static event_t out_event = EVENT_INITIAL_VALUE(out_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+static void ring_write(struct out_ring *r, uint32_t pos, const void *data, size_t len)
+{
+    uint32_t off = pos & (CONSOLE_OUTPUT_BUF_SIZE - 1);
+    size_t first = MIN(len, CONSOLE_OUTPUT_BUF_SIZE - off);
+
+    memcpy(&r->buf[off], data, first);
+    memcpy(r->buf, (const char *)data + first, len - first);
+}
+
+static void ring_read(struct out_ring *r, uint32_t pos, void *data, size_t len)
+{
+    uint32_t off = pos & (CONSOLE_OUTPUT_BUF_SIZE - 1);
+    size_t first = MIN(len, CONSOLE_OUTPUT_BUF_SIZE - off);
+
+    memcpy(data, &r->buf[off], first);
+    memcpy((char *)data + first, r->buf, len - first);
+}
+
+static void out_append(const char *str, size_t len)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct out_ring *r = &out_rings[arch_curr_cpu_num()];
+
+    while (len > 0) {
+        struct out_record rec;
+        rec.len = MIN(len, OUT_MAX_RECORD);
+
+        uint32_t head = r->head;
+        uint32_t used = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (CONSOLE_OUTPUT_BUF_SIZE - used < sizeof(rec) + rec.len) {
+            atomic_add(&r->dropped, len);
+            break;
+        }
+
+        rec.seq = atomic_add(&out_seq, 1);
+        ring_write(r, head, &rec, sizeof(rec));
+        ring_write(r, head + sizeof(rec), str, rec.len);
+        __atomic_store_n(&r->head, head + sizeof(rec) + rec.len, __ATOMIC_RELEASE);
+
+        str += rec.len;
+        len -= rec.len;
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    /* the thread lock may be held if interrupts are off, leave those to the poll */
+    if (!arch_ints_disabled())
+        event_signal(&out_event, false);
+}
+
+/* write out the oldest record across all the cpus, returns false if there are none */
+static bool out_drain_one(void)
+{
+    struct out_ring *oldest = NULL;
+    struct out_record rec, oldest_rec;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct out_ring *r = &out_rings[i];
+
+        int dropped = atomic_swap(&r->dropped, 0);
+        if (dropped) {
+            char msg[48];
+            size_t n = snprintf(msg, sizeof(msg), "\n[console: cpu %u dropped %d bytes]\n", i, dropped);
+            out_sinks(msg, MIN(n, sizeof(msg) - 1));
+        }
+
+        if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail)
+            continue;
+
+        ring_read(r, r->tail, &rec, sizeof(rec));
+        if (!oldest || (int32_t)(rec.seq - oldest_rec.seq) < 0) {
+            oldest = r;
+            oldest_rec = rec;
+        }
+    }
+
+    if (!oldest)
+        return false;
+
+    char buf[64];
+    uint32_t pos = oldest->tail + sizeof(oldest_rec);
+    for (size_t left = oldest_rec.len; left > 0; ) {
+        size_t n = MIN(left, sizeof(buf));
+        ring_read(oldest, pos, buf, n);
+        out_sinks(buf, n);
+        pos += n;
+        left -= n;
+    }
+
+    __atomic_store_n(&oldest->tail, pos, __ATOMIC_RELEASE);
+    return true;
+}
+
+static int out_drain_thread(void *arg)
+{
+    for (;;) {
+        event_wait_timeout(&out_event, CONSOLE_OUTPUT_POLL_MS);
+        while (!out_panic && out_drain_one())
+            ;
+    }
+
+    return 0;
+}
+
+static void out_count(const char *str, size_t len)
+{
+    if (out_async && !out_panic)
+        out_append(str, len);
+    else
+        out_sinks(str, len);
+}
+
+void console_output_panic(void)
+{
+    if (out_panic)
+        return;
+
+    /* stop the drain thread and write out whatever it has left synchronously */
+    out_panic = true;
+    if (out_async) {
+        while (out_drain_one())
+            ;
+    }
+}
+
+static void console_output_init(uint level)
+{
+    thread_t *t = thread_create("console out", &out_drain_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!t)
+        return;
+    thread_detach_and_resume(t);
+
+    out_async = true;
+}
+
+LK_INIT_HOOK(console_output, console_output_init, LK_INIT_LEVEL_THREADING);
+#else
+static void out_count(const char *str, size_t len)
+{
+    out_sinks(str, len);
+}
+
+void console_output_panic(void)
+{
+}
+#endif // CONSOLE_OUTPUT_ASYNC
+
 void register_print_callback(print_callback_t *cb)
 {
     spin_lock_saved_state_t state;
@@ -70,6 +70,14 @@ static inline void io_handle_init(io_handle_t *io, io_handle_hooks_t *hooks)
 /* the main console io handle */
 extern io_handle_t console_io;
 
+/* switch console output back to writing synchronously, first writing out
+ * anything still buffered. for panic and halt paths, there is no way back. */
+void console_output_panic(void);
+
+#ifndef CONSOLE_OUTPUT_ASYNC
+#define CONSOLE_OUTPUT_ASYNC 0
+#endif
+
 #ifndef CONSOLE_HAS_INPUT_BUFFER
 #define CONSOLE_HAS_INPUT_BUFFER 0
 #endif
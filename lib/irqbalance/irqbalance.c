@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Interrupt balancer.
+ *
+ * A low priority thread looks at the interrupt counts lib/irqstats keeps
+ * once a period and moves busy vectors off the cpus that take the most
+ * interrupts, using set_interrupt_affinity(). Each busy vector is placed on
+ * the least loaded active cpu in turn, counting the interrupts of vectors
+ * that can't be moved against the cpu taking them, and the new placement is
+ * only applied if it lowers the worst cpu's load by at least a quarter, so
+ * vectors don't bounce between cpus on noise.
+ *
+ * Only vectors still on the boot cpu, where the interrupt controller puts
+ * everything, or where the balancer itself put them are moved. A vector a
+ * driver routed with set_interrupt_affinity() is left alone.
+ */
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/mp.h>
+#include <kernel/thread.h>
+#include <lib/irqstats.h>
+#include <lk/init.h>
+#include <platform/interrupts.h>
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+/* how often to rebalance, in ms */
+#ifndef IRQBALANCE_PERIOD
+#define IRQBALANCE_PERIOD 1000
+#endif
+
+/* interrupts per period below which a vector isn't worth moving */
+#ifndef IRQBALANCE_MIN_IRQS
+#define IRQBALANCE_MIN_IRQS 100
+#endif
+
+#define IRQBALANCE_MAX_VECTORS 64
+
+struct irqbalance_vector {
+    uint vector;
+    uint mask;                          /* what the balancer routed it to, 0 if never */
+    uint32_t count[SMP_MAX_CPUS];       /* irqstats counts at this pass */
+    uint32_t last[SMP_MAX_CPUS];        /* and at the previous one */
+    uint32_t delta;                     /* interrupts on all cpus since the previous pass */
+    int cpu;                            /* where this pass puts it, -1 if it stays put */
+};
+
+static struct irqbalance_vector vectors[IRQBALANCE_MAX_VECTORS];
+static uint vector_count;
+
+static bool irqbalance_enabled = true;
+static uint32_t irqbalance_passes;
+static uint32_t irqbalance_moves;
+
+static struct irqbalance_vector *find_vector(uint vector)
+{
+    for (uint i = 0; i < vector_count; i++) {
+        if (vectors[i].vector == vector)
+            return &vectors[i];
+    }
+
+    if (vector_count == IRQBALANCE_MAX_VECTORS)
+        return NULL;
+
+    struct irqbalance_vector *v = &vectors[vector_count++];
+    memset(v, 0, sizeof(*v));
+    v->vector = vector;
+    return v;
+}
+
+static void collect(uint vector, uint cpu, uint32_t count, uint64_t cycles, void *arg)
+{
+    struct irqbalance_vector *v = find_vector(vector);
+    if (v)
+        v->count[cpu] = count;
+}
+
+static bool vector_movable(const struct irqbalance_vector *v)
+{
+    uint aff = get_interrupt_affinity(v->vector);
+
+    if (aff == 0)
+        return false;
+    if (v->mask)
+        return aff == v->mask;
+    return aff == 1;
+}
+
+static int compare_delta(const void *_a, const void *_b)
+{
+    const struct irqbalance_vector *a = _a, *b = _b;
+
+    if (a->delta != b->delta)
+        return (a->delta > b->delta) ? -1 : 1;
+    return 0;
+}
+
+static uint32_t max_load(const uint32_t *load)
+{
+    uint32_t max = 0;
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+        max = MAX(max, load[cpu]);
+    return max;
+}
+
+static void irqbalance_pass(void)
+{
+    uint32_t cur_load[SMP_MAX_CPUS] = { 0 };
+    uint32_t new_load[SMP_MAX_CPUS] = { 0 };
+    bool any = false;
+
+    irqbalance_passes++;
+
+    irqstats_for_each(&collect, NULL);
+
+    /* work out what each vector took on each cpu since the last pass. cur_load ends up with
+     * what every cpu took, new_load with what it would keep if all busy vectors moved off */
+    for (uint i = 0; i < vector_count; i++) {
+        struct irqbalance_vector *v = &vectors[i];
+        uint32_t d[SMP_MAX_CPUS];
+
+        v->delta = 0;
+        for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+            /* the counts go backwards if someone ran 'irqstats reset' */
+            d[cpu] = (v->count[cpu] >= v->last[cpu]) ? v->count[cpu] - v->last[cpu] : v->count[cpu];
+            v->last[cpu] = v->count[cpu];
+            v->delta += d[cpu];
+        }
+
+        v->cpu = -1;
+        bool movable = v->delta >= IRQBALANCE_MIN_IRQS && vector_movable(v);
+        for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+            cur_load[cpu] += d[cpu];
+            if (!movable)
+                new_load[cpu] += d[cpu];
+        }
+        if (movable) {
+            v->cpu = 0;
+            any = true;
+        }
+    }
+    if (!any)
+        return;
+
+    /* greedily place the busiest vectors first, each on the active cpu with the least load */
+    qsort(vectors, vector_count, sizeof(vectors[0]), compare_delta);
+    for (uint i = 0; i < vector_count; i++) {
+        struct irqbalance_vector *v = &vectors[i];
+        if (v->cpu < 0)
+            continue;
+
+        uint best = 0;
+        for (uint cpu = 1; cpu < SMP_MAX_CPUS; cpu++) {
+            if (mp_is_cpu_active(cpu) && new_load[cpu] < new_load[best])
+                best = cpu;
+        }
+
+        v->cpu = best;
+        new_load[best] += v->delta;
+    }
+
+    uint32_t cur_max = max_load(cur_load);
+    uint32_t new_max = max_load(new_load);
+    LTRACEF("max load %u now, %u balanced\n", cur_max, new_max);
+
+    if ((uint64_t)new_max * 4 > (uint64_t)cur_max * 3)
+        return;
+
+    for (uint i = 0; i < vector_count; i++) {
+        struct irqbalance_vector *v = &vectors[i];
+        if (v->cpu < 0)
+            continue;
+
+        uint mask = 1u << v->cpu;
+        if (mask == get_interrupt_affinity(v->vector))
+            continue;
+
+        if (set_interrupt_affinity(v->vector, mask) == NO_ERROR) {
+            LTRACEF("vector %u to cpu %d\n", v->vector, v->cpu);
+            v->mask = get_interrupt_affinity(v->vector);
+            irqbalance_moves++;
+        }
+    }
+}
+
+static int irqbalance_thread(void *arg)
+{
+    for (;;) {
+        thread_sleep(IRQBALANCE_PERIOD);
+
+        if (irqbalance_enabled)
+            irqbalance_pass();
+    }
+
+    return 0;
+}
+
+static void irqbalance_init(uint level)
+{
+    thread_t *t = thread_create("irqbalance", &irqbalance_thread, NULL, LOW_PRIORITY, DEFAULT_STACK_SIZE);
+    if (t)
+        thread_detach_and_resume(t);
+}
+
+LK_INIT_HOOK(irqbalance, &irqbalance_init, LK_INIT_LEVEL_THREADING);
+
+#if WITH_LIB_CONSOLE
+
+static int cmd_irqbalance(int argc, const cmd_args *argv)
+{
+    if (argc < 2 || !strcmp(argv[1].str, "status")) {
+        printf("balancing is %s, %u passes, %u moves\n", irqbalance_enabled ? "on" : "off",
+               irqbalance_passes, irqbalance_moves);
+        printf("%6s %8s %10s\n", "vector", "affinity", "irqs/pass");
+        for (uint i = 0; i < vector_count; i++) {
+            const struct irqbalance_vector *v = &vectors[i];
+            printf("%6u %8x %10u%s\n", v->vector, get_interrupt_affinity(v->vector), v->delta,
+                   v->mask ? " balanced" : "");
+        }
+    } else if (!strcmp(argv[1].str, "on")) {
+        irqbalance_enabled = true;
+    } else if (!strcmp(argv[1].str, "off")) {
+        irqbalance_enabled = false;
+    } else {
+        printf("usage: %s [status|on|off]\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("irqbalance", "spread busy interrupt vectors across cpus", &cmd_irqbalance)
+STATIC_COMMAND_END(irqbalance);
+
+#endif
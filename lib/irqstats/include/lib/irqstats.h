@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+/*
+ * Per vector interrupt statistics.
+ *
+ * The interrupt controller driver times every handler it calls with
+ * arch_cycle_count() and hands the result to irqstats_record(), which keeps
+ * a count, the total and maximum duration and a log2 histogram of handler
+ * durations per vector on every cpu. 'irqstats' on the console shows which
+ * handlers the interrupt time goes to.
+ */
+
+#include <compiler.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/* called from interrupt context after the handler for vector has run */
+void irqstats_record(uint vector, uint32_t cycles);
+
+/* called from interrupt context for an interrupt that had no vector */
+void irqstats_spurious(void);
+
+/* call cb for every vector and cpu seen so far, with the counts to date. the
+ * counts are read without stopping the other cpus and may be slightly stale. */
+typedef void (*irqstats_cb)(uint vector, uint cpu, uint32_t count, uint64_t cycles, void *arg);
+void irqstats_for_each(irqstats_cb cb, void *arg);
+
+__END_CDECLS
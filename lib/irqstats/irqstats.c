@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/irqstats.h>
+
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+#endif
+
+/* vectors tracked per cpu, power of 2 */
+#ifndef IRQSTATS_ENTRIES
+#define IRQSTATS_ENTRIES 64
+#endif
+
+/* bucket 0 holds handlers faster than 2^IRQSTATS_HIST_SHIFT cycles, bucket n
+ * those under 2^(IRQSTATS_HIST_SHIFT + n), the last one everything slower */
+#define IRQSTATS_HIST_SHIFT 8
+#define IRQSTATS_BUCKETS 16
+
+struct irqstats_entry {
+    uint vector_plus_one;   /* 0 for an unused slot */
+    uint32_t count;
+    uint64_t total_cycles;
+    uint32_t max_cycles;
+    uint32_t hist[IRQSTATS_BUCKETS];
+};
+
+static struct irqstats_cpu {
+    struct irqstats_entry entries[IRQSTATS_ENTRIES];
+    uint32_t spurious;
+    uint32_t dropped;
+} irqstats[SMP_MAX_CPUS] __CPU_ALIGN;
+
+static struct irqstats_entry *find_entry(struct irqstats_cpu *s, uint vector)
+{
+    uint hash = vector % IRQSTATS_ENTRIES;
+
+    for (uint i = 0; i < IRQSTATS_ENTRIES; i++) {
+        struct irqstats_entry *e = &s->entries[(hash + i) % IRQSTATS_ENTRIES];
+        if (e->vector_plus_one == vector + 1)
+            return e;
+        if (e->vector_plus_one == 0) {
+            e->vector_plus_one = vector + 1;
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+static uint hist_bucket(uint32_t cycles)
+{
+    if (cycles < (1u << IRQSTATS_HIST_SHIFT))
+        return 0;
+
+    uint b = (32 - __builtin_clz(cycles)) - IRQSTATS_HIST_SHIFT;
+    return MIN(b, IRQSTATS_BUCKETS - 1);
+}
+
+void irqstats_record(uint vector, uint32_t cycles)
+{
+    struct irqstats_cpu *s = &irqstats[arch_curr_cpu_num()];
+    struct irqstats_entry *e = find_entry(s, vector);
+
+    if (!e) {
+        s->dropped++;
+        return;
+    }
+
+    e->count++;
+    e->total_cycles += cycles;
+    if (cycles > e->max_cycles)
+        e->max_cycles = cycles;
+    e->hist[hist_bucket(cycles)]++;
+}
+
+void irqstats_spurious(void)
+{
+    irqstats[arch_curr_cpu_num()].spurious++;
+}
+
+void irqstats_for_each(irqstats_cb cb, void *arg)
+{
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        for (uint i = 0; i < IRQSTATS_ENTRIES; i++) {
+            const struct irqstats_entry *e = &irqstats[cpu].entries[i];
+            if (e->vector_plus_one == 0 || e->count == 0)
+                continue;
+
+            cb(e->vector_plus_one - 1, cpu, e->count, e->total_cycles, arg);
+        }
+    }
+}
+
+static void irqstats_reset(void)
+{
+    /* only the local cpu can be stopped from updating its table, the rest may
+     * lose or keep an interrupt or two that lands during the memset */
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    memset(irqstats, 0, sizeof(irqstats));
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+#if WITH_LIB_CONSOLE
+
+struct irqstats_line {
+    uint vector;
+    uint cpu;
+    uint32_t count;
+    uint64_t total_cycles;
+    uint32_t max_cycles;
+};
+
+static int compare_total(const void *_a, const void *_b)
+{
+    const struct irqstats_line *a = _a, *b = _b;
+
+    if (a->total_cycles != b->total_cycles)
+        return (a->total_cycles > b->total_cycles) ? -1 : 1;
+    if (a->vector != b->vector)
+        return (a->vector < b->vector) ? -1 : 1;
+    return (int)a->cpu - (int)b->cpu;
+}
+
+static void irqstats_dump(void)
+{
+    static struct irqstats_line lines[IRQSTATS_ENTRIES * SMP_MAX_CPUS];
+    uint count = 0;
+    uint32_t spurious = 0, dropped = 0;
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        const struct irqstats_cpu *s = &irqstats[cpu];
+
+        spurious += s->spurious;
+        dropped += s->dropped;
+        for (uint i = 0; i < IRQSTATS_ENTRIES; i++) {
+            const struct irqstats_entry *e = &s->entries[i];
+            if (e->vector_plus_one == 0 || e->count == 0)
+                continue;
+
+            struct irqstats_line *l = &lines[count++];
+            l->vector = e->vector_plus_one - 1;
+            l->cpu = cpu;
+            l->count = e->count;
+            l->total_cycles = e->total_cycles;
+            l->max_cycles = e->max_cycles;
+        }
+    }
+
+    /* the vectors eating the most interrupt time first */
+    qsort(lines, count, sizeof(lines[0]), compare_total);
+
+    printf("%6s %4s %10s %14s %10s %10s\n", "vector", "cpu", "count", "total cycles",
+           "avg", "max");
+    for (uint i = 0; i < count; i++) {
+        const struct irqstats_line *l = &lines[i];
+        printf("%6u %4u %10u %14llu %10llu %10u\n", l->vector, l->cpu, l->count,
+               l->total_cycles, l->total_cycles / l->count, l->max_cycles);
+    }
+    printf("%u spurious", spurious);
+    if (dropped)
+        printf(", %u not tracked", dropped);
+    printf("\n");
+}
+
+static void irqstats_hist(uint vector)
+{
+    uint32_t hist[IRQSTATS_BUCKETS] = { 0 };
+    uint32_t total = 0;
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        for (uint i = 0; i < IRQSTATS_ENTRIES; i++) {
+            const struct irqstats_entry *e = &irqstats[cpu].entries[i];
+            if (e->vector_plus_one != vector + 1)
+                continue;
+
+            for (uint b = 0; b < IRQSTATS_BUCKETS; b++)
+                hist[b] += e->hist[b];
+            total += e->count;
+        }
+    }
+
+    printf("vector %u, %u interrupts, handler cycles:\n", vector, total);
+    for (uint b = 0; b < IRQSTATS_BUCKETS; b++) {
+        if (!hist[b])
+            continue;
+
+        if (b == IRQSTATS_BUCKETS - 1)
+            printf("  >= %10u", 1u << (IRQSTATS_HIST_SHIFT + b - 1));
+        else
+            printf("  <  %10u", 1u << (IRQSTATS_HIST_SHIFT + b));
+        printf(" %10u %3u%%\n", hist[b], (uint)((uint64_t)hist[b] * 100 / total));
+    }
+}
+
+static int cmd_irqstats(int argc, const cmd_args *argv)
+{
+    if (argc < 2 || !strcmp(argv[1].str, "dump")) {
+        irqstats_dump();
+    } else if (!strcmp(argv[1].str, "hist") && argc >= 3) {
+        irqstats_hist(argv[2].u);
+    } else if (!strcmp(argv[1].str, "reset")) {
+        irqstats_reset();
+    } else {
+        printf("usage:\n");
+        printf("%s [dump]          : per vector and cpu interrupt counts and handler cycles\n", argv[0].str);
+        printf("%s hist <vector>   : histogram of handler cycles for a vector\n", argv[0].str);
+        printf("%s reset           : clear the statistics\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("irqstats", "per vector interrupt counts and handler times", &cmd_irqstats)
+STATIC_COMMAND_END(irqstats);
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+/*
+ * Threaded interrupt handlers.
+ *
+ * A threaded handler is split in two: a hard handler that runs in interrupt
+ * context and does the minimum needed to quiet the device, and a thread
+ * handler that runs in a kernel thread of its own, at a priority picked by
+ * the driver, and does the rest. Moving descriptor walking, buffer freeing
+ * and completion callbacks into the thread keeps the time spent with
+ * interrupts off short and lets higher priority threads preempt device
+ * processing.
+ *
+ * Interrupts that arrive while the thread handler is running make it run
+ * once more when it returns, so the thread handler must pick up everything
+ * the device has to offer each time it runs.
+ */
+
+#include <compiler.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+enum irq_thread_return {
+    IRQ_HANDLED,        /* the hard handler did everything there was to do */
+    IRQ_WAKE_THREAD,    /* run the thread handler */
+};
+
+typedef enum irq_thread_return (*irq_hard_handler)(void *arg);
+typedef void (*irq_thread_handler)(void *arg);
+
+/* register_threaded_int_handler flags */
+#define IRQ_THREAD_FLAG_ONESHOT 0x1 /* keep the vector masked until the thread handler returns */
+
+/*
+ * Install a split handler on vector, creating a thread named name at the
+ * given priority to run thread_fn. hard may be NULL, in which case every
+ * interrupt wakes the thread; that only works for level triggered sources
+ * with IRQ_THREAD_FLAG_ONESHOT, or for edge triggered ones. The name is not
+ * copied. Returns ERR_NO_MEMORY if the thread could not be created.
+ *
+ * Like register_int_handler(), this does not unmask the vector.
+ */
+status_t register_threaded_int_handler(unsigned int vector, irq_hard_handler hard,
+                                       irq_thread_handler thread_fn, void *arg,
+                                       int priority, uint flags, const char *name);
+
+__END_CDECLS
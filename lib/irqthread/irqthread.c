@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/irqthread.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <list.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <trace.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <platform/interrupts.h>
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+struct irq_thread {
+    struct list_node node;
+
+    unsigned int vector;
+    irq_hard_handler hard;
+    irq_thread_handler thread_fn;
+    void *arg;
+    uint flags;
+    const char *name;
+
+    thread_t *thread;
+    event_t event;
+
+    /* statistics */
+    uint32_t irqs;
+    uint32_t wakeups;
+    uint32_t runs;
+};
+
+static struct list_node irq_thread_list = LIST_INITIAL_VALUE(irq_thread_list);
+static spin_lock_t irq_thread_lock = SPIN_LOCK_INITIAL_VALUE;
+
+static enum handler_return irq_thread_hard(void *arg)
+{
+    struct irq_thread *it = (struct irq_thread *)arg;
+
+    it->irqs++;
+
+    if (it->hard && it->hard(it->arg) == IRQ_HANDLED)
+        return INT_NO_RESCHEDULE;
+
+    /* the source stays quiet until the thread has dealt with it */
+    if (it->flags & IRQ_THREAD_FLAG_ONESHOT)
+        mask_interrupt(it->vector);
+
+    it->wakeups++;
+    event_signal(&it->event, false);
+
+    return INT_RESCHEDULE;
+}
+
+static int irq_thread_entry(void *arg)
+{
+    struct irq_thread *it = (struct irq_thread *)arg;
+
+    for (;;) {
+        event_wait(&it->event);
+
+        LTRACEF("vector %u\n", it->vector);
+
+        it->runs++;
+        it->thread_fn(it->arg);
+
+        if (it->flags & IRQ_THREAD_FLAG_ONESHOT)
+            unmask_interrupt(it->vector);
+    }
+
+    return 0;
+}
+
+status_t register_threaded_int_handler(unsigned int vector, irq_hard_handler hard,
+                                       irq_thread_handler thread_fn, void *arg,
+                                       int priority, uint flags, const char *name)
+{
+    LTRACEF("vector %u, hard %p, thread_fn %p, priority %d, flags 0x%x\n",
+            vector, hard, thread_fn, priority, flags);
+
+    DEBUG_ASSERT(thread_fn);
+
+    struct irq_thread *it = calloc(1, sizeof(*it));
+    if (!it)
+        return ERR_NO_MEMORY;
+
+    it->vector = vector;
+    it->hard = hard;
+    it->thread_fn = thread_fn;
+    it->arg = arg;
+    it->flags = flags;
+    it->name = name;
+    event_init(&it->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    it->thread = thread_create(name, &irq_thread_entry, it, priority, DEFAULT_STACK_SIZE);
+    if (!it->thread) {
+        free(it);
+        return ERR_NO_MEMORY;
+    }
+    thread_detach_and_resume(it->thread);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&irq_thread_lock, state);
+    list_add_tail(&irq_thread_list, &it->node);
+    spin_unlock_irqrestore(&irq_thread_lock, state);
+
+    register_int_handler(vector, &irq_thread_hard, it);
+
+    return NO_ERROR;
+}
+
+#if WITH_LIB_CONSOLE
+
+static int cmd_irqthreads(int argc, const cmd_args *argv)
+{
+    printf("%6s %-20s %4s %10s %10s %10s\n", "vector", "name", "pri", "irqs", "wakeups", "runs");
+
+    /* entries are never removed, so the list can be walked without the lock */
+    struct irq_thread *it;
+    list_for_every_entry(&irq_thread_list, it, struct irq_thread, node) {
+        printf("%6u %-20s %4d %10u %10u %10u\n", it->vector, it->name,
+               it->thread->priority, it->irqs, it->wakeups, it->runs);
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("irqthreads", "list threaded interrupt handlers", &cmd_irqthreads)
+STATIC_COMMAND_END(irqthread);
+
+#endif
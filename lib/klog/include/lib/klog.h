@@ -33,6 +33,12 @@
 
 #define KLOG_CURRENT_BUFFER -1
 
+/*
+ * Each buffer is made of one sub-buffer per cpu. Writers append to the
+ * sub-buffer of the cpu they run on without taking any locks, readers see the
+ * sub-buffers of a buffer one after the other in cpu order.
+ */
+
 void klog_init(void);
 
 ssize_t klog_recover(void *ptr);
@@ -49,8 +55,10 @@ void klog_dump(int buffer);
  * Fill in an iovec that points to the requested buffer, -1 is current buffer.
  * The buffer may be in 2 pieces, due to the internal circular buffer.
  * Return is number of iovec runs.
+ * klog_get_buffer returns the first sub-buffer holding data.
  */
 int klog_get_buffer(int buffer, iovec_t *vec);
+int klog_get_cpu_buffer(int buffer, uint cpu, iovec_t *vec);
 
 /*
  * Read functions actively remove data from the klog on read
@@ -65,6 +73,32 @@ void klog_puts(const char *str);
 void klog_printf(const char *fmt, ...) __PRINTFLIKE(1, 2);
 void klog_vprintf(const char *fmt, va_list ap);
 
+/*
+ * Binary klog. Records hold the format string address and the raw arguments
+ * instead of formatted text, and are only formatted when the log is dumped.
+ * Each cpu appends to its own ring, oldest records are overwritten when a
+ * ring fills up. String arguments are copied into the record, truncated to
+ * KLOG_BIN_MAX_STRING bytes; %n arguments are dropped.
+ *
+ * Every record is a multiple of 8 bytes:
+ *   uint32 size (0 marks a wrap to the start of the ring), uint32 sequence,
+ *   uint64 current_time_hires(), uint64 format string address,
+ *   one uint64 per argument, strings as a uint64 length followed by the
+ *   padded bytes (length ~0 for a NULL string).
+ * A host tool can decode a raw dump of the rings against the kernel image.
+ */
+ssize_t klog_bin_recover(void *ptr);
+status_t klog_bin_create(void *ptr, size_t len);
+
+void klog_bin_printf(const char *fmt, ...) __PRINTFLIKE(1, 2);
+void klog_bin_vprintf(const char *fmt, va_list ap);
+
+/* format and dump all cpus' records to the console, merged by time */
+void klog_bin_dump(void);
+
+/* like klog_get_buffer, for the ring of one cpu */
+int klog_bin_get_buffer(uint cpu, iovec_t *vec);
+
 #else
 
 /* if klog is not present, stub out the input routines */
@@ -72,5 +106,7 @@ static inline void klog_putc(char c) {}
 static inline void klog_puts(const char *str) {}
 static inline void klog_printf(const char *fmt, ...) {}
 static inline void klog_vprintf(const char *fmt, va_list ap) {}
+static inline void klog_bin_printf(const char *fmt, ...) {}
+static inline void klog_bin_vprintf(const char *fmt, va_list ap) {}
 
 #endif
@@ -30,46 +30,33 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <platform.h>
-#include <lib/cksum.h>
+#include <lib/checksum.h>
 
-#define LOCAL_TRACE 0
-
-#ifndef MAX_KLOG_SIZE
-#define MAX_KLOG_SIZE (32*1024)
-#endif
-
-#define KLOG_BUFFER_HEADER_MAGIC 'KLGB'
+#include "klog_priv.h"
 
-struct klog_buffer_header {
-    uint32_t magic;
-    uint32_t header_crc32;
-    uint32_t log_count;
-    uint32_t current_log;
-    uint32_t total_size;
-};
-
-#define KLOG_HEADER_MAGIC 'KLOG'
-
-struct klog_header {
-    uint32_t magic;
-    uint32_t size;
-    uint32_t head;
-    uint32_t tail;
-    uint32_t data_checksum;
-    uint8_t  data[0];
-};
+#define LOCAL_TRACE 0
 
 /* current klog buffer */
 static struct klog_buffer_header *klog_buf;
 
-/* current klog */
-static struct klog_header *klog;
+/*
+ * Every buffer is split into one sub-buffer per cpu, which only that cpu
+ * appends to with interrupts disabled. Writers never share anything and take
+ * no locks; readers move the tail with a compare and swap so that losing a
+ * race against a writer that overwrote the oldest data is harmless.
+ */
+static struct klog_header *klog_cpu[SMP_MAX_CPUS];
+
+static uint klog_cpu_count(void)
+{
+    return klog_buf ? klog_buf->cpu_count : 0;
+}
 
 static struct klog_header *find_nth_log(uint log)
 {
     DEBUG_ASSERT(klog_buf);
     DEBUG_ASSERT(klog_buf->magic == KLOG_BUFFER_HEADER_MAGIC);
-    DEBUG_ASSERT(log < klog_buf->log_count);
+    DEBUG_ASSERT(log < klog_buf->log_count * klog_buf->cpu_count);
 
     struct klog_header *k = (struct klog_header *)(klog_buf + 1);
     while (log > 0) {
@@ -85,12 +72,20 @@ static struct klog_header *find_nth_log(uint log)
     return k;
 }
 
+static struct klog_header *find_cpu_log(int buffer, uint cpu)
+{
+    if (buffer < 0)
+        return klog_cpu[cpu];
+
+    return find_nth_log(buffer * klog_buf->cpu_count + cpu);
+}
+
 static uint32_t get_checksum_klog_buffer_header(const struct klog_buffer_header *kb)
 {
     DEBUG_ASSERT(kb);
     DEBUG_ASSERT(kb->magic == KLOG_BUFFER_HEADER_MAGIC);
 
-    return crc32(0, (const void *)(&kb->header_crc32 + 1), sizeof(*kb) - 8);
+    return checksum_crc32(0, (const void *)(&kb->header_crc32 + 1), sizeof(*kb) - 8);
 }
 
 static uint32_t get_checksum_klog_data(const struct klog_header *k)
@@ -137,8 +132,12 @@ status_t klog_create(void *_ptr, size_t len, uint count)
     if (count == 0)
         return ERR_INVALID_ARGS;
 
+    /* one sub-buffer per log per cpu */
+    uint cpus = SMP_MAX_CPUS;
+    uint logs = count * cpus;
+
     /* check that the size is big enough */
-    if (len < (sizeof(struct klog_buffer_header) + sizeof(struct klog_header) * count + 4 * count))
+    if (len < (sizeof(struct klog_buffer_header) + sizeof(struct klog_header) * logs + 4 * logs))
         return ERR_INVALID_ARGS;
 
     /* set up the buffer header */
@@ -147,30 +146,31 @@ status_t klog_create(void *_ptr, size_t len, uint count)
     klog_buf->log_count = count;
     klog_buf->current_log = 0;
     klog_buf->total_size = len;
+    klog_buf->cpu_count = cpus;
     checksum_klog_buffer_header(klog_buf);
     ptr += sizeof(struct klog_buffer_header);
 
     /* set up each buffer */
-    uint bufsize = len - sizeof(struct klog_buffer_header) - sizeof(struct klog_header) * count;
-    bufsize /= count;
+    uint bufsize = len - sizeof(struct klog_buffer_header) - sizeof(struct klog_header) * logs;
+    bufsize /= logs;
     bufsize = ROUNDDOWN(bufsize, 4);
-    while (count > 0) {
-        klog = (struct klog_header *)ptr;
-        klog->magic = KLOG_HEADER_MAGIC;
-        klog->size = bufsize;
-        klog->head = 0;
-        klog->tail = 0;
-        klog->data_checksum = 0;
-        memset(klog + 1, 0, bufsize);
-        checksum_klog_data(klog);
+    while (logs > 0) {
+        struct klog_header *k = (struct klog_header *)ptr;
+        k->magic = KLOG_HEADER_MAGIC;
+        k->size = bufsize;
+        k->head = 0;
+        k->tail = 0;
+        k->data_checksum = 0;
+        memset(k + 1, 0, bufsize);
+        checksum_klog_data(k);
         ptr += sizeof(struct klog_header) + bufsize;
-        count--;
+        logs--;
     }
 
     klog_set_current_buffer(0);
 
     DEBUG_ASSERT(klog_buf);
-    DEBUG_ASSERT(klog);
+    DEBUG_ASSERT(klog_cpu[0]);
 
     return NO_ERROR;
 }
@@ -196,10 +196,12 @@ ssize_t klog_recover(void *_ptr)
         return ERR_NOT_FOUND;
     if (kbuf->current_log >= kbuf->log_count)
         return ERR_NOT_FOUND;
+    if (kbuf->cpu_count == 0 || kbuf->cpu_count > SMP_MAX_CPUS)
+        return ERR_NOT_FOUND;
 
     /* walk the list of klogs, validating */
     ptr += sizeof(struct klog_buffer_header);
-    for (uint i = 0; i < kbuf->log_count; i++) {
+    for (uint i = 0; i < kbuf->log_count * kbuf->cpu_count; i++) {
         struct klog_header *k = (struct klog_header *)ptr;
 
         /* validate the individual klog */
@@ -230,8 +232,9 @@ ssize_t klog_recover(void *_ptr)
     klog_buf = kbuf;
     klog_set_current_buffer(klog_buf->current_log);
 
-    LTRACEF("found buffer at %p, current log %u (%p) head %u tail %u size %u\n",
-            klog_buf, klog_buf->current_log, klog, klog->head, klog->tail, klog->size);
+    LTRACEF("found buffer at %p, current log %u, %u cpus, head %u tail %u size %u\n",
+            klog_buf, klog_buf->current_log, klog_buf->cpu_count,
+            klog_cpu[0]->head, klog_cpu[0]->tail, klog_cpu[0]->size);
 
     return NO_ERROR;
 }
@@ -269,8 +272,9 @@ status_t klog_set_current_buffer(uint buffer)
     if (buffer >= klog_buf->log_count)
         return ERR_INVALID_ARGS;
 
-    /* find the nth buffer */
-    klog = find_nth_log(buffer);
+    /* find the sub-buffers of the nth buffer */
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+        klog_cpu[cpu] = (cpu < klog_buf->cpu_count) ? find_cpu_log(buffer, cpu) : NULL;
 
     /* update the klog buffer header */
     if (buffer != klog_buf->current_log) {
@@ -282,6 +286,51 @@ status_t klog_set_current_buffer(uint buffer)
 }
 
 #include <arch/ops.h>
+#include <arch/mp.h>
+
+/* number of bytes a sub-buffer holds for a given head and tail */
+static uint32_t klog_used(const struct klog_header *k, uint32_t head, uint32_t tail)
+{
+    return (head >= tail) ? head - tail : k->size - tail + head;
+}
+
+static int klog_get_vec(struct klog_header *k, uint32_t tail, iovec_t *vec)
+{
+    DEBUG_ASSERT(k);
+    DEBUG_ASSERT(k->magic == KLOG_HEADER_MAGIC);
+
+    uint32_t head = __atomic_load_n(&k->head, __ATOMIC_ACQUIRE);
+
+    vec[0].iov_base = &k->data[tail];
+    if (head == tail) {
+        return 0;
+    } else if (head > tail) {
+        /* single run of data, between tail and head */
+        vec[0].iov_len = head - tail;
+
+        return 1;
+    } else {
+        vec[0].iov_len = k->size - tail;
+
+        /* two segments */
+        vec[1].iov_base = &k->data[0];
+        vec[1].iov_len = head;
+
+        return 2;
+    }
+}
+
+/* reads drain the sub-buffers of a log in cpu order */
+static struct klog_header *find_read_log(int buffer)
+{
+    for (uint cpu = 0; cpu < klog_cpu_count(); cpu++) {
+        struct klog_header *k = find_cpu_log(buffer, cpu);
+        if (__atomic_load_n(&k->head, __ATOMIC_RELAXED) != __atomic_load_n(&k->tail, __ATOMIC_RELAXED))
+            return k;
+    }
+
+    return find_cpu_log(buffer, 0);
+}
 
 ssize_t klog_read(char *buf, size_t len, int buf_id)
 {
@@ -290,14 +339,19 @@ ssize_t klog_read(char *buf, size_t len, int buf_id)
     iovec_t vec[2];
     LTRACEF("read (len %zu, buf %u)\n", len, buf_id);
 
-    DEBUG_ASSERT(klog);
-    DEBUG_ASSERT(klog->magic == KLOG_HEADER_MAGIC);
+    if (!klog_buf)
+        return 0;
+    if (buf_id >= 0 && (uint)buf_id >= klog_buf->log_count)
+        return ERR_INVALID_ARGS;
+
+    struct klog_header *k = find_read_log(buf_id);
+    uint32_t tail = __atomic_load_n(&k->tail, __ATOMIC_ACQUIRE);
 
     /* If a klog wraps around at the end then it becomes two iovecs with
      * tail being the start of 1 and head being the end of 0. This means we
      * need to check where we are in the overall klog to properly determine
      * which iovec we want to read from */
-    int vec_cnt = klog_get_buffer(buf_id, vec);
+    int vec_cnt = klog_get_vec(k, tail, vec);
     if (vec_cnt < 1)
         return vec_cnt;
 
@@ -312,10 +366,12 @@ ssize_t klog_read(char *buf, size_t len, int buf_id)
         offset += tmp_len;
     }
 
-    /* Since iovecs are generated by get_buffer we only need to update the tail pointer */
-    klog->tail += offset;
-    if (klog->tail >= klog->size)
-        klog->tail -= klog->size;
+    /* Only the tail needs updating. If a writer overran it in the meantime it
+     * has already moved it past what we read, so leave it alone */
+    uint32_t newtail = tail + offset;
+    if (newtail >= k->size)
+        newtail -= k->size;
+    __atomic_compare_exchange_n(&k->tail, &tail, newtail, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
 
     return offset;
 }
@@ -336,56 +392,81 @@ char klog_getchar(void)
 /* Returns whether the currently selected klog contains data */
 bool klog_has_data(void)
 {
-    DEBUG_ASSERT(klog);
+    for (uint cpu = 0; cpu < klog_cpu_count(); cpu++) {
+        const struct klog_header *k = klog_cpu[cpu];
+        if (__atomic_load_n(&k->head, __ATOMIC_RELAXED) != __atomic_load_n(&k->tail, __ATOMIC_RELAXED))
+            return true;
+    }
 
-    return (klog->head != klog->tail);
+    return false;
 }
 
-static size_t klog_puts_len(const char *str, size_t len)
+/* append to a sub-buffer, called with interrupts disabled on the cpu owning it */
+static void klog_append(struct klog_header *k, const char *str, size_t len)
 {
-    LTRACEF("puts '%s'\n", str);
+    uint32_t size = k->size;
+    uint32_t head = k->head;
+
+    LTRACEF("before write head %u tail %u size %u\n", head, k->tail, size);
+
+    /* only the last size - 1 bytes can be kept */
+    if (len > size - 1) {
+        str += len - (size - 1);
+        len = size - 1;
+    }
 
-    DEBUG_ASSERT(klog);
-    DEBUG_ASSERT(klog->magic == KLOG_HEADER_MAGIC);
+    uint32_t old_head = head;
+    uint32_t written = len;
 
-    LTRACEF("before write head %u tail %u size %u\n", klog->head, klog->tail, klog->size);
+    /* the data checksum is a byte sum, fold in the delta of every byte replaced */
     uint32_t deltasum = 0;
-    size_t count = 0;
-    while (count < len && *str) {
-        /* compute the delta checksum */
-        deltasum += *str - klog->data[klog->head];
-
-        /* store the data */
-        klog->data[klog->head] = *str;
-
-        /* bump the head */
-        uint newhead = klog->head + 1;
-        if (newhead >= klog->size)
-            newhead -= klog->size;
-        DEBUG_ASSERT(newhead < klog->size);
-
-        /* bump the tail if the head collided with it */
-        if (klog->tail == newhead) {
-            uint newtail = klog->tail + 1;
-            if (newtail >= klog->size)
-                newtail -= klog->size;
-            DEBUG_ASSERT(newtail < klog->size);
-            klog->tail = newtail;
+    while (len > 0) {
+        size_t run = MIN(len, size - head);
+        const uint8_t *src = (const uint8_t *)str;
+        uint8_t *dst = &k->data[head];
+
+        for (size_t i = 0; i < run; i++) {
+            deltasum += src[i] - dst[i];
+            dst[i] = src[i];
         }
 
-        /* writeback the head */
-        klog->head = newhead;
+        str += run;
+        len -= run;
+        head += run;
+        if (head == size)
+            head = 0;
+    }
 
-        str++;
-        count++;
+    /* bump the tail past the new head if the oldest data was overwritten,
+     * racing only with readers moving it forward */
+    uint32_t newtail = (head + 1 == size) ? 0 : head + 1;
+    uint32_t tail = __atomic_load_n(&k->tail, __ATOMIC_RELAXED);
+    while (klog_used(k, old_head, tail) + written > size - 1) {
+        if (__atomic_compare_exchange_n(&k->tail, &tail, newtail, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
     }
-    LTRACEF("after write head %u tail %u\n", klog->head, klog->tail);
 
-    klog->data_checksum += deltasum;
+    __atomic_store_n(&k->head, head, __ATOMIC_RELEASE);
+    k->data_checksum += deltasum;
 
-    LTRACEF("kputs len %u\n", count);
+    LTRACEF("after write head %u tail %u\n", k->head, k->tail);
+}
 
-    return count;
+static size_t klog_puts_len(const char *str, size_t len)
+{
+    len = strnlen(str, len);
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    struct klog_header *k = klog_cpu[arch_curr_cpu_num()];
+    if (k)
+        klog_append(k, str, len);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    LTRACEF("kputs len %zu\n", len);
+
+    return len;
 }
 
 void klog_putchar(char c)
@@ -434,47 +515,44 @@ int klog_get_buffer(int buffer, iovec_t *vec)
     if (buffer >= 0 && (uint)buffer >= klog_buf->log_count)
         return ERR_INVALID_ARGS;
 
-    struct klog_header *k;
-    if (buffer < 0)
-        k = klog;
-    else
-        k = find_nth_log(buffer);
+    struct klog_header *k = find_read_log(buffer);
 
-    DEBUG_ASSERT(k);
-    DEBUG_ASSERT(k->magic == KLOG_HEADER_MAGIC);
+    return klog_get_vec(k, __atomic_load_n(&k->tail, __ATOMIC_ACQUIRE), vec);
+}
 
-    vec[0].iov_base = &k->data[k->tail];
-    if (k->head == k->tail) {
+int klog_get_cpu_buffer(int buffer, uint cpu, iovec_t *vec)
+{
+    if (!klog_buf)
         return 0;
-    } else if (k->head > k->tail) {
-        /* single run of data, between tail and head */
-        vec[0].iov_len = k->head - k->tail;
-
-        return 1;
-    } else {
-        vec[0].iov_len = k->size - k->tail;
+    if (!vec)
+        return ERR_INVALID_ARGS;
+    if (buffer >= 0 && (uint)buffer >= klog_buf->log_count)
+        return ERR_INVALID_ARGS;
+    if (cpu >= klog_buf->cpu_count)
+        return ERR_INVALID_ARGS;
 
-        /* two segments */
-        vec[1].iov_base = &k->data[0];
-        vec[1].iov_len = k->head;
+    struct klog_header *k = find_cpu_log(buffer, cpu);
 
-        return 2;
-    }
+    return klog_get_vec(k, __atomic_load_n(&k->tail, __ATOMIC_ACQUIRE), vec);
 }
 
 void klog_dump(int buffer)
 {
     iovec_t vec[2];
 
-    int err = klog_get_buffer(buffer, vec);
-    if (err <= 0)
-        return;
-
-    for (uint i = 0; i < vec[0].iov_len; i++)
-        putchar(*((const char *)vec[0].iov_base + i));
-    if (err > 1) {
-        for (uint i = 0; i < vec[1].iov_len; i++)
-            putchar(*((const char *)vec[1].iov_base + i));
+    for (uint cpu = 0; cpu < klog_cpu_count(); cpu++) {
+        int err = klog_get_cpu_buffer(buffer, cpu, vec);
+        if (err <= 0)
+            continue;
+
+        if (klog_cpu_count() > 1)
+            printf("--- cpu %u ---\n", cpu);
+        for (uint i = 0; i < vec[0].iov_len; i++)
+            putchar(*((const char *)vec[0].iov_base + i));
+        if (err > 1) {
+            for (uint i = 0; i < vec[1].iov_len; i++)
+                putchar(*((const char *)vec[1].iov_base + i));
+        }
     }
 }
 
@@ -511,6 +589,10 @@ usage:
         printf("usage: %s printftest\n", argv[0].str);
         printf("usage: %s dump [buffer num]\n", argv[0].str);
         printf("usage: %s vec [buffer num]\n", argv[0].str);
+        printf("usage: %s bincreate <size>\n", argv[0].str);
+        printf("usage: %s binprintftest\n", argv[0].str);
+        printf("usage: %s bindump\n", argv[0].str);
+        printf("usage: %s binvec <cpu>\n", argv[0].str);
         return -1;
     }
 
@@ -542,7 +624,8 @@ usage:
     } else if (!strcmp(argv[1].str, "getbufnum")) {
         printf("%d current buffer\n", klog_current_buffer());
     } else if (!strcmp(argv[1].str, "getbufptr")) {
-        printf("ptr %p\n", klog);
+        for (uint cpu = 0; cpu < klog_cpu_count(); cpu++)
+            printf("cpu %u ptr %p\n", cpu, klog_cpu[cpu]);
     } else if (!strcmp(argv[1].str, "setbufnum")) {
         if (argc < 3) goto notenoughargs;
 
@@ -600,6 +683,36 @@ usage:
         printf("klog_get_buffer returns %d\n", err);
         printf("vec %d: base %p, len %zu\n", 0, vec[0].iov_base, vec[0].iov_len);
         printf("vec %d: base %p, len %zu\n", 1, vec[1].iov_base, vec[1].iov_len);
+    } else if (!strcmp(argv[1].str, "bincreate")) {
+        if (argc < 3) goto notenoughargs;
+
+        uint size = argv[2].u;
+
+        void *ptr = malloc(size);
+        if (!ptr) {
+            printf("error allocating memory for klog\n");
+            return -1;
+        }
+        err = klog_bin_create(ptr, size);
+        printf("klog_bin_create returns %d\n", err);
+        if (err < 0)
+            free(ptr);
+    } else if (!strcmp(argv[1].str, "binprintftest")) {
+        klog_bin_printf("a plain string\n");
+        klog_bin_printf("numbers: %d %d %d %u %llx %zu\n", 1, -2, 3, 99, 0x123456789abcULL, sizeof(void *));
+        klog_bin_printf("strings: '%s' '%s' 100%%\n", "a little string", "");
+        klog_bin_printf("pointer %p char %c\n", &cmd_klog, 'x');
+    } else if (!strcmp(argv[1].str, "bindump")) {
+        klog_bin_dump();
+    } else if (!strcmp(argv[1].str, "binvec")) {
+        if (argc < 3) goto notenoughargs;
+
+        iovec_t vec[2];
+        memset(vec, 0x99, sizeof(vec));
+        int err = klog_bin_get_buffer(argv[2].u, vec);
+        printf("klog_bin_get_buffer returns %d\n", err);
+        printf("vec %d: base %p, len %zu\n", 0, vec[0].iov_base, vec[0].iov_len);
+        printf("vec %d: base %p, len %zu\n", 1, vec[1].iov_base, vec[1].iov_len);
     } else {
         printf("ERROR unknown command\n");
         goto usage;
@@ -0,0 +1,680 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/klog.h>
+
+#include <err.h>
+#include <debug.h>
+#include <assert.h>
+#include <trace.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <platform.h>
+#include <arch/ops.h>
+#include <arch/mp.h>
+#include <kernel/spinlock.h>
+#include <lib/checksum.h>
+
+#include "klog_priv.h"
+
+#define LOCAL_TRACE 0
+
+#ifndef MAX_KLOG_BIN_SIZE
+#define MAX_KLOG_BIN_SIZE (64*1024)
+#endif
+
+/* largest record, including the header, as built on the stack by the writer */
+#ifndef KLOG_BIN_MAX_RECORD
+#define KLOG_BIN_MAX_RECORD 256
+#endif
+
+#ifndef KLOG_BIN_MAX_STRING
+#define KLOG_BIN_MAX_STRING 64
+#endif
+
+#define KLOG_BIN_BUFFER_HEADER_MAGIC 'KLGS'
+
+struct klog_bin_buffer_header {
+    uint32_t magic;
+    uint32_t header_crc32;
+    uint32_t log_count;
+    uint32_t total_size;
+    uint64_t image_tag;
+};
+
+struct klog_bin_record {
+    uint32_t size;
+    uint32_t seq;
+    uint64_t time;
+    uint64_t fmt;
+    uint64_t args[0];
+};
+
+#define KLOG_BIN_NULL_STRING (~0ULL)
+
+/* argument classes of a conversion, the writer and reader must agree on these */
+enum {
+    ARG_END,        /* no more conversions */
+    ARG_NONE,       /* %% and unknown conversions, no argument */
+    ARG_SKIP,       /* argument is consumed but not recorded */
+    ARG_INT,
+    ARG_LONG,
+    ARG_LONGLONG,
+    ARG_SIZE,
+    ARG_INTMAX,
+    ARG_PTRDIFF,
+    ARG_PTR,
+    ARG_STRING,
+#if FLOAT_PRINTF
+    ARG_DOUBLE,
+#endif
+};
+
+static struct klog_bin_buffer_header *klog_bin;
+static struct klog_header *klog_bin_log[SMP_MAX_CPUS];
+static spin_lock_t klog_bin_lock[SMP_MAX_CPUS];
+static uint32_t klog_bin_seq[SMP_MAX_CPUS];
+
+/* a recovered log written by another kernel image is dumped raw and not appended to */
+static bool klog_bin_foreign;
+
+/* identifies the image the format string addresses belong to */
+static uint64_t klog_bin_image_tag(void)
+{
+    return (uintptr_t)&klog_bin_vprintf;
+}
+
+static uint32_t get_checksum_klog_bin_header(const struct klog_bin_buffer_header *kb)
+{
+    return checksum_crc32(0, (const void *)(&kb->header_crc32 + 1), sizeof(*kb) - 8);
+}
+
+/*
+ * Find the next printf conversion in fmt, matching lib/libc's printf engine.
+ * Returns its argument class, start and end are set around the conversion spec.
+ */
+static int next_conversion(const char *fmt, const char **start, const char **end)
+{
+    fmt = strchr(fmt, '%');
+    if (!fmt)
+        return ARG_END;
+
+    const char *p = fmt + 1;
+    uint longs = 0;
+    bool half = false;
+    char size = 0;
+    for (;; p++) {
+        switch (*p) {
+            case 0:
+                return ARG_END;
+            case '0'...'9':
+            case '.':
+            case '-':
+            case '+':
+            case ' ':
+            case '#':
+                continue;
+            case 'l':
+                longs++;
+                continue;
+            case 'h':
+                half = true;
+                continue;
+            case 'z':
+            case 'j':
+            case 't':
+                size = *p;
+                continue;
+        }
+        break;
+    }
+
+    *start = fmt;
+    *end = p + 1;
+
+    switch (*p) {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'x':
+        case 'X':
+            if (longs > 1)
+                return ARG_LONGLONG;
+            if (longs)
+                return ARG_LONG;
+            if (half)
+                return ARG_INT;
+            if (size == 'z')
+                return ARG_SIZE;
+            if (size == 'j')
+                return ARG_INTMAX;
+            if (size == 't')
+                return ARG_PTRDIFF;
+            return ARG_INT;
+        case 'c':
+            return ARG_INT;
+        case 'p':
+            return ARG_PTR;
+        case 's':
+            return ARG_STRING;
+        case 'n':
+            return ARG_SKIP;
+#if FLOAT_PRINTF
+        case 'f':
+        case 'F':
+        case 'a':
+        case 'A':
+            return ARG_DOUBLE;
+#endif
+        default:
+            return ARG_NONE;
+    }
+}
+
+static uint32_t record_size(const struct klog_header *k, uint32_t pos)
+{
+    uint32_t size;
+
+    /* records are only 4 byte aligned in the ring */
+    memcpy(&size, &k->data[pos], sizeof(size));
+    return size;
+}
+
+/* drop the oldest record */
+static void pop_record_locked(struct klog_header *k)
+{
+    uint32_t size = record_size(k, k->tail);
+
+    if (size == 0) {
+        /* wrap marker */
+        k->tail = 0;
+        return;
+    }
+    if (size < sizeof(struct klog_bin_record) || size > k->size - k->tail) {
+        /* garbage, throw the whole ring away */
+        k->tail = k->head;
+        return;
+    }
+
+    k->tail += size;
+    if (k->tail == k->size)
+        k->tail = 0;
+}
+
+/* make sure no record starts in (start, end], the ring is assumed non empty */
+static void clear_range_locked(struct klog_header *k, uint32_t start, uint32_t end)
+{
+    while (k->tail != k->head && k->tail > start && k->tail <= end)
+        pop_record_locked(k);
+}
+
+/* rings are always bigger than the largest record, so the head never catches up with the tail */
+static void write_record_locked(struct klog_header *k, const void *rec, uint32_t len)
+{
+    if (k->size - k->head < len) {
+        /* doesn't fit before the end, drop what is left there and wrap */
+        uint32_t head = k->head;
+        while (k->tail != k->head && k->tail > head)
+            pop_record_locked(k);
+        if (k->tail == head) {
+            k->head = k->tail = 0;
+        } else {
+            /* tail is now below the old head, clear the start for the new record */
+            while (k->tail != k->head && k->tail <= len)
+                pop_record_locked(k);
+            uint32_t marker = 0;
+            memcpy(&k->data[head], &marker, sizeof(marker));
+            if (k->tail == head)
+                k->tail = 0;
+            k->head = 0;
+        }
+    }
+
+    uint32_t end = k->head + len;
+    if (k->tail != k->head) {
+        clear_range_locked(k, k->head, end);
+        if (end == k->size) {
+            /* the head is about to wrap to 0, it must not land on the tail */
+            while (k->tail != k->head && k->tail == 0)
+                pop_record_locked(k);
+        }
+    }
+
+    memcpy(&k->data[k->head], rec, len);
+    k->head = (end == k->size) ? 0 : end;
+}
+
+void klog_bin_vprintf(const char *fmt, va_list ap)
+{
+    struct klog_bin_buffer_header *kb = __atomic_load_n(&klog_bin, __ATOMIC_ACQUIRE);
+    if (!kb || klog_bin_foreign)
+        return;
+
+    uint64_t buf[KLOG_BIN_MAX_RECORD / 8];
+    struct klog_bin_record *rec = (struct klog_bin_record *)buf;
+    const uint max = countof(buf);
+    uint slot = sizeof(*rec) / 8;
+
+    /* copy the arguments out, as far as they fit */
+    const char *p = fmt;
+    const char *start, *end;
+    int class;
+    while ((class = next_conversion(p, &start, &end)) != ARG_END && slot < max) {
+        uint64_t val;
+
+        p = end;
+        switch (class) {
+            case ARG_NONE:
+                continue;
+            case ARG_SKIP:
+                va_arg(ap, void *);
+                continue;
+            case ARG_INT:
+                val = va_arg(ap, int);
+                break;
+            case ARG_LONG:
+                val = va_arg(ap, long);
+                break;
+            case ARG_LONGLONG:
+                val = va_arg(ap, long long);
+                break;
+            case ARG_SIZE:
+                val = va_arg(ap, size_t);
+                break;
+            case ARG_INTMAX:
+                val = va_arg(ap, intmax_t);
+                break;
+            case ARG_PTRDIFF:
+                val = va_arg(ap, ptrdiff_t);
+                break;
+            case ARG_PTR:
+                val = (uintptr_t)va_arg(ap, void *);
+                break;
+#if FLOAT_PRINTF
+            case ARG_DOUBLE: {
+                double d = va_arg(ap, double);
+                memcpy(&val, &d, sizeof(val));
+                break;
+            }
+#endif
+            case ARG_STRING: {
+                const char *s = va_arg(ap, const char *);
+                if (!s) {
+                    val = KLOG_BIN_NULL_STRING;
+                    break;
+                }
+                size_t len = strnlen(s, KLOG_BIN_MAX_STRING);
+                uint words = ROUNDUP(len, 8) / 8;
+                if (slot + 1 + words > max) {
+                    slot = max;
+                    continue;
+                }
+                buf[slot++] = len;
+                if (words)
+                    buf[slot + words - 1] = 0;
+                memcpy(&buf[slot], s, len);
+                slot += words;
+                continue;
+            }
+            default:
+                continue;
+        }
+        buf[slot++] = val;
+    }
+
+    rec->size = slot * 8;
+    rec->time = current_time_hires();
+    rec->fmt = (uintptr_t)fmt;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    uint cpu = arch_curr_cpu_num();
+    if (cpu < kb->log_count) {
+        spin_lock(&klog_bin_lock[cpu]);
+        rec->seq = klog_bin_seq[cpu]++;
+        write_record_locked(klog_bin_log[cpu], rec, rec->size);
+        spin_unlock(&klog_bin_lock[cpu]);
+    }
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+void klog_bin_printf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    klog_bin_vprintf(fmt, ap);
+    va_end(ap);
+}
+
+static void attach(struct klog_bin_buffer_header *kb)
+{
+    uint8_t *ptr = (uint8_t *)(kb + 1);
+
+    for (uint i = 0; i < kb->log_count; i++) {
+        klog_bin_log[i] = (struct klog_header *)ptr;
+        klog_bin_seq[i] = 0;
+        spin_lock_init(&klog_bin_lock[i]);
+        ptr += sizeof(struct klog_header) + klog_bin_log[i]->size;
+    }
+
+    klog_bin_foreign = (kb->image_tag != klog_bin_image_tag());
+    __atomic_store_n(&klog_bin, kb, __ATOMIC_RELEASE);
+}
+
+status_t klog_bin_create(void *_ptr, size_t len)
+{
+    uint8_t *ptr = _ptr;
+    uint count = SMP_MAX_CPUS;
+    LTRACEF("ptr %p len %zu\n", ptr, len);
+
+    if (!ptr)
+        return ERR_INVALID_ARGS;
+    if (len > MAX_KLOG_BIN_SIZE)
+        return ERR_INVALID_ARGS;
+
+    /* every ring must hold at least one full sized record */
+    size_t overhead = sizeof(struct klog_bin_buffer_header) + sizeof(struct klog_header) * count;
+    if (len < overhead + (KLOG_BIN_MAX_RECORD + 8) * count)
+        return ERR_INVALID_ARGS;
+
+    /* stop the writers while the rings are laid out */
+    __atomic_store_n(&klog_bin, NULL, __ATOMIC_SEQ_CST);
+
+    struct klog_bin_buffer_header *kb = (struct klog_bin_buffer_header *)ptr;
+    kb->magic = KLOG_BIN_BUFFER_HEADER_MAGIC;
+    kb->log_count = count;
+    kb->total_size = len;
+    kb->image_tag = klog_bin_image_tag();
+    kb->header_crc32 = get_checksum_klog_bin_header(kb);
+    ptr += sizeof(*kb);
+
+    uint bufsize = ROUNDDOWN((len - overhead) / count, 8);
+    for (uint i = 0; i < count; i++) {
+        struct klog_header *k = (struct klog_header *)ptr;
+        k->magic = KLOG_HEADER_MAGIC;
+        k->size = bufsize;
+        k->head = 0;
+        k->tail = 0;
+        k->data_checksum = 0;
+        ptr += sizeof(struct klog_header) + bufsize;
+    }
+
+    attach(kb);
+
+    return NO_ERROR;
+}
+
+ssize_t klog_bin_recover(void *_ptr)
+{
+    uint8_t *ptr = _ptr;
+    LTRACEF("ptr %p\n", ptr);
+
+    if (!ptr)
+        return ERR_INVALID_ARGS;
+
+    struct klog_bin_buffer_header *kb = (struct klog_bin_buffer_header *)ptr;
+    if (kb->magic != KLOG_BIN_BUFFER_HEADER_MAGIC)
+        return ERR_NOT_FOUND;
+    if (get_checksum_klog_bin_header(kb) != kb->header_crc32)
+        return ERR_NOT_FOUND;
+
+    /* some sanity checks */
+    if (kb->total_size > MAX_KLOG_BIN_SIZE)
+        return ERR_NOT_FOUND;
+    if (kb->log_count == 0 || kb->log_count > SMP_MAX_CPUS)
+        return ERR_NOT_FOUND;
+
+    /* walk the rings, validating */
+    const uint8_t *limit = ptr + kb->total_size;
+    ptr += sizeof(*kb);
+    for (uint i = 0; i < kb->log_count; i++) {
+        const struct klog_header *k = (const struct klog_header *)ptr;
+
+        if (ptr + sizeof(*k) > limit)
+            return ERR_NOT_FOUND;
+        if (k->magic != KLOG_HEADER_MAGIC)
+            return ERR_NOT_FOUND;
+        if (k->size < KLOG_BIN_MAX_RECORD + 8 || (k->size & 7))
+            return ERR_NOT_FOUND;
+        if (k->size > (size_t)(limit - ptr - sizeof(*k)))
+            return ERR_NOT_FOUND;
+        if (k->head >= k->size || (k->head & 7))
+            return ERR_NOT_FOUND;
+        if (k->tail >= k->size || (k->tail & 7))
+            return ERR_NOT_FOUND;
+
+        ptr += sizeof(*k) + k->size;
+    }
+
+    __atomic_store_n(&klog_bin, NULL, __ATOMIC_SEQ_CST);
+    attach(kb);
+
+    LTRACEF("found %u rings at %p%s\n", kb->log_count, kb,
+            klog_bin_foreign ? ", written by another image" : "");
+
+    return NO_ERROR;
+}
+
+int klog_bin_get_buffer(uint cpu, iovec_t *vec)
+{
+    if (!klog_bin)
+        return 0;
+    if (!vec)
+        return ERR_INVALID_ARGS;
+    if (cpu >= klog_bin->log_count)
+        return ERR_INVALID_ARGS;
+
+    const struct klog_header *k = klog_bin_log[cpu];
+
+    vec[0].iov_base = (void *)&k->data[k->tail];
+    if (k->head == k->tail) {
+        return 0;
+    } else if (k->head > k->tail) {
+        vec[0].iov_len = k->head - k->tail;
+
+        return 1;
+    } else {
+        /* the first run may end in a wrap marker */
+        vec[0].iov_len = k->size - k->tail;
+
+        vec[1].iov_base = (void *)&k->data[0];
+        vec[1].iov_len = k->head;
+
+        return 2;
+    }
+}
+
+/* copy one ring out as a contiguous run of records, skipping the wrap marker */
+static size_t snapshot_ring(uint cpu, uint8_t *buf)
+{
+    const struct klog_header *k = klog_bin_log[cpu];
+    size_t len = 0;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&klog_bin_lock[cpu], state);
+    uint32_t pos = k->tail;
+    while (pos != k->head) {
+        uint32_t size = record_size(k, pos);
+        if (size == 0) {
+            if (pos == 0)
+                break;
+            pos = 0;
+            continue;
+        }
+        if (size < sizeof(struct klog_bin_record) || size > k->size - pos || len + size > k->size)
+            break;
+
+        memcpy(buf + len, &k->data[pos], size);
+        len += size;
+        pos += size;
+        if (pos == k->size)
+            pos = 0;
+    }
+    spin_unlock_irqrestore(&klog_bin_lock[cpu], state);
+
+    return len;
+}
+
+static void print_literal(const char *str, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        putchar(str[i]);
+}
+
+static void print_record(uint cpu, const struct klog_bin_record *rec)
+{
+    const uint64_t *arg = rec->args;
+    const uint64_t *arg_end = (const uint64_t *)((const uint8_t *)rec + rec->size);
+
+    printf("[%5llu.%06llu] %u: ", rec->time / 1000000, rec->time % 1000000, cpu);
+
+    if (klog_bin_foreign) {
+        /* the format string isn't ours, leave the decoding to a host tool */
+        printf("fmt %#llx", rec->fmt);
+        while (arg < arg_end)
+            printf(" %#llx", *arg++);
+        putchar('\n');
+        return;
+    }
+
+    const char *p = (const char *)(uintptr_t)rec->fmt;
+    const char *start, *end;
+    int class;
+    while ((class = next_conversion(p, &start, &end)) != ARG_END) {
+        char spec[32];
+
+        print_literal(p, start - p);
+        p = end;
+
+        size_t spec_len = end - start;
+        if (spec_len >= sizeof(spec)) {
+            printf("<bad format>\n");
+            return;
+        }
+        memcpy(spec, start, spec_len);
+        spec[spec_len] = 0;
+
+        if (class == ARG_NONE) {
+            printf(spec);
+            continue;
+        }
+        if (class == ARG_SKIP)
+            continue;
+        if (arg == arg_end) {
+            printf("<truncated>\n");
+            return;
+        }
+
+        uint64_t val = *arg++;
+        switch (class) {
+            case ARG_INT:
+                printf(spec, (int)val);
+                break;
+            case ARG_LONG:
+                printf(spec, (long)val);
+                break;
+            case ARG_LONGLONG:
+                printf(spec, (long long)val);
+                break;
+            case ARG_SIZE:
+                printf(spec, (size_t)val);
+                break;
+            case ARG_INTMAX:
+                printf(spec, (intmax_t)val);
+                break;
+            case ARG_PTRDIFF:
+                printf(spec, (ptrdiff_t)val);
+                break;
+            case ARG_PTR:
+                printf(spec, (void *)(uintptr_t)val);
+                break;
+#if FLOAT_PRINTF
+            case ARG_DOUBLE: {
+                double d;
+                memcpy(&d, &val, sizeof(d));
+                printf(spec, d);
+                break;
+            }
+#endif
+            case ARG_STRING: {
+                if (val == KLOG_BIN_NULL_STRING) {
+                    printf(spec, (const char *)NULL);
+                    break;
+                }
+                char str[KLOG_BIN_MAX_STRING + 1];
+                uint words = ROUNDUP(val, 8) / 8;
+                if (val > KLOG_BIN_MAX_STRING || words > (size_t)(arg_end - arg)) {
+                    printf("<truncated>\n");
+                    return;
+                }
+                memcpy(str, arg, val);
+                str[val] = 0;
+                arg += words;
+                printf(spec, str);
+                break;
+            }
+        }
+    }
+    print_literal(p, strlen(p));
+}
+
+void klog_bin_dump(void)
+{
+    uint8_t *snapshot[SMP_MAX_CPUS];
+    size_t len[SMP_MAX_CPUS];
+    size_t pos[SMP_MAX_CPUS];
+
+    if (!klog_bin)
+        return;
+
+    uint count = klog_bin->log_count;
+    for (uint i = 0; i < count; i++) {
+        snapshot[i] = malloc(klog_bin_log[i]->size);
+        len[i] = snapshot[i] ? snapshot_ring(i, snapshot[i]) : 0;
+        pos[i] = 0;
+    }
+
+    /* merge the cpus by timestamp */
+    for (;;) {
+        const struct klog_bin_record *next = NULL;
+        uint next_cpu = 0;
+        for (uint i = 0; i < count; i++) {
+            if (pos[i] >= len[i])
+                continue;
+            const struct klog_bin_record *rec = (const void *)(snapshot[i] + pos[i]);
+            if (!next || rec->time < next->time) {
+                next = rec;
+                next_cpu = i;
+            }
+        }
+        if (!next)
+            break;
+
+        print_record(next_cpu, next);
+        pos[next_cpu] += next->size;
+    }
+
+    for (uint i = 0; i < count; i++)
+        free(snapshot[i]);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <compiler.h>
+
+/*
+ * in-memory layout shared by the text and binary klogs. The text klog has
+ * log_count * cpu_count klog_headers following the buffer header, the
+ * sub-buffers of each log grouped together.
+ */
+
+#ifndef MAX_KLOG_SIZE
+#define MAX_KLOG_SIZE (32*1024)
+#endif
+
+#define KLOG_BUFFER_HEADER_MAGIC 'KLGB'
+
+struct klog_buffer_header {
+    uint32_t magic;
+    uint32_t header_crc32;
+    uint32_t log_count;
+    uint32_t current_log;
+    uint32_t total_size;
+    uint32_t cpu_count;     /* sub-buffers per log */
+};
+
+#define KLOG_HEADER_MAGIC 'KLOG'
+
+struct klog_header {
+    uint32_t magic;
+    uint32_t size;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t data_checksum;
+    uint8_t  data[0];
+};
@@ -3,9 +3,10 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_DEPS := \
-    lib/cksum
+    lib/checksum
 
 MODULE_SRCS := \
 	$(LOCAL_DIR)/klog.c \
+	$(LOCAL_DIR)/klog_bin.c \
 
 include make/module.mk
@@ -36,6 +36,11 @@
 #define FLOAT_PRINTF 1
 #endif
 
+/* size of the staging buffer _printf_engine collects output in before calling out */
+#ifndef PRINTF_OUTPUT_BUFFER_LEN
+#define PRINTF_OUTPUT_BUFFER_LEN 64
+#endif
+
 int sprintf(char *str, const char *fmt, ...)
 {
     int err;
@@ -120,6 +125,33 @@ int vsnprintf(char *str, size_t len, const char *fmt, va_list ap)
 #define LEADZEROFLAG   0x00001000
 #define BLANKPOSFLAG   0x00002000
 
+/* "00" through "99", to convert two decimal digits per division */
+static const char decimal_pairs[200] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* write n in decimal backwards from end, returns the first digit */
+static char *uint32_to_decimal(char *end, uint32_t n)
+{
+    while (n >= 100) {
+        uint i = (n % 100) * 2;
+        n /= 100;
+        *--end = decimal_pairs[i + 1];
+        *--end = decimal_pairs[i];
+    }
+    if (n >= 10) {
+        *--end = decimal_pairs[n * 2 + 1];
+        *--end = decimal_pairs[n * 2];
+    } else {
+        *--end = n + '0';
+    }
+
+    return end;
+}
+
 __NO_INLINE static char *longlong_to_string(char *buf, unsigned long long n, size_t len, uint flag, char *signchar)
 {
     size_t pos = len;
@@ -132,15 +164,20 @@ __NO_INLINE static char *longlong_to_string(char *buf, unsigned long long n, siz
 
     buf[--pos] = 0;
 
-    /* only do the math if the number is >= 10 */
-    while (n >= 10) {
-        int digit = n % 10;
-
-        n /= 10;
-
-        buf[--pos] = digit + '0';
+    /* peel off 9 digits at a time with 64 bit math, which is a library call on
+     * 32 bit cpus, so the per digit work can be done in 32 bits */
+    char *s = &buf[pos];
+    while (n > UINT32_MAX) {
+        uint32_t low = n % 1000000000;
+        n /= 1000000000;
+
+        char *chunk_end = s;
+        s = uint32_to_decimal(s, low);
+        while (chunk_end - s < 9)
+            *--s = '0';
     }
-    buf[--pos] = n + '0';
+    s = uint32_to_decimal(s, (uint32_t)n);
+    pos = s - buf;
 
     if (negative)
         *signchar = '-';
@@ -418,8 +455,41 @@ int _printf_engine(_printf_engine_output_func out, void *state, const char *fmt,
     size_t chars_written = 0;
     char num_buffer[32];
 
-#define OUTPUT_STRING(str, len) do { err = out(str, len, state); if (err < 0) { goto exit; } else { chars_written += err; } } while(0)
-#define OUTPUT_CHAR(c) do { char __temp[1] = { c }; OUTPUT_STRING(__temp, 1); } while (0)
+    /* output is collected here and handed to out in chunks */
+    char out_buffer[PRINTF_OUTPUT_BUFFER_LEN];
+    size_t out_pos = 0;
+
+#define FLUSH_OUTPUT() do { \
+        if (out_pos > 0) { \
+            err = out(out_buffer, out_pos, state); \
+            out_pos = 0; \
+            if (err < 0) \
+                goto exit; \
+        } \
+    } while (0)
+#define OUTPUT_STRING(str, len) do { \
+        size_t __len = (len); \
+        if (out_pos + __len > sizeof(out_buffer)) { \
+            FLUSH_OUTPUT(); \
+            if (__len >= sizeof(out_buffer)) { \
+                /* too big to bother staging */ \
+                err = out(str, __len, state); \
+                if (err < 0) \
+                    goto exit; \
+                chars_written += __len; \
+                break; \
+            } \
+        } \
+        memcpy(&out_buffer[out_pos], str, __len); \
+        out_pos += __len; \
+        chars_written += __len; \
+    } while (0)
+#define OUTPUT_CHAR(c) do { \
+        if (out_pos == sizeof(out_buffer)) \
+            FLUSH_OUTPUT(); \
+        out_buffer[out_pos++] = (c); \
+        chars_written++; \
+    } while (0)
 
     for (;;) {
         /* reset the format state */
@@ -598,7 +668,7 @@ _output_string:
         if (flags & LEFTFORMATFLAG) {
             /* left justify the text */
             OUTPUT_STRING(s, string_len);
-            uint written = err;
+            uint written = string_len;
 
             /* pad to the right (if necessary) */
             for (; format_num > written; format_num--)
@@ -629,6 +699,9 @@ _output_string:
         continue;
     }
 
+    FLUSH_OUTPUT();
+
+#undef FLUSH_OUTPUT
 #undef OUTPUT_STRING
 #undef OUTPUT_CHAR
 
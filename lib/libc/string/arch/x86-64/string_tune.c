@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Picks the strategy the assembly memcpy and memset use for large buffers,
+ * based on the cpu they end up running on. Until this runs the thresholds
+ * are at their maximum and everything goes through the plain register
+ * loops, which work on any x86-64.
+ */
+#include <arch/x86.h>
+#include <lk/init.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <trace.h>
+
+#define LOCAL_TRACE 0
+
+/* without FSRM rep movsb has a startup cost only worth paying on large copies */
+#ifndef X86_STRING_ERMS_THRESHOLD
+#define X86_STRING_ERMS_THRESHOLD 2048
+#endif
+
+/* sizes at or above these use rep movsb/stosb, and non-temporal stores */
+size_t x86_string_rep_threshold = SIZE_MAX;
+size_t x86_string_nt_threshold = SIZE_MAX;
+
+/* size of the largest cache, from the deterministic cache parameters leaf
+ * where there is one, from AMD's extended leaf otherwise */
+static size_t last_level_cache_size(uint32_t max_leaf)
+{
+    uint32_t a, b, c, d;
+    size_t size = 0;
+
+    if (max_leaf >= 4) {
+        for (uint32_t i = 0; i < 16; i++) {
+            x86_cpuid(4, i, &a, &b, &c, &d);
+            if ((a & 0x1f) == 0)
+                break;
+            size_t ways = (b >> 22) + 1;
+            size_t partitions = ((b >> 12) & 0x3ff) + 1;
+            size_t line = (b & 0xfff) + 1;
+            size_t sets = (size_t)c + 1;
+            size = MAX(size, ways * partitions * line * sets);
+        }
+    }
+
+    if (size == 0) {
+        x86_cpuid(0x80000000, 0, &a, &b, &c, &d);
+        if (a >= 0x80000006) {
+            x86_cpuid(0x80000006, 0, &a, &b, &c, &d);
+            size = MAX((size_t)(c >> 16) * 1024, (size_t)(d >> 18) * 512 * 1024);
+        }
+    }
+
+    return size;
+}
+
+static void x86_string_tune(uint level)
+{
+    uint32_t a, b, c, d;
+
+    x86_cpuid(0, 0, &a, &b, &c, &d);
+    uint32_t max_leaf = a;
+
+    if (max_leaf >= 7) {
+        if (check_fsrm_avail())
+            x86_string_rep_threshold = 0;
+        else if (check_erms_avail())
+            x86_string_rep_threshold = X86_STRING_ERMS_THRESHOLD;
+    }
+
+    /* a copy bigger than the cache would only push everything else out of it */
+    size_t llc = last_level_cache_size(max_leaf);
+    if (llc)
+        x86_string_nt_threshold = llc;
+
+    LTRACEF("rep threshold %#zx, non-temporal threshold %#zx\n",
+            x86_string_rep_threshold, x86_string_nt_threshold);
+}
+
+LK_INIT_HOOK(x86_string, x86_string_tune, LK_INIT_LEVEL_ARCH_EARLY);
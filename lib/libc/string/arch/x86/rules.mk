@@ -1,5 +1,10 @@
 LOCAL_DIR := $(GET_LOCAL_DIR)
 
+ifeq ($(SUBARCH),x86-64)
+# 64 bit builds share ARCH with 32 bit ones, their routines live next door
+include $(LIBC_STRING_C_DIR)/arch/x86-64/rules.mk
+else
+
 ASM_STRING_OPS := #bcopy bzero memcpy memmove memset
 
 MODULE_SRCS += \
@@ -9,3 +14,4 @@ MODULE_SRCS += \
 # filter out the C implementation
 C_STRING_OPS := $(filter-out $(ASM_STRING_OPS),$(C_STRING_OPS))
 
+endif
@@ -1,5 +1,5 @@
 /*
-** Copyright 2001, Manuel J. Petit. All rights reserved.
+** Copyright 2001, Travis Geiselbrecht. All rights reserved.
 ** Distributed under the terms of the NewOS License.
 */
 /*
@@ -26,20 +26,33 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "string_word.h"
 
 void *
 memchr(void const *buf, int c, size_t len)
 {
-    size_t i;
     unsigned char const *b= buf;
     unsigned char        x= (c&0xff);
 
-    for (i= 0; i< len; i++) {
-        if (b[i]== x) {
-            return (void *)(b+i);
+    for (; len && !word_aligned(b); b++, len--) {
+        if (*b== x) {
+            return (void *)b;
+        }
+    }
+
+    /* x ^ pattern has a zero byte wherever the word holds x */
+    strword pattern = WORD_ONES * x;
+    for (; len >= WORD_SIZE; b += WORD_SIZE, len -= WORD_SIZE) {
+        if (WORD_HAS_ZERO(*(const strword *)b ^ pattern)) {
+            break;
+        }
+    }
+
+    for (; len; b++, len--) {
+        if (*b== x) {
+            return (void *)b;
         }
     }
 
     return NULL;
 }
-
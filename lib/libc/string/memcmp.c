@@ -26,15 +26,28 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "string_word.h"
 
 int
 memcmp(const void *cs, const void *ct, size_t count)
 {
-    const unsigned char *su1, *su2;
-    signed char res = 0;
+    const unsigned char *su1 = cs, *su2 = ct;
 
-    for (su1 = cs, su2 = ct; 0 < count; ++su1, ++su2, count--)
-        if ((res = *su1 - *su2) != 0)
-            break;
-    return res;
+    /* when both can be aligned together, skip over equal words and leave
+     * the first differing one to the byte loop */
+    if (word_aligned((const void *)((uintptr_t)su1 ^ (uintptr_t)su2))) {
+        for (; count && !word_aligned(su1); ++su1, ++su2, count--) {
+            if (*su1 != *su2)
+                return *su1 - *su2;
+        }
+        for (; count >= WORD_SIZE; su1 += WORD_SIZE, su2 += WORD_SIZE, count -= WORD_SIZE) {
+            if (*(const strword *)su1 != *(const strword *)su2)
+                break;
+        }
+    }
+
+    for (; 0 < count; ++su1, ++su2, count--)
+        if (*su1 != *su2)
+            return *su1 - *su2;
+    return 0;
 }
@@ -26,16 +26,34 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "string_word.h"
 
 int
 strcmp(char const *cs, char const *ct)
 {
-    signed char __res;
+    const unsigned char *s1 = (const unsigned char *)cs;
+    const unsigned char *s2 = (const unsigned char *)ct;
 
-    while (1) {
-        if ((__res = *cs - *ct++) != 0 || !*cs++)
-            break;
+    /* with both strings aligned alike, skip over equal words holding no
+     * terminator and finish in the byte loop */
+    if (word_aligned((const void *)((uintptr_t)s1 ^ (uintptr_t)s2))) {
+        for (; !word_aligned(s1); s1++, s2++) {
+            if (*s1 != *s2 || !*s1)
+                return *s1 - *s2;
+        }
+        for (;;) {
+            strword w = *(const strword *)s1;
+            if (w != *(const strword *)s2 || WORD_HAS_ZERO(w))
+                break;
+            s1 += WORD_SIZE;
+            s2 += WORD_SIZE;
+        }
     }
 
-    return __res;
+    while (*s1 == *s2 && *s1) {
+        s1++;
+        s2++;
+    }
+
+    return *s1 - *s2;
 }
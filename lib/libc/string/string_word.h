@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+/*
+ * Helpers for the string routines that scan a word at a time. Words are
+ * only ever read at aligned addresses, so a scan that runs past the end of
+ * a string never touches a page the string doesn't.
+ */
+#include <compiler.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef unsigned long __MAY_ALIAS strword;
+
+#define WORD_SIZE sizeof(strword)
+#define WORD_MASK (WORD_SIZE - 1)
+
+#define WORD_ONES ((strword)-1 / 0xff)
+#define WORD_HIGHS (WORD_ONES * 0x80)
+
+/* non zero if any byte of x is zero */
+#define WORD_HAS_ZERO(x) (((x) - WORD_ONES) & ~(x) & WORD_HIGHS)
+
+static inline bool word_aligned(const void *p)
+{
+    return ((uintptr_t)p & WORD_MASK) == 0;
+}
@@ -26,16 +26,24 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "string_word.h"
 
 size_t
 strlen(char const *s)
 {
-    size_t i;
+    const char *p = s;
 
-    i= 0;
-    while (s[i]) {
-        i+= 1;
+    for (; !word_aligned(p); p++) {
+        if (!*p)
+            return p - s;
     }
 
-    return i;
+    const strword *w = (const strword *)p;
+    while (!WORD_HAS_ZERO(*w))
+        w++;
+
+    for (p = (const char *)w; *p; p++)
+        ;
+
+    return p - s;
 }
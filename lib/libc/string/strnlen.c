@@ -26,13 +26,24 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "string_word.h"
 
 size_t
 strnlen(char const *s, size_t count)
 {
-    const char *sc;
+    const char *sc = s;
 
-    for (sc = s; count-- && *sc != '\0'; ++sc)
+    for (; count && !word_aligned(sc); ++sc, count--) {
+        if (*sc == '\0')
+            return sc - s;
+    }
+
+    for (; count >= WORD_SIZE; sc += WORD_SIZE, count -= WORD_SIZE) {
+        if (WORD_HAS_ZERO(*(const strword *)sc))
+            break;
+    }
+
+    for (; count-- && *sc != '\0'; ++sc)
         ;
     return sc - s;
 }
@@ -23,12 +23,15 @@
 
 #include "minip-internal.h"
 
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
 #include <list.h>
 #include <string.h>
-#include <malloc.h>
 #include <stdio.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
+#include <platform.h>
 #include <trace.h>
 
 typedef union {
@@ -37,34 +40,134 @@ typedef union {
 } ipv4_t;
 
 #define LOCAL_TRACE 0
-static struct list_node arp_list;
+
+/* the cache is a hash table of ARP_CACHE_SETS sets of ARP_CACHE_WAYS entries.
+ * lookups don't take arp_mutex: every entry has a sequence count that is odd
+ * while an update is being written, and readers retry if it moved under them.
+ * updates are serialized by arp_mutex. */
+#ifndef ARP_CACHE_SETS
+#define ARP_CACHE_SETS 16 // power of two
+#endif
+#define ARP_CACHE_WAYS 4
+
+/* entries not heard from for ARP_ENTRY_TIMEOUT are dropped. looking up one
+ * older than ARP_REFRESH_AGE sends a new request, while the old answer keeps
+ * being used */
+#define ARP_ENTRY_TIMEOUT (5 * 60 * 1000) // ms
+#define ARP_REFRESH_AGE (4 * 60 * 1000) // ms
+#define ARP_UPDATE_INTERVAL 1000 // ms, how stale the age of an entry can get
+
 typedef struct {
-    struct list_node node;
-    uint32_t addr;
+    uint32_t seq;
+    uint32_t addr; // 0 if the entry is free
     uint8_t mac[6];
+    lk_time_t updated;
+    lk_time_t refresh_sent; // only rate limits refreshes, not covered by seq
 } arp_entry_t;
 
+static arp_entry_t arp_cache[ARP_CACHE_SETS][ARP_CACHE_WAYS];
+
+static struct {
+    volatile int hits;
+    volatile int misses;
+    volatile int expired;
+    volatile int refreshes;
+    volatile int evictions;
+} arp_stats;
+
+/* outgoing packets wait here while their destination is being resolved, at
+ * most ARP_PENDING_PACKETS each for up to ARP_PENDING_HOSTS addresses */
+#ifndef ARP_PENDING_HOSTS
+#define ARP_PENDING_HOSTS 8
+#endif
+#ifndef ARP_PENDING_PACKETS
+#define ARP_PENDING_PACKETS 8
+#endif
+
+/* requests are sent this many times, this far apart, before giving up */
+#define ARP_RETRIES 3
+#define ARP_RETRY_INTERVAL 100 // ms
+
+/* how often arp_get_dest_mac looks at the cache while waiting */
+#define ARP_POLL_INTERVAL 10 // ms
+
+typedef struct {
+    uint32_t addr; // 0 if the slot is free
+    minip_netif_t *netif; // where the request went out and the packets go
+    uint retries;
+    lk_time_t deadline;
+    uint count;
+    struct list_node packets;
+    net_timer_t timer;
+} arp_pending_t;
+
 static mutex_t arp_mutex = MUTEX_INITIAL_VALUE(arp_mutex);
+static arp_pending_t arp_pending[ARP_PENDING_HOSTS];
+
+static void arp_pending_timeout(void *arg);
 
 void arp_cache_init(void)
 {
-    list_initialize(&arp_list);
+    for (uint i = 0; i < ARP_PENDING_HOSTS; i++)
+        list_initialize(&arp_pending[i].packets);
 }
 
-static inline void mru_update(struct list_node *entry)
+static arp_pending_t *find_pending_locked(uint32_t addr)
 {
-    if (arp_list.next == entry)
-        return;
+    for (uint i = 0; i < ARP_PENDING_HOSTS; i++) {
+        if (arp_pending[i].addr == addr)
+            return &arp_pending[i];
+    }
 
-    list_delete(entry);
-    list_add_head(&arp_list, entry);
+    return NULL;
+}
+
+/* free up the slot, handing its packets over to list */
+static void release_pending_locked(arp_pending_t *pend, struct list_node *list)
+{
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&pend->packets, pktbuf_t, list)))
+        list_add_tail(list, &p->list);
+
+    pend->addr = 0;
+    pend->count = 0;
+    net_timer_cancel(&pend->timer);
+}
+
+static inline arp_entry_t *arp_cache_set(uint32_t addr)
+{
+    return arp_cache[((addr * 0x9e3779b1u) >> 16) & (ARP_CACHE_SETS - 1)];
+}
+
+/* consistent copy of an entry, without taking arp_mutex */
+static void arp_entry_read(const arp_entry_t *e, uint32_t *addr, uint8_t mac[6], lk_time_t *updated)
+{
+    uint32_t seq;
+
+    do {
+        seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        *addr = e->addr;
+        memcpy(mac, e->mac, 6);
+        *updated = e->updated;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || __atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq);
+}
+
+static void arp_entry_write_locked(arp_entry_t *e, uint32_t addr, const uint8_t mac[6], lk_time_t now)
+{
+    DEBUG_ASSERT(is_mutex_held(&arp_mutex));
+
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->addr = addr;
+    memcpy(e->mac, mac, 6);
+    e->updated = now;
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
 }
 
 void arp_cache_update(uint32_t addr, const uint8_t mac[6])
 {
-    arp_entry_t *arp;
     ipv4_t ip;
-    bool found = false;
 
     ip.u = addr;
 
@@ -73,77 +176,214 @@ void arp_cache_update(uint32_t addr, const uint8_t mac[6])
         return;
     }
 
-    /* If the entry is in the cache update the address and move
-     * it to head */
+    struct list_node ready = LIST_INITIAL_VALUE(ready);
+    lk_time_t now = current_time();
+    arp_entry_t *set = arp_cache_set(addr);
+
     mutex_acquire(&arp_mutex);
-    list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-        if (arp->addr == addr) {
-            arp->addr = addr;
-            mru_update(&arp->node);
-            found = true;
+
+    /* refresh the entry for the address if there is one, otherwise take a free
+     * or expired entry, or failing that the one not heard from the longest */
+    arp_entry_t *e = NULL;
+    arp_entry_t *victim = &set[0];
+    for (uint i = 0; i < ARP_CACHE_WAYS; i++) {
+        if (set[i].addr == addr) {
+            e = &set[i];
             break;
         }
+        if (victim->addr != 0 && (set[i].addr == 0 || TIME_LT(set[i].updated, victim->updated)))
+            victim = &set[i];
     }
 
-    if (!found) {
+    if (!e) {
         LTRACEF("Adding %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x to cache\n",
                 ip.b[0], ip.b[1], ip.b[2], ip.b[3],
                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-        arp = malloc(sizeof(arp_entry_t));
-        if (arp == NULL) {
-            goto err;
+        if (victim->addr != 0 && now - victim->updated < ARP_ENTRY_TIMEOUT)
+            atomic_add(&arp_stats.evictions, 1);
+        e = victim;
+    }
+
+    /* every received packet lands here, so skip rewriting an entry that was
+     * refreshed recently and hasn't changed, to keep readers from retrying */
+    if (e->addr != addr || memcmp(e->mac, mac, 6) || now - e->updated >= ARP_UPDATE_INTERVAL)
+        arp_entry_write_locked(e, addr, mac, now);
+
+    /* anything waiting on this address can go now */
+    minip_netif_t *netif = NULL;
+    arp_pending_t *pend = find_pending_locked(addr);
+    if (pend) {
+        netif = pend->netif;
+        release_pending_locked(pend, &ready);
+    }
+
+    mutex_release(&arp_mutex);
+
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&ready, pktbuf_t, list))) {
+        minip_build_mac_hdr(netif, (struct eth_hdr *)p->data, mac, ETH_TYPE_IPV4);
+        minip_netif_tx(netif, p);
+    }
+}
+
+status_t arp_queue_packet(minip_netif_t *netif, uint32_t addr, pktbuf_t *p)
+{
+    bool send_request = false;
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&arp_mutex);
+
+    /* the reply may have come in since the caller looked */
+    uint8_t mac[6];
+    if (arp_cache_lookup(netif, addr, mac)) {
+        mutex_release(&arp_mutex);
+        minip_build_mac_hdr(netif, (struct eth_hdr *)p->data, mac, ETH_TYPE_IPV4);
+        minip_netif_tx(netif, p);
+        return NO_ERROR;
+    }
+
+    arp_pending_t *pend = find_pending_locked(addr);
+    if (!pend) {
+        pend = find_pending_locked(0);
+        if (!pend) {
+            LTRACEF("too many unresolved addresses\n");
+            err = -EHOSTUNREACH;
+            goto out;
         }
 
-        arp->addr = addr;
-        memcpy(arp->mac, mac, sizeof(arp->mac));
-        list_add_head(&arp_list, &arp->node);
+        pend->addr = addr;
+        pend->netif = netif;
+        pend->retries = 0;
+        pend->deadline = current_time() + ARP_RETRY_INTERVAL;
+        net_timer_set(&pend->timer, &arp_pending_timeout, pend, ARP_RETRY_INTERVAL);
+        send_request = true;
+    }
+
+    if (pend->count == ARP_PENDING_PACKETS) {
+        LTRACEF("pending queue full for 0x%x\n", addr);
+        err = ERR_NO_MEMORY;
+        goto out;
     }
 
-err:
+    list_add_tail(&pend->packets, &p->list);
+    pend->count++;
+    p = NULL;
+
+out:
     mutex_release(&arp_mutex);
-    return;
+
+    if (p)
+        pktbuf_free(p, true);
+    if (send_request)
+        arp_send_request(netif, addr);
+
+    return err;
 }
 
-/* Looks up and returns a MAC address based on the provided ip addr */
-uint8_t *arp_cache_lookup(uint32_t addr)
+static void arp_pending_timeout(void *arg)
 {
-    arp_entry_t *arp = NULL;
-    uint8_t *ret = NULL;
+    arp_pending_t *pend = arg;
+    struct list_node dropped = LIST_INITIAL_VALUE(dropped);
+    minip_netif_t *netif;
+    uint32_t addr;
 
-    /* If the entry is in the cache update the address and move
-     * it to head */
     mutex_acquire(&arp_mutex);
-    list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-        if (arp->addr == addr) {
-            mru_update(&arp->node);
-            ret = arp->mac;
+
+    /* resolved, or the slot was taken over by another address since this fired */
+    addr = pend->addr;
+    netif = pend->netif;
+    if (addr == 0 || TIME_LT(current_time(), pend->deadline)) {
+        mutex_release(&arp_mutex);
+        return;
+    }
+
+    if (++pend->retries < ARP_RETRIES) {
+        pend->deadline = current_time() + ARP_RETRY_INTERVAL;
+        net_timer_set(&pend->timer, &arp_pending_timeout, pend, ARP_RETRY_INTERVAL);
+        mutex_release(&arp_mutex);
+
+        arp_send_request(netif, addr);
+        return;
+    }
+
+    LTRACEF("giving up on 0x%x, dropping %u packets\n", addr, pend->count);
+    release_pending_locked(pend, &dropped);
+
+    mutex_release(&arp_mutex);
+
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&dropped, pktbuf_t, list)))
+        pktbuf_free(p, true);
+}
+
+/* Looks up the MAC address for the provided ip addr, without blocking */
+bool arp_cache_lookup(minip_netif_t *netif, uint32_t addr, uint8_t mac[6])
+{
+    arp_entry_t *set = arp_cache_set(addr);
+    lk_time_t now = current_time();
+
+    for (uint i = 0; i < ARP_CACHE_WAYS; i++) {
+        uint32_t e_addr;
+        lk_time_t updated;
+
+        arp_entry_read(&set[i], &e_addr, mac, &updated);
+        if (e_addr != addr)
+            continue;
+
+        lk_time_t age = now - updated;
+        if (age >= ARP_ENTRY_TIMEOUT) {
+            atomic_add(&arp_stats.expired, 1);
             break;
         }
+
+        /* getting old, ask again, but not every time it is used */
+        if (age >= ARP_REFRESH_AGE && now - set[i].refresh_sent >= ARP_RETRY_INTERVAL) {
+            set[i].refresh_sent = now;
+            atomic_add(&arp_stats.refreshes, 1);
+            arp_send_request(netif, addr);
+        }
+
+        atomic_add(&arp_stats.hits, 1);
+        return true;
     }
-    mutex_release(&arp_mutex);
 
-    return ret;
+    atomic_add(&arp_stats.misses, 1);
+    return false;
 }
 
 void arp_cache_dump(void)
 {
-    int i = 0;
-    arp_entry_t *arp;
+    int count = 0;
+    lk_time_t now = current_time();
 
-    if (!list_is_empty(&arp_list)) {
-        list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
+    for (uint s = 0; s < ARP_CACHE_SETS; s++) {
+        for (uint w = 0; w < ARP_CACHE_WAYS; w++) {
             ipv4_t ip;
-            ip.u = arp->addr;
-            printf("%2d: %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x\n",
-                   i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3],
-                   arp->mac[0], arp->mac[1], arp->mac[2], arp->mac[3], arp->mac[4], arp->mac[5]);
+            uint8_t mac[6];
+            lk_time_t updated;
+
+            arp_entry_read(&arp_cache[s][w], &ip.u, mac, &updated);
+            if (ip.u == 0)
+                continue;
+
+            lk_time_t age = now - updated;
+            printf("%2d: %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x, age %u ms%s\n",
+                   count++, ip.b[0], ip.b[1], ip.b[2], ip.b[3],
+                   mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+                   (uint)age, (age >= ARP_ENTRY_TIMEOUT) ? " (expired)" : "");
         }
-    } else {
+    }
+
+    if (count == 0) {
         printf("The arp table is empty\n");
     }
+
+    printf("%d hits, %d misses, %d expired, %d refreshes, %d evictions\n",
+           arp_stats.hits, arp_stats.misses, arp_stats.expired, arp_stats.refreshes,
+           arp_stats.evictions);
 }
 
-int arp_send_request(uint32_t addr)
+int arp_send_request(minip_netif_t *netif, uint32_t addr)
 {
     pktbuf_t *p;
     struct eth_hdr *eth;
@@ -155,50 +395,39 @@ int arp_send_request(uint32_t addr)
 
     eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
     arp = pktbuf_append(p, sizeof(struct arp_pkt));
-    minip_build_mac_hdr(eth, bcast_mac, ETH_TYPE_ARP);
+    minip_build_mac_hdr(netif, eth, bcast_mac, ETH_TYPE_ARP);
 
     arp->htype = htons(0x0001);
     arp->ptype = htons(0x0800);
     arp->hlen = 6;
     arp->plen = 4;
     arp->oper = htons(ARP_OPER_REQUEST);
-    arp->spa = minip_get_ipaddr();
+    arp->spa = netif->ip;
     arp->tpa = addr;
-    minip_get_macaddr(arp->sha);
+    mac_addr_copy(arp->sha, netif->mac);
     mac_addr_copy(arp->tha, bcast_mac);
 
-    minip_tx_handler(p);
+    minip_netif_tx(netif, p);
     return 0;
 }
 
-static void handle_arp_timeout_cb(void *arg)
+/* resolve host, waiting for the reply. for callers that need the address up
+ * front, the packet path uses arp_queue_packet instead */
+status_t arp_get_dest_mac(minip_netif_t *netif, uint32_t host, uint8_t mac[6])
 {
-    *(bool *)arg = true;
-}
+    if (host == IPV4_BCAST || host == netif->broadcast) {
+        mac_addr_copy(mac, bcast_mac);
+        return NO_ERROR;
+    }
 
-const uint8_t *arp_get_dest_mac(uint32_t host)
-{
-    const uint8_t *dst_mac = NULL;
-    bool arp_timeout = false;
-    net_timer_t arp_timeout_timer;
-
-    if (host == IPV4_BCAST) {
-        return bcast_mac;
-    }
-
-    dst_mac = arp_cache_lookup(host);
-    if (dst_mac == NULL) {
-        arp_send_request(host);
-        memset(&arp_timeout_timer, 0, sizeof(arp_timeout_timer));
-        net_timer_set(&arp_timeout_timer, handle_arp_timeout_cb, &arp_timeout, 100);
-        while (!arp_timeout) {
-            dst_mac = arp_cache_lookup(host);
-            if (dst_mac) {
-                net_timer_cancel(&arp_timeout_timer);
-                break;
-            }
+    bool found = arp_cache_lookup(netif, host, mac);
+    for (uint i = 0; !found && i < ARP_RETRIES; i++) {
+        arp_send_request(netif, host);
+        for (lk_time_t t = 0; !found && t < ARP_RETRY_INTERVAL; t += ARP_POLL_INTERVAL) {
+            thread_sleep(ARP_POLL_INTERVAL);
+            found = arp_cache_lookup(netif, host, mac);
         }
     }
 
-    return dst_mac;
+    return found ? NO_ERROR : -EHOSTUNREACH;
 }
@@ -23,44 +23,130 @@
 
 #include "minip-internal.h"
 
-/* XXX alternate implementation, merge */
+#include <string.h>
+
+/*
+ * The ones complement sum doesn't care how wide the words being added are, as
+ * long as carries out of the top get added back in at the bottom, so the data
+ * is summed 64 bits at a time and folded down to 16 at the end. It also works
+ * out the same in either byte order, so the words are loaded natively.
+ */
+
+/* add with end around carry */
+static inline uint64_t add64(uint64_t sum, uint64_t val)
+{
+    sum += val;
+    return sum + (sum < val);
+}
+
+static inline uint64_t load64(const uint8_t *buf)
+{
+    uint64_t val;
+    memcpy(&val, buf, sizeof(val));
+    return val;
+}
+
+static inline uint16_t fold64(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+#if ARCH_X86_64
+/* sum blocks of 32 bytes, keeping the carry in the flags between words */
+static uint64_t sum_blocks(uint64_t sum, const uint8_t *buf, size_t blocks)
+{
+    __asm__(
+        "clc\n"
+        "1:\n"
+        "adcq 0(%[buf]), %[sum]\n"
+        "adcq 8(%[buf]), %[sum]\n"
+        "adcq 16(%[buf]), %[sum]\n"
+        "adcq 24(%[buf]), %[sum]\n"
+        "leaq 32(%[buf]), %[buf]\n"
+        "decq %[blocks]\n" // leaves the carry flag alone
+        "jnz 1b\n"
+        "adcq $0, %[sum]\n"
+        : [sum] "+r" (sum), [buf] "+r" (buf), [blocks] "+r" (blocks)
+        :
+        : "cc", "memory");
+
+    return sum;
+}
+#else
+static uint64_t sum_blocks(uint64_t sum, const uint8_t *buf, size_t blocks)
+{
+    while (blocks--) {
+        sum = add64(sum, load64(buf));
+        sum = add64(sum, load64(buf + 8));
+        sum = add64(sum, load64(buf + 16));
+        sum = add64(sum, load64(buf + 24));
+        buf += 32;
+    }
+
+    return sum;
+}
+#endif
+
 uint16_t ones_sum16(uint32_t sum, const void *_buf, int len)
 {
-    const uint16_t *buf = _buf;
+    const uint8_t *buf = _buf;
+    uint64_t total = sum;
 
-    while (len >= 2) {
-        sum += *buf++;
-        if (sum & 0x80000000)
-            sum = (sum & 0xffff) + (sum >> 16);
-        len -= 2;
+    if (len >= 32) {
+        total = sum_blocks(total, buf, len / 32);
+        buf += len & ~31;
+        len &= 31;
     }
 
-    if (len) {
-        uint16_t temp = htons((*(uint8_t *)buf) << 8);
-        sum += temp;
+    for (; len >= 8; len -= 8, buf += 8)
+        total = add64(total, load64(buf));
+
+    for (; len >= 2; len -= 2, buf += 2) {
+        uint16_t val;
+        memcpy(&val, buf, sizeof(val));
+        total += val;
     }
 
-    while (sum >> 16)
-        sum = (sum & 0xffff) + (sum >> 16);
+    if (len)
+        total += htons(*buf << 8);
 
-    return sum;
+    return fold64(total);
 }
 
-uint16_t rfc1701_chksum(const uint8_t *buf, size_t len)
+uint16_t ones_sum16_copy(uint32_t sum, void *_dst, const void *_src, int len)
 {
-    uint32_t total = 0;
-    uint16_t chksum = 0;
-    const uint16_t *p = (const uint16_t *) buf;
+    uint8_t *dst = _dst;
+    const uint8_t *src = _src;
+    uint64_t total = sum;
+
+    for (; len >= 8; len -= 8, src += 8, dst += 8) {
+        uint64_t val = load64(src);
+        memcpy(dst, &val, sizeof(val));
+        total = add64(total, val);
+    }
 
-    // Length is in bytes
-    for (size_t i = 0; i < len / 2; i++ ) {
-        total += p[i];
+    for (; len >= 2; len -= 2, src += 2, dst += 2) {
+        uint16_t val;
+        memcpy(&val, src, sizeof(val));
+        memcpy(dst, &val, sizeof(val));
+        total += val;
     }
 
-    chksum = (total & 0xFFFF) + (total >> 16);
-    chksum = ~chksum;
+    if (len) {
+        *dst = *src;
+        total += htons(*src << 8);
+    }
 
-    return chksum;
+    return fold64(total);
+}
+
+uint16_t rfc1701_chksum(const uint8_t *buf, size_t len)
+{
+    return ~ones_sum16(0, buf, len & ~1);
 }
 
 #if MINIP_USE_UDP_CHECKSUM
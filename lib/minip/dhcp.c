@@ -265,7 +265,7 @@ done:
     } else if (cfgstate == 1) {
         if (op == OP_DHCPACK) {
             printip("dhcp: ack:", msg->yiaddr);
-            minip_set_ipaddr(msg->yiaddr);
+            minip_netif_set_addr(minip_netif_default(), msg->yiaddr, netmask, gateway);
             configured = 1;
         }
     }
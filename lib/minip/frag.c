@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * IPv4 fragmentation and reassembly.
+ *
+ * Outgoing packets bigger than the mtu are copied out into fragments of their
+ * own, while incoming fragments are copied into a per datagram buffer, since
+ * the driver takes its rx buffers back as soon as we return. A bitmap of the
+ * 8 byte blocks that have arrived takes care of duplicates and overlaps. A
+ * datagram that doesn't complete within IPV4_REASM_TIMEOUT is dropped.
+ */
+#include "minip-internal.h"
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/mutex.h>
+#include <lib/pktbuf.h>
+#include <platform.h>
+
+#define LOCAL_TRACE 0
+
+/* datagrams being put back together at once */
+#ifndef IPV4_REASM_SLOTS
+#define IPV4_REASM_SLOTS 4
+#endif
+
+/* largest datagram payload that is reassembled, a multiple of 8 */
+#ifndef IPV4_REASM_MAX_SIZE
+#define IPV4_REASM_MAX_SIZE 16384
+#endif
+
+#ifndef IPV4_REASM_TIMEOUT
+#define IPV4_REASM_TIMEOUT 5000
+#endif
+
+#define REASM_BLOCKS (IPV4_REASM_MAX_SIZE / 8)
+
+STATIC_ASSERT((IPV4_REASM_MAX_SIZE % 8) == 0);
+
+typedef struct ipv4_reasm {
+    uint8_t *buf;           // NULL if the slot is free
+    uint32_t src_addr;
+    uint32_t dst_addr;
+    uint16_t id;
+    uint8_t proto;
+    size_t total_len;       // 0 until the last fragment shows up
+    uint blocks_received;
+    lk_time_t deadline;
+    net_timer_t timer;
+    uint32_t blocks[REASM_BLOCKS / 32 + 1];
+} ipv4_reasm_t;
+
+static ipv4_reasm_t reasm_slots[IPV4_REASM_SLOTS];
+static mutex_t reasm_lock = MUTEX_INITIAL_VALUE(reasm_lock);
+static uint16_t ipv4_next_id;
+
+static struct {
+    uint reassembled;
+    uint timeouts;
+    uint dropped;
+} reasm_stats;
+
+static void reasm_release_locked(ipv4_reasm_t *r)
+{
+    free(r->buf);
+    r->buf = NULL;
+}
+
+static void reasm_timeout(void *arg)
+{
+    ipv4_reasm_t *r = arg;
+
+    mutex_acquire(&reasm_lock);
+    /* the slot may have completed and been reused since the timer went off */
+    if (r->buf && TIME_GTE(current_time(), r->deadline)) {
+        LTRACEF("dropping incomplete datagram id 0x%hx\n", ntohs(r->id));
+        reasm_release_locked(r);
+        reasm_stats.timeouts++;
+    }
+    mutex_release(&reasm_lock);
+}
+
+static ipv4_reasm_t *reasm_find_locked(const struct ipv4_hdr *ip)
+{
+    ipv4_reasm_t *free_slot = NULL;
+
+    for (uint i = 0; i < IPV4_REASM_SLOTS; i++) {
+        ipv4_reasm_t *r = &reasm_slots[i];
+        if (!r->buf) {
+            if (!free_slot)
+                free_slot = r;
+            continue;
+        }
+        if (r->id == ip->id && r->src_addr == ip->src_addr &&
+                r->dst_addr == ip->dst_addr && r->proto == ip->proto)
+            return r;
+    }
+
+    if (!free_slot)
+        return NULL;
+
+    free_slot->buf = malloc(IPV4_REASM_MAX_SIZE);
+    if (!free_slot->buf)
+        return NULL;
+
+    free_slot->src_addr = ip->src_addr;
+    free_slot->dst_addr = ip->dst_addr;
+    free_slot->id = ip->id;
+    free_slot->proto = ip->proto;
+    free_slot->total_len = 0;
+    free_slot->blocks_received = 0;
+    memset(free_slot->blocks, 0, sizeof(free_slot->blocks));
+    free_slot->deadline = current_time() + IPV4_REASM_TIMEOUT;
+    net_timer_set(&free_slot->timer, &reasm_timeout, free_slot, IPV4_REASM_TIMEOUT);
+
+    return free_slot;
+}
+
+static void reasm_buf_free(void *buf, void *arg)
+{
+    free(buf);
+}
+
+pktbuf_t *ipv4_reassemble(const pktbuf_t *p, const struct ipv4_hdr *ip)
+{
+    uint16_t frag = ntohs(ip->flags_frags);
+    size_t offset = (size_t)(frag & IPV4_FRAG_OFFSET_MASK) * 8;
+    size_t len = p->dlen;
+    bool last = !(frag & IPV4_FLAG_MF);
+
+    /* every fragment but the last carries a multiple of 8 bytes */
+    if (len == 0 || (!last && (len % 8) != 0) || offset + len > IPV4_REASM_MAX_SIZE) {
+        LTRACEF("REJECT: bad fragment offset %zu len %zu\n", offset, len);
+        reasm_stats.dropped++;
+        return NULL;
+    }
+
+    pktbuf_t *whole = NULL;
+
+    mutex_acquire(&reasm_lock);
+
+    ipv4_reasm_t *r = reasm_find_locked(ip);
+    if (!r) {
+        LTRACEF("REJECT: no room to reassemble id 0x%hx\n", ntohs(ip->id));
+        reasm_stats.dropped++;
+        goto out;
+    }
+
+    if (last) {
+        if (r->total_len != 0 && r->total_len != offset + len)
+            goto drop;
+        r->total_len = offset + len;
+    } else if (r->total_len != 0 && offset + len > r->total_len) {
+        goto drop;
+    }
+
+    memcpy(r->buf + offset, p->data, len);
+    for (uint b = offset / 8; b < ROUNDUP(offset + len, 8) / 8; b++) {
+        uint32_t bit = 1u << (b % 32);
+        if (!(r->blocks[b / 32] & bit)) {
+            r->blocks[b / 32] |= bit;
+            r->blocks_received++;
+        }
+    }
+
+    if (r->total_len == 0 || r->blocks_received != ROUNDUP(r->total_len, 8) / 8)
+        goto out;
+
+    /* all there, hand the buffer over to a pktbuf */
+    whole = pktbuf_alloc_empty();
+    if (!whole)
+        goto drop;
+
+    pktbuf_add_buffer(whole, r->buf, IPV4_REASM_MAX_SIZE, 0, 0, &reasm_buf_free, NULL);
+    whole->dlen = r->total_len;
+    r->buf = NULL;
+    net_timer_cancel(&r->timer);
+    reasm_stats.reassembled++;
+    goto out;
+
+drop:
+    LTRACEF("REJECT: inconsistent fragments for id 0x%hx\n", ntohs(ip->id));
+    net_timer_cancel(&r->timer);
+    reasm_release_locked(r);
+    reasm_stats.dropped++;
+out:
+    mutex_release(&reasm_lock);
+
+    return whole;
+}
+
+status_t ipv4_send_fragments(const minip_route_t *route, pktbuf_t *p, uint32_t dest_addr, uint8_t proto)
+{
+    size_t total = pktbuf_total_len(p);
+    size_t max = minip_ipv4_max_payload(route->netif) & ~7;
+    status_t err = NO_ERROR;
+
+    if (total > 0xffff - sizeof(struct ipv4_hdr)) {
+        pktbuf_free(p, true);
+        return ERR_TOO_BIG;
+    }
+
+    uint16_t id = __atomic_fetch_add(&ipv4_next_id, 1, __ATOMIC_RELAXED);
+
+    for (size_t offset = 0; offset < total; ) {
+        size_t len = MIN(max, total - offset);
+
+        pktbuf_t *f = pktbuf_alloc_chain(len);
+        if (!f) {
+            err = ERR_NO_MEMORY;
+            break;
+        }
+
+        size_t copied = 0;
+        for (pktbuf_t *part = f; part; part = part->next)
+            copied += pktbuf_copy_out(p, offset + copied, part->data, part->dlen);
+        DEBUG_ASSERT(copied == len);
+
+        uint16_t flags_frags = offset / 8;
+        if (offset + len < total)
+            flags_frags |= IPV4_FLAG_MF;
+
+        struct ipv4_hdr *ip = pktbuf_prepend(f, sizeof(struct ipv4_hdr));
+        minip_build_ipv4_hdr_etc(route->netif, ip, dest_addr, proto, len, id, flags_frags);
+
+        LTRACEF("fragment id 0x%hx offset %zu len %zu\n", id, offset, len);
+        err = minip_ipv4_output(route, f);
+        if (err < 0)
+            break;
+
+        offset += len;
+    }
+
+    pktbuf_free(p, true);
+
+    return err;
+}
+
+void ipv4_reasm_dump(void)
+{
+    uint active = 0;
+
+    mutex_acquire(&reasm_lock);
+    for (uint i = 0; i < IPV4_REASM_SLOTS; i++) {
+        if (reasm_slots[i].buf)
+            active++;
+    }
+    mutex_release(&reasm_lock);
+
+    printf("reassembly: %u in progress, %u done, %u timed out, %u dropped\n",
+           active, reasm_stats.reassembled, reasm_stats.timeouts, reasm_stats.dropped);
+}
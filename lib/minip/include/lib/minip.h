@@ -24,7 +24,9 @@
 #pragma once
 
 #include <endian.h>
+#include <iovec.h>
 #include <list.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
 
@@ -37,20 +39,44 @@
 #define IPV4_NONE (0)
 
 typedef int (*tx_func_t)(pktbuf_t *p);
+/* send a list of packets, linked through their list nodes, returning how many
+ * went out. the driver owns all of them either way */
+typedef int (*tx_batch_func_t)(struct list_node *list);
 typedef void (*udp_callback_t)(void *data, size_t len,
                                uint32_t srcaddr, uint16_t srcport, void *arg);
 
-/* initialize minip with static configuration */
+/* initialize minip with static configuration, on a default interface
+ * named "eth0" which the rest of the single interface calls below act on */
 void minip_init(tx_func_t tx_func, void *tx_arg,
                 uint32_t ip, uint32_t netmask, uint32_t gateway);
 
 /* initialize minip with DHCP configuration */
 void minip_init_dhcp(tx_func_t tx_func, void *tx_arg);
 
-/* packet rx hook to hand to ethernet driver */
+/* packet rx hook to hand to ethernet driver, for the default interface */
 void minip_rx_driver_callback(pktbuf_t *p);
 
-/* global configuration state */
+/* what the driver's tx_func can do on top of sending single buffer packets */
+#define MINIP_TX_OFFLOAD_SG         (1<<0) // multi part pktbufs, otherwise they are copied into one
+#define MINIP_TX_OFFLOAD_TCP_CSUM   (1<<1) // PKTBUF_FLAG_CKSUM_TCP_PARTIAL
+#define MINIP_TX_OFFLOAD_TSO        (1<<2) // tcp segmentation, pktbuf gso_size
+
+void minip_set_tx_offloads(uint offloads);
+
+/* optional, for drivers that can queue several packets and tell the nic once */
+void minip_set_tx_batch_handler(tx_batch_func_t tx_batch_func);
+
+/* the ipv4 mtu of the interface, not counting the ethernet header. the driver
+ * should set it to what its rx buffers can hold, larger packets are fragmented */
+#ifndef MINIP_DEFAULT_MTU
+#define MINIP_DEFAULT_MTU 1500
+#endif
+#define MINIP_MIN_MTU     576
+#define MINIP_MAX_MTU     9000
+
+status_t minip_set_mtu(uint mtu);
+uint minip_get_mtu(void);
+
 void minip_get_macaddr(uint8_t *addr);
 void minip_set_macaddr(const uint8_t *addr);
 
@@ -62,27 +88,142 @@ const char *minip_get_hostname(void);
 
 uint32_t minip_parse_ipaddr(const char *addr, size_t len);
 
+/* interfaces. each one has its own addresses, mtu and tx handlers, and hands
+ * its rx packets to minip_netif_rx. interfaces are never destroyed */
+typedef struct minip_netif minip_netif_t;
+
+#ifndef MINIP_MAX_ROUTES
+#define MINIP_MAX_ROUTES 16
+#endif
+
+/* returns NULL if out of memory */
+minip_netif_t *minip_netif_create(const char *name, const uint8_t mac[6], tx_func_t tx_func, void *tx_arg);
+minip_netif_t *minip_netif_find(const char *name);
+/* the first interface created, NULL if there are none yet */
+minip_netif_t *minip_netif_default(void);
+
+void minip_netif_rx(minip_netif_t *netif, pktbuf_t *p);
+void minip_netif_set_tx_offloads(minip_netif_t *netif, uint offloads);
+void minip_netif_set_tx_batch_handler(minip_netif_t *netif, tx_batch_func_t tx_batch_func);
+status_t minip_netif_set_mtu(minip_netif_t *netif, uint mtu);
+/* also installs the route to the local subnet and, if gateway is set, a default
+ * route through it, replacing the ones from the previous address */
+void minip_netif_set_addr(minip_netif_t *netif, uint32_t ip, uint32_t netmask, uint32_t gateway);
+
+/* routes, picked by longest prefix. several routes for the same prefix share
+ * the traffic, each flow sticking to one of them by a hash of its addresses
+ * and ports. gateway is IPV4_NONE for destinations directly on the link */
+status_t minip_route_add(uint32_t dest, uint32_t netmask, uint32_t gateway, minip_netif_t *netif);
+status_t minip_route_del(uint32_t dest, uint32_t netmask, uint32_t gateway, minip_netif_t *netif);
+void minip_route_dump(void);
+void minip_netif_dump(void);
+
 /* udp */
 typedef struct udp_socket udp_socket_t;
 
+/* cb runs on the rx path, and should be quick. a NULL cb stops listening */
 int udp_listen(uint16_t port, udp_callback_t cb, void *arg);
+/* like udp_listen, but packets are copied onto a queue of up to queue_len
+ * and cb runs on a udp worker thread, for slow handlers. packets that don't
+ * fit are dropped */
+int udp_listen_queued(uint16_t port, udp_callback_t cb, void *arg, uint queue_len);
 status_t udp_open(uint32_t host, uint16_t sport, uint16_t dport, udp_socket_t **handle);
 status_t udp_send(void *buf, size_t len, udp_socket_t *handle);
+status_t udp_send_iovec(const iovec_t *iov, uint iov_count, udp_socket_t *handle);
+
+/* one datagram of a batch. on receive iov is a single buffer, valid until the
+ * callback returns, and addr and port are where it came from. on send the
+ * socket decides where it goes and addr and port are ignored. */
+typedef struct udp_msg {
+    iovec_t *iov;
+    uint iov_count;
+    uint32_t addr;
+    uint16_t port;
+} udp_msg_t;
+
+typedef void (*udp_batch_callback_t)(const udp_msg_t *msgs, uint count, void *arg);
+
+/* send count datagrams, handing them to the driver together. returns how many
+ * were sent, which is short if one couldn't be built, or an error if none were */
+int udp_send_batch(const udp_msg_t *msgs, uint count, udp_socket_t *handle);
+
+/* like udp_listen_queued, but cb gets everything waiting on the queue at once,
+ * up to a limit */
+int udp_listen_batch(uint16_t port, udp_batch_callback_t cb, void *arg, uint queue_len);
 status_t udp_close(udp_socket_t *handle);
 
 /* tcp */
 typedef struct tcp_socket tcp_socket_t;
 
 status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port);
+/* set the receive and transmit buffer sizes of the sockets accepted from a listening socket.
+ * the receive buffer, which is also the largest window advertised, is rounded up to a power of two. */
+status_t tcp_set_buffer_sizes(tcp_socket_t *listen_socket, size_t rx_size, size_t tx_size);
+/* how many connections a listening socket holds for tcp_accept, and as many again half open.
+ * past that SYNs are dropped, or, with syn_cookies, the half open ones are answered statelessly. */
+status_t tcp_set_backlog(tcp_socket_t *listen_socket, uint backlog, bool syn_cookies);
 status_t tcp_accept_timeout(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket, lk_time_t timeout);
 status_t tcp_close(tcp_socket_t *socket);
 ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len);
 ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len);
+/* gather write. the data is copied into the socket, then, if the nic can do scatter gather,
+ * segments are sent straight out of the socket's buffer. */
+ssize_t tcp_writev(tcp_socket_t *socket, const iovec_t *iov, uint iov_cnt);
+/* like tcp_write, but copies only what fits in the transmit buffer right now and returns how
+ * much that was, possibly 0. for sockets served from a wait set. */
+ssize_t tcp_write_nowait(tcp_socket_t *socket, const void *buf, size_t len);
+
+/* zero copy receive. tcp_read_peek blocks like tcp_read, then describes the received data in
+ * place, in up to two regions, and returns its total length. the data stays in the socket, and
+ * keeps taking up receive window, until tcp_read_release hands back the first len bytes of it.
+ * only one thread should read a socket this way at a time. */
+ssize_t tcp_read_peek(tcp_socket_t *socket, iovec_t regions[2]);
+status_t tcp_read_release(tcp_socket_t *socket, size_t len);
+
+/* counters of a connection, for benchmarks and debugging */
+typedef struct tcp_stats {
+    uint64_t segs_out;
+    uint64_t segs_retransmitted;
+    uint32_t fast_retransmits;
+    uint32_t timeouts;
+    uint32_t srtt;  // usecs, 0 until measured
+    uint32_t cwnd;  // bytes
+    uint32_t mss;
+} tcp_stats_t;
+
+status_t tcp_get_stats(tcp_socket_t *socket, tcp_stats_t *stats);
 
 static inline status_t tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket)
 {
     return tcp_accept_timeout(listen_socket, accept_socket, INFINITE_TIME);
 }
 
+/* wait sets, for serving many sockets from one thread. a socket is added with the events of
+ * interest and a cookie handed back with them. readiness is level triggered: a socket keeps
+ * being reported until it is read, written or accepted from far enough to clear it. hup is
+ * reported whether asked for or not. a socket stays referenced, and so valid, until removed
+ * from every wait set it is on, even past tcp_close. */
+#define TCP_POLL_IN     (1<<0) // data to read, end of stream, or a connection to accept
+#define TCP_POLL_OUT    (1<<1) // room in the transmit buffer
+#define TCP_POLL_HUP    (1<<2) // the connection is closed
+
+typedef struct tcp_waitset tcp_waitset_t;
+
+typedef struct tcp_poll_result {
+    tcp_socket_t *socket;
+    void *cookie;
+    uint events;
+} tcp_poll_result_t;
+
+status_t tcp_waitset_create(tcp_waitset_t **handle);
+status_t tcp_waitset_destroy(tcp_waitset_t *ws);
+status_t tcp_waitset_add(tcp_waitset_t *ws, tcp_socket_t *socket, uint events, void *cookie);
+status_t tcp_waitset_remove(tcp_waitset_t *ws, tcp_socket_t *socket);
+/* change the events a socket on the wait set is waited on for */
+status_t tcp_waitset_modify(tcp_waitset_t *ws, tcp_socket_t *socket, uint events);
+/* wait for at least one socket to be ready, filling in up to max results. returns the number
+ * filled in or ERR_TIMED_OUT. */
+int tcp_waitset_wait(tcp_waitset_t *ws, tcp_poll_result_t *results, uint max, lk_time_t timeout);
+
 /* utilities */
 void gen_random_mac_address(uint8_t *mac_addr);
@@ -52,6 +52,8 @@ typedef struct pktbuf {
     pktbuf_free_callback cb;
     void *cb_args;
     u8 *buffer;
+    struct pktbuf *next; // next part of a multi part packet
+    u32 gso_size; // if set, the nic cuts the tcp payload up into segments this long
 } pktbuf_t;
 
 typedef struct pktbuf_pool_object {
@@ -64,8 +66,9 @@ typedef struct pktbuf_pool_object {
 #define PKTBUF_FLAG_CKSUM_IP_GOOD  (1<<0)
 #define PKTBUF_FLAG_CKSUM_TCP_GOOD (1<<1)
 #define PKTBUF_FLAG_CKSUM_UDP_GOOD (1<<2)
-#define PKTBUF_FLAG_EOF            (1<<3)
+#define PKTBUF_FLAG_EOF            (1<<3) // last (or only) part of a packet
 #define PKTBUF_FLAG_CACHED         (1<<4)
+#define PKTBUF_FLAG_CKSUM_TCP_PARTIAL (1<<5) // tx: the tcp checksum only covers the pseudo header, the nic finishes it
 
 /* Return the physical address offset of data in the packet */
 static inline u32 pktbuf_data_phys(pktbuf_t *p)
@@ -85,15 +88,17 @@ static inline u32 pktbuf_avail_tail(pktbuf_t *p)
     return p->blen - (p->data - p->buffer) - p->dlen;
 }
 
-// allocate packet buffer from buffer pool
+// allocate packet buffer from buffer pool. never blocks, so these may be
+// called from interrupt context; they return NULL when the pool is empty
 pktbuf_t *pktbuf_alloc(void);
 pktbuf_t *pktbuf_alloc_empty(void);
 
 /* Add a buffer to an existing packet buffer */
 void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz,
                        uint32_t flags, pktbuf_free_callback cb, void *cb_args);
-// return packet buffer to buffer pool
-// returns number of threads woken up
+// return packet buffer, and any parts after it, to buffer pool
+// returns the number of pktbufs freed. reschedule is unused, since
+// nothing waits for the pool anymore
 int pktbuf_free(pktbuf_t *p, bool reschedule);
 
 // extend buffer by sz bytes, copied from data
@@ -123,5 +128,30 @@ void pktbuf_create(void *ptr, size_t size);
 // Create buffers for pktbufs of size PKTBUF_BUF_SIZE out of size
 void pktbuf_create_bufs(void *ptr, size_t size);
 
+/* Multi part packets: the first pktbuf holds the headers and each part after it,
+ * linked through next, points at more payload in a buffer of its own, usually
+ * one added with pktbuf_add_buffer. Only the last part has PKTBUF_FLAG_EOF set.
+ * pktbuf_free on the first part frees all of them. */
+
+// add part to the end of the packet p
+void pktbuf_append_part(pktbuf_t *p, pktbuf_t *part);
+
+// length of the data in all the parts of the packet
+size_t pktbuf_total_len(const pktbuf_t *p);
+
+// copy all the parts into the first one and free them, for drivers that can only
+// send a single buffer. returns ERR_TOO_BIG if they don't fit.
+status_t pktbuf_linearize(pktbuf_t *p);
+
+// allocate a packet with room for len bytes of data, chaining as many pool objects
+// as it takes. only the first part has header space in front. dlen of every part
+// is already set, fill them with pktbuf_copy_in. returns NULL if the pool runs out
+pktbuf_t *pktbuf_alloc_chain(size_t len);
+
+// copy len bytes starting offset bytes into the packet, across parts, to or from buf.
+// return the number of bytes copied, which is short if the packet ends first
+size_t pktbuf_copy_out(const pktbuf_t *p, size_t offset, void *buf, size_t len);
+size_t pktbuf_copy_in(pktbuf_t *p, size_t offset, const void *buf, size_t len);
+
 void pktbuf_dump(pktbuf_t *p);
 #endif
@@ -74,8 +74,13 @@ static int cmd_arp(int argc, const cmd_args *argv)
     } else if (argc == 3 && strncmp(cmd, "query", sizeof("query")) == 0) {
         const char *addr_s = argv[2].str;
         uint32_t addr = str_ip_to_int(addr_s, strlen(addr_s));
+        minip_route_t route;
 
-        arp_send_request(addr);
+        if (!minip_route_lookup(addr, 0, &route)) {
+            printf("no route to %s\n", addr_s);
+            return -1;
+        }
+        arp_send_request(route.netif, route.nexthop);
     } else {
         arp_usage();
     }
@@ -89,7 +94,9 @@ static int cmd_minip(int argc, const cmd_args *argv)
 minip_usage:
         printf("minip commands\n");
         printf("mi [a]rp                        dump arp table\n");
-        printf("mi [s]tatus                     print ip status\n");
+        printf("mi [m]tu [size]                 show or set the default interface mtu\n");
+        printf("mi [r]oute                      dump the routing table\n");
+        printf("mi [s]tatus                     print ip status and interfaces\n");
         printf("mi [t]est [dest] [port] [cnt]   send <cnt> test packets to the dest:port\n");
     } else {
         switch (argv[1].str[0]) {
@@ -98,11 +105,26 @@ minip_usage:
                 arp_cache_dump();
                 break;
 
+            case 'm':
+                if (argc >= 3 && minip_set_mtu(argv[2].u) != NO_ERROR) {
+                    printf("mtu must be between %u and %u\n", MINIP_MIN_MTU, MINIP_MAX_MTU);
+                    return -1;
+                }
+                printf("mtu: %u\n", minip_get_mtu());
+                break;
+
+            case 'r':
+                minip_route_dump();
+                break;
+
             case 's': {
                 uint32_t ipaddr = minip_get_ipaddr();
 
                 printf("hostname: %s\n", minip_get_hostname());
                 printf("ip: %u.%u.%u.%u\n", IPV4_SPLIT(ipaddr));
+                printf("mtu: %u\n", minip_get_mtu());
+                minip_netif_dump();
+                ipv4_reasm_dump();
             }
             break;
             case 't': {
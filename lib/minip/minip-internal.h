@@ -33,7 +33,6 @@
 
 /* Lib configuration */
 #define MINIP_USE_UDP_CHECKSUM    0
-#define MINIP_MTU_SIZE            1536
 #define MINIP_USE_ARP             1
 
 #pragma pack(push, 1)
@@ -79,6 +78,11 @@ struct eth_hdr {
 
 #pragma pack(pop)
 
+/* ipv4_hdr flags_frags, in host order */
+#define IPV4_FLAG_DF              0x4000
+#define IPV4_FLAG_MF              0x2000
+#define IPV4_FRAG_OFFSET_MASK     0x1fff // in units of 8 bytes
+
 enum {
     ICMP_ECHO_REPLY   = 0,
     ICMP_ECHO_REQUEST = 8,
@@ -100,32 +104,99 @@ enum {
     ARP_OPER_REPLY   = 0x0002,
 };
 
-extern tx_func_t minip_tx_handler;
+struct minip_netif {
+    struct list_node node;
+    char name[16];
+
+    /* the driver side, each interface queues to its own */
+    tx_func_t tx_func;
+    void *tx_arg;
+    tx_batch_func_t tx_batch_func;
+    uint tx_offloads;
+    uint mtu;
+
+    uint8_t mac[6];
+    uint32_t ip;
+    uint32_t netmask;
+    uint32_t broadcast;
+    uint32_t gateway;
+
+    uint rx_packets;
+    uint tx_packets;
+    uint tx_errors;
+};
+
+/* where a packet for some destination goes out */
+typedef struct minip_route {
+    minip_netif_t *netif;
+    uint32_t nexthop; // the destination itself if it is on the link, otherwise the gateway
+} minip_route_t;
+
+/* spreads flows over routes of equal length */
+static inline uint32_t minip_flow_hash(uint32_t addr, uint16_t sport, uint16_t dport)
+{
+    return ((addr ^ ((uint32_t)sport << 16 | dport)) * 0x9e3779b1u) >> 16;
+}
+
+/* limited broadcasts go out the default interface */
+bool minip_route_lookup(uint32_t dest, uint32_t flow_hash, minip_route_t *route);
+
+void minip_netif_tx(minip_netif_t *netif, pktbuf_t *p);
+/* send every packet on list, in one go if the driver can */
+void minip_netif_tx_list(minip_netif_t *netif, struct list_node *list);
+/* set up the rest of the stack, the first time an interface is created */
+void minip_core_init(void);
 typedef struct udp_hdr udp_hdr_t;
 static const uint8_t bcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
 void arp_cache_init(void);
 void arp_cache_update(uint32_t addr, const uint8_t mac[6]);
-uint8_t *arp_cache_lookup(uint32_t addr);
+/* copies the mac for addr out of the cache, doesn't block. refreshes of old
+ * entries are asked for on netif */
+bool arp_cache_lookup(minip_netif_t *netif, uint32_t addr, uint8_t mac[6]);
 void arp_cache_dump(void);
-int arp_send_request(uint32_t addr);
-const uint8_t *arp_get_dest_mac(uint32_t host);
+int arp_send_request(minip_netif_t *netif, uint32_t addr);
+status_t arp_get_dest_mac(minip_netif_t *netif, uint32_t host, uint8_t mac[6]);
+/* hold on to an ipv4 packet, with room for the ethernet header in front, until
+ * addr resolves on netif. the packet is sent or freed either way. returns an
+ * error if it had to be dropped right away */
+status_t arp_queue_packet(minip_netif_t *netif, uint32_t addr, pktbuf_t *p);
 
 uint16_t rfc1701_chksum(const uint8_t *buf, size_t len);
 uint16_t rfc768_chksum(struct ipv4_hdr *ipv4, udp_hdr_t *udp);
 uint16_t ones_sum16(uint32_t sum, const void *_buf, int len);
+/* copy len bytes from src to dst, returning their sum as ones_sum16 would */
+uint16_t ones_sum16_copy(uint32_t sum, void *dst, const void *src, int len);
 
 /* Helper methods for building headers */
-void minip_build_mac_hdr(struct eth_hdr *pkt, const uint8_t *dst, uint16_t type);
-void minip_build_ipv4_hdr(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, uint16_t len);
+void minip_build_mac_hdr(minip_netif_t *netif, struct eth_hdr *pkt, const uint8_t *dst, uint16_t type);
+void minip_build_ipv4_hdr(minip_netif_t *netif, struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, uint16_t len);
+/* as above with an explicit id and flags_frags (host order) for fragments */
+void minip_build_ipv4_hdr_etc(minip_netif_t *netif, struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto,
+                              uint16_t len, uint16_t id, uint16_t flags_frags);
 
+/* route the packet by its destination and send it. consumes p */
 status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto);
+/* same, for callers that looked the route up already */
+status_t minip_ipv4_send_route(const minip_route_t *route, pktbuf_t *p, uint32_t dest_addr, uint8_t proto);
+/* add the ethernet header to a packet starting at its ipv4 header and send it,
+ * or hand it to arp until the next hop resolves. the packet is consumed either way */
+status_t minip_ipv4_output(const minip_route_t *route, pktbuf_t *p);
+/* the most ipv4 payload that goes out netif without fragmenting, given its mtu
+ * and whether its driver takes multi part packets */
+size_t minip_ipv4_max_payload(const minip_netif_t *netif);
+
+/* fragmentation and reassembly, frag.c */
+/* split p, which holds ipv4 payload only, into fragments and send them. consumes p */
+status_t ipv4_send_fragments(const minip_route_t *route, pktbuf_t *p, uint32_t dest_addr, uint8_t proto);
+/* take a copy of the fragment in p, whose header is ip. returns the whole payload
+ * once the last piece is in, which the caller frees, and NULL until then */
+pktbuf_t *ipv4_reassemble(const pktbuf_t *p, const struct ipv4_hdr *ip);
+void ipv4_reasm_dump(void);
 
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip);
 void udp_input(pktbuf_t *p, uint32_t src_ip);
 
-const uint8_t *get_dest_mac(uint32_t host);
-
 // timers
 typedef void (*net_timer_callback_t)(void *);
 
@@ -133,6 +204,7 @@ typedef struct net_timer {
     struct list_node node;
 
     lk_time_t sched_time;
+    uint slot;
 
     net_timer_callback_t cb;
     void *arg;
@@ -146,6 +218,40 @@ bool net_timer_cancel(net_timer_t *) __NONNULL();
 
 void net_timer_init(void);
 
+// tcp congestion control
+typedef struct tcp_cc_state {
+    uint32_t mss;
+    uint32_t cwnd;       // bytes allowed in flight
+    uint32_t ssthresh;
+    uint32_t acked;      // bytes acked towards the next congestion avoidance increase
+} tcp_cc_state_t;
+
+/* a congestion control algorithm. the tcp core does loss detection and recovery bookkeeping,
+ * the algorithm only decides how cwnd and ssthresh move. in_flight is in bytes. */
+typedef struct tcp_cc_ops {
+    const char *name;
+
+    /* set up the initial window, mss is valid */
+    void (*init)(tcp_cc_state_t *cc);
+
+    /* new data was acked outside of fast recovery */
+    void (*on_ack)(tcp_cc_state_t *cc, uint32_t acked, uint32_t in_flight);
+
+    /* three duplicate acks, entering fast recovery */
+    void (*on_enter_recovery)(tcp_cc_state_t *cc, uint32_t in_flight);
+
+    /* another duplicate ack while in fast recovery */
+    void (*on_recovery_dup_ack)(tcp_cc_state_t *cc);
+
+    /* everything outstanding at the start of recovery has been acked */
+    void (*on_exit_recovery)(tcp_cc_state_t *cc, uint32_t in_flight);
+
+    /* the retransmit timer went off */
+    void (*on_timeout)(tcp_cc_state_t *cc, uint32_t in_flight);
+} tcp_cc_ops_t;
+
+extern const tcp_cc_ops_t tcp_cc_newreno;
+
 static inline void mac_addr_copy(uint8_t *dest, const uint8_t *src)
 {
     *(uint32_t *)dest = *(const uint32_t *)src;
@@ -36,6 +36,7 @@
 #include <malloc.h>
 #include <list.h>
 #include <kernel/thread.h>
+#include <kernel/debug.h>
 
 static struct list_node arp_list = LIST_INITIAL_VALUE(arp_list);
 
@@ -43,12 +44,10 @@ static struct list_node arp_list = LIST_INITIAL_VALUE(arp_list);
 // 1. Tear endian code out into something that flips words before/after tx/rx calls
 
 #define LOCAL_TRACE 0
-static uint32_t minip_ip      = IPV4_NONE;
-static uint32_t minip_netmask = IPV4_NONE;
-static uint32_t minip_broadcast = IPV4_BCAST;
-static uint32_t minip_gateway = IPV4_NONE;
 
 static const uint8_t broadcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+/* for the default interface, which minip_init creates later on */
 static uint8_t minip_mac[6] = {0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC};
 
 static char minip_hostname[32] = "";
@@ -66,30 +65,60 @@ const char *minip_get_hostname(void)
     return minip_hostname;
 }
 
-static void compute_broadcast_address(void)
-{
-    minip_broadcast = (minip_ip & minip_netmask) | (IPV4_BCAST & ~minip_netmask);
-}
-
 void minip_get_macaddr(uint8_t *addr)
 {
-    mac_addr_copy(addr, minip_mac);
+    minip_netif_t *netif = minip_netif_default();
+
+    mac_addr_copy(addr, netif ? netif->mac : minip_mac);
 }
 
 void minip_set_macaddr(const uint8_t *addr)
 {
+    minip_netif_t *netif = minip_netif_default();
+
     mac_addr_copy(minip_mac, addr);
+    if (netif)
+        mac_addr_copy(netif->mac, addr);
 }
 
 uint32_t minip_get_ipaddr(void)
 {
-    return minip_ip;
+    minip_netif_t *netif = minip_netif_default();
+
+    return netif ? netif->ip : IPV4_NONE;
 }
 
 void minip_set_ipaddr(const uint32_t addr)
 {
-    minip_ip = addr;
-    compute_broadcast_address();
+    minip_netif_t *netif = minip_netif_default();
+
+    if (netif)
+        minip_netif_set_addr(netif, addr, netif->netmask, netif->gateway);
+}
+
+status_t minip_set_mtu(uint mtu)
+{
+    minip_netif_t *netif = minip_netif_default();
+
+    return netif ? minip_netif_set_mtu(netif, mtu) : ERR_NOT_READY;
+}
+
+uint minip_get_mtu(void)
+{
+    minip_netif_t *netif = minip_netif_default();
+
+    return netif ? netif->mtu : MINIP_DEFAULT_MTU;
+}
+
+size_t minip_ipv4_max_payload(const minip_netif_t *netif)
+{
+    size_t max = netif->mtu - sizeof(struct ipv4_hdr);
+
+    /* without scatter gather the packet has to fit one buffer */
+    if (!(netif->tx_offloads & MINIP_TX_OFFLOAD_SG))
+        max = MIN(max, (size_t)PKTBUF_MAX_DATA);
+
+    return max;
 }
 
 void gen_random_mac_address(uint8_t *mac_addr)
@@ -102,157 +131,167 @@ void gen_random_mac_address(uint8_t *mac_addr)
     mac_addr[0] |= (1<<1);
 }
 
-/* This function is called by minip to send packets */
-tx_func_t minip_tx_handler;
-void *minip_tx_arg;
+void minip_set_tx_offloads(uint offloads)
+{
+    minip_netif_t *netif = minip_netif_default();
+
+    if (netif)
+        minip_netif_set_tx_offloads(netif, offloads);
+}
+
+void minip_set_tx_batch_handler(tx_batch_func_t tx_batch_func)
+{
+    minip_netif_t *netif = minip_netif_default();
 
-void minip_init(tx_func_t tx_handler, void *tx_arg,
-                uint32_t ip, uint32_t mask, uint32_t gateway)
+    if (netif)
+        minip_netif_set_tx_batch_handler(netif, tx_batch_func);
+}
+
+void minip_core_init(void)
 {
-    minip_tx_handler = tx_handler;
-    minip_tx_arg = tx_arg;
+    static bool initialized;
 
-    minip_ip = ip;
-    minip_netmask = mask;
-    minip_gateway = gateway;
-    compute_broadcast_address();
+    if (initialized)
+        return;
+    initialized = true;
 
     arp_cache_init();
     net_timer_init();
 }
 
+void minip_init(tx_func_t tx_handler, void *tx_arg,
+                uint32_t ip, uint32_t mask, uint32_t gateway)
+{
+    minip_netif_t *netif = minip_netif_default();
+
+    if (!netif) {
+        netif = minip_netif_create("eth0", minip_mac, tx_handler, tx_arg);
+        if (!netif) {
+            panic("minip: no memory for the default interface\n");
+        }
+    } else {
+        netif->tx_func = tx_handler;
+        netif->tx_arg = tx_arg;
+    }
+
+    minip_netif_set_addr(netif, ip, mask, gateway);
+}
+
 uint16_t ipv4_payload_len(struct ipv4_hdr *pkt)
 {
     return (pkt->len - ((pkt->ver_ihl >> 4) * 5));
 }
 
-void minip_build_mac_hdr(struct eth_hdr *pkt, const uint8_t *dst, uint16_t type)
+void minip_build_mac_hdr(minip_netif_t *netif, struct eth_hdr *pkt, const uint8_t *dst, uint16_t type)
 {
     mac_addr_copy(pkt->dst_mac, dst);
-    mac_addr_copy(pkt->src_mac, minip_mac);
+    mac_addr_copy(pkt->src_mac, netif->mac);
     pkt->type = htons(type);
 }
 
-void minip_build_ipv4_hdr(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, uint16_t len)
+void minip_build_ipv4_hdr(minip_netif_t *netif, struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, uint16_t len)
+{
+    minip_build_ipv4_hdr_etc(netif, ipv4, dst, proto, len, 0, IPV4_FLAG_DF); // no offset, no fragments
+}
+
+void minip_build_ipv4_hdr_etc(minip_netif_t *netif, struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto,
+                              uint16_t len, uint16_t id, uint16_t flags_frags)
 {
     ipv4->ver_ihl       = 0x45;
     ipv4->dscp_ecn      = 0;
     ipv4->len           = htons(20 + len); // 5 * 4 from ihl, plus payload length
-    ipv4->id            = 0;
-    ipv4->flags_frags   = 0x40; // no offset, no fragments
+    ipv4->id            = htons(id);
+    ipv4->flags_frags   = htons(flags_frags);
     ipv4->ttl           = 64;
     ipv4->proto         = proto;
     ipv4->dst_addr      = dst;
-    ipv4->src_addr      = minip_ip;
+    ipv4->src_addr      = netif->ip;
 
     /* This may be unnecessary if the controller supports checksum offloading */
     ipv4->chksum = 0;
     ipv4->chksum = rfc1701_chksum((uint8_t *) ipv4, sizeof(struct ipv4_hdr));
 }
 
-int send_arp_request(uint32_t addr)
+status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto)
 {
-    pktbuf_t *p;
-    struct eth_hdr *eth;
-    struct arp_pkt *arp;
+    minip_route_t route;
 
-    if ((p = pktbuf_alloc()) == NULL) {
-        return -1;
+    if (!minip_route_lookup(dest_addr, minip_flow_hash(dest_addr, 0, 0), &route)) {
+        LTRACEF("no route to 0x%x\n", dest_addr);
+        pktbuf_free(p, true);
+        return -EHOSTUNREACH;
     }
 
-    eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
-    arp = pktbuf_append(p, sizeof(struct arp_pkt));
-    minip_build_mac_hdr(eth, bcast_mac, ETH_TYPE_ARP);
-
-    arp->htype = htons(0x0001);
-    arp->ptype = htons(0x0800);
-    arp->hlen = 6;
-    arp->plen = 4;
-    arp->oper = htons(ARP_OPER_REQUEST);
-    arp->spa = minip_ip;
-    arp->tpa = addr;
-    mac_addr_copy(arp->sha, minip_mac);
-    mac_addr_copy(arp->tha, bcast_mac);
-
-    minip_tx_handler(p);
-    return 0;
-}
-
-static void handle_arp_timeout_cb(void *arg)
-{
-    *(bool *)arg = true;
+    return minip_ipv4_send_route(&route, p, dest_addr, proto);
 }
 
-const uint8_t *get_dest_mac(uint32_t host)
+status_t minip_ipv4_send_route(const minip_route_t *route, pktbuf_t *p, uint32_t dest_addr, uint8_t proto)
 {
-    uint8_t *dst_mac = NULL;
-    bool arp_timeout = false;
-    net_timer_t arp_timeout_timer;
+    status_t ret = 0;
+    size_t data_len = pktbuf_total_len(p);
+    minip_netif_t *netif = route->netif;
 
-    if (host == IPV4_BCAST) {
-        return bcast_mac;
+    /* segmentation offload packets are cut up by the nic instead */
+    if (p->gso_size == 0 && data_len > minip_ipv4_max_payload(netif)) {
+        return ipv4_send_fragments(route, p, dest_addr, proto);
     }
 
-    dst_mac = arp_cache_lookup(host);
-    if (dst_mac == NULL) {
-        send_arp_request(host);
-        memset(&arp_timeout_timer, 0, sizeof(arp_timeout_timer));
-        net_timer_set(&arp_timeout_timer, handle_arp_timeout_cb, &arp_timeout, 100);
-        while (!arp_timeout) {
-            dst_mac = arp_cache_lookup(host);
-            if (dst_mac) {
-                net_timer_cancel(&arp_timeout_timer);
-                break;
-            }
+    if (!(netif->tx_offloads & MINIP_TX_OFFLOAD_SG) && p->next) {
+        ret = pktbuf_linearize(p);
+        if (ret < 0) {
+            pktbuf_free(p, true);
+            return ret;
         }
     }
 
-    return dst_mac;
+    struct ipv4_hdr *ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
+    minip_build_ipv4_hdr(netif, ip, dest_addr, proto, data_len);
+
+    return minip_ipv4_output(route, p);
 }
 
-status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto)
+status_t minip_ipv4_output(const minip_route_t *route, pktbuf_t *p)
 {
-    status_t ret = 0;
-    size_t data_len = p->dlen;
-    const uint8_t *dst_mac;
-
-    struct ipv4_hdr *ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
     struct eth_hdr *eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
-
-
-    if (dest_addr == IPV4_BCAST || dest_addr == minip_broadcast) {
-        dst_mac = bcast_mac;
-        goto ready;
+    minip_netif_t *netif = route->netif;
+    uint8_t dst_mac[6];
+
+    if (route->nexthop == IPV4_BCAST || route->nexthop == netif->broadcast) {
+        mac_addr_copy(dst_mac, bcast_mac);
+    } else if (!arp_cache_lookup(netif, route->nexthop, dst_mac)) {
+        /* park it until the address resolves, rather than waiting here */
+        return arp_queue_packet(netif, route->nexthop, p);
     }
 
-    dst_mac = get_dest_mac(dest_addr);
-    if (!dst_mac) {
-        pktbuf_free(p, true);
-        ret = -EHOSTUNREACH;
-        goto err;
-    }
-
-ready:
-    minip_build_mac_hdr(eth, dst_mac, ETH_TYPE_IPV4);
-    minip_build_ipv4_hdr(ip, dest_addr, proto, data_len);
+    minip_build_mac_hdr(netif, eth, dst_mac, ETH_TYPE_IPV4);
 
-    minip_tx_handler(p);
+    minip_netif_tx(netif, p);
 
-err:
-    return ret;
+    return NO_ERROR;
 }
 
 /* Swap the dst/src ip addresses and send an ICMP ECHO REPLY with the same payload.
  * According to spec the data portion doesn't matter, but ping itself validates that
  * the payload is identical
  */
-void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdatalen)
+static void send_ping_reply(minip_netif_t *netif, uint32_t ipaddr, struct icmp_pkt *req, size_t reqdatalen)
 {
     pktbuf_t *p;
     size_t len;
     struct eth_hdr *eth;
     struct ipv4_hdr *ip;
     struct icmp_pkt *icmp;
+    uint8_t dst_mac[6];
+
+    /* the reply is built in a single buffer, too bad for reassembled giant pings */
+    if (reqdatalen > PKTBUF_MAX_DATA - sizeof(struct icmp_pkt)) {
+        return;
+    }
+
+    /* the request just put the sender in the cache */
+    if (!arp_cache_lookup(netif, ipaddr, dst_mac)) {
+        return;
+    }
 
     if ((p = pktbuf_alloc()) == NULL) {
         return;
@@ -265,8 +304,8 @@ void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdatalen)
 
     len = sizeof(struct icmp_pkt) + reqdatalen;
 
-    minip_build_mac_hdr(eth, arp_cache_lookup(ipaddr), ETH_TYPE_IPV4);
-    minip_build_ipv4_hdr(ip, ipaddr, IP_PROTO_ICMP, len);
+    minip_build_mac_hdr(netif, eth, dst_mac, ETH_TYPE_IPV4);
+    minip_build_ipv4_hdr(netif, ip, ipaddr, IP_PROTO_ICMP, len);
 
     icmp->type = ICMP_ECHO_REPLY;
     icmp->code = 0;
@@ -274,7 +313,7 @@ void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdatalen)
     icmp->chksum = 0;
     icmp->chksum = rfc1701_chksum((uint8_t *) icmp, len);
 
-    minip_tx_handler(p);
+    minip_netif_tx(netif, p);
 }
 
 static void dump_ipv4_addr(uint32_t addr)
@@ -294,7 +333,7 @@ static void dump_ipv4_packet(const struct ipv4_hdr *ip)
            (ip->ver_ihl & 0xf) * 4, ip->proto, ntohs(ip->chksum), ntohs(ip->len), ntohs(ip->id), ntohs(ip->flags_frags) & 0x1fff);
 }
 
-__NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
+__NO_INLINE static void handle_ipv4_packet(minip_netif_t *netif, pktbuf_t *p, const uint8_t *src_mac)
 {
     struct ipv4_hdr *ip;
 
@@ -349,12 +388,22 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
 
     /* see if it's for us */
     if (ip->dst_addr != IPV4_BCAST) {
-        if (minip_ip != IPV4_NONE && ip->dst_addr != minip_ip && ip->dst_addr != minip_broadcast) {
+        if (netif->ip != IPV4_NONE && ip->dst_addr != netif->ip && ip->dst_addr != netif->broadcast) {
             LTRACEF("REJECT: for another host\n");
             return;
         }
     }
 
+    /* hold on to fragments until the whole payload is in, then carry on with that */
+    pktbuf_t *whole = NULL;
+    if (ntohs(ip->flags_frags) & (IPV4_FLAG_MF | IPV4_FRAG_OFFSET_MASK)) {
+        whole = ipv4_reassemble(p, ip);
+        if (!whole) {
+            return;
+        }
+        p = whole;
+    }
+
     /* We only handle UDP and ECHO REQUEST */
     switch (ip->proto) {
         case IP_PROTO_ICMP: {
@@ -363,7 +412,7 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
                 break;
             }
             if (icmp->type == ICMP_ECHO_REQUEST) {
-                send_ping_reply(ip->src_addr, icmp, p->dlen);
+                send_ping_reply(netif, ip->src_addr, icmp, p->dlen);
             }
         }
         break;
@@ -376,9 +425,13 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
             tcp_input(p, ip->src_addr, ip->dst_addr);
             break;
     }
+
+    if (whole) {
+        pktbuf_free(whole, true);
+    }
 }
 
-__NO_INLINE static int handle_arp_pkt(pktbuf_t *p)
+__NO_INLINE static int handle_arp_pkt(minip_netif_t *netif, pktbuf_t *p)
 {
     struct eth_hdr *eth;
     struct arp_pkt *arp;
@@ -395,7 +448,7 @@ __NO_INLINE static int handle_arp_pkt(pktbuf_t *p)
             struct eth_hdr *reth;
             struct arp_pkt *rarp;
 
-            if (memcmp(&arp->tpa, &minip_ip, sizeof(minip_ip)) == 0) {
+            if (memcmp(&arp->tpa, &netif->ip, sizeof(netif->ip)) == 0) {
                 if ((rp = pktbuf_alloc()) == NULL) {
                     break;
                 }
@@ -404,7 +457,7 @@ __NO_INLINE static int handle_arp_pkt(pktbuf_t *p)
                 rarp = pktbuf_append(rp, sizeof(struct arp_pkt));
 
                 // Eth header
-                minip_build_mac_hdr(reth, eth->src_mac, ETH_TYPE_ARP);
+                minip_build_mac_hdr(netif, reth, eth->src_mac, ETH_TYPE_ARP);
 
                 // ARP packet
                 rarp->oper = htons(ARP_OPER_REPLY);
@@ -412,12 +465,12 @@ __NO_INLINE static int handle_arp_pkt(pktbuf_t *p)
                 rarp->ptype = htons(0x0800);
                 rarp->hlen = 6;
                 rarp->plen = 4;
-                mac_addr_copy(rarp->sha, minip_mac);
-                rarp->spa = minip_ip;
+                mac_addr_copy(rarp->sha, netif->mac);
+                rarp->spa = netif->ip;
                 mac_addr_copy(rarp->tha, arp->sha);
                 rarp->tpa = arp->spa;
 
-                minip_tx_handler(rp);
+                minip_netif_tx(netif, rp);
             }
         }
         break;
@@ -449,9 +502,21 @@ static void dump_eth_packet(const struct eth_hdr *eth)
 }
 
 void minip_rx_driver_callback(pktbuf_t *p)
+{
+    minip_netif_t *netif = minip_netif_default();
+
+    if (netif) {
+        minip_netif_rx(netif, p);
+    }
+}
+
+void minip_netif_rx(minip_netif_t *netif, pktbuf_t *p)
 {
     struct eth_hdr *eth;
 
+    netif->rx_packets++;
+    KEVLOG_NET_RX(netif, p->dlen);
+
     if ((eth = (void *) pktbuf_consume(p, sizeof(struct eth_hdr))) == NULL) {
         return;
     }
@@ -460,7 +525,7 @@ void minip_rx_driver_callback(pktbuf_t *p)
         dump_eth_packet(eth);
     }
 
-    if (memcmp(eth->dst_mac, minip_mac, 6) != 0 &&
+    if (memcmp(eth->dst_mac, netif->mac, 6) != 0 &&
             memcmp(eth->dst_mac, broadcast_mac, 6) != 0) {
         /* not for us */
         return;
@@ -469,12 +534,12 @@ void minip_rx_driver_callback(pktbuf_t *p)
     switch (htons(eth->type)) {
         case ETH_TYPE_IPV4:
             LTRACEF("ipv4 pkt\n");
-            handle_ipv4_packet(p, eth->src_mac);
+            handle_ipv4_packet(netif, p, eth->src_mac);
             break;
 
         case ETH_TYPE_ARP:
             LTRACEF("arp pkt\n");
-            handle_arp_pkt(p);
+            handle_arp_pkt(netif, p);
             break;
     }
 }
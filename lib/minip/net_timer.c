@@ -21,11 +21,25 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+/*
+ * Net timers are kept on a hashed timing wheel. Each slot covers NET_TIMER_TICK
+ * ms and a timer goes into the slot its expiry time falls in, modulo the wheel
+ * size, so arming and cancelling are O(1) no matter how many timers are
+ * pending. Timers further out than one revolution share a slot with nearer ones
+ * and are simply skipped until their round comes up. A bitmap of non empty
+ * slots lets the workers sleep until the next occupied slot instead of
+ * ticking through empty ones.
+ *
+ * Expired timers are moved to a separate list and their callbacks run by
+ * NET_TIMER_WORKERS threads, so one slow callback does not hold up the rest.
+ */
 #include "minip-internal.h"
 
 #include <trace.h>
 #include <debug.h>
+#include <assert.h>
 #include <compiler.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <list.h>
 #include <err.h>
@@ -37,33 +51,175 @@
 
 #define LOCAL_TRACE 0
 
-static struct list_node net_timer_list = LIST_INITIAL_VALUE(net_timer_list);
-static event_t net_timer_event = EVENT_INITIAL_VALUE(net_timer_event, false, 0);
+/* ms per wheel slot */
+#ifndef NET_TIMER_TICK
+#define NET_TIMER_TICK 10
+#endif
+
+/* must be a multiple of 32 */
+#ifndef NET_TIMER_SLOTS
+#define NET_TIMER_SLOTS 256
+#endif
+
+#ifndef NET_TIMER_WORKERS
+#define NET_TIMER_WORKERS 1
+#endif
+
+#define SLOT_MASK (NET_TIMER_SLOTS - 1)
+#define NET_TIMER_EXPIRED ((uint)-1)
+#define BITMAP_WORDS (NET_TIMER_SLOTS / 32)
+
+STATIC_ASSERT((NET_TIMER_SLOTS & SLOT_MASK) == 0 && (NET_TIMER_SLOTS % 32) == 0);
+
+static struct list_node wheel[NET_TIMER_SLOTS];
+static uint32_t wheel_bitmap[BITMAP_WORDS];
+static struct list_node expired_list = LIST_INITIAL_VALUE(expired_list);
+
+/* the slot being processed and the time its tick started */
+static uint wheel_tick;
+static lk_time_t wheel_time;
+static uint wheel_count;
+
+/* when the sleeping workers will next look at the wheel */
+static lk_time_t next_wake = INFINITE_TIME;
+
+static event_t net_timer_event = EVENT_INITIAL_VALUE(net_timer_event, false, EVENT_FLAG_AUTOUNSIGNAL);
 static mutex_t net_timer_lock = MUTEX_INITIAL_VALUE(net_timer_lock);
 
-static void add_to_queue(net_timer_t *t)
+static inline void slot_mark(uint slot)
+{
+    wheel_bitmap[slot / 32] |= 1u << (slot % 32);
+}
+
+static inline void slot_clear_if_empty(uint slot)
+{
+    if (list_is_empty(&wheel[slot]))
+        wheel_bitmap[slot / 32] &= ~(1u << (slot % 32));
+}
+
+/* number of ticks from start to the next occupied slot, or NET_TIMER_SLOTS if none */
+static uint next_occupied(uint start)
+{
+    uint slot = start & SLOT_MASK;
+
+    for (uint scanned = 0; scanned < NET_TIMER_SLOTS + 32; ) {
+        uint32_t word = wheel_bitmap[slot / 32] >> (slot % 32);
+        if (word) {
+            uint dist = scanned + __builtin_ctz(word);
+            return MIN(dist, NET_TIMER_SLOTS);
+        }
+        scanned += 32 - (slot % 32);
+        slot = (slot + 32 - (slot % 32)) & SLOT_MASK;
+    }
+
+    return NET_TIMER_SLOTS;
+}
+
+static void wheel_insert_locked(net_timer_t *t)
+{
+    if (wheel_count == 0) {
+        /* nothing is pending, restart the wheel at the current time */
+        wheel_time = current_time();
+    }
+
+    uint ticks = 0;
+    if (TIME_GT(t->sched_time, wheel_time))
+        ticks = (t->sched_time - wheel_time) / NET_TIMER_TICK;
+
+    uint slot = (wheel_tick + ticks) & SLOT_MASK;
+    t->slot = slot;
+    list_add_tail(&wheel[slot], &t->node);
+    slot_mark(slot);
+    wheel_count++;
+}
+
+static void wheel_remove_locked(net_timer_t *t)
+{
+    list_delete(&t->node);
+
+    /* timers that already expired are only on the expired list */
+    if (t->slot != NET_TIMER_EXPIRED) {
+        DEBUG_ASSERT(wheel_count > 0);
+        wheel_count--;
+        slot_clear_if_empty(t->slot);
+    }
+}
+
+/* move everything in the given slot that is due by now to the expired list */
+static void wheel_expire_slot_locked(uint slot, lk_time_t now)
 {
-    net_timer_t *e;
-    list_for_every_entry(&net_timer_list, e, net_timer_t, node) {
-        if (TIME_GT(e->sched_time, t->sched_time)) {
-            list_add_before(&e->node, &t->node);
-            return;
+    net_timer_t *e, *temp;
+    list_for_every_entry_safe(&wheel[slot], e, temp, net_timer_t, node) {
+        if (TIME_LTE(e->sched_time, now)) {
+            list_delete(&e->node);
+            list_add_tail(&expired_list, &e->node);
+            e->slot = NET_TIMER_EXPIRED;
+            wheel_count--;
+        }
+    }
+    slot_clear_if_empty(slot);
+}
+
+static void wheel_advance_locked(lk_time_t now)
+{
+    if (wheel_count == 0)
+        return;
+
+    /* fell a whole revolution behind, sweep every slot once and catch up */
+    lk_time_t behind = now - wheel_time;
+    if (TIME_GTE(now, wheel_time) && behind >= NET_TIMER_SLOTS * NET_TIMER_TICK) {
+        for (uint i = 0; i < NET_TIMER_SLOTS; i++)
+            wheel_expire_slot_locked(i, now);
+        uint ticks = behind / NET_TIMER_TICK;
+        wheel_tick += ticks;
+        wheel_time += ticks * NET_TIMER_TICK;
+    }
+
+    while (TIME_GTE(now, wheel_time)) {
+        wheel_expire_slot_locked(wheel_tick & SLOT_MASK, now);
+
+        /* stay on a slot until its tick has completely gone by */
+        if (TIME_LT(now, wheel_time + NET_TIMER_TICK))
+            break;
+
+        wheel_tick++;
+        wheel_time += NET_TIMER_TICK;
+    }
+}
+
+/* how long the workers may sleep before something on the wheel is due */
+static lk_time_t wheel_next_delay_locked(lk_time_t now)
+{
+    if (wheel_count == 0)
+        return INFINITE_TIME;
+
+    uint ticks = next_occupied(wheel_tick);
+    if (ticks == 0) {
+        /* the current slot, wake for the earliest one in it or at the end of the tick */
+        lk_time_t delay = wheel_time + NET_TIMER_TICK - now;
+        net_timer_t *e;
+        list_for_every_entry(&wheel[wheel_tick & SLOT_MASK], e, net_timer_t, node) {
+            if (TIME_LT(e->sched_time - now, delay))
+                delay = e->sched_time - now;
         }
+        return delay;
     }
 
-    list_add_tail(&net_timer_list, &t->node);
+    lk_time_t when = wheel_time + ticks * NET_TIMER_TICK;
+    return TIME_GT(when, now) ? when - now : 0;
 }
 
 bool net_timer_set(net_timer_t *t, net_timer_callback_t cb, void *callback_args, lk_time_t delay)
 {
     bool newly_queued = true;
+    bool wake = false;
 
     lk_time_t now = current_time();
 
     mutex_acquire(&net_timer_lock);
 
     if (list_in_list(&t->node)) {
-        list_delete(&t->node);
+        wheel_remove_locked(t);
         newly_queued = false;
     }
 
@@ -71,11 +227,17 @@ bool net_timer_set(net_timer_t *t, net_timer_callback_t cb, void *callback_args,
     t->arg = callback_args;
     t->sched_time = now + delay;
 
-    add_to_queue(t);
+    wheel_insert_locked(t);
+
+    if (next_wake == INFINITE_TIME || TIME_LT(t->sched_time, next_wake)) {
+        next_wake = t->sched_time;
+        wake = true;
+    }
 
     mutex_release(&net_timer_lock);
 
-    event_signal(&net_timer_event, true);
+    if (wake)
+        event_signal(&net_timer_event, true);
 
     return newly_queued;
 }
@@ -87,7 +249,7 @@ bool net_timer_cancel(net_timer_t *t)
     mutex_acquire(&net_timer_lock);
 
     if (list_in_list(&t->node)) {
-        list_delete(&t->node);
+        wheel_remove_locked(t);
         was_queued = true;
     }
 
@@ -96,55 +258,52 @@ bool net_timer_cancel(net_timer_t *t)
     return was_queued;
 }
 
-/* returns the delay to the next event */
+/* runs expired timers until none are left, returns the delay to the next one */
 static lk_time_t net_timer_work_routine(void)
 {
-    lk_time_t now = current_time();
-    lk_time_t delay = INFINITE_TIME;
+    lk_time_t delay;
 
     mutex_acquire(&net_timer_lock);
 
     for (;;) {
-        net_timer_t *e;
-        e = list_peek_head_type(&net_timer_list, net_timer_t, node);
-        if (!e) {
-            delay = INFINITE_TIME;
-            goto done;
-        }
+        lk_time_t now = current_time();
 
-        if (TIME_GT(e->sched_time, now)) {
-            delay = e->sched_time - now;
-            goto done;
+        wheel_advance_locked(now);
+
+        net_timer_t *e = list_remove_head_type(&expired_list, net_timer_t, node);
+        if (!e) {
+            delay = wheel_next_delay_locked(now);
+            next_wake = (delay == INFINITE_TIME) ? INFINITE_TIME : now + delay;
+            break;
         }
 
-        list_delete(&e->node);
+        net_timer_callback_t cb = e->cb;
+        void *arg = e->arg;
+        bool more = !list_is_empty(&expired_list);
 
         mutex_release(&net_timer_lock);
 
-        LTRACEF("firing timer %p, cb %p, arg %p\n", e, e->cb, e->arg);
-        e->cb(e->arg);
+        /* hand the rest of the batch to another worker */
+        if (more && NET_TIMER_WORKERS > 1)
+            event_signal(&net_timer_event, false);
+
+        LTRACEF("firing timer %p, cb %p, arg %p\n", e, cb, arg);
+        cb(arg);
 
         mutex_acquire(&net_timer_lock);
     }
 
-done:
-    if (delay == INFINITE_TIME)
-        event_unsignal(&net_timer_event);
-
     mutex_release(&net_timer_lock);
 
     return delay;
 }
 
-int net_timer_work_thread(void *args)
+static int net_timer_work_thread(void *args)
 {
     for (;;) {
-        event_wait(&net_timer_event);
-
         lk_time_t delay = net_timer_work_routine();
-        if (delay != INFINITE_TIME) {
-            thread_sleep(MIN(delay, 100));
-        }
+
+        event_wait_timeout(&net_timer_event, delay);
     }
 
     return 0;
@@ -152,7 +311,14 @@ int net_timer_work_thread(void *args)
 
 void net_timer_init(void)
 {
-    thread_detach_and_resume(thread_create("net timer", &net_timer_work_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
-}
+    for (uint i = 0; i < NET_TIMER_SLOTS; i++)
+        list_initialize(&wheel[i]);
 
+    wheel_time = current_time();
 
+    for (uint i = 0; i < NET_TIMER_WORKERS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "net timer %u", i);
+        thread_detach_and_resume(thread_create(name, &net_timer_work_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+    }
+}
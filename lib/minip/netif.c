@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Network interfaces and the routing table.
+ *
+ * Interfaces sit on a list that only ever grows, so pointers to them stay good
+ * and the list can be walked without holding the lock. Routes live in a small
+ * fixed table, searched in full for the longest matching prefix. Routes of the
+ * same length tie, and the flow hash picks one of them, which is how traffic
+ * is spread over several interfaces into the same network.
+ */
+#include "minip-internal.h"
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/debug.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+
+#define LOCAL_TRACE 0
+
+/* routes added along with an interface address, replaced when it changes */
+#define ROUTE_FLAG_USED 0x1
+#define ROUTE_FLAG_AUTO 0x2
+
+typedef struct {
+    uint32_t dest;
+    uint32_t netmask;
+    uint32_t gateway;
+    minip_netif_t *netif;
+    uint flags;
+} route_entry_t;
+
+static struct list_node netif_list = LIST_INITIAL_VALUE(netif_list);
+static minip_netif_t *netif_default;
+static mutex_t netif_lock = MUTEX_INITIAL_VALUE(netif_lock);
+
+static route_entry_t route_table[MINIP_MAX_ROUTES];
+static spin_lock_t route_lock = SPIN_LOCK_INITIAL_VALUE;
+
+minip_netif_t *minip_netif_create(const char *name, const uint8_t mac[6], tx_func_t tx_func, void *tx_arg)
+{
+    DEBUG_ASSERT(name && mac && tx_func);
+
+    minip_netif_t *netif = calloc(1, sizeof(minip_netif_t));
+    if (!netif)
+        return NULL;
+
+    strlcpy(netif->name, name, sizeof(netif->name));
+    mac_addr_copy(netif->mac, mac);
+    netif->tx_func = tx_func;
+    netif->tx_arg = tx_arg;
+    netif->mtu = MINIP_DEFAULT_MTU;
+    netif->ip = IPV4_NONE;
+    netif->netmask = IPV4_NONE;
+    netif->broadcast = IPV4_BCAST;
+    netif->gateway = IPV4_NONE;
+
+    minip_core_init();
+
+    mutex_acquire(&netif_lock);
+    list_add_tail(&netif_list, &netif->node);
+    if (!netif_default)
+        netif_default = netif;
+    mutex_release(&netif_lock);
+
+    return netif;
+}
+
+minip_netif_t *minip_netif_find(const char *name)
+{
+    minip_netif_t *netif;
+    list_for_every_entry(&netif_list, netif, minip_netif_t, node) {
+        if (!strcmp(netif->name, name))
+            return netif;
+    }
+
+    return NULL;
+}
+
+minip_netif_t *minip_netif_default(void)
+{
+    return netif_default;
+}
+
+void minip_netif_set_tx_offloads(minip_netif_t *netif, uint offloads)
+{
+    netif->tx_offloads = offloads;
+}
+
+void minip_netif_set_tx_batch_handler(minip_netif_t *netif, tx_batch_func_t tx_batch_func)
+{
+    netif->tx_batch_func = tx_batch_func;
+}
+
+status_t minip_netif_set_mtu(minip_netif_t *netif, uint mtu)
+{
+    if (mtu < MINIP_MIN_MTU || mtu > MINIP_MAX_MTU)
+        return ERR_INVALID_ARGS;
+
+    netif->mtu = mtu;
+    return NO_ERROR;
+}
+
+static status_t route_add_flags(uint32_t dest, uint32_t netmask, uint32_t gateway,
+                                minip_netif_t *netif, uint flags)
+{
+    status_t err = ERR_NO_RESOURCES;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&route_lock, state);
+    for (uint i = 0; i < MINIP_MAX_ROUTES; i++) {
+        route_entry_t *e = &route_table[i];
+        if (e->flags & ROUTE_FLAG_USED)
+            continue;
+
+        e->dest = dest & netmask;
+        e->netmask = netmask;
+        e->gateway = gateway;
+        e->netif = netif;
+        e->flags = ROUTE_FLAG_USED | flags;
+        err = NO_ERROR;
+        break;
+    }
+    spin_unlock_irqrestore(&route_lock, state);
+
+    return err;
+}
+
+void minip_netif_set_addr(minip_netif_t *netif, uint32_t ip, uint32_t netmask, uint32_t gateway)
+{
+    /* drop the routes that came with the old address */
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&route_lock, state);
+    for (uint i = 0; i < MINIP_MAX_ROUTES; i++) {
+        route_entry_t *e = &route_table[i];
+        if ((e->flags & ROUTE_FLAG_AUTO) && e->netif == netif)
+            e->flags = 0;
+    }
+    spin_unlock_irqrestore(&route_lock, state);
+
+    netif->ip = ip;
+    netif->netmask = netmask;
+    netif->gateway = gateway;
+    netif->broadcast = (ip != IPV4_NONE && netmask != IPV4_NONE) ? ((ip & netmask) | ~netmask) : IPV4_BCAST;
+
+    if (ip == IPV4_NONE)
+        return;
+
+    if (netmask != IPV4_NONE && route_add_flags(ip, netmask, IPV4_NONE, netif, ROUTE_FLAG_AUTO) < 0)
+        printf("minip: no room for the %s subnet route\n", netif->name);
+    if (gateway != IPV4_NONE && route_add_flags(IPV4_NONE, IPV4_NONE, gateway, netif, ROUTE_FLAG_AUTO) < 0)
+        printf("minip: no room for the %s default route\n", netif->name);
+}
+
+status_t minip_route_add(uint32_t dest, uint32_t netmask, uint32_t gateway, minip_netif_t *netif)
+{
+    if (!netif)
+        return ERR_INVALID_ARGS;
+
+    return route_add_flags(dest, netmask, gateway, netif, 0);
+}
+
+status_t minip_route_del(uint32_t dest, uint32_t netmask, uint32_t gateway, minip_netif_t *netif)
+{
+    status_t err = ERR_NOT_FOUND;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&route_lock, state);
+    for (uint i = 0; i < MINIP_MAX_ROUTES; i++) {
+        route_entry_t *e = &route_table[i];
+        if ((e->flags & ROUTE_FLAG_USED) && e->dest == (dest & netmask) && e->netmask == netmask &&
+                e->gateway == gateway && e->netif == netif) {
+            e->flags = 0;
+            err = NO_ERROR;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&route_lock, state);
+
+    return err;
+}
+
+bool minip_route_lookup(uint32_t dest, uint32_t flow_hash, minip_route_t *route)
+{
+    if (dest == IPV4_BCAST) {
+        route->netif = netif_default;
+        route->nexthop = dest;
+        return route->netif != NULL;
+    }
+
+    int best_len = -1;
+    uint ties = 0;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&route_lock, state);
+
+    /* find the longest match and how many routes share it */
+    for (uint i = 0; i < MINIP_MAX_ROUTES; i++) {
+        const route_entry_t *e = &route_table[i];
+        if (!(e->flags & ROUTE_FLAG_USED) || (dest & e->netmask) != e->dest)
+            continue;
+
+        int len = __builtin_popcount(e->netmask);
+        if (len > best_len) {
+            best_len = len;
+            ties = 0;
+        }
+        if (len == best_len)
+            ties++;
+    }
+
+    /* then take the flow's pick of them */
+    const route_entry_t *found = NULL;
+    uint pick = ties ? flow_hash % ties : 0;
+    for (uint i = 0; ties && i < MINIP_MAX_ROUTES; i++) {
+        const route_entry_t *e = &route_table[i];
+        if (!(e->flags & ROUTE_FLAG_USED) || (dest & e->netmask) != e->dest ||
+                __builtin_popcount(e->netmask) != best_len)
+            continue;
+
+        if (pick-- == 0) {
+            found = e;
+            break;
+        }
+    }
+
+    if (found) {
+        route->netif = found->netif;
+        route->nexthop = (found->gateway != IPV4_NONE) ? found->gateway : dest;
+    }
+
+    spin_unlock_irqrestore(&route_lock, state);
+
+    LTRACEF("dest 0x%x -> %s nexthop 0x%x\n", dest, found ? route->netif->name : "none",
+            found ? route->nexthop : 0);
+
+    return found != NULL;
+}
+
+void minip_netif_tx(minip_netif_t *netif, pktbuf_t *p)
+{
+    netif->tx_packets++;
+    KEVLOG_NET_TX(netif, p->dlen);
+    if (netif->tx_func(p) < 0)
+        netif->tx_errors++;
+}
+
+void minip_netif_tx_list(minip_netif_t *netif, struct list_node *list)
+{
+    if (netif->tx_batch_func) {
+        uint count = list_length(list);
+#if WITH_KERNEL_EVLOG
+        pktbuf_t *p;
+        list_for_every_entry(list, p, pktbuf_t, list)
+            KEVLOG_NET_TX(netif, p->dlen);
+#endif
+        int sent = netif->tx_batch_func(list);
+        netif->tx_packets += count;
+        if (sent >= 0 && (uint)sent < count)
+            netif->tx_errors += count - sent;
+        return;
+    }
+
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(list, pktbuf_t, list)))
+        minip_netif_tx(netif, p);
+}
+
+void minip_netif_dump(void)
+{
+    minip_netif_t *netif;
+    list_for_every_entry(&netif_list, netif, minip_netif_t, node) {
+        printf("%s%s: mac %02x:%02x:%02x:%02x:%02x:%02x mtu %u offloads 0x%x\n",
+               netif->name, (netif == netif_default) ? " (default)" : "",
+               netif->mac[0], netif->mac[1], netif->mac[2], netif->mac[3], netif->mac[4], netif->mac[5],
+               netif->mtu, netif->tx_offloads);
+        printf("\tip %u.%u.%u.%u netmask %u.%u.%u.%u gateway %u.%u.%u.%u\n",
+               IPV4_SPLIT(netif->ip), IPV4_SPLIT(netif->netmask), IPV4_SPLIT(netif->gateway));
+        printf("\trx %u tx %u tx errors %u\n", netif->rx_packets, netif->tx_packets, netif->tx_errors);
+    }
+}
+
+void minip_route_dump(void)
+{
+    route_entry_t routes[MINIP_MAX_ROUTES];
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&route_lock, state);
+    memcpy(routes, route_table, sizeof(routes));
+    spin_unlock_irqrestore(&route_lock, state);
+
+    printf("%-18s %-16s %-16s %s\n", "destination", "netmask", "gateway", "interface");
+    for (uint i = 0; i < MINIP_MAX_ROUTES; i++) {
+        const route_entry_t *e = &routes[i];
+        if (!(e->flags & ROUTE_FLAG_USED))
+            continue;
+
+        char dest[16], mask[16], gw[16];
+        snprintf(dest, sizeof(dest), "%u.%u.%u.%u", IPV4_SPLIT(e->dest));
+        snprintf(mask, sizeof(mask), "%u.%u.%u.%u", IPV4_SPLIT(e->netmask));
+        snprintf(gw, sizeof(gw), "%u.%u.%u.%u", IPV4_SPLIT(e->gateway));
+        printf("%-18s %-16s %-16s %s%s\n", dest, mask, gw, e->netif->name,
+               (e->flags & ROUTE_FLAG_AUTO) ? "" : " (static)");
+    }
+}
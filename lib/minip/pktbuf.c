@@ -24,13 +24,13 @@
 
 #include <assert.h>
 #include <debug.h>
+#include <err.h>
 #include <trace.h>
 #include <printf.h>
 #include <string.h>
 #include <malloc.h>
 
 #include <kernel/thread.h>
-#include <kernel/semaphore.h>
 #include <kernel/spinlock.h>
 #include <lib/pktbuf.h>
 #include <lib/pool.h>
@@ -42,36 +42,142 @@
 
 #define LOCAL_TRACE 0
 
+/* each cpu keeps up to PKTBUF_CACHE_HIGH objects of its own, moving
+ * PKTBUF_CACHE_BATCH at a time to and from the shared pool */
+#ifndef PKTBUF_CACHE_HIGH
+#define PKTBUF_CACHE_HIGH 16
+#endif
+#ifndef PKTBUF_CACHE_BATCH
+#define PKTBUF_CACHE_BATCH 8
+#endif
+
+struct pktbuf_cache {
+    spin_lock_t lock;
+    uint count;
+    pool_t objects;
+} __ALIGNED(CACHE_LINE);
+
 static pool_t pktbuf_pool;
-static semaphore_t pktbuf_sem;
 static spin_lock_t lock;
+static struct pktbuf_cache pktbuf_caches[SMP_MAX_CPUS];
 
-
-/* Take an object from the pool of pktbuf objects to act as a header or buffer.  */
-static void *get_pool_object(void)
+/* move up to count objects from the shared pool to the list in batch */
+static uint pool_take_batch(pool_t *batch, uint count)
 {
-    pool_t *entry;
     spin_lock_saved_state_t state;
+    uint taken = 0;
 
-    sem_wait(&pktbuf_sem);
     spin_lock_irqsave(&lock, state);
-    entry = pool_alloc(&pktbuf_pool);
+    for (; taken < count; taken++) {
+        void *entry = pool_alloc(&pktbuf_pool);
+        if (!entry)
+            break;
+        pool_free(batch, entry);
+    }
     spin_unlock_irqrestore(&lock, state);
 
-    return (pktbuf_pool_object_t *) entry;
+    return taken;
+}
+
+/* give the objects other cpus are holding back to the shared pool, returns how many */
+static uint pktbuf_caches_drain(void)
+{
+    uint count = 0;
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct pktbuf_cache *pc = &pktbuf_caches[cpu];
+        spin_lock_saved_state_t state;
+
+        spin_lock_irqsave(&pc->lock, state);
+        spin_lock(&lock);
+        void *entry;
+        while ((entry = pool_alloc(&pc->objects))) {
+            pool_free(&pktbuf_pool, entry);
+            count++;
+        }
+        pc->count = 0;
+        spin_unlock(&lock);
+        spin_unlock_irqrestore(&pc->lock, state);
+    }
 
+    return count;
 }
 
-/* Return an object to thje pktbuf object pool. */
-static void free_pool_object(pktbuf_pool_object_t *entry, bool reschedule)
+/* Take an object from the pool of pktbuf objects to act as a header or buffer.
+ * Never blocks, so it is fine from interrupt context. Returns NULL when every
+ * object is in use. */
+static void *get_pool_object(void)
 {
-    DEBUG_ASSERT(entry);
     spin_lock_saved_state_t state;
+    struct pktbuf_cache *pc;
+    void *entry;
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    pc = &pktbuf_caches[arch_curr_cpu_num()];
+    spin_lock(&pc->lock);
+    entry = pool_alloc(&pc->objects);
+    if (entry)
+        pc->count--;
+    spin_unlock_restore(&pc->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (entry)
+        return entry;
+
+    /* the cache is empty, pull a batch out of the shared pool */
+    pool_t batch = { NULL };
+    uint count = pool_take_batch(&batch, PKTBUF_CACHE_BATCH);
+    if (count == 0 && pktbuf_caches_drain() > 0) {
+        /* other cpus were sitting on the last free objects */
+        count = pool_take_batch(&batch, PKTBUF_CACHE_BATCH);
+    }
 
-    spin_lock_irqsave(&lock, state);
-    pool_free(&pktbuf_pool, entry);
-    spin_unlock_irqrestore(&lock, state);
-    sem_post(&pktbuf_sem, reschedule);
+    entry = pool_alloc(&batch);
+    if (!entry) {
+        LTRACEF("out of pktbufs\n");
+        return NULL;
+    }
+
+    /* stash the rest. we may be on another cpu by now, which is fine */
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    pc = &pktbuf_caches[arch_curr_cpu_num()];
+    spin_lock(&pc->lock);
+    void *extra;
+    while ((extra = pool_alloc(&batch))) {
+        pool_free(&pc->objects, extra);
+        pc->count++;
+    }
+    spin_unlock_restore(&pc->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return entry;
+}
+
+/* Return an object to the pktbuf object pool. */
+static void free_pool_object(pktbuf_pool_object_t *entry)
+{
+    DEBUG_ASSERT(entry);
+    spin_lock_saved_state_t state;
+    struct pktbuf_cache *pc;
+    pool_t flush = { NULL };
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    pc = &pktbuf_caches[arch_curr_cpu_num()];
+    spin_lock(&pc->lock);
+    pool_free(&pc->objects, entry);
+    pc->count++;
+    if (pc->count > PKTBUF_CACHE_HIGH) {
+        for (uint i = 0; i < PKTBUF_CACHE_BATCH; i++)
+            pool_free(&flush, pool_alloc(&pc->objects));
+        pc->count -= PKTBUF_CACHE_BATCH;
+    }
+    spin_unlock_restore(&pc->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (flush.next_free) {
+        spin_lock_irqsave(&lock, state);
+        void *obj;
+        while ((obj = pool_alloc(&flush)))
+            pool_free(&pktbuf_pool, obj);
+        spin_unlock_irqrestore(&lock, state);
+    }
 }
 
 /* Callback used internally to place a pktbuf_pool_object back in the pool after
@@ -79,7 +185,7 @@ static void free_pool_object(pktbuf_pool_object_t *entry, bool reschedule)
  */
 static void free_pktbuf_buf_cb(void *buf, void *arg)
 {
-    free_pool_object((pktbuf_pool_object_t *)buf, true);
+    free_pool_object((pktbuf_pool_object_t *)buf);
 }
 
 /* Add a buffer to a pktbuf. Header space for prepending data is adjusted based on
@@ -128,7 +234,7 @@ pktbuf_t *pktbuf_alloc(void)
 
     buf = get_pool_object();
     if (!buf) {
-        free_pool_object((pktbuf_pool_object_t *)p, false);
+        free_pool_object((pktbuf_pool_object_t *)p);
         return NULL;
     }
 
@@ -140,8 +246,13 @@ pktbuf_t *pktbuf_alloc(void)
 pktbuf_t *pktbuf_alloc_empty(void)
 {
     pktbuf_t *p = (pktbuf_t *) get_pool_object();
+    if (!p) {
+        return NULL;
+    }
 
     p->flags = PKTBUF_FLAG_EOF;
+    p->next = NULL;
+    p->gso_size = 0;
     return p;
 }
 
@@ -149,12 +260,130 @@ int pktbuf_free(pktbuf_t *p, bool reschedule)
 {
     DEBUG_ASSERT(p);
 
-    if (p->cb) {
-        p->cb(p->buffer, p->cb_args);
+    int count = 0;
+    while (p) {
+        pktbuf_t *next = p->next;
+
+        if (p->cb) {
+            p->cb(p->buffer, p->cb_args);
+        }
+        free_pool_object((pktbuf_pool_object_t *)p);
+        count++;
+
+        p = next;
+    }
+
+    return count;
+}
+
+void pktbuf_append_part(pktbuf_t *p, pktbuf_t *part)
+{
+    DEBUG_ASSERT(p && part);
+    DEBUG_ASSERT(part->next == NULL);
+
+    while (p->next)
+        p = p->next;
+
+    p->flags &= ~PKTBUF_FLAG_EOF;
+    p->next = part;
+    part->flags |= PKTBUF_FLAG_EOF;
+}
+
+size_t pktbuf_total_len(const pktbuf_t *p)
+{
+    size_t len = 0;
+    for (; p; p = p->next)
+        len += p->dlen;
+
+    return len;
+}
+
+status_t pktbuf_linearize(pktbuf_t *p)
+{
+    DEBUG_ASSERT(p);
+
+    if (!p->next)
+        return NO_ERROR;
+
+    if (pktbuf_avail_tail(p) < pktbuf_total_len(p->next))
+        return ERR_TOO_BIG;
+
+    for (pktbuf_t *part = p->next; part; part = part->next)
+        pktbuf_append_data(p, part->data, part->dlen);
+
+    pktbuf_free(p->next, false);
+    p->next = NULL;
+    p->flags |= PKTBUF_FLAG_EOF;
+
+    return NO_ERROR;
+}
+
+pktbuf_t *pktbuf_alloc_chain(size_t len)
+{
+    pktbuf_t *p = pktbuf_alloc();
+    if (!p)
+        return NULL;
+
+    size_t chunk = MIN(len, (size_t)PKTBUF_MAX_DATA);
+    p->dlen = chunk;
+    len -= chunk;
+
+    while (len > 0) {
+        pktbuf_t *part = pktbuf_alloc();
+        if (!part) {
+            pktbuf_free(p, false);
+            return NULL;
+        }
+
+        /* later parts only hold payload, so the whole buffer is usable */
+        part->data = part->buffer;
+        chunk = MIN(len, (size_t)part->blen);
+        part->dlen = chunk;
+        len -= chunk;
+
+        pktbuf_append_part(p, part);
+    }
+
+    return p;
+}
+
+/* find the part holding byte offset, leaving offset relative to that part */
+static const pktbuf_t *pktbuf_seek(const pktbuf_t *p, size_t *offset)
+{
+    while (p && *offset >= p->dlen) {
+        *offset -= p->dlen;
+        p = p->next;
+    }
+
+    return p;
+}
+
+size_t pktbuf_copy_out(const pktbuf_t *p, size_t offset, void *buf, size_t len)
+{
+    size_t copied = 0;
+
+    for (p = pktbuf_seek(p, &offset); p && copied < len; p = p->next) {
+        size_t chunk = MIN(len - copied, p->dlen - offset);
+        memcpy((uint8_t *)buf + copied, p->data + offset, chunk);
+        copied += chunk;
+        offset = 0;
+    }
+
+    return copied;
+}
+
+size_t pktbuf_copy_in(pktbuf_t *p, size_t offset, const void *buf, size_t len)
+{
+    size_t copied = 0;
+
+    for (p = (pktbuf_t *)pktbuf_seek(p, &offset); p && copied < len; p = p->next) {
+        size_t chunk = MIN(len - copied, p->dlen - offset);
+        memcpy(p->data + offset, (const uint8_t *)buf + copied, chunk);
+        copied += chunk;
+        offset = 0;
     }
-    free_pool_object((pktbuf_pool_object_t *)p, false);
 
-    return 1;
+    return copied;
 }
 
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz)
@@ -244,7 +473,8 @@ static void pktbuf_init(uint level)
 #endif
 
     pool_init(&pktbuf_pool, sizeof(struct pktbuf_pool_object), CACHE_LINE, PKTBUF_POOL_SIZE, slab);
-    sem_init(&pktbuf_sem, PKTBUF_POOL_SIZE);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+        spin_lock_init(&pktbuf_caches[cpu].lock);
 }
 
 LK_INIT_HOOK(pktbuf, pktbuf_init, LK_INIT_LEVEL_THREADING);
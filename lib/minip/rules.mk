@@ -5,17 +5,21 @@ MODULE := $(LOCAL_DIR)
 MODULE_DEPS := \
 	lib/cbuf \
 	lib/iovec \
-	lib/pool
+	lib/pool \
+	lib/workqueue
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/arp.c \
 	$(LOCAL_DIR)/chksum.c \
 	$(LOCAL_DIR)/dhcp.c \
+	$(LOCAL_DIR)/frag.c \
 	$(LOCAL_DIR)/lk_console.c \
 	$(LOCAL_DIR)/minip.c \
 	$(LOCAL_DIR)/net_timer.c \
+	$(LOCAL_DIR)/netif.c \
 	$(LOCAL_DIR)/pktbuf.c \
 	$(LOCAL_DIR)/tcp.c \
+	$(LOCAL_DIR)/tcp_newreno.c \
 	$(LOCAL_DIR)/udp.c
 
 include make/module.mk
@@ -29,11 +29,16 @@
 #include <stdlib.h>
 #include <err.h>
 #include <string.h>
+#include <pow2.h>
 #include <sys/types.h>
 #include <lib/console.h>
 #include <lib/cbuf.h>
+#include <lib/slab.h>
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <lk/init.h>
 #include <arch/ops.h>
 #include <platform.h>
 
@@ -60,11 +65,40 @@ typedef struct tcp_pseudo_header {
     uint16_t tcp_length;
 } __PACKED tcp_pseudo_header_t;
 
-typedef struct tcp_mss_option {
-    uint8_t kind; /* 0x2 */
-    uint8_t len;  /* 0x4 */
-    uint16_t mss;
-} __PACKED tcp_mss_option_t;
+/* option kinds */
+#define TCP_OPT_END             0
+#define TCP_OPT_NOP             1
+#define TCP_OPT_MSS             2
+#define TCP_OPT_WSCALE          3
+#define TCP_OPT_SACK_PERMITTED  4
+#define TCP_OPT_SACK            5
+
+#define TCP_MAX_WSCALE          14  // RFC 7323
+#define TCP_MAX_SACK_BLOCKS     4   // what fits in the option space without timestamps
+#define TCP_TX_SACK_BLOCKS      3   // blocks we put in our own acks
+#define TCP_MAX_SACK_HOLES      8   // scoreboard entries remembered per socket
+
+typedef struct tcp_sack_block {
+    uint32_t start;
+    uint32_t end;   // one past the last byte
+} tcp_sack_block_t;
+
+/* the options we care about out of an incoming segment */
+typedef struct tcp_options {
+    uint16_t mss;           // 0 if not present
+    int wscale;             // -1 if not present
+    bool sack_permitted;
+    uint sack_count;
+    tcp_sack_block_t sack[TCP_MAX_SACK_BLOCKS];
+} tcp_options_t;
+
+/* out of order data held until the hole before it is filled */
+typedef struct tcp_ooo_segment {
+    struct list_node node;
+    uint32_t sequence;
+    uint32_t len;
+    uint8_t data[];
+} tcp_ooo_segment_t;
 
 typedef enum tcp_state {
     STATE_CLOSED,
@@ -91,6 +125,7 @@ typedef enum tcp_flags {
 
 typedef struct tcp_socket {
     struct list_node node;
+    struct tcp_bucket *bucket; // hash bucket the socket is linked into
 
     mutex_t lock;
     volatile int ref;
@@ -100,8 +135,12 @@ typedef struct tcp_socket {
     ipv4_addr remote_ip;
     uint16_t local_port;
     uint16_t remote_port;
+    minip_route_t route; // picked when the connection is set up
 
     uint32_t mss;
+    uint8_t  rx_wscale; // shift applied to the windows we advertise
+    uint8_t  tx_wscale; // shift applied to the windows they advertise
+    bool     sack_ok;   // they sent SACK permitted, so we may send them SACK blocks
 
     /* rx */
     uint32_t rx_win_size;
@@ -112,6 +151,8 @@ typedef struct tcp_socket {
     event_t  rx_event;
     int      rx_full_mss_count; // number of packets we have received in a row with a full mss
     net_timer_t ack_delay_timer;
+    struct list_node rx_ooo_list; // tcp_ooo_segment_t, sorted by sequence
+    uint32_t rx_ooo_bytes;
 
     /* tx */
     uint32_t tx_win_low;  // low side of the acked window
@@ -119,22 +160,121 @@ typedef struct tcp_socket {
     uint32_t tx_highest_seq; // highest sequence we have txed them
     uint8_t  *tx_buffer;  // our outgoing buffer
     uint32_t tx_buffer_size; // size of tx_buffer
-    uint32_t tx_buffer_offset; // offset into the buffer to append new data to
+    uint32_t tx_buffer_start; // where tx_win_low sits in the buffer
+    uint32_t tx_buffer_offset; // offset from tx_buffer_start to append new data to
+    volatile int tx_inplace; // segments the nic is sending straight out of tx_buffer
     event_t  tx_event;
     net_timer_t retransmit_timer;
-
-    /* listen accept */
-    semaphore_t accept_sem;
-    struct tcp_socket *accepted;
+    tcp_sack_block_t tx_sacked[TCP_MAX_SACK_HOLES]; // ranges past tx_win_low they told us they hold
+    uint     tx_sacked_count;
+    uint     tx_dup_acks;
+
+    /* congestion control */
+    const tcp_cc_ops_t *cc_ops;
+    tcp_cc_state_t cc;
+    bool     in_recovery;   // in fast recovery until recover is acked
+    uint32_t recover;
+    uint32_t rto_recover;   // after a timeout, partial acks below this resend the next segment
+
+    /* rtt estimation (RFC 6298), one segment timed at a time */
+    bool     rtt_timing;
+    uint32_t rtt_seq;       // timing ends when this is acked
+    lk_bigtime_t rtt_start;
+    uint32_t srtt;          // usecs
+    uint32_t rttvar;        // usecs
+    uint32_t rto;           // msecs
+
+    /* stats */
+    uint64_t segs_out;
+    uint64_t segs_retransmitted;
+    uint32_t fast_retransmits;
+    uint32_t timeouts;
+    uint32_t rtt_samples;
+
+    /* listen accept. the queue and counts are under tcp_accept_lock, the limits under lock */
+    semaphore_t accept_sem;         // counts accept_queue
+    struct list_node accept_queue;  // connections through the handshake, oldest first
+    uint     accept_queued;
+    uint     accept_half_open;      // children still in SYN_RCVD
+    uint     accept_backlog;
+    bool     syn_cookies;
+    bool     accept_closed;         // the listener is gone, new children are reset
+    struct list_node accept_node;   // child: on its listener's accept_queue
+    struct tcp_socket *listener;    // child: while half open, with a ref held on it
 
     net_timer_t time_wait_timer;
+
+    /* tcp_poll_entry_t of the wait sets watching us, under tcp_poll_lock */
+    struct list_node poll_entries;
 } tcp_socket_t;
 
+/* a socket's membership in a wait set */
+typedef struct tcp_poll_entry {
+    struct list_node set_node;      // on the wait set, under its lock
+    struct list_node socket_node;   // on the socket, under tcp_poll_lock
+    struct list_node ready_node;    // on the wait set's ready list, under tcp_poll_lock
+    bool on_ready;
+    tcp_socket_t *s;
+    struct tcp_waitset *ws;
+    uint events;
+    void *cookie;
+} tcp_poll_entry_t;
+
+struct tcp_waitset {
+    mutex_t lock;
+    event_t event;
+    struct list_node entries;
+    struct list_node ready;         // entries that may have something to report
+};
+
+/* taken from the driver's tx completions too, so a spinlock */
+static spin_lock_t tcp_poll_lock = SPIN_LOCK_INITIAL_VALUE;
+
 #define DEFAULT_MSS (1460)
 #define DEFAULT_RX_WINDOW_SIZE (8192)
 #define DEFAULT_TX_BUFFER_SIZE (8192)
+#define MIN_BUFFER_SIZE (4096)
+#define MAX_BUFFER_SIZE (1024*1024)
+
+#ifndef TCP_DEFAULT_BACKLOG
+#define TCP_DEFAULT_BACKLOG (8)
+#endif
+#define TCP_MAX_BACKLOG (256)
+
+/* whether new listen sockets answer with syn cookies once their half open queue is full */
+#ifndef TCP_SYN_COOKIES
+#define TCP_SYN_COOKIES (1)
+#endif
+
+/* how long a half open connection waits for the final ack of the handshake */
+#ifndef TCP_SYN_RCVD_TIMEOUT
+#define TCP_SYN_RCVD_TIMEOUT (3000)
+#endif
+
+/* protects every listen socket's accept queue. nests inside socket locks */
+static mutex_t tcp_accept_lock = MUTEX_INITIAL_VALUE(tcp_accept_lock);
+
+/* the mss we advertise, from the mtu. segments are only bigger than a buffer
+ * when the nic takes multi part packets, otherwise stick to the usual size */
+static uint32_t tcp_local_mss(const minip_netif_t *netif)
+{
+    uint32_t mss = netif->mtu - sizeof(struct ipv4_hdr) - sizeof(tcp_header_t);
+
+    if (!(netif->tx_offloads & MINIP_TX_OFFLOAD_SG))
+        mss = MIN(mss, DEFAULT_MSS);
+
+    return mss;
+}
 
-#define RETRANSMIT_TIMEOUT (50)
+#define FAST_RETRANSMIT_DUP_ACKS (3)
+
+/* largest segment handed to a nic doing segmentation offload, leaving room for the ip and tcp
+ * headers under the 64K ip datagram limit */
+#define TSO_MAX_SEGMENT (65535 - 20 - 60)
+
+#define INITIAL_RTO (250)
+#define MIN_RTO (50)
+#define MAX_RTO (60000)
 #define DELAYED_ACK_TIMEOUT (50)
 #define TIME_WAIT_TIMEOUT (60000) // 1 minute
 
@@ -145,8 +285,23 @@ typedef struct tcp_socket {
 #define SEQUENCE_GT(a, b) ((int32_t)((a) - (b)) > 0)
 #define SEQUENCE_LT(a, b) ((int32_t)((a) - (b)) < 0)
 
-static mutex_t tcp_socket_list_lock = MUTEX_INITIAL_VALUE(tcp_socket_list_lock);
-static struct list_node tcp_socket_list = LIST_INITIAL_VALUE(tcp_socket_list);
+/* sockets are hashed on (remote ip, remote port, local port), listening sockets on local port
+ * alone in a table of their own. both sizes must be powers of two. */
+#ifndef TCP_HASH_BUCKETS
+#define TCP_HASH_BUCKETS 64
+#endif
+#ifndef TCP_LISTEN_HASH_BUCKETS
+#define TCP_LISTEN_HASH_BUCKETS 16
+#endif
+
+typedef struct tcp_bucket {
+    mutex_t lock;
+    struct list_node list;
+} tcp_bucket_t;
+
+static tcp_bucket_t tcp_socket_table[TCP_HASH_BUCKETS];
+static tcp_bucket_t tcp_listen_table[TCP_LISTEN_HASH_BUCKETS];
+static slab_cache_t tcp_socket_cache;
 
 static bool tcp_debug = false;
 
@@ -154,17 +309,21 @@ static bool tcp_debug = false;
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port);
 static void add_socket_to_list(tcp_socket_t *s);
 static void remove_socket_from_list(tcp_socket_t *s);
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers);
-static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
-                         size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size);
+static tcp_socket_t *create_tcp_socket(uint32_t rx_size, uint32_t tx_size, bool alloc_buffers);
+static status_t tcp_send(const minip_route_t *route, ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
+                         size_t len, pktbuf_t *payload, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size);
 static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence);
 static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence);
 static void send_ack(tcp_socket_t *s);
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size);
+static void tcp_poll_wake(tcp_socket_t *s);
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, const tcp_options_t *opts);
+static ssize_t tcp_write_pending_data(tcp_socket_t *s);
+static ssize_t tcp_retransmit(tcp_socket_t *s);
 static void handle_retransmit_timeout(void *_s);
 static void handle_time_wait_timeout(void *_s);
 static void handle_delayed_ack_timeout(void *_s);
 static void tcp_remote_close(tcp_socket_t *s);
+static void tcp_half_open_done(tcp_socket_t *s, bool established);
 static void tcp_wakeup_waiters(tcp_socket_t *s);
 static void inc_socket_ref(tcp_socket_t *s);
 static bool dec_socket_ref(tcp_socket_t *s);
@@ -222,85 +381,131 @@ static void dump_socket(tcp_socket_t *s)
     printf("socket %p: state %d (%s), local 0x%x:%hu, remote 0x%x:%hu, ref %d\n",
            s, s->state, tcp_state_to_string(s->state),
            s->local_ip, s->local_port, s->remote_ip, s->remote_port, s->ref);
+    if (s->state == STATE_LISTEN) {
+        printf("\taccept: queued %u half open %u backlog %u syn cookies %d\n",
+               s->accept_queued, s->accept_half_open, s->accept_backlog, s->syn_cookies);
+    }
     if (s->state == STATE_ESTABLISHED || s->state == STATE_CLOSE_WAIT) {
         printf("\trx: wsize %u wlo %u whi %u (%u)\n",
                s->rx_win_size, s->rx_win_low, s->rx_win_high,
                s->rx_win_high - s->rx_win_low);
-        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u bufoff %u\n",
+        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u bufstart %u bufoff %u in place %d\n",
                s->tx_win_low, s->tx_win_high, s->tx_win_high - s->tx_win_low,
                s->tx_highest_seq, s->tx_highest_seq - s->tx_win_low,
-               s->tx_buffer_size, s->tx_buffer_offset);
+               s->tx_buffer_size, s->tx_buffer_start, s->tx_buffer_offset, s->tx_inplace);
+        printf("\tmss %u rx_wscale %u tx_wscale %u sack %d ooo bytes %u sacked blocks %u\n",
+               s->mss, s->rx_wscale, s->tx_wscale, s->sack_ok, s->rx_ooo_bytes, s->tx_sacked_count);
+        printf("\tcc %s: cwnd %u ssthresh %u%s, srtt %u.%03u ms rttvar %u.%03u ms rto %u ms (%u samples)\n",
+               s->cc_ops->name, s->cc.cwnd, s->cc.ssthresh, s->in_recovery ? " (recovery)" : "",
+               s->srtt / 1000, s->srtt % 1000, s->rttvar / 1000, s->rttvar % 1000, s->rto, s->rtt_samples);
+        printf("\tsegs out %llu retransmitted %llu, fast retransmits %u, timeouts %u\n",
+               s->segs_out, s->segs_retransmitted, s->fast_retransmits, s->timeouts);
     }
 }
 
+static inline uint tcp_hash(ipv4_addr remote_ip, uint16_t remote_port, uint16_t local_port)
+{
+    uint32_t h = remote_ip ^ ((uint32_t)remote_port << 16 | local_port);
+    return (h * 0x9e3779b1u) >> 16;
+}
+
+static tcp_bucket_t *socket_bucket(ipv4_addr remote_ip, uint16_t remote_port, uint16_t local_port)
+{
+    return &tcp_socket_table[tcp_hash(remote_ip, remote_port, local_port) & (TCP_HASH_BUCKETS - 1)];
+}
+
+static tcp_bucket_t *listen_bucket(uint16_t local_port)
+{
+    return &tcp_listen_table[tcp_hash(0, 0, local_port) & (TCP_LISTEN_HASH_BUCKETS - 1)];
+}
+
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port)
 {
     LTRACEF("remote ip 0x%x local ip 0x%x remote port %u local port %u\n", remote_ip, local_ip, remote_port, local_port);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    /* full match against the connected sockets first */
+    tcp_bucket_t *b = socket_bucket(remote_ip, remote_port, local_port);
+    tcp_socket_t *s;
 
-    /* XXX replace with something faster, like a hash table */
-    tcp_socket_t *s = NULL;
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_CLOSED || s->state == STATE_LISTEN) {
+    mutex_acquire(&b->lock);
+    list_for_every_entry(&b->list, s, tcp_socket_t, node) {
+        if (s->state == STATE_CLOSED)
             continue;
-        } else {
-            /* full check */
-            if (s->remote_ip == remote_ip &&
-                    s->local_ip == local_ip &&
-                    s->remote_port == remote_port &&
-                    s->local_port == local_port) {
-                goto out;
-            }
+        if (s->remote_ip == remote_ip &&
+                s->local_ip == local_ip &&
+                s->remote_port == remote_port &&
+                s->local_port == local_port) {
+            /* bump the ref before returning it */
+            inc_socket_ref(s);
+            mutex_release(&b->lock);
+            return s;
         }
     }
+    mutex_release(&b->lock);
 
-    /* walk the list again, looking only for listen matches */
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_LISTEN) {
-            /* sockets in listen state only care about local port */
-            if (s->local_port == local_port) {
-                goto out;
-            }
+    /* sockets in listen state only care about local port */
+    b = listen_bucket(local_port);
+
+    mutex_acquire(&b->lock);
+    list_for_every_entry(&b->list, s, tcp_socket_t, node) {
+        if (s->state == STATE_LISTEN && s->local_port == local_port) {
+            inc_socket_ref(s);
+            mutex_release(&b->lock);
+            return s;
         }
     }
+    mutex_release(&b->lock);
 
-    /* fall through case returns null */
-    s = NULL;
-
-out:
-    /* bump the ref before returning it */
-    if (s)
-        inc_socket_ref(s);
-
-    mutex_release(&tcp_socket_list_lock);
-
-    return s;
+    return NULL;
 }
 
 static void add_socket_to_list(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0); // we should have implicitly bumped the ref when creating the socket
+    DEBUG_ASSERT(!s->bucket);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    /* the addresses must be set up by now, they pick the bucket */
+    tcp_bucket_t *b;
+    if (s->state == STATE_LISTEN)
+        b = listen_bucket(s->local_port);
+    else
+        b = socket_bucket(s->remote_ip, s->remote_port, s->local_port);
 
-    list_add_head(&tcp_socket_list, &s->node);
+    mutex_acquire(&b->lock);
 
-    mutex_release(&tcp_socket_list_lock);
+    list_add_head(&b->list, &s->node);
+    s->bucket = b;
+
+    mutex_release(&b->lock);
 }
 
 static void remove_socket_from_list(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0);
+    DEBUG_ASSERT(s->bucket);
+
+    tcp_bucket_t *b = s->bucket;
 
-    mutex_acquire(&tcp_socket_list_lock);
+    mutex_acquire(&b->lock);
 
     DEBUG_ASSERT(list_in_list(&s->node));
     list_delete(&s->node);
+    s->bucket = NULL;
 
-    mutex_release(&tcp_socket_list_lock);
+    mutex_release(&b->lock);
+}
+
+static void dump_bucket_sockets(tcp_bucket_t *b)
+{
+    tcp_socket_t *s;
+
+    mutex_acquire(&b->lock);
+    list_for_every_entry(&b->list, s, tcp_socket_t, node) {
+        dump_socket(s);
+    }
+    mutex_release(&b->lock);
 }
 
 static void inc_socket_ref(tcp_socket_t *s)
@@ -321,13 +526,25 @@ static bool dec_socket_ref(tcp_socket_t *s)
 
     if (oldval == 1) {
         LTRACEF("destroying socket\n");
+
+        /* wait sets hold a ref for as long as they watch the socket */
+        DEBUG_ASSERT(list_is_empty(&s->poll_entries));
+
+        /* the nic may not be done with the last segments it was handed out of the tx buffer */
+        while (s->tx_inplace > 0)
+            thread_sleep(1);
+
         event_destroy(&s->tx_event);
         event_destroy(&s->rx_event);
 
+        tcp_ooo_segment_t *seg;
+        while ((seg = list_remove_head_type(&s->rx_ooo_list, tcp_ooo_segment_t, node)))
+            free(seg);
+
         free(s->rx_buffer_raw);
         free(s->tx_buffer);
 
-        free(s);
+        slab_free(&tcp_socket_cache, s);
     }
     return (oldval == 1);
 }
@@ -351,6 +568,378 @@ static void tcp_timer_cancel(tcp_socket_t *s, net_timer_t *timer)
         dec_socket_ref(s);
 }
 
+static void parse_options(const uint8_t *opt, size_t len, tcp_options_t *o)
+{
+    memset(o, 0, sizeof(*o));
+    o->wscale = -1;
+
+    while (len > 0) {
+        uint8_t kind = opt[0];
+        if (kind == TCP_OPT_END)
+            break;
+        if (kind == TCP_OPT_NOP) {
+            opt++;
+            len--;
+            continue;
+        }
+
+        if (len < 2 || opt[1] < 2 || opt[1] > len)
+            break;
+        uint8_t optlen = opt[1];
+
+        switch (kind) {
+            case TCP_OPT_MSS:
+                if (optlen == 4)
+                    o->mss = (opt[2] << 8) | opt[3];
+                break;
+            case TCP_OPT_WSCALE:
+                if (optlen == 3)
+                    o->wscale = MIN(opt[2], TCP_MAX_WSCALE);
+                break;
+            case TCP_OPT_SACK_PERMITTED:
+                if (optlen == 2)
+                    o->sack_permitted = true;
+                break;
+            case TCP_OPT_SACK:
+                for (uint i = 2; i + 8 <= optlen && o->sack_count < TCP_MAX_SACK_BLOCKS; i += 8) {
+                    tcp_sack_block_t *b = &o->sack[o->sack_count++];
+                    memcpy(&b->start, opt + i, 4);
+                    memcpy(&b->end, opt + i + 4, 4);
+                    b->start = ntohl(b->start);
+                    b->end = ntohl(b->end);
+                }
+                break;
+        }
+
+        opt += optlen;
+        len -= optlen;
+    }
+}
+
+/* smallest shift that lets the whole window fit in the 16 bit header field */
+static uint8_t window_scale_for(uint32_t win_size)
+{
+    uint8_t shift = 0;
+    while (shift < TCP_MAX_WSCALE && (win_size >> shift) > 0xffff)
+        shift++;
+    return shift;
+}
+
+/*
+ * syn cookies. when a listen socket's half open queue is full the SYN-ACK carries the
+ * connection in its sequence number instead of a socket: the top 5 bits are a 64 second
+ * counter, the next 3 index syn_cookie_mss, the rest are a hash of the addresses, ports,
+ * their sequence, the counter and a secret. window scale and SACK don't survive the trip, so
+ * those connections go without.
+ */
+static const uint16_t syn_cookie_mss[8] = { 536, 1024, 1220, 1360, 1440, 1460, 4036, 8960 };
+static uint32_t syn_cookie_secret;
+
+static uint32_t syn_cookie_hash(ipv4_addr src_ip, ipv4_addr dst_ip, uint16_t src_port, uint16_t dst_port,
+                                uint32_t seq, uint32_t count)
+{
+    uint32_t h = syn_cookie_secret ^ (count * 0x9e3779b1u);
+
+    h = (h ^ src_ip) * 0x85ebca6bu;
+    h ^= h >> 13;
+    h = (h ^ dst_ip) * 0xc2b2ae35u;
+    h ^= h >> 16;
+    h = (h ^ (((uint32_t)src_port << 16) | dst_port)) * 0x85ebca6bu;
+    h ^= h >> 13;
+    h = (h ^ seq) * 0xc2b2ae35u;
+    h ^= h >> 16;
+
+    return h & 0xffffff;
+}
+
+static uint32_t syn_cookie_make(ipv4_addr src_ip, ipv4_addr dst_ip, uint16_t src_port, uint16_t dst_port,
+                                uint32_t seq, uint32_t mss)
+{
+    uint32_t count = current_time() / 64000;
+
+    uint index = 0;
+    for (uint i = 1; i < countof(syn_cookie_mss); i++) {
+        if (syn_cookie_mss[i] <= mss)
+            index = i;
+    }
+
+    return ((count & 0x1f) << 27) | (index << 24) |
+           syn_cookie_hash(src_ip, dst_ip, src_port, dst_port, seq, count);
+}
+
+/* the mss a cookie was made with, or 0 if it isn't one of ours from the last two counter ticks */
+static uint32_t syn_cookie_check(ipv4_addr src_ip, ipv4_addr dst_ip, uint16_t src_port, uint16_t dst_port,
+                                 uint32_t seq, uint32_t cookie)
+{
+    uint32_t now = current_time() / 64000;
+
+    for (uint32_t count = now - 1; count != now + 1; count++) {
+        if ((cookie >> 27) != (count & 0x1f))
+            continue;
+        if ((cookie & 0xffffff) == syn_cookie_hash(src_ip, dst_ip, src_port, dst_port, seq, count))
+            return syn_cookie_mss[(cookie >> 24) & 0x7];
+    }
+
+    return 0;
+}
+
+/* a new connection off listen socket s, in the socket table and returned locked */
+static tcp_socket_t *tcp_listen_new_child(tcp_socket_t *s, ipv4_addr src_ip, ipv4_addr dst_ip,
+                                          const tcp_header_t *header, const minip_route_t *route,
+                                          tcp_state_t state, uint32_t rx_seq, uint32_t mss)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    /* with the buffer sizes set on the listening one */
+    tcp_socket_t *child = create_tcp_socket(s->rx_win_size, s->tx_buffer_size, true);
+    if (!child)
+        return NULL;
+
+    /* set it up */
+    child->local_ip = dst_ip;
+    child->local_port = s->local_port;
+    child->remote_ip = src_ip;
+    child->remote_port = header->source_port;
+    child->route = *route;
+    child->mss = mss;
+    child->state = state;
+
+    child->cc.mss = child->mss;
+    child->cc_ops->init(&child->cc);
+
+    /* remember their sequence */
+    child->rx_win_low = rx_seq;
+    child->rx_win_high = child->rx_win_low + child->rx_win_size - 1;
+
+    mutex_acquire(&child->lock);
+
+    add_socket_to_list(child);
+
+    return child;
+}
+
+/* put a connection that finished the handshake on its listener's accept queue.
+ * returns false if the listener has been closed. */
+static bool tcp_accept_queue(tcp_socket_t *l, tcp_socket_t *child)
+{
+    mutex_acquire(&tcp_accept_lock);
+    bool closed = l->accept_closed;
+    if (!closed) {
+        list_add_tail(&l->accept_queue, &child->accept_node);
+        l->accept_queued++;
+    }
+    mutex_release(&tcp_accept_lock);
+
+    if (closed)
+        return false;
+
+    /* wake anyone up that is waiting to accept */
+    sem_post(&l->accept_sem, true);
+    tcp_poll_wake(l);
+
+    return true;
+}
+
+/* a connection that nobody is going to accept: out of the table, and drop the ref it was made with */
+static void tcp_drop_unaccepted(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    if (s->state == STATE_ESTABLISHED || s->state == STATE_CLOSE_WAIT)
+        tcp_socket_send(s, NULL, 0, PKT_RST, NULL, 0, s->tx_win_low);
+
+    s->state = STATE_CLOSED;
+
+    tcp_timer_cancel(s, &s->retransmit_timer);
+    tcp_timer_cancel(s, &s->ack_delay_timer);
+
+    remove_socket_from_list(s);
+    dec_socket_ref(s);
+}
+
+/* a half open connection got the final ack, or died waiting for it */
+static void tcp_half_open_done(tcp_socket_t *s, bool established)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    tcp_socket_t *l = s->listener;
+    if (!l)
+        return;
+    s->listener = NULL;
+
+    mutex_acquire(&tcp_accept_lock);
+    DEBUG_ASSERT(l->accept_half_open > 0);
+    l->accept_half_open--;
+    mutex_release(&tcp_accept_lock);
+
+    if (!established || !tcp_accept_queue(l, s))
+        tcp_drop_unaccepted(s);
+
+    dec_socket_ref(l);
+}
+
+static void handle_syn_rcvd_timeout(void *_s)
+{
+    tcp_socket_t *s = _s;
+
+    LTRACEF("s %p\n", s);
+
+    mutex_acquire(&s->lock);
+    if (s->state == STATE_SYN_RCVD)
+        tcp_half_open_done(s, false);
+    mutex_release(&s->lock);
+
+    dec_socket_ref(s);
+}
+
+/* a SYN to listen socket s: answer it with a half open connection, or a cookie if the queue is full */
+static void tcp_listen_syn(tcp_socket_t *s, ipv4_addr src_ip, ipv4_addr dst_ip,
+                           const tcp_header_t *header, const tcp_options_t *opts)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    /* the reply goes back the way the flow hashes to */
+    minip_route_t route;
+    if (!minip_route_lookup(src_ip, minip_flow_hash(src_ip, header->source_port, header->dest_port), &route))
+        return;
+
+    uint32_t mss = tcp_local_mss(route.netif);
+    if (opts->mss)
+        mss = MIN(mss, opts->mss);
+
+    /* see if we have a slot to accept. with the accept queue full there is nothing to do but
+     * let them retry, with only the half open one full a cookie stands in for the socket */
+    mutex_acquire(&tcp_accept_lock);
+    bool drop = s->accept_queued >= s->accept_backlog;
+    bool cookie = s->accept_half_open >= s->accept_backlog;
+    if (cookie && !s->syn_cookies)
+        drop = true;
+    if (!drop && !cookie)
+        s->accept_half_open++;
+    mutex_release(&tcp_accept_lock);
+
+    if (drop)
+        return;
+
+    uint8_t syn_options[12];
+    size_t syn_options_len = 0;
+
+    if (cookie) {
+        uint32_t seq = syn_cookie_make(src_ip, dst_ip, header->source_port, header->dest_port,
+                                       header->seq_num, mss);
+        uint32_t cookie_mss = syn_cookie_mss[(seq >> 24) & 0x7];
+
+        syn_options[syn_options_len++] = TCP_OPT_MSS;
+        syn_options[syn_options_len++] = 4;
+        syn_options[syn_options_len++] = cookie_mss >> 8;
+        syn_options[syn_options_len++] = cookie_mss & 0xff;
+
+        tcp_send(&route, src_ip, header->source_port, dst_ip, header->dest_port, NULL, 0, NULL,
+                 PKT_ACK|PKT_SYN, syn_options, syn_options_len, header->seq_num + 1, seq,
+                 MIN(s->rx_win_size, 0xffff));
+        return;
+    }
+
+    tcp_socket_t *accept_socket = tcp_listen_new_child(s, src_ip, dst_ip, header, &route,
+                                                       STATE_SYN_RCVD, header->seq_num + 1, mss);
+    if (!accept_socket) {
+        mutex_acquire(&tcp_accept_lock);
+        s->accept_half_open--;
+        mutex_release(&tcp_accept_lock);
+        return;
+    }
+
+    /* it goes on our accept queue once the handshake is done */
+    inc_socket_ref(s);
+    accept_socket->listener = s;
+
+    /* pick up what they offered. window scaling is only used if both sides ask for it */
+    if (opts->wscale >= 0) {
+        accept_socket->tx_wscale = opts->wscale;
+        accept_socket->rx_wscale = window_scale_for(accept_socket->rx_win_size);
+    }
+    accept_socket->sack_ok = opts->sack_permitted;
+
+    /* set up the options for sending back: our mss and, if they asked, window scale
+     * and SACK permitted. we always accept SACK blocks. */
+    syn_options[syn_options_len++] = TCP_OPT_MSS;
+    syn_options[syn_options_len++] = 4;
+    syn_options[syn_options_len++] = tcp_local_mss(route.netif) >> 8;
+    syn_options[syn_options_len++] = tcp_local_mss(route.netif) & 0xff;
+    if (opts->wscale >= 0) {
+        syn_options[syn_options_len++] = TCP_OPT_NOP;
+        syn_options[syn_options_len++] = TCP_OPT_WSCALE;
+        syn_options[syn_options_len++] = 3;
+        syn_options[syn_options_len++] = accept_socket->rx_wscale;
+    }
+    if (opts->sack_permitted) {
+        syn_options[syn_options_len++] = TCP_OPT_NOP;
+        syn_options[syn_options_len++] = TCP_OPT_NOP;
+        syn_options[syn_options_len++] = TCP_OPT_SACK_PERMITTED;
+        syn_options[syn_options_len++] = 2;
+    }
+
+    /* send a response */
+    tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, syn_options, syn_options_len,
+                    accept_socket->tx_win_low);
+
+    /* SYN consumed a sequence */
+    accept_socket->tx_win_low++;
+
+    /* give up on it if the handshake doesn't finish */
+    tcp_timer_set(accept_socket, &accept_socket->retransmit_timer, &handle_syn_rcvd_timeout,
+                  TCP_SYN_RCVD_TIMEOUT);
+
+    mutex_release(&accept_socket->lock);
+}
+
+/* an ACK to listen socket s that may finish a cookie handshake. returns false if it didn't */
+static bool tcp_listen_cookie_ack(tcp_socket_t *s, ipv4_addr src_ip, ipv4_addr dst_ip,
+                                  const tcp_header_t *header, pktbuf_t *p)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    if (!s->syn_cookies)
+        return false;
+
+    uint32_t mss = syn_cookie_check(src_ip, dst_ip, header->source_port, header->dest_port,
+                                    header->seq_num - 1, header->ack_num - 1);
+    if (mss == 0)
+        return false;
+
+    minip_route_t route;
+    if (!minip_route_lookup(src_ip, minip_flow_hash(src_ip, header->source_port, header->dest_port), &route))
+        return true;
+
+    mutex_acquire(&tcp_accept_lock);
+    bool full = s->accept_queued >= s->accept_backlog;
+    mutex_release(&tcp_accept_lock);
+    if (full)
+        return true;
+
+    tcp_socket_t *accept_socket = tcp_listen_new_child(s, src_ip, dst_ip, header, &route,
+                                                       STATE_ESTABLISHED, header->seq_num,
+                                                       MIN(mss, tcp_local_mss(route.netif)));
+    if (!accept_socket)
+        return true;
+
+    /* the SYN-ACK they're acking was our sequence */
+    accept_socket->tx_win_low = header->ack_num;
+    accept_socket->tx_win_high = accept_socket->tx_win_low + header->win_size;
+    accept_socket->tx_highest_seq = accept_socket->tx_win_low;
+    accept_socket->rto_recover = accept_socket->tx_win_low;
+
+    if (p->dlen > 0)
+        handle_data(accept_socket, p->data, p->dlen, header->seq_num);
+
+    if (!tcp_accept_queue(s, accept_socket))
+        tcp_drop_unaccepted(accept_socket);
+
+    mutex_release(&accept_socket->lock);
+
+    return true;
+}
+
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 {
     if (unlikely(tcp_debug))
@@ -368,7 +957,7 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 
     /* compute the actual header length (+ options) */
     size_t header_len = ((ntohs(header->length_flags) >> 12) & 0xf) * 4;
-    if (p->dlen < header_len) {
+    if (header_len < sizeof(tcp_header_t) || p->dlen < header_len) {
         TRACEF("REJECT: packet too large for buffer\n");
         return;
     }
@@ -405,6 +994,9 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
     size_t data_len = p->dlen - header_len;
     uint32_t highest_sequence = header->seq_num + ((data_len > 0) ? (data_len - 1) : 0);
 
+    tcp_options_t opts;
+    parse_options((const uint8_t *)(header + 1), header_len - sizeof(tcp_header_t), &opts);
+
     /* see if it matches a socket we have */
     tcp_socket_t *s = lookup_socket(src_ip, dst_ip, header->source_port, header->dest_port);
     if (!s) {
@@ -434,57 +1026,20 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             goto send_reset;
 
             /* passive connect states */
-        case STATE_LISTEN: {
+        case STATE_LISTEN:
             /* we're in listen and they want to talk to us */
-            if (!(packet_flags & PKT_SYN)) {
-                /* not a SYN, send RST */
-                goto send_reset;
+            if (packet_flags & PKT_SYN) {
+                tcp_listen_syn(s, src_ip, dst_ip, header, &opts);
+                break;
             }
 
-            /* see if we have a slot to accept */
-            if (s->accepted != NULL)
-                goto done;
-
-            /* make a new accept socket */
-            tcp_socket_t *accept_socket = create_tcp_socket(true);
-            if (!accept_socket)
-                goto done;
-
-            /* set it up */
-            accept_socket->local_ip = minip_get_ipaddr();
-            accept_socket->local_port = s->local_port;
-            accept_socket->remote_ip = src_ip;
-            accept_socket->remote_port = header->source_port;
-            accept_socket->state = STATE_SYN_RCVD;
-
-            mutex_acquire(&accept_socket->lock);
-
-            add_socket_to_list(accept_socket);
-
-            /* remember their sequence */
-            accept_socket->rx_win_low = header->seq_num + 1;
-            accept_socket->rx_win_high = accept_socket->rx_win_low + accept_socket->rx_win_size - 1;
-
-            /* save this socket and wake anyone up that is waiting to accept */
-            s->accepted = accept_socket;
-            sem_post(&s->accept_sem, true);
-
-            /* set up a mss option for sending back */
-            tcp_mss_option_t mss_option;
-            mss_option.kind = 0x2;
-            mss_option.len = 0x4;
-            mss_option.mss = ntohs(s->mss); // XXX make sure we fit in their mss
-
-            /* send a response */
-            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, &mss_option, sizeof(mss_option),
-                            accept_socket->tx_win_low);
+            /* the end of a handshake we answered with a syn cookie */
+            if ((packet_flags & PKT_ACK) && tcp_listen_cookie_ack(s, src_ip, dst_ip, header, p))
+                break;
 
-            /* SYN consumed a sequence */
-            accept_socket->tx_win_low++;
+            /* anything else, send RST */
+            goto send_reset;
 
-            mutex_release(&accept_socket->lock);
-            break;
-        }
         case STATE_SYN_RCVD:
             if (packet_flags & PKT_SYN) {
                 /* they must have not seen our ack of their original syn, retransmit */
@@ -498,10 +1053,16 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
                     goto send_reset;
                 }
 
-                s->tx_win_high = s->tx_win_low + header->win_size;
+                s->tx_win_high = s->tx_win_low + ((uint32_t)header->win_size << s->tx_wscale);
                 s->tx_highest_seq = s->tx_win_low;
+                s->rto_recover = s->tx_win_low;
 
                 s->state = STATE_ESTABLISHED;
+                tcp_poll_wake(s);
+
+                /* off to the accept queue */
+                tcp_timer_cancel(s, &s->retransmit_timer);
+                tcp_half_open_done(s, true);
             } else {
                 goto send_reset;
             }
@@ -511,7 +1072,7 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         case STATE_ESTABLISHED:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, (uint32_t)header->win_size << s->tx_wscale, &opts);
             }
 
             if (data_len > 0) {
@@ -531,13 +1092,14 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 
                 /* wake up any read waiters */
                 event_signal(&s->rx_event, true);
+                tcp_poll_wake(s);
             }
             break;
 
         case STATE_CLOSE_WAIT:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, (uint32_t)header->win_size << s->tx_wscale, &opts);
             }
             if (packet_flags & PKT_FIN) {
                 /* they must have missed our ack, ack them again */
@@ -608,10 +1170,75 @@ send_reset:
     }
 
     LTRACEF("SEND RST\n");
-    if (!(packet_flags & PKT_RST)) {
-        tcp_send(src_ip, header->source_port, dst_ip, header->dest_port,
-                 NULL, 0, PKT_RST, NULL, 0, 0, header->ack_num, 0);
+    minip_route_t route;
+    if (!(packet_flags & PKT_RST) &&
+            minip_route_lookup(src_ip, minip_flow_hash(src_ip, header->source_port, header->dest_port), &route)) {
+        tcp_send(&route, src_ip, header->source_port, dst_ip, header->dest_port,
+                 NULL, 0, NULL, PKT_RST, NULL, 0, 0, header->ack_num, 0);
+    }
+}
+
+/* move whatever out of order data the new rx_win_low has reached into the receive buffer */
+static size_t drain_ooo_segments(tcp_socket_t *s)
+{
+    size_t total = 0;
+    tcp_ooo_segment_t *seg;
+
+    while ((seg = list_peek_head_type(&s->rx_ooo_list, tcp_ooo_segment_t, node))) {
+        if (SEQUENCE_GT(seg->sequence, s->rx_win_low))
+            break;
+
+        uint32_t offset = s->rx_win_low - seg->sequence;
+        if (offset < seg->len) {
+            size_t copy_len = MIN(s->rx_win_high - s->rx_win_low, seg->len - offset);
+            if (copy_len < seg->len - offset)
+                break; // no room for all of it yet, leave it queued
+
+            cbuf_write(&s->rx_buffer, seg->data + offset, copy_len, false);
+            s->rx_win_low += copy_len;
+            total += copy_len;
+        }
+
+        list_delete(&seg->node);
+        s->rx_ooo_bytes -= seg->len;
+        free(seg);
+    }
+
+    return total;
+}
+
+/* hang on to a segment past a hole, so only the hole needs to be resent */
+static void queue_ooo_segment(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence)
+{
+    uint32_t sequence_top = sequence + len - 1;
+
+    /* only if it is entirely in the window, and the window isn't already spoken for */
+    if (SEQUENCE_LTE(sequence, s->rx_win_low) || SEQUENCE_GT(sequence_top, s->rx_win_high))
+        return;
+    if (s->rx_ooo_bytes + len > s->rx_win_size)
+        return;
+
+    /* find our spot, dropping anything that overlaps what we already hold */
+    tcp_ooo_segment_t *seg;
+    struct list_node *prev = &s->rx_ooo_list;
+    list_for_every_entry(&s->rx_ooo_list, seg, tcp_ooo_segment_t, node) {
+        uint32_t seg_top = seg->sequence + seg->len - 1;
+        if (SEQUENCE_LT(sequence_top, seg->sequence))
+            break;
+        if (SEQUENCE_LTE(sequence, seg_top))
+            return;
+        prev = &seg->node;
     }
+
+    seg = malloc(sizeof(tcp_ooo_segment_t) + len);
+    if (!seg)
+        return;
+
+    seg->sequence = sequence;
+    seg->len = len;
+    memcpy(seg->data, data, len);
+    list_add_after(prev, &seg->node);
+    s->rx_ooo_bytes += len;
 }
 
 static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence)
@@ -640,7 +1267,13 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
         s->rx_win_low += copy_len;
 
         cbuf_write(&s->rx_buffer, (uint8_t *)data + offset, copy_len, false);
+
+        /* it may have filled a hole */
+        bool filled_hole = !list_is_empty(&s->rx_ooo_list);
+        copy_len += drain_ooo_segments(s);
+
         event_signal(&s->rx_event, true);
+        tcp_poll_wake(s);
 
         /* keep a counter if they've been sending a full mss */
         if (copy_len >= s->mss) {
@@ -649,8 +1282,9 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
             s->rx_full_mss_count = 0;
         }
 
-        /* immediately ack if we're more than halfway into our buffer or they've sent 2 or more full packets */
-        if (s->rx_full_mss_count >= 2 ||
+        /* immediately ack if we're more than halfway into our buffer, they've sent 2 or more full
+         * packets or we just got past a hole */
+        if (s->rx_full_mss_count >= 2 || filled_hole ||
                 (int)(s->rx_win_low + s->rx_win_size - s->rx_win_high) > (int)s->rx_win_size / 2) {
             send_ack(s);
             s->rx_full_mss_count = 0;
@@ -658,12 +1292,42 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
             tcp_timer_set(s, &s->ack_delay_timer, &handle_delayed_ack_timeout, DELAYED_ACK_TIMEOUT);
         }
     } else {
-        // either out of order or completely out of our window, drop
-        // duplicately ack the last thing we really got
+        // either out of order or completely out of our window. hold on to it if it is past
+        // a hole, and duplicately ack the last thing we really got
+        queue_ooo_segment(s, data, len, sequence);
         send_ack(s);
     }
 }
 
+/* the nic is done with a segment it sent out of the tx buffer, possibly in interrupt context */
+static void tcp_tx_inplace_done(void *buf, void *arg)
+{
+    tcp_socket_t *s = arg;
+
+    /* a writer may be waiting to slide the buffer back */
+    if (atomic_add(&s->tx_inplace, -1) == 1) {
+        event_signal(&s->tx_event, false);
+        tcp_poll_wake(s);
+    }
+}
+
+/* move the unacked data back to the start of the tx buffer, unless the nic may still be
+ * reading some of the space it would move through */
+static bool tcp_compact_tx_buffer(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    if (s->tx_buffer_start == 0)
+        return true;
+    if (s->tx_inplace > 0)
+        return false;
+
+    memmove(s->tx_buffer, s->tx_buffer + s->tx_buffer_start, s->tx_buffer_offset);
+    s->tx_buffer_start = 0;
+
+    return true;
+}
+
 static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags,
                                 const void *options, size_t options_length, uint32_t sequence)
 {
@@ -679,22 +1343,46 @@ static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, t
     LTRACEF("rx_win_low %u rx_win_size %u read_buf_len %zu, new win high %u\n",
             s->rx_win_low, s->rx_win_size, cbuf_space_used(&s->rx_buffer), rx_win_high);
 
-    uint16_t win_size;
+    uint32_t win;
     if (SEQUENCE_GTE(rx_win_high, s->rx_win_high)) {
         s->rx_win_high = rx_win_high;
-        win_size = rx_win_high - s->rx_win_low;
+        win = rx_win_high - s->rx_win_low;
     } else {
         // the window size has shrunk, but we can't move the
         // right edge of the window backwards
-        win_size = s->rx_win_high - s->rx_win_low;
+        win = s->rx_win_high - s->rx_win_low;
     }
 
+    // the window in a SYN is never scaled
+    if (!(flags & PKT_SYN))
+        win >>= s->rx_wscale;
+    uint16_t win_size = MIN(win, 0xffff);
+
     // we are piggybacking a pending ACK, so clear the delayed ACK timer
     if (flags & PKT_ACK) {
         tcp_timer_cancel(s, &s->ack_delay_timer);
     }
 
-    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, data, len, flags,
+    // if the nic can take it, send data out of the tx buffer where it is instead of copying it
+    pktbuf_t *payload = NULL;
+    if (len > 0 && (s->route.netif->tx_offloads & MINIP_TX_OFFLOAD_SG) && (const uint8_t *)data >= s->tx_buffer &&
+            (const uint8_t *)data + len <= s->tx_buffer + s->tx_buffer_size) {
+        payload = pktbuf_alloc_empty();
+        if (!payload)
+            return ERR_NO_MEMORY; // out of pktbufs, the retransmit timer will get it out later
+        pktbuf_add_buffer(payload, (uint8_t *)data, len, 0, 0, &tcp_tx_inplace_done, s);
+        payload->dlen = len;
+        atomic_add(&s->tx_inplace, 1);
+
+        // anything longer than a segment is left to the nic to cut up
+        if (len > s->mss)
+            payload->gso_size = s->mss;
+
+        data = NULL;
+        len = 0;
+    }
+
+    status_t err = tcp_send(&s->route, s->remote_ip, s->remote_port, s->local_ip, s->local_port, data, len, payload, flags,
                             options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size);
 
     return err;
@@ -708,19 +1396,58 @@ static void send_ack(tcp_socket_t *s)
     if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT && s->state != STATE_FIN_WAIT_2)
         return;
 
-    tcp_socket_send(s, NULL, 0, PKT_ACK, NULL, 0, s->tx_win_low);
+    /* tell them about the out of order data we are holding, merging adjacent segments */
+    uint8_t options[4 + TCP_TX_SACK_BLOCKS * 8];
+    size_t options_len = 0;
+
+    if (s->sack_ok && !list_is_empty(&s->rx_ooo_list)) {
+        uint blocks = 0;
+        uint32_t start = 0, end = 0;
+        tcp_ooo_segment_t *seg;
+
+        options[0] = TCP_OPT_NOP;
+        options[1] = TCP_OPT_NOP;
+        options[2] = TCP_OPT_SACK;
+        list_for_every_entry(&s->rx_ooo_list, seg, tcp_ooo_segment_t, node) {
+            if (blocks > 0 && seg->sequence == end) {
+                end += seg->len;
+            } else {
+                if (blocks == TCP_TX_SACK_BLOCKS)
+                    break;
+                start = seg->sequence;
+                end = start + seg->len;
+                blocks++;
+            }
+            uint32_t val = htonl(start);
+            memcpy(&options[4 + (blocks - 1) * 8], &val, 4);
+            val = htonl(end);
+            memcpy(&options[4 + (blocks - 1) * 8 + 4], &val, 4);
+        }
+        options[3] = 2 + blocks * 8;
+        options_len = 4 + blocks * 8;
+    }
+
+    tcp_socket_send(s, NULL, 0, PKT_ACK, options_len ? options : NULL, options_len, s->tx_win_low);
 }
 
-static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
-                         size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size)
+/* send a segment. the data either comes from buf, copied in behind the header, or is already in
+ * the payload pktbuf, which becomes the second part of the packet. a payload with a gso_size is
+ * more than one segment's worth, for the nic to split up. */
+static status_t tcp_send(const minip_route_t *route, ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
+                         size_t len, pktbuf_t *payload, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size)
 {
     DEBUG_ASSERT(len == 0 || buf);
+    DEBUG_ASSERT(len == 0 || !payload);
+    DEBUG_ASSERT(!payload || !payload->gso_size || (route->netif->tx_offloads & MINIP_TX_OFFLOAD_TSO));
     DEBUG_ASSERT(options_length == 0 || options);
     DEBUG_ASSERT((options_length % 4) == 0);
 
     pktbuf_t *p = pktbuf_alloc();
-    if (!p)
+    if (!p) {
+        if (payload)
+            pktbuf_free(payload, true);
         return ERR_NO_MEMORY;
+    }
 
     tcp_header_t *header = pktbuf_prepend(p, sizeof(tcp_header_t) + options_length);
     DEBUG_ASSERT(header);
@@ -737,21 +1464,38 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     if (options)
         memcpy(header + 1, options, options_length);
 
-    /* append the data */
-    if (len > 0)
-        pktbuf_append_data(p, buf, len);
-
     /* compute the checksum */
-    /* XXX get the tx ckecksum capability from the nic */
-    if (FORCE_TCP_CHECKSUM || true) {
-        tcp_pseudo_header_t pheader;
-        pheader.source_addr = src_ip;
-        pheader.dest_addr = dest_ip;
-        pheader.zero = 0;
-        pheader.protocol = IP_PROTO_TCP;
-        pheader.tcp_length = htons(p->dlen);
+    size_t header_len = p->dlen;
+    tcp_pseudo_header_t pheader;
+    pheader.source_addr = src_ip;
+    pheader.dest_addr = dest_ip;
+    pheader.zero = 0;
+    pheader.protocol = IP_PROTO_TCP;
+    pheader.tcp_length = htons(header_len + len + (payload ? payload->dlen : 0));
+
+    uint16_t sum = ones_sum16(0, &pheader, sizeof(pheader));
+    if (!FORCE_TCP_CHECKSUM && (route->netif->tx_offloads & MINIP_TX_OFFLOAD_TCP_CSUM)) {
+        /* the nic sums the segment and folds it into the pseudo header's sum */
+        if (len > 0)
+            pktbuf_append_data(p, buf, len);
+
+        header->checksum = sum;
+        p->flags |= PKTBUF_FLAG_CKSUM_TCP_PARTIAL;
+    } else {
+        /* the header is a multiple of 4 bytes, so the sum carries straight on into the data,
+         * which is summed as it is copied in */
+        sum = ones_sum16(sum, header, header_len);
+        if (len > 0)
+            sum = ones_sum16_copy(sum, pktbuf_append(p, len), buf, len);
+        if (payload)
+            sum = ones_sum16(sum, payload->data, payload->dlen);
+
+        header->checksum = ~sum;
+    }
 
-        header->checksum = cksum_pheader(&pheader, p->data, p->dlen);
+    if (payload) {
+        p->gso_size = payload->gso_size;
+        pktbuf_append_part(p, payload);
     }
 
     if (LOCAL_TRACE) {
@@ -759,12 +1503,93 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
         dump_tcp_header(header);
     }
 
-    status_t err = minip_ipv4_send(p, dest_ip, IP_PROTO_TCP);
+    status_t err = minip_ipv4_send_route(route, p, dest_ip, IP_PROTO_TCP);
 
     return err;
 }
 
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size)
+/* fold the SACK blocks of an incoming ack into the scoreboard, dropping whatever the
+ * cumulative ack has covered */
+static void update_sacked(tcp_socket_t *s, const tcp_options_t *opts)
+{
+    uint count = 0;
+    for (uint i = 0; i < s->tx_sacked_count; i++) {
+        tcp_sack_block_t b = s->tx_sacked[i];
+        if (SEQUENCE_LTE(b.end, s->tx_win_low))
+            continue;
+        if (SEQUENCE_LT(b.start, s->tx_win_low))
+            b.start = s->tx_win_low;
+        s->tx_sacked[count++] = b;
+    }
+    s->tx_sacked_count = count;
+
+    for (uint i = 0; i < opts->sack_count; i++) {
+        tcp_sack_block_t b = opts->sack[i];
+
+        /* ignore anything outside of what is in flight */
+        if (SEQUENCE_LTE(b.end, b.start) || SEQUENCE_LTE(b.end, s->tx_win_low) ||
+                SEQUENCE_GT(b.end, s->tx_highest_seq))
+            continue;
+        if (SEQUENCE_LT(b.start, s->tx_win_low))
+            b.start = s->tx_win_low;
+
+        /* merge with everything it touches, keeping the list sorted */
+        uint j = 0;
+        while (j < s->tx_sacked_count) {
+            tcp_sack_block_t *o = &s->tx_sacked[j];
+            if (SEQUENCE_LT(o->end, b.start) || SEQUENCE_GT(o->start, b.end)) {
+                j++;
+                continue;
+            }
+            if (SEQUENCE_LT(o->start, b.start))
+                b.start = o->start;
+            if (SEQUENCE_GT(o->end, b.end))
+                b.end = o->end;
+            memmove(o, o + 1, (s->tx_sacked_count - j - 1) * sizeof(*o));
+            s->tx_sacked_count--;
+        }
+
+        for (j = 0; j < s->tx_sacked_count; j++) {
+            if (SEQUENCE_LT(b.start, s->tx_sacked[j].start))
+                break;
+        }
+        if (s->tx_sacked_count == TCP_MAX_SACK_HOLES) {
+            /* out of room, forget the highest block */
+            if (j == s->tx_sacked_count)
+                continue;
+            s->tx_sacked_count--;
+        }
+        memmove(&s->tx_sacked[j + 1], &s->tx_sacked[j], (s->tx_sacked_count - j) * sizeof(b));
+        s->tx_sacked[j] = b;
+        s->tx_sacked_count++;
+    }
+}
+
+static uint32_t bytes_in_flight(const tcp_socket_t *s)
+{
+    return s->tx_highest_seq - s->tx_win_low;
+}
+
+/* fold in a new round trip sample, RFC 6298 section 2 */
+static void rtt_sample(tcp_socket_t *s, uint32_t rtt)
+{
+    if (s->rtt_samples++ == 0) {
+        s->srtt = rtt;
+        s->rttvar = rtt / 2;
+    } else {
+        uint32_t delta = (s->srtt > rtt) ? s->srtt - rtt : rtt - s->srtt;
+        s->rttvar = (3 * s->rttvar + delta) / 4;
+        s->srtt = (7 * s->srtt + rtt) / 8;
+    }
+
+    /* the clock granularity term is a msec */
+    uint32_t rto = (s->srtt + MAX(1000, 4 * s->rttvar)) / 1000;
+    s->rto = MIN(MAX(rto, MIN_RTO), MAX_RTO);
+
+    LTRACEF("s %p, rtt %u usecs, srtt %u rttvar %u rto %u\n", s, rtt, s->srtt, s->rttvar, s->rto);
+}
+
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, const tcp_options_t *opts)
 {
     LTRACEF("socket %p ack sequence %u, win_size %u\n", s, sequence, win_size);
 
@@ -773,12 +1598,36 @@ static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size)
 
     LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u offset %u\n",
             s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_buffer_offset);
-    if (SEQUENCE_LTE(sequence, s->tx_win_low)) {
+    if (SEQUENCE_LT(sequence, s->tx_win_low)) {
         /* they're acking stuff we've already received an ack for */
         return;
     } else if (SEQUENCE_GT(sequence, s->tx_highest_seq)) {
         /* they're acking stuff we haven't sent */
         return;
+    } else if (sequence == s->tx_win_low) {
+        /* nothing new acked, but it may carry a window update or news of a loss */
+        bool window_update = (s->tx_win_low + win_size != s->tx_win_high);
+        s->tx_win_high = s->tx_win_low + win_size;
+        update_sacked(s, opts);
+
+        /* a duplicate ack, with data outstanding, that isn't just a window update */
+        if (bytes_in_flight(s) > 0 && (opts->sack_count > 0 || !window_update)) {
+            s->tx_dup_acks++;
+            if (s->in_recovery) {
+                s->cc_ops->on_recovery_dup_ack(&s->cc);
+            } else if (s->tx_dup_acks == FAST_RETRANSMIT_DUP_ACKS) {
+                /* something past a hole got there, resend the hole without waiting */
+                s->cc_ops->on_enter_recovery(&s->cc, bytes_in_flight(s));
+                s->in_recovery = true;
+                s->recover = s->tx_highest_seq;
+                s->fast_retransmits++;
+
+                tcp_retransmit(s);
+                tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+            }
+        }
+
+        tcp_write_pending_data(s);
     } else {
         /* their ack is somewhere in our window */
         uint32_t acked_len;
@@ -790,24 +1639,62 @@ static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size)
         DEBUG_ASSERT(acked_len <= s->tx_buffer_size);
         DEBUG_ASSERT(acked_len <= s->tx_buffer_offset);
 
-        memmove(s->tx_buffer, s->tx_buffer + acked_len, s->tx_buffer_offset - acked_len);
-
+        s->tx_buffer_start += acked_len;
         s->tx_buffer_offset -= acked_len;
+        tcp_compact_tx_buffer(s);
         s->tx_win_low += acked_len;
         s->tx_win_high = s->tx_win_low + win_size;
+        s->tx_dup_acks = 0;
+        update_sacked(s, opts);
+
+        /* take a round trip sample if the timed segment made it */
+        if (s->rtt_timing && SEQUENCE_GTE(sequence, s->rtt_seq)) {
+            s->rtt_timing = false;
+            rtt_sample(s, current_time_hires() - s->rtt_start);
+        }
+
+        if (s->in_recovery) {
+            if (SEQUENCE_GTE(sequence, s->recover)) {
+                s->in_recovery = false;
+                s->cc_ops->on_exit_recovery(&s->cc, bytes_in_flight(s));
+            } else {
+                /* partial ack, the next hole is also gone */
+                tcp_retransmit(s);
+            }
+        } else {
+            s->cc_ops->on_ack(&s->cc, acked_len, bytes_in_flight(s));
+            if (SEQUENCE_LT(sequence, s->rto_recover))
+                tcp_retransmit(s);
+        }
 
         /* cancel or reset our retransmit timer */
         if (s->tx_win_low == s->tx_highest_seq) {
             tcp_timer_cancel(s, &s->retransmit_timer);
         } else {
-            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
         }
 
+        /* the window may have opened for data we have been holding back */
+        tcp_write_pending_data(s);
+
         /* we have opened the transmit buffer */
         event_signal(&s->tx_event, true);
+        tcp_poll_wake(s);
     }
 }
 
+/* how much to hand down at once. with segmentation offload (which needs in place sends, the headers
+ * and the payload wouldn't fit a single pktbuf) the nic cuts super segments up into mss sized ones */
+static uint32_t tcp_tx_segment_size(const tcp_socket_t *s)
+{
+    const uint offloads = MINIP_TX_OFFLOAD_SG | MINIP_TX_OFFLOAD_TSO;
+
+    if ((s->route.netif->tx_offloads & offloads) != offloads)
+        return s->mss;
+
+    return MAX(s->mss, (TSO_MAX_SEGMENT / s->mss) * s->mss);
+}
+
 static ssize_t tcp_write_pending_data(tcp_socket_t *s)
 {
     LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u offset %u\n",
@@ -816,31 +1703,71 @@ static ssize_t tcp_write_pending_data(tcp_socket_t *s)
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
     DEBUG_ASSERT(s->tx_buffer_size > 0);
-    DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
+    DEBUG_ASSERT(s->tx_buffer_start + s->tx_buffer_offset <= s->tx_buffer_size);
+
+    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT)
+        return 0;
 
     /* do we have any new data to send? */
     uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
     uint32_t pending = s->tx_buffer_offset - outstanding;
     LTRACEF("outstanding %u, pending %u\n", outstanding, pending);
 
+    /* stay inside their window. with nothing in flight, send a segment regardless, so a closed
+     * window gets probed by the retransmit timer */
+    uint32_t window = SEQUENCE_GT(s->tx_win_high, s->tx_highest_seq) ? s->tx_win_high - s->tx_highest_seq : 0;
+    window = MIN(window, (s->cc.cwnd > outstanding) ? s->cc.cwnd - outstanding : 0);
+    if (outstanding == 0)
+        window = MAX(window, s->mss);
+    pending = MIN(pending, window);
+
     /* send packets that cover the pending area of the window */
+    uint32_t segment_size = tcp_tx_segment_size(s);
     uint32_t offset = 0;
     while (offset < pending) {
-        uint32_t tosend = MIN(s->mss, pending - offset);
+        uint32_t tosend = MIN(segment_size, pending - offset);
 
-        tcp_socket_send(s, s->tx_buffer + outstanding + offset, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_highest_seq);
+        tcp_socket_send(s, s->tx_buffer + s->tx_buffer_start + outstanding + offset, tosend, PKT_ACK|PKT_PSH, NULL, 0,
+                        s->tx_highest_seq);
         s->tx_highest_seq += tosend;
         offset += tosend;
+        s->segs_out++;
+
+        if (!s->rtt_timing) {
+            s->rtt_timing = true;
+            s->rtt_seq = s->tx_highest_seq;
+            s->rtt_start = current_time_hires();
+        }
     }
 
-    /* reset the retransmit timer if we sent anything */
-    if (offset > 0) {
-        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+    /* arm the retransmit timer if we sent anything and it isn't running already */
+    if (offset > 0 && outstanding == 0) {
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
     }
 
     return offset;
 }
 
+/* resend the range [start, end), a segment at a time */
+static uint32_t retransmit_range(tcp_socket_t *s, uint32_t start, uint32_t end)
+{
+    uint32_t sent = 0;
+
+    while (SEQUENCE_LT(start, end)) {
+        uint32_t tosend = MIN(s->mss, end - start);
+
+        LTRACEF("s %p, tosend %u seq %u\n", s, tosend, start);
+        tcp_socket_send(s, s->tx_buffer + s->tx_buffer_start + (start - s->tx_win_low), tosend, PKT_ACK|PKT_PSH, NULL, 0,
+                        start);
+        start += tosend;
+        sent += tosend;
+        s->segs_out++;
+        s->segs_retransmitted++;
+    }
+
+    return sent;
+}
+
 static ssize_t tcp_retransmit(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
@@ -854,12 +1781,22 @@ static ssize_t tcp_retransmit(tcp_socket_t *s)
     if (outstanding == 0)
         return 0;
 
-    uint32_t tosend = MIN(s->mss, outstanding);
+    /* Karn: an ack for anything resent can't be told apart from one for the original */
+    s->rtt_timing = false;
 
-    LTRACEF("s %p, tosend %u seq %u\n", s, tosend, s->tx_win_low);
-    tcp_socket_send(s, s->tx_buffer, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_win_low);
+    /* without SACK information only the first segment is known to be missing */
+    if (s->tx_sacked_count == 0)
+        return retransmit_range(s, s->tx_win_low, s->tx_win_low + MIN(s->mss, outstanding));
 
-    return tosend;
+    /* otherwise fill every hole below the highest range they have */
+    uint32_t sent = 0;
+    uint32_t hole = s->tx_win_low;
+    for (uint i = 0; i < s->tx_sacked_count; i++) {
+        sent += retransmit_range(s, hole, s->tx_sacked[i].start);
+        hole = s->tx_sacked[i].end;
+    }
+
+    return sent;
 }
 
 static void handle_retransmit_timeout(void *_s)
@@ -872,10 +1809,22 @@ static void handle_retransmit_timeout(void *_s)
 
     mutex_acquire(&s->lock);
 
-    if (tcp_retransmit(s) == 0)
+    if (bytes_in_flight(s) == 0 || (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT))
         goto done;
 
-    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+    /* collapse the window, back the timer off and forget what they told us they hold, in case
+     * they have thrown it away (RFC 2018 section 8) */
+    s->cc_ops->on_timeout(&s->cc, bytes_in_flight(s));
+    s->in_recovery = false;
+    s->rto_recover = s->tx_highest_seq;
+    s->tx_sacked_count = 0;
+    s->tx_dup_acks = 0;
+    s->rto = MIN(s->rto * 2, MAX_RTO);
+    s->timeouts++;
+
+    tcp_retransmit(s);
+
+    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
 
 done:
     mutex_release(&s->lock);
@@ -924,6 +1873,7 @@ static void tcp_wakeup_waiters(tcp_socket_t *s)
     // wake up any waiters
     event_signal(&s->rx_event, true);
     event_signal(&s->tx_event, true);
+    tcp_poll_wake(s);
 }
 
 static void tcp_remote_close(tcp_socket_t *s)
@@ -943,40 +1893,79 @@ static void tcp_remote_close(tcp_socket_t *s)
     tcp_timer_cancel(s, &s->ack_delay_timer);
 
     tcp_wakeup_waiters(s);
+
+    /* reset before anyone accepted it */
+    tcp_half_open_done(s, false);
 }
 
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
+static void tcp_init(uint level)
+{
+    for (uint i = 0; i < countof(tcp_socket_table); i++) {
+        mutex_init(&tcp_socket_table[i].lock);
+        list_initialize(&tcp_socket_table[i].list);
+    }
+    for (uint i = 0; i < countof(tcp_listen_table); i++) {
+        mutex_init(&tcp_listen_table[i].lock);
+        list_initialize(&tcp_listen_table[i].list);
+    }
+
+    TYPED_SLAB_CACHE_INIT(tcp_socket_t, &tcp_socket_cache, "tcp_socket", NULL, NULL);
+
+    syn_cookie_secret = rand();
+}
+
+LK_INIT_HOOK(tcp, tcp_init, LK_INIT_LEVEL_THREADING);
+
+static tcp_socket_t *create_tcp_socket(uint32_t rx_size, uint32_t tx_size, bool alloc_buffers)
 {
     tcp_socket_t *s;
 
-    s = calloc(1, sizeof(tcp_socket_t));
+    s = TYPED_SLAB_ALLOC(tcp_socket_t, &tcp_socket_cache);
     if (!s)
         return NULL;
 
+    memset(s, 0, sizeof(*s));
+
     mutex_init(&s->lock);
     s->ref = 1; // start with the ref already bumped
 
     s->state = STATE_CLOSED;
-    s->rx_win_size = DEFAULT_RX_WINDOW_SIZE;
+    s->rx_win_size = rx_size;
     event_init(&s->rx_event, false, 0);
+    list_initialize(&s->rx_ooo_list);
+    list_initialize(&s->poll_entries);
 
     s->mss = DEFAULT_MSS;
+    s->cc_ops = &tcp_cc_newreno;
+    s->rto = INITIAL_RTO;
 
     s->tx_win_low = rand();
     s->tx_win_high = s->tx_win_low;
     s->tx_highest_seq = s->tx_win_low;
+    s->rto_recover = s->tx_win_low;
     event_init(&s->tx_event, true, 0);
 
+    s->tx_buffer_size = tx_size;
+
     if (alloc_buffers) {
-        // XXX check for error
         s->rx_buffer_raw = malloc(s->rx_win_size);
-        cbuf_initialize_etc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
-
-        s->tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
         s->tx_buffer = malloc(s->tx_buffer_size);
+        if (!s->rx_buffer_raw || !s->tx_buffer) {
+            free(s->rx_buffer_raw);
+            free(s->tx_buffer);
+            event_destroy(&s->tx_event);
+            event_destroy(&s->rx_event);
+            slab_free(&tcp_socket_cache, s);
+            return NULL;
+        }
+
+        cbuf_initialize_etc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
     }
 
     sem_init(&s->accept_sem, 0);
+    list_initialize(&s->accept_queue);
+    s->accept_backlog = TCP_DEFAULT_BACKLOG;
+    s->syn_cookies = TCP_SYN_COOKIES;
 
     return s;
 }
@@ -990,7 +1979,7 @@ status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port)
     if (!handle)
         return ERR_INVALID_ARGS;
 
-    s = create_tcp_socket(false);
+    s = create_tcp_socket(DEFAULT_RX_WINDOW_SIZE, DEFAULT_TX_BUFFER_SIZE, false);
     if (!s)
         return ERR_NO_MEMORY;
 
@@ -1008,6 +1997,78 @@ status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port)
     return NO_ERROR;
 }
 
+status_t tcp_set_buffer_sizes(tcp_socket_t *listen_socket, size_t rx_size, size_t tx_size)
+{
+    if (!listen_socket)
+        return ERR_INVALID_ARGS;
+    if (rx_size < MIN_BUFFER_SIZE || rx_size > MAX_BUFFER_SIZE ||
+            tx_size < MIN_BUFFER_SIZE || tx_size > MAX_BUFFER_SIZE)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = listen_socket;
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&s->lock);
+    if (s->state != STATE_LISTEN) {
+        err = ERR_BAD_STATE;
+    } else {
+        /* the receive buffer is a cbuf */
+        s->rx_win_size = valpow2(log2_uint(rx_size - 1) + 1);
+        s->tx_buffer_size = tx_size;
+    }
+    mutex_release(&s->lock);
+
+    return err;
+}
+
+status_t tcp_set_backlog(tcp_socket_t *listen_socket, uint backlog, bool syn_cookies)
+{
+    if (!listen_socket)
+        return ERR_INVALID_ARGS;
+    if (backlog == 0 || backlog > TCP_MAX_BACKLOG)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = listen_socket;
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&s->lock);
+    if (s->state != STATE_LISTEN) {
+        err = ERR_BAD_STATE;
+    } else {
+        /* connections already queued past a smaller backlog stay until accepted */
+        s->accept_backlog = backlog;
+        s->syn_cookies = syn_cookies;
+    }
+    mutex_release(&s->lock);
+
+    return err;
+}
+
+/* reset whatever is still waiting on a closing listener's accept queue. the half open ones
+ * find accept_closed set when they get there */
+static void tcp_listen_drain(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    struct list_node queue = LIST_INITIAL_VALUE(queue);
+    tcp_socket_t *child;
+
+    mutex_acquire(&tcp_accept_lock);
+    s->accept_closed = true;
+    while ((child = list_remove_head_type(&s->accept_queue, tcp_socket_t, accept_node)))
+        list_add_tail(&queue, &child->accept_node);
+    s->accept_queued = 0;
+    mutex_release(&tcp_accept_lock);
+
+    while ((child = list_remove_head_type(&queue, tcp_socket_t, accept_node))) {
+        inc_socket_ref(child);
+        mutex_acquire(&child->lock);
+        tcp_drop_unaccepted(child);
+        mutex_release(&child->lock);
+        dec_socket_ref(child);
+    }
+}
+
 status_t tcp_accept_timeout(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket, lk_time_t timeout)
 {
     if (!listen_socket || !accept_socket)
@@ -1022,53 +2083,54 @@ status_t tcp_accept_timeout(tcp_socket_t *listen_socket, tcp_socket_t **accept_s
         return ERR_TIMED_OUT;
     }
 
-    mutex_acquire(&s->lock);
+    /* we got here, grab the oldest accepted socket and return */
+    mutex_acquire(&tcp_accept_lock);
+    tcp_socket_t *child = list_remove_head_type(&s->accept_queue, tcp_socket_t, accept_node);
+    if (child)
+        s->accept_queued--;
+    mutex_release(&tcp_accept_lock);
 
-    /* we got here, grab the accepted socket and return */
-    DEBUG_ASSERT(s->accepted);
-    *accept_socket = s->accepted;
-    s->accepted = NULL;
-
-    mutex_release(&s->lock);
     dec_socket_ref(s);
 
+    /* the listener was closed under us */
+    if (!child)
+        return ERR_CHANNEL_CLOSED;
+
+    *accept_socket = child;
+
     return NO_ERROR;
 }
 
-ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len)
+/* wait for something in the receive buffer. returns with the socket locked and NO_ERROR if there
+ * is data, ERR_CHANNEL_CLOSED with the socket unlocked if there never will be */
+static status_t tcp_wait_for_data(tcp_socket_t *s)
 {
-    LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
-    if (!socket)
-        return ERR_INVALID_ARGS;
-    if (len == 0)
-        return 0;
-    if (!buf)
-        return ERR_INVALID_ARGS;
+    for (;;) {
+        /* block on available data */
+        event_wait(&s->rx_event);
 
-    tcp_socket_t *s = socket;
-    inc_socket_ref(s);
+        mutex_acquire(&s->lock);
 
-    ssize_t ret = 0;
-retry:
-    /* block on available data */
-    event_wait(&s->rx_event);
+        /* whatever is in the receive buffer can be read, even if we're closed */
+        if (cbuf_space_used(&s->rx_buffer) > 0)
+            return NO_ERROR;
 
-    mutex_acquire(&s->lock);
-
-    /* try to read some data from the receive buffer, even if we're closed */
-    ret = cbuf_read(&s->rx_buffer, buf, len, false);
-    if (ret == 0) {
         /* check to see if we've closed */
         if (s->state != STATE_ESTABLISHED) {
-            ret = ERR_CHANNEL_CLOSED;
-            goto out;
+            mutex_release(&s->lock);
+            return ERR_CHANNEL_CLOSED;
         }
 
         /* we must have raced with another thread */
         event_unsignal(&s->rx_event);
         mutex_release(&s->lock);
-        goto retry;
     }
+}
+
+/* some of the receive buffer has been handed back, update the read event and our window */
+static void tcp_rx_consumed(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
 
     /* if we've used up the last byte in the read buffer, unsignal the read event */
     size_t remaining_bytes = cbuf_space_used(&s->rx_buffer);
@@ -1082,34 +2144,139 @@ retry:
     /* if we've opened it enough, send an ack */
     if (new_rx_win_size >= s->mss && s->rx_win_high - s->rx_win_low < s->mss)
         send_ack(s);
+}
+
+ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len)
+{
+    LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
+    if (!socket)
+        return ERR_INVALID_ARGS;
+    if (len == 0)
+        return 0;
+    if (!buf)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+
+    ssize_t ret = tcp_wait_for_data(s);
+    if (ret < 0)
+        goto out;
+
+    ret = cbuf_read(&s->rx_buffer, buf, len, false);
+
+    tcp_rx_consumed(s);
+
+    mutex_release(&s->lock);
 
 out:
+    dec_socket_ref(s);
+
+    return ret;
+}
+
+ssize_t tcp_read_peek(tcp_socket_t *socket, iovec_t regions[2])
+{
+    LTRACEF("socket %p, regions %p\n", socket, regions);
+    if (!socket || !regions)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+
+    ssize_t ret = tcp_wait_for_data(s);
+    if (ret < 0)
+        goto out;
+
+    /* the region between the cbuf's tail and head is only ever touched by the reader, so it
+     * stays put after we drop the lock. it also stays out of the advertised window until
+     * released, which is what keeps the sender from overrunning it. */
+    ret = cbuf_peek(&s->rx_buffer, regions);
+
     mutex_release(&s->lock);
+
+out:
     dec_socket_ref(s);
 
     return ret;
 }
 
+status_t tcp_read_release(tcp_socket_t *socket, size_t len)
+{
+    LTRACEF("socket %p, len %zu\n", socket, len);
+    if (!socket)
+        return ERR_INVALID_ARGS;
+    if (len == 0)
+        return NO_ERROR;
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+
+    mutex_acquire(&s->lock);
+
+    status_t err = NO_ERROR;
+    if (len > cbuf_space_used(&s->rx_buffer)) {
+        err = ERR_INVALID_ARGS;
+        goto out;
+    }
+
+    cbuf_read(&s->rx_buffer, NULL, len, false);
+
+    tcp_rx_consumed(s);
+
+out:
+    mutex_release(&s->lock);
+    dec_socket_ref(s);
+
+    return err;
+}
+
 ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
 {
     LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
+    if (len > 0 && !buf)
+        return ERR_INVALID_ARGS;
+
+    iovec_t iov = { .iov_base = (void *)buf, .iov_len = len };
+    return tcp_writev(socket, &iov, 1);
+}
+
+/* copy the iovec into the transmit buffer. with wait set, blocks until all of it is in,
+ * otherwise copies what fits and returns how much that was */
+static ssize_t tcp_writev_etc(tcp_socket_t *socket, const iovec_t *iov, uint iov_cnt, bool wait)
+{
+    LTRACEF("socket %p, iov %p, iov_cnt %u, wait %d\n", socket, iov, iov_cnt, wait);
     if (!socket)
         return ERR_INVALID_ARGS;
+    if (iov_cnt > 0 && !iov)
+        return ERR_INVALID_ARGS;
+
+    ssize_t len = iovec_size(iov, iov_cnt);
+    if (len < 0)
+        return len;
     if (len == 0)
         return 0;
-    if (!buf)
-        return ERR_INVALID_ARGS;
 
     tcp_socket_t *s = socket;
     inc_socket_ref(s);
 
-    size_t off = 0;
-    while (off < len) {
-        LTRACEF("off %zu, len %zu\n", off, len);
+    uint i = 0;
+    size_t iov_off = 0;
+    size_t copied = 0;
+    while (i < iov_cnt) {
+        if (iov_off == iov[i].iov_len) {
+            i++;
+            iov_off = 0;
+            continue;
+        }
+
+        LTRACEF("iov %u, off %zu, len %zu\n", i, iov_off, iov[i].iov_len);
 
         /* wait for the tx buffer to open up */
-        event_wait(&s->tx_event);
-        LTRACEF("after event_wait\n");
+        if (wait) {
+            event_wait(&s->tx_event);
+            LTRACEF("after event_wait\n");
+        }
 
         mutex_acquire(&s->lock);
 
@@ -1121,34 +2288,83 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
         }
 
         DEBUG_ASSERT(s->tx_buffer_size > 0);
-        DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
+        DEBUG_ASSERT(s->tx_buffer_start + s->tx_buffer_offset <= s->tx_buffer_size);
+
+        /* make room at the end if acked data is still taking up the front */
+        if (s->tx_buffer_start + s->tx_buffer_offset == s->tx_buffer_size)
+            tcp_compact_tx_buffer(s);
 
         /* figure out how much data to copy in */
-        size_t to_copy = MIN(s->tx_buffer_size - s->tx_buffer_offset, len - off);
+        uint32_t tail = s->tx_buffer_start + s->tx_buffer_offset;
+        size_t to_copy = MIN(s->tx_buffer_size - tail, iov[i].iov_len - iov_off);
         if (to_copy == 0) {
+            /* full, wait for an ack or for the nic to let go of the front of the buffer. the
+             * event is unsignalled first so neither can slip in between */
+            event_unsignal(&s->tx_event);
+            bool can_compact = s->tx_buffer_start > 0 && s->tx_inplace == 0;
+            if (can_compact)
+                event_signal(&s->tx_event, false);
             mutex_release(&s->lock);
+            if (!wait && !can_compact)
+                break;
             continue;
         }
 
-        memcpy(s->tx_buffer + s->tx_buffer_offset, (uint8_t *)buf + off, to_copy);
+        memcpy(s->tx_buffer + tail, (uint8_t *)iov[i].iov_base + iov_off, to_copy);
         s->tx_buffer_offset += to_copy;
 
         /* if this has completely filled it, unsignal the event */
-        DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
-        if (s->tx_buffer_offset == s->tx_buffer_size) {
+        DEBUG_ASSERT(s->tx_buffer_start + s->tx_buffer_offset <= s->tx_buffer_size);
+        if (s->tx_buffer_start + s->tx_buffer_offset == s->tx_buffer_size) {
             event_unsignal(&s->tx_event);
         }
 
         /* send as much data as we can */
         tcp_write_pending_data(s);
 
-        off += to_copy;
+        iov_off += to_copy;
+        copied += to_copy;
 
         mutex_release(&s->lock);
     }
 
     dec_socket_ref(s);
-    return len;
+    return copied;
+}
+
+ssize_t tcp_writev(tcp_socket_t *socket, const iovec_t *iov, uint iov_cnt)
+{
+    return tcp_writev_etc(socket, iov, iov_cnt, true);
+}
+
+ssize_t tcp_write_nowait(tcp_socket_t *socket, const void *buf, size_t len)
+{
+    LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
+    if (len > 0 && !buf)
+        return ERR_INVALID_ARGS;
+
+    iovec_t iov = { .iov_base = (void *)buf, .iov_len = len };
+    return tcp_writev_etc(socket, &iov, 1, false);
+}
+
+status_t tcp_get_stats(tcp_socket_t *socket, tcp_stats_t *stats)
+{
+    if (!socket || !stats)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+
+    mutex_acquire(&s->lock);
+    stats->segs_out = s->segs_out;
+    stats->segs_retransmitted = s->segs_retransmitted;
+    stats->fast_retransmits = s->fast_retransmits;
+    stats->timeouts = s->timeouts;
+    stats->srtt = s->srtt;
+    stats->cwnd = s->cc.cwnd;
+    stats->mss = s->mss;
+    mutex_release(&s->lock);
+
+    return NO_ERROR;
 }
 
 status_t tcp_close(tcp_socket_t *socket)
@@ -1174,6 +2390,9 @@ status_t tcp_close(tcp_socket_t *socket)
             tcp_timer_cancel(s, &s->ack_delay_timer);
             tcp_timer_cancel(s, &s->retransmit_timer);
 
+            if (s->state == STATE_LISTEN)
+                tcp_listen_drain(s);
+
             s->state = STATE_CLOSED;
 
             /* drop the extra ref that was held when the socket was created */
@@ -1220,6 +2439,291 @@ out:
     return err;
 }
 
+/* wait sets */
+
+/* what an entry would report right now */
+static uint tcp_poll_ready_locked(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    switch (s->state) {
+        case STATE_LISTEN: {
+            mutex_acquire(&tcp_accept_lock);
+            bool queued = s->accept_queued > 0;
+            mutex_release(&tcp_accept_lock);
+            return queued ? TCP_POLL_IN : 0;
+        }
+        case STATE_SYN_SENT:
+        case STATE_SYN_RCVD:
+            return 0;
+        case STATE_ESTABLISHED:
+        case STATE_CLOSE_WAIT: {
+            uint events = 0;
+
+            /* a remote close reads as end of stream */
+            if (s->state == STATE_CLOSE_WAIT || cbuf_space_used(&s->rx_buffer) > 0)
+                events |= TCP_POLL_IN;
+
+            /* same test tcp_writev makes before copying in */
+            if (s->tx_buffer_start + s->tx_buffer_offset < s->tx_buffer_size ||
+                    (s->tx_buffer_start > 0 && s->tx_inplace == 0))
+                events |= TCP_POLL_OUT;
+            return events;
+        }
+        default:
+            /* closed or closing, reads and writes will fail right away */
+            return TCP_POLL_IN | TCP_POLL_HUP;
+    }
+}
+
+/* queue every wait set entry of the socket to be looked at. callable from the nic's tx completion */
+static void tcp_poll_wake(tcp_socket_t *s)
+{
+    tcp_poll_entry_t *e;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&tcp_poll_lock, state);
+    list_for_every_entry(&s->poll_entries, e, tcp_poll_entry_t, socket_node) {
+        if (!e->on_ready) {
+            list_add_tail(&e->ws->ready, &e->ready_node);
+            e->on_ready = true;
+        }
+        event_signal(&e->ws->event, false);
+    }
+    spin_unlock_irqrestore(&tcp_poll_lock, state);
+}
+
+static void tcp_poll_requeue(tcp_poll_entry_t *e)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&tcp_poll_lock, state);
+    if (!e->on_ready) {
+        list_add_tail(&e->ws->ready, &e->ready_node);
+        e->on_ready = true;
+    }
+    spin_unlock_irqrestore(&tcp_poll_lock, state);
+}
+
+static void tcp_poll_entry_free(tcp_poll_entry_t *e)
+{
+    DEBUG_ASSERT(is_mutex_held(&e->ws->lock));
+
+    list_delete(&e->set_node);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&tcp_poll_lock, state);
+    list_delete(&e->socket_node);
+    if (e->on_ready)
+        list_delete(&e->ready_node);
+    spin_unlock_irqrestore(&tcp_poll_lock, state);
+
+    dec_socket_ref(e->s);
+    free(e);
+}
+
+static tcp_poll_entry_t *tcp_waitset_find(tcp_waitset_t *ws, tcp_socket_t *s)
+{
+    tcp_poll_entry_t *e;
+
+    list_for_every_entry(&ws->entries, e, tcp_poll_entry_t, set_node) {
+        if (e->s == s)
+            return e;
+    }
+    return NULL;
+}
+
+status_t tcp_waitset_create(tcp_waitset_t **handle)
+{
+    if (!handle)
+        return ERR_INVALID_ARGS;
+
+    tcp_waitset_t *ws = calloc(1, sizeof(*ws));
+    if (!ws)
+        return ERR_NO_MEMORY;
+
+    mutex_init(&ws->lock);
+    event_init(&ws->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    list_initialize(&ws->entries);
+    list_initialize(&ws->ready);
+
+    *handle = ws;
+
+    return NO_ERROR;
+}
+
+status_t tcp_waitset_destroy(tcp_waitset_t *ws)
+{
+    if (!ws)
+        return ERR_INVALID_ARGS;
+
+    tcp_poll_entry_t *e;
+
+    mutex_acquire(&ws->lock);
+    while ((e = list_peek_head_type(&ws->entries, tcp_poll_entry_t, set_node)))
+        tcp_poll_entry_free(e);
+    mutex_release(&ws->lock);
+
+    event_destroy(&ws->event);
+    mutex_destroy(&ws->lock);
+    free(ws);
+
+    return NO_ERROR;
+}
+
+status_t tcp_waitset_add(tcp_waitset_t *ws, tcp_socket_t *socket, uint events, void *cookie)
+{
+    if (!ws || !socket)
+        return ERR_INVALID_ARGS;
+    if (events & ~(TCP_POLL_IN | TCP_POLL_OUT | TCP_POLL_HUP))
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&ws->lock);
+
+    if (tcp_waitset_find(ws, s)) {
+        err = ERR_ALREADY_EXISTS;
+        goto out;
+    }
+
+    tcp_poll_entry_t *e = calloc(1, sizeof(*e));
+    if (!e) {
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+
+    /* the entry keeps the socket around until it is removed */
+    inc_socket_ref(s);
+    e->s = s;
+    e->ws = ws;
+    e->events = events;
+    e->cookie = cookie;
+    list_add_tail(&ws->entries, &e->set_node);
+
+    /* start out queued, it may already be ready */
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&tcp_poll_lock, state);
+    list_add_tail(&s->poll_entries, &e->socket_node);
+    list_add_tail(&ws->ready, &e->ready_node);
+    e->on_ready = true;
+    event_signal(&ws->event, false);
+    spin_unlock_irqrestore(&tcp_poll_lock, state);
+
+out:
+    mutex_release(&ws->lock);
+
+    return err;
+}
+
+status_t tcp_waitset_remove(tcp_waitset_t *ws, tcp_socket_t *socket)
+{
+    if (!ws || !socket)
+        return ERR_INVALID_ARGS;
+
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&ws->lock);
+    tcp_poll_entry_t *e = tcp_waitset_find(ws, socket);
+    if (e)
+        tcp_poll_entry_free(e);
+    else
+        err = ERR_NOT_FOUND;
+    mutex_release(&ws->lock);
+
+    return err;
+}
+
+status_t tcp_waitset_modify(tcp_waitset_t *ws, tcp_socket_t *socket, uint events)
+{
+    if (!ws || !socket)
+        return ERR_INVALID_ARGS;
+    if (events & ~(TCP_POLL_IN | TCP_POLL_OUT | TCP_POLL_HUP))
+        return ERR_INVALID_ARGS;
+
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&ws->lock);
+    tcp_poll_entry_t *e = tcp_waitset_find(ws, socket);
+    if (e) {
+        e->events = events;
+        /* it may be ready for the new events already */
+        tcp_poll_requeue(e);
+        event_signal(&ws->event, false);
+    } else {
+        err = ERR_NOT_FOUND;
+    }
+    mutex_release(&ws->lock);
+
+    return err;
+}
+
+/* look at everything queued once, filling in results. returns how many were reported */
+static int tcp_waitset_scan(tcp_waitset_t *ws, tcp_poll_result_t *results, uint max)
+{
+    DEBUG_ASSERT(is_mutex_held(&ws->lock));
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&tcp_poll_lock, state);
+    uint queued = list_length(&ws->ready);
+    spin_unlock_irqrestore(&tcp_poll_lock, state);
+
+    uint count = 0;
+    while (queued-- > 0 && count < max) {
+        spin_lock_irqsave(&tcp_poll_lock, state);
+        tcp_poll_entry_t *e = list_remove_head_type(&ws->ready, tcp_poll_entry_t, ready_node);
+        if (e)
+            e->on_ready = false;
+        spin_unlock_irqrestore(&tcp_poll_lock, state);
+        if (!e)
+            break;
+
+        /* any wakeup from here on queues it again */
+        mutex_acquire(&e->s->lock);
+        uint events = tcp_poll_ready_locked(e->s) & (e->events | TCP_POLL_HUP);
+        mutex_release(&e->s->lock);
+
+        if (events) {
+            results[count].socket = e->s;
+            results[count].cookie = e->cookie;
+            results[count].events = events;
+            count++;
+
+            /* level triggered: stays queued until the condition goes away */
+            tcp_poll_requeue(e);
+        }
+    }
+
+    return count;
+}
+
+int tcp_waitset_wait(tcp_waitset_t *ws, tcp_poll_result_t *results, uint max, lk_time_t timeout)
+{
+    if (!ws || !results || max == 0)
+        return ERR_INVALID_ARGS;
+
+    lk_time_t start = current_time();
+
+    for (;;) {
+        mutex_acquire(&ws->lock);
+        int count = tcp_waitset_scan(ws, results, max);
+        mutex_release(&ws->lock);
+
+        if (count > 0)
+            return count;
+
+        lk_time_t wait = INFINITE_TIME;
+        if (timeout != INFINITE_TIME) {
+            lk_time_t elapsed = current_time() - start;
+            if (elapsed >= timeout)
+                return ERR_TIMED_OUT;
+            wait = timeout - elapsed;
+        }
+
+        event_wait_timeout(&ws->event, wait);
+    }
+}
+
 /* debug stuff */
 static int cmd_tcp(int argc, const cmd_args *argv)
 {
@@ -1238,12 +2742,10 @@ usage:
 
     if (!strcmp(argv[1].str, "sockets")) {
 
-        mutex_acquire(&tcp_socket_list_lock);
-        tcp_socket_t *s = NULL;
-        list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-            dump_socket(s);
-        }
-        mutex_release(&tcp_socket_list_lock);
+        for (uint i = 0; i < countof(tcp_listen_table); i++)
+            dump_bucket_sockets(&tcp_listen_table[i]);
+        for (uint i = 0; i < countof(tcp_socket_table); i++)
+            dump_bucket_sockets(&tcp_socket_table[i]);
     } else if (!strcmp(argv[1].str, "listenclose")) {
         /* listen for a connection, accept it, then immediately close it */
         if (argc < 3) goto notenoughargs;
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * NewReno congestion control, RFC 5681 and RFC 6582.
+ */
+#include "minip-internal.h"
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* RFC 6928 initial window */
+static uint32_t initial_window(uint32_t mss)
+{
+    return MIN(10 * mss, MAX(2 * mss, 14600));
+}
+
+/* half of what was in flight, but never less than two segments */
+static uint32_t loss_ssthresh(const tcp_cc_state_t *cc, uint32_t in_flight)
+{
+    return MAX(in_flight / 2, 2 * cc->mss);
+}
+
+static void newreno_init(tcp_cc_state_t *cc)
+{
+    cc->cwnd = initial_window(cc->mss);
+    cc->ssthresh = UINT32_MAX;
+    cc->acked = 0;
+}
+
+static void newreno_on_ack(tcp_cc_state_t *cc, uint32_t acked, uint32_t in_flight)
+{
+    if (cc->cwnd < cc->ssthresh) {
+        /* slow start, grow by at most a segment per ack */
+        cc->cwnd += MIN(acked, cc->mss);
+    } else {
+        /* congestion avoidance, a segment per window's worth of acked data */
+        cc->acked += acked;
+        if (cc->acked >= cc->cwnd) {
+            cc->acked -= cc->cwnd;
+            cc->cwnd += cc->mss;
+        }
+    }
+}
+
+static void newreno_on_enter_recovery(tcp_cc_state_t *cc, uint32_t in_flight)
+{
+    cc->ssthresh = loss_ssthresh(cc, in_flight);
+
+    /* inflate by the three segments that have left the network */
+    cc->cwnd = cc->ssthresh + 3 * cc->mss;
+    cc->acked = 0;
+}
+
+static void newreno_on_recovery_dup_ack(tcp_cc_state_t *cc)
+{
+    cc->cwnd += cc->mss;
+}
+
+static void newreno_on_exit_recovery(tcp_cc_state_t *cc, uint32_t in_flight)
+{
+    /* deflate, without allowing a burst */
+    cc->cwnd = MIN(cc->ssthresh, MAX(in_flight, cc->mss) + cc->mss);
+}
+
+static void newreno_on_timeout(tcp_cc_state_t *cc, uint32_t in_flight)
+{
+    cc->ssthresh = loss_ssthresh(cc, in_flight);
+    cc->cwnd = cc->mss;
+    cc->acked = 0;
+}
+
+const tcp_cc_ops_t tcp_cc_newreno = {
+    .name = "newreno",
+    .init = newreno_init,
+    .on_ack = newreno_on_ack,
+    .on_enter_recovery = newreno_on_enter_recovery,
+    .on_recovery_dup_ack = newreno_on_recovery_dup_ack,
+    .on_exit_recovery = newreno_on_exit_recovery,
+    .on_timeout = newreno_on_timeout,
+};
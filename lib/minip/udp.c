@@ -25,6 +25,7 @@
 
 #include "minip-internal.h"
 
+#include <assert.h>
 #include <err.h>
 #include <errno.h>
 #include <iovec.h>
@@ -32,23 +33,62 @@
 #include <malloc.h>
 #include <stdint.h>
 #include <trace.h>
+#include <arch/ops.h>
+#include <kernel/mutex.h>
+#include <kernel/rcu.h>
+#include <kernel/thread.h>
+#include <lib/workqueue.h>
+#include <lk/init.h>
 
 #define LOCAL_TRACE 0
 
-static struct list_node udp_list = LIST_INITIAL_VALUE(udp_list);
+/* listeners are hashed by port */
+#ifndef UDP_HASH_SIZE
+#define UDP_HASH_SIZE 16 // power of two
+#endif
 
 struct udp_listener {
     struct list_node list;
     uint16_t port;
     udp_callback_t callback;
+    udp_batch_callback_t batch_callback; // instead of callback, for batched listeners
     void *arg;
+    volatile int ref;
+    bool removed;
+
+    /* queued listeners get copies of their packets, delivered from udp_workqueue */
+    uint queue_len; // 0 to run the callback inline on the rx path
+    uint queued;
+    uint dropped;
+    struct list_node rx_queue;
+    work_t work;
+
+    struct rcu_head rcu; // drops the hash table's reference after removal
 };
 
+/* where a packet on a listener's rx queue came from, in front of its payload */
+struct udp_rx_info {
+    uint32_t src_ip;
+    uint16_t src_port;
+};
+
+/* most messages a batched listener is handed at once */
+#ifndef UDP_RX_BATCH
+#define UDP_RX_BATCH 16
+#endif
+
+/* protects the rx queues and changes to the hash table, udp_input looks
+ * listeners up under rcu */
+static mutex_t udp_lock = MUTEX_INITIAL_VALUE(udp_lock);
+static struct list_node udp_hash[UDP_HASH_SIZE];
+static workqueue_t *udp_workqueue;
+
 typedef struct udp_socket {
     uint32_t host;
     uint16_t sport;
     uint16_t dport;
-    const uint8_t *mac;
+    minip_route_t route; // picked at open, the socket sticks to it
+    uint8_t mac[6];
 } udp_socket_t;
 
 typedef struct udp_hdr {
@@ -59,39 +99,215 @@ typedef struct udp_hdr {
 } __PACKED udp_hdr_t;
 
 
-int udp_listen(uint16_t port, udp_callback_t cb, void *arg)
+static inline struct list_node *udp_hash_bucket(uint16_t port)
 {
-    struct udp_listener *entry, *temp;
+    return &udp_hash[(port ^ (port >> 8)) & (UDP_HASH_SIZE - 1)];
+}
 
-    list_for_every_entry_safe(&udp_list, entry, temp, struct udp_listener, list) {
-        if (entry->port == port) {
-            if (cb == NULL) {
-                list_delete(&entry->list);
-                return 0;
+static struct udp_listener *find_listener_locked(uint16_t port)
+{
+    struct udp_listener *e;
+
+    DEBUG_ASSERT(is_mutex_held(&udp_lock));
+
+    list_for_every_entry(udp_hash_bucket(port), e, struct udp_listener, list) {
+        if (e->port == port)
+            return e;
+    }
+
+    return NULL;
+}
+
+static void udp_listener_release(struct udp_listener *e)
+{
+    if (atomic_add(&e->ref, -1) != 1)
+        return;
+
+    /* the last reference is gone, so nothing else can touch the queue */
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&e->rx_queue, pktbuf_t, list)))
+        pktbuf_free(p, true);
+
+    free(e);
+}
+
+static void udp_listener_rcu_release(struct rcu_head *head)
+{
+    udp_listener_release(containerof(head, struct udp_listener, rcu));
+}
+
+/* drain a queued listener's rx queue into its callback, a batch at a time */
+static void udp_rx_work(void *arg)
+{
+    struct udp_listener *e = arg;
+    pktbuf_t *batch[UDP_RX_BATCH];
+    udp_msg_t msgs[UDP_RX_BATCH];
+    iovec_t iov[UDP_RX_BATCH];
+
+    for (;;) {
+        uint count = 0;
+
+        mutex_acquire(&udp_lock);
+        while (count < UDP_RX_BATCH &&
+                (batch[count] = list_remove_head_type(&e->rx_queue, pktbuf_t, list))) {
+            count++;
+        }
+        e->queued -= count;
+        bool removed = e->removed;
+        mutex_release(&udp_lock);
+
+        if (count == 0)
+            break;
+
+        for (uint i = 0; i < count; i++) {
+            struct udp_rx_info *info = pktbuf_consume(batch[i], sizeof(struct udp_rx_info));
+            iov[i].iov_base = batch[i]->data;
+            iov[i].iov_len = batch[i]->dlen;
+            msgs[i].iov = &iov[i];
+            msgs[i].iov_count = 1;
+            msgs[i].addr = info->src_ip;
+            msgs[i].port = info->src_port;
+        }
+
+        if (!removed) {
+            if (e->batch_callback) {
+                e->batch_callback(msgs, count, e->arg);
+            } else {
+                for (uint i = 0; i < count; i++)
+                    e->callback(iov[i].iov_base, iov[i].iov_len, msgs[i].addr, msgs[i].port, e->arg);
             }
+        }
+
+        for (uint i = 0; i < count; i++)
+            pktbuf_free(batch[i], true);
+    }
+
+    /* drop the reference the queueing took */
+    udp_listener_release(e);
+}
+
+/* copy the packet onto a queued listener's rx queue. the driver takes
+ * its buffer back once udp_input returns. */
+static void udp_queue_rx(struct udp_listener *e, pktbuf_t *p, uint32_t src_ip, uint16_t src_port)
+{
+    pktbuf_t *q = NULL;
+
+    if (p->dlen <= PKTBUF_MAX_DATA - sizeof(struct udp_rx_info))
+        q = pktbuf_alloc();
+    if (!q) {
+        mutex_acquire(&udp_lock);
+        e->dropped++;
+        mutex_release(&udp_lock);
+        return;
+    }
+
+    struct udp_rx_info *info = pktbuf_append(q, sizeof(struct udp_rx_info));
+    info->src_ip = src_ip;
+    info->src_port = src_port;
+    pktbuf_append_data(q, p->data, p->dlen);
+
+    mutex_acquire(&udp_lock);
+    if (e->removed || e->queued >= e->queue_len) {
+        e->dropped++;
+        mutex_release(&udp_lock);
+        pktbuf_free(q, true);
+        return;
+    }
+
+    list_add_tail(&e->rx_queue, &q->list);
+    e->queued++;
+
+    /* every run the work is queued for holds a reference */
+    atomic_add(&e->ref, 1);
+    if (workqueue_queue(udp_workqueue, &e->work, 0) < 0)
+        atomic_add(&e->ref, -1); // already pending, that run picks this up
+    mutex_release(&udp_lock);
+}
+
+static int udp_listen_etc(uint16_t port, udp_callback_t cb, udp_batch_callback_t batch_cb,
+                          void *arg, uint queue_len)
+{
+    struct udp_listener *entry;
+
+    mutex_acquire(&udp_lock);
+
+    entry = find_listener_locked(port);
+    if (entry) {
+        if (cb != NULL || batch_cb != NULL) {
+            mutex_release(&udp_lock);
             return -1;
         }
+
+        /* callbacks already running or queued finish, nothing new is delivered */
+        rcu_list_delete(&entry->list);
+        entry->removed = true;
+        mutex_release(&udp_lock);
+
+        /* udp_input may have found it just before it came off the list */
+        call_rcu(&entry->rcu, &udp_listener_rcu_release);
+        return 0;
     }
 
-    if ((entry = malloc(sizeof(struct udp_listener))) == NULL) {
+    if (cb == NULL && batch_cb == NULL) {
+        mutex_release(&udp_lock);
+        return 0;
+    }
+
+    if (queue_len > 0 && !udp_workqueue) {
+        udp_workqueue = workqueue_create("udp_rx", DEFAULT_PRIORITY, 1, 0);
+        if (!udp_workqueue) {
+            mutex_release(&udp_lock);
+            return -1;
+        }
+    }
+
+    if ((entry = calloc(1, sizeof(struct udp_listener))) == NULL) {
+        mutex_release(&udp_lock);
         return -1;
     }
 
     entry->port = port;
     entry->callback = cb;
+    entry->batch_callback = batch_cb;
     entry->arg = arg;
+    entry->ref = 1; // the hash table's
+    entry->queue_len = queue_len;
+    list_initialize(&entry->rx_queue);
+    work_init(&entry->work, &udp_rx_work, entry);
+
+    rcu_list_add_tail(udp_hash_bucket(port), &entry->list);
 
-    list_add_tail(&udp_list, &entry->list);
+    mutex_release(&udp_lock);
 
     return 0;
 }
 
+int udp_listen(uint16_t port, udp_callback_t cb, void *arg)
+{
+    return udp_listen_etc(port, cb, NULL, arg, 0);
+}
+
+int udp_listen_queued(uint16_t port, udp_callback_t cb, void *arg, uint queue_len)
+{
+    if (cb && queue_len == 0)
+        return -1;
+
+    return udp_listen_etc(port, cb, NULL, arg, queue_len);
+}
+
+int udp_listen_batch(uint16_t port, udp_batch_callback_t cb, void *arg, uint queue_len)
+{
+    if (cb && queue_len == 0)
+        return -1;
+
+    return udp_listen_etc(port, NULL, cb, arg, queue_len);
+}
+
 status_t udp_open(uint32_t host, uint16_t sport, uint16_t dport, udp_socket_t **handle)
 {
     LTRACEF("host %u.%u.%u.%u sport %u dport %u handle %p\n",
             IPV4_SPLIT(host), sport, dport, handle);
     udp_socket_t *socket;
-    const uint8_t *dst_mac;
 
     if (handle == NULL) {
         return -EINVAL;
@@ -102,8 +318,8 @@ status_t udp_open(uint32_t host, uint16_t sport, uint16_t dport, udp_socket_t **
         return -ENOMEM;
     }
 
-    dst_mac = arp_get_dest_mac(host);
-    if (dst_mac == NULL) {
+    if (!minip_route_lookup(host, minip_flow_hash(host, sport, dport), &socket->route) ||
+            arp_get_dest_mac(socket->route.netif, socket->route.nexthop, socket->mac) < 0) {
         free(socket);
         return -EHOSTUNREACH;
     }
@@ -111,7 +327,6 @@ status_t udp_open(uint32_t host, uint16_t sport, uint16_t dport, udp_socket_t **
     socket->host = host;
     socket->sport = sport;
     socket->dport = dport;
-    socket->mac = dst_mac;
 
     *handle = socket;
 
@@ -128,26 +343,36 @@ status_t udp_close(udp_socket_t *handle)
     return NO_ERROR;
 }
 
-status_t udp_send_iovec(const iovec_t *iov, uint iov_count, udp_socket_t *handle)
+/* the most that goes out as a single unfragmented packet built in one buffer */
+static size_t udp_max_single_payload(const udp_socket_t *handle)
+{
+    return MIN(PKTBUF_MAX_DATA - sizeof(udp_hdr_t) - sizeof(struct ipv4_hdr),
+               minip_ipv4_max_payload(handle->route.netif) - sizeof(udp_hdr_t));
+}
+
+/* build a complete frame for the socket out of iov */
+static status_t udp_build_pkt(const iovec_t *iov, uint iov_count, udp_socket_t *handle, pktbuf_t **out)
 {
     pktbuf_t *p;
     struct eth_hdr *eth;
     struct ipv4_hdr *ip;
     udp_hdr_t *udp;
-    status_t ret = NO_ERROR;
     void *buf;
     ssize_t len;
 
-    if (handle == NULL || iov == NULL || iov_count == 0) {
+    if (iov == NULL || iov_count == 0) {
         return -EINVAL;
     }
 
+    len = iovec_size(iov, iov_count);
+    if (len > (ssize_t)udp_max_single_payload(handle)) {
+        return -EMSGSIZE;
+    }
+
     if ((p = pktbuf_alloc()) == NULL) {
         return -ENOMEM;
     }
 
-    len = iovec_size(iov, iov_count);
-
     buf = pktbuf_append(p, len);
     udp = pktbuf_prepend(p, sizeof(udp_hdr_t));
     ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
@@ -160,16 +385,99 @@ status_t udp_send_iovec(const iovec_t *iov, uint iov_count, udp_socket_t *handle
     udp->len        = htons(sizeof(udp_hdr_t) + len);
     udp->chksum     = 0;
 
-    minip_build_mac_hdr(eth, handle->mac, ETH_TYPE_IPV4);
-    minip_build_ipv4_hdr(ip, handle->host, IP_PROTO_UDP, len + sizeof(udp_hdr_t));
+    minip_build_mac_hdr(handle->route.netif, eth, handle->mac, ETH_TYPE_IPV4);
+    minip_build_ipv4_hdr(handle->route.netif, ip, handle->host, IP_PROTO_UDP, len + sizeof(udp_hdr_t));
 
 #if (MINIP_USE_UDP_CHECKSUM != 0)
     udp->chksum = rfc768_chksum(ip, udp);
 #endif
 
-    minip_tx_handler(p);
+    *out = p;
+    return NO_ERROR;
+}
+
+/* datagrams too big for one buffer are copied into a chain and go through the
+ * ip layer, which fragments them to fit the mtu */
+static status_t udp_send_large(const iovec_t *iov, uint iov_count, size_t len, udp_socket_t *handle)
+{
+    if (len > 0xffff - sizeof(udp_hdr_t) - sizeof(struct ipv4_hdr)) {
+        return -EMSGSIZE;
+    }
 
-    return ret;
+    pktbuf_t *p = pktbuf_alloc_chain(sizeof(udp_hdr_t) + len);
+    if (!p) {
+        return -ENOMEM;
+    }
+
+    /* no checksum, it is optional and would have to be summed across the parts */
+    udp_hdr_t udp;
+    udp.src_port    = htons(handle->sport);
+    udp.dst_port    = htons(handle->dport);
+    udp.len         = htons(sizeof(udp_hdr_t) + len);
+    udp.chksum      = 0;
+    pktbuf_copy_in(p, 0, &udp, sizeof(udp));
+
+    size_t offset = sizeof(udp_hdr_t);
+    for (uint i = 0; i < iov_count; i++) {
+        pktbuf_copy_in(p, offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+
+    return minip_ipv4_send_route(&handle->route, p, handle->host, IP_PROTO_UDP);
+}
+
+status_t udp_send_iovec(const iovec_t *iov, uint iov_count, udp_socket_t *handle)
+{
+    pktbuf_t *p;
+
+    if (handle == NULL) {
+        return -EINVAL;
+    }
+
+    if (iov != NULL && iov_count > 0) {
+        ssize_t len = iovec_size(iov, iov_count);
+        if (len > (ssize_t)udp_max_single_payload(handle)) {
+            return udp_send_large(iov, iov_count, len, handle);
+        }
+    }
+
+    status_t ret = udp_build_pkt(iov, iov_count, handle, &p);
+    if (ret < 0) {
+        return ret;
+    }
+
+    minip_netif_tx(handle->route.netif, p);
+
+    return NO_ERROR;
+}
+
+int udp_send_batch(const udp_msg_t *msgs, uint count, udp_socket_t *handle)
+{
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    status_t ret = NO_ERROR;
+    uint built;
+
+    if (handle == NULL || msgs == NULL) {
+        return -EINVAL;
+    }
+
+    /* build them all up front, then give the driver the lot */
+    for (built = 0; built < count; built++) {
+        pktbuf_t *p;
+        ret = udp_build_pkt(msgs[built].iov, msgs[built].iov_count, handle, &p);
+        if (ret < 0) {
+            break;
+        }
+        list_add_tail(&list, &p->list);
+    }
+
+    if (built == 0) {
+        return ret;
+    }
+
+    minip_netif_tx_list(handle->route.netif, &list);
+
+    return built;
 }
 
 status_t udp_send(void *buf, size_t len, udp_socket_t *handle)
@@ -200,10 +508,36 @@ void udp_input(pktbuf_t *p, uint32_t src_ip)
 
     port = ntohs(udp->dst_port);
 
-    list_for_every_entry(&udp_list, e, struct udp_listener, list) {
-        if (e->port == port) {
-            e->callback(p->data, p->dlen, src_ip, ntohs(udp->src_port), e->arg);
-            return;
+    /* hold on to the listener, the callback may stop listening */
+    struct udp_listener *entry;
+    rcu_read_state_t state;
+    e = NULL;
+    rcu_read_lock(state);
+    rcu_list_for_every_entry(udp_hash_bucket(port), entry, struct udp_listener, list) {
+        if (entry->port == port) {
+            atomic_add(&entry->ref, 1);
+            e = entry;
+            break;
         }
     }
+    rcu_read_unlock(state);
+
+    if (!e)
+        return;
+
+    if (e->queue_len > 0) {
+        udp_queue_rx(e, p, src_ip, ntohs(udp->src_port));
+    } else {
+        e->callback(p->data, p->dlen, src_ip, ntohs(udp->src_port), e->arg);
+    }
+
+    udp_listener_release(e);
 }
+
+static void udp_init(uint level)
+{
+    for (uint i = 0; i < UDP_HASH_SIZE; i++)
+        list_initialize(&udp_hash[i]);
+}
+
+LK_INIT_HOOK(udp, udp_init, LK_INIT_LEVEL_THREADING);
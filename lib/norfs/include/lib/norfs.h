@@ -77,4 +77,20 @@ status_t norfs_read_obj(uint32_t key, unsigned char *buffer, uint16_t buffer_len
  */
 void norfs_wipe_fs(void);
 
+/*
+ * Garbage collection counters since mount.  Write amplification is
+ * (host_bytes + gc_bytes) / host_bytes.
+ */
+struct norfs_gc_stats {
+    uint32_t blocks_erased;
+    uint32_t sync_collections;  /* collections a writer had to wait for */
+    uint32_t objects_copied;
+    uint64_t host_bytes;        /* bytes written on behalf of callers */
+    uint64_t gc_bytes;          /* bytes rewritten by the collector */
+    lk_bigtime_t gc_time;       /* total time spent collecting, in us */
+    lk_bigtime_t max_step_time; /* longest the collector held the fs, in us */
+};
+
+status_t norfs_get_gc_stats(struct norfs_gc_stats *stats);
+
 #endif
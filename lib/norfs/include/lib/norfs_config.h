@@ -36,6 +36,21 @@
 #define NORFS_AVAILABLE_SPACE ((NORFS_NVRAM_SIZE - NORFS_NUM_BLOCKS * NORFS_BLOCK_HEADER_SIZE) / 2)
 #define NORFS_MIN_FREE_BLOCKS 1
 
+/* The background collector wakes up once no more than the low watermark of
+ * blocks are free and keeps collecting until the high watermark is reached.
+ * Writes only collect synchronously when they eat into the last
+ * NORFS_MIN_FREE_BLOCKS blocks.
+ */
+#ifndef NORFS_GC_LOW_WATERMARK
+#define NORFS_GC_LOW_WATERMARK (NORFS_MIN_FREE_BLOCKS + 1)
+#endif
+#ifndef NORFS_GC_HIGH_WATERMARK
+#define NORFS_GC_HIGH_WATERMARK (NORFS_MIN_FREE_BLOCKS + 2)
+#endif
+#ifndef NORFS_GC_PRIORITY
+#define NORFS_GC_PRIORITY LOW_PRIORITY
+#endif
+
 #define NORFS_KEY_OFFSET 0
 #define NORFS_VERSION_OFFSET 4
 #define NORFS_LENGTH_OFFSET 6
@@ -45,4 +60,8 @@
 
 #define NORFS_DELETED_MASK 1
 
+/* inodes are found through a hash of their key with this many buckets */
+#define NORFS_INODE_HASH_BITS 8
+#define NORFS_INODE_HASH_SIZE (1 << NORFS_INODE_HASH_BITS)
+
 #endif
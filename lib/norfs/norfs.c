@@ -33,6 +33,9 @@
 #include <platform/flash_nor_config.h>
 #include <list.h>
 #include <debug.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
 
 /* FRIEND_TEST non-static if unit testing, in order to
  * allow functions to be exposed by a test header file.
@@ -55,6 +58,9 @@
  */
 #define VERSION_GREATER_THAN(a, b) ((int16_t)((a) - (b)) > 0)
 
+/* Key reserved for checkpoints, callers can't store objects under it. */
+#define NORFS_CHECKPOINT_KEY 0xFFFF
+
 struct norfs_header {
     uint32_t key;
     uint16_t version;
@@ -63,6 +69,34 @@ struct norfs_header {
     uint16_t crc;
 };
 
+/*
+ * A checkpoint is written as the first object of every block opened for
+ * writing, holding the inode table and per block state at that point.  Each
+ * block that held objects is identified by its last object, so mount can tell
+ * whether it has only been appended to since.
+ */
+struct norfs_checkpoint_block {
+    uint32_t last;              /* header of the last object, 0 if none */
+    uint32_t last_key;
+    uint16_t last_version;
+    uint16_t last_crc;
+    uint32_t erases;
+    uint32_t live;
+};
+
+struct norfs_checkpoint_inode {
+    uint32_t key;
+    uint32_t location;
+    uint32_t reference_count;
+};
+
+struct norfs_checkpoint {
+    uint32_t total_remaining_space;
+    uint32_t num_inodes;
+    struct norfs_checkpoint_block blocks[NORFS_NUM_BLOCKS];
+    /* followed by num_inodes struct norfs_checkpoint_inode */
+};
+
 /* Block header written after successful erase. */
 FRIEND_TEST const unsigned char NORFS_BLOCK_HEADER[4] = {'T', 'O', 'F', 'U'};
 /* Block header to indicate garbage collection has started. */
@@ -78,10 +112,37 @@ FRIEND_TEST uint8_t num_free_blocks = 0;
 static bool fs_mounted = false;
 FRIEND_TEST uint32_t norfs_nvram_offset;
 static struct list_node inode_list;
+static struct list_node inode_hash[NORFS_INODE_HASH_SIZE];
 
 static bool block_free[NORFS_NUM_BLOCKS];
 
+/* Per block bookkeeping for picking blocks, kept in memory since mount:
+ * erases, bytes held by current versions of objects, and when the block was
+ * last opened for writing on the block_seq clock.
+ */
+static uint32_t block_erases[NORFS_NUM_BLOCKS];
+static uint32_t block_live[NORFS_NUM_BLOCKS];
+static uint32_t block_opened[NORFS_NUM_BLOCKS];
+static uint32_t block_seq;
+/* header of the last object written to each block, 0 if none */
+static uint32_t block_last[NORFS_NUM_BLOCKS];
+static uint16_t checkpoint_version;
+
+/* Serializes all access to the fs state and the flash. */
+static mutex_t norfs_lock = MUTEX_INITIAL_VALUE(norfs_lock);
+
+/* Background collector.  A block is collected one object at a time, gc_block
+ * and gc_read_ptr track how far it got, -1 means no block is being collected.
+ */
+static thread_t *gc_thread;
+static event_t gc_event = EVENT_INITIAL_VALUE(gc_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+static bool gc_exit;
+static int gc_block = -1;
+static uint32_t gc_read_ptr;
+static struct norfs_gc_stats gc_stats;
+
 static status_t collect_garbage(void);
+static status_t write_checkpoint(uint32_t *ptr);
 static status_t load_and_verify_obj(uint32_t *ptr, struct norfs_header *header);
 
 FRIEND_TEST uint8_t block_num(uint32_t flash_pointer)
@@ -89,21 +150,28 @@ FRIEND_TEST uint8_t block_num(uint32_t flash_pointer)
     return flash_pointer/FLASH_PAGE_SIZE;
 }
 
-/* Update pointer to a free block.  If no free blocks, return error. */
+/*
+ * Update pointer to the least erased free block, going round robin from the
+ * current block among equally worn ones.  If no free blocks, return error.
+ */
 FRIEND_TEST status_t find_free_block(uint32_t *ptr)
 {
     uint8_t i = block_num(*ptr) + 1;
     uint8_t imod;
+    int best = -1;
     for (uint8_t j = 0;  j < NORFS_NUM_BLOCKS; i++, j++) {
         imod  = i % NORFS_NUM_BLOCKS;
-        /* If is a free block, return. */
-        if (block_free[imod]) {
-            *ptr = imod * FLASH_PAGE_SIZE + sizeof(NORFS_BLOCK_HEADER);
-            return NO_ERROR;
+        if (block_free[imod] &&
+                (best < 0 || block_erases[imod] < block_erases[best])) {
+            best = imod;
         }
     }
-    /* A free block could not be found. */
-    return ERR_NO_MEMORY;
+    if (best < 0) {
+        /* A free block could not be found. */
+        return ERR_NO_MEMORY;
+    }
+    *ptr = best * FLASH_PAGE_SIZE + sizeof(NORFS_BLOCK_HEADER);
+    return NO_ERROR;
 }
 
 static uint32_t curr_block_free_space(uint32_t pointer)
@@ -119,9 +187,53 @@ static bool block_full(uint8_t block, uint32_t ptr)
     return curr_block_free_space(ptr) < NORFS_OBJ_OFFSET;
 }
 
-static uint8_t select_garbage_block(uint32_t ptr)
+/*
+ * Cost-benefit victim selection: what erasing a block gains over what copying
+ * its live data costs, weighted by how long ago it was written so that cold,
+ * mostly live blocks are still cycled and wear evens out.  Blocks scan round
+ * robin from the block being written to, which breaks ties.
+ */
+static int select_garbage_block(uint32_t ptr)
+{
+    const uint32_t capacity = FLASH_PAGE_SIZE - NORFS_BLOCK_HEADER_SIZE;
+    uint64_t score, best_score = 0;
+    uint32_t live;
+    uint8_t block;
+    int best = -1;
+
+    for (uint8_t i = 1; i < NORFS_NUM_BLOCKS; i++) {
+        block = (block_num(ptr) + i) % NORFS_NUM_BLOCKS;
+        if (block_free[block])
+            continue;
+
+        live = MIN(block_live[block], capacity);
+        score = (uint64_t)(capacity - live) *
+                (block_seq - block_opened[block] + 1) * capacity /
+                (capacity + live);
+        if (best < 0 || score > best_score) {
+            best = block;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+/* Account for an object version becoming, or no longer being, current. */
+static void block_live_add(uint32_t loc, uint16_t len)
 {
-    return (block_num(ptr) + 1) % 8;
+    block_live[block_num(loc)] += NORFS_FLASH_SIZE(len);
+}
+
+static void block_live_sub(uint32_t loc, uint16_t len)
+{
+    uint32_t *live = &block_live[block_num(loc)];
+    *live -= MIN(*live, NORFS_FLASH_SIZE(len));
+}
+
+static void gc_kick(void)
+{
+    if (num_free_blocks <= NORFS_GC_LOW_WATERMARK)
+        event_signal(&gc_event, false);
 }
 
 static ssize_t nvram_read(size_t offset, size_t length, void *ptr)
@@ -146,21 +258,35 @@ unsigned char *nvram_flash_pointer(uint32_t loc)
     return FLASH_PTR(flash_nor_get_bank(NORFS_BANK), loc + norfs_nvram_offset);
 }
 
+static inline struct list_node *inode_bucket(uint32_t key)
+{
+    return &inode_hash[(key * 0x9e3779b1u) >> (32 - NORFS_INODE_HASH_BITS)];
+}
+
+static void init_inodes(void)
+{
+    list_initialize(&inode_list);
+    for (uint32_t i = 0; i < NORFS_INODE_HASH_SIZE; i++)
+        list_initialize(&inode_hash[i]);
+}
+
+static void add_inode(struct norfs_inode *inode, uint32_t key)
+{
+    inode->key = key;
+    list_add_tail(&inode_list, &inode->lnode);
+    list_add_head(inode_bucket(key), &inode->hnode);
+}
+
 FRIEND_TEST bool get_inode(uint32_t key, struct norfs_inode **inode)
 {
-    struct list_node *curr_lnode;
     struct norfs_inode *curr_inode;
-    uint32_t curr_key;
 
     if (!inode)
         return false;
 
     *inode = NULL;
-    list_for_every(&inode_list, curr_lnode) {
-        curr_inode = containerof(curr_lnode, struct norfs_inode, lnode);
-        nvram_read(curr_inode->location + NORFS_KEY_OFFSET,
-                   sizeof(curr_key), &curr_key);
-        if (curr_key == key) {
+    list_for_every_entry(inode_bucket(key), curr_inode, struct norfs_inode, hnode) {
+        if (curr_inode->key == key) {
             *inode = curr_inode;
             return true;
         }
@@ -220,8 +346,8 @@ static ssize_t read_header(uint32_t ptr, struct norfs_header *header)
     return total_bytes_read;
 }
 
-status_t norfs_read_obj_iovec(uint32_t key, iovec_t *obj_iov,
-                              uint32_t iov_count, size_t *bytes_read, uint8_t flags)
+static status_t read_obj_iovec_locked(uint32_t key, iovec_t *obj_iov,
+                                      uint32_t iov_count, size_t *bytes_read)
 {
     if (!fs_mounted)
         return ERR_NOT_MOUNTED;
@@ -273,6 +399,16 @@ status_t norfs_read_obj_iovec(uint32_t key, iovec_t *obj_iov,
     return NO_ERROR;
 }
 
+status_t norfs_read_obj_iovec(uint32_t key, iovec_t *obj_iov,
+                              uint32_t iov_count, size_t *bytes_read, uint8_t flags)
+{
+    mutex_acquire(&norfs_lock);
+    status_t status = read_obj_iovec_locked(key, obj_iov, iov_count, bytes_read);
+    mutex_release(&norfs_lock);
+
+    return status;
+}
+
 static status_t write_obj_header(uint32_t *ptr, uint32_t key, uint16_t version,
                                  uint16_t len, uint8_t flags, uint16_t crc)
 {
@@ -370,6 +506,8 @@ static status_t initialize_next_block(uint32_t *ptr)
 
     num_free_blocks--;
     block_free[block_num(*ptr)] = false;
+    block_opened[block_num(*ptr)] = ++block_seq;
+    gc_kick();
     bytes_written = nvram_write(*ptr,
                                 sizeof(NORFS_BLOCK_GC_STARTED_HEADER), &NORFS_BLOCK_GC_STARTED_HEADER);
 
@@ -382,6 +520,12 @@ static status_t initialize_next_block(uint32_t *ptr)
     *ptr += sizeof(NORFS_BLOCK_GC_STARTED_HEADER) +
             sizeof(NORFS_BLOCK_GC_FINISHED_HEADER);
 
+    status = write_checkpoint(ptr);
+    if (status) {
+        TRACEF("Failed to write checkpoint.  Error: %d\n", status);
+        return status;
+    }
+
     if (num_free_blocks < NORFS_MIN_FREE_BLOCKS) {
         status = collect_garbage();
         if (status) {
@@ -428,9 +572,69 @@ status_t write_obj_iovec(const iovec_t *iov, uint iov_count, uint *location,
         return status;
     }
 
+    block_last[block_num(header_loc)] = header_loc;
     return NO_ERROR;
 }
 
+/*
+ * Write a checkpoint at ptr, which must be the start of a block that was just
+ * opened.  Skipped when there is nothing to describe or the inode table has
+ * outgrown what fits in an object, mount then falls back to an older
+ * checkpoint or to scanning.
+ */
+static status_t write_checkpoint(uint32_t *ptr)
+{
+    struct norfs_checkpoint *cp;
+    struct norfs_checkpoint_inode *entry;
+    struct norfs_inode *inode;
+    struct norfs_header header;
+    struct iovec iov[1];
+    status_t status;
+    size_t len;
+
+    size_t num_inodes = list_length(&inode_list);
+    len = sizeof(*cp) + num_inodes * sizeof(*entry);
+    if (num_inodes == 0 || len > NORFS_MAX_OBJ_LEN)
+        return NO_ERROR;
+
+    cp = calloc(1, len);
+    if (!cp)
+        return NO_ERROR;
+
+    cp->total_remaining_space = total_remaining_space;
+    cp->num_inodes = num_inodes;
+    for (uint8_t i = 0; i < NORFS_NUM_BLOCKS; i++) {
+        cp->blocks[i].erases = block_erases[i];
+        cp->blocks[i].live = block_live[i];
+        if (block_free[i] || !block_last[i] || i == block_num(*ptr))
+            continue;
+        if (read_header(block_last[i], &header) < 0)
+            continue;
+        cp->blocks[i].last = block_last[i];
+        cp->blocks[i].last_key = header.key;
+        cp->blocks[i].last_version = header.version;
+        cp->blocks[i].last_crc = header.crc;
+    }
+
+    entry = (struct norfs_checkpoint_inode *)(cp + 1);
+    list_for_every_entry(&inode_list, inode, struct norfs_inode, lnode) {
+        entry->key = inode->key;
+        entry->location = inode->location;
+        entry->reference_count = inode->reference_count;
+        entry++;
+    }
+
+    iov->iov_base = cp;
+    iov->iov_len = len;
+    status = write_obj_iovec(iov, 1, ptr, NORFS_CHECKPOINT_KEY,
+                             checkpoint_version + 1, 0);
+    if (!status)
+        checkpoint_version++;
+
+    free(cp);
+    return status;
+}
+
 status_t norfs_read_obj(uint32_t key, unsigned char *buffer,
                         uint16_t buffer_len, size_t *bytes_read,
                         uint8_t flags)
@@ -452,7 +656,7 @@ status_t norfs_put_obj(uint32_t key, unsigned char *obj, uint16_t len,
     if (!fs_mounted)
         return ERR_NOT_MOUNTED;
 
-    if (key == 0xFFFF) {
+    if (key == NORFS_CHECKPOINT_KEY) {
         return ERR_INVALID_ARGS;
     }
     status_t status;
@@ -468,23 +672,33 @@ bool is_deleted(uint32_t loc)
     return NORFS_DELETED_MASK & flags;
 }
 
+static status_t put_obj_iovec_locked(uint32_t key, const iovec_t *iov,
+                                     uint32_t iov_count, uint8_t flags);
+
 status_t norfs_remove_obj(uint32_t key)
 {
-    if (!fs_mounted)
-        return ERR_NOT_MOUNTED;
-
     struct norfs_inode *inode;
     uint16_t prior_len;
     struct iovec iov[1];
     status_t status;
+
+    mutex_acquire(&norfs_lock);
+    if (!fs_mounted) {
+        mutex_release(&norfs_lock);
+        return ERR_NOT_MOUNTED;
+    }
+
     bool success = get_inode(key, &inode);
-    if (!success || is_deleted(inode->location))
+    if (!success || is_deleted(inode->location)) {
+        mutex_release(&norfs_lock);
         return ERR_NOT_FOUND;
+    }
 
     status = nvram_read(inode->location + NORFS_LENGTH_OFFSET,
                         sizeof(uint16_t), &prior_len);
     if (status < 0) {
         TRACEF("Failed to read during norfs_remove_obj.  Status: %d\n", status);
+        mutex_release(&norfs_lock);
         return status;
     }
 
@@ -495,9 +709,10 @@ status_t norfs_remove_obj(uint32_t key)
      * Write a deleted object by passing a null iovec pointer.  Only header
      * will be written.
      */
-    status = norfs_put_obj_iovec(key, iov, 0, NORFS_DELETED_MASK);
+    status = put_obj_iovec_locked(key, iov, 0, NORFS_DELETED_MASK);
     if (status)
         TRACEF("Error putting object. %d\n", status);
+    mutex_release(&norfs_lock);
 
     return status;
 }
@@ -525,13 +740,13 @@ static status_t find_space_for_object(uint16_t obj_len, uint32_t *ptr)
  * write to - after a full loop in a round-robin style garbage selection of
  * blocks.  Which is a lot of write attempts.
  */
-status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
-                             uint32_t iov_count, uint8_t flags)
+static status_t put_obj_iovec_locked(uint32_t key, const iovec_t *iov,
+                                     uint32_t iov_count, uint8_t flags)
 {
     if (!fs_mounted)
         return ERR_NOT_MOUNTED;
 
-    if (key == 0xFFFF) {
+    if (key == NORFS_CHECKPOINT_KEY) {
         return ERR_INVALID_ARGS;
     }
 
@@ -563,6 +778,8 @@ status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
         return ERR_NOT_FOUND;
     } else {
         inode = malloc(sizeof(struct norfs_inode));
+        if (!inode)
+            return ERR_NO_MEMORY;
         inode->reference_count = 1;
     }
 
@@ -594,17 +811,20 @@ status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
                              version, flags);
     if (!status) {
         if (!obj_preexists) {
-            list_add_tail(&inode_list, &inode->lnode);
+            add_inode(inode, key);
         } else {
             /* If object preexists, remove outdated version from remaining space. */
             uint16_t prior_len;
             nvram_read(inode->location + NORFS_LENGTH_OFFSET,
                        sizeof(uint16_t), &prior_len);
             total_remaining_space += NORFS_FLASH_SIZE(prior_len);
+            block_live_sub(inode->location, prior_len);
             inode->reference_count++;
         }
         inode->location = header_loc;
+        block_live_add(header_loc, len);
         total_remaining_space -= NORFS_FLASH_SIZE(len);
+        gc_stats.host_bytes += NORFS_FLASH_SIZE(len);
     } else {
         TRACEF("Error writing object. Status: %d\n", status);
     }
@@ -618,11 +838,22 @@ status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
     return status;
 }
 
+status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
+                             uint32_t iov_count, uint8_t flags)
+{
+    mutex_acquire(&norfs_lock);
+    status_t status = put_obj_iovec_locked(key, iov, iov_count, flags);
+    mutex_release(&norfs_lock);
+
+    return status;
+}
+
 static void remove_inode(struct norfs_inode *inode)
 {
     if (!inode)
         return;
     list_delete(&inode->lnode);
+    list_delete(&inode->hnode);
     free(inode);
     inode = NULL;
 }
@@ -643,6 +874,10 @@ static status_t collect_garbage_object(uint32_t *garbage_read_pointer,
         TRACEF("Failed to load garbage_obj at %d\n", *garbage_read_pointer);
         return status;
     }
+    if (header.key == NORFS_CHECKPOINT_KEY) {
+        /* A newer one was written to the block the write pointer is in. */
+        return NO_ERROR;
+    }
     inode_found = get_inode(header.key, &inode);
     if (inode_found) {
         if (garb_obj_loc == inode->location) {
@@ -651,6 +886,7 @@ static status_t collect_garbage_object(uint32_t *garbage_read_pointer,
                 /* If last version of object, remove. */
                 remove_inode(inode);
                 total_remaining_space += NORFS_OBJ_OFFSET;
+                block_live_sub(garb_obj_loc, header.len);
                 return NO_ERROR;
             }
             iov->iov_base = nvram_flash_pointer(garb_obj_loc + NORFS_OBJ_OFFSET);
@@ -663,6 +899,10 @@ static status_t collect_garbage_object(uint32_t *garbage_read_pointer,
                 return status;
             }
             inode->location = new_obj_loc;
+            block_live_sub(garb_obj_loc, header.len);
+            block_live_add(new_obj_loc, header.len);
+            gc_stats.objects_copied++;
+            gc_stats.gc_bytes += NORFS_FLASH_SIZE(header.len);
             return NO_ERROR;
         } else {
             inode->reference_count--;
@@ -712,6 +952,9 @@ static status_t erase_block(uint8_t block)
     }
     block_free[block] = true;
     num_free_blocks++;
+    block_erases[block]++;
+    block_live[block] = 0;
+    block_last[block] = 0;
 
     return NO_ERROR;
 }
@@ -732,15 +975,170 @@ FRIEND_TEST status_t collect_block(uint32_t garbage_block,
     return erase_block(garbage_block);
 }
 
+static void gc_account_step(lk_bigtime_t start)
+{
+    lk_bigtime_t elapsed = current_time_hires() - start;
+    gc_stats.max_step_time = MAX(gc_stats.max_step_time, elapsed);
+}
+
+static status_t gc_start_block(void)
+{
+    int block = select_garbage_block(write_pointer);
+    if (block < 0)
+        return ERR_NOT_FOUND;
+
+    gc_block = block;
+    gc_read_ptr = block * FLASH_PAGE_SIZE + NORFS_BLOCK_HEADER_SIZE;
+    return NO_ERROR;
+}
+
+/*
+ * Move the next object off the block being collected.  Fails once the end of
+ * the objects in the block has been reached.
+ */
+static status_t gc_move_object(void)
+{
+    lk_bigtime_t start = current_time_hires();
+    status_t status = collect_garbage_object(&gc_read_ptr, &write_pointer);
+    gc_stats.gc_time += current_time_hires() - start;
+
+    return status;
+}
+
+static status_t gc_finish_block(void)
+{
+    lk_bigtime_t start = current_time_hires();
+    status_t status = erase_block(gc_block);
+    gc_stats.gc_time += current_time_hires() - start;
+
+    if (!status)
+        gc_stats.blocks_erased++;
+    gc_block = -1;
+    return status;
+}
+
+/*
+ * Collect a whole block while a write waits on it.  Only happens once the
+ * write pointer has moved into the last reserved free block, which then
+ * receives whatever the background collector has not moved yet.
+ */
 static status_t collect_garbage(void)
 {
+    lk_bigtime_t start = current_time_hires();
     status_t status;
-    uint8_t garbage_read_block = select_garbage_block(write_pointer);
-    status = collect_block(garbage_read_block, &write_pointer);
 
+    if (gc_block < 0) {
+        status = gc_start_block();
+        if (status)
+            return status;
+    }
+
+    while (!block_full(gc_block, gc_read_ptr)) {
+        if (gc_move_object())
+            break;
+    }
+    status = gc_finish_block();
+
+    gc_stats.sync_collections++;
+    gc_account_step(start);
     return status;
 }
 
+/*
+ * One unit of background collection, called with norfs_lock held: pick a
+ * block, move a single object off it, or erase it once nothing live is left
+ * on it.  Returns false when there is nothing more to do for now.
+ */
+static bool gc_step(void)
+{
+    struct norfs_header header;
+    uint8_t block_num_to_write;
+
+    if (!fs_mounted)
+        return false;
+
+    if (gc_block < 0) {
+        if (num_free_blocks >= NORFS_GC_HIGH_WATERMARK)
+            return false;
+        return gc_start_block() == NO_ERROR;
+    }
+
+    if (block_full(gc_block, gc_read_ptr)) {
+        gc_finish_block();
+        return true;
+    }
+
+    /* Make room the way a write would, but leave the reserved blocks to
+     * collect_garbage(), which will finish this block if it gets there first.
+     */
+    if (read_header(gc_read_ptr, &header) >= 0 &&
+            header.len <= NORFS_MAX_OBJ_LEN &&
+            curr_block_free_space(write_pointer) < NORFS_FLASH_SIZE(header.len)) {
+        if (num_free_blocks <= NORFS_MIN_FREE_BLOCKS)
+            return false;
+        if (initialize_next_block(&write_pointer))
+            return false;
+    }
+
+    block_num_to_write = block_num(write_pointer);
+    if (gc_move_object()) {
+        /* Nothing after this is valid, erase the block on the next step. */
+        gc_read_ptr = (gc_block + 1) * FLASH_PAGE_SIZE;
+    }
+    if (gc_block >= 0 && block_num(write_pointer) != block_num_to_write)
+        initialize_next_block(&write_pointer);
+
+    return true;
+}
+
+static int gc_thread_entry(void *arg)
+{
+    lk_bigtime_t start;
+    uint32_t erased;
+    bool more;
+
+    for (;;) {
+        event_wait(&gc_event);
+
+        mutex_acquire(&norfs_lock);
+        if (gc_exit) {
+            mutex_release(&norfs_lock);
+            break;
+        }
+
+        /* Bounded, so that a file system with nothing left to reclaim does
+         * not keep moving the same objects around. */
+        erased = gc_stats.blocks_erased;
+        while (!gc_exit && gc_stats.blocks_erased - erased < NORFS_NUM_BLOCKS) {
+            start = current_time_hires();
+            more = gc_step();
+            gc_account_step(start);
+            if (!more)
+                break;
+
+            /* Hand the fs to any waiting writer between objects. */
+            mutex_release(&norfs_lock);
+            mutex_acquire(&norfs_lock);
+        }
+        mutex_release(&norfs_lock);
+    }
+
+    return 0;
+}
+
+status_t norfs_get_gc_stats(struct norfs_gc_stats *stats)
+{
+    mutex_acquire(&norfs_lock);
+    if (!fs_mounted) {
+        mutex_release(&norfs_lock);
+        return ERR_NOT_MOUNTED;
+    }
+    *stats = gc_stats;
+    mutex_release(&norfs_lock);
+
+    return NO_ERROR;
+}
+
 /*
  * Load object into buffer and verify object's integrity via crc.  ptr parameter
  * is updated upon successful verification.
@@ -831,7 +1229,7 @@ status_t read_block_verification(uint32_t *ptr)
 
 static status_t mount_next_obj(void)
 {
-    uint16_t curr_obj_loc;
+    uint32_t curr_obj_loc;
     uint16_t inode_version, inode_len;
     curr_obj_loc = write_pointer;
     struct norfs_inode *inode;
@@ -842,6 +1240,12 @@ static status_t mount_next_obj(void)
     if (status) {
         return status;
     }
+    block_last[block_num(curr_obj_loc)] = curr_obj_loc;
+    if (header.key == NORFS_CHECKPOINT_KEY) {
+        if (VERSION_GREATER_THAN(header.version, checkpoint_version))
+            checkpoint_version = header.version;
+        return NO_ERROR;
+    }
     if (get_inode(header.key, &inode)) {
         nvram_read(inode->location + NORFS_VERSION_OFFSET,
                    sizeof(inode_version), &inode_version);
@@ -852,17 +1256,22 @@ static status_t mount_next_obj(void)
                        sizeof(inode_len), &inode_len);
             total_remaining_space += inode_len;
             total_remaining_space -= header.len;
+            block_live_sub(inode->location, inode_len);
+            block_live_add(curr_obj_loc, header.len);
             inode->location = curr_obj_loc;
         }
         inode->reference_count += 1;
     } else {
         /* Object not yet held in memory.  Create new inode. */
         inode = malloc(sizeof(struct norfs_inode));
+        if (!inode)
+            return ERR_NO_MEMORY;
         inode->location = curr_obj_loc;
 
         inode->reference_count = 1;
 
-        list_add_tail(&inode_list, &inode->lnode);
+        add_inode(inode, header.key);
+        block_live_add(curr_obj_loc, header.len);
         total_remaining_space -= NORFS_FLASH_SIZE(header.len);
     }
 
@@ -878,30 +1287,142 @@ static void purge_unreferenced_inodes(void)
 {
     struct list_node *curr_lnode, *temp_node;
     struct norfs_inode *curr_inode;
+    uint16_t len;
     list_for_every_safe(&inode_list, curr_lnode, temp_node) {
         curr_inode = containerof(curr_lnode, struct norfs_inode, lnode);
         if (curr_inode->reference_count == 0) {
+            nvram_read(curr_inode->location + NORFS_LENGTH_OFFSET,
+                       sizeof(len), &len);
+            block_live_sub(curr_inode->location, len);
             remove_inode(curr_inode);
         }
     }
 }
 
-status_t norfs_mount_fs(uint32_t offset)
+static void free_inodes(void)
 {
-    if (fs_mounted) {
-        TRACEF("Filesystem already mounted.\n");
-        return ERR_ALREADY_MOUNTED;
+    struct list_node *curr_lnode, *temp_node;
+    struct norfs_inode *curr_inode;
+    list_for_every_safe(&inode_list, curr_lnode, temp_node) {
+        curr_inode = containerof(curr_lnode, struct norfs_inode, lnode);
+        remove_inode(curr_inode);
     }
-    status_t status = 0;
-    norfs_nvram_offset = offset;
-
-    list_initialize(&inode_list);
-    flash_nor_begin(NORFS_BANK);
-    srand(current_time());
+}
 
+static void reset_mount_state(void)
+{
     total_remaining_space = NORFS_AVAILABLE_SPACE;
     num_free_blocks = 0;
-    TRACEF("Mounting NOR file system.\n");
+    checkpoint_version = 0;
+    memset(block_free, 0, sizeof(block_free));
+    memset(block_erases, 0, sizeof(block_erases));
+    memset(block_live, 0, sizeof(block_live));
+    memset(block_last, 0, sizeof(block_last));
+}
+
+/*
+ * Mount from the newest checkpoint, which only takes reading the first object
+ * of every block.  Blocks are then scanned from where the checkpoint left
+ * them, which normally leaves just the objects written since.  Fails if a
+ * block the checkpoint describes has been erased since, or any block needs
+ * attention only a full scan gives it.
+ */
+static status_t mount_from_checkpoint(void)
+{
+    struct norfs_checkpoint cp;
+    struct norfs_checkpoint_inode entry;
+    struct norfs_checkpoint_block *cpb;
+    struct norfs_inode *inode;
+    struct norfs_header header;
+    bool used[NORFS_NUM_BLOCKS];
+    uint32_t cp_loc = 0;
+    uint32_t ptr, obj_loc;
+    status_t status;
+
+    for (uint8_t i = 0; i < NORFS_NUM_BLOCKS; i++) {
+        ptr = i * FLASH_PAGE_SIZE;
+        status = read_block_verification(&ptr);
+        used[i] = (status == NO_ERROR);
+        if (status == ERR_NOT_CONFIGURED)
+            continue;
+        if (status)
+            return status;
+
+        obj_loc = ptr;
+        if (load_and_verify_obj(&ptr, &header) ||
+                header.key != NORFS_CHECKPOINT_KEY)
+            continue;
+        if (!cp_loc || VERSION_GREATER_THAN(header.version, checkpoint_version)) {
+            cp_loc = obj_loc;
+            checkpoint_version = header.version;
+        }
+    }
+    if (!cp_loc)
+        return ERR_NOT_FOUND;
+
+    read_header(cp_loc, &header);
+    nvram_read(cp_loc + NORFS_OBJ_OFFSET, sizeof(cp), &cp);
+    if (header.len != sizeof(cp) + cp.num_inodes * sizeof(entry))
+        return ERR_BAD_STATE;
+
+    for (uint8_t i = 0; i < NORFS_NUM_BLOCKS; i++) {
+        cpb = &cp.blocks[i];
+        if (!cpb->last)
+            continue;
+        if (!used[i] || read_header(cpb->last, &header) < 0 ||
+                header.key != cpb->last_key ||
+                header.version != cpb->last_version ||
+                header.crc != cpb->last_crc) {
+            TRACEF("Block %d changed since the checkpoint.\n", i);
+            return ERR_BAD_STATE;
+        }
+    }
+
+    for (uint32_t n = 0; n < cp.num_inodes; n++) {
+        nvram_read(cp_loc + NORFS_OBJ_OFFSET + sizeof(cp) + n * sizeof(entry),
+                   sizeof(entry), &entry);
+        inode = malloc(sizeof(struct norfs_inode));
+        if (!inode)
+            return ERR_NO_MEMORY;
+        inode->location = entry.location;
+        inode->reference_count = entry.reference_count;
+        add_inode(inode, entry.key);
+    }
+    total_remaining_space = cp.total_remaining_space;
+
+    /* Pick up what was written after the checkpoint. */
+    for (uint8_t i = 0; i < NORFS_NUM_BLOCKS; i++) {
+        cpb = &cp.blocks[i];
+        block_erases[i] = cpb->erases;
+        block_live[i] = cpb->live;
+        block_free[i] = !used[i];
+        if (!used[i]) {
+            num_free_blocks++;
+            continue;
+        }
+
+        write_pointer = i * FLASH_PAGE_SIZE + NORFS_BLOCK_HEADER_SIZE;
+        if (cpb->last) {
+            write_pointer = cpb->last;
+            if (load_and_verify_obj(&write_pointer, &header))
+                return ERR_BAD_STATE;
+            block_last[i] = cpb->last;
+        }
+        while (!block_full(i, write_pointer)) {
+            status = mount_next_obj();
+            if (status)
+                break;
+        }
+    }
+
+    return NO_ERROR;
+}
+
+/* Verify and index every object on flash. */
+static status_t mount_scan(void)
+{
+    status_t status;
+
     for (uint8_t i = 0; i < NORFS_NUM_BLOCKS; i++) {
         write_pointer = i * FLASH_PAGE_SIZE;
         status = read_block_verification(&write_pointer);
@@ -915,7 +1436,6 @@ status_t norfs_mount_fs(uint32_t offset)
             continue;
         } else if (status != NO_ERROR) {
             TRACEF("Unexpected status: %d.  Exiting.\n", status);
-            flash_nor_end(NORFS_BANK);
             return status;
         }
         block_free[i] = false;
@@ -926,6 +1446,41 @@ status_t norfs_mount_fs(uint32_t offset)
         }
     }
 
+    return NO_ERROR;
+}
+
+static status_t mount_fs_locked(uint32_t offset)
+{
+    if (fs_mounted) {
+        TRACEF("Filesystem already mounted.\n");
+        return ERR_ALREADY_MOUNTED;
+    }
+    status_t status = 0;
+    norfs_nvram_offset = offset;
+
+    init_inodes();
+    memset(&gc_stats, 0, sizeof(gc_stats));
+    memset(block_opened, 0, sizeof(block_opened));
+    block_seq = 0;
+    gc_block = -1;
+    flash_nor_begin(NORFS_BANK);
+    srand(current_time());
+
+    reset_mount_state();
+    TRACEF("Mounting NOR file system.\n");
+    status = mount_from_checkpoint();
+    if (status) {
+        TRACEF("No usable checkpoint (%d), scanning all objects.\n", status);
+        free_inodes();
+        reset_mount_state();
+        status = mount_scan();
+        if (status) {
+            free_inodes();
+            flash_nor_end(NORFS_BANK);
+            return status;
+        }
+    }
+
     purge_unreferenced_inodes();
 
     write_pointer = rand() % NORFS_NVRAM_SIZE;
@@ -942,25 +1497,49 @@ status_t norfs_mount_fs(uint32_t offset)
     return NO_ERROR;
 }
 
+status_t norfs_mount_fs(uint32_t offset)
+{
+    mutex_acquire(&norfs_lock);
+    status_t status = mount_fs_locked(offset);
+    if (status) {
+        mutex_release(&norfs_lock);
+        return status;
+    }
+
+    gc_exit = false;
+    gc_thread = thread_create("norfs gc", &gc_thread_entry, NULL,
+                              NORFS_GC_PRIORITY, DEFAULT_STACK_SIZE);
+    if (gc_thread)
+        thread_resume(gc_thread);
+    else
+        TRACEF("Failed to start garbage collector, collecting in writes.\n");
+    gc_kick();
+    mutex_release(&norfs_lock);
+
+    return NO_ERROR;
+}
+
 void norfs_unmount_fs(void)
 {
     TRACEF("Unmounting NOR file system\n");
-    struct list_node *curr_lnode;
-    struct norfs_inode *curr_inode;
-    struct list_node *temp_node;
 
+    mutex_acquire(&norfs_lock);
     if (!fs_mounted) {
         TRACEF("Filesystem not mounted.\n");
+        mutex_release(&norfs_lock);
         return;
     }
-    if (!list_is_empty(&inode_list)) {
-        list_for_every_safe(&inode_list, curr_lnode, temp_node) {
-            if (curr_lnode) {
-                curr_inode = containerof(curr_lnode, struct norfs_inode, lnode);
-                remove_inode(curr_inode);
-            }
-        }
+
+    if (gc_thread) {
+        gc_exit = true;
+        event_signal(&gc_event, false);
+        mutex_release(&norfs_lock);
+        thread_join(gc_thread, NULL, INFINITE_TIME);
+        mutex_acquire(&norfs_lock);
+        gc_thread = NULL;
     }
+    gc_block = -1;
+    free_inodes();
     write_pointer = rand() % NORFS_NVRAM_SIZE;
     total_remaining_space = NORFS_AVAILABLE_SPACE;
     num_free_blocks = 0;
@@ -968,6 +1547,7 @@ void norfs_unmount_fs(void)
         block_free[i] = false;
     }
     fs_mounted = false;
+    mutex_release(&norfs_lock);
 }
 
 void norfs_wipe_fs(void)
@@ -978,3 +1558,65 @@ void norfs_wipe_fs(void)
     flash_nor_end(0);
     norfs_mount_fs(norfs_nvram_offset);
 }
+
+#if WITH_LIB_CONSOLE
+
+#include <lib/console.h>
+#include <stdio.h>
+
+static void dump_blocks(void)
+{
+    mutex_acquire(&norfs_lock);
+    printf("%5s %5s %8s %8s %6s\n", "block", "state", "erases", "live", "age");
+    for (uint8_t i = 0; i < NORFS_NUM_BLOCKS; i++) {
+        printf("%5u %5s %8u %8u %6u\n", i,
+               block_free[i] ? "free" : (i == block_num(write_pointer)) ? "write" :
+               (i == gc_block) ? "gc" : "used",
+               block_erases[i], block_live[i],
+               block_free[i] ? 0 : block_seq - block_opened[i]);
+    }
+    mutex_release(&norfs_lock);
+}
+
+static int cmd_norfs(int argc, const cmd_args *argv)
+{
+    struct norfs_gc_stats stats;
+    status_t status;
+
+    if (argc < 2 || (strcmp(argv[1].str, "gc") && strcmp(argv[1].str, "blocks"))) {
+        printf("usage:\n");
+        printf("\t%s gc     : garbage collection statistics\n", argv[0].str);
+        printf("\t%s blocks : per block wear and live bytes\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    status = norfs_get_gc_stats(&stats);
+    if (status) {
+        printf("norfs not mounted\n");
+        return status;
+    }
+
+    if (!strcmp(argv[1].str, "blocks")) {
+        dump_blocks();
+        return NO_ERROR;
+    }
+
+    printf("blocks erased %u (%u in writes), objects copied %u\n",
+           stats.blocks_erased, stats.sync_collections, stats.objects_copied);
+    printf("gc time %llu us, longest step %llu us\n",
+           stats.gc_time, stats.max_step_time);
+    printf("host bytes %llu, gc bytes %llu", stats.host_bytes, stats.gc_bytes);
+    if (stats.host_bytes)
+        printf(", write amplification %llu.%02llu",
+               (stats.host_bytes + stats.gc_bytes) / stats.host_bytes,
+               (stats.gc_bytes * 100 / stats.host_bytes) % 100);
+    printf("\n");
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("norfs", "nor flash file system", &cmd_norfs)
+STATIC_COMMAND_END(norfs);
+
+#endif // WITH_LIB_CONSOLE
@@ -25,10 +25,19 @@
 #include <string.h>
 #include <compiler.h>
 #include <stdlib.h>
+#include <malloc.h>
 #include <arch.h>
+#include <err.h>
+#include <trace.h>
 #include <lib/bio.h>
+#include <lib/checksum.h>
 #include <lib/partition.h>
 
+#define LOCAL_TRACE 0
+
+/* most partitions partition_unpublish() looks for, gpt tables usually have 128 entries */
+#define MAX_PARTITIONS 128
+
 struct chs {
     uint8_t c;
     uint8_t h;
@@ -44,6 +53,37 @@ struct mbr_part {
     uint32_t lba_length;
 } __PACKED;
 
+#define MBR_TYPE_GPT_PROTECTIVE 0xee
+
+#define GPT_SIGNATURE 0x5452415020494645ULL /* "EFI PART" */
+#define GPT_MAX_ENTRY_ARRAY (128 * 1024)
+
+struct gpt_header {
+    uint64_t signature;
+    uint32_t revision;
+    uint32_t header_size;
+    uint32_t header_crc32;
+    uint32_t reserved;
+    uint64_t my_lba;
+    uint64_t alternate_lba;
+    uint64_t first_usable_lba;
+    uint64_t last_usable_lba;
+    uint8_t disk_guid[16];
+    uint64_t entry_lba;
+    uint32_t entry_count;
+    uint32_t entry_size;
+    uint32_t entry_array_crc32;
+} __PACKED;
+
+struct gpt_entry {
+    uint8_t type_guid[16];
+    uint8_t unique_guid[16];
+    uint64_t first_lba;
+    uint64_t last_lba;
+    uint64_t attributes;
+    uint16_t name[36];
+} __PACKED;
+
 static status_t validate_mbr_partition(bdev_t *dev, const struct mbr_part *part)
 {
     /* check for invalid types */
@@ -64,6 +104,123 @@ static status_t validate_mbr_partition(bdev_t *dev, const struct mbr_part *part)
     return 0;
 }
 
+/* publish a partition as <device>p<index>, noting if it doesn't line up with the medium */
+static status_t publish_partition(bdev_t *dev, const char *device, uint index, bnum_t start, bnum_t len)
+{
+    char subdevice[128];
+
+    snprintf(subdevice, sizeof(subdevice), "%sp%u", device, index);
+
+    status_t err = bio_publish_subdevice(device, subdevice, start, len);
+    if (err < 0) {
+        dprintf(INFO, "error publishing subdevice '%s'\n", subdevice);
+        return err;
+    }
+
+    off_t byte_start = (off_t)start << dev->block_shift;
+    if (bio_align_io(dev, byte_start) != byte_start)
+        dprintf(INFO, "partition '%s' does not start on a %zu byte boundary\n", subdevice, dev->io_align);
+
+    return NO_ERROR;
+}
+
+/* read the gpt header at lba into hdr, using the block sized buf */
+static status_t read_gpt_header(bdev_t *dev, uint64_t lba, struct gpt_header *hdr, uint8_t *buf)
+{
+    if (lba >= dev->block_count)
+        return ERR_NOT_FOUND;
+
+    ssize_t err = bio_read_block(dev, buf, lba, 1);
+    if (err < (ssize_t)dev->block_size)
+        return ERR_IO;
+
+    memcpy(hdr, buf, sizeof(*hdr));
+    if (hdr->signature != GPT_SIGNATURE)
+        return ERR_NOT_FOUND;
+    if (hdr->header_size < sizeof(*hdr) || hdr->header_size > dev->block_size)
+        return ERR_NOT_VALID;
+    if (hdr->my_lba != lba)
+        return ERR_NOT_VALID;
+
+    /* the crc covers the header with its own crc field zeroed */
+    memset(buf + offsetof(struct gpt_header, header_crc32), 0, sizeof(hdr->header_crc32));
+    if (checksum_crc32(0, buf, hdr->header_size) != hdr->header_crc32)
+        return ERR_CHECKSUM_FAIL;
+
+    if (hdr->entry_size < sizeof(struct gpt_entry) || (hdr->entry_size % 8))
+        return ERR_NOT_VALID;
+    if ((uint64_t)hdr->entry_count * hdr->entry_size > GPT_MAX_ENTRY_ARRAY)
+        return ERR_NOT_VALID;
+
+    uint64_t array_blocks = ROUNDUP((uint64_t)hdr->entry_count * hdr->entry_size, dev->block_size) >> dev->block_shift;
+    if (hdr->entry_lba + array_blocks > dev->block_count)
+        return ERR_NOT_VALID;
+
+    return NO_ERROR;
+}
+
+static int gpt_publish(bdev_t *dev, const char *device, uint8_t *buf)
+{
+    struct gpt_header hdr;
+    int err;
+
+    err = read_gpt_header(dev, 1, &hdr, buf);
+    if (err < 0) {
+        /* fall back to the backup header in the last block */
+        dprintf(INFO, "primary gpt header not usable (%d), trying the backup\n", err);
+        err = read_gpt_header(dev, dev->block_count - 1, &hdr, buf);
+        if (err < 0)
+            return err;
+    }
+
+    LTRACEF("gpt: %u entries of %u bytes at lba %llu\n", hdr.entry_count, hdr.entry_size, hdr.entry_lba);
+
+    /* pull in the whole entry array with one read instead of a block at a time */
+    size_t array_len = (size_t)hdr.entry_count * hdr.entry_size;
+    size_t read_len = ROUNDUP(array_len, dev->block_size);
+    uint8_t *entries = memalign(CACHE_LINE, ROUNDUP(read_len, CACHE_LINE));
+    if (!entries)
+        return ERR_NO_MEMORY;
+
+    ssize_t rlen = bio_read_block(dev, entries, hdr.entry_lba, read_len >> dev->block_shift);
+    if (rlen < (ssize_t)read_len) {
+        err = ERR_IO;
+        goto done;
+    }
+
+    if (checksum_crc32(0, entries, array_len) != hdr.entry_array_crc32) {
+        dprintf(INFO, "gpt entry array failed checksum\n");
+        err = ERR_CHECKSUM_FAIL;
+        goto done;
+    }
+
+    static const uint8_t unused_guid[16];
+    int count = 0;
+    for (uint i = 0; i < hdr.entry_count && i < MAX_PARTITIONS; i++) {
+        struct gpt_entry entry;
+        memcpy(&entry, entries + i * hdr.entry_size, sizeof(entry));
+
+        if (!memcmp(entry.type_guid, unused_guid, sizeof(unused_guid)))
+            continue;
+
+        LTRACEF("\t%u: first 0x%llx, last 0x%llx\n", i, entry.first_lba, entry.last_lba);
+
+        if (entry.first_lba < hdr.first_usable_lba || entry.last_lba > hdr.last_usable_lba ||
+                entry.first_lba > entry.last_lba || entry.last_lba >= dev->block_count) {
+            dprintf(INFO, "gpt entry %u out of range\n", i);
+            continue;
+        }
+
+        if (publish_partition(dev, device, i, entry.first_lba, entry.last_lba - entry.first_lba + 1) >= 0)
+            count++;
+    }
+    err = count;
+
+done:
+    free(entries);
+    return err;
+}
+
 int partition_publish(const char *device, off_t offset)
 {
     int err = 0;
@@ -104,20 +261,26 @@ int partition_publish(const char *device, off_t offset)
         }
 #endif
 
+        /* a protective entry means the real table is a gpt behind it */
+        if (offset == 0) {
+            for (i=0; i < 4; i++) {
+                if (part[i].type == MBR_TYPE_GPT_PROTECTIVE)
+                    break;
+            }
+            if (i < 4) {
+                err = gpt_publish(dev, device, buf);
+                if (err >= 0)
+                    count = err;
+                break;
+            }
+        }
+
         /* validate each of the partition entries */
         for (i=0; i < 4; i++) {
             if (validate_mbr_partition(dev, &part[i]) >= 0) {
                 // publish it
-                char subdevice[128];
-
-                sprintf(subdevice, "%sp%d", device, i);
-
-                err = bio_publish_subdevice(device, subdevice, part[i].lba_start, part[i].lba_length);
-                if (err < 0) {
-                    dprintf(INFO, "error publishing subdevice '%s'\n", subdevice);
-                    continue;
-                }
-                count++;
+                if (publish_partition(dev, device, i, part[i].lba_start, part[i].lba_length) >= 0)
+                    count++;
             }
         }
     } while (0);
@@ -136,7 +299,7 @@ int partition_unpublish(const char *device)
     char devname[512];
 
     count = 0;
-    for (i=0; i < 16; i++) {
+    for (i=0; i < MAX_PARTITIONS; i++) {
         sprintf(devname, "%sp%d", device, i);
 
         dev = bio_open(devname);
@@ -2,7 +2,9 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
-MODULE_DEPS += lib/bio
+MODULE_DEPS += \
+	lib/bio \
+	lib/checksum
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/partition.c
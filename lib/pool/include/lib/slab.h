@@ -0,0 +1,173 @@
+/**
+ * A slab allocator for fixed-size kernel objects.
+ *
+ * Each cache hands out objects of a single size and alignment. Objects are carved out of slabs,
+ * runs of one or more pages from the page allocator, with the free objects of every slab kept on a
+ * pool_t free list. The cache grows a slab at a time as needed and gives empty slabs back to the
+ * page allocator, keeping at most one spare around.
+ *
+ * In front of the slabs every cpu has a small magazine of free objects, so that most allocations
+ * and frees only touch a per-cpu spinlock. Magazines are refilled from and flushed to the slabs
+ * half a magazine at a time under the cache mutex.
+ *
+ * An optional constructor is run once over every object when its slab is created, not on every
+ * allocation. Objects must be returned to the cache in their constructed state, so that whatever
+ * the constructor set up (locks, list nodes, ...) can be reused by the next owner. When a
+ * constructor is given, the free list link is stored past the end of the object so a free object
+ * keeps its contents.
+ *
+ * Allocation and freeing may block and must be done from thread context.
+ *
+ * Typical usage:
+ *
+ * static slab_cache_t foo_cache;
+ *
+ * slab_cache_init(&foo_cache, "foo", sizeof(foo_t), __alignof(foo_t), NULL, NULL);
+ *
+ * foo_t *foo = slab_alloc(&foo_cache);
+ * ...
+ * slab_free(&foo_cache, foo);
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <list.h>
+#include <sys/types.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+
+__BEGIN_CDECLS
+
+/**
+ * Number of free objects each cpu may hold on to per cache.
+ */
+#define SLAB_MAGAZINE_SIZE 16
+
+/**
+ * Object constructor, called once per object when a new slab is populated.
+ */
+typedef void (*slab_ctor_t)(void *object, void *arg);
+
+/**
+ * Helper type, not for public usage.
+ */
+struct slab_magazine {
+    spin_lock_t lock;
+    uint count;
+    void *objects[SLAB_MAGAZINE_SIZE];
+
+    /* allocations and frees satisfied by the magazine */
+    uint64_t alloc_hits;
+    uint64_t free_hits;
+};
+
+/**
+ * Cache type.
+ */
+typedef struct slab_cache {
+    // Private:
+    struct list_node node;
+    const char *name;
+
+    size_t object_size;
+    size_t slot_size;
+    size_t link_offset;
+    size_t first_offset;
+    uint slab_pages;
+    uint objects_per_slab;
+
+    slab_ctor_t ctor;
+    void *ctor_arg;
+
+    mutex_t lock;
+    struct list_node partial;
+    struct list_node full;
+    struct list_node empty;
+
+    uint slab_count;
+    uint empty_count;
+    size_t objects_out;     // taken out of slabs, including those in magazines
+    uint64_t alloc_misses;  // allocs and frees that went to the slabs
+    uint64_t free_misses;
+    uint64_t grows;
+    uint64_t shrinks;
+
+    struct slab_magazine magazines[SMP_MAX_CPUS];
+} slab_cache_t;
+
+/**
+ * Usage statistics for a cache, see slab_cache_get_stats().
+ */
+typedef struct slab_stats {
+    size_t object_size;
+    size_t slot_size;
+    uint objects_per_slab;
+    uint slab_pages;
+    uint slab_count;
+    size_t objects_total;
+    size_t objects_in_use;    // handed out to callers
+    size_t objects_cached;    // sitting in cpu magazines
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t magazine_hits;   // allocs and frees that did not take the cache mutex
+    uint64_t grows;
+    uint64_t shrinks;
+} slab_stats_t;
+
+/**
+ * Initialize a cache for objects of the given size and alignment. The name is not copied and must
+ * outlive the cache. ctor may be NULL.
+ * Returns ERR_INVALID_ARGS if the object does not fit in a slab.
+ */
+status_t slab_cache_init(slab_cache_t *cache, const char *name, size_t object_size,
+                         size_t object_align, slab_ctor_t ctor, void *ctor_arg);
+
+/**
+ * Tear down a cache, returning all of its pages.
+ * Returns ERR_BUSY, leaving the cache intact, if any objects are still allocated.
+ */
+status_t slab_cache_destroy(slab_cache_t *cache);
+
+/**
+ * Allocate an object from the cache.
+ * Returns NULL if out of memory. Otherwise, the return value is aligned at object_align and is at
+ * least object_size bytes.
+ */
+void *slab_alloc(slab_cache_t *cache);
+
+/**
+ * Free an object previously allocated with slab_alloc from the same cache.
+ */
+void slab_free(slab_cache_t *cache, void *object);
+
+/**
+ * Flush all cpu magazines back into the slabs and give every empty slab back to the page
+ * allocator. Returns the number of pages freed.
+ */
+size_t slab_cache_reap(slab_cache_t *cache);
+
+/**
+ * Reap every cache in the system. Returns the number of pages freed.
+ */
+size_t slab_reap(void);
+
+/**
+ * Get a snapshot of the usage statistics of a cache.
+ */
+void slab_cache_get_stats(slab_cache_t *cache, slab_stats_t *stats);
+
+/**
+ * Typed convenience wrappers, in the spirit of the TYPED_POOL_* macros.
+ */
+#define TYPED_SLAB_CACHE_INIT(type, cache, name, ctor, arg) \
+    slab_cache_init(cache, name, sizeof(type), __alignof(type), ctor, arg)
+
+#define TYPED_SLAB_ALLOC(type, cache) \
+    ((type*) slab_alloc(cache))
+
+#define TYPED_SLAB_FREE(type, cache, object) \
+    slab_free(cache, object)
+
+__END_CDECLS
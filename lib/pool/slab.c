@@ -0,0 +1,485 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/slab.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <pow2.h>
+#include <stdio.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <lib/page_alloc.h>
+#include <lib/pool.h>
+
+#define LOCAL_TRACE 0
+
+/* smallest number of objects we try to fit in a slab, and how many pages
+ * we're willing to spend to get there */
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_MAX_PAGES 8
+
+/* magazines are refilled and flushed this many objects at a time */
+#define SLAB_BATCH (SLAB_MAGAZINE_SIZE / 2)
+
+/* empty slabs each cache keeps around to absorb alloc/free churn */
+#define SLAB_MAX_EMPTY 1
+
+/* lives at the start of every slab, followed by the objects */
+struct slab {
+    struct list_node node;
+    pool_t free;
+    uint in_use;
+};
+
+static struct list_node slab_caches = LIST_INITIAL_VALUE(slab_caches);
+static mutex_t slab_caches_lock = MUTEX_INITIAL_VALUE(slab_caches_lock);
+
+static struct slab *object_to_slab(slab_cache_t *cache, void *object)
+{
+    if (cache->slab_pages == 1)
+        return (struct slab *)ROUNDDOWN((uintptr_t)object, PAGE_SIZE);
+
+    /* multi page slabs are not aligned to their size, go find the one
+     * holding the object. only empty slabs can be skipped. */
+    struct list_node *lists[] = { &cache->partial, &cache->full };
+    size_t slab_size = cache->slab_pages * PAGE_SIZE;
+    for (uint i = 0; i < countof(lists); i++) {
+        struct slab *slab;
+        list_for_every_entry(lists[i], slab, struct slab, node) {
+            if ((uintptr_t)object >= (uintptr_t)slab &&
+                    (uintptr_t)object < (uintptr_t)slab + slab_size)
+                return slab;
+        }
+    }
+
+    panic("slab: object %p does not belong to cache '%s'\n", object, cache->name);
+}
+
+static void slab_release_locked(slab_cache_t *cache, struct slab *slab)
+{
+    LTRACEF("cache '%s' slab %p\n", cache->name, slab);
+
+    page_free(slab, cache->slab_pages);
+    cache->slab_count--;
+    cache->shrinks++;
+}
+
+static struct slab *slab_grow_locked(slab_cache_t *cache)
+{
+    struct slab *slab = page_alloc(cache->slab_pages, PAGE_ALLOC_ANY_ARENA);
+    if (!slab)
+        return NULL;
+
+    LTRACEF("cache '%s' slab %p\n", cache->name, slab);
+
+    list_clear_node(&slab->node);
+    pool_init(&slab->free, cache->slot_size, __alignof(void *), 0, NULL);
+    slab->in_use = 0;
+
+    /* thread the free list backwards so objects are handed out in address order */
+    uint8_t *base = (uint8_t *)slab + cache->first_offset;
+    for (uint i = cache->objects_per_slab; i > 0; i--) {
+        uint8_t *object = base + (i - 1) * cache->slot_size;
+        if (cache->ctor)
+            cache->ctor(object, cache->ctor_arg);
+        pool_free(&slab->free, object + cache->link_offset);
+    }
+
+    cache->slab_count++;
+    cache->grows++;
+
+    return slab;
+}
+
+static void *slab_alloc_locked(slab_cache_t *cache)
+{
+    struct slab *slab = list_peek_head_type(&cache->partial, struct slab, node);
+    if (!slab) {
+        slab = list_remove_head_type(&cache->empty, struct slab, node);
+        if (slab) {
+            cache->empty_count--;
+        } else {
+            slab = slab_grow_locked(cache);
+            if (!slab)
+                return NULL;
+        }
+        list_add_head(&cache->partial, &slab->node);
+    }
+
+    uint8_t *link = pool_alloc(&slab->free);
+    DEBUG_ASSERT(link);
+
+    if (++slab->in_use == cache->objects_per_slab) {
+        list_delete(&slab->node);
+        list_add_head(&cache->full, &slab->node);
+    }
+    cache->objects_out++;
+
+    return link - cache->link_offset;
+}
+
+static void slab_free_locked(slab_cache_t *cache, void *object)
+{
+    struct slab *slab = object_to_slab(cache, object);
+
+    DEBUG_ASSERT(slab->in_use > 0);
+    DEBUG_ASSERT((uintptr_t)object >= (uintptr_t)slab + cache->first_offset);
+    DEBUG_ASSERT(((uintptr_t)object - (uintptr_t)slab - cache->first_offset) % cache->slot_size == 0);
+
+    pool_free(&slab->free, (uint8_t *)object + cache->link_offset);
+    cache->objects_out--;
+
+    bool was_full = (slab->in_use-- == cache->objects_per_slab);
+    if (slab->in_use == 0) {
+        list_delete(&slab->node);
+        if (cache->empty_count < SLAB_MAX_EMPTY) {
+            list_add_head(&cache->empty, &slab->node);
+            cache->empty_count++;
+        } else {
+            slab_release_locked(cache, slab);
+        }
+    } else if (was_full) {
+        list_delete(&slab->node);
+        list_add_head(&cache->partial, &slab->node);
+    }
+}
+
+/* return the contents of every cpu's magazine to the slabs */
+static void slab_drain_magazines_locked(slab_cache_t *cache)
+{
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct slab_magazine *mag = &cache->magazines[cpu];
+        void *objects[SLAB_MAGAZINE_SIZE];
+        spin_lock_saved_state_t state;
+
+        spin_lock_irqsave(&mag->lock, state);
+        uint count = mag->count;
+        memcpy(objects, mag->objects, count * sizeof(void *));
+        mag->count = 0;
+        spin_unlock_irqrestore(&mag->lock, state);
+
+        for (uint i = 0; i < count; i++)
+            slab_free_locked(cache, objects[i]);
+    }
+}
+
+status_t slab_cache_init(slab_cache_t *cache, const char *name, size_t object_size,
+                         size_t object_align, slab_ctor_t ctor, void *ctor_arg)
+{
+    DEBUG_ASSERT(cache);
+    DEBUG_ASSERT(name);
+
+    if (object_size == 0 || !ispow2(object_align) || object_align > PAGE_SIZE)
+        return ERR_INVALID_ARGS;
+
+    size_t align = MAX(object_align, __alignof(void *));
+
+    /* with a constructor the free list link must not clobber the object */
+    size_t link_offset = 0;
+    size_t size = MAX(object_size, sizeof(void *));
+    if (ctor) {
+        link_offset = ROUNDUP(object_size, __alignof(void *));
+        size = link_offset + sizeof(void *);
+    }
+
+    size_t slot_size = ROUNDUP(size, align);
+    size_t first_offset = ROUNDUP(sizeof(struct slab), align);
+
+    uint pages;
+    size_t per_slab = 0;
+    for (pages = 1; pages <= SLAB_MAX_PAGES; pages++) {
+        size_t bytes = pages * PAGE_SIZE;
+        per_slab = (bytes > first_offset) ? (bytes - first_offset) / slot_size : 0;
+        if (per_slab >= SLAB_MIN_OBJECTS)
+            break;
+    }
+    pages = MIN(pages, SLAB_MAX_PAGES);
+    if (per_slab == 0)
+        return ERR_INVALID_ARGS;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->name = name;
+    cache->object_size = object_size;
+    cache->slot_size = slot_size;
+    cache->link_offset = link_offset;
+    cache->first_offset = first_offset;
+    cache->slab_pages = pages;
+    cache->objects_per_slab = per_slab;
+    cache->ctor = ctor;
+    cache->ctor_arg = ctor_arg;
+
+    mutex_init(&cache->lock);
+    list_initialize(&cache->partial);
+    list_initialize(&cache->full);
+    list_initialize(&cache->empty);
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+        spin_lock_init(&cache->magazines[cpu].lock);
+
+    LTRACEF("cache '%s' object %zu slot %zu, %zu objects in %u pages\n",
+            name, object_size, slot_size, per_slab, pages);
+
+    mutex_acquire(&slab_caches_lock);
+    list_add_tail(&slab_caches, &cache->node);
+    mutex_release(&slab_caches_lock);
+
+    return NO_ERROR;
+}
+
+status_t slab_cache_destroy(slab_cache_t *cache)
+{
+    DEBUG_ASSERT(cache);
+
+    mutex_acquire(&cache->lock);
+    slab_drain_magazines_locked(cache);
+    if (cache->objects_out != 0) {
+        mutex_release(&cache->lock);
+        return ERR_BUSY;
+    }
+
+    DEBUG_ASSERT(list_is_empty(&cache->partial));
+    DEBUG_ASSERT(list_is_empty(&cache->full));
+
+    struct slab *slab;
+    while ((slab = list_remove_head_type(&cache->empty, struct slab, node)))
+        slab_release_locked(cache, slab);
+    cache->empty_count = 0;
+    mutex_release(&cache->lock);
+
+    mutex_acquire(&slab_caches_lock);
+    list_delete(&cache->node);
+    mutex_release(&slab_caches_lock);
+
+    mutex_destroy(&cache->lock);
+
+    return NO_ERROR;
+}
+
+void *slab_alloc(slab_cache_t *cache)
+{
+    DEBUG_ASSERT(cache);
+
+    spin_lock_saved_state_t state;
+    struct slab_magazine *mag;
+    void *object = NULL;
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    mag = &cache->magazines[arch_curr_cpu_num()];
+    spin_lock(&mag->lock);
+    if (mag->count > 0) {
+        object = mag->objects[--mag->count];
+        mag->alloc_hits++;
+    }
+    spin_unlock_restore(&mag->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (object)
+        return object;
+
+    /* the magazine is empty, pull a batch out of the slabs */
+    void *batch[SLAB_BATCH];
+    uint count;
+
+    mutex_acquire(&cache->lock);
+    cache->alloc_misses++;
+    for (count = 0; count < SLAB_BATCH; count++) {
+        batch[count] = slab_alloc_locked(cache);
+        if (!batch[count])
+            break;
+    }
+    mutex_release(&cache->lock);
+
+    if (count == 0)
+        return NULL;
+    object = batch[--count];
+
+    /* stash the rest. we may be on another cpu by now, which is fine */
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    mag = &cache->magazines[arch_curr_cpu_num()];
+    spin_lock(&mag->lock);
+    while (count > 0 && mag->count < SLAB_MAGAZINE_SIZE)
+        mag->objects[mag->count++] = batch[--count];
+    spin_unlock_restore(&mag->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    /* someone else filled it up in the meantime */
+    if (count > 0) {
+        mutex_acquire(&cache->lock);
+        while (count > 0)
+            slab_free_locked(cache, batch[--count]);
+        mutex_release(&cache->lock);
+    }
+
+    return object;
+}
+
+void slab_free(slab_cache_t *cache, void *object)
+{
+    DEBUG_ASSERT(cache);
+    DEBUG_ASSERT(object);
+
+    spin_lock_saved_state_t state;
+    struct slab_magazine *mag;
+    void *batch[SLAB_BATCH];
+    uint count = 0;
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    mag = &cache->magazines[arch_curr_cpu_num()];
+    spin_lock(&mag->lock);
+    if (mag->count == SLAB_MAGAZINE_SIZE) {
+        /* full, make room by sending the oldest half back to the slabs */
+        count = SLAB_BATCH;
+        memcpy(batch, mag->objects, SLAB_BATCH * sizeof(void *));
+        memmove(mag->objects, mag->objects + SLAB_BATCH,
+                (SLAB_MAGAZINE_SIZE - SLAB_BATCH) * sizeof(void *));
+        mag->count -= SLAB_BATCH;
+    } else {
+        mag->free_hits++;
+    }
+    mag->objects[mag->count++] = object;
+    spin_unlock_restore(&mag->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (count > 0) {
+        mutex_acquire(&cache->lock);
+        cache->free_misses++;
+        for (uint i = 0; i < count; i++)
+            slab_free_locked(cache, batch[i]);
+        mutex_release(&cache->lock);
+    }
+}
+
+size_t slab_cache_reap(slab_cache_t *cache)
+{
+    DEBUG_ASSERT(cache);
+
+    mutex_acquire(&cache->lock);
+    uint slabs = cache->slab_count;
+
+    slab_drain_magazines_locked(cache);
+
+    struct slab *slab;
+    while ((slab = list_remove_head_type(&cache->empty, struct slab, node)))
+        slab_release_locked(cache, slab);
+    cache->empty_count = 0;
+
+    size_t pages = (size_t)(slabs - cache->slab_count) * cache->slab_pages;
+    mutex_release(&cache->lock);
+
+    return pages;
+}
+
+size_t slab_reap(void)
+{
+    size_t pages = 0;
+
+    mutex_acquire(&slab_caches_lock);
+    slab_cache_t *cache;
+    list_for_every_entry(&slab_caches, cache, slab_cache_t, node)
+        pages += slab_cache_reap(cache);
+    mutex_release(&slab_caches_lock);
+
+    return pages;
+}
+
+void slab_cache_get_stats(slab_cache_t *cache, slab_stats_t *stats)
+{
+    DEBUG_ASSERT(cache);
+    DEBUG_ASSERT(stats);
+
+    memset(stats, 0, sizeof(*stats));
+
+    mutex_acquire(&cache->lock);
+    stats->object_size = cache->object_size;
+    stats->slot_size = cache->slot_size;
+    stats->objects_per_slab = cache->objects_per_slab;
+    stats->slab_pages = cache->slab_pages;
+    stats->slab_count = cache->slab_count;
+    stats->objects_total = (size_t)cache->slab_count * cache->objects_per_slab;
+    stats->allocs = cache->alloc_misses;
+    stats->frees = cache->free_misses;
+    stats->grows = cache->grows;
+    stats->shrinks = cache->shrinks;
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct slab_magazine *mag = &cache->magazines[cpu];
+        spin_lock_saved_state_t state;
+
+        spin_lock_irqsave(&mag->lock, state);
+        stats->objects_cached += mag->count;
+        stats->allocs += mag->alloc_hits;
+        stats->frees += mag->free_hits;
+        stats->magazine_hits += mag->alloc_hits + mag->free_hits;
+        spin_unlock_irqrestore(&mag->lock, state);
+    }
+    stats->objects_in_use = cache->objects_out - stats->objects_cached;
+    mutex_release(&cache->lock);
+}
+
+#if WITH_LIB_CONSOLE
+
+#include <lib/console.h>
+
+static void slab_dump(void)
+{
+    printf("%-16s %6s %6s %4s %5s %6s %8s %8s %8s %8s %12s %12s %5s\n",
+           "name", "size", "slot", "per", "pages", "slabs", "total", "in use", "cached",
+           "KB", "allocs", "frees", "hit%");
+
+    mutex_acquire(&slab_caches_lock);
+    slab_cache_t *cache;
+    list_for_every_entry(&slab_caches, cache, slab_cache_t, node) {
+        slab_stats_t s;
+        slab_cache_get_stats(cache, &s);
+
+        uint64_t ops = s.allocs + s.frees;
+        printf("%-16s %6zu %6zu %4u %5u %6u %8zu %8zu %8zu %8zu %12llu %12llu %5u\n",
+               cache->name, s.object_size, s.slot_size, s.objects_per_slab, s.slab_pages,
+               s.slab_count, s.objects_total, s.objects_in_use, s.objects_cached,
+               (size_t)s.slab_count * s.slab_pages * PAGE_SIZE / 1024,
+               s.allocs, s.frees, ops ? (uint)(s.magazine_hits * 100 / ops) : 0);
+    }
+    mutex_release(&slab_caches_lock);
+}
+
+static int cmd_slab(int argc, const cmd_args *argv)
+{
+    if (argc < 2 || !strcmp(argv[1].str, "list")) {
+        slab_dump();
+    } else if (!strcmp(argv[1].str, "reap")) {
+        size_t pages = slab_reap();
+        printf("freed %zu pages\n", pages);
+    } else {
+        printf("usage:\n");
+        printf("%s [list]              : show all slab caches\n", argv[0].str);
+        printf("%s reap                : flush magazines and free empty slabs\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("slab", "slab allocator caches", &cmd_slab)
+STATIC_COMMAND_END(slab);
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+/*
+ * Sampling profiler.
+ *
+ * A periodic timer on every cpu records the pc the timer interrupt landed
+ * on, and optionally a frame pointer backtrace of the interrupted thread,
+ * into a per cpu sample buffer. The results are dumped from the console as a
+ * histogram of pcs or as folded stacks; tools/symbolize-profile.py turns
+ * either into function names using the kernel elf.
+ *
+ * The arch irq entry code hands the interrupted context to the profiler
+ * through profiler_irq_enter(), arches that don't only count samples as
+ * without a pc. Backtraces need the kernel built with frame pointers, see
+ * PROFILER_FRAME_POINTERS in rules.mk.
+ */
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/* called by the arch irq entry with the pc and frame pointer interrupted */
+void profiler_irq_enter(uintptr_t pc, uintptr_t fp);
+
+/*
+ * Start sampling every cpu at the given rate. depth is the number of return
+ * addresses to record on top of the pc, 0 for the pc only. Samples from an
+ * earlier run are discarded.
+ */
+status_t profiler_start(uint hz, uint depth);
+void profiler_stop(void);
+bool profiler_running(void);
+
+__END_CDECLS
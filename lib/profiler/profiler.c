@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/profiler.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/mp.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <platform.h>
+
+#define LOCAL_TRACE 0
+
+/* samples kept per cpu, further ones are counted as dropped */
+#ifndef PROFILER_SAMPLES
+#define PROFILER_SAMPLES 4096
+#endif
+
+#ifndef PROFILER_MAX_DEPTH
+#define PROFILER_MAX_DEPTH 16
+#endif
+
+#define PROFILER_DEFAULT_HZ 1000
+#define DEFAULT_TOP_COUNT 20
+
+struct irq_frame {
+    uintptr_t pc;
+    uintptr_t fp;
+} __ALIGNED(CACHE_LINE);
+
+/*
+ * A sample is stride words: the pc followed by up to stride - 1 return
+ * addresses, innermost first, terminated by a 0 if the stack was shallower.
+ */
+struct profiler_cpu {
+    timer_t timer;
+    uintptr_t *samples;
+    uint count;
+    uint idle;
+    uint dropped;
+    uint no_pc;
+} __ALIGNED(CACHE_LINE);
+
+static struct irq_frame irq_frames[SMP_MAX_CPUS];
+static struct profiler_cpu profiler_cpus[SMP_MAX_CPUS];
+
+static volatile bool running;
+static uint stride;
+static lk_time_t period;
+static lk_time_t run_start, run_time;
+
+void profiler_irq_enter(uintptr_t pc, uintptr_t fp)
+{
+    struct irq_frame *f = &irq_frames[arch_curr_cpu_num()];
+
+    f->pc = pc;
+    f->fp = fp;
+}
+
+/* walk a frame pointer chain, staying inside the thread's own stack */
+static uint backtrace(const thread_t *t, uintptr_t fp, uintptr_t *out, uint max)
+{
+    uintptr_t lo = (uintptr_t)t->stack;
+    uintptr_t hi = lo + t->stack_size - 2 * sizeof(uintptr_t); /* last place a frame fits */
+    uint n = 0;
+
+    if (!t->stack || t->stack_size < 2 * sizeof(uintptr_t))
+        fp = 0;
+
+    while (n < max && fp >= lo && fp <= hi && fp != 0 && (fp & (sizeof(uintptr_t) - 1)) == 0) {
+        const uintptr_t *frame = (const uintptr_t *)fp;
+
+        /* frame[0] is the caller's frame pointer, frame[1] the return address */
+        if (frame[1] == 0)
+            break;
+        out[n++] = frame[1];
+        if (frame[0] <= fp)
+            break;
+        fp = frame[0];
+    }
+    if (n < max)
+        out[n] = 0;
+
+    return n;
+}
+
+static enum handler_return profiler_timer(timer_t *timer, lk_time_t now, void *arg)
+{
+    struct profiler_cpu *pcpu = arg;
+    const struct irq_frame *f = &irq_frames[arch_curr_cpu_num()];
+    thread_t *t = get_current_thread();
+
+    if (!running)
+        return INT_NO_RESCHEDULE;
+
+    if (t->flags & THREAD_FLAG_IDLE) {
+        pcpu->idle++;
+    } else if (f->pc == 0) {
+        pcpu->no_pc++;
+    } else if (pcpu->count == PROFILER_SAMPLES) {
+        pcpu->dropped++;
+    } else {
+        uintptr_t *s = &pcpu->samples[pcpu->count * stride];
+        s[0] = f->pc;
+        if (stride > 1)
+            backtrace(t, f->fp, &s[1], stride - 1);
+        pcpu->count++;
+    }
+
+    return INT_NO_RESCHEDULE;
+}
+
+/* timers fire on the cpu that set them up, so arm each one from a thread pinned there */
+static int start_cpu_thread(void *arg)
+{
+    struct profiler_cpu *pcpu = arg;
+
+    timer_set_periodic(&pcpu->timer, period, profiler_timer, pcpu);
+    return 0;
+}
+
+static void free_samples(void)
+{
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        free(profiler_cpus[i].samples);
+        profiler_cpus[i].samples = NULL;
+    }
+}
+
+status_t profiler_start(uint hz, uint depth)
+{
+    if (running)
+        return ERR_BUSY;
+    if (hz == 0 || depth > PROFILER_MAX_DEPTH)
+        return ERR_INVALID_ARGS;
+
+    free_samples();
+
+    stride = depth + 1;
+    period = MAX(1000 / hz, 1u);
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct profiler_cpu *pcpu = &profiler_cpus[i];
+
+        timer_initialize(&pcpu->timer);
+        pcpu->count = pcpu->idle = pcpu->dropped = pcpu->no_pc = 0;
+        if (!mp_is_cpu_active(i))
+            continue;
+
+        pcpu->samples = malloc(PROFILER_SAMPLES * stride * sizeof(uintptr_t));
+        if (!pcpu->samples) {
+            free_samples();
+            return ERR_NO_MEMORY;
+        }
+    }
+
+    run_start = current_time();
+    running = true;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct profiler_cpu *pcpu = &profiler_cpus[i];
+        if (!pcpu->samples)
+            continue;
+
+        thread_t *t = thread_create("profiler start", start_cpu_thread, pcpu,
+                                    HIGHEST_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!t) {
+            profiler_stop();
+            return ERR_NO_MEMORY;
+        }
+        thread_set_pinned_cpu(t, i);
+        thread_resume(t);
+        thread_join(t, NULL, INFINITE_TIME);
+    }
+
+    LTRACEF("period %u ms, stride %u\n", (uint)period, stride);
+
+    return NO_ERROR;
+}
+
+void profiler_stop(void)
+{
+    if (!running)
+        return;
+
+    running = false;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        timer_cancel(&profiler_cpus[i].timer);
+    run_time = current_time() - run_start;
+
+    /* let a callback already past the running check on another cpu finish */
+    thread_sleep(period + 1);
+}
+
+bool profiler_running(void)
+{
+    return running;
+}
+
+#if WITH_LIB_CONSOLE
+
+#include <lib/console.h>
+
+struct pc_count {
+    uintptr_t pc;
+    uint count;
+};
+
+static int compare_stack(const void *_a, const void *_b)
+{
+    const uintptr_t *a = _a, *b = _b;
+
+    for (uint i = 0; i < stride; i++) {
+        if (a[i] != b[i])
+            return (a[i] < b[i]) ? -1 : 1;
+        if (a[i] == 0)
+            break;
+    }
+    return 0;
+}
+
+static int compare_pc(const void *_a, const void *_b)
+{
+    const uintptr_t *a = _a, *b = _b;
+
+    if (a[0] != b[0])
+        return (a[0] < b[0]) ? -1 : 1;
+    return 0;
+}
+
+static int compare_count(const void *_a, const void *_b)
+{
+    const struct pc_count *a = _a, *b = _b;
+
+    if (a->count != b->count)
+        return (a->count > b->count) ? -1 : 1;
+    return 0;
+}
+
+/* gather every cpu's samples into one sorted array, returns the sample count */
+static uint gather_samples(uintptr_t **out, int (*compare)(const void *, const void *))
+{
+    uint total = 0;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        total += profiler_cpus[i].count;
+
+    *out = NULL;
+    if (total == 0)
+        return 0;
+
+    uintptr_t *all = malloc(total * stride * sizeof(uintptr_t));
+    if (!all)
+        return 0;
+
+    uintptr_t *p = all;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        const struct profiler_cpu *pcpu = &profiler_cpus[i];
+        if (pcpu->count) {
+            memcpy(p, pcpu->samples, pcpu->count * stride * sizeof(uintptr_t));
+            p += pcpu->count * stride;
+        }
+    }
+
+    qsort(all, total, stride * sizeof(uintptr_t), compare);
+    *out = all;
+
+    return total;
+}
+
+static void dump_summary(void)
+{
+    uint count = 0, idle = 0, dropped = 0, no_pc = 0;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        count += profiler_cpus[i].count;
+        idle += profiler_cpus[i].idle;
+        dropped += profiler_cpus[i].dropped;
+        no_pc += profiler_cpus[i].no_pc;
+    }
+
+    printf("%u samples over %u ms at %u ms per sample, %u idle, %u dropped, %u without a pc\n",
+           count, (uint)(running ? current_time() - run_start : run_time), (uint)period,
+           idle, dropped, no_pc);
+}
+
+static void dump_histogram(uint top)
+{
+    uintptr_t *all;
+    uint total = gather_samples(&all, compare_pc);
+
+    dump_summary();
+    if (total == 0)
+        return;
+
+    /* collapse runs of the same pc */
+    struct pc_count *counts = malloc(total * sizeof(struct pc_count));
+    if (!counts) {
+        free(all);
+        return;
+    }
+
+    uint n = 0;
+    for (uint i = 0; i < total; i++) {
+        uintptr_t pc = all[i * stride];
+        if (n > 0 && counts[n - 1].pc == pc) {
+            counts[n - 1].count++;
+        } else {
+            counts[n].pc = pc;
+            counts[n].count = 1;
+            n++;
+        }
+    }
+    free(all);
+
+    qsort(counts, n, sizeof(struct pc_count), compare_count);
+
+    printf("%8s %7s %-18s\n", "samples", "percent", "pc");
+    for (uint i = 0; i < MIN(n, top); i++) {
+        uint pct = counts[i].count * 1000 / total;
+        printf("%8u %3u.%u%% 0x%lx\n", counts[i].count, pct / 10, pct % 10, counts[i].pc);
+    }
+
+    free(counts);
+}
+
+/* one line per distinct stack, outermost frame first, as flame graph tools expect */
+static void dump_folded(void)
+{
+    uintptr_t *all;
+    uint total = gather_samples(&all, compare_stack);
+
+    for (uint i = 0; i < total;) {
+        const uintptr_t *s = &all[i * stride];
+        uint run = 1;
+        while (i + run < total && compare_stack(s, &all[(i + run) * stride]) == 0)
+            run++;
+
+        uint depth = 1;
+        while (depth < stride && s[depth])
+            depth++;
+        for (uint j = depth; j > 0; j--)
+            printf("0x%lx%s", s[j - 1], (j > 1) ? ";" : " ");
+        printf("%u\n", run);
+
+        i += run;
+    }
+
+    free(all);
+}
+
+static int cmd_profile(int argc, const cmd_args *argv)
+{
+    if (argc < 2) {
+usage:
+        printf("usage:\n");
+        printf("\t%s start [hz] [depth] : sample every cpu, recording depth return addresses\n", argv[0].str);
+        printf("\t%s stop               : stop sampling\n", argv[0].str);
+        printf("\t%s dump [count]       : most sampled pcs\n", argv[0].str);
+        printf("\t%s folded             : sampled stacks in folded format\n", argv[0].str);
+        printf("\t%s status             : sample counts\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    if (!strcmp(argv[1].str, "start")) {
+        uint hz = (argc >= 3) ? argv[2].u : PROFILER_DEFAULT_HZ;
+        uint depth = (argc >= 4) ? argv[3].u : 0;
+
+        status_t err = profiler_start(hz, depth);
+        if (err < 0) {
+            printf("error %d starting the profiler\n", err);
+            return err;
+        }
+        printf("sampling every %u ms, %u frames per sample\n", (uint)period, stride);
+    } else if (!strcmp(argv[1].str, "stop")) {
+        profiler_stop();
+        dump_summary();
+    } else if (!strcmp(argv[1].str, "status")) {
+        printf("profiler %s\n", running ? "running" : "stopped");
+        dump_summary();
+    } else if (!strcmp(argv[1].str, "dump") || !strcmp(argv[1].str, "folded")) {
+        if (running) {
+            printf("stop the profiler first\n");
+            return ERR_BUSY;
+        }
+        if (!strcmp(argv[1].str, "dump"))
+            dump_histogram((argc >= 3) ? argv[2].u : DEFAULT_TOP_COUNT);
+        else
+            dump_folded();
+    } else {
+        goto usage;
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("profile", "sampling profiler", &cmd_profile)
+STATIC_COMMAND_END(profiler);
+
+#endif // WITH_LIB_CONSOLE
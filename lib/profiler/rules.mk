@@ -0,0 +1,13 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/profiler.c
+
+# keep frame pointers everywhere so 'profile start -b' can walk the stack
+ifeq ($(PROFILER_FRAME_POINTERS),1)
+GLOBAL_COMPILEFLAGS += -fno-omit-frame-pointer
+endif
+
+include make/module.mk
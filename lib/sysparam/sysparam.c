@@ -42,6 +42,11 @@
 
 #define SYSPARAM_FLAG_LOCK 0x1
 
+/* must be a power of two */
+#ifndef SYSPARAM_HASH_BUCKETS
+#define SYSPARAM_HASH_BUCKETS 16
+#endif
+
 struct sysparam_phys {
     uint32_t magic;
     uint32_t crc32; // crc of entire structure below crc including padding
@@ -57,16 +62,19 @@ struct sysparam_phys {
     uint8_t namedata[0];
 };
 
-/* a copy we keep in memory */
+/* a copy we keep in memory, or a reference to one in a memory mapped device */
 struct sysparam {
     struct list_node node;
+    struct list_node hash_node;
 
+    uint32_t hash;
     uint32_t flags;
 
-    char *name;
+    const char *name;
+    size_t namelen;
 
     size_t datalen;
-    void *data;
+    const void *data;
 
     /* in memory size to hold this structure, the name string, and the data */
     size_t memlen;
@@ -75,17 +83,24 @@ struct sysparam {
 /* global state */
 static struct {
     struct list_node list;
+    struct list_node buckets[SYSPARAM_HASH_BUCKETS];
 
     bool dirty;
 
     bdev_t *bdev;
     off_t offset;
     size_t len;
+
+    /* start of the parameter area if the bdev is memory mapped, params then
+     * point into it instead of holding copies */
+    const uint8_t *map;
 } params;
 
 static void sysparam_init(uint level)
 {
     list_initialize(&params.list);
+    for (uint i = 0; i < SYSPARAM_HASH_BUCKETS; i++)
+        list_initialize(&params.buckets[i]);
 }
 
 LK_INIT_HOOK(sysparam, &sysparam_init, LK_INIT_LEVEL_THREADING);
@@ -116,51 +131,111 @@ static inline uint32_t sysparam_crc32(const struct sysparam_phys *sp)
     return sum;
 }
 
+/* fnv-1a */
+static uint32_t sysparam_hash(const char *name, size_t namelen)
+{
+    uint32_t hash = 0x811c9dc5;
+
+    for (size_t i = 0; i < namelen; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
 static struct sysparam *sysparam_create(const char *name, size_t namelen, const void *data, size_t datalen, uint32_t flags)
 {
-    struct sysparam *param = malloc(sizeof(struct sysparam));
+    /* the structure, the terminated name and the data padded out to a multiple of 4
+     * all share one allocation */
+    size_t namealloc = ROUNDUP(namelen + 1, 4);
+    size_t alloclen = ROUNDUP(datalen, 4);
+    size_t memlen = sizeof(struct sysparam) + namealloc + alloclen;
+
+    struct sysparam *param = malloc(memlen);
     if (!param)
         return NULL;
 
     param->flags = flags;
-    param->memlen = sizeof(struct sysparam);
+    param->memlen = memlen;
+    param->hash = sysparam_hash(name, namelen);
+
+    char *namebuf = (char *)(param + 1);
+    memcpy(namebuf, name, namelen);
+    namebuf[namelen] = '\0';
+    param->name = namebuf;
+    param->namelen = namelen;
+
+    uint8_t *databuf = (uint8_t *)namebuf + namealloc;
+    memcpy(databuf, data, datalen);
+    memset(databuf + datalen, 0, alloclen - datalen); /* zero out the trailing space */
+    param->data = databuf;
+    param->datalen = datalen;
 
-    param->name = malloc(namelen + 1);
-    if (!param->name) {
-        free(param);
-        return NULL;
-    }
-    param->memlen += namelen + 1;
+    return param;
+}
 
-    memcpy(param->name, name, namelen);
-    param->name[namelen] = '\0';
+/* reference a param where it sits in the memory map. the name is only
+ * copied if the padding doesn't happen to terminate it */
+static struct sysparam *sysparam_map_phys(const struct sysparam_phys *sp)
+{
+    size_t namelen = sp->namelen;
+    size_t namealloc = (namelen % 4) ? 0 : namelen + 1;
+    size_t memlen = sizeof(struct sysparam) + namealloc;
 
-    param->datalen = datalen;
-    size_t alloclen = ROUNDUP(datalen, 4); /* allocate a multiple of 4 for padding purposes */
-    param->data = malloc(alloclen);
-    if (!param->data) {
-        free(param->name);
-        free(param);
+    struct sysparam *param = malloc(memlen);
+    if (!param)
         return NULL;
+
+    param->flags = sp->flags;
+    param->memlen = memlen;
+    param->hash = sysparam_hash((const char *)sp->namedata, namelen);
+
+    if (namealloc) {
+        char *namebuf = (char *)(param + 1);
+        memcpy(namebuf, sp->namedata, namelen);
+        namebuf[namelen] = '\0';
+        param->name = namebuf;
+    } else {
+        param->name = (const char *)sp->namedata;
     }
-    param->memlen += alloclen;
+    param->namelen = namelen;
 
-    memcpy(param->data, data, datalen);
-    memset((char *)param->data + datalen, 0, alloclen - datalen); /* zero out the trailing space */
+    param->data = sp->namedata + ROUNDUP(namelen, 4);
+    param->datalen = sp->datalen;
 
     return param;
 }
 
 static struct sysparam *sysparam_read_phys(const struct sysparam_phys *sp)
 {
+    if (params.map)
+        return sysparam_map_phys(sp);
+
     return sysparam_create((const char *)sp->namedata, sp->namelen, sp->namedata + ROUNDUP(sp->namelen, 4), sp->datalen, sp->flags);
 }
 
+static void sysparam_insert(struct sysparam *param)
+{
+    list_add_tail(&params.list, &param->node);
+    list_add_tail(&params.buckets[param->hash & (SYSPARAM_HASH_BUCKETS - 1)], &param->hash_node);
+}
+
+static void sysparam_delete(struct sysparam *param)
+{
+    list_delete(&param->node);
+    list_delete(&param->hash_node);
+    free(param);
+}
+
 static struct sysparam *sysparam_find(const char *name)
 {
+    size_t namelen = strlen(name);
+    uint32_t hash = sysparam_hash(name, namelen);
+
     struct sysparam *param;
-    list_for_every_entry(&params.list, param, struct sysparam, node) {
-        if (strcmp(name, param->name) == 0)
+    list_for_every_entry(&params.buckets[hash & (SYSPARAM_HASH_BUCKETS - 1)], param, struct sysparam, hash_node) {
+        if (param->hash == hash && param->namelen == namelen && memcmp(name, param->name, namelen) == 0)
             return param;
     }
 
@@ -183,16 +258,28 @@ status_t sysparam_scan(bdev_t *bdev, off_t offset, size_t len)
     params.len = len;
     params.dirty = false;
 
-    /* allocate a len sized block */
-    uint8_t *buf = malloc(len);
-    if (!buf)
-        return ERR_NO_MEMORY;
-
-    /* read in the sector at the scan offset */
-    err = bio_read(bdev, buf, offset, len);
-    if (err < (ssize_t)len) {
-        err = ERR_IO;
-        goto err;
+    /* memory mapped devices are parsed in place, and the params reference
+     * their data there. everything else is read into a staging buffer and copied */
+    uint8_t *buf;
+    void *map;
+    if (bio_ioctl(bdev, BIO_IOCTL_GET_MEM_MAP, &map) == NO_ERROR && map) {
+        buf = (uint8_t *)map + offset;
+        params.map = buf;
+    } else {
+        params.map = NULL;
+
+        /* allocate a len sized block */
+        buf = malloc(len);
+        if (!buf)
+            return ERR_NO_MEMORY;
+
+        /* read in the sector at the scan offset */
+        err = bio_read(bdev, buf, offset, len);
+        if (err < (ssize_t)len) {
+            err = ERR_IO;
+            goto err;
+        }
+        err = NO_ERROR;
     }
 
     LTRACEF("looking for sysparams in block:\n");
@@ -212,7 +299,7 @@ status_t sysparam_scan(bdev_t *bdev, off_t offset, size_t len)
 
         /* looks valid, see if length is sane */
         size_t splen = sysparam_len(sp);
-        if (pos + splen > offset + len) {
+        if (pos + splen > len) {
             /* length exceeds the size of the area */
             LTRACEF("param at 0x%x: bad length\n", pos);
             break;
@@ -238,12 +325,13 @@ status_t sysparam_scan(bdev_t *bdev, off_t offset, size_t len)
             break;
         }
 
-        list_add_tail(&params.list, &param->node);
+        sysparam_insert(param);
     }
 
 
 err:
-    free(buf);
+    if (!params.map)
+        free(buf);
 
     LTRACE_EXIT;
     return err;
@@ -260,16 +348,17 @@ status_t sysparam_reload(void)
     struct sysparam *param;
     struct sysparam *temp;
     list_for_every_entry_safe(&params.list, param, temp, struct sysparam, node) {
-        list_delete(&param->node);
-
-        free(param->name);
-        free(param->data);
-        free(param);
+        sysparam_delete(param);
     }
 
     /* reset the list back to scratch */
     params.dirty = false;
 
+    if (params.map) {
+        bio_ioctl(params.bdev, BIO_IOCTL_PUT_MEM_MAP, NULL);
+        params.map = NULL;
+    }
+
     status_t err = sysparam_scan(params.bdev, params.offset, params.len);
 
     return err;
@@ -334,7 +423,7 @@ status_t sysparam_write(void)
     off_t total_len = 0;
     list_for_every_entry(&params.list, param, struct sysparam, node) {
         total_len += sizeof(struct sysparam_phys);
-        total_len += ROUNDUP(strlen(param->name), 4);
+        total_len += ROUNDUP(param->namelen, 4);
         total_len += ROUNDUP(param->datalen, 4);
     }
 
@@ -348,15 +437,8 @@ status_t sysparam_write(void)
         return ERR_NO_MEMORY;
     }
 
-    /* erase the block device area this covers */
-    ssize_t err = bio_erase(params.bdev, params.offset, params.len);
-    if (err < (ssize_t)params.len) {
-        TRACEF("error erasing sysparam area\n");
-        free(buf);
-        return ERR_IO;
-    }
-
-    /* serialize all of the parameters */
+    /* serialize all of the parameters. this has to happen before the erase,
+     * params may still point into the area */
     off_t pos = 0;
     list_for_every_entry(&params.list, param, struct sysparam, node) {
         struct sysparam_phys phys;
@@ -365,15 +447,15 @@ status_t sysparam_write(void)
         phys.magic = SYSPARAM_MAGIC;
         phys.crc32 = 0;
         phys.flags = param->flags;
-        phys.namelen = strlen(param->name);
+        phys.namelen = param->namelen;
         phys.datalen = param->datalen;
 
         /* calculate the crc of the entire thing + padding */
         uint32_t zero = 0;
         uint32_t sum = crc32(0, (const void *)&phys.flags, 8);
-        sum = crc32(sum, (const void *)param->name, strlen(param->name));
-        if (strlen(param->name) % 4)
-            sum = crc32(sum, (const void *)&zero, 4 - (strlen(param->name) % 4));
+        sum = crc32(sum, (const void *)param->name, param->namelen);
+        if (param->namelen % 4)
+            sum = crc32(sum, (const void *)&zero, 4 - (param->namelen % 4));
         sum = crc32(sum, (const void *)param->data, ROUNDUP(param->datalen, 4));
         phys.crc32 = sum;
 
@@ -382,18 +464,22 @@ status_t sysparam_write(void)
         pos += sizeof(struct sysparam_phys);
 
         /* name portion */
-        memcpy(buf + pos, param->name, strlen(param->name));
-        pos += ROUNDUP(strlen(param->name), 2);
-        if (pos % 4) {
-            /* write 2 zeros to realign */
-            pos += 2;
-        }
+        memcpy(buf + pos, param->name, param->namelen);
+        pos += ROUNDUP(param->namelen, 4);
 
         /* data portion */
         memcpy(buf + pos, param->data, param->datalen);
         pos += ROUNDUP(param->datalen, 4);
     }
 
+    /* erase the block device area this covers */
+    ssize_t err = bio_erase(params.bdev, params.offset, params.len);
+    if (err < (ssize_t)params.len) {
+        TRACEF("error erasing sysparam area\n");
+        free(buf);
+        return ERR_IO;
+    }
+
     /* write the block out */
     bio_write(params.bdev, buf, params.offset, params.len);
 
@@ -401,6 +487,10 @@ status_t sysparam_write(void)
 
     params.dirty = false;
 
+    /* mapped params now point at the old layout, pick up the new one */
+    if (params.map)
+        return sysparam_reload();
+
     return NO_ERROR;
 }
 
@@ -416,7 +506,7 @@ status_t sysparam_add(const char *name, const void *value, size_t len)
     if (!param)
         return ERR_NO_MEMORY;
 
-    list_add_tail(&params.list, &param->node);
+    sysparam_insert(param);
 
     params.dirty = true;
 
@@ -434,11 +524,7 @@ status_t sysparam_remove(const char *name)
     if (sysparam_is_locked(param))
         return ERR_NOT_ALLOWED;
 
-    list_delete(&param->node);
-
-    free(param->name);
-    free(param->data);
-    free(param);
+    sysparam_delete(param);
 
     params.dirty = true;
 
@@ -497,7 +583,8 @@ void sysparam_dump(bool show_all)
         total_memlen += param->memlen;
     }
 
-    printf("total in-memory usage: %zu bytes\n", total_memlen);
+    printf("total in-memory usage: %zu bytes%s\n", total_memlen,
+           params.map ? ", values mapped in place" : "");
 }
 
 #if WITH_LIB_CONSOLE
@@ -24,13 +24,36 @@
 #pragma once
 
 #include <compiler.h>
+#include <sys/types.h>
 
 __BEGIN_CDECLS
 
+// Called for every block received, and with NULL data once the transfer
+// is over. Returning a negative value aborts the transfer.
 typedef int (*tftp_callback_t)(void *data, size_t len, void *arg);
 
+// Called once a transfer to a buffer or block device is over, with the
+// number of bytes received. status is ERR_TOO_BIG if the file did not fit.
+typedef void (*tftp_done_callback_t)(status_t status, size_t len, void *arg);
+
 int tftp_server_init(void *arg);
 
+// Registering a file name that is already registered unregisters it.
 int tftp_set_write_client(const char *file_name, tftp_callback_t cb, void *arg);
 
+// Receive |file_name| straight into |buf|, which holds at most |len| bytes.
+// Replaces an earlier registration of the same name.
+int tftp_set_write_buffer(const char *file_name, void *buf, size_t len,
+                          tftp_done_callback_t done_cb, void *arg);
+
+#if WITH_LIB_BIO
+struct bdev;
+
+// Receive |file_name| onto |bdev| from |offset| on. The range has to be
+// erased already if the device needs it. Replaces an earlier registration
+// of the same name.
+int tftp_set_write_bdev(const char *file_name, struct bdev *bdev, off_t offset,
+                        tftp_done_callback_t done_cb, void *arg);
+#endif
+
 __END_CDECLS
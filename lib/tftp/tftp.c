@@ -25,6 +25,7 @@
 #include <trace.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <list.h>
 #include <compiler.h>
@@ -32,6 +33,9 @@
 #include <stdbool.h>
 #include <lib/minip.h>
 #include <platform.h>
+#if WITH_LIB_BIO
+#include <lib/bio.h>
+#endif
 
 #include <lib/tftp.h>
 
@@ -43,6 +47,7 @@
 #define TFTP_OPCODE_DATA  3UL
 #define TFTP_OPCODE_ACK   4UL
 #define TFTP_OPCODE_ERROR 5UL
+#define TFTP_OPCODE_OACK  6UL
 
 // TFTP Errors:
 #define TFTP_ERROR_UNDEF        0UL
@@ -53,28 +58,76 @@
 #define TFTP_ERROR_UNKNOWN_XFER 4UL
 #define TFTP_ERROR_EXISTS       6UL
 #define TFTP_ERROR_NO_SUCH_USER 7UL
+#define TFTP_ERROR_OPTIONS      8UL
 
 #define TFTP_PORT 69
 
+#define TFTP_DEFAULT_BLKSIZE 512
+
+// Largest block accepted with the blksize option (RFC 2348). The default
+// keeps a data packet within one ethernet frame, and within what a queued
+// udp listener can copy.
+#ifndef TFTP_MAX_BLKSIZE
+#define TFTP_MAX_BLKSIZE 1456
+#endif
+
+// Most blocks the client may send before waiting for an ack, with the
+// windowsize option (RFC 7440).
+#ifndef TFTP_MAX_WINDOWSIZE
+#define TFTP_MAX_WINDOWSIZE 32
+#endif
+
+// Writes to a block device are gathered into chunks of this size.
+#ifndef TFTP_BDEV_CHUNK_SIZE
+#define TFTP_BDEV_CHUNK_SIZE (32 * 1024)
+#endif
+
 #define RD_U16(ptr) \
     (uint16_t)(((uint16_t)*((uint8_t*)(ptr)+1)<<8)|(uint16_t)*(uint8_t*)(ptr))
 
 static struct list_node tftp_list = LIST_INITIAL_VALUE(tftp_list);
 
+// Where the data of a job goes.
+enum tftp_sink {
+    TFTP_SINK_CALLBACK,
+    TFTP_SINK_BUFFER,
+    TFTP_SINK_BDEV,
+};
+
 // Represents tftp jobs and clients of them. If |socket| is not null the
 // job is in progress and members below it are valid.
 typedef struct {
     struct list_node list;
     // Registration info.
     const char *file_name;
+    enum tftp_sink sink;
     tftp_callback_t callback;
+    tftp_done_callback_t done_callback;
     void *arg;
+    uint8_t *buf;
+    size_t buf_len;
+#if WITH_LIB_BIO
+    bdev_t *bdev;
+    off_t bdev_offset;
+#endif
     // Current job info.
     udp_socket_t *socket;
     uint32_t src_addr;
     uint16_t src_port;
     uint16_t listen_port;
-    uint16_t pkt_count;
+    uint16_t blksize;
+    uint16_t windowsize;
+    // Block expected next, and how many arrived since the last ack.
+    uint16_t next_block;
+    uint16_t window_count;
+    // An ack for an out of order block has been sent, and not another
+    // one until the sender is back in sequence.
+    bool resyncing;
+    size_t total_len;
+#if WITH_LIB_BIO
+    uint8_t *chunk;
+    size_t chunk_len;
+#endif
 } tftp_job_t;
 
 uint16_t next_port = 2224;
@@ -104,26 +157,129 @@ static void send_error(udp_socket_t *socket, uint16_t code)
     }
 }
 
-static void end_transfer(tftp_job_t *job, bool do_callback)
+static void send_oack(udp_socket_t *socket, const char *opts, size_t opts_len)
+{
+    // Packet is [6][option][0][value][0]...
+    uint16_t opcode = htons(TFTP_OPCODE_OACK);
+    iovec_t iov[] = {
+        { &opcode, sizeof(opcode) },
+        { (void *)opts, opts_len },
+    };
+    status_t st = udp_send_iovec(iov, countof(iov), socket);
+    if (st < 0) {
+        LTRACEF("send_oack failed: %d\n", st);
+    }
+}
+
+#if WITH_LIB_BIO
+static status_t flush_chunk(tftp_job_t *job)
+{
+    if (job->chunk_len == 0) {
+        return NO_ERROR;
+    }
+
+    off_t offset = job->bdev_offset + job->total_len - job->chunk_len;
+    ssize_t err = bio_write(job->bdev, job->chunk, offset, job->chunk_len);
+    if (err != (ssize_t)job->chunk_len) {
+        LTRACEF("bio_write at %lld failed: %ld\n", offset, (long)err);
+        return (err < 0) ? (status_t)err : ERR_IO;
+    }
+
+    job->chunk_len = 0;
+    return NO_ERROR;
+}
+#endif
+
+static void end_transfer(tftp_job_t *job, bool do_callback, status_t status)
 {
     udp_listen(job->listen_port, NULL, NULL);
     udp_close(job->socket);
     job->socket = NULL;
     job->src_addr = 0UL;
-    if (do_callback) {
+
+#if WITH_LIB_BIO
+    if (job->sink == TFTP_SINK_BDEV) {
+        if (status == NO_ERROR) {
+            status = flush_chunk(job);
+        }
+        free(job->chunk);
+        job->chunk = NULL;
+        job->chunk_len = 0;
+    }
+#endif
+
+    if (!do_callback) {
+        return;
+    }
+    if (job->sink == TFTP_SINK_CALLBACK) {
         job->callback(NULL, 0UL, job->arg);
+    } else if (job->done_callback) {
+        job->done_callback(status, job->total_len, job->arg);
     }
 }
 
+static void abort_transfer(tftp_job_t *job, uint16_t code, status_t status)
+{
+    send_error(job->socket, code);
+    end_transfer(job, true, status);
+}
+
+// Hand one block to the job's sink. Returns an error if it can't be
+// taken, and the transfer is aborted.
+static status_t store_block(tftp_job_t *job, const void *data, size_t len)
+{
+    switch (job->sink) {
+        case TFTP_SINK_CALLBACK:
+            if (job->callback((void *)data, len, job->arg) < 0) {
+                return ERR_CANCELLED;
+            }
+            break;
+        case TFTP_SINK_BUFFER:
+            if (len > job->buf_len - job->total_len) {
+                return ERR_TOO_BIG;
+            }
+            memcpy(job->buf + job->total_len, data, len);
+            break;
+#if WITH_LIB_BIO
+        case TFTP_SINK_BDEV: {
+            if ((off_t)len > job->bdev->total_size - job->bdev_offset - (off_t)job->total_len) {
+                return ERR_TOO_BIG;
+            }
+            const uint8_t *src = data;
+            size_t left = len;
+            while (left > 0) {
+                size_t tocopy = MIN(left, TFTP_BDEV_CHUNK_SIZE - job->chunk_len);
+                memcpy(job->chunk + job->chunk_len, src, tocopy);
+                job->chunk_len += tocopy;
+                job->total_len += tocopy;
+                src += tocopy;
+                left -= tocopy;
+                if (job->chunk_len == TFTP_BDEV_CHUNK_SIZE) {
+                    status_t err = flush_chunk(job);
+                    if (err < 0) {
+                        return err;
+                    }
+                }
+            }
+            return NO_ERROR;
+        }
+#endif
+        default:
+            return ERR_NOT_SUPPORTED;
+    }
+
+    job->total_len += len;
+    return NO_ERROR;
+}
+
 static void udp_wrq_callback(void *data, size_t len,
                              uint32_t srcaddr, uint16_t srcport,
                              void *arg)
 {
-    // Packet is [3][count][data]. All packets but the last have 512
+    // Packet is [3][block][data]. All packets but the last have blksize
     // bytes of data, including zero data.
     char *data_c = data;
     tftp_job_t *job = arg;
-    job->pkt_count++;
 
     if (len < 4) {
         // Not to spec. Ignore.
@@ -139,29 +295,57 @@ static void udp_wrq_callback(void *data, size_t len,
     if ((srcaddr != job->src_addr) || (srcport != job->src_port)) {
         LTRACEF("invalid source\n");
         send_error(job->socket, TFTP_ERROR_UNKNOWN_XFER);
-        end_transfer(job, true);
+        end_transfer(job, true, ERR_CHANNEL_CLOSED);
         return;
     }
 
     if (RD_U16(data_c) != htons(TFTP_OPCODE_DATA)) {
         LTRACEF("invalid opcode\n");
-        send_error(job->socket, TFTP_ERROR_ILLEGAL_OP);
-        end_transfer(job, true);
+        abort_transfer(job, TFTP_ERROR_ILLEGAL_OP, ERR_BAD_STATE);
+        return;
+    }
+
+    size_t payload = len - 4;
+    if (payload > job->blksize) {
+        LTRACEF("block too long: %zu\n", payload);
+        abort_transfer(job, TFTP_ERROR_ILLEGAL_OP, ERR_BAD_STATE);
+        return;
+    }
+
+    uint16_t block = ntohs(RD_U16(data_c + 2));
+    if (block != job->next_block) {
+        // A block of the window went missing, or the sender is repeating
+        // one we have. Ack the last block in sequence, once, so the sender
+        // restarts from there instead of waiting to time out (RFC 7440).
+        LTRACEF("block %u, expected %u\n", block, job->next_block);
+        if (!job->resyncing) {
+            send_ack(job->socket, job->next_block - 1);
+            job->resyncing = true;
+            job->window_count = 0;
+        }
+        return;
+    }
+    job->resyncing = false;
+
+    status_t err = store_block(job, &data_c[4], payload);
+    if (err < 0) {
+        // The client wants to abort, or it doesn't fit.
+        abort_transfer(job, TFTP_ERROR_FULL, err);
         return;
     }
 
-    send_ack(job->socket, job->pkt_count);
+    job->next_block++;
+    job->window_count++;
 
-    if (job->callback(&data_c[4], len - 4, job->arg) < 0) {
-        // The client wants to abort.
-        send_error(job->socket, TFTP_ERROR_FULL);
-        end_transfer(job, true);
+    // The last packet always has less than blksize bytes of payload.
+    bool last = payload < job->blksize;
+    if (last || job->window_count == job->windowsize) {
+        send_ack(job->socket, block);
+        job->window_count = 0;
     }
 
-    // 512 bytes payload plus 4 of fixed header. The last packet.
-    // has always less than 512 bytes of payload.
-    if (len != 516) {
-        end_transfer(job, true);
+    if (last) {
+        end_transfer(job, true, NO_ERROR);
     }
 }
 
@@ -177,6 +361,77 @@ static tftp_job_t *get_job_by_name(const char *file_name)
     return NULL;
 }
 
+// Pull the next nul terminated string out of a request, NULL if the
+// packet ends first.
+static const char *next_string(const char **pos, const char *end)
+{
+    const char *str = *pos;
+    const char *nul = memchr(str, 0, end - str);
+    if (!nul) {
+        return NULL;
+    }
+    *pos = nul + 1;
+    return str;
+}
+
+// Option names are case insensitive.
+static bool option_is(const char *name, const char *option)
+{
+    return strnicmp(name, option, strlen(option) + 1) == 0;
+}
+
+// Go over the options of a write request, settling blksize and windowsize
+// and building the option ack in |oack|. Returns the length of the option
+// ack, 0 if there is nothing to ack, or an error for a request to refuse.
+static ssize_t parse_options(tftp_job_t *job, const char *pos, const char *end,
+                             char *oack, size_t oack_size)
+{
+    size_t oack_len = 0;
+    const char *name;
+    const char *value;
+
+    while ((name = next_string(&pos, end)) && (value = next_string(&pos, end))) {
+        unsigned long val = strtoul(value, NULL, 10);
+        if (option_is(name, "blksize")) {
+            // The sender asks for the blocks it wants, we may shrink them.
+            if (val < 8) {
+                return ERR_INVALID_ARGS;
+            }
+            job->blksize = MIN(val, TFTP_MAX_BLKSIZE);
+            val = job->blksize;
+        } else if (option_is(name, "windowsize")) {
+            if (val < 1) {
+                return ERR_INVALID_ARGS;
+            }
+            job->windowsize = MIN(val, TFTP_MAX_WINDOWSIZE);
+            val = job->windowsize;
+        } else if (option_is(name, "tsize")) {
+            // Refuse up front what is not going to fit.
+            if (job->sink == TFTP_SINK_BUFFER && val > job->buf_len) {
+                return ERR_TOO_BIG;
+            }
+#if WITH_LIB_BIO
+            if (job->sink == TFTP_SINK_BDEV &&
+                    (off_t)val > job->bdev->total_size - job->bdev_offset) {
+                return ERR_TOO_BIG;
+            }
+#endif
+        } else {
+            // Options we don't know are left out of the ack.
+            continue;
+        }
+
+        // The known names are short enough to always fit.
+        size_t name_len = strlen(name) + 1;
+        memcpy(oack + oack_len, name, name_len);
+        oack_len += name_len;
+        int n = snprintf(oack + oack_len, oack_size - oack_len, "%lu", val);
+        oack_len += n + 1;
+    }
+
+    return oack_len;
+}
+
 static void udp_svc_callback(void *data, size_t len,
                              uint32_t srcaddr, uint16_t srcport,
                              void *arg)
@@ -186,6 +441,10 @@ static void udp_svc_callback(void *data, size_t len,
     udp_socket_t *socket;
     tftp_job_t *job;
 
+    if (len < 2) {
+        return;
+    }
+
     st = udp_open(srcaddr, next_port, srcport, &socket);
     if (st < 0) {
         LTRACEF("error opening send socket %d\n", st);
@@ -202,9 +461,20 @@ static void udp_svc_callback(void *data, size_t len,
         return;
     }
 
-    // Look for a client that can hadle the file. TODO: |data|
-    // needs to be null terminated. A malicious client can crash us.
-    job = get_job_by_name(((char *)data) + 2);
+    // Packet is [2][file name][0][mode][0], then option and value pairs.
+    const char *pos = (const char *)data + 2;
+    const char *end = (const char *)data + len;
+    const char *file_name = next_string(&pos, end);
+    const char *mode = next_string(&pos, end);
+    if (!file_name || !mode) {
+        LTRACEF("malformed request\n");
+        send_error(socket, TFTP_ERROR_ILLEGAL_OP);
+        udp_close(socket);
+        return;
+    }
+
+    // Look for a client that can handle the file.
+    job = get_job_by_name(file_name);
 
     if (!job) {
         // Nobody claims to handle that file.
@@ -224,60 +494,164 @@ static void udp_svc_callback(void *data, size_t len,
         return;
     }
 
-    LTRACEF("write op accepted, port %d\n", srcport);
+    job->blksize = TFTP_DEFAULT_BLKSIZE;
+    job->windowsize = 1;
+
+    // Three options and their values, at most 20 digits each.
+    char oack[sizeof("blksize") + sizeof("windowsize") + sizeof("tsize") + 3 * 21];
+    ssize_t oack_len = parse_options(job, pos, end, oack, sizeof(oack));
+    if (oack_len < 0) {
+        LTRACEF("options refused: %ld\n", (long)oack_len);
+        send_error(socket, (oack_len == ERR_TOO_BIG) ? TFTP_ERROR_FULL : TFTP_ERROR_OPTIONS);
+        udp_close(socket);
+        return;
+    }
+
+#if WITH_LIB_BIO
+    if (job->sink == TFTP_SINK_BDEV) {
+        job->chunk = malloc(TFTP_BDEV_CHUNK_SIZE);
+        if (!job->chunk) {
+            send_error(socket, TFTP_ERROR_FULL);
+            udp_close(socket);
+            return;
+        }
+        job->chunk_len = 0;
+    }
+#endif
+
+    LTRACEF("write op accepted, port %d, blksize %u, windowsize %u\n",
+            srcport, job->blksize, job->windowsize);
     // Request accepted. The rest of the transfer happens between
     // next_port <----> srcport via udp_wrq_callback().
 
     job->socket = socket;
     job->src_addr = srcaddr;
     job->src_port = srcport;
-    job->pkt_count = 0UL;
+    job->next_block = 1;
+    job->window_count = 0;
+    job->resyncing = false;
+    job->total_len = 0;
     job->listen_port = next_port;
 
-    st = udp_listen(job->listen_port, &udp_wrq_callback, job);
+    // Block device writes are too slow for the rx path. The queue holds a
+    // whole window while the previous one is written out.
+    if (job->sink == TFTP_SINK_BDEV) {
+        st = udp_listen_queued(job->listen_port, &udp_wrq_callback, job,
+                               2 * job->windowsize);
+    } else {
+        st = udp_listen(job->listen_port, &udp_wrq_callback, job);
+    }
     if (st < 0) {
         LTRACEF("error listening on port\n");
+        send_error(socket, TFTP_ERROR_UNDEF);
+        end_transfer(job, false, NO_ERROR);
         return;
     }
 
-    send_ack(socket, 0UL);
+    // The option ack takes the place of ack 0 (RFC 2347).
+    if (oack_len > 0) {
+        send_oack(socket, oack, oack_len);
+    } else {
+        send_ack(socket, 0UL);
+    }
     next_port++;
 }
 
-int tftp_set_write_client(const char *file_name, tftp_callback_t cb, void *arg)
+// Take a registration off the list, cancelling its transfer silently.
+// Returns false if there was none for |file_name|.
+static bool remove_job(const char *file_name)
 {
-    DEBUG_ASSERT(file_name);
-    DEBUG_ASSERT(cb);
-
-    tftp_job_t *job;
+    tftp_job_t *job = get_job_by_name(file_name);
+    if (!job) {
+        return false;
+    }
 
-    list_for_every_entry(&tftp_list, job, tftp_job_t, list) {
-        if (strcmp(file_name, job->file_name) == 0) {
-            list_delete(&job->list);
-            if (job->socket) {
-                // There is a job in progress. It will be cancelled silently.
-                end_transfer(job, false);
-            }
-            return 0;
-        }
+    list_delete(&job->list);
+    if (job->socket) {
+        // There is a job in progress. It will be cancelled silently.
+        end_transfer(job, false, ERR_CANCELLED);
     }
+    return true;
+}
+
+static tftp_job_t *add_job(const char *file_name, enum tftp_sink sink, void *arg)
+{
+    tftp_job_t *job;
 
     if ((job = malloc(sizeof(tftp_job_t))) == NULL) {
-        return -1;
+        return NULL;
     }
 
     memset(job, 0, sizeof(tftp_job_t));
     job->file_name = file_name;
-    job->callback = cb;
+    job->sink = sink;
     job->arg = arg;
 
     list_add_tail(&tftp_list, &job->list);
+    return job;
+}
+
+int tftp_set_write_client(const char *file_name, tftp_callback_t cb, void *arg)
+{
+    DEBUG_ASSERT(file_name);
+    DEBUG_ASSERT(cb);
+
+    if (remove_job(file_name)) {
+        return 0;
+    }
+
+    tftp_job_t *job = add_job(file_name, TFTP_SINK_CALLBACK, arg);
+    if (!job) {
+        return -1;
+    }
+    job->callback = cb;
     return 0;
 }
 
+int tftp_set_write_buffer(const char *file_name, void *buf, size_t len,
+                          tftp_done_callback_t done_cb, void *arg)
+{
+    DEBUG_ASSERT(file_name);
+    DEBUG_ASSERT(buf || len == 0);
+
+    remove_job(file_name);
+
+    tftp_job_t *job = add_job(file_name, TFTP_SINK_BUFFER, arg);
+    if (!job) {
+        return ERR_NO_MEMORY;
+    }
+    job->done_callback = done_cb;
+    job->buf = buf;
+    job->buf_len = len;
+    return NO_ERROR;
+}
+
+#if WITH_LIB_BIO
+int tftp_set_write_bdev(const char *file_name, bdev_t *bdev, off_t offset,
+                        tftp_done_callback_t done_cb, void *arg)
+{
+    DEBUG_ASSERT(file_name);
+    DEBUG_ASSERT(bdev);
+
+    if (offset < 0 || offset > bdev->total_size) {
+        return ERR_INVALID_ARGS;
+    }
+
+    remove_job(file_name);
+
+    tftp_job_t *job = add_job(file_name, TFTP_SINK_BDEV, arg);
+    if (!job) {
+        return ERR_NO_MEMORY;
+    }
+    job->done_callback = done_cb;
+    job->bdev = bdev;
+    job->bdev_offset = offset;
+    return NO_ERROR;
+}
+#endif
+
 int tftp_server_init(void *arg)
 {
     status_t st = udp_listen(TFTP_PORT, &udp_svc_callback, 0);
     return st;
 }
-
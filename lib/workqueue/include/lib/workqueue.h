@@ -0,0 +1,119 @@
+/**
+ * Kernel work queues.
+ *
+ * A work queue runs callbacks on a set of dedicated kernel threads. Per-cpu queues have one
+ * worker thread pinned to every cpu, and work is run on the cpu that queued it unless a cpu is
+ * picked explicitly. Unbound queues have a single list served by max_active worker threads that
+ * may run anywhere. In both cases at most max_active items of a queue run at the same time.
+ *
+ * Work items are embedded in the caller's own structures and are never allocated by the queue.
+ * An item is on at most one queue at a time; queueing it again while it is still pending is a
+ * no-op, queueing it while it is running makes it run once more, possibly on another worker
+ * before the current run has returned. Once the callback has been entered the queue no longer
+ * touches the item, so the callback is free to release it.
+ *
+ * Queueing and cancelling may be done from interrupt context, with WORKQUEUE_QUEUE_NORESCHED when
+ * queueing. Waiting for work to finish may not.
+ *
+ * Typical usage:
+ *
+ * static work_t foo_work;
+ *
+ * work_init(&foo_work, &foo_callback, foo);
+ * workqueue_queue(system_workqueue, &foo_work, 0);
+ * ...
+ * work_cancel_sync(&foo_work);
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <list.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+typedef void (*work_callback)(void *arg);
+
+struct workqueue;
+
+/**
+ * Work item. Initialize with work_init() or WORK_INITIAL_VALUE().
+ */
+typedef struct work {
+    // Private:
+    struct list_node node;
+    work_callback cb;
+    void *arg;
+    struct workqueue *wq;
+    bool pending;
+} work_t;
+
+#define WORK_INITIAL_VALUE(w, _cb, _arg) \
+{ \
+    .node = LIST_INITIAL_CLEARED_VALUE, \
+    .cb = (_cb), \
+    .arg = (_arg), \
+    .wq = NULL, \
+    .pending = false, \
+}
+
+typedef struct workqueue workqueue_t;
+
+/* workqueue_create flags */
+#define WORKQUEUE_FLAG_PER_CPU      0x1     // one worker pinned to every cpu
+
+/* workqueue_queue flags */
+#define WORKQUEUE_QUEUE_NORESCHED   0x1     // don't reschedule to a woken worker right away
+
+/**
+ * The default queue, per-cpu at DPC_PRIORITY without a concurrency limit. Valid from
+ * LK_INIT_LEVEL_THREADING on.
+ */
+extern workqueue_t *system_workqueue;
+
+void work_init(work_t *work, work_callback cb, void *arg);
+
+/**
+ * Create a work queue whose workers run at the given priority. A max_active of 0 means one
+ * item per cpu for per-cpu queues and a single worker for unbound ones. The name is not copied
+ * and must outlive the queue.
+ * Returns NULL if out of memory.
+ */
+workqueue_t *workqueue_create(const char *name, int priority, uint max_active, uint flags);
+
+/**
+ * Wait for all queued work to finish and tear the queue down.
+ */
+void workqueue_destroy(workqueue_t *wq);
+
+/**
+ * Queue work on the current cpu for per-cpu queues, on the shared list otherwise.
+ * Returns ERR_ALREADY_EXISTS if the item was already pending.
+ */
+status_t workqueue_queue(workqueue_t *wq, work_t *work, uint flags);
+
+/**
+ * Queue work to run on a specific cpu of a per-cpu queue.
+ * Returns ERR_INVALID_ARGS if the queue is not per-cpu or the cpu is out of range, and
+ * ERR_NOT_READY if the cpu has not come up yet.
+ */
+status_t workqueue_queue_on(workqueue_t *wq, uint cpu, work_t *work, uint flags);
+
+/**
+ * Wait until wq has no pending or running work left.
+ */
+void workqueue_flush(workqueue_t *wq);
+
+/**
+ * Take work off its queue if it has not started yet. Returns true if it was pending.
+ */
+bool work_cancel(work_t *work);
+
+/**
+ * Like work_cancel(), but also wait for the callback to return if it is running.
+ * Must not be called from the callback itself.
+ */
+bool work_cancel_sync(work_t *work);
+
+__END_CDECLS
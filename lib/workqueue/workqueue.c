@@ -0,0 +1,463 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/workqueue.h>
+
+#include <debug.h>
+#include <assert.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <lib/console.h>
+#include <lk/init.h>
+
+#define LOCAL_TRACE 0
+
+/* one list of pending work, per cpu for per-cpu queues */
+struct wq_pool {
+    struct list_node pending;
+    event_t event;
+    uint workers;
+};
+
+struct wq_worker {
+    struct workqueue *wq;
+    struct wq_pool *pool;
+    thread_t *thread;
+    work_t *current;
+};
+
+struct workqueue {
+    struct list_node node;
+    const char *name;
+    int priority;
+    uint flags;
+
+    spin_lock_t lock;
+    uint max_active;
+    uint active;
+    uint outstanding;   // pending plus running
+    bool dying;
+
+    /* threads waiting in flush or cancel, woken under the thread lock */
+    wait_queue_t idle_wait;
+    uint waiters;
+
+    uint64_t queued;
+    uint64_t completed;
+    uint64_t cancelled;
+
+    uint pool_count;
+    uint worker_count;
+    struct wq_worker *workers;
+    struct wq_pool pools[];
+};
+
+STATIC_ASSERT(SMP_MAX_CPUS <= 32);
+
+workqueue_t *system_workqueue;
+
+/* all queues, for bringing up workers on secondary cpus and for the console */
+static mutex_t wq_list_lock = MUTEX_INITIAL_VALUE(wq_list_lock);
+static struct list_node wq_list = LIST_INITIAL_VALUE(wq_list);
+
+static int worker_thread(void *arg)
+{
+    struct wq_worker *w = arg;
+    workqueue_t *wq = w->wq;
+    struct wq_pool *pool = w->pool;
+    spin_lock_saved_state_t state;
+
+    for (;;) {
+        work_callback cb = NULL;
+        void *cb_arg = NULL;
+
+        spin_lock_irqsave(&wq->lock, state);
+        if (wq->dying && list_is_empty(&pool->pending)) {
+            spin_unlock_irqrestore(&wq->lock, state);
+            break;
+        }
+        work_t *work = NULL;
+        if (wq->active < wq->max_active)
+            work = list_remove_head_type(&pool->pending, work_t, node);
+        if (work) {
+            work->pending = false;
+            cb = work->cb;
+            cb_arg = work->arg;
+            w->current = work;
+            wq->active++;
+        }
+        spin_unlock_irqrestore(&wq->lock, state);
+
+        if (!work) {
+            event_wait(&pool->event);
+            continue;
+        }
+
+        LTRACEF("%s: calling %p, arg %p\n", wq->name, cb, cb_arg);
+        cb(cb_arg);
+
+        /* the item may be gone by now, only compare against it */
+        uint32_t kick = 0;
+        spin_lock_irqsave(&wq->lock, state);
+        w->current = NULL;
+        if (wq->active-- == wq->max_active) {
+            /* other pools may have been held back by the limit */
+            for (uint i = 0; i < wq->pool_count; i++) {
+                if (&wq->pools[i] != pool && !list_is_empty(&wq->pools[i].pending))
+                    kick |= 1U << i;
+            }
+        }
+        wq->outstanding--;
+        wq->completed++;
+        bool wake = wq->waiters > 0;
+        spin_unlock_irqrestore(&wq->lock, state);
+
+        for (uint i = 0; kick; i++, kick >>= 1) {
+            if (kick & 1)
+                event_signal(&wq->pools[i].event, false);
+        }
+
+        if (wake) {
+            THREAD_LOCK(tstate);
+            wait_queue_wake_all(&wq->idle_wait, false, NO_ERROR);
+            THREAD_UNLOCK(tstate);
+        }
+    }
+
+    /* pass the exit on to the other workers sharing the pool */
+    event_signal(&pool->event, false);
+
+    return 0;
+}
+
+/* called with wq_list_lock held */
+static void start_worker(workqueue_t *wq, uint index, int cpu)
+{
+    struct wq_worker *w = &wq->workers[index];
+    char name[32];
+
+    if (w->thread)
+        return;
+
+    snprintf(name, sizeof(name), "%s-%u", wq->name, index);
+    w->thread = thread_create(name, &worker_thread, w, wq->priority, DEFAULT_STACK_SIZE);
+    if (!w->thread) {
+        TRACEF("%s: failed to create worker %u\n", wq->name, index);
+        return;
+    }
+    if (cpu >= 0)
+        thread_set_pinned_cpu(w->thread, cpu);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&wq->lock, state);
+    w->pool->workers++;
+    spin_unlock_irqrestore(&wq->lock, state);
+
+    thread_resume(w->thread);
+}
+
+void work_init(work_t *work, work_callback cb, void *arg)
+{
+    *work = (work_t)WORK_INITIAL_VALUE(*work, cb, arg);
+}
+
+workqueue_t *workqueue_create(const char *name, int priority, uint max_active, uint flags)
+{
+    uint pools = (flags & WORKQUEUE_FLAG_PER_CPU) ? SMP_MAX_CPUS : 1;
+
+    if (max_active == 0)
+        max_active = (flags & WORKQUEUE_FLAG_PER_CPU) ? SMP_MAX_CPUS : 1;
+
+    workqueue_t *wq = calloc(1, sizeof(workqueue_t) + pools * sizeof(struct wq_pool));
+    if (!wq)
+        return NULL;
+
+    wq->name = name;
+    wq->priority = priority;
+    wq->flags = flags;
+    wq->lock = SPIN_LOCK_INITIAL_VALUE;
+    wq->max_active = max_active;
+    wait_queue_init(&wq->idle_wait);
+    wq->pool_count = pools;
+    wq->worker_count = (flags & WORKQUEUE_FLAG_PER_CPU) ? SMP_MAX_CPUS : max_active;
+
+    wq->workers = calloc(wq->worker_count, sizeof(struct wq_worker));
+    if (!wq->workers) {
+        free(wq);
+        return NULL;
+    }
+
+    for (uint i = 0; i < pools; i++) {
+        list_initialize(&wq->pools[i].pending);
+        event_init(&wq->pools[i].event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    }
+
+    for (uint i = 0; i < wq->worker_count; i++) {
+        wq->workers[i].wq = wq;
+        wq->workers[i].pool = &wq->pools[(flags & WORKQUEUE_FLAG_PER_CPU) ? i : 0];
+    }
+
+    mutex_acquire(&wq_list_lock);
+    list_add_tail(&wq_list, &wq->node);
+    for (uint i = 0; i < wq->worker_count; i++) {
+        /* per-cpu workers of cpus that are not up yet are started from the secondary init hook */
+        if (!(flags & WORKQUEUE_FLAG_PER_CPU))
+            start_worker(wq, i, -1);
+        else if (i == arch_curr_cpu_num() || mp_is_cpu_active(i))
+            start_worker(wq, i, i);
+    }
+    mutex_release(&wq_list_lock);
+
+    LTRACEF("%s: %u pools, %u workers, max active %u\n", name, pools, wq->worker_count, max_active);
+
+    return wq;
+}
+
+void workqueue_destroy(workqueue_t *wq)
+{
+    DEBUG_ASSERT(wq && wq != system_workqueue);
+
+    workqueue_flush(wq);
+
+    mutex_acquire(&wq_list_lock);
+    list_delete(&wq->node);
+    mutex_release(&wq_list_lock);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&wq->lock, state);
+    wq->dying = true;
+    spin_unlock_irqrestore(&wq->lock, state);
+
+    for (uint i = 0; i < wq->pool_count; i++)
+        event_signal(&wq->pools[i].event, false);
+
+    for (uint i = 0; i < wq->worker_count; i++) {
+        if (wq->workers[i].thread)
+            thread_join(wq->workers[i].thread, NULL, INFINITE_TIME);
+    }
+
+    for (uint i = 0; i < wq->pool_count; i++)
+        event_destroy(&wq->pools[i].event);
+    THREAD_LOCK(tstate);
+    wait_queue_destroy(&wq->idle_wait, false);
+    THREAD_UNLOCK(tstate);
+
+    free(wq->workers);
+    free(wq);
+}
+
+static status_t queue_on_pool(workqueue_t *wq, struct wq_pool *pool, work_t *work, uint flags,
+                              bool need_worker)
+{
+    status_t err = NO_ERROR;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&wq->lock, state);
+
+    DEBUG_ASSERT(!wq->dying);
+    DEBUG_ASSERT(!work->pending || work->wq == wq);
+
+    if (work->pending) {
+        err = ERR_ALREADY_EXISTS;
+    } else if (need_worker && pool->workers == 0) {
+        err = ERR_NOT_READY;
+    } else {
+        work->wq = wq;
+        work->pending = true;
+        list_add_tail(&pool->pending, &work->node);
+        wq->outstanding++;
+        wq->queued++;
+    }
+
+    spin_unlock_irqrestore(&wq->lock, state);
+
+    if (err == NO_ERROR) {
+        event_signal(&pool->event, !(flags & WORKQUEUE_QUEUE_NORESCHED));
+    }
+
+    return err;
+}
+
+status_t workqueue_queue(workqueue_t *wq, work_t *work, uint flags)
+{
+    LTRACEF("%s: work %p\n", wq->name, work);
+
+    uint pool = (wq->flags & WORKQUEUE_FLAG_PER_CPU) ? arch_curr_cpu_num() : 0;
+
+    return queue_on_pool(wq, &wq->pools[pool], work, flags, false);
+}
+
+status_t workqueue_queue_on(workqueue_t *wq, uint cpu, work_t *work, uint flags)
+{
+    LTRACEF("%s: cpu %u, work %p\n", wq->name, cpu, work);
+
+    if (!(wq->flags & WORKQUEUE_FLAG_PER_CPU) || cpu >= wq->pool_count)
+        return ERR_INVALID_ARGS;
+
+    return queue_on_pool(wq, &wq->pools[cpu], work, flags, true);
+}
+
+/* block until done() holds, evaluated under the queue lock */
+static void wait_for(workqueue_t *wq, bool (*done)(workqueue_t *wq, const work_t *work),
+                     const work_t *work)
+{
+    THREAD_LOCK(state);
+    for (;;) {
+        spin_lock(&wq->lock);
+        bool finished = done(wq, work);
+        if (!finished)
+            wq->waiters++;
+        spin_unlock(&wq->lock);
+
+        if (finished)
+            break;
+
+        wait_queue_block(&wq->idle_wait, INFINITE_TIME);
+
+        spin_lock(&wq->lock);
+        wq->waiters--;
+        spin_unlock(&wq->lock);
+    }
+    THREAD_UNLOCK(state);
+}
+
+static bool wq_is_idle(workqueue_t *wq, const work_t *work)
+{
+    return wq->outstanding == 0;
+}
+
+static bool work_is_idle(workqueue_t *wq, const work_t *work)
+{
+    for (uint i = 0; i < wq->worker_count; i++) {
+        if (wq->workers[i].current == work)
+            return false;
+    }
+    return true;
+}
+
+void workqueue_flush(workqueue_t *wq)
+{
+    wait_for(wq, &wq_is_idle, NULL);
+}
+
+bool work_cancel(work_t *work)
+{
+    workqueue_t *wq = work->wq;
+    bool was_pending = false;
+
+    if (!wq)
+        return false;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&wq->lock, state);
+    if (work->pending) {
+        list_delete(&work->node);
+        work->pending = false;
+        wq->outstanding--;
+        wq->cancelled++;
+        was_pending = true;
+    }
+    bool wake = was_pending && wq->waiters > 0;
+    spin_unlock_irqrestore(&wq->lock, state);
+
+    if (wake) {
+        THREAD_LOCK(tstate);
+        wait_queue_wake_all(&wq->idle_wait, false, NO_ERROR);
+        THREAD_UNLOCK(tstate);
+    }
+
+    return was_pending;
+}
+
+bool work_cancel_sync(work_t *work)
+{
+    bool was_pending = work_cancel(work);
+
+    if (work->wq)
+        wait_for(work->wq, &work_is_idle, work);
+
+    return was_pending;
+}
+
+static void workqueue_init(uint level)
+{
+    system_workqueue = workqueue_create("wq", DPC_PRIORITY, 0, WORKQUEUE_FLAG_PER_CPU);
+    if (!system_workqueue)
+        panic("failed to create the system work queue\n");
+}
+
+LK_INIT_HOOK(workqueue, &workqueue_init, LK_INIT_LEVEL_THREADING - 1);
+
+#if WITH_SMP
+static void workqueue_init_secondary(uint level)
+{
+    uint cpu = arch_curr_cpu_num();
+
+    mutex_acquire(&wq_list_lock);
+    workqueue_t *wq;
+    list_for_every_entry(&wq_list, wq, workqueue_t, node) {
+        if (wq->flags & WORKQUEUE_FLAG_PER_CPU)
+            start_worker(wq, cpu, cpu);
+    }
+    mutex_release(&wq_list_lock);
+}
+
+LK_INIT_HOOK_FLAGS(workqueue_secondary, &workqueue_init_secondary, LK_INIT_LEVEL_THREADING,
+                   LK_INIT_FLAG_SECONDARY_CPUS);
+#endif
+
+#if LK_DEBUGLEVEL > 0
+static int cmd_wq(int argc, const cmd_args *argv)
+{
+    mutex_acquire(&wq_list_lock);
+    printf("%-16s %5s %4s %8s %6s %12s %12s %10s\n",
+           "name", "prio", "max", "workers", "active", "queued", "completed", "cancelled");
+    workqueue_t *wq;
+    list_for_every_entry(&wq_list, wq, workqueue_t, node) {
+        uint workers = 0;
+        for (uint i = 0; i < wq->worker_count; i++) {
+            if (wq->workers[i].thread)
+                workers++;
+        }
+        printf("%-16s %5d %4u %8u %6u %12llu %12llu %10llu\n",
+               wq->name, wq->priority, wq->max_active, workers, wq->active,
+               wq->queued, wq->completed, wq->cancelled);
+    }
+    mutex_release(&wq_list_lock);
+
+    return NO_ERROR;
+}
+#endif
+
+STATIC_COMMAND_START
+#if LK_DEBUGLEVEL > 0
+STATIC_COMMAND("wq", "list work queues", &cmd_wq)
+#endif
+STATIC_COMMAND_END(workqueue);
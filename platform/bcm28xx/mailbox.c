@@ -149,6 +149,9 @@ status_t display_get_framebuffer(struct display_framebuffer *fb)
     fb->image.height = fb_desc.phys_height;
     fb->image.stride = fb_desc.phys_width;
     fb->flush = NULL;
+    fb->flush_rect = NULL;
+    fb->back_pixels = NULL;
+    fb->flip = NULL;
 
     return NO_ERROR;
 }
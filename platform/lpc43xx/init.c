@@ -27,6 +27,7 @@
 #include <platform.h>
 
 #include <platform/lpc43xx-clocks.h>
+#include <lib/io.h>
 
 void lpc43xx_debug_early_init(void);
 void lpc43xx_debug_init(void);
@@ -120,6 +121,9 @@ void platform_init(void)
 void platform_halt(platform_halt_action suggested_action,
                    platform_halt_reason reason)
 {
+    /* anything still queued for the console goes out first */
+    console_output_panic();
+
     arch_disable_ints();
     if (suggested_action == HALT_ACTION_REBOOT) {
         // CORE reset
@@ -26,6 +26,7 @@
 #include <dev/uart.h>
 #include <platform/mt_uart.h>
 #include <platform.h>
+#include <lib/io.h>
 
 void _dputc(char c)
 {
@@ -53,6 +54,9 @@ int dgetc(char *c, bool wait)
 
 void platform_halt(platform_halt_action suggested_action, platform_halt_reason reason)
 {
+    /* anything still queued for the console goes out first */
+    console_output_panic();
+
     arch_disable_ints();
     for (;;);
 }
@@ -0,0 +1,903 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * AHCI SATA host controller.
+ *
+ * Every port with an ATA disk behind it becomes a bio device. Requests are
+ * queued per port and split into commands of up to AHCI_PRD_COUNT scatter
+ * entries, which are issued into as many command slots as the drive's queue
+ * allows, as native command queueing FPDMA commands if both the controller and
+ * the drive support it, one DMA EXT command at a time otherwise. Completions
+ * are harvested from the interrupt, which refills the freed slots.
+ */
+#include <reg.h>
+#include <debug.h>
+#include <trace.h>
+#include <assert.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arch/x86.h>
+#include <sys/types.h>
+#include <platform/interrupts.h>
+#include <platform/pc.h>
+#include <platform.h>
+#include <dev/pci.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/vm.h>
+#include <lib/bio.h>
+#include <lk/init.h>
+#include <pow2.h>
+
+#define LOCAL_TRACE 0
+
+// scatter entries per command, sized so a command table takes 1k
+#ifndef AHCI_PRD_COUNT
+#define AHCI_PRD_COUNT 56
+#endif
+#define AHCI_BOUNCE_SIZE (64 * 1024)
+#define AHCI_MAX_PORTS 32
+#define AHCI_MAX_SLOTS 32
+
+// hba registers
+#define AHCI_CAP        0x00
+#define AHCI_GHC        0x04
+#define AHCI_IS         0x08
+#define AHCI_PI         0x0c
+#define AHCI_VS         0x10
+
+#define AHCI_CAP_NP(cap)    (((cap) & 0x1f) + 1)
+#define AHCI_CAP_NCS(cap)   ((((cap) >> 8) & 0x1f) + 1)
+#define AHCI_CAP_SSS        (1u << 27)
+#define AHCI_CAP_SNCQ       (1u << 30)
+#define AHCI_CAP_S64A       (1u << 31)
+
+#define AHCI_GHC_HR         (1u << 0)
+#define AHCI_GHC_IE         (1u << 1)
+#define AHCI_GHC_AE         (1u << 31)
+
+// port registers
+#define AHCI_PORT(n)    (0x100 + (n) * 0x80)
+#define AHCI_PxCLB      0x00
+#define AHCI_PxCLBU     0x04
+#define AHCI_PxFB       0x08
+#define AHCI_PxFBU      0x0c
+#define AHCI_PxIS       0x10
+#define AHCI_PxIE       0x14
+#define AHCI_PxCMD      0x18
+#define AHCI_PxTFD      0x20
+#define AHCI_PxSIG      0x24
+#define AHCI_PxSSTS     0x28
+#define AHCI_PxSERR     0x30
+#define AHCI_PxSACT     0x34
+#define AHCI_PxCI       0x38
+
+#define AHCI_PxCMD_ST       (1u << 0)
+#define AHCI_PxCMD_SUD      (1u << 1)
+#define AHCI_PxCMD_POD      (1u << 2)
+#define AHCI_PxCMD_FRE      (1u << 4)
+#define AHCI_PxCMD_FR       (1u << 14)
+#define AHCI_PxCMD_CR       (1u << 15)
+
+#define AHCI_PxIS_DHRS      (1u << 0)
+#define AHCI_PxIS_PSS       (1u << 1)
+#define AHCI_PxIS_DSS       (1u << 2)
+#define AHCI_PxIS_SDBS      (1u << 3)
+#define AHCI_PxIS_IFS       (1u << 27)
+#define AHCI_PxIS_HBDS      (1u << 28)
+#define AHCI_PxIS_HBFS      (1u << 29)
+#define AHCI_PxIS_TFES      (1u << 30)
+#define AHCI_PxIS_ERRORS    (AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS | AHCI_PxIS_TFES)
+
+#define AHCI_TFD_ERR        0x01
+#define AHCI_TFD_DRQ        0x08
+#define AHCI_TFD_BSY        0x80
+
+#define AHCI_SSTS_DET(ssts) ((ssts) & 0xf)
+#define AHCI_SSTS_DET_PRESENT 3
+
+#define AHCI_SIG_ATA        0x00000101
+
+// ata commands
+#define ATA_READ_DMA_EXT        0x25
+#define ATA_WRITE_DMA_EXT       0x35
+#define ATA_READ_FPDMA_QUEUED   0x60
+#define ATA_WRITE_FPDMA_QUEUED  0x61
+#define ATA_IDENTIFY            0xec
+
+#define FIS_TYPE_REG_H2D    0x27
+
+struct ahci_cmd_header {
+    uint16_t flags;     // command fis length in dwords, write, ...
+    uint16_t prdtl;     // scatter entries
+    volatile uint32_t prdbc; // bytes transferred
+    uint32_t ctba;
+    uint32_t ctbau;
+    uint32_t reserved[4];
+};
+
+#define AHCI_CMD_WRITE      (1u << 6)
+
+struct ahci_prd {
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;       // byte count minus one, bit 31 interrupt on completion
+};
+
+struct ahci_cmd_table {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    struct ahci_prd prdt[AHCI_PRD_COUNT];
+};
+
+#define AHCI_CMD_LIST_SIZE  1024
+#define AHCI_FIS_SIZE       256
+
+struct ahci_slot {
+    bio_request_t *req;
+    uint count;         // blocks moved by the command
+    bool bounced;
+    size_t offset;      // byte offset of the command into its request
+};
+
+struct ahci_port {
+    struct ahci_controller *hba;
+    uint index;
+    uintptr_t regs;
+
+    struct ahci_cmd_header *cmd_list;
+    struct ahci_cmd_table *tables;
+    paddr_t tables_pa;
+    uint8_t *bounce;
+    paddr_t bounce_pa;
+    bool bounce_busy;
+
+    bool ncq;
+    uint slots;         // usable command slots
+    uint32_t issued;    // slots with a command in flight
+
+    spin_lock_t lock;
+    struct list_node queue; // requests waiting for, or part way into, slots
+    struct {
+        uint iov;           // where the head of the queue is issued up to
+        size_t iov_off;
+        size_t offset;
+        bnum_t block;
+        uint remaining;
+    } cur;
+    struct ahci_slot slot[AHCI_MAX_SLOTS];
+
+    bdev_t bdev;
+};
+
+struct ahci_controller {
+    uintptr_t regs;
+    int irq;
+    uint32_t cap;
+    struct ahci_port *ports[AHCI_MAX_PORTS];
+};
+
+static inline uint32_t ahci_read(struct ahci_controller *hba, uint reg)
+{
+    return readl(hba->regs + reg);
+}
+
+static inline void ahci_write(struct ahci_controller *hba, uint reg, uint32_t val)
+{
+    writel(val, hba->regs + reg);
+}
+
+static inline uint32_t ahci_port_read(struct ahci_port *port, uint reg)
+{
+    return readl(port->regs + reg);
+}
+
+static inline void ahci_port_write(struct ahci_port *port, uint reg, uint32_t val)
+{
+    writel(val, port->regs + reg);
+}
+
+/* poll a register until (value & mask) == match, for up to timeout ms */
+static status_t ahci_wait(uintptr_t reg, uint32_t mask, uint32_t match, lk_time_t timeout)
+{
+    lk_time_t start = current_time();
+
+    while ((readl(reg) & mask) != match) {
+        if (current_time() - start > timeout)
+            return ERR_TIMED_OUT;
+        thread_sleep(1);
+    }
+
+    return NO_ERROR;
+}
+
+static bool ahci_reachable(struct ahci_port *port, const void *va, size_t len, paddr_t *pa)
+{
+    *pa = vaddr_to_paddr((void *)va);
+    if (*pa == 0 || (*pa & 1))
+        return false;
+    if (!(port->hba->cap & AHCI_CAP_S64A) && (uint64_t)*pa + len > 0x100000000ULL)
+        return false;
+
+    return true;
+}
+
+/* copy between a request's scatter list, starting offset bytes in, and buf */
+static void ahci_copy_iov(const bio_request_t *req, size_t offset, uint8_t *buf, size_t len, bool to_iov)
+{
+    for (uint i = 0; i < req->iov_cnt && len > 0; i++) {
+        if (offset >= req->iov[i].iov_len) {
+            offset -= req->iov[i].iov_len;
+            continue;
+        }
+
+        uint8_t *base = (uint8_t *)req->iov[i].iov_base + offset;
+        size_t chunk = MIN(len, req->iov[i].iov_len - offset);
+
+        if (to_iov)
+            memcpy(base, buf, chunk);
+        else
+            memcpy(buf, base, chunk);
+
+        buf += chunk;
+        len -= chunk;
+        offset = 0;
+    }
+}
+
+static void ahci_set_prd(struct ahci_prd *prd, paddr_t pa, size_t len)
+{
+    prd->dba = (uint32_t)pa;
+    prd->dbau = (uint32_t)((uint64_t)pa >> 32);
+    prd->reserved = 0;
+    prd->dbc = len - 1;
+}
+
+/* fill a command table's scatter list from the head request's current
+ * position. returns the bytes covered, whole blocks, or 0 if the next block
+ * can't be reached by the controller. */
+static size_t ahci_map_direct(struct ahci_port *port, struct ahci_cmd_table *table, size_t max, uint *prdtl)
+{
+    const bio_request_t *req = list_peek_head_type(&port->queue, bio_request_t, node);
+    size_t block_size = port->bdev.block_size;
+    uint iov = port->cur.iov;
+    size_t off = port->cur.iov_off;
+    size_t total = 0;
+    size_t last_len = 0;
+    paddr_t last_pa = 0;
+    uint n = 0;
+
+    while (total < max && iov < req->iov_cnt) {
+        const uint8_t *va = (const uint8_t *)req->iov[iov].iov_base + off;
+        size_t len = MIN(req->iov[iov].iov_len - off, max - total);
+        len = MIN(len, PAGE_SIZE - ((uintptr_t)va & (PAGE_SIZE - 1)));
+
+        if (len == 0) {
+            iov++;
+            off = 0;
+            continue;
+        }
+
+        paddr_t pa;
+        if (!ahci_reachable(port, va, len, &pa))
+            break;
+
+        if (n > 0 && last_pa + last_len == pa) {
+            last_len += len;
+        } else {
+            if (n == AHCI_PRD_COUNT)
+                break;
+            if (n > 0)
+                ahci_set_prd(&table->prdt[n - 1], last_pa, last_len);
+            last_pa = pa;
+            last_len = len;
+            n++;
+        }
+
+        total += len;
+        off += len;
+        if (off == req->iov[iov].iov_len) {
+            iov++;
+            off = 0;
+        }
+    }
+
+    // give back a partial block at the end
+    size_t excess = total % block_size;
+    total -= excess;
+    while (excess > 0) {
+        if (last_len > excess) {
+            last_len -= excess;
+            break;
+        }
+
+        excess -= last_len;
+        n--;
+        if (n > 0) {
+            last_pa = table->prdt[n - 1].dba | ((uint64_t)table->prdt[n - 1].dbau << 32);
+            last_len = table->prdt[n - 1].dbc + 1;
+        }
+    }
+
+    if (total == 0)
+        return 0;
+
+    ahci_set_prd(&table->prdt[n - 1], last_pa, last_len);
+    *prdtl = n;
+
+    return total;
+}
+
+static void ahci_build_fis(struct ahci_port *port, uint8_t *fis, uint slot, bool write, uint64_t lba, uint count)
+{
+    memset(fis, 0, 20);
+    fis[0] = FIS_TYPE_REG_H2D;
+    fis[1] = 0x80; // command
+    fis[4] = lba;
+    fis[5] = lba >> 8;
+    fis[6] = lba >> 16;
+    fis[7] = 0x40; // lba mode
+    fis[8] = lba >> 24;
+    fis[9] = lba >> 32;
+    fis[10] = lba >> 40;
+
+    if (port->ncq) {
+        fis[2] = write ? ATA_WRITE_FPDMA_QUEUED : ATA_READ_FPDMA_QUEUED;
+        fis[3] = count;
+        fis[11] = count >> 8;
+        fis[12] = slot << 3;
+    } else {
+        fis[2] = write ? ATA_WRITE_DMA_EXT : ATA_READ_DMA_EXT;
+        fis[12] = count;
+        fis[13] = count >> 8;
+    }
+}
+
+/* issue commands for queued requests into free slots until one or the other
+ * runs out. port->lock must be held. */
+static void ahci_dispatch_locked(struct ahci_port *port)
+{
+    size_t block_size = port->bdev.block_size;
+
+    for (;;) {
+        bio_request_t *req = list_peek_head_type(&port->queue, bio_request_t, node);
+        if (!req)
+            return;
+
+        uint32_t busy = port->issued | ~(uint32_t)((1ull << port->slots) - 1);
+        if (busy == 0xffffffff)
+            return;
+        uint slot = __builtin_ctz(~busy);
+
+        // the request is at the head of the queue for the first time
+        if (req->pending == 0) {
+            port->cur.iov = 0;
+            port->cur.iov_off = 0;
+            port->cur.offset = 0;
+            port->cur.block = req->block;
+            port->cur.remaining = req->count;
+            req->result = (ssize_t)req->count * block_size;
+            req->pending = 1;
+        }
+
+        struct ahci_cmd_table *table = &port->tables[slot];
+        size_t max = (size_t)MIN(port->cur.remaining, 0x10000) * block_size;
+        uint prdtl = 0;
+        bool bounced = false;
+
+        size_t len = ahci_map_direct(port, table, max, &prdtl);
+        if (len == 0) {
+            if (port->bounce_busy)
+                return;
+
+            len = MIN(max, AHCI_BOUNCE_SIZE);
+            ahci_set_prd(&table->prdt[0], port->bounce_pa, len);
+            prdtl = 1;
+            bounced = true;
+            port->bounce_busy = true;
+            if (req->write)
+                ahci_copy_iov(req, port->cur.offset, port->bounce, len, false);
+        }
+
+        uint count = len / block_size;
+
+        struct ahci_slot *s = &port->slot[slot];
+        s->req = req;
+        s->count = count;
+        s->bounced = bounced;
+        s->offset = port->cur.offset;
+        req->pending++;
+
+        ahci_build_fis(port, table->cfis, slot, req->write, port->cur.block, count);
+
+        struct ahci_cmd_header *hdr = &port->cmd_list[slot];
+        hdr->flags = 5 | (req->write ? AHCI_CMD_WRITE : 0);
+        hdr->prdtl = prdtl;
+        hdr->prdbc = 0;
+
+        LTRACEF("port %u slot %u: %s block %u count %u prds %u%s\n", port->index, slot,
+                req->write ? "write" : "read", port->cur.block, count, prdtl, bounced ? " bounced" : "");
+
+        port->issued |= 1u << slot;
+        CF;
+        if (port->ncq)
+            ahci_port_write(port, AHCI_PxSACT, 1u << slot);
+        ahci_port_write(port, AHCI_PxCI, 1u << slot);
+
+        // step past the command, and off the queue once the request is all issued
+        port->cur.offset += len;
+        port->cur.block += count;
+        port->cur.remaining -= count;
+        if (port->cur.remaining == 0) {
+            list_delete(&req->node);
+            req->pending--; // the queue's hold
+        } else {
+            size_t skip = len;
+            while (skip > 0) {
+                size_t chunk = MIN(skip, req->iov[port->cur.iov].iov_len - port->cur.iov_off);
+                skip -= chunk;
+                port->cur.iov_off += chunk;
+                if (port->cur.iov_off == req->iov[port->cur.iov].iov_len) {
+                    port->cur.iov++;
+                    port->cur.iov_off = 0;
+                }
+            }
+        }
+
+        // without ncq the drive takes one command at a time
+        if (!port->ncq)
+            return;
+    }
+}
+
+/* retire a finished command. requests that are done move to the done list.
+ * port->lock must be held. */
+static void ahci_retire_locked(struct ahci_port *port, uint slot, status_t err, struct list_node *done)
+{
+    struct ahci_slot *s = &port->slot[slot];
+    bio_request_t *req = s->req;
+    size_t block_size = port->bdev.block_size;
+
+    port->issued &= ~(1u << slot);
+    s->req = NULL;
+
+    if (s->bounced) {
+        if (err == NO_ERROR && !req->write)
+            ahci_copy_iov(req, s->offset, port->bounce, (size_t)s->count * block_size, true);
+        port->bounce_busy = false;
+    }
+
+    if (err < 0)
+        req->result = err;
+
+    if (--req->pending == 0)
+        list_add_tail(done, &req->node);
+}
+
+/* a failed command stops the port. fail everything in flight, clear the
+ * error and restart the port. port->lock must be held. */
+static void ahci_port_recover_locked(struct ahci_port *port, struct list_node *done)
+{
+    dprintf(INFO, "ahci: port %u error, is 0x%x tfd 0x%x serr 0x%x\n", port->index,
+            ahci_port_read(port, AHCI_PxIS), ahci_port_read(port, AHCI_PxTFD),
+            ahci_port_read(port, AHCI_PxSERR));
+
+    ahci_port_write(port, AHCI_PxCMD, ahci_port_read(port, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+    for (uint i = 0; i < 500 && (ahci_port_read(port, AHCI_PxCMD) & AHCI_PxCMD_CR); i++)
+        spin(1000);
+
+    for (uint slot = 0; slot < port->slots; slot++) {
+        if (port->issued & (1u << slot))
+            ahci_retire_locked(port, slot, ERR_IO, done);
+    }
+
+    // the head of the queue may have been part way issued, fail the rest of it
+    bio_request_t *req = list_peek_head_type(&port->queue, bio_request_t, node);
+    if (req && req->pending > 0) {
+        list_delete(&req->node);
+        req->result = ERR_IO;
+        if (--req->pending == 0)
+            list_add_tail(done, &req->node);
+    }
+
+    ahci_port_write(port, AHCI_PxSERR, 0xffffffff);
+    ahci_port_write(port, AHCI_PxIS, 0xffffffff);
+    ahci_port_write(port, AHCI_PxCMD, ahci_port_read(port, AHCI_PxCMD) | AHCI_PxCMD_ST);
+}
+
+static void ahci_complete(struct list_node *done)
+{
+    bio_request_t *req;
+
+    while ((req = list_remove_head_type(done, bio_request_t, node)))
+        bio_request_complete(req, req->result);
+}
+
+static enum handler_return ahci_irq(void *arg)
+{
+    struct ahci_controller *hba = arg;
+    struct list_node done = LIST_INITIAL_VALUE(done);
+
+    uint32_t is = ahci_read(hba, AHCI_IS);
+    if (is == 0)
+        return INT_NO_RESCHEDULE;
+
+    for (uint i = 0; i < AHCI_MAX_PORTS; i++) {
+        if (!(is & (1u << i)))
+            continue;
+
+        struct ahci_port *port = hba->ports[i];
+        uint32_t port_is = readl(hba->regs + AHCI_PORT(i) + AHCI_PxIS);
+        writel(port_is, hba->regs + AHCI_PORT(i) + AHCI_PxIS);
+        if (!port)
+            continue;
+
+        spin_lock(&port->lock);
+        if (port_is & AHCI_PxIS_ERRORS) {
+            ahci_port_recover_locked(port, &done);
+        } else {
+            uint32_t running = ahci_port_read(port, AHCI_PxCI) | ahci_port_read(port, AHCI_PxSACT);
+            uint32_t finished = port->issued & ~running;
+
+            while (finished) {
+                uint slot = __builtin_ctz(finished);
+                finished &= finished - 1;
+                ahci_retire_locked(port, slot, NO_ERROR, &done);
+            }
+        }
+        ahci_dispatch_locked(port);
+        spin_unlock(&port->lock);
+    }
+
+    // the hba bits are cleared after the port's
+    ahci_write(hba, AHCI_IS, is);
+
+    if (list_is_empty(&done))
+        return INT_NO_RESCHEDULE;
+
+    ahci_complete(&done);
+
+    return INT_RESCHEDULE;
+}
+
+static status_t ahci_bdev_submit(struct bdev *bdev, bio_request_t *req)
+{
+    struct ahci_port *port = containerof(bdev, struct ahci_port, bdev);
+    spin_lock_saved_state_t state;
+
+    LTRACEF("port %u, req %p, block 0x%x, count %u\n", port->index, req, req->block, req->count);
+
+    req->pending = 0;
+
+    spin_lock_irqsave(&port->lock, state);
+    list_add_tail(&port->queue, &req->node);
+    ahci_dispatch_locked(port);
+    spin_unlock_irqrestore(&port->lock, state);
+
+    return NO_ERROR;
+}
+
+static ssize_t ahci_bdev_io(struct bdev *bdev, void *buf, bnum_t block, uint count, bool write)
+{
+    iovec_t iov = { buf, (size_t)count * bdev->block_size };
+    bio_request_t req = {
+        .write = write,
+        .block = block,
+        .count = count,
+        .iov = &iov,
+        .iov_cnt = 1,
+    };
+
+    if (count == 0)
+        return 0;
+
+    event_init(&req.done, false, 0);
+    ahci_bdev_submit(bdev, &req);
+
+    return bio_request_wait(&req);
+}
+
+static ssize_t ahci_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
+{
+    return ahci_bdev_io(bdev, buf, block, count, false);
+}
+
+static ssize_t ahci_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count)
+{
+    return ahci_bdev_io(bdev, (void *)buf, block, count, true);
+}
+
+static status_t ahci_port_stop(struct ahci_port *port)
+{
+    uint32_t cmd = ahci_port_read(port, AHCI_PxCMD);
+
+    ahci_port_write(port, AHCI_PxCMD, cmd & ~AHCI_PxCMD_ST);
+    if (ahci_wait(port->regs + AHCI_PxCMD, AHCI_PxCMD_CR, 0, 500) < 0)
+        return ERR_TIMED_OUT;
+
+    ahci_port_write(port, AHCI_PxCMD, ahci_port_read(port, AHCI_PxCMD) & ~AHCI_PxCMD_FRE);
+    if (ahci_wait(port->regs + AHCI_PxCMD, AHCI_PxCMD_FR, 0, 500) < 0)
+        return ERR_TIMED_OUT;
+
+    return NO_ERROR;
+}
+
+/* run IDENTIFY DEVICE through slot 0 by polling, before interrupts are on */
+static status_t ahci_identify(struct ahci_port *port, uint16_t *info)
+{
+    struct ahci_cmd_table *table = &port->tables[0];
+    struct ahci_cmd_header *hdr = &port->cmd_list[0];
+
+    memset(table->cfis, 0, sizeof(table->cfis));
+    table->cfis[0] = FIS_TYPE_REG_H2D;
+    table->cfis[1] = 0x80;
+    table->cfis[2] = ATA_IDENTIFY;
+    ahci_set_prd(&table->prdt[0], port->bounce_pa, 512);
+
+    hdr->flags = 5;
+    hdr->prdtl = 1;
+    hdr->prdbc = 0;
+
+    CF;
+    ahci_port_write(port, AHCI_PxCI, 1);
+
+    lk_time_t start = current_time();
+    while (ahci_port_read(port, AHCI_PxCI) & 1) {
+        if ((ahci_port_read(port, AHCI_PxIS) & AHCI_PxIS_TFES) || current_time() - start > 1000)
+            return ERR_IO;
+        thread_sleep(1);
+    }
+    if (ahci_port_read(port, AHCI_PxTFD) & AHCI_TFD_ERR)
+        return ERR_IO;
+
+    memcpy(info, port->bounce, 512);
+
+    return NO_ERROR;
+}
+
+static status_t ahci_port_init(struct ahci_controller *hba, uint index)
+{
+    static uint found_index = 0;
+    status_t err;
+
+    struct ahci_port *port = calloc(1, sizeof(struct ahci_port));
+    if (!port)
+        return ERR_NO_MEMORY;
+
+    port->hba = hba;
+    port->index = index;
+    port->regs = hba->regs + AHCI_PORT(index);
+    spin_lock_init(&port->lock);
+    list_initialize(&port->queue);
+
+    err = ahci_port_stop(port);
+    if (err < 0) {
+        LTRACEF("port %u won't stop\n", index);
+        goto error;
+    }
+
+    // command list, received fises, command tables and the bounce buffer in one piece
+    port->slots = AHCI_CAP_NCS(hba->cap);
+    size_t tables_off = PAGE_SIZE;
+    size_t bounce_off = tables_off + ROUNDUP(port->slots * sizeof(struct ahci_cmd_table), PAGE_SIZE);
+    void *mem;
+
+    err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "ahci", bounce_off + AHCI_BOUNCE_SIZE, &mem,
+                               PAGE_SIZE_SHIFT, VMM_FLAG_ZERO_FILL, ARCH_MMU_FLAG_CACHED);
+    if (err < 0)
+        goto error;
+
+    paddr_t pa = vaddr_to_paddr(mem);
+    if (!(hba->cap & AHCI_CAP_S64A) && (uint64_t)pa + bounce_off + AHCI_BOUNCE_SIZE > 0x100000000ULL) {
+        err = ERR_NOT_SUPPORTED;
+        goto error_free;
+    }
+
+    port->cmd_list = mem;
+    port->tables = (struct ahci_cmd_table *)((uint8_t *)mem + tables_off);
+    port->tables_pa = pa + tables_off;
+    port->bounce = (uint8_t *)mem + bounce_off;
+    port->bounce_pa = pa + bounce_off;
+
+    for (uint i = 0; i < port->slots; i++) {
+        paddr_t table_pa = port->tables_pa + i * sizeof(struct ahci_cmd_table);
+        port->cmd_list[i].ctba = (uint32_t)table_pa;
+        port->cmd_list[i].ctbau = (uint32_t)((uint64_t)table_pa >> 32);
+    }
+
+    ahci_port_write(port, AHCI_PxCLB, (uint32_t)pa);
+    ahci_port_write(port, AHCI_PxCLBU, (uint32_t)((uint64_t)pa >> 32));
+    ahci_port_write(port, AHCI_PxFB, (uint32_t)(pa + AHCI_CMD_LIST_SIZE));
+    ahci_port_write(port, AHCI_PxFBU, (uint32_t)((uint64_t)(pa + AHCI_CMD_LIST_SIZE) >> 32));
+
+    ahci_port_write(port, AHCI_PxSERR, 0xffffffff);
+    ahci_port_write(port, AHCI_PxIS, 0xffffffff);
+
+    uint32_t cmd = ahci_port_read(port, AHCI_PxCMD) | AHCI_PxCMD_FRE | AHCI_PxCMD_POD;
+    if (hba->cap & AHCI_CAP_SSS)
+        cmd |= AHCI_PxCMD_SUD;
+    ahci_port_write(port, AHCI_PxCMD, cmd);
+
+    // wait for the link to come up and the drive to finish its reset
+    err = ahci_wait(port->regs + AHCI_PxSSTS, 0xf, AHCI_SSTS_DET_PRESENT, 20);
+    if (err < 0) {
+        err = ERR_NOT_FOUND;
+        goto error_stop;
+    }
+    err = ahci_wait(port->regs + AHCI_PxTFD, AHCI_TFD_BSY | AHCI_TFD_DRQ, 0, 1000);
+    if (err < 0)
+        goto error_stop;
+
+    if (ahci_port_read(port, AHCI_PxSIG) != AHCI_SIG_ATA) {
+        LTRACEF("port %u: not an ata disk, signature 0x%x\n", index, ahci_port_read(port, AHCI_PxSIG));
+        err = ERR_NOT_FOUND;
+        goto error_stop;
+    }
+
+    ahci_port_write(port, AHCI_PxSERR, 0xffffffff);
+    ahci_port_write(port, AHCI_PxCMD, ahci_port_read(port, AHCI_PxCMD) | AHCI_PxCMD_ST);
+
+    uint16_t info[256];
+    err = ahci_identify(port, info);
+    if (err < 0) {
+        dprintf(INFO, "ahci: port %u: identify failed\n", index);
+        goto error_stop;
+    }
+
+    // 48 bit addressing is all this driver speaks
+    if (!(info[83] & (1 << 10))) {
+        dprintf(INFO, "ahci: port %u: drive lacks 48 bit lba\n", index);
+        err = ERR_NOT_SUPPORTED;
+        goto error_stop;
+    }
+
+    uint64_t sectors = info[100] | ((uint64_t)info[101] << 16) | ((uint64_t)info[102] << 32) |
+                       ((uint64_t)info[103] << 48);
+    size_t sector_size = 512;
+    if ((info[106] & 0xc000) == 0x4000 && (info[106] & (1 << 12)))
+        sector_size = 2 * (info[117] | ((uint32_t)info[118] << 16));
+    if (sector_size < 512 || !ispow2(sector_size)) {
+        err = ERR_NOT_SUPPORTED;
+        goto error_stop;
+    }
+
+    // queue as deep as both ends allow
+    if ((hba->cap & AHCI_CAP_SNCQ) && (info[76] & (1 << 8))) {
+        port->ncq = true;
+        port->slots = MIN(port->slots, (info[75] & 0x1fu) + 1);
+    } else {
+        port->slots = 1;
+    }
+
+    ahci_port_write(port, AHCI_PxIS, 0xffffffff);
+    ahci_port_write(port, AHCI_PxIE, AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_DSS |
+                    AHCI_PxIS_SDBS | AHCI_PxIS_ERRORS);
+
+    char name[16];
+    snprintf(name, sizeof(name), "sata%u", found_index++);
+    bio_initialize_bdev(&port->bdev, name, sector_size, MIN(sectors, (uint64_t)UINT32_MAX),
+                        0, NULL, BIO_FLAGS_NONE);
+
+    port->bdev.read_block = &ahci_bdev_read_block;
+    port->bdev.write_block = &ahci_bdev_write_block;
+    port->bdev.submit = &ahci_bdev_submit;
+
+    hba->ports[index] = port;
+    bio_register_device(&port->bdev);
+
+    dprintf(INFO, "ahci: port %u: %s, %llu sectors of %zu bytes, %s depth %u\n", index, name,
+            sectors, sector_size, port->ncq ? "ncq" : "no ncq", port->slots);
+
+    return NO_ERROR;
+
+error_stop:
+    ahci_port_stop(port);
+error_free:
+    vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)mem);
+error:
+    free(port);
+    return err;
+}
+
+static status_t ahci_probe(pci_location_t *loc)
+{
+    pci_config_t config;
+    status_t err;
+
+    for (uint i = 0; i < sizeof(config) / sizeof(uint32_t); i++) {
+        if (pci_read_config_word(loc, i * sizeof(uint32_t), (uint32_t *)&config + i) != _PCI_SUCCESSFUL)
+            return ERR_NOT_CONFIGURED;
+    }
+
+    // abar is bar 5, memory space
+    paddr_t abar = config.base_addresses[5] & ~0xfu;
+    if ((config.base_addresses[5] & 1) || !abar || config.interrupt_line >= 16)
+        return ERR_NOT_CONFIGURED;
+
+    pci_write_config_half(loc, PCI_CONFIG_COMMAND,
+                          config.command | PCI_COMMAND_MEM_EN | PCI_COMMAND_BUS_MASTER_EN);
+
+    struct ahci_controller *hba = calloc(1, sizeof(struct ahci_controller));
+    if (!hba)
+        return ERR_NO_MEMORY;
+
+    void *ptr;
+    size_t map_off = abar & (PAGE_SIZE - 1);
+    err = vmm_alloc_physical(vmm_get_kernel_aspace(), "ahci_abar",
+                             ROUNDUP(map_off + AHCI_PORT(AHCI_MAX_PORTS), PAGE_SIZE), &ptr,
+                             PAGE_SIZE_SHIFT, abar - map_off, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+    if (err < 0) {
+        free(hba);
+        return err;
+    }
+
+    hba->regs = (uintptr_t)ptr + map_off;
+    hba->irq = INT_BASE + config.interrupt_line;
+
+    // reset into ahci mode
+    ahci_write(hba, AHCI_GHC, AHCI_GHC_AE);
+    ahci_write(hba, AHCI_GHC, AHCI_GHC_AE | AHCI_GHC_HR);
+    if (ahci_wait(hba->regs + AHCI_GHC, AHCI_GHC_HR, 0, 1000) < 0) {
+        dprintf(INFO, "ahci: controller reset timed out\n");
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ptr);
+        free(hba);
+        return ERR_TIMED_OUT;
+    }
+    ahci_write(hba, AHCI_GHC, AHCI_GHC_AE);
+
+    hba->cap = ahci_read(hba, AHCI_CAP);
+    uint32_t pi = ahci_read(hba, AHCI_PI);
+
+    dprintf(INFO, "ahci: controller at %02x:%02x version 0x%x, cap 0x%x, ports 0x%x, irq %u\n",
+            loc->bus, loc->dev_fn, ahci_read(hba, AHCI_VS), hba->cap, pi, config.interrupt_line);
+
+    // ports only raise interrupts once they are fully set up
+    register_int_handler(hba->irq, &ahci_irq, hba);
+    unmask_interrupt(hba->irq);
+
+    ahci_write(hba, AHCI_IS, 0xffffffff);
+    ahci_write(hba, AHCI_GHC, AHCI_GHC_AE | AHCI_GHC_IE);
+
+    uint found = 0;
+    for (uint i = 0; i < AHCI_MAX_PORTS; i++) {
+        if ((pi & (1u << i)) && ahci_port_init(hba, i) == NO_ERROR)
+            found++;
+    }
+
+    return found ? NO_ERROR : ERR_NOT_FOUND;
+}
+
+static void ahci_init(uint level)
+{
+    pci_location_t loc;
+
+    for (uint16_t i = 0; pci_find_pci_class_code(&loc, 0x010601, i) == _PCI_SUCCESSFUL; i++)
+        ahci_probe(&loc);
+}
+
+LK_INIT_HOOK_DEFERRED(ahci, ahci_init, LK_INIT_LEVEL_PLATFORM);
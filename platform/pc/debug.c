@@ -23,7 +23,11 @@
 #include <stdarg.h>
 #include <reg.h>
 #include <stdio.h>
+#include <debug.h>
+#include <platform.h>
 #include <kernel/thread.h>
+#include <kernel/spinlock.h>
+#include <arch/ops.h>
 #include <arch/x86.h>
 #include <lib/cbuf.h>
 #include <platform/interrupts.h>
@@ -31,6 +35,7 @@
 #include <platform/console.h>
 #include <platform/keyboard.h>
 #include <platform/debug.h>
+#include <lib/io.h>
 
 #ifndef DEBUG_BAUD_RATE
 #define DEBUG_BAUD_RATE 115200
@@ -38,6 +43,9 @@
 #ifndef DEBUG_COM_PORT
 #define DEBUG_COM_PORT 1
 #endif
+#ifndef DEBUG_TXBUF_SIZE
+#define DEBUG_TXBUF_SIZE 1024
+#endif
 
 static const int uart_baud_rate = DEBUG_BAUD_RATE;
 static const int uart_io_port = (DEBUG_COM_PORT == 1) ? COM1_REG :
@@ -48,6 +56,56 @@ static const int uart_irq = (DEBUG_COM_PORT == 1 || DEBUG_COM_PORT == 3) ? INT_C
 
 cbuf_t console_input_buf;
 
+/* once platform_init_debug has run, transmit goes through tx_buf and is drained by
+ * the tx holding register empty interrupt. the lock covers the tx fifo, tx_buf's
+ * consumer side and the interrupt enable register */
+static cbuf_t uart_tx_buf;
+static spin_lock_t uart_lock = SPIN_LOCK_INITIAL_VALUE;
+static bool uart_tx_irq;
+
+#define UART_FIFO_LEN 16
+
+/* refill the fifo once it has drained, keeping the tx interrupt on while data is
+ * left. uart lock must be held */
+static void uart_tx_fill_locked(void)
+{
+    if ((inp(uart_io_port + 5) & (1<<5)) == 0) { // fifo not empty yet
+        if (cbuf_space_used(&uart_tx_buf) > 0)
+            outp(uart_io_port + 1, 0x3); // interrupt when it is
+        return;
+    }
+
+    for (uint i = 0; i < UART_FIFO_LEN; i++) {
+        char c;
+        if (cbuf_read_char(&uart_tx_buf, &c, false) != 1) {
+            outp(uart_io_port + 1, 0x1); // receive data available only
+            return;
+        }
+        outp(uart_io_port + 0, c);
+    }
+
+    outp(uart_io_port + 1, 0x3); // and transmit holding register empty
+}
+
+static void debug_uart_putc(char c)
+{
+    while ((inp(uart_io_port + 5) & (1<<6)) == 0)
+        ;
+    outp(uart_io_port + 0, c);
+}
+
+/* write out everything buffered and then c, spinning on the uart. uart lock must
+ * be held, if it can be */
+static void uart_tx_poll_locked(char c)
+{
+    char buffered;
+
+    while (uart_tx_irq && cbuf_read_char(&uart_tx_buf, &buffered, false) == 1)
+        debug_uart_putc(buffered);
+
+    debug_uart_putc(c);
+}
+
 static enum handler_return uart_irq_handler(void *arg)
 {
     unsigned char c;
@@ -59,6 +117,11 @@ static enum handler_return uart_irq_handler(void *arg)
         resched = true;
     }
 
+    spin_lock(&uart_lock);
+    if (uart_tx_irq)
+        uart_tx_fill_locked();
+    spin_unlock(&uart_lock);
+
     return resched ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
 }
 
@@ -81,6 +144,7 @@ void platform_init_debug(void)
 {
     /* finish uart init to get rx going */
     cbuf_initialize(&console_input_buf, 1024);
+    cbuf_initialize(&uart_tx_buf, DEBUG_TXBUF_SIZE);
 
     register_int_handler(uart_irq, uart_irq_handler, NULL);
     unmask_interrupt(uart_irq);
@@ -90,13 +154,12 @@ void platform_init_debug(void)
     // modem control register: Auxiliary Output 2 is another IRQ enable bit
     const uint8_t mcr = inp(uart_io_port + 4);
     outp(uart_io_port + 4, mcr | 0x8);
-}
 
-static void debug_uart_putc(char c)
-{
-    while ((inp(uart_io_port + 5) & (1<<6)) == 0)
-        ;
-    outp(uart_io_port + 0, c);
+    /* switch transmit over to the buffer */
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&uart_lock, state);
+    uart_tx_irq = true;
+    spin_unlock_irqrestore(&uart_lock, state);
 }
 
 void platform_dputc(char c)
@@ -105,7 +168,50 @@ void platform_dputc(char c)
         platform_dputc('\r');
 
     cputc(c);
-    debug_uart_putc(c);
+
+    spin_lock_saved_state_t state;
+
+    /* with interrupts off we may be inside the thread lock, which queueing to the
+     * cbuf can take, so write synchronously behind whatever is buffered */
+    if (!uart_tx_irq || arch_ints_disabled()) {
+        spin_lock_irqsave(&uart_lock, state);
+        uart_tx_poll_locked(c);
+        spin_unlock_irqrestore(&uart_lock, state);
+        return;
+    }
+
+    while (cbuf_write_char(&uart_tx_buf, c, false) != 1) {
+        /* buffer full, make room by waiting for the fifo */
+        while ((inp(uart_io_port + 5) & (1<<5)) == 0)
+            ;
+        spin_lock_irqsave(&uart_lock, state);
+        uart_tx_fill_locked();
+        spin_unlock_irqrestore(&uart_lock, state);
+    }
+
+    /* start the fifo if it is idle, the interrupt takes it from there */
+    spin_lock_irqsave(&uart_lock, state);
+    uart_tx_fill_locked();
+    spin_unlock_irqrestore(&uart_lock, state);
+}
+
+void platform_pputc(char c)
+{
+    if (c == '\n')
+        platform_pputc('\r');
+
+    cputc(c);
+
+    /* flush what is buffered first, unless the lock holder is what panicked */
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    if (spin_trylock(&uart_lock) == 0) {
+        uart_tx_poll_locked(c);
+        spin_unlock(&uart_lock);
+    } else {
+        debug_uart_putc(c);
+    }
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 }
 
 int platform_dgetc(char *c, bool wait)
@@ -113,8 +219,24 @@ int platform_dgetc(char *c, bool wait)
     return cbuf_read_char(&console_input_buf, c, wait);
 }
 
-void platform_halt(void)
+void platform_halt(platform_halt_action suggested_action,
+                   platform_halt_reason reason)
 {
+    /* anything still queued for the console goes out first */
+    console_output_panic();
+
+    if (suggested_action == HALT_ACTION_SHUTDOWN) {
+        /* enter S5 through PM1a_CNT, where the qemu q35/piix firmware and older bochs put it */
+        dprintf(ALWAYS, "Shutting down... (reason = %d)\n", reason);
+        outpw(0x604, 0x2000);
+        outpw(0xb004, 0x2000);
+    } else if (suggested_action == HALT_ACTION_REBOOT) {
+        /* pulse the reset line through the keyboard controller */
+        dprintf(ALWAYS, "Rebooting... (reason = %d)\n", reason);
+        outp(0x64, 0xfe);
+    }
+
+    dprintf(ALWAYS, "HALT: spinning forever... (reason = %d)\n", reason);
     for (;;) {
         x86_cli();
         x86_hlt();
@@ -27,6 +27,7 @@
 #include <assert.h>
 #include <err.h>
 #include <malloc.h>
+#include <string.h>
 #include <arch/x86.h>
 #include <sys/types.h>
 #include <platform/interrupts.h>
@@ -37,9 +38,43 @@
 #include <dev/driver.h>
 #include <dev/class/block.h>
 #include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <kernel/vm.h>
+#include <lib/bio.h>
 
 #define LOCAL_TRACE 0
 
+// bus master dma, for channels found on pci
+#ifndef IDE_PRD_COUNT
+#define IDE_PRD_COUNT 64
+#endif
+#define IDE_DMA_MAX_SECTORS 256
+#define IDE_DMA_BOUNCE_SIZE (64 * 1024)
+#define IDE_DMA_TIMEOUT 20000
+
+// bus master registers, relative to the channel's block in bar 4
+#define BM_REG_COMMAND 0
+#define BM_REG_STATUS  2
+#define BM_REG_PRDT    4
+
+#define BM_CMD_START   0x01
+#define BM_CMD_READ    0x08 // device to memory
+
+#define BM_STATUS_ACTIVE 0x01
+#define BM_STATUS_ERR    0x02
+#define BM_STATUS_IRQ    0x04
+
+// physical region descriptor, one per physically contiguous piece of a transfer.
+// regions may not cross a 64k boundary and a count of 0 means 64k.
+struct ide_prd {
+    uint32_t addr;
+    uint16_t count;
+    uint16_t flags;
+};
+
+#define PRD_FLAG_EOT 0x8000
+
 // status register bits
 #define IDE_CTRL_BSY   0x80
 #define IDE_DRV_RDY    0x40
@@ -152,7 +187,34 @@ struct ide_driver_state {
     struct {
         int sectors;
         int sector_size;
+        bool dma;
     } drive[2];
+
+    // bus master dma state, bmide is 0 if the channel can't do dma
+    uint16_t bmide;
+    struct ide_prd *prdt;
+    paddr_t prdt_pa;
+    uint8_t *bounce;
+    paddr_t bounce_pa;
+
+    spin_lock_t lock;
+    struct list_node queue; // requests waiting for the channel
+    bio_request_t *active;  // request being transferred
+    struct {
+        uint iov;           // position in the active request's scatter list
+        size_t iov_off;
+        uint chunk_iov;     // where the running chunk started
+        size_t chunk_iov_off;
+        bnum_t block;       // first block of the running chunk
+        uint remaining;     // blocks left in the request, including the running chunk
+        uint count;         // blocks in the running chunk
+        bool bounced;
+        lk_time_t deadline;
+    } xfer;
+    timer_t timeout;
+
+    struct device *dev;
+    bdev_t bdev;
 };
 
 static const uint16_t ide_device_regs[][IDE_REG_NUM] = {
@@ -213,6 +275,11 @@ static int ide_wait_for_completion(struct device *dev);
 static int ide_detect_ata(struct device *dev, int index);
 static void ide_lba_setup(struct device *dev, uint32_t addr, int index);
 
+static status_t ide_dma_init(struct device *dev);
+static ssize_t ide_dma_transfer(struct device *dev, bnum_t block, void *buf, uint count, bool write);
+static enum handler_return ide_dma_irq(struct device *dev, uint8_t bm_status);
+static void ide_bdev_register(struct device *dev);
+
 static status_t ide_init(struct device *dev)
 {
     status_t res = NO_ERROR;
@@ -268,6 +335,19 @@ static status_t ide_init(struct device *dev)
         state->irq = ide_device_irqs[config->legacy_index & 0x7f];
         state->regs = ide_device_regs[config->legacy_index & 0x7f];
         state->type[0] = state->type[1] = TYPE_NONE;
+
+        // bar 4 is the bus master block, 8 bytes per channel
+        uint32_t bar = pci_config.base_addresses[4];
+        if ((bar & 1) && (bar & ~3u)) {
+            state->bmide = (bar & ~3u) + ((config->legacy_index & 1) ? 8 : 0);
+
+            err = pci_write_config_half(&loc, PCI_CONFIG_COMMAND,
+                                        pci_config.command | PCI_COMMAND_IO_EN | PCI_COMMAND_BUS_MASTER_EN);
+            if (err != _PCI_SUCCESSFUL) {
+                LTRACEF("Failed to enable bus mastering: 0x%02x\n", err);
+                state->bmide = 0;
+            }
+        }
     } else {
         // legacy isa
         DEBUG_ASSERT(config->legacy_index < 2);
@@ -279,8 +359,12 @@ static status_t ide_init(struct device *dev)
     }
 
     dev->state = state;
+    state->dev = dev;
 
     event_init(&state->completion, false, EVENT_FLAG_AUTOUNSIGNAL);
+    spin_lock_init(&state->lock);
+    list_initialize(&state->queue);
+    timer_initialize(&state->timeout);
 
     register_int_handler(state->irq, ide_irq_handler, dev);
     unmask_interrupt(state->irq);
@@ -291,6 +375,12 @@ static status_t ide_init(struct device *dev)
     /* detect drives */
     ide_detect_drives(dev);
 
+    /* fall back to pio if the dma buffers can't be set up */
+    if (state->bmide && ide_dma_init(dev) < 0)
+        state->bmide = 0;
+
+    ide_bdev_register(dev);
+
     return NO_ERROR;
 
 err:
@@ -304,6 +394,16 @@ static enum handler_return ide_irq_handler(void *arg)
     struct ide_driver_state *state = dev->state;
     uint8_t val;
 
+    if (state->bmide) {
+        /* the bus master latches every drive interrupt, dma or not */
+        uint8_t bm_status = inp(state->bmide + BM_REG_STATUS);
+        if (bm_status & BM_STATUS_IRQ)
+            outp(state->bmide + BM_REG_STATUS, bm_status);
+
+        if (state->active)
+            return ide_dma_irq(dev, bm_status);
+    }
+
     val = ide_read_reg8(dev, IDE_REG_STATUS);
 
     if ((val & IDE_DRV_ERR) == 0) {
@@ -338,7 +438,7 @@ static ssize_t ide_write(struct device *dev, off_t offset, const void *buf, size
     DEBUG_ASSERT(dev);
     DEBUG_ASSERT(dev->state);
 
-    __UNUSED struct ide_driver_state *state = dev->state;
+    struct ide_driver_state *state = dev->state;
 
     size_t sectors, do_sectors, i;
     const uint16_t *ubuf = buf;
@@ -346,6 +446,11 @@ static ssize_t ide_write(struct device *dev, off_t offset, const void *buf, size
     ssize_t ret = 0;
     int err;
 
+    if (state->bmide && state->drive[index].dma) {
+        ret = ide_dma_transfer(dev, offset, (void *)buf, count, true);
+        return (ret < 0) ? ret : (ssize_t)count;
+    }
+
     ide_device_select(dev, index);
     ide_delay_400ns(dev);
 
@@ -423,7 +528,7 @@ static ssize_t ide_read(struct device *dev, off_t offset, void *buf, size_t coun
     DEBUG_ASSERT(dev);
     DEBUG_ASSERT(dev->state);
 
-    __UNUSED struct ide_driver_state *state = dev->state;
+    struct ide_driver_state *state = dev->state;
 
     size_t sectors, do_sectors, i;
     uint16_t *ubuf = buf;
@@ -431,6 +536,11 @@ static ssize_t ide_read(struct device *dev, off_t offset, void *buf, size_t coun
     ssize_t ret = 0;
     int err;
 
+    if (state->bmide && state->drive[index].dma) {
+        ret = ide_dma_transfer(dev, offset, buf, count, false);
+        return (ret < 0) ? ret : (ssize_t)count;
+    }
+
     ide_device_select(dev, index);
     ide_delay_400ns(dev);
 
@@ -909,6 +1019,9 @@ static status_t ide_detect_ata(struct device *dev, int index)
 
     ide_read_reg16_array(dev, IDE_REG_DATA, info, 256);
 
+    // capabilities, dma supported
+    state->drive[index].dma = !!(info[49] & (1 << 8));
+
     uint32_t lba28_sectors = *((uint32_t *) (&info[60]));
     if (lba28_sectors > 0) {
         state->drive[index].sectors = lba28_sectors;
@@ -950,3 +1063,404 @@ static void ide_lba_setup(struct device *dev, uint32_t addr, int drive)
     ide_write_reg8(dev, IDE_REG_PRECOMP, 0xff);
 }
 
+
+/*
+ * Bus master dma.
+ *
+ * Transfers are driven from the channel's interrupt. Requests queue up on the
+ * channel and the active one is carried out in commands of up to 256 sectors,
+ * each described to the controller by the prd table. The interrupt that ends
+ * one command starts the next one, so a request runs to completion without a
+ * thread stepping it along. Pieces of a scatter list the controller can't
+ * reach, buffers that aren't word aligned or sit above 4GB, go through a
+ * bounce buffer instead.
+ */
+#define IDE_SECTOR_SIZE 512
+
+static enum handler_return ide_dma_timeout(struct timer *t, lk_time_t now, void *arg);
+
+static inline size_t ide_prd_len(const struct ide_prd *prd)
+{
+    return prd->count ? prd->count : 0x10000;
+}
+
+static status_t ide_dma_init(struct device *dev)
+{
+    struct ide_driver_state *state = dev->state;
+    void *ptr;
+    status_t err;
+
+    // a 64k aligned bounce buffer takes a single region, followed by the prd table
+    err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "ide_dma", IDE_DMA_BOUNCE_SIZE + PAGE_SIZE,
+                               &ptr, 16, 0, ARCH_MMU_FLAG_CACHED);
+    if (err < 0) {
+        LTRACEF("Failed to allocate dma buffers: %d\n", err);
+        return err;
+    }
+
+    state->bounce = ptr;
+    state->bounce_pa = vaddr_to_paddr(ptr);
+    state->prdt = (struct ide_prd *)(state->bounce + IDE_DMA_BOUNCE_SIZE);
+    state->prdt_pa = state->bounce_pa + IDE_DMA_BOUNCE_SIZE;
+
+    if ((uint64_t)state->prdt_pa + PAGE_SIZE > 0x100000000ULL) {
+        LTRACEF("dma buffers out of reach at 0x%llx\n", (uint64_t)state->bounce_pa);
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ptr);
+        return ERR_NOT_SUPPORTED;
+    }
+
+    outp(state->bmide + BM_REG_COMMAND, 0);
+    outpd(state->bmide + BM_REG_PRDT, state->prdt_pa);
+    outp(state->bmide + BM_REG_STATUS, inp(state->bmide + BM_REG_STATUS) | BM_STATUS_IRQ | BM_STATUS_ERR);
+
+    dprintf(INFO, "ide: bus master dma at 0x%hx\n", state->bmide);
+
+    return NO_ERROR;
+}
+
+/* move a scatter list position forward by len bytes, copying between the
+ * list and buf on the way if buf is set */
+static void ide_iov_walk(const bio_request_t *req, uint *iov, size_t *off, uint8_t *buf, size_t len, bool to_iov)
+{
+    while (len > 0) {
+        DEBUG_ASSERT(*iov < req->iov_cnt);
+
+        uint8_t *base = (uint8_t *)req->iov[*iov].iov_base + *off;
+        size_t chunk = MIN(len, req->iov[*iov].iov_len - *off);
+
+        if (buf) {
+            if (to_iov)
+                memcpy(base, buf, chunk);
+            else
+                memcpy(buf, base, chunk);
+            buf += chunk;
+        }
+
+        len -= chunk;
+        *off += chunk;
+        if (*off == req->iov[*iov].iov_len) {
+            (*iov)++;
+            *off = 0;
+        }
+    }
+}
+
+/* describe as much of the rest of the active request as fits in one command
+ * straight from its scatter list. returns the bytes covered, always whole
+ * sectors, or 0 if the next sector can't be reached by the controller. */
+static size_t ide_dma_map_direct(struct ide_driver_state *state, size_t max)
+{
+    const bio_request_t *req = state->active;
+    uint iov = state->xfer.iov;
+    size_t off = state->xfer.iov_off;
+    size_t total = 0;
+    uint n = 0;
+
+    while (total < max && iov < req->iov_cnt) {
+        uint8_t *va = (uint8_t *)req->iov[iov].iov_base + off;
+        size_t len = MIN(req->iov[iov].iov_len - off, max - total);
+        len = MIN(len, PAGE_SIZE - ((uintptr_t)va & (PAGE_SIZE - 1)));
+
+        if (len == 0) {
+            iov++;
+            off = 0;
+            continue;
+        }
+
+        paddr_t pa = vaddr_to_paddr(va);
+        if (pa == 0 || (pa & 1) || (uint64_t)pa + len > 0x100000000ULL)
+            break;
+
+        // grow the last region if this piece follows it without crossing 64k
+        struct ide_prd *prev = n ? &state->prdt[n - 1] : NULL;
+        if (prev && prev->addr + ide_prd_len(prev) == pa &&
+                ((prev->addr ^ (pa + len - 1)) & ~0xffffu) == 0) {
+            prev->count = (uint16_t)(ide_prd_len(prev) + len);
+        } else {
+            if (n == IDE_PRD_COUNT)
+                break;
+
+            state->prdt[n].addr = pa;
+            state->prdt[n].count = (uint16_t)len;
+            state->prdt[n].flags = 0;
+            n++;
+        }
+
+        total += len;
+        off += len;
+        if (off == req->iov[iov].iov_len) {
+            iov++;
+            off = 0;
+        }
+    }
+
+    // the command moves whole sectors, give back a partial one at the end
+    size_t excess = total % IDE_SECTOR_SIZE;
+    total -= excess;
+    while (excess > 0) {
+        struct ide_prd *last = &state->prdt[n - 1];
+        size_t len = ide_prd_len(last);
+
+        if (len > excess) {
+            last->count = (uint16_t)(len - excess);
+            break;
+        }
+
+        excess -= len;
+        n--;
+    }
+
+    if (total == 0)
+        return 0;
+
+    state->prdt[n - 1].flags = PRD_FLAG_EOT;
+
+    return total;
+}
+
+/* program and start the next command of the active request. state->lock must be held. */
+static status_t ide_dma_start_locked(struct device *dev)
+{
+    struct ide_driver_state *state = dev->state;
+    bio_request_t *req = state->active;
+    int index = 0; // hard code drive for now
+    size_t len;
+
+    size_t max = (size_t)MIN(state->xfer.remaining, IDE_DMA_MAX_SECTORS) * IDE_SECTOR_SIZE;
+
+    state->xfer.chunk_iov = state->xfer.iov;
+    state->xfer.chunk_iov_off = state->xfer.iov_off;
+
+    len = ide_dma_map_direct(state, max);
+    state->xfer.bounced = (len == 0);
+    if (state->xfer.bounced) {
+        len = MIN(max, IDE_DMA_BOUNCE_SIZE);
+        state->prdt[0].addr = state->bounce_pa;
+        state->prdt[0].count = (uint16_t)len;
+        state->prdt[0].flags = PRD_FLAG_EOT;
+    }
+
+    // consume the scatter list, filling the bounce buffer if writing through it
+    ide_iov_walk(req, &state->xfer.iov, &state->xfer.iov_off,
+                 (state->xfer.bounced && req->write) ? state->bounce : NULL, len, false);
+    state->xfer.count = len / IDE_SECTOR_SIZE;
+
+    ide_device_select(dev, index);
+    ide_delay_400ns(dev);
+
+    // the drive is idle between commands, don't wait around for it in here
+    if (ide_read_reg8(dev, IDE_REG_ALT_STATUS) & (IDE_CTRL_BSY | IDE_DRV_DRQ)) {
+        LTRACEF("drive busy, can't start dma\n");
+        return ERR_BUSY;
+    }
+
+    uint8_t cmd = req->write ? 0 : BM_CMD_READ;
+
+    outp(state->bmide + BM_REG_COMMAND, cmd);
+    outpd(state->bmide + BM_REG_PRDT, state->prdt_pa);
+    outp(state->bmide + BM_REG_STATUS, inp(state->bmide + BM_REG_STATUS) | BM_STATUS_IRQ | BM_STATUS_ERR);
+
+    ide_lba_setup(dev, state->xfer.block, index);
+    ide_write_reg8(dev, IDE_REG_SECTOR_COUNT, state->xfer.count & 0xff); // 256 is sent as 0
+    ide_write_reg8(dev, IDE_REG_COMMAND, req->write ? ATA_WRITE_DMA : ATA_READ_DMA);
+
+    outp(state->bmide + BM_REG_COMMAND, cmd | BM_CMD_START);
+
+    state->xfer.deadline = current_time() + IDE_DMA_TIMEOUT;
+    timer_set_oneshot(&state->timeout, IDE_DMA_TIMEOUT, ide_dma_timeout, dev);
+
+    return NO_ERROR;
+}
+
+/* get the channel going on the active request, or the next queued one if it
+ * is idle. requests that fail to start are moved to done. state->lock must be held. */
+static void ide_dma_kick_locked(struct device *dev, struct list_node *done)
+{
+    struct ide_driver_state *state = dev->state;
+
+    for (;;) {
+        if (!state->active) {
+            bio_request_t *req = list_remove_head_type(&state->queue, bio_request_t, node);
+            if (!req)
+                return;
+
+            state->active = req;
+            state->xfer.iov = 0;
+            state->xfer.iov_off = 0;
+            state->xfer.block = req->block;
+            state->xfer.remaining = req->count;
+        }
+
+        status_t err = ide_dma_start_locked(dev);
+        if (err == NO_ERROR)
+            return;
+
+        state->active->result = err;
+        list_add_tail(done, &state->active->node);
+        state->active = NULL;
+    }
+}
+
+/* wrap up the running command and start the next one. finished requests are
+ * moved to done, to be completed once state->lock is dropped. state->lock must be held. */
+static void ide_dma_finish_locked(struct device *dev, status_t err, struct list_node *done)
+{
+    struct ide_driver_state *state = dev->state;
+    bio_request_t *req = state->active;
+
+    timer_cancel(&state->timeout);
+    outp(state->bmide + BM_REG_COMMAND, 0);
+
+    if (err == NO_ERROR) {
+        if (state->xfer.bounced && !req->write)
+            ide_iov_walk(req, &state->xfer.chunk_iov, &state->xfer.chunk_iov_off, state->bounce,
+                         state->xfer.count * IDE_SECTOR_SIZE, true);
+
+        state->xfer.block += state->xfer.count;
+        state->xfer.remaining -= state->xfer.count;
+    }
+
+    if (err < 0 || state->xfer.remaining == 0) {
+        req->result = (err < 0) ? err : (ssize_t)req->count * IDE_SECTOR_SIZE;
+        list_add_tail(done, &req->node);
+        state->active = NULL;
+    }
+
+    ide_dma_kick_locked(dev, done);
+}
+
+static enum handler_return ide_dma_complete(struct list_node *done)
+{
+    enum handler_return ret = INT_NO_RESCHEDULE;
+    bio_request_t *req;
+
+    while ((req = list_remove_head_type(done, bio_request_t, node))) {
+        bio_request_complete(req, req->result);
+        ret = INT_RESCHEDULE;
+    }
+
+    return ret;
+}
+
+static enum handler_return ide_dma_irq(struct device *dev, uint8_t bm_status)
+{
+    struct ide_driver_state *state = dev->state;
+    struct list_node done = LIST_INITIAL_VALUE(done);
+
+    // reading the status register acks the drive
+    uint8_t status = ide_read_reg8(dev, IDE_REG_STATUS);
+
+    spin_lock(&state->lock);
+    if (state->active && (bm_status & BM_STATUS_IRQ)) {
+        status_t err = NO_ERROR;
+
+        if ((status & (IDE_DRV_ERR | IDE_DRV_WRTFLT)) || (bm_status & BM_STATUS_ERR)) {
+            LTRACEF("dma error, status 0x%hhx bm status 0x%hhx\n", status, bm_status);
+            err = ERR_IO;
+        }
+
+        ide_dma_finish_locked(dev, err, &done);
+    }
+    spin_unlock(&state->lock);
+
+    return ide_dma_complete(&done);
+}
+
+static enum handler_return ide_dma_timeout(struct timer *t, lk_time_t now, void *arg)
+{
+    struct device *dev = arg;
+    struct ide_driver_state *state = dev->state;
+    struct list_node done = LIST_INITIAL_VALUE(done);
+
+    spin_lock(&state->lock);
+    // the command may have finished, and another started, on the way here
+    if (state->active && TIME_GTE(now, state->xfer.deadline)) {
+        dprintf(INFO, "ide: dma timed out at block %u\n", state->xfer.block);
+        ide_dma_finish_locked(dev, ERR_TIMED_OUT, &done);
+    }
+    spin_unlock(&state->lock);
+
+    return ide_dma_complete(&done);
+}
+
+static void ide_dma_queue(struct device *dev, bio_request_t *req)
+{
+    struct ide_driver_state *state = dev->state;
+    struct list_node done = LIST_INITIAL_VALUE(done);
+    spin_lock_saved_state_t lock_state;
+
+    spin_lock_irqsave(&state->lock, lock_state);
+    list_add_tail(&state->queue, &req->node);
+    if (!state->active)
+        ide_dma_kick_locked(dev, &done);
+    spin_unlock_irqrestore(&state->lock, lock_state);
+
+    ide_dma_complete(&done);
+}
+
+static ssize_t ide_dma_transfer(struct device *dev, bnum_t block, void *buf, uint count, bool write)
+{
+    iovec_t iov = { buf, (size_t)count * IDE_SECTOR_SIZE };
+    bio_request_t req = {
+        .write = write,
+        .block = block,
+        .count = count,
+        .iov = &iov,
+        .iov_cnt = 1,
+    };
+
+    if (count == 0)
+        return 0;
+
+    event_init(&req.done, false, 0);
+    ide_dma_queue(dev, &req);
+
+    return bio_request_wait(&req);
+}
+
+static ssize_t ide_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
+{
+    struct ide_driver_state *state = containerof(bdev, struct ide_driver_state, bdev);
+
+    ssize_t ret = ide_read(state->dev, block, buf, count);
+    return (ret < 0) ? ret : ret * (ssize_t)bdev->block_size;
+}
+
+static ssize_t ide_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count)
+{
+    struct ide_driver_state *state = containerof(bdev, struct ide_driver_state, bdev);
+
+    ssize_t ret = ide_write(state->dev, block, buf, count);
+    return (ret < 0) ? ret : ret * (ssize_t)bdev->block_size;
+}
+
+static status_t ide_bdev_submit(struct bdev *bdev, bio_request_t *req)
+{
+    struct ide_driver_state *state = containerof(bdev, struct ide_driver_state, bdev);
+
+    LTRACEF("dev %p, req %p, block 0x%x, count %u\n", bdev, req, req->block, req->count);
+
+    ide_dma_queue(state->dev, req);
+
+    return NO_ERROR;
+}
+
+/* publish the disk to bio, with a submit hook if the channel can do dma */
+static void ide_bdev_register(struct device *dev)
+{
+    struct ide_driver_state *state = dev->state;
+    int index = 0; // hard code drive for now
+
+    if (state->type[index] != TYPE_IDEDISK || state->drive[index].sectors <= 0)
+        return;
+
+    bio_initialize_bdev(&state->bdev, dev->name, state->drive[index].sector_size,
+                        state->drive[index].sectors, 0, NULL, BIO_FLAGS_NONE);
+
+    state->bdev.read_block = &ide_bdev_read_block;
+    state->bdev.write_block = &ide_bdev_write_block;
+    if (state->bmide && state->drive[index].dma)
+        state->bdev.submit = &ide_bdev_submit;
+
+    bio_register_device(&state->bdev);
+}
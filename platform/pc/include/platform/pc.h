@@ -30,7 +30,7 @@
 /* NOTE: keep arch/x86/crt0.S in sync with these definitions */
 
 /* interrupts */
-#define INT_VECTORS 0x31
+#define INT_VECTORS 0x40
 
 /* defined interrupts */
 #define INT_BASE            0x20
@@ -46,8 +46,7 @@
 #define INT_IDE0            0x2e
 #define INT_IDE1            0x2f
 
-/* APIC vectors */
-#define INT_APIC_TIMER      0x22
+/* 0x3b - 0x3f belong to the local apic, see arch/x86/apic.h */
 
 /* PIC remap bases */
 #define PIC1_BASE 0x20
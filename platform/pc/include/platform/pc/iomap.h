@@ -26,6 +26,8 @@
 /* i8253/i8254 programmable interval timer registers */
 #define I8253_CONTROL_REG   0x43
 #define I8253_DATA_REG      0x40
+#define I8253_CH2_DATA_REG  0x42
+#define I8253_CH2_GATE_REG  0x61    /* channel 2 gate and output, shared with the speaker */
 
 /* i8042 keyboard controller registers */
 #define I8042_COMMAND_REG   0x64
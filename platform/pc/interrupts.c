@@ -31,8 +31,14 @@
 #include <arch/ops.h>
 #include <arch/x86.h>
 #include <kernel/spinlock.h>
+#if WITH_LIB_IRQSTATS
+#include <lib/irqstats.h>
+#endif
 #include "platform_p.h"
 #include <platform/pc.h>
+#if WITH_SMP
+#include <arch/x86/apic.h>
+#endif
 
 static spin_lock_t lock;
 
@@ -150,6 +156,10 @@ void issueEOI(unsigned int vector)
     } else if (vector >= PIC2_BASE && vector <= PIC2_BASE + 7) {
         outp(PIC2, 0x20);
         outp(PIC1, 0x20);   // must issue both for the second PIC
+#if WITH_SMP
+    } else if (vector >= X86_INT_LAPIC_BASE && vector != X86_INT_LAPIC_SPURIOUS) {
+        lapic_eoi();
+#endif
     }
 }
 
@@ -216,8 +226,16 @@ enum handler_return platform_irq(x86_iframe_t *frame)
     // deliver the interrupt
     enum handler_return ret = INT_NO_RESCHEDULE;
 
+#if WITH_LIB_IRQSTATS
+    uint32_t start = arch_cycle_count();
+#endif
+    thread_wake_batch_begin();
     if (int_handler_table[vector].handler)
         ret = int_handler_table[vector].handler(int_handler_table[vector].arg);
+    ret |= thread_wake_batch_end();
+#if WITH_LIB_IRQSTATS
+    irqstats_record(vector, arch_cycle_count() - start);
+#endif
 
     // ack the interrupt
     issueEOI(vector);
@@ -0,0 +1,818 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * NVMe controller.
+ *
+ * Namespace 1 of every controller becomes a bio device. The controller gets an
+ * io submission and completion queue pair per cpu, as many as it will hand out,
+ * and requests are queued on the pair of the cpu submitting them so cpus don't
+ * contend for a queue. Requests are split into commands of up to
+ * NVME_PRP_COUNT + 1 pages, as many in flight as the queue is deep. There is no
+ * msi support on this platform, so all completion queues share the pci
+ * interrupt, which drains every queue and refills the freed slots.
+ */
+#include <reg.h>
+#include <debug.h>
+#include <trace.h>
+#include <assert.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arch/x86.h>
+#include <arch/ops.h>
+#include <sys/types.h>
+#include <platform/interrupts.h>
+#include <platform/pc.h>
+#include <platform.h>
+#include <dev/pci.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/vm.h>
+#include <lib/bio.h>
+#include <lk/init.h>
+
+#define LOCAL_TRACE 0
+
+#ifndef NVME_MAX_IO_QUEUES
+#define NVME_MAX_IO_QUEUES SMP_MAX_CPUS
+#endif
+#ifndef NVME_QUEUE_DEPTH
+#define NVME_QUEUE_DEPTH 32
+#endif
+// prp list entries per command, on top of the page in prp1
+#define NVME_PRP_COUNT 32
+#define NVME_ADMIN_DEPTH 8
+#define NVME_BOUNCE_SIZE (64 * 1024)
+#define NVME_ADMIN_TIMEOUT 2000
+
+// command ids in flight are tracked in a 32 bit mask
+STATIC_ASSERT(NVME_QUEUE_DEPTH >= 2 && NVME_QUEUE_DEPTH <= 33);
+
+// controller registers
+#define NVME_CAP        0x00
+#define NVME_VS         0x08
+#define NVME_INTMS      0x0c
+#define NVME_INTMC      0x10
+#define NVME_CC         0x14
+#define NVME_CSTS       0x1c
+#define NVME_AQA        0x24
+#define NVME_ASQ        0x28
+#define NVME_ACQ        0x30
+#define NVME_DOORBELL   0x1000
+
+#define NVME_CAP_MQES(cap)      ((uint32_t)((cap) & 0xffff) + 1)
+#define NVME_CAP_TO(cap)        ((uint32_t)(((cap) >> 24) & 0xff))
+#define NVME_CAP_DSTRD(cap)     ((uint32_t)(((cap) >> 32) & 0xf))
+#define NVME_CAP_MPSMIN(cap)    ((uint32_t)(((cap) >> 48) & 0xf))
+
+#define NVME_CC_EN              (1u << 0)
+#define NVME_CC_IOSQES(n)       ((n) << 16)
+#define NVME_CC_IOCQES(n)       ((n) << 20)
+
+#define NVME_CSTS_RDY           (1u << 0)
+#define NVME_CSTS_CFS           (1u << 1)
+
+// admin commands
+#define NVME_ADMIN_CREATE_SQ    0x01
+#define NVME_ADMIN_CREATE_CQ    0x05
+#define NVME_ADMIN_IDENTIFY     0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+#define NVME_FEAT_NUM_QUEUES    0x07
+
+// nvm commands
+#define NVME_CMD_WRITE          0x01
+#define NVME_CMD_READ           0x02
+
+struct nvme_cmd {
+    uint32_t cdw0;      // opcode, command id in the top half
+    uint32_t nsid;
+    uint64_t reserved;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+};
+STATIC_ASSERT(sizeof(struct nvme_cmd) == 64);
+
+struct nvme_cpl {
+    uint32_t result;
+    uint32_t reserved;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;    // phase tag in bit 0
+};
+STATIC_ASSERT(sizeof(struct nvme_cpl) == 16);
+
+struct nvme_slot {
+    bio_request_t *req;
+    uint count;         // blocks moved by the command
+    bool bounced;
+    size_t offset;      // byte offset of the command into its request
+};
+
+struct nvme_queue {
+    struct nvme_controller *ctrl;
+    uint qid;
+    uint depth;
+
+    struct nvme_cmd *sq;
+    volatile struct nvme_cpl *cq;
+    paddr_t sq_pa;
+    paddr_t cq_pa;
+    uint sq_tail;
+    uint cq_head;
+    uint16_t phase;
+    uintptr_t sq_db;
+    uintptr_t cq_db;
+
+    uint64_t *prp_lists;
+    paddr_t prp_lists_pa;
+    uint8_t *bounce;
+    paddr_t bounce_pa;
+    bool bounce_busy;
+
+    spin_lock_t lock;
+    uint32_t busy;          // command ids in flight
+    struct list_node queue; // requests waiting for, or part way into, command ids
+    struct {
+        uint iov;           // where the head of the queue is issued up to
+        size_t iov_off;
+        size_t offset;
+        bnum_t block;
+        uint remaining;
+    } cur;
+    struct nvme_slot slot[NVME_QUEUE_DEPTH];
+};
+
+struct nvme_controller {
+    uintptr_t regs;
+    void *map;
+    int irq;
+    uint64_t cap;
+    uint dstrd;
+    size_t max_transfer;
+
+    struct nvme_queue *admin;
+    uint io_count;
+    struct nvme_queue *io[NVME_MAX_IO_QUEUES];
+
+    uint32_t nsid;
+    bdev_t bdev;
+};
+
+static inline uint32_t nvme_read(struct nvme_controller *ctrl, uint reg)
+{
+    return readl(ctrl->regs + reg);
+}
+
+static inline void nvme_write(struct nvme_controller *ctrl, uint reg, uint32_t val)
+{
+    writel(val, ctrl->regs + reg);
+}
+
+static inline void nvme_write64(struct nvme_controller *ctrl, uint reg, uint64_t val)
+{
+    writel((uint32_t)val, ctrl->regs + reg);
+    writel((uint32_t)(val >> 32), ctrl->regs + reg + 4);
+}
+
+static status_t nvme_wait_ready(struct nvme_controller *ctrl, bool ready)
+{
+    lk_time_t timeout = MAX(NVME_CAP_TO(ctrl->cap), 1u) * 500;
+    lk_time_t start = current_time();
+
+    while (!!(nvme_read(ctrl, NVME_CSTS) & NVME_CSTS_RDY) != ready) {
+        if (nvme_read(ctrl, NVME_CSTS) & NVME_CSTS_CFS)
+            return ERR_IO;
+        if (current_time() - start > timeout)
+            return ERR_TIMED_OUT;
+        thread_sleep(1);
+    }
+
+    return NO_ERROR;
+}
+
+/* allocate a queue pair with its prp lists and bounce buffer, which the admin
+ * queue does without except for a page to identify into */
+static struct nvme_queue *nvme_queue_alloc(struct nvme_controller *ctrl, uint qid, uint depth)
+{
+    struct nvme_queue *q = calloc(1, sizeof(struct nvme_queue));
+    if (!q)
+        return NULL;
+
+    size_t sq_size = ROUNDUP(depth * sizeof(struct nvme_cmd), PAGE_SIZE);
+    size_t cq_size = ROUNDUP(depth * sizeof(struct nvme_cpl), PAGE_SIZE);
+    size_t prp_size = qid ? ROUNDUP(depth * NVME_PRP_COUNT * sizeof(uint64_t), PAGE_SIZE) : 0;
+    size_t bounce_size = qid ? NVME_BOUNCE_SIZE : PAGE_SIZE;
+    void *mem;
+
+    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "nvme_queue",
+                                        sq_size + cq_size + prp_size + bounce_size, &mem,
+                                        PAGE_SIZE_SHIFT, VMM_FLAG_ZERO_FILL, ARCH_MMU_FLAG_CACHED);
+    if (err < 0) {
+        free(q);
+        return NULL;
+    }
+
+    paddr_t pa = vaddr_to_paddr(mem);
+    uint8_t *va = mem;
+
+    q->ctrl = ctrl;
+    q->qid = qid;
+    q->depth = depth;
+    q->sq = (struct nvme_cmd *)va;
+    q->sq_pa = pa;
+    q->cq = (volatile struct nvme_cpl *)(va + sq_size);
+    q->cq_pa = pa + sq_size;
+    q->prp_lists = (uint64_t *)(va + sq_size + cq_size);
+    q->prp_lists_pa = pa + sq_size + cq_size;
+    q->bounce = va + sq_size + cq_size + prp_size;
+    q->bounce_pa = pa + sq_size + cq_size + prp_size;
+    q->phase = 1;
+    q->sq_db = ctrl->regs + NVME_DOORBELL + (2 * qid) * (4u << ctrl->dstrd);
+    q->cq_db = ctrl->regs + NVME_DOORBELL + (2 * qid + 1) * (4u << ctrl->dstrd);
+
+    spin_lock_init(&q->lock);
+    list_initialize(&q->queue);
+
+    return q;
+}
+
+/* run an admin command to completion by polling, only used while setting up */
+static status_t nvme_admin_cmd(struct nvme_controller *ctrl, struct nvme_cmd *cmd, uint32_t *result)
+{
+    struct nvme_queue *q = ctrl->admin;
+
+    cmd->cdw0 |= (uint32_t)q->sq_tail << 16;
+    q->sq[q->sq_tail] = *cmd;
+    q->sq_tail = (q->sq_tail + 1) % q->depth;
+    CF;
+    writel(q->sq_tail, q->sq_db);
+
+    lk_time_t start = current_time();
+    volatile struct nvme_cpl *cpl = &q->cq[q->cq_head];
+    while ((cpl->status & 1) != q->phase) {
+        if (current_time() - start > NVME_ADMIN_TIMEOUT)
+            return ERR_TIMED_OUT;
+        thread_sleep(1);
+    }
+
+    uint16_t status = cpl->status >> 1;
+    if (result)
+        *result = cpl->result;
+
+    if (++q->cq_head == q->depth) {
+        q->cq_head = 0;
+        q->phase ^= 1;
+    }
+    writel(q->cq_head, q->cq_db);
+
+    if (status) {
+        LTRACEF("admin opcode 0x%x failed, status 0x%x\n", cmd->cdw0 & 0xff, status);
+        return ERR_IO;
+    }
+
+    return NO_ERROR;
+}
+
+static status_t nvme_identify(struct nvme_controller *ctrl, uint32_t nsid, uint32_t cns)
+{
+    struct nvme_cmd cmd = {
+        .cdw0 = NVME_ADMIN_IDENTIFY,
+        .nsid = nsid,
+        .prp1 = ctrl->admin->bounce_pa,
+        .cdw10 = cns,
+    };
+
+    return nvme_admin_cmd(ctrl, &cmd, NULL);
+}
+
+static status_t nvme_create_io_queue(struct nvme_controller *ctrl, struct nvme_queue *q)
+{
+    struct nvme_cmd cmd = {
+        .cdw0 = NVME_ADMIN_CREATE_CQ,
+        .prp1 = q->cq_pa,
+        .cdw10 = ((q->depth - 1) << 16) | q->qid,
+        .cdw11 = (1 << 1) | (1 << 0), // interrupts on vector 0, physically contiguous
+    };
+    status_t err = nvme_admin_cmd(ctrl, &cmd, NULL);
+    if (err < 0)
+        return err;
+
+    cmd = (struct nvme_cmd) {
+        .cdw0 = NVME_ADMIN_CREATE_SQ,
+        .prp1 = q->sq_pa,
+        .cdw10 = ((q->depth - 1) << 16) | q->qid,
+        .cdw11 = (q->qid << 16) | (1 << 0), // its completion queue, physically contiguous
+    };
+
+    return nvme_admin_cmd(ctrl, &cmd, NULL);
+}
+
+/* copy between a request's scatter list, starting offset bytes in, and buf */
+static void nvme_copy_iov(const bio_request_t *req, size_t offset, uint8_t *buf, size_t len, bool to_iov)
+{
+    for (uint i = 0; i < req->iov_cnt && len > 0; i++) {
+        if (offset >= req->iov[i].iov_len) {
+            offset -= req->iov[i].iov_len;
+            continue;
+        }
+
+        uint8_t *base = (uint8_t *)req->iov[i].iov_base + offset;
+        size_t chunk = MIN(len, req->iov[i].iov_len - offset);
+
+        if (to_iov)
+            memcpy(base, buf, chunk);
+        else
+            memcpy(buf, base, chunk);
+
+        buf += chunk;
+        len -= chunk;
+        offset = 0;
+    }
+}
+
+/* describe as much of the head request from its current position as one
+ * command's prps can. after the first, every page must start on a page
+ * boundary and all but the last must end on one. returns the bytes covered,
+ * whole blocks, or 0 if the next block can't be described. */
+static size_t nvme_map_direct(struct nvme_queue *q, uint64_t *list, size_t max, uint64_t *prp1)
+{
+    const bio_request_t *req = list_peek_head_type(&q->queue, bio_request_t, node);
+    size_t block_size = q->ctrl->bdev.block_size;
+    uint iov = q->cur.iov;
+    size_t off = q->cur.iov_off;
+    size_t total = 0;
+    bool page_end = false;
+    uint n = 0;
+
+    while (total < max && iov < req->iov_cnt) {
+        const uint8_t *va = (const uint8_t *)req->iov[iov].iov_base + off;
+        size_t len = MIN(req->iov[iov].iov_len - off, max - total);
+        len = MIN(len, PAGE_SIZE - ((uintptr_t)va & (PAGE_SIZE - 1)));
+
+        if (len == 0) {
+            iov++;
+            off = 0;
+            continue;
+        }
+
+        paddr_t pa = vaddr_to_paddr((void *)va);
+        if (pa == 0 || (pa & 3))
+            break;
+
+        if (n == 0) {
+            *prp1 = pa;
+        } else {
+            if (!page_end || (pa & (PAGE_SIZE - 1)) || n > NVME_PRP_COUNT)
+                break;
+            list[n - 1] = pa;
+        }
+        n++;
+
+        page_end = ((pa + len) & (PAGE_SIZE - 1)) == 0;
+        total += len;
+        off += len;
+        if (off == req->iov[iov].iov_len) {
+            iov++;
+            off = 0;
+        }
+    }
+
+    // give back a partial block at the end. prps carry no lengths, the
+    // command's block count says how much of the last page is used.
+    return total - total % block_size;
+}
+
+/* issue commands for queued requests until the queue or the command ids run
+ * out. q->lock must be held. */
+static void nvme_dispatch_locked(struct nvme_queue *q)
+{
+    struct nvme_controller *ctrl = q->ctrl;
+    size_t block_size = ctrl->bdev.block_size;
+    uint slots = q->depth - 1; // a full ring can't be told from an empty one
+
+    for (;;) {
+        bio_request_t *req = list_peek_head_type(&q->queue, bio_request_t, node);
+        if (!req)
+            return;
+
+        uint32_t busy = q->busy | ~(uint32_t)((1ull << slots) - 1);
+        if (busy == 0xffffffff)
+            return;
+        uint cid = __builtin_ctz(~busy);
+
+        // the request is at the head of the queue for the first time
+        if (req->pending == 0) {
+            q->cur.iov = 0;
+            q->cur.iov_off = 0;
+            q->cur.offset = 0;
+            q->cur.block = req->block;
+            q->cur.remaining = req->count;
+            req->result = (ssize_t)req->count * block_size;
+            req->pending = 1;
+        }
+
+        uint64_t *list = &q->prp_lists[cid * NVME_PRP_COUNT];
+        paddr_t list_pa = q->prp_lists_pa + cid * NVME_PRP_COUNT * sizeof(uint64_t);
+        size_t max = MIN((size_t)MIN(q->cur.remaining, 0x10000) * block_size, ctrl->max_transfer);
+        uint64_t prp1 = 0;
+        bool bounced = false;
+
+        size_t len = nvme_map_direct(q, list, max, &prp1);
+        if (len == 0) {
+            if (q->bounce_busy)
+                return;
+
+            len = MIN(max, NVME_BOUNCE_SIZE);
+            prp1 = q->bounce_pa;
+            for (uint i = 1; i * PAGE_SIZE < len; i++)
+                list[i - 1] = q->bounce_pa + i * PAGE_SIZE;
+            bounced = true;
+            q->bounce_busy = true;
+            if (req->write)
+                nvme_copy_iov(req, q->cur.offset, q->bounce, len, false);
+        }
+
+        uint count = len / block_size;
+        uint pages = ROUNDUP((prp1 & (PAGE_SIZE - 1)) + len, PAGE_SIZE) / PAGE_SIZE;
+
+        struct nvme_slot *s = &q->slot[cid];
+        s->req = req;
+        s->count = count;
+        s->bounced = bounced;
+        s->offset = q->cur.offset;
+        req->pending++;
+
+        struct nvme_cmd *cmd = &q->sq[q->sq_tail];
+        memset(cmd, 0, sizeof(*cmd));
+        cmd->cdw0 = (req->write ? NVME_CMD_WRITE : NVME_CMD_READ) | (cid << 16);
+        cmd->nsid = ctrl->nsid;
+        cmd->prp1 = prp1;
+        cmd->prp2 = (pages == 1) ? 0 : (pages == 2) ? list[0] : list_pa;
+        cmd->cdw10 = (uint32_t)q->cur.block;
+        cmd->cdw11 = (uint32_t)((uint64_t)q->cur.block >> 32);
+        cmd->cdw12 = count - 1;
+
+        LTRACEF("queue %u cid %u: %s block %u count %u pages %u%s\n", q->qid, cid,
+                req->write ? "write" : "read", q->cur.block, count, pages, bounced ? " bounced" : "");
+
+        q->busy |= 1u << cid;
+        q->sq_tail = (q->sq_tail + 1) % q->depth;
+        CF;
+        writel(q->sq_tail, q->sq_db);
+
+        // step past the command, and off the queue once the request is all issued
+        q->cur.offset += len;
+        q->cur.block += count;
+        q->cur.remaining -= count;
+        if (q->cur.remaining == 0) {
+            list_delete(&req->node);
+            req->pending--; // the queue's hold
+        } else {
+            size_t skip = len;
+            while (skip > 0) {
+                size_t chunk = MIN(skip, req->iov[q->cur.iov].iov_len - q->cur.iov_off);
+                skip -= chunk;
+                q->cur.iov_off += chunk;
+                if (q->cur.iov_off == req->iov[q->cur.iov].iov_len) {
+                    q->cur.iov++;
+                    q->cur.iov_off = 0;
+                }
+            }
+        }
+    }
+}
+
+/* retire a finished command. requests that are done move to the done list.
+ * q->lock must be held. */
+static void nvme_retire_locked(struct nvme_queue *q, uint cid, status_t err, struct list_node *done)
+{
+    struct nvme_slot *s = &q->slot[cid];
+    bio_request_t *req = s->req;
+
+    q->busy &= ~(1u << cid);
+    s->req = NULL;
+
+    if (s->bounced) {
+        if (err == NO_ERROR && !req->write)
+            nvme_copy_iov(req, s->offset, q->bounce, (size_t)s->count * q->ctrl->bdev.block_size, true);
+        q->bounce_busy = false;
+    }
+
+    if (err < 0)
+        req->result = err;
+
+    if (--req->pending == 0)
+        list_add_tail(done, &req->node);
+}
+
+/* harvest the completion queue. q->lock must be held. */
+static void nvme_reap_locked(struct nvme_queue *q, struct list_node *done)
+{
+    bool reaped = false;
+
+    for (;;) {
+        volatile struct nvme_cpl *cpl = &q->cq[q->cq_head];
+        uint16_t status = cpl->status;
+        if ((status & 1) != q->phase)
+            break;
+
+        uint cid = cpl->cid;
+        if (cid < q->depth - 1 && q->slot[cid].req) {
+            if (status >> 1)
+                LTRACEF("queue %u cid %u failed, status 0x%x\n", q->qid, cid, status >> 1);
+            nvme_retire_locked(q, cid, (status >> 1) ? ERR_IO : NO_ERROR, done);
+        }
+
+        if (++q->cq_head == q->depth) {
+            q->cq_head = 0;
+            q->phase ^= 1;
+        }
+        reaped = true;
+    }
+
+    if (reaped)
+        writel(q->cq_head, q->cq_db);
+}
+
+static enum handler_return nvme_irq(void *arg)
+{
+    struct nvme_controller *ctrl = arg;
+    struct list_node done = LIST_INITIAL_VALUE(done);
+    bio_request_t *req;
+
+    for (uint i = 0; i < ctrl->io_count; i++) {
+        struct nvme_queue *q = ctrl->io[i];
+
+        spin_lock(&q->lock);
+        nvme_reap_locked(q, &done);
+        nvme_dispatch_locked(q);
+        spin_unlock(&q->lock);
+    }
+
+    if (list_is_empty(&done))
+        return INT_NO_RESCHEDULE;
+
+    while ((req = list_remove_head_type(&done, bio_request_t, node)))
+        bio_request_complete(req, req->result);
+
+    return INT_RESCHEDULE;
+}
+
+static status_t nvme_bdev_submit(struct bdev *bdev, bio_request_t *req)
+{
+    struct nvme_controller *ctrl = containerof(bdev, struct nvme_controller, bdev);
+    spin_lock_saved_state_t state;
+
+    // queue on this cpu's pair. being migrated right after only costs locality.
+    struct nvme_queue *q = ctrl->io[arch_curr_cpu_num() % ctrl->io_count];
+
+    LTRACEF("queue %u, req %p, block 0x%x, count %u\n", q->qid, req, req->block, req->count);
+
+    req->pending = 0;
+
+    spin_lock_irqsave(&q->lock, state);
+    list_add_tail(&q->queue, &req->node);
+    nvme_dispatch_locked(q);
+    spin_unlock_irqrestore(&q->lock, state);
+
+    return NO_ERROR;
+}
+
+static ssize_t nvme_bdev_io(struct bdev *bdev, void *buf, bnum_t block, uint count, bool write)
+{
+    iovec_t iov = { buf, (size_t)count * bdev->block_size };
+    bio_request_t req = {
+        .write = write,
+        .block = block,
+        .count = count,
+        .iov = &iov,
+        .iov_cnt = 1,
+    };
+
+    if (count == 0)
+        return 0;
+
+    event_init(&req.done, false, 0);
+    nvme_bdev_submit(bdev, &req);
+
+    return bio_request_wait(&req);
+}
+
+static ssize_t nvme_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
+{
+    return nvme_bdev_io(bdev, buf, block, count, false);
+}
+
+static ssize_t nvme_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count)
+{
+    return nvme_bdev_io(bdev, (void *)buf, block, count, true);
+}
+
+static status_t nvme_map_regs(struct nvme_controller *ctrl, paddr_t pa, size_t size)
+{
+    if (ctrl->map)
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ctrl->map);
+    ctrl->map = NULL;
+
+    status_t err = vmm_alloc_physical(vmm_get_kernel_aspace(), "nvme_regs", ROUNDUP(size, PAGE_SIZE),
+                                      &ctrl->map, PAGE_SIZE_SHIFT, pa, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+    if (err < 0)
+        return err;
+
+    ctrl->regs = (uintptr_t)ctrl->map;
+
+    return NO_ERROR;
+}
+
+static status_t nvme_probe(pci_location_t *loc)
+{
+    static uint found_index = 0;
+    pci_config_t config;
+    status_t err;
+
+    for (uint i = 0; i < sizeof(config) / sizeof(uint32_t); i++) {
+        if (pci_read_config_word(loc, i * sizeof(uint32_t), (uint32_t *)&config + i) != _PCI_SUCCESSFUL)
+            return ERR_NOT_CONFIGURED;
+    }
+
+    // registers are in bar 0, usually 64 bit
+    uint64_t bar = config.base_addresses[0] & ~0xfu;
+    if ((config.base_addresses[0] & 0x6) == 0x4)
+        bar |= (uint64_t)config.base_addresses[1] << 32;
+    if ((config.base_addresses[0] & 1) || !bar || bar != (paddr_t)bar || config.interrupt_line >= 16)
+        return ERR_NOT_CONFIGURED;
+
+    pci_write_config_half(loc, PCI_CONFIG_COMMAND,
+                          config.command | PCI_COMMAND_MEM_EN | PCI_COMMAND_BUS_MASTER_EN);
+
+    struct nvme_controller *ctrl = calloc(1, sizeof(struct nvme_controller));
+    if (!ctrl)
+        return ERR_NO_MEMORY;
+
+    ctrl->irq = INT_BASE + config.interrupt_line;
+
+    // map enough to find the doorbell stride, then enough for every queue's doorbells
+    err = nvme_map_regs(ctrl, bar, PAGE_SIZE);
+    if (err < 0)
+        goto error;
+
+    ctrl->cap = *REG64(ctrl->regs + NVME_CAP);
+    ctrl->dstrd = NVME_CAP_DSTRD(ctrl->cap);
+    if ((PAGE_SIZE >> 12) < (1u << NVME_CAP_MPSMIN(ctrl->cap))) {
+        err = ERR_NOT_SUPPORTED;
+        goto error;
+    }
+
+    uint io_count = MIN(NVME_MAX_IO_QUEUES, SMP_MAX_CPUS);
+    err = nvme_map_regs(ctrl, bar, NVME_DOORBELL + 2 * (io_count + 1) * (4u << ctrl->dstrd));
+    if (err < 0)
+        goto error;
+
+    dprintf(INFO, "nvme: controller at %02x:%02x version 0x%x, irq %u\n",
+            loc->bus, loc->dev_fn, nvme_read(ctrl, NVME_VS), config.interrupt_line);
+
+    // stop it, and restart it with the admin queue
+    nvme_write(ctrl, NVME_CC, nvme_read(ctrl, NVME_CC) & ~NVME_CC_EN);
+    err = nvme_wait_ready(ctrl, false);
+    if (err < 0)
+        goto error;
+
+    ctrl->admin = nvme_queue_alloc(ctrl, 0, NVME_ADMIN_DEPTH);
+    if (!ctrl->admin) {
+        err = ERR_NO_MEMORY;
+        goto error;
+    }
+
+    nvme_write(ctrl, NVME_AQA, ((NVME_ADMIN_DEPTH - 1) << 16) | (NVME_ADMIN_DEPTH - 1));
+    nvme_write64(ctrl, NVME_ASQ, ctrl->admin->sq_pa);
+    nvme_write64(ctrl, NVME_ACQ, ctrl->admin->cq_pa);
+    nvme_write(ctrl, NVME_CC, NVME_CC_EN | NVME_CC_IOSQES(6) | NVME_CC_IOCQES(4));
+    err = nvme_wait_ready(ctrl, true);
+    if (err < 0) {
+        dprintf(INFO, "nvme: controller won't come ready\n");
+        goto error;
+    }
+
+    // largest transfer, in units of the minimum page size
+    err = nvme_identify(ctrl, 0, 1);
+    if (err < 0)
+        goto error;
+
+    uint8_t mdts = ctrl->admin->bounce[77];
+    ctrl->max_transfer = (NVME_PRP_COUNT + 1) * PAGE_SIZE;
+    if (mdts)
+        ctrl->max_transfer = MIN(ctrl->max_transfer, (size_t)4096 << mdts);
+
+    // namespace 1, without metadata
+    ctrl->nsid = 1;
+    err = nvme_identify(ctrl, ctrl->nsid, 0);
+    if (err < 0)
+        goto error;
+
+    const uint8_t *ns = ctrl->admin->bounce;
+    uint64_t blocks;
+    memcpy(&blocks, ns, sizeof(blocks));
+    const uint8_t *lbaf = ns + 128 + 4 * (ns[26] & 0xf);
+    size_t block_size = 1u << lbaf[2];
+    if (blocks == 0 || lbaf[0] || lbaf[1] || block_size < 512 || block_size > PAGE_SIZE) {
+        dprintf(INFO, "nvme: namespace %u unusable\n", ctrl->nsid);
+        err = ERR_NOT_SUPPORTED;
+        goto error;
+    }
+
+    // ask for a queue pair per cpu, and take what we're given
+    uint32_t result;
+    struct nvme_cmd cmd = {
+        .cdw0 = NVME_ADMIN_SET_FEATURES,
+        .cdw10 = NVME_FEAT_NUM_QUEUES,
+        .cdw11 = ((io_count - 1) << 16) | (io_count - 1),
+    };
+    err = nvme_admin_cmd(ctrl, &cmd, &result);
+    if (err < 0)
+        goto error;
+    io_count = MIN(io_count, (result & 0xffff) + 1);
+    io_count = MIN(io_count, (result >> 16) + 1);
+
+    uint depth = MIN(NVME_QUEUE_DEPTH, NVME_CAP_MQES(ctrl->cap));
+    for (uint i = 0; i < io_count; i++) {
+        struct nvme_queue *q = nvme_queue_alloc(ctrl, i + 1, depth);
+        if (!q)
+            break;
+
+        if (nvme_create_io_queue(ctrl, q) < 0) {
+            LTRACEF("failed to create io queue %u\n", i + 1);
+            break;
+        }
+        ctrl->io[ctrl->io_count++] = q;
+    }
+    if (ctrl->io_count == 0) {
+        err = ERR_NO_RESOURCES;
+        goto error;
+    }
+
+    char name[16];
+    snprintf(name, sizeof(name), "nvme%u", found_index++);
+    bio_initialize_bdev(&ctrl->bdev, name, block_size, MIN(blocks, (uint64_t)UINT32_MAX),
+                        0, NULL, BIO_FLAGS_NONE);
+
+    ctrl->bdev.read_block = &nvme_bdev_read_block;
+    ctrl->bdev.write_block = &nvme_bdev_write_block;
+    ctrl->bdev.submit = &nvme_bdev_submit;
+
+    register_int_handler(ctrl->irq, &nvme_irq, ctrl);
+    unmask_interrupt(ctrl->irq);
+
+    bio_register_device(&ctrl->bdev);
+
+    dprintf(INFO, "nvme: %s, %llu blocks of %zu bytes, %u io queues of %u\n",
+            name, blocks, block_size, ctrl->io_count, depth);
+
+    return NO_ERROR;
+
+error:
+    // the controller may still own some of its memory until it is disabled, leak it
+    if (ctrl->map)
+        nvme_write(ctrl, NVME_CC, nvme_read(ctrl, NVME_CC) & ~NVME_CC_EN);
+    return err;
+}
+
+static void nvme_init(uint level)
+{
+    pci_location_t loc;
+
+    for (uint16_t i = 0; pci_find_pci_class_code(&loc, 0x010802, i) == _PCI_SUCCESSFUL; i++)
+        nvme_probe(&loc);
+}
+
+LK_INIT_HOOK_DEFERRED(nvme, nvme_init, LK_INIT_LEVEL_PLATFORM);
@@ -40,6 +40,9 @@
 #include <string.h>
 #include <assert.h>
 #include <kernel/vm.h>
+#if WITH_DEV_VIRTIO
+#include <dev/virtio.h>
+#endif
 
 #define LOCAL_TRACE 0
 
@@ -256,4 +259,8 @@ void platform_init(void)
     pci_init();
 
     platform_init_mmu_mappings();
+
+#if WITH_DEV_VIRTIO
+    virtio_pci_detect();
+#endif
 }
@@ -19,10 +19,19 @@ MODULE_SRCS += \
     $(LOCAL_DIR)/keyboard.c \
     $(LOCAL_DIR)/pci.c \
     $(LOCAL_DIR)/ide.c \
+    $(LOCAL_DIR)/ahci.c \
+    $(LOCAL_DIR)/nvme.c \
     $(LOCAL_DIR)/uart.c \
 
 LK_HEAP_IMPLEMENTATION ?= dlmalloc
 
+# with more than one cpu the scheduler runs off the per cpu local apic timers, which are
+# programmed one shot
+ifeq ($(SUBARCH)$(WITH_SMP),x86-641)
+GLOBAL_DEFINES += \
+    PLATFORM_HAS_DYNAMIC_TIMER=1
+endif
+
 MODULE_DEPS += app/pcitests
 
 include make/module.mk
@@ -33,6 +33,9 @@
 #include <platform/pc.h>
 #include "platform_p.h"
 #include <arch/x86.h>
+#if WITH_SMP
+#include <arch/x86/apic.h>
+#endif
 
 static platform_timer_callback t_callback;
 static void *callback_arg;
@@ -54,6 +57,58 @@ static uint16_t divisor;
  *  interrupt, in milliseconds */
 #define MAX_TIMER_INTERVAL 55
 
+#if WITH_SMP
+/* with more than one cpu every cpu runs its own one shot timer off its local apic, and
+ * the pit stays periodic as the time base */
+static struct {
+    platform_timer_callback callback;
+    void *arg;
+} lapic_timers[SMP_MAX_CPUS];
+
+static uint32_t lapic_ticks_per_ms;
+
+#define LAPIC_CALIBRATE_MS 10
+
+static enum handler_return lapic_timer_tick(void *arg)
+{
+    uint cpu = arch_curr_cpu_num();
+
+    if (!lapic_timers[cpu].callback)
+        return INT_NO_RESCHEDULE;
+
+    return lapic_timers[cpu].callback(lapic_timers[cpu].arg, current_time());
+}
+
+/* count local apic timer ticks across a pit channel 2 one shot */
+static void lapic_timer_calibrate(void)
+{
+    if (!lapic_present())
+        return;
+
+    /* gate channel 2 on with the speaker off, mode 0, LSB followed by MSB */
+    uint8_t ctrl = inp(I8253_CH2_GATE_REG) & ~0x03;
+    outp(I8253_CH2_GATE_REG, ctrl | 0x01);
+    outp(I8253_CONTROL_REG, 0xb0);
+
+    uint16_t count = INTERNAL_FREQ * LAPIC_CALIBRATE_MS / 1000;
+    outp(I8253_CH2_DATA_REG, count & 0xff);
+    outp(I8253_CH2_DATA_REG, count >> 8);
+
+    lapic_timer_start(UINT32_MAX, false);
+    while (!(inp(I8253_CH2_GATE_REG) & 0x20))
+        ;
+    uint32_t elapsed = UINT32_MAX - lapic_timer_current_count();
+    lapic_timer_stop();
+
+    outp(I8253_CH2_GATE_REG, ctrl);
+
+    lapic_ticks_per_ms = elapsed / LAPIC_CALIBRATE_MS;
+    dprintf(INFO, "local apic timer %u ticks per ms\n", lapic_ticks_per_ms);
+
+    register_int_handler(X86_INT_LAPIC_TIMER, &lapic_timer_tick, NULL);
+}
+#endif
+
 
 
 status_t platform_set_periodic_timer(platform_timer_callback callback, void *arg, lk_time_t interval)
@@ -160,6 +215,10 @@ void platform_init_timer(void)
     set_pit_frequency(1000); // ~1ms granularity
     register_int_handler(INT_PIT, &os_timer_tick, NULL);
     unmask_interrupt(INT_PIT);
+
+#if WITH_SMP
+    lapic_timer_calibrate();
+#endif
 }
 
 void platform_halt_timers(void)
@@ -175,6 +234,23 @@ status_t platform_set_oneshot_timer(platform_timer_callback callback,
 
     uint32_t count;
 
+#if WITH_SMP
+    if (lapic_ticks_per_ms) {
+        uint cpu = arch_curr_cpu_num();
+        uint64_t ticks = (uint64_t)lapic_ticks_per_ms * interval;
+
+        spin_lock_saved_state_t state;
+        arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+        lapic_timers[cpu].callback = callback;
+        lapic_timers[cpu].arg = arg;
+        lapic_timer_start(MAX(MIN(ticks, UINT32_MAX), 1), false);
+
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+        return NO_ERROR;
+    }
+#endif
+
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&lock, state);
 
@@ -205,6 +281,13 @@ status_t platform_set_oneshot_timer(platform_timer_callback callback,
 
 void platform_stop_timer(void)
 {
+#if WITH_SMP
+    if (lapic_ticks_per_ms) {
+        lapic_timer_stop();
+        return;
+    }
+#endif
+
     /* Enable interrupt mode that will stop the decreasing counter of the PIT */
     outp(I8253_CONTROL_REG, 0x30);
     return;
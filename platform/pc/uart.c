@@ -82,7 +82,7 @@ static status_t uart_init(struct device *dev)
     dev->state = state;
 
     /* set up the driver state */
-    cbuf_initialize(&state->rx_buf, config->rx_buf_len);
+    cbuf_initialize_flags(&state->rx_buf, config->rx_buf_len, NULL, CBUF_FLAG_SPSC); // irq -> reader
     cbuf_initialize(&state->tx_buf, config->tx_buf_len);
 
     /* configure the uart */
@@ -28,6 +28,7 @@
 #include <kernel/thread.h>
 #include <stdio.h>
 #include <lib/console.h>
+#include <lib/io.h>
 
 /*
  * default implementations of these routines, if the platform code
@@ -36,6 +37,9 @@
 __WEAK void platform_halt(platform_halt_action suggested_action,
                           platform_halt_reason reason)
 {
+    /* anything still queued for the console goes out first */
+    console_output_panic();
+
 #if ENABLE_PANIC_SHELL
 
     if (reason == HALT_REASON_SW_PANIC) {
@@ -28,3 +28,7 @@
 #define GICD_OFFSET (0x00000)
 #define GICC_OFFSET (0x10000)
 
+/* with -machine virt,gic-version=3 */
+#define GITS_OFFSET (0x80000)
+#define GICR_OFFSET (0xa0000)
+
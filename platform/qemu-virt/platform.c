@@ -24,27 +24,43 @@
 #include <err.h>
 #include <debug.h>
 #include <trace.h>
+#include <string.h>
+#include <stdlib.h>
 #include <dev/interrupt/arm_gic.h>
 #include <dev/timer/arm_generic.h>
 #include <dev/uart.h>
 #include <dev/virtio.h>
 #include <dev/virtio/net.h>
 #include <lk/init.h>
+#include <lib/console.h>
+#include <kernel/mp.h>
 #include <kernel/vm.h>
 #include <kernel/spinlock.h>
 #include <platform.h>
 #include <platform/gic.h>
 #include <platform/interrupts.h>
 #include <platform/qemu-virt.h>
-#include <libfdt.h>
+#include <lib/devicetree.h>
 #include "platform_p.h"
 
 #if WITH_LIB_MINIP
 #include <lib/minip.h>
+#include <lib/io.h>
 #endif
 
 #define DEFAULT_MEMORY_SIZE (MEMSIZE) /* try to fetch from the emulator via the fdt */
 
+/* the device tree is indexed before the heap is up, so out of a static pool */
+#ifndef PLATFORM_DT_POOL_SIZE
+#define PLATFORM_DT_POOL_SIZE (32*1024)
+#endif
+
+static uint8_t dt_pool[PLATFORM_DT_POOL_SIZE] __ALIGNED(8);
+static devicetree_t dt = {
+    .pool = dt_pool,
+    .pool_size = sizeof(dt_pool),
+};
+
 /* initial memory mappings. parsed by start.S */
 struct mmu_initial_mapping mmu_initial_mappings[] = {
     /* all of memory */
@@ -76,7 +92,7 @@ static pmm_arena_t arena = {
     .flags = PMM_ARENA_FLAG_KMAP,
 };
 
-extern void psci_call(ulong arg0, ulong arg1, ulong arg2, ulong arg3);
+extern int psci_call(ulong arg0, ulong arg1, ulong arg2, ulong arg3);
 
 void platform_early_init(void)
 {
@@ -87,62 +103,64 @@ void platform_early_init(void)
 
     uart_init_early();
 
-    /* look for a flattened device tree just before the kernel */
-    const void *fdt = (void *)KERNEL_BASE;
-    int err = fdt_check_header(fdt);
-    if (err >= 0) {
-        /* walk the nodes, looking for 'memory' */
-        int depth = 0;
-        int offset = 0;
-        for (;;) {
-            offset = fdt_next_node(fdt, offset, &depth);
-            if (offset < 0)
-                break;
-
-            /* get the name */
-            const char *name = fdt_get_name(fdt, offset, NULL);
-            if (!name)
-                continue;
-
-            /* look for the 'memory' property */
-            if (strcmp(name, "memory") == 0) {
-                int lenp;
-                const void *prop_ptr = fdt_getprop(fdt, offset, "reg", &lenp);
-                if (prop_ptr && lenp == 0x10) {
-                    /* we're looking at a memory descriptor */
-                    //uint64_t base = fdt64_to_cpu(*(uint64_t *)prop_ptr);
-                    uint64_t len = fdt64_to_cpu(*((const uint64_t *)prop_ptr + 1));
-
-                    /* trim size on certain platforms */
+    /* look for a flattened device tree just before the kernel, in the first 64k of ram */
+    uint cpu_count = SMP_MAX_CPUS;
+    if (dt_init(&dt, (void *)KERNEL_BASE, KERNEL_LOAD_OFFSET) == 0) {
+        dt_node_t *node = dt_find_node(&dt, "/memory");
+        dt_prop_t *reg = node ? dt_find_prop(node, "reg") : NULL;
+        if (reg && reg->size == 0x10) {
+            /* we're looking at a memory descriptor, two cells each of base and length */
+            uint64_t len = ((uint64_t)dt_rd32((u8 *)reg->data + 8) << 32) | dt_rd32((u8 *)reg->data + 12);
+
+            /* trim size on certain platforms */
 #if ARCH_ARM
-                    if (len > 1024*1024*1024U) {
-                        len = 1024*1024*1024; /* only use the first 1GB on ARM32 */
-                        printf("trimming memory to 1GB\n");
-                    }
+            if (len > 1024*1024*1024U) {
+                len = 1024*1024*1024; /* only use the first 1GB on ARM32 */
+                printf("trimming memory to 1GB\n");
+            }
 #endif
 
-                    /* set the size in the pmm arena */
-                    arena.size = len;
-                }
+            /* set the size in the pmm arena */
+            arena.size = len;
+        }
+
+        /* don't bother asking psci for cpus the emulator doesn't have */
+        node = dt_find_node(&dt, "/cpus");
+        if (node) {
+            uint count = 0;
+            for (node = node->child; node; node = node->sibling) {
+                dt_prop_t *type = dt_find_prop(node, "device_type");
+                if (type && type->size == 4 && !memcmp(type->data, "cpu", 4))
+                    count++;
             }
+            if (count)
+                cpu_count = MIN(count, SMP_MAX_CPUS);
         }
     }
 
+    /* boot the secondary cpus using the Power State Coordintion Interface,
+     * early enough for them to park and take part in pmm_add_arena() */
+    ulong psci_call_num = 0x84000000 + 3; /* SMC32 CPU_ON */
+#if ARCH_ARM64
+    psci_call_num += 0x40000000; /* SMC64 */
+#endif
+    uint started = 0;
+    for (uint i = 1; i < cpu_count; i++) {
+        if (psci_call(psci_call_num, i, MEMBASE + KERNEL_LOAD_OFFSET, 0) == 0)
+            started++;
+    }
+
+#if ARCH_ARM64
+    /* have them help initialize the page array */
+    mp_early_wait_parked(started);
+#endif
+
     /* add the main memory arena */
     pmm_add_arena(&arena);
 
     /* reserve the first 64k of ram, which should be holding the fdt */
     struct list_node list = LIST_INITIAL_VALUE(list);
     pmm_alloc_range(MEMBASE, 0x10000 / PAGE_SIZE, &list);
-
-    /* boot the secondary cpus using the Power State Coordintion Interface */
-    ulong psci_call_num = 0x84000000 + 3; /* SMC32 CPU_ON */
-#if ARCH_ARM64
-    psci_call_num += 0x40000000; /* SMC64 */
-#endif
-    for (uint i = 1; i < SMP_MAX_CPUS; i++) {
-        psci_call(psci_call_num, i, MEMBASE + KERNEL_LOAD_OFFSET, 0);
-    }
 }
 
 void platform_init(void)
@@ -175,7 +193,38 @@ void platform_init(void)
         //minip_init(virtio_net_send_minip_pkt, NULL, ip_addr, ip_mask, ip_gateway);
         minip_init_dhcp(virtio_net_send_minip_pkt, NULL);
 
+        minip_set_tx_offloads(virtio_net_get_tx_offloads());
+        minip_set_tx_batch_handler(virtio_net_send_minip_pkts);
+
         virtio_net_start();
     }
 #endif
 }
+
+void platform_halt(platform_halt_action suggested_action,
+                   platform_halt_reason reason)
+{
+    /* anything still queued for the console goes out first */
+    console_output_panic();
+
+    /* PSCI SYSTEM_OFF and SYSTEM_RESET, qemu exits or restarts the machine */
+    if (suggested_action == HALT_ACTION_SHUTDOWN) {
+        dprintf(ALWAYS, "Shutting down... (reason = %d)\n", reason);
+        psci_call(0x84000000 + 8, 0, 0, 0);
+    } else if (suggested_action == HALT_ACTION_REBOOT) {
+        dprintf(ALWAYS, "Rebooting... (reason = %d)\n", reason);
+        psci_call(0x84000000 + 9, 0, 0, 0);
+    }
+
+#if ENABLE_PANIC_SHELL
+    if (reason == HALT_REASON_SW_PANIC) {
+        dprintf(ALWAYS, "CRASH: starting debug shell... (reason = %d)\n", reason);
+        arch_disable_ints();
+        panic_shell_start();
+    }
+#endif  // ENABLE_PANIC_SHELL
+
+    dprintf(ALWAYS, "HALT: spinning forever... (reason = %d)\n", reason);
+    arch_disable_ints();
+    for (;;);
+}
@@ -27,7 +27,7 @@ KERNEL_LOAD_OFFSET := 0x10000 # 64k
 
 MODULE_DEPS += \
     lib/cbuf \
-    lib/fdt \
+    lib/devicetree \
     dev/interrupt/arm_gic \
     dev/timer/arm_generic \
     dev/virtio/block \
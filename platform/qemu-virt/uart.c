@@ -25,6 +25,8 @@
 #include <trace.h>
 #include <lib/cbuf.h>
 #include <kernel/thread.h>
+#include <kernel/spinlock.h>
+#include <arch/ops.h>
 #include <platform/interrupts.h>
 #include <platform/debug.h>
 #include <platform/qemu-virt.h>
@@ -49,10 +51,19 @@
 #define UARTREG(base, reg)  (*REG32((base)  + (reg)))
 
 #define RXBUF_SIZE 16
+#ifndef TXBUF_SIZE
+#define TXBUF_SIZE 1024
+#endif
 #define NUM_UART 1
 
 static cbuf_t uart_rx_buf[NUM_UART];
 
+/* transmit goes through tx_buf, drained by the tx interrupt, once uart_init has run.
+ * the lock covers the tx fifo, tx_buf's consumer side and UART_IMSC */
+static cbuf_t uart_tx_buf[NUM_UART];
+static spin_lock_t uart_lock[NUM_UART];
+static bool uart_tx_irq[NUM_UART];
+
 static inline uintptr_t uart_to_ptr(unsigned int n)
 {
     switch (n) {
@@ -62,6 +73,43 @@ static inline uintptr_t uart_to_ptr(unsigned int n)
     }
 }
 
+/* move buffered tx data into the fifo, enabling the tx interrupt if some is left.
+ * uart lock must be held */
+static void uart_tx_fill_locked(uint port)
+{
+    uintptr_t base = uart_to_ptr(port);
+
+    while ((UARTREG(base, UART_TFR) & (1<<5)) == 0) { // !txff
+        char c;
+        if (cbuf_read_char(&uart_tx_buf[port], &c, false) != 1) {
+            UARTREG(base, UART_IMSC) &= ~(1<<5); // !txim
+            return;
+        }
+        UARTREG(base, UART_DR) = c;
+    }
+
+    UARTREG(base, UART_IMSC) |= (1<<5); // txim
+}
+
+/* write out everything buffered and then c, spinning on the fifo. uart lock must be
+ * held, if it can be */
+static void uart_tx_poll_locked(uint port, char c)
+{
+    uintptr_t base = uart_to_ptr(port);
+    char buffered;
+
+    while (uart_tx_irq[port] && cbuf_read_char(&uart_tx_buf[port], &buffered, false) == 1) {
+        while (UARTREG(base, UART_TFR) & (1<<5))
+            ;
+        UARTREG(base, UART_DR) = buffered;
+    }
+
+    /* spin while fifo is full */
+    while (UARTREG(base, UART_TFR) & (1<<5))
+        ;
+    UARTREG(base, UART_DR) = c;
+}
+
 static enum handler_return uart_irq(void *arg)
 {
     bool resched = false;
@@ -85,7 +133,9 @@ static enum handler_return uart_irq(void *arg)
             {
                 /* if we're out of rx buffer, mask the irq instead of handling it */
                 if (cbuf_space_avail(rxbuf) == 0) {
+                    spin_lock(&uart_lock[port]);
                     UARTREG(base, UART_IMSC) &= ~(1<<4); // !rxim
+                    spin_unlock(&uart_lock[port]);
                     break;
                 }
 
@@ -97,6 +147,12 @@ static enum handler_return uart_irq(void *arg)
         }
     }
 
+    if (isr & (1<<5)) { // txmis
+        spin_lock(&uart_lock[port]);
+        uart_tx_fill_locked(port);
+        spin_unlock(&uart_lock[port]);
+    }
+
     return resched ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
 }
 
@@ -105,8 +161,11 @@ void uart_init(void)
     for (size_t i = 0; i < NUM_UART; i++) {
         uintptr_t base = uart_to_ptr(i);
 
-        // create circular buffer to hold received data
-        cbuf_initialize(&uart_rx_buf[i], RXBUF_SIZE);
+        // create circular buffer to hold received data, filled only by the irq handler
+        cbuf_initialize_flags(&uart_rx_buf[i], RXBUF_SIZE, NULL, CBUF_FLAG_SPSC);
+
+        // and one for data waiting to go out
+        cbuf_initialize(&uart_tx_buf[i], TXBUF_SIZE);
 
         // assumes interrupts are contiguous
         register_int_handler(UART0_INT + i, &uart_irq, (void *)i);
@@ -125,12 +184,19 @@ void uart_init(void)
 
         // enable interrupt
         unmask_interrupt(UART0_INT + i);
+
+        // switch transmit over to the buffer
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&uart_lock[i], state);
+        uart_tx_irq[i] = true;
+        spin_unlock_irqrestore(&uart_lock[i], state);
     }
 }
 
 void uart_init_early(void)
 {
     for (size_t i = 0; i < NUM_UART; i++) {
+        spin_lock_init(&uart_lock[i]);
         UARTREG(uart_to_ptr(i), UART_CR) = (1<<8)|(1<<0); // tx_enable, uarten
     }
 }
@@ -138,11 +204,30 @@ void uart_init_early(void)
 int uart_putc(int port, char c)
 {
     uintptr_t base = uart_to_ptr(port);
+    spin_lock_saved_state_t state;
+
+    /* with interrupts off we may be inside the thread lock, which queueing to the
+     * cbuf can take, so write synchronously behind whatever is buffered */
+    if (!uart_tx_irq[port] || arch_ints_disabled()) {
+        spin_lock_irqsave(&uart_lock[port], state);
+        uart_tx_poll_locked(port, c);
+        spin_unlock_irqrestore(&uart_lock[port], state);
+        return 1;
+    }
 
-    /* spin while fifo is full */
-    while (UARTREG(base, UART_TFR) & (1<<5))
-        ;
-    UARTREG(base, UART_DR) = c;
+    while (cbuf_write_char(&uart_tx_buf[port], c, false) != 1) {
+        /* buffer full, make room by waiting for the fifo */
+        while (UARTREG(base, UART_TFR) & (1<<5))
+            ;
+        spin_lock_irqsave(&uart_lock[port], state);
+        uart_tx_fill_locked(port);
+        spin_unlock_irqrestore(&uart_lock[port], state);
+    }
+
+    /* top up the fifo right away, the interrupt takes it from there */
+    spin_lock_irqsave(&uart_lock[port], state);
+    uart_tx_fill_locked(port);
+    spin_unlock_irqrestore(&uart_lock[port], state);
 
     return 1;
 }
@@ -153,7 +238,10 @@ int uart_getc(int port, bool wait)
 
     char c;
     if (cbuf_read_char(rxbuf, &c, wait) == 1) {
-        UARTREG(uart_to_ptr(port), UART_IMSC) = (1<<4); // rxim
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&uart_lock[port], state);
+        UARTREG(uart_to_ptr(port), UART_IMSC) |= (1<<4); // rxim
+        spin_unlock_irqrestore(&uart_lock[port], state);
         return c;
     }
 
@@ -163,12 +251,24 @@ int uart_getc(int port, bool wait)
 /* panic-time getc/putc */
 int uart_pputc(int port, char c)
 {
-    uintptr_t base = uart_to_ptr(port);
+    /* flush what is buffered first, unless the lock holder is what panicked */
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    bool locked = spin_trylock(&uart_lock[port]) == 0;
+
+    if (locked) {
+        uart_tx_poll_locked(port, c);
+        spin_unlock(&uart_lock[port]);
+    } else {
+        uintptr_t base = uart_to_ptr(port);
 
-    /* spin while fifo is full */
-    while (UARTREG(base, UART_TFR) & (1<<5))
-        ;
-    UARTREG(base, UART_DR) = c;
+        /* spin while fifo is full */
+        while (UARTREG(base, UART_TFR) & (1<<5))
+            ;
+        UARTREG(base, UART_DR) = c;
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 
     return 1;
 }
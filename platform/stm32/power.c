@@ -28,10 +28,14 @@
 #include <platform/debug.h>
 #include <arch/ops.h>
 #include <arch/arm/cm.h>
+#include <lib/io.h>
 
 void platform_halt(platform_halt_action suggested_action,
                    platform_halt_reason reason)
 {
+    /* anything still queued for the console goes out first */
+    console_output_panic();
+
 #if ENABLE_PANIC_SHELL
     if (reason == HALT_REASON_SW_PANIC) {
         dprintf(ALWAYS, "CRASH: starting debug shell... (reason = %d)\n", reason);
@@ -31,6 +31,7 @@
 #include <err.h>
 #include <dev/usb.h>
 #include <dev/usbc.h>
+#include <kernel/spinlock.h>
 #include <arch/arm/cm.h>
 #include <platform/rcc.h>
 #include <platform/stm32.h>
@@ -48,12 +49,18 @@
 
 struct ep_status {
     bool ack_ep0_in;
+
+    /* the transfer the hardware is working on and the ones queued behind it */
     usbc_transfer_t *transfer;
+    struct list_node queue;
 };
 
 static struct {
     bool do_resched;
 
+    /* protects the endpoint transfer queues */
+    spin_lock_t lock;
+
     struct ep_status ep_in[NUM_EP];
     struct ep_status ep_out[NUM_EP];
 
@@ -62,6 +69,87 @@ static struct {
     PCD_HandleTypeDef handle;
 } usbc;
 
+/* start the next queued transfer on an idle endpoint. usbc.lock must be held. */
+static void ep_start_next_locked(ep_t epnum, bool in)
+{
+    struct ep_status *stat = in ? &usbc.ep_in[epnum] : &usbc.ep_out[epnum];
+
+    DEBUG_ASSERT(!stat->transfer);
+
+    usbc_transfer_t *t = list_remove_head_type(&stat->queue, usbc_transfer_t, node);
+    if (!t)
+        return;
+
+    stat->transfer = t;
+    if (in)
+        HAL_PCD_EP_Transmit(&usbc.handle, epnum, t->buf, t->buflen);
+    else
+        HAL_PCD_EP_Receive(&usbc.handle, epnum, t->buf, t->buflen);
+}
+
+static status_t ep_queue(ep_t epnum, bool in, usbc_transfer_t *t)
+{
+    struct ep_status *stat = in ? &usbc.ep_in[epnum] : &usbc.ep_out[epnum];
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&usbc.lock, state);
+
+    list_add_tail(&stat->queue, &t->node);
+    if (!stat->transfer)
+        ep_start_next_locked(epnum, in);
+
+    spin_unlock_irqrestore(&usbc.lock, state);
+
+    return NO_ERROR;
+}
+
+/* the active transfer of an endpoint is done. get the next one going before
+ * handing it back, so the endpoint doesn't sit idle while the callback runs. */
+static void ep_complete(ep_t epnum, bool in, uint bufpos)
+{
+    struct ep_status *stat = in ? &usbc.ep_in[epnum] : &usbc.ep_out[epnum];
+
+    spin_lock(&usbc.lock);
+    usbc_transfer_t *t = stat->transfer;
+    stat->transfer = NULL;
+    if (t)
+        ep_start_next_locked(epnum, in);
+    spin_unlock(&usbc.lock);
+
+    if (!t)
+        return;
+
+    LTRACEF("completing transfer %p\n", t);
+
+    t->bufpos = bufpos;
+    t->result = 0;
+    t->callback(epnum, t);
+    usbc.do_resched = true;
+}
+
+/* fail the active and every queued transfer of an endpoint */
+static void ep_cancel_all(ep_t epnum, bool in)
+{
+    struct ep_status *stat = in ? &usbc.ep_in[epnum] : &usbc.ep_out[epnum];
+    struct list_node cancelled = LIST_INITIAL_VALUE(cancelled);
+    usbc_transfer_t *t;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&usbc.lock, state);
+    if (stat->transfer) {
+        list_add_tail(&cancelled, &stat->transfer->node);
+        stat->transfer = NULL;
+    }
+    while ((t = list_remove_head_type(&stat->queue, usbc_transfer_t, node)))
+        list_add_tail(&cancelled, &t->node);
+    spin_unlock_irqrestore(&usbc.lock, state);
+
+    while ((t = list_remove_head_type(&cancelled, usbc_transfer_t, node))) {
+        t->result = ERR_CANCELLED;
+        t->callback(epnum, t);
+    }
+}
+
 uint32_t stm32_usbc_pma_alloc(uint32_t size) {
     // TODO(konkers): Fail on OOM
     uint32_t addr = usbc.pma_highwater;
@@ -86,6 +174,12 @@ void stm32_usbc_init(void)
 {
     LTRACE_ENTRY;
 
+    usbc.lock = SPIN_LOCK_INITIAL_VALUE;
+    for (uint i = 0; i < NUM_EP; i++) {
+        list_initialize(&usbc.ep_in[i].queue);
+        list_initialize(&usbc.ep_out[i].queue);
+    }
+
     usbc.pma_highwater = 0x40;
 
     // Set LL Driver parameters
@@ -124,16 +218,7 @@ void HAL_PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
         usbc_ep0_ack();
     } else if (usbc.ep_out[epnum].transfer) {
         // completing a transfer
-        usbc_transfer_t *t = usbc.ep_out[epnum].transfer;
-        usbc.ep_out[epnum].transfer = NULL;
-
-        LTRACEF("completing transfer %p\n", t);
-
-        PCD_EPTypeDef *ep = &hpcd->OUT_ep[epnum];
-        t->bufpos = ep->xfer_count;
-        t->result = 0;
-        t->callback(epnum, t);
-        usbc.do_resched = true;
+        ep_complete(epnum, false, hpcd->OUT_ep[epnum].xfer_count);
     }
 }
 
@@ -156,16 +241,7 @@ void HAL_PCD_DataInStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
         // in transfer done
         if (usbc.ep_in[epnum].transfer) {
             // completing a transfer
-            usbc_transfer_t *t = usbc.ep_in[epnum].transfer;
-            usbc.ep_in[epnum].transfer = NULL;
-
-            LTRACEF("completing transfer %p\n", t);
-
-            PCD_EPTypeDef *ep = &hpcd->IN_ep[epnum];
-            t->bufpos = ep->xfer_count;
-            t->result = 0;
-            t->callback(epnum, t);
-            usbc.do_resched = true;
+            ep_complete(epnum, true, ep->xfer_count);
         }
     }
 }
@@ -193,18 +269,8 @@ void HAL_PCD_ResetCallback(PCD_HandleTypeDef *hpcd)
 
     /* fail all the outstanding transactions */
     for (uint i = 0; i < NUM_EP; i++) {
-        if (usbc.ep_in[i].transfer) {
-            usbc_transfer_t *t = usbc.ep_in[i].transfer;
-            usbc.ep_in[i].transfer = NULL;
-            t->result = ERR_CANCELLED;
-            t->callback(i, t);
-        }
-        if (usbc.ep_out[i].transfer) {
-            usbc_transfer_t *t = usbc.ep_out[i].transfer;
-            usbc.ep_out[i].transfer = NULL;
-            t->result = ERR_CANCELLED;
-            t->callback(i, t);
-        }
+        ep_cancel_all(i, true);
+        ep_cancel_all(i, false);
     }
 
     HAL_PCD_EP_Open(&usbc.handle, 0, 0x40, PCD_EP_TYPE_CTRL);
@@ -326,26 +392,18 @@ status_t usbc_queue_rx(ep_t ep, usbc_transfer_t *transfer)
 {
     LTRACEF("ep %u, transfer %p (buf %p, buflen %zu)\n", ep, transfer, transfer->buf, transfer->buflen);
 
-    DEBUG_ASSERT(ep <= NUM_EP);
-    DEBUG_ASSERT(usbc.ep_out[ep].transfer == NULL);
+    DEBUG_ASSERT(ep < NUM_EP);
 
-    usbc.ep_out[ep].transfer = transfer;
-    HAL_PCD_EP_Receive(&usbc.handle, ep, transfer->buf, transfer->buflen);
-
-    return NO_ERROR;
+    return ep_queue(ep, false, transfer);
 }
 
 status_t usbc_queue_tx(ep_t ep, usbc_transfer_t *transfer)
 {
     LTRACEF("ep %u, transfer %p (buf %p, buflen %zu)\n", ep, transfer, transfer->buf, transfer->buflen);
 
-    DEBUG_ASSERT(ep <= NUM_EP);
-    DEBUG_ASSERT(usbc.ep_in[ep].transfer == NULL);
+    DEBUG_ASSERT(ep < NUM_EP);
 
-    usbc.ep_in[ep].transfer = transfer;
-    HAL_PCD_EP_Transmit(&usbc.handle, ep, transfer->buf, transfer->buflen);
-
-    return NO_ERROR;
+    return ep_queue(ep, true, transfer);
 }
 
 void stm32_USB_IRQ(void)
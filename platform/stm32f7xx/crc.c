@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * crc-32 through the CRC calculation unit. It is set up to bit reverse
+ * words in and the result out, which turns its msb first engine into the
+ * reflected crc everyone else uses. Words only; the unaligned ends are done
+ * in software.
+ */
+#if WITH_LIB_CHECKSUM
+
+#include <lib/checksum.h>
+#include <kernel/spinlock.h>
+#include <platform/stm32.h>
+
+static spin_lock_t crc_lock = SPIN_LOCK_INITIAL_VALUE;
+
+static uint32_t crc32_stm32(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    size_t head = (-(uintptr_t)buf) & 3;
+    if (head > len)
+        head = len;
+    crc = checksum_crc32_soft(crc, buf, head);
+    buf += head;
+    len -= head;
+
+    size_t words = len / 4;
+    if (words > 0) {
+        const uint32_t *w = (const uint32_t *)buf;
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&crc_lock, state);
+
+        CRC->INIT = __RBIT(~crc);
+        CRC->CR = CRC_CR_REV_IN | CRC_CR_REV_OUT | CRC_CR_RESET;
+        for (size_t i = 0; i < words; i++)
+            CRC->DR = w[i];
+        crc = ~CRC->DR;
+
+        spin_unlock_irqrestore(&crc_lock, state);
+    }
+
+    return checksum_crc32_soft(crc, buf + words * 4, len & 3);
+}
+
+void checksum_platform_init(struct checksum_ops *ops)
+{
+    RCC->AHB1ENR |= RCC_AHB1ENR_CRCEN;
+    __DSB();
+
+    ops->crc32_name = "stm32 crc unit";
+    ops->crc32 = crc32_stm32;
+    ops->crc32_uses_simd = false;
+}
+
+#endif
@@ -61,8 +61,10 @@
 #include <dev/display.h>
 #include <kernel/event.h>
 #include <kernel/thread.h>
+#include <kernel/spinlock.h>
 #include <arch/ops.h>
 #include <arch/arm/cm.h>
+#include <lib/console.h>
 #include <platform.h>
 #include <platform/stm32.h>
 #include <platform/eth.h>
@@ -74,6 +76,8 @@
 
 #define LOCAL_TRACE 0
 
+#if WITH_LIB_MINIP
+
 /* LAN8742A PHY Address*/
 #define LAN8742A_PHY_ADDRESS            0x00
 /* DP83848 PHY Address*/
@@ -81,26 +85,119 @@
 /* KSZ8721 PHY Address*/
 #define KSZ8721_PHY_ADDRESS             0x01
 
+/* descriptor ring sizes, each rx descriptor holds on to one pktbuf for good */
+#ifndef STM32_ETH_RX_DESC_CNT
+#define STM32_ETH_RX_DESC_CNT   16
+#endif
+#ifndef STM32_ETH_TX_DESC_CNT
+#define STM32_ETH_TX_DESC_CNT   16
+#endif
+
+/* a whole frame always fits in one rx buffer, so frames never span descriptors */
+#define RX_BUF_SIZE             ETH_RX_BUF_SIZE
+STATIC_ASSERT(RX_BUF_SIZE <= PKTBUF_SIZE);
+
+/* receive errors that make the frame worthless, as opposed to checksum errors
+ * which are left for the stack to find again */
+#define RX_FRAME_ERRORS         (ETH_DMARXDESC_DE | ETH_DMARXDESC_OE | ETH_DMARXDESC_LC | \
+                                 ETH_DMARXDESC_RWT | ETH_DMARXDESC_RE | ETH_DMARXDESC_CE)
+
+/* with enhanced descriptors bit 0 of the status means ExtendedStatus is valid */
+#define RX_DESC_ESA             ETH_DMARXDESC_MAMPCE
+
+#define PKTBUF_FLAG_CKSUM_MASK  (PKTBUF_FLAG_CKSUM_IP_GOOD | PKTBUF_FLAG_CKSUM_TCP_GOOD | \
+                                 PKTBUF_FLAG_CKSUM_UDP_GOOD)
+
 struct eth_status {
     ETH_HandleTypeDef EthHandle;
 
     eth_phy_itf eth_phy;
     event_t rx_event;
-
-    /* allocated directly out of DTCM below */
-    ETH_DMADescTypeDef  *DMARxDscrTab;  // ETH_RXBUFNB
-    ETH_DMADescTypeDef  *DMATxDscrTab;  // ETH_TXBUFNB
-    uint8_t             *Rx_Buff;       // ETH_RXBUFNB * ETH_RX_BUF_SIZE
-    uint8_t             *Tx_Buff;       // ETH_TXBUFNB * ETH_TX_BUF_SIZE
+    spin_lock_t tx_lock;
+
+    /* allocated directly out of DTCM below, which is not cached */
+    ETH_DMADescTypeDef  *rx_descs;      // STM32_ETH_RX_DESC_CNT
+    ETH_DMADescTypeDef  *tx_descs;      // STM32_ETH_TX_DESC_CNT
+
+    /* buffer of every rx descriptor */
+    pktbuf_t *rx_pbufs[STM32_ETH_RX_DESC_CNT];
+    uint rx_head;
+
+    /* packets in flight, stored at the last descriptor of their frame */
+    pktbuf_t *tx_pbufs[STM32_ETH_TX_DESC_CNT];
+    uint tx_head;   // next descriptor to fill
+    uint tx_tail;   // oldest descriptor the hardware may still own
+    uint tx_count;
+
+    uint rx_frames;
+    uint rx_errors;
+    uint tx_frames;
+    uint tx_full;
 };
 
 static struct eth_status eth;
 
 static int eth_rx_worker(void *arg);
 
-#if WITH_LIB_MINIP
-static int eth_send_raw_pkt(pktbuf_t *p);
+/* hand an rx buffer (back) to the dma. nothing of it may be left dirty in the
+ * cache to be written back over what the dma puts there, dirty is how much of
+ * it the cpu may have written to */
+static void eth_rx_arm(uint i, size_t dirty)
+{
+    pktbuf_t *p = eth.rx_pbufs[i];
+    ETH_DMADescTypeDef *desc = &eth.rx_descs[i];
+
+    if (dirty)
+        arch_clean_invalidate_cache_range((addr_t)p->buffer, dirty);
+
+    desc->Buffer1Addr = p->phys_base;
+    desc->ControlBufferSize = ETH_DMARXDESC_RCH | RX_BUF_SIZE;
+    __DMB();
+    desc->Status = ETH_DMARXDESC_OWN;
+}
+
+static status_t eth_rings_init(void)
+{
+    /* allocate descriptor memory from DTCM */
+    /* XXX do in a more generic way */
+#if MEMBASE == 0x20000000
+#error DTCM will collide with MEMBASE
 #endif
+    addr_t tcm_ptr = RAMDTCM_BASE;
+
+    eth.tx_descs = (void *)tcm_ptr;
+    tcm_ptr += sizeof(*eth.tx_descs) * STM32_ETH_TX_DESC_CNT;
+    eth.rx_descs = (void *)tcm_ptr;
+    tcm_ptr += sizeof(*eth.rx_descs) * STM32_ETH_RX_DESC_CNT;
+
+    memset(eth.tx_descs, 0, sizeof(*eth.tx_descs) * STM32_ETH_TX_DESC_CNT);
+    memset(eth.rx_descs, 0, sizeof(*eth.rx_descs) * STM32_ETH_RX_DESC_CNT);
+
+    /* chain mode, the last descriptor points back at the first */
+    for (uint i = 0; i < STM32_ETH_TX_DESC_CNT; i++) {
+        eth.tx_descs[i].Status = ETH_DMATXDESC_TCH;
+        eth.tx_descs[i].Buffer2NextDescAddr =
+            (uint32_t)&eth.tx_descs[(i + 1) % STM32_ETH_TX_DESC_CNT];
+    }
+
+    for (uint i = 0; i < STM32_ETH_RX_DESC_CNT; i++) {
+        eth.rx_pbufs[i] = pktbuf_alloc();
+        if (!eth.rx_pbufs[i])
+            return ERR_NO_MEMORY;
+
+        eth.rx_descs[i].Buffer2NextDescAddr =
+            (uint32_t)&eth.rx_descs[(i + 1) % STM32_ETH_RX_DESC_CNT];
+        eth_rx_arm(i, RX_BUF_SIZE);
+    }
+
+    eth.rx_head = 0;
+    eth.tx_head = eth.tx_tail = eth.tx_count = 0;
+
+    eth.EthHandle.Instance->DMATDLAR = (uint32_t)eth.tx_descs;
+    eth.EthHandle.Instance->DMARDLAR = (uint32_t)eth.rx_descs;
+
+    return NO_ERROR;
+}
 
 status_t eth_init(const uint8_t *mac_addr, eth_phy_itf eth_phy)
 {
@@ -136,35 +233,20 @@ status_t eth_init(const uint8_t *mac_addr, eth_phy_itf eth_phy)
     }
 
     eth.EthHandle.Init.RxMode = ETH_RXINTERRUPT_MODE;
-    //eth.EthHandle.Init.ChecksumMode = ETH_CHECKSUM_BY_HARDWARE; // XXX icmp checksums corrupted if stack stuff valid checksum
-    eth.EthHandle.Init.ChecksumMode = ETH_CHECKSUM_BY_SOFTWARE;
+    /* turns on the rx checksum engine. on tx the checksum insertion is picked per
+     * frame in the descriptor and only used for offloaded tcp, full insertion
+     * mangles the icmp checksums the stack already filled in */
+    eth.EthHandle.Init.ChecksumMode = ETH_CHECKSUM_BY_HARDWARE;
 
     /* configure ethernet peripheral (GPIOs, clocks, MAC, DMA) */
     if (HAL_ETH_Init(&eth.EthHandle) != HAL_OK)
         return ERR_NOT_CONFIGURED;
 
-    /* allocate descriptor and buffer memory from DTCM */
-    /* XXX do in a more generic way */
-#if MEMBASE == 0x20000000
-#error DTCM will collide with MEMBASE
-#endif
-    addr_t tcm_ptr = RAMDTCM_BASE;
-
-    eth.DMATxDscrTab = (void *)tcm_ptr;
-    tcm_ptr += sizeof(*eth.DMATxDscrTab) * ETH_TXBUFNB;
-    eth.DMARxDscrTab = (void *)tcm_ptr;
-    tcm_ptr += sizeof(*eth.DMARxDscrTab) * ETH_RXBUFNB;
+    spin_lock_init(&eth.tx_lock);
 
-    eth.Tx_Buff = (void *)tcm_ptr;
-    tcm_ptr += ETH_TX_BUF_SIZE * ETH_TXBUFNB;
-    eth.Rx_Buff = (void *)tcm_ptr;
-    tcm_ptr += ETH_RX_BUF_SIZE * ETH_RXBUFNB;
-
-    /* Initialize Tx Descriptors list: Chain Mode */
-    HAL_ETH_DMATxDescListInit(&eth.EthHandle, eth.DMATxDscrTab, eth.Tx_Buff, ETH_TXBUFNB);
-
-    /* Initialize Rx Descriptors list: Chain Mode  */
-    HAL_ETH_DMARxDescListInit(&eth.EthHandle, eth.DMARxDscrTab, eth.Rx_Buff, ETH_RXBUFNB);
+    status_t err = eth_rings_init();
+    if (err < 0)
+        return err;
 
     /* Enable MAC and DMA transmission and reception */
     HAL_ETH_Start(&eth.EthHandle);
@@ -208,55 +290,98 @@ void stm32_ETH_IRQ(void)
 {
     arm_cm_irq_entry();
 
-    HAL_ETH_IRQHandler(&eth.EthHandle);
+    ETH_TypeDef *regs = eth.EthHandle.Instance;
+    uint32_t status = regs->DMASR;
+    bool resched = false;
+
+    /* only the receive interrupt is enabled, the rx thread does the rest */
+    if (status & ETH_DMA_IT_R) {
+        regs->DMASR = ETH_DMA_IT_R | ETH_DMA_IT_NIS;
+        event_signal(&eth.rx_event, false);
+        resched = true;
+    }
 
-    arm_cm_irq_exit(true);
+    arm_cm_irq_exit(resched);
 }
 
-/**
-  * @brief  Ethernet Rx Transfer completed callback
-  * @param  heth: ETH handle
-  * @retval None
-  */
-void HAL_ETH_RxCpltCallback(ETH_HandleTypeDef *heth)
+/* set the checksum flags of a received frame from what the checksum engine found */
+static void eth_rx_csum(pktbuf_t *p, uint32_t status, uint32_t ext)
 {
-    event_signal(&eth.rx_event, false);
+    p->flags &= ~PKTBUF_FLAG_CKSUM_MASK;
+
+    if (!(status & RX_DESC_ESA) || !(ext & ETH_DMAPTPRXDESC_IPV4PR) ||
+            (ext & (ETH_DMAPTPRXDESC_IPCB | ETH_DMAPTPRXDESC_IPHE))) {
+        return;
+    }
+
+    p->flags |= PKTBUF_FLAG_CKSUM_IP_GOOD;
+    if (ext & ETH_DMAPTPRXDESC_IPPE)
+        return;
+
+    switch (ext & ETH_DMAPTPRXDESC_IPPT) {
+        case ETH_DMAPTPRXDESC_IPPT_TCP:
+            p->flags |= PKTBUF_FLAG_CKSUM_TCP_GOOD;
+            break;
+        case ETH_DMAPTPRXDESC_IPPT_UDP:
+            p->flags |= PKTBUF_FLAG_CKSUM_UDP_GOOD;
+            break;
+    }
 }
 
-static status_t eth_send(const void *buf, size_t len)
+/* pass every frame the dma has finished with up the stack, returns how many */
+static uint eth_rx_harvest(void)
 {
-    status_t err;
-    __IO ETH_DMADescTypeDef *DmaTxDesc;
+    uint count = 0;
 
-    LTRACEF("buf %p, len %zu\n", buf, len);
+    for (;;) {
+        uint i = eth.rx_head;
+        ETH_DMADescTypeDef *desc = &eth.rx_descs[i];
+        uint32_t status = desc->Status;
 
-    DmaTxDesc = eth.EthHandle.TxDesc;
+        if (status & ETH_DMARXDESC_OWN)
+            break;
+        __DMB();
 
-    /* is the buffer available? */
-    if ((DmaTxDesc->Status & ETH_DMATXDESC_OWN) != 0) {
-        LTRACEF("tx buffer not available\n");
-        err = ERR_IO;
-        goto error;
-    }
+        pktbuf_t *p = eth.rx_pbufs[i];
+        size_t dirty = 0;
+        uint32_t len = (status & ETH_DMARXDESC_FL) >> ETH_DMARXDESC_FRAMELENGTHSHIFT;
 
-    uint8_t *buffer = (uint8_t *)(DmaTxDesc->Buffer1Addr);
-    memcpy(buffer, buf, len);
+        if ((status & RX_FRAME_ERRORS) ||
+                (status & (ETH_DMARXDESC_FS | ETH_DMARXDESC_LS)) != (ETH_DMARXDESC_FS | ETH_DMARXDESC_LS) ||
+                len <= 4 || len > RX_BUF_SIZE) {
+            LTRACEF("dropping frame, status 0x%x\n", status);
+            eth.rx_errors++;
+        } else {
+            /* drop the fcs, and whatever the cpu speculatively pulled in while the dma was writing */
+            len -= 4;
+            arch_invalidate_cache_range((addr_t)p->buffer, len);
 
-    HAL_StatusTypeDef e = HAL_ETH_TransmitFrame(&eth.EthHandle, len);
+            p->data = p->buffer;
+            p->dlen = len;
+            eth_rx_csum(p, status, desc->ExtendedStatus);
 
-    err = (e == HAL_OK) ? NO_ERROR : ERR_IO;
+            LTRACEF("got packet len %u, buffer %p\n", len, p->data);
 
-error:
-    /* When Transmit Underflow flag is set, clear it and issue a Transmit Poll Demand to resume transmission */
-    if ((eth.EthHandle.Instance->DMASR & ETH_DMASR_TUS) != 0) {
-        /* Clear TUS ETHERNET DMA flag */
-        eth.EthHandle.Instance->DMASR = ETH_DMASR_TUS;
+            /* the stack is done with the buffer when the callback returns, so it goes straight back to the ring */
+            minip_rx_driver_callback(p);
+            eth.rx_frames++;
+            dirty = len;
+        }
 
-        /* Resume DMA transmission*/
-        eth.EthHandle.Instance->DMATPDR = 0;
+        eth_rx_arm(i, dirty);
+        eth.rx_head = (i + 1) % STM32_ETH_RX_DESC_CNT;
+        count++;
     }
 
-    return err;
+    /* When Rx Buffer unavailable flag is set: clear it and resume reception */
+    if (count && (eth.EthHandle.Instance->DMASR & ETH_DMASR_RBUS) != (uint32_t)RESET) {
+        /* Clear RBUS ETHERNET DMA flag */
+        eth.EthHandle.Instance->DMASR = ETH_DMASR_RBUS;
+        /* Resume DMA reception */
+        eth.EthHandle.Instance->DMARPDR = 0;
+    }
+
+    return count;
 }
 
 static int eth_rx_worker(void *arg)
@@ -292,55 +417,136 @@ static int eth_rx_worker(void *arg)
         status_t event_err = event_wait(&eth.rx_event);
         if (event_err >= NO_ERROR) {
 #endif
-            // XXX probably race with the event here
-            while (HAL_ETH_GetReceivedFrame_IT(&eth.EthHandle) == HAL_OK) {
-                LTRACEF("got packet len %u, buffer %p, seg count %u\n", eth.EthHandle.RxFrameInfos.length,
-                        (void *)eth.EthHandle.RxFrameInfos.buffer,
-                        eth.EthHandle.RxFrameInfos.SegCount);
+            /* a frame landing after the ring looked empty signals the event again,
+             * so it is picked up on the next pass */
+            while (eth_rx_harvest() > 0)
+                ;
+        }
+    }
 
-#if WITH_LIB_MINIP
-                /* allocate a pktbuf header, point it at our rx buffer, and pass up the stack */
-                pktbuf_t *p = pktbuf_alloc_empty();
-                if (p) {
-                    pktbuf_add_buffer(p, (void *)eth.EthHandle.RxFrameInfos.buffer, eth.EthHandle.RxFrameInfos.length,
-                                      0, 0, NULL, NULL);
-                    p->dlen = eth.EthHandle.RxFrameInfos.length;
+    return 0;
+}
 
-                    minip_rx_driver_callback(p);
+/* free the packets the dma is done sending, with tx_lock held */
+static void eth_tx_reap(void)
+{
+    while (eth.tx_count > 0) {
+        uint i = eth.tx_tail;
+        if (eth.tx_descs[i].Status & ETH_DMATXDESC_OWN)
+            break;
 
-                    pktbuf_free(p, true);
-                }
-#endif
+        if (eth.tx_pbufs[i]) {
+            pktbuf_free(eth.tx_pbufs[i], false);
+            eth.tx_pbufs[i] = NULL;
+        }
+        eth.tx_tail = (i + 1) % STM32_ETH_TX_DESC_CNT;
+        eth.tx_count--;
+    }
+}
 
-                /* Release descriptors to DMA */
-                /* Point to first descriptor */
-                __IO ETH_DMADescTypeDef *dmarxdesc;
+/* number of descriptors a packet needs, one per non empty part */
+static uint eth_tx_desc_count(const pktbuf_t *p)
+{
+    uint count = 0;
+    for (; p; p = p->next) {
+        if (p->dlen)
+            count++;
+    }
+    return count;
+}
 
-                dmarxdesc = eth.EthHandle.RxFrameInfos.FSRxDesc;
-                /* Set Own bit in Rx descriptors: gives the buffers back to DMA */
-                for (uint i=0; i< eth.EthHandle.RxFrameInfos.SegCount; i++) {
-                    dmarxdesc->Status |= ETH_DMARXDESC_OWN;
-                    dmarxdesc = (ETH_DMADescTypeDef *)(dmarxdesc->Buffer2NextDescAddr);
-                }
+/* with the tcp checksum field holding the sum of the pseudo header, let the mac
+ * work out the whole thing. the full insertion mode wants the field cleared */
+static uint32_t eth_tx_csum_ctrl(pktbuf_t *p)
+{
+    if (!(p->flags & PKTBUF_FLAG_CKSUM_TCP_PARTIAL))
+        return ETH_DMATXDESC_CIC_BYPASS;
 
-                /* Clear Segment_Count */
-                eth.EthHandle.RxFrameInfos.SegCount =0;
+    /* ethernet header, then the ip header of ihl words, the tcp checksum is 16 bytes in */
+    if (p->dlen < 14 + 20)
+        return ETH_DMATXDESC_CIC_BYPASS;
+    uint ihl = (p->data[14] & 0xf) * 4;
+    uint off = 14 + ihl + 16;
+    if (ihl < 20 || p->dlen < off + 2)
+        return ETH_DMATXDESC_CIC_BYPASS;
 
-                /* When Rx Buffer unavailable flag is set: clear it and resume reception */
-                if ((eth.EthHandle.Instance->DMASR & ETH_DMASR_RBUS) != (uint32_t)RESET) {
-                    /* Clear RBUS ETHERNET DMA flag */
-                    eth.EthHandle.Instance->DMASR = ETH_DMASR_RBUS;
-                    /* Resume DMA reception */
-                    eth.EthHandle.Instance->DMARPDR = 0;
-                }
-            }
-        }
+    p->data[off] = 0;
+    p->data[off + 1] = 0;
+
+    return ETH_DMATXDESC_CIC_TCPUDPICMP_FULL;
+}
+
+/* put a packet on the tx ring, with tx_lock held. the caller kicks the dma */
+static status_t eth_tx_queue(pktbuf_t *p)
+{
+    uint count = eth_tx_desc_count(p);
+
+    if (count == 0)
+        return ERR_INVALID_ARGS;
+    if (count > STM32_ETH_TX_DESC_CNT - eth.tx_count) {
+        eth.tx_full++;
+        return ERR_NO_RESOURCES;
     }
 
-    return 0;
+    uint32_t cic = eth_tx_csum_ctrl(p);
+    uint first = eth.tx_head;
+    uint i = first;
+    uint last = first;
+    ETH_DMADescTypeDef *first_desc = &eth.tx_descs[first];
+
+    for (pktbuf_t *part = p; part; part = part->next) {
+        if (!part->dlen)
+            continue;
+
+        arch_clean_cache_range((addr_t)part->data, part->dlen);
+
+        ETH_DMADescTypeDef *desc = &eth.tx_descs[i];
+        desc->Buffer1Addr = pktbuf_data_phys(part);
+        desc->ControlBufferSize = part->dlen & ETH_DMATXDESC_TBS1;
+
+        uint32_t ctrl = ETH_DMATXDESC_TCH | cic;
+        if (i == first)
+            ctrl |= ETH_DMATXDESC_FS;
+        if (--count == 0)
+            ctrl |= ETH_DMATXDESC_LS | ETH_DMATXDESC_IC;
+
+        /* everything but the first descriptor goes to the dma right away, the
+         * first one last so it never sees half a frame */
+        if (i != first)
+            ctrl |= ETH_DMATXDESC_OWN;
+        desc->Status = ctrl;
+
+        last = i;
+        i = (i + 1) % STM32_ETH_TX_DESC_CNT;
+        eth.tx_count++;
+    }
+
+    eth.tx_pbufs[last] = p;
+    eth.tx_head = i;
+
+    __DMB();
+    first_desc->Status |= ETH_DMATXDESC_OWN;
+    eth.tx_frames++;
+
+    return NO_ERROR;
 }
 
-#if WITH_LIB_MINIP
+/* tell the dma there is something to send, with tx_lock held */
+static void eth_tx_kick(void)
+{
+    ETH_TypeDef *regs = eth.EthHandle.Instance;
+
+    __DSB();
+
+    /* When Transmit Underflow flag is set, clear it to resume transmission */
+    if ((regs->DMASR & ETH_DMASR_TUS) != 0) {
+        /* Clear TUS ETHERNET DMA flag */
+        regs->DMASR = ETH_DMASR_TUS;
+    }
+
+    /* Issue a Transmit Poll Demand, the dma suspends whenever it runs out of descriptors */
+    regs->DMATPDR = 0;
+}
 
 status_t stm32_eth_send_minip_pkt(pktbuf_t *p)
 {
@@ -348,20 +554,81 @@ status_t stm32_eth_send_minip_pkt(pktbuf_t *p)
 
     DEBUG_ASSERT(p && p->dlen);
 
-    if (!(p->flags & PKTBUF_FLAG_EOF)) {
-        /* can't handle multi part packets yet */
-        PANIC_UNIMPLEMENTED;
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&eth.tx_lock, state);
 
-        return ERR_NOT_IMPLEMENTED;
-    }
+    eth_tx_reap();
+    status_t err = eth_tx_queue(p);
+    if (err >= 0)
+        eth_tx_kick();
 
-    status_t err = eth_send(p->data, p->dlen);
+    spin_unlock_irqrestore(&eth.tx_lock, state);
 
-    pktbuf_free(p, true);
+    if (err < 0)
+        pktbuf_free(p, true);
 
     return err;
 }
 
-#endif
+int stm32_eth_send_minip_pkts(struct list_node *list)
+{
+    struct list_node dropped = LIST_INITIAL_VALUE(dropped);
+    pktbuf_t *p;
+    int count = 0;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&eth.tx_lock, state);
+
+    eth_tx_reap();
+    while ((p = list_remove_head_type(list, pktbuf_t, list)) != NULL) {
+        if (eth_tx_queue(p) < 0) {
+            list_add_tail(&dropped, &p->list);
+            continue;
+        }
+        count++;
+    }
+    if (count > 0)
+        eth_tx_kick();
+
+    spin_unlock_irqrestore(&eth.tx_lock, state);
+
+    /* free outside the lock */
+    while ((p = list_remove_head_type(&dropped, pktbuf_t, list)) != NULL) {
+        pktbuf_free(p, false);
+    }
+
+    return count;
+}
+
+static int cmd_eth(int argc, const cmd_args *argv)
+{
+    uint rx_owned = 0, tx_owned = 0;
+
+    for (uint i = 0; i < STM32_ETH_RX_DESC_CNT; i++)
+        rx_owned += !!(eth.rx_descs[i].Status & ETH_DMARXDESC_OWN);
+    for (uint i = 0; i < STM32_ETH_TX_DESC_CNT; i++)
+        tx_owned += !!(eth.tx_descs[i].Status & ETH_DMATXDESC_OWN);
+
+    printf("rx: %u/%u descriptors armed, head %u, %u frames, %u errors\n",
+           rx_owned, STM32_ETH_RX_DESC_CNT, eth.rx_head, eth.rx_frames, eth.rx_errors);
+    printf("tx: %u/%u descriptors in use (%u with dma), head %u tail %u, %u frames, %u ring full\n",
+           eth.tx_count, STM32_ETH_TX_DESC_CNT, tx_owned, eth.tx_head, eth.tx_tail,
+           eth.tx_frames, eth.tx_full);
+    printf("dma status 0x%08x\n", eth.EthHandle.Instance->DMASR);
+
+    return NO_ERROR;
+}
 
+STATIC_COMMAND_START
+STATIC_COMMAND("eth", "stm32 ethernet status", &cmd_eth)
+STATIC_COMMAND_END(stm32_eth);
 
+#else
+
+status_t eth_init(const uint8_t *mac_addr, eth_phy_itf eth_phy)
+{
+    /* the dma rings are made of pktbufs */
+    return ERR_NOT_SUPPORTED;
+}
+
+#endif
@@ -33,7 +33,9 @@ typedef enum {
 } eth_phy_itf;
 
 struct pktbuf;
+struct list_node;
 
 status_t eth_init(const uint8_t *mac_addr, eth_phy_itf eth_phy);
 status_t stm32_eth_send_minip_pkt(struct pktbuf *p);
+int stm32_eth_send_minip_pkts(struct list_node *list);
 
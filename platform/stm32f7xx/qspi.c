@@ -42,6 +42,19 @@
 #define LOCAL_TRACE 0
 #define MAX_DMA_WAIT_MS 1024
 
+// Reads at least this long are copied out of the memory mapped flash instead
+// of going through indirect mode dma, which costs a command and an interrupt
+// per page. Once in memory mapped mode all reads are served from there until a
+// write or erase needs the command interface back.
+#ifndef QSPI_LINEAR_READ_THRESHOLD
+#define QSPI_LINEAR_READ_THRESHOLD 1024
+#endif
+
+// How far ahead of the copy to touch the memory mapped flash.
+#ifndef QSPI_LINEAR_PREFETCH_LINES
+#define QSPI_LINEAR_PREFETCH_LINES 4
+#endif
+
 typedef void (*CpltCallback)(void);
 
 typedef enum {
@@ -62,6 +75,13 @@ static bio_erase_geometry_info_t geometry;
 
 static mutex_t spiflash_mutex;
 
+// Outstanding BIO_IOCTL_GET_MEM_MAP callers, memory mapped mode is put back
+// after writes and erases while there are any.
+static uint linear_map_count;
+
+// The bio layer's default read, used for short reads in command mode.
+static ssize_t (*default_read)(struct bdev *, void *buf, off_t offset, size_t len);
+
 // Functions exported to Block I/O handler.
 static ssize_t spiflash_bdev_read(struct bdev *device, void *buf, off_t offset, size_t len);
 static ssize_t spiflash_bdev_read_block(struct bdev *device, void *buf, bnum_t block, uint count);
@@ -84,6 +104,10 @@ static HAL_StatusTypeDef qspi_rx_dma(QSPI_HandleTypeDef *, QSPI_CommandTypeDef *
 static status_t qspi_enable_linear(void);
 static status_t qspi_disable_linear(void);
 static bool qspi_is_linear(void);
+static status_t qspi_enter_linear_unsafe(void);
+static status_t qspi_enter_command_unsafe(void);
+static void qspi_flash_modified_unsafe(uint32_t addr, size_t len);
+static ssize_t qspi_linear_read_unsafe(void *buf, uint32_t addr, size_t len);
 
 status_t qspi_dma_init(QSPI_HandleTypeDef *hqspi);
 
@@ -316,21 +340,54 @@ static status_t qspi_reset_memory_unsafe(QSPI_HandleTypeDef *hqspi)
     return NO_ERROR;
 }
 
+static ssize_t spiflash_bdev_read(struct bdev *device, void *buf, off_t offset, size_t len)
+{
+    LTRACEF("device %p, buf %p, offset 0x%llx, len 0x%zx\n",
+            device, buf, offset, len);
+
+    len = bio_trim_range(device, offset, len);
+    if (len == 0)
+        return 0;
+
+    // Memory mapped reads need no bounce buffer, whatever the alignment.
+    mutex_acquire(&spiflash_mutex);
+    if (device_state == QSPI_STATE_LINEAR || len >= QSPI_LINEAR_READ_THRESHOLD) {
+        ssize_t retcode = qspi_linear_read_unsafe(buf, offset, len);
+        mutex_release(&spiflash_mutex);
+        return retcode;
+    }
+    mutex_release(&spiflash_mutex);
+
+    return default_read(device, buf, offset, len);
+}
+
 static ssize_t spiflash_bdev_read_block(struct bdev *device, void *buf,
                                         bnum_t block, uint count)
 {
     LTRACEF("device %p, buf %p, block %u, count %u\n",
             device, buf, block, count);
 
-    if (!IS_ALIGNED((uintptr_t)buf, CACHE_LINE)) {
-        DEBUG_ASSERT(IS_ALIGNED((uintptr_t)buf, CACHE_LINE));
-        return ERR_INVALID_ARGS;
-    }
-
     count = bio_trim_block_range(device, block, count);
     if (count == 0)
         return 0;
 
+    ssize_t retcode = 0;
+
+    mutex_acquire(&spiflash_mutex);
+
+    if (device_state == QSPI_STATE_LINEAR ||
+            count * device->block_size >= QSPI_LINEAR_READ_THRESHOLD) {
+        retcode = qspi_linear_read_unsafe(buf, block * device->block_size,
+                                          count * device->block_size);
+        goto err;
+    }
+
+    if (!IS_ALIGNED((uintptr_t)buf, CACHE_LINE)) {
+        DEBUG_ASSERT(IS_ALIGNED((uintptr_t)buf, CACHE_LINE));
+        retcode = ERR_INVALID_ARGS;
+        goto err;
+    }
+
     QSPI_CommandTypeDef s_command;
     HAL_StatusTypeDef status;
 
@@ -350,10 +407,6 @@ static ssize_t spiflash_bdev_read_block(struct bdev *device, void *buf,
 
     s_command.NbData = device->block_size;
 
-    ssize_t retcode = 0;
-
-    mutex_acquire(&spiflash_mutex);
-
     s_command.Address = block * device->block_size;
     for (uint i = 0; i < count; i++) {
 
@@ -393,10 +446,15 @@ static ssize_t spiflash_bdev_write_block(struct bdev *device, const void *_buf,
     }
 
     const uint8_t *buf = _buf;
+    uint32_t start = block * N25QXXA_PAGE_SIZE;
+    size_t span = count * N25QXXA_PAGE_SIZE;
 
     mutex_acquire(&spiflash_mutex);
 
-    ssize_t total_bytes_written = 0;
+    ssize_t total_bytes_written = qspi_enter_command_unsafe();
+    if (total_bytes_written < 0)
+        goto err;
+
     for (; count > 0; count--, block++) {
         ssize_t bytes_written = qspi_write_page_unsafe(block * N25QXXA_PAGE_SIZE, buf);
         if (bytes_written < 0) {
@@ -411,6 +469,7 @@ static ssize_t spiflash_bdev_write_block(struct bdev *device, const void *_buf,
     }
 
 err:
+    qspi_flash_modified_unsafe(start, span);
     mutex_release(&spiflash_mutex);
     return total_bytes_written;
 }
@@ -424,9 +483,14 @@ static ssize_t spiflash_bdev_erase(struct bdev *device, off_t offset,
     }
 
     ssize_t total_erased = 0;
+    uint32_t start = offset;
 
     mutex_acquire(&spiflash_mutex);
 
+    total_erased = qspi_enter_command_unsafe();
+    if (total_erased < 0)
+        goto finish;
+
     // Choose an erase strategy based on the number of bytes being erased.
     if (len == device->total_size && offset == 0) {
         // Bulk erase the whole flash.
@@ -457,6 +521,7 @@ static ssize_t spiflash_bdev_erase(struct bdev *device, off_t offset,
     }
 
 finish:
+    qspi_flash_modified_unsafe(start, len);
     mutex_release(&spiflash_mutex);
     return total_erased;
 }
@@ -630,7 +695,8 @@ status_t qspi_flash_init(size_t flash_size)
                         (flash_size / N25QXXA_PAGE_SIZE), 1, &geometry,
                         BIO_FLAG_CACHE_ALIGNED_READS);
 
-    // qspi_flash_device.read: Use default hook.
+    default_read = qspi_flash_device.read;
+    qspi_flash_device.read = &spiflash_bdev_read;
     qspi_flash_device.read_block = &spiflash_bdev_read_block;
     // qspi_flash_device.write has a default hook that will be okay
     qspi_flash_device.write_block = &spiflash_bdev_write_block;
@@ -1001,29 +1067,27 @@ static uint32_t get_specialized_instruction(uint32_t instruction, uint32_t addre
     return instruction;
 }
 
-static status_t qspi_enable_linear(void)
+// Must hold spiflash_mutex before calling.
+static status_t qspi_enter_linear_unsafe(void)
 {
-    status_t result = NO_ERROR;
-
-    mutex_acquire(&spiflash_mutex);
-
     if (device_state == QSPI_STATE_LINEAR) {
         // Device is already in linear mode, nothing to be done.
-        goto finish;
+        return NO_ERROR;
     }
 
-    result = qspi_dummy_cycles_cfg_unsafe(&qspi_handle);
-
-    static const QSPI_CommandTypeDef s_command = {
+    // The dummy cycles in the volatile configuration register were set up in
+    // qspi_flash_init and nothing but a memory reset changes them.
+    uint32_t largest_offset = geometry.size - 1;
+    QSPI_CommandTypeDef s_command = {
         .InstructionMode   = QSPI_INSTRUCTION_1_LINE,
-        .AddressSize       = QSPI_ADDRESS_24_BITS,
+        .AddressSize       = get_address_size(largest_offset),
         .AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE,
         .DdrMode           = QSPI_DDR_MODE_DISABLE,
         .DdrHoldHalfCycle  = QSPI_DDR_HHC_ANALOG_DELAY,
         .AddressMode       = QSPI_ADDRESS_1_LINE,
-        .Instruction       = QUAD_OUT_FAST_READ_CMD,
+        .Instruction       = get_specialized_instruction(QUAD_OUT_FAST_READ_CMD, largest_offset),
         .DataMode          = QSPI_DATA_4_LINES,
-        .DummyCycles       = 10,
+        .DummyCycles       = N25QXXA_DUMMY_CYCLES_READ_QUAD,
         .SIOOMode          = QSPI_SIOO_INST_EVERY_CMD
     };
 
@@ -1033,41 +1097,102 @@ static status_t qspi_enable_linear(void)
 
     HAL_StatusTypeDef hal_result = HAL_QSPI_MemoryMapped(&qspi_handle, &s_command, &linear_mode_cfg);
     if (hal_result != HAL_OK) {
-        result = hal_error_to_status(hal_result);
         dprintf(CRITICAL, "%s: HAL_QSPI_MemoryMapped failed with err = %d\n",
                 __func__, hal_result);
-        goto finish;
+        return hal_error_to_status(hal_result);
     }
 
     device_state = QSPI_STATE_LINEAR;
 
-finish:
-    mutex_release(&spiflash_mutex);
-    return result;
+    return NO_ERROR;
 }
 
-
-static status_t qspi_disable_linear(void)
+// Must hold spiflash_mutex before calling.
+static status_t qspi_enter_command_unsafe(void)
 {
-    status_t result = NO_ERROR;
-
-    mutex_acquire(&spiflash_mutex);
-
     if (device_state == QSPI_STATE_COMMAND) {
         // Device is already in Command mode, nothing to be done.
-        goto finish;
+        return NO_ERROR;
     }
 
-    result = hal_error_to_status(HAL_QSPI_Abort(&qspi_handle));
-    if (result == NO_ERROR) {
-        device_state = QSPI_STATE_COMMAND;
-    } else {
+    status_t result = hal_error_to_status(HAL_QSPI_Abort(&qspi_handle));
+    if (result != NO_ERROR) {
         dprintf(CRITICAL, "%s: HAL_QSPI_Abort failed with err = %d\n",
                 __func__, result);
+        return result;
     }
 
+    device_state = QSPI_STATE_COMMAND;
+
+    return NO_ERROR;
+}
+
+// Called after a write or erase of [addr, addr + len). The memory mapped
+// flash is cacheable, drop whatever of the old contents is still cached and
+// give memory mapped mode back to anyone holding a pointer into it.
+// Must hold spiflash_mutex before calling.
+static void qspi_flash_modified_unsafe(uint32_t addr, size_t len)
+{
+    if (len > 0)
+        arch_invalidate_cache_range(QSPI_BASE + addr, len);
+
+    if (linear_map_count > 0)
+        qspi_enter_linear_unsafe();
+}
+
+// Copy out of the memory mapped flash, touching a few cache lines ahead of the
+// copy so that the line fills overlap with copying out the previous ones.
+// Must hold spiflash_mutex before calling.
+static ssize_t qspi_linear_read_unsafe(void *buf, uint32_t addr, size_t len)
+{
+    status_t result = qspi_enter_linear_unsafe();
+    if (result != NO_ERROR)
+        return result;
+
+    const uint8_t *src = (const uint8_t *)QSPI_BASE + addr;
+    uint8_t *dst = buf;
+    size_t left = len;
+
+    while (left > 0) {
+        size_t chunk = CACHE_LINE - ((uintptr_t)src & (CACHE_LINE - 1));
+        if (chunk > left)
+            chunk = left;
+
+        __builtin_prefetch(src + QSPI_LINEAR_PREFETCH_LINES * CACHE_LINE);
+        memcpy(dst, src, chunk);
+
+        src += chunk;
+        dst += chunk;
+        left -= chunk;
+    }
+
+    return len;
+}
+
+static status_t qspi_enable_linear(void)
+{
+    mutex_acquire(&spiflash_mutex);
+
+    status_t result = qspi_enter_linear_unsafe();
+    if (result == NO_ERROR)
+        linear_map_count++;
+
+    mutex_release(&spiflash_mutex);
+    return result;
+}
+
+
+static status_t qspi_disable_linear(void)
+{
+    status_t result = NO_ERROR;
+
+    mutex_acquire(&spiflash_mutex);
+
+    if (linear_map_count > 0)
+        linear_map_count--;
+    if (linear_map_count == 0)
+        result = qspi_enter_command_unsafe();
 
-finish:
     mutex_release(&spiflash_mutex);
     return result;
 }
@@ -38,6 +38,7 @@ GLOBAL_DEFINES += \
     CONSOLE_HAS_INPUT_BUFFER=1
 
 MODULE_SRCS += \
+	$(LOCAL_DIR)/crc.c \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/eth.c \
 	$(LOCAL_DIR)/flash.c \
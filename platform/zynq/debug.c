@@ -29,6 +29,7 @@
 #include <platform/zynq.h>
 #include <target/debugconfig.h>
 #include <reg.h>
+#include <lib/io.h>
 
 /* DEBUG_UART must be defined to 0 or 1 */
 #if defined(DEBUG_UART) && DEBUG_UART == 0
@@ -60,6 +61,9 @@ int platform_dgetc(char *c, bool wait)
 void platform_halt(platform_halt_action suggested_action,
                    platform_halt_reason reason)
 {
+    /* anything still queued for the console goes out first */
+    console_output_panic();
+
     switch (suggested_action) {
         default:
         case HALT_ACTION_SHUTDOWN:
@@ -70,6 +70,20 @@
 #define GEM_TX_BUF_SIZE     1536
 #endif
 
+/* frames harvested per pass of the rx thread before it yields */
+#ifndef GEM_RX_BUDGET
+#define GEM_RX_BUDGET       16
+#endif
+
+/* checksum offload result in bits 23:22 of the rx descriptor status word */
+#define RX_CSUM_NONE        0
+#define RX_CSUM_IP          1
+#define RX_CSUM_IP_TCP      2
+#define RX_CSUM_IP_UDP      3
+
+#define PKTBUF_FLAG_CKSUM_MASK \
+    (PKTBUF_FLAG_CKSUM_IP_GOOD | PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD)
+
 pool_t rx_buf_pool;
 static spin_lock_t lock = SPIN_LOCK_INITIAL_VALUE;
 
@@ -82,11 +96,16 @@ struct gem_desc {
  * RX:
  *  rx_tbl contains rx descriptors. A pktbuf is allocated for each of these and a descriptor
  *  entry in the table points to a buffer in the pktbuf. rx_tbl[X]'s pktbuf is stored in rx_pbufs[X]
+ *  The rx complete interrupt is masked as soon as it fires and the rx thread harvests the ring
+ *  in batches of GEM_RX_BUDGET frames, handing every pktbuf to the callback in place and giving
+ *  it straight back to its descriptor. The interrupt is only unmasked again once the ring is empty.
  *
  * TX:
- *  The current position to write new tx descriptors to is maintained by gem.tx_head. As frames are
- *  queued in tx_tbl their pktbufs are stored in the list queued_pbufs. As frame transmission is
- *  completed these pktbufs are released back to the pool by the interrupt handler for TX_COMPLETE
+ *  The current position to write new tx descriptors to is maintained by gem.tx_head. Every part of
+ *  a multi part pktbuf gets a descriptor of its own, the frame's pktbuf and descriptor count are
+ *  stored in tx_pbufs/tx_frags at the index of its first descriptor, which is the only one the
+ *  controller marks used when it is done. Completed frames are released back to the pool by the
+ *  interrupt handler for TX_COMPLETE, and by the send path before it queues more.
  */
 struct gem_descs {
     struct gem_desc rx_tbl[GEM_RX_DESC_CNT];
@@ -103,13 +122,19 @@ struct gem_state {
     unsigned int tx_tail;
     unsigned int tx_count;
     struct list_node tx_queue;
-    struct list_node queued_pbufs;
+    pktbuf_t *tx_pbufs[GEM_TX_DESC_CNT];
+    uint8_t tx_frags[GEM_TX_DESC_CNT];
 
     gem_cb_t rx_callback;
     event_t rx_pending;
     event_t tx_complete;
     bool debug_rx;
     pktbuf_t *rx_pbufs[GEM_RX_DESC_CNT];
+
+    /* rx moderation stats */
+    uint32_t rx_irqs;
+    uint32_t rx_passes;
+    uint32_t rx_frames;
 };
 
 struct gem_state gem;
@@ -129,81 +154,130 @@ static int free_completed_pbuf_frames(void)
 
     gem.regs->tx_status = gem.regs->tx_status;
 
+    /* the controller only marks the first descriptor of a frame used */
     while (gem.tx_count > 0 &&
             (gem.descs->tx_tbl[gem.tx_tail].ctrl & TX_DESC_USED)) {
+        unsigned int first = gem.tx_tail;
+        unsigned int frags = gem.tx_frags[first];
+
+        DEBUG_ASSERT(gem.tx_pbufs[first]);
+        ret += pktbuf_free(gem.tx_pbufs[first], false);
+        gem.tx_pbufs[first] = NULL;
+
+        /* hand the rest of the frame's descriptors back to the driver as well, so the
+         * controller stops at them if it ever gets there before they are reused */
+        for (unsigned int i = 1; i < frags; i++) {
+            unsigned int pos = (first + i) % GEM_TX_DESC_CNT;
+            gem.descs->tx_tbl[pos].ctrl |= TX_DESC_USED;
+        }
 
-        bool eof;
-        do {
-            pktbuf_t *p = list_remove_head_type(&gem.queued_pbufs, pktbuf_t, list);
-            DEBUG_ASSERT(p);
-            eof = p->flags & PKTBUF_FLAG_EOF;
-            ret += pktbuf_free(p, false);
-        } while (!eof);
-
-        gem.tx_tail = (gem.tx_tail + 1) % GEM_TX_DESC_CNT;
-        gem.tx_count--;
+        gem.tx_tail = (gem.tx_tail + frags) % GEM_TX_DESC_CNT;
+        gem.tx_count -= frags;
     }
 
     return ret;
 }
 
-void queue_pkts_in_tx_tbl(void)
+/* number of descriptors a packet needs, one per non empty part */
+static unsigned int tx_frag_count(const pktbuf_t *p)
 {
-    pktbuf_t *p;
-    unsigned int cur_pos;
+    unsigned int count = 0;
 
-    if (list_is_empty(&gem.tx_queue)) {
-        return;
+    for (; p; p = p->next) {
+        if (p->dlen)
+            count++;
     }
 
-    // XXX handle multi part buffers
+    return count;
+}
+
+void queue_pkts_in_tx_tbl(void)
+{
+    pktbuf_t *p;
+    pktbuf_t *parts[GEM_TX_DESC_CNT];
+    bool queued = false;
 
     /* Queue packets in the descriptor table until we're either out of space in the table
      * or out of packets in our tx queue. Any packets left will remain in the list and be
      * processed the next time available */
-    while (gem.tx_count < GEM_TX_DESC_CNT &&
-            ((p = list_remove_head_type(&gem.tx_queue, pktbuf_t, list)) != NULL)) {
-        cur_pos = gem.tx_head;
-
-        uint32_t addr = pktbuf_data_phys(p);
-        uint32_t ctrl = gem.descs->tx_tbl[cur_pos].ctrl & TX_DESC_WRAP; /* protect the wrap bit */
-        ctrl |= TX_BUF_LEN(p->dlen);
+    while ((p = list_peek_head_type(&gem.tx_queue, pktbuf_t, list)) != NULL) {
+        unsigned int frags = 0;
+        for (pktbuf_t *part = p; part; part = part->next) {
+            if (part->dlen) {
+                DEBUG_ASSERT(frags < GEM_TX_DESC_CNT); // checked by the send path
+                parts[frags++] = part;
+            }
+        }
+        if (gem.tx_count + frags > GEM_TX_DESC_CNT) {
+            break;
+        }
+        list_delete(&p->list);
+
+        /* fill in the descriptors back to front, the first control word last so the
+         * controller can't start on a partially built frame */
+        unsigned int first = gem.tx_head;
+        for (int i = frags - 1; i >= 0; i--) {
+            unsigned int pos = (first + i) % GEM_TX_DESC_CNT;
+            uint32_t ctrl = gem.descs->tx_tbl[pos].ctrl & TX_DESC_WRAP; /* protect the wrap bit */
+            ctrl |= TX_BUF_LEN(parts[i]->dlen);
+            if (i == (int)frags - 1) {
+                ctrl |= TX_LAST_BUF;
+            }
 
-        DEBUG_ASSERT(p->flags & PKTBUF_FLAG_EOF); // a multi part buffer would have caused a race condition w/hardware
-        if (p->flags & PKTBUF_FLAG_EOF) {
-            ctrl |= TX_LAST_BUF;
+            gem.descs->tx_tbl[pos].addr = pktbuf_data_phys(parts[i]);
+            if (i == 0) {
+                DMB;
+            }
+            gem.descs->tx_tbl[pos].ctrl = ctrl;
         }
 
-        /* fill in the descriptor, control word last (in case hardware is racing us) */
-        gem.descs->tx_tbl[cur_pos].addr = addr;
-        gem.descs->tx_tbl[cur_pos].ctrl = ctrl;
+        gem.tx_pbufs[first] = p;
+        gem.tx_frags[first] = frags;
+        gem.tx_head = (gem.tx_head + frags) % GEM_TX_DESC_CNT;
+        gem.tx_count += frags;
+        queued = true;
+    }
+
+    /* one kick for everything queued */
+    if (queued) {
+        DMB;
+        gem.regs->net_ctrl |= NET_CTRL_START_TX;
+    }
+}
+
+/* get a packet ready for the hardware, returns false if it can't be sent */
+static bool gem_prepare_tx_pkt(pktbuf_t *p)
+{
+    if (!p || pktbuf_total_len(p) == 0) {
+        return false;
+    }
+
+    /* a frame has to fit in the ring, copy excessively fragmented ones together */
+    if (tx_frag_count(p) > GEM_TX_DESC_CNT / 2 && pktbuf_linearize(p) < 0) {
+        return false;
+    }
 
-        gem.tx_head = (gem.tx_head + 1) % GEM_TX_DESC_CNT;
-        gem.tx_count++;
-        list_add_tail(&gem.queued_pbufs, &p->list);
+    /* make sure the output buffers are fully written to memory before
+     * placing on the outgoing list. */
+    for (pktbuf_t *part = p; part; part = part->next) {
+        arch_clean_cache_range((vaddr_t)part->data, part->dlen);
     }
 
-    DMB;
-    gem.regs->net_ctrl |= NET_CTRL_START_TX;
+    return true;
 }
 
 int gem_send_raw_pkt(struct pktbuf *p)
 {
     status_t ret = NO_ERROR;
 
-    if (!p || !p->dlen) {
+    if (!gem_prepare_tx_pkt(p)) {
         ret = -1;
         goto err;
     }
 
-    /* make sure the output buffer is fully written to memory before
-     * placing on the outgoing list. */
-
-    // XXX handle multi part buffers
-    arch_clean_cache_range((vaddr_t)p->data, p->dlen);
-
     spin_lock_saved_state_t irqstate;
     spin_lock_irqsave(&lock, irqstate);
+    free_completed_pbuf_frames();
     list_add_tail(&gem.tx_queue, &p->list);
     queue_pkts_in_tx_tbl();
     spin_unlock_irqrestore(&lock, irqstate);
@@ -212,6 +286,38 @@ err:
     return ret;
 }
 
+int gem_send_raw_pkts(struct list_node *list)
+{
+    struct list_node batch = LIST_INITIAL_VALUE(batch);
+    pktbuf_t *p;
+    int count = 0;
+
+    while ((p = list_remove_head_type(list, pktbuf_t, list)) != NULL) {
+        if (!gem_prepare_tx_pkt(p)) {
+            pktbuf_free(p, false);
+            continue;
+        }
+        list_add_tail(&batch, &p->list);
+        count++;
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    /* reap what has completed, queue the lot and start the controller once */
+    spin_lock_saved_state_t irqstate;
+    spin_lock_irqsave(&lock, irqstate);
+    free_completed_pbuf_frames();
+    while ((p = list_remove_head_type(&batch, pktbuf_t, list)) != NULL) {
+        list_add_tail(&gem.tx_queue, &p->list);
+    }
+    queue_pkts_in_tx_tbl();
+    spin_unlock_irqrestore(&lock, irqstate);
+
+    return count;
+}
+
 
 enum handler_return gem_int_handler(void *arg)
 {
@@ -226,13 +332,19 @@ enum handler_return gem_int_handler(void *arg)
         // clear any pending status
         gem.regs->intr_status = intr_status;
 
-        // Received an RX complete
+        // Received an RX complete, hand the ring over to the rx thread until it is drained
         if (intr_status & INTR_RX_COMPLETE) {
-            event_signal(&gem.rx_pending, false);
+            /* status keeps latching while masked, only wake the thread if it was armed */
+            bool armed = !(gem.regs->intr_mask & INTR_RX_COMPLETE);
 
+            gem.regs->intr_dis = INTR_RX_COMPLETE;
             gem.regs->rx_status |= INTR_RX_COMPLETE;
 
-            resched = true;
+            if (armed) {
+                gem.rx_irqs++;
+                event_signal(&gem.rx_pending, false);
+                resched = true;
+            }
         }
 
         if (intr_status & INTR_RX_USED_READ) {
@@ -360,50 +472,85 @@ static void gem_cfg_ints(void)
                         INTR_RX_USED_READ | INTR_TX_CORRUPT | INTR_TX_USED_READ | INTR_RX_OVERRUN;
 }
 
+/* process up to budget received frames starting at *bp, returns the number handled */
+static int gem_rx_harvest(int *bp, int budget)
+{
+    int count = 0;
+
+    while (count < budget && (gem.descs->rx_tbl[*bp].addr & RX_DESC_USED)) {
+        uint32_t ctrl = gem.descs->rx_tbl[*bp].ctrl;
+        pktbuf_t *p = gem.rx_pbufs[*bp];
+
+        p->dlen = RX_BUF_LEN(ctrl);
+        p->data = p->buffer + 2;
+
+        /* copy the checksum offloading bits */
+        uint32_t flags = p->flags & ~PKTBUF_FLAG_CKSUM_MASK;
+        switch (BITS_SHIFT(ctrl, 23, 22)) {
+            case RX_CSUM_IP_TCP:
+                flags |= PKTBUF_FLAG_CKSUM_IP_GOOD | PKTBUF_FLAG_CKSUM_TCP_GOOD;
+                break;
+            case RX_CSUM_IP_UDP:
+                flags |= PKTBUF_FLAG_CKSUM_IP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD;
+                break;
+            case RX_CSUM_IP:
+                flags |= PKTBUF_FLAG_CKSUM_IP_GOOD;
+                break;
+        }
+        p->flags = flags;
+
+        /* invalidate any stale cache lines on the receive buffer to ensure
+         * the cpu has a fresh copy of incomding data. */
+        arch_invalidate_cache_range((vaddr_t)p->data, p->dlen);
+        u8 *end = p->data + p->dlen;
+
+        if (unlikely(gem.debug_rx)) {
+            debug_rx_handler(p);
+        }
+
+        if (likely(gem.rx_callback)) {
+            gem.rx_callback(p);
+        }
+
+        /* only the part of the buffer the frame covered can have been dirtied by the
+         * callback, flush it before giving the buffer back to the hardware */
+        if (p->data + p->dlen > end)
+            end = p->data + p->dlen;
+        arch_clean_invalidate_cache_range((vaddr_t)p->buffer, end - p->buffer);
+
+        gem.descs->rx_tbl[*bp].ctrl = 0;
+        gem.descs->rx_tbl[*bp].addr &= ~RX_DESC_USED;
+        *bp = (*bp + 1) % GEM_RX_DESC_CNT;
+        count++;
+    }
+
+    gem.rx_frames += count;
+    return count;
+}
+
 int gem_rx_thread(void *arg)
 {
-    pktbuf_t *p;
     int bp = 0;
 
     while (1) {
         event_wait(&gem.rx_pending);
 
         for (;;) {
-            if (gem.descs->rx_tbl[bp].addr & RX_DESC_USED) {
-                uint32_t ctrl = gem.descs->rx_tbl[bp].ctrl;
-
-                p = gem.rx_pbufs[bp];
-                p->dlen = RX_BUF_LEN(ctrl);
-                p->data = p->buffer + 2;
-
-                /* copy the checksum offloading bits */
-                p->flags = 0;
-                p->flags |= (BITS_SHIFT(ctrl, 23, 22) != 0) ? PKTBUF_FLAG_CKSUM_IP_GOOD : 0;
-                p->flags |= (BITS_SHIFT(ctrl, 23, 22) == 1) ? PKTBUF_FLAG_CKSUM_UDP_GOOD : 0;
-                p->flags |= (BITS_SHIFT(ctrl, 23, 22) == 2) ? PKTBUF_FLAG_CKSUM_TCP_GOOD : 0;
-
-                /* invalidate any stale cache lines on the receive buffer to ensure
-                 * the cpu has a fresh copy of incomding data. */
-                arch_invalidate_cache_range((vaddr_t)p->data, p->dlen);
-
-                if (unlikely(gem.debug_rx)) {
-                    debug_rx_handler(p);
-                }
-
-                if (likely(gem.rx_callback)) {
-                    gem.rx_callback(p);
-                }
-
-                /* make sure all dirty data is flushed out of the buffer before
-                 * putting into the receive queue */
-                arch_clean_invalidate_cache_range((vaddr_t)p->buffer, PKTBUF_SIZE);
-
-                gem.descs->rx_tbl[bp].addr &= ~RX_DESC_USED;
-                gem.descs->rx_tbl[bp].ctrl = 0;
-                bp = (bp + 1) % GEM_RX_DESC_CNT;
-            } else {
-                break;
+            gem.rx_passes++;
+            if (gem_rx_harvest(&bp, GEM_RX_BUDGET) == GEM_RX_BUDGET) {
+                /* still busy, keep polling but let others run */
+                thread_yield();
+                continue;
             }
+
+            /* the ring looks empty: clear the latched status, unmask the interrupt and look
+             * once more, a frame that landed in between would not raise it */
+            gem.regs->intr_status = INTR_RX_COMPLETE;
+            gem.regs->rx_status |= INTR_RX_COMPLETE;
+            gem.regs->intr_en = INTR_RX_COMPLETE;
+            if (!(gem.descs->rx_tbl[bp].addr & RX_DESC_USED))
+                break;
+            gem.regs->intr_dis = INTR_RX_COMPLETE;
         }
     }
 
@@ -466,7 +613,6 @@ status_t gem_init(uintptr_t gem_base)
     /* Data structure init */
     event_init(&gem.tx_complete, false, EVENT_FLAG_AUTOUNSIGNAL);
     event_init(&gem.rx_pending, false, EVENT_FLAG_AUTOUNSIGNAL);
-    list_initialize(&gem.queued_pbufs);
     list_initialize(&gem.tx_queue);
 
     /* allocate a block of uncached contiguous memory for the peripheral descriptors */
@@ -612,6 +758,8 @@ static int cmd_gem(int argc, const cmd_args *argv)
                rx_used, GEM_RX_DESC_CNT, tx_used, GEM_TX_DESC_CNT);
         printf("frames rx: %u, frames tx: %u\n",
                frames_rx, frames_tx);
+        printf("rx irqs: %u, rx passes: %u, rx frames handled: %u\n",
+               gem.rx_irqs, gem.rx_passes, gem.rx_frames);
         printf("tx:\n");
         for (size_t i = 0; i < GEM_TX_DESC_CNT; i++) {
             uint32_t ctrl = gem.descs->tx_tbl[i].ctrl;
@@ -2,12 +2,16 @@
 #include  <platform/zynq.h>
 
 struct pktbuf;
+struct list_node;
 
 typedef void (*gem_cb_t)(struct pktbuf *p);
 status_t gem_init(uintptr_t regsbase);
 void gem_set_callback(gem_cb_t rx);
 void gem_set_macaddr(uint8_t mac[6]);
 int gem_send_raw_pkt(struct pktbuf *p);
+/* send a list of pktbufs, linked through their list nodes, starting the controller once.
+ * returns the number queued, the driver owns all of them either way */
+int gem_send_raw_pkts(struct list_node *list);
 
 void gem_disable(void);
 
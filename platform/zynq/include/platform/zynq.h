@@ -69,6 +69,7 @@
 #define L2CACHE_BASE      (CPUPRIV_BASE + 0x2000)
 
 #define QSPI_LINEAR_BASE  (0xfc000000)
+#define QSPI_LINEAR_SIZE  (16*1024*1024) // 24 bit addresses, single flash
 
 /* interrupts */
 #define TTC0_A_INT    42
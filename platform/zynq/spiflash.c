@@ -37,6 +37,7 @@
 #include <lib/console.h>
 #include <dev/qspi.h>
 #include <kernel/thread.h>
+#include <platform.h>
 
 #include <platform/zynq.h>
 
@@ -45,7 +46,10 @@
 // parameters specifically for the 16MB spansion S25FL128S flash
 #define PARAMETER_AREA_SIZE (128*1024)
 #define PAGE_PROGRAM_SIZE (256)     // can be something else based on the part
-#define PAGE_ERASE_SLEEP_TIME (150) // amount of time before waiting to check if erase completed
+#define PAGE_PROGRAM_KHZ (80000)    // quad page program is slower than reads
+#define PAGE_PROGRAM_TIMEOUT (20)   // ms, well past the worst case page program time
+#define SECTOR_ERASE_TIMEOUT (4000) // ms, the worst case for a 256K sector is ~2.6s
+#define ERASE_POLL_INTERVAL (5)     // ms between status polls while erasing
 #define SECTOR_ERASE_SIZE (4096)
 #define LARGE_SECTOR_ERASE_SIZE (64*1024)
 
@@ -61,6 +65,7 @@ struct spi_flash {
     struct qspi_ctxt qspi;
     bdev_t bdev;
     bio_erase_geometry_info_t geometry[MAX_GEOMETRY_COUNT];
+    size_t geometry_count;
 
     off_t size;
 };
@@ -86,6 +91,37 @@ static void qspi_rd32(struct qspi_ctxt *qspi, uint32_t addr, uint32_t *data, uin
     qspi_rd(qspi, qspi_fix_addr(addr) | 0x6B, 4, data, count);
 }
 
+/*
+ * Copy out of the linear window. The window is mapped as device memory, so
+ * every load out of it has to be naturally aligned; whole words are read and
+ * stored to buf one at a time. Reading word after word keeps the controller
+ * streaming a single quad read command instead of a command per fifo load.
+ */
+static void qspi_linear_copy(void *buf, uint32_t addr, size_t len)
+{
+    const volatile uint8_t *src = (const volatile uint8_t *)((uintptr_t)QSPI_LINEAR_BASE + addr);
+    uint8_t *dst = buf;
+
+    while (len > 0 && !IS_ALIGNED((uintptr_t)src, 4)) {
+        *dst++ = *src++;
+        len--;
+    }
+
+    const volatile uint32_t *src32 = (const volatile uint32_t *)src;
+    while (len >= 4) {
+        uint32_t w = *src32++;
+        memcpy(dst, &w, 4);
+        dst += 4;
+        len -= 4;
+    }
+
+    src = (const volatile uint8_t *)src32;
+    while (len > 0) {
+        *dst++ = *src++;
+        len--;
+    }
+}
+
 static inline void qspi_wren(struct qspi_ctxt *qspi)
 {
     qspi_wr1(qspi, 0x06);
@@ -114,40 +150,74 @@ static inline void qspi_wr_status_cr1(struct qspi_ctxt *qspi, uint8_t status, ui
     qspi_wr3(qspi, cmd);
 }
 
+/*
+ * Wait for a program or erase to finish, sleeping interval ms between status
+ * polls, or just yielding the cpu if interval is 0. The controller has no way
+ * of polling the flash by itself, nor does the flash raise an interrupt.
+ * Returns the final status register, or ERR_TIMED_OUT.
+ */
+static int qspi_wait_ready(struct qspi_ctxt *qspi, lk_time_t timeout, lk_time_t interval)
+{
+    lk_time_t start = current_time();
+    uint32_t status;
+
+    while ((status = qspi_rd_status(qspi)) & STS_BUSY) {
+        if (current_time() - start > timeout)
+            return ERR_TIMED_OUT;
+
+        if (interval)
+            thread_sleep(interval);
+        else
+            thread_yield();
+    }
+
+    return status;
+}
+
+/* erase block size at addr according to the cfi, 0 if outside the flash */
+static size_t spiflash_erase_size(uint32_t addr)
+{
+    for (size_t i = 0; i < flash.geometry_count; i++) {
+        const bio_erase_geometry_info_t *g = &flash.geometry[i];
+        if (addr >= g->start && addr - g->start < g->size)
+            return g->erase_size;
+    }
+
+    /* no cfi geometry, assume the layout of the S25FL128S */
+    return (addr < PARAMETER_AREA_SIZE) ? SECTOR_ERASE_SIZE : LARGE_SECTOR_ERASE_SIZE;
+}
+
 static ssize_t qspi_erase_sector(struct qspi_ctxt *qspi, uint32_t addr)
 {
     uint32_t cmd;
-    uint32_t status;
+    int status;
     ssize_t toerase;
 
     LTRACEF("addr 0x%x\n", addr);
 
     DEBUG_ASSERT(qspi);
 
-    if (addr < PARAMETER_AREA_SIZE) {
-        // erase a small parameter sector (4K)
-        DEBUG_ASSERT(IS_ALIGNED(addr, SECTOR_ERASE_SIZE));
-        if (!IS_ALIGNED(addr, SECTOR_ERASE_SIZE))
-            return ERR_INVALID_ARGS;
+    toerase = spiflash_erase_size(addr);
+    DEBUG_ASSERT(toerase && IS_ALIGNED(addr, toerase));
+    if (!toerase || !IS_ALIGNED(addr, toerase))
+        return ERR_INVALID_ARGS;
 
+    if (toerase == SECTOR_ERASE_SIZE) {
+        // erase a small parameter sector (4K)
         cmd = 0x20;
-        toerase = SECTOR_ERASE_SIZE;
     } else {
         // erase a large sector (64k or 256k)
-        DEBUG_ASSERT(IS_ALIGNED(addr, LARGE_SECTOR_ERASE_SIZE));
-        if (!IS_ALIGNED(addr, LARGE_SECTOR_ERASE_SIZE))
-            return ERR_INVALID_ARGS;
-
         cmd = 0xd8;
-        toerase = LARGE_SECTOR_ERASE_SIZE;
     }
 
     qspi_wren(qspi);
     qspi_wr(qspi, qspi_fix_addr(addr) | cmd, 3, 0, 0);
 
-    thread_sleep(PAGE_ERASE_SLEEP_TIME);
-    while ((status = qspi_rd_status(qspi)) & STS_BUSY)
-        ;
+    status = qspi_wait_ready(qspi, SECTOR_ERASE_TIMEOUT, ERASE_POLL_INTERVAL);
+    if (status < 0) {
+        TRACEF("timed out @ 0x%x\n", addr);
+        return status;
+    }
 
     LTRACEF("status 0x%x\n", status);
     if (status & (STS_PROGRAM_ERR | STS_ERASE_ERR)) {
@@ -159,28 +229,25 @@ static ssize_t qspi_erase_sector(struct qspi_ctxt *qspi, uint32_t addr)
     return toerase;
 }
 
-static ssize_t qspi_write_page(struct qspi_ctxt *qspi, uint32_t addr, const uint8_t *data)
+/* quad input page program, the caller sets the bus speed */
+static ssize_t qspi_program_page(struct qspi_ctxt *qspi, uint32_t addr, const uint8_t *data)
 {
-    uint32_t oldkhz, status;
+    int status;
 
-    LTRACEF("addr 0x%x, data %p\n", addr, data);
-
-    DEBUG_ASSERT(qspi);
-    DEBUG_ASSERT(data);
     DEBUG_ASSERT(IS_ALIGNED(addr, PAGE_PROGRAM_SIZE));
 
     if (!IS_ALIGNED(addr, PAGE_PROGRAM_SIZE))
         return ERR_INVALID_ARGS;
 
-    oldkhz = qspi->khz;
-    if (qspi_set_speed(qspi, 80000))
-        return ERR_IO;
-
     qspi_wren(qspi);
     qspi_wr(qspi, qspi_fix_addr(addr) | 0x32, 3, (uint32_t *)data, PAGE_PROGRAM_SIZE / 4);
-    qspi_set_speed(qspi, oldkhz);
 
-    while ((status = qspi_rd_status(qspi)) & STS_BUSY) ;
+    /* a page takes well under a millisecond, too short to sleep on */
+    status = qspi_wait_ready(qspi, PAGE_PROGRAM_TIMEOUT, 0);
+    if (status < 0) {
+        printf("qspi_write_page timed out @ %x\n", addr);
+        return status;
+    }
 
     if (status & (STS_PROGRAM_ERR | STS_ERASE_ERR)) {
         printf("qspi_write_page failed @ %x\n", addr);
@@ -190,6 +257,58 @@ static ssize_t qspi_write_page(struct qspi_ctxt *qspi, uint32_t addr, const uint
     return PAGE_PROGRAM_SIZE;
 }
 
+static ssize_t qspi_write_page(struct qspi_ctxt *qspi, uint32_t addr, const uint8_t *data)
+{
+    uint32_t oldkhz;
+
+    LTRACEF("addr 0x%x, data %p\n", addr, data);
+
+    DEBUG_ASSERT(qspi);
+    DEBUG_ASSERT(data);
+
+    oldkhz = qspi->khz;
+    if (qspi_set_speed(qspi, PAGE_PROGRAM_KHZ))
+        return ERR_IO;
+
+    ssize_t ret = qspi_program_page(qspi, addr, data);
+    qspi_set_speed(qspi, oldkhz);
+
+    return ret;
+}
+
+/* whether the range already reads back as erased, through the linear window */
+static bool spiflash_is_erased(uint32_t addr, size_t len)
+{
+    if (addr + len > QSPI_LINEAR_SIZE)
+        return false;
+
+    bool was_linear = flash.qspi.linear_mode;
+    qspi_enable_linear(&flash.qspi);
+
+    const volatile uint32_t *p = (const volatile uint32_t *)((uintptr_t)QSPI_LINEAR_BASE + addr);
+    bool erased = true;
+    for (size_t i = 0; i < len / 4; i++) {
+        if (p[i] != 0xffffffff) {
+            erased = false;
+            break;
+        }
+    }
+
+    if (!was_linear)
+        qspi_disable_linear(&flash.qspi);
+
+    return erased;
+}
+
+static bool page_is_erased(const uint8_t *data)
+{
+    for (size_t i = 0; i < PAGE_PROGRAM_SIZE; i++) {
+        if (data[i] != 0xff)
+            return false;
+    }
+    return true;
+}
+
 static ssize_t spiflash_read_cfi(void *buf, size_t len)
 {
     DEBUG_ASSERT(len > 0 && (len % 4) == 0);
@@ -288,6 +407,7 @@ status_t spiflash_detect(void)
 
         offset += flash.geometry[i].size;
     }
+    flash.geometry_count = region_count;
 
     free(buf);
 
@@ -350,6 +470,19 @@ static ssize_t spiflash_bdev_read(struct bdev *bdev, void *buf, off_t offset, si
     if (len == 0)
         return 0;
 
+    /* anything inside the linear window is read from there, switching modes
+     * is only a couple of register writes */
+    if (offset + len <= QSPI_LINEAR_SIZE) {
+        bool was_linear = flash.qspi.linear_mode;
+
+        qspi_enable_linear(&flash.qspi);
+        qspi_linear_copy(buf, offset, len);
+        if (!was_linear)
+            qspi_disable_linear(&flash.qspi);
+
+        return len;
+    }
+
     // XXX handle not multiple of 4
     qspi_rd32(&flash.qspi, offset, buf, len / 4);
 
@@ -379,11 +512,26 @@ static ssize_t spiflash_bdev_write_block(struct bdev *bdev, const void *_buf, bn
 
     const uint8_t *buf = _buf;
 
+    /* programming needs the regular command interface */
+    bool was_linear = flash.qspi.linear_mode;
+    qspi_disable_linear(&flash.qspi);
+
     ssize_t written = 0;
+    uint32_t oldkhz = flash.qspi.khz;
+    if (qspi_set_speed(&flash.qspi, PAGE_PROGRAM_KHZ)) {
+        written = ERR_IO;
+        count = 0;
+    }
+
     while (count > 0) {
-        ssize_t err = qspi_write_page(&flash.qspi, block * PAGE_PROGRAM_SIZE, buf);
-        if (err < 0)
-            return err;
+        /* programming all ones changes no bits, so leave erased pages alone */
+        ssize_t err = PAGE_PROGRAM_SIZE;
+        if (!page_is_erased(buf))
+            err = qspi_program_page(&flash.qspi, block * PAGE_PROGRAM_SIZE, buf);
+        if (err < 0) {
+            written = err;
+            break;
+        }
 
         buf += PAGE_PROGRAM_SIZE;
         written += err;
@@ -391,6 +539,11 @@ static ssize_t spiflash_bdev_write_block(struct bdev *bdev, const void *_buf, bn
         count--;
     }
 
+    qspi_set_speed(&flash.qspi, oldkhz);
+
+    if (was_linear)
+        qspi_enable_linear(&flash.qspi);
+
     return written;
 }
 
@@ -402,16 +555,28 @@ static ssize_t spiflash_bdev_erase(struct bdev *bdev, off_t offset, size_t len)
     if (len == 0)
         return 0;
 
+    bool was_linear = flash.qspi.linear_mode;
+    qspi_disable_linear(&flash.qspi);
+
     ssize_t erased = 0;
     while (erased < (ssize_t)len) {
-        ssize_t err = qspi_erase_sector(&flash.qspi, offset);
-        if (err < 0)
-            return err;
+        /* blank checking a sector takes a fraction of the time erasing it does */
+        size_t size = spiflash_erase_size(offset);
+        ssize_t err = size;
+        if (!size || !spiflash_is_erased(offset, size))
+            err = qspi_erase_sector(&flash.qspi, offset);
+        if (err < 0) {
+            erased = err;
+            break;
+        }
 
         erased += err;
         offset += err;
     }
 
+    if (was_linear)
+        qspi_enable_linear(&flash.qspi);
+
     return erased;
 }
 
@@ -0,0 +1,7 @@
+# top level project rules for the pc-x86-64-bench project
+#
+ARCH := x86
+SUBARCH := x86-64
+
+include project/target/pc.mk
+include project/virtual/bench.mk
@@ -0,0 +1,3 @@
+# benchmark runner for qemu-aarch64
+include project/virtual/bench.mk
+include project/target/qemu-virt-a53.mk
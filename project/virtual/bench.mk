@@ -0,0 +1,9 @@
+# common modules for -bench variants, which run the benchmark suite at boot,
+# print the results on the console and power off. see scripts/do-bench
+
+MODULES += \
+  app/benchrunner \
+  app/tests \
+  lib/version \
+
+WITH_CPP_SUPPORT=true
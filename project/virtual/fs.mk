@@ -6,5 +6,6 @@ MODULES += \
     lib/fs/fat32 \
     lib/fs/spifs \
     lib/fs/spifs/test \
-    lib/fs/memfs
+    lib/fs/memfs \
+    lib/fs/crofs
 
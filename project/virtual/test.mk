@@ -8,6 +8,8 @@ MODULES += \
   lib/aes/test \
   lib/cksum \
   lib/debugcommands \
+  lib/irqstats \
+  lib/profiler \
   lib/version \
 
 WITH_CPP_SUPPORT=true
@@ -28,6 +28,7 @@
 #include <platform/ide.h>
 #include <platform/pcnet.h>
 #include <platform.h>
+#include <lk/init.h>
 #include <malloc.h>
 #include <string.h>
 #include <debug.h>
@@ -70,13 +71,19 @@ void target_init(void)
 {
     // initialize static devices
     device_init_all();
+}
 
+// probing the drives takes a while and nothing at boot needs them, so it runs
+// in the background. use lk_init_wait_deferred() before looking for them.
+static void target_ide_init(uint level)
+{
     // try to initialize pci ide first
     if (device_init(&__device_ide_pci_ide0) < 0 || device_init(&__device_ide_pci_ide1) < 0) {
         // if that fails, initialize the legacy ISA IDE controllers
         device_init(&__device_ide_ide0);
         device_init(&__device_ide_ide1);
     }
-
 }
 
+LK_INIT_HOOK_DEFERRED(target_ide, target_ide_init, LK_INIT_LEVEL_TARGET);
+
@@ -410,6 +410,9 @@ status_t display_get_framebuffer(struct display_framebuffer *fb)
     fb->image.height = BSP_LCD_GetYSize();
     fb->image.stride = BSP_LCD_GetXSize();
     fb->flush = NULL;
+    fb->flush_rect = NULL;
+    fb->back_pixels = NULL;
+    fb->flip = NULL;
 
     return NO_ERROR;
 }
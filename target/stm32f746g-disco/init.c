@@ -88,6 +88,8 @@ void target_init(void)
     uint32_t ip_gateway = IPV4_NONE;
 
     minip_init(stm32_eth_send_minip_pkt, NULL, ip_addr, ip_mask, ip_gateway);
+    minip_set_tx_offloads(MINIP_TX_OFFLOAD_SG | MINIP_TX_OFFLOAD_TCP_CSUM);
+    minip_set_tx_batch_handler(stm32_eth_send_minip_pkts);
 #endif
 
     // start usb
@@ -29,6 +29,9 @@
 #include <dev/usb.h>
 #include <dev/usbc.h>
 #include <dev/usb/class/bulktest.h>
+#if WITH_APP_LKBOOT
+#include <app/lkboot.h>
+#endif
 #include <hw/usb.h>
 #include <lk/init.h>
 
@@ -107,5 +110,10 @@ void target_usb_setup(void)
     /* add our bulk endpoint class device */
     usb_class_bulktest_init(1, 1, 1);
 
+#if WITH_APP_LKBOOT
+    /* and lkboot on the next pair of endpoints */
+    lkboot_usb_init(usb_get_current_iface_num_highspeed(), 2, 2);
+#endif
+
     usb_start();
 }
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+# vim: set expandtab ts=4 sw=4 tw=100:
+#
+# Load test for app/inetsrv. Opens connections in bursts against the echo, discard and chargen
+# services of a target, checks what comes back and reports how many were served, turned away or
+# failed. Run 'inetsrv' on the target console afterwards to compare with its own counts.
+#
+# usage: inetsrv-load.py [options] <target ip>
+
+import asyncio
+import os
+import sys
+import time
+from optparse import OptionParser
+
+PORTS = {"echo": 7, "discard": 9, "chargen": 19}
+
+parser = OptionParser(usage="%prog [options] <target ip>")
+parser.add_option("-c", "--connections", dest="connections", type="int", default=64,
+                  help="connections opened at once in every burst (default 64)")
+parser.add_option("-b", "--bursts", dest="bursts", type="int", default=10,
+                  help="number of bursts (default 10)")
+parser.add_option("-s", "--services", dest="services", default="echo,discard,chargen",
+                  help="comma separated services to spread the connections over")
+parser.add_option("-l", "--length", dest="length", type="int", default=16384,
+                  help="bytes sent or read per connection (default 16384)")
+parser.add_option("-t", "--timeout", dest="timeout", type="float", default=10.0,
+                  help="seconds before a connection counts as failed (default 10)")
+(options, args) = parser.parse_args()
+
+if len(args) != 1:
+    parser.error("need the target ip")
+
+services = options.services.split(",")
+for s in services:
+    if s not in PORTS:
+        parser.error("unknown service %s" % s)
+
+
+def chargen_sequence(length):
+    # same sequence the target sends, printable characters from '!' wrapping back to ' '
+    out = bytearray()
+    c = ord('!')
+    while len(out) < length:
+        out.append(c)
+        c += 1
+        if c == 0x7f:
+            c = ord(' ')
+    return bytes(out)
+
+
+CHARGEN = chargen_sequence(0x5f * 0x5f)
+
+
+async def run_echo(reader, writer):
+    payload = os.urandom(options.length)
+    writer.write(payload)
+    await writer.drain()
+    got = await reader.readexactly(len(payload))
+    return got == payload
+
+
+async def run_discard(reader, writer):
+    writer.write(os.urandom(options.length))
+    await writer.drain()
+    return True
+
+
+async def run_chargen(reader, writer):
+    got = await reader.readexactly(options.length)
+    want = (CHARGEN * (options.length // len(CHARGEN) + 1))[:options.length]
+    return got == want
+
+
+RUNNERS = {"echo": run_echo, "discard": run_discard, "chargen": run_chargen}
+
+
+async def one_connection(host, service, stats):
+    try:
+        reader, writer = await asyncio.wait_for(
+            asyncio.open_connection(host, PORTS[service]), options.timeout)
+    except (OSError, asyncio.TimeoutError):
+        stats["connect failed"] += 1
+        return
+
+    try:
+        ok = await asyncio.wait_for(RUNNERS[service](reader, writer), options.timeout)
+        stats["served" if ok else "bad data"] += 1
+    except asyncio.IncompleteReadError as e:
+        # closed right after the handshake, the connection limit turned us away
+        stats["refused" if not e.partial else "cut short"] += 1
+    except ConnectionError:
+        stats["refused"] += 1
+    except asyncio.TimeoutError:
+        stats["timed out"] += 1
+    finally:
+        writer.close()
+        try:
+            await writer.wait_closed()
+        except OSError:
+            pass
+
+
+async def main(host):
+    stats = dict.fromkeys(["served", "refused", "cut short", "bad data", "timed out",
+                           "connect failed"], 0)
+    start = time.monotonic()
+
+    for burst in range(options.bursts):
+        tasks = [one_connection(host, services[i % len(services)], stats)
+                 for i in range(options.connections)]
+        await asyncio.gather(*tasks)
+        print("burst %d: %s" % (burst, ", ".join("%s %d" % kv for kv in stats.items() if kv[1])))
+
+    elapsed = time.monotonic() - start
+    total = options.bursts * options.connections
+    print("%d connections in %.2f secs, %.1f per sec" % (total, elapsed, total / elapsed))
+    return 0 if stats["bad data"] == 0 and stats["timed out"] == 0 else 1
+
+
+sys.exit(asyncio.run(main(args[0])))
@@ -29,6 +29,8 @@
 #include <fcntl.h>
 #include <sys/types.h>
 
+#include <lib/miniz.h>
+
 #include "network.h"
 #include "../app/lkboot/lkboot_protocol.h"
 
@@ -53,10 +55,11 @@ static int readx(int s, void *_data, int len)
     return 0;
 }
 
-static int upload(int s, int txfd, size_t txlen, int do_endian_swap)
+static int upload(int s, int txfd, size_t txlen, int do_endian_swap, int can_deflate)
 {
     int err = 0;
     msg_hdr_t hdr;
+    char *zbuf = NULL;
 
     char *buf = malloc(txlen);
     if (!buf)
@@ -82,19 +85,35 @@ static int upload(int s, int txfd, size_t txlen, int do_endian_swap)
         }
     }
 
+    /* compress if the server can take it and it makes the transfer smaller */
+    char *data = buf;
+    size_t datalen = txlen;
+    unsigned char extra = 0;
+    if (can_deflate && txlen > 0) {
+        size_t zlen;
+        zbuf = tdefl_compress_mem_to_heap(buf, txlen, &zlen,
+                                          TDEFL_WRITE_ZLIB_HEADER | TDEFL_DEFAULT_MAX_PROBES);
+        if (zbuf && zlen < txlen) {
+            fprintf(stderr, "compressed %zu bytes to %zu\n", txlen, zlen);
+            data = zbuf;
+            datalen = zlen;
+            extra = LKB_DATA_DEFLATE;
+        }
+    }
+
     size_t pos = 0;
-    while (pos < txlen) {
-        size_t xfer = (txlen - pos > 65536) ? 65536 : txlen - pos;
+    while (pos < datalen) {
+        size_t xfer = (datalen - pos > 65536) ? 65536 : datalen - pos;
 
         hdr.opcode = MSG_SEND_DATA;
-        hdr.extra = 0;
+        hdr.extra = extra;
         hdr.length = xfer - 1;
         if (write(s, &hdr, sizeof(hdr)) != sizeof(hdr)) {
             fprintf(stderr, "error: writing socket\n");
             err = -1;
             goto done;
         }
-        if (write(s, buf + pos, xfer) != xfer) {
+        if (write(s, data + pos, xfer) != xfer) {
             fprintf(stderr, "error: writing socket\n");
             err = -1;
             goto done;
@@ -112,6 +131,7 @@ static int upload(int s, int txfd, size_t txlen, int do_endian_swap)
     }
 
 done:
+    free(zbuf);
     free(buf);
 
     return err;
@@ -275,7 +295,8 @@ int lkboot_txn(const char *host, const char *_cmd, int txfd, const char *args)
         if (readx(fd_in, &hdr, sizeof(hdr))) goto iofail;
         switch (hdr.opcode) {
             case MSG_GO_AHEAD:
-                if (upload(fd_out, txfd, txlen, do_endian_swap)) {
+                if (upload(fd_out, txfd, txlen, do_endian_swap,
+                           hdr.extra & LKB_GO_AHEAD_DEFLATE)) {
                     ret = -1;
                     goto out;
                 }
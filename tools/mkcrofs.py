@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+# vim: set expandtab ts=4 sw=4 tw=100:
+#
+# Build a crofs image out of a directory tree, see lib/fs/crofs/crofs_fs.h for the format.
+#
+# usage: mkcrofs.py [-b block_shift] [-l level] <dir> <image>
+
+import os
+import struct
+import sys
+import zlib
+from optparse import OptionParser
+
+CROFS_MAGIC = 0x73666f72
+CROFS_VERSION = 1
+CROFS_NAME_LEN = 64
+
+SUPER_FMT = "<6I"
+ENTRY_FMT = "<%dsQII" % CROFS_NAME_LEN
+
+parser = OptionParser(usage="%prog [options] <dir> <image>")
+parser.add_option("-b", "--block-shift", dest="block_shift", type="int", default=14,
+                  help="log2 of the block size, 12 to 17 (default 14)")
+parser.add_option("-l", "--level", dest="level", type="int", default=9,
+                  help="zlib compression level (default 9)")
+(options, args) = parser.parse_args()
+
+if len(args) != 2:
+    parser.error("need a source directory and an image name")
+if options.block_shift < 12 or options.block_shift > 17:
+    parser.error("block shift out of range")
+
+root, image = args
+block_size = 1 << options.block_shift
+
+files = []
+for dirpath, dirnames, filenames in os.walk(root):
+    for f in filenames:
+        path = os.path.join(dirpath, f)
+        name = os.path.relpath(path, root).replace(os.sep, "/").encode("utf-8")
+        if len(name) > CROFS_NAME_LEN:
+            sys.exit("name too long: %s" % name.decode("utf-8"))
+        files.append((name, path))
+files.sort()
+
+# superblock, then the file table, then every file's index followed by its blocks
+files_offset = struct.calcsize(SUPER_FMT)
+data = bytearray()
+pos = files_offset + len(files) * struct.calcsize(ENTRY_FMT)
+entries = []
+raw_total = 0
+
+for name, path in files:
+    with open(path, "rb") as f:
+        contents = f.read()
+    raw_total += len(contents)
+
+    blocks = []
+    for off in range(0, len(contents), block_size):
+        raw = contents[off:off + block_size]
+        z = zlib.compress(raw, options.level)
+        blocks.append(z if len(z) < len(raw) else raw)
+
+    index_offset = pos
+    offset = index_offset + (len(blocks) + 1) * 4
+    index = []
+    for b in blocks:
+        index.append(offset)
+        offset += len(b)
+    index.append(offset)
+
+    data += struct.pack("<%dI" % len(index), *index)
+    for b in blocks:
+        data += b
+    pos = offset
+
+    entries.append(struct.pack(ENTRY_FMT, name, len(contents), index_offset, 0))
+
+with open(image, "wb") as out:
+    out.write(struct.pack(SUPER_FMT, CROFS_MAGIC, CROFS_VERSION, options.block_shift, len(files),
+                          files_offset, pos))
+    for e in entries:
+        out.write(e)
+    out.write(data)
+
+print("%d files, %d bytes in %d bytes" % (len(files), raw_total, pos))
@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+# vim: set expandtab ts=4 sw=4 tw=100:
+#
+# Turn the addresses in the output of 'profile dump' and 'profile folded' into function names,
+# merging entries that land in the same function. Folded stacks come out ready for
+# flamegraph.pl or speedscope.
+#
+# usage: symbolize-profile.py [-n nm] <lk.elf> [console log]
+
+import bisect
+import re
+import subprocess
+import sys
+from optparse import OptionParser
+
+HIST_RE = re.compile(r"^\s*(\d+)\s+[\d.]+%\s+0x([0-9a-fA-F]+)\s*$")
+FOLDED_RE = re.compile(r"^(0x[0-9a-fA-F]+(?:;0x[0-9a-fA-F]+)*) (\d+)\s*$")
+
+parser = OptionParser(usage="%prog [options] <lk.elf> [console log]")
+parser.add_option("-n", "--nm", dest="nm", default="nm",
+                  help="nm for the target, e.g. aarch64-elf-nm (default nm)")
+parser.add_option("-o", "--offsets", dest="offsets", action="store_true", default=False,
+                  help="keep the offset into the function instead of merging by function")
+(options, args) = parser.parse_args()
+
+if len(args) < 1 or len(args) > 2:
+    parser.error("need the kernel elf")
+
+out = subprocess.run([options.nm, "-n", "-C", "--defined-only", args[0]],
+                     stdout=subprocess.PIPE, check=True, universal_newlines=True).stdout
+addrs = []
+names = []
+for line in out.splitlines():
+    fields = line.split(None, 2)
+    if len(fields) == 3 and fields[1] in "tTwW":
+        addrs.append(int(fields[0], 16))
+        names.append(fields[2])
+
+
+def symbolize(addr, is_return):
+    # a return address points past the call, look up the call itself
+    lookup = addr - 1 if is_return else addr
+    i = bisect.bisect_right(addrs, lookup) - 1
+    if i < 0:
+        return "0x%x" % addr
+    if options.offsets:
+        return "%s+0x%x" % (names[i], addr - addrs[i])
+    return names[i]
+
+
+hist = {}
+hist_total = 0
+folded = {}
+
+log = open(args[1]) if len(args) == 2 else sys.stdin
+for line in log:
+    m = HIST_RE.match(line)
+    if m:
+        count = int(m.group(1))
+        name = symbolize(int(m.group(2), 16), False)
+        hist[name] = hist.get(name, 0) + count
+        hist_total += count
+        continue
+    m = FOLDED_RE.match(line)
+    if m:
+        frames = m.group(1).split(";")
+        # outermost first, the last one is the interrupted pc
+        stack = [symbolize(int(f, 16), True) for f in frames[:-1]]
+        stack.append(symbolize(int(frames[-1], 16), False))
+        key = ";".join(stack)
+        folded[key] = folded.get(key, 0) + int(m.group(2))
+
+for name, count in sorted(hist.items(), key=lambda kv: -kv[1]):
+    print("%8u %5.1f%% %s" % (count, 100.0 * count / hist_total, name))
+for stack, count in sorted(folded.items()):
+    print("%s %u" % (stack, count))
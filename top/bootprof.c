@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Boot time profiler. Records are appended to a fixed table under a spin
+ * lock so they can come from any cpu or thread, starting before the heap
+ * exists. Once the table is full further events are only counted.
+ */
+#include <lk/bootprof.h>
+
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <kernel/spinlock.h>
+#include <platform.h>
+
+#if LK_BOOTPROF
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+#endif
+
+#ifndef BOOTPROF_MAX_RECORDS
+#define BOOTPROF_MAX_RECORDS 64
+#endif
+
+#define SUMMARY_COUNT 5
+
+struct bootprof_record {
+    uint32_t start;
+    uint32_t cycles;
+    uint level;
+    uint8_t kind;
+    uint8_t cpu;
+    char name[22];
+};
+
+static spin_lock_t bootprof_lock = SPIN_LOCK_INITIAL_VALUE;
+static struct bootprof_record records[BOOTPROF_MAX_RECORDS];
+static uint record_count;
+static uint dropped_count;
+static bool have_first;
+static uint32_t first_start;
+
+void bootprof_record(enum bootprof_kind kind, const char *name, uint level, uint32_t start)
+{
+    uint32_t cycles = arch_cycle_count() - start;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bootprof_lock, state);
+
+    if (!have_first) {
+        first_start = start;
+        have_first = true;
+    }
+
+    if (record_count < BOOTPROF_MAX_RECORDS) {
+        struct bootprof_record *r = &records[record_count++];
+        r->start = start;
+        r->cycles = cycles;
+        r->level = level;
+        r->kind = kind;
+        r->cpu = arch_curr_cpu_num();
+        strlcpy(r->name, name ? name : "", sizeof(r->name));
+    } else {
+        dropped_count++;
+    }
+
+    spin_unlock_irqrestore(&bootprof_lock, state);
+}
+
+/* indices of the n slowest records, slowest first. returns how many */
+static uint find_slowest(uint *slowest, uint n)
+{
+    uint count = 0;
+
+    if (n == 0)
+        return 0;
+
+    for (uint i = 0; i < record_count; i++) {
+        if (count == n && records[i].cycles <= records[slowest[count - 1]].cycles)
+            continue;
+
+        uint j = (count < n) ? count++ : count - 1;
+        for (; j > 0 && records[slowest[j - 1]].cycles < records[i].cycles; j--)
+            slowest[j] = slowest[j - 1];
+        slowest[j] = i;
+    }
+
+    return count;
+}
+
+void bootprof_summary(void)
+{
+    uint slowest[SUMMARY_COUNT];
+
+    uint32_t total = arch_cycle_count() - first_start;
+    uint count = find_slowest(slowest, SUMMARY_COUNT);
+
+    dprintf(INFO, "bootprof: %u events, %u cycles (%u ms) since first, slowest:",
+           record_count + dropped_count, total, (uint)current_time());
+    for (uint i = 0; i < count; i++) {
+        const struct bootprof_record *r = &records[slowest[i]];
+        dprintf(INFO, " %s %u", r->name, r->cycles);
+    }
+    dprintf(INFO, "\n");
+}
+
+#if WITH_LIB_CONSOLE
+
+static const char *kind_name(uint kind)
+{
+    switch (kind) {
+        case BOOTPROF_INIT_HOOK: return "init";
+        case BOOTPROF_DEVICE: return "dev";
+        case BOOTPROF_APP: return "app";
+        case BOOTPROF_MOUNT: return "mount";
+        default: return "?";
+    }
+}
+
+static void dump_record(const struct bootprof_record *r)
+{
+    printf("%10u %10u %3u %-5s %#8x %s\n", r->start - first_start, r->cycles,
+           r->cpu, kind_name(r->kind), r->level, r->name);
+}
+
+static int cmd_bootprof(int argc, const cmd_args *argv)
+{
+    bool top = (argc >= 2 && !strcmp(argv[1].str, "top"));
+
+    if (argc >= 2 && !top) {
+        printf("usage:\n");
+        printf("\t%s          : all events in the order they finished\n", argv[0].str);
+        printf("\t%s top [n]  : the n slowest events\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    printf("%10s %10s %3s %-5s %8s %s\n", "offset", "cycles", "cpu", "kind", "level", "name");
+    if (top) {
+        uint slowest[BOOTPROF_MAX_RECORDS];
+        uint n = (argc >= 3) ? argv[2].u : 10;
+        n = find_slowest(slowest, MIN(n, BOOTPROF_MAX_RECORDS));
+        for (uint i = 0; i < n; i++)
+            dump_record(&records[slowest[i]]);
+    } else {
+        for (uint i = 0; i < record_count; i++)
+            dump_record(&records[i]);
+    }
+    if (dropped_count)
+        printf("%u events did not fit\n", dropped_count);
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("bootprof", "boot time profile", &cmd_bootprof)
+STATIC_COMMAND_END(bootprof);
+
+#endif // WITH_LIB_CONSOLE
+
+#endif // LK_BOOTPROF
@@ -28,11 +28,14 @@
  */
 #include <arch/ops.h>
 #include <lk/init.h>
+#include <lk/bootprof.h>
 
 #include <assert.h>
 #include <compiler.h>
 #include <debug.h>
 #include <trace.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
 
 #define LOCAL_TRACE 0
 #define TRACE_INIT (LK_DEBUGLEVEL >= 2)
@@ -43,6 +46,89 @@
 extern const struct lk_init_struct __lk_init[];
 extern const struct lk_init_struct __lk_init_end[];
 
+#ifndef LK_INIT_MAX_ASYNC
+#define LK_INIT_MAX_ASYNC 8
+#endif
+#ifndef LK_INIT_MAX_DEFERRED
+#define LK_INIT_MAX_DEFERRED 8
+#endif
+
+/* async hooks of the level being run, only touched by the boot thread */
+static thread_t *async_threads[LK_INIT_MAX_ASYNC];
+static uint async_count;
+static uint async_level;
+
+static mutex_t deferred_lock = MUTEX_INITIAL_VALUE(deferred_lock);
+static thread_t *deferred_threads[LK_INIT_MAX_DEFERRED];
+static uint deferred_count;
+
+static void call_hook(const struct lk_init_struct *init)
+{
+#if TRACE_INIT
+    if (init->level >= EARLIEST_TRACE_LEVEL) {
+        printf("INIT: cpu %d, calling hook %p (%s) at level %#x, flags %#x\n",
+               arch_curr_cpu_num(), init->hook, init->name, init->level, init->flags);
+    }
+#endif
+    uint32_t start = bootprof_start();
+    init->hook(init->level);
+    bootprof_record(BOOTPROF_INIT_HOOK, init->name, init->level, start);
+}
+
+static int hook_thread(void *arg)
+{
+    call_hook(arg);
+    return 0;
+}
+
+static void join_async(void)
+{
+    for (uint i = 0; i < async_count; i++)
+        thread_join(async_threads[i], NULL, INFINITE_TIME);
+    async_count = 0;
+}
+
+/* start a hook in its own thread, returns false if it has to run inline */
+static bool start_hook_thread(const struct lk_init_struct *init)
+{
+    bool deferred = init->flags & LK_INIT_FLAG_DEFERRED;
+    thread_t *t;
+
+    if (deferred) {
+        mutex_acquire(&deferred_lock);
+        if (deferred_count == LK_INIT_MAX_DEFERRED) {
+            mutex_release(&deferred_lock);
+            return false;
+        }
+    } else if (async_count == LK_INIT_MAX_ASYNC) {
+        join_async();
+    }
+
+    t = thread_create(init->name, &hook_thread, (void *)init,
+                      deferred ? LOW_PRIORITY : DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    if (t) {
+        if (deferred)
+            deferred_threads[deferred_count++] = t;
+        else
+            async_threads[async_count++] = t;
+        thread_resume(t);
+    }
+
+    if (deferred)
+        mutex_release(&deferred_lock);
+
+    return t != NULL;
+}
+
+void lk_init_wait_deferred(void)
+{
+    mutex_acquire(&deferred_lock);
+    for (uint i = 0; i < deferred_count; i++)
+        thread_join(deferred_threads[i], NULL, INFINITE_TIME);
+    deferred_count = 0;
+    mutex_release(&deferred_lock);
+}
+
 void lk_init_level(enum lk_init_flags required_flag, uint start_level, uint stop_level)
 {
     LTRACEF("flags %#x, start_level %#x, stop_level %#x\n",
@@ -92,16 +178,27 @@ void lk_init_level(enum lk_init_flags required_flag, uint start_level, uint stop
         if (!found)
             break;
 
-#if TRACE_INIT
-        if (found->level >= EARLIEST_TRACE_LEVEL) {
-            printf("INIT: cpu %d, calling hook %p (%s) at level %#x, flags %#x\n",
-                   arch_curr_cpu_num(), found->hook, found->name, found->level, found->flags);
+        /* a new level only starts once the async hooks of the last one are done */
+        bool primary = (required_flag == LK_INIT_FLAG_PRIMARY_CPU);
+        if (primary && async_count > 0 && found->level != async_level)
+            join_async();
+
+        bool threaded = false;
+        if (primary && (found->flags & (LK_INIT_FLAG_ASYNC | LK_INIT_FLAG_DEFERRED)) &&
+                found->level >= LK_INIT_LEVEL_THREADING) {
+            threaded = start_hook_thread(found);
+            if (threaded && (found->flags & LK_INIT_FLAG_ASYNC))
+                async_level = found->level;
         }
-#endif
-        found->hook(found->level);
+        if (!threaded)
+            call_hook(found);
+
         last_called_level = found->level;
         last = found;
     }
+
+    if (required_flag == LK_INIT_FLAG_PRIMARY_CPU)
+        join_async();
 }
 
 #if 0
@@ -36,6 +36,7 @@
 #include <kernel/mutex.h>
 #include <kernel/novm.h>
 #include <kernel/thread.h>
+#include <lk/bootprof.h>
 #include <lk/init.h>
 #include <lk/main.h>
 
@@ -152,6 +153,8 @@ static int bootstrap2(void *arg)
 
     lk_primary_cpu_init_level(LK_INIT_LEVEL_APPS, LK_INIT_LEVEL_LAST);
 
+    bootprof_summary();
+
     return 0;
 }
 